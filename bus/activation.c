@@ -55,6 +55,8 @@ struct BusActivation
                               */
   DBusHashTable *directories;
   DBusHashTable *environment;
+  DBusMessage *names_snapshot; /**< Cached ListActivatableNames reply body, or #NULL */
+  DBusHashTable *systemd_units; /**< Unit name -> BusSystemdUnit with requests in flight */
 };
 
 typedef struct
@@ -62,16 +64,19 @@ typedef struct
   int refcount;
   char *dir_c;
   DBusHashTable *entries;
+  unsigned int scan_serial; /**< Bumped by each update_directory() */
 } BusServiceDirectory;
 
 typedef struct
 {
   int refcount;
   char *name;
-  char *exec;
+  char *exec; /**< #NULL until the file has been fully loaded */
   char *user;
   char *systemd_service;
   unsigned long mtime;
+  unsigned long parsed_at; /**< Wall clock second in which the file was read */
+  unsigned int scan_serial; /**< s_dir->scan_serial when the file was last seen */
   BusServiceDirectory *s_dir;
   char *filename;
 } BusActivationEntry;
@@ -105,8 +110,22 @@ typedef struct
   DBusBabysitter *babysitter;
   DBusTimeout *timeout;
   unsigned int timeout_added : 1;
+  unsigned int systemd_unit_linked : 1; /**< In its BusSystemdUnit's list */
 } BusPendingActivation;
 
+/**
+ * A systemd unit for which ActivationRequest has been sent and not yet
+ * answered, with every pending activation waiting for it (not
+ * referenced; they unlink themselves when finalized). Several bus names
+ * can share one unit, and systemd starts it only once however often it
+ * is asked, so only the first of them sends a request.
+ */
+typedef struct
+{
+  char *name;
+  DBusList *pending_activations;
+} BusSystemdUnit;
+
 #if 0
 static BusServiceDirectory *
 bus_service_directory_ref (BusServiceDirectory *dir)
@@ -138,6 +157,91 @@ bus_service_directory_unref (BusServiceDirectory *dir)
   dbus_free (dir);
 }
 
+static void
+bus_systemd_unit_free (void *data)
+{
+  BusSystemdUnit *unit = data;
+
+  if (unit == NULL) /* hash table requires this */
+    return;
+
+  _dbus_list_clear (&unit->pending_activations);
+  dbus_free (unit->name);
+  dbus_free (unit);
+}
+
+/**
+ * Records that the pending activation waits for its systemd unit.
+ *
+ * @param activation the activation
+ * @param pending_activation a pending activation with a systemd_service
+ * @param already_requested set to #TRUE if another pending activation
+ *  is already waiting for the same unit
+ * @returns #FALSE if no memory
+ */
+static dbus_bool_t
+systemd_unit_add_pending (BusActivation        *activation,
+                          BusPendingActivation *pending_activation,
+                          dbus_bool_t          *already_requested)
+{
+  BusSystemdUnit *unit;
+
+  _dbus_assert (pending_activation->systemd_service != NULL);
+  _dbus_assert (!pending_activation->systemd_unit_linked);
+
+  unit = _dbus_hash_table_lookup_string (activation->systemd_units,
+                                         pending_activation->systemd_service);
+
+  if (unit == NULL)
+    {
+      unit = dbus_new0 (BusSystemdUnit, 1);
+      if (unit == NULL)
+        return FALSE;
+
+      unit->name = _dbus_strdup (pending_activation->systemd_service);
+      if (unit->name == NULL ||
+          !_dbus_hash_table_insert_string (activation->systemd_units,
+                                           unit->name, unit))
+        {
+          bus_systemd_unit_free (unit);
+          return FALSE;
+        }
+    }
+
+  *already_requested = (unit->pending_activations != NULL);
+
+  if (!_dbus_list_append (&unit->pending_activations, pending_activation))
+    {
+      if (unit->pending_activations == NULL)
+        _dbus_hash_table_remove_string (activation->systemd_units, unit->name);
+
+      return FALSE;
+    }
+
+  pending_activation->systemd_unit_linked = TRUE;
+  return TRUE;
+}
+
+static void
+systemd_unit_remove_pending (BusPendingActivation *pending_activation)
+{
+  BusActivation *activation = pending_activation->activation;
+  BusSystemdUnit *unit;
+
+  if (!pending_activation->systemd_unit_linked)
+    return;
+
+  unit = _dbus_hash_table_lookup_string (activation->systemd_units,
+                                         pending_activation->systemd_service);
+  _dbus_assert (unit != NULL);
+
+  _dbus_list_remove (&unit->pending_activations, pending_activation);
+  pending_activation->systemd_unit_linked = FALSE;
+
+  if (unit->pending_activations == NULL)
+    _dbus_hash_table_remove_string (activation->systemd_units, unit->name);
+}
+
 static void
 bus_pending_activation_entry_free (BusPendingActivationEntry *entry)
 {
@@ -145,7 +249,10 @@ bus_pending_activation_entry_free (BusPendingActivationEntry *entry)
     dbus_message_unref (entry->activation_message);
 
   if (entry->connection)
-    dbus_connection_unref (entry->connection);
+    {
+      bus_connection_unhold_oom_error (entry->connection);
+      dbus_connection_unref (entry->connection);
+    }
 
   dbus_free (entry);
 }
@@ -194,6 +301,8 @@ bus_pending_activation_unref (BusPendingActivation *pending_activation)
       _dbus_babysitter_unref (pending_activation->babysitter);
     }
 
+  systemd_unit_remove_pending (pending_activation);
+
   dbus_free (pending_activation->service_name);
   dbus_free (pending_activation->exec);
   dbus_free (pending_activation->systemd_service);
@@ -248,35 +357,48 @@ bus_activation_entry_unref (BusActivationEntry *entry)
   dbus_free (entry);
 }
 
+/* Called whenever an entry is added to, removed from or renamed in
+ * activation->entries */
+static void
+bus_activation_names_changed (BusActivation *activation)
+{
+  if (activation->names_snapshot != NULL)
+    {
+      dbus_message_unref (activation->names_snapshot);
+      activation->names_snapshot = NULL;
+    }
+}
+
+/* Adds or updates the entry of a service file, taking ownership of
+ * the strings whatever happens. exec is #NULL if only the name has
+ * been read so far. */
 static dbus_bool_t
-update_desktop_file_entry (BusActivation       *activation,
-                           BusServiceDirectory *s_dir,
-                           DBusString          *filename,
-                           BusDesktopFile      *desktop_file,
-                           DBusError           *error)
+update_service_entry (BusActivation       *activation,
+                      BusServiceDirectory *s_dir,
+                      DBusString          *filename,
+                      char                *name,
+                      char                *exec,
+                      char                *user,
+                      char                *systemd_service,
+                      unsigned long        mtime,
+                      DBusError           *error)
 {
-  char *name, *exec, *user, *exec_tmp, *systemd_service;
   BusActivationEntry *entry;
-  DBusStat stat_buf;
   DBusString file_path;
-  DBusError tmp_error;
   dbus_bool_t retval;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
   retval = FALSE;
-  name = NULL;
-  exec = NULL;
-  user = NULL;
-  exec_tmp = NULL;
   entry = NULL;
-  systemd_service = NULL;
-
-  dbus_error_init (&tmp_error);
 
   if (!_dbus_string_init (&file_path))
     {
       BUS_SET_OOM (error);
+      dbus_free (name);
+      dbus_free (exec);
+      dbus_free (user);
+      dbus_free (systemd_service);
       return FALSE;
     }
 
@@ -287,81 +409,12 @@ update_desktop_file_entry (BusActivation       *activation,
       goto out;
     }
 
-  if (!_dbus_stat (&file_path, &stat_buf, NULL))
-    {
-      dbus_set_error (error, DBUS_ERROR_FAILED,
-                      "Can't stat the service file\n");
-      goto out;
-    }
-
-  if (!bus_desktop_file_get_string (desktop_file,
-                                    DBUS_SERVICE_SECTION,
-                                    DBUS_SERVICE_NAME,
-                                    &name,
-                                    error))
-    goto out;
-
-  if (!bus_desktop_file_get_string (desktop_file,
-                                    DBUS_SERVICE_SECTION,
-                                    DBUS_SERVICE_EXEC,
-                                    &exec_tmp,
-                                    error))
-    goto out;
-
-  exec = _dbus_strdup (_dbus_replace_install_prefix (exec_tmp));
-  dbus_free (exec_tmp);
-  exec_tmp = NULL;
-
-  /* user is not _required_ unless we are using system activation */
-  if (!bus_desktop_file_get_string (desktop_file,
-                                    DBUS_SERVICE_SECTION,
-                                    DBUS_SERVICE_USER,
-                                    &user, &tmp_error))
-    {
-      _DBUS_ASSERT_ERROR_IS_SET (&tmp_error);
-      /* if we got OOM, then exit */
-      if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
-        {
-          dbus_move_error (&tmp_error, error);
-          goto out;
-        }
-      else
-        {
-          /* if we have error because we didn't find anything then continue */
-          dbus_error_free (&tmp_error);
-          dbus_free (user);
-          user = NULL;
-        }
-    }
-  _DBUS_ASSERT_ERROR_IS_CLEAR (&tmp_error);
-
-  /* systemd service is never required */
-  if (!bus_desktop_file_get_string (desktop_file,
-                                    DBUS_SERVICE_SECTION,
-                                    DBUS_SERVICE_SYSTEMD_SERVICE,
-                                    &systemd_service, &tmp_error))
-    {
-      _DBUS_ASSERT_ERROR_IS_SET (&tmp_error);
-      /* if we got OOM, then exit */
-      if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
-        {
-          dbus_move_error (&tmp_error, error);
-          goto out;
-        }
-      else
-        {
-          /* if we have error because we didn't find anything then continue */
-          dbus_error_free (&tmp_error);
-          dbus_free (systemd_service);
-          systemd_service = NULL;
-        }
-    }
-
-  _DBUS_ASSERT_ERROR_IS_CLEAR (&tmp_error);
-
   entry = _dbus_hash_table_lookup_string (s_dir->entries,
                                           _dbus_string_get_const_data (filename));
 
+  /* everything below may add, drop or rename an entry */
+  bus_activation_names_changed (activation);
+
   if (entry == NULL) /* New file */
     {
       /* FIXME we need a better-defined algorithm for which service file to
@@ -401,19 +454,23 @@ update_desktop_file_entry (BusActivation       *activation,
           goto out;
         }
 
-      if (!_dbus_hash_table_insert_string (activation->entries, entry->name, bus_activation_entry_ref (entry)))
+      /* a failed insertion doesn't free the value, so only take the
+       * hash table's reference once it has succeeded */
+      if (!_dbus_hash_table_insert_string (activation->entries, entry->name, entry))
         {
           BUS_SET_OOM (error);
           goto out;
         }
+      bus_activation_entry_ref (entry);
 
-      if (!_dbus_hash_table_insert_string (s_dir->entries, entry->filename, bus_activation_entry_ref (entry)))
+      if (!_dbus_hash_table_insert_string (s_dir->entries, entry->filename, entry))
         {
           /* Revert the insertion in the entries table */
           _dbus_hash_table_remove_string (activation->entries, entry->name);
           BUS_SET_OOM (error);
           goto out;
         }
+      bus_activation_entry_ref (entry);
 
       _dbus_verbose ("Added \"%s\" to list of services\n", entry->name);
     }
@@ -450,7 +507,7 @@ update_desktop_file_entry (BusActivation       *activation,
       systemd_service = NULL;
 
       if (!_dbus_hash_table_insert_string (activation->entries,
-                                           entry->name, bus_activation_entry_ref(entry)))
+                                           entry->name, entry))
         {
           BUS_SET_OOM (error);
           /* Also remove path to entries hash since we want this in sync with
@@ -459,28 +516,230 @@ update_desktop_file_entry (BusActivation       *activation,
                                           entry->filename);
           goto out;
         }
-    }
+      bus_activation_entry_ref (entry);
+    }
+
+  entry->mtime = mtime;
+  entry->scan_serial = s_dir->scan_serial;
+  {
+    long tv_sec, tv_usec;
+
+    _dbus_get_real_time (&tv_sec, &tv_usec);
+    entry->parsed_at = tv_sec;
+  }
+  retval = TRUE;
+
+out:
+  /* if these have been transferred into entry, the variables will be NULL */
+  dbus_free (name);
+  dbus_free (exec);
+  dbus_free (user);
+  dbus_free (systemd_service);
+  _dbus_string_free (&file_path);
+
+  if (entry)
+    bus_activation_entry_unref (entry);
+
+  return retval;
+}
+
+static dbus_bool_t
+update_desktop_file_entry (BusActivation       *activation,
+                           BusServiceDirectory *s_dir,
+                           DBusString          *filename,
+                           BusDesktopFile      *desktop_file,
+                           DBusError           *error)
+{
+  char *name, *exec, *user, *exec_tmp, *systemd_service;
+  DBusError tmp_error;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  name = NULL;
+  exec = NULL;
+  user = NULL;
+  exec_tmp = NULL;
+  systemd_service = NULL;
+
+  dbus_error_init (&tmp_error);
+
+  if (!bus_desktop_file_get_string (desktop_file,
+                                    DBUS_SERVICE_SECTION,
+                                    DBUS_SERVICE_NAME,
+                                    &name,
+                                    error))
+    goto out;
+
+  if (!bus_desktop_file_get_string (desktop_file,
+                                    DBUS_SERVICE_SECTION,
+                                    DBUS_SERVICE_EXEC,
+                                    &exec_tmp,
+                                    error))
+    goto out;
+
+  exec = _dbus_strdup (_dbus_replace_install_prefix (exec_tmp));
+  dbus_free (exec_tmp);
+  exec_tmp = NULL;
+
+  if (exec == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  /* user is not _required_ unless we are using system activation */
+  if (!bus_desktop_file_get_string (desktop_file,
+                                    DBUS_SERVICE_SECTION,
+                                    DBUS_SERVICE_USER,
+                                    &user, &tmp_error))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (&tmp_error);
+      /* if we got OOM, then exit */
+      if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
+        {
+          dbus_move_error (&tmp_error, error);
+          goto out;
+        }
+      else
+        {
+          /* if we have error because we didn't find anything then continue */
+          dbus_error_free (&tmp_error);
+          dbus_free (user);
+          user = NULL;
+        }
+    }
+  _DBUS_ASSERT_ERROR_IS_CLEAR (&tmp_error);
+
+  /* systemd service is never required */
+  if (!bus_desktop_file_get_string (desktop_file,
+                                    DBUS_SERVICE_SECTION,
+                                    DBUS_SERVICE_SYSTEMD_SERVICE,
+                                    &systemd_service, &tmp_error))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (&tmp_error);
+      /* if we got OOM, then exit */
+      if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
+        {
+          dbus_move_error (&tmp_error, error);
+          goto out;
+        }
+      else
+        {
+          /* if we have error because we didn't find anything then continue */
+          dbus_error_free (&tmp_error);
+          dbus_free (systemd_service);
+          systemd_service = NULL;
+        }
+    }
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (&tmp_error);
+
+  /* bus_desktop_file_load() already stat()ed the file */
+  return update_service_entry (activation, s_dir, filename,
+                               name, exec, user, systemd_service,
+                               bus_desktop_file_get_mtime (desktop_file),
+                               error);
+
+out:
+  dbus_free (name);
+  dbus_free (exec);
+  dbus_free (user);
+  dbus_free (systemd_service);
+  return FALSE;
+}
+
+/* Reads a service file into its entry. With name_only, just its Name
+ * is picked out of it, if that can be done without a full parse, and
+ * the rest waits until the entry is actually needed (see
+ * check_service_file()); most services are never activated in a
+ * session, so this keeps start-up and reloading cheap. */
+static dbus_bool_t
+read_service_file (BusActivation       *activation,
+                   BusServiceDirectory *s_dir,
+                   DBusString          *filename,
+                   DBusString          *full_path,
+                   dbus_bool_t          name_only,
+                   DBusError           *error)
+{
+  BusDesktopFile *desktop_file;
+  dbus_bool_t retval;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (name_only)
+    {
+      DBusError tmp_error;
+      unsigned long mtime;
+      char *name;
+
+      dbus_error_init (&tmp_error);
+
+      if (bus_desktop_file_scan_string (full_path,
+                                        DBUS_SERVICE_SECTION,
+                                        DBUS_SERVICE_NAME,
+                                        &name, &mtime, &tmp_error))
+        return update_service_entry (activation, s_dir, filename,
+                                     name, NULL, NULL, NULL, mtime,
+                                     error);
+
+      if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
+        {
+          dbus_move_error (&tmp_error, error);
+          return FALSE;
+        }
 
-  entry->mtime = stat_buf.mtime;
-  retval = TRUE;
+      /* let the full parse say what's wrong with it */
+      dbus_error_free (&tmp_error);
+    }
 
-out:
-  /* if these have been transferred into entry, the variables will be NULL */
-  dbus_free (name);
-  dbus_free (exec);
-  dbus_free (user);
-  dbus_free (systemd_service);
-  _dbus_string_free (&file_path);
+  desktop_file = bus_desktop_file_load (full_path, error);
+  if (desktop_file == NULL)
+    return FALSE;
 
-  if (entry)
-    bus_activation_entry_unref (entry);
+  retval = update_desktop_file_entry (activation, s_dir, filename,
+                                      desktop_file, error);
+  bus_desktop_file_free (desktop_file);
 
   return retval;
 }
 
+/* Drops a service file's entry from both the activation and its
+ * directory */
+static void
+remove_service_file_entry (BusActivation      *activation,
+                           BusActivationEntry *entry)
+{
+  bus_activation_entry_ref (entry);
+
+  if (_dbus_hash_table_lookup_string (activation->entries,
+                                      entry->name) == entry)
+    _dbus_hash_table_remove_string (activation->entries, entry->name);
+
+  _dbus_hash_table_remove_string (entry->s_dir->entries, entry->filename);
+  bus_activation_names_changed (activation);
+
+  bus_activation_entry_unref (entry);
+}
+
+/* A file whose mtime is the second we read it in may have been
+ * changed again within that second, so it is read again next time.
+ */
+static dbus_bool_t
+service_file_changed (BusActivationEntry *entry,
+                      const DBusStat     *stat_buf)
+{
+  return stat_buf->mtime != entry->mtime ||
+         stat_buf->mtime >= entry->parsed_at;
+}
+
+/* Rereads the service file behind entry if it changed, or if
+ * need_details is set and only its name has been read so far.
+ * *updated_entry is set to #NULL if the file is gone or no longer
+ * valid. */
 static dbus_bool_t
 check_service_file (BusActivation       *activation,
                     BusActivationEntry  *entry,
+                    dbus_bool_t          need_details,
                     BusActivationEntry **updated_entry,
                     DBusError           *error)
 {
@@ -514,8 +773,7 @@ check_service_file (BusActivation       *activation,
       _dbus_verbose ("****** Can't stat file \"%s\", removing from cache\n",
                      _dbus_string_get_const_data (&file_path));
 
-      _dbus_hash_table_remove_string (activation->entries, entry->name);
-      _dbus_hash_table_remove_string (entry->s_dir->entries, entry->filename);
+      remove_service_file_entry (activation, entry);
 
       tmp_entry = NULL;
       retval = TRUE;
@@ -523,15 +781,19 @@ check_service_file (BusActivation       *activation,
     }
   else
     {
-      if (stat_buf.mtime > entry->mtime)
+      if (service_file_changed (entry, &stat_buf) ||
+          (need_details && entry->exec == NULL))
         {
-          BusDesktopFile *desktop_file;
           DBusError tmp_error;
 
           dbus_error_init (&tmp_error);
 
-          desktop_file = bus_desktop_file_load (&file_path, &tmp_error);
-          if (desktop_file == NULL)
+          /* @todo We can return OOM or a DBUS_ERROR_FAILED error
+           *       Handle these both better
+           */
+          if (!read_service_file (activation, entry->s_dir, &filename, &file_path,
+                                  !need_details && entry->exec == NULL,
+                                  &tmp_error))
             {
               _dbus_verbose ("Could not load %s: %s\n",
                              _dbus_string_get_const_data (&file_path),
@@ -543,28 +805,14 @@ check_service_file (BusActivation       *activation,
                   goto out;
                 }
               dbus_error_free (&tmp_error);
-              retval = TRUE;
-              goto out;
-            }
 
-          /* @todo We can return OOM or a DBUS_ERROR_FAILED error
-           *       Handle these both better
-           */
-          if (!update_desktop_file_entry (activation, entry->s_dir, &filename, desktop_file, &tmp_error))
-            {
-              bus_desktop_file_free (desktop_file);
-              if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
-                {
-                  dbus_move_error (&tmp_error, error);
-                  retval = FALSE;
-                  goto out;
-                }
-              dbus_error_free (&tmp_error);
+              /* same as if the file had never been there */
+              remove_service_file_entry (activation, entry);
+              tmp_entry = NULL;
               retval = TRUE;
               goto out;
             }
 
-          bus_desktop_file_free (desktop_file);
           retval = TRUE;
         }
     }
@@ -578,7 +826,48 @@ out:
 }
 
 
-/* warning: this doesn't fully "undo" itself on failure, i.e. doesn't strip
+/* Drops the entries of every service file in s_dir that the current
+ * scan did not come across. */
+static dbus_bool_t
+remove_unseen_service_files (BusActivation       *activation,
+                             BusServiceDirectory *s_dir)
+{
+  DBusHashIter iter;
+  DBusList *unseen;
+  BusActivationEntry *entry;
+
+  unseen = NULL;
+
+  _dbus_hash_iter_init (s_dir->entries, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      entry = _dbus_hash_iter_get_value (&iter);
+
+      if (entry->scan_serial != s_dir->scan_serial &&
+          !_dbus_list_append (&unseen, entry))
+        {
+          _dbus_list_clear (&unseen);
+          return FALSE;
+        }
+    }
+
+  while ((entry = _dbus_list_pop_first (&unseen)) != NULL)
+    {
+      _dbus_verbose ("Service file \"%s\" is gone from %s, removing from cache\n",
+                     entry->filename, s_dir->dir_c);
+      remove_service_file_entry (activation, entry);
+    }
+
+  return TRUE;
+}
+
+/* Brings the entries of s_dir up to date with the directory: new
+ * service files are indexed by name, modified ones are reread (just
+ * the name again, unless the entry had been fully loaded), vanished
+ * ones are dropped, and files that have not changed since they were
+ * last read are only stat()ed.
+ *
+ * warning: this doesn't fully "undo" itself on failure, i.e. doesn't strip
  * hash entries it already added.
  */
 static dbus_bool_t
@@ -588,7 +877,6 @@ update_directory (BusActivation       *activation,
 {
   DBusDirIter *iter;
   DBusString dir, filename;
-  BusDesktopFile *desktop_file;
   DBusError tmp_error;
   dbus_bool_t retval;
   BusActivationEntry *entry;
@@ -597,7 +885,6 @@ update_directory (BusActivation       *activation,
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
   iter = NULL;
-  desktop_file = NULL;
 
   _dbus_string_init_const (&dir, s_dir->dir_c);
 
@@ -615,6 +902,7 @@ update_directory (BusActivation       *activation,
     }
 
   retval = FALSE;
+  s_dir->scan_serial += 1;
 
   /* from this point it's safe to "goto out" */
 
@@ -624,6 +912,15 @@ update_directory (BusActivation       *activation,
       _dbus_verbose ("Failed to open directory %s: %s\n",
                      s_dir->dir_c,
                      error ? error->message : "unknown");
+
+      /* a directory that went away takes its services with it */
+      if (!dbus_error_has_name (error, DBUS_ERROR_NO_MEMORY) &&
+          !remove_unseen_service_files (activation, s_dir))
+        {
+          dbus_error_free (error);
+          BUS_SET_OOM (error);
+        }
+
       goto out;
     }
 
@@ -645,9 +942,14 @@ update_directory (BusActivation       *activation,
       entry = _dbus_hash_table_lookup_string (s_dir->entries, _dbus_string_get_const_data (&filename));
       if (entry) /* Already has this service file in the cache */
         {
-          if (!check_service_file (activation, entry, NULL, error))
+          BusActivationEntry *updated;
+
+          if (!check_service_file (activation, entry, FALSE, &updated, error))
             goto out;
 
+          if (updated != NULL)
+            updated->scan_serial = s_dir->scan_serial;
+
           continue;
         }
 
@@ -658,32 +960,13 @@ update_directory (BusActivation       *activation,
           goto out;
         }
 
-      /* New file */
-      desktop_file = bus_desktop_file_load (&full_path, &tmp_error);
-      if (desktop_file == NULL)
-        {
-          _dbus_verbose ("Could not load %s: %s\n",
-                         _dbus_string_get_const_data (&full_path),
-                         tmp_error.message);
-
-          if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
-            {
-              dbus_move_error (&tmp_error, error);
-              goto out;
-            }
-
-          dbus_error_free (&tmp_error);
-          continue;
-        }
-
+      /* New file: only its name is needed until it is activated */
       /* @todo We can return OOM or a DBUS_ERROR_FAILED error
        *       Handle these both better
        */
-      if (!update_desktop_file_entry (activation, s_dir, &filename, desktop_file, &tmp_error))
+      if (!read_service_file (activation, s_dir, &filename, &full_path,
+                              TRUE, &tmp_error))
         {
-          bus_desktop_file_free (desktop_file);
-          desktop_file = NULL;
-
           _dbus_verbose ("Could not add %s to activation entry list: %s\n",
                          _dbus_string_get_const_data (&full_path), tmp_error.message);
 
@@ -696,12 +979,6 @@ update_directory (BusActivation       *activation,
           dbus_error_free (&tmp_error);
           continue;
         }
-      else
-        {
-          bus_desktop_file_free (desktop_file);
-          desktop_file = NULL;
-          continue;
-        }
     }
 
   if (dbus_error_is_set (&tmp_error))
@@ -710,6 +987,12 @@ update_directory (BusActivation       *activation,
       goto out;
     }
 
+  if (!remove_unseen_service_files (activation, s_dir))
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
   retval = TRUE;
 
  out:
@@ -789,6 +1072,33 @@ out:
   return retval;
 }
 
+/* Drops a directory that is no longer configured, and its services */
+static void
+remove_service_directory (BusActivation       *activation,
+                          BusServiceDirectory *s_dir)
+{
+  DBusHashIter iter;
+
+  _dbus_hash_iter_init (s_dir->entries, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      BusActivationEntry *entry = _dbus_hash_iter_get_value (&iter);
+
+      if (_dbus_hash_table_lookup_string (activation->entries,
+                                          entry->name) == entry)
+        _dbus_hash_table_remove_string (activation->entries, entry->name);
+    }
+
+  bus_activation_names_changed (activation);
+}
+
+/**
+ * Points the activation at a new list of service directories. Service
+ * files in directories that were already configured are only re-read
+ * if they have changed since they were last loaded, so reloading the
+ * configuration (including from an inotify event) does not re-parse
+ * every service file on the system.
+ */
 dbus_bool_t
 bus_activation_reload (BusActivation     *activation,
                        const DBusString  *address,
@@ -797,6 +1107,10 @@ bus_activation_reload (BusActivation     *activation,
 {
   DBusList      *link;
   char          *dir;
+  DBusHashTable *old_directories;
+  DBusHashIter   iter;
+
+  old_directories = NULL;
 
   if (activation->server_address != NULL)
     dbus_free (activation->server_address);
@@ -806,23 +1120,26 @@ bus_activation_reload (BusActivation     *activation,
       goto failed;
     }
 
-  if (activation->entries != NULL)
-    _dbus_hash_table_unref (activation->entries);
-  activation->entries = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
-                                             (DBusFreeFunction)bus_activation_entry_unref);
   if (activation->entries == NULL)
     {
-      BUS_SET_OOM (error);
-      goto failed;
+      activation->entries = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
+                                                 (DBusFreeFunction)bus_activation_entry_unref);
+      if (activation->entries == NULL)
+        {
+          BUS_SET_OOM (error);
+          goto failed;
+        }
     }
 
-  if (activation->directories != NULL)
-    _dbus_hash_table_unref (activation->directories);
+  /* Keep the old directories, and the entries parsed from them, until
+   * we know which of them are still wanted */
+  old_directories = activation->directories;
   activation->directories = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
                                                   (DBusFreeFunction)bus_service_directory_unref);
 
   if (activation->directories == NULL)
     {
+      activation->directories = old_directories;
       BUS_SET_OOM (error);
       goto failed;
     }
@@ -832,32 +1149,50 @@ bus_activation_reload (BusActivation     *activation,
     {
       BusServiceDirectory *s_dir;
 
-      dir = _dbus_strdup ((const char *) link->data);
-      if (!dir)
+      if (_dbus_hash_table_lookup_string (activation->directories,
+                                          link->data) != NULL)
         {
-          BUS_SET_OOM (error);
-          goto failed;
+          link = _dbus_list_get_next_link (directories, link);
+          continue;
         }
 
-      s_dir = dbus_new0 (BusServiceDirectory, 1);
-      if (!s_dir)
+      s_dir = NULL;
+      if (old_directories != NULL)
+        s_dir = _dbus_hash_table_lookup_string (old_directories, link->data);
+
+      if (s_dir != NULL)
         {
-          dbus_free (dir);
-          BUS_SET_OOM (error);
-          goto failed;
+          s_dir->refcount += 1;
         }
+      else
+        {
+          dir = _dbus_strdup ((const char *) link->data);
+          if (!dir)
+            {
+              BUS_SET_OOM (error);
+              goto failed;
+            }
 
-      s_dir->refcount = 1;
-      s_dir->dir_c = dir;
+          s_dir = dbus_new0 (BusServiceDirectory, 1);
+          if (!s_dir)
+            {
+              dbus_free (dir);
+              BUS_SET_OOM (error);
+              goto failed;
+            }
 
-      s_dir->entries = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
-                                             (DBusFreeFunction)bus_activation_entry_unref);
+          s_dir->refcount = 1;
+          s_dir->dir_c = dir;
 
-      if (!s_dir->entries)
-        {
-          bus_service_directory_unref (s_dir);
-          BUS_SET_OOM (error);
-          goto failed;
+          s_dir->entries = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
+                                                 (DBusFreeFunction)bus_activation_entry_unref);
+
+          if (!s_dir->entries)
+            {
+              bus_service_directory_unref (s_dir);
+              BUS_SET_OOM (error);
+              goto failed;
+            }
         }
 
       if (!_dbus_hash_table_insert_string (activation->directories, s_dir->dir_c, s_dir))
@@ -867,6 +1202,9 @@ bus_activation_reload (BusActivation     *activation,
           goto failed;
         }
 
+      if (old_directories != NULL)
+        _dbus_hash_table_remove_string (old_directories, s_dir->dir_c);
+
       /* only fail on OOM, it is ok if we can't read the directory */
       if (!update_directory (activation, s_dir, error))
         {
@@ -879,8 +1217,25 @@ bus_activation_reload (BusActivation     *activation,
       link = _dbus_list_get_next_link (directories, link);
     }
 
+  if (old_directories != NULL)
+    {
+      _dbus_hash_iter_init (old_directories, &iter);
+      while (_dbus_hash_iter_next (&iter))
+        remove_service_directory (activation, _dbus_hash_iter_get_value (&iter));
+
+      _dbus_hash_table_unref (old_directories);
+    }
+
   return TRUE;
  failed:
+  if (old_directories != NULL && old_directories != activation->directories)
+    {
+      _dbus_hash_iter_init (old_directories, &iter);
+      while (_dbus_hash_iter_next (&iter))
+        remove_service_directory (activation, _dbus_hash_iter_get_value (&iter));
+
+      _dbus_hash_table_unref (old_directories);
+    }
   return FALSE;
 }
 
@@ -919,6 +1274,15 @@ bus_activation_new (BusContext        *context,
       goto failed;
     }
 
+  activation->systemd_units = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
+                                                    bus_systemd_unit_free);
+
+  if (activation->systemd_units == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
   activation->environment = _dbus_hash_table_new (DBUS_HASH_STRING,
                                                   (DBusFreeFunction) dbus_free,
                                                   (DBusFreeFunction) dbus_free);
@@ -967,10 +1331,14 @@ bus_activation_unref (BusActivation *activation)
     _dbus_hash_table_unref (activation->entries);
   if (activation->pending_activations)
     _dbus_hash_table_unref (activation->pending_activations);
+  if (activation->systemd_units)
+    _dbus_hash_table_unref (activation->systemd_units);
   if (activation->directories)
     _dbus_hash_table_unref (activation->directories);
   if (activation->environment)
     _dbus_hash_table_unref (activation->environment);
+  if (activation->names_snapshot)
+    dbus_message_unref (activation->names_snapshot);
 
   dbus_free (activation);
 }
@@ -1559,6 +1927,21 @@ update_service_cache (BusActivation *activation, DBusError *error)
   return TRUE;
 }
 
+/**
+ * Brings the service files of every configured service directory up
+ * to date, as bus_activation_reload() does for the same directories.
+ *
+ * @param activation the activation
+ * @param error set if there was not enough memory
+ * @returns #FALSE if there was not enough memory
+ */
+dbus_bool_t
+bus_activation_update_service_files (BusActivation *activation,
+                                     DBusError     *error)
+{
+  return update_service_cache (activation, error);
+}
+
 static BusActivationEntry *
 activation_find_entry (BusActivation *activation,
                        const char    *service_name,
@@ -1575,11 +1958,13 @@ activation_find_entry (BusActivation *activation,
       entry = _dbus_hash_table_lookup_string (activation->entries,
                                               service_name);
     }
-  else
+
+  /* a rescan only read the name, or it may have changed since */
+  if (entry)
     {
       BusActivationEntry *updated_entry;
 
-      if (!check_service_file (activation, entry, &updated_entry, error))
+      if (!check_service_file (activation, entry, TRUE, &updated_entry, error))
         return NULL;
 
       entry = updated_entry;
@@ -1691,6 +2076,7 @@ child_setup (void *user_data)
 #ifdef DBUS_UNIX
   BusActivation *activation = user_data;
   DBusRLimit *initial_fd_limit;
+  DBusCpuAffinity *initial_cpu_affinity;
   DBusError error;
 
   dbus_error_init (&error);
@@ -1705,6 +2091,22 @@ child_setup (void *user_data)
                        "Failed to reset fd limit before activating "
                        "service: %s: %s",
                        error.name, error.message);
+      dbus_error_free (&error);
+    }
+
+  /* services are not bound by the <cpu_affinity> of the bus */
+  initial_cpu_affinity =
+    bus_context_get_initial_cpu_affinity (activation->context);
+
+  if (initial_cpu_affinity != NULL &&
+      !_dbus_cpu_affinity_restore (initial_cpu_affinity, &error))
+    {
+      bus_context_log (activation->context,
+                       DBUS_SYSTEM_LOG_WARNING,
+                       "Failed to reset CPU affinity before activating "
+                       "service: %s: %s",
+                       error.name, error.message);
+      dbus_error_free (&error);
     }
 #endif
 }
@@ -1808,7 +2210,10 @@ bus_activation_activate_service (BusActivation  *activation,
   dbus_message_ref (activation_message);
   pending_activation_entry->connection = connection;
   if (connection)
-    dbus_connection_ref (connection);
+    {
+      dbus_connection_ref (connection);
+      bus_connection_hold_oom_error (connection);
+    }
 
   /* Check if the service is being activated */
   pending_activation = _dbus_hash_table_lookup_string (activation->pending_activations, service_name);
@@ -1956,6 +2361,27 @@ bus_activation_activate_service (BusActivation  *activation,
           DBusString service_string;
           BusService *service;
           BusRegistry *registry;
+          dbus_bool_t already_requested;
+
+          if (!systemd_unit_add_pending (activation, pending_activation,
+                                         &already_requested))
+            {
+              _dbus_verbose ("No memory to track systemd unit of activation\n");
+              BUS_SET_OOM (error);
+              return FALSE;
+            }
+
+          if (already_requested)
+            {
+              /* Another bus name provided by the same unit is already
+               * waiting for it; this one will appear (or fail) along
+               * with it, so there's no need to ask systemd again. */
+              bus_context_log (activation->context,
+                               DBUS_SYSTEM_LOG_INFO, "Activating via systemd: service name='%s' unit='%s' (already requested)",
+                               service_name,
+                               entry->systemd_service);
+              return TRUE;
+            }
 
           /* OK, we have a systemd service configured for this entry,
              hence let's enqueue an activation request message. This
@@ -2239,6 +2665,84 @@ bus_activation_list_services (BusActivation *activation,
   return FALSE;
 }
 
+/* Fully loads every entry of which only the name has been read, so
+ * that files which turn out not to be valid are dropped before their
+ * names get listed. Returns #FALSE if no memory. */
+static dbus_bool_t
+load_all_entries (BusActivation *activation,
+                  DBusError     *error)
+{
+  DBusHashIter iter;
+  DBusList *unloaded;
+  BusActivationEntry *entry;
+  dbus_bool_t retval;
+
+  unloaded = NULL;
+  retval = TRUE;
+
+  _dbus_hash_iter_init (activation->entries, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      entry = _dbus_hash_iter_get_value (&iter);
+
+      if (entry->exec != NULL)
+        continue;
+
+      if (!_dbus_list_append (&unloaded, entry))
+        {
+          BUS_SET_OOM (error);
+          retval = FALSE;
+          break;
+        }
+
+      bus_activation_entry_ref (entry);
+    }
+
+  while ((entry = _dbus_list_pop_first (&unloaded)) != NULL)
+    {
+      /* skip entries dropped while loading an earlier one */
+      if (retval &&
+          _dbus_hash_table_lookup_string (entry->s_dir->entries,
+                                          entry->filename) == entry &&
+          !check_service_file (activation, entry, TRUE, NULL, error))
+        retval = FALSE;
+
+      bus_activation_entry_unref (entry);
+    }
+
+  return retval;
+}
+
+/**
+ * Returns an unaddressed method return carrying the
+ * ListActivatableNames reply body. It is rebuilt only after a service
+ * file has been added, removed or changed. Service files of which only
+ * the name has been read so far are loaded completely first.
+ *
+ * @param activation the activation
+ * @returns the snapshot, owned by the activation, or #NULL if no memory
+ */
+DBusMessage *
+bus_activation_get_names_snapshot (BusActivation *activation)
+{
+  if (activation->names_snapshot == NULL)
+    {
+      DBusError error;
+
+      dbus_error_init (&error);
+
+      if (!load_all_entries (activation, &error))
+        {
+          dbus_error_free (&error);
+          return NULL;
+        }
+
+      activation->names_snapshot = bus_names_snapshot_new (activation->entries);
+    }
+
+  return activation->names_snapshot;
+}
+
 dbus_bool_t
 dbus_activation_systemd_failure (BusActivation *activation,
                                  DBusMessage   *message)
@@ -2262,22 +2766,41 @@ dbus_activation_systemd_failure (BusActivation *activation,
 
   if (unit)
     {
-      DBusHashIter iter;
+      BusSystemdUnit *u;
 
       bus_context_log (activation->context,
                        DBUS_SYSTEM_LOG_INFO, "Activation via systemd failed for unit '%s': %s",
                        unit,
                        str);
 
-      _dbus_hash_iter_init (activation->pending_activations,
-                            &iter);
-
-      while (_dbus_hash_iter_next (&iter))
+      /* Failing a pending activation can finalize it, which unlinks it
+       * from the unit and frees the unit with the last one, so look the
+       * unit up again each time. Pending activations that already left
+       * the hash table but are kept alive by a transaction are skipped. */
+      while ((u = _dbus_hash_table_lookup_string (activation->systemd_units,
+                                                  unit)) != NULL)
         {
-          BusPendingActivation *p = _dbus_hash_iter_get_value (&iter);
+          BusPendingActivation *p = NULL;
+          DBusList *link;
+
+          for (link = _dbus_list_get_first_link (&u->pending_activations);
+               link != NULL;
+               link = _dbus_list_get_next_link (&u->pending_activations, link))
+            {
+              BusPendingActivation *candidate = link->data;
 
-          if (p->systemd_service && strcmp (p->systemd_service, unit) == 0)
-            pending_activation_failed(p, &error);
+              if (_dbus_hash_table_lookup_string (activation->pending_activations,
+                                                  candidate->service_name) == candidate)
+                {
+                  p = candidate;
+                  break;
+                }
+            }
+
+          if (p == NULL)
+            break;
+
+          pending_activation_failed (p, &error);
         }
     }
 
@@ -2328,7 +2851,9 @@ test_create_service_file (DBusString *dir,
       goto out;
     }
 
-  fprintf (file, "[D-BUS Service]\nName=%s\nExec=%s\n", name, exec);
+  fprintf (file, "[D-BUS Service]\nName=%s\n", name);
+  if (exec != NULL)
+    fprintf (file, "Exec=%s\n", exec);
   fclose (file);
 
 out:
@@ -2488,7 +3013,8 @@ check_func (void *data)
     }
   else
     {
-      if (!d->expecting_find)
+      /* only the name is read up front; finding it loads the rest */
+      if (!d->expecting_find || entry->exec == NULL)
         ret_val = FALSE;
     }
 
@@ -2565,6 +3091,19 @@ do_service_reload_test (DBusString *dir, dbus_bool_t oom_test)
   if (!do_test ("Removed service file", oom_test, &d))
     return FALSE;
 
+  /* Check for a service file that has a name but is not valid */
+  if (!test_create_service_file (dir, SERVICE_FILE_2, SERVICE_NAME_2, NULL))
+    return FALSE;
+
+  d.expecting_find = FALSE;
+  d.service_name = SERVICE_NAME_2;
+
+  if (!do_test ("Service file without Exec", oom_test, &d))
+    return FALSE;
+
+  if (!test_remove_service_file (dir, SERVICE_FILE_2))
+    return FALSE;
+
   /* Check for updated service file */
 
   _dbus_sleep_milliseconds (1000); /* Sleep a second to make sure the mtime is updated */
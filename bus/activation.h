@@ -36,6 +36,8 @@ dbus_bool_t bus_activation_reload           (BusActivation     *activation,
 						const DBusString  *address,
 						DBusList         **directories,
 						DBusError         *error);
+dbus_bool_t bus_activation_update_service_files (BusActivation   *activation,
+                                                DBusError       *error);
 BusActivation* bus_activation_ref              (BusActivation     *activation);
 void           bus_activation_unref            (BusActivation     *activation);
 
@@ -57,6 +59,7 @@ dbus_bool_t    bus_activation_service_created  (BusActivation     *activation,
 dbus_bool_t    bus_activation_list_services    (BusActivation     *registry,
 						char            ***listp,
 						int               *array_len);
+DBusMessage   *bus_activation_get_names_snapshot (BusActivation   *activation);
 dbus_bool_t    dbus_activation_systemd_failure (BusActivation     *activation,
                                                 DBusMessage       *message);
 
@@ -29,7 +29,9 @@
 #ifdef HAVE_APPARMOR
 
 #include <dbus/dbus-internals.h>
+#include <dbus/dbus-mainloop.h>
 #include <dbus/dbus-string.h>
+#include <dbus/dbus-watch.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
@@ -73,6 +75,33 @@ struct BusAppArmorConfinement
 
 static BusAppArmorConfinement *bus_con = NULL;
 
+/* Number of slots in the query cache; a power of two */
+#define QUERY_CACHE_SIZE 256
+/* Longest query worth caching, not counting the label command prefix */
+#define QUERY_CACHE_MAX_LEN 1024
+
+/* The answer libapparmor gave to one aa_query_label() query */
+typedef struct
+{
+  char *query;          /* Query after the command prefix, or NULL if unused */
+  int query_len;        /* Length of query */
+  uint32_t mask;        /* Permission asked about */
+  int generation;       /* query_cache_generation when stored */
+  dbus_bool_t allow;    /* aa_query_label() result */
+  dbus_bool_t audit;    /* aa_query_label() result */
+} QueryCacheEntry;
+
+static QueryCacheEntry *query_cache = NULL;
+
+/* Bumped whenever AppArmor reports a policy change */
+static int query_cache_generation = 0;
+
+/* apparmorfs "revision" file, which polls readable after a policy
+ * change; queries are only cached while we are watching it */
+static int revision_fd = -1;
+static DBusWatch *revision_watch = NULL;
+static DBusLoop *revision_loop = NULL;
+
 /**
  * Callers of this function give up ownership of the *label and *mode
  * pointers.
@@ -319,6 +348,136 @@ build_eavesdrop_query (DBusString *query, const char *con, const char *bustype)
   return build_common_query (query, con, bustype);
 }
 
+static dbus_bool_t
+handle_revision_watch (DBusWatch    *watch,
+                       unsigned int  flags,
+                       void         *data)
+{
+  char buf[64];
+
+  _dbus_verbose ("AppArmor policy changed, flushing query cache\n");
+  query_cache_generation += 1;
+
+  /* reading the revision file is what re-arms it */
+  if (lseek (revision_fd, 0, SEEK_SET) < 0 ||
+      read (revision_fd, buf, sizeof (buf)) < 0 ||
+      (flags & (DBUS_WATCH_ERROR | DBUS_WATCH_HANGUP)))
+    {
+      /* we can't tell when policy changes any more */
+      _dbus_verbose ("Lost AppArmor policy revision file, disabling query cache\n");
+      _dbus_loop_remove_watch (revision_loop, revision_watch);
+      _dbus_watch_invalidate (revision_watch);
+      _dbus_watch_unref (revision_watch);
+      revision_watch = NULL;
+    }
+
+  return TRUE;
+}
+
+static void
+query_cache_free (void)
+{
+  int i;
+
+  if (revision_watch != NULL)
+    {
+      _dbus_loop_remove_watch (revision_loop, revision_watch);
+      _dbus_watch_invalidate (revision_watch);
+      _dbus_watch_unref (revision_watch);
+      revision_watch = NULL;
+    }
+
+  if (revision_loop != NULL)
+    {
+      _dbus_loop_unref (revision_loop);
+      revision_loop = NULL;
+    }
+
+  if (revision_fd >= 0)
+    {
+      close (revision_fd);
+      revision_fd = -1;
+    }
+
+  if (query_cache != NULL)
+    {
+      for (i = 0; i < QUERY_CACHE_SIZE; i++)
+        dbus_free (query_cache[i].query);
+
+      dbus_free (query_cache);
+      query_cache = NULL;
+    }
+}
+
+/*
+ * aa_query_label(), answered from the cache while the AppArmor policy
+ * revision hasn't changed since the same query was last made. Failed
+ * queries are never cached, so errno behaves as for aa_query_label().
+ */
+static int
+query_label (uint32_t     mask,
+             DBusString  *query,
+             dbus_bool_t *allow,
+             dbus_bool_t *audit)
+{
+  QueryCacheEntry *entry;
+  const char *key;
+  unsigned int hash;
+  int key_len, i, res;
+
+  entry = NULL;
+  key = _dbus_string_get_const_data (query) + AA_QUERY_CMD_LABEL_SIZE;
+  key_len = _dbus_string_get_length (query) - AA_QUERY_CMD_LABEL_SIZE;
+
+  if (revision_watch != NULL && query_cache != NULL &&
+      key_len <= QUERY_CACHE_MAX_LEN)
+    {
+      hash = mask;
+      for (i = 0; i < key_len; i++)
+        hash = hash * 31 + (unsigned char) key[i];
+
+      entry = &query_cache[hash & (QUERY_CACHE_SIZE - 1)];
+
+      if (entry->query != NULL &&
+          entry->generation == query_cache_generation &&
+          entry->mask == mask &&
+          entry->query_len == key_len &&
+          memcmp (entry->query, key, key_len) == 0)
+        {
+          *allow = entry->allow;
+          *audit = entry->audit;
+          return 0;
+        }
+    }
+
+  res = aa_query_label (mask,
+                        _dbus_string_get_data (query),
+                        _dbus_string_get_length (query),
+                        allow, audit);
+
+  if (res == -1 || entry == NULL)
+    return res;
+
+  /* aa_query_label() only scribbled over the command prefix, so key
+   * still holds the query; OOM just leaves it uncached */
+  if (entry->query == NULL || entry->query_len != key_len)
+    {
+      dbus_free (entry->query);
+      entry->query = dbus_malloc (key_len);
+      if (entry->query == NULL)
+        return res;
+    }
+
+  memcpy (entry->query, key, key_len);
+  entry->query_len = key_len;
+  entry->mask = mask;
+  entry->generation = query_cache_generation;
+  entry->allow = *allow;
+  entry->audit = *audit;
+
+  return res;
+}
+
 static void
 set_error_from_query_errno (DBusError *error, int error_number)
 {
@@ -477,6 +636,68 @@ bus_apparmor_full_init (DBusError *error)
   return TRUE;
 }
 
+/**
+ * Starts caching AppArmor query results. This needs the apparmorfs
+ * revision file to learn about policy changes; without it, or on
+ * OOM, every query keeps going to the kernel.
+ *
+ * @param loop the main loop to watch the revision file from
+ */
+void
+bus_apparmor_init_query_cache (DBusLoop *loop)
+{
+#ifdef HAVE_APPARMOR
+  DBusString path;
+  char *aa_securityfs = NULL;
+
+  if (!apparmor_enabled || revision_watch != NULL)
+    return;
+
+  if (!_dbus_string_init (&path))
+    return;
+
+  if (aa_find_mountpoint (&aa_securityfs) != 0 ||
+      !_dbus_string_append (&path, aa_securityfs) ||
+      !_dbus_string_append (&path, "/revision"))
+    goto out;
+
+  revision_fd = open (_dbus_string_get_const_data (&path),
+                      O_RDONLY | O_CLOEXEC);
+  if (revision_fd < 0)
+    {
+      _dbus_verbose ("No AppArmor policy revision file, not caching queries: %s\n",
+                     _dbus_strerror (errno));
+      goto out;
+    }
+
+  query_cache = dbus_new0 (QueryCacheEntry, QUERY_CACHE_SIZE);
+  if (query_cache == NULL)
+    goto failed;
+
+  revision_loop = _dbus_loop_ref (loop);
+  revision_watch = _dbus_watch_new (revision_fd, DBUS_WATCH_READABLE, TRUE,
+                                    handle_revision_watch, NULL, NULL);
+  if (revision_watch == NULL)
+    goto failed;
+
+  if (!_dbus_loop_add_watch (loop, revision_watch))
+    {
+      _dbus_watch_unref (revision_watch);
+      revision_watch = NULL;
+      goto failed;
+    }
+
+  _dbus_verbose ("Caching AppArmor query results\n");
+  goto out;
+
+ failed:
+  query_cache_free ();
+ out:
+  free (aa_securityfs);
+  _dbus_string_free (&path);
+#endif /* HAVE_APPARMOR */
+}
+
 void
 bus_apparmor_shutdown (void)
 {
@@ -486,6 +707,8 @@ bus_apparmor_shutdown (void)
 
   _dbus_verbose ("AppArmor shutdown\n");
 
+  query_cache_free ();
+
   bus_apparmor_confinement_unref (bus_con);
   bus_con = NULL;
 #endif /* HAVE_APPARMOR */
@@ -633,10 +856,7 @@ bus_apparmor_allows_acquire_service (DBusConnection     *connection,
       goto oom;
     }
 
-  res = aa_query_label (AA_DBUS_BIND,
-                        _dbus_string_get_data (&qstr),
-                        _dbus_string_get_length (&qstr),
-                        &allow, &audit);
+  res = query_label (AA_DBUS_BIND, &qstr, &allow, &audit);
   _dbus_string_free (&qstr);
   if (res == -1)
     {
@@ -800,10 +1020,7 @@ bus_apparmor_allows_send (DBusConnection     *sender,
           goto oom;
         }
 
-      res = aa_query_label (src_perm,
-                            _dbus_string_get_data (&qstr),
-                            _dbus_string_get_length (&qstr),
-                            &src_allow, &src_audit);
+      res = query_label (src_perm, &qstr, &src_allow, &src_audit);
       _dbus_string_free (&qstr);
       if (res == -1)
         {
@@ -830,10 +1047,7 @@ bus_apparmor_allows_send (DBusConnection     *sender,
           goto oom;
         }
 
-      res = aa_query_label (dst_perm,
-                            _dbus_string_get_data (&qstr),
-                            _dbus_string_get_length (&qstr),
-                            &dst_allow, &dst_audit);
+      res = query_label (dst_perm, &qstr, &dst_allow, &dst_audit);
       _dbus_string_free (&qstr);
       if (res == -1)
         {
@@ -1032,10 +1246,7 @@ bus_apparmor_allows_eavesdropping (DBusConnection     *connection,
       goto oom;
     }
 
-  res = aa_query_label (AA_DBUS_EAVESDROP,
-                        _dbus_string_get_data (&qstr),
-                        _dbus_string_get_length (&qstr),
-                        &allow, &audit);
+  res = query_label (AA_DBUS_EAVESDROP, &qstr, &allow, &audit);
   _dbus_string_free (&qstr);
   if (res == -1)
     {
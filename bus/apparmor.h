@@ -27,12 +27,14 @@
 #define BUS_APPARMOR_H
 
 #include <dbus/dbus.h>
+#include <dbus/dbus-mainloop.h>
 #include "bus.h"
 
 dbus_bool_t bus_apparmor_pre_init (void);
 dbus_bool_t bus_apparmor_set_mode_from_config (const char *mode,
                                                DBusError *error);
 dbus_bool_t bus_apparmor_full_init (DBusError *error);
+void bus_apparmor_init_query_cache (DBusLoop *loop);
 void bus_apparmor_shutdown (void);
 dbus_bool_t bus_apparmor_enabled (void);
 
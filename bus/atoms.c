@@ -0,0 +1,160 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* atoms.c  Interned strings
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "atoms.h"
+#include <dbus/dbus-hash.h>
+#include <dbus/dbus-internals.h>
+#include <string.h>
+
+typedef struct
+{
+  int refcount;
+  char str[4]; /**< Actually allocated to the length of the string */
+} BusAtom;
+
+#define ATOM_FROM_STRING(s) \
+  ((BusAtom *) (void *) ((s) - _DBUS_STRUCT_OFFSET (BusAtom, str)))
+
+/* The dbus-daemon is single-threaded, so this needs no lock. Keyed by
+ * the atom's own string; neither keys nor values are freed by the table.
+ */
+static DBusHashTable *atoms = NULL;
+
+/**
+ * Returns the atom for a string, creating it if necessary; either way
+ * the caller owns a new reference to it.
+ *
+ * @param str the string
+ * @returns the atom, or #NULL if not enough memory
+ */
+const char *
+bus_atom_ref (const char *str)
+{
+  BusAtom *atom;
+  size_t len;
+
+  _dbus_assert (str != NULL);
+
+  if (atoms == NULL)
+    {
+      atoms = _dbus_hash_table_new (DBUS_HASH_STRING, NULL, NULL);
+      if (atoms == NULL)
+        return NULL;
+    }
+  else
+    {
+      atom = _dbus_hash_table_lookup_string (atoms, str);
+
+      if (atom != NULL)
+        {
+          _dbus_assert (atom->refcount > 0);
+          atom->refcount += 1;
+          return atom->str;
+        }
+    }
+
+  len = strlen (str);
+  atom = dbus_malloc (MAX (sizeof (BusAtom),
+                           _DBUS_STRUCT_OFFSET (BusAtom, str) + len + 1));
+  if (atom == NULL)
+    goto failed;
+
+  atom->refcount = 1;
+  memcpy (atom->str, str, len + 1);
+
+  if (!_dbus_hash_table_insert_string (atoms, atom->str, atom))
+    {
+      dbus_free (atom);
+      goto failed;
+    }
+
+  return atom->str;
+
+ failed:
+  if (_dbus_hash_table_get_n_entries (atoms) == 0)
+    {
+      _dbus_hash_table_unref (atoms);
+      atoms = NULL;
+    }
+
+  return NULL;
+}
+
+/**
+ * Releases a reference to an atom.
+ *
+ * @param atom the atom, or #NULL to do nothing
+ */
+void
+bus_atom_unref (const char *atom)
+{
+  BusAtom *a;
+
+  if (atom == NULL)
+    return;
+
+  a = ATOM_FROM_STRING (atom);
+
+  _dbus_assert (a->refcount > 0);
+  _dbus_assert (atoms != NULL);
+  _dbus_assert (_dbus_hash_table_lookup_string (atoms, atom) == a);
+
+  a->refcount -= 1;
+
+  if (a->refcount > 0)
+    return;
+
+  _dbus_hash_table_remove_string (atoms, atom);
+  dbus_free (a);
+
+  if (_dbus_hash_table_get_n_entries (atoms) == 0)
+    {
+      _dbus_hash_table_unref (atoms);
+      atoms = NULL;
+    }
+}
+
+/**
+ * bus_atom_unref() with the signature of a #DBusFreeFunction, for
+ * hash tables keyed by atoms.
+ *
+ * @param atom the atom, or #NULL
+ */
+void
+bus_atom_free_func (void *atom)
+{
+  bus_atom_unref (atom);
+}
+
+/**
+ * Returns how many distinct atoms exist.
+ *
+ * @returns the number of atoms
+ */
+int
+bus_atoms_get_n (void)
+{
+  if (atoms == NULL)
+    return 0;
+
+  return _dbus_hash_table_get_n_entries (atoms);
+}
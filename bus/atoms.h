@@ -0,0 +1,38 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* atoms.h  Interned strings
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef BUS_ATOMS_H
+#define BUS_ATOMS_H
+
+#include <dbus/dbus.h>
+
+/* An atom is a reference-counted, read-only copy of a string, shared by
+ * everyone holding the same contents, so two atoms are equal exactly
+ * when they are the same pointer. The table behind them is
+ * daemon-wide and only exists while some atom does.
+ */
+
+const char *bus_atom_ref         (const char *str);
+void        bus_atom_unref       (const char *atom);
+void        bus_atom_free_func   (void       *atom);
+int         bus_atoms_get_n      (void);
+
+#endif /* BUS_ATOMS_H */
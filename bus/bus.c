@@ -37,16 +37,55 @@
 #include "apparmor.h"
 #include "audit.h"
 #include "dir-watch.h"
+#include "log-queue.h"
+#include "stats.h"
+#include "stats-server.h"
+#include "stats-page.h"
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-hash.h>
+#include <dbus/dbus-connection-internal.h>
 #include <dbus/dbus-credentials.h>
 #include <dbus/dbus-internals.h>
 #include <dbus/dbus-server-protected.h>
+#include <dbus/dbus-trace.h>
 
 #ifdef DBUS_CYGWIN
 #include <signal.h>
 #endif
 
+/** Number of slots in the policy verdict cache; a power of two */
+#define POLICY_CACHE_SIZE 256
+/** Longest path, interface, member and error name, together, worth caching */
+#define POLICY_CACHE_FIELDS_LEN 200
+
+#define POLICY_CACHE_IS_REPLY        (1 << 0)
+#define POLICY_CACHE_REQUESTED_REPLY (1 << 1)
+#define POLICY_CACHE_EAVESDROPPING   (1 << 2)
+#define POLICY_CACHE_BY_POLICY       (1 << 3)
+
+/**
+ * A message that the sender's and the recipient's policies both let
+ * through, keyed on everything bus_client_policy_check_can_send() and
+ * bus_client_policy_check_can_receive() look at when the recipient is
+ * an active connection and the sender is one too, or is the bus driver.
+ *
+ * With #POLICY_CACHE_BY_POLICY the recipient is its #BusClientPolicy
+ * rather than its connection, so that one entry covers every recipient
+ * with that policy.
+ */
+typedef struct
+{
+  DBusConnection *sender;       /**< Sending connection, or NULL for the bus driver */
+  const void *recipient;        /**< Proposed recipient or its policy */
+  dbus_uint32_t serial;         /**< policy_cache_serial when stored, 0 if unused */
+  dbus_uint32_t owners_serial;  /**< bus_registry_get_owners_serial() when stored */
+  int message_type;             /**< Message type */
+  unsigned int flags;           /**< POLICY_CACHE_* */
+  unsigned int log : 1;         /**< The send rule asked for the message to be logged */
+  int fields_len;               /**< Bytes used in fields */
+  char fields[POLICY_CACHE_FIELDS_LEN]; /**< Path, interface, member and error name */
+} BusPolicyCacheEntry;
+
 struct BusContext
 {
   int refcount;
@@ -58,6 +97,7 @@ struct BusContext
   char *pidfile;
   char *user;
   char *log_prefix;
+  BusLogQueue *log_queue;              /**< Writes log messages off the main loop, or NULL */
   DBusLoop *loop;
   DBusList *servers;
   BusConnections *connections;
@@ -66,17 +106,39 @@ struct BusContext
   BusPolicy *policy;
   BusMatchmaker *matchmaker;
   BusLimits limits;
+  BusConfigParser *config;             /**< Parser the active configuration came from */
   DBusRLimit *initial_fd_limit;
+  DBusCpuAffinity *initial_cpu_affinity;
   unsigned int fork : 1;
   unsigned int syslog : 1;
   unsigned int keep_umask : 1;
   unsigned int allow_anonymous : 1;
   unsigned int systemd_activation : 1;
+  unsigned int print_startup_timings : 1;
+  unsigned int defer_service_files : 1;
   dbus_bool_t watches_enabled;
+  DBusTimeout *service_files_timeout;  /**< Reads deferred .service files, or NULL */
+  dbus_uint64_t startup_begin;         /**< When bus_context_new() started */
+  dbus_uint64_t startup_nsec[BUS_N_STARTUP_PHASES]; /**< How long each part of it took */
+  dbus_uint64_t ready_nsec;            /**< From startup_begin until readiness was signalled */
+  dbus_uint64_t started_nsec;          /**< From startup_begin until the .service files were read too */
+  BusPolicyCacheEntry *policy_cache;   /**< Recent send/receive policy verdicts, or NULL */
+  dbus_uint32_t policy_cache_serial;   /**< Bumped to forget every cached verdict */
+#ifdef DBUS_ENABLE_STATS
+  BusLatencyHistogram latency[BUS_N_LATENCY_HISTOGRAMS];
+  BusTopTalkers *top_talkers;
+  BusStatsServer *stats_server;
+  BusStatsPage *stats_page;
+  dbus_uint64_t n_queue_full_rejections; /**< Messages refused because the recipient's queue was full */
+#endif
 };
 
 static dbus_int32_t server_data_slot = -1;
 
+static void write_log_message (DBusSystemLogSeverity  severity,
+                               const char            *text,
+                               dbus_bool_t            use_syslog);
+
 typedef struct
 {
   BusContext *context;
@@ -167,6 +229,18 @@ remove_server_timeout (DBusTimeout *timeout,
   _dbus_loop_remove_timeout (context->loop, timeout);
 }
 
+static void
+toggle_server_timeout (DBusTimeout *timeout,
+                       void        *data)
+{
+  DBusServer *server = data;
+  BusContext *context;
+
+  context = server_get_context (server);
+
+  _dbus_loop_toggle_timeout (context->loop, timeout);
+}
+
 static void
 new_connection_callback (DBusServer     *server,
                          DBusConnection *new_connection,
@@ -198,6 +272,25 @@ new_connection_callback (DBusServer     *server,
   dbus_connection_set_max_message_unix_fds (new_connection,
                                         context->limits.max_message_unix_fds);
 
+  dbus_connection_set_max_unflushed_size (new_connection,
+                                          context->limits.max_unflushed_bytes);
+
+  _dbus_connection_set_deferred_validation_size (new_connection,
+                                  context->limits.deferred_validation_bytes);
+
+  _dbus_connection_set_max_overtaken_broadcasts (new_connection,
+                                  context->limits.max_overtaken_broadcasts);
+
+  _dbus_connection_set_broadcast_ttl (new_connection,
+                                      context->limits.broadcast_signal_ttl);
+
+  /* no point holding more in the kernel than we would queue ourselves */
+  _dbus_connection_set_max_socket_buffer_sizes (new_connection,
+      MIN (context->limits.max_socket_buffer_bytes,
+           context->limits.max_outgoing_bytes),
+      MIN (context->limits.max_socket_buffer_bytes,
+           context->limits.max_incoming_bytes));
+
   dbus_connection_set_allow_anonymous (new_connection,
                                        context->allow_anonymous);
 
@@ -256,7 +349,7 @@ setup_server (BusContext *context,
   if (!dbus_server_set_timeout_functions (server,
                                           add_server_timeout,
                                           remove_server_timeout,
-                                          NULL,
+                                          toggle_server_timeout,
                                           server, NULL))
     {
       BUS_SET_OOM (error);
@@ -266,6 +359,22 @@ setup_server (BusContext *context,
   return TRUE;
 }
 
+/* Everything the parser builds, the policy included, is counted as
+ * policy memory */
+static BusConfigParser *
+load_config (const DBusString *config_file,
+             DBusError        *error)
+{
+  BusConfigParser *parser;
+  DBusMemoryTag old_tag;
+
+  old_tag = _dbus_memory_push_tag (DBUS_MEMORY_TAG_POLICY);
+  parser = bus_config_load (config_file, TRUE, NULL, error);
+  _dbus_memory_pop_tag (old_tag);
+
+  return parser;
+}
+
 /* This code only gets executed the first time the
  * config files are parsed.  It is not executed
  * when config files are reloaded.
@@ -473,6 +582,39 @@ process_config_first_time_only (BusContext       *context,
         }
     }
 
+  if (bus_config_parser_get_stats_listen (parser) != NULL)
+    {
+#ifdef DBUS_ENABLE_STATS
+      context->stats_server =
+        bus_stats_server_new (context,
+                              bus_config_parser_get_stats_listen (parser),
+                              error);
+      if (context->stats_server == NULL)
+        {
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          goto failed;
+        }
+#else
+      bus_context_log (context, DBUS_SYSTEM_LOG_WARNING,
+                       "Ignoring <stats_listen>: dbus-daemon was built "
+                       "without statistics");
+#endif
+    }
+
+  /* Before anything big is allocated, so that it comes from the NUMA
+   * nodes of those CPUs */
+  if (bus_config_parser_get_cpu_affinity (parser) != NULL)
+    {
+      context->initial_cpu_affinity =
+        _dbus_cpu_affinity_set (bus_config_parser_get_cpu_affinity (parser),
+                                error);
+      if (context->initial_cpu_affinity == NULL)
+        {
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          goto failed;
+        }
+    }
+
   context->fork = bus_config_parser_get_fork (parser);
   context->syslog = bus_config_parser_get_syslog (parser);
   context->keep_umask = bus_config_parser_get_keep_umask (parser);
@@ -612,7 +754,17 @@ process_config_every_time (BusContext      *context,
     }
   else
     {
-      context->activation = bus_activation_new (context, &full_address, dirs, error);
+      DBusList *no_dirs = NULL;
+      dbus_uint64_t start;
+
+      /* if deferred, read_deferred_service_files() reads them later */
+      start = _dbus_get_monotonic_time_nsec ();
+      context->activation = bus_activation_new (context, &full_address,
+                                                context->defer_service_files ?
+                                                &no_dirs : dirs,
+                                                error);
+      context->startup_nsec[BUS_STARTUP_SERVICE_FILES] =
+        _dbus_get_monotonic_time_nsec () - start;
     }
 
   if (context->activation == NULL)
@@ -734,6 +886,120 @@ process_config_postinit (BusContext      *context,
   return TRUE;
 }
 
+static const char * const startup_phase_names[] = {
+  "config",
+  "includedir",
+  "listen",
+  "service files",
+  "daemonize",
+  "security",
+  "watch",
+  "finish"
+};
+
+_DBUS_STATIC_ASSERT (_DBUS_N_ELEMENTS (startup_phase_names) ==
+                     BUS_N_STARTUP_PHASES);
+
+/* Adds the time since *start to @phase, and starts timing the next */
+static void
+startup_phase_done (BusContext      *context,
+                    BusStartupPhase  phase,
+                    dbus_uint64_t   *start)
+{
+  dbus_uint64_t now = _dbus_get_monotonic_time_nsec ();
+
+  context->startup_nsec[phase] += now - *start;
+  *start = now;
+}
+
+static void
+print_startup_timings (BusContext *context)
+{
+  DBusString str;
+  int i;
+
+  if (!_dbus_string_init (&str))
+    return;
+
+  if (!_dbus_string_append_printf (&str,
+                                   "Startup took %.1f ms, ready after %.1f ms:",
+                                   context->started_nsec / 1e6,
+                                   context->ready_nsec / 1e6))
+    goto out;
+
+  for (i = 0; i < BUS_N_STARTUP_PHASES; i++)
+    {
+      if (!_dbus_string_append_printf (&str, "%s %s %.1f ms",
+                                       i == 0 ? "" : ",",
+                                       startup_phase_names[i],
+                                       context->startup_nsec[i] / 1e6))
+        goto out;
+    }
+
+  bus_context_log_literal (context, DBUS_SYSTEM_LOG_INFO,
+                           _dbus_string_get_const_data (&str));
+
+ out:
+  _dbus_string_free (&str);
+}
+
+/* Everything, including any deferred .service files, has been read */
+static void
+startup_complete (BusContext *context)
+{
+  context->started_nsec = _dbus_get_monotonic_time_nsec () -
+    context->startup_begin;
+
+  if (context->print_startup_timings)
+    print_startup_timings (context);
+}
+
+static void
+stop_deferred_service_files (BusContext *context)
+{
+  if (context->service_files_timeout == NULL)
+    return;
+
+  _dbus_loop_remove_timeout (context->loop, context->service_files_timeout);
+  _dbus_timeout_unref (context->service_files_timeout);
+  context->service_files_timeout = NULL;
+}
+
+/* Reads the .service files as soon as the main loop runs, once
+ * readiness has been signalled. Until then, nobody can have connected
+ * to ask for activation. */
+static dbus_bool_t
+read_deferred_service_files (void *data)
+{
+  BusContext *context = data;
+  DBusError error = DBUS_ERROR_INIT;
+  DBusString address;
+  dbus_uint64_t start;
+
+  /* a failed reload dropped the configuration; the next one reads them */
+  if (context->config != NULL)
+    {
+      _dbus_string_init_const (&address, context->address);
+      start = _dbus_get_monotonic_time_nsec ();
+
+      if (!bus_activation_reload (context->activation, &address,
+                                  bus_config_parser_get_service_dirs (context->config),
+                                  &error))
+        {
+          /* only for lack of memory, so try again when the loop next
+           * runs timeouts */
+          dbus_error_free (&error);
+          return FALSE;
+        }
+
+      startup_phase_done (context, BUS_STARTUP_SERVICE_FILES, &start);
+    }
+
+  stop_deferred_service_files (context);
+  startup_complete (context);
+  return TRUE;
+}
+
 BusContext*
 bus_context_new (const DBusString *config_file,
                  BusContextFlags   flags,
@@ -744,6 +1010,7 @@ bus_context_new (const DBusString *config_file,
 {
   BusContext *context;
   BusConfigParser *parser;
+  dbus_uint64_t start;
 
   _dbus_assert ((flags & BUS_CONTEXT_FLAG_FORK_NEVER) == 0 ||
                 (flags & BUS_CONTEXT_FLAG_FORK_ALWAYS) == 0);
@@ -766,10 +1033,26 @@ bus_context_new (const DBusString *config_file,
       goto failed;
     }
   context->refcount = 1;
+  context->policy_cache_serial = 1;
+  context->startup_begin = _dbus_get_monotonic_time_nsec ();
+  context->print_startup_timings =
+    (flags & BUS_CONTEXT_FLAG_PRINT_STARTUP_TIMINGS) != 0;
+  context->defer_service_files =
+    (flags & BUS_CONTEXT_FLAG_DEFER_SERVICE_FILES) != 0;
+  start = context->startup_begin;
 
   if (!_dbus_generate_uuid (&context->uuid, error))
     goto failed;
 
+#ifdef DBUS_ENABLE_STATS
+  context->top_talkers = bus_top_talkers_new ();
+  if (context->top_talkers == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+#endif
+
   if (!_dbus_string_copy_data (config_file, &context->config_file))
     {
       BUS_SET_OOM (error);
@@ -792,24 +1075,36 @@ bus_context_new (const DBusString *config_file,
       goto failed;
     }
 
-  parser = bus_config_load (config_file, TRUE, NULL, error);
+  parser = load_config (config_file, error);
   if (parser == NULL)
     {
       _DBUS_ASSERT_ERROR_IS_SET (error);
       goto failed;
     }
 
+  startup_phase_done (context, BUS_STARTUP_CONFIG, &start);
+  context->startup_nsec[BUS_STARTUP_INCLUDEDIR] =
+    bus_config_parser_get_includedir_time (parser);
+
   if (!process_config_first_time_only (context, parser, address, flags, error))
     {
       _DBUS_ASSERT_ERROR_IS_SET (error);
       goto failed;
     }
+
+  startup_phase_done (context, BUS_STARTUP_LISTEN, &start);
+
   if (!process_config_every_time (context, parser, FALSE, error))
     {
       _DBUS_ASSERT_ERROR_IS_SET (error);
       goto failed;
     }
 
+  /* the rest of applying the configuration counts as reading it */
+  startup_phase_done (context, BUS_STARTUP_CONFIG, &start);
+  context->startup_nsec[BUS_STARTUP_CONFIG] -=
+    context->startup_nsec[BUS_STARTUP_SERVICE_FILES];
+
   /* we need another ref of the server data slot for the context
    * to own
    */
@@ -861,6 +1156,10 @@ bus_context_new (const DBusString *config_file,
       _dbus_string_free (&addr);
     }
 
+  /* whoever started us can connect from here on */
+  context->ready_nsec = _dbus_get_monotonic_time_nsec () -
+    context->startup_begin;
+
   context->connections = bus_connections_new (context);
   if (context->connections == NULL)
     {
@@ -875,6 +1174,27 @@ bus_context_new (const DBusString *config_file,
       goto failed;
     }
 
+  /* Like <stats_listen>, only read at startup, but it needs the
+   * connections to count */
+  if (bus_config_parser_get_stats_page (parser) != NULL)
+    {
+#ifdef DBUS_ENABLE_STATS
+      context->stats_page =
+        bus_stats_page_new (context,
+                            bus_config_parser_get_stats_page (parser),
+                            error);
+      if (context->stats_page == NULL)
+        {
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          goto failed;
+        }
+#else
+      bus_context_log (context, DBUS_SYSTEM_LOG_WARNING,
+                       "Ignoring <stats_page>: dbus-daemon was built "
+                       "without statistics");
+#endif
+    }
+
   /* check user before we fork */
   if (context->user != NULL)
     {
@@ -931,6 +1251,8 @@ bus_context_new (const DBusString *config_file,
       !_dbus_pipe_is_stdout_or_stderr (print_pid_pipe))
     _dbus_pipe_close (print_pid_pipe, NULL);
 
+  startup_phase_done (context, BUS_STARTUP_DAEMONIZE, &start);
+
   if (!bus_selinux_full_init ())
     {
       bus_context_log (context, DBUS_SYSTEM_LOG_FATAL, "SELinux enabled but D-Bus initialization failed; check system log\n");
@@ -942,6 +1264,8 @@ bus_context_new (const DBusString *config_file,
       goto failed;
     }
 
+  bus_apparmor_init_query_cache (context->loop);
+
   if (bus_apparmor_enabled ())
     {
       /* Only print AppArmor mediation message when syslog support is enabled */
@@ -950,17 +1274,19 @@ bus_context_new (const DBusString *config_file,
                          "AppArmor D-Bus mediation is enabled\n");
     }
 
+  startup_phase_done (context, BUS_STARTUP_SECURITY, &start);
+
   if (!process_config_postinit (context, parser, error))
     {
       _DBUS_ASSERT_ERROR_IS_SET (error);
       goto failed;
     }
 
-  if (parser != NULL)
-    {
-      bus_config_parser_unref (parser);
-      parser = NULL;
-    }
+  startup_phase_done (context, BUS_STARTUP_WATCH, &start);
+
+  /* Keep the parser so that reloading can tell whether it changed */
+  context->config = parser;
+  parser = NULL;
 
   /* Here we change our credentials if required,
    * as soon as we've set up our sockets and pidfile
@@ -976,6 +1302,37 @@ bus_context_new (const DBusString *config_file,
 
   bus_audit_init (context);
 
+  /* Only now, since threads don't survive becoming a daemon; until
+   * here, and if this fails, messages are logged as they happen */
+  context->log_queue = bus_log_queue_new (write_log_message);
+
+  startup_phase_done (context, BUS_STARTUP_FINISH, &start);
+
+  if (context->defer_service_files)
+    {
+      context->service_files_timeout =
+        _dbus_timeout_new (0, read_deferred_service_files, context, NULL);
+
+      if (context->service_files_timeout == NULL)
+        {
+          BUS_SET_OOM (error);
+          goto failed;
+        }
+
+      if (!_dbus_loop_add_timeout (context->loop,
+                                   context->service_files_timeout))
+        {
+          _dbus_timeout_unref (context->service_files_timeout);
+          context->service_files_timeout = NULL;
+          BUS_SET_OOM (error);
+          goto failed;
+        }
+    }
+  else
+    {
+      startup_complete (context);
+    }
+
   dbus_server_free_data_slot (&server_data_slot);
 
   return context;
@@ -1011,14 +1368,53 @@ bus_context_reload_config (BusContext *context,
   _dbus_flush_caches ();
 
   ret = FALSE;
+  parser = NULL;
+
+  if (context->config != NULL &&
+      !bus_config_parser_sources_changed (context->config))
+    {
+      DBusString address;
+
+      /* Parsing the same files again would give the same result, but
+       * group memberships and service files may still have changed */
+      _dbus_verbose ("Configuration unchanged, skipping parse\n");
+
+      if (!bus_connections_reload_policy (context->connections, error))
+        {
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          goto failed;
+        }
+
+      _dbus_string_init_const (&address, context->address);
+
+      if (!bus_activation_reload (context->activation, &address,
+                                  bus_config_parser_get_service_dirs (context->config),
+                                  error))
+        {
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          goto failed;
+        }
+
+      ret = TRUE;
+      goto reloaded;
+    }
+
   _dbus_string_init_const (&config_file, context->config_file);
-  parser = bus_config_load (&config_file, TRUE, NULL, error);
+  parser = load_config (&config_file, error);
   if (parser == NULL)
     {
       _DBUS_ASSERT_ERROR_IS_SET (error);
       goto failed;
     }
 
+  /* From here on the active configuration may be partly replaced, so
+   * the old parser no longer describes it */
+  if (context->config != NULL)
+    {
+      bus_config_parser_unref (context->config);
+      context->config = NULL;
+    }
+
   if (!process_config_every_time (context, parser, TRUE, error))
     {
       _DBUS_ASSERT_ERROR_IS_SET (error);
@@ -1031,6 +1427,17 @@ bus_context_reload_config (BusContext *context,
     }
   ret = TRUE;
 
+  context->config = parser;
+  parser = NULL;
+
+ reloaded:
+  /* reloading read any .service files that were still deferred */
+  if (context->service_files_timeout != NULL)
+    {
+      stop_deferred_service_files (context);
+      startup_complete (context);
+    }
+
   bus_context_log (context, DBUS_SYSTEM_LOG_INFO, "Reloaded configuration");
  failed:
   if (!ret)
@@ -1099,6 +1506,13 @@ bus_context_unref (BusContext *context)
       _dbus_verbose ("Finalizing bus context %p\n", context);
 
       bus_context_shutdown (context);
+      stop_deferred_service_files (context);
+
+      if (context->log_queue)
+        {
+          bus_log_queue_free (context->log_queue);
+          context->log_queue = NULL;
+        }
 
       if (context->connections)
         {
@@ -1133,6 +1547,32 @@ bus_context_unref (BusContext *context)
           context->policy = NULL;
         }
 
+      if (context->config)
+        {
+          bus_config_parser_unref (context->config);
+          context->config = NULL;
+        }
+
+#ifdef DBUS_ENABLE_STATS
+      if (context->stats_server)
+        {
+          bus_stats_server_free (context->stats_server);
+          context->stats_server = NULL;
+        }
+
+      if (context->stats_page)
+        {
+          bus_stats_page_free (context->stats_page);
+          context->stats_page = NULL;
+        }
+
+      if (context->top_talkers)
+        {
+          bus_top_talkers_free (context->top_talkers);
+          context->top_talkers = NULL;
+        }
+#endif
+
       if (context->loop)
         {
           _dbus_loop_unref (context->loop);
@@ -1145,6 +1585,7 @@ bus_context_unref (BusContext *context)
           context->matchmaker = NULL;
         }
 
+      dbus_free (context->policy_cache);
       dbus_free (context->config_file);
       dbus_free (context->log_prefix);
       dbus_free (context->type);
@@ -1168,6 +1609,9 @@ bus_context_unref (BusContext *context)
       if (context->initial_fd_limit)
         _dbus_rlimit_free (context->initial_fd_limit);
 
+      if (context->initial_cpu_affinity)
+        _dbus_cpu_affinity_free (context->initial_cpu_affinity);
+
       dbus_free (context);
 
       dbus_server_free_data_slot (&server_data_slot);
@@ -1284,6 +1728,72 @@ bus_context_get_pending_fd_timeout (BusContext *context)
   return context->limits.pending_fd_timeout;
 }
 
+int
+bus_context_get_reload_delay (BusContext *context)
+{
+  return context->limits.reload_delay;
+}
+
+static dbus_bool_t
+dir_in_list (DBusList  **dirs,
+             const char *dir)
+{
+  DBusList *link;
+
+  for (link = _dbus_list_get_first_link (dirs);
+       link != NULL;
+       link = _dbus_list_get_next_link (dirs, link))
+    {
+      if (strcmp (link->data, dir) == 0)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/**
+ * Whether a change in the given directory can only have changed
+ * service files, so that bus_context_reload_service_files() is enough
+ * to take it into account.
+ *
+ * @param context the bus context
+ * @param dir a watched directory
+ * @returns #TRUE if dir has service files and no configuration
+ */
+dbus_bool_t
+bus_context_is_service_only_dir (BusContext *context,
+                                 const char *dir)
+{
+  if (context->config == NULL)
+    return FALSE;
+
+  return dir_in_list (bus_config_parser_get_service_dirs (context->config), dir) &&
+    !dir_in_list (bus_config_parser_get_conf_dirs (context->config), dir);
+}
+
+/**
+ * Re-reads the service files that have changed in the configured
+ * service directories, without reloading the configuration itself.
+ *
+ * @param context the bus context
+ * @param error set on failure
+ * @returns #FALSE if there was not enough memory
+ */
+dbus_bool_t
+bus_context_reload_service_files (BusContext *context,
+                                  DBusError  *error)
+{
+  if (!bus_activation_update_service_files (context->activation, error))
+    {
+      bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                       "Unable to reload service files: %s", error->message);
+      return FALSE;
+    }
+
+  _dbus_verbose ("Reloaded service files\n");
+  return TRUE;
+}
+
 int
 bus_context_get_max_completed_connections (BusContext *context)
 {
@@ -1302,6 +1812,26 @@ bus_context_get_max_connections_per_user (BusContext *context)
   return context->limits.max_connections_per_user;
 }
 
+void
+bus_context_get_rate_limits (BusContext *context,
+                             long       *messages_per_second,
+                             long       *bytes_per_second,
+                             long       *messages_per_second_per_user,
+                             long       *bytes_per_second_per_user)
+{
+  *messages_per_second = context->limits.max_messages_per_second;
+  *bytes_per_second = context->limits.max_bytes_per_second;
+  *messages_per_second_per_user =
+    context->limits.max_messages_per_second_per_user;
+  *bytes_per_second_per_user = context->limits.max_bytes_per_second_per_user;
+}
+
+long
+bus_context_get_coalesce_properties_changed_bytes (BusContext *context)
+{
+  return context->limits.coalesce_properties_changed_bytes;
+}
+
 int
 bus_context_get_max_pending_activations (BusContext *context)
 {
@@ -1326,6 +1856,22 @@ bus_context_get_max_replies_per_connection (BusContext *context)
   return context->limits.max_replies_per_connection;
 }
 
+/**
+ * Checks whether the messages already queued for a connection exceed
+ * the max_outgoing_bytes or max_outgoing_unix_fds limit.
+ *
+ * @param context the bus context
+ * @param connection the connection
+ * @returns #TRUE if nothing more should be queued for it
+ */
+dbus_bool_t
+bus_context_outgoing_queue_is_full (BusContext     *context,
+                                    DBusConnection *connection)
+{
+  return dbus_connection_get_outgoing_size (connection) > context->limits.max_outgoing_bytes ||
+    dbus_connection_get_outgoing_unix_fds (connection) > context->limits.max_outgoing_unix_fds;
+}
+
 int
 bus_context_get_reply_timeout (BusContext *context)
 {
@@ -1338,11 +1884,138 @@ bus_context_get_initial_fd_limit (BusContext *context)
   return context->initial_fd_limit;
 }
 
+DBusCpuAffinity *
+bus_context_get_initial_cpu_affinity (BusContext *context)
+{
+  return context->initial_cpu_affinity;
+}
+
+/**
+ * Gets how long part of bus_context_new() took, in nanoseconds. With
+ * #BUS_CONTEXT_FLAG_DEFER_SERVICE_FILES, #BUS_STARTUP_SERVICE_FILES
+ * is the time the main loop later spent reading them.
+ */
+dbus_uint64_t
+bus_context_get_startup_time (BusContext      *context,
+                              BusStartupPhase  phase)
+{
+  _dbus_assert (phase < BUS_N_STARTUP_PHASES);
+
+  return context->startup_nsec[phase];
+}
+
+/**
+ * Gets how long after bus_context_new() started the bus was ready to
+ * be connected to, in nanoseconds; that is when the address was
+ * printed, if it was asked for.
+ */
+dbus_uint64_t
+bus_context_get_ready_time (BusContext *context)
+{
+  return context->ready_nsec;
+}
+
+/**
+ * Gets how long after bus_context_new() started the bus had finished
+ * starting up, including reading any deferred .service files, in
+ * nanoseconds; or 0 if it hasn't finished.
+ */
+dbus_uint64_t
+bus_context_get_started_time (BusContext *context)
+{
+  return context->started_nsec;
+}
+
+/* Writes a message that was queued by queue_log_message() */
+static void
+write_log_message (DBusSystemLogSeverity  severity,
+                   const char            *text,
+                   dbus_bool_t            use_syslog)
+{
+  if (use_syslog)
+    {
+      _dbus_system_log (severity, "%s", text);
+    }
+  else
+    {
+      fputs (text, stderr);
+      fputc ('\n', stderr);
+    }
+}
+
+/* Hands a message to the log thread, which writes it as
+ * bus_context_log() would have. Returns FALSE if there was no memory
+ * to format it, or it is a security message for which there was no
+ * room, and the caller must write it itself. */
+static dbus_bool_t
+queue_log_message_valist (BusContext            *context,
+                          DBusSystemLogSeverity  severity,
+                          const char            *msg,
+                          va_list                args)
+{
+  DBusString text;
+  dbus_bool_t queued;
+
+  _dbus_assert (context->log_queue != NULL);
+  _dbus_assert (severity != DBUS_SYSTEM_LOG_FATAL);
+
+  if (!_dbus_string_init (&text))
+    return FALSE;
+
+  if ((context->syslog && context->log_prefix != NULL &&
+       !_dbus_string_append (&text, context->log_prefix)) ||
+      !_dbus_string_append_printf_valist (&text, msg, args))
+    {
+      _dbus_string_free (&text);
+      return FALSE;
+    }
+
+  queued = bus_log_queue_push (context->log_queue, severity,
+                               _dbus_string_get_const_data (&text),
+                               context->syslog);
+  _dbus_string_free (&text);
+  return queued;
+}
+
+static dbus_bool_t
+queue_log_message (BusContext            *context,
+                   DBusSystemLogSeverity  severity,
+                   const char            *msg,
+                   ...)
+{
+  va_list args;
+  dbus_bool_t queued;
+
+  va_start (args, msg);
+  queued = queue_log_message_valist (context, severity, msg, args);
+  va_end (args);
+
+  return queued;
+}
+
 void
 bus_context_log (BusContext *context, DBusSystemLogSeverity severity, const char *msg, ...)
 {
   va_list args;
 
+  if (context->log_queue != NULL)
+    {
+      if (severity != DBUS_SYSTEM_LOG_FATAL)
+        {
+          dbus_bool_t queued;
+
+          va_start (args, msg);
+          queued = queue_log_message_valist (context, severity, msg, args);
+          va_end (args);
+
+          if (queued)
+            return;
+        }
+
+      /* whatever was logged before this should come out first */
+      bus_log_queue_flush (context->log_queue);
+    }
+
   if (!context->syslog)
     {
       /* we're not syslogging; just output to stderr */
@@ -1393,6 +2066,15 @@ bus_context_log_literal (BusContext            *context,
                          DBusSystemLogSeverity  severity,
                          const char            *msg)
 {
+  if (context->log_queue != NULL)
+    {
+      if (severity != DBUS_SYSTEM_LOG_FATAL &&
+          queue_log_message (context, severity, "%s", msg))
+        return;
+
+      bus_log_queue_flush (context->log_queue);
+    }
+
   if (!context->syslog)
     {
       fputs (msg, stderr);
@@ -1450,6 +2132,13 @@ complain_about_message (BusContext     *context,
   const char *sender_name;
   const char *sender_loginfo;
   const char *proposed_recipient_loginfo;
+  unsigned long n_suppressed = 0;
+
+  /* A client that keeps provoking complaints only gets so many of them
+   * logged, and not formatting the rest is most of the saving */
+  if (log && sender != NULL &&
+      !bus_connection_charge_log (sender, &n_suppressed))
+    log = FALSE;
 
   if (error == NULL && !log)
     return;
@@ -1488,13 +2177,123 @@ complain_about_message (BusContext     *context,
 
   /* If we hit OOM while setting the error, this will syslog "out of memory"
    * which is itself an indication that something is seriously wrong */
-  if (log)
+  if (log && n_suppressed > 0)
+    bus_context_log (context, DBUS_SYSTEM_LOG_SECURITY,
+        "%s (and %lu similar messages about this sender were not logged)",
+        stack_error.message, n_suppressed);
+  else if (log)
     bus_context_log_literal (context, DBUS_SYSTEM_LOG_SECURITY,
         stack_error.message);
 
   dbus_move_error (&stack_error, error);
 }
 
+/**
+ * Forgets every cached policy verdict. Called whenever a connection's
+ * policy, activity or identity changes; name ownership is tracked
+ * separately through bus_registry_get_owners_serial().
+ *
+ * @param context the bus context
+ */
+void
+bus_context_invalidate_policy_cache (BusContext *context)
+{
+  context->policy_cache_serial += 1;
+
+  if (context->policy_cache_serial == 0)
+    {
+      if (context->policy_cache != NULL)
+        memset (context->policy_cache, '\0',
+                sizeof (BusPolicyCacheEntry) * POLICY_CACHE_SIZE);
+      context->policy_cache_serial = 1;
+    }
+}
+
+static dbus_bool_t
+policy_cache_append_field (BusPolicyCacheEntry *key,
+                           const char          *field)
+{
+  int len;
+
+  /* none of the header fields can be empty or contain \1, so it
+   * stands for "not set" */
+  if (field == NULL)
+    field = "\1";
+
+  len = strlen (field) + 1;
+  if (key->fields_len + len > POLICY_CACHE_FIELDS_LEN)
+    return FALSE;
+
+  memcpy (key->fields + key->fields_len, field, len);
+  key->fields_len += len;
+
+  return TRUE;
+}
+
+/*
+ * Fills in key for this message and returns the slot it maps to, or
+ * NULL if the message can't be cached. *hit is set if the slot holds a
+ * current verdict for exactly this key.
+ */
+static BusPolicyCacheEntry *
+policy_cache_lookup (BusContext          *context,
+                     DBusConnection      *sender,
+                     const void          *recipient,
+                     DBusMessage         *message,
+                     unsigned int         flags,
+                     BusPolicyCacheEntry *key,
+                     dbus_bool_t         *hit)
+{
+  BusPolicyCacheEntry *entry;
+  unsigned int hash;
+  int i;
+
+  *hit = FALSE;
+
+  if (context->policy_cache == NULL)
+    {
+      /* the cache is only an optimization, so OOM just skips it */
+      context->policy_cache = dbus_new0 (BusPolicyCacheEntry,
+                                         POLICY_CACHE_SIZE);
+      if (context->policy_cache == NULL)
+        return NULL;
+    }
+
+  key->sender = sender;
+  key->recipient = recipient;
+  key->serial = context->policy_cache_serial;
+  key->owners_serial = bus_registry_get_owners_serial (context->registry);
+  key->message_type = dbus_message_get_type (message);
+  key->flags = flags;
+  key->log = FALSE;
+  key->fields_len = 0;
+
+  if (!policy_cache_append_field (key, dbus_message_get_path (message)) ||
+      !policy_cache_append_field (key, dbus_message_get_interface (message)) ||
+      !policy_cache_append_field (key, dbus_message_get_member (message)) ||
+      !policy_cache_append_field (key, dbus_message_get_error_name (message)))
+    return NULL;
+
+  hash = (unsigned int) (((uintptr_t) sender) >> 4);
+  hash = hash * 31 + (unsigned int) (((uintptr_t) recipient) >> 4);
+  hash = hash * 31 + key->message_type * 8 + flags;
+  for (i = 0; i < key->fields_len; i++)
+    hash = hash * 31 + (unsigned char) key->fields[i];
+
+  entry = &context->policy_cache[hash & (POLICY_CACHE_SIZE - 1)];
+
+  *hit = entry->serial == key->serial &&
+    entry->owners_serial == key->owners_serial &&
+    entry->sender == sender &&
+    entry->recipient == recipient &&
+    entry->message_type == key->message_type &&
+    entry->flags == flags &&
+    entry->fields_len == key->fields_len &&
+    memcmp (entry->fields, key->fields, key->fields_len) == 0;
+
+  return entry;
+}
+
 /*
  * addressed_recipient is the recipient specified in the message.
  *
@@ -1508,14 +2307,14 @@ complain_about_message (BusContext     *context,
  * NULL for addressed_recipient may mean the bus driver, or may mean
  * no destination was specified in the message (e.g. a signal).
  */
-dbus_bool_t
-bus_context_check_security_policy (BusContext     *context,
-                                   BusTransaction *transaction,
-                                   DBusConnection *sender,
-                                   DBusConnection *addressed_recipient,
-                                   DBusConnection *proposed_recipient,
-                                   DBusMessage    *message,
-                                   DBusError      *error)
+static dbus_bool_t
+check_security_policy (BusContext     *context,
+                       BusTransaction *transaction,
+                       DBusConnection *sender,
+                       DBusConnection *addressed_recipient,
+                       DBusConnection *proposed_recipient,
+                       DBusMessage    *message,
+                       DBusError      *error)
 {
   const char *src, *dest;
   BusClientPolicy *sender_policy;
@@ -1524,6 +2323,9 @@ bus_context_check_security_policy (BusContext     *context,
   dbus_bool_t log;
   int type;
   dbus_bool_t requested_reply;
+  BusPolicyCacheEntry cache_key;
+  BusPolicyCacheEntry *cache_entry;
+  dbus_bool_t cached;
 
   type = dbus_message_get_type (message);
   src = dbus_message_get_sender (message);
@@ -1703,8 +2505,52 @@ bus_context_check_security_policy (BusContext     *context,
                 (proposed_recipient != NULL && sender == NULL && recipient_policy == NULL) ||
                 (proposed_recipient == NULL && recipient_policy == NULL));
 
+  /* Between two active connections, or from the bus driver to one,
+   * the verdict only depends on the message header fields, the reply
+   * state and the policies, so an earlier "allowed" for the same key
+   * can be reused. Denials are never cached, since the complaint needs
+   * the matched rule count.
+   */
+  cache_entry = NULL;
+  cached = FALSE;
+  if (recipient_policy != NULL)
+    {
+      const void *recipient_key;
+      unsigned int flags;
+
+      flags = 0;
+      if (dbus_message_get_reply_serial (message) != 0)
+        flags |= POLICY_CACHE_IS_REPLY;
+      if (requested_reply)
+        flags |= POLICY_CACHE_REQUESTED_REPLY;
+      if (addressed_recipient != proposed_recipient && dest != NULL)
+        flags |= POLICY_CACHE_EAVESDROPPING;
+
+      /* The recipient only matters to the send rules through the names
+       * it owns, so every recipient that owns nothing but its unique
+       * name gets the verdict of any other with the same policy, unless
+       * a send rule names a unique name. Connections with the same
+       * identity share a policy, so a broadcast to many such recipients
+       * is checked once per identity rather than once per recipient.
+       */
+      recipient_key = proposed_recipient;
+      if (bus_connection_get_n_services_owned (proposed_recipient) <= 1 &&
+          (sender_policy == NULL ||
+           !bus_client_policy_sends_to_unique_names (sender_policy)))
+        {
+          recipient_key = recipient_policy;
+          flags |= POLICY_CACHE_BY_POLICY;
+        }
+
+      cache_entry = policy_cache_lookup (context, sender, recipient_key,
+                                         message, flags, &cache_key, &cached);
+    }
+
   log = FALSE;
-  if (sender_policy &&
+  if (cached)
+    log = cache_entry->log;
+
+  if (!cached && sender_policy &&
       !bus_client_policy_check_can_send (sender_policy,
                                          context->registry,
                                          requested_reply,
@@ -1729,7 +2575,7 @@ bus_context_check_security_policy (BusContext     *context,
           TRUE, NULL);
     }
 
-  if (recipient_policy &&
+  if (!cached && recipient_policy &&
       !bus_client_policy_check_can_receive (recipient_policy,
                                             context->registry,
                                             requested_reply,
@@ -1745,11 +2591,19 @@ bus_context_check_security_policy (BusContext     *context,
       return FALSE;
     }
 
+  if (cache_entry != NULL && !cached)
+    {
+      *cache_entry = cache_key;
+      cache_entry->log = log;
+    }
+
   /* See if limits on size have been exceeded */
   if (proposed_recipient &&
-      ((dbus_connection_get_outgoing_size (proposed_recipient) > context->limits.max_outgoing_bytes) ||
-       (dbus_connection_get_outgoing_unix_fds (proposed_recipient) > context->limits.max_outgoing_unix_fds)))
+      bus_context_outgoing_queue_is_full (context, proposed_recipient))
     {
+#ifdef DBUS_ENABLE_STATS
+      context->n_queue_full_rejections += 1;
+#endif
       complain_about_message (context, DBUS_ERROR_LIMITS_EXCEEDED,
           "Rejected: destination has a full message queue",
           0, message, sender, proposed_recipient, requested_reply, TRUE,
@@ -1779,6 +2633,67 @@ bus_context_check_security_policy (BusContext     *context,
   return TRUE;
 }
 
+dbus_bool_t
+bus_context_check_security_policy (BusContext     *context,
+                                   BusTransaction *transaction,
+                                   DBusConnection *sender,
+                                   DBusConnection *addressed_recipient,
+                                   DBusConnection *proposed_recipient,
+                                   DBusMessage    *message,
+                                   DBusError      *error)
+{
+  dbus_bool_t allowed;
+  DBusPhase old_phase;
+#ifdef DBUS_ENABLE_STATS
+  long tv_sec, tv_usec;
+
+  _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+#endif
+
+  old_phase = _dbus_phase_enter (DBUS_PHASE_POLICY);
+  allowed = check_security_policy (context, transaction, sender,
+                                   addressed_recipient, proposed_recipient,
+                                   message, error);
+  _dbus_phase_leave (old_phase);
+
+#ifdef DBUS_ENABLE_STATS
+  bus_latency_histogram_record (&context->latency[BUS_LATENCY_POLICY_CHECK],
+                                tv_sec, tv_usec);
+#endif
+
+  _DBUS_TRACE4 (policy__checked,
+                dbus_message_get_serial (message),
+                dbus_message_get_sender (message),
+                proposed_recipient != NULL ?
+                  bus_connection_get_name (proposed_recipient) : NULL,
+                allowed);
+
+  return allowed;
+}
+
+#ifdef DBUS_ENABLE_STATS
+BusLatencyHistogram *
+bus_context_get_latency_histogram (BusContext              *context,
+                                   BusLatencyHistogramType  type)
+{
+  _dbus_assert (type < BUS_N_LATENCY_HISTOGRAMS);
+
+  return &context->latency[type];
+}
+
+BusTopTalkers *
+bus_context_get_top_talkers (BusContext *context)
+{
+  return context->top_talkers;
+}
+
+dbus_uint64_t
+bus_context_get_n_queue_full_rejections (BusContext *context)
+{
+  return context->n_queue_full_rejections;
+}
+#endif
+
 void
 bus_context_check_all_watches (BusContext *context)
 {
@@ -44,6 +44,10 @@ typedef struct BusOwner		BusOwner;
 typedef struct BusTransaction   BusTransaction;
 typedef struct BusMatchmaker    BusMatchmaker;
 typedef struct BusMatchRule     BusMatchRule;
+typedef struct BusLatencyHistogram BusLatencyHistogram;
+typedef struct BusTopTalkers    BusTopTalkers;
+typedef struct BusStatsServer   BusStatsServer;
+typedef struct BusStatsPage     BusStatsPage;
 
 typedef struct
 {
@@ -51,11 +55,22 @@ typedef struct
   long max_incoming_unix_fds;       /**< How many incoming message unix fds for a single connection */
   long max_outgoing_bytes;          /**< How many outgoing bytes can be queued for a single connection */
   long max_outgoing_unix_fds;       /**< How many outgoing unix fds can be queued for a single connection */
+  long max_unflushed_bytes;         /**< How many outgoing bytes can wait for the main loop before writing immediately */
+  long deferred_validation_bytes;   /**< Message bodies this long are validated only once something needs them, or 0 */
+  int max_overtaken_broadcasts;     /**< How many queued broadcasts a reply or unicast message may overtake */
+  int broadcast_signal_ttl;         /**< Milliseconds a broadcast may wait in a connection's queue before it is dropped, or 0 */
+  int max_socket_buffer_bytes;      /**< Largest a connection's kernel socket buffers may grow to, or 0 */
+  long coalesce_properties_changed_bytes; /**< Queued bytes from which PropertiesChanged signals are merged, or 0 */
+  long max_messages_per_second;     /**< Sustained incoming messages per second per connection, or 0 */
+  long max_bytes_per_second;        /**< Sustained incoming bytes per second per connection, or 0 */
+  long max_messages_per_second_per_user; /**< As max_messages_per_second, for all of a user's connections */
+  long max_bytes_per_second_per_user;    /**< As max_bytes_per_second, for all of a user's connections */
   long max_message_size;            /**< Max size of a single message in bytes */
   long max_message_unix_fds;        /**< Max number of unix fds of a single message*/
   int activation_timeout;           /**< How long to wait for an activation to time out */
   int auth_timeout;                 /**< How long to wait for an authentication to time out */
   int pending_fd_timeout;           /**< How long to wait for a D-Bus message with a fd to time out */
+  int reload_delay;                 /**< How long watched directories must be quiet before we reload */
   int max_completed_connections;    /**< Max number of authorized connections */
   int max_incomplete_connections;   /**< Max number of incomplete connections */
   int max_connections_per_user;     /**< Max number of connections auth'd as same user */
@@ -66,15 +81,40 @@ typedef struct
   int reply_timeout;                  /**< How long to wait before timing out a reply */
 } BusLimits;
 
+/* Which part of message handling a latency histogram times */
+typedef enum
+{
+  BUS_LATENCY_ROUTING,       /**< Whole dispatch of a message */
+  BUS_LATENCY_POLICY_CHECK,  /**< One security policy check */
+  BUS_LATENCY_MATCHMAKER,    /**< Finding match rule recipients */
+  BUS_N_LATENCY_HISTOGRAMS
+} BusLatencyHistogramType;
+
 typedef enum
 {
   BUS_CONTEXT_FLAG_NONE = 0,
   BUS_CONTEXT_FLAG_FORK_ALWAYS = (1 << 1),
   BUS_CONTEXT_FLAG_FORK_NEVER = (1 << 2),
   BUS_CONTEXT_FLAG_WRITE_PID_FILE = (1 << 3),
-  BUS_CONTEXT_FLAG_SYSTEMD_ACTIVATION = (1 << 4)
+  BUS_CONTEXT_FLAG_SYSTEMD_ACTIVATION = (1 << 4),
+  BUS_CONTEXT_FLAG_PRINT_STARTUP_TIMINGS = (1 << 6), /**< Print how long each part of starting up took */
+  BUS_CONTEXT_FLAG_DEFER_SERVICE_FILES = (1 << 7) /**< Signal readiness before reading .service files */
 } BusContextFlags;
 
+/* The parts of bus_context_new() whose duration is recorded */
+typedef enum
+{
+  BUS_STARTUP_CONFIG,        /**< Parsing and applying the configuration */
+  BUS_STARTUP_INCLUDEDIR,    /**< Of which, the <includedir> directories */
+  BUS_STARTUP_LISTEN,        /**< Setting up the listening sockets */
+  BUS_STARTUP_SERVICE_FILES, /**< Reading .service files */
+  BUS_STARTUP_DAEMONIZE,     /**< Forking and writing the pid file */
+  BUS_STARTUP_SECURITY,      /**< Initializing SELinux and AppArmor */
+  BUS_STARTUP_WATCH,         /**< Raising the fd limit and watching directories */
+  BUS_STARTUP_FINISH,        /**< Changing user, audit and the log thread */
+  BUS_N_STARTUP_PHASES
+} BusStartupPhase;
+
 BusContext*       bus_context_new                                (const DBusString *config_file,
                                                                   BusContextFlags   flags,
                                                                   DBusPipe         *print_addr_pipe,
@@ -106,18 +146,37 @@ BusPolicy*        bus_context_get_policy                         (BusContext
 BusClientPolicy*  bus_context_create_client_policy               (BusContext       *context,
                                                                   DBusConnection   *connection,
                                                                   DBusError        *error);
+void              bus_context_invalidate_policy_cache            (BusContext       *context);
 int               bus_context_get_activation_timeout             (BusContext       *context);
 int               bus_context_get_auth_timeout                   (BusContext       *context);
 int               bus_context_get_pending_fd_timeout             (BusContext       *context);
+int               bus_context_get_reload_delay                   (BusContext       *context);
+dbus_bool_t       bus_context_is_service_only_dir                (BusContext       *context,
+                                                                  const char       *dir);
+dbus_bool_t       bus_context_reload_service_files               (BusContext       *context,
+                                                                  DBusError        *error);
 int               bus_context_get_max_completed_connections      (BusContext       *context);
 int               bus_context_get_max_incomplete_connections     (BusContext       *context);
 int               bus_context_get_max_connections_per_user       (BusContext       *context);
+void              bus_context_get_rate_limits                    (BusContext       *context,
+                                                                  long             *messages_per_second,
+                                                                  long             *bytes_per_second,
+                                                                  long             *messages_per_second_per_user,
+                                                                  long             *bytes_per_second_per_user);
+long              bus_context_get_coalesce_properties_changed_bytes (BusContext    *context);
 int               bus_context_get_max_pending_activations        (BusContext       *context);
 int               bus_context_get_max_services_per_connection    (BusContext       *context);
 int               bus_context_get_max_match_rules_per_connection (BusContext       *context);
 int               bus_context_get_max_replies_per_connection     (BusContext       *context);
+dbus_bool_t       bus_context_outgoing_queue_is_full             (BusContext       *context,
+                                                                  DBusConnection   *connection);
 int               bus_context_get_reply_timeout                  (BusContext       *context);
 DBusRLimit *      bus_context_get_initial_fd_limit               (BusContext       *context);
+DBusCpuAffinity * bus_context_get_initial_cpu_affinity           (BusContext       *context);
+dbus_uint64_t     bus_context_get_startup_time                   (BusContext       *context,
+                                                                  BusStartupPhase   phase);
+dbus_uint64_t     bus_context_get_ready_time                     (BusContext       *context);
+dbus_uint64_t     bus_context_get_started_time                   (BusContext       *context);
 void              bus_context_log                                (BusContext       *context,
                                                                   DBusSystemLogSeverity severity,
                                                                   const char       *msg,
@@ -140,4 +199,10 @@ dbus_bool_t       bus_context_check_security_policy              (BusContext
                                                                   DBusError        *error);
 void              bus_context_check_all_watches                  (BusContext       *context);
 
+/* only present if DBUS_ENABLE_STATS */
+BusLatencyHistogram* bus_context_get_latency_histogram           (BusContext       *context,
+                                                                  BusLatencyHistogramType type);
+BusTopTalkers*    bus_context_get_top_talkers                    (BusContext       *context);
+dbus_uint64_t     bus_context_get_n_queue_full_rejections        (BusContext       *context);
+
 #endif /* BUS_BUS_H */
@@ -0,0 +1,501 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* coalesce.c  Merging superseded PropertiesChanged signals
+ *
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "coalesce.h"
+#include "test.h"
+#include <dbus/dbus-internals.h>
+#include <string.h>
+
+/*
+ * A connection that falls behind on its signals may be sent one
+ * PropertiesChanged signal in place of two, if the older one is still
+ * waiting in its queue: the merged signal carries the newer one's
+ * values and invalidations, plus whatever the older one said about
+ * properties the newer one doesn't mention.
+ */
+
+/* PropertiesChanged (s interface, a{sv} changed, as invalidated) */
+#define PROPERTIES_CHANGED_SIGNATURE "sa{sv}as"
+#define ARG_CHANGED 1
+#define ARG_INVALIDATED 2
+
+/**
+ * Checks whether a message is a PropertiesChanged signal that
+ * bus_coalesce_merge() can handle.
+ *
+ * @param message the message
+ * @returns #TRUE if it can be merged
+ */
+dbus_bool_t
+bus_coalesce_is_mergeable (DBusMessage *message)
+{
+  return dbus_message_is_signal (message, DBUS_INTERFACE_PROPERTIES,
+                                 "PropertiesChanged") &&
+    dbus_message_has_signature (message, PROPERTIES_CHANGED_SIGNATURE) &&
+    dbus_message_get_sender (message) != NULL &&
+    !dbus_message_contains_unix_fds (message);
+}
+
+/**
+ * Appends a string to @p key that is the same for two mergeable
+ * messages if and only if they can be merged, because they come from
+ * the same sender and are about the same object and interface.
+ *
+ * @param message a mergeable message
+ * @param key string to append to
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+bus_coalesce_append_key (DBusMessage *message,
+                         DBusString  *key)
+{
+  DBusMessageIter iter;
+  const char *interface;
+
+  _dbus_assert (bus_coalesce_is_mergeable (message));
+
+  dbus_message_iter_init (message, &iter);
+  dbus_message_iter_get_basic (&iter, &interface);
+
+  /* none of these can contain a space */
+  return _dbus_string_append (key, dbus_message_get_sender (message)) &&
+    _dbus_string_append_byte (key, ' ') &&
+    _dbus_string_append (key, dbus_message_get_path (message)) &&
+    _dbus_string_append_byte (key, ' ') &&
+    _dbus_string_append (key, interface);
+}
+
+static void
+iter_init_at_arg (DBusMessage     *message,
+                  int              arg,
+                  DBusMessageIter *iter)
+{
+  dbus_message_iter_init (message, iter);
+
+  while (arg-- > 0)
+    dbus_message_iter_next (iter);
+}
+
+/* Whether the message changes or invalidates the named property */
+static dbus_bool_t
+mentions_property (DBusMessage *message,
+                   const char  *name)
+{
+  DBusMessageIter iter, array, entry;
+  const char *other;
+
+  iter_init_at_arg (message, ARG_CHANGED, &iter);
+  dbus_message_iter_recurse (&iter, &array);
+
+  while (dbus_message_iter_get_arg_type (&array) == DBUS_TYPE_DICT_ENTRY)
+    {
+      dbus_message_iter_recurse (&array, &entry);
+      dbus_message_iter_get_basic (&entry, &other);
+
+      if (strcmp (name, other) == 0)
+        return TRUE;
+
+      dbus_message_iter_next (&array);
+    }
+
+  dbus_message_iter_next (&iter);
+  dbus_message_iter_recurse (&iter, &array);
+
+  while (dbus_message_iter_get_arg_type (&array) == DBUS_TYPE_STRING)
+    {
+      dbus_message_iter_get_basic (&array, &other);
+
+      if (strcmp (name, other) == 0)
+        return TRUE;
+
+      dbus_message_iter_next (&array);
+    }
+
+  return FALSE;
+}
+
+static dbus_bool_t
+copy_value (DBusMessageIter *from,
+            DBusMessageIter *to)
+{
+  DBusMessageIter from_sub, to_sub;
+  char *signature;
+  int type;
+
+  type = dbus_message_iter_get_arg_type (from);
+
+  if (dbus_type_is_basic (type))
+    {
+      DBusBasicValue value;
+
+      dbus_message_iter_get_basic (from, &value);
+      return dbus_message_iter_append_basic (to, type, &value);
+    }
+
+  dbus_message_iter_recurse (from, &from_sub);
+  signature = NULL;
+
+  if (type == DBUS_TYPE_VARIANT)
+    {
+      signature = dbus_message_iter_get_signature (&from_sub);
+      if (signature == NULL)
+        return FALSE;
+    }
+  else if (type == DBUS_TYPE_ARRAY)
+    {
+      signature = dbus_message_iter_get_signature (from);
+      if (signature == NULL)
+        return FALSE;
+
+      /* drop the 'a' to get the element type */
+      memmove (signature, signature + 1, strlen (signature));
+    }
+
+  if (!dbus_message_iter_open_container (to, type, signature, &to_sub))
+    {
+      dbus_free (signature);
+      return FALSE;
+    }
+
+  dbus_free (signature);
+
+  while (dbus_message_iter_get_arg_type (&from_sub) != DBUS_TYPE_INVALID)
+    {
+      if (!copy_value (&from_sub, &to_sub))
+        {
+          dbus_message_iter_abandon_container (to, &to_sub);
+          return FALSE;
+        }
+
+      dbus_message_iter_next (&from_sub);
+    }
+
+  return dbus_message_iter_close_container (to, &to_sub);
+}
+
+/* Copies the elements of one of the message's arrays that
+ * @p superseded_by doesn't mention, or all of them if it is NULL */
+static dbus_bool_t
+copy_properties (DBusMessage     *message,
+                 int              arg,
+                 DBusMessage     *superseded_by,
+                 DBusMessageIter *to)
+{
+  DBusMessageIter iter, array;
+
+  iter_init_at_arg (message, arg, &iter);
+  dbus_message_iter_recurse (&iter, &array);
+
+  while (dbus_message_iter_get_arg_type (&array) != DBUS_TYPE_INVALID)
+    {
+      if (superseded_by != NULL)
+        {
+          DBusMessageIter entry;
+          const char *name;
+
+          if (arg == ARG_CHANGED)
+            {
+              dbus_message_iter_recurse (&array, &entry);
+              dbus_message_iter_get_basic (&entry, &name);
+            }
+          else
+            {
+              dbus_message_iter_get_basic (&array, &name);
+            }
+
+          if (mentions_property (superseded_by, name))
+            {
+              dbus_message_iter_next (&array);
+              continue;
+            }
+        }
+
+      if (!copy_value (&array, to))
+        return FALSE;
+
+      dbus_message_iter_next (&array);
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+append_merged_array (DBusMessage     *older,
+                     DBusMessage     *newer,
+                     int              arg,
+                     const char      *element_signature,
+                     DBusMessageIter *to)
+{
+  DBusMessageIter array;
+
+  if (!dbus_message_iter_open_container (to, DBUS_TYPE_ARRAY,
+                                         element_signature, &array))
+    return FALSE;
+
+  if (!copy_properties (older, arg, newer, &array) ||
+      !copy_properties (newer, arg, NULL, &array))
+    {
+      dbus_message_iter_abandon_container (to, &array);
+      return FALSE;
+    }
+
+  return dbus_message_iter_close_container (to, &array);
+}
+
+/**
+ * Merges two PropertiesChanged signals for the same object and
+ * interface into one that says the same as sending both, in order.
+ * It has the newer one's sender, destination and serial, so it can
+ * take the newer one's place in the queue.
+ *
+ * @param older the signal sent first
+ * @param newer the signal sent later
+ * @returns the merged signal, or #NULL if not enough memory
+ */
+DBusMessage *
+bus_coalesce_merge (DBusMessage *older,
+                    DBusMessage *newer)
+{
+  DBusMessage *merged;
+  DBusMessageIter iter;
+  const char *interface;
+
+  _dbus_assert (bus_coalesce_is_mergeable (older));
+  _dbus_assert (bus_coalesce_is_mergeable (newer));
+
+  merged = dbus_message_new_signal (dbus_message_get_path (newer),
+                                    DBUS_INTERFACE_PROPERTIES,
+                                    "PropertiesChanged");
+  if (merged == NULL)
+    return NULL;
+
+  if (!dbus_message_set_sender (merged, dbus_message_get_sender (newer)) ||
+      !dbus_message_set_destination (merged,
+                                     dbus_message_get_destination (newer)))
+    goto oom;
+
+  dbus_message_set_serial (merged, dbus_message_get_serial (newer));
+
+  dbus_message_iter_init (newer, &iter);
+  dbus_message_iter_get_basic (&iter, &interface);
+
+  dbus_message_iter_init_append (merged, &iter);
+
+  if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &interface) ||
+      !append_merged_array (older, newer, ARG_CHANGED,
+                            DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+                            DBUS_TYPE_STRING_AS_STRING
+                            DBUS_TYPE_VARIANT_AS_STRING
+                            DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
+                            &iter) ||
+      !append_merged_array (older, newer, ARG_INVALIDATED,
+                            DBUS_TYPE_STRING_AS_STRING, &iter))
+    goto oom;
+
+  return merged;
+
+oom:
+  dbus_message_unref (merged);
+  return NULL;
+}
+
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+
+static DBusMessage *
+new_properties_changed (const char *path,
+                        const char *changed_name,
+                        dbus_int32_t changed_value,
+                        const char *invalidated_name)
+{
+  DBusMessage *message;
+  DBusMessageIter iter, array, entry, variant;
+  const char *interface = "com.example.Thing";
+
+  message = dbus_message_new_signal (path, DBUS_INTERFACE_PROPERTIES,
+                                     "PropertiesChanged");
+  if (message == NULL ||
+      !dbus_message_set_sender (message, ":1.42"))
+    _dbus_assert_not_reached ("no memory");
+
+  dbus_message_iter_init_append (message, &iter);
+
+  if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &interface) ||
+      !dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "{sv}",
+                                         &array))
+    _dbus_assert_not_reached ("no memory");
+
+  if (changed_name != NULL)
+    {
+      if (!dbus_message_iter_open_container (&array, DBUS_TYPE_DICT_ENTRY,
+                                             NULL, &entry) ||
+          !dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING,
+                                           &changed_name) ||
+          !dbus_message_iter_open_container (&entry, DBUS_TYPE_VARIANT, "ai",
+                                             &variant))
+        _dbus_assert_not_reached ("no memory");
+
+      /* an array, to exercise copying containers */
+      {
+        DBusMessageIter ints;
+
+        if (!dbus_message_iter_open_container (&variant, DBUS_TYPE_ARRAY, "i",
+                                               &ints) ||
+            !dbus_message_iter_append_basic (&ints, DBUS_TYPE_INT32,
+                                             &changed_value) ||
+            !dbus_message_iter_close_container (&variant, &ints))
+          _dbus_assert_not_reached ("no memory");
+      }
+
+      if (!dbus_message_iter_close_container (&entry, &variant) ||
+          !dbus_message_iter_close_container (&array, &entry))
+        _dbus_assert_not_reached ("no memory");
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &array) ||
+      !dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "s", &array))
+    _dbus_assert_not_reached ("no memory");
+
+  if (invalidated_name != NULL &&
+      !dbus_message_iter_append_basic (&array, DBUS_TYPE_STRING,
+                                       &invalidated_name))
+    _dbus_assert_not_reached ("no memory");
+
+  if (!dbus_message_iter_close_container (&iter, &array))
+    _dbus_assert_not_reached ("no memory");
+
+  return message;
+}
+
+/* Returns the value of the named changed property, -1 if it is
+ * invalidated, or 0 if it isn't mentioned */
+static dbus_int32_t
+get_property (DBusMessage *message,
+              const char  *name)
+{
+  DBusMessageIter iter, array, entry, variant, ints;
+  const char *other;
+  dbus_int32_t value;
+
+  iter_init_at_arg (message, ARG_CHANGED, &iter);
+  dbus_message_iter_recurse (&iter, &array);
+
+  while (dbus_message_iter_get_arg_type (&array) == DBUS_TYPE_DICT_ENTRY)
+    {
+      dbus_message_iter_recurse (&array, &entry);
+      dbus_message_iter_get_basic (&entry, &other);
+
+      if (strcmp (name, other) == 0)
+        {
+          dbus_message_iter_next (&entry);
+          dbus_message_iter_recurse (&entry, &variant);
+          dbus_message_iter_recurse (&variant, &ints);
+          dbus_message_iter_get_basic (&ints, &value);
+          return value;
+        }
+
+      dbus_message_iter_next (&array);
+    }
+
+  dbus_message_iter_next (&iter);
+  dbus_message_iter_recurse (&iter, &array);
+
+  while (dbus_message_iter_get_arg_type (&array) == DBUS_TYPE_STRING)
+    {
+      dbus_message_iter_get_basic (&array, &other);
+
+      if (strcmp (name, other) == 0)
+        return -1;
+
+      dbus_message_iter_next (&array);
+    }
+
+  return 0;
+}
+
+dbus_bool_t
+bus_coalesce_test (const DBusString *test_data_dir)
+{
+  DBusMessage *a, *b, *c, *merged, *twice;
+  DBusString key_a, key_b, key_other;
+  DBusMessage *other;
+
+  a = new_properties_changed ("/a", "Colour", 1, "Shape");
+  b = new_properties_changed ("/a", "Size", 2, "Colour");
+  c = new_properties_changed ("/a", "Shape", 3, NULL);
+  other = new_properties_changed ("/b", "Size", 4, NULL);
+  dbus_message_set_serial (b, 7);
+
+  _dbus_assert (bus_coalesce_is_mergeable (a));
+
+  if (!_dbus_string_init (&key_a) ||
+      !_dbus_string_init (&key_b) ||
+      !_dbus_string_init (&key_other) ||
+      !bus_coalesce_append_key (a, &key_a) ||
+      !bus_coalesce_append_key (b, &key_b) ||
+      !bus_coalesce_append_key (other, &key_other))
+    _dbus_assert_not_reached ("no memory");
+
+  _dbus_assert (_dbus_string_equal (&key_a, &key_b));
+  _dbus_assert (!_dbus_string_equal (&key_a, &key_other));
+
+  /* b invalidates the Colour that a changed, and a's invalidation of
+   * Shape still stands */
+  merged = bus_coalesce_merge (a, b);
+  _dbus_assert (merged != NULL);
+  _dbus_assert (bus_coalesce_is_mergeable (merged));
+  _dbus_assert (dbus_message_get_serial (merged) == 7);
+  _dbus_assert (strcmp (dbus_message_get_sender (merged), ":1.42") == 0);
+  _dbus_assert (get_property (merged, "Colour") == -1);
+  _dbus_assert (get_property (merged, "Size") == 2);
+  _dbus_assert (get_property (merged, "Shape") == -1);
+
+  /* then c changes Shape again */
+  twice = bus_coalesce_merge (merged, c);
+  _dbus_assert (twice != NULL);
+  _dbus_assert (get_property (twice, "Colour") == -1);
+  _dbus_assert (get_property (twice, "Size") == 2);
+  _dbus_assert (get_property (twice, "Shape") == 3);
+
+  dbus_message_unref (twice);
+  dbus_message_unref (merged);
+
+  /* invalidating something doesn't lose a newer value for it */
+  merged = bus_coalesce_merge (b, a);
+  _dbus_assert (merged != NULL);
+  _dbus_assert (get_property (merged, "Colour") == 1);
+  _dbus_assert (get_property (merged, "Size") == 2);
+  _dbus_assert (get_property (merged, "Shape") == -1);
+  dbus_message_unref (merged);
+
+  _dbus_string_free (&key_a);
+  _dbus_string_free (&key_b);
+  _dbus_string_free (&key_other);
+  dbus_message_unref (a);
+  dbus_message_unref (b);
+  dbus_message_unref (c);
+  dbus_message_unref (other);
+
+  return TRUE;
+}
+
+#endif /* DBUS_ENABLE_EMBEDDED_TESTS */
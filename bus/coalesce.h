@@ -0,0 +1,35 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* coalesce.h  Merging superseded PropertiesChanged signals
+ *
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef BUS_COALESCE_H
+#define BUS_COALESCE_H
+
+#include <dbus/dbus.h>
+#include <dbus/dbus-string.h>
+
+dbus_bool_t  bus_coalesce_is_mergeable (DBusMessage *message);
+dbus_bool_t  bus_coalesce_append_key   (DBusMessage *message,
+                                        DBusString  *key);
+DBusMessage *bus_coalesce_merge        (DBusMessage *older,
+                                        DBusMessage *newer);
+
+#endif /* BUS_COALESCE_H */
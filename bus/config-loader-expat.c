@@ -217,6 +217,10 @@ bus_config_load (const DBusString      *file,
     }
   context.parser = parser;
 
+  /* include_file() records included files itself */
+  if (is_toplevel)
+    bus_config_parser_add_source (parser, file);
+
   XML_SetUserData (expat, &context);
   XML_SetElementHandler (expat,
                          expat_StartElementHandler,
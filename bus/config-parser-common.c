@@ -63,6 +63,18 @@ bus_config_parser_element_name_to_type (const char *name)
     {
       return ELEMENT_LISTEN;
     }
+  else if (strcmp (name, "stats_listen") == 0)
+    {
+      return ELEMENT_STATS_LISTEN;
+    }
+  else if (strcmp (name, "stats_page") == 0)
+    {
+      return ELEMENT_STATS_PAGE;
+    }
+  else if (strcmp (name, "cpu_affinity") == 0)
+    {
+      return ELEMENT_CPU_AFFINITY;
+    }
   else if (strcmp (name, "auth") == 0)
     {
       return ELEMENT_AUTH;
@@ -187,6 +199,12 @@ bus_config_parser_element_type_to_name (ElementType type)
       return "allow_anonymous";
     case ELEMENT_APPARMOR:
       return "apparmor";
+    case ELEMENT_STATS_LISTEN:
+      return "stats_listen";
+    case ELEMENT_CPU_AFFINITY:
+      return "cpu_affinity";
+    case ELEMENT_STATS_PAGE:
+      return "stats_page";
     }
 
   _dbus_assert_not_reached ("bad element type");
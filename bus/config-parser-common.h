@@ -50,7 +50,10 @@ typedef enum
   ELEMENT_KEEP_UMASK,
   ELEMENT_SYSLOG,
   ELEMENT_ALLOW_ANONYMOUS,
-  ELEMENT_APPARMOR
+  ELEMENT_APPARMOR,
+  ELEMENT_STATS_LISTEN,
+  ELEMENT_CPU_AFFINITY,
+  ELEMENT_STATS_PAGE
 } ElementType;
 
 ElementType bus_config_parser_element_name_to_type (const char *element_name);
@@ -312,6 +312,13 @@ bus_config_parser_finished (BusConfigParser   *parser,
   return TRUE;
 }
 
+void
+bus_config_parser_add_source (BusConfigParser   *parser,
+                              const DBusString  *path)
+{
+  /* the activation helper never reloads, so sources aren't tracked */
+}
+
 const char*
 bus_config_parser_get_user (BusConfigParser *parser)
 {
@@ -79,6 +79,32 @@ typedef struct
 
 } Element;
 
+/**
+ * A file or directory the configuration was read from, as it was
+ * when it was read.
+ */
+typedef struct
+{
+  char *path;          /**< Absolute or basedir-relative path */
+  dbus_bool_t exists;  /**< FALSE if it could not be stat()ed */
+  unsigned long mtime; /**< Modification time */
+  unsigned long ctime; /**< Status change time */
+  unsigned long size;  /**< Size in bytes */
+  long checked;        /**< Real time in seconds when it was stat()ed */
+} BusConfigSource;
+
+/**
+ * A user or group name the configuration refers to, and what it
+ * resolved to when the configuration was read.
+ */
+typedef struct
+{
+  char *name;             /**< User or group name from the configuration */
+  dbus_bool_t is_group;   /**< TRUE if name is a group */
+  dbus_bool_t known;      /**< FALSE if name did not resolve */
+  unsigned long id;       /**< uid or gid name resolved to */
+} BusConfigIdentity;
+
 /**
  * Parser for bus configuration file. 
  */
@@ -110,10 +136,22 @@ struct BusConfigParser
 
   char *pidfile;         /**< PID file */
 
+  char *stats_listen;    /**< Address to serve statistics as text on */
+
+  char *stats_page;      /**< File to publish core counters in */
+
+  char *cpu_affinity;    /**< CPUs to run on */
+
   DBusList *included_files;  /**< Included files stack */
 
   DBusHashTable *service_context_table; /**< Map service names to SELinux contexts */
 
+  DBusList *sources;     /**< BusConfigSource for each file and directory read */
+
+  DBusList *identities;  /**< BusConfigIdentity for each user and group looked up */
+
+  dbus_uint64_t includedir_nsec; /**< Time spent in this file's <includedir> directories */
+
   unsigned int fork : 1; /**< TRUE to fork into daemon mode */
 
   unsigned int syslog : 1; /**< TRUE to enable syslog */
@@ -122,6 +160,8 @@ struct BusConfigParser
   unsigned int is_toplevel : 1; /**< FALSE if we are a sub-config-file inside another one */
 
   unsigned int allow_anonymous : 1; /**< TRUE to allow anonymous connections */
+
+  unsigned int sources_incomplete : 1; /**< TRUE if some source or identity could not be recorded */
 };
 
 static Element*
@@ -329,6 +369,27 @@ merge_included (BusConfigParser *parser,
       included->pidfile = NULL;
     }
 
+  if (included->stats_listen != NULL)
+    {
+      dbus_free (parser->stats_listen);
+      parser->stats_listen = included->stats_listen;
+      included->stats_listen = NULL;
+    }
+
+  if (included->stats_page != NULL)
+    {
+      dbus_free (parser->stats_page);
+      parser->stats_page = included->stats_page;
+      included->stats_page = NULL;
+    }
+
+  if (included->cpu_affinity != NULL)
+    {
+      dbus_free (parser->cpu_affinity);
+      parser->cpu_affinity = included->cpu_affinity;
+      included->cpu_affinity = NULL;
+    }
+
   if (included->servicehelper != NULL)
     {
       dbus_free (parser->servicehelper);
@@ -347,6 +408,15 @@ merge_included (BusConfigParser *parser,
 
   while ((link = _dbus_list_pop_first_link (&included->conf_dirs)))
     _dbus_list_append_link (&parser->conf_dirs, link);
+
+  while ((link = _dbus_list_pop_first_link (&included->sources)))
+    _dbus_list_append_link (&parser->sources, link);
+
+  while ((link = _dbus_list_pop_first_link (&included->identities)))
+    _dbus_list_append_link (&parser->identities, link);
+
+  if (included->sources_incomplete)
+    parser->sources_incomplete = TRUE;
   
   return TRUE;
 }
@@ -369,6 +439,147 @@ seen_include (BusConfigParser  *parser,
   return FALSE;
 }
 
+static void
+source_free (BusConfigSource *source)
+{
+  dbus_free (source->path);
+  dbus_free (source);
+}
+
+static void
+identity_free (BusConfigIdentity *identity)
+{
+  dbus_free (identity->name);
+  dbus_free (identity);
+}
+
+static void
+source_stat (BusConfigSource *source)
+{
+  DBusString path;
+  DBusStat sb;
+  long now;
+
+  _dbus_string_init_const (&path, source->path);
+  _dbus_get_real_time (&now, NULL);
+
+  source->checked = now;
+  source->exists = _dbus_stat (&path, &sb, NULL);
+
+  if (source->exists)
+    {
+      source->mtime = sb.mtime;
+      source->ctime = sb.ctime;
+      source->size = sb.size;
+    }
+}
+
+/**
+ * Records that the configuration was read from the given file or
+ * directory, so bus_config_parser_sources_changed() can tell whether
+ * it needs to be read again. This must be called before the file is
+ * read. If the source can't be recorded for lack of memory, the
+ * parser is marked as always needing to be reloaded.
+ *
+ * @param parser the parser
+ * @param path the file or directory about to be read
+ */
+void
+bus_config_parser_add_source (BusConfigParser  *parser,
+                              const DBusString *path)
+{
+  BusConfigSource *source;
+
+  source = dbus_new0 (BusConfigSource, 1);
+  if (source == NULL)
+    goto oom;
+
+  if (!_dbus_string_copy_data (path, &source->path))
+    {
+      dbus_free (source);
+      goto oom;
+    }
+
+  source_stat (source);
+
+  if (!_dbus_list_append (&parser->sources, source))
+    {
+      source_free (source);
+      goto oom;
+    }
+
+  return;
+
+ oom:
+  parser->sources_incomplete = TRUE;
+}
+
+static void
+add_identity (BusConfigParser *parser,
+              const char      *name,
+              dbus_bool_t      is_group,
+              dbus_bool_t      known,
+              unsigned long    id)
+{
+  BusConfigIdentity *identity;
+
+  identity = dbus_new0 (BusConfigIdentity, 1);
+  if (identity == NULL)
+    goto oom;
+
+  identity->name = _dbus_strdup (name);
+  if (identity->name == NULL)
+    {
+      dbus_free (identity);
+      goto oom;
+    }
+
+  identity->is_group = is_group;
+  identity->known = known;
+  identity->id = id;
+
+  if (!_dbus_list_append (&parser->identities, identity))
+    {
+      identity_free (identity);
+      goto oom;
+    }
+
+  return;
+
+ oom:
+  parser->sources_incomplete = TRUE;
+}
+
+static dbus_bool_t
+parse_user (BusConfigParser *parser,
+            const char      *user,
+            dbus_uid_t      *uid)
+{
+  DBusString username;
+  dbus_bool_t known;
+
+  _dbus_string_init_const (&username, user);
+  known = _dbus_parse_unix_user_from_config (&username, uid);
+  add_identity (parser, user, FALSE, known, known ? *uid : 0);
+
+  return known;
+}
+
+static dbus_bool_t
+parse_group (BusConfigParser *parser,
+             const char      *group,
+             dbus_gid_t      *gid)
+{
+  DBusString groupname;
+  dbus_bool_t known;
+
+  _dbus_string_init_const (&groupname, group);
+  known = _dbus_parse_unix_group_from_config (&groupname, gid);
+  add_identity (parser, group, TRUE, known, known ? *gid : 0);
+
+  return known;
+}
+
 BusConfigParser*
 bus_config_parser_new (const DBusString      *basedir,
                        dbus_bool_t            is_toplevel,
@@ -428,6 +639,30 @@ bus_config_parser_new (const DBusString      *basedir,
       parser->limits.max_incoming_unix_fds = DBUS_DEFAULT_MESSAGE_UNIX_FDS*4;
       parser->limits.max_outgoing_unix_fds = DBUS_DEFAULT_MESSAGE_UNIX_FDS*4;
       parser->limits.max_message_unix_fds = DBUS_DEFAULT_MESSAGE_UNIX_FDS;
+
+      /* Write each message as soon as it is sent unless told otherwise */
+      parser->limits.max_unflushed_bytes = 0;
+
+      /* Validate every message body on arrival unless told otherwise */
+      parser->limits.deferred_validation_bytes = 0;
+
+      /* Send everything in order unless told otherwise */
+      parser->limits.max_overtaken_broadcasts = 0;
+
+      /* Write every broadcast, however long it has been queued */
+      parser->limits.broadcast_signal_ttl = 0;
+
+      /* Leave socket buffers as the kernel sized them */
+      parser->limits.max_socket_buffer_bytes = 0;
+
+      /* Deliver every PropertiesChanged signal unless told otherwise */
+      parser->limits.coalesce_properties_changed_bytes = 0;
+
+      /* No rate limits unless told otherwise */
+      parser->limits.max_messages_per_second = 0;
+      parser->limits.max_bytes_per_second = 0;
+      parser->limits.max_messages_per_second_per_user = 0;
+      parser->limits.max_bytes_per_second_per_user = 0;
       
       /* Making this long means the user has to wait longer for an error
        * message if something screws up, but making it too short means
@@ -445,6 +680,10 @@ bus_config_parser_new (const DBusString      *basedir,
        * https://bugs.freedesktop.org/show_bug.cgi?id=80559
        */
       parser->limits.pending_fd_timeout = 150000; /* 2.5 minutes */
+
+      /* Long enough for a package manager to put down several
+       * packages' files before we look at them */
+      parser->limits.reload_delay = 250;
       
       parser->limits.max_incomplete_connections = 64;
       parser->limits.max_connections_per_user = 256;
@@ -507,6 +746,9 @@ bus_config_parser_unref (BusConfigParser *parser)
       dbus_free (parser->servicehelper);
       dbus_free (parser->bus_type);
       dbus_free (parser->pidfile);
+      dbus_free (parser->stats_listen);
+      dbus_free (parser->stats_page);
+      dbus_free (parser->cpu_affinity);
       
       _dbus_list_foreach (&parser->listen_on,
                           (DBusForeachFunction) dbus_free,
@@ -531,6 +773,18 @@ bus_config_parser_unref (BusConfigParser *parser)
                           NULL);
 
       _dbus_list_clear (&parser->mechanisms);
+
+      _dbus_list_foreach (&parser->sources,
+                          (DBusForeachFunction) source_free,
+                          NULL);
+
+      _dbus_list_clear (&parser->sources);
+
+      _dbus_list_foreach (&parser->identities,
+                          (DBusForeachFunction) identity_free,
+                          NULL);
+
+      _dbus_list_clear (&parser->identities);
       
       _dbus_string_free (&parser->basedir);
 
@@ -789,6 +1043,45 @@ start_busconfig_child (BusConfigParser   *parser,
           return FALSE;
         }
 
+      return TRUE;
+    }
+  else if (element_type == ELEMENT_STATS_LISTEN)
+    {
+      if (!check_no_attributes (parser, "stats_listen", attribute_names, attribute_values, error))
+        return FALSE;
+
+      if (push_element (parser, ELEMENT_STATS_LISTEN) == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      return TRUE;
+    }
+  else if (element_type == ELEMENT_STATS_PAGE)
+    {
+      if (!check_no_attributes (parser, "stats_page", attribute_names, attribute_values, error))
+        return FALSE;
+
+      if (push_element (parser, ELEMENT_STATS_PAGE) == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      return TRUE;
+    }
+  else if (element_type == ELEMENT_CPU_AFFINITY)
+    {
+      if (!check_no_attributes (parser, "cpu_affinity", attribute_names, attribute_values, error))
+        return FALSE;
+
+      if (push_element (parser, ELEMENT_CPU_AFFINITY) == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
       return TRUE;
     }
   else if (element_type == ELEMENT_AUTH)
@@ -1042,11 +1335,7 @@ start_busconfig_child (BusConfigParser   *parser,
         }
       else if (user != NULL)
         {
-          DBusString username;
-          _dbus_string_init_const (&username, user);
-
-          if (_dbus_parse_unix_user_from_config (&username,
-                                                 &e->d.policy.gid_uid_or_at_console))
+          if (parse_user (parser, user, &e->d.policy.gid_uid_or_at_console))
             e->d.policy.type = POLICY_USER;
           else
             _dbus_warn ("Unknown username \"%s\" in message bus configuration file\n",
@@ -1054,11 +1343,7 @@ start_busconfig_child (BusConfigParser   *parser,
         }
       else if (group != NULL)
         {
-          DBusString group_name;
-          _dbus_string_init_const (&group_name, group);
-
-          if (_dbus_parse_unix_group_from_config (&group_name,
-                                                  &e->d.policy.gid_uid_or_at_console))
+          if (parse_group (parser, group, &e->d.policy.gid_uid_or_at_console))
             e->d.policy.type = POLICY_GROUP;
           else
             _dbus_warn ("Unknown group \"%s\" in message bus configuration file\n",
@@ -1566,12 +1851,9 @@ append_rule_from_element (BusConfigParser   *parser,
         }
       else
         {
-          DBusString username;
           dbus_uid_t uid;
-          
-          _dbus_string_init_const (&username, user);
       
-          if (_dbus_parse_unix_user_from_config (&username, &uid))
+          if (parse_user (parser, user, &uid))
             {
               rule = bus_policy_rule_new (BUS_POLICY_RULE_USER, allow); 
               if (rule == NULL)
@@ -1598,12 +1880,9 @@ append_rule_from_element (BusConfigParser   *parser,
         }
       else
         {
-          DBusString groupname;
           dbus_gid_t gid;
           
-          _dbus_string_init_const (&groupname, group);
-          
-          if (_dbus_parse_unix_group_from_config (&groupname, &gid))
+          if (parse_group (parser, group, &gid))
             {
               rule = bus_policy_rule_new (BUS_POLICY_RULE_GROUP, allow); 
               if (rule == NULL)
@@ -1907,6 +2186,59 @@ set_limit (BusConfigParser *parser,
       must_be_positive = TRUE;
       parser->limits.max_outgoing_unix_fds = value;
     }
+  else if (strcmp (name, "max_unflushed_bytes") == 0)
+    {
+      must_be_positive = TRUE;
+      parser->limits.max_unflushed_bytes = value;
+    }
+  else if (strcmp (name, "deferred_validation_bytes") == 0)
+    {
+      must_be_positive = TRUE;
+      parser->limits.deferred_validation_bytes = value;
+    }
+  else if (strcmp (name, "max_overtaken_broadcasts") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.max_overtaken_broadcasts = value;
+    }
+  else if (strcmp (name, "broadcast_signal_ttl") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.broadcast_signal_ttl = value;
+    }
+  else if (strcmp (name, "max_socket_buffer_bytes") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.max_socket_buffer_bytes = value;
+    }
+  else if (strcmp (name, "coalesce_properties_changed_bytes") == 0)
+    {
+      must_be_positive = TRUE;
+      parser->limits.coalesce_properties_changed_bytes = value;
+    }
+  else if (strcmp (name, "max_messages_per_second") == 0)
+    {
+      must_be_positive = TRUE;
+      parser->limits.max_messages_per_second = value;
+    }
+  else if (strcmp (name, "max_bytes_per_second") == 0)
+    {
+      must_be_positive = TRUE;
+      parser->limits.max_bytes_per_second = value;
+    }
+  else if (strcmp (name, "max_messages_per_second_per_user") == 0)
+    {
+      must_be_positive = TRUE;
+      parser->limits.max_messages_per_second_per_user = value;
+    }
+  else if (strcmp (name, "max_bytes_per_second_per_user") == 0)
+    {
+      must_be_positive = TRUE;
+      parser->limits.max_bytes_per_second_per_user = value;
+    }
   else if (strcmp (name, "max_message_size") == 0)
     {
       must_be_positive = TRUE;
@@ -1935,6 +2267,12 @@ set_limit (BusConfigParser *parser,
       must_be_int = TRUE;
       parser->limits.pending_fd_timeout = value;
     }
+  else if (strcmp (name, "reload_delay") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.reload_delay = value;
+    }
   else if (strcmp (name, "reply_timeout") == 0)
     {
       must_be_positive = TRUE;
@@ -2062,6 +2400,9 @@ bus_config_parser_end_element (BusConfigParser   *parser,
     case ELEMENT_USER:
     case ELEMENT_CONFIGTYPE:
     case ELEMENT_LISTEN:
+    case ELEMENT_STATS_LISTEN:
+    case ELEMENT_STATS_PAGE:
+    case ELEMENT_CPU_AFFINITY:
     case ELEMENT_PIDFILE:
     case ELEMENT_AUTH:
     case ELEMENT_SERVICEDIR:
@@ -2169,6 +2510,10 @@ include_file (BusConfigParser   *parser,
       return FALSE;
     }
 
+  /* Recorded here rather than by the included parser, so that a
+   * missing or broken file is noticed once it is fixed */
+  bus_config_parser_add_source (parser, filename);
+
   /* Since parser is passed in as the parent, included
      inherits parser's limits. */
   included = bus_config_load (filename, FALSE, parser, &tmp_error);
@@ -2261,6 +2606,9 @@ include_dir (BusConfigParser   *parser,
     }
 
   retval = FALSE;
+
+  /* the directory's mtime changes when files are added or removed */
+  bus_config_parser_add_source (parser, dirname);
   
   dir = _dbus_directory_open (dirname, error);
 
@@ -2279,12 +2627,10 @@ include_dir (BusConfigParser   *parser,
   while (_dbus_directory_get_next_file (dir, &filename, &tmp_error))
     {
       DBusString full_path;
+      unsigned char full_path_storage[256];
 
-      if (!_dbus_string_init (&full_path))
-        {
-          BUS_SET_OOM (error);
-          goto failed;
-        }
+      _dbus_string_init_borrowed (&full_path, full_path_storage,
+                                  sizeof (full_path_storage));
 
       if (!_dbus_string_copy (dirname, 0, &full_path, 0))
         {
@@ -2430,6 +2776,48 @@ bus_config_parser_content (BusConfigParser   *parser,
       }
       break;
 
+    case ELEMENT_STATS_LISTEN:
+      {
+        char *s;
+
+        e->had_content = TRUE;
+
+        if (!_dbus_string_copy_data (content, &s))
+          goto nomem;
+
+        dbus_free (parser->stats_listen);
+        parser->stats_listen = s;
+      }
+      break;
+
+    case ELEMENT_STATS_PAGE:
+      {
+        char *s;
+
+        e->had_content = TRUE;
+
+        if (!_dbus_string_copy_data (content, &s))
+          goto nomem;
+
+        dbus_free (parser->stats_page);
+        parser->stats_page = s;
+      }
+      break;
+
+    case ELEMENT_CPU_AFFINITY:
+      {
+        char *s;
+
+        e->had_content = TRUE;
+
+        if (!_dbus_string_copy_data (content, &s))
+          goto nomem;
+
+        dbus_free (parser->cpu_affinity);
+        parser->cpu_affinity = s;
+      }
+      break;
+
     case ELEMENT_INCLUDE:
       {
         DBusString full_path, selinux_policy_root;
@@ -2505,6 +2893,7 @@ bus_config_parser_content (BusConfigParser   *parser,
     case ELEMENT_INCLUDEDIR:
       {
         DBusString full_path;
+        dbus_uint64_t start;
         
         e->had_content = TRUE;
 
@@ -2516,6 +2905,8 @@ bus_config_parser_content (BusConfigParser   *parser,
             _dbus_string_free (&full_path);
             goto nomem;
           }
+
+        start = _dbus_get_monotonic_time_nsec ();
         
         if (!include_dir (parser, &full_path, error))
           {
@@ -2523,6 +2914,7 @@ bus_config_parser_content (BusConfigParser   *parser,
             return FALSE;
           }
 
+        parser->includedir_nsec += _dbus_get_monotonic_time_nsec () - start;
         _dbus_string_free (&full_path);
       }
       break;
@@ -2748,6 +3140,36 @@ bus_config_parser_get_pidfile (BusConfigParser   *parser)
   return parser->pidfile;
 }
 
+const char *
+bus_config_parser_get_stats_listen (BusConfigParser   *parser)
+{
+  return parser->stats_listen;
+}
+
+const char *
+bus_config_parser_get_stats_page (BusConfigParser   *parser)
+{
+  return parser->stats_page;
+}
+
+const char *
+bus_config_parser_get_cpu_affinity (BusConfigParser   *parser)
+{
+  return parser->cpu_affinity;
+}
+
+/**
+ * Gets how long reading the directories named by <includedir> took,
+ * in nanoseconds. For the top-level file that is the time spent in
+ * system.d or session.d; time spent on an <includedir> in an
+ * included file is not counted.
+ */
+dbus_uint64_t
+bus_config_parser_get_includedir_time (BusConfigParser *parser)
+{
+  return parser->includedir_nsec;
+}
+
 const char *
 bus_config_parser_get_servicehelper (BusConfigParser   *parser)
 {
@@ -2790,6 +3212,95 @@ bus_config_parser_steal_service_context_table (BusConfigParser *parser)
   return table;
 }
 
+static dbus_bool_t
+source_changed (BusConfigSource *source)
+{
+  BusConfigSource current;
+
+  current = *source;
+  source_stat (&current);
+
+  if (current.exists != source->exists)
+    return TRUE;
+
+  if (!current.exists)
+    return FALSE;
+
+  /* A file modified in the second it was read might have been read
+   * before the modification, so we can't trust its mtime */
+  return current.mtime != source->mtime ||
+    current.ctime != source->ctime ||
+    current.size != source->size ||
+    (long) source->mtime >= source->checked;
+}
+
+static dbus_bool_t
+identity_changed (BusConfigIdentity *identity)
+{
+  DBusString name;
+  dbus_bool_t known;
+  unsigned long id;
+
+  _dbus_string_init_const (&name, identity->name);
+
+  if (identity->is_group)
+    {
+      dbus_gid_t gid;
+
+      known = _dbus_parse_unix_group_from_config (&name, &gid);
+      id = gid;
+    }
+  else
+    {
+      dbus_uid_t uid;
+
+      known = _dbus_parse_unix_user_from_config (&name, &uid);
+      id = uid;
+    }
+
+  if (known != identity->known)
+    return TRUE;
+
+  return known && id != identity->id;
+}
+
+/**
+ * Checks whether reading the configuration again could give a
+ * different result: whether any file or directory it was read from has
+ * changed, appeared or disappeared, or any user or group name in it
+ * now resolves differently. Callers should flush the user database
+ * cache first.
+ *
+ * @param parser a parser that has finished loading a configuration
+ * @returns #TRUE if the configuration needs to be read again
+ */
+dbus_bool_t
+bus_config_parser_sources_changed (BusConfigParser *parser)
+{
+  DBusList *link;
+
+  if (parser->sources_incomplete)
+    return TRUE;
+
+  for (link = _dbus_list_get_first_link (&parser->sources);
+       link != NULL;
+       link = _dbus_list_get_next_link (&parser->sources, link))
+    {
+      if (source_changed (link->data))
+        return TRUE;
+    }
+
+  for (link = _dbus_list_get_first_link (&parser->identities);
+       link != NULL;
+       link = _dbus_list_get_next_link (&parser->identities, link))
+    {
+      if (identity_changed (link->data))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
 #include <stdio.h>
 
@@ -3148,11 +3659,22 @@ limits_equal (const BusLimits *a,
      || a->max_incoming_unix_fds == b->max_incoming_unix_fds
      || a->max_outgoing_bytes == b->max_outgoing_bytes
      || a->max_outgoing_unix_fds == b->max_outgoing_unix_fds
+     || a->max_unflushed_bytes == b->max_unflushed_bytes
+     || a->deferred_validation_bytes == b->deferred_validation_bytes
+     || a->max_overtaken_broadcasts == b->max_overtaken_broadcasts
+     || a->broadcast_signal_ttl == b->broadcast_signal_ttl
+     || a->max_socket_buffer_bytes == b->max_socket_buffer_bytes
+     || a->coalesce_properties_changed_bytes == b->coalesce_properties_changed_bytes
+     || a->max_messages_per_second == b->max_messages_per_second
+     || a->max_bytes_per_second == b->max_bytes_per_second
+     || a->max_messages_per_second_per_user == b->max_messages_per_second_per_user
+     || a->max_bytes_per_second_per_user == b->max_bytes_per_second_per_user
      || a->max_message_size == b->max_message_size
      || a->max_message_unix_fds == b->max_message_unix_fds
      || a->activation_timeout == b->activation_timeout
      || a->auth_timeout == b->auth_timeout
      || a->pending_fd_timeout == b->pending_fd_timeout
+     || a->reload_delay == b->reload_delay
      || a->max_completed_connections == b->max_completed_connections
      || a->max_incomplete_connections == b->max_incomplete_connections
      || a->max_connections_per_user == b->max_connections_per_user
@@ -3195,6 +3717,15 @@ config_parsers_equal (const BusConfigParser *a,
   if (!strings_equal_or_both_null (a->pidfile, b->pidfile))
     return FALSE;
 
+  if (!strings_equal_or_both_null (a->stats_listen, b->stats_listen))
+    return FALSE;
+
+  if (!strings_equal_or_both_null (a->stats_page, b->stats_page))
+    return FALSE;
+
+  if (!strings_equal_or_both_null (a->cpu_affinity, b->cpu_affinity))
+    return FALSE;
+
   if (! bools_equal (a->fork, b->fork))
     return FALSE;
 
@@ -31,18 +31,28 @@
 #include "expirelist.h"
 #include "selinux.h"
 #include "apparmor.h"
+#include "ratelimit.h"
+#include "coalesce.h"
+#include <dbus/dbus-asv-util.h>
 #include <dbus/dbus-list.h>
+#include <dbus/dbus-marshal-validate.h>
 #include <dbus/dbus-hash.h>
+#include <dbus/dbus-mempool.h>
 #include <dbus/dbus-timeout.h>
 #include <dbus/dbus-connection-internal.h>
 #include <dbus/dbus-internals.h>
+#include <dbus/dbus-message-internal.h>
+#include <dbus/dbus-trace.h>
+#include <string.h>
 
 /* Trim executed commands to this length; we want to keep logs readable */
 #define MAX_LOG_COMMAND_LEN 50
 
 static void bus_connection_remove_transactions (DBusConnection *connection);
 
-typedef struct
+typedef struct BusPendingReply BusPendingReply;
+
+struct BusPendingReply
 {
   BusExpireItem expire_item;
 
@@ -50,8 +60,79 @@ typedef struct
   DBusConnection *will_send_reply;
 
   dbus_uint32_t reply_serial;
-  
-} BusPendingReply;
+
+  DBusList *link; /**< Our link in BusConnections::pending_replies */
+  BusPendingReply *next_with_key; /**< Next in our pending_reply_index chain */
+
+  /* While in the expire list, we are also in the chains of the two
+   * connections, so that one can drop its replies without a walk
+   * over everyone's */
+  BusPendingReply *prev_to_get; /**< Previous in will_get_reply's chain */
+  BusPendingReply *next_to_get; /**< Next in will_get_reply's chain */
+  BusPendingReply *prev_to_send; /**< Previous in will_send_reply's chain */
+  BusPendingReply *next_to_send; /**< Next in will_send_reply's chain */
+  unsigned int replied : 1; /**< A transaction sending the reply is in progress */
+};
+
+typedef struct
+{
+  BusTransaction *transaction;
+  DBusMessage    *message;
+  DBusPreallocatedSend *preallocated;
+  DBusMessage    *merged;     /**< Sent instead of message if superseded can be taken back, or NULL */
+  DBusMessage    *superseded; /**< Queued message that merged also stands for */
+} MessageToSend;
+
+/** Bytes of bookkeeping storage inside each BusTransaction */
+#define TRANSACTION_ARENA_SIZE 2048
+/** Usual size of the extra chunks a big transaction allocates */
+#define TRANSACTION_CHUNK_SIZE (4 * TRANSACTION_ARENA_SIZE)
+/** How many finished transactions BusConnections keeps for reuse */
+#define MAX_SPARE_TRANSACTIONS 4
+
+typedef struct TransactionChunk TransactionChunk;
+
+/** Heap chunk for a transaction that outgrew its inline arena */
+struct TransactionChunk
+{
+  TransactionChunk *next;
+};
+
+/** Offset of the usable space in a TransactionChunk */
+#define TRANSACTION_CHUNK_HEADER _DBUS_ALIGN_VALUE (sizeof (TransactionChunk), 8)
+
+/*
+ * Everything a transaction allocates for its own bookkeeping - the
+ * MessageToSend for each recipient, the list links queueing them and
+ * listing the connections involved, and the cancel hooks - comes from
+ * a bump arena that is thrown away in one go when the transaction is
+ * executed or cancelled. Those objects may be unlinked earlier, but
+ * are never freed individually.
+ */
+struct BusTransaction
+{
+  DBusList *connections;
+  BusContext *context;
+  DBusList *cancel_hooks;
+  BusTransaction *next_spare;  /**< Next in BusConnections::spare_transactions */
+  TransactionChunk *chunks;    /**< Heap chunks, once the inline arena is full */
+  unsigned char *arena_pos;    /**< Next free byte */
+  unsigned char *arena_end;    /**< End of the current chunk */
+  union
+  {
+    void *align_pointer;
+    double align_double;
+    unsigned char bytes[TRANSACTION_ARENA_SIZE];
+  } arena;
+};
+
+/* The rate limits shared by all of one user's connections */
+typedef struct
+{
+  int refcount;
+  dbus_uid_t uid;
+  BusRateBucket bucket;
+} BusUserRate;
 
 struct BusConnections
 {
@@ -62,23 +143,41 @@ struct BusConnections
   int n_incomplete;     /**< Length of incomplete list */
   BusContext *context;
   DBusHashTable *completed_by_user; /**< Number of completed connections for each UID */
+  DBusHashTable *rate_by_user; /**< UID => BusUserRate, or NULL until per-user rate limits are needed */
   DBusTimeout *expire_timeout; /**< Timeout for expiring incomplete connections. */
   int stamp;                   /**< Incrementing number */
+  DBusConnection **recipients; /**< Stack of matchmaker results, see bus_connections_push_recipient() */
+  int n_recipients;            /**< Used length of recipients */
+  int n_recipients_allocated;  /**< Allocated length of recipients */
   BusExpireList *pending_replies; /**< List of pending replies */
+  DBusHashTable *pending_reply_index; /**< pending_reply_key() => chain of BusPendingReply */
+  BusTransaction *spare_transactions; /**< Finished transactions kept for reuse, see transaction_free() */
+  int n_spare_transactions;            /**< Length of spare_transactions */
+  DBusMessage *spare_oom_message;      /**< OOM error no connection is holding, see bus_connection_preallocate_oom_error() */
+  DBusTimeout *trim_timeout;           /**< Timeout for trimming connections' buffers */
 
   /** List of all monitoring connections, a subset of completed.
    * Each member is a #DBusConnection. */
   DBusList *monitors;
   BusMatchmaker *monitor_matchmaker;
 
+  /** Connections that called WatchSignalInterest, a subset of completed.
+   * Each member is a #DBusConnection. */
+  DBusList *signal_interest_watchers;
+  dbus_uint32_t signal_interest_sent_version; /**< Matchmaker's interest version in the last SignalInterest to all of them */
+  dbus_bool_t signal_interest_sent_everything; /**< Whether that SignalInterest said everything */
+
 #ifdef DBUS_ENABLE_STATS
   int total_match_rules;
   int peak_match_rules;
+  int total_match_rule_bytes; /**< bus_match_rule_get_n_bytes() of all rules */
   int peak_match_rules_per_conn;
 
   int total_bus_names;
   int peak_bus_names;
   int peak_bus_names_per_conn;
+
+  dbus_uint32_t n_monitor_dropped; /**< Captured messages dropped, all monitors */
 #endif
 };
 
@@ -97,15 +196,24 @@ typedef struct
   DBusList *transaction_messages; /**< Stuff we need to send as part of a transaction */
   DBusMessage *oom_message;
   DBusPreallocatedSend *oom_preallocated;
+  int n_oom_error_holds; /**< Pending activations that may have to send oom_message */
   BusClientPolicy *policy;
 
+  char *last_destination;               /**< Well-known name we last sent to, or NULL */
+  int last_destination_allocated;       /**< Bytes allocated for last_destination */
+  DBusConnection *last_recipient;       /**< Its primary owner then */
+  dbus_uint32_t last_destination_serial; /**< bus_registry_get_owners_serial() then */
+
   char *cached_loginfo_string;
+  DBusMessage *credentials_snapshot; /**< GetConnectionCredentials reply template, or NULL */
   BusSELinuxID *selinux_id;
   BusAppArmorConfinement *apparmor_confinement;
 
   long connection_tv_sec;  /**< Time when we connected (seconds component) */
   long connection_tv_usec; /**< Time when we connected (microsec component) */
   int stamp;               /**< connections->stamp last time we were traversed */
+  dbus_bool_t busy;        /**< Sent or received a message since the last trim pass */
+  dbus_bool_t trimmed;     /**< Buffers given back, and quiet since */
 
 #ifdef DBUS_ENABLE_STATS
   int peak_match_rules;
@@ -113,9 +221,31 @@ typedef struct
 #endif
   int n_pending_unix_fds;
   DBusTimeout *pending_unix_fds_timeout;
+  int n_pending_replies; /**< Number of replies we are waiting for */
+  BusPendingReply *replies_to_get;  /**< Chain of the replies we are waiting for */
+  BusPendingReply *replies_to_send; /**< Chain of the replies others wait for from us */
+
+  BusRateBucket rate;         /**< This connection's own rate limits */
+  BusRateBucket log_rate;     /**< How often complaints about its messages are logged */
+  unsigned long n_log_suppressed; /**< Complaints not logged since the last one that was */
+  BusUserRate *user_rate;     /**< Its user's rate limits, or NULL */
+  DBusTimeout *rate_timeout;  /**< Resumes reading; NULL if no rate limits apply */
+  dbus_bool_t rate_paused;    /**< Reading is paused until the rate limits allow more */
+
+  /** sender => the last message it queued for us while we were
+   * behind, if that was a mergeable PropertiesChanged; NULL if not
+   * behind yet */
+  DBusHashTable *coalesce_index;
 
   /** non-NULL if and only if this is a monitor */
   DBusList *link_in_monitors;
+  /** non-NULL if and only if this called WatchSignalInterest */
+  DBusList *link_in_signal_interest_watchers;
+  dbus_uint32_t n_monitor_dropping;  /**< Captured messages dropped since it last kept up */
+  BusMonitorOptions monitor_options;
+  dbus_uint32_t monitor_n_matched;   /**< Matches since the last sampled one */
+  long monitor_second;               /**< Monotonic second monitor_n_this_second counts */
+  dbus_uint32_t monitor_n_this_second; /**< Captured during monitor_second */
 } BusConnectionData;
 
 static dbus_bool_t bus_pending_reply_expired (BusExpireList *list,
@@ -126,6 +256,16 @@ static void bus_connection_drop_pending_replies (BusConnections  *connections,
                                                  DBusConnection  *connection);
 
 static dbus_bool_t expire_incomplete_timeout (void *data);
+static dbus_bool_t trim_timeout (void *data);
+
+/* Connections quiet for this long give back the buffer space they
+ * are not using */
+#define TRIM_INTERVAL_MILLISECONDS (30 * 1000)
+
+/* How many complaints about one connection's messages are logged per
+ * second, once a second's worth has been used up; see
+ * bus_connection_charge_log() */
+#define LOG_MESSAGES_PER_SECOND 10
 
 #define BUS_CONNECTION_DATA(connection) (dbus_connection_get_data ((connection), connection_data_slot))
 
@@ -199,12 +339,72 @@ adjust_connections_for_uid (BusConnections *connections,
     }
 }
 
+static BusUserRate *
+user_rate_ref_for_uid (BusConnections *connections,
+                       dbus_uid_t      uid,
+                       long            messages_per_second,
+                       long            bytes_per_second)
+{
+  BusUserRate *user_rate;
+
+  if (connections->rate_by_user == NULL)
+    {
+      connections->rate_by_user = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+                                                        NULL, NULL);
+      if (connections->rate_by_user == NULL)
+        return NULL;
+    }
+
+  user_rate = _dbus_hash_table_lookup_uintptr (connections->rate_by_user, uid);
+
+  if (user_rate == NULL)
+    {
+      long tv_sec, tv_usec;
+
+      user_rate = dbus_new0 (BusUserRate, 1);
+      if (user_rate == NULL)
+        return NULL;
+
+      user_rate->uid = uid;
+      _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+      bus_rate_bucket_init (&user_rate->bucket, messages_per_second,
+                            bytes_per_second, tv_sec, tv_usec);
+
+      if (!_dbus_hash_table_insert_uintptr (connections->rate_by_user,
+                                            uid, user_rate))
+        {
+          dbus_free (user_rate);
+          return NULL;
+        }
+    }
+
+  user_rate->refcount += 1;
+  return user_rate;
+}
+
+static void
+user_rate_unref (BusConnections *connections,
+                 BusUserRate    *user_rate)
+{
+  _dbus_assert (user_rate->refcount > 0);
+
+  user_rate->refcount -= 1;
+
+  if (user_rate->refcount == 0)
+    {
+      _dbus_hash_table_remove_uintptr (connections->rate_by_user,
+                                       user_rate->uid);
+      dbus_free (user_rate);
+    }
+}
+
 void
 bus_connection_disconnected (DBusConnection *connection)
 {
   BusConnectionData *d;
   BusService *service;
   BusMatchmaker *matchmaker;
+  DBusList *link;
   
   d = BUS_CONNECTION_DATA (connection);
   _dbus_assert (d != NULL);
@@ -212,8 +412,18 @@ bus_connection_disconnected (DBusConnection *connection)
   _dbus_verbose ("%s disconnected, dropping all service ownership and releasing\n",
                  d->name ? d->name : "(inactive)");
 
-  /* Delete our match rules */
-  if (d->n_match_rules > 0)
+  if (d->n_log_suppressed > 0)
+    bus_context_log (d->connections->context, DBUS_SYSTEM_LOG_SECURITY,
+                     "%lu messages about connection %s (%s) were not logged",
+                     d->n_log_suppressed, d->name ? d->name : "(inactive)",
+                     d->cached_loginfo_string ? d->cached_loginfo_string : "(unknown)");
+
+  /* the DBusConnection address may be reused by a later connection */
+  bus_context_invalidate_policy_cache (d->connections->context);
+
+  /* Delete our match rules, and other connections' rules that refer
+   * to our unique name. Both are cheap to find. */
+  if (bus_connection_is_active (connection))
     {
       matchmaker = bus_context_get_matchmaker (d->connections->context);
       bus_matchmaker_disconnected (matchmaker, connection);
@@ -225,40 +435,61 @@ bus_connection_disconnected (DBusConnection *connection)
    * disconnecting a client, and preallocating a broadcast "service is
    * now gone" message for every client-service pair seems kind of
    * involved.
+   *
+   * All the names go in one transaction, so that a connection owning
+   * hundreds of names queues all of its NameOwnerChanged signals and
+   * sends them in a single pass. If we run out of memory part way
+   * through, cancelling restores every name released so far and we
+   * start over.
    */
-  while ((service = _dbus_list_get_last (&d->services_owned)))
+  if (d->services_owned != NULL)
     {
       BusTransaction *transaction;
       DBusError error;
 
     retry:
-      
+
       dbus_error_init (&error);
-        
+
       while ((transaction = bus_transaction_new (d->connections->context)) == NULL)
         _dbus_wait_for_memory ();
-        
-      if (!bus_service_remove_owner (service, connection,
-                                     transaction, &error))
+
+      /* A released name only leaves services_owned when the
+       * transaction lets go of its restore data, so walk the list
+       * rather than popping from it.
+       */
+      link = _dbus_list_get_last_link (&d->services_owned);
+      while (link != NULL)
         {
-          _DBUS_ASSERT_ERROR_IS_SET (&error);
-          
-          if (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
-            {
-              dbus_error_free (&error);
-              bus_transaction_cancel_and_free (transaction);
-              _dbus_wait_for_memory ();
-              goto retry;
-            }
-          else
+          DBusList *prev = _dbus_list_get_prev_link (&d->services_owned, link);
+
+          service = link->data;
+
+          if (!bus_service_remove_owner (service, connection,
+                                         transaction, &error))
             {
-              _dbus_verbose ("Failed to remove service owner: %s %s\n",
-                             error.name, error.message);
-              _dbus_assert_not_reached ("Removing service owner failed for non-memory-related reason");
+              _DBUS_ASSERT_ERROR_IS_SET (&error);
+
+              if (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
+                {
+                  dbus_error_free (&error);
+                  bus_transaction_cancel_and_free (transaction);
+                  _dbus_wait_for_memory ();
+                  goto retry;
+                }
+              else
+                {
+                  _dbus_verbose ("Failed to remove service owner: %s %s\n",
+                                 error.name, error.message);
+                  _dbus_assert_not_reached ("Removing service owner failed for non-memory-related reason");
+                }
             }
+
+          link = prev;
         }
-        
+
       bus_transaction_execute_and_free (transaction);
+      _dbus_assert (d->services_owned == NULL);
     }
 
   bus_dispatch_remove_connection (connection);
@@ -292,9 +523,25 @@ bus_connection_disconnected (DBusConnection *connection)
     }
   d->pending_unix_fds_timeout = NULL;
   _dbus_connection_set_pending_fds_function (connection, NULL, NULL);
+
+  if (d->rate_timeout)
+    {
+      _dbus_loop_remove_timeout (bus_context_get_loop (d->connections->context),
+                                 d->rate_timeout);
+      _dbus_timeout_unref (d->rate_timeout);
+    }
+  d->rate_timeout = NULL;
+
+  if (d->user_rate)
+    user_rate_unref (d->connections, d->user_rate);
+  d->user_rate = NULL;
   
   bus_connection_remove_transactions (connection);
 
+  if (d->coalesce_index != NULL)
+    _dbus_hash_table_unref (d->coalesce_index);
+  d->coalesce_index = NULL;
+
   if (d->link_in_monitors != NULL)
     {
       BusMatchmaker *mm = d->connections->monitor_matchmaker;
@@ -306,6 +553,13 @@ bus_connection_disconnected (DBusConnection *connection)
       d->link_in_monitors = NULL;
     }
 
+  if (d->link_in_signal_interest_watchers != NULL)
+    {
+      _dbus_list_remove_link (&d->connections->signal_interest_watchers,
+                              d->link_in_signal_interest_watchers);
+      d->link_in_signal_interest_watchers = NULL;
+    }
+
   if (d->link_in_connection_list != NULL)
     {
       if (d->name != NULL)
@@ -393,6 +647,15 @@ remove_connection_timeout (DBusTimeout    *timeout,
   _dbus_loop_remove_timeout (connection_get_loop (connection), timeout);
 }
 
+static void
+toggle_connection_timeout (DBusTimeout    *timeout,
+                           void           *data)
+{
+  DBusConnection *connection = data;
+
+  _dbus_loop_toggle_timeout (connection_get_loop (connection), timeout);
+}
+
 static void
 dispatch_status_function (DBusConnection    *connection,
                           DBusDispatchStatus new_status,
@@ -448,6 +711,10 @@ free_connection_data (void *data)
     bus_apparmor_confinement_unref (d->apparmor_confinement);
   
   dbus_free (d->cached_loginfo_string);
+  dbus_free (d->last_destination);
+
+  if (d->credentials_snapshot)
+    dbus_message_unref (d->credentials_snapshot);
   
   dbus_free (d->name);
   
@@ -485,16 +752,38 @@ bus_connections_new (BusContext *context)
                                                       connections);
   if (connections->pending_replies == NULL)
     goto failed_4;
+
+  connections->pending_reply_index = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+                                                           NULL, NULL);
+  if (connections->pending_reply_index == NULL)
+    goto failed_5;
   
   if (!_dbus_loop_add_timeout (bus_context_get_loop (context),
                                connections->expire_timeout))
-    goto failed_5;
-  
+    goto failed_6;
+
+  connections->trim_timeout = _dbus_timeout_new (TRIM_INTERVAL_MILLISECONDS,
+                                                 trim_timeout,
+                                                 connections, NULL);
+  if (connections->trim_timeout == NULL)
+    goto failed_7;
+
+  if (!_dbus_loop_add_timeout (bus_context_get_loop (context),
+                               connections->trim_timeout))
+    goto failed_8;
+
   connections->refcount = 1;
   connections->context = context;
   
   return connections;
 
+ failed_8:
+  _dbus_timeout_unref (connections->trim_timeout);
+ failed_7:
+  _dbus_loop_remove_timeout (bus_context_get_loop (context),
+                             connections->expire_timeout);
+ failed_6:
+  _dbus_hash_table_unref (connections->pending_reply_index);
  failed_5:
   bus_expire_list_free (connections->pending_replies);
  failed_4:
@@ -542,6 +831,7 @@ bus_connections_unref (BusConnections *connections)
 
       /* drop all monitors */
       _dbus_list_clear (&connections->monitors);
+      _dbus_list_clear (&connections->signal_interest_watchers);
 
       /* drop all real connections */
       while (connections->completed != NULL)
@@ -559,14 +849,41 @@ bus_connections_unref (BusConnections *connections)
       _dbus_assert (connections->n_completed == 0);
 
       bus_expire_list_free (connections->pending_replies);
+      _dbus_hash_table_unref (connections->pending_reply_index);
       
       _dbus_loop_remove_timeout (bus_context_get_loop (connections->context),
                                  connections->expire_timeout);
       
       _dbus_timeout_unref (connections->expire_timeout);
+
+      _dbus_loop_remove_timeout (bus_context_get_loop (connections->context),
+                                 connections->trim_timeout);
+
+      _dbus_timeout_unref (connections->trim_timeout);
       
       _dbus_hash_table_unref (connections->completed_by_user);
 
+      if (connections->rate_by_user != NULL)
+        {
+          _dbus_assert (_dbus_hash_table_get_n_entries (connections->rate_by_user) == 0);
+          _dbus_hash_table_unref (connections->rate_by_user);
+        }
+
+      _dbus_assert (connections->n_recipients == 0);
+      dbus_free (connections->recipients);
+
+      /* after disconnecting everyone, which runs transactions */
+      while (connections->spare_transactions != NULL)
+        {
+          BusTransaction *spare = connections->spare_transactions;
+
+          connections->spare_transactions = spare->next_spare;
+          dbus_free (spare);
+        }
+
+      if (connections->spare_oom_message != NULL)
+        dbus_message_unref (connections->spare_oom_message);
+
       if (connections->monitor_matchmaker != NULL)
         bus_matchmaker_unref (connections->monitor_matchmaker);
 
@@ -656,11 +973,15 @@ check_pending_fds_cb (DBusConnection *connection)
       _dbus_timeout_set_interval (d->pending_unix_fds_timeout,
               bus_context_get_pending_fd_timeout (d->connections->context));
       _dbus_timeout_set_enabled (d->pending_unix_fds_timeout, TRUE);
+      _dbus_loop_toggle_timeout (bus_context_get_loop (d->connections->context),
+                                 d->pending_unix_fds_timeout);
     }
 
   if (n_pending_unix_fds_old > 0 && n_pending_unix_fds_new == 0)
     {
       _dbus_timeout_set_enabled (d->pending_unix_fds_timeout, FALSE);
+      _dbus_loop_toggle_timeout (bus_context_get_loop (d->connections->context),
+                                 d->pending_unix_fds_timeout);
     }
 
 
@@ -675,6 +996,97 @@ pending_unix_fds_timeout_cb (void *data)
   return TRUE;
 }
 
+/* Stops reading from the connection while either of its buckets is in
+ * debt, and starts again once both have been paid off */
+static void
+update_rate_limit_pause (DBusConnection    *connection,
+                         BusConnectionData *d,
+                         long               tv_sec,
+                         long               tv_usec)
+{
+  DBusLoop *loop;
+  int delay;
+
+  loop = bus_context_get_loop (d->connections->context);
+  delay = bus_rate_bucket_get_delay (&d->rate, tv_sec, tv_usec);
+
+  if (d->user_rate != NULL)
+    delay = MAX (delay, bus_rate_bucket_get_delay (&d->user_rate->bucket,
+                                                   tv_sec, tv_usec));
+
+  if (delay > 0)
+    {
+      _dbus_timeout_set_interval (d->rate_timeout, delay);
+      _dbus_timeout_set_enabled (d->rate_timeout, TRUE);
+      _dbus_loop_toggle_timeout (loop, d->rate_timeout);
+
+      if (!d->rate_paused)
+        {
+          _dbus_verbose ("Rate limits pause reading from %s for %d ms\n",
+                         d->name ? d->name : "(inactive)", delay);
+          d->rate_paused = TRUE;
+          _dbus_connection_set_reads_paused (connection, TRUE);
+        }
+    }
+  else if (d->rate_paused)
+    {
+      _dbus_timeout_set_enabled (d->rate_timeout, FALSE);
+      _dbus_loop_toggle_timeout (loop, d->rate_timeout);
+
+      _dbus_verbose ("Rate limits resume reading from %s\n",
+                     d->name ? d->name : "(inactive)");
+      d->rate_paused = FALSE;
+      _dbus_connection_set_reads_paused (connection, FALSE);
+    }
+}
+
+static dbus_bool_t
+rate_limit_timeout_cb (void *data)
+{
+  DBusConnection *connection = data;
+  BusConnectionData *d = BUS_CONNECTION_DATA (connection);
+  long tv_sec, tv_usec;
+
+  _dbus_assert (d != NULL);
+
+  _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+  update_rate_limit_pause (connection, d, tv_sec, tv_usec);
+  return TRUE;
+}
+
+/**
+ * Charges a message received from the connection to its rate limits,
+ * and those of its user, and stops reading from it until they allow
+ * more messages. See the max_messages_per_second limit and friends.
+ *
+ * @param connection the sender
+ * @param message the message it sent
+ */
+void
+bus_connection_charge_rate_limits (DBusConnection *connection,
+                                   DBusMessage    *message)
+{
+  BusConnectionData *d;
+  long tv_sec, tv_usec;
+  int size;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  if (d->rate_timeout == NULL)
+    return;
+
+  _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+  size = _dbus_message_get_size (message);
+
+  bus_rate_bucket_charge (&d->rate, size, tv_sec, tv_usec);
+
+  if (d->user_rate != NULL)
+    bus_rate_bucket_charge (&d->user_rate->bucket, size, tv_sec, tv_usec);
+
+  update_rate_limit_pause (connection, d, tv_sec, tv_usec);
+}
+
 dbus_bool_t
 bus_connections_setup_connection (BusConnections *connections,
                                   DBusConnection *connection)
@@ -683,6 +1095,8 @@ bus_connections_setup_connection (BusConnections *connections,
   BusConnectionData *d;
   dbus_bool_t retval;
   DBusError error;
+  long messages_per_second, bytes_per_second;
+  long user_messages_per_second, user_bytes_per_second;
 
   
   d = dbus_new0 (BusConnectionData, 1);
@@ -695,6 +1109,9 @@ bus_connections_setup_connection (BusConnections *connections,
   
   _dbus_get_monotonic_time (&d->connection_tv_sec,
                             &d->connection_tv_usec);
+
+  bus_rate_bucket_init (&d->log_rate, LOG_MESSAGES_PER_SECOND, 0,
+                        d->connection_tv_sec, d->connection_tv_usec);
   
   _dbus_assert (connection_data_slot >= 0);
   
@@ -748,7 +1165,7 @@ bus_connections_setup_connection (BusConnections *connections,
   if (!dbus_connection_set_timeout_functions (connection,
                                               add_connection_timeout,
                                               remove_connection_timeout,
-                                              NULL,
+                                              toggle_connection_timeout,
                                               connection, NULL))
     goto out;
 
@@ -783,6 +1200,38 @@ bus_connections_setup_connection (BusConnections *connections,
         }
     }
 
+  bus_context_get_rate_limits (connections->context, &messages_per_second,
+                               &bytes_per_second, &user_messages_per_second,
+                               &user_bytes_per_second);
+
+  if (messages_per_second > 0 || bytes_per_second > 0 ||
+      user_messages_per_second > 0 || user_bytes_per_second > 0)
+    {
+      DBusTimeout *rate_timeout;
+      long tv_sec, tv_usec;
+
+      _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+      bus_rate_bucket_init (&d->rate, messages_per_second, bytes_per_second,
+                            tv_sec, tv_usec);
+
+      rate_timeout = _dbus_timeout_new (100, /* irrelevant */
+                                        rate_limit_timeout_cb,
+                                        connection, NULL);
+      if (rate_timeout == NULL)
+        goto out;
+
+      _dbus_timeout_set_enabled (rate_timeout, FALSE);
+      if (!_dbus_loop_add_timeout (bus_context_get_loop (connections->context),
+                                   rate_timeout))
+        {
+          _dbus_timeout_unref (rate_timeout);
+          goto out;
+        }
+
+      /* only set once it is in the main loop, see below */
+      d->rate_timeout = rate_timeout;
+    }
+
   /* Setup pending fds timeout (see #80559) */
   d->pending_unix_fds_timeout = _dbus_timeout_new (100, /* irrelevant */
                                                    pending_unix_fds_timeout_cb,
@@ -853,6 +1302,14 @@ bus_connections_setup_connection (BusConnections *connections,
       if (d->pending_unix_fds_timeout)
         _dbus_timeout_unref (d->pending_unix_fds_timeout);
 
+      if (d->rate_timeout)
+        {
+          _dbus_loop_remove_timeout (bus_context_get_loop (connections->context),
+                                     d->rate_timeout);
+          _dbus_timeout_unref (d->rate_timeout);
+        }
+      d->rate_timeout = NULL;
+
       d->pending_unix_fds_timeout = NULL;
 
       _dbus_connection_set_pending_fds_function (connection, NULL, NULL);
@@ -937,7 +1394,8 @@ bus_connections_expire_incomplete (BusConnections *connections)
         }
     }
 
-  bus_expire_timeout_set_interval (connections->expire_timeout,
+  bus_expire_timeout_set_interval (bus_context_get_loop (connections->context),
+                                   connections->expire_timeout,
                                    next_interval);
 }
 
@@ -954,6 +1412,65 @@ expire_incomplete_timeout (void *data)
   return TRUE;
 }
 
+static void
+trim_if_idle (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  if (d->busy)
+    {
+      /* Busy connections would only grow their buffers back */
+      d->busy = FALSE;
+      d->trimmed = FALSE;
+    }
+  else if (!d->trimmed)
+    {
+      _dbus_connection_trim_buffers (connection);
+      d->trimmed = TRUE;
+    }
+}
+
+static dbus_bool_t
+trim_timeout (void *data)
+{
+  BusConnections *connections = data;
+  DBusList *link;
+
+  /* Each pass trims the connections that did nothing since the last
+   * one, so a burst stops costing memory a pass or two after it ends */
+  for (link = _dbus_list_get_first_link (&connections->completed);
+       link != NULL;
+       link = _dbus_list_get_next_link (&connections->completed, link))
+    trim_if_idle (link->data);
+
+  for (link = _dbus_list_get_first_link (&connections->incomplete);
+       link != NULL;
+       link = _dbus_list_get_next_link (&connections->incomplete, link))
+    trim_if_idle (link->data);
+
+  return TRUE;
+}
+
+/**
+ * Notes that a message came in from this connection, so that its
+ * buffers are left alone until it has been quiet for a while.
+ *
+ * @param connection the connection
+ */
+void
+bus_connection_mark_busy (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  d->busy = TRUE;
+}
+
 dbus_bool_t
 bus_connection_get_unix_groups  (DBusConnection   *connection,
                                  unsigned long   **groups,
@@ -1011,6 +1528,41 @@ bus_connection_is_in_unix_group (DBusConnection *connection,
   return FALSE;
 }
 
+/**
+ * Decides whether a complaint about a message from this connection
+ * should be logged, so that a client provoking policy denials can't
+ * flood the log: a second's worth at LOG_MESSAGES_PER_SECOND can be
+ * logged at once, and then no more than that rate.
+ *
+ * @param connection the connection the message came from
+ * @param n_suppressed_p if the complaint is to be logged, returns how
+ *  many were not since the last one that was
+ * @returns #FALSE if the complaint should not be logged
+ */
+dbus_bool_t
+bus_connection_charge_log (DBusConnection *connection,
+                           unsigned long  *n_suppressed_p)
+{
+  BusConnectionData *d;
+  long tv_sec, tv_usec;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+
+  if (bus_rate_bucket_get_delay (&d->log_rate, tv_sec, tv_usec) > 0)
+    {
+      d->n_log_suppressed += 1;
+      return FALSE;
+    }
+
+  bus_rate_bucket_charge (&d->log_rate, 0, tv_sec, tv_usec);
+  *n_suppressed_p = d->n_log_suppressed;
+  d->n_log_suppressed = 0;
+  return TRUE;
+}
+
 const char *
 bus_connection_get_loginfo (DBusConnection        *connection)
 {
@@ -1024,17 +1576,166 @@ bus_connection_get_loginfo (DBusConnection        *connection)
   return d->cached_loginfo_string;  
 }
 
-BusClientPolicy*
-bus_connection_get_policy (DBusConnection *connection)
+/**
+ * Checks a message body that the loader left unvalidated (see the
+ * deferred_validation_bytes limit), before anything reads or delivers
+ * it. A sender of an invalid body is disconnected, as it would have
+ * been had the loader found it.
+ *
+ * @param connection the sender, or #NULL for the bus driver
+ * @param message the message
+ * @returns #FALSE if the body is invalid and the message must be dropped
+ */
+dbus_bool_t
+bus_connection_check_deferred_body (DBusConnection *connection,
+                                    DBusMessage    *message)
 {
-  BusConnectionData *d;
-    
-  d = BUS_CONNECTION_DATA (connection);
+  DBusValidity validity;
 
-  _dbus_assert (d != NULL);
-  _dbus_assert (d->policy != NULL);
-  
-  return d->policy;
+  validity = _dbus_message_validate_deferred_body (message);
+  if (validity == DBUS_VALID)
+    return TRUE;
+
+  /* only messages from a loader are ever left unvalidated */
+  _dbus_assert (connection != NULL);
+
+  bus_context_log (bus_connection_get_context (connection),
+                   DBUS_SYSTEM_LOG_WARNING,
+                   "Connection %s sent a message with an invalid body "
+                   "(%s); disconnecting it",
+                   bus_connection_get_loginfo (connection),
+                   _dbus_validity_to_error_message (validity));
+  dbus_connection_close (connection);
+  return FALSE;
+}
+
+static DBusMessage *
+build_credentials_snapshot (DBusConnection *connection)
+{
+  DBusMessage *snapshot;
+  DBusMessageIter iter;
+  DBusMessageIter array_iter;
+  unsigned long ulong_val;
+  char *s;
+
+  snapshot = dbus_message_new (DBUS_MESSAGE_TYPE_METHOD_RETURN);
+  if (snapshot == NULL)
+    return NULL;
+
+  dbus_message_set_no_reply (snapshot, TRUE);
+
+  dbus_message_iter_init_append (snapshot, &iter);
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "{sv}",
+                                         &array_iter))
+    {
+      dbus_message_unref (snapshot);
+      return NULL;
+    }
+
+  /* we can't represent > 32-bit pids; if your system needs them, please
+   * add ProcessID64 to the spec or something */
+  if (dbus_connection_get_unix_process_id (connection, &ulong_val) &&
+      ulong_val <= _DBUS_UINT32_MAX)
+    {
+      if (!_dbus_asv_add_uint32 (&array_iter, "ProcessID", ulong_val))
+        goto oom;
+    }
+
+  /* we can't represent > 32-bit uids; if your system needs them, please
+   * add UnixUserID64 to the spec or something */
+  if (dbus_connection_get_unix_user (connection, &ulong_val) &&
+      ulong_val <= _DBUS_UINT32_MAX)
+    {
+      if (!_dbus_asv_add_uint32 (&array_iter, "UnixUserID", ulong_val))
+        goto oom;
+    }
+
+  if (dbus_connection_get_windows_user (connection, &s))
+    {
+      DBusString str;
+      dbus_bool_t result;
+
+      if (s == NULL)
+        goto oom;
+
+      _dbus_string_init_const (&str, s);
+      result = _dbus_validate_utf8 (&str, 0, _dbus_string_get_length (&str));
+      _dbus_string_free (&str);
+      if (result)
+        {
+          if (!_dbus_asv_add_string (&array_iter, "WindowsSID", s))
+            {
+              dbus_free (s);
+              goto oom;
+            }
+        }
+      dbus_free (s);
+    }
+
+  if (_dbus_connection_get_linux_security_label (connection, &s))
+    {
+      if (s == NULL)
+        goto oom;
+
+      /* use the GVariant bytestring convention for strings of unknown
+       * encoding: include the \0 in the payload, for zero-copy reading */
+      if (!_dbus_asv_add_byte_array (&array_iter, "LinuxSecurityLabel",
+                                     s, strlen (s) + 1))
+        {
+          dbus_free (s);
+          goto oom;
+        }
+
+      dbus_free (s);
+    }
+
+  if (!_dbus_asv_close (&iter, &array_iter))
+    goto oom;
+
+  return snapshot;
+
+ oom:
+  _dbus_asv_abandon (&iter, &array_iter);
+  dbus_message_unref (snapshot);
+  return NULL;
+}
+
+/**
+ * Returns an unaddressed method return whose body is the a{sv} of
+ * credentials that GetConnectionCredentials reports for this
+ * connection. The credentials can't change once the connection has
+ * authenticated, so this is marshalled once and then copied for each
+ * caller.
+ *
+ * @param connection the connection
+ * @returns the snapshot, owned by the connection, or #NULL if no memory
+ */
+DBusMessage *
+bus_connection_get_credentials_snapshot (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  if (d->credentials_snapshot == NULL)
+    d->credentials_snapshot = build_credentials_snapshot (connection);
+
+  return d->credentials_snapshot;
+}
+
+BusClientPolicy*
+bus_connection_get_policy (DBusConnection *connection)
+{
+  BusConnectionData *d;
+    
+  d = BUS_CONNECTION_DATA (connection);
+
+  _dbus_assert (d != NULL);
+  _dbus_assert (d->policy != NULL);
+  
+  return d->policy;
 }
 
 static dbus_bool_t
@@ -1117,6 +1818,138 @@ bus_connections_foreach (BusConnections               *connections,
   foreach_inactive (connections, function, data);
 }
 
+/* Splits a unique name as made by create_unique_client_name() */
+static dbus_bool_t
+parse_unique_name (const char *unique_name,
+                   long       *major,
+                   long       *minor)
+{
+  DBusString str;
+  int end;
+
+  _dbus_string_init_const (&str, unique_name);
+
+  return _dbus_string_get_byte (&str, 0) == ':' &&
+    _dbus_string_parse_int (&str, 1, major, &end) &&
+    _dbus_string_get_byte (&str, end) == '.' &&
+    _dbus_string_parse_int (&str, end + 1, minor, &end) &&
+    end == _dbus_string_get_length (&str);
+}
+
+/* Unique names are handed out in increasing order, so this is also
+ * the order of the completed list */
+static dbus_bool_t
+unique_name_is_after (const char *unique_name,
+                      long        major,
+                      long        minor)
+{
+  long this_major, this_minor;
+
+  if (!parse_unique_name (unique_name, &this_major, &this_minor))
+    _dbus_assert_not_reached ("unique name we made can't be parsed");
+
+  return this_major > major ||
+    (this_major == major && this_minor > minor);
+}
+
+static DBusConnection *
+first_active_from (BusConnections *connections,
+                   DBusList       *link)
+{
+  for (; link != NULL;
+       link = _dbus_list_get_next_link (&connections->completed, link))
+    {
+      if (!bus_connection_is_monitor (link->data))
+        return link->data;
+    }
+
+  return NULL;
+}
+
+/**
+ * Finds where to resume paging through the active connections, in
+ * the order they were given their unique names. Monitors are
+ * skipped.
+ *
+ * This is cheap if the connection called unique_name is still there,
+ * and a walk over the connections older than it if not.
+ *
+ * @param connections the connections object
+ * @param unique_name the last connection seen, or "" to start
+ * @param error set if unique_name is not a unique name
+ * @returns the next connection, or #NULL at the end or on error
+ */
+DBusConnection *
+bus_connections_get_active_after (BusConnections *connections,
+                                  const char     *unique_name,
+                                  DBusError      *error)
+{
+  BusService *service;
+  DBusString str;
+  DBusList *link;
+  long major, minor;
+
+  if (*unique_name == '\0')
+    return first_active_from (connections,
+                              _dbus_list_get_first_link (&connections->completed));
+
+  if (!parse_unique_name (unique_name, &major, &minor))
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                      "'%s' is not a unique connection name", unique_name);
+      return NULL;
+    }
+
+  _dbus_string_init_const (&str, unique_name);
+  service = bus_registry_lookup (bus_context_get_registry (connections->context),
+                                 &str);
+
+  if (service != NULL)
+    {
+      BusConnectionData *d;
+
+      d = BUS_CONNECTION_DATA (bus_service_get_primary_owners_connection (service));
+      _dbus_assert (d != NULL);
+
+      return first_active_from (connections,
+                                _dbus_list_get_next_link (&connections->completed,
+                                                          d->link_in_connection_list));
+    }
+
+  for (link = _dbus_list_get_first_link (&connections->completed);
+       link != NULL;
+       link = _dbus_list_get_next_link (&connections->completed, link))
+    {
+      if (unique_name_is_after (bus_connection_get_name (link->data),
+                                major, minor))
+        break;
+    }
+
+  return first_active_from (connections, link);
+}
+
+/**
+ * Continues from bus_connections_get_active_after().
+ *
+ * @param connections the connections object
+ * @param connection an active connection
+ * @returns the next one, or #NULL at the end
+ */
+DBusConnection *
+bus_connections_get_next_active (BusConnections *connections,
+                                 DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+  _dbus_assert (d->name != NULL);
+
+  return first_active_from (connections,
+                            _dbus_list_get_next_link (&connections->completed,
+                                                      d->link_in_connection_list));
+}
+
 BusContext*
 bus_connections_get_context (BusConnections *connections)
 {
@@ -1136,6 +1969,73 @@ bus_connections_increment_stamp (BusConnections *connections)
   connections->stamp += 1;
 }
 
+/*
+ * The matchmaker reports the recipients of a message by pushing them
+ * here, so that broadcasting to many connections doesn't need a list
+ * link per recipient. The storage is kept for reuse by later messages.
+ *
+ * Sending to one recipient can cause another message to be matched
+ * (for instance, a copy for monitors) before the caller has finished
+ * with its own recipients, so this is used as a stack: callers note
+ * bus_connections_get_n_recipients() before matching, iterate from
+ * there, and truncate back to it when done.
+ */
+dbus_bool_t
+bus_connections_push_recipient (BusConnections *connections,
+                                DBusConnection *connection)
+{
+  if (connections->n_recipients == connections->n_recipients_allocated)
+    {
+      DBusConnection **recipients;
+      int n_allocated;
+
+      n_allocated = connections->n_recipients_allocated * 2;
+      if (n_allocated == 0)
+        n_allocated = 16;
+
+      recipients = dbus_realloc (connections->recipients,
+                                 n_allocated * sizeof (DBusConnection *));
+      if (recipients == NULL)
+        return FALSE;
+
+      connections->recipients = recipients;
+      connections->n_recipients_allocated = n_allocated;
+    }
+
+  connections->recipients[connections->n_recipients] = connection;
+  connections->n_recipients += 1;
+  return TRUE;
+}
+
+int
+bus_connections_get_n_recipients (BusConnections *connections)
+{
+  return connections->n_recipients;
+}
+
+/* The result must not be kept across a nested push, which can move
+ * the storage; look it up again by index instead.
+ */
+DBusConnection *
+bus_connections_get_recipient (BusConnections *connections,
+                               int             i)
+{
+  _dbus_assert (i >= 0);
+  _dbus_assert (i < connections->n_recipients);
+
+  return connections->recipients[i];
+}
+
+void
+bus_connections_truncate_recipients (BusConnections *connections,
+                                     int             n_recipients)
+{
+  _dbus_assert (n_recipients >= 0);
+  _dbus_assert (n_recipients <= connections->n_recipients);
+
+  connections->n_recipients = n_recipients;
+}
+
 /* Mark connection with current stamp, return TRUE if it
  * didn't already have that stamp
  */
@@ -1193,6 +2093,72 @@ bus_connection_get_registry (DBusConnection *connection)
   return bus_context_get_registry (d->connections->context);
 }
 
+/**
+ * Finds the connection that a message from this connection to the
+ * given name should go to. The well-known name it last sent to is
+ * remembered with its owner, and is valid until any name changes
+ * owner, so a client that keeps calling the same service doesn't look
+ * it up again.
+ *
+ * @param connection the sender
+ * @param name the destination
+ * @returns the primary owner of name, or #NULL if it has none
+ */
+DBusConnection*
+bus_connection_resolve_destination (DBusConnection *connection,
+                                    const char     *name)
+{
+  BusConnectionData *d;
+  BusRegistry *registry;
+  BusService *service;
+  DBusString str;
+  dbus_uint32_t serial;
+  int len;
+
+  d = BUS_CONNECTION_DATA (connection);
+
+  _dbus_assert (d != NULL);
+
+  registry = bus_context_get_registry (d->connections->context);
+  serial = bus_registry_get_owners_serial (registry);
+
+  if (d->last_recipient != NULL &&
+      d->last_destination_serial == serial &&
+      strcmp (d->last_destination, name) == 0)
+    return d->last_recipient;
+
+  _dbus_string_init_const (&str, name);
+  service = bus_registry_lookup (registry, &str);
+
+  if (service == NULL)
+    return NULL;
+
+  /* unique names are found by their numbers anyway */
+  if (*name == ':')
+    return bus_service_get_primary_owners_connection (service);
+
+  d->last_recipient = NULL;
+  len = strlen (name) + 1;
+
+  if (len > d->last_destination_allocated)
+    {
+      char *s;
+
+      s = dbus_realloc (d->last_destination, len);
+      if (s == NULL)
+        return bus_service_get_primary_owners_connection (service);
+
+      d->last_destination = s;
+      d->last_destination_allocated = len;
+    }
+
+  memcpy (d->last_destination, name, len);
+  d->last_destination_serial = serial;
+  d->last_recipient = bus_service_get_primary_owners_connection (service);
+
+  return d->last_recipient;
+}
+
 BusActivation*
 bus_connection_get_activation (DBusConnection *connection)
 {
@@ -1259,6 +2225,52 @@ bus_connection_is_active (DBusConnection *connection)
   return d->name != NULL;
 }
 
+/*
+ * Builds an OOM error that can be sent without allocating anything
+ * more, apart from its destination.
+ */
+static DBusMessage *
+new_oom_error (void)
+{
+  DBusMessage *message;
+
+  message = dbus_message_new (DBUS_MESSAGE_TYPE_ERROR);
+
+  if (message == NULL)
+    return NULL;
+
+  if (!dbus_message_set_error_name (message, DBUS_ERROR_NO_MEMORY) ||
+      !dbus_message_set_sender (message,
+                                DBUS_SERVICE_DBUS))
+    {
+      dbus_message_unref (message);
+      return NULL;
+    }
+  
+  /* set reply serial to placeholder value just so space is already allocated
+   * for it.
+   */
+  if (!dbus_message_set_reply_serial (message, 14))
+    {
+      dbus_message_unref (message);
+      return NULL;
+    }
+
+  return message;
+}
+
+/**
+ * Makes sure that bus_connection_send_oom_error() will work for this
+ * connection. bus_dispatch() does this for the connection it is
+ * dispatching, and gives the error back with
+ * bus_connection_return_oom_error() when it is done.
+ *
+ * The error message is not kept per connection: the one that nobody
+ * holds is shared, so that idle connections don't need one each.
+ *
+ * @param connection the connection
+ * @returns #FALSE if not enough memory
+ */
 dbus_bool_t
 bus_connection_preallocate_oom_error (DBusConnection *connection)
 {
@@ -1277,7 +2289,11 @@ bus_connection_preallocate_oom_error (DBusConnection *connection)
   if (preallocated == NULL)
     return FALSE;
 
-  message = dbus_message_new (DBUS_MESSAGE_TYPE_ERROR);
+  message = d->connections->spare_oom_message;
+  d->connections->spare_oom_message = NULL;
+
+  if (message == NULL)
+    message = new_oom_error ();
 
   if (message == NULL)
     {
@@ -1286,30 +2302,91 @@ bus_connection_preallocate_oom_error (DBusConnection *connection)
     }
 
   /* d->name may be NULL, but that is OK */
-  if (!dbus_message_set_error_name (message, DBUS_ERROR_NO_MEMORY) ||
-      !dbus_message_set_destination (message, d->name) ||
-      !dbus_message_set_sender (message,
-                                DBUS_SERVICE_DBUS))
+  if (!dbus_message_set_destination (message, d->name))
     {
       dbus_connection_free_preallocated_send (connection, preallocated);
       dbus_message_unref (message);
       return FALSE;
     }
+
+  d->oom_message = message;
+  d->oom_preallocated = preallocated;
   
-  /* set reply serial to placeholder value just so space is already allocated
-   * for it.
-   */
-  if (!dbus_message_set_reply_serial (message, 14))
-    {
-      dbus_connection_free_preallocated_send (connection, preallocated);
-      dbus_message_unref (message);
-      return FALSE;
-    }
+  return TRUE;
+}
+
+/**
+ * Gives back what bus_connection_preallocate_oom_error() set aside,
+ * unless it was used or a pending activation still holds it (see
+ * bus_connection_hold_oom_error()).
+ *
+ * @param connection the connection
+ */
+void
+bus_connection_return_oom_error (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+
+  /* Already gone if the connection was disconnected */
+  if (d == NULL || d->oom_preallocated == NULL || d->n_oom_error_holds > 0)
+    return;
+
+  dbus_connection_free_preallocated_send (connection, d->oom_preallocated);
+  d->oom_preallocated = NULL;
+
+  if (d->connections->spare_oom_message == NULL)
+    d->connections->spare_oom_message = d->oom_message;
+  else
+    dbus_message_unref (d->oom_message);
+
+  d->oom_message = NULL;
+}
+
+/**
+ * Keeps the OOM error preallocated for this connection past the end
+ * of the current dispatch, for a pending activation that may have to
+ * send it later. Must be balanced with bus_connection_unhold_oom_error().
+ *
+ * @param connection the connection being dispatched
+ */
+void
+bus_connection_hold_oom_error (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+
+  if (d == NULL)
+    return;
 
-  d->oom_message = message;
-  d->oom_preallocated = preallocated;
-  
-  return TRUE;
+  d->n_oom_error_holds += 1;
+}
+
+/**
+ * Undoes bus_connection_hold_oom_error(). The error is given back at
+ * the end of the connection's next dispatch.
+ *
+ * @param connection the connection
+ */
+void
+bus_connection_unhold_oom_error (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  /* Pending activations can outlive BusConnections on shutdown */
+  if (connection_data_slot < 0)
+    return;
+
+  d = BUS_CONNECTION_DATA (connection);
+
+  if (d == NULL)
+    return;
+
+  _dbus_assert (d->n_oom_error_holds > 0);
+
+  d->n_oom_error_holds -= 1;
 }
 
 void
@@ -1321,7 +2398,18 @@ bus_connection_send_oom_error (DBusConnection *connection,
   d = BUS_CONNECTION_DATA (connection);  
 
   _dbus_assert (d != NULL);  
-  _dbus_assert (d->oom_message != NULL);
+
+  /* Several pending activations can share one preallocated error; for
+   * all but the first, we can only try */
+  if (d->oom_message == NULL &&
+      !bus_connection_preallocate_oom_error (connection))
+    {
+      bus_context_log (d->connections->context, DBUS_SYSTEM_LOG_WARNING,
+                       "dbus-daemon transaction failed (OOM), could not "
+                       "even send an error to sender %s",
+                       bus_connection_get_loginfo (connection));
+      return;
+    }
 
   bus_context_log (d->connections->context, DBUS_SYSTEM_LOG_WARNING,
                    "dbus-daemon transaction failed (OOM), sending error to "
@@ -1372,42 +2460,33 @@ bus_connection_add_match_rule_link (DBusConnection *connection,
   d->connections->total_match_rules += 1;
   update_peak (&d->connections->peak_match_rules,
                d->connections->total_match_rules);
+  d->connections->total_match_rule_bytes +=
+    bus_match_rule_get_n_bytes (link->data);
 #endif
 }
 
-dbus_bool_t
-bus_connection_add_match_rule (DBusConnection *connection,
-                               BusMatchRule   *rule)
-{
-    DBusList *link;
-
-  link = _dbus_list_alloc_link (rule);
-
-  if (link == NULL)
-    return FALSE;
-
-  bus_connection_add_match_rule_link (connection, link);
-
-  return TRUE;
-}
-
+/* Unlinks and frees a link added with bus_connection_add_match_rule_link() */
 void
-bus_connection_remove_match_rule (DBusConnection *connection,
-                                  BusMatchRule   *rule)
+bus_connection_remove_match_rule_link (DBusConnection *connection,
+                                       DBusList       *link)
 {
   BusConnectionData *d;
 
   d = BUS_CONNECTION_DATA (connection);
   _dbus_assert (d != NULL);
 
-  _dbus_list_remove_last (&d->match_rules, rule);
+  _dbus_list_unlink (&d->match_rules, link);
 
   d->n_match_rules -= 1;
   _dbus_assert (d->n_match_rules >= 0);
 
 #ifdef DBUS_ENABLE_STATS
   d->connections->total_match_rules -= 1;
+  d->connections->total_match_rule_bytes -=
+    bus_match_rule_get_n_bytes (link->data);
 #endif
+
+  _dbus_list_free_link (link);
 }
 
 int
@@ -1421,6 +2500,28 @@ bus_connection_get_n_match_rules (DBusConnection *connection)
   return d->n_match_rules;
 }
 
+DBusList**
+bus_connection_get_match_rules (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  return &d->match_rules;
+}
+
+DBusList**
+bus_connection_get_owned_services (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  return &d->services_owned;
+}
+
 void
 bus_connection_add_owned_service_link (DBusConnection *connection,
                                        DBusList       *link)
@@ -1445,32 +2546,21 @@ bus_connection_add_owned_service_link (DBusConnection *connection,
 #endif
 }
 
-dbus_bool_t
-bus_connection_add_owned_service (DBusConnection *connection,
-                                  BusService     *service)
-{
-  DBusList *link;
-
-  link = _dbus_list_alloc_link (service);
-
-  if (link == NULL)
-    return FALSE;
-
-  bus_connection_add_owned_service_link (connection, link);
-
-  return TRUE;
-}
-
+/*
+ * Takes back a link given to bus_connection_add_owned_service_link(),
+ * and frees it. The caller keeps the link, so that a connection owning
+ * many names doesn't have to search for one.
+ */
 void
-bus_connection_remove_owned_service (DBusConnection *connection,
-                                     BusService     *service)
+bus_connection_remove_owned_service_link (DBusConnection *connection,
+                                          DBusList       *link)
 {
   BusConnectionData *d;
 
   d = BUS_CONNECTION_DATA (connection);
   _dbus_assert (d != NULL);
 
-  _dbus_list_remove_last (&d->services_owned, service);
+  _dbus_list_remove_link (&d->services_owned, link);
 
   d->n_services_owned -= 1;
   _dbus_assert (d->n_services_owned >= 0);
@@ -1537,6 +2627,24 @@ bus_connection_complete (DBusConnection   *connection,
   
   if (dbus_connection_get_unix_user (connection, &uid))
     {
+      long messages_per_second, bytes_per_second;
+      long user_messages_per_second, user_bytes_per_second;
+
+      bus_context_get_rate_limits (d->connections->context,
+                                   &messages_per_second, &bytes_per_second,
+                                   &user_messages_per_second,
+                                   &user_bytes_per_second);
+
+      if (d->rate_timeout != NULL &&
+          (user_messages_per_second > 0 || user_bytes_per_second > 0))
+        {
+          d->user_rate = user_rate_ref_for_uid (d->connections, uid,
+                                                user_messages_per_second,
+                                                user_bytes_per_second);
+          if (d->user_rate == NULL)
+            goto fail;
+        }
+
       if (!adjust_connections_for_uid (d->connections,
                                        uid, 1))
         goto fail;
@@ -1548,6 +2656,8 @@ bus_connection_complete (DBusConnection   *connection,
   if (!cache_peer_loginfo_string (d, connection))
     goto fail;
 
+  bus_context_invalidate_policy_cache (d->connections->context);
+
   /* Now the connection is active, move it between lists */
   _dbus_list_unlink (&d->connections->incomplete,
                      d->link_in_connection_list);
@@ -1573,6 +2683,9 @@ fail:
   BUS_SET_OOM (error);
   dbus_free (d->name);
   d->name = NULL;
+  if (d->user_rate)
+    user_rate_unref (d->connections, d->user_rate);
+  d->user_rate = NULL;
   if (d->policy)
     bus_client_policy_unref (d->policy);
   d->policy = NULL;
@@ -1586,33 +2699,68 @@ bus_connections_reload_policy (BusConnections *connections,
   BusConnectionData *d;
   DBusConnection *connection;
   DBusList *link;
+  DBusList *policies;
+  BusClientPolicy *policy;
+  dbus_bool_t retval;
 
   _dbus_assert (connections != NULL);
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
+  bus_context_invalidate_policy_cache (connections->context);
+
+  retval = FALSE;
+  policies = NULL;
+
+  /* Build every new policy before replacing any, so that on failure
+   * all connections keep their old one. Connections with the same
+   * identity get the same policy, so this only builds one for each. */
   for (link = _dbus_list_get_first_link (&(connections->completed));
        link;
        link = _dbus_list_get_next_link (&(connections->completed), link))
     {
       connection = link->data;
-      d = BUS_CONNECTION_DATA (connection);
-      _dbus_assert (d != NULL);
-      _dbus_assert (d->policy != NULL);
 
-      bus_client_policy_unref (d->policy);
-      d->policy = bus_context_create_client_policy (connections->context,
-                                                    connection,
-                                                    error);
-      if (d->policy == NULL)
+      policy = bus_context_create_client_policy (connections->context,
+                                                 connection, error);
+      if (policy == NULL)
         {
           _dbus_verbose ("Failed to create security policy for connection %p\n",
                       connection);
           _DBUS_ASSERT_ERROR_IS_SET (error);
-          return FALSE;
+          goto out;
+        }
+
+      if (!_dbus_list_append (&policies, policy))
+        {
+          bus_client_policy_unref (policy);
+          BUS_SET_OOM (error);
+          goto out;
         }
     }
 
-  return TRUE;
+  for (link = _dbus_list_get_first_link (&(connections->completed));
+       link;
+       link = _dbus_list_get_next_link (&(connections->completed), link))
+    {
+      connection = link->data;
+      d = BUS_CONNECTION_DATA (connection);
+      _dbus_assert (d != NULL);
+      _dbus_assert (d->policy != NULL);
+
+      bus_client_policy_unref (d->policy);
+      d->policy = _dbus_list_pop_first (&policies);
+      _dbus_assert (d->policy != NULL);
+    }
+
+  _dbus_assert (policies == NULL);
+  retval = TRUE;
+
+ out:
+  _dbus_list_foreach (&policies, (DBusForeachFunction) bus_client_policy_unref,
+                      NULL);
+  _dbus_list_clear (&policies);
+
+  return retval;
 }
 
 const char *
@@ -1660,6 +2808,180 @@ bus_connections_check_limits (BusConnections  *connections,
   return TRUE;
 }
 
+/* Serials are only unique per connection, so mix in the recipient of
+ * the reply; replies whose keys still collide are chained */
+static uintptr_t
+pending_reply_key (DBusConnection *will_get_reply,
+                   dbus_uint32_t   reply_serial)
+{
+  return ((uintptr_t) will_get_reply) ^ reply_serial;
+}
+
+static dbus_bool_t
+bus_connections_index_pending_reply (BusConnections  *connections,
+                                     BusPendingReply *pending)
+{
+  BusPendingReply *first;
+  uintptr_t key;
+
+  key = pending_reply_key (pending->will_get_reply, pending->reply_serial);
+  first = _dbus_hash_table_lookup_uintptr (connections->pending_reply_index,
+                                           key);
+
+  if (first != NULL)
+    {
+      /* go second in the chain, so the table itself is unchanged */
+      pending->next_with_key = first->next_with_key;
+      first->next_with_key = pending;
+      return TRUE;
+    }
+
+  pending->next_with_key = NULL;
+
+  return _dbus_hash_table_insert_uintptr (connections->pending_reply_index,
+                                          key, pending);
+}
+
+static void
+bus_connections_unindex_pending_reply (BusConnections  *connections,
+                                       BusPendingReply *pending)
+{
+  BusPendingReply *first;
+  uintptr_t key;
+
+  key = pending_reply_key (pending->will_get_reply, pending->reply_serial);
+  first = _dbus_hash_table_lookup_uintptr (connections->pending_reply_index,
+                                           key);
+  _dbus_assert (first != NULL);
+
+  if (first == pending)
+    {
+      if (pending->next_with_key != NULL)
+        {
+          /* can't fail, since the key is already in the table */
+          _dbus_hash_table_insert_uintptr (connections->pending_reply_index,
+                                           key, pending->next_with_key);
+        }
+      else
+        {
+          _dbus_hash_table_remove_uintptr (connections->pending_reply_index,
+                                           key);
+        }
+    }
+  else
+    {
+      while (first->next_with_key != pending)
+        {
+          first = first->next_with_key;
+          _dbus_assert (first != NULL);
+        }
+
+      first->next_with_key = pending->next_with_key;
+    }
+
+  pending->next_with_key = NULL;
+}
+
+/* Finds a pending reply that is still in the expire list */
+static BusPendingReply *
+bus_connections_find_pending_reply (BusConnections *connections,
+                                    DBusConnection *will_get_reply,
+                                    DBusConnection *will_send_reply,
+                                    dbus_uint32_t   reply_serial)
+{
+  BusPendingReply *pending;
+
+  pending = _dbus_hash_table_lookup_uintptr (connections->pending_reply_index,
+                                             pending_reply_key (will_get_reply,
+                                                                reply_serial));
+
+  while (pending != NULL)
+    {
+      if (!pending->replied &&
+          pending->reply_serial == reply_serial &&
+          pending->will_get_reply == will_get_reply &&
+          pending->will_send_reply == will_send_reply)
+        return pending;
+
+      pending = pending->next_with_key;
+    }
+
+  return NULL;
+}
+
+static void
+bus_pending_reply_unchain_sender (BusPendingReply *pending)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (pending->will_send_reply);
+  _dbus_assert (d != NULL);
+
+  if (pending->prev_to_send != NULL)
+    pending->prev_to_send->next_to_send = pending->next_to_send;
+  else
+    d->replies_to_send = pending->next_to_send;
+
+  if (pending->next_to_send != NULL)
+    pending->next_to_send->prev_to_send = pending->prev_to_send;
+
+  pending->prev_to_send = NULL;
+  pending->next_to_send = NULL;
+}
+
+/* Keeps BusConnectionData::n_pending_replies and the per-connection
+ * chains in step with the expire list */
+static void
+bus_pending_reply_count (BusPendingReply *pending,
+                         int              delta)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (pending->will_get_reply);
+  _dbus_assert (d != NULL);
+
+  d->n_pending_replies += delta;
+  _dbus_assert (d->n_pending_replies >= 0);
+
+  if (delta > 0)
+    {
+      pending->prev_to_get = NULL;
+      pending->next_to_get = d->replies_to_get;
+      if (d->replies_to_get != NULL)
+        d->replies_to_get->prev_to_get = pending;
+      d->replies_to_get = pending;
+
+      /* NULL once the replier has gone away */
+      if (pending->will_send_reply != NULL)
+        {
+          d = BUS_CONNECTION_DATA (pending->will_send_reply);
+          _dbus_assert (d != NULL);
+
+          pending->prev_to_send = NULL;
+          pending->next_to_send = d->replies_to_send;
+          if (d->replies_to_send != NULL)
+            d->replies_to_send->prev_to_send = pending;
+          d->replies_to_send = pending;
+        }
+    }
+  else
+    {
+      if (pending->prev_to_get != NULL)
+        pending->prev_to_get->next_to_get = pending->next_to_get;
+      else
+        d->replies_to_get = pending->next_to_get;
+
+      if (pending->next_to_get != NULL)
+        pending->next_to_get->prev_to_get = pending->prev_to_get;
+
+      pending->prev_to_get = NULL;
+      pending->next_to_get = NULL;
+
+      if (pending->will_send_reply != NULL)
+        bus_pending_reply_unchain_sender (pending);
+    }
+}
+
 static void
 bus_pending_reply_free (BusPendingReply *pending)
 {
@@ -1752,6 +3074,8 @@ bus_pending_reply_expired (BusExpireList *list,
     }
 
   bus_expire_list_remove_link (connections->pending_replies, link);
+  bus_pending_reply_count (pending, -1);
+  bus_connections_unindex_pending_reply (connections, pending);
 
   bus_pending_reply_free (pending);
   bus_transaction_execute_and_free (transaction);
@@ -1763,60 +3087,57 @@ static void
 bus_connection_drop_pending_replies (BusConnections  *connections,
                                      DBusConnection  *connection)
 {
-  /* The DBusConnection is almost 100% finalized here, so you can't
-   * do anything with it except check for pointer equality
-   */
-  DBusList *link;
+  BusConnectionData *d;
+  BusPendingReply *pending;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
 
   _dbus_verbose ("Dropping pending replies that involve connection %p\n",
                  connection);
-  
-  link = bus_expire_list_get_first_link (connections->pending_replies);
-  while (link != NULL)
+
+  /* We don't need to track the replies we were waiting for anymore.
+   * This goes first, so that those we would have sent ourselves
+   * are gone before the second loop.
+   */
+  while ((pending = d->replies_to_get) != NULL)
     {
-      DBusList *next;
-      BusPendingReply *pending;
+      _dbus_verbose ("Dropping pending reply %p, replier %p receiver %p serial %u\n",
+                     pending,
+                     pending->will_send_reply,
+                     pending->will_get_reply,
+                     pending->reply_serial);
+
+      bus_expire_list_remove_link (connections->pending_replies,
+                                   pending->link);
+      bus_pending_reply_count (pending, -1);
+      bus_connections_unindex_pending_reply (connections, pending);
+      bus_pending_reply_free (pending);
+    }
 
-      next = bus_expire_list_get_next_link (connections->pending_replies,
-                                            link);
-      pending = link->data;
+  /* The replies we owe aren't going to be sent, so set things up so
+   * they will be expired right away
+   */
+  while ((pending = d->replies_to_send) != NULL)
+    {
+      _dbus_verbose ("Will expire pending reply %p, replier %p receiver %p serial %u\n",
+                     pending,
+                     pending->will_send_reply,
+                     pending->will_get_reply,
+                     pending->reply_serial);
 
-      if (pending->will_get_reply == connection)
-        {
-          /* We don't need to track this pending reply anymore */
+      bus_pending_reply_unchain_sender (pending);
 
-          _dbus_verbose ("Dropping pending reply %p, replier %p receiver %p serial %u\n",
-                         pending,
-                         pending->will_send_reply,
-                         pending->will_get_reply,
-                         pending->reply_serial);
-          
-          bus_expire_list_remove_link (connections->pending_replies,
-                                       link);
-          bus_pending_reply_free (pending);
-        }
-      else if (pending->will_send_reply == connection)
-        {
-          /* The reply isn't going to be sent, so set things
-           * up so it will be expired right away
-           */
-          _dbus_verbose ("Will expire pending reply %p, replier %p receiver %p serial %u\n",
-                         pending,
-                         pending->will_send_reply,
-                         pending->will_get_reply,
-                         pending->reply_serial);
-          
-          pending->will_send_reply = NULL;
-          pending->expire_item.added_tv_sec = 0;
-          pending->expire_item.added_tv_usec = 0;
+      /* will_send_reply isn't part of the index key, so the index
+       * needn't change */
+      pending->will_send_reply = NULL;
 
-          bus_expire_list_recheck_immediately (connections->pending_replies);
-        }
-      
-      link = next;
+      bus_expire_list_expire_link_soon (connections->pending_replies,
+                                        pending->link);
     }
-}
 
+  _dbus_assert (d->n_pending_replies == 0);
+}
 
 typedef struct
 {
@@ -1831,9 +3152,13 @@ cancel_pending_reply (void *data)
 
   _dbus_verbose ("d = %p\n", d);
   
-  if (!bus_expire_list_remove (d->connections->pending_replies,
-                               &d->pending->expire_item))
-    _dbus_assert_not_reached ("pending reply did not exist to be cancelled");
+  _dbus_assert (bus_expire_list_contains_item (d->connections->pending_replies,
+                                               &d->pending->expire_item));
+
+  bus_expire_list_remove_link (d->connections->pending_replies,
+                               d->pending->link);
+  bus_pending_reply_count (d->pending, -1);
+  bus_connections_unindex_pending_reply (d->connections, d->pending);
 
   bus_pending_reply_free (d->pending); /* since it's been cancelled */
 }
@@ -1865,10 +3190,9 @@ bus_connections_expect_reply (BusConnections  *connections,
                               DBusError       *error)
 {
   BusPendingReply *pending;
+  BusConnectionData *d;
   dbus_uint32_t reply_serial;
-  DBusList *link;
   CancelPendingReplyData *cprd;
-  int count;
 
   _dbus_assert (will_get_reply != NULL);
   _dbus_assert (will_send_reply != NULL);
@@ -1879,28 +3203,19 @@ bus_connections_expect_reply (BusConnections  *connections,
   
   reply_serial = dbus_message_get_serial (reply_to_this);
 
-  link = bus_expire_list_get_first_link (connections->pending_replies);
-  count = 0;
-  while (link != NULL)
+  if (bus_connections_find_pending_reply (connections, will_get_reply,
+                                          will_send_reply,
+                                          reply_serial) != NULL)
     {
-      pending = link->data;
-
-      if (pending->reply_serial == reply_serial &&
-          pending->will_get_reply == will_get_reply &&
-          pending->will_send_reply == will_send_reply)
-        {
-          dbus_set_error (error, DBUS_ERROR_ACCESS_DENIED,
-                          "Message has the same reply serial as a currently-outstanding existing method call");
-          return FALSE;
-        }
-      
-      link = bus_expire_list_get_next_link (connections->pending_replies,
-                                            link);
-      if (pending->will_get_reply == will_get_reply)
-        ++count;
+      dbus_set_error (error, DBUS_ERROR_ACCESS_DENIED,
+                      "Message has the same reply serial as a currently-outstanding existing method call");
+      return FALSE;
     }
-  
-  if (count >=
+
+  d = BUS_CONNECTION_DATA (will_get_reply);
+  _dbus_assert (d != NULL);
+
+  if (d->n_pending_replies >=
       bus_context_get_max_replies_per_connection (connections->context))
     {
       dbus_set_error (error, DBUS_ERROR_LIMITS_EXCEEDED,
@@ -1915,29 +3230,35 @@ bus_connections_expect_reply (BusConnections  *connections,
       return FALSE;
     }
 
-#ifdef DBUS_ENABLE_VERBOSE_MODE
-  /* so we can see a not-yet-added pending reply */
-  pending->expire_item.added_tv_sec = 1;
-  pending->expire_item.added_tv_usec = 1;
-#endif
-
   pending->will_get_reply = will_get_reply;
   pending->will_send_reply = will_send_reply;
   pending->reply_serial = reply_serial;
+
+  _dbus_get_monotonic_time (&pending->expire_item.added_tv_sec,
+                            &pending->expire_item.added_tv_usec);
+
+  pending->link = _dbus_list_alloc_link (pending);
+  if (pending->link == NULL)
+    {
+      BUS_SET_OOM (error);
+      bus_pending_reply_free (pending);
+      return FALSE;
+    }
   
   cprd = dbus_new0 (CancelPendingReplyData, 1);
   if (cprd == NULL)
     {
       BUS_SET_OOM (error);
+      _dbus_list_free_link (pending->link);
       bus_pending_reply_free (pending);
       return FALSE;
     }
   
-  if (!bus_expire_list_add (connections->pending_replies,
-                            &pending->expire_item))
+  if (!bus_connections_index_pending_reply (connections, pending))
     {
       BUS_SET_OOM (error);
       dbus_free (cprd);
+      _dbus_list_free_link (pending->link);
       bus_pending_reply_free (pending);
       return FALSE;
     }
@@ -1948,17 +3269,19 @@ bus_connections_expect_reply (BusConnections  *connections,
                                         cancel_pending_reply_data_free))
     {
       BUS_SET_OOM (error);
-      bus_expire_list_remove (connections->pending_replies, &pending->expire_item);
+      bus_connections_unindex_pending_reply (connections, pending);
       dbus_free (cprd);
+      _dbus_list_free_link (pending->link);
       bus_pending_reply_free (pending);
       return FALSE;
     }
                                         
   cprd->pending = pending;
   cprd->connections = connections;
-  
-  _dbus_get_monotonic_time (&pending->expire_item.added_tv_sec,
-                            &pending->expire_item.added_tv_usec);
+
+  /* the newest item, so no walk is needed to insert it */
+  bus_expire_list_add_link (connections->pending_replies, pending->link);
+  bus_pending_reply_count (pending, 1);
 
   _dbus_verbose ("Added pending reply %p, replier %p receiver %p serial %u\n",
                  pending,
@@ -1980,10 +3303,14 @@ cancel_check_pending_reply (void *data)
 {
   CheckPendingReplyData *d = data;
 
+  BusPendingReply *pending = d->link->data;
+
   _dbus_verbose ("d = %p\n",d);
 
+  pending->replied = FALSE;
   bus_expire_list_add_link (d->connections->pending_replies,
                             d->link);
+  bus_pending_reply_count (pending, 1);
   d->link = NULL;
 }
 
@@ -2000,7 +3327,8 @@ check_pending_reply_data_free (void *data)
       
       _dbus_assert (!bus_expire_list_contains_item (d->connections->pending_replies,
                                                     &pending->expire_item));
-      
+
+      bus_connections_unindex_pending_reply (d->connections, pending);
       bus_pending_reply_free (pending);
       _dbus_list_free_link (d->link);
     }
@@ -2021,38 +3349,25 @@ bus_connections_check_reply (BusConnections *connections,
                              DBusError      *error)
 {
   CheckPendingReplyData *cprd;
-  DBusList *link;
+  BusPendingReply *pending;
   dbus_uint32_t reply_serial;
   
-  _dbus_assert (sending_reply != NULL);
-  _dbus_assert (receiving_reply != NULL);
-
-  reply_serial = dbus_message_get_reply_serial (reply);
-
-  link = bus_expire_list_get_first_link (connections->pending_replies);
-  while (link != NULL)
-    {
-      BusPendingReply *pending = link->data;
+  _dbus_assert (sending_reply != NULL);
+  _dbus_assert (receiving_reply != NULL);
 
-      if (pending->reply_serial == reply_serial &&
-          pending->will_get_reply == receiving_reply &&
-          pending->will_send_reply == sending_reply)
-        {
-          _dbus_verbose ("Found pending reply with serial %u\n", reply_serial);
-          break;
-        }
-      
-      link = bus_expire_list_get_next_link (connections->pending_replies,
-                                            link);
-    }
+  reply_serial = dbus_message_get_reply_serial (reply);
 
-  if (link == NULL)
+  pending = bus_connections_find_pending_reply (connections, receiving_reply,
+                                                sending_reply, reply_serial);
+  if (pending == NULL)
     {
       _dbus_verbose ("No pending reply expected\n");
 
       return FALSE;
     }
 
+  _dbus_verbose ("Found pending reply with serial %u\n", reply_serial);
+
   cprd = dbus_new0 (CheckPendingReplyData, 1);
   if (cprd == NULL)
     {
@@ -2070,13 +3385,16 @@ bus_connections_check_reply (BusConnections *connections,
       return FALSE;
     }
 
-  cprd->link = link;
+  cprd->link = pending->link;
   cprd->connections = connections;
   
+  /* stays in the index until the transaction is cancelled or freed */
+  pending->replied = TRUE;
   bus_expire_list_unlink (connections->pending_replies,
-                          link);
+                          pending->link);
+  bus_pending_reply_count (pending, -1);
   
-  _dbus_assert (!bus_expire_list_contains_item (connections->pending_replies, link->data));
+  _dbus_assert (!bus_expire_list_contains_item (connections->pending_replies, &pending->expire_item));
 
   return TRUE;
 }
@@ -2088,13 +3406,6 @@ bus_connections_check_reply (BusConnections *connections,
  * one transaction across any main loop iterations.
  */
 
-typedef struct
-{
-  BusTransaction *transaction;
-  DBusMessage    *message;
-  DBusPreallocatedSend *preallocated;
-} MessageToSend;
-
 typedef struct
 {
   BusTransactionCancelFunction cancel_function;
@@ -2102,12 +3413,81 @@ typedef struct
   void *data;
 } CancelHook;
 
-struct BusTransaction
+static void
+transaction_arena_reset (BusTransaction *transaction)
 {
-  DBusList *connections;
-  BusContext *context;
-  DBusList *cancel_hooks;
-};
+  while (transaction->chunks != NULL)
+    {
+      TransactionChunk *chunk = transaction->chunks;
+
+      transaction->chunks = chunk->next;
+      dbus_free (chunk);
+    }
+
+  transaction->arena_pos = transaction->arena.bytes;
+  transaction->arena_end = transaction->arena.bytes + TRANSACTION_ARENA_SIZE;
+}
+
+static void *
+transaction_alloc (BusTransaction *transaction,
+                   size_t          size)
+{
+  void *p;
+
+  size = _DBUS_ALIGN_VALUE (size, 8);
+
+  if (size > (size_t) (transaction->arena_end - transaction->arena_pos))
+    {
+      TransactionChunk *chunk;
+      size_t chunk_size;
+
+      chunk_size = MAX (size, TRANSACTION_CHUNK_SIZE);
+      chunk = dbus_malloc (TRANSACTION_CHUNK_HEADER + chunk_size);
+      if (chunk == NULL)
+        return NULL;
+
+      chunk->next = transaction->chunks;
+      transaction->chunks = chunk;
+      transaction->arena_pos = ((unsigned char *) chunk) + TRANSACTION_CHUNK_HEADER;
+      transaction->arena_end = transaction->arena_pos + chunk_size;
+    }
+
+  p = transaction->arena_pos;
+  transaction->arena_pos += size;
+
+  return p;
+}
+
+/* A list link in the transaction's arena: it must only ever be
+ * taken off its list with _dbus_list_unlink(), never freed. */
+static DBusList *
+transaction_alloc_link (BusTransaction *transaction,
+                        void           *data)
+{
+  DBusList *link;
+
+  link = transaction_alloc (transaction, sizeof (DBusList));
+  if (link == NULL)
+    return NULL;
+
+  link->data = data;
+
+  return link;
+}
+
+static DBusConnection *
+transaction_pop_connection (BusTransaction *transaction)
+{
+  DBusList *link;
+
+  link = _dbus_list_get_first_link (&transaction->connections);
+  if (link == NULL)
+    return NULL;
+
+  _dbus_list_unlink (&transaction->connections, link);
+
+  return link->data;
+}
 
 static void
 message_to_send_free (DBusConnection *connection,
@@ -2116,10 +3496,16 @@ message_to_send_free (DBusConnection *connection,
   if (to_send->message)
     dbus_message_unref (to_send->message);
 
+  if (to_send->merged)
+    dbus_message_unref (to_send->merged);
+
+  if (to_send->superseded)
+    dbus_message_unref (to_send->superseded);
+
   if (to_send->preallocated)
     dbus_connection_free_preallocated_send (connection, to_send->preallocated);
 
-  dbus_free (to_send);
+  /* to_send itself belongs to the transaction's arena */
 }
 
 static void
@@ -2142,8 +3528,6 @@ cancel_hook_free (void *element,
 
   if (ch->free_data_function)
     (* ch->free_data_function) (ch->data);
-
-  dbus_free (ch);
 }
 
 static void
@@ -2151,19 +3535,39 @@ free_cancel_hooks (BusTransaction *transaction)
 {
   _dbus_list_foreach (&transaction->cancel_hooks,
                       cancel_hook_free, NULL);
-  
-  _dbus_list_clear (&transaction->cancel_hooks);
+
+  /* the hooks and their links are in the arena */
+  transaction->cancel_hooks = NULL;
 }
 
 BusTransaction*
 bus_transaction_new (BusContext *context)
 {
   BusTransaction *transaction;
+  BusConnections *connections;
 
-  transaction = dbus_new0 (BusTransaction, 1);
-  if (transaction == NULL)
-    return NULL;
+  connections = bus_context_get_connections (context);
 
+  if (connections != NULL && connections->spare_transactions != NULL)
+    {
+      transaction = connections->spare_transactions;
+      connections->spare_transactions = transaction->next_spare;
+      connections->n_spare_transactions -= 1;
+    }
+  else
+    {
+      /* not dbus_new0(), there's no need to clear the arena */
+      transaction = dbus_new (BusTransaction, 1);
+      if (transaction == NULL)
+        return NULL;
+
+      transaction->chunks = NULL;
+      transaction_arena_reset (transaction);
+    }
+
+  transaction->connections = NULL;
+  transaction->cancel_hooks = NULL;
+  transaction->next_spare = NULL;
   transaction->context = context;
   
   return transaction;
@@ -2179,6 +3583,43 @@ bus_transaction_get_context (BusTransaction  *transaction)
  * Reserve enough memory to capture the given message if the
  * transaction goes through.
  */
+/* Applies the monitor's sampling and rate limit to one match */
+static dbus_bool_t
+monitor_wants_capture (BusConnectionData *d)
+{
+  const BusMonitorOptions *options = &d->monitor_options;
+
+  if (options->sample_interval > 1)
+    {
+      d->monitor_n_matched += 1;
+
+      if (d->monitor_n_matched < options->sample_interval)
+        return FALSE;
+
+      d->monitor_n_matched = 0;
+    }
+
+  if (options->max_per_second > 0)
+    {
+      long tv_sec, tv_usec;
+
+      _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+
+      if (tv_sec != d->monitor_second)
+        {
+          d->monitor_second = tv_sec;
+          d->monitor_n_this_second = 0;
+        }
+
+      if (d->monitor_n_this_second >= options->max_per_second)
+        return FALSE;
+
+      d->monitor_n_this_second += 1;
+    }
+
+  return TRUE;
+}
+
 dbus_bool_t
 bus_transaction_capture (BusTransaction *transaction,
                          DBusConnection *sender,
@@ -2186,8 +3627,8 @@ bus_transaction_capture (BusTransaction *transaction,
 {
   BusConnections *connections;
   BusMatchmaker *mm;
-  DBusList *link;
-  DBusList *recipients = NULL;
+  DBusMessage *header_only = NULL;
+  int first, last, i;
   dbus_bool_t ret = FALSE;
 
   connections = bus_context_get_connections (transaction->context);
@@ -2201,24 +3642,84 @@ bus_transaction_capture (BusTransaction *transaction,
    * There's little point, since there is up to 1 per process. */
   _dbus_assert (mm != NULL);
 
-  if (!bus_matchmaker_get_recipients (mm, connections, sender, NULL, message,
-        &recipients))
-    goto out;
+  first = bus_connections_get_n_recipients (connections);
+
+  if (!bus_matchmaker_get_recipients (mm, connections, sender, NULL, message))
+    return FALSE;
+
+  last = bus_connections_get_n_recipients (connections);
 
-  for (link = _dbus_list_get_first_link (&recipients);
-      link != NULL;
-      link = _dbus_list_get_next_link (&recipients, link))
+  for (i = first; i < last; i++)
     {
-      DBusConnection *recipient = link->data;
+      DBusConnection *recipient;
+      BusConnectionData *d;
 
-      if (!bus_transaction_send (transaction, recipient, message))
-        goto out;
+      recipient = bus_connections_get_recipient (connections, i);
+      d = BUS_CONNECTION_DATA (recipient);
+
+      if (!monitor_wants_capture (d))
+        continue;
+
+      /* A monitor that does not keep up loses captured messages rather
+       * than growing its queue without bound; nobody is waiting on them */
+      if (bus_context_outgoing_queue_is_full (transaction->context,
+                                              recipient))
+        {
+          if (d->n_monitor_dropping == 0)
+            bus_context_log (transaction->context, DBUS_SYSTEM_LOG_WARNING,
+                             "Monitor %s is not reading its messages; "
+                             "dropping captured messages until it catches up",
+                             bus_connection_get_loginfo (recipient));
+
+#ifdef DBUS_ENABLE_STATS
+          connections->n_monitor_dropped += 1;
+#endif
+          d->n_monitor_dropping += 1;
+          continue;
+        }
+
+      if (d->n_monitor_dropping != 0)
+        {
+          bus_context_log (transaction->context, DBUS_SYSTEM_LOG_INFO,
+                           "Monitor %s caught up after %u captured messages "
+                           "were dropped",
+                           bus_connection_get_loginfo (recipient),
+                           d->n_monitor_dropping);
+          d->n_monitor_dropping = 0;
+        }
+
+      if (d->monitor_options.headers_only)
+        {
+          /* one copy serves every headers-only monitor */
+          if (header_only == NULL)
+            {
+              header_only = _dbus_message_copy_header_only (message);
+              if (header_only == NULL)
+                goto out;
+            }
+
+          if (!bus_transaction_send (transaction, recipient, header_only))
+            goto out;
+        }
+      else
+        {
+          /* A body nobody has checked yet is only passed on once it
+           * has been; an invalid one is left for dispatching to reject */
+          if (_dbus_message_validate_deferred_body (message) != DBUS_VALID)
+            continue;
+
+          if (!bus_transaction_send (transaction, recipient, message))
+            goto out;
+        }
     }
 
   ret = TRUE;
 
 out:
-  _dbus_list_clear (&recipients);
+  if (header_only != NULL)
+    dbus_message_unref (header_only);
+
+  bus_connections_truncate_recipients (connections, first);
   return ret;
 }
 
@@ -2320,6 +3821,130 @@ bus_transaction_send_from_driver (BusTransaction *transaction,
   return bus_transaction_send (transaction, connection, message);
 }
 
+static void
+coalesce_index_value_free (void *data)
+{
+  /* the hash table may free a new entry's NULL value */
+  if (data != NULL)
+    dbus_message_unref (data);
+}
+
+/*
+ * While a connection has at least coalesce_properties_changed_bytes
+ * queued for it, remember the last message queued for it by each
+ * sender if that was a PropertiesChanged signal, and merge it into the
+ * next one if that is for the same object and interface and the first
+ * is still waiting. The merged signal takes the place of the second,
+ * so anything else the sender queued in between would overtake the
+ * first: forget the sender as soon as it queues anything else. This
+ * is only an optimization, so on OOM the message is just sent as it is.
+ */
+static void
+prepare_coalescing (DBusConnection    *connection,
+                    BusConnectionData *d,
+                    MessageToSend     *to_send)
+{
+  DBusString key, queued_key;
+  DBusMessage *queued;
+  DBusMessage *merged;
+  const char *sender;
+  char *sender_copy;
+  long threshold;
+
+  threshold =
+    bus_context_get_coalesce_properties_changed_bytes (d->connections->context);
+
+  if (threshold == 0)
+    return;
+
+  sender = dbus_message_get_sender (to_send->message);
+
+  if (!bus_coalesce_is_mergeable (to_send->message))
+    {
+      if (d->coalesce_index != NULL)
+        _dbus_hash_table_remove_string (d->coalesce_index, sender);
+      return;
+    }
+
+  if (dbus_connection_get_outgoing_size (connection) < threshold)
+    {
+      /* it has caught up, so what we remember has probably been sent */
+      if (d->coalesce_index != NULL)
+        _dbus_hash_table_remove_all (d->coalesce_index);
+      return;
+    }
+
+  if (d->coalesce_index == NULL)
+    {
+      d->coalesce_index = _dbus_hash_table_new (DBUS_HASH_STRING, dbus_free,
+                                                coalesce_index_value_free);
+      if (d->coalesce_index == NULL)
+        return;
+    }
+
+  merged = NULL;
+  queued = _dbus_hash_table_lookup_string (d->coalesce_index, sender);
+
+  if (queued != NULL &&
+      _dbus_connection_can_remove_outgoing_message (connection, queued))
+    {
+      if (!_dbus_string_init (&key))
+        goto forget;
+
+      if (!_dbus_string_init (&queued_key))
+        {
+          _dbus_string_free (&key);
+          goto forget;
+        }
+
+      if (bus_coalesce_append_key (to_send->message, &key) &&
+          bus_coalesce_append_key (queued, &queued_key) &&
+          _dbus_string_equal (&key, &queued_key))
+        merged = bus_coalesce_merge (queued, to_send->message);
+
+      _dbus_string_free (&key);
+      _dbus_string_free (&queued_key);
+
+      /* the index is about to drop its reference */
+      if (merged != NULL)
+        dbus_message_ref (queued);
+    }
+
+  if (merged == NULL)
+    queued = NULL;
+
+  sender_copy = _dbus_strdup (sender);
+  if (sender_copy == NULL)
+    goto forget;
+
+  /* If the transaction is cancelled, or the queued message gets
+   * written after all, the index names a message that is not in the
+   * queue, and the next signal will simply not be merged with it */
+  if (!_dbus_hash_table_insert_string (d->coalesce_index, sender_copy,
+                                       dbus_message_ref (merged != NULL ?
+                                                         merged :
+                                                         to_send->message)))
+    {
+      dbus_message_unref (merged != NULL ? merged : to_send->message);
+      dbus_free (sender_copy);
+      goto forget;
+    }
+
+  to_send->merged = merged;
+  to_send->superseded = queued;
+  return;
+
+ forget:
+  /* whatever we remembered is no longer the sender's last message */
+  _dbus_hash_table_remove_string (d->coalesce_index, sender);
+
+  if (merged != NULL)
+    dbus_message_unref (merged);
+
+  if (queued != NULL)
+    dbus_message_unref (queued);
+}
+
 dbus_bool_t
 bus_transaction_send (BusTransaction *transaction,
                       DBusConnection *connection,
@@ -2327,6 +3952,7 @@ bus_transaction_send (BusTransaction *transaction,
 {
   MessageToSend *to_send;
   BusConnectionData *d;
+  DBusList *to_send_link;
   DBusList *link;
 
   _dbus_verbose ("  trying to add %s interface=%s member=%s error=%s to transaction%s\n",
@@ -2350,30 +3976,30 @@ bus_transaction_send (BusTransaction *transaction,
   d = BUS_CONNECTION_DATA (connection);
   _dbus_assert (d != NULL);
   
-  to_send = dbus_new (MessageToSend, 1);
+  /* A broadcast needs one of these per recipient, so they come from
+   * the transaction's arena rather than going through malloc() for
+   * each; on failure they are simply left there */
+  to_send = transaction_alloc (transaction, sizeof (MessageToSend));
   if (to_send == NULL)
-    {
-      return FALSE;
-    }
+    return FALSE;
+
+  to_send_link = transaction_alloc_link (transaction, to_send);
+  if (to_send_link == NULL)
+    return FALSE;
 
   to_send->preallocated = dbus_connection_preallocate_send (connection);
   if (to_send->preallocated == NULL)
-    {
-      dbus_free (to_send);
-      return FALSE;
-    }  
+    return FALSE;
   
   dbus_message_ref (message);
   to_send->message = message;
   to_send->transaction = transaction;
+  to_send->merged = NULL;
+  to_send->superseded = NULL;
 
-  _dbus_verbose ("about to prepend message\n");
-  
-  if (!_dbus_list_prepend (&d->transaction_messages, to_send))
-    {
-      message_to_send_free (connection, to_send);
-      return FALSE;
-    }
+  prepare_coalescing (connection, d, to_send);
+
+  _dbus_list_prepend_link (&d->transaction_messages, to_send_link);
 
   _dbus_verbose ("prepended message\n");
   
@@ -2397,12 +4023,15 @@ bus_transaction_send (BusTransaction *transaction,
 
   if (link == NULL)
     {
-      if (!_dbus_list_prepend (&transaction->connections, connection))
+      link = transaction_alloc_link (transaction, connection);
+      if (link == NULL)
         {
-          _dbus_list_remove (&d->transaction_messages, to_send);
+          _dbus_list_unlink (&d->transaction_messages, to_send_link);
           message_to_send_free (connection, to_send);
           return FALSE;
         }
+
+      _dbus_list_prepend_link (&transaction->connections, link);
     }
 
   return TRUE;
@@ -2411,11 +4040,27 @@ bus_transaction_send (BusTransaction *transaction,
 static void
 transaction_free (BusTransaction *transaction)
 {
+  BusConnections *connections;
+
   _dbus_assert (transaction->connections == NULL);
 
   free_cancel_hooks (transaction);
 
-  dbus_free (transaction);
+  transaction_arena_reset (transaction);
+
+  connections = bus_context_get_connections (transaction->context);
+
+  if (connections != NULL &&
+      connections->n_spare_transactions < MAX_SPARE_TRANSACTIONS)
+    {
+      transaction->next_spare = connections->spare_transactions;
+      connections->spare_transactions = transaction;
+      connections->n_spare_transactions += 1;
+    }
+  else
+    {
+      dbus_free (transaction);
+    }
 }
 
 static void
@@ -2436,8 +4081,7 @@ connection_cancel_transaction (DBusConnection *connection,
       
       if (m->transaction == transaction)
         {
-          _dbus_list_remove_link (&d->transaction_messages,
-                                  link);
+          _dbus_list_unlink (&d->transaction_messages, link);
           
           message_to_send_free (connection, m);
         }
@@ -2453,7 +4097,7 @@ bus_transaction_cancel_and_free (BusTransaction *transaction)
 
   _dbus_verbose ("TRANSACTION: cancelled\n");
   
-  while ((connection = _dbus_list_pop_first (&transaction->connections)))
+  while ((connection = transaction_pop_connection (transaction)))
     connection_cancel_transaction (connection, transaction);
 
   _dbus_list_foreach (&transaction->cancel_hooks,
@@ -2472,6 +4116,8 @@ connection_execute_transaction (DBusConnection *connection,
   d = BUS_CONNECTION_DATA (connection);
   _dbus_assert (d != NULL);
 
+  d->busy = TRUE;
+
   /* Send the queue in order (FIFO) */
   link = _dbus_list_get_last_link (&d->transaction_messages);
   while (link != NULL)
@@ -2481,14 +4127,30 @@ connection_execute_transaction (DBusConnection *connection,
       
       if (m->transaction == transaction)
         {
-          _dbus_list_remove_link (&d->transaction_messages,
-                                  link);
+          DBusMessage *message = m->message;
+
+          _dbus_list_unlink (&d->transaction_messages, link);
 
           _dbus_assert (dbus_message_get_sender (m->message) != NULL);
-          
+
+          if (m->merged != NULL &&
+              _dbus_connection_remove_outgoing_message (connection,
+                                                        m->superseded))
+            {
+              _dbus_verbose ("merged PropertiesChanged %u into queued %u\n",
+                             dbus_message_get_serial (m->message),
+                             dbus_message_get_serial (m->superseded));
+              message = m->merged;
+            }
+
+          _DBUS_TRACE3 (message__enqueued,
+                        dbus_message_get_serial (m->message),
+                        dbus_message_get_sender (m->message),
+                        bus_connection_get_name (connection));
+
           dbus_connection_send_preallocated (connection,
                                              m->preallocated,
-                                             m->message,
+                                             message,
                                              NULL);
 
           m->preallocated = NULL; /* so we don't double-free it */
@@ -2510,7 +4172,7 @@ bus_transaction_execute_and_free (BusTransaction *transaction)
 
   _dbus_verbose ("TRANSACTION: executing\n");
   
-  while ((connection = _dbus_list_pop_first (&transaction->connections)))
+  while ((connection = transaction_pop_connection (transaction)))
     connection_execute_transaction (connection, transaction);
 
   transaction_free (transaction);
@@ -2521,17 +4183,25 @@ bus_connection_remove_transactions (DBusConnection *connection)
 {
   MessageToSend *to_send;
   BusConnectionData *d;
+  DBusList *link;
   
   d = BUS_CONNECTION_DATA (connection);
   _dbus_assert (d != NULL);
   
-  while ((to_send = _dbus_list_get_first (&d->transaction_messages)))
+  while ((link = _dbus_list_get_first_link (&d->transaction_messages)))
     {
-      /* only has an effect for the first MessageToSend listing this transaction */
-      _dbus_list_remove (&to_send->transaction->connections,
-                         connection);
+      DBusList *connection_link;
+
+      to_send = link->data;
 
-      _dbus_list_remove (&d->transaction_messages, to_send);
+      /* only finds anything for the first MessageToSend listing this transaction */
+      connection_link = _dbus_list_find_last (&to_send->transaction->connections,
+                                              connection);
+      if (connection_link != NULL)
+        _dbus_list_unlink (&to_send->transaction->connections,
+                           connection_link);
+
+      _dbus_list_unlink (&d->transaction_messages, link);
       message_to_send_free (connection, to_send);
     }
 }
@@ -2577,11 +4247,16 @@ bus_transaction_add_cancel_hook (BusTransaction               *transaction,
                                  DBusFreeFunction              free_data_function)
 {
   CancelHook *ch;
+  DBusList *link;
 
-  ch = dbus_new (CancelHook, 1);
+  ch = transaction_alloc (transaction, sizeof (CancelHook));
   if (ch == NULL)
     return FALSE;
 
+  link = transaction_alloc_link (transaction, ch);
+  if (link == NULL)
+    return FALSE;
+
   _dbus_verbose ("     adding cancel hook function = %p data = %p\n",
                  cancel_function, data);
   
@@ -2592,11 +4267,7 @@ bus_transaction_add_cancel_hook (BusTransaction               *transaction,
   /* It's important that the hooks get run in reverse order that they
    * were added
    */
-  if (!_dbus_list_prepend (&transaction->cancel_hooks, ch))
-    {
-      dbus_free (ch);
-      return FALSE;
-    }
+  _dbus_list_prepend_link (&transaction->cancel_hooks, link);
 
   return TRUE;
 }
@@ -2626,6 +4297,12 @@ bus_connections_get_peak_match_rules (BusConnections *connections)
   return connections->peak_match_rules;
 }
 
+int
+bus_connections_get_total_match_rule_bytes (BusConnections *connections)
+{
+  return connections->total_match_rule_bytes;
+}
+
 int
 bus_connections_get_peak_match_rules_per_conn (BusConnections *connections)
 {
@@ -2650,6 +4327,12 @@ bus_connections_get_peak_bus_names_per_conn (BusConnections *connections)
   return connections->peak_bus_names_per_conn;
 }
 
+dbus_uint32_t
+bus_connections_get_n_monitor_dropped (BusConnections *connections)
+{
+  return connections->n_monitor_dropped;
+}
+
 int
 bus_connection_get_peak_match_rules (DBusConnection *connection)
 {
@@ -2684,6 +4367,73 @@ bus_connection_is_monitor (DBusConnection *connection)
   return d->link_in_monitors != NULL;
 }
 
+/**
+ * Remembers that @p connection wants org.freedesktop.DBus.SignalInterest
+ * whenever the summary changes, until it disconnects.
+ *
+ * @param connection an active connection
+ * @returns #FALSE on OOM
+ */
+dbus_bool_t
+bus_connection_watch_signal_interest (DBusConnection *connection)
+{
+  BusConnectionData *d;
+  DBusList *link;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  if (d->link_in_signal_interest_watchers != NULL)
+    return TRUE;
+
+  link = _dbus_list_alloc_link (connection);
+
+  if (link == NULL)
+    return FALSE;
+
+  d->link_in_signal_interest_watchers = link;
+  _dbus_list_append_link (&d->connections->signal_interest_watchers, link);
+  return TRUE;
+}
+
+DBusList **
+bus_connections_get_signal_interest_watchers (BusConnections *connections)
+{
+  return &connections->signal_interest_watchers;
+}
+
+/**
+ * Gets what the last SignalInterest sent to every watcher said, as
+ * recorded by bus_connections_set_signal_interest_sent().
+ *
+ * @param connections the connections
+ * @param version return location for the matchmaker's interest version
+ * @param everything return location for whether it said everything
+ */
+void
+bus_connections_get_signal_interest_sent (BusConnections *connections,
+                                          dbus_uint32_t  *version,
+                                          dbus_bool_t    *everything)
+{
+  *version = connections->signal_interest_sent_version;
+  *everything = connections->signal_interest_sent_everything;
+}
+
+void
+bus_connections_set_signal_interest_sent (BusConnections *connections,
+                                          dbus_uint32_t   version,
+                                          dbus_bool_t     everything)
+{
+  connections->signal_interest_sent_version = version;
+  connections->signal_interest_sent_everything = everything;
+}
+
+dbus_bool_t
+bus_connections_have_monitors (BusConnections *connections)
+{
+  return connections->monitors != NULL;
+}
+
 static dbus_bool_t
 bcd_add_monitor_rules (BusConnectionData  *d,
                        DBusConnection     *connection,
@@ -2730,6 +4480,7 @@ dbus_bool_t
 bus_connection_be_monitor (DBusConnection  *connection,
                            BusTransaction  *transaction,
                            DBusList       **rules,
+                           const BusMonitorOptions *options,
                            DBusError       *error)
 {
   BusConnectionData *d;
@@ -2799,6 +4550,16 @@ bus_connection_be_monitor (DBusConnection  *connection,
       bus_matchmaker_disconnected (mm, connection);
     }
 
+  d->monitor_options = *options;
+
+  /* what a monitor sees should be in the order it happened, and
+   * dropped messages are counted in monitor_dropped instead */
+  _dbus_connection_set_max_overtaken_broadcasts (connection, 0);
+  _dbus_connection_set_broadcast_ttl (connection, 0);
+  _dbus_assert (d->monitor_options.sample_interval >= 1);
+  d->monitor_n_matched = 0;
+  d->monitor_n_this_second = 0;
+
   /* flag it as a monitor */
   d->link_in_monitors = link;
   _dbus_list_append_link (&d->connections->monitors, link);
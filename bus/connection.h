@@ -43,16 +43,37 @@ void            bus_connections_foreach           (BusConnections
 void            bus_connections_foreach_active    (BusConnections               *connections,
                                                    BusConnectionForeachFunction  function,
                                                    void                         *data);
+DBusConnection* bus_connections_get_active_after  (BusConnections               *connections,
+                                                   const char                   *unique_name,
+                                                   DBusError                    *error);
+DBusConnection* bus_connections_get_next_active   (BusConnections               *connections,
+                                                   DBusConnection               *connection);
 BusContext*     bus_connections_get_context       (BusConnections               *connections);
 void            bus_connections_increment_stamp   (BusConnections               *connections);
+dbus_bool_t     bus_connections_push_recipient    (BusConnections               *connections,
+                                                   DBusConnection               *connection);
+int             bus_connections_get_n_recipients  (BusConnections               *connections);
+DBusConnection* bus_connections_get_recipient     (BusConnections               *connections,
+                                                   int                           i);
+void            bus_connections_truncate_recipients (BusConnections             *connections,
+                                                     int                         n_recipients);
 dbus_bool_t     bus_connections_reload_policy     (BusConnections               *connections,
                                                    DBusError                    *error);
 BusContext*     bus_connection_get_context        (DBusConnection               *connection);
 BusConnections* bus_connection_get_connections    (DBusConnection               *connection);
 BusRegistry*    bus_connection_get_registry       (DBusConnection               *connection);
+DBusConnection* bus_connection_resolve_destination (DBusConnection              *connection,
+                                                    const char                  *name);
 BusActivation*  bus_connection_get_activation     (DBusConnection               *connection);
 BusMatchmaker*  bus_connection_get_matchmaker     (DBusConnection               *connection);
 const char *    bus_connection_get_loginfo        (DBusConnection        *connection);
+dbus_bool_t     bus_connection_charge_log         (DBusConnection        *connection,
+                                                   unsigned long         *n_suppressed_p);
+dbus_bool_t     bus_connection_check_deferred_body (DBusConnection       *connection,
+                                                    DBusMessage          *message);
+void            bus_connection_charge_rate_limits (DBusConnection        *connection,
+                                                   DBusMessage           *message);
+DBusMessage *   bus_connection_get_credentials_snapshot (DBusConnection *connection);
 BusSELinuxID*   bus_connection_get_selinux_id     (DBusConnection               *connection);
 BusAppArmorConfinement* bus_connection_dup_apparmor_confinement (DBusConnection *connection);
 dbus_bool_t     bus_connections_check_limits      (BusConnections               *connections,
@@ -76,29 +97,31 @@ dbus_bool_t     bus_connections_check_reply       (BusConnections
 dbus_bool_t     bus_connection_mark_stamp         (DBusConnection               *connection);
 
 dbus_bool_t bus_connection_is_active (DBusConnection *connection);
+void        bus_connection_mark_busy (DBusConnection *connection);
 const char *bus_connection_get_name  (DBusConnection *connection);
 
 dbus_bool_t bus_connection_preallocate_oom_error (DBusConnection *connection);
+void        bus_connection_return_oom_error      (DBusConnection *connection);
+void        bus_connection_hold_oom_error        (DBusConnection *connection);
+void        bus_connection_unhold_oom_error      (DBusConnection *connection);
 void        bus_connection_send_oom_error        (DBusConnection *connection,
                                                   DBusMessage    *in_reply_to);
 
 /* called by signals.c */
-dbus_bool_t bus_connection_add_match_rule      (DBusConnection *connection,
-                                                BusMatchRule   *rule);
-void        bus_connection_add_match_rule_link (DBusConnection *connection,
-                                                DBusList       *link);
-void        bus_connection_remove_match_rule   (DBusConnection *connection,
-                                                BusMatchRule   *rule);
+void        bus_connection_add_match_rule_link    (DBusConnection *connection,
+                                                   DBusList       *link);
+void        bus_connection_remove_match_rule_link (DBusConnection *connection,
+                                                   DBusList       *link);
 int         bus_connection_get_n_match_rules   (DBusConnection *connection);
+DBusList**  bus_connection_get_match_rules     (DBusConnection *connection);
+DBusList**  bus_connection_get_owned_services  (DBusConnection *connection);
 
 
 /* called by services.c */
-dbus_bool_t bus_connection_add_owned_service      (DBusConnection *connection,
-                                                   BusService     *service);
-void        bus_connection_remove_owned_service   (DBusConnection *connection,
-                                                   BusService     *service);
-void        bus_connection_add_owned_service_link (DBusConnection *connection,
-                                                   DBusList       *link);
+void        bus_connection_add_owned_service_link    (DBusConnection *connection,
+                                                      DBusList       *link);
+void        bus_connection_remove_owned_service_link (DBusConnection *connection,
+                                                      DBusList       *link);
 int         bus_connection_get_n_services_owned   (DBusConnection *connection);
 
 /* called by driver.c */
@@ -117,12 +140,34 @@ dbus_bool_t      bus_connection_get_unix_groups  (DBusConnection       *connecti
                                                   DBusError            *error);
 BusClientPolicy* bus_connection_get_policy  (DBusConnection       *connection);
 
+/** How much of the matching traffic a monitor receives */
+typedef struct
+{
+  dbus_uint32_t sample_interval;  /**< Capture one in this many matches, >= 1 */
+  dbus_uint32_t max_per_second;   /**< Capture at most this many a second, or 0 */
+  dbus_bool_t headers_only;       /**< Capture the header but not the body */
+} BusMonitorOptions;
+
+#define BUS_MONITOR_OPTIONS_INIT { 1, 0, FALSE }
+
 dbus_bool_t bus_connection_is_monitor (DBusConnection  *connection);
 dbus_bool_t bus_connection_be_monitor (DBusConnection  *connection,
                                        BusTransaction  *transaction,
                                        DBusList       **rules,
+                                       const BusMonitorOptions *options,
                                        DBusError       *error);
 
+dbus_bool_t bus_connections_have_monitors (BusConnections *connections);
+
+dbus_bool_t bus_connection_watch_signal_interest          (DBusConnection *connection);
+DBusList  **bus_connections_get_signal_interest_watchers  (BusConnections *connections);
+void        bus_connections_get_signal_interest_sent      (BusConnections *connections,
+                                                           dbus_uint32_t  *version,
+                                                           dbus_bool_t    *everything);
+void        bus_connections_set_signal_interest_sent      (BusConnections *connections,
+                                                           dbus_uint32_t   version,
+                                                           dbus_bool_t     everything);
+
 /* transaction API so we can send or not send a block of messages as a whole */
 
 typedef void (* BusTransactionCancelFunction) (void *data);
@@ -158,10 +203,12 @@ int bus_connections_get_n_incomplete              (BusConnections *connections);
 /* called by stats.c, only present if DBUS_ENABLE_STATS */
 int bus_connections_get_total_match_rules         (BusConnections *connections);
 int bus_connections_get_peak_match_rules          (BusConnections *connections);
+int bus_connections_get_total_match_rule_bytes    (BusConnections *connections);
 int bus_connections_get_peak_match_rules_per_conn (BusConnections *connections);
 int bus_connections_get_total_bus_names           (BusConnections *connections);
 int bus_connections_get_peak_bus_names            (BusConnections *connections);
 int bus_connections_get_peak_bus_names_per_conn   (BusConnections *connections);
+dbus_uint32_t bus_connections_get_n_monitor_dropped (BusConnections *connections);
 
 int bus_connection_get_peak_match_rules           (DBusConnection *connection);
 int bus_connection_get_peak_bus_names             (DBusConnection *connection);
@@ -48,6 +48,7 @@ struct BusDesktopFile
   int n_sections;
   BusDesktopFileSection *sections;
   int n_allocated_sections;
+  unsigned long mtime; /**< Modification time of the file when it was loaded */
 };
 
 /**
@@ -457,7 +458,6 @@ parse_key_value (BusDesktopFileParser *parser, DBusError *error)
   int value_start;
   int p;
   char *value, *tmp;
-  DBusString key;
   BusDesktopFileLine *line;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
@@ -535,35 +535,21 @@ parse_key_value (BusDesktopFileParser *parser, DBusError *error)
       return FALSE;
     }
   
-  if (!_dbus_string_init (&key))
+  /* Keys were checked with VALID_KEY_CHAR, so no unescaping is needed */
+  tmp = dbus_malloc (key_end - key_start + 1);
+  if (tmp == NULL)
     {
       dbus_free (value);
       parser_free (parser);
       BUS_SET_OOM (error);
       return FALSE;
     }
-  
-  if (!_dbus_string_copy_len (&parser->data, key_start, key_end - key_start,
-                              &key, 0))
-    {
-      _dbus_string_free (&key);
-      dbus_free (value);
-      parser_free (parser);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-  
-  if (!_dbus_string_steal_data (&key, &tmp))
-    {
-      _dbus_string_free (&key);
-      dbus_free (value);
-      parser_free (parser);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-  
-  _dbus_string_free (&key);
-  
+
+  memcpy (tmp, _dbus_string_get_const_data_len (&parser->data, key_start,
+                                                key_end - key_start),
+          key_end - key_start);
+  tmp[key_end - key_start] = '\0';
+
   line->key = tmp;
   line->value = value;
 
@@ -624,6 +610,7 @@ bus_desktop_file_load (DBusString *filename,
 		       DBusError  *error)
 {
   DBusString str;
+  unsigned char str_storage[512];
   BusDesktopFileParser parser;
   DBusStat sb;
 
@@ -642,11 +629,8 @@ bus_desktop_file_load (DBusString *filename,
       return NULL;
     }
   
-  if (!_dbus_string_init (&str))
-    {
-      BUS_SET_OOM (error);
-      return NULL;
-    }
+  /* service files are usually a few hundred bytes */
+  _dbus_string_init_borrowed (&str, str_storage, sizeof (str_storage));
   
   if (!_dbus_file_get_contents (&str, filename, error))
     {
@@ -670,6 +654,8 @@ bus_desktop_file_load (DBusString *filename,
       return NULL;
     }
   
+  parser.desktop_file->mtime = sb.mtime;
+
   parser.data = str;
   parser.line_num = 1;
   parser.pos = 0;
@@ -708,6 +694,147 @@ bus_desktop_file_load (DBusString *filename,
   return parser.desktop_file;
 }
 
+/**
+ * Finds one string in a desktop file without building a
+ * #BusDesktopFile, for callers that need a single key out of many
+ * files. The first line for the key in the first section of that name
+ * is used, as bus_desktop_file_get_string() would, but the rest of the
+ * file is not checked, so a file this accepts can still fail
+ * bus_desktop_file_load(). Values with escapes are not decoded here;
+ * they are reported as #DBUS_ERROR_FAILED, like a missing key, and the
+ * caller should load the file instead.
+ *
+ * @param filename the file to read
+ * @param section_name the section
+ * @param keyname the key
+ * @param val return location for the value, to be freed with dbus_free()
+ * @param mtime return location for the file's modification time
+ * @param error return location for an error
+ * @returns #FALSE if the value was not found or an error occurred
+ */
+dbus_bool_t
+bus_desktop_file_scan_string (DBusString    *filename,
+                              const char    *section_name,
+                              const char    *keyname,
+                              char         **val,
+                              unsigned long *mtime,
+                              DBusError     *error)
+{
+  DBusString str;
+  unsigned char str_storage[512];
+  DBusStat sb;
+  int section_len, key_len;
+  int pos, len, line_end, eol_len;
+  dbus_bool_t in_section;
+  const char *data;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  *val = NULL;
+
+  if (!_dbus_stat (filename, &sb, error))
+    return FALSE;
+
+  if (sb.size > _DBUS_ONE_KILOBYTE * 128)
+    {
+      dbus_set_error (error, DBUS_ERROR_FAILED,
+                      "Desktop file size (%ld bytes) is too large", (long) sb.size);
+      return FALSE;
+    }
+
+  _dbus_string_init_borrowed (&str, str_storage, sizeof (str_storage));
+
+  if (!_dbus_file_get_contents (&str, filename, error))
+    {
+      _dbus_string_free (&str);
+      return FALSE;
+    }
+
+  section_len = strlen (section_name);
+  key_len = strlen (keyname);
+  data = _dbus_string_get_const_data (&str);
+  len = _dbus_string_get_length (&str);
+  in_section = FALSE;
+  pos = 0;
+
+  while (pos < len)
+    {
+      if (!_dbus_string_find_eol (&str, pos, &line_end, &eol_len))
+        line_end = len;
+
+      if (data[pos] == '[')
+        {
+          /* only the first section of that name counts */
+          if (in_section)
+            break;
+
+          in_section = (line_end - pos == section_len + 2 &&
+                        data[line_end - 1] == ']' &&
+                        memcmp (data + pos + 1, section_name, section_len) == 0);
+        }
+      else if (in_section &&
+               line_end - pos > key_len &&
+               memcmp (data + pos, keyname, key_len) == 0)
+        {
+          int p = pos + key_len;
+
+          while (p < line_end && data[p] == ' ')
+            p++;
+
+          if (p < line_end && data[p] == '=')
+            {
+              p++;
+
+              while (p < line_end && data[p] == ' ')
+                p++;
+
+              if (memchr (data + p, '\\', line_end - p) != NULL ||
+                  memchr (data + p, '\0', line_end - p) != NULL ||
+                  !_dbus_string_validate_utf8 (&str, p, line_end - p))
+                break;
+
+              *val = dbus_malloc (line_end - p + 1);
+              if (*val == NULL)
+                {
+                  _dbus_string_free (&str);
+                  BUS_SET_OOM (error);
+                  return FALSE;
+                }
+
+              memcpy (*val, data + p, line_end - p);
+              (*val)[line_end - p] = '\0';
+              *mtime = sb.mtime;
+
+              _dbus_string_free (&str);
+              return TRUE;
+            }
+        }
+
+      if (line_end == len)
+        break;
+
+      pos = line_end + eol_len;
+    }
+
+  _dbus_string_free (&str);
+  dbus_set_error (error, DBUS_ERROR_FAILED,
+                  "No plain \"%s\" key in .service file\n", keyname);
+  return FALSE;
+}
+
+/**
+ * Returns the modification time the file had when it was loaded, so
+ * that callers need not stat() it again.
+ *
+ * @param desktop_file the loaded file
+ * @returns the mtime in seconds
+ */
+unsigned long
+bus_desktop_file_get_mtime (BusDesktopFile *desktop_file)
+{
+  return desktop_file->mtime;
+}
+
 static BusDesktopFileSection *
 lookup_section (BusDesktopFile *desktop_file,
 		const char     *section_name)
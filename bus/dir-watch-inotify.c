@@ -39,6 +39,7 @@
 #include <dbus/dbus-internals.h>
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-sysdeps-unix.h>
+#include <dbus/dbus-timeout.h>
 #include <dbus/dbus-watch.h>
 #include "dir-watch.h"
 
@@ -46,6 +47,10 @@
 #define INOTIFY_EVENT_SIZE (sizeof(struct inotify_event))
 #define INOTIFY_BUF_LEN (1024 * (INOTIFY_EVENT_SIZE + 16))
 
+/* Changes that keep coming are reloaded at the latest this many times
+ * the reload delay after the first of them */
+#define MAX_RELOAD_DELAYS 8
+
 /* use a static array to avoid handling OOM */
 static int wds[MAX_DIRS_TO_WATCH];
 static char *dirs[MAX_DIRS_TO_WATCH];
@@ -53,6 +58,93 @@ static int num_wds = 0;
 static int inotify_fd = -1;
 static DBusWatch *watch = NULL;
 static DBusLoop *loop = NULL;
+static BusContext *watch_context = NULL;
+
+/* Changes are collected until the directories have been quiet for the
+ * reload delay, and then reloaded together */
+static DBusTimeout *reload_timeout = NULL;
+static dbus_bool_t reload_pending = FALSE;
+static dbus_bool_t reload_config_pending = FALSE; /* not just service files */
+static long reload_first_sec, reload_first_usec;
+
+static void
+_reload_now (void)
+{
+  if (reload_config_pending)
+    {
+      _dbus_verbose ("Sending SIGHUP signal for changed configuration\n");
+      (void) kill (_dbus_getpid (), SIGHUP);
+    }
+  else
+    {
+      DBusError error = DBUS_ERROR_INIT;
+
+      /* only service files changed: there's no need to parse the
+       * configuration and recompile every connection's policy */
+      if (!bus_context_reload_service_files (watch_context, &error))
+        dbus_error_free (&error);
+    }
+
+  reload_pending = FALSE;
+  reload_config_pending = FALSE;
+}
+
+static dbus_bool_t
+_handle_reload_timeout (void *data)
+{
+  _dbus_timeout_set_enabled (reload_timeout, FALSE);
+  _dbus_loop_toggle_timeout (loop, reload_timeout);
+
+  _reload_now ();
+  return TRUE;
+}
+
+static void
+_schedule_reload (void)
+{
+  long delay, now_sec, now_usec, interval;
+
+  delay = bus_context_get_reload_delay (watch_context);
+
+  if (delay <= 0 || reload_timeout == NULL)
+    {
+      _reload_now ();
+      return;
+    }
+
+  _dbus_get_monotonic_time (&now_sec, &now_usec);
+
+  if (!reload_pending)
+    {
+      reload_pending = TRUE;
+      reload_first_sec = now_sec;
+      reload_first_usec = now_usec;
+      interval = delay;
+    }
+  else
+    {
+      /* wait for the directories to be quiet again, but don't put off
+       * a stream of changes forever */
+      interval = delay * MAX_RELOAD_DELAYS -
+        ((now_sec - reload_first_sec) * 1000 +
+         (now_usec - reload_first_usec) / 1000);
+
+      if (interval <= 0)
+        {
+          _dbus_timeout_set_enabled (reload_timeout, FALSE);
+          _dbus_loop_toggle_timeout (loop, reload_timeout);
+          _reload_now ();
+          return;
+        }
+
+      interval = MIN (interval, delay);
+    }
+
+  /* toggling starts the interval again from now */
+  _dbus_timeout_set_interval (reload_timeout, interval);
+  _dbus_timeout_set_enabled (reload_timeout, TRUE);
+  _dbus_loop_toggle_timeout (loop, reload_timeout);
+}
 
 static dbus_bool_t
 _handle_inotify_watch (DBusWatch *passed_watch, unsigned int flags, void *data)
@@ -63,28 +155,54 @@ _handle_inotify_watch (DBusWatch *passed_watch, unsigned int flags, void *data)
 
   ret = read (inotify_fd, buffer, INOTIFY_BUF_LEN);
   if (ret < 0)
-    _dbus_verbose ("Error reading inotify event: '%s'\n", _dbus_strerror(errno));
+    {
+      _dbus_verbose ("Error reading inotify event: '%s'\n", _dbus_strerror(errno));
+      return TRUE;
+    }
   else if (!ret)
-    _dbus_verbose ("Error reading inotify event: buffer too small\n");
-  else
     {
-      _dbus_verbose ("Sending SIGHUP signal on reception of %ld inotify event(s)\n", (long) ret);
-      (void) kill (_dbus_getpid (), SIGHUP);
+      _dbus_verbose ("Error reading inotify event: buffer too small\n");
+      return TRUE;
     }
 
-#ifdef DBUS_ENABLE_VERBOSE_MODE
+  _dbus_verbose ("Reloading on reception of %ld inotify event(s)\n", (long) ret);
+
   while (i < ret)
     {
       struct inotify_event *ev;
+      int j;
 
       ev = (struct inotify_event *) &buffer[i];
       i += INOTIFY_EVENT_SIZE + ev->len;
       if (ev->len)
         _dbus_verbose ("event name: '%s'\n", ev->name);
       _dbus_verbose ("inotify event: wd=%d mask=%u cookie=%u len=%u\n", ev->wd, ev->mask, ev->cookie, ev->len);
-    }
+
+      if (reload_config_pending)
+        continue;
+
+#ifdef IN_Q_OVERFLOW
+      /* events may have been lost, so anything may have changed */
+      if (ev->mask & IN_Q_OVERFLOW)
+        {
+          reload_config_pending = TRUE;
+          continue;
+        }
 #endif
 
+      for (j = 0; j < num_wds; j++)
+        {
+          if (wds[j] == ev->wd)
+            break;
+        }
+
+      if (j == num_wds || dirs[j] == NULL ||
+          !bus_context_is_service_only_dir (watch_context, dirs[j]))
+        reload_config_pending = TRUE;
+    }
+
+  _schedule_reload ();
+
   return TRUE;
 }
 
@@ -201,6 +319,15 @@ _shutdown_inotify (void *data)
 
   _set_watched_dirs_internal (&empty);
 
+  if (reload_timeout != NULL)
+    {
+      _dbus_loop_remove_timeout (loop, reload_timeout);
+      _dbus_timeout_unref (reload_timeout);
+      reload_timeout = NULL;
+    }
+  reload_pending = FALSE;
+  reload_config_pending = FALSE;
+
   if (watch != NULL)
     {
       _dbus_loop_remove_watch (loop, watch);
@@ -210,6 +337,7 @@ _shutdown_inotify (void *data)
     }
   watch = NULL;
   loop = NULL;
+  watch_context = NULL;
 
   close (inotify_fd);
   inotify_fd = -1;
@@ -244,6 +372,7 @@ _init_inotify (BusContext *context)
 
       loop = bus_context_get_loop (context);
       _dbus_loop_ref (loop);
+      watch_context = context;
 
       watch = _dbus_watch_new (inotify_fd, DBUS_WATCH_READABLE, TRUE,
                                _handle_inotify_watch, NULL, NULL);
@@ -262,6 +391,19 @@ _init_inotify (BusContext *context)
           goto out;
         }
 
+      /* without it we reload after every change, as we used to */
+      reload_timeout = _dbus_timeout_new (100, /* irrelevant */
+                                          _handle_reload_timeout, NULL, NULL);
+      if (reload_timeout != NULL)
+        {
+          _dbus_timeout_set_enabled (reload_timeout, FALSE);
+          if (!_dbus_loop_add_timeout (loop, reload_timeout))
+            {
+              _dbus_timeout_unref (reload_timeout);
+              reload_timeout = NULL;
+            }
+        }
+
       if (!_dbus_register_shutdown_func (_shutdown_inotify, NULL))
       {
           _dbus_warn ("Unable to register shutdown func");
@@ -31,10 +31,16 @@
 #include "activation.h"
 #include "utils.h"
 #include "bus.h"
+#include "config-parser.h"
+#include "policy.h"
 #include "signals.h"
+#include "stats.h"
 #include "test.h"
+#include <dbus/dbus-connection-internal.h>
+#include <dbus/dbus-file.h>
 #include <dbus/dbus-internals.h>
 #include <dbus/dbus-misc.h>
+#include <dbus/dbus-trace.h>
 #include <string.h>
 
 #ifdef HAVE_UNIX_FD_PASSING
@@ -125,10 +131,14 @@ bus_dispatch_matches (BusTransaction *transaction,
 {
   DBusError tmp_error;
   BusConnections *connections;
-  DBusList *recipients;
   BusMatchmaker *matchmaker;
-  DBusList *link;
+  int first, last, i;
   BusContext *context;
+  dbus_bool_t found;
+  DBusPhase old_phase;
+#ifdef DBUS_ENABLE_STATS
+  long tv_sec, tv_usec;
+#endif
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
@@ -170,34 +180,60 @@ bus_dispatch_matches (BusTransaction *transaction,
     }
 
   /* Now dispatch to others who look interested in this message */
+  matchmaker = bus_context_get_matchmaker (context);
+
+  /* Only eavesdroppers can be interested in a message with a
+   * destination, and nowadays there are hardly ever any */
+  if (dbus_message_get_destination (message) != NULL &&
+      !bus_matchmaker_has_eavesdroppers (matchmaker))
+    return TRUE;
+
   connections = bus_context_get_connections (context);
   dbus_error_init (&tmp_error);
-  matchmaker = bus_context_get_matchmaker (context);
 
-  recipients = NULL;
-  if (!bus_matchmaker_get_recipients (matchmaker, connections,
-                                      sender, addressed_recipient, message,
-                                      &recipients))
+  first = bus_connections_get_n_recipients (connections);
+
+#ifdef DBUS_ENABLE_STATS
+  _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+#endif
+
+  old_phase = _dbus_phase_enter (DBUS_PHASE_MATCHMAKER);
+  found = bus_matchmaker_get_recipients (matchmaker, connections,
+                                         sender, addressed_recipient, message);
+  _dbus_phase_leave (old_phase);
+
+#ifdef DBUS_ENABLE_STATS
+  bus_latency_histogram_record (
+      bus_context_get_latency_histogram (context, BUS_LATENCY_MATCHMAKER),
+      tv_sec, tv_usec);
+#endif
+
+  if (!found)
     {
       BUS_SET_OOM (error);
       return FALSE;
     }
 
-  link = _dbus_list_get_first_link (&recipients);
-  while (link != NULL)
+  last = bus_connections_get_n_recipients (connections);
+
+  /* A broadcast body the loader left unvalidated is checked once it
+   * turns out somebody will receive it */
+  if (last > first &&
+      !bus_connection_check_deferred_body (sender, message))
+    last = first;
+
+  for (i = first; i < last; i++)
     {
       DBusConnection *dest;
 
-      dest = link->data;
+      dest = bus_connections_get_recipient (connections, i);
 
       if (!send_one_message (dest, context, sender, addressed_recipient,
                              message, transaction, &tmp_error))
         break;
-
-      link = _dbus_list_get_next_link (&recipients, link);
     }
 
-  _dbus_list_clear (&recipients);
+  bus_connections_truncate_recipients (connections, first);
 
   if (dbus_error_is_set (&tmp_error))
     {
@@ -218,6 +254,11 @@ bus_dispatch (DBusConnection *connection,
   BusContext *context;
   DBusHandlerResult result;
   DBusConnection *addressed_recipient;
+#ifdef DBUS_ENABLE_STATS
+  long tv_sec, tv_usec;
+
+  _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+#endif
 
   result = DBUS_HANDLER_RESULT_HANDLED;
 
@@ -228,12 +269,19 @@ bus_dispatch (DBusConnection *connection,
   context = bus_connection_get_context (connection);
   _dbus_assert (context != NULL);
 
+  _DBUS_TRACE3 (dispatch__start,
+                dbus_message_get_serial (message),
+                bus_connection_get_name (connection),
+                dbus_message_get_type (message));
+
   /* If we can't even allocate an OOM error, we just go to sleep
    * until we can.
    */
   while (!bus_connection_preallocate_oom_error (connection))
     _dbus_wait_for_memory ();
 
+  bus_connection_mark_busy (connection);
+
   /* Ref connection in case we disconnect it at some point in here */
   dbus_connection_ref (connection);
 
@@ -285,22 +333,25 @@ bus_dispatch (DBusConnection *connection,
         }
     }
 
+  bus_connection_charge_rate_limits (connection, message);
+
   service_name = dbus_message_get_destination (message);
 
 #ifdef DBUS_ENABLE_VERBOSE_MODE
-  {
-    const char *interface_name, *member_name, *error_name;
+  if (_dbus_is_verbose ())
+    {
+      const char *interface_name, *member_name, *error_name;
 
-    interface_name = dbus_message_get_interface (message);
-    member_name = dbus_message_get_member (message);
-    error_name = dbus_message_get_error_name (message);
+      interface_name = dbus_message_get_interface (message);
+      member_name = dbus_message_get_member (message);
+      error_name = dbus_message_get_error_name (message);
 
-    _dbus_verbose ("DISPATCH: %s %s %s to %s\n",
-                   interface_name ? interface_name : "(no interface)",
-                   member_name ? member_name : "(no member)",
-                   error_name ? error_name : "(no error name)",
-                   service_name ? service_name : "peer");
-  }
+      _dbus_verbose ("DISPATCH: %s %s %s to %s\n",
+                     interface_name ? interface_name : "(no interface)",
+                     member_name ? member_name : "(no member)",
+                     error_name ? error_name : "(no error name)",
+                     service_name ? service_name : "peer");
+    }
 #endif /* DBUS_ENABLE_VERBOSE_MODE */
 
   /* If service_name is NULL, if it's a signal we send it to all
@@ -370,6 +421,18 @@ bus_dispatch (DBusConnection *connection,
    */
   service_name = dbus_message_get_destination (message);
 
+#ifdef DBUS_ENABLE_STATS
+  bus_top_talkers_record (bus_context_get_top_talkers (context), message);
+#endif
+
+  /* A message with a destination is read by the driver or delivered
+   * almost every time, so there is nothing to gain by checking a body
+   * the loader left unvalidated any later; broadcasts are checked in
+   * bus_dispatch_matches() */
+  if (service_name != NULL &&
+      !bus_connection_check_deferred_body (connection, message))
+    goto out;
+
   if (!bus_transaction_capture (transaction, connection, message))
     {
       BUS_SET_OOM (&error);
@@ -398,18 +461,12 @@ bus_dispatch (DBusConnection *connection,
     }
   else if (service_name != NULL) /* route to named service */
     {
-      DBusString service_string;
-      BusService *service;
-      BusRegistry *registry;
-
       _dbus_assert (service_name != NULL);
 
-      registry = bus_connection_get_registry (connection);
-
-      _dbus_string_init_const (&service_string, service_name);
-      service = bus_registry_lookup (registry, &service_string);
+      addressed_recipient = bus_connection_resolve_destination (connection,
+                                                                service_name);
 
-      if (service == NULL && dbus_message_get_auto_start (message))
+      if (addressed_recipient == NULL && dbus_message_get_auto_start (message))
         {
           BusActivation *activation;
           /* We can't do the security policy check here, since the addressed
@@ -428,7 +485,7 @@ bus_dispatch (DBusConnection *connection,
 
           goto out;
         }
-      else if (service == NULL)
+      else if (addressed_recipient == NULL)
         {
           dbus_set_error (&error,
                           DBUS_ERROR_NAME_HAS_NO_OWNER,
@@ -436,11 +493,6 @@ bus_dispatch (DBusConnection *connection,
                           service_name);
           goto out;
         }
-      else
-        {
-          addressed_recipient = bus_service_get_primary_owners_connection (service);
-          _dbus_assert (addressed_recipient != NULL);
-        }
     }
 
   /* Now send the message to its destination (or not, if
@@ -494,8 +546,19 @@ bus_dispatch (DBusConnection *connection,
   if (transaction != NULL)
     {
       bus_transaction_execute_and_free (transaction);
+
+#ifdef DBUS_ENABLE_STATS
+      bus_latency_histogram_record (
+          bus_context_get_latency_histogram (context, BUS_LATENCY_ROUTING),
+          tv_sec, tv_usec);
+#endif
     }
 
+  _DBUS_TRACE2 (dispatch__done,
+                dbus_message_get_serial (message),
+                bus_connection_get_name (connection));
+
+  bus_connection_return_oom_error (connection);
   dbus_connection_unref (connection);
 
   return result;
@@ -506,7 +569,14 @@ bus_dispatch_message_filter (DBusConnection     *connection,
                              DBusMessage        *message,
                              void               *user_data)
 {
-  return bus_dispatch (connection, message);
+  DBusHandlerResult result;
+  DBusPhase old_phase;
+
+  old_phase = _dbus_phase_enter (DBUS_PHASE_TRANSACTION);
+  result = bus_dispatch (connection, message);
+  _dbus_phase_leave (old_phase);
+
+  return result;
 }
 
 dbus_bool_t
@@ -1637,8 +1707,10 @@ check_add_match (BusContext     *context,
  * but the correct thing may include OOM errors.
  */
 static dbus_bool_t
-check_get_all_match_rules (BusContext     *context,
-                           DBusConnection *connection)
+check_stats_method (BusContext     *context,
+                    DBusConnection *connection,
+                    const char     *method,
+                    const char     *reply_signature)
 {
   DBusMessage *message;
   dbus_bool_t retval;
@@ -1649,17 +1721,58 @@ check_get_all_match_rules (BusContext     *context,
   dbus_error_init (&error);
   message = NULL;
 
-  _dbus_verbose ("check_get_all_match_rules for connection %p\n",
-                 connection);
+  _dbus_verbose ("check_stats_method (%s) for connection %p\n",
+                 method, connection);
 
   message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
                                           DBUS_PATH_DBUS,
                                           BUS_INTERFACE_STATS,
-                                          "GetAllMatchRules");
+                                          method);
 
   if (message == NULL)
     return TRUE;
 
+  if (strcmp (method, "GetAllConnectionStats") == 0)
+    {
+      dbus_uint32_t fields = 0;
+
+      if (!dbus_message_append_args (message,
+                                     DBUS_TYPE_UINT32, &fields,
+                                     DBUS_TYPE_INVALID))
+        {
+          dbus_message_unref (message);
+          return TRUE;
+        }
+    }
+  else if (strcmp (method, "SetPhaseTiming") == 0)
+    {
+      dbus_bool_t enabled = TRUE;
+
+      if (!dbus_message_append_args (message,
+                                     DBUS_TYPE_BOOLEAN, &enabled,
+                                     DBUS_TYPE_INVALID))
+        {
+          dbus_message_unref (message);
+          return TRUE;
+        }
+    }
+  /* the paged methods; ask for the first page, of the default size */
+  else if (strcmp (method, "GetMatchRulesPaged") == 0 ||
+           strcmp (method, "ListNamesPaged") == 0)
+    {
+      const char *cursor = "";
+      dbus_uint32_t max_bytes = 0;
+
+      if (!dbus_message_append_args (message,
+                                     DBUS_TYPE_STRING, &cursor,
+                                     DBUS_TYPE_UINT32, &max_bytes,
+                                     DBUS_TYPE_INVALID))
+        {
+          dbus_message_unref (message);
+          return TRUE;
+        }
+    }
+
   if (!dbus_connection_send (connection, message, &serial))
     {
       dbus_message_unref (message);
@@ -1730,7 +1843,8 @@ check_get_all_match_rules (BusContext     *context,
     }
   else
     {
-      if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_METHOD_RETURN)
+      if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_METHOD_RETURN &&
+          dbus_message_has_signature (message, reply_signature))
         {
           ; /* good, expected */
           _dbus_assert (dbus_message_get_reply_serial (message) == serial);
@@ -3182,12 +3296,13 @@ check_existent_hello_from_self (BusContext     *context,
  * but the correct thing may include OOM errors.
  */
 static dbus_bool_t
-check_existent_ping (BusContext     *context,
-                     DBusConnection *connection)
+check_ping (BusContext     *context,
+            DBusConnection *connection,
+            const char     *destination)
 {
   DBusMessage *message;
   dbus_uint32_t serial;
-  message = dbus_message_new_method_call (EXISTENT_SERVICE_NAME,
+  message = dbus_message_new_method_call (destination,
                                           "/org/freedesktop/TestSuite",
                                           "org.freedesktop.DBus.Peer",
                                           "Ping");
@@ -3225,6 +3340,13 @@ check_existent_ping (BusContext     *context,
       return FALSE;
     }
 
+  /* The bus driver answers Peer methods itself */
+  if (dbus_message_is_error (message, DBUS_ERROR_NO_MEMORY))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
   if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
     {
       _dbus_warn ("Unexpected message return during Ping\n");
@@ -3242,14 +3364,15 @@ check_existent_ping (BusContext     *context,
  * but the correct thing may include OOM errors.
  */
 static dbus_bool_t
-check_existent_get_machine_id (BusContext     *context,
-                               DBusConnection *connection)
+check_get_machine_id (BusContext     *context,
+                      DBusConnection *connection,
+                      const char     *destination)
 {
   DBusMessage *message;
   dbus_uint32_t serial;
   const char *machine_id;
 
-  message = dbus_message_new_method_call (EXISTENT_SERVICE_NAME,
+  message = dbus_message_new_method_call (destination,
                                           "/org/freedesktop/TestSuite",
                                           "org.freedesktop.DBus.Peer",
                                           "GetMachineId");
@@ -3287,6 +3410,12 @@ check_existent_get_machine_id (BusContext     *context,
       return FALSE;
     }
 
+  if (dbus_message_is_error (message, DBUS_ERROR_NO_MEMORY))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
   if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
     {
       _dbus_warn ("Unexpected message return during GetMachineId\n");
@@ -3319,6 +3448,34 @@ check_existent_get_machine_id (BusContext     *context,
   return TRUE;
 }
 
+static dbus_bool_t
+check_existent_ping (BusContext     *context,
+                     DBusConnection *connection)
+{
+  return check_ping (context, connection, EXISTENT_SERVICE_NAME);
+}
+
+static dbus_bool_t
+check_existent_get_machine_id (BusContext     *context,
+                               DBusConnection *connection)
+{
+  return check_get_machine_id (context, connection, EXISTENT_SERVICE_NAME);
+}
+
+static dbus_bool_t
+check_driver_ping (BusContext     *context,
+                   DBusConnection *connection)
+{
+  return check_ping (context, connection, DBUS_SERVICE_DBUS);
+}
+
+static dbus_bool_t
+check_driver_get_machine_id (BusContext     *context,
+                             DBusConnection *connection)
+{
+  return check_get_machine_id (context, connection, DBUS_SERVICE_DBUS);
+}
+
 /* returns TRUE if the correct thing happens,
  * but the correct thing may include OOM errors.
  */
@@ -4717,172 +4874,726 @@ setenv_TEST_LAUNCH_HELPER_CONFIG(const DBusString *test_data_dir,
   return TRUE;
 }
 
+/* Returns the bus side of @client, which must have said Hello */
+static DBusConnection *
+get_server_side (BusContext     *context,
+                 DBusConnection *client)
+{
+  DBusString name;
+  BusService *service;
+
+  _dbus_string_init_const (&name, dbus_bus_get_unique_name (client));
+  service = bus_registry_lookup (bus_context_get_registry (context), &name);
+  _dbus_assert (service != NULL);
+
+  return bus_service_get_primary_owners_connection (service);
+}
+
+/* Rules that name a unique name as sender or destination must go away
+ * when that name's owner disconnects, even though they belong to
+ * someone else.
+ */
 static dbus_bool_t
-bus_dispatch_test_conf (const DBusString *test_data_dir,
-		        const char       *filename,
-		        dbus_bool_t       use_launcher)
+check_rules_naming_peer_dropped (BusContext     *context,
+                                 DBusConnection *connection)
 {
-  BusContext *context;
-  DBusConnection *foo;
-  DBusConnection *bar;
-  DBusConnection *baz;
+  DBusConnection *peer;
+  DBusConnection *server_side;
   DBusError error;
-
-  /* save the config name for the activation helper */
-  if (!setenv_TEST_LAUNCH_HELPER_CONFIG (test_data_dir, filename))
-    _dbus_assert_not_reached ("no memory setting TEST_LAUNCH_HELPER_CONFIG");
+  DBusString rule;
+  dbus_bool_t retval;
+  int n_rules;
 
   dbus_error_init (&error);
+  retval = FALSE;
 
-  context = bus_context_new_test (test_data_dir, filename);
-  if (context == NULL)
-    return FALSE;
-
-  foo = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
-  if (foo == NULL)
+  peer = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
+  if (peer == NULL)
     _dbus_assert_not_reached ("could not alloc connection");
 
-  if (!bus_setup_debug_client (foo))
+  if (!bus_setup_debug_client (peer))
     _dbus_assert_not_reached ("could not set up connection");
 
-  spin_connection_until_authenticated (context, foo);
+  spin_connection_until_authenticated (context, peer);
 
-  if (!check_hello_message (context, foo))
+  if (!check_hello_message (context, peer))
     _dbus_assert_not_reached ("hello message failed");
 
-  if (!check_double_hello_message (context, foo))
-    _dbus_assert_not_reached ("double hello message failed");
+  server_side = get_server_side (context, connection);
+  n_rules = bus_connection_get_n_match_rules (server_side);
 
-  if (!check_add_match (context, foo, ""))
-    _dbus_assert_not_reached ("AddMatch message failed");
+  if (!_dbus_string_init (&rule))
+    _dbus_assert_not_reached ("no memory for match rule");
 
-  bar = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
-  if (bar == NULL)
-    _dbus_assert_not_reached ("could not alloc connection");
+  if (!_dbus_string_append_printf (&rule, "sender='%s'",
+                                   dbus_bus_get_unique_name (peer)))
+    _dbus_assert_not_reached ("no memory for match rule");
 
-  if (!bus_setup_debug_client (bar))
-    _dbus_assert_not_reached ("could not set up connection");
+  if (!check_add_match (context, connection,
+                        _dbus_string_get_const_data (&rule)))
+    goto out;
 
-  spin_connection_until_authenticated (context, bar);
+  _dbus_string_set_length (&rule, 0);
+  if (!_dbus_string_append_printf (&rule, "type='signal',destination='%s'",
+                                   dbus_bus_get_unique_name (peer)))
+    _dbus_assert_not_reached ("no memory for match rule");
 
-  if (!check_hello_message (context, bar))
-    _dbus_assert_not_reached ("hello message failed");
+  if (!check_add_match (context, connection,
+                        _dbus_string_get_const_data (&rule)))
+    goto out;
 
-  if (!check_add_match (context, bar, ""))
-    _dbus_assert_not_reached ("AddMatch message failed");
+  _dbus_assert (bus_connection_get_n_match_rules (server_side) ==
+                n_rules + 2);
 
-  baz = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
-  if (baz == NULL)
-    _dbus_assert_not_reached ("could not alloc connection");
+  kill_client_connection (context, peer);
 
-  if (!bus_setup_debug_client (baz))
-    _dbus_assert_not_reached ("could not set up connection");
+  if (bus_connection_get_n_match_rules (server_side) != n_rules)
+    {
+      _dbus_warn ("%d match rules naming a disconnected peer were left\n",
+                  bus_connection_get_n_match_rules (server_side) - n_rules);
+      goto out;
+    }
 
-  spin_connection_until_authenticated (context, baz);
+  retval = TRUE;
 
-  if (!check_hello_message (context, baz))
-    _dbus_assert_not_reached ("hello message failed");
+ out:
+  _dbus_string_free (&rule);
+  return retval;
+}
 
-  if (!check_add_match (context, baz, ""))
-    _dbus_assert_not_reached ("AddMatch message failed");
+/* Sends AddMatches or RemoveMatches with @rules and returns the reply,
+ * or #NULL if there was no memory to send the call or the bus
+ * disconnected us */
+static DBusMessage *
+call_match_batch (BusContext        *context,
+                  DBusConnection    *connection,
+                  const char        *method,
+                  const char *const *rules,
+                  int                n_rules)
+{
+  DBusMessage *message;
+  dbus_uint32_t serial;
 
-  if (!check_add_match (context, baz, "interface='com.example'"))
-    _dbus_assert_not_reached ("AddMatch message failed");
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          method);
 
-#ifdef DBUS_ENABLE_STATS
-  if (!check_get_all_match_rules (context, baz))
-    _dbus_assert_not_reached ("GetAllMatchRules message failed");
-#endif
+  if (message == NULL)
+    return NULL;
 
-#ifdef DBUS_WIN_FIXME
-  _dbus_warn("TODO: testing of GetConnectionUnixUser message skipped for now\n");
-  _dbus_warn("TODO: testing of GetConnectionUnixProcessID message skipped for now\n");
-#else
-  if (!check_get_connection_unix_user (context, baz))
-    _dbus_assert_not_reached ("GetConnectionUnixUser message failed");
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+                                 &rules, n_rules,
+                                 DBUS_TYPE_INVALID) ||
+      !dbus_connection_send (connection, message, &serial))
+    {
+      dbus_message_unref (message);
+      return NULL;
+    }
 
-  if (!check_get_connection_unix_process_id (context, baz))
-    _dbus_assert_not_reached ("GetConnectionUnixProcessID message failed");
-#endif
+  dbus_message_unref (message);
 
-  if (!check_list_services (context, baz))
-    _dbus_assert_not_reached ("ListActivatableNames message failed");
+  bus_test_run_clients_loop (SEND_PENDING (connection));
+  block_connection_until_message_from_bus (context, connection, method);
 
-  if (!check_no_leftovers (context))
+  if (!dbus_connection_get_is_connected (connection))
     {
-      _dbus_warn ("Messages were left over after setting up initial connections\n");
-      _dbus_assert_not_reached ("initial connection setup failed");
+      _dbus_verbose ("connection was disconnected\n");
+      return NULL;
     }
 
-  check1_try_iterations (context, "create_and_hello",
-                         check_hello_connection);
-
-  check2_try_iterations (context, foo, "nonexistent_service_no_auto_start",
-                         check_nonexistent_service_no_auto_start);
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    _dbus_assert_not_reached ("no reply to a batch of match rules");
 
-#ifdef DBUS_WIN_FIXME
-  _dbus_warn("TODO: dispatch.c segfault_service_no_auto_start test\n");
-#else
-  check2_try_iterations (context, foo, "segfault_service_no_auto_start",
-                         check_segfault_service_no_auto_start);
-#endif
+  verbose_message_received (connection, message);
+  _dbus_assert (dbus_message_has_sender (message, DBUS_SERVICE_DBUS));
+  _dbus_assert (dbus_message_get_reply_serial (message) == serial);
 
-  check2_try_iterations (context, foo, "existent_service_no_auto_start",
-                         check_existent_service_no_auto_start);
+  return message;
+}
 
-  check2_try_iterations (context, foo, "nonexistent_service_auto_start",
-                         check_nonexistent_service_auto_start);
+/* Checks that @reply is the error @name, and frees it */
+static void
+assert_batch_error (DBusMessage *reply,
+                    const char  *name)
+{
+  _dbus_assert (reply != NULL);
 
+  if (!dbus_message_is_error (reply, name))
+    {
+      _dbus_warn ("expected %s, got %s\n", name,
+                  nonnull (dbus_message_get_error_name (reply), "a reply"));
+      _dbus_assert_not_reached ("wrong reply to a batch of match rules");
+    }
 
-#ifdef DBUS_WIN_FIXME
-  _dbus_warn("TODO: dispatch.c segfault_service_auto_start test\n");
-#else
-  /* only do the segfault test if we are not using the launcher */
-  check2_try_iterations (context, foo, "segfault_service_auto_start",
-                         check_segfault_service_auto_start);
-#endif
+  dbus_message_unref (reply);
+}
 
-  /* only do the shell fail test if we are not using the launcher */
-  check2_try_iterations (context, foo, "shell_fail_service_auto_start",
-                         check_shell_fail_service_auto_start);
+static void
+assert_batch_ack (DBusMessage *reply)
+{
+  _dbus_assert (reply != NULL);
+  _dbus_assert (dbus_message_get_type (reply) ==
+                DBUS_MESSAGE_TYPE_METHOD_RETURN);
+  dbus_message_unref (reply);
+}
 
-  /* specific to launcher */
-  if (use_launcher)
-    if (!check_launch_service_file_missing (context, foo))
-      _dbus_assert_not_reached ("did not get service file not found error");
+/* AddMatches adds all of its rules or none of them, and RemoveMatches
+ * stops at the first rule it can't find */
+static void
+check_match_batches (BusContext     *context,
+                     DBusConnection *connection)
+{
+  static const char *const rules[] = {
+    "type='signal',interface='com.example.Batch',member='One'",
+    "type='signal',interface='com.example.Batch',member='Two'"
+  };
+  const char *batch[3];
+  const char **too_many;
+  DBusConnection *server_side;
+  int n_rules, limit, i;
+
+  server_side = get_server_side (context, connection);
+  n_rules = bus_connection_get_n_match_rules (server_side);
+
+  /* a malformed rule in the middle stops the ones around it too */
+  batch[0] = rules[0];
+  batch[1] = "type='nonsense'";
+  batch[2] = rules[1];
+  assert_batch_error (call_match_batch (context, connection, "AddMatches",
+                                        batch, 3),
+                      DBUS_ERROR_MATCH_RULE_INVALID);
+  _dbus_assert (bus_connection_get_n_match_rules (server_side) == n_rules);
+
+  /* so does a batch that would go over the limit, however many of its
+   * rules would have fitted */
+  limit = bus_context_get_max_match_rules_per_connection (context);
+  too_many = dbus_new (const char *, limit + 1);
+  if (too_many == NULL)
+    _dbus_assert_not_reached ("no memory for match rules");
+
+  for (i = 0; i <= limit; i++)
+    too_many[i] = rules[0];
+
+  assert_batch_error (call_match_batch (context, connection, "AddMatches",
+                                        too_many, limit + 1),
+                      DBUS_ERROR_LIMITS_EXCEEDED);
+  _dbus_assert (bus_connection_get_n_match_rules (server_side) == n_rules);
+  dbus_free (too_many);
+
+  assert_batch_ack (call_match_batch (context, connection, "AddMatches",
+                                      rules, 2));
+  _dbus_assert (bus_connection_get_n_match_rules (server_side) ==
+                n_rules + 2);
+
+  /* the rules before one that isn't there stay removed */
+  batch[0] = rules[0];
+  batch[1] = "type='signal',interface='com.example.Batch',member='Never'";
+  batch[2] = rules[1];
+  assert_batch_error (call_match_batch (context, connection, "RemoveMatches",
+                                        batch, 3),
+                      DBUS_ERROR_MATCH_RULE_NOT_FOUND);
+  _dbus_assert (bus_connection_get_n_match_rules (server_side) ==
+                n_rules + 1);
+
+  assert_batch_ack (call_match_batch (context, connection, "RemoveMatches",
+                                      rules + 1, 1));
+  _dbus_assert (bus_connection_get_n_match_rules (server_side) == n_rules);
+
+  /* an empty batch is fine either way */
+  assert_batch_ack (call_match_batch (context, connection, "AddMatches",
+                                      rules, 0));
+  assert_batch_ack (call_match_batch (context, connection, "RemoveMatches",
+                                      rules, 0));
 
-#if 0
-  /* Note: need to resolve some issues with the testing code in order to run
-   * this in oom (handle that we sometimes don't get replies back from the bus
-   * when oom happens, without blocking the test).
-   */
-  check2_try_iterations (context, foo, "existent_service_auto_auto_start",
-                         check_existent_service_auto_start);
-#endif
+  if (!check_no_leftovers (context))
+    _dbus_assert_not_reached ("messages left over from match rule batches");
+}
 
-  if (!check_existent_service_auto_start (context, foo))
-    _dbus_assert_not_reached ("existent service auto start failed");
+/* Running out of memory part way through AddMatches takes back the
+ * rules it had already added.
+ *
+ * returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_add_matches (BusContext     *context,
+                   DBusConnection *connection)
+{
+  static const char *const rules[] = {
+    "type='signal',interface='com.example.Batch',member='Oom1'",
+    "type='signal',interface='com.example.Batch',member='Oom2'",
+    "type='signal',interface='com.example.Batch',member='Oom3'"
+  };
+  DBusConnection *server_side;
+  DBusMessage *reply;
+  dbus_bool_t retried;
+  int n_rules, i;
+
+  server_side = get_server_side (context, connection);
+  n_rules = bus_connection_get_n_match_rules (server_side);
+
+  reply = call_match_batch (context, connection, "AddMatches",
+                            rules, _DBUS_N_ELEMENTS (rules));
+  if (reply == NULL)
+    return TRUE;
 
-  if (!check_shell_service_success_auto_start (context, foo))
-    _dbus_assert_not_reached ("shell success service auto start failed");
+  if (dbus_message_is_error (reply, DBUS_ERROR_NO_MEMORY))
+    {
+      dbus_message_unref (reply);
 
-  _dbus_verbose ("Disconnecting foo, bar, and baz\n");
+      if (bus_connection_get_n_match_rules (server_side) != n_rules)
+        {
+          _dbus_warn ("%d match rules were left by a failed AddMatches\n",
+                      bus_connection_get_n_match_rules (server_side) -
+                      n_rules);
+          return FALSE;
+        }
 
-  kill_client_connection_unchecked (foo);
-  kill_client_connection_unchecked (bar);
-  kill_client_connection_unchecked (baz);
+      return TRUE;
+    }
 
-  bus_context_unref (context);
+  if (dbus_message_get_type (reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
+    {
+      warn_unexpected (connection, reply, "method return for AddMatches");
+      dbus_message_unref (reply);
+      return FALSE;
+    }
+
+  dbus_message_unref (reply);
+  _dbus_assert (bus_connection_get_n_match_rules (server_side) ==
+                n_rules + (int) _DBUS_N_ELEMENTS (rules));
+
+  /* Take them out again one at a time, so that running out of memory
+   * can't leave us unsure which ones went. A rule that is gone after
+   * a NoMemory error was removed before the reply couldn't be sent. */
+  for (i = 0; i < (int) _DBUS_N_ELEMENTS (rules); i++)
+    {
+      retried = FALSE;
+
+      while (TRUE)
+        {
+          reply = call_match_batch (context, connection, "RemoveMatches",
+                                    rules + i, 1);
+
+          if (reply == NULL)
+            {
+              if (!dbus_connection_get_is_connected (connection))
+                return TRUE;
+
+              _dbus_wait_for_memory ();
+              continue;
+            }
+
+          if (dbus_message_is_error (reply, DBUS_ERROR_NO_MEMORY))
+            {
+              dbus_message_unref (reply);
+              retried = TRUE;
+              _dbus_wait_for_memory ();
+              continue;
+            }
+
+          if (dbus_message_get_type (reply) ==
+              DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+              (retried &&
+               dbus_message_is_error (reply, DBUS_ERROR_MATCH_RULE_NOT_FOUND)))
+            break;
+
+          warn_unexpected (connection, reply, "method return for RemoveMatches");
+          dbus_message_unref (reply);
+          return FALSE;
+        }
+
+      dbus_message_unref (reply);
+    }
+
+  _dbus_assert (bus_connection_get_n_match_rules (server_side) == n_rules);
 
   return TRUE;
 }
 
+/* Counts the connections with a rule matching @message */
+static int
+count_recipients (BusContext  *context,
+                  DBusMessage *message)
+{
+  BusConnections *connections = bus_context_get_connections (context);
+  int first = bus_connections_get_n_recipients (connections);
+  int n;
+
+  if (!bus_matchmaker_get_recipients (bus_context_get_matchmaker (context),
+                                      connections, NULL, NULL, message))
+    _dbus_assert_not_reached ("no memory for recipients");
+
+  n = bus_connections_get_n_recipients (connections) - first;
+  bus_connections_truncate_recipients (connections, first);
+  return n;
+}
+
+/* Equal rules from different connections are evaluated once, on behalf
+ * of all of them, and must keep working whichever of them is removed
+ * first.
+ */
+static void
+check_shared_match_rules (BusContext     *context,
+                          DBusConnection *foo,
+                          DBusConnection *bar,
+                          DBusConnection *baz)
+{
+  BusMatchmaker *matchmaker = bus_context_get_matchmaker (context);
+  DBusConnection *owners[3];
+  BusMatchRule *rules[3];
+  BusMatchRule *value;
+  DBusMessage *message;
+  DBusString text;
+  int n_distinct;
+  int i;
+
+  owners[0] = get_server_side (context, foo);
+  owners[1] = get_server_side (context, bar);
+  owners[2] = get_server_side (context, baz);
+
+  /* only an eavesdropping rule can match a message with a destination,
+   * so the connections' other rules won't get in the way */
+  _dbus_string_init_const (&text,
+      "eavesdrop='true',interface='com.example.Shared'");
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS, "/",
+                                          "com.example.Shared", "Method");
+  if (message == NULL)
+    _dbus_assert_not_reached ("no memory for message");
+
+  n_distinct = bus_matchmaker_get_n_distinct_rules (matchmaker);
+
+  for (i = 0; i < 3; i++)
+    {
+      rules[i] = bus_match_rule_parse (owners[i], &text, NULL);
+      if (rules[i] == NULL)
+        _dbus_assert_not_reached ("no memory for match rule");
+
+      if (!bus_matchmaker_add_rule (matchmaker, rules[i]))
+        _dbus_assert_not_reached ("no memory for match rule");
+    }
+
+  _dbus_assert (bus_matchmaker_get_n_distinct_rules (matchmaker) ==
+                n_distinct + 1);
+  _dbus_assert (count_recipients (context, message) == 3);
+
+  /* the first is the one that stands for the others */
+  bus_matchmaker_remove_rule (matchmaker, rules[0]);
+  _dbus_assert (bus_matchmaker_get_n_distinct_rules (matchmaker) ==
+                n_distinct + 1);
+  _dbus_assert (count_recipients (context, message) == 2);
+
+  value = bus_match_rule_parse (owners[2], &text, NULL);
+  if (value == NULL)
+    _dbus_assert_not_reached ("no memory for match rule");
+
+  if (!bus_matchmaker_remove_rule_by_value (matchmaker, value, NULL))
+    _dbus_assert_not_reached ("shared match rule was not found");
+
+  bus_match_rule_unref (value);
+  _dbus_assert (count_recipients (context, message) == 1);
+
+  bus_matchmaker_remove_rule (matchmaker, rules[1]);
+  _dbus_assert (bus_matchmaker_get_n_distinct_rules (matchmaker) ==
+                n_distinct);
+  _dbus_assert (count_recipients (context, message) == 0);
+
+  for (i = 0; i < 3; i++)
+    bus_match_rule_unref (rules[i]);
+
+  dbus_message_unref (message);
+}
+
 static dbus_bool_t
-bus_dispatch_test_conf_fail (const DBusString *test_data_dir,
-		             const char       *filename)
+interest_bit_is_set (const unsigned char *bitmap,
+                     unsigned int         bit)
+{
+  return (bitmap[bit / 8] & (1 << (bit % 8))) != 0;
+}
+
+/* The SignalInterest summary changes when the first rule for a signal
+ * arrives and when the last one goes, but not when an equal rule from
+ * another connection comes and goes in between.
+ */
+static void
+check_signal_interest (BusContext     *context,
+                       DBusConnection *foo,
+                       DBusConnection *bar)
+{
+  BusMatchmaker *matchmaker = bus_context_get_matchmaker (context);
+  unsigned char bitmap[DBUS_SIGNAL_INTEREST_BYTES];
+  BusMatchRule *rules[2];
+  DBusString text;
+  dbus_uint32_t version;
+  unsigned int bits[2];
+  dbus_bool_t was_set[2];
+  int i;
+
+  _dbus_signal_interest_get_bits ("com.example.Interest", "Changed",
+                                  &bits[0], &bits[1]);
+
+  bus_matchmaker_get_signal_interest (matchmaker, bitmap);
+  version = bus_matchmaker_get_signal_interest_version (matchmaker);
+
+  for (i = 0; i < 2; i++)
+    was_set[i] = interest_bit_is_set (bitmap, bits[i]);
+
+  _dbus_string_init_const (&text,
+      "type='signal',interface='com.example.Interest',member='Changed'");
+
+  for (i = 0; i < 2; i++)
+    {
+      rules[i] = bus_match_rule_parse (get_server_side (context,
+                                                        i ? bar : foo),
+                                       &text, NULL);
+      if (rules[i] == NULL)
+        _dbus_assert_not_reached ("no memory for match rule");
+
+      if (!bus_matchmaker_add_rule (matchmaker, rules[i]))
+        _dbus_assert_not_reached ("no memory for match rule");
+    }
+
+  bus_matchmaker_get_signal_interest (matchmaker, bitmap);
+  _dbus_assert (interest_bit_is_set (bitmap, bits[0]));
+  _dbus_assert (interest_bit_is_set (bitmap, bits[1]));
+
+  if (!was_set[0] || !was_set[1])
+    _dbus_assert (bus_matchmaker_get_signal_interest_version (matchmaker) !=
+                  version);
+
+  version = bus_matchmaker_get_signal_interest_version (matchmaker);
+
+  /* the other connection's rule takes its place */
+  bus_matchmaker_remove_rule (matchmaker, rules[0]);
+  _dbus_assert (bus_matchmaker_get_signal_interest_version (matchmaker) ==
+                version);
+
+  bus_matchmaker_remove_rule (matchmaker, rules[1]);
+  bus_matchmaker_get_signal_interest (matchmaker, bitmap);
+
+  for (i = 0; i < 2; i++)
+    _dbus_assert (interest_bit_is_set (bitmap, bits[i]) == was_set[i]);
+
+  if (!was_set[0] || !was_set[1])
+    _dbus_assert (bus_matchmaker_get_signal_interest_version (matchmaker) !=
+                  version);
+
+  for (i = 0; i < 2; i++)
+    bus_match_rule_unref (rules[i]);
+}
+
+/* Connections with the same identity share a client policy, so that
+ * a broadcast to them is checked against it once */
+static void
+check_shared_client_policies (BusContext     *context,
+                              DBusConnection *foo,
+                              DBusConnection *bar)
+{
+  DBusConnection *server_foo = get_server_side (context, foo);
+  DBusConnection *server_bar = get_server_side (context, bar);
+  unsigned long foo_uid, bar_uid;
+
+  if (!dbus_connection_get_unix_user (server_foo, &foo_uid) ||
+      !dbus_connection_get_unix_user (server_bar, &bar_uid) ||
+      foo_uid != bar_uid)
+    return;
+
+  _dbus_assert (bus_connection_get_policy (server_foo) ==
+                bus_connection_get_policy (server_bar));
+}
+
+/* Unique names are found by their numbers, and only when spelled the
+ * way the bus writes them */
+static void
+check_unique_name_lookup (BusContext     *context,
+                          DBusConnection *foo,
+                          DBusConnection *bar)
+{
+  BusRegistry *registry = bus_context_get_registry (context);
+  DBusConnection *conns[2];
+  int i;
+
+  conns[0] = foo;
+  conns[1] = bar;
+
+  for (i = 0; i < 2; i++)
+    {
+      const char *name = dbus_bus_get_unique_name (conns[i]);
+      DBusString str;
+      DBusString respelled;
+      BusService *service;
+
+      _dbus_string_init_const (&str, name);
+      service = bus_registry_lookup (registry, &str);
+      _dbus_assert (service != NULL);
+      _dbus_assert (bus_service_get_primary_owners_connection (service) ==
+                    get_server_side (context, conns[i]));
+
+      /* ":1.5" is not ":01.5", ":1.05" or ":1.5x" */
+      if (!_dbus_string_init (&respelled))
+        _dbus_assert_not_reached ("no memory");
+
+      if (!_dbus_string_append (&respelled, ":0") ||
+          !_dbus_string_append (&respelled, name + 1))
+        _dbus_assert_not_reached ("no memory");
+
+      _dbus_assert (bus_registry_lookup (registry, &respelled) == NULL);
+
+      _dbus_string_set_length (&respelled, 0);
+      if (!_dbus_string_append_len (&respelled, name,
+                                    strchr (name, '.') + 1 - name) ||
+          !_dbus_string_append (&respelled, "0") ||
+          !_dbus_string_append (&respelled, strchr (name, '.') + 1))
+        _dbus_assert_not_reached ("no memory");
+
+      _dbus_assert (bus_registry_lookup (registry, &respelled) == NULL);
+
+      _dbus_string_set_length (&respelled, 0);
+      if (!_dbus_string_append (&respelled, name) ||
+          !_dbus_string_append (&respelled, "x"))
+        _dbus_assert_not_reached ("no memory");
+
+      _dbus_assert (bus_registry_lookup (registry, &respelled) == NULL);
+
+      _dbus_string_free (&respelled);
+    }
+
+  {
+    DBusString str;
+
+    _dbus_string_init_const (&str, ":1.2147483647");
+    _dbus_assert (bus_registry_lookup (registry, &str) == NULL);
+    _dbus_string_init_const (&str, ":1.2147483648");
+    _dbus_assert (bus_registry_lookup (registry, &str) == NULL);
+  }
+}
+
+static dbus_bool_t
+drop_messages_foreach (DBusConnection *connection,
+                       void           *data)
+{
+  DBusMessage *message;
+
+  while ((message = pop_message_waiting_for_memory (connection)) != NULL)
+    dbus_message_unref (message);
+
+  return TRUE;
+}
+
+/* A remembered destination follows the name to its next owner */
+static void
+check_destination_cache (BusContext     *context,
+                         DBusConnection *foo,
+                         DBusConnection *bar)
+{
+  DBusConnection *server_foo = get_server_side (context, foo);
+  DBusConnection *server_bar = get_server_side (context, bar);
+  BusRegistry *registry = bus_context_get_registry (context);
+  const char *name = "org.freedesktop.DBus.TestSuite.DestinationCache";
+  BusTransaction *transaction, *replace_transaction;
+  DBusString str;
+  DBusError error = DBUS_ERROR_INIT;
+  dbus_uint32_t result;
+
+  _dbus_string_init_const (&str, name);
+
+  _dbus_assert (bus_connection_resolve_destination (server_bar, name) == NULL);
+
+  transaction = bus_transaction_new (context);
+  if (transaction == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  if (!bus_registry_acquire_service (registry, server_foo, &str, 0, &result,
+                                     transaction, &error))
+    _dbus_assert_not_reached ("could not acquire name");
+
+  _dbus_assert (bus_connection_resolve_destination (server_bar, name) ==
+                server_foo);
+  _dbus_assert (bus_connection_resolve_destination (server_bar, name) ==
+                server_foo);
+
+  /* taking the name back bumps the owners serial */
+  bus_transaction_cancel_and_free (transaction);
+
+  _dbus_assert (bus_connection_resolve_destination (server_bar, name) == NULL);
+
+  transaction = bus_transaction_new (context);
+  if (transaction == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  if (!bus_registry_acquire_service (registry, server_bar, &str, 0, &result,
+                                     transaction, &error))
+    _dbus_assert_not_reached ("could not acquire name");
+
+  _dbus_assert (bus_connection_resolve_destination (server_foo, name) ==
+                server_bar);
+  _dbus_assert (bus_connection_resolve_destination (server_bar, name) ==
+                server_bar);
+
+  bus_transaction_cancel_and_free (transaction);
+
+  _dbus_assert (bus_connection_resolve_destination (server_foo, name) == NULL);
+  _dbus_assert (bus_connection_resolve_destination (server_foo,
+                  dbus_bus_get_unique_name (bar)) == server_bar);
+
+  /* a queued owner taking over changes nobody's membership of the
+   * queue, only its order */
+  transaction = bus_transaction_new (context);
+  if (transaction == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  if (!bus_registry_acquire_service (registry, server_foo, &str,
+                                     DBUS_NAME_FLAG_ALLOW_REPLACEMENT,
+                                     &result, transaction, &error) ||
+      result != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+    _dbus_assert_not_reached ("could not acquire name");
+
+  if (!bus_registry_acquire_service (registry, server_bar, &str, 0, &result,
+                                     transaction, &error) ||
+      result != DBUS_REQUEST_NAME_REPLY_IN_QUEUE)
+    _dbus_assert_not_reached ("could not queue for name");
+
+  _dbus_assert (bus_connection_resolve_destination (server_bar, name) ==
+                server_foo);
+
+  /* as on the bus, the takeover is a transaction of its own */
+  replace_transaction = bus_transaction_new (context);
+  if (replace_transaction == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  if (!bus_registry_acquire_service (registry, server_bar, &str,
+                                     DBUS_NAME_FLAG_REPLACE_EXISTING,
+                                     &result, replace_transaction, &error) ||
+      result != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+    _dbus_assert_not_reached ("could not replace owner");
+
+  _dbus_assert (bus_connection_resolve_destination (server_bar, name) ==
+                server_bar);
+
+  /* cancelling a swap of owners isn't supported, so let it happen and
+   * throw away the signals about it */
+  bus_transaction_execute_and_free (replace_transaction);
+  bus_transaction_cancel_and_free (transaction);
+
+  _dbus_assert (bus_connection_resolve_destination (server_bar, name) == NULL);
+
+  bus_test_run_everything (context);
+  bus_test_clients_foreach (drop_messages_foreach, NULL);
+}
+
+static dbus_bool_t
+bus_dispatch_test_conf (const DBusString *test_data_dir,
+		        const char       *filename,
+		        dbus_bool_t       use_launcher)
 {
   BusContext *context;
   DBusConnection *foo;
+  DBusConnection *bar;
+  DBusConnection *baz;
   DBusError error;
 
   /* save the config name for the activation helper */
@@ -4913,96 +5624,1430 @@ bus_dispatch_test_conf_fail (const DBusString *test_data_dir,
   if (!check_add_match (context, foo, ""))
     _dbus_assert_not_reached ("AddMatch message failed");
 
-  /* this only tests the activation.c user check */
-  if (!check_launch_service_user_missing (context, foo))
-    _dbus_assert_not_reached ("user missing did not trigger error");
+  bar = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
+  if (bar == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
 
-  /* this only tests the desktop.c exec check */
-  if (!check_launch_service_exec_missing (context, foo))
-    _dbus_assert_not_reached ("exec missing did not trigger error");
+  if (!bus_setup_debug_client (bar))
+    _dbus_assert_not_reached ("could not set up connection");
 
-  /* this only tests the desktop.c service check */
-  if (!check_launch_service_service_missing (context, foo))
-    _dbus_assert_not_reached ("service missing did not trigger error");
+  spin_connection_until_authenticated (context, bar);
 
-  _dbus_verbose ("Disconnecting foo\n");
+  if (!check_hello_message (context, bar))
+    _dbus_assert_not_reached ("hello message failed");
 
-  kill_client_connection_unchecked (foo);
+  if (!check_add_match (context, bar, ""))
+    _dbus_assert_not_reached ("AddMatch message failed");
 
-  bus_context_unref (context);
+  baz = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
+  if (baz == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
 
-  return TRUE;
-}
+  if (!bus_setup_debug_client (baz))
+    _dbus_assert_not_reached ("could not set up connection");
 
-dbus_bool_t
-bus_dispatch_test (const DBusString *test_data_dir)
-{
-  /* run normal activation tests */
-  _dbus_verbose ("Normal activation tests\n");
-  if (!bus_dispatch_test_conf (test_data_dir,
-  			       "valid-config-files/debug-allow-all.conf", FALSE))
-    return FALSE;
+  spin_connection_until_authenticated (context, baz);
+
+  if (!check_hello_message (context, baz))
+    _dbus_assert_not_reached ("hello message failed");
+
+  if (!check_add_match (context, baz, ""))
+    _dbus_assert_not_reached ("AddMatch message failed");
+
+  if (!check_add_match (context, baz, "interface='com.example'"))
+    _dbus_assert_not_reached ("AddMatch message failed");
+
+#ifdef DBUS_ENABLE_STATS
+  if (!check_stats_method (context, baz, "GetAllMatchRules", "a{sas}"))
+    _dbus_assert_not_reached ("GetAllMatchRules message failed");
+
+  if (!check_stats_method (context, baz, "GetMatchRulesPaged", "a{sas}s"))
+    _dbus_assert_not_reached ("GetMatchRulesPaged message failed");
+
+  if (!check_stats_method (context, baz, "ListNamesPaged", "ass"))
+    _dbus_assert_not_reached ("ListNamesPaged message failed");
+
+  if (!check_stats_method (context, baz, "GetAllConnectionStats",
+                           "a(sa{sv})"))
+    _dbus_assert_not_reached ("GetAllConnectionStats message failed");
+
+  /* timing stays on for the rest of the tests */
+  if (!check_stats_method (context, baz, "SetPhaseTiming", ""))
+    _dbus_assert_not_reached ("SetPhaseTiming message failed");
+
+  if (!check_stats_method (context, baz, "GetPhaseTimings", "tta{s(tt)}"))
+    _dbus_assert_not_reached ("GetPhaseTimings message failed");
+#endif
+
+#ifdef DBUS_WIN_FIXME
+  _dbus_warn("TODO: testing of GetConnectionUnixUser message skipped for now\n");
+  _dbus_warn("TODO: testing of GetConnectionUnixProcessID message skipped for now\n");
+#else
+  if (!check_get_connection_unix_user (context, baz))
+    _dbus_assert_not_reached ("GetConnectionUnixUser message failed");
+
+  if (!check_get_connection_unix_process_id (context, baz))
+    _dbus_assert_not_reached ("GetConnectionUnixProcessID message failed");
+#endif
+
+  if (!check_list_services (context, baz))
+    _dbus_assert_not_reached ("ListActivatableNames message failed");
+
+  if (!check_rules_naming_peer_dropped (context, baz))
+    _dbus_assert_not_reached ("rules naming a disconnected peer were kept");
+
+  check_match_batches (context, baz);
+
+  check_shared_match_rules (context, foo, bar, baz);
+  check_signal_interest (context, foo, bar);
+  check_shared_client_policies (context, foo, bar);
+  check_unique_name_lookup (context, foo, bar);
+  check_destination_cache (context, foo, bar);
+
+  if (!check_no_leftovers (context))
+    {
+      _dbus_warn ("Messages were left over after setting up initial connections\n");
+      _dbus_assert_not_reached ("initial connection setup failed");
+    }
+
+  check1_try_iterations (context, "create_and_hello",
+                         check_hello_connection);
+
+  check2_try_iterations (context, foo, "driver_ping", check_driver_ping);
+
+  check2_try_iterations (context, foo, "driver_get_machine_id",
+                         check_driver_get_machine_id);
+
+  check2_try_iterations (context, foo, "add_matches", check_add_matches);
+
+  check2_try_iterations (context, foo, "nonexistent_service_no_auto_start",
+                         check_nonexistent_service_no_auto_start);
+
+#ifdef DBUS_WIN_FIXME
+  _dbus_warn("TODO: dispatch.c segfault_service_no_auto_start test\n");
+#else
+  check2_try_iterations (context, foo, "segfault_service_no_auto_start",
+                         check_segfault_service_no_auto_start);
+#endif
+
+  check2_try_iterations (context, foo, "existent_service_no_auto_start",
+                         check_existent_service_no_auto_start);
+
+  check2_try_iterations (context, foo, "nonexistent_service_auto_start",
+                         check_nonexistent_service_auto_start);
+
+
+#ifdef DBUS_WIN_FIXME
+  _dbus_warn("TODO: dispatch.c segfault_service_auto_start test\n");
+#else
+  /* only do the segfault test if we are not using the launcher */
+  check2_try_iterations (context, foo, "segfault_service_auto_start",
+                         check_segfault_service_auto_start);
+#endif
+
+  /* only do the shell fail test if we are not using the launcher */
+  check2_try_iterations (context, foo, "shell_fail_service_auto_start",
+                         check_shell_fail_service_auto_start);
+
+  /* specific to launcher */
+  if (use_launcher)
+    if (!check_launch_service_file_missing (context, foo))
+      _dbus_assert_not_reached ("did not get service file not found error");
+
+#if 0
+  /* Note: need to resolve some issues with the testing code in order to run
+   * this in oom (handle that we sometimes don't get replies back from the bus
+   * when oom happens, without blocking the test).
+   */
+  check2_try_iterations (context, foo, "existent_service_auto_auto_start",
+                         check_existent_service_auto_start);
+#endif
+
+  if (!check_existent_service_auto_start (context, foo))
+    _dbus_assert_not_reached ("existent service auto start failed");
+
+  if (!check_shell_service_success_auto_start (context, foo))
+    _dbus_assert_not_reached ("shell success service auto start failed");
+
+  _dbus_verbose ("Disconnecting foo, bar, and baz\n");
+
+  kill_client_connection_unchecked (foo);
+  kill_client_connection_unchecked (bar);
+  kill_client_connection_unchecked (baz);
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
+static dbus_bool_t
+bus_dispatch_test_conf_fail (const DBusString *test_data_dir,
+		             const char       *filename)
+{
+  BusContext *context;
+  DBusConnection *foo;
+  DBusError error;
+
+  /* save the config name for the activation helper */
+  if (!setenv_TEST_LAUNCH_HELPER_CONFIG (test_data_dir, filename))
+    _dbus_assert_not_reached ("no memory setting TEST_LAUNCH_HELPER_CONFIG");
+
+  dbus_error_init (&error);
+
+  context = bus_context_new_test (test_data_dir, filename);
+  if (context == NULL)
+    return FALSE;
+
+  foo = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
+  if (foo == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
+
+  if (!bus_setup_debug_client (foo))
+    _dbus_assert_not_reached ("could not set up connection");
+
+  spin_connection_until_authenticated (context, foo);
+
+  if (!check_hello_message (context, foo))
+    _dbus_assert_not_reached ("hello message failed");
+
+  if (!check_double_hello_message (context, foo))
+    _dbus_assert_not_reached ("double hello message failed");
+
+  if (!check_add_match (context, foo, ""))
+    _dbus_assert_not_reached ("AddMatch message failed");
+
+  /* this only tests the activation.c user check */
+  if (!check_launch_service_user_missing (context, foo))
+    _dbus_assert_not_reached ("user missing did not trigger error");
+
+  /* this only tests the desktop.c exec check */
+  if (!check_launch_service_exec_missing (context, foo))
+    _dbus_assert_not_reached ("exec missing did not trigger error");
+
+  /* this only tests the desktop.c service check */
+  if (!check_launch_service_service_missing (context, foo))
+    _dbus_assert_not_reached ("service missing did not trigger error");
+
+  _dbus_verbose ("Disconnecting foo\n");
+
+  kill_client_connection_unchecked (foo);
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
+dbus_bool_t
+bus_dispatch_test (const DBusString *test_data_dir)
+{
+  /* run normal activation tests */
+  _dbus_verbose ("Normal activation tests\n");
+  if (!bus_dispatch_test_conf (test_data_dir,
+  			       "valid-config-files/debug-allow-all.conf", FALSE))
+    return FALSE;
+
+#ifdef DBUS_WIN
+  _dbus_warn("Info: Launch helper activation tests skipped because launch-helper is not supported yet\n");
+#else
+  /* run launch-helper activation tests */
+  _dbus_verbose ("Launch helper activation tests\n");
+  if (!bus_dispatch_test_conf (test_data_dir,
+  			       "valid-config-files-system/debug-allow-all-pass.conf", TRUE))
+    return FALSE;
+
+  /* run select launch-helper activation tests on broken service files */
+  if (!bus_dispatch_test_conf_fail (test_data_dir,
+  			            "valid-config-files-system/debug-allow-all-fail.conf"))
+    return FALSE;
+#endif
+
+  return TRUE;
+}
+
+dbus_bool_t
+bus_dispatch_sha1_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *foo;
+  DBusError error;
+
+  dbus_error_init (&error);
+
+  /* Test SHA1 authentication */
+  _dbus_verbose ("Testing SHA1 context\n");
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-allow-all-sha1.conf");
+  if (context == NULL)
+    return FALSE;
+
+  foo = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
+  if (foo == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
+
+  if (!bus_setup_debug_client (foo))
+    _dbus_assert_not_reached ("could not set up connection");
+
+  spin_connection_until_authenticated (context, foo);
+
+  if (!check_hello_message (context, foo))
+    _dbus_assert_not_reached ("hello message failed");
+
+  if (!check_add_match (context, foo, ""))
+    _dbus_assert_not_reached ("addmatch message failed");
+
+  if (!check_no_leftovers (context))
+    {
+      _dbus_warn ("Messages were left over after setting up initial SHA-1 connection\n");
+      _dbus_assert_not_reached ("initial connection setup failed");
+    }
+
+  check1_try_iterations (context, "create_and_hello_sha1",
+                         check_hello_connection);
+
+  kill_client_connection_unchecked (foo);
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
+/* Clients that the synthetic rules are spread over */
+#define PERF_N_CLIENTS 50
+
+/* Calls timed per signal, per rule population */
+#define PERF_N_CALLS 2000
+
+static const int perf_rule_counts[] = { 1000, 10000, 100000 };
+
+/* Rules typical of desktop and system buses. They are numbered so that
+ * each one is distinct, and kind 3 is per-peer: %s is a client's unique
+ * name. */
+static BusMatchRule *
+perf_rule_new (DBusConnection *connection,
+               const char     *unique_name,
+               int             i)
+{
+  DBusString text;
+  DBusError error = DBUS_ERROR_INIT;
+  BusMatchRule *rule;
+  dbus_bool_t ok;
+
+  if (!_dbus_string_init (&text))
+    _dbus_assert_not_reached ("no memory for match rule");
+
+  switch (i % 4)
+    {
+      case 0:
+        ok = _dbus_string_append_printf (&text,
+            "type='signal',interface='org.example.Iface%d',member='Changed'",
+            i / 4);
+        break;
+
+      case 1:
+        ok = _dbus_string_append_printf (&text,
+            "type='signal',interface='" DBUS_INTERFACE_PROPERTIES "',"
+            "member='PropertiesChanged',"
+            "path_namespace='/org/example/Object%d'", i / 4);
+        break;
+
+      case 2:
+        ok = _dbus_string_append_printf (&text,
+            "type='signal',sender='" DBUS_SERVICE_DBUS "',"
+            "interface='" DBUS_INTERFACE_DBUS "',member='NameOwnerChanged',"
+            "arg0='org.example.Name%d'", i / 4);
+        break;
+
+      default:
+        ok = _dbus_string_append_printf (&text,
+            "type='signal',sender='%s',path='/org/example/Object%d'",
+            unique_name, i / 4);
+        break;
+    }
+
+  if (!ok)
+    _dbus_assert_not_reached ("no memory for match rule");
+
+  rule = bus_match_rule_parse (connection, &text, &error);
+
+  if (rule == NULL)
+    _dbus_assert_not_reached (error.message);
+
+  _dbus_string_free (&text);
+  return rule;
+}
+
+typedef struct
+{
+  const char *name;
+  dbus_bool_t from_driver;
+  const char *path;
+  const char *interface;
+  const char *member;
+  const char *arg0;
+} PerfSignal;
+
+static const PerfSignal perf_signals[] = {
+  { "PropertiesChanged", FALSE, "/org/example/Object7/Child",
+    DBUS_INTERFACE_PROPERTIES, "PropertiesChanged", NULL },
+  { "NameOwnerChanged", TRUE, DBUS_PATH_DBUS,
+    DBUS_INTERFACE_DBUS, "NameOwnerChanged", "org.example.Name5" },
+  { "interface+member", FALSE, "/",
+    "org.example.Iface3", "Changed", NULL },
+  { "per-peer path", FALSE, "/org/example/Object2",
+    "com.example.Peer", "Changed", NULL },
+  { "unmatched", FALSE, "/com/example/Nowhere",
+    "com.example.Nobody", "Nothing", NULL }
+};
+
+static DBusMessage *
+perf_signal_new (const PerfSignal *sig,
+                 const char       *sender)
+{
+  DBusMessage *message;
+
+  message = dbus_message_new_signal (sig->path, sig->interface, sig->member);
+
+  if (message == NULL ||
+      !dbus_message_set_sender (message, sender) ||
+      (sig->arg0 != NULL &&
+       !dbus_message_append_args (message,
+                                  DBUS_TYPE_STRING, &sig->arg0,
+                                  DBUS_TYPE_STRING, &sig->arg0,
+                                  DBUS_TYPE_STRING, &sender,
+                                  DBUS_TYPE_INVALID)))
+    _dbus_assert_not_reached ("no memory for signal");
+
+  return message;
+}
+
+/**
+ * Not a test so much as a benchmark, run only when asked for by name:
+ * load increasing numbers of synthetic match rules into the
+ * matchmaker and time bus_matchmaker_get_recipients() for a few
+ * representative signals, to show how its cost grows with the number
+ * of rules.
+ */
+dbus_bool_t
+bus_matchmaker_perf_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  BusMatchmaker *matchmaker;
+  BusConnections *connections;
+  DBusConnection *clients[PERF_N_CLIENTS];
+  DBusConnection *server_sides[PERF_N_CLIENTS];
+  const char *unique_names[PERF_N_CLIENTS];
+  DBusError error;
+  int n_rules = 0;
+  int i, j, k;
+
+  dbus_error_init (&error);
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    return FALSE;
+
+  matchmaker = bus_context_get_matchmaker (context);
+  connections = bus_context_get_connections (context);
+
+  for (i = 0; i < PERF_N_CLIENTS; i++)
+    {
+      DBusString name;
+      BusService *service;
+
+      clients[i] = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
+      if (clients[i] == NULL)
+        _dbus_assert_not_reached ("could not alloc connection");
+
+      if (!bus_setup_debug_client (clients[i]))
+        _dbus_assert_not_reached ("could not set up connection");
+
+      spin_connection_until_authenticated (context, clients[i]);
+
+      if (!check_hello_message (context, clients[i]))
+        _dbus_assert_not_reached ("hello message failed");
+
+      /* check_hello_message() expects everyone to see the next client */
+      if (!check_add_match (context, clients[i], ""))
+        _dbus_assert_not_reached ("AddMatch message failed");
+
+      unique_names[i] = dbus_bus_get_unique_name (clients[i]);
+      if (unique_names[i] == NULL)
+        _dbus_assert_not_reached ("client has no unique name");
+
+      _dbus_string_init_const (&name, unique_names[i]);
+      service = bus_registry_lookup (bus_context_get_registry (context),
+                                     &name);
+      _dbus_assert (service != NULL);
+      server_sides[i] = bus_service_get_primary_owners_connection (service);
+    }
+
+  /* but the benchmark only wants the synthetic rules */
+  for (i = 0; i < PERF_N_CLIENTS; i++)
+    bus_matchmaker_disconnected (matchmaker, server_sides[i]);
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (perf_rule_counts); i++)
+    {
+      for (; n_rules < perf_rule_counts[i]; n_rules++)
+        {
+          int owner = (n_rules / 4) % PERF_N_CLIENTS;
+          BusMatchRule *rule;
+
+          rule = perf_rule_new (server_sides[owner], unique_names[owner],
+                                n_rules);
+
+          if (!bus_matchmaker_add_rule (matchmaker, rule))
+            _dbus_assert_not_reached ("no memory for match rule");
+
+          bus_match_rule_unref (rule);
+        }
+
+      for (j = 0; j < _DBUS_N_ELEMENTS (perf_signals); j++)
+        {
+          const PerfSignal *sig = &perf_signals[j];
+          DBusConnection *sender;
+          DBusMessage *message;
+          long start_sec, start_usec, end_sec, end_usec;
+          int first = bus_connections_get_n_recipients (connections);
+          int n_recipients = 0;
+          double elapsed;
+
+          /* the per-peer rule for Object2 belongs to client 2 */
+          sender = sig->from_driver ? NULL : server_sides[2];
+          message = perf_signal_new (sig, sig->from_driver ?
+                                     DBUS_SERVICE_DBUS : unique_names[2]);
+
+          _dbus_get_monotonic_time (&start_sec, &start_usec);
+
+          for (k = 0; k < PERF_N_CALLS; k++)
+            {
+              if (!bus_matchmaker_get_recipients (matchmaker, connections,
+                                                  sender, NULL, message))
+                _dbus_assert_not_reached ("no memory for recipients");
+
+              n_recipients = bus_connections_get_n_recipients (connections) -
+                first;
+              bus_connections_truncate_recipients (connections, first);
+            }
+
+          _dbus_get_monotonic_time (&end_sec, &end_usec);
+          elapsed = (end_sec - start_sec) * 1e9 +
+            (end_usec - start_usec) * 1e3;
+
+          printf ("matchmaker-perf: %6d rules: %-18s %10.0f ns/call, "
+                  "%d recipients\n", n_rules, sig->name,
+                  elapsed / PERF_N_CALLS, n_recipients);
+
+          dbus_message_unref (message);
+        }
+    }
+
+  for (i = 0; i < PERF_N_CLIENTS; i++)
+    kill_client_connection_unchecked (clients[i]);
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
+/* Synthetic system.d files in the policy benchmark's default corpus,
+ * roughly as many as a full desktop distribution installs */
+#define POLICY_PERF_N_SERVICES 150
+
+/* Times the corpus is loaded, and calls timed per check */
+#define POLICY_PERF_N_LOADS 10
+#define POLICY_PERF_N_CALLS 2000
+
+/* Well-known names, taken from the corpus, that messages are sent to */
+#define POLICY_PERF_N_DESTINATIONS 3
+
+/* The start and end of system.conf, which each corpus is included into */
+static const char policy_perf_conf_start[] =
+  "<!DOCTYPE busconfig PUBLIC \"-//freedesktop//DTD D-Bus Bus Configuration 1.0//EN\"\n"
+  " \"http://www.freedesktop.org/standards/dbus/1.0/busconfig.dtd\">\n"
+  "<busconfig>\n"
+  "  <type>system</type>\n"
+  "  <listen>unix:tmpdir=/tmp</listen>\n"
+  "  <policy context=\"default\">\n"
+  "    <allow user=\"*\"/>\n"
+  "    <deny own=\"*\"/>\n"
+  "    <deny send_type=\"method_call\"/>\n"
+  "    <allow send_type=\"signal\"/>\n"
+  "    <allow send_requested_reply=\"true\" send_type=\"method_return\"/>\n"
+  "    <allow send_requested_reply=\"true\" send_type=\"error\"/>\n"
+  "    <allow receive_type=\"method_call\"/>\n"
+  "    <allow receive_type=\"method_return\"/>\n"
+  "    <allow receive_type=\"error\"/>\n"
+  "    <allow receive_type=\"signal\"/>\n"
+  "    <allow send_destination=\"" DBUS_SERVICE_DBUS "\"\n"
+  "           send_interface=\"" DBUS_INTERFACE_DBUS "\"/>\n"
+  "    <allow send_destination=\"" DBUS_SERVICE_DBUS "\"\n"
+  "           send_interface=\"" DBUS_INTERFACE_INTROSPECTABLE "\"/>\n"
+  "    <deny send_destination=\"" DBUS_SERVICE_DBUS "\"\n"
+  "          send_interface=\"" DBUS_INTERFACE_DBUS "\"\n"
+  "          send_member=\"UpdateActivationEnvironment\"/>\n"
+  "  </policy>\n";
+
+static const char policy_perf_conf_end[] =
+  "</busconfig>\n";
+
+/* A service's system.d file, in the shape most of them take: its own
+ * user may own the name, and everyone else may only use a few of its
+ * methods. %s is the name. */
+static dbus_bool_t
+policy_perf_append_service (DBusString *str,
+                            const char *name)
+{
+  return _dbus_string_append (str, "<busconfig>\n"
+                              "  <policy user=\"root\">\n") &&
+    _dbus_string_append_printf (str,
+        "    <allow own=\"%s\"/>\n"
+        "    <allow send_destination=\"%s\"/>\n", name, name) &&
+    _dbus_string_append (str, "  </policy>\n"
+                         "  <policy group=\"root\">\n") &&
+    _dbus_string_append_printf (str,
+        "    <allow send_destination=\"%s\" send_interface=\"%s.Admin\"/>\n",
+        name, name) &&
+    _dbus_string_append (str, "  </policy>\n"
+                         "  <policy at_console=\"true\">\n") &&
+    _dbus_string_append_printf (str,
+        "    <allow send_destination=\"%s\" send_interface=\"%s.Session\"/>\n",
+        name, name) &&
+    _dbus_string_append (str, "  </policy>\n"
+                         "  <policy context=\"default\">\n") &&
+    _dbus_string_append_printf (str,
+        "    <allow send_destination=\"%s\""
+        " send_interface=\"" DBUS_INTERFACE_INTROSPECTABLE "\"/>\n"
+        "    <allow send_destination=\"%s\""
+        " send_interface=\"" DBUS_INTERFACE_PEER "\"/>\n"
+        "    <allow send_destination=\"%s\""
+        " send_interface=\"" DBUS_INTERFACE_PROPERTIES "\" send_member=\"Get\"/>\n"
+        "    <allow send_destination=\"%s\""
+        " send_interface=\"" DBUS_INTERFACE_PROPERTIES "\" send_member=\"GetAll\"/>\n",
+        name, name, name, name) &&
+    _dbus_string_append_printf (str,
+        "    <allow send_destination=\"%s\" send_interface=\"%s.Manager\""
+        " send_member=\"List\"/>\n"
+        "    <deny send_destination=\"%s\" send_interface=\"%s.Manager\""
+        " send_member=\"Reset\"/>\n"
+        "    <allow receive_sender=\"%s\"/>\n",
+        name, name, name, name, name) &&
+    _dbus_string_append (str, "  </policy>\n"
+                         "</busconfig>\n");
+}
+
+static void
+policy_perf_path (DBusString *path,
+                  const DBusString *dir,
+                  const char *file)
+{
+  if (!_dbus_string_init (path) ||
+      !_dbus_string_copy (dir, 0, path, 0) ||
+      !_dbus_string_append (path, "/") ||
+      !_dbus_string_append (path, file))
+    _dbus_assert_not_reached ("no memory for file name");
+}
+
+static void
+policy_perf_save (const DBusString *dir,
+                  const char       *file,
+                  const DBusString *content)
+{
+  DBusString path;
+  DBusError error = DBUS_ERROR_INIT;
+
+  policy_perf_path (&path, dir, file);
+
+  if (!_dbus_string_save_to_file (content, &path, TRUE, &error))
+    _dbus_assert_not_reached (error.message);
+
+  _dbus_string_free (&path);
+}
+
+static void
+policy_perf_delete (const DBusString *dir,
+                    const char       *file)
+{
+  DBusString path;
+
+  policy_perf_path (&path, dir, file);
+  _dbus_delete_file (&path, NULL);
+  _dbus_string_free (&path);
+}
+
+/* Writes a system.conf including the synthetic corpus, or the
+ * directories in @corpus if not #NULL, into @dir, and returns how many
+ * synthetic files it wrote */
+static int
+policy_perf_write_corpus (const DBusString *dir,
+                          const char       *corpus)
+{
+  DBusString conf;
+  DBusString services;
+  DBusError error = DBUS_ERROR_INIT;
+  int i;
+
+  if (!_dbus_string_init (&conf) ||
+      !_dbus_string_append (&conf, policy_perf_conf_start))
+    _dbus_assert_not_reached ("no memory for corpus");
+
+  if (!_dbus_create_directory (dir, &error))
+    _dbus_assert_not_reached (error.message);
+
+  if (corpus != NULL)
+    {
+      const char *next;
+
+      /* a list like /usr/share/dbus-1/system.d:/etc/dbus-1/system.d */
+      for (; *corpus != '\0'; corpus = next)
+        {
+          next = strchr (corpus, ':');
+          if (next == NULL)
+            next = corpus + strlen (corpus);
+
+          if (next > corpus &&
+              !_dbus_string_append_printf (&conf,
+                                           "  <includedir>%.*s</includedir>\n",
+                                           (int) (next - corpus), corpus))
+            _dbus_assert_not_reached ("no memory for corpus");
+
+          if (*next == ':')
+            next++;
+        }
+
+      i = 0;
+    }
+  else
+    {
+      policy_perf_path (&services, dir, "system.d");
+
+      if (!_dbus_create_directory (&services, &error))
+        _dbus_assert_not_reached (error.message);
+
+      if (!_dbus_string_append_printf (&conf,
+                                       "  <includedir>%s</includedir>\n",
+                                       _dbus_string_get_const_data (&services)))
+        _dbus_assert_not_reached ("no memory for corpus");
+
+      for (i = 0; i < POLICY_PERF_N_SERVICES; i++)
+        {
+          DBusString content;
+          char name[64];
+          char file[sizeof (name) + sizeof (".conf")];
+
+          snprintf (name, sizeof (name), "org.example.Service%d", i);
+          snprintf (file, sizeof (file), "%s.conf", name);
+
+          if (!_dbus_string_init (&content) ||
+              !policy_perf_append_service (&content, name))
+            _dbus_assert_not_reached ("no memory for corpus");
+
+          policy_perf_save (&services, file, &content);
+          _dbus_string_free (&content);
+        }
+
+      _dbus_string_free (&services);
+    }
+
+  if (!_dbus_string_append (&conf, policy_perf_conf_end))
+    _dbus_assert_not_reached ("no memory for corpus");
+
+  policy_perf_save (dir, "system.conf", &conf);
+  _dbus_string_free (&conf);
+
+  return i;
+}
+
+static void
+policy_perf_delete_corpus (const DBusString *dir,
+                           int               n_services)
+{
+  DBusString services;
+  int i;
+
+  if (n_services > 0)
+    {
+      policy_perf_path (&services, dir, "system.d");
+
+      for (i = 0; i < n_services; i++)
+        {
+          char file[64];
+
+          snprintf (file, sizeof (file), "org.example.Service%d.conf", i);
+          policy_perf_delete (&services, file);
+        }
+
+      _dbus_delete_directory (&services, NULL);
+      _dbus_string_free (&services);
+    }
+
+  policy_perf_delete (dir, "system.conf");
+  _dbus_delete_directory (dir, NULL);
+}
+
+typedef struct
+{
+  const char *name;
+  int type;
+  dbus_bool_t to_service;    /**< Sent to one of the corpus's names */
+  dbus_bool_t from_rule;     /**< Uses the interface and member of that name's rule */
+  const char *interface;
+  const char *member;
+} PolicyPerfMessage;
+
+static const PolicyPerfMessage policy_perf_messages[] = {
+  { "Introspect", DBUS_MESSAGE_TYPE_METHOD_CALL, TRUE, FALSE,
+    DBUS_INTERFACE_INTROSPECTABLE, "Introspect" },
+  { "Properties.Get", DBUS_MESSAGE_TYPE_METHOD_CALL, TRUE, FALSE,
+    DBUS_INTERFACE_PROPERTIES, "Get" },
+  { "method in rule", DBUS_MESSAGE_TYPE_METHOD_CALL, TRUE, TRUE,
+    NULL, NULL },
+  { "unlisted method", DBUS_MESSAGE_TYPE_METHOD_CALL, TRUE, FALSE,
+    "com.example.Unlisted", "Frob" },
+  { "bus driver call", DBUS_MESSAGE_TYPE_METHOD_CALL, FALSE, FALSE,
+    DBUS_INTERFACE_DBUS, "GetNameOwner" },
+  { "method return", DBUS_MESSAGE_TYPE_METHOD_RETURN, FALSE, FALSE,
+    NULL, NULL },
+  { "broadcast signal", DBUS_MESSAGE_TYPE_SIGNAL, FALSE, FALSE,
+    "com.example.Broadcaster", "Changed" }
+};
+
+static double
+policy_perf_time_send (BusClientPolicy *policy,
+                       BusRegistry     *registry,
+                       DBusConnection  *receiver,
+                       DBusMessage     *message,
+                       dbus_bool_t     *allowed,
+                       dbus_int32_t    *toggles)
+{
+  dbus_uint64_t start;
+  dbus_bool_t requested_reply;
+  dbus_bool_t log;
+  int i;
+
+  requested_reply = dbus_message_get_reply_serial (message) != 0;
+  start = _dbus_get_monotonic_time_nsec ();
+
+  for (i = 0; i < POLICY_PERF_N_CALLS; i++)
+    *allowed = bus_client_policy_check_can_send (policy, registry,
+                                                 requested_reply, receiver,
+                                                 message, toggles, &log);
+
+  return (double) (_dbus_get_monotonic_time_nsec () - start) /
+    POLICY_PERF_N_CALLS;
+}
+
+static double
+policy_perf_time_receive (BusClientPolicy *policy,
+                          BusRegistry     *registry,
+                          DBusConnection  *sender,
+                          DBusConnection  *receiver,
+                          DBusMessage     *message,
+                          dbus_bool_t     *allowed,
+                          dbus_int32_t    *toggles)
+{
+  dbus_uint64_t start;
+  dbus_bool_t requested_reply;
+  DBusConnection *addressed;
+  int i;
+
+  requested_reply = dbus_message_get_reply_serial (message) != 0;
+  addressed = dbus_message_get_destination (message) != NULL ?
+    receiver : NULL;
+  start = _dbus_get_monotonic_time_nsec ();
+
+  for (i = 0; i < POLICY_PERF_N_CALLS; i++)
+    *allowed = bus_client_policy_check_can_receive (policy, registry,
+                                                    requested_reply, sender,
+                                                    addressed, receiver,
+                                                    message, toggles);
+
+  return (double) (_dbus_get_monotonic_time_nsec () - start) /
+    POLICY_PERF_N_CALLS;
+}
+
+/* Picks send rules naming a well-known destination from the start,
+ * middle and end of @policy, since a linear walk costs more the later
+ * the rule that decides */
+static int
+policy_perf_pick_rules (BusClientPolicy *policy,
+                        BusPolicyRule  **picked)
+{
+  DBusList **rules = bus_client_policy_get_rules (policy);
+  DBusList *link;
+  int n_candidates = 0;
+  int n_picked = 0;
+  int i, k;
+
+  for (link = _dbus_list_get_first_link (rules);
+       link != NULL;
+       link = _dbus_list_get_next_link (rules, link))
+    {
+      BusPolicyRule *rule = link->data;
+
+      if (rule->type == BUS_POLICY_RULE_SEND &&
+          rule->d.send.destination != NULL &&
+          rule->d.send.destination[0] != ':' &&
+          strcmp (rule->d.send.destination, DBUS_SERVICE_DBUS) != 0)
+        n_candidates++;
+    }
+
+  if (n_candidates == 0)
+    return 0;
+
+  i = 0;
+
+  for (link = _dbus_list_get_first_link (rules);
+       link != NULL && n_picked < POLICY_PERF_N_DESTINATIONS;
+       link = _dbus_list_get_next_link (rules, link))
+    {
+      BusPolicyRule *rule = link->data;
+
+      if (rule->type != BUS_POLICY_RULE_SEND ||
+          rule->d.send.destination == NULL ||
+          rule->d.send.destination[0] == ':' ||
+          strcmp (rule->d.send.destination, DBUS_SERVICE_DBUS) == 0)
+        continue;
+
+      if (i++ < (n_candidates - 1) * n_picked /
+          (POLICY_PERF_N_DESTINATIONS - 1))
+        continue;
+
+      /* many rules name the same destination, so take the next other */
+      for (k = 0; k < n_picked; k++)
+        {
+          if (strcmp (picked[k]->d.send.destination,
+                      rule->d.send.destination) == 0)
+            break;
+        }
+
+      if (k == n_picked)
+        picked[n_picked++] = rule;
+    }
+
+  return n_picked;
+}
+
+static DBusMessage *
+policy_perf_message_new (const PolicyPerfMessage *kind,
+                         const BusPolicyRule     *rule,
+                         const char              *sender,
+                         const char              *receiver)
+{
+  const char *interface = kind->interface;
+  const char *member = kind->member;
+  const char *destination = NULL;
+  DBusMessage *message;
+
+  if (kind->from_rule)
+    {
+      interface = rule->d.send.interface;
+      member = rule->d.send.member != NULL ? rule->d.send.member : "Frob";
+    }
+
+  if (kind->to_service)
+    destination = rule->d.send.destination;
+  else if (kind->type == DBUS_MESSAGE_TYPE_METHOD_CALL)
+    destination = DBUS_SERVICE_DBUS;
+  else if (kind->type != DBUS_MESSAGE_TYPE_SIGNAL)
+    destination = receiver;
+
+  message = dbus_message_new (kind->type);
+
+  if (message == NULL ||
+      !dbus_message_set_sender (message, sender) ||
+      (destination != NULL &&
+       !dbus_message_set_destination (message, destination)) ||
+      (kind->type != DBUS_MESSAGE_TYPE_METHOD_RETURN &&
+       (!dbus_message_set_path (message, "/org/example/Object") ||
+        (interface != NULL &&
+         !dbus_message_set_interface (message, interface)) ||
+        !dbus_message_set_member (message, member))) ||
+      (kind->type == DBUS_MESSAGE_TYPE_METHOD_RETURN &&
+       !dbus_message_set_reply_serial (message, 1)))
+    _dbus_assert_not_reached ("no memory for message");
+
+  return message;
+}
+
+/**
+ * Not a test so much as a benchmark, run only when asked for by name:
+ * load a system bus policy corpus through the config parser, then time
+ * building a connection's client policy from it and checking a mix of
+ * messages against that, both with the compiled rule tables and with a
+ * plain walk of every rule.
+ *
+ * The corpus is a synthetic set of system.d files unless
+ * DBUS_TEST_POLICY_CORPUS lists directories to include instead, such
+ * as /usr/share/dbus-1/system.d:/etc/dbus-1/system.d from a full
+ * distribution install.
+ */
+dbus_bool_t
+bus_policy_perf_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  BusRegistry *registry;
+  DBusConnection *clients[2];
+  DBusConnection *server_sides[2];
+  const char *unique_names[2];
+  BusPolicyRule *picked[POLICY_PERF_N_DESTINATIONS];
+  BusPolicy *policy = NULL;
+  BusClientPolicy *compiled;
+  BusClientPolicy *linear;
+  BusTransaction *transaction;
+  DBusString dir;
+  DBusString conf;
+  DBusList *link;
+  DBusError error;
+  const char *corpus;
+  const char *tmp;
+  dbus_uint64_t start, parse_nsec, create_nsec;
+  int n_services, n_picked, n_rules;
+  int i, j;
+
+  dbus_error_init (&error);
+  corpus = _dbus_getenv ("DBUS_TEST_POLICY_CORPUS");
+
+  tmp = _dbus_get_tmpdir ();
+
+  if (!_dbus_string_init (&dir) ||
+      !_dbus_string_append (&dir, tmp) ||
+      !_dbus_string_append (&dir, "/dbus-policy-perf-") ||
+      !_dbus_generate_random_ascii (&dir, 6, NULL))
+    _dbus_assert_not_reached ("no memory for corpus directory");
+
+  n_services = policy_perf_write_corpus (&dir, corpus);
+  policy_perf_path (&conf, &dir, "system.conf");
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    return FALSE;
+
+  registry = bus_context_get_registry (context);
+
+  for (i = 0; i < 2; i++)
+    {
+      clients[i] = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
+      if (clients[i] == NULL)
+        _dbus_assert_not_reached ("could not alloc connection");
+
+      if (!bus_setup_debug_client (clients[i]))
+        _dbus_assert_not_reached ("could not set up connection");
+
+      spin_connection_until_authenticated (context, clients[i]);
+
+      if (!check_hello_message (context, clients[i]))
+        _dbus_assert_not_reached ("hello message failed");
+
+      /* check_hello_message() expects everyone to see the next client */
+      if (!check_add_match (context, clients[i], ""))
+        _dbus_assert_not_reached ("AddMatch message failed");
+
+      unique_names[i] = dbus_bus_get_unique_name (clients[i]);
+      server_sides[i] = get_server_side (context, clients[i]);
+    }
+
+  /* A fresh policy each time, so that the client policy is built rather
+   * than found among those already built */
+  parse_nsec = 0;
+  create_nsec = 0;
+
+  for (i = 0; i < POLICY_PERF_N_LOADS; i++)
+    {
+      BusConfigParser *parser;
+
+      if (policy != NULL)
+        bus_policy_unref (policy);
+
+      start = _dbus_get_monotonic_time_nsec ();
+      parser = bus_config_load (&conf, TRUE, NULL, &error);
+
+      if (parser == NULL)
+        _dbus_assert_not_reached (error.message);
+
+      parse_nsec += _dbus_get_monotonic_time_nsec () - start;
+
+      policy = bus_config_parser_steal_policy (parser);
+      bus_config_parser_unref (parser);
+
+      start = _dbus_get_monotonic_time_nsec ();
+      compiled = bus_policy_create_client_policy (policy, server_sides[0],
+                                                  &error);
+
+      if (compiled == NULL)
+        _dbus_assert_not_reached (error.message);
+
+      create_nsec += _dbus_get_monotonic_time_nsec () - start;
+      bus_client_policy_unref (compiled);
+    }
+
+  start = _dbus_get_monotonic_time_nsec ();
+
+  for (i = 0; i < POLICY_PERF_N_CALLS; i++)
+    {
+      compiled = bus_policy_create_client_policy (policy, server_sides[0],
+                                                  &error);
+
+      if (compiled == NULL)
+        _dbus_assert_not_reached (error.message);
+
+      bus_client_policy_unref (compiled);
+    }
+
+  if (corpus != NULL)
+    printf ("policy-perf: corpus %s\n", corpus);
+  else
+    printf ("policy-perf: corpus of %d synthetic files\n", n_services);
+
+  printf ("policy-perf: parsing %.2f ms, new client policy %.1f us, "
+          "shared client policy %.0f ns\n",
+          parse_nsec / 1e6 / POLICY_PERF_N_LOADS,
+          create_nsec / 1e3 / POLICY_PERF_N_LOADS,
+          (double) (_dbus_get_monotonic_time_nsec () - start) /
+          POLICY_PERF_N_CALLS);
+
+  /* Both clients have the same credentials, so share this */
+  compiled = bus_policy_create_client_policy (policy, server_sides[0],
+                                              &error);
+  if (compiled == NULL)
+    _dbus_assert_not_reached (error.message);
+
+  linear = bus_client_policy_new ();
+  if (linear == NULL)
+    _dbus_assert_not_reached ("no memory for client policy");
+
+  n_rules = 0;
+
+  for (link = _dbus_list_get_first_link (bus_client_policy_get_rules (compiled));
+       link != NULL;
+       link = _dbus_list_get_next_link (bus_client_policy_get_rules (compiled),
+                                        link))
+    {
+      if (!bus_client_policy_append_rule (linear, link->data))
+        _dbus_assert_not_reached ("no memory for client policy");
+
+      n_rules++;
+    }
+
+  printf ("policy-perf: %d rules apply to uid %lu\n", n_rules,
+          (unsigned long) _dbus_getuid ());
+
+  n_picked = policy_perf_pick_rules (compiled, picked);
+
+  if (n_picked == 0)
+    _dbus_warn ("No send_destination rules in the corpus, so only "
+                "timing messages to the bus and to unique names\n");
+
+  /* the receiver owns the names that the messages are sent to */
+  transaction = bus_transaction_new (context);
+  if (transaction == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  for (i = 0; i < n_picked; i++)
+    {
+      DBusString name;
+      dbus_uint32_t result;
+
+      _dbus_string_init_const (&name, picked[i]->d.send.destination);
+
+      if (!bus_registry_acquire_service (registry, server_sides[1], &name, 0,
+                                         &result, transaction, &error))
+        _dbus_assert_not_reached (error.message);
+    }
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (policy_perf_messages); i++)
+    {
+      const PolicyPerfMessage *kind = &policy_perf_messages[i];
+
+      for (j = 0; j < (kind->to_service ? n_picked : 1); j++)
+        {
+          DBusConnection *receiver;
+          DBusMessage *message;
+          dbus_bool_t allowed, linear_allowed;
+          dbus_int32_t toggles, linear_toggles;
+          double compiled_nsec, linear_nsec;
+
+          if (kind->from_rule && picked[j]->d.send.interface == NULL)
+            continue;
+
+          message = policy_perf_message_new (kind,
+                                             kind->to_service ? picked[j] : NULL,
+                                             unique_names[0], unique_names[1]);
+
+          /* the bus driver has no connection */
+          receiver = kind->to_service || kind->type != DBUS_MESSAGE_TYPE_METHOD_CALL ?
+            server_sides[1] : NULL;
+
+          compiled_nsec = policy_perf_time_send (compiled, registry, receiver,
+                                                 message, &allowed, &toggles);
+          linear_nsec = policy_perf_time_send (linear, registry, receiver,
+                                               message, &linear_allowed,
+                                               &linear_toggles);
+          _dbus_assert (allowed == linear_allowed);
+          _dbus_assert (toggles == linear_toggles);
+
+          printf ("policy-perf: send    %-16s %-28s compiled %6.0f ns, "
+                  "linear %7.0f ns, %s\n", kind->name,
+                  kind->to_service ? picked[j]->d.send.destination : "",
+                  compiled_nsec, linear_nsec, allowed ? "allowed" : "denied");
+
+          if (receiver != NULL)
+            {
+              compiled_nsec = policy_perf_time_receive (compiled, registry,
+                                                        server_sides[0],
+                                                        receiver, message,
+                                                        &allowed, &toggles);
+              linear_nsec = policy_perf_time_receive (linear, registry,
+                                                      server_sides[0],
+                                                      receiver, message,
+                                                      &linear_allowed,
+                                                      &linear_toggles);
+              _dbus_assert (allowed == linear_allowed);
+              _dbus_assert (toggles == linear_toggles);
+
+              printf ("policy-perf: receive %-16s %-28s compiled %6.0f ns, "
+                      "linear %7.0f ns, %s\n", kind->name,
+                      kind->to_service ? picked[j]->d.send.destination : "",
+                      compiled_nsec, linear_nsec,
+                      allowed ? "allowed" : "denied");
+            }
+
+          dbus_message_unref (message);
+        }
+    }
+
+  /* gives the names back, without telling anyone */
+  bus_transaction_cancel_and_free (transaction);
+
+  bus_client_policy_unref (linear);
+  bus_client_policy_unref (compiled);
+  bus_policy_unref (policy);
+
+  for (i = 0; i < 2; i++)
+    kill_client_connection_unchecked (clients[i]);
+
+  bus_context_unref (context);
+
+  policy_perf_delete_corpus (&dir, n_services);
+  _dbus_string_free (&conf);
+  _dbus_string_free (&dir);
+
+  return TRUE;
+}
+
+#define COALESCE_FILLER_BYTES (256 * 1024)
+
+static void
+coalesce_test_send (BusContext     *context,
+                    DBusConnection *connection,
+                    DBusMessage    *message)
+{
+  BusTransaction *transaction;
+
+  transaction = bus_transaction_new (context);
+  if (transaction == NULL ||
+      !bus_transaction_send (transaction, connection, message))
+    _dbus_assert_not_reached ("no memory");
+
+  bus_transaction_execute_and_free (transaction);
+  dbus_message_unref (message);
+}
+
+static DBusMessage *
+coalesce_test_signal_new (const char *sender,
+                          const char *path,
+                          const char *interface,
+                          const char *member)
+{
+  DBusMessage *message;
+
+  message = dbus_message_new_signal (path, interface, member);
+  if (message == NULL ||
+      !dbus_message_set_sender (message, sender))
+    _dbus_assert_not_reached ("no memory");
+
+  return message;
+}
+
+static DBusMessage *
+coalesce_test_properties_changed_new (const char *sender,
+                                      const char *path)
+{
+  DBusMessage *message;
+  DBusMessageIter iter, array;
+  const char *interface = "com.example.Thing";
+
+  message = coalesce_test_signal_new (sender, path, DBUS_INTERFACE_PROPERTIES,
+                                      "PropertiesChanged");
+
+  dbus_message_iter_init_append (message, &iter);
+
+  if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &interface) ||
+      !dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "{sv}",
+                                         &array) ||
+      !dbus_message_iter_close_container (&iter, &array) ||
+      !dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "s",
+                                         &array) ||
+      !dbus_message_iter_close_container (&iter, &array))
+    _dbus_assert_not_reached ("no memory");
+
+  return message;
+}
+
+static DBusConnection *
+open_coalesce_test_client (BusContext *context)
+{
+  DBusConnection *connection;
+  DBusError error;
+
+  dbus_error_init (&error);
+
+  connection = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
+  if (connection == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
+
+  if (!bus_setup_debug_client (connection))
+    _dbus_assert_not_reached ("could not set up connection");
+
+  spin_connection_until_authenticated (context, connection);
+
+  if (!check_hello_message (context, connection))
+    _dbus_assert_not_reached ("hello message failed");
+
+  /* check_hello_message() expects everyone to see the next client */
+  if (!check_add_match (context, connection, ""))
+    _dbus_assert_not_reached ("AddMatch message failed");
+
+  return connection;
+}
+
+/* Expects the next message from @p sender, ignoring the filler, to be
+ * @p member on @p path, or a method return if @p path is #NULL */
+static void
+coalesce_test_expect (BusContext     *context,
+                      DBusConnection *connection,
+                      const char     *sender,
+                      const char     *path,
+                      const char     *member)
+{
+  DBusMessage *message;
+
+  while (TRUE)
+    {
+      message = pop_message_waiting_for_memory (connection);
+
+      if (message == NULL)
+        {
+          bus_test_run_everything (context);
+          continue;
+        }
+
+      if (dbus_message_has_sender (message, sender) &&
+          !dbus_message_has_member (message, "Fill"))
+        break;
 
-#ifdef DBUS_WIN
-  _dbus_warn("Info: Launch helper activation tests skipped because launch-helper is not supported yet\n");
-#else
-  /* run launch-helper activation tests */
-  _dbus_verbose ("Launch helper activation tests\n");
-  if (!bus_dispatch_test_conf (test_data_dir,
-  			       "valid-config-files-system/debug-allow-all-pass.conf", TRUE))
-    return FALSE;
+      dbus_message_unref (message);
+    }
 
-  /* run select launch-helper activation tests on broken service files */
-  if (!bus_dispatch_test_conf_fail (test_data_dir,
-  			            "valid-config-files-system/debug-allow-all-fail.conf"))
-    return FALSE;
-#endif
+  if (path == NULL ?
+      dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_RETURN :
+      (!dbus_message_has_path (message, path) ||
+       !dbus_message_has_member (message, member)))
+    {
+      warn_unexpected (connection, message, path == NULL ? "reply" : member);
+      _dbus_assert_not_reached ("PropertiesChanged signals out of order");
+    }
 
-  return TRUE;
+  dbus_message_unref (message);
 }
 
+/**
+ * Stalls a connection with more than it can take at once, and checks
+ * that a PropertiesChanged signal queued behind that is merged into
+ * the next one for the same object, unless its sender queued
+ * something else for the connection in between.
+ */
 dbus_bool_t
-bus_dispatch_sha1_test (const DBusString *test_data_dir)
+bus_coalesce_queue_test (const DBusString *test_data_dir)
 {
   BusContext *context;
-  DBusConnection *foo;
-  DBusError error;
-
-  dbus_error_init (&error);
-
-  /* Test SHA1 authentication */
-  _dbus_verbose ("Testing SHA1 context\n");
+  DBusConnection *emitter, *recipient, *server_side;
+  DBusMessage *message;
+  const char *sender;
+  char *filler;
+  int i;
 
   context = bus_context_new_test (test_data_dir,
-                                  "valid-config-files/debug-allow-all-sha1.conf");
+                                  "valid-config-files/coalesce.conf");
   if (context == NULL)
-    return FALSE;
+    _dbus_assert_not_reached ("could not alloc context");
 
-  foo = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
-  if (foo == NULL)
-    _dbus_assert_not_reached ("could not alloc connection");
+  recipient = open_coalesce_test_client (context);
+  emitter = open_coalesce_test_client (context);
+  sender = dbus_bus_get_unique_name (emitter);
+  server_side = get_server_side (context, recipient);
 
-  if (!bus_setup_debug_client (foo))
-    _dbus_assert_not_reached ("could not set up connection");
+  filler = dbus_malloc0 (COALESCE_FILLER_BYTES);
+  if (filler == NULL)
+    _dbus_assert_not_reached ("no memory");
 
-  spin_connection_until_authenticated (context, foo);
+  /* the recipient doesn't read until the end, so sooner or later what
+   * we send it has to wait in its queue */
+  for (i = 0; dbus_connection_get_outgoing_size (server_side) == 0; i++)
+    {
+      int len = COALESCE_FILLER_BYTES;
 
-  if (!check_hello_message (context, foo))
-    _dbus_assert_not_reached ("hello message failed");
+      if (i == 64)
+        _dbus_assert_not_reached ("could not fill the recipient's socket");
 
-  if (!check_add_match (context, foo, ""))
-    _dbus_assert_not_reached ("addmatch message failed");
+      message = coalesce_test_signal_new (sender, "/", "com.example.Filler",
+                                          "Fill");
+      if (!dbus_message_append_args (message,
+                                     DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE,
+                                     &filler, len,
+                                     DBUS_TYPE_INVALID))
+        _dbus_assert_not_reached ("no memory");
 
-  if (!check_no_leftovers (context))
-    {
-      _dbus_warn ("Messages were left over after setting up initial SHA-1 connection\n");
-      _dbus_assert_not_reached ("initial connection setup failed");
+      coalesce_test_send (context, server_side, message);
     }
 
-  check1_try_iterations (context, "create_and_hello_sha1",
-                         check_hello_connection);
+  dbus_free (filler);
 
-  kill_client_connection_unchecked (foo);
+  /* a reply in between must not be overtaken by the second signal */
+  coalesce_test_send (context, server_side,
+                      coalesce_test_properties_changed_new (sender, "/a"));
+
+  message = dbus_message_new (DBUS_MESSAGE_TYPE_METHOD_RETURN);
+  if (message == NULL ||
+      !dbus_message_set_sender (message, sender) ||
+      !dbus_message_set_reply_serial (message, 1))
+    _dbus_assert_not_reached ("no memory");
+
+  coalesce_test_send (context, server_side, message);
+  coalesce_test_send (context, server_side,
+                      coalesce_test_properties_changed_new (sender, "/a"));
+
+  /* with nothing in between, the first of these is merged away */
+  coalesce_test_send (context, server_side,
+                      coalesce_test_properties_changed_new (sender, "/b"));
+  coalesce_test_send (context, server_side,
+                      coalesce_test_properties_changed_new (sender, "/b"));
+
+  coalesce_test_send (context, server_side,
+                      coalesce_test_signal_new (sender, "/",
+                                                "com.example.Filler",
+                                                "Done"));
+
+  coalesce_test_expect (context, recipient, sender, "/a", "PropertiesChanged");
+  coalesce_test_expect (context, recipient, sender, NULL, NULL);
+  coalesce_test_expect (context, recipient, sender, "/a", "PropertiesChanged");
+  coalesce_test_expect (context, recipient, sender, "/b", "PropertiesChanged");
+  coalesce_test_expect (context, recipient, sender, "/", "Done");
+
+  kill_client_connection_unchecked (emitter);
+  kill_client_connection_unchecked (recipient);
 
   bus_context_unref (context);
 
@@ -5158,6 +7203,483 @@ bus_unix_fds_passing_test(const DBusString *test_data_dir)
 
   return TRUE;
 }
+
+/* Opens a client that has said Hello and, if @name is not #NULL,
+ * owns @name */
+static DBusConnection *
+open_peer_test_client (BusContext  *context,
+                       const char  *name,
+                       dbus_bool_t  unix_fds)
+{
+  CheckServiceOwnerChangedData socd;
+  DBusConnection *connection;
+  DBusMessage *message;
+  DBusError error;
+  dbus_uint32_t flags, result, serial;
+
+  dbus_error_init (&error);
+
+  connection = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
+  if (connection == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
+
+  if (!bus_setup_debug_client (connection))
+    _dbus_assert_not_reached ("could not set up connection");
+
+  if (!unix_fds)
+    _dbus_connection_disable_unix_fd_passing (connection);
+
+  spin_connection_until_authenticated (context, connection);
+
+  if (!check_hello_message (context, connection))
+    _dbus_assert_not_reached ("hello message failed");
+
+  if (!check_add_match (context, connection, ""))
+    _dbus_assert_not_reached ("AddMatch message failed");
+
+  _dbus_assert (dbus_connection_can_send_type (connection,
+                                               DBUS_TYPE_UNIX_FD) == unix_fds);
+
+  if (name == NULL)
+    return connection;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "RequestName");
+  flags = 0;
+
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_UINT32, &flags,
+                                 DBUS_TYPE_INVALID) ||
+      !dbus_connection_send (connection, message, &serial))
+    _dbus_assert_not_reached ("no memory");
+
+  dbus_message_unref (message);
+  bus_test_run_clients_loop (SEND_PENDING (connection));
+  block_connection_until_message_from_bus (context, connection,
+                                           "RequestName reply");
+  bus_test_run_everything (context);
+
+  /* everyone, us included, sees NameOwnerChanged; then we get
+   * NameAcquired and the reply */
+  socd.expected_kind = SERVICE_CREATED;
+  socd.expected_service_name = name;
+  socd.failed = FALSE;
+  socd.skip_connection = NULL;
+  bus_test_clients_foreach (check_service_owner_changed_foreach, &socd);
+
+  if (socd.failed)
+    _dbus_assert_not_reached ("no NameOwnerChanged for RequestName");
+
+  message = pop_message_waiting_for_memory (connection);
+  _dbus_assert (message != NULL);
+  _dbus_assert (dbus_message_is_signal (message, DBUS_INTERFACE_DBUS,
+                                        "NameAcquired"));
+  dbus_message_unref (message);
+
+  message = pop_message_waiting_for_memory (connection);
+  _dbus_assert (message != NULL);
+  _dbus_assert (dbus_message_get_reply_serial (message) == serial);
+
+  if (!dbus_message_get_args (message, &error,
+                              DBUS_TYPE_UINT32, &result,
+                              DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached (error.message);
+
+  _dbus_assert (result == DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER);
+  dbus_message_unref (message);
+
+  return connection;
+}
+
+typedef struct
+{
+  const char *unique_name;
+  DBusConnection *found;
+} FindClientData;
+
+static dbus_bool_t
+find_client_foreach (DBusConnection *connection,
+                     void           *data)
+{
+  FindClientData *d = data;
+  const char *name = dbus_bus_get_unique_name (connection);
+
+  if (name == NULL || strcmp (name, d->unique_name) != 0)
+    return TRUE;
+
+  d->found = connection;
+  return FALSE;
+}
+
+/* Returns the test client whose unique name is @unique_name */
+static DBusConnection *
+find_client (const char *unique_name)
+{
+  FindClientData d;
+
+  d.unique_name = unique_name;
+  d.found = NULL;
+  bus_test_clients_foreach (find_client_foreach, &d);
+
+  _dbus_assert (d.found != NULL);
+  return d.found;
+}
+
+/* Calls RequestPeerConnection for @name and returns the reply, or #NULL
+ * if there was no memory to send the call */
+static DBusMessage *
+call_request_peer_connection (BusContext     *context,
+                              DBusConnection *connection,
+                              const char     *name)
+{
+  DBusMessage *message;
+  dbus_uint32_t serial;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "RequestPeerConnection");
+
+  if (message == NULL)
+    return NULL;
+
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_INVALID) ||
+      !dbus_connection_send (connection, message, &serial))
+    {
+      dbus_message_unref (message);
+      return NULL;
+    }
+
+  dbus_message_unref (message);
+
+  bus_test_run_clients_loop (SEND_PENDING (connection));
+  block_connection_until_message_from_bus (context, connection,
+                                           "RequestPeerConnection reply");
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    _dbus_assert_not_reached ("no reply to RequestPeerConnection");
+
+  verbose_message_received (connection, message);
+  _dbus_assert (dbus_message_has_sender (message, DBUS_SERVICE_DBUS));
+  _dbus_assert (dbus_message_get_reply_serial (message) == serial);
+
+  return message;
+}
+
+/* Waits for the PeerConnectionRequested signal that the owner of a
+ * name gets once @reply has gone back to @requester */
+static DBusMessage *
+pop_peer_connection_requested (BusContext     *context,
+                               DBusConnection *requester,
+                               DBusMessage    *reply,
+                               DBusConnection **owner_p)
+{
+  DBusConnection *owner;
+  DBusMessage *signal;
+  DBusError error;
+  const char *owner_name, *requester_name;
+  int fd;
+
+  dbus_error_init (&error);
+
+  _dbus_assert (dbus_message_get_type (reply) ==
+                DBUS_MESSAGE_TYPE_METHOD_RETURN);
+
+  if (!dbus_message_get_args (reply, &error,
+                              DBUS_TYPE_UNIX_FD, &fd,
+                              DBUS_TYPE_STRING, &owner_name,
+                              DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached (error.message);
+
+  _dbus_close (fd, NULL);
+
+  owner = find_client (owner_name);
+  bus_test_run_everything (context);
+  block_connection_until_message_from_bus (context, owner,
+                                           "PeerConnectionRequested");
+
+  signal = pop_message_waiting_for_memory (owner);
+  if (signal == NULL)
+    _dbus_assert_not_reached ("owner was not told about the request");
+
+  verbose_message_received (owner, signal);
+  _dbus_assert (dbus_message_is_signal (signal, DBUS_INTERFACE_DBUS,
+                                        "PeerConnectionRequested"));
+  _dbus_assert (dbus_message_has_sender (signal, DBUS_SERVICE_DBUS));
+  _dbus_assert (dbus_message_has_destination (signal, owner_name));
+
+  if (!dbus_message_get_args (signal, &error,
+                              DBUS_TYPE_STRING, &requester_name,
+                              DBUS_TYPE_UNIX_FD, &fd,
+                              DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached (error.message);
+
+  _dbus_close (fd, NULL);
+  _dbus_assert (strcmp (requester_name,
+                        dbus_bus_get_unique_name (requester)) == 0);
+
+  if (owner_p != NULL)
+    *owner_p = owner;
+
+  return signal;
+}
+
+/* The bus refuses to hand out a socket, and tells nobody else */
+static void
+check_peer_connection_refused (BusContext     *context,
+                               DBusConnection *requester,
+                               const char     *name,
+                               const char     *error_name)
+{
+  DBusMessage *reply;
+
+  reply = call_request_peer_connection (context, requester, name);
+  _dbus_assert (reply != NULL);
+
+  if (!dbus_message_is_error (reply, error_name))
+    {
+      _dbus_warn ("expected %s asking for %s, got %s\n", error_name, name,
+                  nonnull (dbus_message_get_error_name (reply), "a reply"));
+      _dbus_assert_not_reached ("RequestPeerConnection not refused");
+    }
+
+  dbus_message_unref (reply);
+
+  bus_test_run_everything (context);
+  if (!check_no_leftovers (context))
+    _dbus_assert_not_reached ("a refused request was passed on");
+}
+
+/* The two ends authenticate with ANONYMOUS and can then talk, fds
+ * included, without the bus */
+static void
+check_peer_connection_allowed (BusContext     *context,
+                               DBusConnection *requester,
+                               const char     *name)
+{
+  DBusConnection *owner, *client, *server;
+  DBusMessage *reply, *signal, *forged, *message;
+  DBusSocket fds[2];
+  DBusError error;
+  char *peer_name;
+  int fd;
+
+  dbus_error_init (&error);
+
+  reply = call_request_peer_connection (context, requester, name);
+  _dbus_assert (reply != NULL);
+  signal = pop_peer_connection_requested (context, requester, reply, &owner);
+
+  /* only the bus can offer a peer connection */
+  forged = dbus_message_copy (signal);
+  if (forged == NULL || !dbus_message_set_sender (forged, ":1.999"))
+    _dbus_assert_not_reached ("no memory");
+
+  _dbus_assert (dbus_bus_accept_peer_connection (forged, &error) == NULL);
+  _dbus_assert (dbus_error_has_name (&error, DBUS_ERROR_INVALID_ARGS));
+  dbus_error_free (&error);
+  dbus_message_unref (forged);
+
+  server = dbus_bus_accept_peer_connection (signal, &error);
+  if (server == NULL)
+    _dbus_assert_not_reached (error.message);
+
+  client = _dbus_bus_peer_connection_from_reply (reply, &peer_name, &error);
+  if (client == NULL)
+    _dbus_assert_not_reached (error.message);
+
+  _dbus_assert (strcmp (peer_name, dbus_bus_get_unique_name (owner)) == 0);
+  dbus_free (peer_name);
+  dbus_message_unref (signal);
+  dbus_message_unref (reply);
+
+  while (!dbus_connection_get_is_authenticated (client) ||
+         !dbus_connection_get_is_authenticated (server))
+    {
+      if (!dbus_connection_read_write (client, 10) ||
+          !dbus_connection_read_write (server, 10))
+        _dbus_assert_not_reached ("peer handshake failed");
+    }
+
+  /* the owner accepted a peer that didn't prove who it was */
+  _dbus_assert (dbus_connection_get_is_anonymous (server));
+  _dbus_assert (dbus_connection_can_send_type (client, DBUS_TYPE_UNIX_FD));
+  _dbus_assert (dbus_connection_can_send_type (server, DBUS_TYPE_UNIX_FD));
+
+  if (!_dbus_socketpair (&fds[0], &fds[1], TRUE, &error))
+    _dbus_assert_not_reached (error.message);
+
+  message = dbus_message_new_method_call (NULL, "/", "com.example.Peer",
+                                          "Direct");
+  fd = _dbus_socket_get_int (fds[0]);
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_UNIX_FD, &fd,
+                                 DBUS_TYPE_INVALID) ||
+      !dbus_connection_send (client, message, NULL))
+    _dbus_assert_not_reached ("no memory");
+
+  dbus_message_unref (message);
+  dbus_connection_flush (client);
+  _dbus_close_socket (fds[0], NULL);
+  _dbus_close_socket (fds[1], NULL);
+
+  while ((message = dbus_connection_pop_message (server)) == NULL)
+    {
+      if (!dbus_connection_read_write (server, 10))
+        _dbus_assert_not_reached ("peer disconnected");
+    }
+
+  _dbus_assert (dbus_message_is_method_call (message, "com.example.Peer",
+                                             "Direct"));
+  _dbus_assert (dbus_message_has_signature (message, DBUS_TYPE_UNIX_FD_AS_STRING));
+  dbus_message_unref (message);
+
+  /* and none of it went through the bus */
+  bus_test_run_everything (context);
+  if (!check_no_leftovers (context))
+    _dbus_assert_not_reached ("peer traffic reached the bus");
+
+  dbus_connection_close (client);
+  dbus_connection_unref (client);
+  dbus_connection_close (server);
+  dbus_connection_unref (server);
+}
+
+/* An owner that ignores the signal closes its end, and the requester's
+ * end never authenticates */
+static void
+check_peer_connection_ignored (BusContext     *context,
+                               DBusConnection *requester,
+                               const char     *name)
+{
+  DBusConnection *client;
+  DBusMessage *reply;
+  DBusError error;
+
+  dbus_error_init (&error);
+
+  reply = call_request_peer_connection (context, requester, name);
+  _dbus_assert (reply != NULL);
+  dbus_message_unref (pop_peer_connection_requested (context, requester,
+                                                     reply, NULL));
+
+  client = _dbus_bus_peer_connection_from_reply (reply, NULL, &error);
+  if (client == NULL)
+    _dbus_assert_not_reached (error.message);
+
+  dbus_message_unref (reply);
+
+  while (dbus_connection_read_write (client, 10))
+    ;
+
+  _dbus_assert (!dbus_connection_get_is_authenticated (client));
+
+  dbus_connection_close (client);
+  dbus_connection_unref (client);
+}
+
+/* A request either fails with NoMemory and tells the owner nothing, or
+ * hands both sides their socket */
+static dbus_bool_t
+check_request_peer_connection (BusContext     *context,
+                               DBusConnection *connection)
+{
+  DBusMessage *reply;
+
+  reply = call_request_peer_connection (context, connection,
+                                        "com.example.Open");
+
+  if (reply == NULL)
+    return TRUE;
+
+  if (dbus_message_is_error (reply, DBUS_ERROR_NO_MEMORY))
+    {
+      dbus_message_unref (reply);
+      bus_test_run_everything (context);
+      return TRUE;
+    }
+
+  dbus_message_unref (pop_peer_connection_requested (context, connection,
+                                                     reply, NULL));
+  dbus_message_unref (reply);
+
+  return TRUE;
+}
+
+dbus_bool_t
+bus_peer_connection_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *requester, *no_fds_requester;
+  DBusConnection *open, *refusing, *closed, *no_fds;
+  DBusConnection *guarded, *guarded_member;
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/peer-connection.conf");
+  if (context == NULL)
+    _dbus_assert_not_reached ("could not alloc context");
+
+  requester = open_peer_test_client (context, NULL, TRUE);
+  no_fds_requester = open_peer_test_client (context, NULL, FALSE);
+  open = open_peer_test_client (context, "com.example.Open", TRUE);
+  refusing = open_peer_test_client (context, "com.example.Refusing", TRUE);
+  closed = open_peer_test_client (context, "com.example.Closed", TRUE);
+  no_fds = open_peer_test_client (context, "com.example.NoFds", FALSE);
+  guarded = open_peer_test_client (context, "com.example.Guarded", TRUE);
+  guarded_member = open_peer_test_client (context,
+                                          "com.example.GuardedMember", TRUE);
+
+  /* a deny rule for the method itself */
+  check_peer_connection_refused (context, requester, "com.example.Refusing",
+                                 DBUS_ERROR_ACCESS_DENIED);
+  /* the method is allowed, but a socket would bypass rules denying
+   * some other interface or member */
+  check_peer_connection_refused (context, requester, "com.example.Guarded",
+                                 DBUS_ERROR_ACCESS_DENIED);
+  check_peer_connection_refused (context, requester,
+                                 "com.example.GuardedMember",
+                                 DBUS_ERROR_ACCESS_DENIED);
+  /* method calls are denied by default, as on the system bus */
+  check_peer_connection_refused (context, requester, "com.example.Closed",
+                                 DBUS_ERROR_ACCESS_DENIED);
+  /* both sides need fd passing, whatever the policy says */
+  check_peer_connection_refused (context, requester, "com.example.NoFds",
+                                 DBUS_ERROR_NOT_SUPPORTED);
+  check_peer_connection_refused (context, no_fds_requester,
+                                 "com.example.Open",
+                                 DBUS_ERROR_NOT_SUPPORTED);
+  check_peer_connection_refused (context, requester, "com.example.Nobody",
+                                 DBUS_ERROR_NAME_HAS_NO_OWNER);
+  check_peer_connection_refused (context, open, "com.example.Open",
+                                 DBUS_ERROR_INVALID_ARGS);
+
+  check_peer_connection_allowed (context, requester, "com.example.Open");
+  check_peer_connection_ignored (context, requester, "com.example.Open");
+
+  check2_try_iterations (context, requester, "request_peer_connection",
+                         check_request_peer_connection);
+
+  kill_client_connection_unchecked (requester);
+  kill_client_connection_unchecked (no_fds_requester);
+  kill_client_connection_unchecked (open);
+  kill_client_connection_unchecked (refusing);
+  kill_client_connection_unchecked (closed);
+  kill_client_connection_unchecked (no_fds);
+  kill_client_connection_unchecked (guarded);
+  kill_client_connection_unchecked (guarded_member);
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
 #endif
 
 #endif /* DBUS_ENABLE_EMBEDDED_TESTS */
@@ -28,6 +28,7 @@
 #include "connection.h"
 #include "driver.h"
 #include "dispatch.h"
+#include "policy.h"
 #include "services.h"
 #include "selinux.h"
 #include "signals.h"
@@ -39,6 +40,7 @@
 #include <dbus/dbus-string.h>
 #include <dbus/dbus-internals.h>
 #include <dbus/dbus-message.h>
+#include <dbus/dbus-message-internal.h>
 #include <dbus/dbus-marshal-recursive.h>
 #include <dbus/dbus-marshal-validate.h>
 #include <string.h>
@@ -410,6 +412,7 @@ bus_driver_handle_hello (DBusConnection *connection,
                          DBusError      *error)
 {
   DBusString unique_name;
+  unsigned char unique_name_storage[32];
   BusService *service;
   dbus_bool_t retval;
   BusRegistry *registry;
@@ -439,11 +442,8 @@ bus_driver_handle_hello (DBusConnection *connection,
       return FALSE;
     }
 
-  if (!_dbus_string_init (&unique_name))
-    {
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
+  _dbus_string_init_borrowed (&unique_name, unique_name_storage,
+                              sizeof (unique_name_storage));
 
   retval = FALSE;
 
@@ -531,96 +531,56 @@ bus_driver_send_welcome_message (DBusConnection *connection,
 }
 
 static dbus_bool_t
-bus_driver_handle_list_services (DBusConnection *connection,
-                                 BusTransaction *transaction,
-                                 DBusMessage    *message,
-                                 DBusError      *error)
+send_names_snapshot (DBusConnection *connection,
+                     BusTransaction *transaction,
+                     DBusMessage    *message,
+                     DBusMessage    *snapshot,
+                     DBusError      *error)
 {
   DBusMessage *reply;
-  int len;
-  char **services;
-  BusRegistry *registry;
-  int i;
-  DBusMessageIter iter;
-  DBusMessageIter sub;
-
-  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-
-  registry = bus_connection_get_registry (connection);
 
-  reply = dbus_message_new_method_return (message);
-  if (reply == NULL)
+  if (snapshot == NULL)
     {
       BUS_SET_OOM (error);
       return FALSE;
     }
 
-  if (!bus_registry_list_services (registry, &services, &len))
+  /* the snapshot only lacks the addressing of a method return */
+  reply = dbus_message_copy (snapshot);
+  if (reply == NULL)
     {
-      dbus_message_unref (reply);
       BUS_SET_OOM (error);
       return FALSE;
     }
 
-  dbus_message_iter_init_append (reply, &iter);
-
-  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
-                                         DBUS_TYPE_STRING_AS_STRING,
-                                         &sub))
+  if (!dbus_message_set_reply_serial (reply, dbus_message_get_serial (message)) ||
+      !dbus_message_set_destination (reply, dbus_message_get_sender (message)) ||
+      !bus_transaction_send_from_driver (transaction, connection, reply))
     {
-      dbus_free_string_array (services);
       dbus_message_unref (reply);
       BUS_SET_OOM (error);
       return FALSE;
     }
 
-  {
-    /* Include the bus driver in the list */
-    const char *v_STRING = DBUS_SERVICE_DBUS;
-    if (!dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING,
-                                         &v_STRING))
-      {
-        dbus_free_string_array (services);
-        dbus_message_unref (reply);
-        BUS_SET_OOM (error);
-        return FALSE;
-      }
-  }
+  dbus_message_unref (reply);
+  return TRUE;
+}
 
-  i = 0;
-  while (i < len)
-    {
-      if (!dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING,
-                                           &services[i]))
-        {
-          dbus_free_string_array (services);
-          dbus_message_unref (reply);
-          BUS_SET_OOM (error);
-          return FALSE;
-        }
-      ++i;
-    }
+static dbus_bool_t
+bus_driver_handle_list_services (DBusConnection *connection,
+                                 BusTransaction *transaction,
+                                 DBusMessage    *message,
+                                 DBusError      *error)
+{
+  BusRegistry *registry;
 
-  dbus_free_string_array (services);
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
-  if (!dbus_message_iter_close_container (&iter, &sub))
-    {
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
+  registry = bus_connection_get_registry (connection);
 
-  if (!bus_transaction_send_from_driver (transaction, connection, reply))
-    {
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-  else
-    {
-      dbus_message_unref (reply);
-      return TRUE;
-    }
+  return send_names_snapshot (connection, transaction, message,
+                              bus_registry_get_names_snapshot (registry),
+                              error);
 }
 
 static dbus_bool_t
@@ -629,91 +589,15 @@ bus_driver_handle_list_activatable_services (DBusConnection *connection,
 					     DBusMessage    *message,
 					     DBusError      *error)
 {
-  DBusMessage *reply;
-  int len;
-  char **services;
   BusActivation *activation;
-  int i;
-  DBusMessageIter iter;
-  DBusMessageIter sub;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
   activation = bus_connection_get_activation (connection);
 
-  reply = dbus_message_new_method_return (message);
-  if (reply == NULL)
-    {
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-
-  if (!bus_activation_list_services (activation, &services, &len))
-    {
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-
-  dbus_message_iter_init_append (reply, &iter);
-
-  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
-					 DBUS_TYPE_STRING_AS_STRING,
-					 &sub))
-    {
-      dbus_free_string_array (services);
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-
-  {
-    /* Include the bus driver in the list */
-    const char *v_STRING = DBUS_SERVICE_DBUS;
-    if (!dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING,
-					 &v_STRING))
-      {
-	dbus_free_string_array (services);
-	dbus_message_unref (reply);
-	BUS_SET_OOM (error);
-	return FALSE;
-      }
-  }
-
-  i = 0;
-  while (i < len)
-    {
-      if (!dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING,
-					   &services[i]))
-	{
-	  dbus_free_string_array (services);
-	  dbus_message_unref (reply);
-	  BUS_SET_OOM (error);
-	  return FALSE;
-	}
-      ++i;
-    }
-
-  dbus_free_string_array (services);
-
-  if (!dbus_message_iter_close_container (&iter, &sub))
-    {
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-
-  if (!bus_transaction_send_from_driver (transaction, connection, reply))
-    {
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-  else
-    {
-      dbus_message_unref (reply);
-      return TRUE;
-    }
+  return send_names_snapshot (connection, transaction, message,
+                              bus_activation_get_names_snapshot (activation),
+                              error);
 }
 
 static dbus_bool_t
@@ -978,6 +862,125 @@ send_ack_reply (DBusConnection *connection,
   return TRUE;
 }
 
+/* Sends @watcher the current SignalInterest summary, which says
+ * everything if @everything is already known to */
+static dbus_bool_t
+send_signal_interest (DBusConnection *watcher,
+                      BusTransaction *transaction,
+                      dbus_bool_t     everything)
+{
+  BusContext *context;
+  BusMatchmaker *matchmaker;
+  DBusMessage *message;
+  unsigned char bitmap[DBUS_SIGNAL_INTEREST_BYTES];
+  const unsigned char *bitmap_p = bitmap;
+  dbus_uint32_t version;
+
+  context = bus_transaction_get_context (transaction);
+  matchmaker = bus_context_get_matchmaker (context);
+
+  version = bus_matchmaker_get_signal_interest_version (matchmaker);
+
+  if (bus_matchmaker_get_signal_interest (matchmaker, bitmap) ||
+      bus_connections_have_monitors (bus_context_get_connections (context)))
+    everything = TRUE;
+
+  message = dbus_message_new_signal (DBUS_PATH_DBUS,
+                                     DBUS_INTERFACE_DBUS,
+                                     "SignalInterest");
+
+  if (message == NULL)
+    return FALSE;
+
+  if (!dbus_message_set_destination (message, bus_connection_get_name (watcher)) ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_UINT32, &version,
+                                 DBUS_TYPE_BOOLEAN, &everything,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE,
+                                 &bitmap_p, DBUS_SIGNAL_INTEREST_BYTES,
+                                 DBUS_TYPE_INVALID) ||
+      !bus_transaction_send_from_driver (transaction, watcher, message))
+    {
+      dbus_message_unref (message);
+      return FALSE;
+    }
+
+  dbus_message_unref (message);
+  return TRUE;
+}
+
+/* Sends every connection that called WatchSignalInterest the current
+ * summary, unless it is what they were last sent. Monitors can't receive
+ * it, and don't need to: they are the reason it says everything.
+ *
+ * If this fails, some of them may still have a summary that rules out
+ * signals that could now be delivered, so a change that adds rules must
+ * be undone, while one that only removes them can be left for the next
+ * change to catch up with.
+ */
+static dbus_bool_t
+bus_driver_update_signal_interest (BusTransaction *transaction,
+                                   dbus_bool_t     force_everything)
+{
+  BusContext *context;
+  BusConnections *connections;
+  BusMatchmaker *matchmaker;
+  unsigned char bitmap[DBUS_SIGNAL_INTEREST_BYTES];
+  DBusList **watchers;
+  DBusList *link;
+  dbus_uint32_t version, sent_version;
+  dbus_bool_t everything, sent_everything;
+
+  context = bus_transaction_get_context (transaction);
+  connections = bus_context_get_connections (context);
+  matchmaker = bus_context_get_matchmaker (context);
+
+  version = bus_matchmaker_get_signal_interest_version (matchmaker);
+  everything = (bus_matchmaker_get_signal_interest (matchmaker, bitmap) ||
+                bus_connections_have_monitors (connections) ||
+                force_everything);
+
+  bus_connections_get_signal_interest_sent (connections, &sent_version,
+                                            &sent_everything);
+
+  if (version == sent_version && everything == sent_everything)
+    return TRUE;
+
+  watchers = bus_connections_get_signal_interest_watchers (connections);
+
+  for (link = _dbus_list_get_first_link (watchers);
+       link != NULL;
+       link = _dbus_list_get_next_link (watchers, link))
+    {
+      if (bus_connection_is_monitor (link->data))
+        continue;
+
+      if (!send_signal_interest (link->data, transaction, everything))
+        return FALSE;
+    }
+
+  bus_connections_set_signal_interest_sent (connections, version, everything);
+  return TRUE;
+}
+
+static dbus_bool_t
+bus_driver_handle_watch_signal_interest (DBusConnection *connection,
+                                         BusTransaction *transaction,
+                                         DBusMessage    *message,
+                                         DBusError      *error)
+{
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!bus_connection_watch_signal_interest (connection) ||
+      !send_signal_interest (connection, transaction, FALSE))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  return send_ack_reply (connection, transaction, message, error);
+}
+
 static dbus_bool_t
 bus_driver_handle_update_activation_environment (DBusConnection *connection,
                                                  BusTransaction *transaction,
@@ -1181,6 +1184,13 @@ bus_driver_handle_add_match (DBusConnection *connection,
       goto failed;
     }
 
+  if (!bus_driver_update_signal_interest (transaction, FALSE))
+    {
+      BUS_SET_OOM (error);
+      bus_matchmaker_remove_rule (matchmaker, rule);
+      goto failed;
+    }
+
   bus_match_rule_unref (rule);
 
   return TRUE;
@@ -1234,6 +1244,9 @@ bus_driver_handle_remove_match (DBusConnection *connection,
   if (!bus_matchmaker_remove_rule_by_value (matchmaker, rule, error))
     goto failed;
 
+  /* best-effort: a summary that still has the rule is merely pessimistic */
+  bus_driver_update_signal_interest (transaction, FALSE);
+
   bus_match_rule_unref (rule);
 
   return TRUE;
@@ -1245,70 +1258,276 @@ bus_driver_handle_remove_match (DBusConnection *connection,
   return FALSE;
 }
 
-static dbus_bool_t
-bus_driver_handle_get_service_owner (DBusConnection *connection,
-				     BusTransaction *transaction,
-				     DBusMessage    *message,
-				     DBusError      *error)
+static void
+free_match_rule_array (BusMatchRule **rules,
+                       int            n_rules)
 {
-  const char *text;
-  const char *base_name;
-  DBusString str;
-  BusRegistry *registry;
-  BusService *service;
-  DBusMessage *reply;
+  int i;
 
-  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+  if (rules == NULL)
+    return;
 
-  registry = bus_connection_get_registry (connection);
+  for (i = 0; i < n_rules; i++)
+    {
+      if (rules[i] != NULL)
+        bus_match_rule_unref (rules[i]);
+    }
 
-  text = NULL;
-  reply = NULL;
+  dbus_free (rules);
+}
 
-  if (! dbus_message_get_args (message, error,
-			       DBUS_TYPE_STRING, &text,
-			       DBUS_TYPE_INVALID))
-      goto failed;
+/* Parse every rule in the message's string array before touching the
+ * matchmaker, so that a malformed rule rejects the whole batch.
+ */
+static BusMatchRule **
+parse_match_rule_array (DBusConnection *connection,
+                        DBusMessage    *message,
+                        int            *n_rules_p,
+                        DBusError      *error)
+{
+  char **texts;
+  int n_texts;
+  BusMatchRule **rules;
+  DBusString str;
+  int i;
 
-  _dbus_string_init_const (&str, text);
-  service = bus_registry_lookup (registry, &str);
-  if (service == NULL &&
-      _dbus_string_equal_c_str (&str, DBUS_SERVICE_DBUS))
+  texts = NULL;
+  rules = NULL;
+
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+                              &texts, &n_texts,
+                              DBUS_TYPE_INVALID))
     {
-      /* ORG_FREEDESKTOP_DBUS owns itself */
-      base_name = DBUS_SERVICE_DBUS;
+      _dbus_verbose ("No memory to get array of match rules\n");
+      goto failed;
     }
-  else if (service == NULL)
+
+  /* one extra so that an empty batch still gets a non-NULL array */
+  rules = dbus_new0 (BusMatchRule *, n_texts + 1);
+  if (rules == NULL)
     {
-      dbus_set_error (error,
-                      DBUS_ERROR_NAME_HAS_NO_OWNER,
-                      "Could not get owner of name '%s': no such name", text);
+      BUS_SET_OOM (error);
       goto failed;
     }
-  else
+
+  for (i = 0; i < n_texts; i++)
     {
-      base_name = bus_connection_get_name (bus_service_get_primary_owners_connection (service));
-      if (base_name == NULL)
-        {
-          /* FIXME - how is this error possible? */
-          dbus_set_error (error,
-                          DBUS_ERROR_FAILED,
-                          "Could not determine unique name for '%s'", text);
-          goto failed;
-        }
-      _dbus_assert (*base_name == ':');
+      _dbus_string_init_const (&str, texts[i]);
+
+      rules[i] = bus_match_rule_parse (connection, &str, error);
+      if (rules[i] == NULL)
+        goto failed;
     }
 
-  _dbus_assert (base_name != NULL);
+  dbus_free_string_array (texts);
+  *n_rules_p = n_texts;
+  return rules;
 
-  reply = dbus_message_new_method_return (message);
-  if (reply == NULL)
-    goto oom;
+ failed:
+  _DBUS_ASSERT_ERROR_IS_SET (error);
+  if (rules != NULL)
+    free_match_rule_array (rules, n_texts);
+  dbus_free_string_array (texts);
+  return NULL;
+}
 
-  if (! dbus_message_append_args (reply,
-				  DBUS_TYPE_STRING, &base_name,
-				  DBUS_TYPE_INVALID))
-    goto oom;
+static dbus_bool_t
+bus_driver_handle_add_matches (DBusConnection *connection,
+                               BusTransaction *transaction,
+                               DBusMessage    *message,
+                               DBusError      *error)
+{
+  BusMatchRule **rules;
+  int n_rules;
+  int n_added;
+  int i;
+  const char *bustype;
+  BusMatchmaker *matchmaker;
+  BusContext *context;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  n_rules = 0;
+  n_added = 0;
+  context = bus_transaction_get_context (transaction);
+  matchmaker = bus_connection_get_matchmaker (connection);
+
+  rules = parse_match_rule_array (connection, message, &n_rules, error);
+  if (rules == NULL)
+    goto failed;
+
+  /* The batch is all-or-nothing, so it has to fit in its entirety */
+  if (n_rules > 0 &&
+      bus_connection_get_n_match_rules (connection) + n_rules >
+      bus_context_get_max_match_rules_per_connection (context))
+    {
+      dbus_set_error (error, DBUS_ERROR_LIMITS_EXCEEDED,
+                      "Connection \"%s\" is not allowed to add %d more match "
+                      "rules (increase limits in configuration file if "
+                      "required)",
+                      bus_connection_is_active (connection) ?
+                      bus_connection_get_name (connection) :
+                      "(inactive)",
+                      n_rules);
+      goto failed;
+    }
+
+  bustype = context ? bus_context_get_type (context) : NULL;
+
+  for (i = 0; i < n_rules; i++)
+    {
+      if (bus_match_rule_get_client_is_eavesdropping (rules[i]) &&
+          !bus_apparmor_allows_eavesdropping (connection, bustype, error))
+        goto failed;
+    }
+
+  for (n_added = 0; n_added < n_rules; n_added++)
+    {
+      if (!bus_matchmaker_add_rule (matchmaker, rules[n_added]))
+        {
+          BUS_SET_OOM (error);
+          goto failed;
+        }
+    }
+
+  if (!send_ack_reply (connection, transaction,
+                       message, error))
+    goto failed;
+
+  if (!bus_driver_update_signal_interest (transaction, FALSE))
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  free_match_rule_array (rules, n_rules);
+
+  return TRUE;
+
+ failed:
+  _DBUS_ASSERT_ERROR_IS_SET (error);
+  for (i = 0; i < n_added; i++)
+    bus_matchmaker_remove_rule (matchmaker, rules[i]);
+  free_match_rule_array (rules, n_rules);
+  return FALSE;
+}
+
+static dbus_bool_t
+bus_driver_handle_remove_matches (DBusConnection *connection,
+                                  BusTransaction *transaction,
+                                  DBusMessage    *message,
+                                  DBusError      *error)
+{
+  BusMatchRule **rules;
+  int n_rules;
+  int i;
+  BusMatchmaker *matchmaker;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  n_rules = 0;
+
+  rules = parse_match_rule_array (connection, message, &n_rules, error);
+  if (rules == NULL)
+    goto failed;
+
+  /* Rules are removed in order; if one of them is not found, the ones
+   * before it stay removed and the caller gets MatchRuleNotFound. Unlike
+   * RemoveMatch we only ack once everything has been removed, so that
+   * the caller doesn't get an ack followed by an error. If we run out of
+   * memory for the ack, the rules stay removed, which is one of the
+   * outcomes a caller has to expect from a NoMemory error anyway.
+   */
+  matchmaker = bus_connection_get_matchmaker (connection);
+
+  for (i = 0; i < n_rules; i++)
+    {
+      if (!bus_matchmaker_remove_rule_by_value (matchmaker, rules[i], error))
+        goto failed;
+    }
+
+  /* best-effort, as in RemoveMatch */
+  bus_driver_update_signal_interest (transaction, FALSE);
+
+  if (!send_ack_reply (connection, transaction,
+                       message, error))
+    goto failed;
+
+  free_match_rule_array (rules, n_rules);
+
+  return TRUE;
+
+ failed:
+  _DBUS_ASSERT_ERROR_IS_SET (error);
+  free_match_rule_array (rules, n_rules);
+  return FALSE;
+}
+
+static dbus_bool_t
+bus_driver_handle_get_service_owner (DBusConnection *connection,
+				     BusTransaction *transaction,
+				     DBusMessage    *message,
+				     DBusError      *error)
+{
+  const char *text;
+  const char *base_name;
+  DBusString str;
+  BusRegistry *registry;
+  BusService *service;
+  DBusMessage *reply;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  registry = bus_connection_get_registry (connection);
+
+  text = NULL;
+  reply = NULL;
+
+  if (! dbus_message_get_args (message, error,
+			       DBUS_TYPE_STRING, &text,
+			       DBUS_TYPE_INVALID))
+      goto failed;
+
+  _dbus_string_init_const (&str, text);
+  service = bus_registry_lookup (registry, &str);
+  if (service == NULL &&
+      _dbus_string_equal_c_str (&str, DBUS_SERVICE_DBUS))
+    {
+      /* ORG_FREEDESKTOP_DBUS owns itself */
+      base_name = DBUS_SERVICE_DBUS;
+    }
+  else if (service == NULL)
+    {
+      dbus_set_error (error,
+                      DBUS_ERROR_NAME_HAS_NO_OWNER,
+                      "Could not get owner of name '%s': no such name", text);
+      goto failed;
+    }
+  else
+    {
+      base_name = bus_connection_get_name (bus_service_get_primary_owners_connection (service));
+      if (base_name == NULL)
+        {
+          /* FIXME - how is this error possible? */
+          dbus_set_error (error,
+                          DBUS_ERROR_FAILED,
+                          "Could not determine unique name for '%s'", text);
+          goto failed;
+        }
+      _dbus_assert (*base_name == ':');
+    }
+
+  _dbus_assert (base_name != NULL);
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    goto oom;
+
+  if (! dbus_message_append_args (reply,
+				  DBUS_TYPE_STRING, &base_name,
+				  DBUS_TYPE_INVALID))
+    goto oom;
 
   if (! bus_transaction_send_from_driver (transaction, connection, reply))
     goto oom;
@@ -1665,11 +1884,8 @@ bus_driver_handle_get_connection_credentials (DBusConnection *connection,
                                               DBusError      *error)
 {
   DBusConnection *conn;
+  DBusMessage *snapshot;
   DBusMessage *reply;
-  DBusMessageIter reply_iter;
-  DBusMessageIter array_iter;
-  unsigned long ulong_val;
-  char *s;
   const char *service;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
@@ -1682,78 +1898,21 @@ bus_driver_handle_get_connection_credentials (DBusConnection *connection,
   if (conn == NULL)
     goto failed;
 
-  reply = _dbus_asv_new_method_return (message, &reply_iter, &array_iter);
-  if (reply == NULL)
+  snapshot = bus_connection_get_credentials_snapshot (conn);
+  if (snapshot == NULL)
     goto oom;
 
-  /* we can't represent > 32-bit pids; if your system needs them, please
-   * add ProcessID64 to the spec or something */
-  if (dbus_connection_get_unix_process_id (conn, &ulong_val) &&
-      ulong_val <= _DBUS_UINT32_MAX)
-    {
-      if (!_dbus_asv_add_uint32 (&array_iter, "ProcessID", ulong_val))
-        goto oom;
-    }
-
-  /* we can't represent > 32-bit uids; if your system needs them, please
-   * add UnixUserID64 to the spec or something */
-  if (dbus_connection_get_unix_user (conn, &ulong_val) &&
-      ulong_val <= _DBUS_UINT32_MAX)
-    {
-      if (!_dbus_asv_add_uint32 (&array_iter, "UnixUserID", ulong_val))
-        goto oom;
-    }
-
-  if (dbus_connection_get_windows_user (conn, &s))
-    {
-      DBusString str;
-      dbus_bool_t result;
-
-      if (s == NULL)
-        goto oom;
-
-      _dbus_string_init_const (&str, s);
-      result = _dbus_validate_utf8 (&str, 0, _dbus_string_get_length (&str));
-      _dbus_string_free (&str);
-      if (result)
-        {
-          if (!_dbus_asv_add_string (&array_iter, "WindowsSID", s))
-            {
-              dbus_free (s);
-              goto oom;
-            }
-        }
-      dbus_free (s);
-    }
-
-  if (_dbus_connection_get_linux_security_label (conn, &s))
-    {
-      if (s == NULL)
-        goto oom;
-
-      /* use the GVariant bytestring convention for strings of unknown
-       * encoding: include the \0 in the payload, for zero-copy reading */
-      if (!_dbus_asv_add_byte_array (&array_iter, "LinuxSecurityLabel",
-                                     s, strlen (s) + 1))
-        {
-          dbus_free (s);
-          goto oom;
-        }
-
-      dbus_free (s);
-    }
+  /* the snapshot only lacks the addressing of a method return */
+  reply = dbus_message_copy (snapshot);
+  if (reply == NULL)
+    goto oom;
 
-  if (!_dbus_asv_close (&reply_iter, &array_iter))
+  if (!dbus_message_set_reply_serial (reply, dbus_message_get_serial (message)) ||
+      !dbus_message_set_destination (reply, dbus_message_get_sender (message)))
     goto oom;
 
   if (! bus_transaction_send_from_driver (transaction, connection, reply))
-    {
-      /* this time we don't want to close the iterator again, so just
-       * get rid of the message */
-      dbus_message_unref (reply);
-      reply = NULL;
-      goto oom;
-    }
+    goto oom;
 
   dbus_message_unref (reply);
 
@@ -1766,10 +1925,7 @@ bus_driver_handle_get_connection_credentials (DBusConnection *connection,
   _DBUS_ASSERT_ERROR_IS_SET (error);
 
   if (reply)
-    {
-      _dbus_asv_abandon (&reply_iter, &array_iter);
-      dbus_message_unref (reply);
-    }
+    dbus_message_unref (reply);
 
   return FALSE;
 }
@@ -1932,86 +2088,359 @@ bus_driver_handle_get_id (DBusConnection *connection,
   return FALSE;
 }
 
+#ifdef HAVE_UNIX_FD_PASSING
+/* Hands the caller and the owner of a name the two ends of a
+ * socketpair, so that they can talk without going through us */
 static dbus_bool_t
-bus_driver_handle_become_monitor (DBusConnection *connection,
-                                  BusTransaction *transaction,
-                                  DBusMessage    *message,
-                                  DBusError      *error)
+bus_driver_handle_request_peer_connection (DBusConnection *connection,
+                                           BusTransaction *transaction,
+                                           DBusMessage    *message,
+                                           DBusError      *error)
 {
-  char **match_rules = NULL;
-  const char *bustype;
-  BusContext *context;
-  BusMatchRule *rule;
-  DBusList *rules = NULL;
-  DBusList *iter;
+  const char *name;
+  const char *requester;
+  const char *owner;
   DBusString str;
-  int i;
-  int n_match_rules;
-  dbus_uint32_t flags;
-  dbus_bool_t ret = FALSE;
+  BusRegistry *registry;
+  BusService *service;
+  DBusConnection *peer;
+  DBusMessage *probe;
+  DBusMessage *signal;
+  DBusMessage *reply;
+  DBusSocket fds[2] = { DBUS_SOCKET_INIT, DBUS_SOCKET_INIT };
+  int fd;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
-  if (!bus_driver_check_message_is_for_us (message, error))
-    goto out;
+  probe = NULL;
+  signal = NULL;
+  reply = NULL;
 
-  context = bus_transaction_get_context (transaction);
-  bustype = context ? bus_context_get_type (context) : NULL;
-  if (!bus_apparmor_allows_eavesdropping (connection, bustype, error))
-    goto out;
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_STRING, &name,
+                              DBUS_TYPE_INVALID))
+    goto failed;
 
-  if (!bus_driver_check_caller_is_privileged (connection, transaction,
-                                              message, error))
-    goto out;
+  registry = bus_connection_get_registry (connection);
+  _dbus_string_init_const (&str, name);
+  service = bus_registry_lookup (registry, &str);
 
-  if (!dbus_message_get_args (message, error,
-        DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &match_rules, &n_match_rules,
-        DBUS_TYPE_UINT32, &flags,
-        DBUS_TYPE_INVALID))
-    goto out;
+  if (service == NULL)
+    {
+      dbus_set_error (error, DBUS_ERROR_NAME_HAS_NO_OWNER,
+                      "Could not connect to '%s': no such name", name);
+      goto failed;
+    }
 
-  if (flags != 0)
+  peer = bus_service_get_primary_owners_connection (service);
+
+  if (peer == connection)
     {
       dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
-          "BecomeMonitor does not support any flags yet");
-      goto out;
+                      "Could not connect to '%s': it is owned by the caller",
+                      name);
+      goto failed;
     }
 
-  /* Special case: a zero-length array becomes [""] */
-  if (n_match_rules == 0)
+  if (!dbus_connection_can_send_type (connection, DBUS_TYPE_UNIX_FD) ||
+      !dbus_connection_can_send_type (peer, DBUS_TYPE_UNIX_FD))
     {
-      match_rules = dbus_malloc (2 * sizeof (char *));
+      dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                      "Could not connect to '%s': both connections must "
+                      "support Unix fd passing", name);
+      goto failed;
+    }
 
-      if (match_rules == NULL)
-        {
-          BUS_SET_OOM (error);
-          goto out;
-        }
+  /* Nothing the peers send each other from now on is checked against
+   * the policy, so the caller must at least be allowed to send this
+   * very call on to the peer, which the system bus's default policy
+   * does not allow. It is never delivered, so no reply is awaited. */
+  probe = dbus_message_copy (message);
+  if (probe == NULL ||
+      !dbus_message_set_destination (probe, name))
+    goto oom;
 
-      match_rules[0] = _dbus_strdup ("");
+  dbus_message_set_no_reply (probe, TRUE);
 
-      if (match_rules[0] == NULL)
-        {
-          BUS_SET_OOM (error);
-          goto out;
-        }
+  if (!bus_context_check_security_policy (bus_transaction_get_context (transaction),
+                                          transaction, connection, peer, peer,
+                                          probe, error))
+    goto failed;
 
-      match_rules[1] = NULL;
-      n_match_rules = 1;
+  /* That says nothing about rules for only some of the messages they
+   * could exchange, say a deny rule with send_interface or send_member;
+   * with none of those between them, the check above covers the lot */
+  if (bus_client_policy_restricts_messages (bus_connection_get_policy (connection),
+                                            registry, BUS_POLICY_RULE_SEND,
+                                            peer) ||
+      bus_client_policy_restricts_messages (bus_connection_get_policy (peer),
+                                            registry, BUS_POLICY_RULE_RECEIVE,
+                                            connection))
+    {
+      dbus_set_error (error, DBUS_ERROR_ACCESS_DENIED,
+                      "Could not connect to '%s': the security policy only "
+                      "allows some of the messages the caller could send it",
+                      name);
+      goto failed;
     }
 
-  for (i = 0; i < n_match_rules; i++)
-    {
-      _dbus_string_init_const (&str, match_rules[i]);
-      rule = bus_match_rule_parse (connection, &str, error);
+  if (!_dbus_socketpair (&fds[0], &fds[1], FALSE, error))
+    goto failed;
 
-      if (rule == NULL)
-        {
-          BUS_SET_OOM (error);
-          goto out;
-        }
+  requester = bus_connection_get_name (connection);
+  owner = bus_connection_get_name (peer);
 
-      /* monitors always eavesdrop */
+  signal = dbus_message_new_signal (DBUS_PATH_DBUS,
+                                    DBUS_INTERFACE_DBUS,
+                                    "PeerConnectionRequested");
+  if (signal == NULL)
+    goto oom;
+
+  /* Appending duplicates the fds, so ours are closed below either way */
+  fd = _dbus_socket_get_int (fds[1]);
+  if (!dbus_message_set_destination (signal, owner) ||
+      !dbus_message_append_args (signal,
+                                 DBUS_TYPE_STRING, &requester,
+                                 DBUS_TYPE_UNIX_FD, &fd,
+                                 DBUS_TYPE_INVALID))
+    goto oom;
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    goto oom;
+
+  fd = _dbus_socket_get_int (fds[0]);
+  if (!dbus_message_append_args (reply,
+                                 DBUS_TYPE_UNIX_FD, &fd,
+                                 DBUS_TYPE_STRING, &owner,
+                                 DBUS_TYPE_INVALID))
+    goto oom;
+
+  /* The peer gets the signal before anything the caller sends it over
+   * the new socket, and after anything the caller sent it through us */
+  if (!bus_transaction_send_from_driver (transaction, peer, signal) ||
+      !bus_transaction_send_from_driver (transaction, connection, reply))
+    goto oom;
+
+  _dbus_close_socket (fds[0], NULL);
+  _dbus_close_socket (fds[1], NULL);
+  dbus_message_unref (probe);
+  dbus_message_unref (signal);
+  dbus_message_unref (reply);
+  return TRUE;
+
+ oom:
+  BUS_SET_OOM (error);
+
+ failed:
+  _DBUS_ASSERT_ERROR_IS_SET (error);
+
+  if (_dbus_socket_is_valid (fds[0]))
+    _dbus_close_socket (fds[0], NULL);
+  if (_dbus_socket_is_valid (fds[1]))
+    _dbus_close_socket (fds[1], NULL);
+  if (probe)
+    dbus_message_unref (probe);
+  if (signal)
+    dbus_message_unref (signal);
+  if (reply)
+    dbus_message_unref (reply);
+  return FALSE;
+}
+#endif
+
+/* Replies to org.freedesktop.DBus.Peer never change during the
+ * daemon's lifetime, so each is built once and then copied; health
+ * checks calling Ping in a loop only pay for the copy.
+ */
+static DBusMessage *ping_reply = NULL;
+static DBusMessage *machine_id_reply = NULL;
+
+static void
+free_peer_reply (void *data)
+{
+  DBusMessage **template_p = data;
+
+  dbus_message_unref (*template_p);
+  *template_p = NULL;
+}
+
+static DBusMessage *
+get_peer_reply (DBusMessage **template_p,
+                const char   *machine_id)
+{
+  DBusMessage *template_message;
+
+  if (*template_p != NULL)
+    return *template_p;
+
+  template_message = dbus_message_new (DBUS_MESSAGE_TYPE_METHOD_RETURN);
+  if (template_message == NULL)
+    return NULL;
+
+  if ((machine_id != NULL &&
+       !dbus_message_append_args (template_message,
+                                  DBUS_TYPE_STRING, &machine_id,
+                                  DBUS_TYPE_INVALID)) ||
+      !_dbus_register_shutdown_func (free_peer_reply, template_p))
+    {
+      dbus_message_unref (template_message);
+      return NULL;
+    }
+
+  *template_p = template_message;
+  return template_message;
+}
+
+static dbus_bool_t
+send_peer_reply (DBusConnection *connection,
+                 BusTransaction *transaction,
+                 DBusMessage    *message,
+                 DBusMessage    *template_message,
+                 DBusError      *error)
+{
+  DBusMessage *reply;
+
+  reply = _dbus_message_new_reply_from_template (template_message, message);
+  if (reply == NULL)
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!bus_transaction_send_from_driver (transaction, connection, reply))
+    {
+      dbus_message_unref (reply);
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  dbus_message_unref (reply);
+  return TRUE;
+}
+
+static dbus_bool_t
+bus_driver_handle_ping (DBusConnection *connection,
+                        BusTransaction *transaction,
+                        DBusMessage    *message,
+                        DBusError      *error)
+{
+  DBusMessage *template_message;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  template_message = get_peer_reply (&ping_reply, NULL);
+  if (template_message == NULL)
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  return send_peer_reply (connection, transaction, message, template_message,
+                          error);
+}
+
+static dbus_bool_t
+bus_driver_handle_get_machine_id (DBusConnection *connection,
+                                  BusTransaction *transaction,
+                                  DBusMessage    *message,
+                                  DBusError      *error)
+{
+  DBusMessage *template_message;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  template_message = machine_id_reply;
+
+  if (template_message == NULL)
+    {
+      DBusString uuid;
+
+      if (!_dbus_string_init (&uuid))
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      if (!_dbus_get_local_machine_uuid_encoded (&uuid, error))
+        {
+          _dbus_string_free (&uuid);
+          return FALSE;
+        }
+
+      template_message = get_peer_reply (&machine_id_reply,
+                                         _dbus_string_get_const_data (&uuid));
+      _dbus_string_free (&uuid);
+
+      if (template_message == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+    }
+
+  return send_peer_reply (connection, transaction, message, template_message,
+                          error);
+}
+
+/* Checks shared by BecomeMonitor and BecomeMonitorWithOptions */
+static dbus_bool_t
+check_caller_may_monitor (DBusConnection *connection,
+                          BusTransaction *transaction,
+                          DBusMessage    *message,
+                          DBusError      *error)
+{
+  const char *bustype;
+  BusContext *context;
+
+  if (!bus_driver_check_message_is_for_us (message, error))
+    return FALSE;
+
+  context = bus_transaction_get_context (transaction);
+  bustype = context ? bus_context_get_type (context) : NULL;
+  if (!bus_apparmor_allows_eavesdropping (connection, bustype, error))
+    return FALSE;
+
+  return bus_driver_check_caller_is_privileged (connection, transaction,
+                                                message, error);
+}
+
+static dbus_bool_t
+become_monitor (DBusConnection          *connection,
+                BusTransaction          *transaction,
+                DBusMessage             *message,
+                const char * const      *match_rules,
+                int                      n_match_rules,
+                const BusMonitorOptions *options,
+                DBusError               *error)
+{
+  /* Special case: a zero-length array becomes [""] */
+  static const char * const match_all[] = { "" };
+  BusMatchRule *rule;
+  DBusList *rules = NULL;
+  DBusList *iter;
+  DBusString str;
+  int i;
+  dbus_bool_t ret = FALSE;
+
+  if (n_match_rules == 0)
+    {
+      match_rules = match_all;
+      n_match_rules = 1;
+    }
+
+  for (i = 0; i < n_match_rules; i++)
+    {
+      _dbus_string_init_const (&str, match_rules[i]);
+      rule = bus_match_rule_parse (connection, &str, error);
+
+      if (rule == NULL)
+        {
+          BUS_SET_OOM (error);
+          goto out;
+        }
+
+      /* monitors always eavesdrop */
       bus_match_rule_set_client_is_eavesdropping (rule, TRUE);
 
       if (!_dbus_list_append (&rules, rule))
@@ -2028,7 +2457,16 @@ bus_driver_handle_become_monitor (DBusConnection *connection,
   if (!send_ack_reply (connection, transaction, message, error))
     goto out;
 
-  if (!bus_connection_be_monitor (connection, transaction, &rules, error))
+  /* Publishers must stop skipping signals before there is a monitor to
+   * see them, so this can't wait until it is one */
+  if (!bus_driver_update_signal_interest (transaction, TRUE))
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  if (!bus_connection_be_monitor (connection, transaction, &rules, options,
+                                  error))
     goto out;
 
   ret = TRUE;
@@ -2046,6 +2484,136 @@ out:
 
   _dbus_list_clear (&rules);
 
+  return ret;
+}
+
+static dbus_bool_t
+bus_driver_handle_become_monitor (DBusConnection *connection,
+                                  BusTransaction *transaction,
+                                  DBusMessage    *message,
+                                  DBusError      *error)
+{
+  BusMonitorOptions options = BUS_MONITOR_OPTIONS_INIT;
+  char **match_rules = NULL;
+  int n_match_rules;
+  dbus_uint32_t flags;
+  dbus_bool_t ret = FALSE;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!check_caller_may_monitor (connection, transaction, message, error))
+    goto out;
+
+  if (!dbus_message_get_args (message, error,
+        DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &match_rules, &n_match_rules,
+        DBUS_TYPE_UINT32, &flags,
+        DBUS_TYPE_INVALID))
+    goto out;
+
+  if (flags != 0)
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+          "BecomeMonitor does not support any flags yet");
+      goto out;
+    }
+
+  ret = become_monitor (connection, transaction, message,
+                        (const char * const *) match_rules, n_match_rules,
+                        &options, error);
+
+out:
+  dbus_free_string_array (match_rules);
+  return ret;
+}
+
+/* Reads the a{sv} of BecomeMonitorWithOptions into @options */
+static dbus_bool_t
+read_monitor_options (DBusMessageIter   *arr_iter,
+                      BusMonitorOptions *options,
+                      DBusError         *error)
+{
+  while (dbus_message_iter_get_arg_type (arr_iter) == DBUS_TYPE_DICT_ENTRY)
+    {
+      DBusMessageIter entry_iter, var_iter;
+      const char *key;
+      int type;
+
+      dbus_message_iter_recurse (arr_iter, &entry_iter);
+      dbus_message_iter_get_basic (&entry_iter, &key);
+      dbus_message_iter_next (&entry_iter);
+      dbus_message_iter_recurse (&entry_iter, &var_iter);
+      type = dbus_message_iter_get_arg_type (&var_iter);
+
+      if (strcmp (key, "SampleInterval") == 0 && type == DBUS_TYPE_UINT32)
+        {
+          dbus_message_iter_get_basic (&var_iter, &options->sample_interval);
+
+          if (options->sample_interval == 0)
+            {
+              dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                              "SampleInterval must be at least 1");
+              return FALSE;
+            }
+        }
+      else if (strcmp (key, "MaxMessagesPerSecond") == 0 &&
+               type == DBUS_TYPE_UINT32)
+        {
+          dbus_message_iter_get_basic (&var_iter, &options->max_per_second);
+        }
+      else if (strcmp (key, "HeadersOnly") == 0 &&
+               type == DBUS_TYPE_BOOLEAN)
+        {
+          dbus_message_iter_get_basic (&var_iter, &options->headers_only);
+        }
+      else
+        {
+          dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                          "Unknown monitor option \"%s\" of type \"%c\"",
+                          key, type);
+          return FALSE;
+        }
+
+      dbus_message_iter_next (arr_iter);
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+bus_driver_handle_become_monitor_with_options (DBusConnection *connection,
+                                               BusTransaction *transaction,
+                                               DBusMessage    *message,
+                                               DBusError      *error)
+{
+  BusMonitorOptions options = BUS_MONITOR_OPTIONS_INIT;
+  char **match_rules = NULL;
+  int n_match_rules;
+  DBusMessageIter iter, arr_iter;
+  dbus_bool_t ret = FALSE;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!check_caller_may_monitor (connection, transaction, message, error))
+    goto out;
+
+  /* the signature was checked against "asa{sv}" already */
+  if (!dbus_message_get_args (message, error,
+        DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &match_rules, &n_match_rules,
+        DBUS_TYPE_INVALID))
+    goto out;
+
+  dbus_message_iter_init (message, &iter);
+  dbus_message_iter_next (&iter);
+  dbus_message_iter_recurse (&iter, &arr_iter);
+
+  if (!read_monitor_options (&arr_iter, &options, error))
+    goto out;
+
+  ret = become_monitor (connection, transaction, message,
+                        (const char * const *) match_rules, n_match_rules,
+                        &options, error);
+
+out:
   dbus_free_string_array (match_rules);
   return ret;
 }
@@ -2106,6 +2674,18 @@ static const MessageHandler dbus_message_handlers[] = {
     DBUS_TYPE_STRING_AS_STRING,
     "",
     bus_driver_handle_remove_match },
+  { "AddMatches",
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
+    "",
+    bus_driver_handle_add_matches },
+  { "RemoveMatches",
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
+    "",
+    bus_driver_handle_remove_matches },
+  { "WatchSignalInterest",
+    "",
+    "",
+    bus_driver_handle_watch_signal_interest },
   { "GetNameOwner",
     DBUS_TYPE_STRING_AS_STRING,
     DBUS_TYPE_STRING_AS_STRING,
@@ -2140,6 +2720,10 @@ static const MessageHandler dbus_message_handlers[] = {
     bus_driver_handle_get_id },
   { "GetConnectionCredentials", "s", "a{sv}",
     bus_driver_handle_get_connection_credentials },
+#ifdef HAVE_UNIX_FD_PASSING
+  { "RequestPeerConnection", "s", "hs",
+    bus_driver_handle_request_peer_connection },
+#endif
   { NULL, NULL, NULL, NULL }
 };
 
@@ -2151,8 +2735,17 @@ static const MessageHandler introspectable_message_handlers[] = {
   { NULL, NULL, NULL, NULL }
 };
 
+static const MessageHandler peer_message_handlers[] = {
+  { "Ping", "", "", bus_driver_handle_ping },
+  { "GetMachineId", "", DBUS_TYPE_STRING_AS_STRING,
+    bus_driver_handle_get_machine_id },
+  { NULL, NULL, NULL, NULL }
+};
+
 static const MessageHandler monitoring_message_handlers[] = {
   { "BecomeMonitor", "asu", "", bus_driver_handle_become_monitor },
+  { "BecomeMonitorWithOptions", "asa{sv}", "",
+    bus_driver_handle_become_monitor_with_options },
   { NULL, NULL, NULL, NULL }
 };
 
@@ -2168,7 +2761,14 @@ static const MessageHandler verbose_message_handlers[] = {
 static const MessageHandler stats_message_handlers[] = {
   { "GetStats", "", "a{sv}", bus_stats_handle_get_stats },
   { "GetConnectionStats", "s", "a{sv}", bus_stats_handle_get_connection_stats },
+  { "GetAllConnectionStats", "u", "a(sa{sv})", bus_stats_handle_get_all_connection_stats },
   { "GetAllMatchRules", "", "a{sas}", bus_stats_handle_get_all_match_rules },
+  { "GetMatchRulesPaged", "su", "a{sas}s", bus_stats_handle_get_match_rules_paged },
+  { "ListNamesPaged", "su", "ass", bus_stats_handle_list_names_paged },
+  { "GetLatencyHistograms", "", "a{s(ttua(ut))}", bus_stats_handle_get_latency_histograms },
+  { "GetTopTalkers", "", "a(sssttt)", bus_stats_handle_get_top_talkers },
+  { "SetPhaseTiming", "b", "", bus_stats_handle_set_phase_timing },
+  { "GetPhaseTimings", "", "tta{s(tt)}", bus_stats_handle_get_phase_timings },
   { NULL, NULL, NULL, NULL }
 };
 #endif
@@ -2193,7 +2793,20 @@ static InterfaceHandler interface_handlers[] = {
     "    </signal>\n"
     "    <signal name=\"NameAcquired\">\n"
     "      <arg type=\"s\"/>\n"
-    "    </signal>\n" },
+    "    </signal>\n"
+    "    <signal name=\"SignalInterest\">\n"
+    "      <arg type=\"u\"/>\n"
+    "      <arg type=\"b\"/>\n"
+    "      <arg type=\"ay\"/>\n"
+    "    </signal>\n"
+#ifdef HAVE_UNIX_FD_PASSING
+    "    <signal name=\"PeerConnectionRequested\">\n"
+    "      <arg type=\"s\"/>\n"
+    "      <arg type=\"h\"/>\n"
+    "    </signal>\n"
+#endif
+    },
+  { DBUS_INTERFACE_PEER, peer_message_handlers, NULL },
   { DBUS_INTERFACE_INTROSPECTABLE, introspectable_message_handlers, NULL },
   { DBUS_INTERFACE_MONITORING, monitoring_message_handlers, NULL },
 #ifdef DBUS_ENABLE_VERBOSE_MODE
@@ -2287,13 +2900,52 @@ bus_driver_generate_introspect_string (DBusString *xml)
   return TRUE;
 }
 
+/* The driver's interfaces are fixed at compile time, so its
+ * introspection data only needs generating once */
+static char *introspect_xml = NULL;
+
+static void
+free_introspect_xml (void *data)
+{
+  dbus_free (introspect_xml);
+  introspect_xml = NULL;
+}
+
+static const char *
+get_introspect_xml (void)
+{
+  DBusString xml;
+
+  if (introspect_xml != NULL)
+    return introspect_xml;
+
+  if (!_dbus_string_init (&xml))
+    return NULL;
+
+  if (!bus_driver_generate_introspect_string (&xml) ||
+      !_dbus_string_steal_data (&xml, &introspect_xml))
+    {
+      _dbus_string_free (&xml);
+      return NULL;
+    }
+
+  _dbus_string_free (&xml);
+
+  if (!_dbus_register_shutdown_func (free_introspect_xml, NULL))
+    {
+      free_introspect_xml (NULL);
+      return NULL;
+    }
+
+  return introspect_xml;
+}
+
 static dbus_bool_t
 bus_driver_handle_introspect (DBusConnection *connection,
                               BusTransaction *transaction,
                               DBusMessage    *message,
                               DBusError      *error)
 {
-  DBusString xml;
   DBusMessage *reply;
   const char *v_STRING;
 
@@ -2310,17 +2962,10 @@ bus_driver_handle_introspect (DBusConnection *connection,
       return FALSE;
     }
 
-  if (!_dbus_string_init (&xml))
-    {
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-
-  if (!bus_driver_generate_introspect_string (&xml))
+  v_STRING = get_introspect_xml ();
+  if (v_STRING == NULL)
     goto oom;
 
-  v_STRING = _dbus_string_get_const_data (&xml);
-
   reply = dbus_message_new_method_return (message);
   if (reply == NULL)
     goto oom;
@@ -2334,7 +2979,6 @@ bus_driver_handle_introspect (DBusConnection *connection,
     goto oom;
 
   dbus_message_unref (reply);
-  _dbus_string_free (&xml);
 
   return TRUE;
 
@@ -2344,8 +2988,6 @@ bus_driver_handle_introspect (DBusConnection *connection,
   if (reply)
     dbus_message_unref (reply);
 
-  _dbus_string_free (&xml);
-
   return FALSE;
 }
 
@@ -2381,6 +3023,94 @@ bus_driver_check_message_is_for_us (DBusMessage *message,
   return TRUE;
 }
 
+/* All the methods above, hashed by name, so that finding the handler
+ * for a call costs one string comparison rather than one per method.
+ * It is an open-addressed table at most half full; entries for the
+ * same name are probed in interface_handlers order. */
+#define METHOD_INDEX_SIZE 128
+
+typedef struct
+{
+  const InterfaceHandler *ih;
+  const MessageHandler *mh;
+  unsigned int hash;
+} MethodIndexEntry;
+
+static MethodIndexEntry method_index[METHOD_INDEX_SIZE];
+static dbus_bool_t method_index_built = FALSE;
+
+static unsigned int
+method_name_hash (const char *name)
+{
+  unsigned int hash = 0;
+
+  for (; *name != '\0'; name++)
+    hash = hash * 31 + (unsigned char) *name;
+
+  return hash;
+}
+
+/* The dbus-daemon is single-threaded, so this needs no locking */
+static void
+method_index_build (void)
+{
+  const InterfaceHandler *ih;
+  const MessageHandler *mh;
+  int n_methods = 0;
+
+  for (ih = interface_handlers; ih->name != NULL; ih++)
+    {
+      for (mh = ih->message_handlers; mh->name != NULL; mh++)
+        {
+          unsigned int hash = method_name_hash (mh->name);
+          unsigned int i = hash & (METHOD_INDEX_SIZE - 1);
+
+          while (method_index[i].mh != NULL)
+            i = (i + 1) & (METHOD_INDEX_SIZE - 1);
+
+          method_index[i].ih = ih;
+          method_index[i].mh = mh;
+          method_index[i].hash = hash;
+          n_methods++;
+        }
+    }
+
+  /* keep probe sequences short */
+  _dbus_assert (n_methods <= METHOD_INDEX_SIZE / 2);
+
+  method_index_built = TRUE;
+}
+
+/* Finds a method by name in the given interface, or in any if it is
+ * NULL, in which case the first interface with such a method wins.
+ * Returns NULL if there is none. */
+static const MethodIndexEntry *
+method_index_lookup (const char *interface,
+                     const char *name)
+{
+  unsigned int hash;
+  unsigned int i;
+
+  if (!method_index_built)
+    method_index_build ();
+
+  hash = method_name_hash (name);
+
+  for (i = hash & (METHOD_INDEX_SIZE - 1);
+       method_index[i].mh != NULL;
+       i = (i + 1) & (METHOD_INDEX_SIZE - 1))
+    {
+      const MethodIndexEntry *entry = &method_index[i];
+
+      if (entry->hash == hash &&
+          strcmp (entry->mh->name, name) == 0 &&
+          (interface == NULL || strcmp (interface, entry->ih->name) == 0))
+        return entry;
+    }
+
+  return NULL;
+}
+
 dbus_bool_t
 bus_driver_handle_message (DBusConnection *connection,
                            BusTransaction *transaction,
@@ -2390,7 +3120,8 @@ bus_driver_handle_message (DBusConnection *connection,
   const char *name, *interface;
   const InterfaceHandler *ih;
   const MessageHandler *mh;
-  dbus_bool_t found_interface = FALSE;
+  const MethodIndexEntry *entry;
+  dbus_bool_t found_interface;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
@@ -2439,53 +3170,52 @@ bus_driver_handle_message (DBusConnection *connection,
   _dbus_assert (dbus_message_get_sender (message) != NULL ||
                 strcmp (name, "Hello") == 0);
 
-  for (ih = interface_handlers; ih->name != NULL; ih++)
+  entry = method_index_lookup (interface, name);
+
+  if (entry != NULL)
     {
-      if (interface != NULL && strcmp (interface, ih->name) != 0)
-        continue;
+      mh = entry->mh;
 
-      found_interface = TRUE;
+      _dbus_verbose ("Found driver handler for %s\n", name);
 
-      for (mh = ih->message_handlers; mh->name != NULL; mh++)
+      if (!dbus_message_has_signature (message, mh->in_args))
         {
-          if (strcmp (mh->name, name) != 0)
-            continue;
-
-          _dbus_verbose ("Found driver handler for %s\n", name);
-
-          if (!dbus_message_has_signature (message, mh->in_args))
-            {
-              _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-              _dbus_verbose ("Call to %s has wrong args (%s, expected %s)\n",
-                             name, dbus_message_get_signature (message),
-                             mh->in_args);
-
-              dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
-                              "Call to %s has wrong args (%s, expected %s)\n",
-                              name, dbus_message_get_signature (message),
-                              mh->in_args);
-              _DBUS_ASSERT_ERROR_IS_SET (error);
-              return FALSE;
-            }
+          _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+          _dbus_verbose ("Call to %s has wrong args (%s, expected %s)\n",
+                         name, dbus_message_get_signature (message),
+                         mh->in_args);
+
+          dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                          "Call to %s has wrong args (%s, expected %s)\n",
+                          name, dbus_message_get_signature (message),
+                          mh->in_args);
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          return FALSE;
+        }
 
-          if ((* mh->handler) (connection, transaction, message, error))
-            {
-              _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-              _dbus_verbose ("Driver handler succeeded\n");
-              return TRUE;
-            }
-          else
-            {
-              _DBUS_ASSERT_ERROR_IS_SET (error);
-              _dbus_verbose ("Driver handler returned failure\n");
-              return FALSE;
-            }
+      if ((* mh->handler) (connection, transaction, message, error))
+        {
+          _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+          _dbus_verbose ("Driver handler succeeded\n");
+          return TRUE;
+        }
+      else
+        {
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          _dbus_verbose ("Driver handler returned failure\n");
+          return FALSE;
         }
     }
 
   _dbus_verbose ("No driver handler for message \"%s\"\n",
                  name);
 
+  /* only the error needs to know whether the interface exists */
+  found_interface = (interface == NULL);
+
+  for (ih = interface_handlers; ih->name != NULL && !found_interface; ih++)
+    found_interface = (strcmp (interface, ih->name) == 0);
+
   dbus_set_error (error, found_interface ? DBUS_ERROR_UNKNOWN_METHOD : DBUS_ERROR_UNKNOWN_INTERFACE,
                   "%s does not understand message %s",
                   DBUS_SERVICE_DBUS, name);
@@ -30,7 +30,7 @@
 
 struct BusExpireList
 {
-  DBusList      *items; /**< List of BusExpireItem */
+  DBusList      *items; /**< List of BusExpireItem, most recently added first */
   DBusTimeout   *timeout;
   DBusLoop      *loop;
   BusExpireFunc  expire_func;
@@ -40,6 +40,16 @@ struct BusExpireList
 
 static dbus_bool_t expire_timeout_handler (void *data);
 
+static dbus_bool_t
+expire_item_added_after (BusExpireItem *a,
+                         BusExpireItem *b)
+{
+  if (a->added_tv_sec != b->added_tv_sec)
+    return a->added_tv_sec > b->added_tv_sec;
+
+  return a->added_tv_usec > b->added_tv_usec;
+}
+
 BusExpireList*
 bus_expire_list_new (DBusLoop      *loop,
                      int            expire_after,
@@ -92,7 +102,8 @@ bus_expire_list_free (BusExpireList *list)
 }
 
 void
-bus_expire_timeout_set_interval (DBusTimeout   *timeout,
+bus_expire_timeout_set_interval (DBusLoop      *loop,
+                                 DBusTimeout   *timeout,
                                  int            next_interval)
 {
   if (next_interval >= 0)
@@ -100,6 +111,7 @@ bus_expire_timeout_set_interval (DBusTimeout   *timeout,
       _dbus_timeout_set_interval (timeout,
                                   next_interval);
       _dbus_timeout_set_enabled (timeout, TRUE);
+      _dbus_loop_toggle_timeout (loop, timeout);
 
       _dbus_verbose ("Enabled an expire timeout with interval %d\n",
                      next_interval);
@@ -107,6 +119,7 @@ bus_expire_timeout_set_interval (DBusTimeout   *timeout,
   else if (dbus_timeout_get_enabled (timeout))
     {
       _dbus_timeout_set_enabled (timeout, FALSE);
+      _dbus_loop_toggle_timeout (loop, timeout);
 
       _dbus_verbose ("Disabled an expire timeout\n");
     }
@@ -119,7 +132,7 @@ bus_expire_list_recheck_immediately (BusExpireList *list)
 {
   _dbus_verbose ("setting interval on expire list to 0 for immediate recheck\n");
 
-  bus_expire_timeout_set_interval (list->timeout, 0);
+  bus_expire_timeout_set_interval (list->loop, list->timeout, 0);
 }
 
 static int
@@ -128,16 +141,16 @@ do_expiration_with_monotonic_time (BusExpireList *list,
                                    long           tv_usec)
 {
   DBusList *link;
-  int next_interval, min_wait_time, items_to_expire;
+  int next_interval;
 
   next_interval = -1;
-  min_wait_time = 3600 * 1000; /* this is reset anyway if used */
-  items_to_expire = 0;
-  
-  link = _dbus_list_get_first_link (&list->items);
+
+  /* The list is sorted by the time items were added, so walk it from
+   * the oldest end and stop at the first item that hasn't expired yet */
+  link = _dbus_list_get_last_link (&list->items);
   while (link != NULL)
     {
-      DBusList *next = _dbus_list_get_next_link (&list->items, link);
+      DBusList *prev = _dbus_list_get_prev_link (&list->items, link);
       double elapsed;
       BusExpireItem *item;
 
@@ -164,22 +177,17 @@ do_expiration_with_monotonic_time (BusExpireList *list,
               break;
             }
         }
-      else if (list->expire_after > 0)
+      else
         {
-          double to_wait;
+          if (list->expire_after > 0)
+            next_interval = (double) list->expire_after - elapsed;
 
-          items_to_expire = 1;
-          to_wait = (double) list->expire_after - elapsed;
-          if (min_wait_time > to_wait)
-            min_wait_time = to_wait;
+          break;
         }
 
-      link = next;
+      link = prev;
     }
 
-  if (next_interval < 0 && items_to_expire)
-    next_interval = min_wait_time;
-
   return next_interval;
 }
 
@@ -199,7 +207,7 @@ bus_expirelist_expire (BusExpireList *list)
       next_interval = do_expiration_with_monotonic_time (list, tv_sec, tv_usec);
     }
 
-  bus_expire_timeout_set_interval (list->timeout, next_interval);
+  bus_expire_timeout_set_interval (list->loop, list->timeout, next_interval);
 }
 
 static dbus_bool_t
@@ -236,29 +244,61 @@ bus_expire_list_unlink (BusExpireList *list,
   _dbus_list_unlink (&list->items, link);
 }
 
+/* The item must have been added no earlier than every item already in
+ * the list */
 dbus_bool_t
 bus_expire_list_add (BusExpireList *list,
                      BusExpireItem *item)
 {
   dbus_bool_t ret;
 
+  _dbus_assert (list->items == NULL ||
+                !expire_item_added_after (list->items->data, item));
+
   ret = _dbus_list_prepend (&list->items, item);
   if (ret && !dbus_timeout_get_enabled (list->timeout))
-    bus_expire_timeout_set_interval (list->timeout, 0);
+    bus_expire_timeout_set_interval (list->loop, list->timeout, 0);
 
   return ret;
 }
 
+/* Unlike bus_expire_list_add(), the item can have been added at any
+ * time, e.g. when putting back an item taken out with
+ * bus_expire_list_unlink(); that costs a walk past every later item */
 void
 bus_expire_list_add_link (BusExpireList *list,
                           DBusList      *link)
 {
+  DBusList *before;
+
   _dbus_assert (link->data != NULL);
-  
-  _dbus_list_prepend_link (&list->items, link);
+
+  before = _dbus_list_get_first_link (&list->items);
+  while (before != NULL && expire_item_added_after (before->data, link->data))
+    before = _dbus_list_get_next_link (&list->items, before);
+
+  _dbus_list_insert_before_link (&list->items, before, link);
 
   if (!dbus_timeout_get_enabled (list->timeout))
-    bus_expire_timeout_set_interval (list->timeout, 0);
+    bus_expire_timeout_set_interval (list->loop, list->timeout, 0);
+}
+
+/* Expire an item the next time the list is checked, regardless of when
+ * it was added */
+void
+bus_expire_list_expire_link_soon (BusExpireList *list,
+                                  DBusList      *link)
+{
+  BusExpireItem *item = link->data;
+
+  item->added_tv_sec = 0;
+  item->added_tv_usec = 0;
+
+  /* it is now the oldest item */
+  _dbus_list_unlink (&list->items, link);
+  _dbus_list_append_link (&list->items, link);
+
+  bus_expire_list_recheck_immediately (list);
 }
 
 DBusList*
@@ -327,6 +367,7 @@ bus_expire_list_test (const DBusString *test_data_dir)
   long tv_sec_expired, tv_usec_expired;
   long tv_sec_past, tv_usec_past;
   TestExpireItem *item;
+  TestExpireItem *item2;
   int next_interval;
   dbus_bool_t result = FALSE;
 
@@ -387,6 +428,42 @@ bus_expire_list_test (const DBusString *test_data_dir)
   _dbus_verbose ("next_interval = %d\n", next_interval);
   _dbus_assert (next_interval == 1000 + EXPIRE_AFTER);
 
+  /* a later item doesn't expire with the first, and the walk stops at it */
+  item2 = dbus_new0 (TestExpireItem, 1);
+
+  if (item2 == NULL)
+    goto oom;
+
+  item2->item.added_tv_sec = tv_sec;
+  item2->item.added_tv_usec = tv_usec;
+  time_add_milliseconds (&item2->item.added_tv_sec,
+                         &item2->item.added_tv_usec, EXPIRE_AFTER / 2);
+  if (!bus_expire_list_add (list, &item2->item))
+    _dbus_assert_not_reached ("out of memory");
+
+  next_interval =
+    do_expiration_with_monotonic_time (list, tv_sec_expired,
+                                       tv_usec_expired);
+  _dbus_assert (item->expire_count == 2);
+  _dbus_assert (item2->expire_count == 0);
+  _dbus_verbose ("next_interval = %d\n", next_interval);
+  _dbus_assert (next_interval == EXPIRE_AFTER / 2);
+
+  /* an item marked to expire soon becomes the oldest */
+  bus_expire_list_expire_link_soon (list,
+                                    bus_expire_list_get_first_link (list));
+
+  next_interval =
+    do_expiration_with_monotonic_time (list, tv_sec_not_expired,
+                                       tv_usec_not_expired);
+  _dbus_assert (item->expire_count == 2);
+  _dbus_assert (item2->expire_count == 1);
+  _dbus_verbose ("next_interval = %d\n", next_interval);
+  _dbus_assert (next_interval == 1);
+
+  bus_expire_list_remove (list, &item2->item);
+  dbus_free (item2);
+
   bus_expire_list_remove (list, &item->item);
   dbus_free (item);
   
@@ -64,6 +64,8 @@ dbus_bool_t    bus_expire_list_contains_item       (BusExpireList *list,
                                                     BusExpireItem *item);
 void           bus_expire_list_unlink              (BusExpireList *list,
                                                     DBusList      *link);
+void           bus_expire_list_expire_link_soon    (BusExpireList *list,
+                                                    DBusList      *link);
 
 /* this macro and function are semi-related utility functions, not really part of the
  * BusExpireList API
@@ -74,7 +76,8 @@ void           bus_expire_list_unlink              (BusExpireList *list,
  (((double) (now_tv_sec) - (double) (orig_tv_sec)) * 1000.0 +   \
  ((double) (now_tv_usec) - (double) (orig_tv_usec)) / 1000.0)
 
-void bus_expire_timeout_set_interval (DBusTimeout   *timeout,
+void bus_expire_timeout_set_interval (DBusLoop      *loop,
+                                      DBusTimeout   *timeout,
                                       int            next_interval);
 
 #endif /* BUS_EXPIRE_LIST_H */
@@ -0,0 +1,412 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* log-queue.c  Writing log messages from a helper thread
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "log-queue.h"
+#include "test.h"
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-threads-internal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef DBUS_UNIX
+#include <pthread.h>
+#include <signal.h>
+#endif
+
+/** Most messages waiting to be written before new ones are dropped */
+#define MAX_QUEUED_LOG_MESSAGES 256
+
+/* The helper thread must not call dbus_malloc() or dbus_free(): memory
+ * accounting in the daemon assumes only the main thread does. So an
+ * entry stays in its slot until it has been written, and its text is
+ * freed by the main thread when the slot is reused or the queue freed. */
+typedef struct
+{
+  DBusSystemLogSeverity severity;
+  char *text;                      /**< Written out already if outside the queued entries */
+  dbus_bool_t use_syslog;
+  unsigned long n_dropped_before;  /**< Messages dropped just before this one */
+} BusLogEntry;
+
+struct BusLogQueue
+{
+  DBusCMutex *mutex;                 /**< Protects everything below */
+  DBusCondVar *queued_cond;          /**< Signalled when a message is queued, or on stopping */
+  DBusCondVar *idle_cond;            /**< Signalled when everything queued has been written */
+  BusLogWriteFunction write_function;
+  BusLogEntry entries[MAX_QUEUED_LOG_MESSAGES];  /**< Ring buffer */
+  int head;                          /**< Index of the oldest entry, being written if writing */
+  int n_entries;
+  unsigned long n_dropped;           /**< Dropped since the last queued message */
+  dbus_bool_t writing;               /**< The helper thread is writing a message */
+  dbus_bool_t stopping;              /**< The helper thread should finish up and exit */
+#ifdef DBUS_UNIX
+  pthread_t thread;
+#endif
+};
+
+static void
+write_dropped (BusLogQueue  *queue,
+               unsigned long n_dropped,
+               dbus_bool_t   use_syslog)
+{
+  char text[100];
+
+  snprintf (text, sizeof (text),
+            "%lu log messages were dropped because too many were queued",
+            n_dropped);
+  (* queue->write_function) (DBUS_SYSTEM_LOG_WARNING, text, use_syslog);
+}
+
+#ifdef DBUS_UNIX
+static void *
+log_thread (void *data)
+{
+  BusLogQueue *queue = data;
+  dbus_bool_t use_syslog = FALSE;
+
+  _dbus_cmutex_lock (queue->mutex);
+
+  while (TRUE)
+    {
+      BusLogEntry entry;
+
+      while (queue->n_entries == 0 && !queue->stopping)
+        _dbus_condvar_wait (queue->queued_cond, queue->mutex);
+
+      /* stop only once everything queued has been written */
+      if (queue->n_entries == 0)
+        break;
+
+      /* the slot stays queued, text and all, until it has been written */
+      entry = queue->entries[queue->head];
+      queue->writing = TRUE;
+      _dbus_cmutex_unlock (queue->mutex);
+
+      if (entry.n_dropped_before > 0)
+        write_dropped (queue, entry.n_dropped_before, entry.use_syslog);
+
+      (* queue->write_function) (entry.severity, entry.text, entry.use_syslog);
+      use_syslog = entry.use_syslog;
+
+      _dbus_cmutex_lock (queue->mutex);
+      queue->head = (queue->head + 1) % MAX_QUEUED_LOG_MESSAGES;
+      queue->n_entries -= 1;
+      queue->writing = FALSE;
+
+      if (queue->n_entries == 0)
+        _dbus_condvar_wake_one (queue->idle_cond);
+    }
+
+  if (queue->n_dropped > 0)
+    write_dropped (queue, queue->n_dropped, use_syslog);
+
+  _dbus_cmutex_unlock (queue->mutex);
+
+  return NULL;
+}
+#endif
+
+/**
+ * Creates a log queue and starts its helper thread, which passes each
+ * queued message to @p write_function.
+ *
+ * @returns the queue, or #NULL if there is no memory or no thread
+ *  could be started, in which case the caller should write messages
+ *  itself
+ */
+BusLogQueue *
+bus_log_queue_new (BusLogWriteFunction write_function)
+{
+#ifdef DBUS_UNIX
+  BusLogQueue *queue;
+  sigset_t all_signals, old_signals;
+  int rc;
+
+  queue = dbus_new0 (BusLogQueue, 1);
+  if (queue == NULL)
+    return NULL;
+
+  queue->write_function = write_function;
+
+  _dbus_cmutex_new_at_location (&queue->mutex);
+  if (queue->mutex == NULL)
+    goto failed;
+
+  _dbus_condvar_new_at_location (&queue->queued_cond);
+  if (queue->queued_cond == NULL)
+    goto failed;
+
+  _dbus_condvar_new_at_location (&queue->idle_cond);
+  if (queue->idle_cond == NULL)
+    goto failed;
+
+  /* Signals are for the main loop; the thread inherits this mask */
+  sigfillset (&all_signals);
+  pthread_sigmask (SIG_BLOCK, &all_signals, &old_signals);
+  rc = pthread_create (&queue->thread, NULL, log_thread, queue);
+  pthread_sigmask (SIG_SETMASK, &old_signals, NULL);
+
+  if (rc != 0)
+    {
+      _dbus_verbose ("Unable to start log thread: %s\n",
+                     _dbus_strerror (rc));
+      goto failed;
+    }
+
+  return queue;
+
+ failed:
+  _dbus_condvar_free_at_location (&queue->idle_cond);
+  _dbus_condvar_free_at_location (&queue->queued_cond);
+  _dbus_cmutex_free_at_location (&queue->mutex);
+  dbus_free (queue);
+  return NULL;
+#else
+  return NULL;
+#endif
+}
+
+/**
+ * Writes out everything still queued, stops the helper thread and
+ * frees the queue.
+ */
+void
+bus_log_queue_free (BusLogQueue *queue)
+{
+#ifdef DBUS_UNIX
+  int i;
+
+  _dbus_cmutex_lock (queue->mutex);
+  queue->stopping = TRUE;
+  _dbus_condvar_wake_one (queue->queued_cond);
+  _dbus_cmutex_unlock (queue->mutex);
+
+  pthread_join (queue->thread, NULL);
+  _dbus_assert (queue->n_entries == 0);
+
+  for (i = 0; i < MAX_QUEUED_LOG_MESSAGES; i++)
+    dbus_free (queue->entries[i].text);
+
+  _dbus_condvar_free_at_location (&queue->idle_cond);
+  _dbus_condvar_free_at_location (&queue->queued_cond);
+  _dbus_cmutex_free_at_location (&queue->mutex);
+  dbus_free (queue);
+#endif
+}
+
+/**
+ * Queues a copy of a message to be written by the helper thread. If
+ * the queue is full or there is no memory for the copy, the message is
+ * dropped and counted; but security messages are never dropped, and
+ * #FALSE is returned instead, so that the caller can flush the queue
+ * and write the message itself.
+ *
+ * @param queue the queue
+ * @param severity the severity to log at
+ * @param text the message
+ * @param use_syslog passed on to the write function
+ * @returns #FALSE if the message was neither queued nor dropped
+ */
+dbus_bool_t
+bus_log_queue_push (BusLogQueue           *queue,
+                    DBusSystemLogSeverity  severity,
+                    const char            *text,
+                    dbus_bool_t            use_syslog)
+{
+  BusLogEntry *entry;
+  char *copy;
+
+  _dbus_cmutex_lock (queue->mutex);
+
+  if (queue->n_entries == MAX_QUEUED_LOG_MESSAGES)
+    goto drop;
+
+  entry = &queue->entries[(queue->head + queue->n_entries) %
+                          MAX_QUEUED_LOG_MESSAGES];
+
+  /* whatever was in the slot has been written */
+  dbus_free (entry->text);
+  entry->text = NULL;
+
+  copy = _dbus_strdup (text);
+  if (copy == NULL)
+    goto drop;
+
+  entry->severity = severity;
+  entry->text = copy;
+  entry->use_syslog = use_syslog;
+  entry->n_dropped_before = queue->n_dropped;
+  queue->n_dropped = 0;
+  queue->n_entries += 1;
+
+  _dbus_condvar_wake_one (queue->queued_cond);
+  _dbus_cmutex_unlock (queue->mutex);
+  return TRUE;
+
+ drop:
+  if (severity == DBUS_SYSTEM_LOG_SECURITY)
+    {
+      _dbus_cmutex_unlock (queue->mutex);
+      return FALSE;
+    }
+
+  queue->n_dropped += 1;
+  _dbus_cmutex_unlock (queue->mutex);
+  return TRUE;
+}
+
+/**
+ * Waits until every queued message has been written, for instance
+ * before logging a fatal error and exiting.
+ */
+void
+bus_log_queue_flush (BusLogQueue *queue)
+{
+  _dbus_cmutex_lock (queue->mutex);
+
+  while (queue->n_entries > 0 || queue->writing)
+    _dbus_condvar_wait (queue->idle_cond, queue->mutex);
+
+  _dbus_cmutex_unlock (queue->mutex);
+}
+
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+
+/* Only touched by the helper thread until the test has flushed */
+static int test_n_written = 0;
+static int test_n_out_of_order = 0;
+static unsigned long test_n_dropped = 0;
+static size_t test_max_length = 0;
+static DBusCMutex *test_gate = NULL;
+static char long_text[4096];
+
+static void
+test_write (DBusSystemLogSeverity  severity,
+            const char            *text,
+            dbus_bool_t            use_syslog)
+{
+  _dbus_assert (!use_syslog);
+
+  if (text[0] == 'x')
+    {
+      test_max_length = strlen (text);
+      return;
+    }
+
+  if (strncmp (text, "test ", 5) == 0)
+    {
+      /* written in the order they were queued, dropped ones aside */
+      if (atoi (text + 5) < test_n_written)
+        test_n_out_of_order += 1;
+
+      test_n_written += 1;
+    }
+  else
+    {
+      _dbus_assert (severity == DBUS_SYSTEM_LOG_WARNING);
+      test_n_dropped += strtoul (text, NULL, 10);
+    }
+
+  /* lets the test hold the thread up until the queue overflows */
+  if (test_gate != NULL)
+    {
+      _dbus_cmutex_lock (test_gate);
+      _dbus_cmutex_unlock (test_gate);
+    }
+}
+
+static void
+test_push (BusLogQueue *queue,
+           int          i)
+{
+  char text[32];
+
+  snprintf (text, sizeof (text), "test %d", i);
+  if (!bus_log_queue_push (queue, DBUS_SYSTEM_LOG_INFO, text, FALSE))
+    _dbus_assert_not_reached ("message neither queued nor dropped");
+}
+
+dbus_bool_t
+bus_log_queue_test (const DBusString *test_data_dir)
+{
+  BusLogQueue *queue;
+  int i, total;
+
+  queue = bus_log_queue_new (test_write);
+#ifndef DBUS_UNIX
+  /* no helper thread here, so bus_context_log() writes synchronously */
+  _dbus_assert (queue == NULL);
+  return TRUE;
+#else
+  if (queue == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  for (i = 0; i < 10; i++)
+    test_push (queue, i);
+
+  bus_log_queue_flush (queue);
+  _dbus_assert (test_n_written == 10);
+  _dbus_assert (test_n_dropped == 0);
+
+  /* long messages are written out whole */
+  memset (long_text, 'x', sizeof (long_text) - 1);
+  long_text[sizeof (long_text) - 1] = '\0';
+  if (!bus_log_queue_push (queue, DBUS_SYSTEM_LOG_INFO, long_text, FALSE))
+    _dbus_assert_not_reached ("message neither queued nor dropped");
+  bus_log_queue_flush (queue);
+  _dbus_assert (test_max_length == sizeof (long_text) - 1);
+
+  /* While the thread is held up writing, the queue fills up, and what
+   * doesn't fit is counted rather than written */
+  _dbus_cmutex_new_at_location (&test_gate);
+  if (test_gate == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  _dbus_cmutex_lock (test_gate);
+  test_n_written = 0;
+  total = MAX_QUEUED_LOG_MESSAGES + 10;
+
+  for (i = 0; i < total; i++)
+    test_push (queue, i);
+
+  /* a security message is handed back rather than dropped */
+  if (bus_log_queue_push (queue, DBUS_SYSTEM_LOG_SECURITY,
+                          "security message", FALSE))
+    _dbus_assert_not_reached ("security message dropped");
+
+  _dbus_cmutex_unlock (test_gate);
+
+  /* freeing writes out whatever is left, even the last count */
+  bus_log_queue_free (queue);
+  _dbus_cmutex_free_at_location (&test_gate);
+
+  _dbus_assert (test_n_dropped > 0);
+  _dbus_assert (test_n_written + test_n_dropped == (unsigned long) total);
+  _dbus_assert (test_n_out_of_order == 0);
+
+  return TRUE;
+#endif
+}
+
+#endif /* DBUS_ENABLE_EMBEDDED_TESTS */
@@ -0,0 +1,50 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* log-queue.h  Writing log messages from a helper thread
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef BUS_LOG_QUEUE_H
+#define BUS_LOG_QUEUE_H
+
+#include <dbus/dbus.h>
+#include <dbus/dbus-sysdeps.h>
+
+/*
+ * A bounded queue of log messages, written out by a helper thread so
+ * that a slow syslog or journal doesn't hold up the main loop. When
+ * the queue is full, new messages are dropped and counted, and the
+ * count is written out once there is room again; security messages
+ * are left for the caller to write instead.
+ */
+typedef struct BusLogQueue BusLogQueue;
+
+/* Called on the helper thread for each message, in order */
+typedef void (* BusLogWriteFunction) (DBusSystemLogSeverity  severity,
+                                      const char            *text,
+                                      dbus_bool_t            use_syslog);
+
+BusLogQueue *bus_log_queue_new   (BusLogWriteFunction    write_function);
+void         bus_log_queue_free  (BusLogQueue           *queue);
+dbus_bool_t  bus_log_queue_push  (BusLogQueue           *queue,
+                                  DBusSystemLogSeverity  severity,
+                                  const char            *text,
+                                  dbus_bool_t            use_syslog);
+void         bus_log_queue_flush (BusLogQueue           *queue);
+
+#endif /* BUS_LOG_QUEUE_H */
@@ -143,6 +143,8 @@ usage (void)
       " [--address=ADDRESS]"
       " [--nopidfile]"
       " [--nofork]"
+      " [--print-startup-timings]"
+      " [--defer-service-files]"
 #ifdef DBUS_UNIX
       " [--fork]"
       " [--systemd-activation]"
@@ -379,6 +381,11 @@ main (int argc, char **argv)
   dbus_bool_t print_pid;
   BusContextFlags flags;
 
+#ifdef DBUS_ENABLE_STATS
+  /* before anything is allocated, so that nothing escapes the count */
+  _dbus_memory_enable_accounting ();
+#endif
+
   if (!_dbus_string_init (&config_file))
     return 1;
 
@@ -436,6 +443,14 @@ main (int argc, char **argv)
         {
           flags &= ~BUS_CONTEXT_FLAG_WRITE_PID_FILE;
         }
+      else if (strcmp (arg, "--print-startup-timings") == 0)
+        {
+          flags |= BUS_CONTEXT_FLAG_PRINT_STARTUP_TIMINGS;
+        }
+      else if (strcmp (arg, "--defer-service-files") == 0)
+        {
+          flags |= BUS_CONTEXT_FLAG_DEFER_SERVICE_FILES;
+        }
       else if (strcmp (arg, "--system") == 0)
         {
           check_two_config_files (&config_file, "system");
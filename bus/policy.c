@@ -132,6 +132,12 @@ struct BusPolicy
   DBusHashTable *rules_by_gid;     /**< per-GID policy rules */
   DBusList *at_console_true_rules; /**< console user policy rules where at_console="true"*/
   DBusList *at_console_false_rules; /**< console user policy rules where at_console="false"*/
+
+  /** client_policy_key() => the #BusClientPolicy built for it, so that
+   * connections whose identities pick the same rules share one. Only
+   * filled in once the configuration is complete and no more rules
+   * are appended. */
+  DBusHashTable *client_policies;
 };
 
 static void
@@ -158,6 +164,14 @@ free_rule_list_func (void *data)
   dbus_free (list);
 }
 
+static void
+client_policy_unref_maybe (void *data)
+{
+  /* the hash table may free a new entry's NULL value */
+  if (data != NULL)
+    bus_client_policy_unref (data);
+}
+
 BusPolicy*
 bus_policy_new (void)
 {
@@ -181,6 +195,11 @@ bus_policy_new (void)
   if (policy->rules_by_gid == NULL)
     goto failed;
 
+  policy->client_policies = _dbus_hash_table_new (DBUS_HASH_STRING,
+      dbus_free, client_policy_unref_maybe);
+  if (policy->client_policies == NULL)
+    goto failed;
+
   return policy;
   
  failed:
@@ -230,6 +249,12 @@ bus_policy_unref (BusPolicy *policy)
           _dbus_hash_table_unref (policy->rules_by_gid);
           policy->rules_by_gid = NULL;
         }
+
+      if (policy->client_policies)
+        {
+          _dbus_hash_table_unref (policy->client_policies);
+          policy->client_policies = NULL;
+        }
       
       dbus_free (policy);
     }
@@ -267,62 +292,149 @@ add_list_to_client (DBusList        **list,
   return TRUE;
 }
 
+/*
+ * Which of the policy's rule lists apply to a connection, which is all
+ * its client policy depends on: the per-uid list if there is one for
+ * its uid, the per-gid lists of its groups in order, and whether it is
+ * at the console if there are console rules.
+ */
+static dbus_bool_t
+client_policy_key (BusPolicy           *policy,
+                   dbus_bool_t          have_uid,
+                   dbus_uid_t           uid,
+                   dbus_bool_t          at_console,
+                   const unsigned long *groups,
+                   int                  n_groups,
+                   DBusString          *key)
+{
+  int i;
+
+  if (!have_uid)
+    {
+      if (!_dbus_string_append (key, "-"))
+        return FALSE;
+    }
+  else
+    {
+      if (_dbus_hash_table_lookup_uintptr (policy->rules_by_uid, uid) != NULL)
+        {
+          if (!_dbus_string_append_printf (key, "u%lu", (unsigned long) uid))
+            return FALSE;
+        }
+
+      if (!_dbus_string_append (key, at_console ? "c" : "n"))
+        return FALSE;
+    }
+
+  for (i = 0; i < n_groups; i++)
+    {
+      if (_dbus_hash_table_lookup_uintptr (policy->rules_by_gid,
+                                           groups[i]) != NULL &&
+          !_dbus_string_append_printf (key, "g%lu", groups[i]))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * Gets the client policy for a connection: the rules that apply to it,
+ * in the order they apply. Connections for which the same rule lists
+ * apply get the same policy, built once.
+ *
+ * @param policy the policy from the configuration
+ * @param connection an authenticated connection
+ * @param error return location for errors
+ * @returns a new reference to the client policy, or #NULL
+ */
 BusClientPolicy*
 bus_policy_create_client_policy (BusPolicy      *policy,
                                  DBusConnection *connection,
                                  DBusError      *error)
 {
   BusClientPolicy *client;
+  unsigned long *groups;
+  int n_groups;
   dbus_uid_t uid;
+  dbus_bool_t have_uid;
   dbus_bool_t at_console;
+  DBusString key;
+  char *key_copy;
+  int i;
 
   _dbus_assert (dbus_connection_get_is_authenticated (connection));
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-  
-  client = bus_client_policy_new ();
-  if (client == NULL)
-    goto nomem;
 
-  if (!add_list_to_client (&policy->default_rules,
-                           client))
-    goto nomem;
+  client = NULL;
+  groups = NULL;
+  n_groups = 0;
+  uid = DBUS_UID_UNSET;
+  at_console = FALSE;
+
+  if (!_dbus_string_init (&key))
+    {
+      BUS_SET_OOM (error);
+      return NULL;
+    }
 
   /* we avoid the overhead of looking up user's groups
    * if we don't have any group rules anyway
    */
   if (_dbus_hash_table_get_n_entries (policy->rules_by_gid) > 0)
     {
-      unsigned long *groups;
-      int n_groups;
-      int i;
-      
       if (!bus_connection_get_unix_groups (connection, &groups, &n_groups, error))
         goto failed;
-      
-      i = 0;
-      while (i < n_groups)
+    }
+
+  have_uid = dbus_connection_get_unix_user (connection, &uid);
+
+  /* likewise the console check, if no rules depend on it */
+  if (have_uid &&
+      (policy->at_console_true_rules != NULL ||
+       policy->at_console_false_rules != NULL))
+    {
+      at_console = _dbus_unix_user_is_at_console (uid, error);
+
+      if (!at_console && dbus_error_is_set (error))
+        goto failed;
+    }
+
+  if (!client_policy_key (policy, have_uid, uid, at_console,
+                          groups, n_groups, &key))
+    goto nomem;
+
+  client = _dbus_hash_table_lookup_string (policy->client_policies,
+                                           _dbus_string_get_const_data (&key));
+
+  if (client != NULL)
+    {
+      bus_client_policy_ref (client);
+      goto out;
+    }
+
+  client = bus_client_policy_new ();
+  if (client == NULL)
+    goto nomem;
+
+  if (!add_list_to_client (&policy->default_rules,
+                           client))
+    goto nomem;
+
+  for (i = 0; i < n_groups; i++)
+    {
+      DBusList **list;
+
+      list = _dbus_hash_table_lookup_uintptr (policy->rules_by_gid,
+                                              groups[i]);
+
+      if (list != NULL)
         {
-          DBusList **list;
-          
-          list = _dbus_hash_table_lookup_uintptr (policy->rules_by_gid,
-                                                groups[i]);
-          
-          if (list != NULL)
-            {
-              if (!add_list_to_client (list, client))
-                {
-                  dbus_free (groups);
-                  goto nomem;
-                }
-            }
-          
-          ++i;
+          if (!add_list_to_client (list, client))
+            goto nomem;
         }
-
-      dbus_free (groups);
     }
-  
-  if (dbus_connection_get_unix_user (connection, &uid))
+
+  if (have_uid)
     {
       if (_dbus_hash_table_get_n_entries (policy->rules_by_uid) > 0)
         {
@@ -339,21 +451,11 @@ bus_policy_create_client_policy (BusPolicy      *policy,
         }
 
       /* Add console rules */
-      at_console = _dbus_unix_user_is_at_console (uid, error);
-      
-      if (at_console)
-        {
-          if (!add_list_to_client (&policy->at_console_true_rules, client))
-            goto nomem;
-        }
-      else if (dbus_error_is_set (error) == TRUE)
-        {
-          goto failed;
-        }
-      else if (!add_list_to_client (&policy->at_console_false_rules, client))
-        {
-          goto nomem;
-        }
+      if (!add_list_to_client (at_console ?
+                               &policy->at_console_true_rules :
+                               &policy->at_console_false_rules,
+                               client))
+        goto nomem;
     }
 
   if (!add_list_to_client (&policy->mandatory_rules,
@@ -361,7 +463,23 @@ bus_policy_create_client_policy (BusPolicy      *policy,
     goto nomem;
 
   bus_client_policy_optimize (client);
-  
+
+  if (!bus_client_policy_compile (client))
+    goto nomem;
+
+  /* sharing is only an optimization, so OOM just skips it */
+  if (_dbus_string_steal_data (&key, &key_copy))
+    {
+      if (_dbus_hash_table_insert_string (policy->client_policies,
+                                          key_copy, client))
+        bus_client_policy_ref (client);
+      else
+        dbus_free (key_copy);
+    }
+
+ out:
+  dbus_free (groups);
+  _dbus_string_free (&key);
   return client;
 
  nomem:
@@ -370,6 +488,8 @@ bus_policy_create_client_policy (BusPolicy      *policy,
   _DBUS_ASSERT_ERROR_IS_SET (error);
   if (client)
     bus_client_policy_unref (client);
+  dbus_free (groups);
+  _dbus_string_free (&key);
   return NULL;
 }
 
@@ -688,11 +808,62 @@ bus_policy_merge (BusPolicy *policy,
   return TRUE;
 }
 
+/**
+ * The send or receive rules of a client policy, indexed by interface.
+ *
+ * A rule naming an interface can only apply to messages with that
+ * interface, or, for deny rules, to messages with no interface at all;
+ * a rule without an interface can apply to anything. So the candidates
+ * for a message are two short index lists, merged back into config
+ * file order so that the last matching rule still wins.
+ */
+typedef struct
+{
+  BusPolicyRule **rules;       /**< Every rule of this type, in config order */
+  int n_rules;                 /**< Length of rules */
+  int *any_interface;          /**< Indexes of rules without an interface */
+  int n_any_interface;         /**< Length of any_interface */
+  int *no_interface;           /**< Indexes of rules that apply to messages without an interface */
+  int n_no_interface;          /**< Length of no_interface */
+  DBusHashTable *by_interface; /**< Interface => BusPolicyRuleSlice of rules naming it */
+} BusPolicyRuleTable;
+
+/** Indexes into BusPolicyRuleTable rules, in increasing order */
+typedef struct
+{
+  int *indexes;                /**< The indexes */
+  int n_indexes;               /**< Length of indexes */
+} BusPolicyRuleSlice;
+
+/**
+ * The own rules of a client policy, indexed by the name they mention.
+ *
+ * Only the last applicable own rule matters, so each name keeps just
+ * the index of its last rule. A name can only be matched by its exact
+ * rules, by prefix rules for itself or one of its dotted parents, and
+ * by rules without a name, so a check costs one lookup per component
+ * of the requested name rather than one comparison per rule.
+ */
+typedef struct
+{
+  BusPolicyRule **rules;       /**< Every own rule, in config order */
+  int n_rules;                 /**< Length of rules */
+  int last_any;                /**< Index of the last rule without a name, or -1 */
+  DBusHashTable *exact;        /**< Name => 1 + index of the last own="name" rule */
+  DBusHashTable *prefix;       /**< Name => 1 + index of the last own_prefix="name" rule */
+} BusPolicyOwnTable;
+
 struct BusClientPolicy
 {
   int refcount;
 
   DBusList *rules;
+
+  BusPolicyRuleTable send;     /**< Send rules, once compiled */
+  BusPolicyRuleTable receive;  /**< Receive rules, once compiled */
+  BusPolicyOwnTable own;       /**< Own rules, once compiled */
+  unsigned int compiled : 1;   /**< #TRUE if send, receive and own are valid */
+  unsigned int sends_to_unique_names : 1; /**< Some send rule has a unique name as send_destination */
 };
 
 BusClientPolicy*
@@ -728,6 +899,41 @@ rule_unref_foreach (void *data,
   bus_policy_rule_unref (rule);
 }
 
+static void
+rule_table_clear (BusPolicyRuleTable *table)
+{
+  dbus_free (table->rules);
+  dbus_free (table->any_interface);
+  dbus_free (table->no_interface);
+
+  if (table->by_interface)
+    _dbus_hash_table_unref (table->by_interface);
+
+  memset (table, '\0', sizeof (BusPolicyRuleTable));
+}
+
+static void
+own_table_clear (BusPolicyOwnTable *table)
+{
+  dbus_free (table->rules);
+
+  if (table->exact)
+    _dbus_hash_table_unref (table->exact);
+  if (table->prefix)
+    _dbus_hash_table_unref (table->prefix);
+
+  memset (table, '\0', sizeof (BusPolicyOwnTable));
+}
+
+static void
+client_policy_uncompile (BusClientPolicy *policy)
+{
+  rule_table_clear (&policy->send);
+  rule_table_clear (&policy->receive);
+  own_table_clear (&policy->own);
+  policy->compiled = FALSE;
+}
+
 void
 bus_client_policy_unref (BusClientPolicy *policy)
 {
@@ -737,6 +943,8 @@ bus_client_policy_unref (BusClientPolicy *policy)
 
   if (policy->refcount == 0)
     {
+      client_policy_uncompile (policy);
+
       _dbus_list_foreach (&policy->rules,
                           rule_unref_foreach,
                           NULL);
@@ -791,6 +999,8 @@ bus_client_policy_optimize (BusClientPolicy *policy)
 
   _dbus_verbose ("Optimizing policy with %d rules\n",
                  _dbus_list_get_length (&policy->rules));
+
+  client_policy_uncompile (policy);
   
   link = _dbus_list_get_first_link (&policy->rules);
   while (link != NULL)
@@ -847,388 +1057,795 @@ bus_client_policy_optimize (BusClientPolicy *policy)
                  _dbus_list_get_length (&policy->rules));
 }
 
-dbus_bool_t
-bus_client_policy_append_rule (BusClientPolicy *policy,
-                               BusPolicyRule   *rule)
+static const char *
+rule_get_interface (BusPolicyRule *rule)
 {
-  _dbus_verbose ("Appending rule %p with type %d to policy %p\n",
-                 rule, rule->type, policy);
-  
-  if (!_dbus_list_append (&policy->rules, rule))
+  if (rule->type == BUS_POLICY_RULE_SEND)
+    return rule->d.send.interface;
+  else
+    return rule->d.receive.interface;
+}
+
+static void
+rule_slice_free (void *data)
+{
+  BusPolicyRuleSlice *slice = data;
+
+  if (slice == NULL) /* DBusHashTable is on crack */
+    return;
+
+  dbus_free (slice->indexes);
+  dbus_free (slice);
+}
+
+static dbus_bool_t
+rule_table_add_to_interface (BusPolicyRuleTable *table,
+                             const char         *interface,
+                             int                 index)
+{
+  BusPolicyRuleSlice *slice;
+  int *indexes;
+
+  slice = _dbus_hash_table_lookup_string (table->by_interface, interface);
+
+  if (slice == NULL)
+    {
+      slice = dbus_new0 (BusPolicyRuleSlice, 1);
+      if (slice == NULL)
+        return FALSE;
+
+      if (!_dbus_hash_table_insert_string (table->by_interface,
+                                           (char *) interface, slice))
+        {
+          dbus_free (slice);
+          return FALSE;
+        }
+    }
+
+  indexes = dbus_realloc (slice->indexes,
+                          sizeof (int) * (slice->n_indexes + 1));
+  if (indexes == NULL)
     return FALSE;
 
-  bus_policy_rule_ref (rule);
+  slice->indexes = indexes;
+  slice->indexes[slice->n_indexes++] = index;
 
   return TRUE;
 }
 
-dbus_bool_t
-bus_client_policy_check_can_send (BusClientPolicy *policy,
-                                  BusRegistry     *registry,
-                                  dbus_bool_t      requested_reply,
-                                  DBusConnection  *receiver,
-                                  DBusMessage     *message,
-                                  dbus_int32_t    *toggles,
-                                  dbus_bool_t     *log)
+static dbus_bool_t
+rule_table_compile (BusPolicyRuleTable *table,
+                    DBusList          **rules,
+                    BusPolicyRuleType   type)
 {
   DBusList *link;
-  dbus_bool_t allowed;
-  
-  /* policy->rules is in the order the rules appeared
-   * in the config file, i.e. last rule that applies wins
-   */
+  int n;
 
-  _dbus_verbose ("  (policy) checking send rules\n");
-  *toggles = 0;
-  
-  allowed = FALSE;
-  link = _dbus_list_get_first_link (&policy->rules);
-  while (link != NULL)
+  n = 0;
+  for (link = _dbus_list_get_first_link (rules);
+       link != NULL;
+       link = _dbus_list_get_next_link (rules, link))
     {
       BusPolicyRule *rule = link->data;
 
-      link = _dbus_list_get_next_link (&policy->rules, link);
-      
-      /* Rule is skipped if it specifies a different
-       * message name from the message, or a different
-       * destination from the message
-       */
-      
-      if (rule->type != BUS_POLICY_RULE_SEND)
-        {
-          _dbus_verbose ("  (policy) skipping non-send rule\n");
-          continue;
-        }
+      if (rule->type == type)
+        n += 1;
+    }
 
-      if (rule->d.send.message_type != DBUS_MESSAGE_TYPE_INVALID)
-        {
-          if (dbus_message_get_type (message) != rule->d.send.message_type)
-            {
-              _dbus_verbose ("  (policy) skipping rule for different message type\n");
-              continue;
-            }
-        }
+  table->by_interface = _dbus_hash_table_new (DBUS_HASH_STRING,
+                                              NULL, rule_slice_free);
+  if (table->by_interface == NULL)
+    return FALSE;
 
-      /* If it's a reply, the requested_reply flag kicks in */
-      if (dbus_message_get_reply_serial (message) != 0)
-        {
-          /* for allow, requested_reply=true means the rule applies
-           * only when reply was requested. requested_reply=false means
-           * always allow.
-           */
-          if (!requested_reply && rule->allow && rule->d.send.requested_reply && !rule->d.send.eavesdrop)
-            {
-              _dbus_verbose ("  (policy) skipping allow rule since it only applies to requested replies and does not allow eavesdropping\n");
-              continue;
-            }
+  if (n == 0)
+    return TRUE;
 
-          /* for deny, requested_reply=false means the rule applies only
-           * when the reply was not requested. requested_reply=true means the
-           * rule always applies.
-           */
-          if (requested_reply && !rule->allow && !rule->d.send.requested_reply)
-            {
-              _dbus_verbose ("  (policy) skipping deny rule since it only applies to unrequested replies\n");
-              continue;
-            }
-        }
-      
-      if (rule->d.send.path != NULL)
-        {
-          if (dbus_message_get_path (message) != NULL &&
-              strcmp (dbus_message_get_path (message),
-                      rule->d.send.path) != 0)
-            {
-              _dbus_verbose ("  (policy) skipping rule for different path\n");
-              continue;
-            }
-        }
-      
-      if (rule->d.send.interface != NULL)
-        {
-          /* The interface is optional in messages. For allow rules, if the message
-           * has no interface we want to skip the rule (and thus not allow);
-           * for deny rules, if the message has no interface we want to use the
-           * rule (and thus deny).
-           */
-          dbus_bool_t no_interface;
-
-          no_interface = dbus_message_get_interface (message) == NULL;
-          
-          if ((no_interface && rule->allow) ||
-              (!no_interface && 
-               strcmp (dbus_message_get_interface (message),
-                       rule->d.send.interface) != 0))
-            {
-              _dbus_verbose ("  (policy) skipping rule for different interface\n");
-              continue;
-            }
-        }
+  table->rules = dbus_new (BusPolicyRule *, n);
+  table->any_interface = dbus_new (int, n);
+  table->no_interface = dbus_new (int, n);
+  if (table->rules == NULL || table->any_interface == NULL ||
+      table->no_interface == NULL)
+    return FALSE;
 
-      if (rule->d.send.member != NULL)
-        {
-          if (dbus_message_get_member (message) != NULL &&
-              strcmp (dbus_message_get_member (message),
-                      rule->d.send.member) != 0)
-            {
-              _dbus_verbose ("  (policy) skipping rule for different member\n");
-              continue;
-            }
-        }
+  for (link = _dbus_list_get_first_link (rules);
+       link != NULL;
+       link = _dbus_list_get_next_link (rules, link))
+    {
+      BusPolicyRule *rule = link->data;
+      const char *interface;
+      int index;
 
-      if (rule->d.send.error != NULL)
+      if (rule->type != type)
+        continue;
+
+      index = table->n_rules;
+      table->rules[table->n_rules++] = rule;
+
+      interface = rule_get_interface (rule);
+      if (interface == NULL)
         {
-          if (dbus_message_get_error_name (message) != NULL &&
-              strcmp (dbus_message_get_error_name (message),
-                      rule->d.send.error) != 0)
-            {
-              _dbus_verbose ("  (policy) skipping rule for different error name\n");
-              continue;
-            }
+          table->any_interface[table->n_any_interface++] = index;
+          table->no_interface[table->n_no_interface++] = index;
         }
-      
-      if (rule->d.send.destination != NULL)
+      else
         {
-          /* receiver can be NULL for messages that are sent to the
-           * message bus itself, we check the strings in that case as
-           * built-in services don't have a DBusConnection but messages
-           * to them have a destination service name.
-           */
-          if (receiver == NULL)
-            {
-              if (!dbus_message_has_destination (message,
-                                                 rule->d.send.destination))
-                {
-                  _dbus_verbose ("  (policy) skipping rule because message dest is not %s\n",
-                                 rule->d.send.destination);
-                  continue;
-                }
-            }
-          else
-            {
-              DBusString str;
-              BusService *service;
-              
-              _dbus_string_init_const (&str, rule->d.send.destination);
-              
-              service = bus_registry_lookup (registry, &str);
-              if (service == NULL)
-                {
-                  _dbus_verbose ("  (policy) skipping rule because dest %s doesn't exist\n",
-                                 rule->d.send.destination);
-                  continue;
-                }
+          /* deny rules also apply to messages without an interface */
+          if (!rule->allow)
+            table->no_interface[table->n_no_interface++] = index;
 
-              if (!bus_service_has_owner (service, receiver))
-                {
-                  _dbus_verbose ("  (policy) skipping rule because dest %s isn't owned by receiver\n",
-                                 rule->d.send.destination);
-                  continue;
-                }
-            }
+          if (!rule_table_add_to_interface (table, interface, index))
+            return FALSE;
         }
-
-      /* Use this rule */
-      allowed = rule->allow;
-      *log = rule->d.send.log;
-      (*toggles)++;
-
-      _dbus_verbose ("  (policy) used rule, allow now = %d\n",
-                     allowed);
     }
 
-  return allowed;
+  _dbus_verbose ("Compiled %d rules of type %d, %d without an interface, %d interfaces\n",
+                 table->n_rules, type, table->n_any_interface,
+                 _dbus_hash_table_get_n_entries (table->by_interface));
+
+  return TRUE;
 }
 
-/* See docs on what the args mean on bus_context_check_security_policy()
- * comment
- */
-dbus_bool_t
-bus_client_policy_check_can_receive (BusClientPolicy *policy,
-                                     BusRegistry     *registry,
-                                     dbus_bool_t      requested_reply,
-                                     DBusConnection  *sender,
-                                     DBusConnection  *addressed_recipient,
-                                     DBusConnection  *proposed_recipient,
-                                     DBusMessage     *message,
-                                     dbus_int32_t    *toggles)
+static dbus_bool_t
+own_table_compile (BusPolicyOwnTable *table,
+                   DBusList         **rules)
 {
   DBusList *link;
-  dbus_bool_t allowed;
-  dbus_bool_t eavesdropping;
+  int n;
 
-  eavesdropping =
-    addressed_recipient != proposed_recipient &&
-    dbus_message_get_destination (message) != NULL;
-  
-  /* policy->rules is in the order the rules appeared
-   * in the config file, i.e. last rule that applies wins
-   */
+  table->last_any = -1;
 
-  _dbus_verbose ("  (policy) checking receive rules, eavesdropping = %d\n", eavesdropping);
-  *toggles = 0;
-  
-  allowed = FALSE;
-  link = _dbus_list_get_first_link (&policy->rules);
-  while (link != NULL)
+  n = 0;
+  for (link = _dbus_list_get_first_link (rules);
+       link != NULL;
+       link = _dbus_list_get_next_link (rules, link))
     {
       BusPolicyRule *rule = link->data;
 
-      link = _dbus_list_get_next_link (&policy->rules, link);      
-      
-      if (rule->type != BUS_POLICY_RULE_RECEIVE)
+      if (rule->type == BUS_POLICY_RULE_OWN)
+        n += 1;
+    }
+
+  table->exact = _dbus_hash_table_new (DBUS_HASH_STRING, NULL, NULL);
+  table->prefix = _dbus_hash_table_new (DBUS_HASH_STRING, NULL, NULL);
+  if (table->exact == NULL || table->prefix == NULL)
+    return FALSE;
+
+  if (n == 0)
+    return TRUE;
+
+  table->rules = dbus_new (BusPolicyRule *, n);
+  if (table->rules == NULL)
+    return FALSE;
+
+  for (link = _dbus_list_get_first_link (rules);
+       link != NULL;
+       link = _dbus_list_get_next_link (rules, link))
+    {
+      BusPolicyRule *rule = link->data;
+      int index;
+
+      if (rule->type != BUS_POLICY_RULE_OWN)
+        continue;
+
+      index = table->n_rules;
+      table->rules[table->n_rules++] = rule;
+
+      if (rule->d.own.service_name == NULL)
+        table->last_any = index;
+      else if (!_dbus_hash_table_insert_string (rule->d.own.prefix ?
+                                                table->prefix : table->exact,
+                                                rule->d.own.service_name,
+                                                _DBUS_INT_TO_POINTER (index + 1)))
+        return FALSE;
+    }
+
+  _dbus_verbose ("Compiled %d own rules, %d names, %d prefixes\n",
+                 table->n_rules,
+                 _dbus_hash_table_get_n_entries (table->exact),
+                 _dbus_hash_table_get_n_entries (table->prefix));
+
+  return TRUE;
+}
+
+/* Index of the last rule in table that applies to name, or -1 */
+static int
+own_table_lookup (BusPolicyOwnTable *table,
+                  const char        *name,
+                  int                len)
+{
+  char buf[DBUS_MAXIMUM_NAME_LENGTH + 1];
+  int best;
+  int found;
+  int i;
+
+  best = table->last_any;
+
+  if (table->n_rules == 0)
+    return best;
+
+  found = _DBUS_POINTER_TO_INT (_dbus_hash_table_lookup_string (table->exact,
+                                                                name)) - 1;
+  if (found > best)
+    best = found;
+
+  found = _DBUS_POINTER_TO_INT (_dbus_hash_table_lookup_string (table->prefix,
+                                                                name)) - 1;
+  if (found > best)
+    best = found;
+
+  /* a prefix rule also applies to every name beneath it */
+  memcpy (buf, name, len + 1);
+  for (i = len - 1; i >= 0; i--)
+    {
+      if (buf[i] != '.')
+        continue;
+
+      buf[i] = '\0';
+      found = _DBUS_POINTER_TO_INT (_dbus_hash_table_lookup_string (table->prefix,
+                                                                    buf)) - 1;
+      if (found > best)
+        best = found;
+    }
+
+  return best;
+}
+
+/**
+ * Builds the lookup tables used by bus_client_policy_check_can_send(),
+ * bus_client_policy_check_can_receive() and
+ * bus_client_policy_check_can_own(). Appending or optimizing
+ * afterwards drops the tables again, and the checks fall back to
+ * walking every rule until the policy is recompiled.
+ *
+ * @param policy the policy
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+bus_client_policy_compile (BusClientPolicy *policy)
+{
+  DBusList *link;
+
+  client_policy_uncompile (policy);
+
+  policy->sends_to_unique_names = FALSE;
+
+  for (link = _dbus_list_get_first_link (&policy->rules);
+       link != NULL;
+       link = _dbus_list_get_next_link (&policy->rules, link))
+    {
+      BusPolicyRule *rule = link->data;
+
+      if (rule->type == BUS_POLICY_RULE_SEND &&
+          rule->d.send.destination != NULL &&
+          rule->d.send.destination[0] == ':')
+        policy->sends_to_unique_names = TRUE;
+    }
+
+  if (!rule_table_compile (&policy->send, &policy->rules,
+                           BUS_POLICY_RULE_SEND) ||
+      !rule_table_compile (&policy->receive, &policy->rules,
+                           BUS_POLICY_RULE_RECEIVE) ||
+      !own_table_compile (&policy->own, &policy->rules))
+    {
+      client_policy_uncompile (policy);
+      return FALSE;
+    }
+
+  policy->compiled = TRUE;
+
+  return TRUE;
+}
+
+/**
+ * Whether bus_client_policy_check_can_send() could tell apart two
+ * receivers that own no well-known names. Only a send_destination that
+ * is a unique name can, so when this is #FALSE, such receivers all get
+ * the same verdict as long as their own policies agree.
+ *
+ * @param policy the sender's policy
+ * @returns #TRUE if a send rule names a unique name
+ */
+dbus_bool_t
+bus_client_policy_sends_to_unique_names (BusClientPolicy *policy)
+{
+  /* checks that walk an uncompiled policy are not worth predicting */
+  return !policy->compiled || policy->sends_to_unique_names;
+}
+
+dbus_bool_t
+bus_client_policy_append_rule (BusClientPolicy *policy,
+                               BusPolicyRule   *rule)
+{
+  _dbus_verbose ("Appending rule %p with type %d to policy %p\n",
+                 rule, rule->type, policy);
+
+  if (!_dbus_list_append (&policy->rules, rule))
+    return FALSE;
+
+  bus_policy_rule_ref (rule);
+
+  client_policy_uncompile (policy);
+
+  return TRUE;
+}
+
+/**
+ * Walks the rules that might apply to a message, in config file
+ * order; either the whole rule list, or the merge of two index lists
+ * of a compiled BusPolicyRuleTable.
+ */
+typedef struct
+{
+  DBusList **list;             /**< Uncompiled policy: the rule list */
+  DBusList *link;              /**< Uncompiled policy: next link */
+  BusPolicyRule **rules;       /**< Compiled policy: BusPolicyRuleTable rules */
+  const int *a;                /**< First index list */
+  int n_a;                     /**< Remaining entries in a */
+  const int *b;                /**< Second index list */
+  int n_b;                     /**< Remaining entries in b */
+} BusPolicyRuleIter;
+
+static void
+rule_iter_init (BusPolicyRuleIter  *iter,
+                BusClientPolicy    *policy,
+                BusPolicyRuleTable *table,
+                const char         *interface)
+{
+  memset (iter, '\0', sizeof (BusPolicyRuleIter));
+
+  if (!policy->compiled)
+    {
+      iter->list = &policy->rules;
+      iter->link = _dbus_list_get_first_link (&policy->rules);
+      return;
+    }
+
+  iter->rules = table->rules;
+
+  if (interface == NULL)
+    {
+      iter->a = table->no_interface;
+      iter->n_a = table->n_no_interface;
+    }
+  else
+    {
+      BusPolicyRuleSlice *slice;
+
+      iter->a = table->any_interface;
+      iter->n_a = table->n_any_interface;
+
+      slice = _dbus_hash_table_lookup_string (table->by_interface,
+                                              interface);
+      if (slice != NULL)
         {
-          _dbus_verbose ("  (policy) skipping non-receive rule\n");
-          continue;
+          iter->b = slice->indexes;
+          iter->n_b = slice->n_indexes;
         }
+    }
+}
+
+static BusPolicyRule *
+rule_iter_next (BusPolicyRuleIter *iter)
+{
+  if (iter->list != NULL)
+    {
+      BusPolicyRule *rule;
+
+      if (iter->link == NULL)
+        return NULL;
+
+      rule = iter->link->data;
+      iter->link = _dbus_list_get_next_link (iter->list, iter->link);
+      return rule;
+    }
+
+  if (iter->n_a > 0 &&
+      (iter->n_b == 0 || *iter->a < *iter->b))
+    {
+      iter->n_a -= 1;
+      return iter->rules[*iter->a++];
+    }
+  else if (iter->n_b > 0)
+    {
+      iter->n_b -= 1;
+      return iter->rules[*iter->b++];
+    }
 
-      if (rule->d.receive.message_type != DBUS_MESSAGE_TYPE_INVALID)
+  return NULL;
+}
+
+static dbus_bool_t
+send_rule_applies (BusPolicyRule  *rule,
+                   BusRegistry    *registry,
+                   dbus_bool_t     requested_reply,
+                   DBusConnection *receiver,
+                   DBusMessage    *message)
+{
+  /* Rule is skipped if it specifies a different
+   * message name from the message, or a different
+   * destination from the message
+   */
+
+  if (rule->type != BUS_POLICY_RULE_SEND)
+    {
+      _dbus_verbose ("  (policy) skipping non-send rule\n");
+      return FALSE;
+    }
+
+  if (rule->d.send.message_type != DBUS_MESSAGE_TYPE_INVALID)
+    {
+      if (dbus_message_get_type (message) != rule->d.send.message_type)
         {
-          if (dbus_message_get_type (message) != rule->d.receive.message_type)
-            {
-              _dbus_verbose ("  (policy) skipping rule for different message type\n");
-              continue;
-            }
+          _dbus_verbose ("  (policy) skipping rule for different message type\n");
+          return FALSE;
         }
+    }
 
-      /* for allow, eavesdrop=false means the rule doesn't apply when
-       * eavesdropping. eavesdrop=true means always allow.
+  /* If it's a reply, the requested_reply flag kicks in */
+  if (dbus_message_get_reply_serial (message) != 0)
+    {
+      /* for allow, requested_reply=true means the rule applies
+       * only when reply was requested. requested_reply=false means
+       * always allow.
        */
-      if (eavesdropping && rule->allow && !rule->d.receive.eavesdrop)
+      if (!requested_reply && rule->allow && rule->d.send.requested_reply && !rule->d.send.eavesdrop)
         {
-          _dbus_verbose ("  (policy) skipping allow rule since it doesn't apply to eavesdropping\n");
-          continue;
+          _dbus_verbose ("  (policy) skipping allow rule since it only applies to requested replies and does not allow eavesdropping\n");
+          return FALSE;
         }
 
-      /* for deny, eavesdrop=true means the rule applies only when
-       * eavesdropping; eavesdrop=false means always deny.
+      /* for deny, requested_reply=false means the rule applies only
+       * when the reply was not requested. requested_reply=true means the
+       * rule always applies.
        */
-      if (!eavesdropping && !rule->allow && rule->d.receive.eavesdrop)
+      if (requested_reply && !rule->allow && !rule->d.send.requested_reply)
         {
-          _dbus_verbose ("  (policy) skipping deny rule since it only applies to eavesdropping\n");
-          continue;
+          _dbus_verbose ("  (policy) skipping deny rule since it only applies to unrequested replies\n");
+          return FALSE;
         }
+    }
 
-      /* If it's a reply, the requested_reply flag kicks in */
-      if (dbus_message_get_reply_serial (message) != 0)
+  if (rule->d.send.path != NULL)
+    {
+      if (dbus_message_get_path (message) != NULL &&
+          strcmp (dbus_message_get_path (message),
+                  rule->d.send.path) != 0)
         {
-          /* for allow, requested_reply=true means the rule applies
-           * only when reply was requested. requested_reply=false means
-           * always allow.
-           */
-          if (!requested_reply && rule->allow && rule->d.receive.requested_reply && !rule->d.receive.eavesdrop)
-            {
-              _dbus_verbose ("  (policy) skipping allow rule since it only applies to requested replies and does not allow eavesdropping\n");
-              continue;
-            }
+          _dbus_verbose ("  (policy) skipping rule for different path\n");
+          return FALSE;
+        }
+    }
 
-          /* for deny, requested_reply=false means the rule applies only
-           * when the reply was not requested. requested_reply=true means the
-           * rule always applies.
-           */
-          if (requested_reply && !rule->allow && !rule->d.receive.requested_reply)
-            {
-              _dbus_verbose ("  (policy) skipping deny rule since it only applies to unrequested replies\n");
-              continue;
-            }
+  if (rule->d.send.interface != NULL)
+    {
+      /* The interface is optional in messages. For allow rules, if the message
+       * has no interface we want to skip the rule (and thus not allow);
+       * for deny rules, if the message has no interface we want to use the
+       * rule (and thus deny).
+       */
+      dbus_bool_t no_interface;
+
+      no_interface = dbus_message_get_interface (message) == NULL;
+
+      if ((no_interface && rule->allow) ||
+          (!no_interface &&
+           strcmp (dbus_message_get_interface (message),
+                   rule->d.send.interface) != 0))
+        {
+          _dbus_verbose ("  (policy) skipping rule for different interface\n");
+          return FALSE;
         }
-      
-      if (rule->d.receive.path != NULL)
+    }
+
+  if (rule->d.send.member != NULL)
+    {
+      if (dbus_message_get_member (message) != NULL &&
+          strcmp (dbus_message_get_member (message),
+                  rule->d.send.member) != 0)
+        {
+          _dbus_verbose ("  (policy) skipping rule for different member\n");
+          return FALSE;
+        }
+    }
+
+  if (rule->d.send.error != NULL)
+    {
+      if (dbus_message_get_error_name (message) != NULL &&
+          strcmp (dbus_message_get_error_name (message),
+                  rule->d.send.error) != 0)
+        {
+          _dbus_verbose ("  (policy) skipping rule for different error name\n");
+          return FALSE;
+        }
+    }
+
+  if (rule->d.send.destination != NULL)
+    {
+      /* receiver can be NULL for messages that are sent to the
+       * message bus itself, we check the strings in that case as
+       * built-in services don't have a DBusConnection but messages
+       * to them have a destination service name.
+       */
+      if (receiver == NULL)
         {
-          if (dbus_message_get_path (message) != NULL &&
-              strcmp (dbus_message_get_path (message),
-                      rule->d.receive.path) != 0)
+          if (!dbus_message_has_destination (message,
+                                             rule->d.send.destination))
             {
-              _dbus_verbose ("  (policy) skipping rule for different path\n");
-              continue;
+              _dbus_verbose ("  (policy) skipping rule because message dest is not %s\n",
+                             rule->d.send.destination);
+              return FALSE;
             }
         }
-      
-      if (rule->d.receive.interface != NULL)
+      else
         {
-          /* The interface is optional in messages. For allow rules, if the message
-           * has no interface we want to skip the rule (and thus not allow);
-           * for deny rules, if the message has no interface we want to use the
-           * rule (and thus deny).
-           */
-          dbus_bool_t no_interface;
-
-          no_interface = dbus_message_get_interface (message) == NULL;
-          
-          if ((no_interface && rule->allow) ||
-              (!no_interface &&
-               strcmp (dbus_message_get_interface (message),
-                       rule->d.receive.interface) != 0))
+          DBusString str;
+          BusService *service;
+
+          _dbus_string_init_const (&str, rule->d.send.destination);
+
+          service = bus_registry_lookup (registry, &str);
+          if (service == NULL)
             {
-              _dbus_verbose ("  (policy) skipping rule for different interface\n");
-              continue;
+              _dbus_verbose ("  (policy) skipping rule because dest %s doesn't exist\n",
+                             rule->d.send.destination);
+              return FALSE;
             }
-        }      
 
-      if (rule->d.receive.member != NULL)
-        {
-          if (dbus_message_get_member (message) != NULL &&
-              strcmp (dbus_message_get_member (message),
-                      rule->d.receive.member) != 0)
+          if (!bus_service_has_owner (service, receiver))
             {
-              _dbus_verbose ("  (policy) skipping rule for different member\n");
-              continue;
+              _dbus_verbose ("  (policy) skipping rule because dest %s isn't owned by receiver\n",
+                             rule->d.send.destination);
+              return FALSE;
             }
         }
+    }
+
+  return TRUE;
+}
+
+dbus_bool_t
+bus_client_policy_check_can_send (BusClientPolicy *policy,
+                                  BusRegistry     *registry,
+                                  dbus_bool_t      requested_reply,
+                                  DBusConnection  *receiver,
+                                  DBusMessage     *message,
+                                  dbus_int32_t    *toggles,
+                                  dbus_bool_t     *log)
+{
+  BusPolicyRuleIter iter;
+  BusPolicyRule *rule;
+  dbus_bool_t allowed;
+
+  /* policy->rules is in the order the rules appeared
+   * in the config file, i.e. last rule that applies wins
+   */
+
+  _dbus_verbose ("  (policy) checking send rules\n");
+  *toggles = 0;
+
+  allowed = FALSE;
+  rule_iter_init (&iter, policy, &policy->send,
+                  dbus_message_get_interface (message));
+  while ((rule = rule_iter_next (&iter)) != NULL)
+    {
+      if (!send_rule_applies (rule, registry, requested_reply,
+                              receiver, message))
+        continue;
+
+      /* Use this rule */
+      allowed = rule->allow;
+      *log = rule->d.send.log;
+      (*toggles)++;
+
+      _dbus_verbose ("  (policy) used rule, allow now = %d\n",
+                     allowed);
+    }
+
+  return allowed;
+}
+
+static dbus_bool_t
+receive_rule_applies (BusPolicyRule  *rule,
+                      BusRegistry    *registry,
+                      dbus_bool_t     requested_reply,
+                      DBusConnection *sender,
+                      dbus_bool_t     eavesdropping,
+                      DBusMessage    *message)
+{
+  if (rule->type != BUS_POLICY_RULE_RECEIVE)
+    {
+      _dbus_verbose ("  (policy) skipping non-receive rule\n");
+      return FALSE;
+    }
+
+  if (rule->d.receive.message_type != DBUS_MESSAGE_TYPE_INVALID)
+    {
+      if (dbus_message_get_type (message) != rule->d.receive.message_type)
+        {
+          _dbus_verbose ("  (policy) skipping rule for different message type\n");
+          return FALSE;
+        }
+    }
+
+  /* for allow, eavesdrop=false means the rule doesn't apply when
+   * eavesdropping. eavesdrop=true means always allow.
+   */
+  if (eavesdropping && rule->allow && !rule->d.receive.eavesdrop)
+    {
+      _dbus_verbose ("  (policy) skipping allow rule since it doesn't apply to eavesdropping\n");
+      return FALSE;
+    }
+
+  /* for deny, eavesdrop=true means the rule applies only when
+   * eavesdropping; eavesdrop=false means always deny.
+   */
+  if (!eavesdropping && !rule->allow && rule->d.receive.eavesdrop)
+    {
+      _dbus_verbose ("  (policy) skipping deny rule since it only applies to eavesdropping\n");
+      return FALSE;
+    }
+
+  /* If it's a reply, the requested_reply flag kicks in */
+  if (dbus_message_get_reply_serial (message) != 0)
+    {
+      /* for allow, requested_reply=true means the rule applies
+       * only when reply was requested. requested_reply=false means
+       * always allow.
+       */
+      if (!requested_reply && rule->allow && rule->d.receive.requested_reply && !rule->d.receive.eavesdrop)
+        {
+          _dbus_verbose ("  (policy) skipping allow rule since it only applies to requested replies and does not allow eavesdropping\n");
+          return FALSE;
+        }
+
+      /* for deny, requested_reply=false means the rule applies only
+       * when the reply was not requested. requested_reply=true means the
+       * rule always applies.
+       */
+      if (requested_reply && !rule->allow && !rule->d.receive.requested_reply)
+        {
+          _dbus_verbose ("  (policy) skipping deny rule since it only applies to unrequested replies\n");
+          return FALSE;
+        }
+    }
+
+  if (rule->d.receive.path != NULL)
+    {
+      if (dbus_message_get_path (message) != NULL &&
+          strcmp (dbus_message_get_path (message),
+                  rule->d.receive.path) != 0)
+        {
+          _dbus_verbose ("  (policy) skipping rule for different path\n");
+          return FALSE;
+        }
+    }
+
+  if (rule->d.receive.interface != NULL)
+    {
+      /* The interface is optional in messages. For allow rules, if the message
+       * has no interface we want to skip the rule (and thus not allow);
+       * for deny rules, if the message has no interface we want to use the
+       * rule (and thus deny).
+       */
+      dbus_bool_t no_interface;
+
+      no_interface = dbus_message_get_interface (message) == NULL;
+
+      if ((no_interface && rule->allow) ||
+          (!no_interface &&
+           strcmp (dbus_message_get_interface (message),
+                   rule->d.receive.interface) != 0))
+        {
+          _dbus_verbose ("  (policy) skipping rule for different interface\n");
+          return FALSE;
+        }
+    }
+
+  if (rule->d.receive.member != NULL)
+    {
+      if (dbus_message_get_member (message) != NULL &&
+          strcmp (dbus_message_get_member (message),
+                  rule->d.receive.member) != 0)
+        {
+          _dbus_verbose ("  (policy) skipping rule for different member\n");
+          return FALSE;
+        }
+    }
 
-      if (rule->d.receive.error != NULL)
+  if (rule->d.receive.error != NULL)
+    {
+      if (dbus_message_get_error_name (message) != NULL &&
+          strcmp (dbus_message_get_error_name (message),
+                  rule->d.receive.error) != 0)
         {
-          if (dbus_message_get_error_name (message) != NULL &&
-              strcmp (dbus_message_get_error_name (message),
-                      rule->d.receive.error) != 0)
+          _dbus_verbose ("  (policy) skipping rule for different error name\n");
+          return FALSE;
+        }
+    }
+
+  if (rule->d.receive.origin != NULL)
+    {
+      /* sender can be NULL for messages that originate from the
+       * message bus itself, we check the strings in that case as
+       * built-in services don't have a DBusConnection but will
+       * still set the sender on their messages.
+       */
+      if (sender == NULL)
+        {
+          if (!dbus_message_has_sender (message,
+                                        rule->d.receive.origin))
             {
-              _dbus_verbose ("  (policy) skipping rule for different error name\n");
-              continue;
+              _dbus_verbose ("  (policy) skipping rule because message sender is not %s\n",
+                             rule->d.receive.origin);
+              return FALSE;
             }
         }
-      
-      if (rule->d.receive.origin != NULL)
-        {          
-          /* sender can be NULL for messages that originate from the
-           * message bus itself, we check the strings in that case as
-           * built-in services don't have a DBusConnection but will
-           * still set the sender on their messages.
-           */
-          if (sender == NULL)
+      else
+        {
+          BusService *service;
+          DBusString str;
+
+          _dbus_string_init_const (&str, rule->d.receive.origin);
+
+          service = bus_registry_lookup (registry, &str);
+
+          if (service == NULL)
             {
-              if (!dbus_message_has_sender (message,
-                                            rule->d.receive.origin))
-                {
-                  _dbus_verbose ("  (policy) skipping rule because message sender is not %s\n",
-                                 rule->d.receive.origin);
-                  continue;
-                }
+              _dbus_verbose ("  (policy) skipping rule because origin %s doesn't exist\n",
+                             rule->d.receive.origin);
+              return FALSE;
             }
-          else
-            {
-              BusService *service;
-              DBusString str;
-
-              _dbus_string_init_const (&str, rule->d.receive.origin);
-              
-              service = bus_registry_lookup (registry, &str);
-              
-              if (service == NULL)
-                {
-                  _dbus_verbose ("  (policy) skipping rule because origin %s doesn't exist\n",
-                                 rule->d.receive.origin);
-                  continue;
-                }
 
-              if (!bus_service_has_owner (service, sender))
-                {
-                  _dbus_verbose ("  (policy) skipping rule because origin %s isn't owned by sender\n",
-                                 rule->d.receive.origin);
-                  continue;
-                }
+          if (!bus_service_has_owner (service, sender))
+            {
+              _dbus_verbose ("  (policy) skipping rule because origin %s isn't owned by sender\n",
+                             rule->d.receive.origin);
+              return FALSE;
             }
         }
-      
+    }
+
+  return TRUE;
+}
+
+/* See docs on what the args mean on bus_context_check_security_policy()
+ * comment
+ */
+dbus_bool_t
+bus_client_policy_check_can_receive (BusClientPolicy *policy,
+                                     BusRegistry     *registry,
+                                     dbus_bool_t      requested_reply,
+                                     DBusConnection  *sender,
+                                     DBusConnection  *addressed_recipient,
+                                     DBusConnection  *proposed_recipient,
+                                     DBusMessage     *message,
+                                     dbus_int32_t    *toggles)
+{
+  BusPolicyRuleIter iter;
+  BusPolicyRule *rule;
+  dbus_bool_t allowed;
+  dbus_bool_t eavesdropping;
+
+  eavesdropping =
+    addressed_recipient != proposed_recipient &&
+    dbus_message_get_destination (message) != NULL;
+
+  /* policy->rules is in the order the rules appeared
+   * in the config file, i.e. last rule that applies wins
+   */
+
+  _dbus_verbose ("  (policy) checking receive rules, eavesdropping = %d\n", eavesdropping);
+  *toggles = 0;
+
+  allowed = FALSE;
+  rule_iter_init (&iter, policy, &policy->receive,
+                  dbus_message_get_interface (message));
+  while ((rule = rule_iter_next (&iter)) != NULL)
+    {
+      if (!receive_rule_applies (rule, registry, requested_reply,
+                                 sender, eavesdropping, message))
+        continue;
+
       /* Use this rule */
       allowed = rule->allow;
       (*toggles)++;
@@ -1242,6 +1859,105 @@ bus_client_policy_check_can_receive (BusClientPolicy *policy,
 
 
 
+/* Whether name, from a send_destination or receive_sender, is owned by
+ * connection; a rule with no name applies to every connection */
+static dbus_bool_t
+rule_name_is_owned_by (const char     *name,
+                       BusRegistry    *registry,
+                       DBusConnection *connection)
+{
+  DBusString str;
+  BusService *service;
+
+  if (name == NULL)
+    return TRUE;
+
+  _dbus_string_init_const (&str, name);
+  service = bus_registry_lookup (registry, &str);
+
+  return service != NULL && bus_service_has_owner (service, connection);
+}
+
+/**
+ * Whether the send or receive rules of a policy treat the messages
+ * between its connection and another one differently depending on
+ * what they are: that is, whether a deny rule for the other connection
+ * that names a message type, path, interface, member or error is in
+ * effect, not overridden by a later rule that applies to all messages.
+ * Such rules can't be enforced on messages that don't go through the
+ * bus. Rules that only apply when eavesdropping are ignored.
+ *
+ * @param policy the policy
+ * @param registry the bus registry
+ * @param type #BUS_POLICY_RULE_SEND or #BUS_POLICY_RULE_RECEIVE
+ * @param other the receiver of sent messages, or the sender of
+ *  received ones
+ * @returns #TRUE if some messages are denied
+ */
+dbus_bool_t
+bus_client_policy_restricts_messages (BusClientPolicy   *policy,
+                                      BusRegistry       *registry,
+                                      BusPolicyRuleType  type,
+                                      DBusConnection    *other)
+{
+  DBusList *link;
+  dbus_bool_t restricted;
+
+  _dbus_assert (type == BUS_POLICY_RULE_SEND ||
+                type == BUS_POLICY_RULE_RECEIVE);
+
+  restricted = FALSE;
+
+  for (link = _dbus_list_get_first_link (&policy->rules);
+       link != NULL;
+       link = _dbus_list_get_next_link (&policy->rules, link))
+    {
+      BusPolicyRule *rule = link->data;
+      dbus_bool_t scoped;
+
+      if (rule->type != type)
+        continue;
+
+      if (type == BUS_POLICY_RULE_SEND)
+        {
+          if ((!rule->allow && rule->d.send.eavesdrop) ||
+              !rule_name_is_owned_by (rule->d.send.destination, registry,
+                                      other))
+            continue;
+
+          scoped = rule->d.send.message_type != DBUS_MESSAGE_TYPE_INVALID ||
+            rule->d.send.path != NULL ||
+            rule->d.send.interface != NULL ||
+            rule->d.send.member != NULL ||
+            rule->d.send.error != NULL;
+        }
+      else
+        {
+          if ((!rule->allow && rule->d.receive.eavesdrop) ||
+              !rule_name_is_owned_by (rule->d.receive.origin, registry,
+                                      other))
+            continue;
+
+          scoped = rule->d.receive.message_type != DBUS_MESSAGE_TYPE_INVALID ||
+            rule->d.receive.path != NULL ||
+            rule->d.receive.interface != NULL ||
+            rule->d.receive.member != NULL ||
+            rule->d.receive.error != NULL;
+        }
+
+      /* a rule for every message decides for all of them, whether
+       * the bus sees them or not; one for some messages only restricts
+       * if it denies */
+      if (!scoped)
+        restricted = FALSE;
+      else if (!rule->allow)
+        restricted = TRUE;
+    }
+
+  return restricted;
+}
+
+
 static dbus_bool_t
 bus_rules_check_can_own (DBusList *rules,
                          const DBusString *service_name)
@@ -1299,7 +2015,20 @@ dbus_bool_t
 bus_client_policy_check_can_own (BusClientPolicy  *policy,
                                  const DBusString *service_name)
 {
-  return bus_rules_check_can_own (policy->rules, service_name);
+  int index;
+
+  if (!policy->compiled ||
+      _dbus_string_get_length (service_name) > DBUS_MAXIMUM_NAME_LENGTH)
+    return bus_rules_check_can_own (policy->rules, service_name);
+
+  index = own_table_lookup (&policy->own,
+                            _dbus_string_get_const_data (service_name),
+                            _dbus_string_get_length (service_name));
+
+  if (index < 0)
+    return FALSE;
+
+  return policy->own.rules[index]->allow;
 }
 
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
@@ -1307,7 +2036,43 @@ dbus_bool_t
 bus_policy_check_can_own (BusPolicy  *policy,
                           const DBusString *service_name)
 {
-  return bus_rules_check_can_own (policy->default_rules, service_name);
+  BusClientPolicy *client;
+  DBusList *link;
+  dbus_bool_t allowed;
+
+  allowed = bus_rules_check_can_own (policy->default_rules, service_name);
+
+  /* Check that the compiled own table agrees with the rule walk */
+  client = bus_client_policy_new ();
+  if (client == NULL)
+    return allowed;
+
+  for (link = _dbus_list_get_first_link (&policy->default_rules);
+       link != NULL;
+       link = _dbus_list_get_next_link (&policy->default_rules, link))
+    {
+      if (!bus_client_policy_append_rule (client, link->data))
+        goto out;
+    }
+
+  if (bus_client_policy_compile (client))
+    _dbus_assert (bus_client_policy_check_can_own (client, service_name) ==
+                  allowed);
+
+ out:
+  bus_client_policy_unref (client);
+  return allowed;
+}
+
+/**
+ * Gets the rules of a client policy in the order they apply, for
+ * tests that want to look at them or copy them into an uncompiled
+ * policy.
+ */
+DBusList **
+bus_client_policy_get_rules (BusClientPolicy *policy)
+{
+  return &policy->rules;
 }
 #endif /* DBUS_ENABLE_EMBEDDED_TESTS */
 
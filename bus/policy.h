@@ -155,15 +155,22 @@ dbus_bool_t      bus_client_policy_check_can_receive (BusClientPolicy  *policy,
                                                       DBusConnection   *proposed_recipient,
                                                       DBusMessage      *message,
                                                       dbus_int32_t     *toggles);
+dbus_bool_t      bus_client_policy_restricts_messages (BusClientPolicy   *policy,
+                                                       BusRegistry       *registry,
+                                                       BusPolicyRuleType  type,
+                                                       DBusConnection    *other);
 dbus_bool_t      bus_client_policy_check_can_own     (BusClientPolicy  *policy,
                                                       const DBusString *service_name);
+dbus_bool_t      bus_client_policy_sends_to_unique_names (BusClientPolicy *policy);
 dbus_bool_t      bus_client_policy_append_rule       (BusClientPolicy  *policy,
                                                       BusPolicyRule    *rule);
 void             bus_client_policy_optimize          (BusClientPolicy  *policy);
+dbus_bool_t      bus_client_policy_compile           (BusClientPolicy  *policy);
 
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
 dbus_bool_t      bus_policy_check_can_own     (BusPolicy  *policy,
                                                const DBusString *service_name);
+DBusList **      bus_client_policy_get_rules  (BusClientPolicy *policy);
 #endif
 
 #endif /* BUS_POLICY_H */
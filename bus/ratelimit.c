@@ -0,0 +1,183 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* ratelimit.c  Token buckets for throttling connections
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "ratelimit.h"
+#include "test.h"
+#include <dbus/dbus-internals.h>
+
+/* Credit is kept in thousandths, so that a bucket refilled every
+ * millisecond or so doesn't lose the fractions */
+#define CREDIT_PER_UNIT 1000
+
+void
+bus_rate_bucket_init (BusRateBucket *bucket,
+                      long           messages_per_second,
+                      long           bytes_per_second,
+                      long           tv_sec,
+                      long           tv_usec)
+{
+  _dbus_assert (messages_per_second >= 0);
+  _dbus_assert (bytes_per_second >= 0);
+
+  bucket->messages_per_second = messages_per_second;
+  bucket->bytes_per_second = bytes_per_second;
+  bucket->message_credit = (dbus_int64_t) messages_per_second * CREDIT_PER_UNIT;
+  bucket->byte_credit = (dbus_int64_t) bytes_per_second * CREDIT_PER_UNIT;
+  bucket->refilled_tv_sec = tv_sec;
+  bucket->refilled_tv_usec = tv_usec;
+}
+
+static void
+refill_one (dbus_int64_t *credit,
+            long          per_second,
+            dbus_int64_t  elapsed_usec)
+{
+  dbus_int64_t full = (dbus_int64_t) per_second * CREDIT_PER_UNIT;
+
+  /* per_second * CREDIT_PER_UNIT per second is per_second / 1000 per
+   * microsecond */
+  *credit += (dbus_int64_t) per_second * elapsed_usec / 1000;
+
+  if (*credit > full)
+    *credit = full;
+}
+
+static void
+refill (BusRateBucket *bucket,
+        long           tv_sec,
+        long           tv_usec)
+{
+  dbus_int64_t elapsed_usec;
+
+  elapsed_usec = ((dbus_int64_t) tv_sec - bucket->refilled_tv_sec) * 1000000 +
+    (tv_usec - bucket->refilled_tv_usec);
+
+  /* Monotonic time shouldn't go backwards, but if it does, just start
+   * again from here */
+  if (elapsed_usec < 0)
+    elapsed_usec = 0;
+
+  /* A bucket holds one second's worth, so waiting longer makes no
+   * difference; capping it also keeps the arithmetic from overflowing */
+  if (elapsed_usec > 1000000)
+    elapsed_usec = 1000000;
+
+  refill_one (&bucket->message_credit, bucket->messages_per_second,
+              elapsed_usec);
+  refill_one (&bucket->byte_credit, bucket->bytes_per_second,
+              elapsed_usec);
+
+  bucket->refilled_tv_sec = tv_sec;
+  bucket->refilled_tv_usec = tv_usec;
+}
+
+/**
+ * Takes one message of @p n_bytes out of the bucket, even if that puts
+ * it into debt.
+ */
+void
+bus_rate_bucket_charge (BusRateBucket *bucket,
+                        long           n_bytes,
+                        long           tv_sec,
+                        long           tv_usec)
+{
+  refill (bucket, tv_sec, tv_usec);
+
+  if (bucket->messages_per_second > 0)
+    bucket->message_credit -= CREDIT_PER_UNIT;
+
+  if (bucket->bytes_per_second > 0)
+    bucket->byte_credit -= (dbus_int64_t) n_bytes * CREDIT_PER_UNIT;
+}
+
+static int
+delay_one (dbus_int64_t credit,
+           long         per_second)
+{
+  dbus_int64_t msec;
+
+  if (per_second == 0 || credit >= 0)
+    return 0;
+
+  /* -credit thousandths, at per_second thousandths per millisecond,
+   * rounded up */
+  msec = (-credit + per_second - 1) / per_second;
+
+  return msec > _DBUS_INT_MAX ? _DBUS_INT_MAX : (int) msec;
+}
+
+/**
+ * Returns how many milliseconds from now the bucket will be out of
+ * debt, or 0 if it is not in debt.
+ */
+int
+bus_rate_bucket_get_delay (BusRateBucket *bucket,
+                           long           tv_sec,
+                           long           tv_usec)
+{
+  refill (bucket, tv_sec, tv_usec);
+
+  return MAX (delay_one (bucket->message_credit,
+                         bucket->messages_per_second),
+              delay_one (bucket->byte_credit,
+                         bucket->bytes_per_second));
+}
+
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+
+dbus_bool_t
+bus_rate_bucket_test (const DBusString *test_data_dir)
+{
+  BusRateBucket bucket;
+  int i;
+
+  /* 10 messages or 1000 bytes per second, whichever runs out first */
+  bus_rate_bucket_init (&bucket, 10, 1000, 100, 0);
+  _dbus_assert (bus_rate_bucket_get_delay (&bucket, 100, 0) == 0);
+
+  /* a second's worth goes through at once... */
+  for (i = 0; i < 10; i++)
+    bus_rate_bucket_charge (&bucket, 10, 100, 0);
+
+  _dbus_assert (bus_rate_bucket_get_delay (&bucket, 100, 0) == 0);
+
+  /* ... and one more has to wait for a tenth of a second */
+  bus_rate_bucket_charge (&bucket, 10, 100, 0);
+  _dbus_assert (bus_rate_bucket_get_delay (&bucket, 100, 0) == 100);
+  _dbus_assert (bus_rate_bucket_get_delay (&bucket, 100, 40000) == 60);
+  _dbus_assert (bus_rate_bucket_get_delay (&bucket, 100, 100000) == 0);
+
+  /* waiting longer than a second refills no more than a second's worth */
+  _dbus_assert (bus_rate_bucket_get_delay (&bucket, 200, 0) == 0);
+  bus_rate_bucket_charge (&bucket, 1500, 200, 0);
+  _dbus_assert (bus_rate_bucket_get_delay (&bucket, 200, 0) == 500);
+
+  /* a limit of 0 is no limit */
+  bus_rate_bucket_init (&bucket, 0, 1000, 300, 0);
+  for (i = 0; i < 100; i++)
+    bus_rate_bucket_charge (&bucket, 1, 300, 0);
+  _dbus_assert (bus_rate_bucket_get_delay (&bucket, 300, 0) == 0);
+
+  return TRUE;
+}
+
+#endif /* DBUS_ENABLE_EMBEDDED_TESTS */
@@ -0,0 +1,56 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* ratelimit.h  Token buckets for throttling connections
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef BUS_RATELIMIT_H
+#define BUS_RATELIMIT_H
+
+#include <dbus/dbus.h>
+
+/*
+ * A pair of token buckets, one for messages and one for bytes, each
+ * holding up to one second's worth. Charging may take a bucket into
+ * debt; whoever owns it stops reading until bus_rate_bucket_get_delay()
+ * says the debt has been paid off.
+ */
+typedef struct
+{
+  long messages_per_second;     /**< 0 if messages are not limited */
+  long bytes_per_second;        /**< 0 if bytes are not limited */
+  dbus_int64_t message_credit;  /**< Thousandths of a message, negative while in debt */
+  dbus_int64_t byte_credit;     /**< Thousandths of a byte, negative while in debt */
+  long refilled_tv_sec;         /**< When the credit was last topped up (seconds component) */
+  long refilled_tv_usec;        /**< When the credit was last topped up (microsec component) */
+} BusRateBucket;
+
+void bus_rate_bucket_init      (BusRateBucket *bucket,
+                                long           messages_per_second,
+                                long           bytes_per_second,
+                                long           tv_sec,
+                                long           tv_usec);
+void bus_rate_bucket_charge    (BusRateBucket *bucket,
+                                long           n_bytes,
+                                long           tv_sec,
+                                long           tv_usec);
+int  bus_rate_bucket_get_delay (BusRateBucket *bucket,
+                                long           tv_sec,
+                                long           tv_usec);
+
+#endif /* BUS_RATELIMIT_H */
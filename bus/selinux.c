@@ -70,6 +70,30 @@ static security_id_t bus_sid = SECSID_WILD;
 /* Thread to listen for SELinux status changes via netlink. */
 static pthread_t avc_notify_thread;
 
+/* Number of slots in the decision cache; a power of two. */
+#define DECISION_CACHE_SIZE 64
+
+/* An allowed decision that had nothing to audit, so repeating it
+ * needs neither the AVC nor the audit string. */
+typedef struct
+{
+  security_id_t ssid;
+  security_id_t tsid;
+  security_class_t tclass;
+  access_vector_t requested;
+  int serial;                /* decision_cache_serial when stored */
+  int reset_serial;          /* decision_cache_resets when stored */
+} DecisionCacheEntry;
+
+static DecisionCacheEntry decision_cache[DECISION_CACHE_SIZE];
+
+/* Bumped from the main thread when a SID may be released; starts at 1
+ * so that zeroed slots never match. */
+static int decision_cache_serial = 1;
+
+/* Bumped from the AVC netlink thread on a policy reload. */
+static DBusAtomic decision_cache_resets = { 0 };
+
 /* Prototypes for AVC callback functions.  */
 static void log_callback (const char *fmt, ...);
 static void log_audit_callback (void *data, security_class_t class, char *buf, size_t bufleft);
@@ -160,7 +184,11 @@ policy_reload_callback (u_int32_t event, security_id_t ssid,
                         access_vector_t perms, access_vector_t *out_retained)
 {
   if (event == AVC_CALLBACK_RESET)
-    return raise (SIGHUP);
+    {
+      /* we're on the netlink thread here, so only flag the cache */
+      _dbus_atomic_inc (&decision_cache_resets);
+      return raise (SIGHUP);
+    }
   
   return 0;
 }
@@ -399,6 +427,9 @@ bus_selinux_id_unref (BusSELinuxID *sid)
     return;
 
   _dbus_assert (sid != NULL);
+
+  /* the security_id_t could be freed and reused for another context */
+  decision_cache_serial += 1;
   
   sidput (SELINUX_SID_FROM_BUS (sid));
 #endif /* HAVE_SELINUX */
@@ -469,6 +500,73 @@ bus_selinux_check (BusSELinuxID        *sender_sid,
 }
 #endif /* HAVE_SELINUX */
 
+/**
+ * Looks for a cached "allowed, nothing to audit" decision, and asks
+ * the AVC without auditing if there isn't one. If this returns #TRUE
+ * the permission is granted and nothing needs logging; otherwise the
+ * caller must pass avd and result on to avc_audit(), exactly as
+ * avc_has_perm() would have done internally.
+ *
+ * @param ssid source security context
+ * @param tsid target security context
+ * @param tclass target security class
+ * @param requested requested permissions
+ * @param avd return location for the AVC decision
+ * @param result return location for the avc_has_perm_noaudit() result
+ * @param result_errno return location for errno if result is negative
+ * @returns #TRUE if allowed without auditing
+ */
+#ifdef HAVE_SELINUX
+static dbus_bool_t
+bus_selinux_check_quietly (security_id_t        ssid,
+                           security_id_t        tsid,
+                           security_class_t     tclass,
+                           access_vector_t      requested,
+                           struct av_decision  *avd,
+                           int                 *result,
+                           int                 *result_errno)
+{
+  DecisionCacheEntry *entry;
+  uintptr_t hash;
+  int resets;
+
+  resets = _dbus_atomic_get (&decision_cache_resets);
+
+  hash = (((uintptr_t) ssid) >> 4) * 31 + (((uintptr_t) tsid) >> 4);
+  hash = hash * 31 + tclass * 37 + requested;
+  entry = &decision_cache[hash & (DECISION_CACHE_SIZE - 1)];
+
+  if (entry->serial == decision_cache_serial &&
+      entry->reset_serial == resets &&
+      entry->ssid == ssid &&
+      entry->tsid == tsid &&
+      entry->tclass == tclass &&
+      entry->requested == requested)
+    return TRUE;
+
+  *result = avc_has_perm_noaudit (ssid, tsid, tclass, requested,
+                                  &aeref, avd);
+  *result_errno = errno;
+
+  /* Permissive mode returns 0 for a denial, which still has to be
+   * logged, so look at the decision itself. */
+  if (*result == 0 &&
+      (avd->allowed & requested) == requested &&
+      (avd->auditallow & requested) == 0)
+    {
+      entry->ssid = ssid;
+      entry->tsid = tsid;
+      entry->tclass = tclass;
+      entry->requested = requested;
+      entry->serial = decision_cache_serial;
+      entry->reset_serial = resets;
+      return TRUE;
+    }
+
+  return FALSE;
+}
+#endif /* HAVE_SELINUX */
+
 /**
  * Returns true if the given connection can acquire a service,
  * assuming the given security ID is needed for that service.
@@ -560,10 +658,26 @@ bus_selinux_allows_send (DBusConnection     *sender,
   DBusString auxdata;
   dbus_bool_t ret;
   dbus_bool_t string_alloced;
+  struct av_decision avd;
+  int result, result_errno;
 
   if (!selinux_enabled)
     return TRUE;
 
+  sender_sid = bus_connection_get_selinux_id (sender);
+  /* A NULL proposed_recipient means the bus itself. */
+  if (proposed_recipient)
+    recipient_sid = bus_connection_get_selinux_id (proposed_recipient);
+  else
+    recipient_sid = BUS_SID_FROM_SELINUX (bus_sid);
+
+  /* The audit string is only needed if something gets logged */
+  if (bus_selinux_check_quietly (SELINUX_SID_FROM_BUS (sender_sid),
+                                 SELINUX_SID_FROM_BUS (recipient_sid),
+                                 SECCLASS_DBUS, DBUS__SEND_MSG,
+                                 &avd, &result, &result_errno))
+    return TRUE;
+
   if (!sender || !dbus_connection_get_unix_process_id (sender, &spid))
     spid = 0;
   if (!proposed_recipient || !dbus_connection_get_unix_process_id (proposed_recipient, &tpid))
@@ -630,18 +744,30 @@ bus_selinux_allows_send (DBusConnection     *sender,
 	goto oom;
     }
 
-  sender_sid = bus_connection_get_selinux_id (sender);
-  /* A NULL proposed_recipient means the bus itself. */
-  if (proposed_recipient)
-    recipient_sid = bus_connection_get_selinux_id (proposed_recipient);
-  else
-    recipient_sid = BUS_SID_FROM_SELINUX (bus_sid);
+  avc_audit (SELINUX_SID_FROM_BUS (sender_sid),
+             SELINUX_SID_FROM_BUS (recipient_sid),
+             SECCLASS_DBUS, DBUS__SEND_MSG,
+             &avd, result, &auxdata);
 
-  ret = bus_selinux_check (sender_sid, 
-			   recipient_sid,
-			   SECCLASS_DBUS, 
-			   DBUS__SEND_MSG,
-			   &auxdata);
+  if (result < 0)
+    {
+      /* same reasons as bus_selinux_check() */
+      switch (result_errno)
+        {
+        case EACCES:
+          _dbus_verbose ("SELinux denying due to security policy.\n");
+          break;
+        case EINVAL:
+          _dbus_verbose ("SELinux denying due to invalid security context.\n");
+          break;
+        default:
+          _dbus_verbose ("SELinux denying due to: %s\n", _dbus_strerror (result_errno));
+          break;
+        }
+      ret = FALSE;
+    }
+  else
+    ret = TRUE;
 
   _dbus_string_free (&auxdata);
 
@@ -947,7 +1073,7 @@ bus_selinux_id_table_print (DBusHashTable *service_table)
 #if defined (DBUS_ENABLE_VERBOSE_MODE) && defined (HAVE_SELINUX)
   DBusHashIter iter;
 
-  if (!selinux_enabled)
+  if (!selinux_enabled || !_dbus_is_verbose ())
     return;
   
   _dbus_verbose ("Service SID Table:\n");
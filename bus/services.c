@@ -45,6 +45,9 @@ struct BusService
   BusRegistry *registry;
   char *name;
   DBusList *owners;
+
+  int unique_major; /**< For a unique name in unique_slots, :MAJOR.MINOR; else 0 */
+  int unique_minor;
 };
 
 struct BusOwner
@@ -53,6 +56,7 @@ struct BusOwner
 
   BusService *service;
   DBusConnection *conn;
+  DBusList *link_in_services_owned; /**< Our service in conn's list of owned ones */
 
   unsigned int allow_replacement : 1;
   unsigned int do_not_queue : 1;
@@ -69,6 +73,15 @@ struct BusRegistry
   DBusMemPool   *owner_pool;
 
   DBusHashTable *service_sid_table;
+
+  dbus_uint32_t owners_serial; /**< Bumped whenever any name gains or loses an owner */
+
+  DBusMessage *names_snapshot; /**< Cached ListNames reply body, or #NULL */
+
+  BusService **unique_slots; /**< Unique names by MINOR modulo n_unique_slots */
+  int n_unique_slots;        /**< Zero or a power of two */
+  int n_unique_names;        /**< Unique names in service_hash */
+  int n_unique_overflow;     /**< Unique names whose slot was taken */
 };
 
 BusRegistry*
@@ -135,19 +148,236 @@ bus_registry_unref  (BusRegistry *registry)
         _dbus_mem_pool_free (registry->owner_pool);
       if (registry->service_sid_table)
         _dbus_hash_table_unref (registry->service_sid_table);
+      if (registry->names_snapshot)
+        dbus_message_unref (registry->names_snapshot);
+      dbus_free (registry->unique_slots);
       
       dbus_free (registry);
     }
 }
 
+/**
+ * Returns a number that changes whenever any name on the bus gains or
+ * loses an owner, queued or primary, or its queue is reordered, as
+ * when a queued owner replaces the primary owner.
+ *
+ * @param registry the registry
+ * @returns the current serial
+ */
+dbus_uint32_t
+bus_registry_get_owners_serial (BusRegistry *registry)
+{
+  return registry->owners_serial;
+}
+
+/* Called whenever a name is added to or removed from service_hash */
+static void
+bus_registry_names_changed (BusRegistry *registry)
+{
+  if (registry->names_snapshot != NULL)
+    {
+      dbus_message_unref (registry->names_snapshot);
+      registry->names_snapshot = NULL;
+    }
+}
+
+/**
+ * Returns an unaddressed method return carrying the ListNames reply
+ * body. It is rebuilt only after a name has appeared or disappeared,
+ * so polling ListNames costs one message copy.
+ *
+ * @param registry the registry
+ * @returns the snapshot, owned by the registry, or #NULL if no memory
+ */
+DBusMessage *
+bus_registry_get_names_snapshot (BusRegistry *registry)
+{
+  if (registry->names_snapshot == NULL)
+    registry->names_snapshot = bus_names_snapshot_new (registry->service_hash);
+
+  return registry->names_snapshot;
+}
+
+/* Parses a unique name as create_unique_client_name() writes it,
+ * :MAJOR.MINOR in decimal with no leading zeroes, so that each unique
+ * name has exactly one pair of numbers and each pair one name.
+ */
+static dbus_bool_t
+parse_unique_name (const char *name,
+                   int        *major,
+                   int        *minor)
+{
+  int *numbers[2];
+  int i;
+
+  if (*name != ':')
+    return FALSE;
+
+  numbers[0] = major;
+  numbers[1] = minor;
+
+  for (i = 0; i < 2; i++)
+    {
+      int n = 0;
+      const char *start = ++name;
+
+      while (*name >= '0' && *name <= '9')
+        {
+          if (n > (_DBUS_INT_MAX - (*name - '0')) / 10)
+            return FALSE;
+
+          n = n * 10 + (*name - '0');
+          name++;
+        }
+
+      if (name == start || (*start == '0' && name - start > 1))
+        return FALSE;
+
+      if (*name != (i == 0 ? '.' : '\0'))
+        return FALSE;
+
+      *numbers[i] = n;
+    }
+
+  return TRUE;
+}
+
+/* Drops all the unique names into a new table of n_slots. We don't
+ * shrink again: the table stays as large as the most clients the bus
+ * has had at once needed.
+ */
+static dbus_bool_t
+unique_slots_rebuild (BusRegistry *registry,
+                      int          n_slots)
+{
+  BusService **slots;
+  DBusHashIter iter;
+
+  slots = dbus_new0 (BusService *, n_slots);
+  if (slots == NULL)
+    return FALSE;
+
+  dbus_free (registry->unique_slots);
+  registry->unique_slots = slots;
+  registry->n_unique_slots = n_slots;
+  registry->n_unique_overflow = 0;
+
+  _dbus_hash_iter_init (registry->service_hash, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      BusService *service = _dbus_hash_iter_get_value (&iter);
+      BusService **slot;
+
+      if (service->unique_major == 0)
+        continue;
+
+      slot = &slots[service->unique_minor & (n_slots - 1)];
+      if (*slot == NULL)
+        *slot = service;
+      else
+        registry->n_unique_overflow += 1;
+    }
+
+  return TRUE;
+}
+
+/* Called once a service has gone into service_hash. Doesn't fail: if
+ * there's no memory to grow, or the slot is taken, the name is only
+ * found by the string lookup.
+ */
+static void
+unique_slots_add (BusRegistry *registry,
+                  BusService  *service)
+{
+  BusService **slot;
+
+  if (!parse_unique_name (service->name, &service->unique_major,
+                          &service->unique_minor) ||
+      service->unique_major == 0)
+    {
+      service->unique_major = 0;
+      return;
+    }
+
+  registry->n_unique_names += 1;
+
+  /* keep at least half the slots free, so that the sequential minor
+   * numbers of clients that come and go rarely collide */
+  if (registry->n_unique_names * 2 > registry->n_unique_slots &&
+      registry->n_unique_slots < _DBUS_INT_MAX / 2 / (int) sizeof (BusService *) &&
+      unique_slots_rebuild (registry, MAX (64, registry->n_unique_slots * 2)))
+    return;
+
+  slot = NULL;
+  if (registry->n_unique_slots > 0)
+    slot = &registry->unique_slots[service->unique_minor &
+                                   (registry->n_unique_slots - 1)];
+
+  if (slot != NULL && *slot == NULL)
+    *slot = service;
+  else
+    registry->n_unique_overflow += 1;
+}
+
+/* Called once a service has left service_hash */
+static void
+unique_slots_remove (BusRegistry *registry,
+                     BusService  *service)
+{
+  BusService **slot;
+
+  if (service->unique_major == 0)
+    return;
+
+  registry->n_unique_names -= 1;
+
+  slot = NULL;
+  if (registry->n_unique_slots > 0)
+    slot = &registry->unique_slots[service->unique_minor &
+                                   (registry->n_unique_slots - 1)];
+
+  if (slot != NULL && *slot == service)
+    *slot = NULL;
+  else
+    registry->n_unique_overflow -= 1;
+
+  service->unique_major = 0;
+}
+
+/**
+ * Looks up the service with the given name. A unique name is parsed
+ * and found by its numbers, without hashing the string, unless its
+ * slot was taken when it joined the bus.
+ *
+ * @param registry the registry
+ * @param service_name the well-known or unique name
+ * @returns the service, or #NULL if nobody owns the name
+ */
 BusService*
 bus_registry_lookup (BusRegistry      *registry,
                      const DBusString *service_name)
 {
   BusService *service;
+  const char *name;
+  int major, minor;
 
-  service = _dbus_hash_table_lookup_string (registry->service_hash,
-                                            _dbus_string_get_const_data (service_name));
+  name = _dbus_string_get_const_data (service_name);
+
+  if (registry->n_unique_slots > 0 &&
+      parse_unique_name (name, &major, &minor))
+    {
+      service = registry->unique_slots[minor & (registry->n_unique_slots - 1)];
+
+      if (service != NULL &&
+          service->unique_major == major &&
+          service->unique_minor == minor)
+        return service;
+
+      if (registry->n_unique_overflow == 0)
+        return NULL;
+    }
+
+  service = _dbus_hash_table_lookup_string (registry->service_hash, name);
 
   return service;
 }
@@ -174,6 +404,18 @@ _bus_service_find_owner_link (BusService *service,
   return link;
 }
 
+/*
+ * Called whenever a connection joins or leaves the owners (or queue)
+ * of a name, or moves within it, so that anything remembering the
+ * answer of bus_service_has_owner() or who the primary owner is knows
+ * to look again.
+ */
+static void
+bus_service_owners_changed (BusService *service)
+{
+  service->registry->owners_serial += 1;
+}
+
 static void
 bus_owner_set_flags (BusOwner *owner,
                      dbus_uint32_t flags)
@@ -206,11 +448,15 @@ bus_owner_new (BusService *service,
       result->conn = conn;
       result->service = service;
 
-      if (!bus_connection_add_owned_service (conn, service))
+      result->link_in_services_owned = _dbus_list_alloc_link (service);
+      if (result->link_in_services_owned == NULL)
         {
           _dbus_mem_pool_dealloc (service->registry->owner_pool, result);
           return NULL;
         }
+
+      bus_connection_add_owned_service_link (conn,
+                                             result->link_in_services_owned);
         
       bus_owner_set_flags (result, flags);
     }
@@ -234,7 +480,8 @@ bus_owner_unref  (BusOwner *owner)
 
   if (owner->refcount == 0)
     {
-      bus_connection_remove_owned_service (owner->conn, owner->service);
+      bus_connection_remove_owned_service_link (owner->conn,
+                                                owner->link_in_services_owned);
       _dbus_mem_pool_dealloc (owner->service->registry->owner_pool, owner);
     }
 }
@@ -268,6 +515,7 @@ bus_registry_ensure (BusRegistry               *registry,
 
   service->registry = registry;  
   service->refcount = 1;
+  service->unique_major = 0;
 
   _dbus_verbose ("copying string %p '%s' to service->name\n",
                  service_name, _dbus_string_get_const_data (service_name));
@@ -312,6 +560,9 @@ bus_registry_ensure (BusRegistry               *registry,
       BUS_SET_OOM (error);
       return NULL;
     }
+
+  unique_slots_add (registry, service);
+  bus_registry_names_changed (registry);
   
   return service;
 }
@@ -544,6 +795,7 @@ bus_registry_acquire_service (BusRegistry      *registry,
           temp_owner = (BusOwner *)link->data;
           bus_owner_unref (temp_owner); 
           _dbus_list_free_link (link);
+          bus_service_owners_changed (service);
         }
       
       *result = DBUS_REQUEST_NAME_REPLY_EXISTS;
@@ -715,6 +967,7 @@ bus_service_unlink_owner (BusService      *service,
 {
   _dbus_list_remove_last (&service->owners, owner);
   bus_owner_unref (owner);
+  bus_service_owners_changed (service);
 }
 
 static void
@@ -726,8 +979,10 @@ bus_service_unlink (BusService *service)
    * the failure causing transaction cancel
    * was in the right place, but that's OK
    */
-  _dbus_hash_table_remove_string (service->registry->service_hash,
-                                  service->name);
+  if (_dbus_hash_table_remove_string (service->registry->service_hash,
+                                      service->name))
+    unique_slots_remove (service->registry, service);
+  bus_registry_names_changed (service->registry);
   
   bus_service_unref (service);
 }
@@ -743,6 +998,8 @@ bus_service_relink (BusService           *service,
                                                preallocated,
                                                service->name,
                                                service);
+  unique_slots_add (service->registry, service);
+  bus_registry_names_changed (service->registry);
   
   bus_service_ref (service);
 }
@@ -867,6 +1124,8 @@ bus_service_add_owner (BusService     *service,
               return FALSE;
             }
         }      
+
+      bus_service_owners_changed (service);
     } 
   else 
     {
@@ -883,6 +1142,7 @@ bus_service_add_owner (BusService     *service,
 	  _dbus_assert (link != NULL);
 	  
           _dbus_list_insert_after_link (&service->owners, link, bus_owner_link);
+          bus_service_owners_changed (service);
         }
       
       bus_owner_set_flags (bus_owner, flags);
@@ -907,7 +1167,6 @@ typedef struct
   BusService     *service;
   BusOwner       *before_owner; /* restore to position before this connection in owners list */
   DBusList       *owner_link;
-  DBusList       *service_link;
   DBusPreallocatedHash *hash_entry;
 } OwnershipRestoreData;
 
@@ -917,7 +1176,6 @@ restore_ownership (void *data)
   OwnershipRestoreData *d = data;
   DBusList *link;
 
-  _dbus_assert (d->service_link != NULL);
   _dbus_assert (d->owner_link != NULL);
   
   if (d->service->owners == NULL)
@@ -944,17 +1202,14 @@ restore_ownership (void *data)
     }
   
   _dbus_list_insert_before_link (&d->service->owners, link, d->owner_link);
+  bus_owner_ref (d->owner);
+  bus_service_owners_changed (d->service);
 
-  /* Note that removing then restoring this changes the order in which
-   * ServiceDeleted messages are sent on destruction of the
-   * connection.  This should be OK as the only guarantee there is
-   * that the base service is destroyed last, and we never even
-   * tentatively remove the base service.
+  /* The ref we held kept the owner alive, so the name never left the
+   * connection's services_owned and doesn't need to be put back there.
    */
-  bus_connection_add_owned_service_link (d->owner->conn, d->service_link);
   
   d->hash_entry = NULL;
-  d->service_link = NULL;
   d->owner_link = NULL;
 }
 
@@ -963,8 +1218,6 @@ free_ownership_restore_data (void *data)
 {
   OwnershipRestoreData *d = data;
 
-  if (d->service_link)
-    _dbus_list_free_link (d->service_link);
   if (d->owner_link)
     _dbus_list_free_link (d->owner_link);
   if (d->hash_entry)
@@ -992,7 +1245,6 @@ add_restore_ownership_to_transaction (BusTransaction *transaction,
   
   d->service = service;
   d->owner = owner;
-  d->service_link = _dbus_list_alloc_link (service);
   d->owner_link = _dbus_list_alloc_link (owner);
   d->hash_entry = _dbus_hash_table_preallocate_entry (service->registry->service_hash);
   
@@ -1017,8 +1269,7 @@ add_restore_ownership_to_transaction (BusTransaction *transaction,
       link = _dbus_list_get_next_link (&service->owners, link);
     }
   
-  if (d->service_link == NULL ||
-      d->owner_link == NULL ||
+  if (d->owner_link == NULL ||
       d->hash_entry == NULL ||
       !bus_transaction_add_cancel_hook (transaction, restore_ownership, d,
                                         free_ownership_restore_data))
@@ -1103,6 +1354,7 @@ bus_service_swap_owner (BusService     *service,
   _dbus_list_insert_after_link (&service->owners,
                                 _dbus_list_get_first_link (&service->owners),
 				swap_link);
+  bus_service_owners_changed (service);
 
   return TRUE;
 }
@@ -1141,6 +1393,7 @@ bus_service_remove_owner (BusService     *service,
       temp_owner = (BusOwner *)link->data;
       bus_owner_unref (temp_owner); 
       _dbus_list_free_link (link);
+      bus_service_owners_changed (service);
 
       return TRUE; 
     }
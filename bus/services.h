@@ -36,6 +36,7 @@ typedef void (* BusServiceForeachFunction) (BusService       *service,
 BusRegistry* bus_registry_new             (BusContext                  *context);
 BusRegistry* bus_registry_ref             (BusRegistry                 *registry);
 void         bus_registry_unref           (BusRegistry                 *registry);
+dbus_uint32_t bus_registry_get_owners_serial (BusRegistry                *registry);
 BusService*  bus_registry_lookup          (BusRegistry                 *registry,
                                            const DBusString            *service_name);
 BusService*  bus_registry_ensure          (BusRegistry                 *registry,
@@ -50,6 +51,7 @@ void         bus_registry_foreach         (BusRegistry                 *registry
 dbus_bool_t  bus_registry_list_services   (BusRegistry                 *registry,
                                            char                      ***listp,
                                            int                         *array_len);
+DBusMessage *bus_registry_get_names_snapshot (BusRegistry              *registry);
 dbus_bool_t  bus_registry_acquire_service (BusRegistry                 *registry,
                                            DBusConnection              *connection,
                                            const DBusString            *service_name,
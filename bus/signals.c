@@ -26,9 +26,14 @@
 #include <string.h>
 
 #include "signals.h"
+#include "atoms.h"
 #include "services.h"
 #include "utils.h"
+#include <dbus/dbus-connection-internal.h>
 #include <dbus/dbus-marshal-validate.h>
+#include <dbus/dbus-message-internal.h>
+#include <dbus/dbus-object-tree.h>
+#include <dbus/dbus-trace.h>
 
 struct BusMatchRule
 {
@@ -38,16 +43,35 @@ struct BusMatchRule
 
   unsigned int flags; /**< BusMatchFlags */
 
+  /* the strings are atoms, so equal ones are the same pointer */
   int   message_type;
-  char *interface;
-  char *member;
-  char *sender;
-  char *destination;
-  char *path;
+  const char *interface;
+  const char *member;
+  const char *sender;
+  const char *destination;
+  const char *path;
+  char **path_components; /**< path decomposed with _dbus_decompose_path() */
 
   unsigned int *arg_lens;
   char **args;
   int args_len;
+
+  BusMatchmaker *matchmaker;  /**< Matchmaker the rule was added to, or NULL */
+  DBusList *link;             /**< The rule's link in that matchmaker's lists */
+  DBusList *sender_link;      /**< Link in rules_by_unique_name for a unique sender */
+  DBusList *destination_link; /**< Link in rules_by_unique_name for a unique destination */
+  DBusList *hash_link;        /**< Link in the matchmaker's rules_by_hash */
+  DBusList *connection_link;  /**< Link in matches_go_to's list of rules */
+
+  BusMatchRule *shared;       /**< The equal rule that is in the matchmaker's lists for all of them, or this rule itself */
+  DBusList *subscribers;      /**< If shared is this rule: every rule equal to it, this one first; no references */
+  DBusList *subscriber_link;  /**< Link in shared->subscribers */
+  DBusList *shared_link;      /**< If shared is this rule: link in the matchmaker's shared_rules */
+
+  unsigned int hash; /**< See match_rule_get_hash() */
+
+  unsigned int hashed : 1; /**< hash has been computed */
+  unsigned int packed : 1; /**< The arrays and arg strings share the rule's allocation, see match_rule_pack() */
 };
 
 #define BUS_MATCH_ARG_NAMESPACE   0x4000000u
@@ -92,11 +116,19 @@ bus_match_rule_unref (BusMatchRule *rule)
   rule->refcount -= 1;
   if (rule->refcount == 0)
     {
-      dbus_free (rule->interface);
-      dbus_free (rule->member);
-      dbus_free (rule->sender);
-      dbus_free (rule->destination);
-      dbus_free (rule->path);
+      bus_atom_unref (rule->interface);
+      bus_atom_unref (rule->member);
+      bus_atom_unref (rule->sender);
+      bus_atom_unref (rule->destination);
+      bus_atom_unref (rule->path);
+
+      if (rule->packed)
+        {
+          dbus_free (rule);
+          return;
+        }
+
+      dbus_free_string_array (rule->path_components);
       dbus_free (rule->arg_lens);
 
       /* can't use dbus_free_string_array() since there
@@ -328,16 +360,16 @@ dbus_bool_t
 bus_match_rule_set_interface (BusMatchRule *rule,
                               const char   *interface)
 {
-  char *new;
+  const char *new;
 
   _dbus_assert (interface != NULL);
 
-  new = _dbus_strdup (interface);
+  new = bus_atom_ref (interface);
   if (new == NULL)
     return FALSE;
 
   rule->flags |= BUS_MATCH_INTERFACE;
-  dbus_free (rule->interface);
+  bus_atom_unref (rule->interface);
   rule->interface = new;
 
   return TRUE;
@@ -347,16 +379,16 @@ dbus_bool_t
 bus_match_rule_set_member (BusMatchRule *rule,
                            const char   *member)
 {
-  char *new;
+  const char *new;
 
   _dbus_assert (member != NULL);
 
-  new = _dbus_strdup (member);
+  new = bus_atom_ref (member);
   if (new == NULL)
     return FALSE;
 
   rule->flags |= BUS_MATCH_MEMBER;
-  dbus_free (rule->member);
+  bus_atom_unref (rule->member);
   rule->member = new;
 
   return TRUE;
@@ -366,16 +398,16 @@ dbus_bool_t
 bus_match_rule_set_sender (BusMatchRule *rule,
                            const char   *sender)
 {
-  char *new;
+  const char *new;
 
   _dbus_assert (sender != NULL);
 
-  new = _dbus_strdup (sender);
+  new = bus_atom_ref (sender);
   if (new == NULL)
     return FALSE;
 
   rule->flags |= BUS_MATCH_SENDER;
-  dbus_free (rule->sender);
+  bus_atom_unref (rule->sender);
   rule->sender = new;
 
   return TRUE;
@@ -385,16 +417,16 @@ dbus_bool_t
 bus_match_rule_set_destination (BusMatchRule *rule,
                                 const char   *destination)
 {
-  char *new;
+  const char *new;
 
   _dbus_assert (destination != NULL);
 
-  new = _dbus_strdup (destination);
+  new = bus_atom_ref (destination);
   if (new == NULL)
     return FALSE;
 
   rule->flags |= BUS_MATCH_DESTINATION;
-  dbus_free (rule->destination);
+  bus_atom_unref (rule->destination);
   rule->destination = new;
 
   return TRUE;
@@ -424,14 +456,22 @@ bus_match_rule_set_path (BusMatchRule *rule,
                          const char   *path,
                          dbus_bool_t   is_namespace)
 {
-  char *new;
+  const char *new;
+  char **components;
 
   _dbus_assert (path != NULL);
+  _dbus_assert (!rule->packed);
 
-  new = _dbus_strdup (path);
+  new = bus_atom_ref (path);
   if (new == NULL)
     return FALSE;
 
+  if (!_dbus_decompose_path (new, strlen (new), &components, NULL))
+    {
+      bus_atom_unref (new);
+      return FALSE;
+    }
+
   rule->flags &= ~(BUS_MATCH_PATH|BUS_MATCH_PATH_NAMESPACE);
 
   if (is_namespace)
@@ -439,8 +479,10 @@ bus_match_rule_set_path (BusMatchRule *rule,
   else
     rule->flags |= BUS_MATCH_PATH;
 
-  dbus_free (rule->path);
+  bus_atom_unref (rule->path);
   rule->path = new;
+  dbus_free_string_array (rule->path_components);
+  rule->path_components = components;
 
   return TRUE;
 }
@@ -456,6 +498,7 @@ bus_match_rule_set_arg (BusMatchRule     *rule,
   char *new;
 
   _dbus_assert (value != NULL);
+  _dbus_assert (!rule->packed);
 
   /* args_len is the number of args not including null termination
    * in the char**
@@ -527,6 +570,212 @@ bus_match_rule_set_arg (BusMatchRule     *rule,
   return TRUE;
 }
 
+/* Bytes the rule would take in a single allocation, not counting the
+ * atoms, which are shared */
+static size_t
+match_rule_packed_size (BusMatchRule *rule)
+{
+  size_t size;
+  int i;
+
+  size = _DBUS_ALIGN_VALUE (sizeof (BusMatchRule), sizeof (void *));
+
+  if (rule->path_components != NULL)
+    {
+      for (i = 0; rule->path_components[i] != NULL; i++)
+        size += sizeof (char *) + strlen (rule->path_components[i]) + 1;
+
+      size += sizeof (char *);
+    }
+
+  if (rule->args != NULL)
+    {
+      size += (sizeof (char *) + sizeof (unsigned int)) * (rule->args_len + 1);
+
+      for (i = 0; i < rule->args_len; i++)
+        {
+          if (rule->args[i] != NULL)
+            size += (rule->arg_lens[i] & ~BUS_MATCH_ARG_FLAGS) + 1;
+        }
+    }
+
+  return size;
+}
+
+/*
+ * Rules are created once and then only read, and a big bus holds a
+ * great many of them, so once parsed a rule is moved into a single
+ * allocation: the struct, then the path_components and args pointer
+ * arrays, then arg_lens, then the strings they point to. Returns the
+ * packed rule, having freed the original, or the original unchanged
+ * if there wasn't enough memory, which is just less compact.
+ */
+static BusMatchRule *
+match_rule_pack (BusMatchRule *rule)
+{
+  BusMatchRule *packed;
+  char **pointers;
+  unsigned int *lens;
+  char *strings;
+  size_t len;
+  int n_components;
+  int i;
+
+  _dbus_assert (rule->refcount == 1);
+  _dbus_assert (!rule->packed);
+
+  packed = dbus_malloc (match_rule_packed_size (rule));
+  if (packed == NULL)
+    return rule;
+
+  *packed = *rule;
+  packed->packed = TRUE;
+
+  n_components = 0;
+  if (rule->path_components != NULL)
+    {
+      while (rule->path_components[n_components] != NULL)
+        n_components++;
+    }
+
+  /* the pointer arrays first, then arg_lens, then the strings */
+  pointers = (char **) (void *) (((char *) packed) +
+      _DBUS_ALIGN_VALUE (sizeof (BusMatchRule), sizeof (void *)));
+  lens = (unsigned int *) (void *) (pointers +
+      (rule->path_components != NULL ? n_components + 1 : 0) +
+      (rule->args != NULL ? rule->args_len + 1 : 0));
+  strings = (char *) (lens + (rule->args != NULL ? rule->args_len + 1 : 0));
+
+  if (rule->path_components != NULL)
+    {
+      packed->path_components = pointers;
+
+      for (i = 0; i < n_components; i++)
+        {
+          len = strlen (rule->path_components[i]) + 1;
+          memcpy (strings, rule->path_components[i], len);
+          packed->path_components[i] = strings;
+          strings += len;
+        }
+
+      packed->path_components[n_components] = NULL;
+      pointers += n_components + 1;
+    }
+
+  if (rule->args != NULL)
+    {
+      packed->args = pointers;
+      packed->arg_lens = lens;
+
+      for (i = 0; i <= rule->args_len; i++)
+        {
+          packed->arg_lens[i] = rule->arg_lens[i];
+
+          if (rule->args[i] == NULL)
+            {
+              packed->args[i] = NULL;
+              continue;
+            }
+
+          len = (rule->arg_lens[i] & ~BUS_MATCH_ARG_FLAGS) + 1;
+          memcpy (strings, rule->args[i], len);
+          packed->args[i] = strings;
+          strings += len;
+        }
+    }
+
+  _dbus_assert ((size_t) (strings - (char *) packed) ==
+                match_rule_packed_size (packed));
+
+  /* The atoms now belong to the packed copy; free everything else */
+  rule->interface = NULL;
+  rule->member = NULL;
+  rule->sender = NULL;
+  rule->destination = NULL;
+  rule->path = NULL;
+  bus_match_rule_unref (rule);
+
+  return packed;
+}
+
+/**
+ * Returns how many bytes the rule itself occupies, not counting the
+ * interned strings it shares with other rules.
+ *
+ * @param rule the rule
+ * @returns size in bytes
+ */
+int
+bus_match_rule_get_n_bytes (BusMatchRule *rule)
+{
+  return match_rule_packed_size (rule);
+}
+
+#define MATCH_RULE_HASH_PTR(p) ((unsigned int) (((uintptr_t) (p)) >> 4))
+
+/*
+ * Returns a hash of what match_rule_equal() compares, apart from the
+ * owner and the eavesdropping flag, which the driver may still set
+ * after parsing. The strings are atoms, so their addresses are enough;
+ * arg values are hashed by content. It is computed once, normally at
+ * the end of bus_match_rule_parse(), so nothing else may be changed
+ * after that.
+ */
+static unsigned int
+match_rule_get_hash (BusMatchRule *rule)
+{
+  unsigned int h;
+  int i;
+
+  if (rule->hashed)
+    return rule->hash;
+
+  h = rule->flags & ~BUS_MATCH_CLIENT_IS_EAVESDROPPING;
+
+  if (rule->flags & BUS_MATCH_MESSAGE_TYPE)
+    h = h * 31 + (unsigned int) rule->message_type;
+
+  if (rule->flags & BUS_MATCH_MEMBER)
+    h = h * 31 + MATCH_RULE_HASH_PTR (rule->member);
+
+  if (rule->flags & (BUS_MATCH_PATH | BUS_MATCH_PATH_NAMESPACE))
+    h = h * 31 + MATCH_RULE_HASH_PTR (rule->path);
+
+  if (rule->flags & BUS_MATCH_INTERFACE)
+    h = h * 31 + MATCH_RULE_HASH_PTR (rule->interface);
+
+  if (rule->flags & BUS_MATCH_SENDER)
+    h = h * 31 + MATCH_RULE_HASH_PTR (rule->sender);
+
+  if (rule->flags & BUS_MATCH_DESTINATION)
+    h = h * 31 + MATCH_RULE_HASH_PTR (rule->destination);
+
+  if (rule->flags & BUS_MATCH_ARGS)
+    {
+      for (i = 0; i < rule->args_len; i++)
+        {
+          const unsigned char *p;
+          int length;
+
+          h = h * 31 + rule->arg_lens[i];
+          h = h * 31 + (rule->args[i] != NULL);
+
+          if (rule->args[i] == NULL)
+            continue;
+
+          length = rule->arg_lens[i] & ~BUS_MATCH_ARG_FLAGS;
+          for (p = (const unsigned char *) rule->args[i];
+               p < (const unsigned char *) rule->args[i] + length;
+               p++)
+            h = h * 31 + *p;
+        }
+    }
+
+  rule->hash = h;
+  rule->hashed = TRUE;
+  return h;
+}
+
 #define ISWHITE(c) (((c) == ' ') || ((c) == '\t') || ((c) == '\n') || ((c) == '\r'))
 
 static dbus_bool_t
@@ -736,22 +985,16 @@ tokenize_rule (const DBusString *rule_text,
   int pos;
   DBusString key;
   DBusString value;
+  unsigned char key_storage[64];
+  unsigned char value_storage[256];
   dbus_bool_t retval;
 
   retval = FALSE;
   
-  if (!_dbus_string_init (&key))
-    {
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-
-  if (!_dbus_string_init (&value))
-    {
-      _dbus_string_free (&key);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
+  /* Each token is stolen into a copy of its own, so parse them on the
+   * stack rather than growing and throwing away heap strings */
+  _dbus_string_init_borrowed (&key, key_storage, sizeof (key_storage));
+  _dbus_string_init_borrowed (&value, value_storage, sizeof (value_storage));
 
   i = 0;
   pos = 0;
@@ -914,10 +1157,10 @@ bus_match_rule_parse_arg_match (BusMatchRule     *rule,
  * path='/bar/foo',destination=':452345.34'
  *
  */
-BusMatchRule*
-bus_match_rule_parse (DBusConnection   *matches_go_to,
-                      const DBusString *rule_text,
-                      DBusError        *error)
+static BusMatchRule*
+bus_match_rule_parse_untagged (DBusConnection   *matches_go_to,
+                               const DBusString *rule_text,
+                               DBusError        *error)
 {
   BusMatchRule *rule;
   RuleToken tokens[MAX_RULE_TOKENS+1]; /* NULL termination + 1 */
@@ -1137,6 +1380,10 @@ bus_match_rule_parse (DBusConnection   *matches_go_to,
       ++i;
     }
   
+  rule = match_rule_pack (rule);
+
+  /* so that RemoveMatch doesn't have to */
+  match_rule_get_hash (rule);
 
   goto out;
   
@@ -1162,14 +1409,99 @@ bus_match_rule_parse (DBusConnection   *matches_go_to,
   return rule;
 }
 
+BusMatchRule*
+bus_match_rule_parse (DBusConnection   *matches_go_to,
+                      const DBusString *rule_text,
+                      DBusError        *error)
+{
+  BusMatchRule *rule;
+  DBusMemoryTag old_tag;
+
+  old_tag = _dbus_memory_push_tag (DBUS_MEMORY_TAG_MATCH_RULE);
+  rule = bus_match_rule_parse_untagged (matches_go_to, rule_text, error);
+  _dbus_memory_pop_tag (old_tag);
+
+  return rule;
+}
+
+/* A node in a tree of object path components. The root represents "/",
+ * and each child represents its parent's path plus one more component,
+ * so the rules that can match a path are all on the way down to it.
+ */
+typedef struct RulePathNode RulePathNode;
+struct RulePathNode
+{
+  /* Maps path components to non-NULL (RulePathNode *)s, or NULL if this
+   * node has no children
+   */
+  DBusHashTable *children;
+
+  /* Rules with BUS_MATCH_PATH for exactly this node's path */
+  DBusList *path_rules;
+
+  /* Rules with BUS_MATCH_PATH_NAMESPACE for this node's path */
+  DBusList *namespace_rules;
+};
+
+/* Rules that share a message type and interface. Each rule is stored in
+ * exactly one of these lists: rules that constrain the path go in the
+ * path tree, and the rest are placed by rule_bucket_choose_index(),
+ * according to the most selective of their remaining fields that can be
+ * looked up directly from a message.
+ *
+ * Many connections add the same rules, so rules that differ only in
+ * their owner are stored once: the first of them is in the lists, and
+ * stands for all of them with its subscribers list. A message is matched
+ * against it once, then delivered to each subscriber's owner.
+ */
+typedef struct RuleBucket RuleBucket;
+struct RuleBucket
+{
+  /* Rules that have BUS_MATCH_PATH or BUS_MATCH_PATH_NAMESPACE (other
+   * than path_namespace='/', which constrains nothing). NULL if there are
+   * no such rules.
+   */
+  RulePathNode *path_tree;
+
+  /* Maps strings to non-NULL (DBusList **)s of rules that match arg0
+   * exactly, but aren't in the path tree. NULL if there are no such rules.
+   */
+  DBusHashTable *rules_by_arg0;
+
+  /* Maps bus name namespaces to non-NULL (DBusList **)s of rules with that
+   * arg0namespace, but none of the above. A message's arg0 is looked up
+   * once for each of its dot-separated prefixes.
+   * NULL if there are no such rules.
+   */
+  DBusHashTable *rules_by_arg0_namespace;
+
+  /* Maps unique names (and org.freedesktop.DBus) to non-NULL (DBusList **)s
+   * of rules that have such a BUS_MATCH_SENDER, but none of the above.
+   * NULL if there are no such rules.
+   */
+  DBusHashTable *rules_by_sender;
+
+  /* Maps member names to non-NULL (DBusList **)s of rules that have
+   * BUS_MATCH_MEMBER but none of the above. NULL if there are no such rules.
+   */
+  DBusHashTable *rules_by_member;
+
+  /* List of BusMatchRules that can't go in any of the above */
+  DBusList *rules_unindexed;
+
+  /* How many of all the above have BUS_MATCH_CLIENT_IS_EAVESDROPPING,
+   * the only rules that can match a message with a destination */
+  int n_eavesdropping_rules;
+};
+
 typedef struct RulePool RulePool;
 struct RulePool
 {
-  /* Maps non-NULL interface names to non-NULL (DBusList **)s */
+  /* Maps non-NULL interface names to non-NULL (RuleBucket *)s */
   DBusHashTable *rules_by_iface;
 
-  /* List of BusMatchRules which don't specify an interface */
-  DBusList *rules_without_iface;
+  /* Rules which don't specify an interface */
+  RuleBucket rules_without_iface;
 };
 
 struct BusMatchmaker
@@ -1181,70 +1513,141 @@ struct BusMatchmaker
    * type.
    */
   RulePool rules_by_type[DBUS_NUM_MESSAGE_TYPES];
+
+  /* Maps unique names to non-NULL (DBusList **)s of the rules that have
+   * them as their sender or destination, wherever those rules are stored,
+   * so that they can be found when the name's owner disconnects. The
+   * lists don't hold references.
+   */
+  DBusHashTable *rules_by_unique_name;
+
+  /* Maps match_rule_index_key()s to non-NULL (DBusList **)s of the
+   * rules with that key, so that RemoveMatch can find an equal rule
+   * without searching. Unequal rules may share a key. The lists don't
+   * hold references either.
+   */
+  DBusHashTable *rules_by_hash;
+
+  /* Maps match_rule_get_hash()es to non-NULL (DBusList **)s of the rules
+   * that are in the buckets' lists, so that an equal rule from another
+   * connection can join its subscribers; likewise without references.
+   */
+  DBusHashTable *shared_rules;
+
+  /* Number of rules in the buckets' lists, each standing for one or
+   * more equal rules */
+  int n_distinct_rules;
+
+  /* Sum of the buckets' n_eavesdropping_rules */
+  int n_eavesdropping_rules;
+
+  /* How many distinct rules that can match signals set each bit of
+   * the SignalInterest bitmap, and how many restrict neither interface
+   * nor member, so could match any signal. interest_version changes
+   * whenever the bitmap or whether there are wildcards does.
+   */
+  unsigned int interest_counts[DBUS_SIGNAL_INTEREST_BYTES * 8];
+  int n_interest_wildcards;
+  dbus_uint32_t interest_version;
 };
 
+/* A sender can only be looked up directly if it's a name that can't
+ * change owner: a unique name, or the bus driver itself.
+ */
+static dbus_bool_t
+sender_is_indexable (const char *sender)
+{
+  return (*sender == ':' || strcmp (sender, DBUS_SERVICE_DBUS) == 0);
+}
+
+static dbus_bool_t
+rule_is_in_path_tree (BusMatchRule *rule)
+{
+  if (rule->flags & BUS_MATCH_PATH)
+    return TRUE;
+
+  return ((rule->flags & BUS_MATCH_PATH_NAMESPACE) &&
+          strcmp (rule->path, "/") != 0);
+}
+
+/* Only valid for rules that are not in the path tree */
+static DBusHashTable **
+rule_bucket_choose_index (RuleBucket    *bucket,
+                          BusMatchRule  *rule,
+                          const char   **key)
+{
+  _dbus_assert (!rule_is_in_path_tree (rule));
+
+  if ((rule->flags & BUS_MATCH_ARGS) && rule->args[0] != NULL)
+    {
+      if ((rule->arg_lens[0] & BUS_MATCH_ARG_FLAGS) == 0)
+        {
+          *key = rule->args[0];
+          return &bucket->rules_by_arg0;
+        }
+
+      if (rule->arg_lens[0] & BUS_MATCH_ARG_NAMESPACE)
+        {
+          *key = rule->args[0];
+          return &bucket->rules_by_arg0_namespace;
+        }
+    }
+
+  if ((rule->flags & BUS_MATCH_SENDER) && sender_is_indexable (rule->sender))
+    {
+      *key = rule->sender;
+      return &bucket->rules_by_sender;
+    }
+
+  if (rule->flags & BUS_MATCH_MEMBER)
+    {
+      *key = rule->member;
+      return &bucket->rules_by_member;
+    }
+
+  *key = NULL;
+  return NULL;
+}
+
 #ifdef DBUS_ENABLE_STATS
+/*
+ * Appends the rules of conn_filter to arr_iter as strings. The
+ * connection keeps a list of its own rules, so this doesn't depend
+ * on how many rules other connections have.
+ */
 dbus_bool_t
 bus_match_rule_dump (BusMatchmaker *matchmaker,
                      DBusConnection *conn_filter,
                      DBusMessageIter *arr_iter)
 {
-  int i;
+  DBusList **owned;
+  DBusList *link;
 
-  for (i = 0 ; i < DBUS_NUM_MESSAGE_TYPES ; i++)
+  owned = bus_connection_get_match_rules (conn_filter);
+
+  for (link = _dbus_list_get_first_link (owned);
+       link != NULL;
+       link = _dbus_list_get_next_link (owned, link))
     {
-      DBusHashIter iter;
-      DBusList **list;
-      DBusList *link;
+      BusMatchRule *rule = link->data;
+      char *s;
 
-      _dbus_hash_iter_init (matchmaker->rules_by_type[i].rules_by_iface, &iter);
-      while (_dbus_hash_iter_next (&iter))
-        {
-          list =  _dbus_hash_iter_get_value (&iter);
-          for (link = _dbus_list_get_first_link (list);
-               link != NULL;
-               link = _dbus_list_get_next_link (list, link))
-            {
-              BusMatchRule *rule = link->data;
+      /* a monitor briefly has rules in two matchmakers */
+      if (rule->matchmaker != matchmaker)
+        continue;
 
-              if (rule->matches_go_to == conn_filter)
-                {
-                  char *s = match_rule_to_string (rule);
+      s = match_rule_to_string (rule);
 
-                  if (s == NULL)
-                    return FALSE;
+      if (s == NULL)
+        return FALSE;
 
-                  if (!dbus_message_iter_append_basic (arr_iter, DBUS_TYPE_STRING, &s))
-                    {
-                      dbus_free (s);
-                      return FALSE;
-                    }
-                  dbus_free (s);
-                }
-            }
-        }
-      list = &matchmaker->rules_by_type[i].rules_without_iface;
-      for (link = _dbus_list_get_first_link (list);
-           link != NULL;
-           link = _dbus_list_get_next_link (list, link))
+      if (!dbus_message_iter_append_basic (arr_iter, DBUS_TYPE_STRING, &s))
         {
-          BusMatchRule *rule = link->data;
-
-          if (rule->matches_go_to == conn_filter)
-            {
-              char *s = match_rule_to_string (rule);
-
-              if (s == NULL)
-                return FALSE;
-
-              if (!dbus_message_iter_append_basic (arr_iter, DBUS_TYPE_STRING, &s))
-                {
-                  dbus_free (s);
-                  return FALSE;
-                }
-              dbus_free (s);
-            }
+          dbus_free (s);
+          return FALSE;
         }
+
+      dbus_free (s);
     }
 
   return TRUE;
@@ -1259,6 +1662,19 @@ rule_list_free (DBusList **rules)
       BusMatchRule *rule;
 
       rule = (*rules)->data;
+
+      /* the matchmaker holds a reference to each of the equal rules
+       * this one stands for, not just to itself */
+      while (rule->subscribers != NULL)
+        {
+          BusMatchRule *subscriber = rule->subscribers->data;
+
+          _dbus_list_remove_link (&rule->subscribers, rule->subscribers);
+
+          if (subscriber != rule)
+            bus_match_rule_unref (subscriber);
+        }
+
       bus_match_rule_unref (rule);
       _dbus_list_remove_link (rules, *rules);
     }
@@ -1277,32 +1693,564 @@ rule_list_ptr_free (DBusList **list)
     }
 }
 
-BusMatchmaker*
-bus_matchmaker_new (void)
+static void
+rule_index_free (DBusHashTable **table_p)
 {
-  BusMatchmaker *matchmaker;
-  int i;
-
-  matchmaker = dbus_new0 (BusMatchmaker, 1);
-  if (matchmaker == NULL)
-    return NULL;
-
-  matchmaker->refcount = 1;
-
-  for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
+  if (*table_p != NULL)
     {
-      RulePool *p = matchmaker->rules_by_type + i;
+      _dbus_hash_table_unref (*table_p);
+      *table_p = NULL;
+    }
+}
 
-      p->rules_by_iface = _dbus_hash_table_new (DBUS_HASH_STRING,
-          dbus_free, (DBusFreeFunction) rule_list_ptr_free);
+static void
+rule_path_node_free (RulePathNode *node)
+{
+  /* As for rule_list_ptr_free(), cope with NULL */
+  if (node != NULL)
+    {
+      if (node->children != NULL)
+        _dbus_hash_table_unref (node->children);
 
-      if (p->rules_by_iface == NULL)
-        goto nomem;
+      rule_list_free (&node->path_rules);
+      rule_list_free (&node->namespace_rules);
+      dbus_free (node);
     }
+}
 
-  return matchmaker;
+static dbus_bool_t
+rule_path_node_is_empty (RulePathNode *node)
+{
+  return (node->children == NULL &&
+          node->path_rules == NULL &&
+          node->namespace_rules == NULL);
+}
+
+static void
+rule_bucket_clear (RuleBucket *bucket)
+{
+  rule_path_node_free (bucket->path_tree);
+  bucket->path_tree = NULL;
+  rule_index_free (&bucket->rules_by_arg0);
+  rule_index_free (&bucket->rules_by_arg0_namespace);
+  rule_index_free (&bucket->rules_by_sender);
+  rule_index_free (&bucket->rules_by_member);
+  rule_list_free (&bucket->rules_unindexed);
+}
+
+static void
+rule_bucket_free (RuleBucket *bucket)
+{
+  /* As for rule_list_ptr_free(), cope with NULL */
+  if (bucket != NULL)
+    {
+      rule_bucket_clear (bucket);
+      dbus_free (bucket);
+    }
+}
+
+static dbus_bool_t
+rule_bucket_is_empty (RuleBucket *bucket)
+{
+  return (bucket->path_tree == NULL &&
+          bucket->rules_by_arg0 == NULL &&
+          bucket->rules_by_arg0_namespace == NULL &&
+          bucket->rules_by_sender == NULL &&
+          bucket->rules_by_member == NULL &&
+          bucket->rules_unindexed == NULL);
+}
+
+static DBusList **
+rule_index_get_list (DBusHashTable **table_p,
+                     const char     *key,
+                     dbus_bool_t     create)
+{
+  DBusList **list;
+  const char *key_atom;
+
+  if (*table_p != NULL)
+    {
+      list = _dbus_hash_table_lookup_string (*table_p, key);
+
+      if (list != NULL || !create)
+        return list;
+    }
+  else if (!create)
+    {
+      return NULL;
+    }
+  else
+    {
+      *table_p = _dbus_hash_table_new (DBUS_HASH_STRING,
+          bus_atom_free_func, (DBusFreeFunction) rule_list_ptr_free);
+
+      if (*table_p == NULL)
+        return NULL;
+    }
+
+  list = dbus_new0 (DBusList *, 1);
+  if (list == NULL)
+    goto failed;
+
+  key_atom = bus_atom_ref (key);
+  if (key_atom == NULL)
+    {
+      dbus_free (list);
+      goto failed;
+    }
+
+  /* the table only frees keys, it doesn't modify them */
+  if (!_dbus_hash_table_insert_string (*table_p, (char *) key_atom, list))
+    {
+      dbus_free (list);
+      bus_atom_unref (key_atom);
+      goto failed;
+    }
+
+  return list;
+
+ failed:
+  if (_dbus_hash_table_get_n_entries (*table_p) == 0)
+    rule_index_free (table_p);
+
+  return NULL;
+}
+
+/* Returns the node for @components, or NULL if it does not exist and
+ * either @create is FALSE or we ran out of memory. Running out of memory
+ * can leave empty nodes behind, which rule_path_tree_gc() will discard.
+ */
+static RulePathNode *
+rule_path_tree_lookup (RulePathNode **root_p,
+                       char         **components,
+                       dbus_bool_t    create)
+{
+  RulePathNode *node;
+  int i;
+
+  if (*root_p == NULL)
+    {
+      if (!create)
+        return NULL;
+
+      *root_p = dbus_new0 (RulePathNode, 1);
+      if (*root_p == NULL)
+        return NULL;
+    }
+
+  node = *root_p;
+
+  for (i = 0; components[i] != NULL; i++)
+    {
+      RulePathNode *child = NULL;
+      const char *component_atom;
+
+      if (node->children != NULL)
+        child = _dbus_hash_table_lookup_string (node->children,
+                                                components[i]);
+
+      if (child == NULL)
+        {
+          if (!create)
+            return NULL;
+
+          if (node->children == NULL)
+            {
+              node->children = _dbus_hash_table_new (DBUS_HASH_STRING,
+                  bus_atom_free_func, (DBusFreeFunction) rule_path_node_free);
+
+              if (node->children == NULL)
+                return NULL;
+            }
+
+          child = dbus_new0 (RulePathNode, 1);
+          if (child == NULL)
+            return NULL;
+
+          component_atom = bus_atom_ref (components[i]);
+          if (component_atom == NULL)
+            {
+              dbus_free (child);
+              return NULL;
+            }
+
+          if (!_dbus_hash_table_insert_string (node->children,
+                                               (char *) component_atom,
+                                               child))
+            {
+              dbus_free (child);
+              bus_atom_unref (component_atom);
+              return NULL;
+            }
+        }
+
+      node = child;
+    }
+
+  return node;
+}
+
+/* Discard empty nodes on the way down to @components. Returns TRUE if
+ * @node is now empty itself.
+ */
+static dbus_bool_t
+rule_path_node_gc (RulePathNode  *node,
+                   char         **components)
+{
+  if (node->children != NULL && components[0] != NULL)
+    {
+      RulePathNode *child;
+
+      child = _dbus_hash_table_lookup_string (node->children, components[0]);
+
+      if (child != NULL && rule_path_node_gc (child, components + 1))
+        _dbus_hash_table_remove_string (node->children, components[0]);
+    }
+
+  if (node->children != NULL &&
+      _dbus_hash_table_get_n_entries (node->children) == 0)
+    {
+      _dbus_hash_table_unref (node->children);
+      node->children = NULL;
+    }
+
+  return rule_path_node_is_empty (node);
+}
+
+static void
+rule_path_tree_gc (RulePathNode **root_p,
+                   char         **components)
+{
+  if (*root_p != NULL && rule_path_node_gc (*root_p, components))
+    {
+      rule_path_node_free (*root_p);
+      *root_p = NULL;
+    }
+}
+
+/* Returns the list that @rule belongs in, or NULL if it does not exist
+ * and either @create is FALSE or we ran out of memory.
+ */
+static DBusList **
+rule_bucket_get_list (RuleBucket   *bucket,
+                      BusMatchRule *rule,
+                      dbus_bool_t   create)
+{
+  DBusHashTable **table_p;
+  const char *key;
+
+  if (rule_is_in_path_tree (rule))
+    {
+      RulePathNode *node;
+
+      node = rule_path_tree_lookup (&bucket->path_tree,
+                                    rule->path_components, create);
+
+      if (node == NULL)
+        return NULL;
+
+      if (rule->flags & BUS_MATCH_PATH)
+        return &node->path_rules;
+      else
+        return &node->namespace_rules;
+    }
+
+  table_p = rule_bucket_choose_index (bucket, rule, &key);
+
+  if (table_p == NULL)
+    return &bucket->rules_unindexed;
+
+  return rule_index_get_list (table_p, key, create);
+}
+
+/* Discard the list that @rule belongs in, if it is empty */
+static void
+rule_bucket_gc_list (RuleBucket   *bucket,
+                     BusMatchRule *rule,
+                     DBusList    **rules)
+{
+  DBusHashTable **table_p;
+  const char *key;
+
+  if (*rules != NULL)
+    return;
+
+  if (rule_is_in_path_tree (rule))
+    {
+      rule_path_tree_gc (&bucket->path_tree, rule->path_components);
+      return;
+    }
+
+  table_p = rule_bucket_choose_index (bucket, rule, &key);
+
+  if (table_p == NULL)
+    return;
+
+  _dbus_assert (*table_p != NULL);
+  _dbus_assert (_dbus_hash_table_lookup_string (*table_p, key) == rules);
+
+  _dbus_hash_table_remove_string (*table_p, key);
+
+  if (_dbus_hash_table_get_n_entries (*table_p) == 0)
+    rule_index_free (table_p);
+}
+
+static void
+rule_name_list_ptr_free (DBusList **list)
+{
+  /* As for rule_list_ptr_free(), cope with NULL; but these lists don't
+   * own their rules */
+  if (list != NULL)
+    {
+      _dbus_list_clear (list);
+      dbus_free (list);
+    }
+}
+
+/* Returns the list of rules that mention unique name @name, or NULL if
+ * it does not exist and either @create is FALSE or we ran out of memory.
+ */
+static DBusList **
+bus_matchmaker_get_name_list (BusMatchmaker *matchmaker,
+                              const char    *name,
+                              dbus_bool_t    create)
+{
+  DBusList **list;
+  const char *name_atom;
+
+  list = _dbus_hash_table_lookup_string (matchmaker->rules_by_unique_name,
+                                         name);
+
+  if (list != NULL || !create)
+    return list;
+
+  list = dbus_new0 (DBusList *, 1);
+  if (list == NULL)
+    return NULL;
+
+  name_atom = bus_atom_ref (name);
+  if (name_atom == NULL)
+    {
+      dbus_free (list);
+      return NULL;
+    }
+
+  if (!_dbus_hash_table_insert_string (matchmaker->rules_by_unique_name,
+                                       (char *) name_atom, list))
+    {
+      dbus_free (list);
+      bus_atom_unref (name_atom);
+      return NULL;
+    }
+
+  return list;
+}
+
+static void
+bus_matchmaker_forget_name (BusMatchmaker  *matchmaker,
+                            const char     *name,
+                            DBusList      **link_p)
+{
+  DBusList **list;
+
+  if (*link_p == NULL)
+    return;
+
+  list = bus_matchmaker_get_name_list (matchmaker, name, FALSE);
+  _dbus_assert (list != NULL);
+
+  _dbus_list_remove_link (list, *link_p);
+  *link_p = NULL;
+
+  if (*list == NULL)
+    _dbus_hash_table_remove_string (matchmaker->rules_by_unique_name, name);
+}
+
+static dbus_bool_t
+bus_matchmaker_remember_name (BusMatchmaker  *matchmaker,
+                              BusMatchRule   *rule,
+                              const char     *name,
+                              DBusList      **link_p)
+{
+  DBusList **list;
+
+  list = bus_matchmaker_get_name_list (matchmaker, name, TRUE);
+  if (list == NULL)
+    return FALSE;
+
+  if (!_dbus_list_append (list, rule))
+    {
+      if (*list == NULL)
+        _dbus_hash_table_remove_string (matchmaker->rules_by_unique_name,
+                                        name);
+      return FALSE;
+    }
+
+  *link_p = _dbus_list_get_last_link (list);
+  return TRUE;
+}
+
+static void
+bus_matchmaker_forget_names (BusMatchmaker *matchmaker,
+                             BusMatchRule  *rule)
+{
+  bus_matchmaker_forget_name (matchmaker, rule->sender, &rule->sender_link);
+  bus_matchmaker_forget_name (matchmaker, rule->destination,
+                              &rule->destination_link);
+}
+
+/* A rule can only be equal to rules of the same connection */
+static uintptr_t
+match_rule_index_key (BusMatchRule *rule)
+{
+  return (((uintptr_t) rule->matches_go_to) >> 4) * 31 +
+    match_rule_get_hash (rule);
+}
+
+/* Appends @rule to the list that @table has for @key, and sets
+ * @link_p to its link */
+static dbus_bool_t
+rule_hash_index_add (DBusHashTable  *table,
+                     uintptr_t       key,
+                     BusMatchRule   *rule,
+                     DBusList      **link_p)
+{
+  DBusList **list;
+
+  list = _dbus_hash_table_lookup_uintptr (table, key);
+
+  if (list == NULL)
+    {
+      list = dbus_new0 (DBusList *, 1);
+      if (list == NULL)
+        return FALSE;
+
+      if (!_dbus_hash_table_insert_uintptr (table, key, list))
+        {
+          dbus_free (list);
+          return FALSE;
+        }
+    }
+
+  if (!_dbus_list_append (list, rule))
+    {
+      if (*list == NULL)
+        _dbus_hash_table_remove_uintptr (table, key);
+      return FALSE;
+    }
+
+  *link_p = _dbus_list_get_last_link (list);
+  return TRUE;
+}
+
+static void
+rule_hash_index_remove (DBusHashTable  *table,
+                        uintptr_t       key,
+                        DBusList      **link_p)
+{
+  DBusList **list;
+
+  list = _dbus_hash_table_lookup_uintptr (table, key);
+  _dbus_assert (list != NULL);
+
+  _dbus_list_remove_link (list, *link_p);
+  *link_p = NULL;
+
+  if (*list == NULL)
+    _dbus_hash_table_remove_uintptr (table, key);
+}
+
+static dbus_bool_t
+bus_matchmaker_remember_hash (BusMatchmaker *matchmaker,
+                              BusMatchRule  *rule)
+{
+  return rule_hash_index_add (matchmaker->rules_by_hash,
+                              match_rule_index_key (rule), rule,
+                              &rule->hash_link);
+}
+
+static void
+bus_matchmaker_forget_hash (BusMatchmaker *matchmaker,
+                            BusMatchRule  *rule)
+{
+  rule_hash_index_remove (matchmaker->rules_by_hash,
+                          match_rule_index_key (rule), &rule->hash_link);
+}
+
+/* Index @rule under any unique names it is sent from or to */
+static dbus_bool_t
+bus_matchmaker_remember_names (BusMatchmaker *matchmaker,
+                               BusMatchRule  *rule)
+{
+  if ((rule->flags & BUS_MATCH_SENDER) && *rule->sender == ':' &&
+      !bus_matchmaker_remember_name (matchmaker, rule, rule->sender,
+                                     &rule->sender_link))
+    return FALSE;
+
+  if ((rule->flags & BUS_MATCH_DESTINATION) && *rule->destination == ':' &&
+      !bus_matchmaker_remember_name (matchmaker, rule, rule->destination,
+                                     &rule->destination_link))
+    {
+      bus_matchmaker_forget_names (matchmaker, rule);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+BusMatchmaker*
+bus_matchmaker_new (void)
+{
+  BusMatchmaker *matchmaker;
+  int i;
+
+  matchmaker = dbus_new0 (BusMatchmaker, 1);
+  if (matchmaker == NULL)
+    return NULL;
+
+  matchmaker->refcount = 1;
+
+  matchmaker->rules_by_unique_name = _dbus_hash_table_new (DBUS_HASH_STRING,
+      bus_atom_free_func, (DBusFreeFunction) rule_name_list_ptr_free);
+
+  if (matchmaker->rules_by_unique_name == NULL)
+    goto nomem;
+
+  matchmaker->rules_by_hash = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+      NULL, (DBusFreeFunction) rule_name_list_ptr_free);
+
+  if (matchmaker->rules_by_hash == NULL)
+    goto nomem;
+
+  matchmaker->shared_rules = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+      NULL, (DBusFreeFunction) rule_name_list_ptr_free);
+
+  if (matchmaker->shared_rules == NULL)
+    goto nomem;
+
+  for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
+    {
+      RulePool *p = matchmaker->rules_by_type + i;
+
+      p->rules_by_iface = _dbus_hash_table_new (DBUS_HASH_STRING,
+          bus_atom_free_func, (DBusFreeFunction) rule_bucket_free);
+
+      if (p->rules_by_iface == NULL)
+        goto nomem;
+    }
+
+  return matchmaker;
 
  nomem:
+  if (matchmaker->rules_by_unique_name != NULL)
+    _dbus_hash_table_unref (matchmaker->rules_by_unique_name);
+
+  if (matchmaker->rules_by_hash != NULL)
+    _dbus_hash_table_unref (matchmaker->rules_by_hash);
+
+  if (matchmaker->shared_rules != NULL)
+    _dbus_hash_table_unref (matchmaker->shared_rules);
+
   for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
     {
       RulePool *p = matchmaker->rules_by_type + i;
@@ -1317,7 +2265,7 @@ bus_matchmaker_new (void)
   return NULL;
 }
 
-static DBusList **
+static RuleBucket *
 bus_matchmaker_get_rules (BusMatchmaker *matchmaker,
                           int            message_type,
                           const char    *interface,
@@ -1340,38 +2288,39 @@ bus_matchmaker_get_rules (BusMatchmaker *matchmaker,
     }
   else
     {
-      DBusList **list;
+      RuleBucket *bucket;
 
-      list = _dbus_hash_table_lookup_string (p->rules_by_iface, interface);
+      bucket = _dbus_hash_table_lookup_string (p->rules_by_iface, interface);
 
-      if (list == NULL && create)
+      if (bucket == NULL && create)
         {
-          char *dupped_interface;
+          const char *interface_atom;
 
-          list = dbus_new0 (DBusList *, 1);
-          if (list == NULL)
+          bucket = dbus_new0 (RuleBucket, 1);
+          if (bucket == NULL)
             return NULL;
 
-          dupped_interface = _dbus_strdup (interface);
-          if (dupped_interface == NULL)
+          interface_atom = bus_atom_ref (interface);
+          if (interface_atom == NULL)
             {
-              dbus_free (list);
+              dbus_free (bucket);
               return NULL;
             }
 
-          _dbus_verbose ("Adding list for type %d, iface %s\n", message_type,
+          _dbus_verbose ("Adding bucket for type %d, iface %s\n", message_type,
                          interface);
 
           if (!_dbus_hash_table_insert_string (p->rules_by_iface,
-                                               dupped_interface, list))
+                                               (char *) interface_atom,
+                                               bucket))
             {
-              dbus_free (list);
-              dbus_free (dupped_interface);
+              dbus_free (bucket);
+              bus_atom_unref (interface_atom);
               return NULL;
             }
         }
 
-      return list;
+      return bucket;
     }
 }
 
@@ -1379,14 +2328,14 @@ static void
 bus_matchmaker_gc_rules (BusMatchmaker *matchmaker,
                          int            message_type,
                          const char    *interface,
-                         DBusList     **rules)
+                         RuleBucket    *bucket)
 {
   RulePool *p;
 
   if (interface == NULL)
     return;
 
-  if (*rules != NULL)
+  if (!rule_bucket_is_empty (bucket))
     return;
 
   _dbus_verbose ("GCing HT entry for message_type %u, interface %s\n",
@@ -1395,7 +2344,7 @@ bus_matchmaker_gc_rules (BusMatchmaker *matchmaker,
   p = matchmaker->rules_by_type + message_type;
 
   _dbus_assert (_dbus_hash_table_lookup_string (p->rules_by_iface, interface)
-      == rules);
+      == bucket);
 
   _dbus_hash_table_remove_string (p->rules_by_iface, interface);
 }
@@ -1425,90 +2374,47 @@ bus_matchmaker_unref (BusMatchmaker *matchmaker)
           RulePool *p = matchmaker->rules_by_type + i;
 
           _dbus_hash_table_unref (p->rules_by_iface);
-          rule_list_free (&p->rules_without_iface);
+          rule_bucket_clear (&p->rules_without_iface);
         }
 
+      _dbus_hash_table_unref (matchmaker->rules_by_unique_name);
+      _dbus_hash_table_unref (matchmaker->rules_by_hash);
+      _dbus_hash_table_unref (matchmaker->shared_rules);
       dbus_free (matchmaker);
     }
 }
 
-/* The rule can't be modified after it's added. */
-dbus_bool_t
-bus_matchmaker_add_rule (BusMatchmaker   *matchmaker,
-                         BusMatchRule    *rule)
-{
-  DBusList **rules;
-
-  _dbus_assert (bus_connection_is_active (rule->matches_go_to));
-
-  _dbus_verbose ("Adding rule with message_type %d, interface %s\n",
-                 rule->message_type,
-                 rule->interface != NULL ? rule->interface : "<null>");
-
-  rules = bus_matchmaker_get_rules (matchmaker, rule->message_type,
-                                    rule->interface, TRUE);
-
-  if (rules == NULL)
-    return FALSE;
-
-  if (!_dbus_list_append (rules, rule))
-    return FALSE;
-
-  if (!bus_connection_add_match_rule (rule->matches_go_to, rule))
-    {
-      _dbus_list_remove_last (rules, rule);
-      bus_matchmaker_gc_rules (matchmaker, rule->message_type,
-                               rule->interface, rules);
-      return FALSE;
-    }
-
-  bus_match_rule_ref (rule);
-
-#ifdef DBUS_ENABLE_VERBOSE_MODE
-  {
-    char *s = match_rule_to_string (rule);
-
-    _dbus_verbose ("Added match rule %s to connection %p\n",
-                   s ? s : "nomem", rule->matches_go_to);
-    dbus_free (s);
-  }
-#endif
-  
-  return TRUE;
-}
-
+/* Whether the rules match the same messages, whoever they belong to */
 static dbus_bool_t
-match_rule_equal (BusMatchRule *a,
-                  BusMatchRule *b)
+match_rule_equal_content (BusMatchRule *a,
+                          BusMatchRule *b)
 {
   if (a->flags != b->flags)
     return FALSE;
 
-  if (a->matches_go_to != b->matches_go_to)
-    return FALSE;
-
   if ((a->flags & BUS_MATCH_MESSAGE_TYPE) &&
       a->message_type != b->message_type)
     return FALSE;
 
+  /* the strings are atoms */
   if ((a->flags & BUS_MATCH_MEMBER) &&
-      strcmp (a->member, b->member) != 0)
+      a->member != b->member)
     return FALSE;
 
-  if ((a->flags & BUS_MATCH_PATH) &&
-      strcmp (a->path, b->path) != 0)
+  if ((a->flags & (BUS_MATCH_PATH | BUS_MATCH_PATH_NAMESPACE)) &&
+      a->path != b->path)
     return FALSE;
 
   if ((a->flags & BUS_MATCH_INTERFACE) &&
-      strcmp (a->interface, b->interface) != 0)
+      a->interface != b->interface)
     return FALSE;
 
   if ((a->flags & BUS_MATCH_SENDER) &&
-      strcmp (a->sender, b->sender) != 0)
+      a->sender != b->sender)
     return FALSE;
 
   if ((a->flags & BUS_MATCH_DESTINATION) &&
-      strcmp (a->destination, b->destination) != 0)
+      a->destination != b->destination)
     return FALSE;
 
   /* we already compared the value of flags, and
@@ -1548,63 +2454,351 @@ match_rule_equal (BusMatchRule *a,
   return TRUE;
 }
 
+static dbus_bool_t
+match_rule_equal (BusMatchRule *a,
+                  BusMatchRule *b)
+{
+  return (a->matches_go_to == b->matches_go_to &&
+          match_rule_equal_content (a, b));
+}
+
+/* Returns the rule in the lists that @rule would be equal to, if it
+ * had the same owner, or NULL if there is none yet */
+static BusMatchRule *
+bus_matchmaker_find_shared (BusMatchmaker *matchmaker,
+                            BusMatchRule  *rule)
+{
+  DBusList **list;
+  DBusList *link;
+
+  list = _dbus_hash_table_lookup_uintptr (matchmaker->shared_rules,
+                                          match_rule_get_hash (rule));
+
+  if (list == NULL)
+    return NULL;
+
+  for (link = _dbus_list_get_first_link (list);
+       link != NULL;
+       link = _dbus_list_get_next_link (list, link))
+    {
+      if (match_rule_equal_content (link->data, rule))
+        return link->data;
+    }
+
+  return NULL;
+}
+
+/* Counts @rule, which is in the lists, towards the SignalInterest
+ * summary if @delta is 1, or stops counting it if @delta is -1.
+ */
 static void
-bus_matchmaker_remove_rule_link (DBusList       **rules,
-                                 DBusList        *link)
+bus_matchmaker_count_interest (BusMatchmaker *matchmaker,
+                               BusMatchRule  *rule,
+                               int            delta)
 {
-  BusMatchRule *rule = link->data;
-  
-  bus_connection_remove_match_rule (rule->matches_go_to, rule);
-  _dbus_list_remove_link (rules, link);
+  const char *interface;
+  const char *member;
+  unsigned int bits[2];
+  int i;
+
+  if ((rule->flags & BUS_MATCH_MESSAGE_TYPE) &&
+      rule->message_type != DBUS_MESSAGE_TYPE_SIGNAL &&
+      rule->message_type != DBUS_MESSAGE_TYPE_INVALID)
+    return;
+
+  interface = (rule->flags & BUS_MATCH_INTERFACE) ? rule->interface : NULL;
+  member = (rule->flags & BUS_MATCH_MEMBER) ? rule->member : NULL;
+
+  if (interface == NULL && member == NULL)
+    {
+      matchmaker->n_interest_wildcards += delta;
+
+      if (matchmaker->n_interest_wildcards == (delta > 0 ? 1 : 0))
+        matchmaker->interest_version += 1;
+
+      return;
+    }
+
+  _dbus_signal_interest_get_bits (interface, member, &bits[0], &bits[1]);
+
+  for (i = 0; i < 2; i++)
+    {
+      matchmaker->interest_counts[bits[i]] += delta;
+
+      if (matchmaker->interest_counts[bits[i]] == (delta > 0 ? 1u : 0u))
+        matchmaker->interest_version += 1;
+    }
+}
+
+/* Puts @rule in @bucket, or makes it a subscriber of an equal rule
+ * that is already there. On failure, discards any list that leaves
+ * empty, but not the bucket.
+ */
+static dbus_bool_t
+bus_matchmaker_share_rule (BusMatchmaker *matchmaker,
+                           RuleBucket    *bucket,
+                           BusMatchRule  *rule)
+{
+  BusMatchRule *shared;
+  DBusList **rules;
+
+  _dbus_assert (rule->shared == NULL);
+  _dbus_assert (rule->link == NULL);
+
+  shared = bus_matchmaker_find_shared (matchmaker, rule);
+
+  if (shared != NULL)
+    {
+      if (!_dbus_list_append (&shared->subscribers, rule))
+        return FALSE;
+
+      rule->subscriber_link = _dbus_list_get_last_link (&shared->subscribers);
+      rule->shared = shared;
+      return TRUE;
+    }
+
+  rules = rule_bucket_get_list (bucket, rule, TRUE);
+
+  if (rules == NULL)
+    {
+      if (rule_is_in_path_tree (rule))
+        rule_path_tree_gc (&bucket->path_tree, rule->path_components);
+
+      return FALSE;
+    }
+
+  if (!_dbus_list_append (rules, rule))
+    goto failed;
+
+  rule->link = _dbus_list_get_last_link (rules);
+
+  if (!_dbus_list_append (&rule->subscribers, rule))
+    goto failed_unlink;
+
+  rule->subscriber_link = _dbus_list_get_first_link (&rule->subscribers);
+
+  if (!rule_hash_index_add (matchmaker->shared_rules,
+                            match_rule_get_hash (rule), rule,
+                            &rule->shared_link))
+    goto failed_unsubscribe;
+
+  rule->shared = rule;
+  matchmaker->n_distinct_rules += 1;
+  bus_matchmaker_count_interest (matchmaker, rule, 1);
+  return TRUE;
+
+ failed_unsubscribe:
+  _dbus_list_remove_link (&rule->subscribers, rule->subscriber_link);
+  rule->subscriber_link = NULL;
+ failed_unlink:
+  _dbus_list_remove_link (rules, rule->link);
+  rule->link = NULL;
+ failed:
+  rule_bucket_gc_list (bucket, rule, rules);
+  return FALSE;
+}
+
+/* Undoes bus_matchmaker_share_rule(). If @rule was in the lists on
+ * behalf of others, the oldest of them takes its place; otherwise it is
+ * removed, and so is any list that leaves empty, but not the bucket.
+ */
+static void
+bus_matchmaker_unshare_rule (BusMatchmaker *matchmaker,
+                             RuleBucket    *bucket,
+                             BusMatchRule  *rule)
+{
+  BusMatchRule *shared;
+  DBusList **rules;
+
+  shared = rule->shared;
+  _dbus_assert (shared != NULL);
+
+  _dbus_list_remove_link (&shared->subscribers, rule->subscriber_link);
+  rule->subscriber_link = NULL;
+  rule->shared = NULL;
+
+  if (shared != rule)
+    return;
+
+  if (rule->subscribers != NULL)
+    {
+      BusMatchRule *heir = rule->subscribers->data;
+      DBusList *link;
+
+      heir->subscribers = rule->subscribers;
+      rule->subscribers = NULL;
+
+      for (link = _dbus_list_get_first_link (&heir->subscribers);
+           link != NULL;
+           link = _dbus_list_get_next_link (&heir->subscribers, link))
+        ((BusMatchRule *) link->data)->shared = heir;
+
+      /* it is equal, so it belongs in the same places */
+      heir->link = rule->link;
+      heir->link->data = heir;
+      rule->link = NULL;
+
+      heir->shared_link = rule->shared_link;
+      heir->shared_link->data = heir;
+      rule->shared_link = NULL;
+      return;
+    }
+
+  rules = rule_bucket_get_list (bucket, rule, FALSE);
+  _dbus_assert (rules != NULL);
+
+  _dbus_list_remove_link (rules, rule->link);
+  rule->link = NULL;
+
+  rule_hash_index_remove (matchmaker->shared_rules,
+                          match_rule_get_hash (rule), &rule->shared_link);
+  matchmaker->n_distinct_rules -= 1;
+  bus_matchmaker_count_interest (matchmaker, rule, -1);
+
+  rule_bucket_gc_list (bucket, rule, rules);
+}
+
+static dbus_bool_t
+bus_matchmaker_add_rule_untagged (BusMatchmaker   *matchmaker,
+                                  BusMatchRule    *rule)
+{
+  RuleBucket *bucket;
+
+  _dbus_assert (bus_connection_is_active (rule->matches_go_to));
+
+  _dbus_verbose ("Adding rule with message_type %d, interface %s\n",
+                 rule->message_type,
+                 rule->interface != NULL ? rule->interface : "<null>");
+
+  bucket = bus_matchmaker_get_rules (matchmaker, rule->message_type,
+                                     rule->interface, TRUE);
+
+  if (bucket == NULL)
+    return FALSE;
+
+  if (!bus_matchmaker_share_rule (matchmaker, bucket, rule))
+    goto failed;
+
+  if (!bus_matchmaker_remember_names (matchmaker, rule))
+    goto failed_unshare;
+
+  if (!bus_matchmaker_remember_hash (matchmaker, rule))
+    goto failed_forget_names;
+
+  rule->connection_link = _dbus_list_alloc_link (rule);
+  if (rule->connection_link == NULL)
+    goto failed_forget_hash;
+
+  bus_connection_add_match_rule_link (rule->matches_go_to,
+                                      rule->connection_link);
+  rule->matchmaker = matchmaker;
+
+  if (rule->flags & BUS_MATCH_CLIENT_IS_EAVESDROPPING)
+    {
+      bucket->n_eavesdropping_rules += 1;
+      matchmaker->n_eavesdropping_rules += 1;
+    }
+  bus_match_rule_ref (rule);
 
 #ifdef DBUS_ENABLE_VERBOSE_MODE
-  {
-    char *s = match_rule_to_string (rule);
+  if (_dbus_is_verbose ())
+    {
+      char *s = match_rule_to_string (rule);
 
-    _dbus_verbose ("Removed match rule %s for connection %p\n",
-                   s ? s : "nomem", rule->matches_go_to);
-    dbus_free (s);
-  }
+      _dbus_verbose ("Added match rule %s to connection %p\n",
+                     s ? s : "nomem", rule->matches_go_to);
+      dbus_free (s);
+    }
 #endif
   
-  bus_match_rule_unref (rule);  
+  return TRUE;
+
+ failed_forget_hash:
+  bus_matchmaker_forget_hash (matchmaker, rule);
+ failed_forget_names:
+  bus_matchmaker_forget_names (matchmaker, rule);
+ failed_unshare:
+  bus_matchmaker_unshare_rule (matchmaker, bucket, rule);
+ failed:
+  bus_matchmaker_gc_rules (matchmaker, rule->message_type,
+                           rule->interface, bucket);
+  return FALSE;
+}
+
+/* The rule can't be modified after it's added. */
+dbus_bool_t
+bus_matchmaker_add_rule (BusMatchmaker   *matchmaker,
+                         BusMatchRule    *rule)
+{
+  dbus_bool_t retval;
+  DBusMemoryTag old_tag;
+
+  old_tag = _dbus_memory_push_tag (DBUS_MEMORY_TAG_MATCH_RULE);
+  retval = bus_matchmaker_add_rule_untagged (matchmaker, rule);
+  _dbus_memory_pop_tag (old_tag);
+
+  return retval;
+}
+
+/* Takes @rule out of its connection and the matchmaker's lists,
+ * discards any lists and buckets that leaves empty, and drops the
+ * matchmaker's reference.
+ */
+static void
+bus_matchmaker_drop_rule (BusMatchmaker *matchmaker,
+                          BusMatchRule  *rule)
+{
+  RuleBucket *bucket;
+
+  _dbus_assert (rule->matchmaker == matchmaker);
+  _dbus_assert (rule->shared != NULL);
+
+  bus_connection_remove_match_rule_link (rule->matches_go_to,
+                                         rule->connection_link);
+  rule->connection_link = NULL;
+
+  bucket = bus_matchmaker_get_rules (matchmaker, rule->message_type,
+                                     rule->interface, FALSE);
+  _dbus_assert (bucket != NULL);
+
+  bus_matchmaker_unshare_rule (matchmaker, bucket, rule);
+  rule->matchmaker = NULL;
+  bus_matchmaker_forget_names (matchmaker, rule);
+  bus_matchmaker_forget_hash (matchmaker, rule);
+
+  if (rule->flags & BUS_MATCH_CLIENT_IS_EAVESDROPPING)
+    {
+      _dbus_assert (bucket->n_eavesdropping_rules > 0);
+      bucket->n_eavesdropping_rules -= 1;
+      matchmaker->n_eavesdropping_rules -= 1;
+    }
+
+  bus_matchmaker_gc_rules (matchmaker, rule->message_type, rule->interface,
+      bucket);
+
+#ifdef DBUS_ENABLE_VERBOSE_MODE
+  if (_dbus_is_verbose ())
+    {
+      char *s = match_rule_to_string (rule);
+
+      _dbus_verbose ("Removed match rule %s for connection %p\n",
+                     s ? s : "nomem", rule->matches_go_to);
+      dbus_free (s);
+    }
+#endif
+
+  bus_match_rule_unref (rule);
 }
 
 void
 bus_matchmaker_remove_rule (BusMatchmaker   *matchmaker,
                             BusMatchRule    *rule)
 {
-  DBusList **rules;
-
   _dbus_verbose ("Removing rule with message_type %d, interface %s\n",
                  rule->message_type,
                  rule->interface != NULL ? rule->interface : "<null>");
 
-  bus_connection_remove_match_rule (rule->matches_go_to, rule);
-
-  rules = bus_matchmaker_get_rules (matchmaker, rule->message_type,
-                                    rule->interface, FALSE);
-
-  /* We should only be asked to remove a rule by identity right after it was
-   * added, so there should be a list for it.
-   */
-  _dbus_assert (rules != NULL);
-
-  _dbus_list_remove (rules, rule);
-  bus_matchmaker_gc_rules (matchmaker, rule->message_type, rule->interface,
-      rules);
-
-#ifdef DBUS_ENABLE_VERBOSE_MODE
-  {
-    char *s = match_rule_to_string (rule);
-
-    _dbus_verbose ("Removed match rule %s for connection %p\n",
-                   s ? s : "nomem", rule->matches_go_to);
-    dbus_free (s);
-  }
-#endif
-  
-  bus_match_rule_unref (rule);
+  bus_matchmaker_drop_rule (matchmaker, rule);
 }
 
 /* Remove a single rule which is equal to the given rule by value */
@@ -1620,13 +2814,14 @@ bus_matchmaker_remove_rule_by_value (BusMatchmaker   *matchmaker,
                  value->message_type,
                  value->interface != NULL ? value->interface : "<null>");
 
-  rules = bus_matchmaker_get_rules (matchmaker, value->message_type,
-      value->interface, FALSE);
+  /* Rules that are equal by value always have the same key */
+  rules = _dbus_hash_table_lookup_uintptr (matchmaker->rules_by_hash,
+                                           match_rule_index_key (value));
 
   if (rules != NULL)
     {
-      /* we traverse backward because bus_connection_remove_match_rule()
-       * removes the most-recently-added rule
+      /* we traverse backward so that of several equal rules, the
+       * most recently added is removed
        */
       link = _dbus_list_get_last_link (rules);
       while (link != NULL)
@@ -1639,7 +2834,7 @@ bus_matchmaker_remove_rule_by_value (BusMatchmaker   *matchmaker,
 
           if (match_rule_equal (rule, value))
             {
-              bus_matchmaker_remove_rule_link (rules, link);
+              bus_matchmaker_drop_rule (matchmaker, rule);
               break;
             }
 
@@ -1654,92 +2849,175 @@ bus_matchmaker_remove_rule_by_value (BusMatchmaker   *matchmaker,
       return FALSE;
     }
 
-  bus_matchmaker_gc_rules (matchmaker, value->message_type, value->interface,
-      rules);
-
   return TRUE;
 }
 
-static void
-rule_list_remove_by_connection (DBusList       **rules,
-                                DBusConnection  *connection)
+void
+bus_matchmaker_disconnected (BusMatchmaker   *matchmaker,
+                             DBusConnection  *connection)
 {
+  DBusList **owned;
+  DBusList **naming;
   DBusList *link;
+  const char *name;
 
-  link = _dbus_list_get_first_link (rules);
+  _dbus_assert (bus_connection_is_active (connection));
+
+  _dbus_verbose ("Removing all rules for connection %p\n", connection);
+
+  /* The connection's own rules. A monitor briefly has rules in two
+   * matchmakers, so skip the other one's.
+   */
+  owned = bus_connection_get_match_rules (connection);
+  link = _dbus_list_get_last_link (owned);
   while (link != NULL)
     {
-      BusMatchRule *rule;
-      DBusList *next;
-
-      rule = link->data;
-      next = _dbus_list_get_next_link (rules, link);
+      BusMatchRule *rule = link->data;
+      DBusList *prev = _dbus_list_get_prev_link (owned, link);
 
-      if (rule->matches_go_to == connection)
-        {
-          bus_matchmaker_remove_rule_link (rules, link);
-        }
-      else if (((rule->flags & BUS_MATCH_SENDER) && *rule->sender == ':') ||
-               ((rule->flags & BUS_MATCH_DESTINATION) && *rule->destination == ':'))
-        {
-          /* The rule matches to/from a base service, see if it's the
-           * one being disconnected, since we know this service name
-           * will never be recycled.
-           */
-          const char *name;
+      if (rule->matchmaker == matchmaker)
+        bus_matchmaker_drop_rule (matchmaker, rule);
 
-          name = bus_connection_get_name (connection);
-          _dbus_assert (name != NULL); /* because we're an active connection */
+      link = prev;
+    }
 
-          if (((rule->flags & BUS_MATCH_SENDER) &&
-               strcmp (rule->sender, name) == 0) ||
-              ((rule->flags & BUS_MATCH_DESTINATION) &&
-               strcmp (rule->destination, name) == 0))
-            {
-              bus_matchmaker_remove_rule_link (rules, link);
-            }
-        }
+  /* Other connections' rules to or from its unique name, which will
+   * never be recycled. Dropping a rule removes it from this list, and
+   * the list itself goes away with the last one.
+   */
+  name = bus_connection_get_name (connection);
+  _dbus_assert (name != NULL); /* because we're an active connection */
 
-      link = next;
+  while ((naming = bus_matchmaker_get_name_list (matchmaker, name, FALSE)) != NULL)
+    {
+      bus_matchmaker_drop_rule (matchmaker, (*naming)->data);
     }
 }
 
-void
-bus_matchmaker_disconnected (BusMatchmaker   *matchmaker,
-                             DBusConnection  *connection)
+/* Header fields and arguments of the message being matched. These are
+ * looked up once per message, rather than once per candidate rule.
+ */
+typedef struct
 {
-  int i;
+  DBusMessage *message;
+  DBusConnection *sender;
+  DBusConnection *addressed_recipient;
 
-  /* FIXME
-   *
-   * This scans all match rules on the bus. We could avoid that
-   * for the rules belonging to the connection, since we keep
-   * a list of those; but for the rules that just refer to
-   * the connection we'd need to do something more elaborate.
+  /* Matching connections are pushed onto its recipient stack */
+  BusConnections *connections;
+
+  int type;
+  const char *interface;
+  const char *member;
+  const char *path;
+  const char *destination;
+
+  /* The key under which RuleBucket.rules_by_sender would store rules
+   * that can match this sender, or NULL if there can't be any
    */
+  const char *sender_name;
 
-  _dbus_assert (bus_connection_is_active (connection));
+  /* Arguments are read lazily, up to the highest-numbered one any rule
+   * has asked for so far. n_args_read is the number of entries in args
+   * that are valid; iter is positioned on the last of them.
+   */
+  int n_args_read;
+  DBusMessageIter iter;
+  struct
+  {
+    int type;           /* DBUS_TYPE_INVALID after the last argument */
+    const char *value;  /* non-NULL for strings and object paths */
+    int length;
+  } args[DBUS_MAXIMUM_MATCH_RULE_ARG_NUMBER + 1];
+} MessageFields;
 
-  _dbus_verbose ("Removing all rules for connection %p\n", connection);
+static void
+message_fields_init (MessageFields   *fields,
+                     BusConnections  *connections,
+                     DBusConnection  *sender,
+                     DBusConnection  *addressed_recipient,
+                     DBusMessage     *message)
+{
+  fields->message = message;
+  fields->sender = sender;
+  fields->addressed_recipient = addressed_recipient;
+  fields->connections = connections;
+
+  fields->type = dbus_message_get_type (message);
+  fields->interface = dbus_message_get_interface (message);
+  fields->member = dbus_message_get_member (message);
+  fields->path = dbus_message_get_path (message);
+  fields->destination = dbus_message_get_destination (message);
+
+  /* see match_rule_matches() */
+  if (sender == NULL)
+    fields->sender_name = DBUS_SERVICE_DBUS;
+  else
+    fields->sender_name = bus_connection_get_name (sender);
 
-  for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
-    {
-      RulePool *p = matchmaker->rules_by_type + i;
-      DBusHashIter iter;
+  fields->n_args_read = 0;
+}
+
+/* Returns the type of argument @n, and sets @value and @length if it is
+ * a string or object path.
+ */
+static int
+message_fields_get_arg (MessageFields  *fields,
+                        int             n,
+                        const char    **value,
+                        int            *length)
+{
+  _dbus_assert (n >= 0);
+  _dbus_assert (n <= DBUS_MAXIMUM_MATCH_RULE_ARG_NUMBER);
 
-      rule_list_remove_by_connection (&p->rules_without_iface, connection);
+  while (fields->n_args_read <= n)
+    {
+      int i = fields->n_args_read;
+      int type;
 
-      _dbus_hash_iter_init (p->rules_by_iface, &iter);
-      while (_dbus_hash_iter_next (&iter))
+      if (i == 0)
+        {
+          /* A body the loader left unvalidated must be checked before
+           * it is read; if it is invalid, no argument can match, and
+           * the message is dropped before it is delivered */
+          if (_dbus_message_validate_deferred_body (fields->message) !=
+              DBUS_VALID)
+            {
+              type = DBUS_TYPE_INVALID;
+            }
+          else
+            {
+              dbus_message_iter_init (fields->message, &fields->iter);
+              type = dbus_message_iter_get_arg_type (&fields->iter);
+            }
+        }
+      else if (fields->args[i - 1].type == DBUS_TYPE_INVALID)
         {
-          DBusList **items = _dbus_hash_iter_get_value (&iter);
+          type = DBUS_TYPE_INVALID;
+        }
+      else
+        {
+          dbus_message_iter_next (&fields->iter);
+          type = dbus_message_iter_get_arg_type (&fields->iter);
+        }
 
-          rule_list_remove_by_connection (items, connection);
+      fields->args[i].type = type;
+      fields->args[i].value = NULL;
+      fields->args[i].length = 0;
 
-          if (*items == NULL)
-            _dbus_hash_iter_remove_entry (&iter);
+      if (type == DBUS_TYPE_STRING || type == DBUS_TYPE_OBJECT_PATH)
+        {
+          dbus_message_iter_get_basic (&fields->iter, &fields->args[i].value);
+          _dbus_assert (fields->args[i].value != NULL);
+          fields->args[i].length = strlen (fields->args[i].value);
         }
+
+      fields->n_args_read += 1;
     }
+
+  *value = fields->args[n].value;
+  *length = fields->args[n].length;
+  return fields->args[n].type;
 }
 
 static dbus_bool_t
@@ -1776,9 +3054,7 @@ str_has_prefix (const char *str, const char *prefix)
 
 static dbus_bool_t
 match_rule_matches (BusMatchRule    *rule,
-                    DBusConnection  *sender,
-                    DBusConnection  *addressed_recipient,
-                    DBusMessage     *message,
+                    MessageFields   *fields,
                     BusMatchFlags    already_matched)
 {
   dbus_bool_t wants_to_eavesdrop = FALSE;
@@ -1803,35 +3079,29 @@ match_rule_matches (BusMatchRule    *rule,
     {
       _dbus_assert (rule->message_type != DBUS_MESSAGE_TYPE_INVALID);
 
-      if (rule->message_type != dbus_message_get_type (message))
+      if (rule->message_type != fields->type)
         return FALSE;
     }
 
   if (flags & BUS_MATCH_INTERFACE)
     {
-      const char *iface;
-
       _dbus_assert (rule->interface != NULL);
 
-      iface = dbus_message_get_interface (message);
-      if (iface == NULL)
+      if (fields->interface == NULL)
         return FALSE;
 
-      if (strcmp (iface, rule->interface) != 0)
+      if (strcmp (fields->interface, rule->interface) != 0)
         return FALSE;
     }
 
   if (flags & BUS_MATCH_MEMBER)
     {
-      const char *member;
-
       _dbus_assert (rule->member != NULL);
 
-      member = dbus_message_get_member (message);
-      if (member == NULL)
+      if (fields->member == NULL)
         return FALSE;
 
-      if (strcmp (member, rule->member) != 0)
+      if (strcmp (fields->member, rule->member) != 0)
         return FALSE;
     }
 
@@ -1839,7 +3109,7 @@ match_rule_matches (BusMatchRule    *rule,
     {
       _dbus_assert (rule->sender != NULL);
 
-      if (sender == NULL)
+      if (fields->sender == NULL)
         {
           if (strcmp (rule->sender,
                       DBUS_SERVICE_DBUS) != 0)
@@ -1847,7 +3117,7 @@ match_rule_matches (BusMatchRule    *rule,
         }
       else
         {
-          if (!connection_is_primary_owner (sender, rule->sender))
+          if (!connection_is_primary_owner (fields->sender, rule->sender))
             return FALSE;
         }
     }
@@ -1872,12 +3142,9 @@ match_rule_matches (BusMatchRule    *rule,
    */
   if (flags & BUS_MATCH_DESTINATION)
     {
-      const char *destination;
-
       _dbus_assert (rule->destination != NULL);
 
-      destination = dbus_message_get_destination (message);
-      if (destination == NULL)
+      if (fields->destination == NULL)
         /* broadcast, but this rule specified a destination: no match */
         return FALSE;
 
@@ -1886,7 +3153,7 @@ match_rule_matches (BusMatchRule    *rule,
       if (!wants_to_eavesdrop)
         return FALSE;
 
-      if (addressed_recipient == NULL)
+      if (fields->addressed_recipient == NULL)
         {          
           if (strcmp (rule->destination,
                       DBUS_SERVICE_DBUS) != 0)
@@ -1894,7 +3161,8 @@ match_rule_matches (BusMatchRule    *rule,
         }
       else
         {
-          if (!connection_is_primary_owner (addressed_recipient, rule->destination))
+          if (!connection_is_primary_owner (fields->addressed_recipient,
+                                            rule->destination))
             return FALSE;
         }
     } else { /* no destination in rule */
@@ -1902,7 +3170,7 @@ match_rule_matches (BusMatchRule    *rule,
 
         _dbus_assert (rule->destination == NULL);
 
-        msg_is_broadcast = (dbus_message_get_destination (message) == NULL);
+        msg_is_broadcast = (fields->destination == NULL);
 
         if (!wants_to_eavesdrop && !msg_is_broadcast)
           return FALSE;
@@ -1914,15 +3182,12 @@ match_rule_matches (BusMatchRule    *rule,
 
   if (flags & BUS_MATCH_PATH)
     {
-      const char *path;
-
       _dbus_assert (rule->path != NULL);
 
-      path = dbus_message_get_path (message);
-      if (path == NULL)
+      if (fields->path == NULL)
         return FALSE;
 
-      if (strcmp (path, rule->path) != 0)
+      if (strcmp (fields->path, rule->path) != 0)
         return FALSE;
     }
 
@@ -1933,7 +3198,7 @@ match_rule_matches (BusMatchRule    *rule,
 
       _dbus_assert (rule->path != NULL);
 
-      path = dbus_message_get_path (message);
+      path = fields->path;
       if (path == NULL)
         return FALSE;
 
@@ -1957,12 +3222,9 @@ match_rule_matches (BusMatchRule    *rule,
   if (flags & BUS_MATCH_ARGS)
     {
       int i;
-      DBusMessageIter iter;
       
       _dbus_assert (rule->args != NULL);
 
-      dbus_message_iter_init (message, &iter);
-      
       i = 0;
       while (i < rule->args_len)
         {
@@ -1976,23 +3238,20 @@ match_rule_matches (BusMatchRule    *rule,
           is_path = (rule->arg_lens[i] & BUS_MATCH_ARG_IS_PATH) != 0;
           is_namespace = (rule->arg_lens[i] & BUS_MATCH_ARG_NAMESPACE) != 0;
           
-          current_type = dbus_message_iter_get_arg_type (&iter);
-
           if (expected_arg != NULL)
             {
               const char *actual_arg;
               int actual_length;
 
+              current_type = message_fields_get_arg (fields, i, &actual_arg,
+                                                     &actual_length);
+
               if (current_type != DBUS_TYPE_STRING &&
                   (!is_path || current_type != DBUS_TYPE_OBJECT_PATH))
                 return FALSE;
 
-              actual_arg = NULL;
-              dbus_message_iter_get_basic (&iter, &actual_arg);
               _dbus_assert (actual_arg != NULL);
 
-              actual_length = strlen (actual_arg);
-
               if (is_path)
                 {
                   if (actual_length < expected_length &&
@@ -2042,9 +3301,6 @@ match_rule_matches (BusMatchRule    *rule,
 
             }
           
-          if (current_type != DBUS_TYPE_INVALID)
-            dbus_message_iter_next (&iter);
-
           ++i;
         }
     }
@@ -2054,10 +3310,8 @@ match_rule_matches (BusMatchRule    *rule,
 
 static dbus_bool_t
 get_recipients_from_list (DBusList       **rules,
-                          DBusConnection  *sender,
-                          DBusConnection  *addressed_recipient,
-                          DBusMessage     *message,
-                          DBusList       **recipients_p)
+                          MessageFields   *fields,
+                          BusMatchFlags    already_matched)
 {
   DBusList *link;
 
@@ -2072,30 +3326,42 @@ get_recipients_from_list (DBusList       **rules,
       rule = link->data;
 
 #ifdef DBUS_ENABLE_VERBOSE_MODE
-      {
-        char *s = match_rule_to_string (rule);
+      /* formatting the rule costs an allocation per rule per message */
+      if (_dbus_is_verbose ())
+        {
+          char *s = match_rule_to_string (rule);
 
-        _dbus_verbose ("Checking whether message matches rule %s for connection %p\n",
-                       s ? s : "nomem", rule->matches_go_to);
-        dbus_free (s);
-      }
+          _dbus_verbose ("Checking whether message matches rule %s for connection %p\n",
+                         s ? s : "nomem", rule->matches_go_to);
+          dbus_free (s);
+        }
 #endif
 
-      if (match_rule_matches (rule,
-                              sender, addressed_recipient, message,
-                              BUS_MATCH_MESSAGE_TYPE | BUS_MATCH_INTERFACE))
+      if (match_rule_matches (rule, fields, already_matched))
         {
+          DBusList *subscriber_link;
+
           _dbus_verbose ("Rule matched\n");
 
-          /* Append to the list if we haven't already */
-          if (bus_connection_mark_stamp (rule->matches_go_to))
-            {
-              if (!_dbus_list_append (recipients_p, rule->matches_go_to))
-                return FALSE;
-            }
-          else
+          /* The rule stands for every equal rule, including itself */
+          for (subscriber_link = _dbus_list_get_first_link (&rule->subscribers);
+               subscriber_link != NULL;
+               subscriber_link = _dbus_list_get_next_link (&rule->subscribers,
+                                                           subscriber_link))
             {
-              _dbus_verbose ("Connection already receiving this message, so not adding again\n");
+              BusMatchRule *subscriber = subscriber_link->data;
+
+              /* Append to the list if we haven't already */
+              if (bus_connection_mark_stamp (subscriber->matches_go_to))
+                {
+                  if (!bus_connections_push_recipient (fields->connections,
+                                                       subscriber->matches_go_to))
+                    return FALSE;
+                }
+              else
+                {
+                  _dbus_verbose ("Connection already receiving this message, so not adding again\n");
+                }
             }
         }
 
@@ -2105,19 +3371,269 @@ get_recipients_from_list (DBusList       **rules,
   return TRUE;
 }
 
+static dbus_bool_t
+get_recipients_from_index (DBusHashTable   *table,
+                           const char      *key,
+                           MessageFields   *fields,
+                           BusMatchFlags    already_matched)
+{
+  if (table == NULL || key == NULL)
+    return TRUE;
+
+  return get_recipients_from_list (_dbus_hash_table_lookup_string (table, key),
+                                   fields, already_matched);
+}
+
+/* A rule with arg0namespace='com.example' matches arg0 values
+ * "com.example" and "com.example.*", so look up every dot-separated
+ * prefix of the actual arg0. Valid namespaces can't be longer than a bus
+ * name, so longer prefixes can't match anything.
+ */
+static dbus_bool_t
+get_recipients_from_namespace_index (DBusHashTable   *table,
+                                     const char      *arg0,
+                                     MessageFields   *fields,
+                                     BusMatchFlags    already_matched)
+{
+  char prefix[DBUS_MAXIMUM_NAME_LENGTH + 1];
+  const char *p;
+
+  if (table == NULL || arg0 == NULL)
+    return TRUE;
+
+  for (p = arg0; ; p++)
+    {
+      if (*p == '.' || *p == '\0')
+        {
+          size_t len = p - arg0;
+
+          if (len > DBUS_MAXIMUM_NAME_LENGTH)
+            break;
+
+          memcpy (prefix, arg0, len);
+          prefix[len] = '\0';
+
+          if (!get_recipients_from_list (
+                  _dbus_hash_table_lookup_string (table, prefix),
+                  fields, already_matched))
+            return FALSE;
+        }
+
+      if (*p == '\0')
+        break;
+    }
+
+  return TRUE;
+}
+
+/* Visit the path_namespace rules on every node from the root down to
+ * the message's path, and the path rules on the node for the path itself.
+ */
+static dbus_bool_t
+get_recipients_from_path_tree (RulePathNode    *root,
+                               MessageFields   *fields,
+                               BusMatchFlags    already_matched)
+{
+  /* Enough for most paths; longer ones are copied to the heap */
+  char stack_buf[256];
+  char *buf = NULL;
+  RulePathNode *node;
+  dbus_bool_t retval = FALSE;
+
+  if (root == NULL || fields->path == NULL)
+    return TRUE;
+
+  node = root;
+
+  if (!get_recipients_from_list (&node->namespace_rules, fields,
+                                 already_matched | BUS_MATCH_PATH_NAMESPACE))
+    goto out;
+
+  /* Split a copy of the path into components in-place. The message has
+   * already been validated, so there are no empty components. */
+  if (fields->path[1] != '\0')
+    {
+      size_t len = strlen (fields->path);
+      char *p;
+
+      if (len < sizeof (stack_buf))
+        {
+          p = stack_buf;
+        }
+      else
+        {
+          buf = dbus_malloc (len + 1);
+          if (buf == NULL)
+            goto out;
+          p = buf;
+        }
+
+      memcpy (p, fields->path, len + 1);
+      p++;
+
+      while (node != NULL)
+        {
+          char *next = strchr (p, '/');
+
+          if (next != NULL)
+            *next = '\0';
+
+          if (node->children != NULL)
+            node = _dbus_hash_table_lookup_string (node->children, p);
+          else
+            node = NULL;
+
+          if (node == NULL)
+            break;
+
+          if (!get_recipients_from_list (&node->namespace_rules, fields,
+                                         already_matched | BUS_MATCH_PATH_NAMESPACE))
+            goto out;
+
+          if (next == NULL)
+            break;
+
+          p = next + 1;
+        }
+    }
+
+  if (node != NULL &&
+      !get_recipients_from_list (&node->path_rules, fields,
+                                 already_matched | BUS_MATCH_PATH))
+    goto out;
+
+  retval = TRUE;
+
+ out:
+  dbus_free (buf);
+  return retval;
+}
+
+/* Only the lists whose key matches the message can contain rules that
+ * match it, and every rule in those lists is already known to match on
+ * that key, so we can skip re-checking it.
+ */
+static dbus_bool_t
+get_recipients_from_bucket (RuleBucket      *bucket,
+                            MessageFields   *fields)
+{
+  const BusMatchFlags already_matched =
+    BUS_MATCH_MESSAGE_TYPE | BUS_MATCH_INTERFACE;
+  const char *arg0 = NULL;
+  int length;
+
+  if (bucket == NULL)
+    return TRUE;
+
+  if (fields->destination != NULL && bucket->n_eavesdropping_rules == 0)
+    return TRUE;
+
+  /* arg0 and arg0namespace can only match a string */
+  if ((bucket->rules_by_arg0 != NULL ||
+       bucket->rules_by_arg0_namespace != NULL) &&
+      message_fields_get_arg (fields, 0, &arg0, &length) != DBUS_TYPE_STRING)
+    arg0 = NULL;
+
+  return get_recipients_from_path_tree (bucket->path_tree, fields,
+                                        already_matched) &&
+    get_recipients_from_index (bucket->rules_by_arg0, arg0, fields,
+                               already_matched) &&
+    get_recipients_from_namespace_index (bucket->rules_by_arg0_namespace,
+                                         arg0, fields, already_matched) &&
+    get_recipients_from_index (bucket->rules_by_sender, fields->sender_name,
+                               fields, already_matched | BUS_MATCH_SENDER) &&
+    get_recipients_from_index (bucket->rules_by_member, fields->member,
+                               fields, already_matched | BUS_MATCH_MEMBER) &&
+    get_recipients_from_list (&bucket->rules_unindexed, fields,
+                              already_matched);
+}
+
+/**
+ * Whether any of the rules could match a message with a destination.
+ * Only eavesdropping rules can, so when this is #FALSE, method calls,
+ * replies and unicast signals need not be looked up at all.
+ *
+ * @param matchmaker the matchmaker
+ * @returns #TRUE if there is at least one eavesdropping rule
+ */
+dbus_bool_t
+bus_matchmaker_has_eavesdroppers (BusMatchmaker *matchmaker)
+{
+  return matchmaker->n_eavesdropping_rules > 0;
+}
+
+/**
+ * How many rules the matchmaker evaluates: rules that differ only in
+ * their owner count once.
+ *
+ * @param matchmaker the matchmaker
+ * @returns the number of distinct rules
+ */
+int
+bus_matchmaker_get_n_distinct_rules (BusMatchmaker *matchmaker)
+{
+  return matchmaker->n_distinct_rules;
+}
+
+/**
+ * Gets a number that changes whenever what
+ * bus_matchmaker_get_signal_interest() would return does, so that
+ * callers can tell whether it is worth sending again.
+ *
+ * @param matchmaker the matchmaker
+ * @returns the version of the summary
+ */
+dbus_uint32_t
+bus_matchmaker_get_signal_interest_version (BusMatchmaker *matchmaker)
+{
+  return matchmaker->interest_version;
+}
+
+/**
+ * Summarizes which signals the rules can match, for
+ * org.freedesktop.DBus.SignalInterest: each rule that can match
+ * signals and restricts their interface, member or both sets the bits
+ * given by _dbus_signal_interest_get_bits() for what it restricts, and
+ * any other such rule makes the summary useless.
+ *
+ * @param matchmaker the matchmaker
+ * @param bitmap #DBUS_SIGNAL_INTEREST_BYTES bytes to fill in
+ * @returns #TRUE if some rule could match any signal
+ */
+dbus_bool_t
+bus_matchmaker_get_signal_interest (BusMatchmaker *matchmaker,
+                                    unsigned char *bitmap)
+{
+  unsigned int i;
+
+  memset (bitmap, 0, DBUS_SIGNAL_INTEREST_BYTES);
+
+  for (i = 0; i < DBUS_SIGNAL_INTEREST_BYTES * 8; i++)
+    {
+      if (matchmaker->interest_counts[i] > 0)
+        bitmap[i / 8] |= 1 << (i % 8);
+    }
+
+  return matchmaker->n_interest_wildcards > 0;
+}
+
+/* Push every connection with a rule matching @message onto the
+ * recipient stack of @connections, each at most once. On OOM the stack
+ * is left as it was.
+ */
 dbus_bool_t
 bus_matchmaker_get_recipients (BusMatchmaker   *matchmaker,
                                BusConnections  *connections,
                                DBusConnection  *sender,
                                DBusConnection  *addressed_recipient,
-                               DBusMessage     *message,
-                               DBusList       **recipients_p)
+                               DBusMessage     *message)
 {
-  int type;
-  const char *interface;
-  DBusList **neither, **just_type, **just_iface, **both;
+  MessageFields fields;
+  RuleBucket *neither, *just_type, *just_iface, *both;
+  int first;
 
-  _dbus_assert (*recipients_p == NULL);
+  /* Don't disturb the recipients of any message we're nested inside */
+  first = bus_connections_get_n_recipients (connections);
 
   /* This avoids sending same message to the same connection twice.
    * Purpose of the stamp instead of a bool is to avoid iterating over
@@ -2132,38 +3648,42 @@ bus_matchmaker_get_recipients (BusMatchmaker   *matchmaker,
   if (addressed_recipient != NULL)
     bus_connection_mark_stamp (addressed_recipient);
 
-  type = dbus_message_get_type (message);
-  interface = dbus_message_get_interface (message);
+  message_fields_init (&fields, connections, sender, addressed_recipient,
+                       message);
 
   neither = bus_matchmaker_get_rules (matchmaker, DBUS_MESSAGE_TYPE_INVALID,
       NULL, FALSE);
   just_type = just_iface = both = NULL;
 
-  if (interface != NULL)
+  if (fields.interface != NULL)
     just_iface = bus_matchmaker_get_rules (matchmaker,
-        DBUS_MESSAGE_TYPE_INVALID, interface, FALSE);
+        DBUS_MESSAGE_TYPE_INVALID, fields.interface, FALSE);
 
-  if (type > DBUS_MESSAGE_TYPE_INVALID && type < DBUS_NUM_MESSAGE_TYPES)
+  if (fields.type > DBUS_MESSAGE_TYPE_INVALID &&
+      fields.type < DBUS_NUM_MESSAGE_TYPES)
     {
-      just_type = bus_matchmaker_get_rules (matchmaker, type, NULL, FALSE);
+      just_type = bus_matchmaker_get_rules (matchmaker, fields.type, NULL,
+                                            FALSE);
 
-      if (interface != NULL)
-        both = bus_matchmaker_get_rules (matchmaker, type, interface, FALSE);
+      if (fields.interface != NULL)
+        both = bus_matchmaker_get_rules (matchmaker, fields.type,
+                                         fields.interface, FALSE);
     }
 
-  if (!(get_recipients_from_list (neither, sender, addressed_recipient,
-                                  message, recipients_p) &&
-        get_recipients_from_list (just_iface, sender, addressed_recipient,
-                                  message, recipients_p) &&
-        get_recipients_from_list (just_type, sender, addressed_recipient,
-                                  message, recipients_p) &&
-        get_recipients_from_list (both, sender, addressed_recipient,
-                                  message, recipients_p)))
+  if (!(get_recipients_from_bucket (neither, &fields) &&
+        get_recipients_from_bucket (just_iface, &fields) &&
+        get_recipients_from_bucket (just_type, &fields) &&
+        get_recipients_from_bucket (both, &fields)))
     {
-      _dbus_list_clear (recipients_p);
+      bus_connections_truncate_recipients (connections, first);
       return FALSE;
     }
 
+  _DBUS_TRACE3 (match__recipients,
+                dbus_message_get_serial (message),
+                dbus_message_get_sender (message),
+                bus_connections_get_n_recipients (connections) - first);
+
   return TRUE;
 }
 
@@ -2517,6 +4037,8 @@ static struct {
   { "arg0='comma,type=comma',type=signal", "type=signal,arg0='comma,type=comma'" },
   { "arg0=escap\\e", "arg0='escap\\e'" },
   { "arg0=Time: 8 o\\'clock", "arg0='Time: 8 o'\\''clock'" },
+  { "path_namespace='/foo'", "path_namespace='/foo'" },
+  { "path_namespace='/bar'", "path_namespace='/bar'" },
 };
 
 static void
@@ -2546,6 +4068,9 @@ test_equality (void)
           exit (1);
         }
 
+      /* RemoveMatch relies on equal rules hashing alike */
+      _dbus_assert (match_rule_get_hash (first) == match_rule_get_hash (second));
+
       /* Check match_rule_to_string */
       first_str = match_rule_to_string (first);
       _dbus_assert (first_str != NULL);
@@ -2591,6 +4116,9 @@ test_equality (void)
 
       ++i;
     }
+
+  /* every string the rules interned has been released again */
+  _dbus_assert (bus_atoms_get_n () == 0);
 }
 
 static const char*
@@ -2675,13 +4203,15 @@ check_matches (dbus_bool_t  expected_to_match,
                const char  *rule_text)
 {
   BusMatchRule *rule;
+  MessageFields fields;
   dbus_bool_t matched;
 
   rule = check_parse (TRUE, rule_text);
   _dbus_assert (rule != NULL);
 
   /* We can't test sender/destination rules since we pass NULL here */
-  matched = match_rule_matches (rule, NULL, NULL, message, 0);
+  message_fields_init (&fields, NULL, NULL, NULL, message);
+  matched = match_rule_matches (rule, &fields, 0);
 
   if (matched != expected_to_match)
     {
@@ -2798,6 +4328,7 @@ test_path_match (int type,
                  dbus_bool_t   should_match)
 {
   DBusMessage *message = dbus_message_new (DBUS_MESSAGE_TYPE_SIGNAL);
+  MessageFields fields;
   dbus_bool_t matched;
 
   _dbus_assert (message != NULL);
@@ -2809,7 +4340,8 @@ test_path_match (int type,
                                  NULL))
     _dbus_assert_not_reached ("oom");
 
-  matched = match_rule_matches (rule, NULL, NULL, message, 0);
+  message_fields_init (&fields, NULL, NULL, NULL, message);
+  matched = match_rule_matches (rule, &fields, 0);
 
   if (matched != should_match)
     {
@@ -2948,6 +4480,134 @@ test_matching_path_namespace (void)
   dbus_message_unref (message1);
 }
 
+static struct {
+  const char *rule_text;
+  const char *expected_index;
+} indexing_tests[] = {
+  { "type='signal'", NULL },
+  { "interface='com.example.Foo'", NULL },
+  { "member='Changed'", "member" },
+  { "member='Changed',sender=':1.42'", "sender" },
+  { "member='Changed',sender='org.freedesktop.DBus'", "sender" },
+  { "member='Changed',sender='com.example.Foo'", "member" },
+  { "member='Changed',sender=':1.42',path='/foo'", "path" },
+  { "member='NameOwnerChanged',sender='org.freedesktop.DBus',arg0='com.example.Foo'", "arg0" },
+  { "sender='org.freedesktop.DBus',arg0namespace='com.example'", "arg0namespace" },
+  { "path='/foo',arg0='com.example.Foo'", "path" },
+  { "member='Changed',arg0path='/foo/'", "member" },
+  { "member='Changed',arg1='foo'", "member" },
+  { "path_namespace='/foo'", "path" },
+  { "path_namespace='/',member='Changed'", "member" },
+  { "sender='com.example.Foo'", NULL },
+};
+
+static void
+test_indexing (void)
+{
+  int i;
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (indexing_tests); i++)
+    {
+      RuleBucket bucket = { NULL };
+      BusMatchRule *rule;
+      DBusHashTable **table_p;
+      const char *name;
+      const char *key;
+
+      rule = check_parse (TRUE, indexing_tests[i].rule_text);
+      _dbus_assert (rule != NULL);
+
+      name = NULL;
+
+      if (rule_is_in_path_tree (rule))
+        {
+          _dbus_assert (rule->path_components != NULL);
+          name = "path";
+        }
+      else
+        {
+          table_p = rule_bucket_choose_index (&bucket, rule, &key);
+          _dbus_assert ((table_p == NULL) == (key == NULL));
+
+          if (table_p == &bucket.rules_by_arg0)
+            name = "arg0";
+          else if (table_p == &bucket.rules_by_arg0_namespace)
+            name = "arg0namespace";
+          else if (table_p == &bucket.rules_by_sender)
+            name = "sender";
+          else if (table_p == &bucket.rules_by_member)
+            name = "member";
+          else
+            _dbus_assert (table_p == NULL);
+        }
+
+      if ((name == NULL) != (indexing_tests[i].expected_index == NULL) ||
+          (name != NULL &&
+           strcmp (name, indexing_tests[i].expected_index) != 0))
+        {
+          _dbus_warn ("Expected rule %s to be indexed by %s, got %s\n",
+                      indexing_tests[i].rule_text,
+                      indexing_tests[i].expected_index ?
+                      indexing_tests[i].expected_index : "nothing",
+                      name ? name : "nothing");
+          exit (1);
+        }
+
+      bus_match_rule_unref (rule);
+    }
+}
+
+/* With verbose output off, checking a message against rules mustn't
+ * format them for _dbus_verbose() */
+static void
+test_checking_is_quiet (void)
+{
+  static const char *rules[] = {
+    "type='signal',member='Frobated',arg0='nope'",
+    "type='method_call',interface='org.example.Nope'",
+    "sender=':1.42',path_namespace='/org/example'"
+  };
+  DBusList *list = NULL;
+  DBusMessage *message;
+  MessageFields fields;
+  dbus_bool_t was_verbose;
+  int i, allocations;
+
+  message = dbus_message_new_signal ("/foo/bar", "org.example.Thing",
+                                     "Frobated");
+  _dbus_assert (message != NULL);
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (rules); i++)
+    {
+      BusMatchRule *rule = check_parse (TRUE, rules[i]);
+
+      _dbus_assert (rule != NULL);
+      if (!_dbus_list_append (&list, rule))
+        _dbus_assert_not_reached ("oom");
+    }
+
+  was_verbose = _dbus_is_verbose ();
+  _dbus_set_verbose (FALSE);
+
+  message_fields_init (&fields, NULL, NULL, NULL, message);
+  allocations = _dbus_get_malloc_calls ();
+
+  for (i = 0; i < 100; i++)
+    {
+      if (!get_recipients_from_list (&list, &fields, 0))
+        _dbus_assert_not_reached ("nothing should match");
+    }
+
+  allocations = _dbus_get_malloc_calls () - allocations;
+  _dbus_set_verbose (was_verbose);
+  _dbus_assert (allocations == 0);
+
+  while (list != NULL)
+    bus_match_rule_unref (_dbus_list_pop_first (&list));
+
+  dbus_message_unref (message);
+}
+
 dbus_bool_t
 bus_signals_test (const DBusString *test_data_dir)
 {
@@ -2965,6 +4625,8 @@ bus_signals_test (const DBusString *test_data_dir)
   test_matching ();
   test_path_matching ();
   test_matching_path_namespace ();
+  test_indexing ();
+  test_checking_is_quiet ();
 
   return TRUE;
 }
@@ -75,6 +75,8 @@ void bus_match_rule_set_client_is_eavesdropping (BusMatchRule     *rule,
 
 dbus_bool_t bus_match_rule_get_client_is_eavesdropping (BusMatchRule *rule);
 
+int bus_match_rule_get_n_bytes (BusMatchRule *rule);
+
 BusMatchRule* bus_match_rule_parse (DBusConnection   *matches_go_to,
                                     const DBusString *rule_text,
                                     DBusError        *error);
@@ -98,11 +100,15 @@ void        bus_matchmaker_remove_rule          (BusMatchmaker   *matchmaker,
                                                  BusMatchRule    *rule);
 void        bus_matchmaker_disconnected         (BusMatchmaker   *matchmaker,
                                                  DBusConnection  *connection);
+dbus_bool_t bus_matchmaker_has_eavesdroppers    (BusMatchmaker   *matchmaker);
+int         bus_matchmaker_get_n_distinct_rules (BusMatchmaker   *matchmaker);
+dbus_uint32_t bus_matchmaker_get_signal_interest_version (BusMatchmaker *matchmaker);
+dbus_bool_t bus_matchmaker_get_signal_interest  (BusMatchmaker   *matchmaker,
+                                                 unsigned char   *bitmap);
 dbus_bool_t bus_matchmaker_get_recipients       (BusMatchmaker   *matchmaker,
                                                  BusConnections  *connections,
                                                  DBusConnection  *sender,
                                                  DBusConnection  *addressed_recipient,
-                                                 DBusMessage     *message,
-                                                 DBusList       **recipients_p);
+                                                 DBusMessage     *message);
 
 #endif /* BUS_SIGNALS_H */
@@ -0,0 +1,279 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* stats-page.c - publish core bus counters in a shared memory page
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include <config.h>
+#include "stats-page.h"
+
+#include <dbus/dbus-connection-internal.h>
+#include <dbus/dbus-file.h>
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-mainloop.h>
+#include <dbus/dbus-timeout.h>
+#ifdef DBUS_UNIX
+#include <dbus/dbus-sysdeps-unix.h>
+#endif
+
+#include "connection.h"
+#include "stats.h"
+#include "utils.h"
+
+#include <string.h>
+
+#ifdef DBUS_ENABLE_STATS
+
+/*
+ * The daemon is the only writer, and only ever updates the page from
+ * the main loop, so a sequence counter is all readers need to get a
+ * consistent copy: they never take a lock or send a message, and the
+ * daemon never waits for them.
+ */
+
+/* How often the page is brought up to date, in milliseconds */
+#define BUS_STATS_PAGE_INTERVAL 100
+
+_DBUS_STATIC_ASSERT (sizeof (BusStatsPageLayout) <= BUS_STATS_PAGE_FILE_SIZE);
+
+struct BusStatsPage
+{
+  BusContext *context;
+  char *path;
+  BusStatsPageLayout *layout;  /**< The shared mapping of path */
+  DBusTimeout *timeout;
+  dbus_uint64_t sequence;      /**< What we last stored as layout->sequence */
+};
+
+typedef struct
+{
+  dbus_uint64_t messages;
+  dbus_uint64_t bytes;
+  dbus_uint64_t max_bytes;
+} OutgoingTotals;
+
+static dbus_bool_t
+add_outgoing (DBusConnection *connection,
+              void           *data)
+{
+  OutgoingTotals *totals = data;
+  dbus_uint32_t messages, bytes;
+
+  _dbus_connection_get_stats (connection,
+                              NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+                              &messages, &bytes, NULL, NULL, NULL, NULL);
+
+  totals->messages += messages;
+  totals->bytes += bytes;
+
+  if (bytes > totals->max_bytes)
+    totals->max_bytes = bytes;
+
+  return TRUE;
+}
+
+static void
+stats_page_update (BusStatsPage *page)
+{
+  BusStatsPageLayout *layout = page->layout;
+  BusConnections *connections;
+  OutgoingTotals outgoing = { 0, 0, 0 };
+  dbus_uint64_t messages_routed, bytes_routed;
+
+  connections = bus_context_get_connections (page->context);
+
+  /* gather everything first, to keep the window readers may have to
+   * retry in as short as possible */
+  bus_connections_foreach_active (connections, add_outgoing, &outgoing);
+  bus_top_talkers_get_totals (bus_context_get_top_talkers (page->context),
+                              &messages_routed, &bytes_routed);
+
+  page->sequence += 1;
+  layout->sequence = page->sequence;
+  _dbus_memory_barrier ();
+
+  layout->pid = _dbus_getpid ();
+  layout->update_nsec = _dbus_get_monotonic_time_nsec ();
+  layout->active_connections = bus_connections_get_n_active (connections);
+  layout->incomplete_connections =
+    bus_connections_get_n_incomplete (connections);
+  layout->match_rules = bus_connections_get_total_match_rules (connections);
+  layout->bus_names = bus_connections_get_total_bus_names (connections);
+  layout->messages_routed = messages_routed;
+  layout->bytes_routed = bytes_routed;
+  layout->outgoing_messages = outgoing.messages;
+  layout->outgoing_bytes = outgoing.bytes;
+  layout->max_outgoing_bytes = outgoing.max_bytes;
+  layout->queue_full_rejections =
+    bus_context_get_n_queue_full_rejections (page->context);
+  layout->monitor_dropped_messages =
+    bus_connections_get_n_monitor_dropped (connections);
+
+  _dbus_memory_barrier ();
+  page->sequence += 1;
+  layout->sequence = page->sequence;
+}
+
+static dbus_bool_t
+stats_page_timeout_cb (void *data)
+{
+  stats_page_update (data);
+  return TRUE;
+}
+
+/**
+ * Publishes the core bus counters at @p path, replacing whatever file
+ * was there, and keeps them up to date from the main loop until
+ * bus_stats_page_free(). The file is only readable by the user the
+ * daemon was started as.
+ *
+ * @param context the bus context
+ * @param path the file to publish the counters in
+ * @param error error to set on failure
+ * @returns the page, or #NULL with @p error set
+ */
+BusStatsPage *
+bus_stats_page_new (BusContext  *context,
+                    const char  *path,
+                    DBusError   *error)
+{
+#ifdef DBUS_UNIX
+  BusStatsPage *page;
+  BusStatsPageLayout header;
+  DBusString contents;
+  DBusString filename;
+  void *map;
+
+  page = dbus_new0 (BusStatsPage, 1);
+  if (page == NULL)
+    {
+      BUS_SET_OOM (error);
+      return NULL;
+    }
+
+  page->context = context;
+  page->path = _dbus_strdup (path);
+  if (page->path == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  /* Written out under a temporary name and renamed into place, so
+   * a reader never finds the file short or without its header */
+  if (!_dbus_string_init (&contents))
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, BUS_STATS_PAGE_MAGIC, sizeof (header.magic));
+  header.version = BUS_STATS_PAGE_VERSION;
+  header.size = sizeof (header);
+
+  _dbus_string_init_const (&filename, path);
+
+  if (!_dbus_string_append_len (&contents, (const char *) &header,
+                                sizeof (header)) ||
+      !_dbus_string_insert_bytes (&contents, sizeof (header),
+                                  BUS_STATS_PAGE_FILE_SIZE - sizeof (header),
+                                  '\0'))
+    {
+      _dbus_string_free (&contents);
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  if (!_dbus_string_save_to_file (&contents, &filename, FALSE, error))
+    {
+      _dbus_string_free (&contents);
+      goto failed;
+    }
+
+  _dbus_string_free (&contents);
+
+  if (!_dbus_file_map_shared (&filename, BUS_STATS_PAGE_FILE_SIZE, &map,
+                              error))
+    goto failed;
+
+  page->layout = map;
+
+  page->timeout = _dbus_timeout_new (BUS_STATS_PAGE_INTERVAL,
+                                     stats_page_timeout_cb, page, NULL);
+  if (page->timeout == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  if (!_dbus_loop_add_timeout (bus_context_get_loop (context), page->timeout))
+    {
+      _dbus_timeout_unref (page->timeout);
+      page->timeout = NULL;
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  stats_page_update (page);
+  return page;
+
+failed:
+  bus_stats_page_free (page);
+  return NULL;
+#else
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "<stats_page> is not supported on this platform");
+  return NULL;
+#endif
+}
+
+/**
+ * Stops updating the page, and removes its file.
+ *
+ * @param page the page
+ */
+void
+bus_stats_page_free (BusStatsPage *page)
+{
+  if (page->timeout != NULL)
+    {
+      _dbus_loop_remove_timeout (bus_context_get_loop (page->context),
+                                 page->timeout);
+      _dbus_timeout_unref (page->timeout);
+    }
+
+#ifdef DBUS_UNIX
+  if (page->layout != NULL)
+    {
+      DBusString filename;
+
+      _dbus_file_unmap_shared (page->layout, BUS_STATS_PAGE_FILE_SIZE);
+
+      /* an unprivileged daemon may no longer be allowed to, which is
+       * harmless: the next one replaces it */
+      _dbus_string_init_const (&filename, page->path);
+      _dbus_delete_file (&filename, NULL);
+    }
+#endif
+
+  dbus_free (page->path);
+  dbus_free (page);
+}
+
+#endif /* DBUS_ENABLE_STATS */
@@ -0,0 +1,67 @@
+/* stats-page.h - publish core bus counters in a shared memory page
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef BUS_STATS_PAGE_H
+#define BUS_STATS_PAGE_H
+
+#include "bus.h"
+
+#define BUS_STATS_PAGE_MAGIC "DBUSSTAT"
+#define BUS_STATS_PAGE_VERSION 1
+/* The file is always this long; the layout below fills the start of it */
+#define BUS_STATS_PAGE_FILE_SIZE 4096
+
+/*
+ * The layout of <stats_page>, which is an interface: fields are only
+ * ever added at the end, with version unchanged, and readers must
+ * check that size covers the fields they use. Everything is in host
+ * byte order.
+ *
+ * sequence is odd while the daemon is updating the page. To read it,
+ * load sequence, retry if it is odd, copy the counters, and retry if
+ * sequence has changed since.
+ */
+typedef struct
+{
+  char magic[8];                          /**< BUS_STATS_PAGE_MAGIC, not nul-terminated */
+  dbus_uint32_t version;                  /**< BUS_STATS_PAGE_VERSION */
+  dbus_uint32_t size;                     /**< Bytes of this struct that are valid */
+  volatile dbus_uint64_t sequence;        /**< Odd while an update is in progress */
+  volatile dbus_uint64_t pid;             /**< Process ID of the dbus-daemon */
+  volatile dbus_uint64_t update_nsec;     /**< CLOCK_MONOTONIC time of the last update */
+  volatile dbus_uint64_t active_connections;
+  volatile dbus_uint64_t incomplete_connections;
+  volatile dbus_uint64_t match_rules;
+  volatile dbus_uint64_t bus_names;
+  volatile dbus_uint64_t messages_routed; /**< Every message the daemon has been sent */
+  volatile dbus_uint64_t bytes_routed;    /**< Their total size */
+  volatile dbus_uint64_t outgoing_messages;   /**< Queued for all connections */
+  volatile dbus_uint64_t outgoing_bytes;      /**< Queued for all connections */
+  volatile dbus_uint64_t max_outgoing_bytes;  /**< Queued for the most backed-up connection */
+  volatile dbus_uint64_t queue_full_rejections; /**< Messages refused for a full outgoing queue */
+  volatile dbus_uint64_t monitor_dropped_messages; /**< Captured messages monitors missed */
+} BusStatsPageLayout;
+
+BusStatsPage *bus_stats_page_new  (BusContext   *context,
+                                   const char   *path,
+                                   DBusError    *error);
+void          bus_stats_page_free (BusStatsPage *page);
+
+#endif /* multiple-inclusion guard */
@@ -0,0 +1,527 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* stats-server.c - serve bus statistics as OpenMetrics text
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include <config.h>
+#include "stats-server.h"
+
+#include <dbus/dbus-file.h>
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-list.h>
+#include <dbus/dbus-mainloop.h>
+#include <dbus/dbus-watch.h>
+#ifdef DBUS_UNIX
+#include <dbus/dbus-sysdeps-unix.h>
+#endif
+
+#include "stats.h"
+#include "utils.h"
+
+#include <string.h>
+
+#ifdef DBUS_ENABLE_STATS
+
+/*
+ * A deliberately tiny HTTP/1.0 server: each client sends one request,
+ * gets the whole exposition back and is disconnected. Everything runs
+ * from non-blocking watches on the bus main loop, so a slow or stalled
+ * scraper never holds up message dispatch.
+ */
+
+/* Requests are a few hundred bytes; anything bigger is not a scraper */
+#define MAX_REQUEST_LENGTH 8192
+
+/* Beyond this many clients, the oldest one is dropped */
+#define MAX_CLIENTS 16
+
+typedef struct
+{
+  BusStatsServer *server;
+  DBusSocket fd;
+  DBusWatch *watch;
+  DBusString buffer;      /**< The request while reading, then the response */
+  int n_written;          /**< How much of the response has been written */
+  dbus_bool_t writing;    /**< #TRUE once the request has been read */
+} BusStatsClient;
+
+struct BusStatsServer
+{
+  BusContext *context;
+  DBusSocket *fds;        /**< Listening sockets */
+  DBusWatch **watches;    /**< One watch per listening socket */
+  int n_fds;
+  char *socket_path;      /**< unix:path= to unlink when done, or NULL */
+  DBusList *clients;      /**< BusStatsClient, oldest first */
+  int n_clients;
+};
+
+static DBusLoop *
+server_get_loop (BusStatsServer *server)
+{
+  return bus_context_get_loop (server->context);
+}
+
+static void
+stats_client_free (BusStatsClient *client)
+{
+  BusStatsServer *server = client->server;
+
+  if (client->watch != NULL)
+    {
+      _dbus_loop_remove_watch (server_get_loop (server), client->watch);
+      _dbus_watch_invalidate (client->watch);
+      _dbus_watch_unref (client->watch);
+    }
+
+  _dbus_close_socket (client->fd, NULL);
+  _dbus_string_free (&client->buffer);
+
+  _dbus_list_remove (&server->clients, client);
+  server->n_clients -= 1;
+
+  dbus_free (client);
+}
+
+static dbus_bool_t stats_client_handle_watch (DBusWatch    *watch,
+                                              unsigned int  flags,
+                                              void         *data);
+
+static dbus_bool_t
+stats_client_set_watch (BusStatsClient *client,
+                        unsigned int    flags)
+{
+  DBusLoop *loop = server_get_loop (client->server);
+
+  if (client->watch != NULL)
+    {
+      _dbus_loop_remove_watch (loop, client->watch);
+      _dbus_watch_invalidate (client->watch);
+      _dbus_watch_unref (client->watch);
+    }
+
+  client->watch = _dbus_watch_new (_dbus_socket_get_pollable (client->fd),
+                                   flags, TRUE,
+                                   stats_client_handle_watch, client, NULL);
+  if (client->watch == NULL)
+    return FALSE;
+
+  if (!_dbus_loop_add_watch (loop, client->watch))
+    {
+      _dbus_watch_invalidate (client->watch);
+      _dbus_watch_unref (client->watch);
+      client->watch = NULL;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Returns #FALSE if the request is not complete yet */
+static dbus_bool_t
+stats_client_have_request (BusStatsClient *client)
+{
+  return _dbus_string_find (&client->buffer, 0, "\r\n\r\n", NULL) ||
+    _dbus_string_find (&client->buffer, 0, "\n\n", NULL);
+}
+
+static dbus_bool_t
+stats_client_build_response (BusStatsClient *client)
+{
+  DBusString body;
+  dbus_bool_t is_get;
+
+  is_get = _dbus_string_starts_with_c_str (&client->buffer, "GET ");
+
+  _dbus_string_set_length (&client->buffer, 0);
+
+  if (!is_get)
+    return _dbus_string_append (&client->buffer,
+                                "HTTP/1.0 405 Method Not Allowed\r\n"
+                                "Allow: GET\r\n"
+                                "Connection: close\r\n"
+                                "Content-Length: 0\r\n\r\n");
+
+  if (!_dbus_string_init (&body))
+    return FALSE;
+
+  if (!bus_stats_append_openmetrics (client->server->context, &body) ||
+      !_dbus_string_append_printf (&client->buffer,
+          "HTTP/1.0 200 OK\r\n"
+          "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+          "Connection: close\r\n"
+          "Content-Length: %d\r\n\r\n",
+          _dbus_string_get_length (&body)) ||
+      !_dbus_string_copy (&body, 0, &client->buffer,
+                          _dbus_string_get_length (&client->buffer)))
+    {
+      _dbus_string_free (&body);
+      return FALSE;
+    }
+
+  _dbus_string_free (&body);
+  return TRUE;
+}
+
+/* Returns #FALSE if the client should be disconnected */
+static dbus_bool_t
+stats_client_read (BusStatsClient *client)
+{
+  int bytes_read;
+  int saved_errno;
+
+  bytes_read = _dbus_read_socket (client->fd, &client->buffer,
+                                  MAX_REQUEST_LENGTH -
+                                  _dbus_string_get_length (&client->buffer));
+  saved_errno = _dbus_save_socket_errno ();
+
+  if (bytes_read < 0)
+    return _dbus_get_is_errno_eagain_or_ewouldblock (saved_errno);
+
+  if (bytes_read == 0)
+    return FALSE;
+
+  if (stats_client_have_request (client))
+    {
+      if (!stats_client_build_response (client))
+        {
+          _dbus_verbose ("No memory to answer statistics request\n");
+          return FALSE;
+        }
+
+      client->writing = TRUE;
+      client->n_written = 0;
+    }
+  else if (_dbus_string_get_length (&client->buffer) >= MAX_REQUEST_LENGTH)
+    {
+      _dbus_verbose ("Statistics request too long, disconnecting\n");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Returns #FALSE if the client should be disconnected */
+static dbus_bool_t
+stats_client_write (BusStatsClient *client)
+{
+  int bytes_written;
+  int saved_errno;
+
+  bytes_written = _dbus_write_socket (client->fd, &client->buffer,
+                                      client->n_written,
+                                      _dbus_string_get_length (&client->buffer) -
+                                      client->n_written);
+  saved_errno = _dbus_save_socket_errno ();
+
+  if (bytes_written < 0)
+    return _dbus_get_is_errno_eagain_or_ewouldblock (saved_errno);
+
+  client->n_written += bytes_written;
+
+  return client->n_written < _dbus_string_get_length (&client->buffer);
+}
+
+static dbus_bool_t
+stats_client_handle_watch (DBusWatch    *watch,
+                           unsigned int  flags,
+                           void         *data)
+{
+  BusStatsClient *client = data;
+
+  if (flags & (DBUS_WATCH_ERROR | DBUS_WATCH_HANGUP))
+    goto disconnect;
+
+  if (!client->writing)
+    {
+      if (!stats_client_read (client))
+        goto disconnect;
+
+      if (!client->writing)
+        return TRUE;
+
+      /* the response usually fits in the socket buffer, so only wait
+       * for the socket to become writable if it didn't */
+      if (!stats_client_write (client))
+        goto disconnect;
+
+      if (!stats_client_set_watch (client, DBUS_WATCH_WRITABLE))
+        goto disconnect;
+
+      return TRUE;
+    }
+
+  if (!stats_client_write (client))
+    goto disconnect;
+
+  return TRUE;
+
+disconnect:
+  stats_client_free (client);
+  return TRUE;
+}
+
+static dbus_bool_t
+stats_server_handle_watch (DBusWatch    *watch,
+                           unsigned int  flags,
+                           void         *data)
+{
+  BusStatsServer *server = data;
+  BusStatsClient *client;
+  DBusSocket client_fd;
+  int saved_errno;
+
+  if (!(flags & DBUS_WATCH_READABLE))
+    return TRUE;
+
+  client_fd = _dbus_accept (_dbus_watch_get_socket (watch));
+  saved_errno = _dbus_save_socket_errno ();
+
+  if (!_dbus_socket_is_valid (client_fd))
+    {
+      if (!_dbus_get_is_errno_eagain_or_ewouldblock (saved_errno))
+        _dbus_verbose ("Failed to accept a statistics client: %s\n",
+                       _dbus_strerror (saved_errno));
+      return TRUE;
+    }
+
+  if (!_dbus_set_socket_nonblocking (client_fd, NULL))
+    goto failed;
+
+  if (server->n_clients >= MAX_CLIENTS)
+    stats_client_free (_dbus_list_get_first (&server->clients));
+
+  client = dbus_new0 (BusStatsClient, 1);
+  if (client == NULL)
+    goto failed;
+
+  if (!_dbus_string_init (&client->buffer))
+    {
+      dbus_free (client);
+      goto failed;
+    }
+
+  if (!_dbus_list_append (&server->clients, client))
+    {
+      _dbus_string_free (&client->buffer);
+      dbus_free (client);
+      goto failed;
+    }
+
+  client->server = server;
+  client->fd = client_fd;
+  server->n_clients += 1;
+
+  if (!stats_client_set_watch (client, DBUS_WATCH_READABLE))
+    stats_client_free (client);
+
+  return TRUE;
+
+failed:
+  _dbus_verbose ("Rejected statistics client due to lack of memory\n");
+  _dbus_close_socket (client_fd, NULL);
+  return TRUE;
+}
+
+static dbus_bool_t
+stats_server_listen (BusStatsServer *server,
+                     const char     *address,
+                     DBusError      *error)
+{
+  DBusAddressEntry **entries;
+  const char *method;
+  int n_entries;
+  dbus_bool_t retval;
+
+  if (!dbus_parse_address (address, &entries, &n_entries, error))
+    return FALSE;
+
+  retval = FALSE;
+  method = dbus_address_entry_get_method (entries[0]);
+
+  if (n_entries != 1)
+    {
+      dbus_set_error (error, DBUS_ERROR_BAD_ADDRESS,
+                      "<stats_listen> takes a single address, not \"%s\"",
+                      address);
+    }
+  else if (strcmp (method, "tcp") == 0)
+    {
+      const char *host, *port, *family;
+      DBusString port_str;
+
+      host = dbus_address_entry_get_value (entries[0], "host");
+      port = dbus_address_entry_get_value (entries[0], "port");
+      family = dbus_address_entry_get_value (entries[0], "family");
+
+      if (!_dbus_string_init (&port_str))
+        {
+          BUS_SET_OOM (error);
+          goto out;
+        }
+
+      server->n_fds = _dbus_listen_tcp_socket (host ? host : "localhost",
+                                               port ? port : "0", family,
+                                               &port_str, &server->fds,
+                                               error);
+      _dbus_string_free (&port_str);
+
+      retval = server->n_fds > 0;
+    }
+#ifdef DBUS_UNIX
+  else if (strcmp (method, "unix") == 0 &&
+           dbus_address_entry_get_value (entries[0], "path") != NULL)
+    {
+      const char *path;
+      int fd;
+
+      path = dbus_address_entry_get_value (entries[0], "path");
+
+      server->socket_path = _dbus_strdup (path);
+      server->fds = dbus_new (DBusSocket, 1);
+      if (server->socket_path == NULL || server->fds == NULL)
+        {
+          BUS_SET_OOM (error);
+          goto out;
+        }
+
+      fd = _dbus_listen_unix_socket (path, FALSE, error);
+      if (fd < 0)
+        goto out;
+
+      server->fds[0].fd = fd;
+      server->n_fds = 1;
+      retval = TRUE;
+    }
+#endif
+  else
+    {
+      dbus_set_error (error, DBUS_ERROR_BAD_ADDRESS,
+                      "Unsupported <stats_listen> address \"%s\"", address);
+    }
+
+out:
+  dbus_address_entries_free (entries);
+  return retval;
+}
+
+/**
+ * Starts serving the bus statistics as OpenMetrics text over HTTP on
+ * the given address, which may be tcp:host=...,port=... or, on Unix,
+ * unix:path=....
+ *
+ * @param context the bus context
+ * @param address the address to listen on
+ * @param error return location for errors
+ * @returns the new server, or #NULL on error
+ */
+BusStatsServer *
+bus_stats_server_new (BusContext *context,
+                      const char *address,
+                      DBusError  *error)
+{
+  BusStatsServer *server;
+  int i;
+
+  server = dbus_new0 (BusStatsServer, 1);
+  if (server == NULL)
+    {
+      BUS_SET_OOM (error);
+      return NULL;
+    }
+
+  server->context = context;
+
+  if (!stats_server_listen (server, address, error))
+    goto failed;
+
+  server->watches = dbus_new0 (DBusWatch *, server->n_fds);
+  if (server->watches == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  for (i = 0; i < server->n_fds; i++)
+    {
+      server->watches[i] =
+        _dbus_watch_new (_dbus_socket_get_pollable (server->fds[i]),
+                         DBUS_WATCH_READABLE, TRUE,
+                         stats_server_handle_watch, server, NULL);
+
+      if (server->watches[i] == NULL ||
+          !_dbus_loop_add_watch (server_get_loop (server),
+                                 server->watches[i]))
+        {
+          if (server->watches[i] != NULL)
+            {
+              _dbus_watch_invalidate (server->watches[i]);
+              _dbus_watch_unref (server->watches[i]);
+              server->watches[i] = NULL;
+            }
+
+          BUS_SET_OOM (error);
+          goto failed;
+        }
+    }
+
+  _dbus_verbose ("Serving statistics on %s\n", address);
+  return server;
+
+failed:
+  bus_stats_server_free (server);
+  return NULL;
+}
+
+void
+bus_stats_server_free (BusStatsServer *server)
+{
+  int i;
+
+  while (server->clients != NULL)
+    stats_client_free (server->clients->data);
+
+  for (i = 0; i < server->n_fds; i++)
+    {
+      if (server->watches != NULL && server->watches[i] != NULL)
+        {
+          _dbus_loop_remove_watch (server_get_loop (server),
+                                   server->watches[i]);
+          _dbus_watch_invalidate (server->watches[i]);
+          _dbus_watch_unref (server->watches[i]);
+        }
+
+      _dbus_close_socket (server->fds[i], NULL);
+    }
+
+  if (server->socket_path != NULL && server->n_fds > 0)
+    {
+      DBusString path;
+
+      _dbus_string_init_const (&path, server->socket_path);
+      _dbus_delete_file (&path, NULL);
+    }
+
+  dbus_free (server->watches);
+  dbus_free (server->fds);
+  dbus_free (server->socket_path);
+  dbus_free (server);
+}
+
+#endif /* DBUS_ENABLE_STATS */
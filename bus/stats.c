@@ -25,8 +25,10 @@
 #include "stats.h"
 
 #include <dbus/dbus-asv-util.h>
+#include <dbus/dbus-hash.h>
 #include <dbus/dbus-internals.h>
 #include <dbus/dbus-connection-internal.h>
+#include <dbus/dbus-message-internal.h>
 
 #include "connection.h"
 #include "driver.h"
@@ -34,8 +36,340 @@
 #include "signals.h"
 #include "utils.h"
 
+#include <string.h>
+
 #ifdef DBUS_ENABLE_STATS
 
+/*
+ * Buckets are log-linear, as in HDR histograms: values below
+ * BUS_LATENCY_SUB_BUCKETS get a bucket each, and every power of two
+ * above that is split into BUS_LATENCY_SUB_BUCKETS equal buckets, so
+ * the relative error stays below 1/BUS_LATENCY_SUB_BUCKETS.
+ */
+static int
+latency_bucket (dbus_uint32_t usec)
+{
+  int magnitude;
+
+  if (usec < BUS_LATENCY_SUB_BUCKETS)
+    return usec;
+
+  magnitude = 0;
+  while ((usec >> magnitude) >= 2 * BUS_LATENCY_SUB_BUCKETS)
+    magnitude++;
+
+  return BUS_LATENCY_SUB_BUCKETS * (magnitude + 1) +
+    (usec >> magnitude) - BUS_LATENCY_SUB_BUCKETS;
+}
+
+static dbus_uint32_t
+latency_bucket_lower_bound (int bucket)
+{
+  int magnitude;
+
+  if (bucket < BUS_LATENCY_SUB_BUCKETS)
+    return bucket;
+
+  magnitude = bucket / BUS_LATENCY_SUB_BUCKETS - 1;
+
+  return (dbus_uint32_t) (BUS_LATENCY_SUB_BUCKETS +
+                          bucket % BUS_LATENCY_SUB_BUCKETS) << magnitude;
+}
+
+/**
+ * Adds the time elapsed since the given monotonic time to a histogram.
+ *
+ * @param histogram the histogram
+ * @param start_tv_sec seconds part of when the timed operation started
+ * @param start_tv_usec microseconds part of when it started
+ */
+void
+bus_latency_histogram_record (BusLatencyHistogram *histogram,
+                              long                 start_tv_sec,
+                              long                 start_tv_usec)
+{
+  long tv_sec, tv_usec;
+  long elapsed;
+  dbus_uint32_t usec;
+
+  _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+
+  elapsed = tv_sec - start_tv_sec;
+
+  if (elapsed >= _DBUS_UINT32_MAX / _DBUS_USEC_PER_SECOND)
+    usec = _DBUS_UINT32_MAX;
+  else if (elapsed < 0)
+    usec = 0;
+  else
+    {
+      elapsed = elapsed * _DBUS_USEC_PER_SECOND + tv_usec - start_tv_usec;
+      usec = elapsed < 0 ? 0 : elapsed;
+    }
+
+  histogram->count += 1;
+  histogram->total_usec += usec;
+
+  if (usec > histogram->max_usec)
+    histogram->max_usec = usec;
+
+  histogram->buckets[latency_bucket (usec)] += 1;
+}
+
+/*
+ * Top talkers are counted with the space-saving algorithm (Metwally,
+ * Agrawal and El Abbadi, 2005): a fixed number of counters, each
+ * keyed by "sender interface member". A key without a counter takes
+ * over the smallest one, inheriting its count as the possible
+ * overestimate. Any key sent more often than 1/capacity of all
+ * messages is guaranteed to have a counter.
+ */
+typedef struct
+{
+  char *key;              /**< "sender interface member", or NULL if unused */
+  dbus_uint64_t messages; /**< Messages counted, an upper bound */
+  dbus_uint64_t bytes;    /**< Bytes counted, an upper bound */
+  dbus_uint64_t error;    /**< How much messages may overestimate */
+} BusTalker;
+
+struct BusTopTalkers
+{
+  DBusHashTable *index;   /**< key => BusTalker in talkers */
+  BusTalker talkers[BUS_TOP_TALKERS_CAPACITY];
+  int n_talkers;          /**< Number of talkers ever used */
+  dbus_uint64_t total_messages;  /**< Every message recorded, counted or not */
+  dbus_uint64_t total_bytes;     /**< Their total size */
+};
+
+BusTopTalkers *
+bus_top_talkers_new (void)
+{
+  BusTopTalkers *talkers;
+
+  talkers = dbus_new0 (BusTopTalkers, 1);
+  if (talkers == NULL)
+    return NULL;
+
+  /* keys are owned by the BusTalker */
+  talkers->index = _dbus_hash_table_new (DBUS_HASH_STRING, NULL, NULL);
+  if (talkers->index == NULL)
+    {
+      dbus_free (talkers);
+      return NULL;
+    }
+
+  return talkers;
+}
+
+void
+bus_top_talkers_free (BusTopTalkers *talkers)
+{
+  int i;
+
+  for (i = 0; i < talkers->n_talkers; i++)
+    dbus_free (talkers->talkers[i].key);
+
+  _dbus_hash_table_unref (talkers->index);
+  dbus_free (talkers);
+}
+
+static BusTalker *
+top_talkers_take_counter (BusTopTalkers *talkers,
+                          const char    *key)
+{
+  BusTalker *talker;
+  char *copy;
+  int i;
+
+  copy = _dbus_strdup (key);
+  if (copy == NULL)
+    return NULL;
+
+  if (talkers->n_talkers < BUS_TOP_TALKERS_CAPACITY)
+    {
+      talker = &talkers->talkers[talkers->n_talkers];
+      talkers->n_talkers += 1;
+    }
+  else
+    {
+      talker = &talkers->talkers[0];
+
+      for (i = 1; i < BUS_TOP_TALKERS_CAPACITY; i++)
+        {
+          if (talkers->talkers[i].messages < talker->messages)
+            talker = &talkers->talkers[i];
+        }
+
+      if (talker->key != NULL)
+        {
+          _dbus_hash_table_remove_string (talkers->index, talker->key);
+          dbus_free (talker->key);
+        }
+
+      talker->error = talker->messages;
+    }
+
+  talker->key = copy;
+
+  if (!_dbus_hash_table_insert_string (talkers->index, talker->key, talker))
+    {
+      /* give the counter up, so it is the first to be taken next time */
+      dbus_free (talker->key);
+      talker->key = NULL;
+      talker->messages = 0;
+      talker->bytes = 0;
+      talker->error = 0;
+      return NULL;
+    }
+
+  return talker;
+}
+
+/**
+ * Counts a message towards the top talkers, keyed by its sender,
+ * interface and member. Messages are silently not counted if memory
+ * runs out.
+ *
+ * @param talkers the top talkers
+ * @param message a message that has a sender
+ */
+void
+bus_top_talkers_record (BusTopTalkers *talkers,
+                        DBusMessage   *message)
+{
+  char key[3 * (DBUS_MAXIMUM_NAME_LENGTH + 1)];
+  const char *parts[3];
+  BusTalker *talker;
+  int len, i;
+
+  parts[0] = dbus_message_get_sender (message);
+  parts[1] = dbus_message_get_interface (message);
+  parts[2] = dbus_message_get_member (message);
+
+  talkers->total_messages += 1;
+  talkers->total_bytes += _dbus_message_get_size (message);
+
+  /* none of these can contain a space, so it makes the key unambiguous */
+  len = 0;
+  for (i = 0; i < 3; i++)
+    {
+      size_t part_len;
+
+      part_len = parts[i] == NULL ? 0 : strlen (parts[i]);
+      _dbus_assert (part_len <= DBUS_MAXIMUM_NAME_LENGTH);
+
+      if (part_len > 0)
+        memcpy (key + len, parts[i], part_len);
+
+      len += part_len;
+      key[len++] = i < 2 ? ' ' : '\0';
+    }
+
+  talker = _dbus_hash_table_lookup_string (talkers->index, key);
+  if (talker == NULL)
+    {
+      talker = top_talkers_take_counter (talkers, key);
+      if (talker == NULL)
+        return;
+    }
+
+  talker->messages += 1;
+  talker->bytes += _dbus_message_get_size (message);
+}
+
+/**
+ * Gets how many messages have been recorded in total, and their total
+ * size, including those that no counter could be found for.
+ *
+ * @param talkers the top talkers
+ * @param messages return location for the number of messages
+ * @param bytes return location for the number of bytes
+ */
+void
+bus_top_talkers_get_totals (BusTopTalkers *talkers,
+                            dbus_uint64_t *messages,
+                            dbus_uint64_t *bytes)
+{
+  *messages = talkers->total_messages;
+  *bytes = talkers->total_bytes;
+}
+
+/* GetStats keys for each BusStartupPhase */
+static const char * const startup_phase_keys[] = {
+  "StartupConfigNanoseconds",
+  "StartupIncludedirNanoseconds",
+  "StartupListenNanoseconds",
+  "StartupServiceFilesNanoseconds",
+  "StartupDaemonizeNanoseconds",
+  "StartupSecurityNanoseconds",
+  "StartupWatchNanoseconds",
+  "StartupFinishNanoseconds"
+};
+
+_DBUS_STATIC_ASSERT (_DBUS_N_ELEMENTS (startup_phase_keys) ==
+                     BUS_N_STARTUP_PHASES);
+
+static dbus_bool_t
+append_startup_stats (DBusMessageIter *arr_iter,
+                      BusContext      *context)
+{
+  int phase;
+
+  for (phase = 0; phase < BUS_N_STARTUP_PHASES; phase++)
+    {
+      if (!_dbus_asv_add_uint64 (arr_iter, startup_phase_keys[phase],
+                                 bus_context_get_startup_time (context, phase)))
+        return FALSE;
+    }
+
+  return _dbus_asv_add_uint64 (arr_iter, "StartupReadyNanoseconds",
+                               bus_context_get_ready_time (context)) &&
+    _dbus_asv_add_uint64 (arr_iter, "StartupCompleteNanoseconds",
+                          bus_context_get_started_time (context));
+}
+
+/* Adds <Tag>MemoryBytes and <Tag>MemoryBlocks for each subsystem */
+static dbus_bool_t
+append_memory_stats (DBusMessageIter *arr_iter)
+{
+  DBusString key;
+  int tag;
+
+  if (!_dbus_string_init (&key))
+    return FALSE;
+
+  for (tag = 0; tag < _DBUS_N_MEMORY_TAGS; tag++)
+    {
+      const char *name;
+      size_t bytes;
+      dbus_uint32_t blocks;
+
+      name = _dbus_memory_get_tag_stats (tag, &bytes, &blocks);
+
+      _dbus_string_set_length (&key, 0);
+
+      if (!_dbus_string_append (&key, name) ||
+          !_dbus_string_append (&key, "MemoryBytes") ||
+          !_dbus_asv_add_uint64 (arr_iter, _dbus_string_get_const_data (&key),
+                                 bytes))
+        goto oom;
+
+      _dbus_string_set_length (&key, 0);
+
+      if (!_dbus_string_append (&key, name) ||
+          !_dbus_string_append (&key, "MemoryBlocks") ||
+          !_dbus_asv_add_uint32 (arr_iter, _dbus_string_get_const_data (&key),
+                                 blocks))
+        goto oom;
+    }
+
+  _dbus_string_free (&key);
+  return TRUE;
+
+oom:
+  _dbus_string_free (&key);
+  return FALSE;
+}
+
 dbus_bool_t
 bus_stats_handle_get_stats (DBusConnection *connection,
                             BusTransaction *transaction,
@@ -48,6 +382,8 @@ bus_stats_handle_get_stats (DBusConnection *connection,
   DBusMessageIter iter, arr_iter;
   static dbus_uint32_t stats_serial = 0;
   dbus_uint32_t in_use, in_free_list, allocated;
+  dbus_uint32_t cache_hits, cache_misses, cached;
+  dbus_uint32_t pool_hits, pool_misses, pool_cached, pool_used;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
@@ -65,11 +401,21 @@ bus_stats_handle_get_stats (DBusConnection *connection,
   /* Globals */
 
   _dbus_list_get_stats (&in_use, &in_free_list, &allocated);
+  _dbus_message_get_cache_stats (&cache_hits, &cache_misses, &cached);
+  _dbus_message_get_body_pool_stats (&pool_hits, &pool_misses, &pool_cached,
+                                     &pool_used);
 
   if (!_dbus_asv_add_uint32 (&arr_iter, "Serial", stats_serial++) ||
       !_dbus_asv_add_uint32 (&arr_iter, "ListMemPoolUsedBytes", in_use) ||
       !_dbus_asv_add_uint32 (&arr_iter, "ListMemPoolCachedBytes", in_free_list) ||
-      !_dbus_asv_add_uint32 (&arr_iter, "ListMemPoolAllocatedBytes", allocated))
+      !_dbus_asv_add_uint32 (&arr_iter, "ListMemPoolAllocatedBytes", allocated) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "MessageCacheHits", cache_hits) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "MessageCacheMisses", cache_misses) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "MessageCacheSize", cached) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "MessageBodyPoolHits", pool_hits) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "MessageBodyPoolMisses", pool_misses) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "MessageBodyPoolCachedBytes", pool_cached) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "MessageBodyPoolUsedBytes", pool_used))
     {
       _dbus_asv_abandon (&iter, &arr_iter);
       goto oom;
@@ -85,14 +431,37 @@ bus_stats_handle_get_stats (DBusConnection *connection,
         bus_connections_get_total_match_rules (connections)) ||
       !_dbus_asv_add_uint32 (&arr_iter, "PeakMatchRules",
         bus_connections_get_peak_match_rules (connections)) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "MatchRuleBytes",
+        bus_connections_get_total_match_rule_bytes (connections)) ||
       !_dbus_asv_add_uint32 (&arr_iter, "PeakMatchRulesPerConnection",
         bus_connections_get_peak_match_rules_per_conn (connections)) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "DistinctMatchRules",
+        bus_matchmaker_get_n_distinct_rules (
+            bus_context_get_matchmaker (context))) ||
       !_dbus_asv_add_uint32 (&arr_iter, "BusNames",
         bus_connections_get_total_bus_names (connections)) ||
       !_dbus_asv_add_uint32 (&arr_iter, "PeakBusNames",
         bus_connections_get_peak_bus_names (connections)) ||
       !_dbus_asv_add_uint32 (&arr_iter, "PeakBusNamesPerConnection",
-        bus_connections_get_peak_bus_names_per_conn (connections)))
+        bus_connections_get_peak_bus_names_per_conn (connections)) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "MonitorDroppedMessages",
+        bus_connections_get_n_monitor_dropped (connections)))
+    {
+      _dbus_asv_abandon (&iter, &arr_iter);
+      goto oom;
+    }
+
+  /* Memory by subsystem */
+
+  if (!append_memory_stats (&arr_iter))
+    {
+      _dbus_asv_abandon (&iter, &arr_iter);
+      goto oom;
+    }
+
+  /* How long starting up took */
+
+  if (!append_startup_stats (&arr_iter, context))
     {
       _dbus_asv_abandon (&iter, &arr_iter);
       goto oom;
@@ -117,6 +486,94 @@ oom:
   return FALSE;
 }
 
+/* Groups of per-connection stats, for the field mask of
+ * GetAllConnectionStats */
+#define CONNECTION_STATS_BUS          (1 << 0) /**< Match rules, names */
+#define CONNECTION_STATS_INCOMING     (1 << 1) /**< Messages it sent us */
+#define CONNECTION_STATS_OUTGOING     (1 << 2) /**< Messages queued for it */
+#define CONNECTION_STATS_BUFFERS      (1 << 3) /**< Memory of its buffers */
+#define CONNECTION_STATS_COMPRESSION  (1 << 4) /**< If it negotiated compression */
+#define CONNECTION_STATS_ALL          ((1 << 5) - 1)
+
+static dbus_bool_t
+append_connection_stats (DBusMessageIter *arr_iter,
+                         DBusConnection  *stats_connection,
+                         dbus_uint32_t    fields)
+{
+  dbus_uint32_t in_messages, in_bytes, in_fds, in_peak_bytes, in_peak_fds;
+  dbus_uint32_t out_messages, out_bytes, out_fds, out_peak_bytes, out_peak_fds;
+  dbus_uint32_t in_throttles;
+  dbus_uint64_t in_total_bytes, out_total_bytes;
+  dbus_uint64_t in_wire_bytes, in_plain_bytes, out_wire_bytes, out_plain_bytes;
+
+  /* Bus daemon per-connection stats */
+
+  if ((fields & CONNECTION_STATS_BUS) &&
+      (!_dbus_asv_add_uint32 (arr_iter, "MatchRules",
+         bus_connection_get_n_match_rules (stats_connection)) ||
+       !_dbus_asv_add_uint32 (arr_iter, "PeakMatchRules",
+         bus_connection_get_peak_match_rules (stats_connection)) ||
+       !_dbus_asv_add_uint32 (arr_iter, "BusNames",
+         bus_connection_get_n_services_owned (stats_connection)) ||
+       !_dbus_asv_add_uint32 (arr_iter, "PeakBusNames",
+         bus_connection_get_peak_bus_names (stats_connection)) ||
+       !_dbus_asv_add_string (arr_iter, "UniqueName",
+         bus_connection_get_name (stats_connection))))
+    return FALSE;
+
+  /* DBusConnection per-connection stats */
+
+  _dbus_connection_get_stats (stats_connection,
+                              &in_messages, &in_bytes, &in_fds,
+                              &in_peak_bytes, &in_peak_fds,
+                              &in_total_bytes, &in_throttles,
+                              &out_messages, &out_bytes, &out_fds,
+                              &out_peak_bytes, &out_peak_fds,
+                              &out_total_bytes);
+
+  if ((fields & CONNECTION_STATS_INCOMING) &&
+      (!_dbus_asv_add_uint32 (arr_iter, "IncomingMessages", in_messages) ||
+       !_dbus_asv_add_uint32 (arr_iter, "IncomingBytes", in_bytes) ||
+       !_dbus_asv_add_uint32 (arr_iter, "IncomingFDs", in_fds) ||
+       !_dbus_asv_add_uint32 (arr_iter, "PeakIncomingBytes", in_peak_bytes) ||
+       !_dbus_asv_add_uint32 (arr_iter, "PeakIncomingFDs", in_peak_fds) ||
+       !_dbus_asv_add_uint64 (arr_iter, "TotalIncomingBytes", in_total_bytes) ||
+       !_dbus_asv_add_uint32 (arr_iter, "IncomingThrottles", in_throttles)))
+    return FALSE;
+
+  if ((fields & CONNECTION_STATS_OUTGOING) &&
+      (!_dbus_asv_add_uint32 (arr_iter, "OutgoingMessages", out_messages) ||
+       !_dbus_asv_add_uint32 (arr_iter, "OutgoingBytes", out_bytes) ||
+       !_dbus_asv_add_uint32 (arr_iter, "OutgoingFDs", out_fds) ||
+       !_dbus_asv_add_uint32 (arr_iter, "PeakOutgoingBytes", out_peak_bytes) ||
+       !_dbus_asv_add_uint32 (arr_iter, "PeakOutgoingFDs", out_peak_fds) ||
+       !_dbus_asv_add_uint64 (arr_iter, "TotalOutgoingBytes", out_total_bytes) ||
+       !_dbus_asv_add_uint32 (arr_iter, "OutgoingExpiredBroadcasts",
+         _dbus_connection_get_n_expired_broadcasts (stats_connection)) ||
+       !_dbus_asv_add_uint32 (arr_iter, "OutgoingWriteBlocks",
+         _dbus_connection_get_n_write_blocks (stats_connection))))
+    return FALSE;
+
+  if ((fields & CONNECTION_STATS_BUFFERS) &&
+      !_dbus_asv_add_uint32 (arr_iter, "BufferBytes",
+         _dbus_connection_get_buffer_bytes (stats_connection)))
+    return FALSE;
+
+  /* Only for connections that negotiated compression; the ratio of
+   * each pair is how well it is working */
+  if ((fields & CONNECTION_STATS_COMPRESSION) &&
+      _dbus_connection_get_compression_stats (stats_connection,
+                                              &in_wire_bytes, &in_plain_bytes,
+                                              &out_wire_bytes, &out_plain_bytes) &&
+      (!_dbus_asv_add_uint64 (arr_iter, "CompressedIncomingBytes", in_wire_bytes) ||
+       !_dbus_asv_add_uint64 (arr_iter, "UncompressedIncomingBytes", in_plain_bytes) ||
+       !_dbus_asv_add_uint64 (arr_iter, "CompressedOutgoingBytes", out_wire_bytes) ||
+       !_dbus_asv_add_uint64 (arr_iter, "UncompressedOutgoingBytes", out_plain_bytes)))
+    return FALSE;
+
+  return TRUE;
+}
+
 dbus_bool_t
 bus_stats_handle_get_connection_stats (DBusConnection *caller_connection,
                                        BusTransaction *transaction,
@@ -128,8 +585,6 @@ bus_stats_handle_get_connection_stats (DBusConnection *caller_connection,
   DBusMessage *reply = NULL;
   DBusMessageIter iter, arr_iter;
   static dbus_uint32_t stats_serial = 0;
-  dbus_uint32_t in_messages, in_bytes, in_fds, in_peak_bytes, in_peak_fds;
-  dbus_uint32_t out_messages, out_bytes, out_fds, out_peak_bytes, out_peak_fds;
   BusRegistry *registry;
   BusService *service;
   DBusConnection *stats_connection;
@@ -164,42 +619,9 @@ bus_stats_handle_get_connection_stats (DBusConnection *caller_connection,
   if (reply == NULL)
     goto oom;
 
-  /* Bus daemon per-connection stats */
-
   if (!_dbus_asv_add_uint32 (&arr_iter, "Serial", stats_serial++) ||
-      !_dbus_asv_add_uint32 (&arr_iter, "MatchRules",
-        bus_connection_get_n_match_rules (stats_connection)) ||
-      !_dbus_asv_add_uint32 (&arr_iter, "PeakMatchRules",
-        bus_connection_get_peak_match_rules (stats_connection)) ||
-      !_dbus_asv_add_uint32 (&arr_iter, "BusNames",
-        bus_connection_get_n_services_owned (stats_connection)) ||
-      !_dbus_asv_add_uint32 (&arr_iter, "PeakBusNames",
-        bus_connection_get_peak_bus_names (stats_connection)) ||
-      !_dbus_asv_add_string (&arr_iter, "UniqueName",
-        bus_connection_get_name (stats_connection)))
-    {
-      _dbus_asv_abandon (&iter, &arr_iter);
-      goto oom;
-    }
-
-  /* DBusConnection per-connection stats */
-
-  _dbus_connection_get_stats (stats_connection,
-                              &in_messages, &in_bytes, &in_fds,
-                              &in_peak_bytes, &in_peak_fds,
-                              &out_messages, &out_bytes, &out_fds,
-                              &out_peak_bytes, &out_peak_fds);
-
-  if (!_dbus_asv_add_uint32 (&arr_iter, "IncomingMessages", in_messages) ||
-      !_dbus_asv_add_uint32 (&arr_iter, "IncomingBytes", in_bytes) ||
-      !_dbus_asv_add_uint32 (&arr_iter, "IncomingFDs", in_fds) ||
-      !_dbus_asv_add_uint32 (&arr_iter, "PeakIncomingBytes", in_peak_bytes) ||
-      !_dbus_asv_add_uint32 (&arr_iter, "PeakIncomingFDs", in_peak_fds) ||
-      !_dbus_asv_add_uint32 (&arr_iter, "OutgoingMessages", out_messages) ||
-      !_dbus_asv_add_uint32 (&arr_iter, "OutgoingBytes", out_bytes) ||
-      !_dbus_asv_add_uint32 (&arr_iter, "OutgoingFDs", out_fds) ||
-      !_dbus_asv_add_uint32 (&arr_iter, "PeakOutgoingBytes", out_peak_bytes) ||
-      !_dbus_asv_add_uint32 (&arr_iter, "PeakOutgoingFDs", out_peak_fds))
+      !append_connection_stats (&arr_iter, stats_connection,
+                                CONNECTION_STATS_ALL))
     {
       _dbus_asv_abandon (&iter, &arr_iter);
       goto oom;
@@ -225,102 +647,99 @@ oom:
   return FALSE;
 }
 
-
+/*
+ * GetAllConnectionStats (u fields) -> a(sa{sv})
+ *
+ * What GetConnectionStats returns, for every active connection in
+ * one pass, keyed by unique name. fields is a mask of the
+ * CONNECTION_STATS_ groups to include, or 0 for all of them.
+ */
 dbus_bool_t
-bus_stats_handle_get_all_match_rules (DBusConnection *caller_connection,
-                                      BusTransaction *transaction,
-                                      DBusMessage    *message,
-                                      DBusError      *error)
+bus_stats_handle_get_all_connection_stats (DBusConnection *caller_connection,
+                                           BusTransaction *transaction,
+                                           DBusMessage    *message,
+                                           DBusError      *error)
 {
-  BusContext *context;
-  DBusString bus_name_str;
+  BusConnections *connections;
+  DBusConnection *stats_connection;
   DBusMessage *reply = NULL;
-  DBusMessageIter iter, hash_iter, entry_iter, arr_iter;
-  BusRegistry *registry;
-  char **services = NULL;
-  int services_len;
-  DBusConnection *conn_filter = NULL;
-  BusMatchmaker *matchmaker;
-  int i;
+  DBusMessageIter iter, struct_arr_iter, struct_iter, arr_iter;
+  dbus_uint32_t fields;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
-  registry = bus_connection_get_registry (caller_connection);
-  context = bus_transaction_get_context (transaction);
-  matchmaker = bus_context_get_matchmaker (context);
+  if (!bus_driver_check_message_is_for_us (message, error))
+    return FALSE;
 
-  if (!bus_registry_list_services (registry, &services, &services_len))
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_UINT32, &fields,
+                              DBUS_TYPE_INVALID))
     return FALSE;
 
+  if (fields == 0)
+    fields = CONNECTION_STATS_ALL;
+
+  connections = bus_connection_get_connections (caller_connection);
+
   reply = dbus_message_new_method_return (message);
   if (reply == NULL)
     goto oom;
 
   dbus_message_iter_init_append (reply, &iter);
 
-  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "{sas}",
-                                         &hash_iter))
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(sa{sv})",
+                                         &struct_arr_iter))
     goto oom;
 
-  for (i = 0 ; i < services_len ; i++)
+  for (stats_connection = bus_connections_get_active_after (connections, "",
+                                                            NULL);
+       stats_connection != NULL;
+       stats_connection = bus_connections_get_next_active (connections,
+                                                           stats_connection))
     {
-      BusService *service;
-
-      /* To avoid duplicate entries, only look for unique names */
-      if (services[i][0] != ':')
-        continue;
-
-      _dbus_string_init_const (&bus_name_str, services[i]);
-      service = bus_registry_lookup (registry, &bus_name_str);
-      _dbus_assert (service != NULL);
+      const char *name = bus_connection_get_name (stats_connection);
 
-      conn_filter = bus_service_get_primary_owners_connection (service);
-      _dbus_assert (conn_filter != NULL);
-
-      if (!dbus_message_iter_open_container (&hash_iter, DBUS_TYPE_DICT_ENTRY, NULL,
-                                             &entry_iter))
+      if (!dbus_message_iter_open_container (&struct_arr_iter,
+                                             DBUS_TYPE_STRUCT, NULL,
+                                             &struct_iter))
         {
-          dbus_message_iter_abandon_container (&iter, &hash_iter);
+          dbus_message_iter_abandon_container (&iter, &struct_arr_iter);
           goto oom;
         }
 
-      if (!dbus_message_iter_append_basic (&entry_iter, DBUS_TYPE_STRING, &services[i]))
+      if (!dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+                                           &name) ||
+          !dbus_message_iter_open_container (&struct_iter, DBUS_TYPE_ARRAY,
+                                             "{sv}", &arr_iter))
         {
-          dbus_message_iter_abandon_container (&hash_iter, &entry_iter);
-          dbus_message_iter_abandon_container (&iter, &hash_iter);
+          dbus_message_iter_abandon_container (&struct_arr_iter, &struct_iter);
+          dbus_message_iter_abandon_container (&iter, &struct_arr_iter);
           goto oom;
         }
 
-      if (!dbus_message_iter_open_container (&entry_iter, DBUS_TYPE_ARRAY, "s",
-                                             &arr_iter))
+      if (!append_connection_stats (&arr_iter, stats_connection, fields))
         {
-          dbus_message_iter_abandon_container (&hash_iter, &entry_iter);
-          dbus_message_iter_abandon_container (&iter, &hash_iter);
+          dbus_message_iter_abandon_container (&struct_iter, &arr_iter);
+          dbus_message_iter_abandon_container (&struct_arr_iter, &struct_iter);
+          dbus_message_iter_abandon_container (&iter, &struct_arr_iter);
           goto oom;
         }
 
-      if (!bus_match_rule_dump (matchmaker, conn_filter, &arr_iter))
+      if (!dbus_message_iter_close_container (&struct_iter, &arr_iter))
         {
-          dbus_message_iter_abandon_container (&entry_iter, &arr_iter);
-          dbus_message_iter_abandon_container (&hash_iter, &entry_iter);
-          dbus_message_iter_abandon_container (&iter, &hash_iter);
+          dbus_message_iter_abandon_container (&struct_arr_iter, &struct_iter);
+          dbus_message_iter_abandon_container (&iter, &struct_arr_iter);
           goto oom;
         }
 
-      if (!dbus_message_iter_close_container (&entry_iter, &arr_iter))
-        {
-          dbus_message_iter_abandon_container (&hash_iter, &entry_iter);
-          dbus_message_iter_abandon_container (&iter, &hash_iter);
-          goto oom;
-        }
-      if (!dbus_message_iter_close_container (&hash_iter, &entry_iter))
+      if (!dbus_message_iter_close_container (&struct_arr_iter, &struct_iter))
         {
-          dbus_message_iter_abandon_container (&iter, &hash_iter);
+          dbus_message_iter_abandon_container (&iter, &struct_arr_iter);
           goto oom;
         }
     }
 
-  if (!dbus_message_iter_close_container (&iter, &hash_iter))
+  if (!dbus_message_iter_close_container (&iter, &struct_arr_iter))
     goto oom;
 
   if (!bus_transaction_send_from_driver (transaction, caller_connection,
@@ -328,14 +747,1085 @@ bus_stats_handle_get_all_match_rules (DBusConnection *caller_connection,
     goto oom;
 
   dbus_message_unref (reply);
-  dbus_free_string_array (services);
   return TRUE;
 
 oom:
   if (reply != NULL)
     dbus_message_unref (reply);
 
-  dbus_free_string_array (services);
+  BUS_SET_OOM (error);
+  return FALSE;
+}
+
+static dbus_bool_t
+append_latency_histogram (DBusMessageIter     *dict_iter,
+                          const char          *name,
+                          BusLatencyHistogram *histogram)
+{
+  DBusMessageIter entry_iter, struct_iter, arr_iter, bucket_iter;
+  int i;
+
+  if (!dbus_message_iter_open_container (dict_iter, DBUS_TYPE_DICT_ENTRY,
+                                         NULL, &entry_iter))
+    return FALSE;
+
+  if (!dbus_message_iter_append_basic (&entry_iter, DBUS_TYPE_STRING, &name) ||
+      !dbus_message_iter_open_container (&entry_iter, DBUS_TYPE_STRUCT,
+                                         NULL, &struct_iter))
+    goto abandon_entry;
+
+  if (!dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT64,
+                                       &histogram->count) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT64,
+                                       &histogram->total_usec) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT32,
+                                       &histogram->max_usec) ||
+      !dbus_message_iter_open_container (&struct_iter, DBUS_TYPE_ARRAY,
+                                         "(ut)", &arr_iter))
+    goto abandon_struct;
+
+  /* only the buckets that have samples, each as (lower bound, count) */
+  for (i = 0; i < BUS_LATENCY_N_BUCKETS; i++)
+    {
+      dbus_uint32_t lower_bound;
+
+      if (histogram->buckets[i] == 0)
+        continue;
+
+      lower_bound = latency_bucket_lower_bound (i);
+
+      if (!dbus_message_iter_open_container (&arr_iter, DBUS_TYPE_STRUCT,
+                                             NULL, &bucket_iter))
+        goto abandon_array;
+
+      if (!dbus_message_iter_append_basic (&bucket_iter, DBUS_TYPE_UINT32,
+                                           &lower_bound) ||
+          !dbus_message_iter_append_basic (&bucket_iter, DBUS_TYPE_UINT64,
+                                           &histogram->buckets[i]))
+        {
+          dbus_message_iter_abandon_container (&arr_iter, &bucket_iter);
+          goto abandon_array;
+        }
+
+      if (!dbus_message_iter_close_container (&arr_iter, &bucket_iter))
+        goto abandon_array;
+    }
+
+  if (!dbus_message_iter_close_container (&struct_iter, &arr_iter))
+    goto abandon_struct;
+
+  if (!dbus_message_iter_close_container (&entry_iter, &struct_iter))
+    goto abandon_entry;
+
+  return dbus_message_iter_close_container (dict_iter, &entry_iter);
+
+abandon_array:
+  dbus_message_iter_abandon_container (&struct_iter, &arr_iter);
+abandon_struct:
+  dbus_message_iter_abandon_container (&entry_iter, &struct_iter);
+abandon_entry:
+  dbus_message_iter_abandon_container (dict_iter, &entry_iter);
+  return FALSE;
+}
+
+dbus_bool_t
+bus_stats_handle_get_latency_histograms (DBusConnection *connection,
+                                         BusTransaction *transaction,
+                                         DBusMessage    *message,
+                                         DBusError      *error)
+{
+  static const char * const names[BUS_N_LATENCY_HISTOGRAMS] = {
+    "Routing",
+    "PolicyCheck",
+    "Matchmaker"
+  };
+  BusContext *context;
+  DBusMessage *reply = NULL;
+  DBusMessageIter iter, dict_iter;
+  int i;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!bus_driver_check_message_is_for_us (message, error))
+    return FALSE;
+
+  context = bus_transaction_get_context (transaction);
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    goto oom;
+
+  dbus_message_iter_init_append (reply, &iter);
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                         "{s(ttua(ut))}", &dict_iter))
+    goto oom;
+
+  for (i = 0; i < BUS_N_LATENCY_HISTOGRAMS; i++)
+    {
+      if (!append_latency_histogram (&dict_iter, names[i],
+              bus_context_get_latency_histogram (context, i)))
+        {
+          dbus_message_iter_abandon_container (&iter, &dict_iter);
+          goto oom;
+        }
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &dict_iter))
+    goto oom;
+
+  if (!bus_transaction_send_from_driver (transaction, connection, reply))
+    goto oom;
+
+  dbus_message_unref (reply);
+  return TRUE;
+
+oom:
+  if (reply != NULL)
+    dbus_message_unref (reply);
+
+  BUS_SET_OOM (error);
+  return FALSE;
+}
+
+dbus_bool_t
+bus_stats_handle_set_phase_timing (DBusConnection *connection,
+                                   BusTransaction *transaction,
+                                   DBusMessage    *message,
+                                   DBusError      *error)
+{
+  DBusMessage *reply;
+  dbus_bool_t enabled;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!bus_driver_check_message_is_for_us (message, error))
+    return FALSE;
+
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_BOOLEAN, &enabled,
+                              DBUS_TYPE_INVALID))
+    return FALSE;
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL ||
+      !bus_transaction_send_from_driver (transaction, connection, reply))
+    {
+      if (reply != NULL)
+        dbus_message_unref (reply);
+
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  dbus_message_unref (reply);
+
+  _dbus_phase_set_enabled (enabled);
+  return TRUE;
+}
+
+dbus_bool_t
+bus_stats_handle_get_phase_timings (DBusConnection *connection,
+                                    BusTransaction *transaction,
+                                    DBusMessage    *message,
+                                    DBusError      *error)
+{
+  DBusMessage *reply = NULL;
+  DBusMessageIter iter, dict_iter, entry_iter, struct_iter;
+  dbus_uint64_t iterations, busiest_nsec;
+  int phase;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!bus_driver_check_message_is_for_us (message, error))
+    return FALSE;
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    goto oom;
+
+  _dbus_phase_get_iterations (&iterations, &busiest_nsec);
+
+  dbus_message_iter_init_append (reply, &iter);
+
+  if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_UINT64, &iterations) ||
+      !dbus_message_iter_append_basic (&iter, DBUS_TYPE_UINT64, &busiest_nsec) ||
+      !dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "{s(tt)}",
+                                         &dict_iter))
+    goto oom;
+
+  /* Time outside every phase isn't measured, so there is no entry
+   * for DBUS_PHASE_NONE */
+  for (phase = DBUS_PHASE_NONE + 1; phase < _DBUS_N_PHASES; phase++)
+    {
+      const char *name;
+      dbus_uint64_t entries, nsec;
+
+      name = _dbus_phase_get_stats (phase, &entries, &nsec);
+
+      if (!dbus_message_iter_open_container (&dict_iter, DBUS_TYPE_DICT_ENTRY,
+                                             NULL, &entry_iter))
+        goto abandon_dict;
+
+      if (!dbus_message_iter_append_basic (&entry_iter, DBUS_TYPE_STRING,
+                                           &name) ||
+          !dbus_message_iter_open_container (&entry_iter, DBUS_TYPE_STRUCT,
+                                             NULL, &struct_iter))
+        goto abandon_entry;
+
+      if (!dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT64,
+                                           &entries) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT64,
+                                           &nsec))
+        {
+          dbus_message_iter_abandon_container (&entry_iter, &struct_iter);
+          goto abandon_entry;
+        }
+
+      if (!dbus_message_iter_close_container (&entry_iter, &struct_iter) ||
+          !dbus_message_iter_close_container (&dict_iter, &entry_iter))
+        goto abandon_dict;
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &dict_iter))
+    goto oom;
+
+  if (!bus_transaction_send_from_driver (transaction, connection, reply))
+    goto oom;
+
+  dbus_message_unref (reply);
+  return TRUE;
+
+abandon_entry:
+  dbus_message_iter_abandon_container (&dict_iter, &entry_iter);
+abandon_dict:
+  dbus_message_iter_abandon_container (&iter, &dict_iter);
+oom:
+  if (reply != NULL)
+    dbus_message_unref (reply);
+
+  BUS_SET_OOM (error);
+  return FALSE;
+}
+
+/* Fills @sorted with the talkers in use, busiest first, and returns
+ * how many there are; an insertion sort is plenty for this many */
+static int
+top_talkers_sort (BusTopTalkers *talkers,
+                  BusTalker     *sorted[BUS_TOP_TALKERS_CAPACITY])
+{
+  int n_sorted, i, j;
+
+  n_sorted = 0;
+  for (i = 0; i < talkers->n_talkers; i++)
+    {
+      BusTalker *talker = &talkers->talkers[i];
+
+      if (talker->key == NULL)
+        continue;
+
+      for (j = n_sorted; j > 0 && sorted[j - 1]->messages < talker->messages; j--)
+        sorted[j] = sorted[j - 1];
+
+      sorted[j] = talker;
+      n_sorted++;
+    }
+
+  return n_sorted;
+}
+
+/* Splits a copy of the talker's key, in @buffer, into its three parts */
+static void
+talker_key_split (BusTalker   *talker,
+                  char         buffer[3 * (DBUS_MAXIMUM_NAME_LENGTH + 1)],
+                  const char **sender,
+                  const char **interface,
+                  const char **member)
+{
+  char *space;
+
+  strcpy (buffer, talker->key);
+  *sender = buffer;
+  space = strchr (buffer, ' ');
+  _dbus_assert (space != NULL);
+  *space = '\0';
+  *interface = space + 1;
+  space = strchr (space + 1, ' ');
+  _dbus_assert (space != NULL);
+  *space = '\0';
+  *member = space + 1;
+}
+
+dbus_bool_t
+bus_stats_handle_get_top_talkers (DBusConnection *connection,
+                                  BusTransaction *transaction,
+                                  DBusMessage    *message,
+                                  DBusError      *error)
+{
+  BusTopTalkers *talkers;
+  BusTalker *sorted[BUS_TOP_TALKERS_CAPACITY];
+  DBusMessage *reply = NULL;
+  DBusMessageIter iter, arr_iter, struct_iter;
+  int n_sorted, i;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!bus_driver_check_message_is_for_us (message, error))
+    return FALSE;
+
+  talkers = bus_context_get_top_talkers (bus_transaction_get_context (transaction));
+  n_sorted = top_talkers_sort (talkers, sorted);
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    goto oom;
+
+  dbus_message_iter_init_append (reply, &iter);
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(sssttt)",
+                                         &arr_iter))
+    goto oom;
+
+  for (i = 0; i < n_sorted; i++)
+    {
+      char key[3 * (DBUS_MAXIMUM_NAME_LENGTH + 1)];
+      const char *sender, *interface, *member;
+
+      talker_key_split (sorted[i], key, &sender, &interface, &member);
+
+      if (!dbus_message_iter_open_container (&arr_iter, DBUS_TYPE_STRUCT,
+                                             NULL, &struct_iter))
+        {
+          dbus_message_iter_abandon_container (&iter, &arr_iter);
+          goto oom;
+        }
+
+      if (!dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+                                           &sender) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+                                           &interface) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+                                           &member) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT64,
+                                           &sorted[i]->messages) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT64,
+                                           &sorted[i]->bytes) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT64,
+                                           &sorted[i]->error))
+        {
+          dbus_message_iter_abandon_container (&arr_iter, &struct_iter);
+          dbus_message_iter_abandon_container (&iter, &arr_iter);
+          goto oom;
+        }
+
+      if (!dbus_message_iter_close_container (&arr_iter, &struct_iter))
+        {
+          dbus_message_iter_abandon_container (&iter, &arr_iter);
+          goto oom;
+        }
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &arr_iter))
+    goto oom;
+
+  if (!bus_transaction_send_from_driver (transaction, connection, reply))
+    goto oom;
+
+  dbus_message_unref (reply);
+  return TRUE;
+
+oom:
+  if (reply != NULL)
+    dbus_message_unref (reply);
+
+  BUS_SET_OOM (error);
+  return FALSE;
+}
+
+/*
+ * OpenMetrics text exposition of the same counters, for
+ * <stats_listen>. Names follow the Prometheus conventions: snake case,
+ * base units, and a _total suffix on counter samples.
+ */
+
+static dbus_bool_t
+append_uint64 (DBusString    *str,
+               dbus_uint64_t  value)
+{
+  char buf[21];
+  int i;
+
+  i = sizeof (buf) - 1;
+  buf[i] = '\0';
+
+  do
+    {
+      buf[--i] = '0' + (value % 10);
+      value /= 10;
+    }
+  while (value != 0);
+
+  return _dbus_string_append (str, buf + i);
+}
+
+static dbus_bool_t
+append_usec_as_seconds (DBusString    *str,
+                        dbus_uint64_t  usec)
+{
+  return append_uint64 (str, usec / _DBUS_USEC_PER_SECOND) &&
+    _dbus_string_append_printf (str, ".%06u",
+                                (unsigned) (usec % _DBUS_USEC_PER_SECOND));
+}
+
+static dbus_bool_t
+append_metric_family (DBusString *str,
+                      const char *name,
+                      const char *type,
+                      const char *help)
+{
+  return _dbus_string_append_printf (str, "# TYPE %s %s\n# HELP %s %s\n",
+                                     name, type, name, help);
+}
+
+static dbus_bool_t
+append_gauge (DBusString    *str,
+              const char    *name,
+              const char    *help,
+              dbus_uint64_t  value)
+{
+  return append_metric_family (str, name, "gauge", help) &&
+    _dbus_string_append_printf (str, "%s ", name) &&
+    append_uint64 (str, value) &&
+    _dbus_string_append_byte (str, '\n');
+}
+
+static dbus_bool_t
+append_counter (DBusString    *str,
+                const char    *name,
+                const char    *help,
+                dbus_uint64_t  value)
+{
+  return append_metric_family (str, name, "counter", help) &&
+    _dbus_string_append_printf (str, "%s_total ", name) &&
+    append_uint64 (str, value) &&
+    _dbus_string_append_byte (str, '\n');
+}
+
+static dbus_bool_t
+append_latency_histogram_text (DBusString          *str,
+                               const char          *name,
+                               const char          *operation,
+                               BusLatencyHistogram *histogram)
+{
+  dbus_uint64_t cumulative;
+  int i;
+
+  /* only the buckets that have samples; the last one has no upper
+   * bound that fits in 32 bits, so +Inf covers it */
+  cumulative = 0;
+  for (i = 0; i < BUS_LATENCY_N_BUCKETS - 1; i++)
+    {
+      if (histogram->buckets[i] == 0)
+        continue;
+
+      cumulative += histogram->buckets[i];
+
+      if (!_dbus_string_append_printf (str,
+                                       "%s_bucket{operation=\"%s\",le=\"",
+                                       name, operation) ||
+          !append_usec_as_seconds (str,
+                                   latency_bucket_lower_bound (i + 1) - 1) ||
+          !_dbus_string_append (str, "\"} ") ||
+          !append_uint64 (str, cumulative) ||
+          !_dbus_string_append_byte (str, '\n'))
+        return FALSE;
+    }
+
+  return _dbus_string_append_printf (str,
+                                     "%s_bucket{operation=\"%s\",le=\"+Inf\"} ",
+                                     name, operation) &&
+    append_uint64 (str, histogram->count) &&
+    _dbus_string_append_printf (str, "\n%s_count{operation=\"%s\"} ",
+                                name, operation) &&
+    append_uint64 (str, histogram->count) &&
+    _dbus_string_append_printf (str, "\n%s_sum{operation=\"%s\"} ",
+                                name, operation) &&
+    append_usec_as_seconds (str, histogram->total_usec) &&
+    _dbus_string_append_byte (str, '\n');
+}
+
+static dbus_bool_t
+append_top_talkers_text (DBusString    *str,
+                         const char    *name,
+                         const char    *help,
+                         BusTalker    **sorted,
+                         int            n_sorted,
+                         dbus_bool_t    bytes)
+{
+  int i;
+
+  if (!append_metric_family (str, name, "counter", help))
+    return FALSE;
+
+  for (i = 0; i < n_sorted; i++)
+    {
+      char key[3 * (DBUS_MAXIMUM_NAME_LENGTH + 1)];
+      const char *sender, *interface, *member;
+
+      /* D-Bus names never contain a quote, backslash or newline, so
+       * they need no escaping as label values */
+      talker_key_split (sorted[i], key, &sender, &interface, &member);
+
+      if (!_dbus_string_append_printf (str,
+              "%s_total{sender=\"%s\",interface=\"%s\",member=\"%s\"} ",
+              name, sender, interface, member) ||
+          !append_uint64 (str, bytes ? sorted[i]->bytes : sorted[i]->messages) ||
+          !_dbus_string_append_byte (str, '\n'))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * Appends the bus-wide statistics, latency histograms and top talkers
+ * to @p str in OpenMetrics text format, terminated by "# EOF".
+ * Per-connection statistics are left to GetConnectionStats, so the
+ * cost of this does not grow with the number of connections.
+ *
+ * @param context the bus context
+ * @param str the string to append to
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+bus_stats_append_openmetrics (BusContext *context,
+                              DBusString *str)
+{
+  static const char * const operations[BUS_N_LATENCY_HISTOGRAMS] = {
+    "routing",
+    "policy_check",
+    "matchmaker"
+  };
+  BusConnections *connections;
+  BusTalker *sorted[BUS_TOP_TALKERS_CAPACITY];
+  dbus_uint32_t in_use, in_free_list, allocated;
+  dbus_uint32_t cache_hits, cache_misses, cached;
+  dbus_uint32_t pool_hits, pool_misses, pool_cached, pool_used;
+  int n_sorted, i;
+
+  connections = bus_context_get_connections (context);
+
+  /* Globals */
+
+  _dbus_list_get_stats (&in_use, &in_free_list, &allocated);
+  _dbus_message_get_cache_stats (&cache_hits, &cache_misses, &cached);
+  _dbus_message_get_body_pool_stats (&pool_hits, &pool_misses, &pool_cached,
+                                     &pool_used);
+
+  if (!append_gauge (str, "dbus_list_mem_pool_used_bytes",
+                     "Bytes in use in the DBusList memory pool", in_use) ||
+      !append_gauge (str, "dbus_list_mem_pool_cached_bytes",
+                     "Bytes free for reuse in the DBusList memory pool",
+                     in_free_list) ||
+      !append_gauge (str, "dbus_list_mem_pool_allocated_bytes",
+                     "Bytes allocated by the DBusList memory pool",
+                     allocated) ||
+      !append_counter (str, "dbus_message_cache_hits",
+                       "Messages allocated from the message cache",
+                       cache_hits) ||
+      !append_counter (str, "dbus_message_cache_misses",
+                       "Messages that could not be allocated from the message cache",
+                       cache_misses) ||
+      !append_gauge (str, "dbus_message_cache_size",
+                     "Messages in the message cache", cached) ||
+      !append_counter (str, "dbus_message_body_pool_hits",
+                       "Large message bodies put on a reused buffer",
+                       pool_hits) ||
+      !append_counter (str, "dbus_message_body_pool_misses",
+                       "Large message bodies that needed a new buffer",
+                       pool_misses) ||
+      !append_gauge (str, "dbus_message_body_pool_cached_bytes",
+                     "Bytes of large message buffers kept for reuse",
+                     pool_cached) ||
+      !append_gauge (str, "dbus_message_body_pool_used_bytes",
+                     "Bytes of large message buffers in use", pool_used))
+    return FALSE;
+
+  /* Connections */
+
+  if (!append_gauge (str, "dbus_daemon_active_connections",
+                     "Authenticated connections",
+                     bus_connections_get_n_active (connections)) ||
+      !append_gauge (str, "dbus_daemon_incomplete_connections",
+                     "Connections that have not authenticated yet",
+                     bus_connections_get_n_incomplete (connections)) ||
+      !append_gauge (str, "dbus_daemon_match_rules",
+                     "Match rules of all connections",
+                     bus_connections_get_total_match_rules (connections)) ||
+      !append_gauge (str, "dbus_daemon_peak_match_rules",
+                     "Most match rules ever added at the same time",
+                     bus_connections_get_peak_match_rules (connections)) ||
+      !append_gauge (str, "dbus_daemon_match_rule_bytes",
+                     "Memory taken by match rules, not counting shared strings",
+                     bus_connections_get_total_match_rule_bytes (connections)) ||
+      !append_gauge (str, "dbus_daemon_peak_match_rules_per_connection",
+                     "Most match rules ever added by one connection",
+                     bus_connections_get_peak_match_rules_per_conn (connections)) ||
+      !append_gauge (str, "dbus_daemon_distinct_match_rules",
+                     "Match rules that differ in more than their owner",
+                     bus_matchmaker_get_n_distinct_rules (
+                         bus_context_get_matchmaker (context))) ||
+      !append_gauge (str, "dbus_daemon_bus_names",
+                     "Bus names owned by all connections",
+                     bus_connections_get_total_bus_names (connections)) ||
+      !append_gauge (str, "dbus_daemon_peak_bus_names",
+                     "Most bus names ever owned at the same time",
+                     bus_connections_get_peak_bus_names (connections)) ||
+      !append_gauge (str, "dbus_daemon_peak_bus_names_per_connection",
+                     "Most bus names ever owned by one connection",
+                     bus_connections_get_peak_bus_names_per_conn (connections)) ||
+      !append_counter (str, "dbus_daemon_monitor_dropped_messages",
+                       "Captured messages dropped for monitors that were not keeping up",
+                       bus_connections_get_n_monitor_dropped (connections)))
+    return FALSE;
+
+  /* Latency */
+
+  if (!append_metric_family (str, "dbus_daemon_latency_seconds", "histogram",
+                             "Time spent routing, checking policy and matching a message"))
+    return FALSE;
+
+  for (i = 0; i < BUS_N_LATENCY_HISTOGRAMS; i++)
+    {
+      if (!append_latency_histogram_text (str, "dbus_daemon_latency_seconds",
+              operations[i], bus_context_get_latency_histogram (context, i)))
+        return FALSE;
+    }
+
+  /* Top talkers */
+
+  n_sorted = top_talkers_sort (bus_context_get_top_talkers (context), sorted);
+
+  if (!append_top_talkers_text (str, "dbus_daemon_top_talker_messages",
+                                "Messages sent, an upper bound",
+                                sorted, n_sorted, FALSE) ||
+      !append_top_talkers_text (str, "dbus_daemon_top_talker_bytes",
+                                "Bytes sent, an upper bound",
+                                sorted, n_sorted, TRUE))
+    return FALSE;
+
+  return _dbus_string_append (str, "# EOF\n");
+}
+
+dbus_bool_t
+bus_stats_handle_get_all_match_rules (DBusConnection *caller_connection,
+                                      BusTransaction *transaction,
+                                      DBusMessage    *message,
+                                      DBusError      *error)
+{
+  BusContext *context;
+  DBusString bus_name_str;
+  DBusMessage *reply = NULL;
+  DBusMessageIter iter, hash_iter, entry_iter, arr_iter;
+  BusRegistry *registry;
+  char **services = NULL;
+  int services_len;
+  DBusConnection *conn_filter = NULL;
+  BusMatchmaker *matchmaker;
+  int i;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  registry = bus_connection_get_registry (caller_connection);
+  context = bus_transaction_get_context (transaction);
+  matchmaker = bus_context_get_matchmaker (context);
+
+  if (!bus_registry_list_services (registry, &services, &services_len))
+    return FALSE;
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    goto oom;
+
+  dbus_message_iter_init_append (reply, &iter);
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "{sas}",
+                                         &hash_iter))
+    goto oom;
+
+  for (i = 0 ; i < services_len ; i++)
+    {
+      BusService *service;
+
+      /* To avoid duplicate entries, only look for unique names */
+      if (services[i][0] != ':')
+        continue;
+
+      _dbus_string_init_const (&bus_name_str, services[i]);
+      service = bus_registry_lookup (registry, &bus_name_str);
+      _dbus_assert (service != NULL);
+
+      conn_filter = bus_service_get_primary_owners_connection (service);
+      _dbus_assert (conn_filter != NULL);
+
+      if (!dbus_message_iter_open_container (&hash_iter, DBUS_TYPE_DICT_ENTRY, NULL,
+                                             &entry_iter))
+        {
+          dbus_message_iter_abandon_container (&iter, &hash_iter);
+          goto oom;
+        }
+
+      if (!dbus_message_iter_append_basic (&entry_iter, DBUS_TYPE_STRING, &services[i]))
+        {
+          dbus_message_iter_abandon_container (&hash_iter, &entry_iter);
+          dbus_message_iter_abandon_container (&iter, &hash_iter);
+          goto oom;
+        }
+
+      if (!dbus_message_iter_open_container (&entry_iter, DBUS_TYPE_ARRAY, "s",
+                                             &arr_iter))
+        {
+          dbus_message_iter_abandon_container (&hash_iter, &entry_iter);
+          dbus_message_iter_abandon_container (&iter, &hash_iter);
+          goto oom;
+        }
+
+      if (!bus_match_rule_dump (matchmaker, conn_filter, &arr_iter))
+        {
+          dbus_message_iter_abandon_container (&entry_iter, &arr_iter);
+          dbus_message_iter_abandon_container (&hash_iter, &entry_iter);
+          dbus_message_iter_abandon_container (&iter, &hash_iter);
+          goto oom;
+        }
+
+      if (!dbus_message_iter_close_container (&entry_iter, &arr_iter))
+        {
+          dbus_message_iter_abandon_container (&hash_iter, &entry_iter);
+          dbus_message_iter_abandon_container (&iter, &hash_iter);
+          goto oom;
+        }
+      if (!dbus_message_iter_close_container (&hash_iter, &entry_iter))
+        {
+          dbus_message_iter_abandon_container (&iter, &hash_iter);
+          goto oom;
+        }
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &hash_iter))
+    goto oom;
+
+  if (!bus_transaction_send_from_driver (transaction, caller_connection,
+                                         reply))
+    goto oom;
+
+  dbus_message_unref (reply);
+  dbus_free_string_array (services);
+  return TRUE;
+
+oom:
+  if (reply != NULL)
+    dbus_message_unref (reply);
+
+  dbus_free_string_array (services);
+
+  BUS_SET_OOM (error);
+  return FALSE;
+}
+
+/* Replies to the paged methods stop growing after about this many
+ * bytes; callers may ask for less, or 0 for the default */
+#define DEFAULT_PAGE_BYTES (64 * 1024)
+#define MAX_PAGE_BYTES (1024 * 1024)
+
+/*
+ * Reads the (cursor, max_bytes) arguments of a paged method, and
+ * finds the first connection to go in the page.
+ */
+static dbus_bool_t
+start_page (DBusConnection  *caller_connection,
+            DBusMessage     *message,
+            const char     **cursor,
+            int             *page_bytes,
+            DBusConnection **first,
+            DBusError       *error)
+{
+  dbus_uint32_t max_bytes;
+
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_STRING, cursor,
+                              DBUS_TYPE_UINT32, &max_bytes,
+                              DBUS_TYPE_INVALID))
+    return FALSE;
+
+  if (max_bytes == 0 || max_bytes > MAX_PAGE_BYTES)
+    *page_bytes = max_bytes == 0 ? DEFAULT_PAGE_BYTES : MAX_PAGE_BYTES;
+  else
+    *page_bytes = max_bytes;
+
+  *first = bus_connections_get_active_after (
+      bus_connection_get_connections (caller_connection), *cursor, error);
+
+  return !dbus_error_is_set (error);
+}
+
+/* What a connection's entry adds to a GetMatchRulesPaged reply,
+ * roughly: each string costs its length prefix, nul and padding */
+static int
+match_rules_entry_bytes (DBusConnection *connection)
+{
+  DBusList **rules;
+  DBusList *link;
+  int n_bytes;
+
+  n_bytes = strlen (bus_connection_get_name (connection)) + 16;
+
+  rules = bus_connection_get_match_rules (connection);
+
+  for (link = _dbus_list_get_first_link (rules);
+       link != NULL;
+       link = _dbus_list_get_next_link (rules, link))
+    n_bytes += bus_match_rule_get_n_bytes (link->data) + 8;
+
+  return n_bytes;
+}
+
+/*
+ * GetMatchRulesPaged (s cursor, u max_bytes) -> (a{sas} rules, s next)
+ *
+ * Like GetAllMatchRules, for the connections with unique names after
+ * cursor, stopping once the reply is about max_bytes long. Pass next
+ * as the cursor of the following call; it is "" after the last page.
+ */
+dbus_bool_t
+bus_stats_handle_get_match_rules_paged (DBusConnection *caller_connection,
+                                        BusTransaction *transaction,
+                                        DBusMessage    *message,
+                                        DBusError      *error)
+{
+  BusConnections *connections;
+  BusMatchmaker *matchmaker;
+  DBusConnection *connection;
+  DBusConnection *last = NULL;
+  DBusMessage *reply = NULL;
+  DBusMessageIter iter, hash_iter, entry_iter, arr_iter;
+  const char *cursor;
+  const char *next;
+  int page_bytes;
+  int n_bytes = 0;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!start_page (caller_connection, message, &cursor, &page_bytes,
+                   &connection, error))
+    return FALSE;
+
+  connections = bus_connection_get_connections (caller_connection);
+  matchmaker = bus_context_get_matchmaker (
+      bus_transaction_get_context (transaction));
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    goto oom;
+
+  dbus_message_iter_init_append (reply, &iter);
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "{sas}",
+                                         &hash_iter))
+    goto oom;
+
+  for (; connection != NULL;
+       connection = bus_connections_get_next_active (connections, connection))
+    {
+      const char *name = bus_connection_get_name (connection);
+      int entry_bytes = match_rules_entry_bytes (connection);
+
+      /* always at least one, so that paging makes progress */
+      if (last != NULL && n_bytes + entry_bytes > page_bytes)
+        break;
+
+      if (!dbus_message_iter_open_container (&hash_iter, DBUS_TYPE_DICT_ENTRY,
+                                             NULL, &entry_iter))
+        {
+          dbus_message_iter_abandon_container (&iter, &hash_iter);
+          goto oom;
+        }
+
+      if (!dbus_message_iter_append_basic (&entry_iter, DBUS_TYPE_STRING,
+                                           &name) ||
+          !dbus_message_iter_open_container (&entry_iter, DBUS_TYPE_ARRAY, "s",
+                                             &arr_iter))
+        {
+          dbus_message_iter_abandon_container (&hash_iter, &entry_iter);
+          dbus_message_iter_abandon_container (&iter, &hash_iter);
+          goto oom;
+        }
+
+      if (!bus_match_rule_dump (matchmaker, connection, &arr_iter))
+        {
+          dbus_message_iter_abandon_container (&entry_iter, &arr_iter);
+          dbus_message_iter_abandon_container (&hash_iter, &entry_iter);
+          dbus_message_iter_abandon_container (&iter, &hash_iter);
+          goto oom;
+        }
+
+      if (!dbus_message_iter_close_container (&entry_iter, &arr_iter))
+        {
+          dbus_message_iter_abandon_container (&hash_iter, &entry_iter);
+          dbus_message_iter_abandon_container (&iter, &hash_iter);
+          goto oom;
+        }
+
+      if (!dbus_message_iter_close_container (&hash_iter, &entry_iter))
+        {
+          dbus_message_iter_abandon_container (&iter, &hash_iter);
+          goto oom;
+        }
+
+      n_bytes += entry_bytes;
+      last = connection;
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &hash_iter))
+    goto oom;
+
+  /* the end, unless we stopped early */
+  next = connection != NULL ? bus_connection_get_name (last) : "";
+
+  if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &next))
+    goto oom;
+
+  if (!bus_transaction_send_from_driver (transaction, caller_connection,
+                                         reply))
+    goto oom;
+
+  dbus_message_unref (reply);
+  return TRUE;
+
+oom:
+  if (reply != NULL)
+    dbus_message_unref (reply);
+
+  BUS_SET_OOM (error);
+  return FALSE;
+}
+
+/*
+ * ListNamesPaged (s cursor, u max_bytes) -> (as names, s next)
+ *
+ * Like ListNames, a page at a time: each connection after cursor
+ * brings its unique name and the names it is the primary owner of.
+ * The bus driver's own name comes first. Paging works as for
+ * GetMatchRulesPaged.
+ */
+dbus_bool_t
+bus_stats_handle_list_names_paged (DBusConnection *caller_connection,
+                                   BusTransaction *transaction,
+                                   DBusMessage    *message,
+                                   DBusError      *error)
+{
+  BusConnections *connections;
+  DBusConnection *connection;
+  DBusConnection *last = NULL;
+  DBusMessage *reply = NULL;
+  DBusMessageIter iter, arr_iter;
+  const char *cursor;
+  const char *next;
+  int page_bytes;
+  int n_bytes = 0;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!start_page (caller_connection, message, &cursor, &page_bytes,
+                   &connection, error))
+    return FALSE;
+
+  connections = bus_connection_get_connections (caller_connection);
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    goto oom;
+
+  dbus_message_iter_init_append (reply, &iter);
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                         DBUS_TYPE_STRING_AS_STRING,
+                                         &arr_iter))
+    goto oom;
+
+  if (*cursor == '\0')
+    {
+      const char *driver_name = DBUS_SERVICE_DBUS;
+
+      if (!dbus_message_iter_append_basic (&arr_iter, DBUS_TYPE_STRING,
+                                           &driver_name))
+        {
+          dbus_message_iter_abandon_container (&iter, &arr_iter);
+          goto oom;
+        }
+    }
+
+  for (; connection != NULL;
+       connection = bus_connections_get_next_active (connections, connection))
+    {
+      DBusList **owned;
+      DBusList *link;
+      int entry_bytes;
+
+      owned = bus_connection_get_owned_services (connection);
+
+      entry_bytes = 0;
+      for (link = _dbus_list_get_first_link (owned);
+           link != NULL;
+           link = _dbus_list_get_next_link (owned, link))
+        entry_bytes += strlen (bus_service_get_name (link->data)) + 8;
+
+      if (last != NULL && n_bytes + entry_bytes > page_bytes)
+        break;
+
+      /* the unique name is among them */
+      for (link = _dbus_list_get_first_link (owned);
+           link != NULL;
+           link = _dbus_list_get_next_link (owned, link))
+        {
+          BusService *service = link->data;
+          const char *name;
+
+          /* names it is only queued for come with their owner */
+          if (bus_service_get_primary_owners_connection (service) != connection)
+            continue;
+
+          name = bus_service_get_name (service);
+
+          if (!dbus_message_iter_append_basic (&arr_iter, DBUS_TYPE_STRING,
+                                               &name))
+            {
+              dbus_message_iter_abandon_container (&iter, &arr_iter);
+              goto oom;
+            }
+        }
+
+      n_bytes += entry_bytes;
+      last = connection;
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &arr_iter))
+    goto oom;
+
+  next = connection != NULL ? bus_connection_get_name (last) : "";
+
+  if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &next))
+    goto oom;
+
+  if (!bus_transaction_send_from_driver (transaction, caller_connection,
+                                         reply))
+    goto oom;
+
+  dbus_message_unref (reply);
+  return TRUE;
+
+oom:
+  if (reply != NULL)
+    dbus_message_unref (reply);
 
   BUS_SET_OOM (error);
   return FALSE;
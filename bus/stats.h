@@ -25,6 +25,36 @@
 
 #define BUS_INTERFACE_STATS "org.freedesktop.DBus.Debug.Stats"
 
+/* A histogram has BUS_LATENCY_SUB_BUCKETS buckets per power of two */
+#define BUS_LATENCY_SUB_BUCKETS 4
+#define BUS_LATENCY_N_BUCKETS (BUS_LATENCY_SUB_BUCKETS * 32)
+
+struct BusLatencyHistogram
+{
+  dbus_uint64_t count;       /**< Number of samples */
+  dbus_uint64_t total_usec;  /**< Sum of all samples */
+  dbus_uint32_t max_usec;    /**< Largest sample */
+  dbus_uint64_t buckets[BUS_LATENCY_N_BUCKETS]; /**< Samples per bucket */
+};
+
+void bus_latency_histogram_record (BusLatencyHistogram *histogram,
+                                   long                 start_tv_sec,
+                                   long                 start_tv_usec);
+
+/* How many (sender, interface, member) keys the top-talkers sketch tracks */
+#define BUS_TOP_TALKERS_CAPACITY 128
+
+BusTopTalkers *bus_top_talkers_new    (void);
+void           bus_top_talkers_free   (BusTopTalkers *talkers);
+void           bus_top_talkers_record (BusTopTalkers *talkers,
+                                       DBusMessage   *message);
+void           bus_top_talkers_get_totals (BusTopTalkers *talkers,
+                                           dbus_uint64_t *messages,
+                                           dbus_uint64_t *bytes);
+
+dbus_bool_t bus_stats_append_openmetrics (BusContext *context,
+                                          DBusString *str);
+
 dbus_bool_t bus_stats_handle_get_stats (DBusConnection *connection,
                                         BusTransaction *transaction,
                                         DBusMessage    *message,
@@ -35,9 +65,44 @@ dbus_bool_t bus_stats_handle_get_connection_stats (DBusConnection *connection,
                                                    DBusMessage    *message,
                                                    DBusError      *error);
 
+dbus_bool_t bus_stats_handle_get_all_connection_stats (DBusConnection *caller_connection,
+                                                       BusTransaction *transaction,
+                                                       DBusMessage    *message,
+                                                       DBusError      *error);
+
+dbus_bool_t bus_stats_handle_get_latency_histograms (DBusConnection *connection,
+                                                   BusTransaction *transaction,
+                                                   DBusMessage    *message,
+                                                   DBusError      *error);
+
+dbus_bool_t bus_stats_handle_set_phase_timing (DBusConnection *connection,
+                                               BusTransaction *transaction,
+                                               DBusMessage    *message,
+                                               DBusError      *error);
+
+dbus_bool_t bus_stats_handle_get_phase_timings (DBusConnection *connection,
+                                                BusTransaction *transaction,
+                                                DBusMessage    *message,
+                                                DBusError      *error);
+
+dbus_bool_t bus_stats_handle_get_top_talkers (DBusConnection *connection,
+                                             BusTransaction *transaction,
+                                             DBusMessage    *message,
+                                             DBusError      *error);
+
 dbus_bool_t bus_stats_handle_get_all_match_rules (DBusConnection *caller_connection,
                                                   BusTransaction *transaction,
                                                   DBusMessage    *message,
                                                   DBusError      *error);
 
+dbus_bool_t bus_stats_handle_get_match_rules_paged (DBusConnection *caller_connection,
+                                                    BusTransaction *transaction,
+                                                    DBusMessage    *message,
+                                                    DBusError      *error);
+
+dbus_bool_t bus_stats_handle_list_names_paged (DBusConnection *caller_connection,
+                                               BusTransaction *transaction,
+                                               DBusMessage    *message,
+                                               DBusError      *error);
+
 #endif /* multiple-inclusion guard */
@@ -130,6 +130,42 @@ main (int argc, char **argv)
       test_post_hook ();
     }
 
+  if (only == NULL || strcmp (only, "rate-limit") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running rate limit test\n", argv[0]);
+      if (!bus_rate_bucket_test (&test_data_dir))
+        die ("rate limit");
+      test_post_hook ();
+    }
+
+  if (only == NULL || strcmp (only, "log-queue") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running log queue test\n", argv[0]);
+      if (!bus_log_queue_test (&test_data_dir))
+        die ("log queue");
+      test_post_hook ();
+    }
+
+  if (only == NULL || strcmp (only, "coalesce") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running PropertiesChanged coalescing test\n", argv[0]);
+      if (!bus_coalesce_test (&test_data_dir))
+        die ("coalesce");
+      test_post_hook ();
+    }
+
+  if (only == NULL || strcmp (only, "coalesce-queue") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running PropertiesChanged coalescing queue test\n", argv[0]);
+      if (!bus_coalesce_queue_test (&test_data_dir))
+        die ("coalesce queue");
+      test_post_hook ();
+    }
+
   if (only == NULL || strcmp (only, "config-parser") == 0)
     {
       test_pre_hook ();
@@ -175,6 +211,25 @@ main (int argc, char **argv)
       test_post_hook ();
     }
 
+  /* a benchmark, so only run on request */
+  if (only != NULL && strcmp (only, "matchmaker-perf") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running matchmaker benchmark\n", argv[0]);
+      if (!bus_matchmaker_perf_test (&test_data_dir))
+        die ("matchmaker benchmark");
+      test_post_hook ();
+    }
+
+  if (only != NULL && strcmp (only, "policy-perf") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running policy benchmark\n", argv[0]);
+      if (!bus_policy_perf_test (&test_data_dir))
+        die ("policy benchmark");
+      test_post_hook ();
+    }
+
 #ifdef HAVE_UNIX_FD_PASSING
   if (only == NULL || strcmp (only, "unix-fds-passing") == 0)
     {
@@ -184,6 +239,15 @@ main (int argc, char **argv)
         die ("unix fd passing");
       test_post_hook ();
     }
+
+  if (only == NULL || strcmp (only, "peer-connection") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running peer connection test\n", argv[0]);
+      if (!bus_peer_connection_test (&test_data_dir))
+        die ("peer connection");
+      test_post_hook ();
+    }
 #endif
 
   printf ("%s: Success\n", argv[0]);
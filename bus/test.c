@@ -71,6 +71,13 @@ remove_client_timeout (DBusTimeout    *timeout,
   _dbus_loop_remove_timeout (client_loop, timeout);
 }
 
+static void
+toggle_client_timeout (DBusTimeout    *timeout,
+                       void           *data)
+{
+  _dbus_loop_toggle_timeout (client_loop, timeout);
+}
+
 static DBusHandlerResult
 client_disconnect_filter (DBusConnection     *connection,
                           DBusMessage        *message,
@@ -127,7 +134,7 @@ bus_setup_debug_client (DBusConnection *connection)
   if (!dbus_connection_set_timeout_functions (connection,
                                               add_client_timeout,
                                               remove_client_timeout,
-                                              NULL,
+                                              toggle_client_timeout,
                                               connection, NULL))
     goto out;
 
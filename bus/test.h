@@ -35,7 +35,13 @@ dbus_bool_t bus_dispatch_sha1_test    (const DBusString             *test_data_d
 dbus_bool_t bus_config_parser_test    (const DBusString             *test_data_dir);
 dbus_bool_t bus_config_parser_trivial_test (const DBusString        *test_data_dir);
 dbus_bool_t bus_signals_test          (const DBusString             *test_data_dir);
+dbus_bool_t bus_matchmaker_perf_test  (const DBusString             *test_data_dir);
+dbus_bool_t bus_policy_perf_test      (const DBusString             *test_data_dir);
 dbus_bool_t bus_expire_list_test      (const DBusString             *test_data_dir);
+dbus_bool_t bus_rate_bucket_test      (const DBusString             *test_data_dir);
+dbus_bool_t bus_log_queue_test        (const DBusString             *test_data_dir);
+dbus_bool_t bus_coalesce_test         (const DBusString             *test_data_dir);
+dbus_bool_t bus_coalesce_queue_test   (const DBusString             *test_data_dir);
 dbus_bool_t bus_activation_service_reload_test (const DBusString    *test_data_dir);
 dbus_bool_t bus_setup_debug_client    (DBusConnection               *connection);
 void        bus_test_clients_foreach  (BusConnectionForeachFunction  function,
@@ -50,6 +56,7 @@ BusContext* bus_context_new_test      (const DBusString             *test_data_d
 
 #ifdef HAVE_UNIX_FD_PASSING
 dbus_bool_t bus_unix_fds_passing_test (const DBusString             *test_data_dir);
+dbus_bool_t bus_peer_connection_test  (const DBusString             *test_data_dir);
 #endif
 
 #endif
@@ -46,3 +46,66 @@ bus_connection_dispatch_one_message  (DBusConnection *connection)
   
   return status == DBUS_DISPATCH_DATA_REMAINS;
 }
+
+/**
+ * Builds an unaddressed method return whose body is the "as" that
+ * ListNames and ListActivatableNames send: the bus driver's own name
+ * followed by every key of a string-keyed hash table. Callers keep the
+ * result until the table changes and copy it for each reply.
+ *
+ * @param names hash table keyed by bus name
+ * @returns the new message, or #NULL if no memory
+ */
+DBusMessage *
+bus_names_snapshot_new (DBusHashTable *names)
+{
+  DBusMessage *snapshot;
+  DBusMessageIter iter;
+  DBusMessageIter sub;
+  DBusHashIter hash_iter;
+  const char *v_STRING;
+
+  snapshot = dbus_message_new (DBUS_MESSAGE_TYPE_METHOD_RETURN);
+  if (snapshot == NULL)
+    return NULL;
+
+  dbus_message_set_no_reply (snapshot, TRUE);
+
+  dbus_message_iter_init_append (snapshot, &iter);
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                         DBUS_TYPE_STRING_AS_STRING,
+                                         &sub))
+    {
+      dbus_message_unref (snapshot);
+      return NULL;
+    }
+
+  /* Include the bus driver in the list */
+  v_STRING = DBUS_SERVICE_DBUS;
+  if (!dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING, &v_STRING))
+    goto oom;
+
+  _dbus_hash_iter_init (names, &hash_iter);
+  while (_dbus_hash_iter_next (&hash_iter))
+    {
+      v_STRING = _dbus_hash_iter_get_string_key (&hash_iter);
+
+      if (!dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING,
+                                           &v_STRING))
+        goto oom;
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &sub))
+    {
+      dbus_message_unref (snapshot);
+      return NULL;
+    }
+
+  return snapshot;
+
+ oom:
+  dbus_message_iter_abandon_container (&iter, &sub);
+  dbus_message_unref (snapshot);
+  return NULL;
+}
@@ -26,6 +26,7 @@
 #define BUS_UTILS_H
 
 #include <dbus/dbus.h>
+#include <dbus/dbus-hash.h>
 
 extern const char bus_no_memory_message[];
 #define BUS_SET_OOM(error) dbus_set_error_const ((error), DBUS_ERROR_NO_MEMORY, bus_no_memory_message)
@@ -33,4 +34,6 @@ extern const char bus_no_memory_message[];
 void        bus_connection_dispatch_all_messages (DBusConnection *connection);
 dbus_bool_t bus_connection_dispatch_one_message  (DBusConnection *connection);
 
+DBusMessage *bus_names_snapshot_new              (DBusHashTable  *names);
+
 #endif /* BUS_UTILS_H */
@@ -1,3 +1,4 @@
+include(CheckCSourceCompiles)
 include(CheckIncludeFile)
 include(CheckIncludeFiles)
 include(CheckSymbolExists)
@@ -25,6 +26,8 @@ check_include_file(string.h     HAVE_STRING_H)
 check_include_file(strings.h     HAVE_STRINGS_H)
 check_include_file(syslog.h     HAVE_SYSLOG_H)
 check_include_files("stdint.h;sys/types.h;sys/event.h" HAVE_SYS_EVENT_H)
+check_include_file(sys/eventfd.h     HAVE_SYS_EVENTFD_H)
+check_include_files("sys/socket.h;linux/vm_sockets.h" HAVE_LINUX_VM_SOCKETS_H)
 check_include_file(sys/inotify.h     HAVE_SYS_INOTIFY_H)
 check_include_file(sys/resource.h     HAVE_SYS_RESOURCE_H)
 check_include_file(sys/stat.h     HAVE_SYS_STAT_H)
@@ -57,6 +60,12 @@ check_symbol_exists(strtoull     "stdlib.h"         HAVE_STRTOULL)           #
 set(CMAKE_REQUIRED_DEFINITIONS -D_GNU_SOURCE)
 check_symbol_exists(pipe2        "fcntl.h;unistd.h"         HAVE_PIPE2)
 check_symbol_exists(accept4      "sys/socket.h"             HAVE_ACCEPT4)
+check_symbol_exists(sched_getcpu "sched.h"                  HAVE_SCHED_GETCPU)
+check_symbol_exists(sched_setaffinity "sched.h"            HAVE_SCHED_SETAFFINITY)
+check_symbol_exists(memfd_create "sys/mman.h"               HAVE_MEMFD_CREATE)
+check_symbol_exists(close_range  "unistd.h"                 HAVE_CLOSE_RANGE)
+check_symbol_exists(vfork        "unistd.h"                 HAVE_VFORK)
+check_symbol_exists(getrandom    "sys/random.h"             HAVE_GETRANDOM)
 check_symbol_exists(dirfd        "dirent.h"                 HAVE_DIRFD)
 check_symbol_exists(inotify_init1 "sys/inotify.h"           HAVE_INOTIFY_INIT1)
 check_symbol_exists(SCM_RIGHTS    "sys/types.h;sys/socket.h;sys/un.h" HAVE_UNIX_FD_PASSING)
@@ -65,6 +74,22 @@ check_symbol_exists(raise        "signal.h"                 HAVE_RAISE)
 
 check_struct_member(cmsgcred cmcred_pid "sys/types.h sys/socket.h" HAVE_CMSGCRED)   #  dbus-sysdeps.c
 
+check_c_source_compiles("
+int main() {
+    int a = 4;
+    int b = __sync_sub_and_fetch(&a, 4);
+    return b;
+}
+" DBUS_USE_SYNC)                                                                   #  dbus-sysdeps-unix.c
+
+check_c_source_compiles("
+#include <pthread.h>
+int main() {
+    pthread_mutexattr_t attr;
+    return pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+}
+" HAVE_PTHREAD_MUTEX_ADAPTIVE_NP)                                                  #  dbus-sysdeps-pthread.c
+
 # missing:
 # HAVE_ABSTRACT_SOCKETS
 # DBUS_HAVE_GCC33_GCOV
@@ -28,6 +28,8 @@
 
 #cmakedefine DBUS_ENABLE_STATS
 
+#cmakedefine DBUS_ENABLE_USDT 1
+
 #define TEST_LISTEN       "@TEST_LISTEN@"
 
 // test binaries
@@ -71,6 +73,8 @@
 
 #cmakedefine DBUS_HAVE_ATOMIC_INT 1
 #cmakedefine DBUS_USE_ATOMIC_INT_486 1
+/* Use the gcc __sync extension */
+#cmakedefine DBUS_USE_SYNC 1
 #if (defined(__i386__) || defined(__x86_64__))
 # define DBUS_HAVE_ATOMIC_INT 1
 # define DBUS_USE_ATOMIC_INT_486 1
@@ -148,6 +152,8 @@
 #cmakedefine HAVE_STRING_H
 #cmakedefine HAVE_SYSLOG_H
 #cmakedefine HAVE_SYS_EVENTS_H
+#cmakedefine HAVE_SYS_EVENTFD_H
+#cmakedefine HAVE_LINUX_VM_SOCKETS_H
 #cmakedefine HAVE_SYS_INOTIFY_H
 #cmakedefine HAVE_SYS_PRCTL_H
 #cmakedefine HAVE_SYS_RESOURCE_H
@@ -225,10 +231,20 @@
 #cmakedefine   HAVE_PIPE2
 
 #cmakedefine HAVE_ACCEPT4 1
+#cmakedefine HAVE_SCHED_GETCPU 1
+#cmakedefine HAVE_SCHED_SETAFFINITY 1
+#cmakedefine HAVE_MEMFD_CREATE 1
+#cmakedefine HAVE_CLOSE_RANGE 1
+#cmakedefine HAVE_VFORK 1
+#cmakedefine HAVE_GETRANDOM 1
 #cmakedefine HAVE_DIRFD 1
 #cmakedefine HAVE_INOTIFY_INIT1 1
 #cmakedefine HAVE_UNIX_FD_PASSING 1
 
+/* Define to compress tcp connections with LZ4 */
+#cmakedefine HAVE_LZ4 1
+#cmakedefine HAVE_PTHREAD_MUTEX_ADAPTIVE_NP 1
+
 // structs
 /* Define to 1 if you have struct cmsgred */
 #cmakedefine    HAVE_CMSGCRED 1
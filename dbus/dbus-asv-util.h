@@ -39,6 +39,9 @@ void         _dbus_asv_abandon           (DBusMessageIter *iter,
 dbus_bool_t  _dbus_asv_add_uint32        (DBusMessageIter *arr_iter,
                                           const char      *key,
                                           dbus_uint32_t    value);
+dbus_bool_t  _dbus_asv_add_uint64        (DBusMessageIter *arr_iter,
+                                          const char      *key,
+                                          dbus_uint64_t    value);
 dbus_bool_t  _dbus_asv_add_string        (DBusMessageIter *arr_iter,
                                           const char      *key,
                                           const char      *value);
@@ -467,6 +467,37 @@ _dbus_auth_script_run (const DBusString *filename)
         {
           auth_set_unix_credentials (auth, 4312, DBUS_PID_UNSET);
         }
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "PIPELINE"))
+        {
+          if (!_dbus_auth_client_pipeline (auth))
+            {
+              _dbus_warn ("no memory to pipeline the auth conversation\n");
+              goto out;
+            }
+        }
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "SHARED_MEMORY"))
+        {
+          /* the ring needs fd passing, so pretend we have that too */
+          _dbus_auth_set_unix_fd_possible (auth, TRUE);
+          _dbus_auth_set_shared_memory_possible (auth, TRUE);
+        }
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "REQUEST_SHARED_MEMORY"))
+        {
+          _dbus_auth_client_request_shared_memory (auth);
+        }
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "COMPRESSION"))
+        {
+          _dbus_auth_set_compression_possible (auth, TRUE);
+        }
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "REQUEST_COMPRESSION"))
+        {
+          _dbus_auth_client_request_compression (auth);
+        }
       else if (_dbus_string_starts_with_c_str (&line,
                                                "ALLOWED_MECHS"))
         {
@@ -692,6 +723,42 @@ _dbus_auth_script_run (const DBusString *filename)
               goto out;
             }
         }
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "EXPECT_SHARED_MEMORY"))
+        {
+          if (!_dbus_auth_get_shared_memory_negotiated (auth))
+            {
+              _dbus_warn ("Expected a shared memory ring to be negotiated\n");
+              goto out;
+            }
+        }
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "EXPECT_NO_SHARED_MEMORY"))
+        {
+          if (_dbus_auth_get_shared_memory_negotiated (auth))
+            {
+              _dbus_warn ("Expected no shared memory ring to be negotiated\n");
+              goto out;
+            }
+        }
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "EXPECT_COMPRESSION"))
+        {
+          if (!_dbus_auth_get_compression_negotiated (auth))
+            {
+              _dbus_warn ("Expected compression to be negotiated\n");
+              goto out;
+            }
+        }
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "EXPECT_NO_COMPRESSION"))
+        {
+          if (_dbus_auth_get_compression_negotiated (auth))
+            {
+              _dbus_warn ("Expected no compression to be negotiated\n");
+              goto out;
+            }
+        }
       else if (_dbus_string_starts_with_c_str (&line,
                                                "EXPECT_HAVE_NO_CREDENTIALS"))
         {
@@ -782,6 +849,16 @@ _dbus_auth_script_run (const DBusString *filename)
           _dbus_warn ("did not expect unused bytes (scripts must specify explicitly if they are expected)\n");
           goto out;
         }
+
+      /* as the transport does next; this must not lose what was
+       * negotiated */
+      _dbus_auth_shrink (auth);
+
+      if (_dbus_auth_do_work (auth) != DBUS_AUTH_STATE_AUTHENTICATED)
+        {
+          _dbus_warn ("no longer authenticated after giving back auth memory\n");
+          goto out;
+        }
     }
 
   if (_dbus_string_get_length (&from_auth) > 0)
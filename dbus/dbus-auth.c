@@ -23,6 +23,7 @@
 
 #include <config.h>
 #include "dbus-auth.h"
+#include "dbus-compress.h"
 #include "dbus-string.h"
 #include "dbus-list.h"
 #include "dbus-internals.h"
@@ -126,7 +127,11 @@ typedef enum {
   DBUS_AUTH_COMMAND_ERROR,
   DBUS_AUTH_COMMAND_UNKNOWN,
   DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD,
-  DBUS_AUTH_COMMAND_AGREE_UNIX_FD
+  DBUS_AUTH_COMMAND_AGREE_UNIX_FD,
+  DBUS_AUTH_COMMAND_NEGOTIATE_SHARED_MEMORY,
+  DBUS_AUTH_COMMAND_AGREE_SHARED_MEMORY,
+  DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION,
+  DBUS_AUTH_COMMAND_AGREE_COMPRESSION
 } DBusAuthCommand;
 
 /**
@@ -191,6 +196,16 @@ struct DBusAuth
 
   unsigned int unix_fd_possible : 1;  /**< This side could do unix fd passing */
   unsigned int unix_fd_negotiated : 1; /**< Unix fd was successfully negotiated */
+
+  unsigned int shared_memory_possible : 1;  /**< This side could use a shared memory ring */
+  unsigned int shared_memory_requested : 1; /**< The client wants to use a shared memory ring */
+  unsigned int shared_memory_negotiated : 1; /**< The shared memory ring was successfully negotiated */
+
+  unsigned int compression_possible : 1;  /**< This side could compress the message stream */
+  unsigned int compression_requested : 1; /**< The client wants to compress the message stream */
+  unsigned int compression_negotiated : 1; /**< Compression was successfully negotiated */
+
+  DBusCompressor *compressor;       /**< Compresses the message stream once negotiated */
 };
 
 /**
@@ -234,6 +249,9 @@ static dbus_bool_t send_begin                (DBusAuth *auth);
 static dbus_bool_t send_cancel               (DBusAuth *auth);
 static dbus_bool_t send_negotiate_unix_fd    (DBusAuth *auth);
 static dbus_bool_t send_agree_unix_fd        (DBusAuth *auth);
+static dbus_bool_t send_agree_shared_memory  (DBusAuth *auth);
+static dbus_bool_t send_negotiate_compression (DBusAuth *auth);
+static dbus_bool_t send_agree_compression    (DBusAuth *auth);
 
 /**
  * Client states
@@ -275,6 +293,18 @@ static dbus_bool_t handle_client_state_waiting_for_reject (DBusAuth         *aut
 static dbus_bool_t handle_client_state_waiting_for_agree_unix_fd (DBusAuth         *auth,
                                                            DBusAuthCommand   command,
                                                            const DBusString *args);
+static dbus_bool_t handle_client_state_waiting_for_agree_shared_memory (DBusAuth         *auth,
+                                                           DBusAuthCommand   command,
+                                                           const DBusString *args);
+static dbus_bool_t handle_client_state_waiting_for_agree_compression (DBusAuth         *auth,
+                                                           DBusAuthCommand   command,
+                                                           const DBusString *args);
+static dbus_bool_t handle_client_state_pipelined_waiting_for_ok (DBusAuth         *auth,
+                                                           DBusAuthCommand   command,
+                                                           const DBusString *args);
+static dbus_bool_t handle_client_state_pipelined_waiting_for_agree_unix_fd (DBusAuth         *auth,
+                                                           DBusAuthCommand   command,
+                                                           const DBusString *args);
 
 static const DBusAuthStateData client_state_need_send_auth = {
   "NeedSendAuth", NULL
@@ -291,6 +321,19 @@ static const DBusAuthStateData client_state_waiting_for_reject = {
 static const DBusAuthStateData client_state_waiting_for_agree_unix_fd = {
   "WaitingForAgreeUnixFD", handle_client_state_waiting_for_agree_unix_fd
 };
+static const DBusAuthStateData client_state_waiting_for_agree_shared_memory = {
+  "WaitingForAgreeSharedMemory", handle_client_state_waiting_for_agree_shared_memory
+};
+static const DBusAuthStateData client_state_waiting_for_agree_compression = {
+  "WaitingForAgreeCompression", handle_client_state_waiting_for_agree_compression
+};
+/* BEGIN has already been sent in these two */
+static const DBusAuthStateData client_state_pipelined_waiting_for_ok = {
+  "PipelinedWaitingForOK", handle_client_state_pipelined_waiting_for_ok
+};
+static const DBusAuthStateData client_state_pipelined_waiting_for_agree_unix_fd = {
+  "PipelinedWaitingForAgreeUnixFD", handle_client_state_pipelined_waiting_for_agree_unix_fd
+};
 
 /**
  * Common terminal states.  Terminal states have handler == NULL.
@@ -563,8 +606,8 @@ sha1_handle_first_client_response (DBusAuth         *auth,
     }
 
   /* we cache the keyring for speed, so here we drop it if it's the
-   * wrong one. FIXME caching the keyring here is useless since we use
-   * a different DBusAuth for every connection.
+   * wrong one. Keyrings are also shared between DBusAuths, so getting
+   * it again for a new connection doesn't re-read the file.
    */
   if (auth->keyring &&
       !_dbus_keyring_is_for_credentials (auth->keyring,
@@ -1504,6 +1547,10 @@ send_rejected (DBusAuth *auth)
     goto nomem;
 
   shutdown_mech (auth);
+
+  /* agreed for the old mechanism, which may not suit the next one */
+  auth->shared_memory_negotiated = FALSE;
+  auth->compression_negotiated = FALSE;
   
   _dbus_assert (DBUS_AUTH_IS_SERVER (auth));
   server_auth = DBUS_AUTH_SERVER (auth);
@@ -1566,10 +1613,11 @@ send_begin (DBusAuth         *auth)
   return TRUE;
 }
 
+/* Returns FALSE on OOM; a bad GUID moves us to need_disconnect */
 static dbus_bool_t
-process_ok(DBusAuth *auth,
-          const DBusString *args_from_ok) {
-
+record_guid_from_server (DBusAuth         *auth,
+                         const DBusString *args_from_ok)
+{
   int end_of_hex;
   
   /* "args_from_ok" should be the GUID, whitespace already pulled off the front */
@@ -1602,11 +1650,39 @@ process_ok(DBusAuth *auth,
   _dbus_verbose ("Got GUID '%s' from the server\n",
                  _dbus_string_get_const_data (& DBUS_AUTH_CLIENT (auth)->guid_from_server));
 
+  return TRUE;
+}
+
+static dbus_bool_t
+process_ok(DBusAuth *auth,
+          const DBusString *args_from_ok) {
+
+  if (!record_guid_from_server (auth, args_from_ok))
+    return FALSE;
+
+  if (auth->state == &common_state_need_disconnect)
+    return TRUE;
+
   if (auth->unix_fd_possible)
-    return send_negotiate_unix_fd(auth);
+    {
+      if (send_negotiate_unix_fd (auth))
+        return TRUE;
+    }
+  else if (auth->compression_requested && auth->compression_possible)
+    {
+      if (send_negotiate_compression (auth))
+        return TRUE;
+    }
+  else
+    {
+      _dbus_verbose("Not negotiating unix fd passing, since not possible\n");
+      if (send_begin (auth))
+        return TRUE;
+    }
 
-  _dbus_verbose("Not negotiating unix fd passing, since not possible\n");
-  return send_begin (auth);
+  /* OOM: forget the GUID so that the OK can be processed again */
+  _dbus_string_set_length (& DBUS_AUTH_CLIENT (auth)->guid_from_server, 0);
+  return FALSE;
 }
 
 static dbus_bool_t
@@ -1628,9 +1704,10 @@ process_data (DBusAuth             *auth,
 {
   int end;
   DBusString decoded;
+  unsigned char decoded_storage[64];
 
-  if (!_dbus_string_init (&decoded))
-    return FALSE;
+  _dbus_string_init_borrowed (&decoded, decoded_storage,
+                              sizeof (decoded_storage));
 
   if (!_dbus_string_hex_decode (args, 0, &end, &decoded, 0))
     {
@@ -1648,7 +1725,8 @@ process_data (DBusAuth             *auth,
     }
 
 #ifdef DBUS_ENABLE_VERBOSE_MODE
-  if (_dbus_string_validate_ascii (&decoded, 0,
+  if (_dbus_is_verbose () &&
+      _dbus_string_validate_ascii (&decoded, 0,
                                    _dbus_string_get_length (&decoded)))
     _dbus_verbose ("%s: data: '%s'\n",
                    DBUS_AUTH_NAME (auth),
@@ -1692,6 +1770,92 @@ send_agree_unix_fd (DBusAuth *auth)
   return TRUE;
 }
 
+static dbus_bool_t
+send_negotiate_shared_memory (DBusAuth *auth)
+{
+  if (!_dbus_string_append (&auth->outgoing,
+                            "NEGOTIATE_SHARED_MEMORY\r\n"))
+    return FALSE;
+
+  goto_state (auth, &client_state_waiting_for_agree_shared_memory);
+  return TRUE;
+}
+
+static dbus_bool_t
+send_agree_shared_memory (DBusAuth *auth)
+{
+  if (!_dbus_string_append (&auth->outgoing,
+                            "AGREE_SHARED_MEMORY\r\n"))
+    return FALSE;
+
+  auth->shared_memory_negotiated = TRUE;
+  _dbus_verbose ("Agreed to a shared memory ring\n");
+
+  goto_state (auth, &server_state_waiting_for_begin);
+  return TRUE;
+}
+
+/* The only algorithm there is, so far */
+#define COMPRESSION_LZ4 "lz4"
+
+static dbus_bool_t
+send_negotiate_compression (DBusAuth *auth)
+{
+  if (!_dbus_string_append (&auth->outgoing,
+                            "NEGOTIATE_COMPRESSION " COMPRESSION_LZ4 "\r\n"))
+    return FALSE;
+
+  goto_state (auth, &client_state_waiting_for_agree_compression);
+  return TRUE;
+}
+
+static dbus_bool_t
+send_agree_compression (DBusAuth *auth)
+{
+  if (auth->compressor == NULL)
+    {
+      auth->compressor = _dbus_compressor_new ();
+
+      if (auth->compressor == NULL)
+        return FALSE;
+    }
+
+  if (!_dbus_string_append (&auth->outgoing,
+                            "AGREE_COMPRESSION " COMPRESSION_LZ4 "\r\n"))
+    return FALSE;
+
+  auth->compression_negotiated = TRUE;
+  _dbus_verbose ("Agreed to compress the message stream\n");
+
+  goto_state (auth, &server_state_waiting_for_begin);
+  return TRUE;
+}
+
+/* Whether a space-separated list of algorithms includes ours */
+static dbus_bool_t
+offers_lz4 (const DBusString *args)
+{
+  DBusString lz4;
+  int start;
+  int end;
+
+  _dbus_string_init_const (&lz4, COMPRESSION_LZ4);
+  start = 0;
+
+  while (start < _dbus_string_get_length (args))
+    {
+      _dbus_string_find_blank (args, start, &end);
+
+      if (end - start == _dbus_string_get_length (&lz4) &&
+          _dbus_string_equal_substring (args, start, end - start, &lz4, 0))
+        return TRUE;
+
+      _dbus_string_skip_blank (args, end, &start);
+    }
+
+  return FALSE;
+}
+
 static dbus_bool_t
 handle_auth (DBusAuth *auth, const DBusString *args)
 {
@@ -1708,17 +1872,16 @@ handle_auth (DBusAuth *auth, const DBusString *args)
       int i;
       DBusString mech;
       DBusString hex_response;
+      unsigned char mech_storage[32];
+      unsigned char hex_response_storage[128];
       
       _dbus_string_find_blank (args, 0, &i);
 
-      if (!_dbus_string_init (&mech))
-        return FALSE;
-
-      if (!_dbus_string_init (&hex_response))
-        {
-          _dbus_string_free (&mech);
-          return FALSE;
-        }
+      /* Mechanism names and the initial response (a hex uid for
+       * EXTERNAL) are short, so this normally stays on the stack */
+      _dbus_string_init_borrowed (&mech, mech_storage, sizeof (mech_storage));
+      _dbus_string_init_borrowed (&hex_response, hex_response_storage,
+                                  sizeof (hex_response_storage));
       
       if (!_dbus_string_copy_len (args, 0, i, &mech, 0))
         goto failed;
@@ -1784,12 +1947,16 @@ handle_server_state_waiting_for_auth  (DBusAuth         *auth,
       return send_rejected (auth);
 
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_SHARED_MEMORY:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
       return send_error (auth, "Need to authenticate first");
 
     case DBUS_AUTH_COMMAND_REJECTED:
     case DBUS_AUTH_COMMAND_OK:
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_SHARED_MEMORY:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -1817,12 +1984,16 @@ handle_server_state_waiting_for_data  (DBusAuth         *auth,
       return TRUE;
 
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_SHARED_MEMORY:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
       return send_error (auth, "Need to authenticate first");
 
     case DBUS_AUTH_COMMAND_REJECTED:
     case DBUS_AUTH_COMMAND_OK:
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_SHARED_MEMORY:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -1846,15 +2017,36 @@ handle_server_state_waiting_for_begin (DBusAuth         *auth,
       return TRUE;
 
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
-      if (auth->unix_fd_possible)
+      if (auth->unix_fd_possible && !auth->compression_negotiated)
         return send_agree_unix_fd(auth);
       else
         return send_error(auth, "Unix FD passing not supported, not authenticated or otherwise not possible");
 
+    case DBUS_AUTH_COMMAND_NEGOTIATE_SHARED_MEMORY:
+      /* The ring carries the messages and the socket their fds, so it
+       * needs fd passing; and it has no room for encoding the data */
+      if (auth->shared_memory_possible && auth->unix_fd_negotiated &&
+          auth->mech != NULL && auth->mech->server_encode_func == NULL)
+        return send_agree_shared_memory (auth);
+      else
+        return send_error (auth, "Shared memory not supported or not possible without Unix FD passing");
+
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+      /* Compressed data goes through the encoding hooks, which can't
+       * carry fds, or data a mechanism encodes as well */
+      if (auth->compression_possible && !auth->unix_fd_negotiated &&
+          auth->mech != NULL && auth->mech->server_encode_func == NULL &&
+          offers_lz4 (args))
+        return send_agree_compression (auth);
+      else
+        return send_error (auth, "Compression not supported or not possible");
+
     case DBUS_AUTH_COMMAND_REJECTED:
     case DBUS_AUTH_COMMAND_OK:
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_SHARED_MEMORY:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
     default:
       return send_error (auth, "Unknown command");
 
@@ -2030,6 +2222,10 @@ handle_client_state_waiting_for_data (DBusAuth         *auth,
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_SHARED_MEMORY:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_AGREE_SHARED_MEMORY:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -2058,6 +2254,10 @@ handle_client_state_waiting_for_ok (DBusAuth         *auth,
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_SHARED_MEMORY:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_AGREE_SHARED_MEMORY:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -2082,6 +2282,10 @@ handle_client_state_waiting_for_reject (DBusAuth         *auth,
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_SHARED_MEMORY:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_AGREE_SHARED_MEMORY:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
     default:
       goto_state (auth, &common_state_need_disconnect);
       return TRUE;
@@ -2099,6 +2303,10 @@ handle_client_state_waiting_for_agree_unix_fd(DBusAuth         *auth,
       _dbus_assert(auth->unix_fd_possible);
       auth->unix_fd_negotiated = TRUE;
       _dbus_verbose("Successfully negotiated UNIX FD passing\n");
+
+      if (auth->shared_memory_requested && auth->shared_memory_possible)
+        return send_negotiate_shared_memory (auth);
+
       return send_begin (auth);
 
     case DBUS_AUTH_COMMAND_ERROR:
@@ -2115,11 +2323,188 @@ handle_client_state_waiting_for_agree_unix_fd(DBusAuth         *auth,
     case DBUS_AUTH_COMMAND_BEGIN:
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_SHARED_MEMORY:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_AGREE_SHARED_MEMORY:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
+    default:
+      return send_error (auth, "Unknown command");
+    }
+}
+
+static dbus_bool_t
+handle_client_state_waiting_for_agree_shared_memory (DBusAuth         *auth,
+                                                     DBusAuthCommand   command,
+                                                     const DBusString *args)
+{
+  switch (command)
+    {
+    case DBUS_AUTH_COMMAND_AGREE_SHARED_MEMORY:
+      _dbus_assert (auth->shared_memory_possible);
+      auth->shared_memory_negotiated = TRUE;
+      _dbus_verbose ("Successfully negotiated a shared memory ring\n");
+      return send_begin (auth);
+
+    case DBUS_AUTH_COMMAND_ERROR:
+      _dbus_assert (auth->shared_memory_possible);
+      auth->shared_memory_negotiated = FALSE;
+      _dbus_verbose ("Failed to negotiate a shared memory ring\n");
+      return send_begin (auth);
+
+    case DBUS_AUTH_COMMAND_OK:
+    case DBUS_AUTH_COMMAND_DATA:
+    case DBUS_AUTH_COMMAND_REJECTED:
+    case DBUS_AUTH_COMMAND_AUTH:
+    case DBUS_AUTH_COMMAND_CANCEL:
+    case DBUS_AUTH_COMMAND_BEGIN:
+    case DBUS_AUTH_COMMAND_UNKNOWN:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_SHARED_MEMORY:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
+    default:
+      return send_error (auth, "Unknown command");
+    }
+}
+
+static dbus_bool_t
+handle_client_state_waiting_for_agree_compression (DBusAuth         *auth,
+                                                   DBusAuthCommand   command,
+                                                   const DBusString *args)
+{
+  switch (command)
+    {
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
+      _dbus_assert (auth->compression_possible);
+
+      if (!offers_lz4 (args))
+        {
+          _dbus_verbose ("Server agreed to a compression algorithm we didn't offer\n");
+          goto_state (auth, &common_state_need_disconnect);
+          return TRUE;
+        }
+
+      if (auth->compressor == NULL)
+        {
+          auth->compressor = _dbus_compressor_new ();
+
+          if (auth->compressor == NULL)
+            return FALSE;
+        }
+
+      auth->compression_negotiated = TRUE;
+      _dbus_verbose ("Successfully negotiated compression\n");
+      return send_begin (auth);
+
+    case DBUS_AUTH_COMMAND_ERROR:
+      _dbus_assert (auth->compression_possible);
+      auth->compression_negotiated = FALSE;
+      _dbus_verbose ("Failed to negotiate compression\n");
+      return send_begin (auth);
+
+    case DBUS_AUTH_COMMAND_OK:
+    case DBUS_AUTH_COMMAND_DATA:
+    case DBUS_AUTH_COMMAND_REJECTED:
+    case DBUS_AUTH_COMMAND_AUTH:
+    case DBUS_AUTH_COMMAND_CANCEL:
+    case DBUS_AUTH_COMMAND_BEGIN:
+    case DBUS_AUTH_COMMAND_UNKNOWN:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_SHARED_MEMORY:
+    case DBUS_AUTH_COMMAND_AGREE_SHARED_MEMORY:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
     default:
       return send_error (auth, "Unknown command");
     }
 }
 
+static dbus_bool_t
+handle_client_state_pipelined_waiting_for_ok (DBusAuth         *auth,
+                                              DBusAuthCommand   command,
+                                              const DBusString *args)
+{
+  switch (command)
+    {
+    case DBUS_AUTH_COMMAND_OK:
+      if (!record_guid_from_server (auth, args))
+        return FALSE;
+
+      if (auth->state == &common_state_need_disconnect)
+        return TRUE;
+
+      if (auth->unix_fd_possible)
+        goto_state (auth, &client_state_pipelined_waiting_for_agree_unix_fd);
+      else
+        goto_state (auth, &common_state_authenticated);
+
+      return TRUE;
+
+    case DBUS_AUTH_COMMAND_REJECTED:
+    case DBUS_AUTH_COMMAND_DATA:
+    case DBUS_AUTH_COMMAND_ERROR:
+    case DBUS_AUTH_COMMAND_AUTH:
+    case DBUS_AUTH_COMMAND_CANCEL:
+    case DBUS_AUTH_COMMAND_BEGIN:
+    case DBUS_AUTH_COMMAND_UNKNOWN:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_SHARED_MEMORY:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_AGREE_SHARED_MEMORY:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
+    default:
+      /* We have already sent BEGIN, and probably messages after it,
+       * so we can't go back and try another mechanism.
+       */
+      _dbus_verbose ("%s: Disconnecting because the server did not accept "
+                     "our pipelined authentication\n",
+                     DBUS_AUTH_NAME (auth));
+      goto_state (auth, &common_state_need_disconnect);
+      return TRUE;
+    }
+}
+
+static dbus_bool_t
+handle_client_state_pipelined_waiting_for_agree_unix_fd (DBusAuth         *auth,
+                                                         DBusAuthCommand   command,
+                                                         const DBusString *args)
+{
+  switch (command)
+    {
+    case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+      _dbus_assert(auth->unix_fd_possible);
+      auth->unix_fd_negotiated = TRUE;
+      _dbus_verbose("Successfully negotiated UNIX FD passing\n");
+      goto_state (auth, &common_state_authenticated);
+      return TRUE;
+
+    case DBUS_AUTH_COMMAND_ERROR:
+      _dbus_assert(auth->unix_fd_possible);
+      auth->unix_fd_negotiated = FALSE;
+      _dbus_verbose("Failed to negotiate UNIX FD passing\n");
+      goto_state (auth, &common_state_authenticated);
+      return TRUE;
+
+    case DBUS_AUTH_COMMAND_OK:
+    case DBUS_AUTH_COMMAND_DATA:
+    case DBUS_AUTH_COMMAND_REJECTED:
+    case DBUS_AUTH_COMMAND_AUTH:
+    case DBUS_AUTH_COMMAND_CANCEL:
+    case DBUS_AUTH_COMMAND_BEGIN:
+    case DBUS_AUTH_COMMAND_UNKNOWN:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_SHARED_MEMORY:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_AGREE_SHARED_MEMORY:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
+    default:
+      goto_state (auth, &common_state_need_disconnect);
+      return TRUE;
+    }
+}
+
 /**
  * Mapping from command name to enum
  */
@@ -2137,7 +2522,11 @@ static const DBusAuthCommandName auth_command_names[] = {
   { "OK",                DBUS_AUTH_COMMAND_OK },
   { "ERROR",             DBUS_AUTH_COMMAND_ERROR },
   { "NEGOTIATE_UNIX_FD", DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD },
-  { "AGREE_UNIX_FD",     DBUS_AUTH_COMMAND_AGREE_UNIX_FD }
+  { "AGREE_UNIX_FD",     DBUS_AUTH_COMMAND_AGREE_UNIX_FD },
+  { "NEGOTIATE_SHARED_MEMORY", DBUS_AUTH_COMMAND_NEGOTIATE_SHARED_MEMORY },
+  { "AGREE_SHARED_MEMORY", DBUS_AUTH_COMMAND_AGREE_SHARED_MEMORY },
+  { "NEGOTIATE_COMPRESSION", DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION },
+  { "AGREE_COMPRESSION", DBUS_AUTH_COMMAND_AGREE_COMPRESSION }
 };
 
 static DBusAuthCommand
@@ -2174,6 +2563,8 @@ process_command (DBusAuth *auth)
   DBusAuthCommand command;
   DBusString line;
   DBusString args;
+  unsigned char line_storage[256];
+  unsigned char args_storage[192];
   int eol;
   int i, j;
   dbus_bool_t retval;
@@ -2186,18 +2577,11 @@ process_command (DBusAuth *auth)
   if (!_dbus_string_find (&auth->incoming, 0, "\r\n", &eol))
     return FALSE;
   
-  if (!_dbus_string_init (&line))
-    {
-      auth->needed_memory = TRUE;
-      return FALSE;
-    }
-
-  if (!_dbus_string_init (&args))
-    {
-      _dbus_string_free (&line);
-      auth->needed_memory = TRUE;
-      return FALSE;
-    }
+  /* Commands are a single short line, so parse them in stack
+   * buffers; a whole AUTH EXTERNAL / NEGOTIATE_UNIX_FD / BEGIN
+   * exchange then needs no heap strings of its own. */
+  _dbus_string_init_borrowed (&line, line_storage, sizeof (line_storage));
+  _dbus_string_init_borrowed (&args, args_storage, sizeof (args_storage));
   
   if (!_dbus_string_copy_len (&auth->incoming, 0, eol, &line, 0))
     goto out;
@@ -2240,10 +2624,8 @@ process_command (DBusAuth *auth)
    * of the incoming buffer and return TRUE to try another command.
    */
 
-  _dbus_string_delete (&auth->incoming, 0, eol);
-  
-  /* kill the \r\n */
-  _dbus_string_delete (&auth->incoming, 0, 2);
+  /* the command and its \r\n */
+  _dbus_string_delete (&auth->incoming, 0, eol + 2);
 
   retval = TRUE;
   
@@ -2399,6 +2781,9 @@ _dbus_auth_unref (DBusAuth *auth)
       if (auth->keyring)
         _dbus_keyring_unref (auth->keyring);
 
+      if (auth->compressor)
+        _dbus_compressor_free (auth->compressor);
+
       _dbus_string_free (&auth->context);
       _dbus_string_free (&auth->challenge);
       _dbus_string_free (&auth->identity);
@@ -2610,6 +2995,66 @@ _dbus_auth_delete_unused_bytes (DBusAuth *auth)
   _dbus_string_set_length (&auth->incoming, 0);
 }
 
+/**
+ * Called once the transport has taken the unused bytes, to give back
+ * the memory the auth conversation only needed while it was going
+ * on. What it negotiated, the authorized identity and the server's
+ * GUID are kept, as are any bytes still waiting to be sent. A bus
+ * keeps one of these for every connection for as long as it lasts,
+ * so this adds up.
+ *
+ * @param auth the auth conversation, which must have finished
+ */
+void
+_dbus_auth_shrink (DBusAuth *auth)
+{
+  if (!DBUS_AUTH_IN_END_STATE (auth))
+    return;
+
+  _dbus_assert (!auth->buffer_outstanding);
+
+  if (auth->keyring)
+    {
+      _dbus_keyring_unref (auth->keyring);
+      auth->keyring = NULL;
+    }
+
+  dbus_free_string_array (auth->allowed_mechs);
+  auth->allowed_mechs = NULL;
+
+  if (DBUS_AUTH_IS_CLIENT (auth))
+    _dbus_list_clear (& DBUS_AUTH_CLIENT (auth)->mechs_to_try);
+
+  _dbus_credentials_clear (auth->credentials);
+  _dbus_credentials_clear (auth->desired_identity);
+
+  /* If compacting fails, a string just stays as large as it was */
+  _dbus_string_set_length (&auth->identity, 0);
+  _dbus_string_compact (&auth->identity, 0);
+  _dbus_string_set_length (&auth->context, 0);
+  _dbus_string_compact (&auth->context, 0);
+  _dbus_string_set_length (&auth->challenge, 0);
+  _dbus_string_compact (&auth->challenge, 0);
+  _dbus_string_compact (&auth->incoming, 0);
+  _dbus_string_compact (&auth->outgoing, 0);
+}
+
+/**
+ * Gets how much memory the auth conversation's buffers are holding.
+ *
+ * @param auth the auth conversation
+ * @returns the number of bytes allocated
+ */
+int
+_dbus_auth_get_buffer_bytes (DBusAuth *auth)
+{
+  return _dbus_string_get_allocated (&auth->incoming) +
+    _dbus_string_get_allocated (&auth->outgoing) +
+    _dbus_string_get_allocated (&auth->identity) +
+    _dbus_string_get_allocated (&auth->context) +
+    _dbus_string_get_allocated (&auth->challenge);
+}
+
 /**
  * Called post-authentication, indicates whether we need to encode
  * the message stream with _dbus_auth_encode_data() prior to
@@ -2623,6 +3068,9 @@ _dbus_auth_needs_encoding (DBusAuth *auth)
 {
   if (auth->state != &common_state_authenticated)
     return FALSE;
+
+  if (auth->compression_negotiated)
+    return TRUE;
   
   if (auth->mech != NULL)
     {
@@ -2655,7 +3103,9 @@ _dbus_auth_encode_data (DBusAuth         *auth,
   if (auth->state != &common_state_authenticated)
     return FALSE;
   
-  if (_dbus_auth_needs_encoding (auth))
+  if (auth->compression_negotiated)
+    return _dbus_compressor_encode (auth->compressor, plaintext, encoded);
+  else if (_dbus_auth_needs_encoding (auth))
     {
       if (DBUS_AUTH_IS_CLIENT (auth))
         return (* auth->mech->client_encode_func) (auth, plaintext, encoded);
@@ -2682,6 +3132,9 @@ _dbus_auth_needs_decoding (DBusAuth *auth)
 {
   if (auth->state != &common_state_authenticated)
     return FALSE;
+
+  if (auth->compression_negotiated)
+    return TRUE;
     
   if (auth->mech != NULL)
     {
@@ -2700,8 +3153,8 @@ _dbus_auth_needs_decoding (DBusAuth *auth)
  * the peer. If no encoding was negotiated, just copies the bytes (you
  * can avoid this by checking _dbus_auth_needs_decoding()).
  *
- * @todo 1.0? We need to be able to distinguish "out of memory" error
- * from "the data is hosed" error.
+ * _dbus_auth_get_data_corrupted() tells an "out of memory" error
+ * from a "the data is hosed" error.
  *
  * @param auth the auth conversation
  * @param encoded the encoded data
@@ -2718,7 +3171,9 @@ _dbus_auth_decode_data (DBusAuth         *auth,
   if (auth->state != &common_state_authenticated)
     return FALSE;
   
-  if (_dbus_auth_needs_decoding (auth))
+  if (auth->compression_negotiated)
+    return _dbus_compressor_decode (auth->compressor, encoded, plaintext);
+  else if (_dbus_auth_needs_decoding (auth))
     {
       if (DBUS_AUTH_IS_CLIENT (auth))
         return (* auth->mech->client_decode_func) (auth, encoded, plaintext);
@@ -2834,6 +3289,197 @@ _dbus_auth_get_unix_fd_negotiated(DBusAuth *auth)
   return auth->unix_fd_negotiated;
 }
 
+/**
+ * Sets whether this side could move messages into a shared memory
+ * ring once authenticated, which also needs unix fd passing. A server
+ * agrees to the ring if the client asks for it and this is set.
+ *
+ * @param auth the auth conversation
+ * @param b #TRUE if a shared memory ring could be used
+ */
+void
+_dbus_auth_set_shared_memory_possible (DBusAuth    *auth,
+                                       dbus_bool_t  b)
+{
+  auth->shared_memory_possible = b;
+}
+
+/**
+ * Makes a client ask for a shared memory ring after it has agreed on
+ * unix fd passing, if _dbus_auth_set_shared_memory_possible() said it
+ * could use one. A pipelined conversation never asks.
+ *
+ * @param auth the client auth conversation
+ */
+void
+_dbus_auth_client_request_shared_memory (DBusAuth *auth)
+{
+  _dbus_assert (DBUS_AUTH_IS_CLIENT (auth));
+
+  auth->shared_memory_requested = TRUE;
+}
+
+/**
+ * Queries whether both sides agreed to use a shared memory ring.
+ *
+ * @param auth the auth conversation
+ * @returns #TRUE if the ring was negotiated
+ */
+dbus_bool_t
+_dbus_auth_get_shared_memory_negotiated (DBusAuth *auth)
+{
+  return auth->shared_memory_negotiated;
+}
+
+/**
+ * Sets whether this side could compress the message stream once
+ * authenticated. Compression goes through the encoding hooks, so it
+ * is only agreed if unix fd passing is not, and if the mechanism does
+ * no encoding of its own.
+ *
+ * @param auth the auth conversation
+ * @param b #TRUE if the message stream could be compressed
+ */
+void
+_dbus_auth_set_compression_possible (DBusAuth    *auth,
+                                     dbus_bool_t  b)
+{
+  auth->compression_possible = b;
+}
+
+/**
+ * Makes a client ask for the message stream to be compressed after it
+ * is authenticated, if _dbus_auth_set_compression_possible() said it
+ * could be. A pipelined conversation never asks.
+ *
+ * @param auth the client auth conversation
+ */
+void
+_dbus_auth_client_request_compression (DBusAuth *auth)
+{
+  _dbus_assert (DBUS_AUTH_IS_CLIENT (auth));
+
+  auth->compression_requested = TRUE;
+}
+
+/**
+ * Queries whether both sides agreed to compress the message stream.
+ *
+ * @param auth the auth conversation
+ * @returns #TRUE if compression was negotiated
+ */
+dbus_bool_t
+_dbus_auth_get_compression_negotiated (DBusAuth *auth)
+{
+  return auth->compression_negotiated;
+}
+
+/**
+ * Whether _dbus_auth_decode_data() failed because the peer sent data
+ * that can't be decoded, rather than for lack of memory; the
+ * connection can't go on after that.
+ *
+ * @param auth the auth conversation
+ * @returns #TRUE if the incoming data is bad
+ */
+dbus_bool_t
+_dbus_auth_get_data_corrupted (DBusAuth *auth)
+{
+  return auth->compressor != NULL &&
+    _dbus_compressor_get_is_corrupted (auth->compressor);
+}
+
+#ifdef DBUS_ENABLE_STATS
+/**
+ * Gets how many bytes the compressor has handled in each direction,
+ * on the wire and as messages.
+ *
+ * @param auth the auth conversation
+ * @param in_wire_bytes returns compressed bytes received
+ * @param in_plain_bytes returns bytes they decompressed to
+ * @param out_wire_bytes returns compressed bytes sent
+ * @param out_plain_bytes returns bytes they were compressed from
+ * @returns #FALSE if compression was not negotiated
+ */
+dbus_bool_t
+_dbus_auth_get_compression_stats (DBusAuth      *auth,
+                                  dbus_uint64_t *in_wire_bytes,
+                                  dbus_uint64_t *in_plain_bytes,
+                                  dbus_uint64_t *out_wire_bytes,
+                                  dbus_uint64_t *out_plain_bytes)
+{
+  if (!auth->compression_negotiated)
+    return FALSE;
+
+  _dbus_compressor_get_stats (auth->compressor, in_wire_bytes, in_plain_bytes,
+                              out_wire_bytes, out_plain_bytes);
+  return TRUE;
+}
+#endif /* DBUS_ENABLE_STATS */
+
+/**
+ * Makes a client queue NEGOTIATE_UNIX_FD (if fd passing is possible)
+ * and BEGIN right behind its initial AUTH EXTERNAL, rather than waiting
+ * for the server's reply to each, so that the whole conversation and
+ * the first messages take a single round-trip. The price is that if the
+ * server does not accept EXTERNAL, we can't fall back to another
+ * mechanism and will disconnect instead.
+ *
+ * Must be called after _dbus_auth_set_unix_fd_possible() and before
+ * anything has been received. Does nothing if the conversation can't
+ * be pipelined, for instance because EXTERNAL is not an allowed
+ * mechanism.
+ *
+ * @param auth the client auth conversation
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_auth_client_pipeline (DBusAuth *auth)
+{
+  DBusString external;
+  int orig_len;
+
+  _dbus_assert (DBUS_AUTH_IS_CLIENT (auth));
+
+  _dbus_string_init_const (&external, all_mechanisms[0].mechanism);
+
+  if (auth->state != &client_state_waiting_for_data ||
+      auth->mech != &all_mechanisms[0] ||
+      find_mech (&external, auth->allowed_mechs) == NULL)
+    return TRUE;
+
+  orig_len = _dbus_string_get_length (&auth->outgoing);
+
+  if (auth->unix_fd_possible &&
+      !_dbus_string_append (&auth->outgoing, "NEGOTIATE_UNIX_FD\r\n"))
+    return FALSE;
+
+  if (!_dbus_string_append (&auth->outgoing, "BEGIN\r\n"))
+    {
+      _dbus_string_set_length (&auth->outgoing, orig_len);
+      return FALSE;
+    }
+
+  goto_state (auth, &client_state_pipelined_waiting_for_ok);
+  return TRUE;
+}
+
+/**
+ * Whether a pipelined client has written everything up to and
+ * including BEGIN, so that messages may follow even though the
+ * server has not replied yet.
+ *
+ * @param auth the auth conversation
+ * @returns #TRUE if messages may be written
+ */
+dbus_bool_t
+_dbus_auth_get_pipelined_begin_sent (DBusAuth *auth)
+{
+  return (auth->state == &client_state_pipelined_waiting_for_ok ||
+          auth->state == &client_state_pipelined_waiting_for_agree_unix_fd) &&
+    _dbus_string_get_length (&auth->outgoing) == 0;
+}
+
 /** @} */
 
 /* tests in dbus-auth-util.c */
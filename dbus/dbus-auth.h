@@ -71,6 +71,9 @@ void          _dbus_auth_get_unused_bytes    (DBusAuth               *auth,
                                               const DBusString      **str);
 DBUS_PRIVATE_EXPORT
 void          _dbus_auth_delete_unused_bytes (DBusAuth               *auth);
+DBUS_PRIVATE_EXPORT
+void          _dbus_auth_shrink              (DBusAuth               *auth);
+int           _dbus_auth_get_buffer_bytes    (DBusAuth               *auth);
 dbus_bool_t   _dbus_auth_needs_encoding      (DBusAuth               *auth);
 dbus_bool_t   _dbus_auth_encode_data         (DBusAuth               *auth,
                                               const DBusString       *plaintext,
@@ -91,6 +94,23 @@ const char*   _dbus_auth_get_guid_from_server(DBusAuth               *auth);
 
 void          _dbus_auth_set_unix_fd_possible(DBusAuth               *auth, dbus_bool_t b);
 dbus_bool_t   _dbus_auth_get_unix_fd_negotiated(DBusAuth             *auth);
+void          _dbus_auth_set_shared_memory_possible (DBusAuth        *auth,
+                                                     dbus_bool_t      b);
+void          _dbus_auth_client_request_shared_memory (DBusAuth      *auth);
+dbus_bool_t   _dbus_auth_get_shared_memory_negotiated (DBusAuth      *auth);
+void          _dbus_auth_set_compression_possible (DBusAuth          *auth,
+                                                   dbus_bool_t        b);
+void          _dbus_auth_client_request_compression (DBusAuth        *auth);
+dbus_bool_t   _dbus_auth_get_compression_negotiated (DBusAuth        *auth);
+dbus_bool_t   _dbus_auth_get_data_corrupted  (DBusAuth               *auth);
+/* if DBUS_ENABLE_STATS */
+dbus_bool_t   _dbus_auth_get_compression_stats (DBusAuth             *auth,
+                                                dbus_uint64_t        *in_wire_bytes,
+                                                dbus_uint64_t        *in_plain_bytes,
+                                                dbus_uint64_t        *out_wire_bytes,
+                                                dbus_uint64_t        *out_plain_bytes);
+dbus_bool_t   _dbus_auth_client_pipeline     (DBusAuth               *auth);
+dbus_bool_t   _dbus_auth_get_pipelined_begin_sent (DBusAuth          *auth);
 
 DBUS_END_DECLS
 
@@ -32,6 +32,11 @@
 #include "dbus-threads-internal.h"
 #include "dbus-connection-internal.h"
 #include "dbus-string.h"
+#include "dbus-pending-call.h"
+#include "dbus-hash.h"
+#include "dbus-sysdeps.h"
+#include "dbus-transport.h"
+#include "dbus-transport-socket.h"
 
 /**
  * @defgroup DBusBus Message bus APIs
@@ -78,6 +83,7 @@ typedef struct
 {
   DBusConnection *connection; /**< Connection we're associated with */
   char *unique_name; /**< Unique name of this connection */
+  DBusHashTable *name_owners; /**< Cached owners of names, "" for none, or #NULL */
 
   unsigned int is_well_known : 1; /**< Is one of the well-known connections in our global array */
 } BusData;
@@ -333,6 +339,9 @@ bus_data_free (void *data)
       _DBUS_UNLOCK (bus);
     }
   
+  if (bd->name_owners != NULL)
+    _dbus_hash_table_unref (bd->name_owners);
+
   dbus_free (bd->unique_name);
   dbus_free (bd);
 
@@ -455,6 +464,13 @@ internal_bus_get (DBusBusType  type,
       bus_connection_addresses[activation_bus_type] != NULL)
     type = activation_bus_type;
   
+  /* This has to be done under the lock, even when the connection is
+   * already there. bus_connections[] only holds a weak ref: on
+   * disconnect, dbus-connection.c clears it through
+   * _dbus_bus_notify_shared_connection_disconnected_unlocked() and then
+   * drops its own ref, which may be the last. Reading the pointer
+   * without the lock and then taking a ref could touch a connection
+   * that has just been freed. */
   if (!private && bus_connections[type] != NULL)
     {
       connection = bus_connections[type];
@@ -1330,6 +1346,353 @@ dbus_bus_name_has_owner (DBusConnection *connection,
   return exists;
 }
 
+/** Most names whose owners we cache per connection. Each takes a
+ * match rule on the bus, and connections have a quota of those.
+ */
+#define MAX_CACHED_NAME_OWNERS 128
+
+#define NAME_OWNER_CHANGED_RULE \
+  "type='signal',sender='" DBUS_SERVICE_DBUS "'," \
+  "interface='" DBUS_INTERFACE_DBUS "',member='NameOwnerChanged'," \
+  "path='" DBUS_PATH_DBUS "',arg0='%s'"
+
+static DBusHandlerResult
+name_owner_cache_filter (DBusConnection *connection,
+                         DBusMessage    *message,
+                         void           *data)
+{
+  BusData *bd = data;
+  const char *name;
+  const char *old_owner;
+  const char *new_owner;
+  char *key;
+  char *value;
+
+  if (!dbus_message_is_signal (message, DBUS_INTERFACE_DBUS,
+                               "NameOwnerChanged") ||
+      !dbus_message_has_sender (message, DBUS_SERVICE_DBUS))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (!dbus_message_get_args (message, NULL,
+                              DBUS_TYPE_STRING, &name,
+                              DBUS_TYPE_STRING, &old_owner,
+                              DBUS_TYPE_STRING, &new_owner,
+                              DBUS_TYPE_INVALID))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (!_DBUS_LOCK (bus_datas))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (bd->name_owners != NULL &&
+      _dbus_hash_table_lookup_string (bd->name_owners, name) != NULL)
+    {
+      key = _dbus_strdup (name);
+      value = _dbus_strdup (new_owner);
+
+      if (key == NULL || value == NULL ||
+          !_dbus_hash_table_insert_string (bd->name_owners, key, value))
+        {
+          /* We can't keep the entry up to date, so forget it */
+          dbus_free (key);
+          dbus_free (value);
+          _dbus_hash_table_remove_string (bd->name_owners, name);
+        }
+    }
+
+  _DBUS_UNLOCK (bus_datas);
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/* Returns FALSE with error set, or TRUE with *owner_p set to a copy of
+ * the owner or NULL if the name has none.
+ */
+static dbus_bool_t
+get_name_owner_cached (DBusConnection *connection,
+                       const char     *name,
+                       char          **owner_p,
+                       DBusError      *error)
+{
+  BusData *bd;
+  const char *cached;
+  DBusMessage *message;
+  DBusMessage *reply;
+  DBusError local_error = DBUS_ERROR_INIT;
+  DBusString rule;
+  const char *owner;
+  dbus_bool_t subscribed;
+  dbus_bool_t keep_rule;
+  char *key;
+  char *value;
+
+  *owner_p = NULL;
+  message = NULL;
+  reply = NULL;
+  subscribed = FALSE;
+  keep_rule = FALSE;
+
+  if (!_dbus_string_init (&rule))
+    {
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!_DBUS_LOCK (bus_datas))
+    {
+      _DBUS_SET_OOM (error);
+      goto failed;
+    }
+
+  bd = ensure_bus_data (connection);
+
+  /* Once disconnected, we'd rather report that than a stale answer */
+  if (bd != NULL && bd->name_owners != NULL &&
+      dbus_connection_get_is_connected (connection))
+    {
+      cached = _dbus_hash_table_lookup_string (bd->name_owners, name);
+
+      if (cached != NULL)
+        {
+          if (*cached != '\0')
+            {
+              *owner_p = _dbus_strdup (cached);
+
+              if (*owner_p == NULL)
+                {
+                  _DBUS_UNLOCK (bus_datas);
+                  _DBUS_SET_OOM (error);
+                  goto failed;
+                }
+            }
+
+          _DBUS_UNLOCK (bus_datas);
+          _dbus_string_free (&rule);
+          return TRUE;
+        }
+    }
+
+  if (bd != NULL && bd->name_owners == NULL)
+    {
+      bd->name_owners = _dbus_hash_table_new (DBUS_HASH_STRING,
+                                              dbus_free, dbus_free);
+
+      if (bd->name_owners != NULL &&
+          !dbus_connection_add_filter (connection, name_owner_cache_filter,
+                                       bd, NULL))
+        {
+          _dbus_hash_table_unref (bd->name_owners);
+          bd->name_owners = NULL;
+        }
+    }
+
+  /* Don't hold the global lock while we block */
+  _DBUS_UNLOCK (bus_datas);
+
+  if (bd == NULL || bd->name_owners == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      goto failed;
+    }
+
+  /* Subscribe to changes before asking, so that none can be missed in
+   * between. If we can't, we still answer but don't cache.
+   */
+  if (!_dbus_string_append_printf (&rule, NAME_OWNER_CHANGED_RULE, name))
+    {
+      _DBUS_SET_OOM (error);
+      goto failed;
+    }
+
+  dbus_bus_add_match (connection, _dbus_string_get_const_data (&rule),
+                      &local_error);
+
+  if (dbus_error_is_set (&local_error))
+    {
+      _dbus_verbose ("Not caching owner of %s: %s\n", name,
+                     local_error.message);
+      dbus_error_free (&local_error);
+    }
+  else
+    {
+      subscribed = TRUE;
+    }
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "GetNameOwner");
+
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_INVALID))
+    {
+      _DBUS_SET_OOM (error);
+      goto failed;
+    }
+
+  reply = dbus_connection_send_with_reply_and_block (connection, message,
+                                                     -1, &local_error);
+
+  if (reply == NULL)
+    {
+      if (!dbus_error_has_name (&local_error, DBUS_ERROR_NAME_HAS_NO_OWNER))
+        {
+          dbus_move_error (&local_error, error);
+          goto failed;
+        }
+
+      dbus_error_free (&local_error);
+      owner = "";
+    }
+  else if (!dbus_message_get_args (reply, error,
+                                   DBUS_TYPE_STRING, &owner,
+                                   DBUS_TYPE_INVALID))
+    {
+      goto failed;
+    }
+
+  if (*owner != '\0')
+    {
+      *owner_p = _dbus_strdup (owner);
+
+      if (*owner_p == NULL)
+        {
+          _DBUS_SET_OOM (error);
+          goto failed;
+        }
+    }
+
+  if (subscribed && _DBUS_LOCK (bus_datas))
+    {
+      /* If another thread got there first, its entry is already being
+       * kept up to date, and our rule is a duplicate.
+       */
+      if (_dbus_hash_table_lookup_string (bd->name_owners, name) == NULL &&
+          _dbus_hash_table_get_n_entries (bd->name_owners) <
+          MAX_CACHED_NAME_OWNERS)
+        {
+          key = _dbus_strdup (name);
+          value = _dbus_strdup (owner);
+
+          if (key != NULL && value != NULL &&
+              _dbus_hash_table_insert_string (bd->name_owners, key, value))
+            {
+              keep_rule = TRUE;
+            }
+          else
+            {
+              dbus_free (key);
+              dbus_free (value);
+            }
+        }
+
+      _DBUS_UNLOCK (bus_datas);
+    }
+
+  if (subscribed && !keep_rule)
+    dbus_bus_remove_match (connection, _dbus_string_get_const_data (&rule),
+                           NULL);
+
+  dbus_message_unref (message);
+
+  if (reply != NULL)
+    dbus_message_unref (reply);
+
+  _dbus_string_free (&rule);
+  return TRUE;
+
+ failed:
+  _DBUS_ASSERT_ERROR_IS_SET (error);
+
+  if (subscribed)
+    dbus_bus_remove_match (connection, _dbus_string_get_const_data (&rule),
+                           NULL);
+
+  if (message != NULL)
+    dbus_message_unref (message);
+
+  if (reply != NULL)
+    dbus_message_unref (reply);
+
+  dbus_free (*owner_p);
+  *owner_p = NULL;
+  _dbus_string_free (&rule);
+  return FALSE;
+}
+
+/**
+ * Gets the unique name of the connection that owns a name, like the
+ * GetNameOwner method, but remembers the answer.
+ *
+ * The first time a connection asks about a name, this blocks for a
+ * round-trip to the bus and adds a match rule for the name's
+ * NameOwnerChanged signals. After that, the answer is kept up to date
+ * from those signals and returned without blocking. Since the signals
+ * are only seen when the connection is dispatched, the cache is only
+ * as fresh as the last dispatch; an application that never dispatches
+ * should use GetNameOwner directly. A connection caches at most a
+ * hundred or so names; beyond that, or if the bus won't accept more
+ * match rules, this just makes the call every time.
+ *
+ * If the name has no owner, returns #NULL and sets
+ * #DBUS_ERROR_NAME_HAS_NO_OWNER.
+ *
+ * @param connection the connection
+ * @param name the name
+ * @param error location to store any errors
+ * @returns the owner's unique name, to be freed with dbus_free(), or #NULL
+ */
+char *
+dbus_bus_get_name_owner_cached (DBusConnection *connection,
+                                const char     *name,
+                                DBusError      *error)
+{
+  char *owner;
+
+  _dbus_return_val_if_fail (connection != NULL, NULL);
+  _dbus_return_val_if_fail (name != NULL, NULL);
+  _dbus_return_val_if_fail (_dbus_check_is_valid_bus_name (name), NULL);
+  _dbus_return_val_if_error_is_set (error, NULL);
+
+  if (!get_name_owner_cached (connection, name, &owner, error))
+    return NULL;
+
+  if (owner == NULL)
+    dbus_set_error (error, DBUS_ERROR_NAME_HAS_NO_OWNER,
+                    "Could not get owner of name '%s': no such name", name);
+
+  return owner;
+}
+
+/**
+ * Asks whether a name has an owner, like dbus_bus_name_has_owner(),
+ * but using the cache described for dbus_bus_get_name_owner_cached().
+ *
+ * @param connection the connection
+ * @param name the name
+ * @param error location to store any errors
+ * @returns #TRUE if the name exists, #FALSE if not or on error
+ */
+dbus_bool_t
+dbus_bus_name_has_owner_cached (DBusConnection *connection,
+                                const char     *name,
+                                DBusError      *error)
+{
+  char *owner;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (name != NULL, FALSE);
+  _dbus_return_val_if_fail (_dbus_check_is_valid_bus_name (name), FALSE);
+  _dbus_return_val_if_error_is_set (error, FALSE);
+
+  if (!get_name_owner_cached (connection, name, &owner, error))
+    return FALSE;
+
+  dbus_free (owner);
+  return owner != NULL;
+}
+
 /**
  * Starts a service that will request ownership of the given name.
  * The returned result will be one of be one of
@@ -1599,4 +1962,701 @@ dbus_bus_remove_match (DBusConnection *connection,
   dbus_message_unref (msg);
 }
 
+typedef struct
+{
+  DBusConnection *connection;
+  char **rules;
+  int n_rules;
+  dbus_bool_t add;
+} MatchBatch;
+
+static void
+match_batch_free (void *data)
+{
+  MatchBatch *batch = data;
+
+  dbus_connection_unref (batch->connection);
+  dbus_free_string_array (batch->rules);
+  dbus_free (batch);
+}
+
+static void
+send_match_rules_one_by_one (DBusConnection    *connection,
+                             const char *const *rules,
+                             int                n_rules,
+                             dbus_bool_t        add,
+                             DBusError         *error)
+{
+  int i;
+
+  for (i = 0; i < n_rules; i++)
+    {
+      if (add)
+        dbus_bus_add_match (connection, rules[i], error);
+      else
+        dbus_bus_remove_match (connection, rules[i], error);
+
+      if (error != NULL && dbus_error_is_set (error))
+        return;
+    }
+}
+
+static void
+match_batch_notify (DBusPendingCall *pending,
+                    void            *data)
+{
+  MatchBatch *batch = data;
+  DBusMessage *reply;
+
+  reply = dbus_pending_call_steal_reply (pending);
+
+  if (reply == NULL)
+    return;
+
+  /* A dbus-daemon older than 1.11 doesn't have the batched methods */
+  if (dbus_message_is_error (reply, DBUS_ERROR_UNKNOWN_METHOD))
+    send_match_rules_one_by_one (batch->connection,
+                                 (const char * const *) batch->rules,
+                                 batch->n_rules, batch->add, NULL);
+
+  dbus_message_unref (reply);
+}
+
+static void
+send_match_rules (DBusConnection    *connection,
+                  const char *const *rules,
+                  int                n_rules,
+                  dbus_bool_t        add,
+                  DBusError         *error)
+{
+  DBusMessage *msg;
+  DBusPendingCall *pending;
+  MatchBatch *batch;
+  int i;
+
+  pending = NULL;
+  batch = NULL;
+
+  msg = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                      DBUS_PATH_DBUS,
+                                      DBUS_INTERFACE_DBUS,
+                                      add ? "AddMatches" : "RemoveMatches");
+
+  if (msg == NULL)
+    goto oom;
+
+  if (!dbus_message_append_args (msg,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+                                 &rules, n_rules,
+                                 DBUS_TYPE_INVALID))
+    goto oom;
+
+  if (error)
+    {
+      DBusMessage *reply;
+
+      reply = dbus_connection_send_with_reply_and_block (connection, msg,
+                                                         -1, error);
+
+      if (reply != NULL)
+        {
+          dbus_message_unref (reply);
+        }
+      else if (dbus_error_has_name (error, DBUS_ERROR_UNKNOWN_METHOD))
+        {
+          dbus_error_free (error);
+          send_match_rules_one_by_one (connection, rules, n_rules, add,
+                                       error);
+        }
+
+      dbus_message_unref (msg);
+      return;
+    }
+
+  /* Nonblocking: we only wait for the reply so that we can fall back
+   * to one message per rule if the bus is too old for the batch.
+   */
+  batch = dbus_new0 (MatchBatch, 1);
+
+  if (batch == NULL)
+    goto oom;
+
+  batch->rules = dbus_new0 (char *, n_rules + 1);
+
+  if (batch->rules == NULL)
+    goto oom;
+
+  for (i = 0; i < n_rules; i++)
+    {
+      batch->rules[i] = _dbus_strdup (rules[i]);
+
+      if (batch->rules[i] == NULL)
+        goto oom;
+    }
+
+  batch->n_rules = n_rules;
+  batch->add = add;
+
+  if (!dbus_connection_send_with_reply (connection, msg, &pending, -1) ||
+      pending == NULL)
+    goto oom;
+
+  batch->connection = dbus_connection_ref (connection);
+
+  if (!dbus_pending_call_set_notify (pending, match_batch_notify, batch,
+                                     match_batch_free))
+    {
+      /* the batch is already on its way, so just stop listening */
+      match_batch_free (batch);
+      batch = NULL;
+    }
+  else if (dbus_pending_call_get_completed (pending))
+    {
+      /* another thread dispatched the reply before we were listening */
+      match_batch_notify (pending, batch);
+    }
+
+  dbus_pending_call_unref (pending);
+  dbus_message_unref (msg);
+  return;
+
+oom:
+  if (batch != NULL)
+    {
+      dbus_free_string_array (batch->rules);
+      dbus_free (batch);
+    }
+
+  if (msg != NULL)
+    dbus_message_unref (msg);
+
+  _DBUS_SET_OOM (error);
+}
+
+/**
+ * Adds several match rules at once. This is equivalent to calling
+ * dbus_bus_add_match() for each rule, but the rules are sent to the
+ * bus in a single AddMatches message, and on a bus that supports it
+ * they are added atomically: either all of the rules are added, or
+ * none of them are. This is much cheaper than a round-trip per rule
+ * for applications that subscribe to many signals at startup.
+ *
+ * If you pass #NULL for the error, this function will not block;
+ * the matches won't be added until you flush the connection, and
+ * errors are not reported. If you pass non-#NULL for the error this
+ * function will block until it gets a reply.
+ *
+ * If the message bus is too old to support AddMatches, the rules are
+ * added with one AddMatch call each. In the nonblocking case this
+ * happens when the reply to AddMatches arrives, so rules added by
+ * later calls may take effect before these ones.
+ *
+ * @param connection connection to the message bus
+ * @param rules array of textual match rules
+ * @param n_rules number of rules in the array
+ * @param error location to store any errors
+ */
+void
+dbus_bus_add_matches (DBusConnection    *connection,
+                      const char *const *rules,
+                      int                n_rules,
+                      DBusError         *error)
+{
+  _dbus_return_if_fail (connection != NULL);
+  _dbus_return_if_fail (rules != NULL || n_rules == 0);
+  _dbus_return_if_fail (n_rules >= 0);
+  _dbus_return_if_error_is_set (error);
+
+  send_match_rules (connection, rules, n_rules, TRUE, error);
+}
+
+/**
+ * Removes several previously-added match rules "by value", using a
+ * single RemoveMatches message. Rules are removed in array order; if
+ * one of them is not found, the ones before it stay removed and the
+ * error is #DBUS_ERROR_MATCH_RULE_NOT_FOUND.
+ *
+ * Blocking, and falling back to one RemoveMatch call per rule on a
+ * message bus that is too old, work as for dbus_bus_add_matches().
+ *
+ * @param connection connection to the message bus
+ * @param rules array of textual match rules
+ * @param n_rules number of rules in the array
+ * @param error location to store any errors
+ */
+void
+dbus_bus_remove_matches (DBusConnection    *connection,
+                         const char *const *rules,
+                         int                n_rules,
+                         DBusError         *error)
+{
+  _dbus_return_if_fail (connection != NULL);
+  _dbus_return_if_fail (rules != NULL || n_rules == 0);
+  _dbus_return_if_fail (n_rules >= 0);
+  _dbus_return_if_error_is_set (error);
+
+  send_match_rules (connection, rules, n_rules, FALSE, error);
+}
+
+#ifdef HAVE_UNIX_FD_PASSING
+/* Wraps one end of a socketpair handed out by the bus in a connection
+ * of our own. The bus already vouched for who holds the other end, and
+ * both ends have its credentials rather than each other's, so the two
+ * sides authenticate anonymously. Takes ownership of fd. */
+static DBusConnection *
+connection_for_peer_socket (int          fd,
+                            const char  *peer_name,
+                            dbus_bool_t  is_server,
+                            DBusError   *error)
+{
+  static const char *mechanisms[] = { "ANONYMOUS", NULL };
+  DBusSocket sock = DBUS_SOCKET_INIT;
+  DBusTransport *transport;
+  DBusConnection *connection;
+  DBusString str;
+  DBusGUID guid;
+  char *escaped;
+
+  sock.fd = fd;
+  transport = NULL;
+
+  if (!_dbus_set_socket_nonblocking (sock, error))
+    goto failed;
+
+  if (!_dbus_string_init (&str))
+    {
+      _DBUS_SET_OOM (error);
+      goto failed;
+    }
+
+  if (is_server)
+    {
+      if (!_dbus_generate_uuid (&guid, error))
+        {
+          _dbus_string_free (&str);
+          goto failed;
+        }
+
+      if (_dbus_uuid_encode (&guid, &str))
+        transport = _dbus_transport_new_for_socket (sock, &str, NULL);
+    }
+  else
+    {
+      escaped = dbus_address_escape_value (peer_name);
+
+      if (escaped != NULL &&
+          _dbus_string_append (&str, "peer:name=") &&
+          _dbus_string_append (&str, escaped))
+        transport = _dbus_transport_new_for_socket (sock, NULL, &str);
+
+      dbus_free (escaped);
+    }
+
+  _dbus_string_free (&str);
+
+  if (transport == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      goto failed;
+    }
+
+  /* the transport owns the socket now */
+  _dbus_socket_invalidate (&sock);
+
+  if (!_dbus_transport_set_auth_mechanisms (transport, mechanisms))
+    {
+      _dbus_transport_unref (transport);
+      _DBUS_SET_OOM (error);
+      return NULL;
+    }
+
+  connection = _dbus_connection_new_for_transport (transport);
+  _dbus_transport_unref (transport);
+
+  if (connection == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      return NULL;
+    }
+
+  if (is_server)
+    dbus_connection_set_allow_anonymous (connection, TRUE);
+
+  return connection;
+
+ failed:
+  _dbus_close_socket (sock, NULL);
+  return NULL;
+}
+
+/**
+ * Wraps the socket in a reply to RequestPeerConnection in a connection,
+ * as dbus_bus_request_peer_connection() does once the reply arrives.
+ * The reply may also be an error, which is returned in @p error.
+ *
+ * @param reply the reply from the bus
+ * @param peer_unique_name return location for the owner's unique name, to free with dbus_free(), or #NULL
+ * @param error location to store any errors
+ * @returns a new connection, or #NULL if error is set
+ */
+DBusConnection *
+_dbus_bus_peer_connection_from_reply (DBusMessage  *reply,
+                                      char        **peer_unique_name,
+                                      DBusError    *error)
+{
+  DBusConnection *peer;
+  const char *owner;
+  int fd;
+
+  if (dbus_set_error_from_message (error, reply) ||
+      !dbus_message_get_args (reply, error,
+                              DBUS_TYPE_UNIX_FD, &fd,
+                              DBUS_TYPE_STRING, &owner,
+                              DBUS_TYPE_INVALID))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      return NULL;
+    }
+
+  peer = connection_for_peer_socket (fd, owner, FALSE, error);
+
+  if (peer != NULL && peer_unique_name != NULL)
+    {
+      *peer_unique_name = _dbus_strdup (owner);
+
+      if (*peer_unique_name == NULL)
+        {
+          dbus_connection_close (peer);
+          dbus_connection_unref (peer);
+          peer = NULL;
+          _DBUS_SET_OOM (error);
+        }
+    }
+
+  return peer;
+}
+#endif
+
+/**
+ * Asks the bus for a direct connection to the owner of a name, so that
+ * heavy traffic between the two no longer goes through the bus. The
+ * bus checks that the caller may send a RequestPeerConnection call on
+ * to the owner of @p name, then gives each side one end of a new
+ * socket; the owner receives its end in a PeerConnectionRequested
+ * signal and accepts it with dbus_bus_accept_peer_connection().
+ * This function blocks until the bus replies.
+ *
+ * The returned connection is private, without a bus: messages sent on
+ * it need no destination, and nothing on it goes through the bus's
+ * policy, monitors or match rules. The owner has received everything
+ * this connection sent it through the bus before this call, and gets
+ * the signal before anything sent on the returned connection. The
+ * connection stays tied to the unique name the owner had at the time,
+ * returned in @p peer_unique_name, even if the well-known name changes
+ * hands later; watch NameOwnerChanged to notice that. Close it with
+ * dbus_connection_close() when done, as for dbus_connection_open_private().
+ *
+ * Both connections to the bus must support Unix fd passing.
+ *
+ * @param connection the connection to the bus
+ * @param name the name whose owner to connect to
+ * @param peer_unique_name return location for the owner's unique name, to free with dbus_free(), or #NULL
+ * @param error location to store any errors
+ * @returns a new connection, or #NULL if error is set
+ */
+DBusConnection *
+dbus_bus_request_peer_connection (DBusConnection  *connection,
+                                  const char      *name,
+                                  char           **peer_unique_name,
+                                  DBusError       *error)
+{
+#ifdef HAVE_UNIX_FD_PASSING
+  DBusMessage *msg;
+  DBusMessage *reply;
+  DBusConnection *peer;
+
+  _dbus_return_val_if_fail (connection != NULL, NULL);
+  _dbus_return_val_if_fail (_dbus_check_is_valid_bus_name (name), NULL);
+  _dbus_return_val_if_error_is_set (error, NULL);
+
+  msg = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                      DBUS_PATH_DBUS,
+                                      DBUS_INTERFACE_DBUS,
+                                      "RequestPeerConnection");
+
+  if (msg == NULL ||
+      !dbus_message_append_args (msg, DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_INVALID))
+    {
+      if (msg != NULL)
+        dbus_message_unref (msg);
+      _DBUS_SET_OOM (error);
+      return NULL;
+    }
+
+  reply = dbus_connection_send_with_reply_and_block (connection, msg,
+                                                     -1, error);
+  dbus_message_unref (msg);
+
+  if (reply == NULL)
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      return NULL;
+    }
+
+  peer = _dbus_bus_peer_connection_from_reply (reply, peer_unique_name,
+                                               error);
+  dbus_message_unref (reply);
+  return peer;
+#else
+  _dbus_return_val_if_fail (connection != NULL, NULL);
+  _dbus_return_val_if_error_is_set (error, NULL);
+
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "Peer connections need Unix fd passing");
+  return NULL;
+#endif
+}
+
+/**
+ * Accepts the direct connection offered by a PeerConnectionRequested
+ * signal from the bus, after another connection called
+ * dbus_bus_request_peer_connection() for a name we own. The requester's
+ * unique name is the signal's first argument. Signals that do not come
+ * from the bus are refused.
+ *
+ * The returned connection is private, and is the server side of the
+ * connection: it does not need to be registered with the bus or send
+ * Hello. Close it with dbus_connection_close() when done. Ignoring the
+ * signal instead closes the socket, and the requester's connection is
+ * disconnected.
+ *
+ * @param message the PeerConnectionRequested signal
+ * @param error location to store any errors
+ * @returns a new connection, or #NULL if error is set
+ */
+DBusConnection *
+dbus_bus_accept_peer_connection (DBusMessage *message,
+                                 DBusError   *error)
+{
+#ifdef HAVE_UNIX_FD_PASSING
+  const char *requester;
+  int fd;
+
+  _dbus_return_val_if_fail (message != NULL, NULL);
+  _dbus_return_val_if_error_is_set (error, NULL);
+
+  if (!dbus_message_is_signal (message, DBUS_INTERFACE_DBUS,
+                               "PeerConnectionRequested") ||
+      !dbus_message_has_sender (message, DBUS_SERVICE_DBUS))
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                      "Not a PeerConnectionRequested signal from the bus");
+      return NULL;
+    }
+
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_STRING, &requester,
+                              DBUS_TYPE_UNIX_FD, &fd,
+                              DBUS_TYPE_INVALID))
+    return NULL;
+
+  return connection_for_peer_socket (fd, requester, TRUE, error);
+#else
+  _dbus_return_val_if_fail (message != NULL, NULL);
+  _dbus_return_val_if_error_is_set (error, NULL);
+
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "Peer connections need Unix fd passing");
+  return NULL;
+#endif
+}
+
 /** @} */
+
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+#include "dbus-server.h"
+#include "dbus-test.h"
+
+static void
+steal_new_connection (DBusServer     *server,
+                      DBusConnection *new_connection,
+                      void           *data)
+{
+  DBusConnection **connection_p = data;
+
+  _dbus_assert (*connection_p == NULL);
+  *connection_p = dbus_connection_ref (new_connection);
+}
+
+/* Waits for the next message to @bus, the side playing the message bus,
+ * dispatching @client meanwhile so that it can act on replies */
+static DBusMessage *
+wait_for_call (DBusConnection *client,
+               DBusConnection *bus)
+{
+  DBusMessage *message;
+
+  while ((message = dbus_connection_pop_message (bus)) == NULL)
+    {
+      if (!dbus_connection_read_write_dispatch (client, 0) ||
+          !dbus_connection_read_write (bus, 10))
+        _dbus_assert_not_reached ("disconnected");
+    }
+
+  return message;
+}
+
+/* Checks that @call is a call to the bus's @method with @rule as its
+ * argument, or with @rules as its argument if @rule is #NULL, and
+ * answers it with @error_name or a plain reply */
+static void
+answer_match_call (DBusConnection    *bus,
+                   DBusMessage       *call,
+                   const char        *method,
+                   const char        *rule,
+                   const char *const *rules,
+                   int                n_rules,
+                   const char        *error_name)
+{
+  DBusMessage *reply;
+  const char *arg;
+  char **args;
+  int n_args, i;
+
+  _dbus_assert (dbus_message_is_method_call (call, DBUS_INTERFACE_DBUS,
+                                             method));
+  _dbus_assert (dbus_message_has_destination (call, DBUS_SERVICE_DBUS));
+
+  if (rule != NULL)
+    {
+      if (!dbus_message_get_args (call, NULL,
+                                  DBUS_TYPE_STRING, &arg,
+                                  DBUS_TYPE_INVALID))
+        _dbus_assert_not_reached ("AddMatch or RemoveMatch without a rule");
+
+      _dbus_assert (strcmp (arg, rule) == 0);
+    }
+  else
+    {
+      if (!dbus_message_get_args (call, NULL,
+                                  DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+                                  &args, &n_args,
+                                  DBUS_TYPE_INVALID))
+        _dbus_assert_not_reached ("a batch without rules");
+
+      _dbus_assert (n_args == n_rules);
+
+      for (i = 0; i < n_rules; i++)
+        _dbus_assert (strcmp (args[i], rules[i]) == 0);
+
+      dbus_free_string_array (args);
+    }
+
+  if (error_name != NULL)
+    reply = dbus_message_new_error (call, error_name, "Not here");
+  else
+    reply = dbus_message_new_method_return (call);
+
+  if (reply == NULL || !dbus_connection_send (bus, reply, NULL))
+    _dbus_assert_not_reached ("no memory");
+
+  dbus_connection_flush (bus);
+  dbus_message_unref (reply);
+  dbus_message_unref (call);
+}
+
+/* A batch sent without waiting for the reply falls back to one call
+ * per rule when the bus doesn't know the batched methods */
+static void
+check_match_batch (DBusConnection *client,
+                   DBusConnection *bus,
+                   dbus_bool_t     add,
+                   dbus_bool_t     old_bus)
+{
+  static const char *const rules[] = {
+    "type='signal',member='One'",
+    "type='signal',member='Two'"
+  };
+  const char *batch_method = add ? "AddMatches" : "RemoveMatches";
+  const char *single_method = add ? "AddMatch" : "RemoveMatch";
+  DBusMessage *message;
+  int i;
+
+  if (add)
+    dbus_bus_add_matches (client, rules, _DBUS_N_ELEMENTS (rules), NULL);
+  else
+    dbus_bus_remove_matches (client, rules, _DBUS_N_ELEMENTS (rules), NULL);
+
+  dbus_connection_flush (client);
+
+  answer_match_call (bus, wait_for_call (client, bus), batch_method,
+                     NULL, rules, _DBUS_N_ELEMENTS (rules),
+                     old_bus ? DBUS_ERROR_UNKNOWN_METHOD : NULL);
+
+  if (old_bus)
+    {
+      for (i = 0; i < (int) _DBUS_N_ELEMENTS (rules); i++)
+        answer_match_call (bus, wait_for_call (client, bus), single_method,
+                           rules[i], NULL, 0, NULL);
+    }
+
+  /* a bus that knew the batch gets nothing more; a ping tells us that
+   * the client has dealt with the reply and sent whatever it was going
+   * to send after it */
+  message = dbus_message_new_method_call (NULL, "/", "com.example.Bus",
+                                          "Ping");
+  if (message == NULL || !dbus_connection_send (client, message, NULL))
+    _dbus_assert_not_reached ("no memory");
+
+  dbus_connection_flush (client);
+  dbus_message_unref (message);
+
+  message = wait_for_call (client, bus);
+  _dbus_assert (dbus_message_is_method_call (message, "com.example.Bus",
+                                             "Ping"));
+  dbus_message_unref (message);
+}
+
+dbus_bool_t
+_dbus_bus_test (void)
+{
+  DBusServer *listener;
+  DBusConnection *client;
+  DBusConnection *bus = NULL;
+  DBusError error = DBUS_ERROR_INIT;
+
+  listener = dbus_server_listen ("debug-pipe:name=bus-test", &error);
+  if (listener == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  dbus_server_set_new_connection_function (listener, steal_new_connection,
+                                           &bus, NULL);
+
+  client = dbus_connection_open_private ("debug-pipe:name=bus-test", &error);
+  if (client == NULL)
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (bus != NULL);
+
+  while (!dbus_connection_get_is_authenticated (client) ||
+         !dbus_connection_get_is_authenticated (bus))
+    {
+      dbus_connection_read_write (client, 10);
+      dbus_connection_read_write (bus, 10);
+    }
+
+  check_match_batch (client, bus, TRUE, FALSE);
+  check_match_batch (client, bus, FALSE, FALSE);
+  check_match_batch (client, bus, TRUE, TRUE);
+  check_match_batch (client, bus, FALSE, TRUE);
+
+  dbus_connection_close (client);
+  dbus_connection_unref (client);
+  dbus_connection_close (bus);
+  dbus_connection_unref (bus);
+  dbus_server_disconnect (listener);
+  dbus_server_unref (listener);
+
+  return TRUE;
+}
+#endif /* DBUS_ENABLE_EMBEDDED_TESTS */
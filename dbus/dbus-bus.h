@@ -73,6 +73,14 @@ dbus_bool_t     dbus_bus_name_has_owner   (DBusConnection *connection,
 					   DBusError      *error);
 
 DBUS_EXPORT
+char*           dbus_bus_get_name_owner_cached (DBusConnection *connection,
+                                                const char     *name,
+                                                DBusError      *error);
+DBUS_EXPORT
+dbus_bool_t     dbus_bus_name_has_owner_cached (DBusConnection *connection,
+                                                const char     *name,
+                                                DBusError      *error);
+DBUS_EXPORT
 dbus_bool_t     dbus_bus_start_service_by_name (DBusConnection *connection,
                                                 const char     *name,
                                                 dbus_uint32_t   flags,
@@ -87,6 +95,25 @@ DBUS_EXPORT
 void            dbus_bus_remove_match     (DBusConnection *connection,
                                            const char     *rule,
                                            DBusError      *error);
+DBUS_EXPORT
+void            dbus_bus_add_matches      (DBusConnection    *connection,
+                                           const char *const *rules,
+                                           int                n_rules,
+                                           DBusError         *error);
+DBUS_EXPORT
+void            dbus_bus_remove_matches   (DBusConnection    *connection,
+                                           const char *const *rules,
+                                           int                n_rules,
+                                           DBusError         *error);
+
+DBUS_EXPORT
+DBusConnection *dbus_bus_request_peer_connection (DBusConnection  *connection,
+                                                  const char      *name,
+                                                  char           **peer_unique_name,
+                                                  DBusError       *error);
+DBUS_EXPORT
+DBusConnection *dbus_bus_accept_peer_connection  (DBusMessage     *message,
+                                                  DBusError       *error);
 
 /** @} */
 
@@ -0,0 +1,621 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-compress.c  Compression of the message stream after authentication
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "dbus-compress.h"
+#include "dbus-protocol.h"
+#include "dbus-test.h"
+
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+/**
+ * @defgroup DBusCompressor Message stream compression
+ * @ingroup  DBusInternals
+ * @brief LZ4 compression of what a connection writes to its socket
+ *
+ * Once both sides have agreed on it during authentication, each
+ * block of data DBusAuth is asked to encode (a message's header or
+ * body) goes on the wire as a 4-byte big-endian word followed by a
+ * payload. The top bit of the word says whether the payload is
+ * compressed and the rest is its length. A compressed payload starts
+ * with the 4-byte big-endian length of the block it holds, followed
+ * by an LZ4 frame; blocks that are short, or that don't get smaller,
+ * are sent as they are.
+ *
+ * Data that is not compressed is passed on as soon as it arrives,
+ * but a compressed block is only decoded once all of it is in. In a
+ * build without LZ4, nothing is compressed and compressed blocks are
+ * rejected, so transports never offer compression there.
+ *
+ * @{
+ */
+
+/** Length of the word in front of every block */
+#define BLOCK_HEADER_LEN 4
+/** Length of an uncompressed block, in front of the LZ4 frame */
+#define COMPRESSED_HEADER_LEN 4
+/** Set in the block header if the payload is compressed */
+#define BLOCK_COMPRESSED 0x80000000
+
+/* The stream has no alignment, so these go a byte at a time */
+static void
+put_uint32_be (unsigned char *data,
+               dbus_uint32_t  value)
+{
+  data[0] = value >> 24;
+  data[1] = value >> 16;
+  data[2] = value >> 8;
+  data[3] = value;
+}
+
+static dbus_uint32_t
+get_uint32_be (const unsigned char *data)
+{
+  return ((dbus_uint32_t) data[0] << 24) | ((dbus_uint32_t) data[1] << 16) |
+    ((dbus_uint32_t) data[2] << 8) | data[3];
+}
+
+/**
+ * Internals of DBusCompressor
+ */
+struct DBusCompressor
+{
+  DBusString pending;             /**< Received bytes not decoded yet */
+  dbus_uint32_t plain_remaining;  /**< Bytes of an uncompressed block still to come */
+
+#ifdef HAVE_LZ4
+  LZ4F_dctx *dctx;                /**< Decompresses incoming frames */
+#endif
+
+  dbus_uint64_t in_wire_bytes;    /**< Bytes decoded, as received */
+  dbus_uint64_t in_plain_bytes;   /**< Bytes decoded, as passed on */
+  dbus_uint64_t out_wire_bytes;   /**< Bytes encoded, as sent */
+  dbus_uint64_t out_plain_bytes;  /**< Bytes encoded, as given to us */
+
+  unsigned int corrupted : 1;     /**< The peer sent something we can't decode */
+};
+
+/**
+ * Creates a compressor for one connection, which compresses what we
+ * send and decompresses what the peer sends.
+ *
+ * @returns the compressor, or #NULL if no memory
+ */
+DBusCompressor *
+_dbus_compressor_new (void)
+{
+  DBusCompressor *compressor;
+
+  compressor = dbus_new0 (DBusCompressor, 1);
+
+  if (compressor == NULL)
+    return NULL;
+
+  if (!_dbus_string_init (&compressor->pending))
+    {
+      dbus_free (compressor);
+      return NULL;
+    }
+
+#ifdef HAVE_LZ4
+  if (LZ4F_isError (LZ4F_createDecompressionContext (&compressor->dctx,
+                                                     LZ4F_VERSION)))
+    {
+      _dbus_string_free (&compressor->pending);
+      dbus_free (compressor);
+      return NULL;
+    }
+#endif
+
+  return compressor;
+}
+
+/**
+ * Frees a compressor.
+ *
+ * @param compressor the compressor
+ */
+void
+_dbus_compressor_free (DBusCompressor *compressor)
+{
+#ifdef HAVE_LZ4
+  LZ4F_freeDecompressionContext (compressor->dctx);
+#endif
+  _dbus_string_free (&compressor->pending);
+  dbus_free (compressor);
+}
+
+#ifdef HAVE_LZ4
+/* Appends plaintext as a compressed block if that makes it smaller,
+ * returns FALSE on OOM; *compressed says whether it did */
+static dbus_bool_t
+encode_compressed (const DBusString *plaintext,
+                   DBusString       *encoded,
+                   dbus_bool_t      *compressed)
+{
+  int len;
+  int orig_len;
+  size_t bound;
+  size_t n;
+  unsigned char *data;
+
+  *compressed = FALSE;
+
+  len = _dbus_string_get_length (plaintext);
+  orig_len = _dbus_string_get_length (encoded);
+  bound = LZ4F_compressFrameBound (len, NULL);
+
+  if (!_dbus_string_lengthen (encoded,
+                              BLOCK_HEADER_LEN + COMPRESSED_HEADER_LEN + bound))
+    return FALSE;
+
+  data = (unsigned char *) _dbus_string_get_data (encoded) + orig_len;
+  n = LZ4F_compressFrame (data + BLOCK_HEADER_LEN + COMPRESSED_HEADER_LEN,
+                          bound, _dbus_string_get_const_data (plaintext), len,
+                          NULL);
+
+  if (LZ4F_isError (n) || n >= (size_t) len)
+    {
+      _dbus_string_set_length (encoded, orig_len);
+      return TRUE;
+    }
+
+  put_uint32_be (data, BLOCK_COMPRESSED | n);
+  put_uint32_be (data + BLOCK_HEADER_LEN, len);
+  _dbus_string_set_length (encoded,
+                           orig_len + BLOCK_HEADER_LEN + COMPRESSED_HEADER_LEN + n);
+  *compressed = TRUE;
+  return TRUE;
+}
+#endif
+
+/**
+ * Appends a block of data to send to the peer, compressed if it is
+ * long enough for that to be worthwhile.
+ *
+ * @param compressor the compressor
+ * @param plaintext the data
+ * @param encoded string the block is appended to
+ * @returns #FALSE if no memory, leaving encoded as it was
+ */
+dbus_bool_t
+_dbus_compressor_encode (DBusCompressor   *compressor,
+                         const DBusString *plaintext,
+                         DBusString       *encoded)
+{
+  int len;
+  int orig_len;
+
+  len = _dbus_string_get_length (plaintext);
+  orig_len = _dbus_string_get_length (encoded);
+
+  if (len == 0)
+    return TRUE;
+
+#ifdef HAVE_LZ4
+  if (len >= DBUS_COMPRESSOR_MIN_LENGTH)
+    {
+      dbus_bool_t compressed;
+
+      if (!encode_compressed (plaintext, encoded, &compressed))
+        return FALSE;
+
+      if (compressed)
+        goto out;
+    }
+#endif
+
+  if (!_dbus_string_lengthen (encoded, BLOCK_HEADER_LEN))
+    return FALSE;
+
+  put_uint32_be ((unsigned char *) _dbus_string_get_data (encoded) + orig_len,
+                 len);
+
+  if (!_dbus_string_copy (plaintext, 0, encoded, orig_len + BLOCK_HEADER_LEN))
+    {
+      _dbus_string_set_length (encoded, orig_len);
+      return FALSE;
+    }
+
+#ifdef HAVE_LZ4
+ out:
+#endif
+  compressor->out_plain_bytes += len;
+  compressor->out_wire_bytes += _dbus_string_get_length (encoded) - orig_len;
+  return TRUE;
+}
+
+/* Appends the block of plain_len bytes compressed in data to
+ * plaintext; FALSE on OOM, or if the data is bad, which sets the
+ * corrupted flag */
+static dbus_bool_t
+decode_compressed (DBusCompressor      *compressor,
+                   const unsigned char *data,
+                   dbus_uint32_t        len,
+                   dbus_uint32_t        plain_len,
+                   DBusString          *plaintext)
+{
+#ifdef HAVE_LZ4
+  int orig_len;
+  size_t src_size;
+  size_t dst_size;
+  size_t ret;
+
+  orig_len = _dbus_string_get_length (plaintext);
+
+  if (!_dbus_string_lengthen (plaintext, plain_len))
+    return FALSE;
+
+  src_size = len;
+  dst_size = plain_len;
+  ret = LZ4F_decompress (compressor->dctx,
+                         _dbus_string_get_data (plaintext) + orig_len,
+                         &dst_size, data, &src_size, NULL);
+
+  /* A frame that ends anywhere but where we were told is as bad as
+   * one that doesn't decompress */
+  if (!LZ4F_isError (ret) && ret == 0 &&
+      src_size == len && dst_size == plain_len)
+    return TRUE;
+
+  _dbus_verbose ("Bad compressed block from the peer: %s\n",
+                 LZ4F_isError (ret) ? LZ4F_getErrorName (ret) : "wrong length");
+  _dbus_string_set_length (plaintext, orig_len);
+#else
+  _dbus_verbose ("Compressed block from the peer, but built without LZ4\n");
+#endif
+
+  compressor->corrupted = TRUE;
+  return FALSE;
+}
+
+/**
+ * Decodes data received from the peer, appending whatever it
+ * completes to plaintext and keeping the rest until more arrives.
+ *
+ * @param compressor the compressor
+ * @param encoded the data as received
+ * @param plaintext string decoded data is appended to
+ * @returns #FALSE if no memory or the data is bad, leaving everything
+ *   as it was; _dbus_compressor_get_is_corrupted() says which
+ */
+dbus_bool_t
+_dbus_compressor_decode (DBusCompressor   *compressor,
+                         const DBusString *encoded,
+                         DBusString       *plaintext)
+{
+  const unsigned char *data;
+  dbus_uint32_t plain_remaining;
+  int pending_len;
+  int plain_len;
+  int len;
+  int pos;
+
+  if (compressor->corrupted)
+    return FALSE;
+
+  pending_len = _dbus_string_get_length (&compressor->pending);
+  plain_len = _dbus_string_get_length (plaintext);
+  plain_remaining = compressor->plain_remaining;
+  pos = 0;
+
+  if (!_dbus_string_copy (encoded, 0, &compressor->pending, pending_len))
+    return FALSE;
+
+  len = _dbus_string_get_length (&compressor->pending);
+  data = (const unsigned char *) _dbus_string_get_const_data (&compressor->pending);
+
+  while (pos < len)
+    {
+      dbus_uint32_t header;
+      dbus_uint32_t block_len;
+
+      if (plain_remaining > 0)
+        {
+          int n;
+
+          n = MIN ((dbus_uint32_t) (len - pos), plain_remaining);
+
+          if (!_dbus_string_copy_len (&compressor->pending, pos, n, plaintext,
+                                      _dbus_string_get_length (plaintext)))
+            goto failed;
+
+          pos += n;
+          plain_remaining -= n;
+          continue;
+        }
+
+      if (len - pos < BLOCK_HEADER_LEN)
+        break;
+
+      header = get_uint32_be (data + pos);
+      block_len = header & ~BLOCK_COMPRESSED;
+
+      if ((header & BLOCK_COMPRESSED) == 0)
+        {
+          if (block_len == 0 || block_len > DBUS_MAXIMUM_MESSAGE_LENGTH)
+            {
+              _dbus_verbose ("Bad block length %u from the peer\n", block_len);
+              compressor->corrupted = TRUE;
+              goto failed;
+            }
+
+          plain_remaining = block_len;
+          pos += BLOCK_HEADER_LEN;
+        }
+      else
+        {
+          dbus_uint32_t uncompressed_len;
+
+          if (len - pos < BLOCK_HEADER_LEN + COMPRESSED_HEADER_LEN)
+            break;
+
+          uncompressed_len = get_uint32_be (data + pos + BLOCK_HEADER_LEN);
+
+          /* we only compress what gets smaller */
+          if (uncompressed_len > DBUS_MAXIMUM_MESSAGE_LENGTH ||
+              block_len == 0 || block_len >= uncompressed_len)
+            {
+              _dbus_verbose ("Bad compressed block length %u/%u from the peer\n",
+                             block_len, uncompressed_len);
+              compressor->corrupted = TRUE;
+              goto failed;
+            }
+
+          if ((dbus_uint32_t) (len - pos) <
+              BLOCK_HEADER_LEN + COMPRESSED_HEADER_LEN + block_len)
+            break;
+
+          if (!decode_compressed (compressor,
+                                  data + pos + BLOCK_HEADER_LEN + COMPRESSED_HEADER_LEN,
+                                  block_len, uncompressed_len, plaintext))
+            goto failed;
+
+          pos += BLOCK_HEADER_LEN + COMPRESSED_HEADER_LEN + block_len;
+        }
+    }
+
+  _dbus_string_delete (&compressor->pending, 0, pos);
+  _dbus_string_compact (&compressor->pending, 2048);
+  compressor->plain_remaining = plain_remaining;
+  compressor->in_wire_bytes += _dbus_string_get_length (encoded);
+  compressor->in_plain_bytes += _dbus_string_get_length (plaintext) - plain_len;
+  return TRUE;
+
+ failed:
+  _dbus_string_set_length (&compressor->pending, pending_len);
+  _dbus_string_set_length (plaintext, plain_len);
+  return FALSE;
+}
+
+/**
+ * Whether _dbus_compressor_decode() failed because the peer sent
+ * something that can't be decoded, rather than for lack of memory.
+ * Once that has happened, the rest of the stream can't be decoded
+ * either.
+ *
+ * @param compressor the compressor
+ * @returns #TRUE if the incoming data is bad
+ */
+dbus_bool_t
+_dbus_compressor_get_is_corrupted (DBusCompressor *compressor)
+{
+  return compressor->corrupted;
+}
+
+/**
+ * Gets how many bytes went through the compressor in each direction,
+ * before and after it; the ratio of the two is how well the data
+ * compressed.
+ *
+ * @param compressor the compressor
+ * @param in_wire_bytes returns bytes received from the peer
+ * @param in_plain_bytes returns bytes they decoded to
+ * @param out_wire_bytes returns bytes sent to the peer
+ * @param out_plain_bytes returns bytes they were encoded from
+ */
+void
+_dbus_compressor_get_stats (DBusCompressor *compressor,
+                            dbus_uint64_t  *in_wire_bytes,
+                            dbus_uint64_t  *in_plain_bytes,
+                            dbus_uint64_t  *out_wire_bytes,
+                            dbus_uint64_t  *out_plain_bytes)
+{
+  if (in_wire_bytes != NULL)
+    *in_wire_bytes = compressor->in_wire_bytes;
+
+  if (in_plain_bytes != NULL)
+    *in_plain_bytes = compressor->in_plain_bytes;
+
+  if (out_wire_bytes != NULL)
+    *out_wire_bytes = compressor->out_wire_bytes;
+
+  if (out_plain_bytes != NULL)
+    *out_plain_bytes = compressor->out_plain_bytes;
+}
+
+/** @} */
+
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+
+/* Decodes encoded in pieces of at most chunk bytes, checking that it
+ * comes out as expected */
+static void
+check_decode (const DBusString *encoded,
+              const DBusString *expected,
+              int               chunk)
+{
+  DBusCompressor *compressor;
+  DBusString piece;
+  DBusString got;
+  int len;
+  int i;
+
+  compressor = _dbus_compressor_new ();
+
+  if (compressor == NULL ||
+      !_dbus_string_init (&piece) ||
+      !_dbus_string_init (&got))
+    _dbus_assert_not_reached ("no memory");
+
+  len = _dbus_string_get_length (encoded);
+
+  for (i = 0; i < len; i += chunk)
+    {
+      _dbus_string_set_length (&piece, 0);
+
+      if (!_dbus_string_copy_len (encoded, i, MIN (chunk, len - i), &piece, 0) ||
+          !_dbus_compressor_decode (compressor, &piece, &got))
+        _dbus_assert_not_reached ("failed to decode");
+    }
+
+  if (!_dbus_string_equal (&got, expected))
+    _dbus_assert_not_reached ("decoded the wrong bytes");
+
+  _dbus_assert (_dbus_string_get_length (&compressor->pending) == 0);
+  _dbus_assert (compressor->plain_remaining == 0);
+
+  _dbus_string_free (&got);
+  _dbus_string_free (&piece);
+  _dbus_compressor_free (compressor);
+}
+
+/**
+ * @ingroup DBusCompressor
+ * Unit test for the message stream compressor.
+ *
+ * @returns #TRUE on success.
+ */
+dbus_bool_t
+_dbus_compress_test (void)
+{
+  DBusCompressor *compressor;
+  DBusString short_block;
+  DBusString long_block;
+  DBusString expected;
+  DBusString encoded;
+  DBusString got;
+  dbus_uint64_t in_wire, in_plain, out_wire, out_plain;
+  int i;
+
+  compressor = _dbus_compressor_new ();
+
+  if (compressor == NULL ||
+      !_dbus_string_init (&short_block) ||
+      !_dbus_string_init (&long_block) ||
+      !_dbus_string_init (&expected) ||
+      !_dbus_string_init (&encoded) ||
+      !_dbus_string_init (&got))
+    _dbus_assert_not_reached ("no memory");
+
+  if (!_dbus_string_append (&short_block, "a short block"))
+    _dbus_assert_not_reached ("no memory");
+
+  for (i = 0; i < 1000; i++)
+    {
+      if (!_dbus_string_append (&long_block, "<item name=\"x\"/>") ||
+          !_dbus_string_append_uint (&long_block, i))
+        _dbus_assert_not_reached ("no memory");
+    }
+
+  if (!_dbus_compressor_encode (compressor, &short_block, &encoded) ||
+      !_dbus_compressor_encode (compressor, &long_block, &encoded) ||
+      !_dbus_compressor_encode (compressor, &short_block, &encoded) ||
+      !_dbus_string_copy (&short_block, 0, &expected, 0) ||
+      !_dbus_string_copy (&long_block, 0, &expected,
+                          _dbus_string_get_length (&expected)) ||
+      !_dbus_string_copy (&short_block, 0, &expected,
+                          _dbus_string_get_length (&expected)))
+    _dbus_assert_not_reached ("no memory");
+
+  /* short blocks just get a header */
+  _dbus_assert (get_uint32_be ((const unsigned char *)
+                               _dbus_string_get_const_data (&encoded)) ==
+                (dbus_uint32_t) _dbus_string_get_length (&short_block));
+
+  _dbus_compressor_get_stats (compressor, NULL, NULL, &out_wire, &out_plain);
+  _dbus_assert (out_plain == (dbus_uint64_t) _dbus_string_get_length (&expected));
+  _dbus_assert (out_wire == (dbus_uint64_t) _dbus_string_get_length (&encoded));
+#ifdef HAVE_LZ4
+  _dbus_assert (out_wire < out_plain);
+#else
+  _dbus_assert (out_wire == out_plain + 3 * BLOCK_HEADER_LEN);
+#endif
+
+  /* however the data is split up when it arrives */
+  check_decode (&encoded, &expected, _dbus_string_get_length (&encoded));
+  check_decode (&encoded, &expected, 1);
+  check_decode (&encoded, &expected, 7);
+  check_decode (&encoded, &expected, 1000);
+
+  if (!_dbus_compressor_decode (compressor, &encoded, &got))
+    _dbus_assert_not_reached ("failed to decode");
+
+  _dbus_compressor_get_stats (compressor, &in_wire, &in_plain, NULL, NULL);
+  _dbus_assert (in_wire == out_wire);
+  _dbus_assert (in_plain == out_plain);
+
+  /* a block that claims to be longer than any message is refused,
+   * without touching what was decoded so far */
+  _dbus_string_set_length (&encoded, 0);
+  _dbus_string_set_length (&got, 1);
+
+  if (!_dbus_string_lengthen (&encoded, BLOCK_HEADER_LEN))
+    _dbus_assert_not_reached ("no memory");
+
+  put_uint32_be ((unsigned char *) _dbus_string_get_data (&encoded),
+                 DBUS_MAXIMUM_MESSAGE_LENGTH + 1);
+  _dbus_assert (!_dbus_compressor_decode (compressor, &encoded, &got));
+  _dbus_assert (_dbus_compressor_get_is_corrupted (compressor));
+  _dbus_assert (_dbus_string_get_length (&got) == 1);
+  _dbus_compressor_free (compressor);
+
+  /* and so is compressed data that doesn't decompress */
+  compressor = _dbus_compressor_new ();
+
+  if (compressor == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  _dbus_string_set_length (&encoded, 0);
+
+  if (!_dbus_string_lengthen (&encoded,
+                              BLOCK_HEADER_LEN + COMPRESSED_HEADER_LEN + 10))
+    _dbus_assert_not_reached ("no memory");
+
+  put_uint32_be ((unsigned char *) _dbus_string_get_data (&encoded),
+                 BLOCK_COMPRESSED | 10);
+  put_uint32_be ((unsigned char *) _dbus_string_get_data (&encoded) +
+                 BLOCK_HEADER_LEN, 100);
+  _dbus_assert (!_dbus_compressor_decode (compressor, &encoded, &got));
+  _dbus_assert (_dbus_compressor_get_is_corrupted (compressor));
+
+  _dbus_string_free (&got);
+  _dbus_string_free (&encoded);
+  _dbus_string_free (&expected);
+  _dbus_string_free (&long_block);
+  _dbus_string_free (&short_block);
+  _dbus_compressor_free (compressor);
+  return TRUE;
+}
+
+#endif /* DBUS_ENABLE_EMBEDDED_TESTS */
@@ -0,0 +1,51 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-compress.h  Compression of the message stream after authentication
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#ifndef DBUS_COMPRESS_H
+#define DBUS_COMPRESS_H
+
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-string.h>
+
+DBUS_BEGIN_DECLS
+
+/** Blocks shorter than this are not worth compressing */
+#define DBUS_COMPRESSOR_MIN_LENGTH 512
+
+typedef struct DBusCompressor DBusCompressor;
+
+DBusCompressor *_dbus_compressor_new              (void);
+void            _dbus_compressor_free             (DBusCompressor   *compressor);
+dbus_bool_t     _dbus_compressor_encode           (DBusCompressor   *compressor,
+                                                   const DBusString *plaintext,
+                                                   DBusString       *encoded);
+dbus_bool_t     _dbus_compressor_decode           (DBusCompressor   *compressor,
+                                                   const DBusString *encoded,
+                                                   DBusString       *plaintext);
+dbus_bool_t     _dbus_compressor_get_is_corrupted (DBusCompressor   *compressor);
+void            _dbus_compressor_get_stats        (DBusCompressor   *compressor,
+                                                   dbus_uint64_t    *in_wire_bytes,
+                                                   dbus_uint64_t    *in_plain_bytes,
+                                                   dbus_uint64_t    *out_wire_bytes,
+                                                   dbus_uint64_t    *out_plain_bytes);
+
+DBUS_END_DECLS
+
+#endif /* DBUS_COMPRESS_H */
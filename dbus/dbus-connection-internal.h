@@ -58,6 +58,9 @@ void              _dbus_connection_queue_received_message_link (DBusConnection
                                                                 DBusList           *link);
 dbus_bool_t       _dbus_connection_has_messages_to_send_unlocked (DBusConnection     *connection);
 DBusMessage*      _dbus_connection_get_message_to_send         (DBusConnection     *connection);
+int               _dbus_connection_get_messages_to_send        (DBusConnection     *connection,
+                                                                DBusMessage       **messages,
+                                                                int                 max_messages);
 void              _dbus_connection_message_sent_unlocked       (DBusConnection     *connection,
                                                                 DBusMessage        *message);
 dbus_bool_t       _dbus_connection_add_watch_unlocked          (DBusConnection     *connection,
@@ -100,6 +103,9 @@ dbus_bool_t       _dbus_connection_send_and_unlock             (DBusConnection
 
 void              _dbus_connection_queue_synthesized_message_link (DBusConnection *connection,
 						                   DBusList *link);
+void              _dbus_connection_queue_completed_pending_call_link (DBusConnection *connection,
+                                                                      DBusList       *link);
+DBusList *        _dbus_connection_take_timeout_error_reserve_unlocked (DBusConnection *connection);
 DBUS_PRIVATE_EXPORT
 void              _dbus_connection_test_get_locks                 (DBusConnection *conn,
                                                                    DBusMutex **mutex_loc,
@@ -114,9 +120,38 @@ void              _dbus_connection_set_pending_fds_function       (DBusConnectio
                                                                    DBusPendingFdsChangeFunction callback,
                                                                    void *data);
 
+DBUS_PRIVATE_EXPORT
+void              _dbus_connection_set_deferred_validation_size   (DBusConnection *connection,
+                                                                   long            size);
+DBUS_PRIVATE_EXPORT
+void              _dbus_connection_set_max_overtaken_broadcasts   (DBusConnection *connection,
+                                                                   int             n);
+DBUS_PRIVATE_EXPORT
+void              _dbus_connection_set_broadcast_ttl              (DBusConnection *connection,
+                                                                   int             ttl);
+DBUS_PRIVATE_EXPORT
+void              _dbus_connection_set_max_socket_buffer_sizes    (DBusConnection *connection,
+                                                                   int             send_size,
+                                                                   int             receive_size);
+DBUS_PRIVATE_EXPORT
+void              _dbus_connection_set_reads_paused               (DBusConnection *connection,
+                                                                   dbus_bool_t     paused);
+DBUS_PRIVATE_EXPORT
+dbus_bool_t       _dbus_connection_can_remove_outgoing_message    (DBusConnection *connection,
+                                                                   DBusMessage    *message);
+DBUS_PRIVATE_EXPORT
+dbus_bool_t       _dbus_connection_remove_outgoing_message        (DBusConnection *connection,
+                                                                   DBusMessage    *message);
+DBUS_PRIVATE_EXPORT
+DBusDispatchStatus _dbus_connection_dispatch_quantum              (DBusConnection *connection,
+                                                                   int             max_messages,
+                                                                   long            quantum);
+
 DBUS_PRIVATE_EXPORT
 dbus_bool_t       _dbus_connection_get_linux_security_label       (DBusConnection  *connection,
                                                                    char           **label_p);
+DBUS_PRIVATE_EXPORT
+void              _dbus_connection_trim_buffers                   (DBusConnection  *connection);
 
 /* if DBUS_ENABLE_STATS */
 DBUS_PRIVATE_EXPORT
@@ -126,15 +161,42 @@ void _dbus_connection_get_stats (DBusConnection *connection,
                                  dbus_uint32_t  *in_fds,
                                  dbus_uint32_t  *in_peak_bytes,
                                  dbus_uint32_t  *in_peak_fds,
+                                 dbus_uint64_t  *in_total_bytes,
+                                 dbus_uint32_t  *in_throttles,
                                  dbus_uint32_t  *out_messages,
                                  dbus_uint32_t  *out_bytes,
                                  dbus_uint32_t  *out_fds,
                                  dbus_uint32_t  *out_peak_bytes,
-                                 dbus_uint32_t  *out_peak_fds);
+                                 dbus_uint32_t  *out_peak_fds,
+                                 dbus_uint64_t  *out_total_bytes);
+DBUS_PRIVATE_EXPORT
+dbus_bool_t _dbus_connection_get_compression_stats (DBusConnection *connection,
+                                                    dbus_uint64_t  *in_wire_bytes,
+                                                    dbus_uint64_t  *in_plain_bytes,
+                                                    dbus_uint64_t  *out_wire_bytes,
+                                                    dbus_uint64_t  *out_plain_bytes);
+DBUS_PRIVATE_EXPORT
+dbus_uint32_t _dbus_connection_get_buffer_bytes (DBusConnection *connection);
+DBUS_PRIVATE_EXPORT
+dbus_uint32_t _dbus_connection_get_n_expired_broadcasts (DBusConnection *connection);
+DBUS_PRIVATE_EXPORT
+dbus_uint32_t _dbus_connection_get_n_write_blocks (DBusConnection *connection);
+
+
+/** Size of the bitmap in org.freedesktop.DBus.SignalInterest */
+#define DBUS_SIGNAL_INTEREST_BYTES 128
 
+DBUS_PRIVATE_EXPORT
+void _dbus_signal_interest_get_bits (const char   *interface,
+                                     const char   *member,
+                                     unsigned int *first,
+                                     unsigned int *second);
 
 /* if DBUS_ENABLE_EMBEDDED_TESTS */
 const char* _dbus_connection_get_address (DBusConnection *connection);
+/* if DBUS_ENABLE_EMBEDDED_TESTS */
+DBUS_PRIVATE_EXPORT
+void _dbus_connection_disable_unix_fd_passing (DBusConnection *connection);
 
 /* This _dbus_bus_* stuff doesn't really belong here, but dbus-bus-internal.h seems
  * silly for one function
@@ -146,6 +208,12 @@ const char* _dbus_connection_get_address (DBusConnection *connection);
 
 void           _dbus_bus_notify_shared_connection_disconnected_unlocked (DBusConnection *connection);
 
+/* if HAVE_UNIX_FD_PASSING */
+DBUS_PRIVATE_EXPORT
+DBusConnection *_dbus_bus_peer_connection_from_reply (DBusMessage  *reply,
+                                                      char        **peer_unique_name,
+                                                      DBusError    *error);
+
 /** @} */
 
 
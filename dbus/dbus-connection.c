@@ -37,6 +37,7 @@
 #include "dbus-threads.h"
 #include "dbus-protocol.h"
 #include "dbus-dataslot.h"
+#include "dbus-dispatch-queues.h"
 #include "dbus-string.h"
 #include "dbus-signature.h"
 #include "dbus-pending-call.h"
@@ -44,6 +45,8 @@
 #include "dbus-threads-internal.h"
 #include "dbus-bus.h"
 #include "dbus-marshal-basic.h"
+#include "dbus-server.h"
+#include "dbus-test.h"
 
 #ifdef DBUS_DISABLE_CHECKS
 #define TOOK_LOCK_CHECK(connection)
@@ -244,6 +247,16 @@ struct DBusPreallocatedSend
   DBusList *counter_link;     /**< Preallocated link in the resource counter */
 };
 
+/**
+ * Pending calls that share a timeout interval. Since they are added
+ * in time order, they also expire in the order of the queue.
+ */
+typedef struct
+{
+  int interval;            /**< Timeout of every call in the queue, in milliseconds */
+  DBusList *pending_calls; /**< #DBusPendingCall in the order their timeouts expire */
+} DBusPendingTimeoutQueue;
+
 #if HAVE_DECL_MSG_NOSIGNAL
 static dbus_bool_t _dbus_modify_sigpipe = FALSE;
 #else
@@ -267,6 +280,11 @@ struct DBusConnection
   DBusList *outgoing_messages; /**< Queue of messages we need to send, send the end of the list first. */
   DBusList *incoming_messages; /**< Queue of messages we have received, end of the list received most recently. */
   DBusList *expired_messages;  /**< Messages that will be released when we next unlock. */
+  DBusList *spare_links;       /**< Unused list links, reused for queueing so that steady
+                                *   traffic doesn't go through the global list allocator */
+  int n_spare_links;           /**< Length of spare_links */
+  DBusPreallocatedSend *spare_preallocated; /**< Kept from the last send, so that the
+                                             *   next one needn't allocate it */
 
   DBusMessage *message_borrowed; /**< Filled in if the first incoming message has been borrowed;
                                   *   dispatch_acquired will be set by the borrower
@@ -276,6 +294,11 @@ struct DBusConnection
   int n_incoming;              /**< Length of incoming queue. */
 
   DBusCounter *outgoing_counter; /**< Counts size of outgoing messages. */
+  long max_unflushed_size;       /**< Leave writing to the main loop until this many bytes are queued */
+  int max_overtaken_broadcasts;  /**< How many queued broadcasts a reply or unicast message may overtake */
+  int broadcast_ttl;             /**< Milliseconds a queued broadcast may wait to be written, or 0 for ever */
+  dbus_uint32_t n_expired_broadcasts; /**< Queued broadcasts dropped for waiting too long */
+  long dispatch_deficit;         /**< Bytes dispatched beyond the quantum in _dbus_connection_dispatch_quantum() */
   
   DBusTransport *transport;    /**< Object that sends/receives messages over network. */
   DBusWatchList *watches;      /**< Stores active watches. */
@@ -287,9 +310,15 @@ struct DBusConnection
   DBusDataSlotList slot_list;   /**< Data stored by allocated integer ID */
 
   DBusHashTable *pending_replies;  /**< Hash of message serials to #DBusPendingCall. */  
+  DBusList *pending_timeout_queues; /**< #DBusPendingTimeoutQueue for each pending call timeout interval in use */
+  DBusTimeout *pending_timeout;     /**< Single timeout for every pending call, #NULL while not set for a deadline */
+  long pending_timeout_tv_sec;      /**< Deadline pending_timeout is set for */
+  long pending_timeout_tv_usec;     /**< Microseconds part of pending_timeout_tv_sec */
   
-  dbus_uint32_t client_serial;       /**< Client serial. Increments each time a message is sent  */
+  DBusAtomic client_serial;          /**< Next client serial; atomic, so it can be taken without the connection lock */
   DBusList *disconnect_message_link; /**< Preallocated list node for queueing the disconnection message */
+  DBusList *timeout_error_reserve;   /**< Preallocated timeout error reply, for a pending call that times out when no memory is left to build one */
+  DBusList *completed_pending_calls; /**< #DBusPendingCall with a completion queue that have their reply, to be completed without dispatching */
 
   DBusWakeupMainFunction wakeup_main_function; /**< Function to wake up the mainloop  */
   void *wakeup_main_data; /**< Application data for wakeup_main_function */
@@ -302,9 +331,16 @@ struct DBusConnection
   DBusDispatchStatus last_dispatch_status; /**< The last dispatch status we reported to the application. */
 
   DBusObjectTree *objects; /**< Object path handlers registered with this connection */
+  DBusDispatchQueues *dispatch_queues; /**< Where method calls and signals wait for a worker, if dbus_connection_set_dispatch_queues() was called */
+
+  DBusMessage *peer_ping_reply;       /**< Reply to Peer.Ping to copy, built on first use */
+  DBusMessage *peer_machine_id_reply; /**< Reply to Peer.GetMachineId to copy, built on first use */
 
   char *server_guid; /**< GUID of server if we are in shared_connections, #NULL if server GUID is unknown or connection is private */
 
+  unsigned char *signal_interest; /**< Last SignalInterest bitmap from the bus, #NULL until one arrives */
+  dbus_uint32_t signal_interest_version; /**< Version of signal_interest */
+
   /* These two MUST be bools and not bitfields, because they are protected by a separate lock
    * from connection->mutex and all bitfields in a word have to be read/written together.
    * So you can't have a different lock for different bitfields in the same word.
@@ -325,6 +361,9 @@ struct DBusConnection
   unsigned int disconnected_message_processed : 1; /**< We did our default handling of the disconnected message,
                                                     * such as closing the connection.
                                                     */
+
+  unsigned int signal_interest_watched : 1;    /**< We have asked the bus for SignalInterest */
+  unsigned int signal_interest_everything : 1; /**< The last SignalInterest said every signal may be received */
   
 #ifndef DBUS_DISABLE_CHECKS
   unsigned int have_connection_lock : 1; /**< Used to check locking */
@@ -338,14 +377,18 @@ struct DBusConnection
 static DBusDispatchStatus _dbus_connection_get_dispatch_status_unlocked      (DBusConnection     *connection);
 static void               _dbus_connection_update_dispatch_status_and_unlock (DBusConnection     *connection,
                                                                               DBusDispatchStatus  new_status);
+static void               complete_routed_pending_calls_unlocked             (DBusConnection     *connection);
 static void               _dbus_connection_last_unref                        (DBusConnection     *connection);
+static void               _dbus_connection_remove_pending_timeout_unlocked   (DBusConnection     *connection,
+                                                                              DBusPendingCall    *pending);
+static dbus_bool_t        pending_timeouts_handler                           (void               *data);
 static void               _dbus_connection_acquire_dispatch                  (DBusConnection     *connection);
 static void               _dbus_connection_release_dispatch                  (DBusConnection     *connection);
 static DBusDispatchStatus _dbus_connection_flush_unlocked                    (DBusConnection     *connection);
 static void               _dbus_connection_close_possibly_shared_and_unlock  (DBusConnection     *connection);
 static dbus_bool_t        _dbus_connection_get_is_connected_unlocked         (DBusConnection     *connection);
 static dbus_bool_t        _dbus_connection_peek_for_reply_unlocked           (DBusConnection     *connection,
-                                                                              dbus_uint32_t       client_serial);
+                                                                              DBusPendingCall    *pending);
 
 static DBusMessageFilter *
 _dbus_message_filter_ref (DBusMessageFilter *filter)
@@ -379,6 +422,55 @@ _dbus_message_filter_unref (DBusMessageFilter *filter)
     }
 }
 
+/** Most list links a connection keeps for reuse */
+#define MAX_SPARE_LINKS 32
+
+/** How many expired messages _dbus_connection_unlock() recycles the links of */
+#define MAX_RECYCLED_EXPIRED_LINKS 16
+
+/*
+ * Allocates a list link, preferring the connection's spare links.
+ * Called with the connection lock held.
+ */
+static DBusList *
+_dbus_connection_alloc_link_unlocked (DBusConnection *connection,
+                                      void           *data)
+{
+  DBusList *link;
+
+  HAVE_LOCK_CHECK (connection);
+
+  link = _dbus_list_pop_first_link (&connection->spare_links);
+
+  if (link == NULL)
+    return _dbus_list_alloc_link (data);
+
+  connection->n_spare_links -= 1;
+  link->data = data;
+  return link;
+}
+
+/*
+ * Frees a list link, keeping it for reuse if the connection has few
+ * spare links. Called with the connection lock held.
+ */
+static void
+_dbus_connection_free_link_unlocked (DBusConnection *connection,
+                                     DBusList       *link)
+{
+  HAVE_LOCK_CHECK (connection);
+
+  if (connection->n_spare_links >= MAX_SPARE_LINKS)
+    {
+      _dbus_list_free_link (link);
+      return;
+    }
+
+  link->data = NULL;
+  _dbus_list_prepend_link (&connection->spare_links, link);
+  connection->n_spare_links += 1;
+}
+
 /**
  * Acquires the connection lock.
  *
@@ -400,6 +492,9 @@ _dbus_connection_unlock (DBusConnection *connection)
 {
   DBusList *expired_messages;
   DBusList *iter;
+  DBusMessage *recycled[MAX_RECYCLED_EXPIRED_LINKS];
+  int n_recycled;
+  int i;
 
   if (TRACE_LOCKS)
     {
@@ -411,9 +506,24 @@ _dbus_connection_unlock (DBusConnection *connection)
   expired_messages = connection->expired_messages;
   connection->expired_messages = NULL;
 
+  /* The messages can only be unreferenced without the lock, but
+   * their links can be kept for reuse while we still have it */
+  n_recycled = 0;
+  while (expired_messages != NULL &&
+         n_recycled < MAX_RECYCLED_EXPIRED_LINKS &&
+         connection->n_spare_links < MAX_SPARE_LINKS)
+    {
+      iter = _dbus_list_pop_first_link (&expired_messages);
+      recycled[n_recycled++] = iter->data;
+      _dbus_connection_free_link_unlocked (connection, iter);
+    }
+
   RELEASING_LOCK_CHECK (connection);
   _dbus_rmutex_unlock (connection->mutex);
 
+  for (i = 0; i < n_recycled; i++)
+    dbus_message_unref (recycled[i]);
+
   for (iter = _dbus_list_pop_first_link (&expired_messages);
       iter != NULL;
       iter = _dbus_list_pop_first_link (&expired_messages))
@@ -486,8 +596,6 @@ _dbus_connection_queue_received_message_link (DBusConnection  *connection,
 
   _dbus_assert (_dbus_transport_peek_is_authenticated (connection->transport));
 
-  _dbus_list_append_link (&connection->incoming_messages,
-                          link);
   message = link->data;
 
   /* If this is a reply we're waiting on, remove timeout for it */
@@ -497,16 +605,26 @@ _dbus_connection_queue_received_message_link (DBusConnection  *connection,
       pending = _dbus_hash_table_lookup_int (connection->pending_replies,
                                              reply_serial);
       if (pending != NULL)
-	{
-	  if (_dbus_pending_call_is_timeout_added_unlocked (pending))
-            _dbus_connection_remove_timeout_unlocked (connection,
-                                                      _dbus_pending_call_get_timeout_unlocked (pending));
+        {
+          _dbus_connection_remove_pending_timeout_unlocked (connection, pending);
 
-	  _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
-	}
+          if (_dbus_pending_call_can_route_reply_unlocked (pending))
+            {
+              _dbus_verbose ("Message %p is a reply for pending call %p with a completion queue\n",
+                             message, pending);
+              _dbus_message_trace_ref (message, -1, -1,
+                  "_dbus_conection_queue_received_message_link");
+              _dbus_pending_call_route_reply_link_unlocked (pending, link);
+              return;
+            }
+
+          /* so that a thread blocking on it knows to look */
+          _dbus_pending_call_set_reply_queued_unlocked (pending, TRUE);
+        }
     }
-  
-  
+
+  _dbus_list_append_link (&connection->incoming_messages,
+                          link);
 
   connection->n_incoming += 1;
 
@@ -560,6 +678,48 @@ _dbus_connection_queue_synthesized_message_link (DBusConnection *connection,
                  link->data, connection, connection->n_incoming);
 }
 
+/**
+ * Adds a link holding a ref to a pending call that has been given its
+ * reply to the list of calls for
+ * _dbus_connection_update_dispatch_status_and_unlock() to complete,
+ * taking ownership of the link and the ref. Cannot fail.
+ *
+ * @param connection the connection
+ * @param link the link
+ */
+void
+_dbus_connection_queue_completed_pending_call_link (DBusConnection *connection,
+                                                    DBusList       *link)
+{
+  HAVE_LOCK_CHECK (connection);
+
+  _dbus_list_append_link (&connection->completed_pending_calls, link);
+
+  /* in case we got here from somewhere that won't complete them, such
+   * as dbus_connection_get_dispatch_status() */
+  _dbus_connection_wakeup_mainloop (connection);
+}
+
+/**
+ * Takes the timeout error reply kept in reserve for a pending call
+ * that times out when there isn't enough memory to build its own.
+ * dbus_connection_send_with_reply() puts a new one in reserve.
+ *
+ * @param connection the connection
+ * @returns a link holding the reply, or #NULL if it has been taken
+ */
+DBusList *
+_dbus_connection_take_timeout_error_reserve_unlocked (DBusConnection *connection)
+{
+  DBusList *link;
+
+  HAVE_LOCK_CHECK (connection);
+
+  link = connection->timeout_error_reserve;
+  connection->timeout_error_reserve = NULL;
+  return link;
+}
+
 
 /**
  * Checks whether there are messages in the outgoing message queue.
@@ -598,6 +758,65 @@ dbus_connection_has_messages_to_send (DBusConnection *connection)
   return v;
 }
 
+static dbus_bool_t
+message_is_broadcast (DBusMessage *message)
+{
+  return dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_SIGNAL &&
+    dbus_message_get_destination (message) == NULL;
+}
+
+/* Drops queued broadcasts older than broadcast_ttl. Broadcasts are
+ * queued in the order they were sent, so this stops at the first one
+ * that is still fresh. Like _dbus_connection_remove_outgoing_message()
+ * it leaves the oldest message, which the transport may have started
+ * writing, and messages with fds, which may have gone ahead of it. */
+static void
+_dbus_connection_expire_broadcasts_unlocked (DBusConnection *connection)
+{
+  DBusList *link;
+  dbus_uint64_t now, ttl_nsec;
+
+  HAVE_LOCK_CHECK (connection);
+
+  if (connection->broadcast_ttl <= 0 || connection->n_outgoing < 2)
+    return;
+
+  now = _dbus_get_monotonic_time_nsec ();
+  ttl_nsec = (dbus_uint64_t) connection->broadcast_ttl * 1000000;
+
+  link = _dbus_list_get_last_link (&connection->outgoing_messages);
+  link = _dbus_list_get_prev_link (&connection->outgoing_messages, link);
+
+  while (link != NULL)
+    {
+      DBusList *prev = _dbus_list_get_prev_link (&connection->outgoing_messages,
+                                                 link);
+      DBusMessage *message = link->data;
+
+      if (message_is_broadcast (message) && message->queued_nsec != 0 &&
+          !dbus_message_contains_unix_fds (message))
+        {
+          if (now - message->queued_nsec < ttl_nsec)
+            break;
+
+          _dbus_list_unlink (&connection->outgoing_messages, link);
+          connection->n_outgoing -= 1;
+          connection->n_expired_broadcasts += 1;
+          _dbus_message_remove_counter (message, connection->outgoing_counter);
+
+          /* unreffed when we unlock, as in _dbus_connection_message_sent_unlocked() */
+          _dbus_list_prepend_link (&connection->expired_messages, link);
+
+          _dbus_verbose ("Broadcast %p dropped unsent from outgoing queue %p "
+                         "after %d ms, %d left to send\n",
+                         message, connection, connection->broadcast_ttl,
+                         connection->n_outgoing);
+        }
+
+      link = prev;
+    }
+}
+
 /**
  * Gets the next outgoing message. The message remains in the
  * queue, and the caller does not own a reference to it.
@@ -609,10 +828,51 @@ DBusMessage*
 _dbus_connection_get_message_to_send (DBusConnection *connection)
 {
   HAVE_LOCK_CHECK (connection);
-  
+
+  _dbus_connection_expire_broadcasts_unlocked (connection);
+
   return _dbus_list_get_last (&connection->outgoing_messages);
 }
 
+/**
+ * Gets the next few outgoing messages, in the order they are to be
+ * sent, so that the transport can write several of them at once.
+ * The messages remain in the queue, and the caller does not own
+ * references to them; they must still be reported with
+ * _dbus_connection_message_sent_unlocked() one at a time, oldest
+ * first.
+ *
+ * @param connection the connection.
+ * @param messages array to fill in
+ * @param max_messages size of the array
+ * @returns the number of messages stored in the array
+ */
+int
+_dbus_connection_get_messages_to_send (DBusConnection  *connection,
+                                       DBusMessage    **messages,
+                                       int              max_messages)
+{
+  DBusList *link;
+  int n_messages;
+
+  HAVE_LOCK_CHECK (connection);
+
+  _dbus_connection_expire_broadcasts_unlocked (connection);
+
+  n_messages = 0;
+  link = _dbus_list_get_last_link (&connection->outgoing_messages);
+
+  while (link != NULL && n_messages < max_messages)
+    {
+      messages[n_messages] = link->data;
+      n_messages += 1;
+
+      link = _dbus_list_get_prev_link (&connection->outgoing_messages, link);
+    }
+
+  return n_messages;
+}
+
 /**
  * Notifies the connection that a message has been sent, so the
  * message can be removed from the outgoing queue.
@@ -912,132 +1172,436 @@ _dbus_connection_toggle_timeout_unlocked (DBusConnection   *connection,
                             enabled);
 }
 
+/*
+ * Takes the connection's pending call timeout out of the application's
+ * main loop, if it was set for a deadline.
+ */
+static void
+_dbus_connection_clear_pending_timeout_unlocked (DBusConnection *connection)
+{
+  HAVE_LOCK_CHECK (connection);
+
+  if (connection->pending_timeout == NULL)
+    return;
+
+  _dbus_connection_remove_timeout_unlocked (connection,
+                                            connection->pending_timeout);
+  _dbus_timeout_unref (connection->pending_timeout);
+  connection->pending_timeout = NULL;
+}
+
+/*
+ * Arms the connection's pending call timeout to fire at the given
+ * monotonic time. The application only ever has it while it is set
+ * for a deadline, so it is always enabled. A new interval is passed on
+ * by toggling it off and on if the application notices that, and
+ * otherwise by swapping in a new timeout, which is added before the
+ * old one is removed so that the old deadline still stands if there
+ * is no memory.
+ */
 static dbus_bool_t
-_dbus_connection_attach_pending_call_unlocked (DBusConnection  *connection,
-                                               DBusPendingCall *pending)
+_dbus_connection_set_pending_timeout_unlocked (DBusConnection *connection,
+                                               long            deadline_sec,
+                                               long            deadline_usec,
+                                               long            now_sec,
+                                               long            now_usec)
 {
-  dbus_uint32_t reply_serial;
-  DBusTimeout *timeout;
+  long interval;
 
   HAVE_LOCK_CHECK (connection);
 
-  reply_serial = _dbus_pending_call_get_reply_serial_unlocked (pending);
-
-  _dbus_assert (reply_serial != 0);
+  interval = (deadline_sec - now_sec) * 1000 +
+    (deadline_usec - now_usec + 999) / 1000;
 
-  timeout = _dbus_pending_call_get_timeout_unlocked (pending);
+  if (interval < 0)
+    interval = 0;
 
-  if (timeout)
+  if (connection->pending_timeout != NULL &&
+      _dbus_timeout_list_can_toggle (connection->timeouts))
     {
-      if (!_dbus_connection_add_timeout_unlocked (connection, timeout))
-        return FALSE;
-      
-      if (!_dbus_hash_table_insert_int (connection->pending_replies,
-                                        reply_serial,
-                                        pending))
-        {
-          _dbus_connection_remove_timeout_unlocked (connection, timeout);
-
-          _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
-          HAVE_LOCK_CHECK (connection);
-          return FALSE;
-        }
-      
-      _dbus_pending_call_set_timeout_added_unlocked (pending, TRUE);
+      _dbus_connection_toggle_timeout_unlocked (connection,
+                                                connection->pending_timeout,
+                                                FALSE);
+      _dbus_timeout_set_interval (connection->pending_timeout, interval);
+      _dbus_connection_toggle_timeout_unlocked (connection,
+                                                connection->pending_timeout,
+                                                TRUE);
     }
   else
     {
-      if (!_dbus_hash_table_insert_int (connection->pending_replies,
-                                        reply_serial,
-                                        pending))
+      DBusTimeout *timeout;
+
+      timeout = _dbus_timeout_new (interval, pending_timeouts_handler,
+                                   connection, NULL);
+      if (timeout == NULL)
+        return FALSE;
+
+      if (!_dbus_connection_add_timeout_unlocked (connection, timeout))
         {
-          HAVE_LOCK_CHECK (connection);
+          _dbus_timeout_unref (timeout);
           return FALSE;
         }
+
+      _dbus_connection_clear_pending_timeout_unlocked (connection);
+      connection->pending_timeout = timeout;
     }
 
-  _dbus_pending_call_ref_unlocked (pending);
+  connection->pending_timeout_tv_sec = deadline_sec;
+  connection->pending_timeout_tv_usec = deadline_usec;
 
-  HAVE_LOCK_CHECK (connection);
-  
   return TRUE;
 }
 
-static void
-free_pending_call_on_hash_removal (void *data)
+/*
+ * Returns the queue for pending calls with the given timeout interval,
+ * creating it if necessary, or NULL if no memory.
+ */
+static DBusPendingTimeoutQueue *
+_dbus_connection_get_pending_timeout_queue_unlocked (DBusConnection *connection,
+                                                     int             interval)
 {
-  DBusPendingCall *pending;
-  DBusConnection  *connection;
-  
-  if (data == NULL)
-    return;
+  DBusPendingTimeoutQueue *queue;
+  DBusList *link;
 
-  pending = data;
+  link = _dbus_list_get_first_link (&connection->pending_timeout_queues);
+  while (link != NULL)
+    {
+      queue = link->data;
 
-  connection = _dbus_pending_call_get_connection_unlocked (pending);
+      if (queue->interval == interval)
+        return queue;
 
-  HAVE_LOCK_CHECK (connection);
-  
-  if (_dbus_pending_call_is_timeout_added_unlocked (pending))
+      link = _dbus_list_get_next_link (&connection->pending_timeout_queues, link);
+    }
+
+  queue = dbus_new0 (DBusPendingTimeoutQueue, 1);
+  if (queue == NULL)
+    return NULL;
+
+  queue->interval = interval;
+
+  if (!_dbus_list_append (&connection->pending_timeout_queues, queue))
     {
-      _dbus_connection_remove_timeout_unlocked (connection,
-                                                _dbus_pending_call_get_timeout_unlocked (pending));
-      
-      _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
+      dbus_free (queue);
+      return NULL;
     }
 
-  /* FIXME 1.0? this is sort of dangerous and undesirable to drop the lock 
-   * here, but the pending call finalizer could in principle call out to 
-   * application code so we pretty much have to... some larger code reorg 
-   * might be needed.
-   */
-  _dbus_connection_ref_unlocked (connection);
-  _dbus_pending_call_unref_and_unlock (pending);
-  CONNECTION_LOCK (connection);
-  _dbus_connection_unref_unlocked (connection);
+  return queue;
 }
 
-static void
-_dbus_connection_detach_pending_call_unlocked (DBusConnection  *connection,
+/*
+ * Starts the timeout of a pending call. Rather than handing one
+ * DBusTimeout per call to the application, each call joins the queue
+ * for its interval, and a single DBusTimeout per connection fires for
+ * whichever queued call expires first; so adding, removing and
+ * expiring a call's timeout doesn't depend on how many are pending.
+ */
+static dbus_bool_t
+_dbus_connection_add_pending_timeout_unlocked (DBusConnection  *connection,
                                                DBusPendingCall *pending)
 {
-  /* This ends up unlocking to call the pending call finalizer, which is unexpected to
-   * say the least.
-   */
-  _dbus_hash_table_remove_int (connection->pending_replies,
-                               _dbus_pending_call_get_reply_serial_unlocked (pending));
+  DBusPendingTimeoutQueue *queue;
+  DBusList *link;
+  int interval;
+  long now_sec, now_usec;
+  long deadline_sec, deadline_usec;
+
+  HAVE_LOCK_CHECK (connection);
+  _dbus_assert (!_dbus_pending_call_is_timeout_added_unlocked (pending));
+
+  interval = _dbus_pending_call_get_timeout_interval_unlocked (pending);
+
+  queue = _dbus_connection_get_pending_timeout_queue_unlocked (connection,
+                                                               interval);
+  if (queue == NULL)
+    return FALSE;
+
+  link = _dbus_connection_alloc_link_unlocked (connection, pending);
+  if (link == NULL)
+    return FALSE;
+
+  _dbus_get_monotonic_time (&now_sec, &now_usec);
+  deadline_sec = now_sec + interval / 1000;
+  deadline_usec = now_usec + (interval % 1000) * 1000;
+  if (deadline_usec >= 1000000)
+    {
+      deadline_sec += 1;
+      deadline_usec -= 1000000;
+    }
+
+  /* Only touch the main loop's timer if this call expires before the
+   * one it's already set for */
+  if ((connection->pending_timeout == NULL ||
+       deadline_sec < connection->pending_timeout_tv_sec ||
+       (deadline_sec == connection->pending_timeout_tv_sec &&
+        deadline_usec < connection->pending_timeout_tv_usec)) &&
+      !_dbus_connection_set_pending_timeout_unlocked (connection,
+                                                      deadline_sec,
+                                                      deadline_usec,
+                                                      now_sec, now_usec))
+    {
+      _dbus_connection_free_link_unlocked (connection, link);
+      return FALSE;
+    }
+
+  _dbus_list_append_link (&queue->pending_calls, link);
+  _dbus_pending_call_set_timeout_queue_link_unlocked (pending, link,
+                                                      deadline_sec,
+                                                      deadline_usec);
+  _dbus_pending_call_set_timeout_added_unlocked (pending, TRUE);
+
+  return TRUE;
 }
 
+/*
+ * Stops the timeout of a pending call. The connection's timeout is
+ * left alone; if it was set for this call, it finds nothing to expire
+ * when it fires and moves on to the next deadline.
+ */
 static void
-_dbus_connection_detach_pending_call_and_unlock (DBusConnection  *connection,
-                                                 DBusPendingCall *pending)
+_dbus_connection_remove_pending_timeout_unlocked (DBusConnection  *connection,
+                                                  DBusPendingCall *pending)
 {
-  /* The idea here is to avoid finalizing the pending call
-   * with the lock held, since there's a destroy notifier
-   * in pending call that goes out to application code.
-   *
-   * There's an extra unlock inside the hash table
-   * "free pending call" function FIXME...
-   */
-  _dbus_pending_call_ref_unlocked (pending);
-  _dbus_hash_table_remove_int (connection->pending_replies,
-                               _dbus_pending_call_get_reply_serial_unlocked (pending));
+  DBusPendingTimeoutQueue *queue;
+  DBusList *link;
+
+  HAVE_LOCK_CHECK (connection);
 
-  if (_dbus_pending_call_is_timeout_added_unlocked (pending))
-      _dbus_connection_remove_timeout_unlocked (connection,
-              _dbus_pending_call_get_timeout_unlocked (pending));
+  if (!_dbus_pending_call_is_timeout_added_unlocked (pending))
+    return;
 
-  _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
+  queue = _dbus_connection_get_pending_timeout_queue_unlocked (connection,
+      _dbus_pending_call_get_timeout_interval_unlocked (pending));
+  /* The queue exists as long as it holds a call */
+  _dbus_assert (queue != NULL);
 
-  _dbus_pending_call_unref_and_unlock (pending);
+  link = _dbus_pending_call_get_timeout_queue_link_unlocked (pending);
+  _dbus_list_unlink (&queue->pending_calls, link);
+  _dbus_connection_free_link_unlocked (connection, link);
+
+  _dbus_pending_call_set_timeout_queue_link_unlocked (pending, NULL, 0, 0);
+  _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
 }
 
-/**
- * Removes a pending call from the connection, such that
- * the pending reply will be ignored. May drop the last
- * reference to the pending call.
- *
- * @param connection the connection
+/** How soon to try expiring pending calls again after running out of memory */
+#define PENDING_TIMEOUT_OOM_RETRY_MILLISECONDS 100
+
+/*
+ * Handler for the connection's pending call timeout: expires every
+ * pending call whose deadline has passed, then sets the timeout for
+ * the earliest remaining one.
+ */
+static dbus_bool_t
+pending_timeouts_handler (void *data)
+{
+  DBusConnection *connection = data;
+  DBusDispatchStatus status;
+  DBusList *link;
+  dbus_bool_t have_next;
+  dbus_bool_t oom;
+  long now_sec, now_usec;
+  long next_sec, next_usec;
+
+  CONNECTION_LOCK (connection);
+  _dbus_connection_ref_unlocked (connection);
+
+  _dbus_get_monotonic_time (&now_sec, &now_usec);
+
+  have_next = FALSE;
+  oom = FALSE;
+  next_sec = next_usec = 0;
+
+  link = _dbus_list_get_first_link (&connection->pending_timeout_queues);
+  while (link != NULL && !oom)
+    {
+      DBusPendingTimeoutQueue *queue = link->data;
+      DBusList *next = _dbus_list_get_next_link (&connection->pending_timeout_queues,
+                                                 link);
+
+      while (queue->pending_calls != NULL)
+        {
+          DBusPendingCall *pending = queue->pending_calls->data;
+          long tv_sec, tv_usec;
+
+          _dbus_pending_call_get_deadline_unlocked (pending, &tv_sec, &tv_usec);
+
+          if (tv_sec > now_sec || (tv_sec == now_sec && tv_usec > now_usec))
+            {
+              if (!have_next || tv_sec < next_sec ||
+                  (tv_sec == next_sec && tv_usec < next_usec))
+                {
+                  next_sec = tv_sec;
+                  next_usec = tv_usec;
+                  have_next = TRUE;
+                }
+              break;
+            }
+
+          _dbus_verbose ("pending call %u timed out\n",
+                         _dbus_pending_call_get_reply_serial_unlocked (pending));
+
+          /* The call stays at the head of its queue until it can have
+           * its timeout error */
+          if (!_dbus_pending_call_queue_timeout_error_unlocked (pending, connection))
+            {
+              oom = TRUE;
+              break;
+            }
+
+          _dbus_connection_remove_pending_timeout_unlocked (connection, pending);
+        }
+
+      /* A queue isn't worth keeping around for an interval nobody uses now */
+      if (queue->pending_calls == NULL)
+        {
+          _dbus_list_remove_link (&connection->pending_timeout_queues, link);
+          dbus_free (queue);
+        }
+
+      link = next;
+    }
+
+  if (oom)
+    {
+      have_next = TRUE;
+      next_sec = now_sec;
+      next_usec = now_usec + PENDING_TIMEOUT_OOM_RETRY_MILLISECONDS * 1000;
+      if (next_usec >= 1000000)
+        {
+          next_sec += 1;
+          next_usec -= 1000000;
+        }
+    }
+
+  /* If it can't be set for the next deadline, the timeout goes off
+   * again after its old interval and we try again then */
+  if (!have_next)
+    _dbus_connection_clear_pending_timeout_unlocked (connection);
+  else if (!_dbus_connection_set_pending_timeout_unlocked (connection,
+                                                           next_sec, next_usec,
+                                                           now_sec, now_usec))
+    oom = TRUE;
+
+  _dbus_verbose ("middle\n");
+  status = _dbus_connection_get_dispatch_status_unlocked (connection);
+
+  /* Unlocks, and calls out to user code */
+  _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+  dbus_connection_unref (connection);
+
+  return !oom;
+}
+
+static dbus_bool_t
+_dbus_connection_attach_pending_call_unlocked (DBusConnection  *connection,
+                                               DBusPendingCall *pending)
+{
+  dbus_uint32_t reply_serial;
+
+  HAVE_LOCK_CHECK (connection);
+
+  reply_serial = _dbus_pending_call_get_reply_serial_unlocked (pending);
+
+  _dbus_assert (reply_serial != 0);
+
+  if (_dbus_pending_call_get_timeout_interval_unlocked (pending) !=
+      DBUS_TIMEOUT_INFINITE)
+    {
+      if (!_dbus_connection_add_pending_timeout_unlocked (connection, pending))
+        return FALSE;
+      
+      if (!_dbus_hash_table_insert_int (connection->pending_replies,
+                                        reply_serial,
+                                        pending))
+        {
+          _dbus_connection_remove_pending_timeout_unlocked (connection, pending);
+          HAVE_LOCK_CHECK (connection);
+          return FALSE;
+        }
+    }
+  else
+    {
+      if (!_dbus_hash_table_insert_int (connection->pending_replies,
+                                        reply_serial,
+                                        pending))
+        {
+          HAVE_LOCK_CHECK (connection);
+          return FALSE;
+        }
+    }
+
+  _dbus_pending_call_ref_unlocked (pending);
+
+  HAVE_LOCK_CHECK (connection);
+  
+  return TRUE;
+}
+
+static void
+free_pending_call_on_hash_removal (void *data)
+{
+  DBusPendingCall *pending;
+  DBusConnection  *connection;
+  
+  if (data == NULL)
+    return;
+
+  pending = data;
+
+  connection = _dbus_pending_call_get_connection_unlocked (pending);
+
+  HAVE_LOCK_CHECK (connection);
+  
+  _dbus_connection_remove_pending_timeout_unlocked (connection, pending);
+
+  /* FIXME 1.0? this is sort of dangerous and undesirable to drop the lock 
+   * here, but the pending call finalizer could in principle call out to 
+   * application code so we pretty much have to... some larger code reorg 
+   * might be needed.
+   */
+  _dbus_connection_ref_unlocked (connection);
+  _dbus_pending_call_unref_and_unlock (pending);
+  CONNECTION_LOCK (connection);
+  _dbus_connection_unref_unlocked (connection);
+}
+
+static void
+_dbus_connection_detach_pending_call_unlocked (DBusConnection  *connection,
+                                               DBusPendingCall *pending)
+{
+  /* This ends up unlocking to call the pending call finalizer, which is unexpected to
+   * say the least.
+   */
+  _dbus_hash_table_remove_int (connection->pending_replies,
+                               _dbus_pending_call_get_reply_serial_unlocked (pending));
+}
+
+static void
+_dbus_connection_detach_pending_call_and_unlock (DBusConnection  *connection,
+                                                 DBusPendingCall *pending)
+{
+  /* The idea here is to avoid finalizing the pending call
+   * with the lock held, since there's a destroy notifier
+   * in pending call that goes out to application code.
+   *
+   * There's an extra unlock inside the hash table
+   * "free pending call" function FIXME...
+   */
+  _dbus_pending_call_ref_unlocked (pending);
+  _dbus_hash_table_remove_int (connection->pending_replies,
+                               _dbus_pending_call_get_reply_serial_unlocked (pending));
+
+  _dbus_connection_remove_pending_timeout_unlocked (connection, pending);
+
+  _dbus_pending_call_unref_and_unlock (pending);
+}
+
+/**
+ * Removes a pending call from the connection, such that
+ * the pending reply will be ignored. May drop the last
+ * reference to the pending call.
+ *
+ * @param connection the connection
  * @param pending the pending call
  */
 void
@@ -1054,7 +1618,8 @@ _dbus_connection_remove_pending_call (DBusConnection  *connection,
  * IO path mutex while waiting for the I/O path.
  *
  * @param connection the connection.
- * @param timeout_milliseconds maximum blocking time, or -1 for no limit.
+ * @param timeout_milliseconds maximum blocking time, 0 to not wait
+ *   at all, or -1 for no limit.
  * @returns TRUE if the I/O path was acquired.
  */
 static dbus_bool_t
@@ -1081,7 +1646,16 @@ _dbus_connection_acquire_io_path (DBusConnection *connection,
   
   if (connection->io_path_acquired)
     {
-      if (timeout_milliseconds != -1)
+      if (timeout_milliseconds == 0)
+        {
+          /* Someone else is doing I/O; a non-blocking caller (typically
+           * a sender that has just queued a message) leaves its message
+           * in the outgoing queue for the current owner, or the main
+           * loop, to write instead of bouncing through the condvar.
+           */
+          _dbus_verbose ("IO path busy, not waiting\n");
+        }
+      else if (timeout_milliseconds != -1)
         {
           _dbus_verbose ("waiting %d for IO path to be acquirable\n",
                          timeout_milliseconds);
@@ -1217,8 +1791,7 @@ _dbus_connection_do_iteration_unlocked (DBusConnection *connection,
           _dbus_verbose ("pending call completed while acquiring I/O path");
         }
       else if ( (pending != NULL) &&
-                _dbus_connection_peek_for_reply_unlocked (connection,
-                                                          _dbus_pending_call_get_reply_serial_unlocked (pending)))
+                _dbus_connection_peek_for_reply_unlocked (connection, pending))
         {
           _dbus_verbose ("pending call completed while acquiring I/O path (reply found in queue)");
         }
@@ -1309,6 +1882,13 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
   if (connection->slot_mutex == NULL)
     goto error;
 
+  _dbus_lock_profile_name (connection->mutex, "connection", connection);
+  _dbus_lock_profile_name (connection->io_path_mutex, "io_path", connection);
+  _dbus_lock_profile_name (connection->dispatch_mutex, "dispatch",
+                           connection);
+  _dbus_lock_profile_name (connection->slot_mutex, "connection slots",
+                           connection);
+
   disconnect_message = dbus_message_new_signal (DBUS_PATH_LOCAL,
                                                 DBUS_INTERFACE_LOCAL,
                                                 "Disconnected");
@@ -1338,6 +1918,11 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
   connection->timeouts = timeout_list;
   connection->pending_replies = pending_replies;
   connection->outgoing_counter = outgoing_counter;
+  connection->max_unflushed_size = 0;
+  connection->max_overtaken_broadcasts = 0;
+  connection->broadcast_ttl = 0;
+  connection->n_expired_broadcasts = 0;
+  connection->dispatch_deficit = 0;
   connection->filter_list = NULL;
   connection->last_dispatch_status = DBUS_DISPATCH_COMPLETE; /* so we're notified first time there's data */
   connection->objects = objects;
@@ -1353,7 +1938,7 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
   
   _dbus_data_slot_list_init (&connection->slot_list);
 
-  connection->client_serial = 1;
+  _dbus_atomic_inc (&connection->client_serial);
 
   connection->disconnect_message_link = disconnect_link;
 
@@ -1456,19 +2041,34 @@ _dbus_connection_unref_unlocked (DBusConnection *connection)
     _dbus_connection_last_unref (connection);
 }
 
+/* Can be called with or without the connection lock */
 static dbus_uint32_t
 _dbus_connection_get_next_client_serial (DBusConnection *connection)
 {
   dbus_uint32_t serial;
 
-  serial = connection->client_serial++;
-
-  if (connection->client_serial == 0)
-    connection->client_serial = 1;
+  /* 0 is not a valid serial, so skip it when the counter wraps */
+  do
+    serial = (dbus_uint32_t) _dbus_atomic_inc (&connection->client_serial);
+  while (serial == 0);
 
   return serial;
 }
 
+/* Gives the message a serial if it doesn't have one, and locks it,
+ * before the connection lock is taken, so that the time spent under
+ * the lock when queueing is as short as possible. */
+static void
+_dbus_connection_prepare_message_for_send (DBusConnection *connection,
+                                           DBusMessage    *message)
+{
+  if (dbus_message_get_serial (message) == 0)
+    dbus_message_set_serial (message,
+                             _dbus_connection_get_next_client_serial (connection));
+
+  dbus_message_lock (message);
+}
+
 /**
  * A callback for use with dbus_watch_new() to create a DBusWatch.
  * 
@@ -1963,15 +2563,24 @@ _dbus_connection_preallocate_send_unlocked (DBusConnection *connection)
   
   _dbus_assert (connection != NULL);
   
-  preallocated = dbus_new (DBusPreallocatedSend, 1);
-  if (preallocated == NULL)
-    return NULL;
+  if (connection->spare_preallocated != NULL)
+    {
+      preallocated = connection->spare_preallocated;
+      connection->spare_preallocated = NULL;
+    }
+  else
+    {
+      preallocated = dbus_new (DBusPreallocatedSend, 1);
+      if (preallocated == NULL)
+        return NULL;
+    }
 
-  preallocated->queue_link = _dbus_list_alloc_link (NULL);
+  preallocated->queue_link = _dbus_connection_alloc_link_unlocked (connection, NULL);
   if (preallocated->queue_link == NULL)
     goto failed_0;
 
-  preallocated->counter_link = _dbus_list_alloc_link (connection->outgoing_counter);
+  preallocated->counter_link =
+    _dbus_connection_alloc_link_unlocked (connection, connection->outgoing_counter);
   if (preallocated->counter_link == NULL)
     goto failed_1;
 
@@ -1982,13 +2591,61 @@ _dbus_connection_preallocate_send_unlocked (DBusConnection *connection)
   return preallocated;
   
  failed_1:
-  _dbus_list_free_link (preallocated->queue_link);
+  _dbus_connection_free_link_unlocked (connection, preallocated->queue_link);
  failed_0:
   dbus_free (preallocated);
   
   return NULL;
 }
 
+
+/* Returns the outgoing link to queue @message in front of, or NULL if
+ * the queue is empty. Normally that is the newest message; with
+ * max_overtaken_broadcasts set, a message that is not a broadcast goes
+ * ahead of that many of the newest queued broadcasts, so that replies
+ * are not stuck behind a flood of signals. Only messages from other
+ * senders are overtaken, since the bus only promises to keep the
+ * order of each sender's messages, and never the oldest, which the
+ * transport may have started writing. */
+static DBusList *
+_dbus_connection_find_outgoing_position (DBusConnection *connection,
+                                         DBusMessage    *message)
+{
+  DBusList *link;
+  DBusList *oldest;
+  const char *sender;
+  int n;
+
+  link = _dbus_list_get_first_link (&connection->outgoing_messages);
+
+  if (link == NULL ||
+      connection->max_overtaken_broadcasts == 0 ||
+      message_is_broadcast (message))
+    return link;
+
+  sender = dbus_message_get_sender (message);
+  if (sender == NULL)
+    return link;
+
+  oldest = _dbus_list_get_last_link (&connection->outgoing_messages);
+
+  for (n = 0; n < connection->max_overtaken_broadcasts && link != oldest; n++)
+    {
+      const char *queued_sender;
+
+      if (!message_is_broadcast (link->data))
+        break;
+
+      queued_sender = dbus_message_get_sender (link->data);
+      if (queued_sender == NULL || strcmp (queued_sender, sender) == 0)
+        break;
+
+      link = _dbus_list_get_next_link (&connection->outgoing_messages, link);
+    }
+
+  return link;
+}
+
 /* Called with lock held, does not update dispatch status */
 static void
 _dbus_connection_send_preallocated_unlocked_no_update (DBusConnection       *connection,
@@ -1999,21 +2656,45 @@ _dbus_connection_send_preallocated_unlocked_no_update (DBusConnection       *con
   dbus_uint32_t serial;
 
   preallocated->queue_link->data = message;
-  _dbus_list_prepend_link (&connection->outgoing_messages,
-                           preallocated->queue_link);
+  _dbus_list_insert_before_link (&connection->outgoing_messages,
+                                 _dbus_connection_find_outgoing_position (connection,
+                                                                          message),
+                                 preallocated->queue_link);
 
   /* It's OK that we'll never call the notify function, because for the
    * outgoing limit, there isn't one */
   _dbus_message_add_counter_link (message,
                                   preallocated->counter_link);
 
-  dbus_free (preallocated);
+  if (connection->spare_preallocated == NULL)
+    {
+      preallocated->queue_link = NULL;
+      preallocated->counter_link = NULL;
+      connection->spare_preallocated = preallocated;
+    }
+  else
+    {
+      dbus_free (preallocated);
+    }
+
   preallocated = NULL;
   
   dbus_message_ref (message);
   
   connection->n_outgoing += 1;
 
+  if (connection->broadcast_ttl > 0 && message_is_broadcast (message))
+    {
+      /* a broadcast is queued for all its recipients at about the same
+       * time, so the first of them can stand for the rest */
+      if (message->queued_nsec == 0)
+        message->queued_nsec = _dbus_get_monotonic_time_nsec ();
+
+      /* so that a recipient that stops reading is not left with more
+       * than the TTL's worth of them */
+      _dbus_connection_expire_broadcasts_unlocked (connection);
+    }
+
   _dbus_verbose ("Message %p (%s %s %s %s '%s') for %s added to outgoing queue %p, %d pending to send\n",
                  message,
                  dbus_message_type_to_string (dbus_message_get_type (message)),
@@ -2052,12 +2733,27 @@ _dbus_connection_send_preallocated_unlocked_no_update (DBusConnection       *con
   dbus_message_lock (message);
 
   /* Now we need to run an iteration to hopefully just write the messages
-   * out immediately, and otherwise get them queued up
+   * out immediately, and otherwise get them queued up. If the application
+   * asked for coalescing and the queue is still small, only make sure the
+   * write watch is enabled; the main loop then writes everything queued
+   * by the time it gets round to it in one go. If someone else holds the
+   * I/O path, they will notice the queue when their iteration finishes.
    */
-  _dbus_connection_do_iteration_unlocked (connection,
-                                          NULL,
-                                          DBUS_ITERATION_DO_WRITING,
-                                          -1);
+  if (connection->max_unflushed_size > 0 &&
+      _dbus_counter_get_size_value (connection->outgoing_counter) <
+      connection->max_unflushed_size)
+    {
+      if (_dbus_connection_acquire_io_path (connection, 0))
+        {
+          _dbus_transport_messages_queued (connection->transport);
+          _dbus_connection_release_io_path (connection);
+        }
+    }
+  else
+    _dbus_connection_do_iteration_unlocked (connection,
+                                            NULL,
+                                            DBUS_ITERATION_DO_WRITING,
+                                            -1);
 
   /* If stuff is still queued up, be sure we wake up the main loop */
   if (connection->n_outgoing > 0)
@@ -2229,15 +2925,24 @@ generate_local_error_message (dbus_uint32_t serial,
 }
 
 /*
- * Peek the incoming queue to see if we got reply for a specific serial
+ * Peek the incoming queue to see if we got reply for a pending call.
+ * The queue is only searched if a reply has been queued since we last
+ * looked, so a thread blocking behind a long queue of unread signals
+ * doesn't walk all of them on every wakeup.
  */
 static dbus_bool_t
-_dbus_connection_peek_for_reply_unlocked (DBusConnection *connection,
-                                          dbus_uint32_t   client_serial)
+_dbus_connection_peek_for_reply_unlocked (DBusConnection  *connection,
+                                          DBusPendingCall *pending)
 {
   DBusList *link;
+  dbus_uint32_t client_serial;
+
   HAVE_LOCK_CHECK (connection);
 
+  if (!_dbus_pending_call_get_reply_queued_unlocked (pending))
+    return FALSE;
+
+  client_serial = _dbus_pending_call_get_reply_serial_unlocked (pending);
   link = _dbus_list_get_first_link (&connection->incoming_messages);
 
   while (link != NULL)
@@ -2252,6 +2957,8 @@ _dbus_connection_peek_for_reply_unlocked (DBusConnection *connection,
       link = _dbus_list_get_next_link (&connection->incoming_messages, link);
     }
 
+  /* someone else took it, for instance with dbus_connection_pop_message() */
+  _dbus_pending_call_set_reply_queued_unlocked (pending, FALSE);
   return FALSE;
 }
 
@@ -2284,7 +2991,8 @@ check_for_reply_unlocked (DBusConnection *connection,
   return NULL;
 }
 
-static void
+/* Returns FALSE if there wasn't enough memory to time out every call */
+static dbus_bool_t
 connection_timeout_and_complete_all_pending_calls_unlocked (DBusConnection *connection)
 {
    /* We can't iterate over the hash in the normal way since we'll be
@@ -2301,21 +3009,20 @@ connection_timeout_and_complete_all_pending_calls_unlocked (DBusConnection *conn
       _dbus_hash_iter_next (&iter);
        
       pending = _dbus_hash_iter_get_value (&iter);
-      _dbus_pending_call_ref_unlocked (pending);
-       
-      _dbus_pending_call_queue_timeout_error_unlocked (pending, 
-                                                       connection);
+      if (!_dbus_pending_call_queue_timeout_error_unlocked (pending,
+                                                            connection))
+        return FALSE;
 
-      if (_dbus_pending_call_is_timeout_added_unlocked (pending))
-          _dbus_connection_remove_timeout_unlocked (connection,
-                                                    _dbus_pending_call_get_timeout_unlocked (pending));
-      _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);       
+      _dbus_pending_call_ref_unlocked (pending);
+      _dbus_connection_remove_pending_timeout_unlocked (connection, pending);
       _dbus_hash_iter_remove_entry (&iter);
 
       _dbus_pending_call_unref_and_unlock (pending);
       CONNECTION_LOCK (connection);
     }
   HAVE_LOCK_CHECK (connection);
+
+  return TRUE;
 }
 
 static void
@@ -2339,6 +3046,9 @@ check_for_reply_and_update_dispatch_unlocked (DBusConnection  *connection,
   DBusMessage *reply;
   DBusDispatchStatus status;
 
+  if (!_dbus_pending_call_get_reply_queued_unlocked (pending))
+    return FALSE;
+
   reply = check_for_reply_unlocked (connection, 
                                     _dbus_pending_call_get_reply_serial_unlocked (pending));
   if (reply != NULL)
@@ -2358,6 +3068,7 @@ check_for_reply_and_update_dispatch_unlocked (DBusConnection  *connection,
       return TRUE;
     }
 
+  _dbus_pending_call_set_reply_queued_unlocked (pending, FALSE);
   return FALSE;
 }
 
@@ -2383,7 +3094,6 @@ _dbus_connection_block_pending_call (DBusPendingCall *pending)
   DBusDispatchStatus status;
   DBusConnection *connection;
   dbus_uint32_t client_serial;
-  DBusTimeout *timeout;
   int timeout_milliseconds, elapsed_milliseconds;
 
   _dbus_assert (pending != NULL);
@@ -2404,12 +3114,10 @@ _dbus_connection_block_pending_call (DBusPendingCall *pending)
    * in _dbus_pending_call_new() so overflows aren't possible
    * below
    */
-  timeout = _dbus_pending_call_get_timeout_unlocked (pending);
+  timeout_milliseconds = _dbus_pending_call_get_timeout_interval_unlocked (pending);
   _dbus_get_monotonic_time (&start_tv_sec, &start_tv_usec);
-  if (timeout)
+  if (timeout_milliseconds != DBUS_TIMEOUT_INFINITE)
     {
-      timeout_milliseconds = dbus_timeout_get_interval (timeout);
-
       _dbus_verbose ("dbus_connection_send_with_reply_and_block(): will block %d milliseconds for reply serial %u from %ld sec %ld usec\n",
                      timeout_milliseconds,
                      client_serial,
@@ -2474,14 +3182,22 @@ _dbus_connection_block_pending_call (DBusPendingCall *pending)
                                                 DBUS_ERROR_DISCONNECTED, 
                                                 "Connection was disconnected before a reply was received"); 
 
-      /* on OOM error_msg is set to NULL */
+      /* on OOM error_msg is set to NULL, and the timeout error is used
+       * instead, if there's memory for that */
+      if (error_msg == NULL &&
+          !_dbus_pending_call_build_timeout_error_unlocked (pending))
+        {
+          _dbus_sleep_milliseconds (PENDING_TIMEOUT_OOM_RETRY_MILLISECONDS);
+          goto recheck_status;
+        }
+
       complete_pending_call_and_unlock (connection, pending, error_msg);
       dbus_pending_call_unref (pending);
       return;
     }
   else if (connection->disconnect_message_link == NULL)
     _dbus_verbose ("dbus_connection_send_with_reply_and_block(): disconnected\n");
-  else if (timeout == NULL)
+  else if (timeout_milliseconds == -1)
     {
        if (status == DBUS_DISPATCH_NEED_MEMORY)
         {
@@ -2538,7 +3254,14 @@ _dbus_connection_block_pending_call (DBusPendingCall *pending)
                  elapsed_milliseconds);
 
   _dbus_assert (!_dbus_pending_call_get_completed_unlocked (pending));
-  
+
+  if (!_dbus_pending_call_build_timeout_error_unlocked (pending))
+    {
+      _dbus_verbose ("dbus_connection_send_with_reply_and_block() waiting for memory for the timeout error\n");
+      _dbus_sleep_milliseconds (PENDING_TIMEOUT_OOM_RETRY_MILLISECONDS);
+      goto recheck_status;
+    }
+
   /* unlock and call user code */
   complete_pending_call_and_unlock (connection, pending, NULL);
 
@@ -2576,25 +3299,221 @@ _dbus_connection_set_pending_fds_function (DBusConnection *connection,
                                             callback, data);
 }
 
-/** @} */
-
 /**
- * @addtogroup DBusConnection
+ * Lets replies, errors and other messages with a destination that are
+ * sent on this connection go ahead of up to @p n queued broadcast
+ * signals from other senders, for a message bus whose clients may
+ * fall behind on signals. 0, the default, sends everything in order.
  *
- * @{
+ * @param connection the connection
+ * @param n how many queued broadcasts a message may overtake
  */
+void
+_dbus_connection_set_max_overtaken_broadcasts (DBusConnection *connection,
+                                               int             n)
+{
+  CONNECTION_LOCK (connection);
+  connection->max_overtaken_broadcasts = n;
+  CONNECTION_UNLOCK (connection);
+}
 
 /**
- * Gets a connection to a remote address. If a connection to the given
- * address already exists, returns the existing connection with its
- * reference count incremented.  Otherwise, returns a new connection
- * and saves the new connection for possible re-use if a future call
- * to dbus_connection_open() asks to connect to the same server.
+ * Drops broadcast signals that were put in the outgoing queue more
+ * than @p ttl milliseconds ago, instead of writing them, for a
+ * message bus whose clients may stop reading for a while and would
+ * rather catch up with recent signals than old ones. Replies and
+ * other messages with a destination are always written. 0, the
+ * default, writes everything.
  *
- * Use dbus_connection_open_private() to get a dedicated connection
- * not shared with other callers of dbus_connection_open().
- *
- * If the open fails, the function returns #NULL, and provides a
+ * @param connection the connection
+ * @param ttl milliseconds a broadcast may wait in the queue
+ */
+void
+_dbus_connection_set_broadcast_ttl (DBusConnection *connection,
+                                    int             ttl)
+{
+  CONNECTION_LOCK (connection);
+  connection->broadcast_ttl = ttl;
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
+ * Lets the socket's kernel send and receive buffers grow, up to the
+ * given sizes, while the peer is slow to read or sends large
+ * messages: the send buffer doubles each time a write would block,
+ * and the receive buffer each time a read takes all it holds. Buffers
+ * never shrink, and stop growing once the kernel refuses to make them
+ * bigger. 0, the default, leaves the buffers as the kernel sized them.
+ *
+ * @param connection the connection
+ * @param send_size largest send buffer to grow to, in bytes, or 0
+ * @param receive_size largest receive buffer to grow to, in bytes, or 0
+ */
+void
+_dbus_connection_set_max_socket_buffer_sizes (DBusConnection *connection,
+                                              int             send_size,
+                                              int             receive_size)
+{
+  CONNECTION_LOCK (connection);
+  _dbus_transport_set_max_socket_buffer_sizes (connection->transport,
+                                               send_size, receive_size);
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
+ * Stops or restarts reading from this connection, for a message bus
+ * that throttles peers: while paused, nothing more is read from the
+ * socket and no more buffered data is parsed into messages, though
+ * messages already in the incoming queue can still be dispatched.
+ *
+ * @param connection the connection
+ * @param paused #TRUE to pause reading, #FALSE to resume it
+ */
+void
+_dbus_connection_set_reads_paused (DBusConnection *connection,
+                                   dbus_bool_t     paused)
+{
+  DBusDispatchStatus status;
+
+  CONNECTION_LOCK (connection);
+  _dbus_transport_set_reads_paused (connection->transport, paused);
+
+  /* on resuming, there may be buffered messages to dispatch */
+  status = _dbus_connection_get_dispatch_status_unlocked (connection);
+
+  /* unlocks and calls out to user code */
+  _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+}
+
+/* A message can be taken back out of the outgoing queue if the
+ * transport cannot have started writing it, which rules out the
+ * oldest, and if it has no fds, which may have gone ahead of it. */
+static DBusList *
+_dbus_connection_find_removable_outgoing_link (DBusConnection *connection,
+                                               DBusMessage    *message)
+{
+  DBusList *link;
+  DBusList *oldest;
+
+  HAVE_LOCK_CHECK (connection);
+
+  if (dbus_message_contains_unix_fds (message))
+    return NULL;
+
+  link = _dbus_list_get_first_link (&connection->outgoing_messages);
+  oldest = _dbus_list_get_last_link (&connection->outgoing_messages);
+
+  while (link != NULL && link != oldest)
+    {
+      if (link->data == message)
+        return link;
+
+      link = _dbus_list_get_next_link (&connection->outgoing_messages, link);
+    }
+
+  return NULL;
+}
+
+/**
+ * Checks whether _dbus_connection_remove_outgoing_message() would
+ * succeed.
+ *
+ * @param connection the connection
+ * @param message a message that may have been sent on it
+ * @returns #TRUE if the message is queued and can still be removed
+ */
+dbus_bool_t
+_dbus_connection_can_remove_outgoing_message (DBusConnection *connection,
+                                              DBusMessage    *message)
+{
+  dbus_bool_t ret;
+
+  CONNECTION_LOCK (connection);
+  ret = (_dbus_connection_find_removable_outgoing_link (connection,
+                                                        message) != NULL);
+  CONNECTION_UNLOCK (connection);
+  return ret;
+}
+
+/**
+ * Takes a message back out of the outgoing queue without sending it,
+ * for a message bus that replaces a queued message with a newer one
+ * superseding it. A message the transport may have started to write
+ * cannot be removed.
+ *
+ * @param connection the connection
+ * @param message a message that may have been sent on it
+ * @returns #TRUE if the message was queued and has been removed
+ */
+dbus_bool_t
+_dbus_connection_remove_outgoing_message (DBusConnection *connection,
+                                          DBusMessage    *message)
+{
+  DBusList *link;
+
+  CONNECTION_LOCK (connection);
+
+  link = _dbus_connection_find_removable_outgoing_link (connection, message);
+
+  if (link == NULL)
+    {
+      CONNECTION_UNLOCK (connection);
+      return FALSE;
+    }
+
+  _dbus_list_unlink (&connection->outgoing_messages, link);
+  connection->n_outgoing -= 1;
+  _dbus_message_remove_counter (message, connection->outgoing_counter);
+
+  /* unreffed when we unlock, as in _dbus_connection_message_sent_unlocked() */
+  _dbus_list_prepend_link (&connection->expired_messages, link);
+
+  _dbus_verbose ("Message %p removed unsent from outgoing queue %p, %d left to send\n",
+                 message, connection, connection->n_outgoing);
+
+  CONNECTION_UNLOCK (connection);
+  return TRUE;
+}
+
+/**
+ * Leaves the bodies of received messages of at least @p size bytes
+ * unvalidated, for a caller that mostly passes them on without
+ * reading them, such as the message bus. Each one must be checked
+ * with _dbus_message_validate_deferred_body() before its body is read
+ * or it is sent anywhere. 0, the default, validates every body as it
+ * is received.
+ *
+ * @param connection the connection
+ * @param size the smallest body left unvalidated, or 0
+ */
+void
+_dbus_connection_set_deferred_validation_size (DBusConnection *connection,
+                                               long            size)
+{
+  CONNECTION_LOCK (connection);
+  _dbus_transport_set_deferred_validation_size (connection->transport, size);
+  CONNECTION_UNLOCK (connection);
+}
+
+/** @} */
+
+/**
+ * @addtogroup DBusConnection
+ *
+ * @{
+ */
+
+/**
+ * Gets a connection to a remote address. If a connection to the given
+ * address already exists, returns the existing connection with its
+ * reference count incremented.  Otherwise, returns a new connection
+ * and saves the new connection for possible re-use if a future call
+ * to dbus_connection_open() asks to connect to the same server.
+ *
+ * Use dbus_connection_open_private() to get a dedicated connection
+ * not shared with other callers of dbus_connection_open().
+ *
+ * If the open fails, the function returns #NULL, and provides a
  * reason for the failure in the error parameter. Pass #NULL for the
  * error parameter if you aren't interested in the reason for
  * failure.
@@ -2603,6 +3522,14 @@ _dbus_connection_set_pending_fds_function (DBusConnection *connection,
  * may call dbus_connection_close(). However, when you are done with the
  * connection you should call dbus_connection_unref().
  *
+ * If the address has the key pipeline=true, as in
+ * "unix:path=/var/run/dbus/system_bus_socket,pipeline=true", the
+ * authentication handshake and the first messages (such as the Hello
+ * sent by dbus_bus_register()) are sent without waiting for the
+ * server's replies, which saves several round-trips. The catch is
+ * that if the server does not accept the EXTERNAL mechanism, the
+ * connection fails rather than falling back to another one.
+ *
  * @note Prefer dbus_connection_open() to dbus_connection_open_private()
  * unless you have good reason; connections are expensive enough
  * that it's wasteful to create lots of connections to the same
@@ -2755,8 +3682,26 @@ _dbus_connection_last_unref (DBusConnection *connection)
 
   _dbus_object_tree_unref (connection->objects);  
 
+  if (connection->peer_ping_reply)
+    dbus_message_unref (connection->peer_ping_reply);
+  if (connection->peer_machine_id_reply)
+    dbus_message_unref (connection->peer_machine_id_reply);
+
+  dbus_free (connection->signal_interest);
+
+  /* each of these holds a ref to us through its pending call */
+  _dbus_assert (connection->completed_pending_calls == NULL);
+
   _dbus_hash_table_unref (connection->pending_replies);
   connection->pending_replies = NULL;
+
+  _dbus_list_foreach (&connection->pending_timeout_queues,
+                      (DBusForeachFunction) dbus_free,
+                      NULL);
+  _dbus_list_clear (&connection->pending_timeout_queues);
+
+  if (connection->pending_timeout)
+    _dbus_timeout_unref (connection->pending_timeout);
   
   _dbus_list_clear (&connection->filter_list);
   
@@ -2770,6 +3715,14 @@ _dbus_connection_last_unref (DBusConnection *connection)
 		      NULL);
   _dbus_list_clear (&connection->incoming_messages);
 
+  /* workers hold a ref while they use these */
+  if (connection->dispatch_queues != NULL)
+    _dbus_dispatch_queues_free (connection->dispatch_queues);
+
+  _dbus_list_clear (&connection->spare_links);
+  connection->n_spare_links = 0;
+  dbus_free (connection->spare_preallocated);
+
   _dbus_counter_unref (connection->outgoing_counter);
 
   _dbus_transport_unref (connection->transport);
@@ -2781,6 +3734,12 @@ _dbus_connection_last_unref (DBusConnection *connection)
       _dbus_list_free_link (connection->disconnect_message_link);
     }
 
+  if (connection->timeout_error_reserve)
+    {
+      dbus_message_unref (connection->timeout_error_reserve->data);
+      _dbus_list_free_link (connection->timeout_error_reserve);
+    }
+
   _dbus_condvar_free_at_location (&connection->dispatch_cond);
   _dbus_condvar_free_at_location (&connection->io_path_cond);
 
@@ -3229,6 +4188,8 @@ dbus_connection_send_preallocated (DBusConnection       *connection,
                         (dbus_message_get_interface (message) != NULL &&
                          dbus_message_get_member (message) != NULL));
 
+  _dbus_connection_prepare_message_for_send (connection, message);
+
   CONNECTION_LOCK (connection);
 
 #ifdef HAVE_UNIX_FD_PASSING
@@ -3306,6 +4267,8 @@ dbus_connection_send (DBusConnection *connection,
   _dbus_return_val_if_fail (connection != NULL, FALSE);
   _dbus_return_val_if_fail (message != NULL, FALSE);
 
+  _dbus_connection_prepare_message_for_send (connection, message);
+
   CONNECTION_LOCK (connection);
 
 #ifdef HAVE_UNIX_FD_PASSING
@@ -3327,30 +4290,108 @@ dbus_connection_send (DBusConnection *connection,
 					   serial);
 }
 
-static dbus_bool_t
-reply_handler_timeout (void *data)
+/**
+ * Queues one message to send on each of several connections, as if by
+ * calling dbus_connection_send() on each, for instance to send a signal
+ * to every peer of a #DBusServer without a message bus.
+ *
+ * The message is given a serial and locked once, and the same message
+ * is queued on every connection rather than a copy. Resources for all
+ * the connections are allocated before anything is queued, so if this
+ * fails for lack of memory, the message was not sent on any of them.
+ *
+ * Since the message has one serial, which comes from the first
+ * connection, it must be a signal, or a method call with
+ * dbus_message_set_no_reply() set: a reply to it on one of the other
+ * connections could be mistaken for a reply to their own messages.
+ *
+ * Like dbus_connection_send(), this also fails without sending
+ * anything if the message has Unix file descriptors and one of the
+ * connections cannot pass them.
+ *
+ * @param connections the connections
+ * @param n_connections how many connections there are
+ * @param message the message to write
+ * @param serial return location for the message serial, or #NULL
+ * @returns #FALSE if no memory, or the message could not be sent on
+ *  every connection
+ */
+dbus_bool_t
+dbus_connection_send_multi (DBusConnection **connections,
+                            int              n_connections,
+                            DBusMessage     *message,
+                            dbus_uint32_t   *serial)
 {
-  DBusConnection *connection;
-  DBusDispatchStatus status;
-  DBusPendingCall *pending = data;
+  DBusPreallocatedSend **preallocated;
+  int i, j;
 
-  connection = _dbus_pending_call_get_connection_and_lock (pending);
-  _dbus_connection_ref_unlocked (connection);
+  _dbus_return_val_if_fail (n_connections >= 0, FALSE);
+  _dbus_return_val_if_fail (connections != NULL || n_connections == 0, FALSE);
+  _dbus_return_val_if_fail (message != NULL, FALSE);
+  _dbus_return_val_if_fail (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_SIGNAL ||
+                            (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_METHOD_CALL &&
+                             dbus_message_get_no_reply (message)), FALSE);
 
-  _dbus_pending_call_queue_timeout_error_unlocked (pending, 
-                                                   connection);
-  _dbus_connection_remove_timeout_unlocked (connection,
-				            _dbus_pending_call_get_timeout_unlocked (pending));
-  _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
+  for (i = 0; i < n_connections; i++)
+    _dbus_return_val_if_fail (connections[i] != NULL, FALSE);
 
-  _dbus_verbose ("middle\n");
-  status = _dbus_connection_get_dispatch_status_unlocked (connection);
+  if (n_connections == 0)
+    {
+      if (serial)
+        *serial = dbus_message_get_serial (message);
+
+      return TRUE;
+    }
+
+  preallocated = dbus_new (DBusPreallocatedSend *, n_connections);
+  if (preallocated == NULL)
+    return FALSE;
+
+  _dbus_connection_prepare_message_for_send (connections[0], message);
+
+  for (i = 0; i < n_connections; i++)
+    {
+      DBusConnection *connection = connections[i];
+
+      CONNECTION_LOCK (connection);
+
+#ifdef HAVE_UNIX_FD_PASSING
+      if (!_dbus_transport_can_pass_unix_fd (connection->transport) &&
+          message->n_unix_fds > 0)
+        {
+          CONNECTION_UNLOCK (connection);
+          goto failed;
+        }
+#endif
+
+      preallocated[i] = _dbus_connection_preallocate_send_unlocked (connection);
+      CONNECTION_UNLOCK (connection);
+
+      if (preallocated[i] == NULL)
+        goto failed;
+    }
+
+  for (i = 0; i < n_connections; i++)
+    {
+      CONNECTION_LOCK (connections[i]);
+      _dbus_connection_send_preallocated_and_unlock (connections[i],
+                                                     preallocated[i],
+                                                     message, NULL);
+    }
+
+  dbus_free (preallocated);
+
+  if (serial)
+    *serial = dbus_message_get_serial (message);
 
-  /* Unlocks, and calls out to user code */
-  _dbus_connection_update_dispatch_status_and_unlock (connection, status);
-  dbus_connection_unref (connection);
-  
   return TRUE;
+
+ failed:
+  for (j = 0; j < i; j++)
+    dbus_connection_free_preallocated_send (connections[j], preallocated[j]);
+
+  dbus_free (preallocated);
+  return FALSE;
 }
 
 /**
@@ -3436,9 +4477,21 @@ dbus_connection_send_with_reply (DBusConnection     *connection,
       return TRUE;
     }
 
+  /* The call's own timeout error is only built if it times out; this
+   * makes sure one can be given to it even if there's no memory then */
+  if (connection->timeout_error_reserve == NULL)
+    {
+      connection->timeout_error_reserve = _dbus_pending_call_new_timeout_error_link ();
+
+      if (connection->timeout_error_reserve == NULL)
+        {
+          CONNECTION_UNLOCK (connection);
+          return FALSE;
+        }
+    }
+
   pending = _dbus_pending_call_new_unlocked (connection,
-                                             timeout_milliseconds,
-                                             reply_handler_timeout);
+                                             timeout_milliseconds);
 
   if (pending == NULL)
     {
@@ -3454,9 +4507,8 @@ dbus_connection_send_with_reply (DBusConnection     *connection,
       dbus_message_set_serial (message, serial);
     }
 
-  if (!_dbus_pending_call_set_timeout_error_unlocked (pending, message, serial))
-    goto error;
-    
+  _dbus_pending_call_set_reply_serial_unlocked (pending, serial);
+
   /* Insert the serial in the pending replies hash;
    * hash takes a refcount on DBusPendingCall.
    * Also, add the timeout.
@@ -3711,6 +4763,12 @@ _dbus_connection_read_write_dispatch (DBusConnection *connection,
                                                   timeout_milliseconds);
         }
     }
+
+  /* Calls with a completion queue don't need to wait for the next
+   * dispatch, or the next call to this function, to be completed:
+   * parse what we have read and finish them now. */
+  (void) _dbus_connection_get_dispatch_status_unlocked (connection);
+  complete_routed_pending_calls_unlocked (connection);
   
   HAVE_LOCK_CHECK (connection);
   /* If we can dispatch, we can make progress until the Disconnected message
@@ -4028,7 +5086,7 @@ _dbus_connection_pop_message_unlocked (DBusConnection *connection)
       
       message = link->data;
       
-      _dbus_list_free_link (link);
+      _dbus_connection_free_link_unlocked (connection, link);
       
       return message;
     }
@@ -4178,15 +5236,6 @@ _dbus_connection_release_dispatch (DBusConnection *connection)
   _dbus_cmutex_unlock (connection->dispatch_mutex);
 }
 
-static void
-_dbus_connection_failed_pop (DBusConnection *connection,
-			     DBusList       *message_link)
-{
-  _dbus_list_prepend_link (&connection->incoming_messages,
-			   message_link);
-  connection->n_incoming += 1;
-}
-
 /* Note this may be called multiple times since we don't track whether we already did it */
 static void
 notify_disconnected_unlocked (DBusConnection *connection)
@@ -4232,7 +5281,8 @@ notify_disconnected_and_dispatch_complete_unlocked (DBusConnection *connection)
       /* If we have pending calls, queue their timeouts - we want the Disconnected
        * to be the last message, after these timeouts.
        */
-      connection_timeout_and_complete_all_pending_calls_unlocked (connection);
+      if (!connection_timeout_and_complete_all_pending_calls_unlocked (connection))
+        return DBUS_DISPATCH_NEED_MEMORY;
       
       /* We haven't sent the disconnect message already,
        * and all real messages have been queued up.
@@ -4295,6 +5345,32 @@ _dbus_connection_get_dispatch_status_unlocked (DBusConnection *connection)
     }
 }
 
+/* Replies to calls with a completion queue skip the incoming queue,
+ * so whoever read them finishes the job here, somewhere it is safe to
+ * drop the lock. Drops and retakes the lock if there is anything to do;
+ * the caller must hold a ref. */
+static void
+complete_routed_pending_calls_unlocked (DBusConnection *connection)
+{
+  HAVE_LOCK_CHECK (connection);
+
+  while (connection->completed_pending_calls != NULL)
+    {
+      DBusList *link;
+      DBusPendingCall *pending;
+
+      link = _dbus_list_pop_first_link (&connection->completed_pending_calls);
+      pending = link->data;
+      _dbus_list_free_link (link);
+
+      _dbus_connection_detach_pending_call_and_unlock (connection, pending);
+      _dbus_pending_call_complete (pending);
+      dbus_pending_call_unref (pending);
+
+      CONNECTION_LOCK (connection);
+    }
+}
+
 static void
 _dbus_connection_update_dispatch_status_and_unlock (DBusConnection    *connection,
                                                     DBusDispatchStatus new_status)
@@ -4307,6 +5383,8 @@ _dbus_connection_update_dispatch_status_and_unlock (DBusConnection    *connectio
 
   _dbus_connection_ref_unlocked (connection);
 
+  complete_routed_pending_calls_unlocked (connection);
+
   changed = new_status != connection->last_dispatch_status;
 
   connection->last_dispatch_status = new_status;
@@ -4386,12 +5464,47 @@ dbus_connection_get_dispatch_status (DBusConnection *connection)
   CONNECTION_LOCK (connection);
 
   status = _dbus_connection_get_dispatch_status_unlocked (connection);
-  
+
+  if (connection->completed_pending_calls != NULL)
+    {
+      _dbus_connection_ref_unlocked (connection);
+      complete_routed_pending_calls_unlocked (connection);
+      CONNECTION_UNLOCK (connection);
+      dbus_connection_unref (connection);
+      return status;
+    }
+
   CONNECTION_UNLOCK (connection);
 
   return status;
 }
 
+/* The replies to Ping and GetMachineId never change, so they are built
+ * once per connection and copied for each call.
+ */
+static DBusMessage *
+new_peer_reply_template (const char *machine_id)
+{
+  DBusMessage *template_message;
+
+  template_message = dbus_message_new (DBUS_MESSAGE_TYPE_METHOD_RETURN);
+  if (template_message == NULL)
+    return NULL;
+
+  dbus_message_set_no_reply (template_message, TRUE);
+
+  if (machine_id != NULL &&
+      !dbus_message_append_args (template_message,
+                                 DBUS_TYPE_STRING, &machine_id,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (template_message);
+      return NULL;
+    }
+
+  return template_message;
+}
+
 /**
  * Filter funtion for handling the Peer standard interface.
  */
@@ -4416,7 +5529,7 @@ _dbus_connection_peer_filter_unlocked_no_update (DBusConnection *connection,
 
   /* Preallocate a linked-list link, so that if we need to dispose of a
    * message, we can attach it to the expired list */
-  expire_link = _dbus_list_alloc_link (NULL);
+  expire_link = _dbus_connection_alloc_link_unlocked (connection, NULL);
 
   if (!expire_link)
     return DBUS_HANDLER_RESULT_NEED_MEMORY;
@@ -4425,7 +5538,15 @@ _dbus_connection_peer_filter_unlocked_no_update (DBusConnection *connection,
                                    DBUS_INTERFACE_PEER,
                                    "Ping"))
     {
-      ret = dbus_message_new_method_return (message);
+      if (connection->peer_ping_reply == NULL)
+        {
+          connection->peer_ping_reply = new_peer_reply_template (NULL);
+          if (connection->peer_ping_reply == NULL)
+            goto out;
+        }
+
+      ret = _dbus_message_new_reply_from_template (connection->peer_ping_reply,
+                                                   message);
       if (ret == NULL)
         goto out;
 
@@ -4435,50 +5556,53 @@ _dbus_connection_peer_filter_unlocked_no_update (DBusConnection *connection,
                                         DBUS_INTERFACE_PEER,
                                         "GetMachineId"))
     {
-      DBusString uuid;
-      DBusError error = DBUS_ERROR_INIT;
-
-      if (!_dbus_string_init (&uuid))
-        goto out;
-
-      if (_dbus_get_local_machine_uuid_encoded (&uuid, &error))
+      if (connection->peer_machine_id_reply == NULL)
         {
-          const char *v_STRING;
+          DBusString uuid;
+          DBusError error = DBUS_ERROR_INIT;
 
-          ret = dbus_message_new_method_return (message);
+          if (!_dbus_string_init (&uuid))
+            goto out;
 
-          if (ret == NULL)
+          if (_dbus_get_local_machine_uuid_encoded (&uuid, &error))
+            {
+              connection->peer_machine_id_reply =
+                new_peer_reply_template (_dbus_string_get_const_data (&uuid));
+              _dbus_string_free (&uuid);
+
+              if (connection->peer_machine_id_reply == NULL)
+                goto out;
+            }
+          else if (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
             {
+              dbus_error_free (&error);
               _dbus_string_free (&uuid);
               goto out;
             }
-
-          v_STRING = _dbus_string_get_const_data (&uuid);
-          if (dbus_message_append_args (ret,
-                                        DBUS_TYPE_STRING, &v_STRING,
-                                        DBUS_TYPE_INVALID))
+          else
             {
-              sent = _dbus_connection_send_unlocked_no_update (connection, ret, NULL);
+              ret = dbus_message_new_error (message, error.name, error.message);
+              dbus_error_free (&error);
+              _dbus_string_free (&uuid);
+
+              if (ret == NULL)
+                goto out;
+
+              sent = _dbus_connection_send_unlocked_no_update (connection, ret,
+                                                               NULL);
             }
         }
-      else if (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
-        {
-          dbus_error_free (&error);
-          goto out;
-        }
-      else
-        {
-          ret = dbus_message_new_error (message, error.name, error.message);
-          dbus_error_free (&error);
 
+      if (connection->peer_machine_id_reply != NULL)
+        {
+          ret = _dbus_message_new_reply_from_template (connection->peer_machine_id_reply,
+                                                       message);
           if (ret == NULL)
             goto out;
 
           sent = _dbus_connection_send_unlocked_no_update (connection, ret,
                                                            NULL);
         }
-
-      _dbus_string_free (&uuid);
     }
   else
     {
@@ -4498,7 +5622,7 @@ _dbus_connection_peer_filter_unlocked_no_update (DBusConnection *connection,
 out:
   if (ret == NULL)
     {
-      _dbus_list_free_link (expire_link);
+      _dbus_connection_free_link_unlocked (connection, expire_link);
     }
   else
     {
@@ -4514,8 +5638,57 @@ out:
 }
 
 /**
-* Processes all builtin filter functions
-*
+ * Filter function that keeps the summary the bus sends in
+ * org.freedesktop.DBus.SignalInterest after
+ * dbus_connection_signal_has_subscribers() has asked for it.
+ */
+static DBusHandlerResult
+_dbus_connection_signal_interest_filter_unlocked_no_update (DBusConnection *connection,
+                                                            DBusMessage    *message)
+{
+  dbus_uint32_t version;
+  dbus_bool_t everything;
+  const unsigned char *bitmap;
+  int n_bytes;
+
+  if (!connection->signal_interest_watched ||
+      !dbus_message_is_signal (message, DBUS_INTERFACE_DBUS,
+                               "SignalInterest") ||
+      !dbus_message_has_sender (message, DBUS_SERVICE_DBUS))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (!dbus_message_get_args (message, NULL,
+                              DBUS_TYPE_UINT32, &version,
+                              DBUS_TYPE_BOOLEAN, &everything,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE,
+                              &bitmap, &n_bytes,
+                              DBUS_TYPE_INVALID))
+    return DBUS_HANDLER_RESULT_HANDLED;
+
+  if (connection->signal_interest == NULL)
+    {
+      connection->signal_interest = dbus_new (unsigned char,
+                                              DBUS_SIGNAL_INTEREST_BYTES);
+
+      if (connection->signal_interest == NULL)
+        return DBUS_HANDLER_RESULT_NEED_MEMORY;
+    }
+
+  /* a bitmap we don't know how to read can't rule anything out */
+  if (n_bytes != DBUS_SIGNAL_INTEREST_BYTES)
+    everything = TRUE;
+  else
+    memcpy (connection->signal_interest, bitmap, DBUS_SIGNAL_INTEREST_BYTES);
+
+  connection->signal_interest_version = version;
+  connection->signal_interest_everything = (everything != FALSE);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/**
+* Processes all builtin filter functions
+*
 * If the spec specifies a standard interface
 * they should be processed from this method
 **/
@@ -4523,103 +5696,120 @@ static DBusHandlerResult
 _dbus_connection_run_builtin_filters_unlocked_no_update (DBusConnection *connection,
                                                            DBusMessage    *message)
 {
-  /* We just run one filter for now but have the option to run more
-     if the spec calls for it in the future */
+  DBusHandlerResult result;
+
+  result = _dbus_connection_signal_interest_filter_unlocked_no_update (connection,
+                                                                       message);
+
+  if (result != DBUS_HANDLER_RESULT_NOT_YET_HANDLED)
+    return result;
 
   return _dbus_connection_peer_filter_unlocked_no_update (connection, message);
 }
 
+/* Replies to a method call that nothing handled with an UnknownMethod
+ * error, or UnknownObject if there was no object at its path. Called
+ * with the connection locked. */
+static DBusHandlerResult
+reply_unknown_method_unlocked (DBusConnection *connection,
+                               DBusMessage    *message,
+                               dbus_bool_t     found_object)
+{
+  DBusMessage *reply;
+  DBusString str;
+  DBusPreallocatedSend *preallocated;
+  DBusList *expire_link;
+
+  HAVE_LOCK_CHECK (connection);
+
+  _dbus_verbose ("  sending error %s\n",
+                 DBUS_ERROR_UNKNOWN_METHOD);
+
+  if (!_dbus_string_init (&str))
+    {
+      _dbus_verbose ("no memory for error string in dispatch\n");
+      return DBUS_HANDLER_RESULT_NEED_MEMORY;
+    }
+
+  if (!_dbus_string_append_printf (&str,
+                                   "Method \"%s\" with signature \"%s\" on interface \"%s\" doesn't exist\n",
+                                   dbus_message_get_member (message),
+                                   dbus_message_get_signature (message),
+                                   dbus_message_get_interface (message)))
+    {
+      _dbus_string_free (&str);
+      _dbus_verbose ("no memory for error string in dispatch\n");
+      return DBUS_HANDLER_RESULT_NEED_MEMORY;
+    }
+
+  reply = dbus_message_new_error (message,
+                                  found_object ? DBUS_ERROR_UNKNOWN_METHOD : DBUS_ERROR_UNKNOWN_OBJECT,
+                                  _dbus_string_get_const_data (&str));
+  _dbus_string_free (&str);
+
+  if (reply == NULL)
+    {
+      _dbus_verbose ("no memory for error reply in dispatch\n");
+      return DBUS_HANDLER_RESULT_NEED_MEMORY;
+    }
+
+  expire_link = _dbus_connection_alloc_link_unlocked (connection, reply);
+
+  if (expire_link == NULL)
+    {
+      dbus_message_unref (reply);
+      _dbus_verbose ("no memory for error send in dispatch\n");
+      return DBUS_HANDLER_RESULT_NEED_MEMORY;
+    }
+
+  preallocated = _dbus_connection_preallocate_send_unlocked (connection);
+
+  if (preallocated == NULL)
+    {
+      _dbus_connection_free_link_unlocked (connection, expire_link);
+      /* It's OK that this is finalized, because it hasn't been seen by
+       * anything that could attach user callbacks */
+      dbus_message_unref (reply);
+      _dbus_verbose ("no memory for error send in dispatch\n");
+      return DBUS_HANDLER_RESULT_NEED_MEMORY;
+    }
+
+  _dbus_connection_send_preallocated_unlocked_no_update (connection, preallocated,
+                                                         reply, NULL);
+  /* reply will be freed when we release the lock */
+  _dbus_list_prepend_link (&connection->expired_messages, expire_link);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
 /**
- * Processes any incoming data.
- *
- * If there's incoming raw data that has not yet been parsed, it is
- * parsed, which may or may not result in adding messages to the
- * incoming queue.
- *
- * The incoming data buffer is filled when the connection reads from
- * its underlying transport (such as a socket).  Reading usually
- * happens in dbus_watch_handle() or dbus_connection_read_write().
- * 
- * If there are complete messages in the incoming queue,
- * dbus_connection_dispatch() removes one message from the queue and
- * processes it. Processing has three steps.
- *
- * First, any method replies are passed to #DBusPendingCall or
- * dbus_connection_send_with_reply_and_block() in order to
- * complete the pending method call.
- * 
- * Second, any filters registered with dbus_connection_add_filter()
- * are run. If any filter returns #DBUS_HANDLER_RESULT_HANDLED
- * then processing stops after that filter.
- *
- * Third, if the message is a method call it is forwarded to
- * any registered object path handlers added with
- * dbus_connection_register_object_path() or
- * dbus_connection_register_fallback().
+ * Runs one message popped from the incoming queue through pending
+ * call completion, the builtin and user filters and the object tree,
+ * replying with an error to unhandled method calls.
  *
- * A single call to dbus_connection_dispatch() will process at most
- * one message; it will not clear the entire message queue.
+ * Must be called with the connection locked and the dispatcher
+ * acquired; the lock is dropped while user code runs and held again on
+ * return. If #DBUS_HANDLER_RESULT_NEED_MEMORY is returned, the message
+ * has been put back at the head of the queue, otherwise it has been
+ * unreferenced and its link freed.
  *
- * Be careful about calling dbus_connection_dispatch() from inside a
- * message handler, i.e. calling dbus_connection_dispatch()
- * recursively.  If threads have been initialized with a recursive
- * mutex function, then this will not deadlock; however, it can
- * certainly confuse your application.
- * 
- * @todo some FIXME in here about handling DBUS_HANDLER_RESULT_NEED_MEMORY
- * 
  * @param connection the connection
- * @returns dispatch status, see dbus_connection_get_dispatch_status()
+ * @param message_link the link popped from the incoming queue
+ * @returns the result of handling the message
  */
-DBusDispatchStatus
-dbus_connection_dispatch (DBusConnection *connection)
+static DBusHandlerResult
+_dbus_connection_dispatch_link_unlocked (DBusConnection *connection,
+                                         DBusList       *message_link)
 {
   DBusMessage *message;
-  DBusList *link, *filter_list_copy, *message_link;
+  DBusList *link, *filter_list_copy;
   DBusHandlerResult result;
   DBusPendingCall *pending;
   dbus_int32_t reply_serial;
-  DBusDispatchStatus status;
   dbus_bool_t found_object;
 
-  _dbus_return_val_if_fail (connection != NULL, DBUS_DISPATCH_COMPLETE);
-
-  _dbus_verbose ("\n");
-  
-  CONNECTION_LOCK (connection);
-  status = _dbus_connection_get_dispatch_status_unlocked (connection);
-  if (status != DBUS_DISPATCH_DATA_REMAINS)
-    {
-      /* unlocks and calls out to user code */
-      _dbus_connection_update_dispatch_status_and_unlock (connection, status);
-      return status;
-    }
-  
-  /* We need to ref the connection since the callback could potentially
-   * drop the last ref to it
-   */
-  _dbus_connection_ref_unlocked (connection);
-
-  _dbus_connection_acquire_dispatch (connection);
   HAVE_LOCK_CHECK (connection);
-
-  message_link = _dbus_connection_pop_message_link_unlocked (connection);
-  if (message_link == NULL)
-    {
-      /* another thread dispatched our stuff */
-
-      _dbus_verbose ("another thread dispatched message (during acquire_dispatch above)\n");
-      
-      _dbus_connection_release_dispatch (connection);
-
-      status = _dbus_connection_get_dispatch_status_unlocked (connection);
-
-      _dbus_connection_update_dispatch_status_and_unlock (connection, status);
-      
-      dbus_connection_unref (connection);
-      
-      return status;
-    }
+  _dbus_assert (connection->dispatch_acquired);
 
   message = message_link->data;
 
@@ -4646,6 +5836,12 @@ dbus_connection_dispatch (DBusConnection *connection)
   reply_serial = dbus_message_get_reply_serial (message);
   pending = _dbus_hash_table_lookup_int (connection->pending_replies,
                                          reply_serial);
+
+  /* A second reply to a call that is already on its way to a
+   * completion queue is just an unexpected message */
+  if (pending && _dbus_pending_call_has_reply_unlocked (pending))
+    pending = NULL;
+
   if (pending)
     {
       _dbus_verbose ("Dispatching a pending reply\n");
@@ -4662,68 +5858,96 @@ dbus_connection_dispatch (DBusConnection *connection)
   if (result != DBUS_HANDLER_RESULT_NOT_YET_HANDLED)
     goto out;
  
-  if (!_dbus_list_copy (&connection->filter_list, &filter_list_copy))
+  /* With no filters installed, skip copying the list and the unlock and
+   * relock around running it, so that the connection lock is held (and
+   * contended with sending threads) for as little as possible.
+   */
+  if (connection->filter_list != NULL)
     {
-      _dbus_connection_release_dispatch (connection);
-      HAVE_LOCK_CHECK (connection);
-      
-      _dbus_connection_failed_pop (connection, message_link);
+      if (!_dbus_list_copy (&connection->filter_list, &filter_list_copy))
+        {
+          result = DBUS_HANDLER_RESULT_NEED_MEMORY;
+          _dbus_verbose ("no memory for filter list copy in dispatch\n");
+          goto out;
+        }
 
-      /* unlocks and calls user code */
-      _dbus_connection_update_dispatch_status_and_unlock (connection,
-                                                          DBUS_DISPATCH_NEED_MEMORY);
-      dbus_connection_unref (connection);
-      
-      return DBUS_DISPATCH_NEED_MEMORY;
-    }
-  
-  _dbus_list_foreach (&filter_list_copy,
-		      (DBusForeachFunction)_dbus_message_filter_ref,
-		      NULL);
+      _dbus_list_foreach (&filter_list_copy,
+                          (DBusForeachFunction)_dbus_message_filter_ref,
+                          NULL);
 
-  /* We're still protected from dispatch() reentrancy here
-   * since we acquired the dispatcher
-   */
-  CONNECTION_UNLOCK (connection);
-  
-  link = _dbus_list_get_first_link (&filter_list_copy);
-  while (link != NULL)
-    {
-      DBusMessageFilter *filter = link->data;
-      DBusList *next = _dbus_list_get_next_link (&filter_list_copy, link);
+      /* We're still protected from dispatch() reentrancy here
+       * since we acquired the dispatcher
+       */
+      CONNECTION_UNLOCK (connection);
 
-      if (filter->function == NULL)
+      link = _dbus_list_get_first_link (&filter_list_copy);
+      while (link != NULL)
         {
-          _dbus_verbose ("  filter was removed in a callback function\n");
+          DBusMessageFilter *filter = link->data;
+          DBusList *next = _dbus_list_get_next_link (&filter_list_copy, link);
+
+          if (filter->function == NULL)
+            {
+              _dbus_verbose ("  filter was removed in a callback function\n");
+              link = next;
+              continue;
+            }
+
+          _dbus_verbose ("  running filter on message %p\n", message);
+          result = (* filter->function) (connection, message, filter->user_data);
+
+          if (result != DBUS_HANDLER_RESULT_NOT_YET_HANDLED)
+            break;
+
           link = next;
-          continue;
         }
 
-      _dbus_verbose ("  running filter on message %p\n", message);
-      result = (* filter->function) (connection, message, filter->user_data);
+      _dbus_list_foreach (&filter_list_copy,
+                          (DBusForeachFunction)_dbus_message_filter_unref,
+                          NULL);
+      _dbus_list_clear (&filter_list_copy);
 
-      if (result != DBUS_HANDLER_RESULT_NOT_YET_HANDLED)
-	break;
+      CONNECTION_LOCK (connection);
 
-      link = next;
+      if (result == DBUS_HANDLER_RESULT_NEED_MEMORY)
+        {
+          _dbus_verbose ("No memory\n");
+          goto out;
+        }
+      else if (result == DBUS_HANDLER_RESULT_HANDLED)
+        {
+          _dbus_verbose ("filter handled message in dispatch\n");
+          goto out;
+        }
     }
 
-  _dbus_list_foreach (&filter_list_copy,
-		      (DBusForeachFunction)_dbus_message_filter_unref,
-		      NULL);
-  _dbus_list_clear (&filter_list_copy);
-  
-  CONNECTION_LOCK (connection);
-
-  if (result == DBUS_HANDLER_RESULT_NEED_MEMORY)
-    {
-      _dbus_verbose ("No memory\n");
-      goto out;
-    }
-  else if (result == DBUS_HANDLER_RESULT_HANDLED)
+  /* With dispatch queues, method calls and signals for objects are run
+   * through the object tree by a worker. Messages about the connection
+   * itself are still dispatched here, and disconnecting stops the
+   * queues, so that workers return once they have dealt with the rest.
+   */
+  if (connection->dispatch_queues != NULL &&
+      (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_METHOD_CALL ||
+       dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_SIGNAL))
     {
-      _dbus_verbose ("filter handled message in dispatch\n");
-      goto out;
+      if (dbus_message_has_path (message, DBUS_PATH_LOCAL))
+        {
+          if (dbus_message_is_signal (message, DBUS_INTERFACE_LOCAL,
+                                      "Disconnected"))
+            _dbus_dispatch_queues_set_stopped (connection->dispatch_queues,
+                                               TRUE);
+        }
+      else if (_dbus_dispatch_queues_push (connection->dispatch_queues,
+                                           message_link))
+        {
+          _dbus_verbose ("  queued message %p for a dispatch worker\n",
+                         message);
+          /* the queue owns both now */
+          message_link = NULL;
+          message = NULL;
+          result = DBUS_HANDLER_RESULT_HANDLED;
+          goto out;
+        }
     }
 
   /* We're still protected from dispatch() reentrancy here
@@ -4755,74 +5979,11 @@ dbus_connection_dispatch (DBusConnection *connection)
 
   if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_METHOD_CALL)
     {
-      DBusMessage *reply;
-      DBusString str;
-      DBusPreallocatedSend *preallocated;
-      DBusList *expire_link;
-
-      _dbus_verbose ("  sending error %s\n",
-                     DBUS_ERROR_UNKNOWN_METHOD);
-
-      if (!_dbus_string_init (&str))
-        {
-          result = DBUS_HANDLER_RESULT_NEED_MEMORY;
-          _dbus_verbose ("no memory for error string in dispatch\n");
-          goto out;
-        }
-              
-      if (!_dbus_string_append_printf (&str,
-                                       "Method \"%s\" with signature \"%s\" on interface \"%s\" doesn't exist\n",
-                                       dbus_message_get_member (message),
-                                       dbus_message_get_signature (message),
-                                       dbus_message_get_interface (message)))
-        {
-          _dbus_string_free (&str);
-          result = DBUS_HANDLER_RESULT_NEED_MEMORY;
-          _dbus_verbose ("no memory for error string in dispatch\n");
-          goto out;
-        }
-      
-      reply = dbus_message_new_error (message,
-                                      found_object ? DBUS_ERROR_UNKNOWN_METHOD : DBUS_ERROR_UNKNOWN_OBJECT,
-                                      _dbus_string_get_const_data (&str));
-      _dbus_string_free (&str);
-
-      if (reply == NULL)
-        {
-          result = DBUS_HANDLER_RESULT_NEED_MEMORY;
-          _dbus_verbose ("no memory for error reply in dispatch\n");
-          goto out;
-        }
-
-      expire_link = _dbus_list_alloc_link (reply);
-
-      if (expire_link == NULL)
-        {
-          dbus_message_unref (reply);
-          result = DBUS_HANDLER_RESULT_NEED_MEMORY;
-          _dbus_verbose ("no memory for error send in dispatch\n");
-          goto out;
-        }
-
-      preallocated = _dbus_connection_preallocate_send_unlocked (connection);
-
-      if (preallocated == NULL)
-        {
-          _dbus_list_free_link (expire_link);
-          /* It's OK that this is finalized, because it hasn't been seen by
-           * anything that could attach user callbacks */
-          dbus_message_unref (reply);
-          result = DBUS_HANDLER_RESULT_NEED_MEMORY;
-          _dbus_verbose ("no memory for error send in dispatch\n");
-          goto out;
-        }
-
-      _dbus_connection_send_preallocated_unlocked_no_update (connection, preallocated,
-                                                             reply, NULL);
-      /* reply will be freed when we release the lock */
-      _dbus_list_prepend_link (&connection->expired_messages, expire_link);
+      result = reply_unknown_method_unlocked (connection, message,
+                                              found_object);
 
-      result = DBUS_HANDLER_RESULT_HANDLED;
+      if (result == DBUS_HANDLER_RESULT_NEED_MEMORY)
+        goto out;
     }
   
   _dbus_verbose ("  done dispatching %p (%s %s %s '%s') on connection %p\n", message,
@@ -4856,9 +6017,6 @@ dbus_connection_dispatch (DBusConnection *connection)
       _dbus_verbose (" ... done dispatching\n");
     }
 
-  _dbus_connection_release_dispatch (connection);
-  HAVE_LOCK_CHECK (connection);
-
   if (message != NULL)
     {
       /* We don't want this message to count in maximum message limits when
@@ -4874,1506 +6032,2943 @@ dbus_connection_dispatch (DBusConnection *connection)
     }
 
   if (message_link != NULL)
-    _dbus_list_free_link (message_link);
-
-  _dbus_verbose ("before final status update\n");
-  status = _dbus_connection_get_dispatch_status_unlocked (connection);
+    _dbus_connection_free_link_unlocked (connection, message_link);
 
-  /* unlocks and calls user code */
-  _dbus_connection_update_dispatch_status_and_unlock (connection, status);
-  
-  dbus_connection_unref (connection);
-  
-  return status;
+  return result;
 }
 
 /**
- * Sets the watch functions for the connection. These functions are
- * responsible for making the application's main loop aware of file
- * descriptors that need to be monitored for events, using select() or
- * poll(). When using Qt, typically the DBusAddWatchFunction would
- * create a QSocketNotifier. When using GLib, the DBusAddWatchFunction
- * could call g_io_add_watch(), or could be used as part of a more
- * elaborate GSource. Note that when a watch is added, it may
- * not be enabled.
+ * Processes any incoming data.
  *
- * The DBusWatchToggledFunction notifies the application that the
- * watch has been enabled or disabled. Call dbus_watch_get_enabled()
- * to check this. A disabled watch should have no effect, and enabled
- * watch should be added to the main loop. This feature is used
- * instead of simply adding/removing the watch because
- * enabling/disabling can be done without memory allocation.  The
- * toggled function may be NULL if a main loop re-queries
- * dbus_watch_get_enabled() every time anyway.
- * 
- * The DBusWatch can be queried for the file descriptor to watch using
- * dbus_watch_get_unix_fd() or dbus_watch_get_socket(), and for the
- * events to watch for using dbus_watch_get_flags(). The flags
+ * If there's incoming raw data that has not yet been parsed, it is
+ * parsed, which may or may not result in adding messages to the
+ * incoming queue.
+ *
+ * The incoming data buffer is filled when the connection reads from
+ * its underlying transport (such as a socket).  Reading usually
+ * happens in dbus_watch_handle() or dbus_connection_read_write().
+ * 
+ * If there are complete messages in the incoming queue,
+ * dbus_connection_dispatch() removes one message from the queue and
+ * processes it. Processing has three steps.
+ *
+ * First, any method replies are passed to #DBusPendingCall or
+ * dbus_connection_send_with_reply_and_block() in order to
+ * complete the pending method call.
+ * 
+ * Second, any filters registered with dbus_connection_add_filter()
+ * are run. If any filter returns #DBUS_HANDLER_RESULT_HANDLED
+ * then processing stops after that filter.
+ *
+ * Third, if the message is a method call it is forwarded to
+ * any registered object path handlers added with
+ * dbus_connection_register_object_path() or
+ * dbus_connection_register_fallback(). If
+ * dbus_connection_set_dispatch_queues() has been called, method calls
+ * and signals are queued for dbus_connection_dispatch_worker() to do
+ * that instead.
+ *
+ * A single call to dbus_connection_dispatch() will process at most
+ * one message; it will not clear the entire message queue. Use
+ * dbus_connection_dispatch_batch() to process several at once.
+ *
+ * Be careful about calling dbus_connection_dispatch() from inside a
+ * message handler, i.e. calling dbus_connection_dispatch()
+ * recursively.  If threads have been initialized with a recursive
+ * mutex function, then this will not deadlock; however, it can
+ * certainly confuse your application.
+ * 
+ * @todo some FIXME in here about handling DBUS_HANDLER_RESULT_NEED_MEMORY
+ * 
+ * @param connection the connection
+ * @returns dispatch status, see dbus_connection_get_dispatch_status()
+ */
+DBusDispatchStatus
+dbus_connection_dispatch (DBusConnection *connection)
+{
+  DBusList *message_link;
+  DBusHandlerResult result;
+  DBusDispatchStatus status;
+
+  _dbus_return_val_if_fail (connection != NULL, DBUS_DISPATCH_COMPLETE);
+
+  _dbus_verbose ("\n");
+  
+  CONNECTION_LOCK (connection);
+  status = _dbus_connection_get_dispatch_status_unlocked (connection);
+  if (status != DBUS_DISPATCH_DATA_REMAINS)
+    {
+      /* unlocks and calls out to user code */
+      _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+      return status;
+    }
+  
+  /* We need to ref the connection since the callback could potentially
+   * drop the last ref to it
+   */
+  _dbus_connection_ref_unlocked (connection);
+
+  _dbus_connection_acquire_dispatch (connection);
+  HAVE_LOCK_CHECK (connection);
+
+  message_link = _dbus_connection_pop_message_link_unlocked (connection);
+  if (message_link == NULL)
+    {
+      /* another thread dispatched our stuff */
+
+      _dbus_verbose ("another thread dispatched message (during acquire_dispatch above)\n");
+      
+      _dbus_connection_release_dispatch (connection);
+
+      status = _dbus_connection_get_dispatch_status_unlocked (connection);
+
+      _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+      
+      dbus_connection_unref (connection);
+      
+      return status;
+    }
+
+  result = _dbus_connection_dispatch_link_unlocked (connection, message_link);
+
+  _dbus_connection_release_dispatch (connection);
+  HAVE_LOCK_CHECK (connection);
+
+  _dbus_verbose ("before final status update\n");
+
+  /* The message was put back, but report why it wasn't dispatched */
+  if (result == DBUS_HANDLER_RESULT_NEED_MEMORY)
+    status = DBUS_DISPATCH_NEED_MEMORY;
+  else
+    status = _dbus_connection_get_dispatch_status_unlocked (connection);
+
+  /* unlocks and calls user code */
+  _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+  
+  dbus_connection_unref (connection);
+  
+  return status;
+}
+
+/* Dispatches up to max_messages messages; if bytes_left is not NULL,
+ * also stops once it is no longer positive, taking off the size of
+ * each message dispatched */
+static DBusDispatchStatus
+dispatch_batch (DBusConnection *connection,
+                int             max_messages,
+                long           *bytes_left)
+{
+  DBusList *message_link;
+  DBusHandlerResult result;
+  DBusDispatchStatus status;
+  int n_dispatched;
+  int size;
+
+  _dbus_verbose ("max %d messages\n", max_messages);
+
+  CONNECTION_LOCK (connection);
+  status = _dbus_connection_get_dispatch_status_unlocked (connection);
+  if (status != DBUS_DISPATCH_DATA_REMAINS)
+    {
+      /* unlocks and calls out to user code */
+      _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+      return status;
+    }
+
+  /* We need to ref the connection since the callback could potentially
+   * drop the last ref to it
+   */
+  _dbus_connection_ref_unlocked (connection);
+
+  _dbus_connection_acquire_dispatch (connection);
+  HAVE_LOCK_CHECK (connection);
+
+  result = DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  n_dispatched = 0;
+  while (n_dispatched < max_messages &&
+         (bytes_left == NULL || *bytes_left > 0))
+    {
+      message_link = _dbus_connection_pop_message_link_unlocked (connection);
+
+      if (message_link == NULL)
+        {
+          /* Either another thread dispatched our stuff while we were
+           * acquiring the dispatcher, or we've emptied the queue; in
+           * both cases parse whatever the transport has buffered */
+          if (_dbus_connection_get_dispatch_status_unlocked (connection) !=
+              DBUS_DISPATCH_DATA_REMAINS)
+            break;
+
+          continue;
+        }
+
+      /* the handler may change the message, e.g. by setting the sender */
+      size = _dbus_message_get_size (message_link->data);
+
+      result = _dbus_connection_dispatch_link_unlocked (connection,
+                                                        message_link);
+
+      if (result == DBUS_HANDLER_RESULT_NEED_MEMORY)
+        break;
+
+      n_dispatched += 1;
+
+      if (bytes_left != NULL)
+        *bytes_left -= size;
+    }
+
+  _dbus_verbose ("dispatched %d messages\n", n_dispatched);
+
+  _dbus_connection_release_dispatch (connection);
+  HAVE_LOCK_CHECK (connection);
+
+  if (result == DBUS_HANDLER_RESULT_NEED_MEMORY)
+    status = DBUS_DISPATCH_NEED_MEMORY;
+  else
+    status = _dbus_connection_get_dispatch_status_unlocked (connection);
+
+  /* unlocks and calls user code */
+  _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+
+  dbus_connection_unref (connection);
+
+  return status;
+}
+
+/**
+ * Like dbus_connection_dispatch(), but processes up to max_messages
+ * messages from the incoming queue, parsing more buffered data as
+ * needed. The dispatcher is only acquired once for the whole batch,
+ * and the dispatch status function is only notified once at the end,
+ * so draining a long queue costs less locking than calling
+ * dbus_connection_dispatch() for each message.
+ *
+ * The batch stops early when the queue runs dry, or if handling a
+ * message runs out of memory; in that case the message is put back to
+ * be dispatched again by the next call, and #DBUS_DISPATCH_NEED_MEMORY
+ * is returned.
+ *
+ * The same caveats as for dbus_connection_dispatch() apply to calling
+ * this function recursively from a message handler.
+ *
+ * @param connection the connection
+ * @param max_messages maximum number of messages to dispatch, at least 1
+ * @returns dispatch status, see dbus_connection_get_dispatch_status()
+ */
+DBusDispatchStatus
+dbus_connection_dispatch_batch (DBusConnection *connection,
+                                int             max_messages)
+{
+  _dbus_return_val_if_fail (connection != NULL, DBUS_DISPATCH_COMPLETE);
+  _dbus_return_val_if_fail (max_messages > 0, DBUS_DISPATCH_COMPLETE);
+
+  return dispatch_batch (connection, max_messages, NULL);
+}
+
+/**
+ * Has method calls and signals for objects run through the object
+ * path handlers by worker threads, rather than by
+ * dbus_connection_dispatch(), so that handlers for different objects
+ * can run at the same time. Use this with handlers that are safe to
+ * call from any thread, on a connection that threads have been
+ * initialized for.
+ *
+ * dbus_connection_dispatch() still completes pending calls, runs the
+ * filters and handles messages about the connection itself. Method
+ * calls and signals that it would have passed on to the object tree go
+ * to one of @p n_queues queues instead, chosen by their object path.
+ * The application runs as many worker threads as it likes, each
+ * calling dbus_connection_dispatch_worker() in a loop. Only one worker
+ * at a time takes messages from each queue, so messages for the same
+ * object path are handled one after the other, in the order they
+ * arrived; with many more queues than workers, objects seldom have to
+ * wait for another one that happens to share their queue.
+ *
+ * Calling this with @p n_queues 0 stops the queues: no more messages
+ * go to them, and workers return #FALSE once the queues are empty.
+ * The queues are also stopped when the connection is disconnected.
+ * They can be started again with the same number of queues, which
+ * can't be changed once it has been set.
+ *
+ * @param connection the connection
+ * @param n_queues how many queues to share object paths between, or 0
+ * @returns #FALSE if there is not enough memory
+ */
+dbus_bool_t
+dbus_connection_set_dispatch_queues (DBusConnection *connection,
+                                     int             n_queues)
+{
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (n_queues >= 0, FALSE);
+
+  CONNECTION_LOCK (connection);
+
+#ifndef DBUS_DISABLE_CHECKS
+  if (connection->dispatch_queues != NULL && n_queues > 0 &&
+      n_queues != _dbus_dispatch_queues_get_size (connection->dispatch_queues))
+    {
+      CONNECTION_UNLOCK (connection);
+
+      _dbus_warn_check_failed ("Attempt to change the number of dispatch queues from %d to %d\n",
+                               _dbus_dispatch_queues_get_size (connection->dispatch_queues),
+                               n_queues);
+      return FALSE;
+    }
+#endif
+
+  if (n_queues > 0 && connection->dispatch_queues == NULL)
+    {
+      connection->dispatch_queues = _dbus_dispatch_queues_new (n_queues);
+
+      if (connection->dispatch_queues == NULL)
+        {
+          CONNECTION_UNLOCK (connection);
+          return FALSE;
+        }
+    }
+  else if (connection->dispatch_queues != NULL)
+    {
+      _dbus_dispatch_queues_set_stopped (connection->dispatch_queues,
+                                         n_queues == 0);
+    }
+
+  CONNECTION_UNLOCK (connection);
+  return TRUE;
+}
+
+/**
+ * Waits until a message is waiting on one of the queues set up with
+ * dbus_connection_set_dispatch_queues(), and runs it through the
+ * object path handlers, replying with an error to a method call that
+ * none of them handles. This is meant to be called in a loop by each
+ * worker thread:
+ *
+ * @code
+ * while (dbus_connection_dispatch_worker (connection, -1))
+ *   ;
+ * @endcode
+ *
+ * If a handler returns #DBUS_HANDLER_RESULT_NEED_MEMORY, the message
+ * is put back at the head of its queue to be handled again, so as with
+ * dbus_connection_dispatch(), handlers have to be idempotent if they
+ * don't return #DBUS_HANDLER_RESULT_HANDLED.
+ *
+ * @param connection the connection
+ * @param timeout_milliseconds how long to wait for a message, or -1
+ *  to wait until there is one or the queues are stopped
+ * @returns #FALSE if the queues have been stopped (or were never set
+ *  up) and nothing is left in them, #TRUE otherwise, even if no
+ *  message came within the timeout
+ */
+dbus_bool_t
+dbus_connection_dispatch_worker (DBusConnection *connection,
+                                 int             timeout_milliseconds)
+{
+  DBusDispatchQueues *queues;
+  DBusList *message_link;
+  DBusMessage *message;
+  DBusHandlerResult result;
+  dbus_bool_t found_object;
+  dbus_bool_t stopped;
+  int queue;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+
+  CONNECTION_LOCK (connection);
+  queues = connection->dispatch_queues;
+
+  if (queues == NULL)
+    {
+      CONNECTION_UNLOCK (connection);
+      return FALSE;
+    }
+
+  /* the queues last as long as the connection */
+  _dbus_connection_ref_unlocked (connection);
+  CONNECTION_UNLOCK (connection);
+
+  message_link = _dbus_dispatch_queues_pop (queues, timeout_milliseconds,
+                                            &queue, &stopped);
+
+  if (message_link == NULL)
+    {
+      dbus_connection_unref (connection);
+      return !stopped;
+    }
+
+  message = message_link->data;
+
+  _dbus_verbose ("  worker running object path dispatch on message %p (%s %s '%s')\n",
+                 message,
+                 dbus_message_type_to_string (dbus_message_get_type (message)),
+                 dbus_message_get_path (message),
+                 dbus_message_get_member (message) ?
+                 dbus_message_get_member (message) :
+                 "no member");
+
+  CONNECTION_LOCK (connection);
+  result = _dbus_object_tree_dispatch_and_unlock (connection->objects,
+                                                  message,
+                                                  &found_object);
+  CONNECTION_LOCK (connection);
+
+  if (result == DBUS_HANDLER_RESULT_NOT_YET_HANDLED &&
+      dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_METHOD_CALL)
+    result = reply_unknown_method_unlocked (connection, message,
+                                            found_object);
+
+  if (result == DBUS_HANDLER_RESULT_NEED_MEMORY)
+    {
+      CONNECTION_UNLOCK (connection);
+      _dbus_dispatch_queues_putback (queues, queue, message_link);
+    }
+  else
+    {
+      _dbus_connection_free_link_unlocked (connection, message_link);
+      CONNECTION_UNLOCK (connection);
+
+      /* finalizing a message can call out, so not under the lock */
+      dbus_message_unref (message);
+      _dbus_dispatch_queues_done (queues, queue);
+    }
+
+  dbus_connection_unref (connection);
+  return TRUE;
+}
+
+/**
+ * Dispatches one round of a deficit round-robin between connections:
+ * up to @p max_messages messages, stopping after the one that takes
+ * the total past @p quantum bytes. The bytes by which a round
+ * overshoots its quantum are taken off the next ones, so a peer that
+ * sends large messages gets no more than one quantum per round on
+ * average; while it is still paying off a large message, its rounds
+ * dispatch nothing.
+ *
+ * @param connection the connection
+ * @param max_messages maximum number of messages to dispatch, at least 1
+ * @param quantum bytes of messages this connection may have per round
+ * @returns dispatch status, see dbus_connection_get_dispatch_status()
+ */
+DBusDispatchStatus
+_dbus_connection_dispatch_quantum (DBusConnection *connection,
+                                   int             max_messages,
+                                   long            quantum)
+{
+  DBusDispatchStatus status;
+  long bytes_left;
+
+  _dbus_assert (max_messages > 0);
+  _dbus_assert (quantum > 0);
+
+  /* Only the main loop that dispatches this connection uses the
+   * deficit, so it needs no lock */
+  if (connection->dispatch_deficit >= quantum)
+    {
+      connection->dispatch_deficit -= quantum;
+      return dbus_connection_get_dispatch_status (connection);
+    }
+
+  bytes_left = quantum - connection->dispatch_deficit;
+  status = dispatch_batch (connection, max_messages, &bytes_left);
+
+  if (bytes_left < 0)
+    connection->dispatch_deficit = -bytes_left;
+  else
+    connection->dispatch_deficit = 0;
+
+  return status;
+}
+
+/**
+ * Sets the watch functions for the connection. These functions are
+ * responsible for making the application's main loop aware of file
+ * descriptors that need to be monitored for events, using select() or
+ * poll(). When using Qt, typically the DBusAddWatchFunction would
+ * create a QSocketNotifier. When using GLib, the DBusAddWatchFunction
+ * could call g_io_add_watch(), or could be used as part of a more
+ * elaborate GSource. Note that when a watch is added, it may
+ * not be enabled.
+ *
+ * The DBusWatchToggledFunction notifies the application that the
+ * watch has been enabled or disabled. Call dbus_watch_get_enabled()
+ * to check this. A disabled watch should have no effect, and enabled
+ * watch should be added to the main loop. This feature is used
+ * instead of simply adding/removing the watch because
+ * enabling/disabling can be done without memory allocation.  The
+ * toggled function may be NULL if a main loop re-queries
+ * dbus_watch_get_enabled() every time anyway.
+ * 
+ * The DBusWatch can be queried for the file descriptor to watch using
+ * dbus_watch_get_unix_fd() or dbus_watch_get_socket(), and for the
+ * events to watch for using dbus_watch_get_flags(). The flags
  * returned by dbus_watch_get_flags() will only contain
  * DBUS_WATCH_READABLE and DBUS_WATCH_WRITABLE, never
  * DBUS_WATCH_HANGUP or DBUS_WATCH_ERROR; all watches implicitly
  * include a watch for hangups, errors, and other exceptional
  * conditions.
  *
- * Once a file descriptor becomes readable or writable, or an exception
- * occurs, dbus_watch_handle() should be called to
- * notify the connection of the file descriptor's condition.
+ * Once a file descriptor becomes readable or writable, or an exception
+ * occurs, dbus_watch_handle() should be called to
+ * notify the connection of the file descriptor's condition.
+ *
+ * dbus_watch_handle() cannot be called during the
+ * DBusAddWatchFunction, as the connection will not be ready to handle
+ * that watch yet.
+ * 
+ * It is not allowed to reference a DBusWatch after it has been passed
+ * to remove_function.
+ *
+ * If #FALSE is returned due to lack of memory, the failure may be due
+ * to a #FALSE return from the new add_function. If so, the
+ * add_function may have been called successfully one or more times,
+ * but the remove_function will also have been called to remove any
+ * successful adds. i.e. if #FALSE is returned the net result
+ * should be that dbus_connection_set_watch_functions() has no effect,
+ * but the add_function and remove_function may have been called.
+ *
+ * @note The thread lock on DBusConnection is held while
+ * watch functions are invoked, so inside these functions you
+ * may not invoke any methods on DBusConnection or it will deadlock.
+ * See the comments in the code or http://lists.freedesktop.org/archives/dbus/2007-July/tread.html#8144
+ * if you encounter this issue and want to attempt writing a patch.
+ * 
+ * @param connection the connection.
+ * @param add_function function to begin monitoring a new descriptor.
+ * @param remove_function function to stop monitoring a descriptor.
+ * @param toggled_function function to notify of enable/disable
+ * @param data data to pass to add_function and remove_function.
+ * @param free_data_function function to be called to free the data.
+ * @returns #FALSE on failure (no memory)
+ */
+dbus_bool_t
+dbus_connection_set_watch_functions (DBusConnection              *connection,
+                                     DBusAddWatchFunction         add_function,
+                                     DBusRemoveWatchFunction      remove_function,
+                                     DBusWatchToggledFunction     toggled_function,
+                                     void                        *data,
+                                     DBusFreeFunction             free_data_function)
+{
+  dbus_bool_t retval;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  
+  CONNECTION_LOCK (connection);
+
+  retval = _dbus_watch_list_set_functions (connection->watches,
+                                           add_function, remove_function,
+                                           toggled_function,
+                                           data, free_data_function);
+
+  CONNECTION_UNLOCK (connection);
+
+  return retval;
+}
+
+/**
+ * Sets the timeout functions for the connection. These functions are
+ * responsible for making the application's main loop aware of timeouts.
+ * When using Qt, typically the DBusAddTimeoutFunction would create a
+ * QTimer. When using GLib, the DBusAddTimeoutFunction would call
+ * g_timeout_add.
+ * 
+ * The DBusTimeoutToggledFunction notifies the application that the
+ * timeout has been enabled or disabled. Call
+ * dbus_timeout_get_enabled() to check this. A disabled timeout should
+ * have no effect, and enabled timeout should be added to the main
+ * loop. This feature is used instead of simply adding/removing the
+ * timeout because enabling/disabling can be done without memory
+ * allocation. With Qt, QTimer::start() and QTimer::stop() can be used
+ * to enable and disable. The toggled function may be NULL if a main
+ * loop re-queries dbus_timeout_get_enabled() every time anyway.
+ * Whenever a timeout is toggled, its interval may change.
+ *
+ * The DBusTimeout can be queried for the timer interval using
+ * dbus_timeout_get_interval(). dbus_timeout_handle() should be called
+ * repeatedly, each time the interval elapses, starting after it has
+ * elapsed once. The timeout stops firing when it is removed with the
+ * given remove_function.  The timer interval may change whenever the
+ * timeout is added, removed, or toggled.
+ *
+ * @note The thread lock on DBusConnection is held while
+ * timeout functions are invoked, so inside these functions you
+ * may not invoke any methods on DBusConnection or it will deadlock.
+ * See the comments in the code or http://lists.freedesktop.org/archives/dbus/2007-July/thread.html#8144
+ * if you encounter this issue and want to attempt writing a patch.
+ *
+ * @param connection the connection.
+ * @param add_function function to add a timeout.
+ * @param remove_function function to remove a timeout.
+ * @param toggled_function function to notify of enable/disable
+ * @param data data to pass to add_function and remove_function.
+ * @param free_data_function function to be called to free the data.
+ * @returns #FALSE on failure (no memory)
+ */
+dbus_bool_t
+dbus_connection_set_timeout_functions   (DBusConnection            *connection,
+					 DBusAddTimeoutFunction     add_function,
+					 DBusRemoveTimeoutFunction  remove_function,
+                                         DBusTimeoutToggledFunction toggled_function,
+					 void                      *data,
+					 DBusFreeFunction           free_data_function)
+{
+  dbus_bool_t retval;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  
+  CONNECTION_LOCK (connection);
+
+  retval = _dbus_timeout_list_set_functions (connection->timeouts,
+                                             add_function, remove_function,
+                                             toggled_function,
+                                             data, free_data_function);
+
+  CONNECTION_UNLOCK (connection);
+
+  return retval;
+}
+
+/**
+ * Sets the mainloop wakeup function for the connection. This function
+ * is responsible for waking up the main loop (if its sleeping in
+ * another thread) when some some change has happened to the
+ * connection that the mainloop needs to reconsider (e.g. a message
+ * has been queued for writing).  When using Qt, this typically
+ * results in a call to QEventLoop::wakeUp().  When using GLib, it
+ * would call g_main_context_wakeup().
+ *
+ * @param connection the connection.
+ * @param wakeup_main_function function to wake up the mainloop
+ * @param data data to pass wakeup_main_function
+ * @param free_data_function function to be called to free the data.
+ */
+void
+dbus_connection_set_wakeup_main_function (DBusConnection            *connection,
+					  DBusWakeupMainFunction     wakeup_main_function,
+					  void                      *data,
+					  DBusFreeFunction           free_data_function)
+{
+  void *old_data;
+  DBusFreeFunction old_free_data;
+
+  _dbus_return_if_fail (connection != NULL);
+  
+  CONNECTION_LOCK (connection);
+  old_data = connection->wakeup_main_data;
+  old_free_data = connection->free_wakeup_main_data;
+
+  connection->wakeup_main_function = wakeup_main_function;
+  connection->wakeup_main_data = data;
+  connection->free_wakeup_main_data = free_data_function;
+  
+  CONNECTION_UNLOCK (connection);
+
+  /* Callback outside the lock */
+  if (old_free_data)
+    (*old_free_data) (old_data);
+}
+
+/**
+ * Set a function to be invoked when the dispatch status changes.
+ * If the dispatch status is #DBUS_DISPATCH_DATA_REMAINS, then
+ * dbus_connection_dispatch() needs to be called to process incoming
+ * messages. However, dbus_connection_dispatch() MUST NOT BE CALLED
+ * from inside the DBusDispatchStatusFunction. Indeed, almost
+ * any reentrancy in this function is a bad idea. Instead,
+ * the DBusDispatchStatusFunction should simply save an indication
+ * that messages should be dispatched later, when the main loop
+ * is re-entered.
+ *
+ * If you don't set a dispatch status function, you have to be sure to
+ * dispatch on every iteration of your main loop, especially if
+ * dbus_watch_handle() or dbus_timeout_handle() were called.
+ *
+ * @param connection the connection
+ * @param function function to call on dispatch status changes
+ * @param data data for function
+ * @param free_data_function free the function data
+ */
+void
+dbus_connection_set_dispatch_status_function (DBusConnection             *connection,
+                                              DBusDispatchStatusFunction  function,
+                                              void                       *data,
+                                              DBusFreeFunction            free_data_function)
+{
+  void *old_data;
+  DBusFreeFunction old_free_data;
+
+  _dbus_return_if_fail (connection != NULL);
+  
+  CONNECTION_LOCK (connection);
+  old_data = connection->dispatch_status_data;
+  old_free_data = connection->free_dispatch_status_data;
+
+  connection->dispatch_status_function = function;
+  connection->dispatch_status_data = data;
+  connection->free_dispatch_status_data = free_data_function;
+  
+  CONNECTION_UNLOCK (connection);
+
+  /* Callback outside the lock */
+  if (old_free_data)
+    (*old_free_data) (old_data);
+}
+
+/**
+ * Get the UNIX file descriptor of the connection, if any.  This can
+ * be used for SELinux access control checks with getpeercon() for
+ * example. DO NOT read or write to the file descriptor, or try to
+ * select() on it; use DBusWatch for main loop integration. Not all
+ * connections will have a file descriptor. So for adding descriptors
+ * to the main loop, use dbus_watch_get_unix_fd() and so forth.
+ *
+ * If the connection is socket-based, you can also use
+ * dbus_connection_get_socket(), which will work on Windows too.
+ * This function always fails on Windows.
+ *
+ * Right now the returned descriptor is always a socket, but
+ * that is not guaranteed.
+ * 
+ * @param connection the connection
+ * @param fd return location for the file descriptor.
+ * @returns #TRUE if fd is successfully obtained.
+ */
+dbus_bool_t
+dbus_connection_get_unix_fd (DBusConnection *connection,
+                             int            *fd)
+{
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (connection->transport != NULL, FALSE);
+
+#ifdef DBUS_WIN
+  /* FIXME do this on a lower level */
+  return FALSE;
+#endif
+  
+  return dbus_connection_get_socket(connection, fd);
+}
+
+/**
+ * Gets the underlying Windows or UNIX socket file descriptor
+ * of the connection, if any. DO NOT read or write to the file descriptor, or try to
+ * select() on it; use DBusWatch for main loop integration. Not all
+ * connections will have a socket. So for adding descriptors
+ * to the main loop, use dbus_watch_get_socket() and so forth.
+ *
+ * If the connection is not socket-based, this function will return FALSE,
+ * even if the connection does have a file descriptor of some kind.
+ * i.e. this function always returns specifically a socket file descriptor.
+ * 
+ * @param connection the connection
+ * @param fd return location for the file descriptor.
+ * @returns #TRUE if fd is successfully obtained.
+ */
+dbus_bool_t
+dbus_connection_get_socket(DBusConnection              *connection,
+                           int                         *fd)
+{
+  dbus_bool_t retval;
+  DBusSocket s = DBUS_SOCKET_INIT;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (connection->transport != NULL, FALSE);
+  
+  CONNECTION_LOCK (connection);
+  
+  retval = _dbus_transport_get_socket_fd (connection->transport, &s);
+
+  if (retval)
+    {
+      *fd = _dbus_socket_get_int (s);
+    }
+
+  CONNECTION_UNLOCK (connection);
+
+  return retval;
+}
+
+
+/**
+ * Gets the UNIX user ID of the connection if known.  Returns #TRUE if
+ * the uid is filled in.  Always returns #FALSE on non-UNIX platforms
+ * for now, though in theory someone could hook Windows to NIS or
+ * something.  Always returns #FALSE prior to authenticating the
+ * connection.
+ *
+ * The UID is only read by servers from clients; clients can't usually
+ * get the UID of servers, because servers do not authenticate to
+ * clients.  The returned UID is the UID the connection authenticated
+ * as.
+ *
+ * The message bus is a server and the apps connecting to the bus
+ * are clients.
+ *
+ * You can ask the bus to tell you the UID of another connection though
+ * if you like; this is done with dbus_bus_get_unix_user().
+ *
+ * @param connection the connection
+ * @param uid return location for the user ID
+ * @returns #TRUE if uid is filled in with a valid user ID
+ */
+dbus_bool_t
+dbus_connection_get_unix_user (DBusConnection *connection,
+                               unsigned long  *uid)
+{
+  dbus_bool_t result;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (uid != NULL, FALSE);
+
+  CONNECTION_LOCK (connection);
+
+  if (!_dbus_transport_try_to_authenticate (connection->transport))
+    result = FALSE;
+  else
+    result = _dbus_transport_get_unix_user (connection->transport,
+                                            uid);
+
+#ifdef DBUS_WIN
+  _dbus_assert (!result);
+#endif
+  
+  CONNECTION_UNLOCK (connection);
+
+  return result;
+}
+
+/**
+ * Gets the process ID of the connection if any.
+ * Returns #TRUE if the pid is filled in.
+ * Always returns #FALSE prior to authenticating the
+ * connection.
+ *
+ * @param connection the connection
+ * @param pid return location for the process ID
+ * @returns #TRUE if uid is filled in with a valid process ID
+ */
+dbus_bool_t
+dbus_connection_get_unix_process_id (DBusConnection *connection,
+				     unsigned long  *pid)
+{
+  dbus_bool_t result;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (pid != NULL, FALSE);
+
+  CONNECTION_LOCK (connection);
+
+  if (!_dbus_transport_try_to_authenticate (connection->transport))
+    result = FALSE;
+  else
+    result = _dbus_transport_get_unix_process_id (connection->transport,
+						  pid);
+
+  CONNECTION_UNLOCK (connection);
+
+  return result;
+}
+
+/**
+ * Gets the ADT audit data of the connection if any.
+ * Returns #TRUE if the structure pointer is returned.
+ * Always returns #FALSE prior to authenticating the
+ * connection.
+ *
+ * @param connection the connection
+ * @param data return location for audit data
+ * @param data_size return location for length of audit data
+ * @returns #TRUE if audit data is filled in with a valid ucred pointer
+ */
+dbus_bool_t
+dbus_connection_get_adt_audit_session_data (DBusConnection *connection,
+					    void          **data,
+					    dbus_int32_t   *data_size)
+{
+  dbus_bool_t result;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (data != NULL, FALSE);
+  _dbus_return_val_if_fail (data_size != NULL, FALSE);
+
+  CONNECTION_LOCK (connection);
+
+  if (!_dbus_transport_try_to_authenticate (connection->transport))
+    result = FALSE;
+  else
+    result = _dbus_transport_get_adt_audit_session_data (connection->transport,
+					    	         data,
+			  			         data_size);
+  CONNECTION_UNLOCK (connection);
+
+  return result;
+}
+
+/**
+ * Sets a predicate function used to determine whether a given user ID
+ * is allowed to connect. When an incoming connection has
+ * authenticated with a particular user ID, this function is called;
+ * if it returns #TRUE, the connection is allowed to proceed,
+ * otherwise the connection is disconnected.
+ *
+ * If the function is set to #NULL (as it is by default), then
+ * only the same UID as the server process will be allowed to
+ * connect. Also, root is always allowed to connect.
+ *
+ * On Windows, the function will be set and its free_data_function will
+ * be invoked when the connection is freed or a new function is set.
+ * However, the function will never be called, because there are
+ * no UNIX user ids to pass to it, or at least none of the existing
+ * auth protocols would allow authenticating as a UNIX user on Windows.
+ * 
+ * @param connection the connection
+ * @param function the predicate
+ * @param data data to pass to the predicate
+ * @param free_data_function function to free the data
+ */
+void
+dbus_connection_set_unix_user_function (DBusConnection             *connection,
+                                        DBusAllowUnixUserFunction   function,
+                                        void                       *data,
+                                        DBusFreeFunction            free_data_function)
+{
+  void *old_data = NULL;
+  DBusFreeFunction old_free_function = NULL;
+
+  _dbus_return_if_fail (connection != NULL);
+  
+  CONNECTION_LOCK (connection);
+  _dbus_transport_set_unix_user_function (connection->transport,
+                                          function, data, free_data_function,
+                                          &old_data, &old_free_function);
+  CONNECTION_UNLOCK (connection);
+
+  if (old_free_function != NULL)
+    (* old_free_function) (old_data);
+}
+
+/* Same calling convention as dbus_connection_get_windows_user */
+dbus_bool_t
+_dbus_connection_get_linux_security_label (DBusConnection  *connection,
+                                           char           **label_p)
+{
+  dbus_bool_t result;
+
+  _dbus_assert (connection != NULL);
+  _dbus_assert (label_p != NULL);
+
+  CONNECTION_LOCK (connection);
+
+  if (!_dbus_transport_try_to_authenticate (connection->transport))
+    result = FALSE;
+  else
+    result = _dbus_transport_get_linux_security_label (connection->transport,
+                                                       label_p);
+#ifndef __linux__
+  _dbus_assert (!result);
+#endif
+
+  CONNECTION_UNLOCK (connection);
+
+  return result;
+}
+
+/**
+ * Gets the Windows user SID of the connection if known.  Returns
+ * #TRUE if the ID is filled in.  Always returns #FALSE on non-Windows
+ * platforms for now, though in theory someone could hook UNIX to
+ * Active Directory or something.  Always returns #FALSE prior to
+ * authenticating the connection.
+ *
+ * The user is only read by servers from clients; clients can't usually
+ * get the user of servers, because servers do not authenticate to
+ * clients. The returned user is the user the connection authenticated
+ * as.
+ *
+ * The message bus is a server and the apps connecting to the bus
+ * are clients.
+ *
+ * The returned user string has to be freed with dbus_free().
+ *
+ * The return value indicates whether the user SID is available;
+ * if it's available but we don't have the memory to copy it,
+ * then the return value is #TRUE and #NULL is given as the SID.
+ * 
+ * @todo We would like to be able to say "You can ask the bus to tell
+ * you the user of another connection though if you like; this is done
+ * with dbus_bus_get_windows_user()." But this has to be implemented
+ * in bus/driver.c and dbus/dbus-bus.c, and is pointless anyway
+ * since on Windows we only use the session bus for now.
+ *
+ * @param connection the connection
+ * @param windows_sid_p return location for an allocated copy of the user ID, or #NULL if no memory
+ * @returns #TRUE if user is available (returned value may be #NULL anyway if no memory)
+ */
+dbus_bool_t
+dbus_connection_get_windows_user (DBusConnection             *connection,
+                                  char                      **windows_sid_p)
+{
+  dbus_bool_t result;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (windows_sid_p != NULL, FALSE);
+
+  CONNECTION_LOCK (connection);
+
+  if (!_dbus_transport_try_to_authenticate (connection->transport))
+    result = FALSE;
+  else
+    result = _dbus_transport_get_windows_user (connection->transport,
+                                               windows_sid_p);
+
+#ifdef DBUS_UNIX
+  _dbus_assert (!result);
+#endif
+  
+  CONNECTION_UNLOCK (connection);
+
+  return result;
+}
+
+/**
+ * Sets a predicate function used to determine whether a given user ID
+ * is allowed to connect. When an incoming connection has
+ * authenticated with a particular user ID, this function is called;
+ * if it returns #TRUE, the connection is allowed to proceed,
+ * otherwise the connection is disconnected.
+ *
+ * If the function is set to #NULL (as it is by default), then
+ * only the same user owning the server process will be allowed to
+ * connect.
+ *
+ * On UNIX, the function will be set and its free_data_function will
+ * be invoked when the connection is freed or a new function is set.
+ * However, the function will never be called, because there is no
+ * way right now to authenticate as a Windows user on UNIX.
+ * 
+ * @param connection the connection
+ * @param function the predicate
+ * @param data data to pass to the predicate
+ * @param free_data_function function to free the data
+ */
+void
+dbus_connection_set_windows_user_function (DBusConnection              *connection,
+                                           DBusAllowWindowsUserFunction function,
+                                           void                        *data,
+                                           DBusFreeFunction             free_data_function)
+{
+  void *old_data = NULL;
+  DBusFreeFunction old_free_function = NULL;
+
+  _dbus_return_if_fail (connection != NULL);
+  
+  CONNECTION_LOCK (connection);
+  _dbus_transport_set_windows_user_function (connection->transport,
+                                             function, data, free_data_function,
+                                             &old_data, &old_free_function);
+  CONNECTION_UNLOCK (connection);
+
+  if (old_free_function != NULL)
+    (* old_free_function) (old_data);
+}
+
+/**
+ * This function must be called on the server side of a connection when the
+ * connection is first seen in the #DBusNewConnectionFunction. If set to
+ * #TRUE (the default is #FALSE), then the connection can proceed even if
+ * the client does not authenticate as some user identity, i.e. clients
+ * can connect anonymously.
+ * 
+ * This setting interacts with the available authorization mechanisms
+ * (see dbus_server_set_auth_mechanisms()). Namely, an auth mechanism
+ * such as ANONYMOUS that supports anonymous auth must be included in
+ * the list of available mechanisms for anonymous login to work.
+ *
+ * This setting also changes the default rule for connections
+ * authorized as a user; normally, if a connection authorizes as
+ * a user identity, it is permitted if the user identity is
+ * root or the user identity matches the user identity of the server
+ * process. If anonymous connections are allowed, however,
+ * then any user identity is allowed.
  *
- * dbus_watch_handle() cannot be called during the
- * DBusAddWatchFunction, as the connection will not be ready to handle
- * that watch yet.
+ * You can override the rules for connections authorized as a
+ * user identity with dbus_connection_set_unix_user_function()
+ * and dbus_connection_set_windows_user_function().
  * 
- * It is not allowed to reference a DBusWatch after it has been passed
- * to remove_function.
+ * @param connection the connection
+ * @param value whether to allow authentication as an anonymous user
+ */
+void
+dbus_connection_set_allow_anonymous (DBusConnection             *connection,
+                                     dbus_bool_t                 value)
+{
+  _dbus_return_if_fail (connection != NULL);
+  
+  CONNECTION_LOCK (connection);
+  _dbus_transport_set_allow_anonymous (connection->transport, value);
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
  *
- * If #FALSE is returned due to lack of memory, the failure may be due
- * to a #FALSE return from the new add_function. If so, the
- * add_function may have been called successfully one or more times,
- * but the remove_function will also have been called to remove any
- * successful adds. i.e. if #FALSE is returned the net result
- * should be that dbus_connection_set_watch_functions() has no effect,
- * but the add_function and remove_function may have been called.
+ * Normally #DBusConnection automatically handles all messages to the
+ * org.freedesktop.DBus.Peer interface. However, the message bus wants
+ * to be able to route methods on that interface through the bus and
+ * to other applications. If routing peer messages is enabled, then
+ * messages with the org.freedesktop.DBus.Peer interface that also
+ * have a bus destination name set will not be automatically
+ * handled by the #DBusConnection and instead will be dispatched
+ * normally to the application.
  *
- * @note The thread lock on DBusConnection is held while
- * watch functions are invoked, so inside these functions you
- * may not invoke any methods on DBusConnection or it will deadlock.
- * See the comments in the code or http://lists.freedesktop.org/archives/dbus/2007-July/tread.html#8144
- * if you encounter this issue and want to attempt writing a patch.
- * 
- * @param connection the connection.
- * @param add_function function to begin monitoring a new descriptor.
- * @param remove_function function to stop monitoring a descriptor.
- * @param toggled_function function to notify of enable/disable
- * @param data data to pass to add_function and remove_function.
- * @param free_data_function function to be called to free the data.
- * @returns #FALSE on failure (no memory)
+ * If a normal application sets this flag, it can break things badly.
+ * So don't set this unless you are the message bus.
+ *
+ * @param connection the connection
+ * @param value #TRUE to pass through org.freedesktop.DBus.Peer messages with a bus name set
+ */
+void
+dbus_connection_set_route_peer_messages (DBusConnection             *connection,
+                                         dbus_bool_t                 value)
+{
+  _dbus_return_if_fail (connection != NULL);
+  
+  CONNECTION_LOCK (connection);
+  connection->route_peer_messages = value;
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
+ * Adds a message filter. Filters are handlers that are run on all
+ * incoming messages, prior to the objects registered with
+ * dbus_connection_register_object_path().  Filters are run in the
+ * order that they were added.  The same handler can be added as a
+ * filter more than once, in which case it will be run more than once.
+ * Filters added during a filter callback won't be run on the message
+ * being processed.
+ *
+ * @todo we don't run filters on messages while blocking without
+ * entering the main loop, since filters are run as part of
+ * dbus_connection_dispatch(). This is probably a feature, as filters
+ * could create arbitrary reentrancy. But kind of sucks if you're
+ * trying to filter METHOD_RETURN for some reason.
+ *
+ * @param connection the connection
+ * @param function function to handle messages
+ * @param user_data user data to pass to the function
+ * @param free_data_function function to use for freeing user data
+ * @returns #TRUE on success, #FALSE if not enough memory.
  */
 dbus_bool_t
-dbus_connection_set_watch_functions (DBusConnection              *connection,
-                                     DBusAddWatchFunction         add_function,
-                                     DBusRemoveWatchFunction      remove_function,
-                                     DBusWatchToggledFunction     toggled_function,
-                                     void                        *data,
-                                     DBusFreeFunction             free_data_function)
+dbus_connection_add_filter (DBusConnection            *connection,
+                            DBusHandleMessageFunction  function,
+                            void                      *user_data,
+                            DBusFreeFunction           free_data_function)
+{
+  DBusMessageFilter *filter;
+  
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (function != NULL, FALSE);
+
+  filter = dbus_new0 (DBusMessageFilter, 1);
+  if (filter == NULL)
+    return FALSE;
+
+  _dbus_atomic_inc (&filter->refcount);
+
+  CONNECTION_LOCK (connection);
+
+  if (!_dbus_list_append (&connection->filter_list,
+                          filter))
+    {
+      _dbus_message_filter_unref (filter);
+      CONNECTION_UNLOCK (connection);
+      return FALSE;
+    }
+
+  /* Fill in filter after all memory allocated,
+   * so we don't run the free_user_data_function
+   * if the add_filter() fails
+   */
+  
+  filter->function = function;
+  filter->user_data = user_data;
+  filter->free_user_data_function = free_data_function;
+        
+  CONNECTION_UNLOCK (connection);
+  return TRUE;
+}
+
+/**
+ * Removes a previously-added message filter. It is a programming
+ * error to call this function for a handler that has not been added
+ * as a filter. If the given handler was added more than once, only
+ * one instance of it will be removed (the most recently-added
+ * instance).
+ *
+ * @param connection the connection
+ * @param function the handler to remove
+ * @param user_data user data for the handler to remove
+ *
+ */
+void
+dbus_connection_remove_filter (DBusConnection            *connection,
+                               DBusHandleMessageFunction  function,
+                               void                      *user_data)
+{
+  DBusList *link;
+  DBusMessageFilter *filter;
+  
+  _dbus_return_if_fail (connection != NULL);
+  _dbus_return_if_fail (function != NULL);
+  
+  CONNECTION_LOCK (connection);
+
+  filter = NULL;
+  
+  link = _dbus_list_get_last_link (&connection->filter_list);
+  while (link != NULL)
+    {
+      filter = link->data;
+
+      if (filter->function == function &&
+          filter->user_data == user_data)
+        {
+          _dbus_list_remove_link (&connection->filter_list, link);
+          filter->function = NULL;
+          
+          break;
+        }
+        
+      link = _dbus_list_get_prev_link (&connection->filter_list, link);
+      filter = NULL;
+    }
+  
+  CONNECTION_UNLOCK (connection);
+
+#ifndef DBUS_DISABLE_CHECKS
+  if (filter == NULL)
+    {
+      _dbus_warn_check_failed ("Attempt to remove filter function %p user data %p, but no such filter has been added\n",
+                               function, user_data);
+      return;
+    }
+#endif
+  
+  /* Call application code */
+  if (filter->free_user_data_function)
+    (* filter->free_user_data_function) (filter->user_data);
+
+  filter->free_user_data_function = NULL;
+  filter->user_data = NULL;
+  
+  _dbus_message_filter_unref (filter);
+}
+
+/**
+ * Registers a handler for a given path or subsection in the object
+ * hierarchy. The given vtable handles messages sent to exactly the
+ * given path or also for paths bellow that, depending on fallback
+ * parameter.
+ *
+ * @param connection the connection
+ * @param fallback whether to handle messages also for "subdirectory"
+ * @param path a '/' delimited string of path elements
+ * @param vtable the virtual table
+ * @param user_data data to pass to functions in the vtable
+ * @param error address where an error can be returned
+ * @returns #FALSE if an error (#DBUS_ERROR_NO_MEMORY or
+ *    #DBUS_ERROR_OBJECT_PATH_IN_USE) is reported
+ */
+static dbus_bool_t
+_dbus_connection_register_object_path (DBusConnection              *connection,
+                                       dbus_bool_t                  fallback,
+                                       const char                  *path,
+                                       const DBusObjectPathVTable  *vtable,
+                                       void                        *user_data,
+                                       DBusError                   *error)
 {
+  char **decomposed_path;
   dbus_bool_t retval;
 
-  _dbus_return_val_if_fail (connection != NULL, FALSE);
-  
+  if (!_dbus_decompose_path (path, strlen (path), &decomposed_path, NULL))
+    return FALSE;
+
   CONNECTION_LOCK (connection);
 
-  retval = _dbus_watch_list_set_functions (connection->watches,
-                                           add_function, remove_function,
-                                           toggled_function,
-                                           data, free_data_function);
+  retval = _dbus_object_tree_register (connection->objects,
+                                       fallback,
+                                       (const char **) decomposed_path, vtable,
+                                       user_data, error);
 
   CONNECTION_UNLOCK (connection);
 
+  dbus_free_string_array (decomposed_path);
+
   return retval;
 }
 
 /**
- * Sets the timeout functions for the connection. These functions are
- * responsible for making the application's main loop aware of timeouts.
- * When using Qt, typically the DBusAddTimeoutFunction would create a
- * QTimer. When using GLib, the DBusAddTimeoutFunction would call
- * g_timeout_add.
- * 
- * The DBusTimeoutToggledFunction notifies the application that the
- * timeout has been enabled or disabled. Call
- * dbus_timeout_get_enabled() to check this. A disabled timeout should
- * have no effect, and enabled timeout should be added to the main
- * loop. This feature is used instead of simply adding/removing the
- * timeout because enabling/disabling can be done without memory
- * allocation. With Qt, QTimer::start() and QTimer::stop() can be used
- * to enable and disable. The toggled function may be NULL if a main
- * loop re-queries dbus_timeout_get_enabled() every time anyway.
- * Whenever a timeout is toggled, its interval may change.
+ * Registers a handler for a given path in the object hierarchy.
+ * The given vtable handles messages sent to exactly the given path.
  *
- * The DBusTimeout can be queried for the timer interval using
- * dbus_timeout_get_interval(). dbus_timeout_handle() should be called
- * repeatedly, each time the interval elapses, starting after it has
- * elapsed once. The timeout stops firing when it is removed with the
- * given remove_function.  The timer interval may change whenever the
- * timeout is added, removed, or toggled.
+ * @param connection the connection
+ * @param path a '/' delimited string of path elements
+ * @param vtable the virtual table
+ * @param user_data data to pass to functions in the vtable
+ * @param error address where an error can be returned
+ * @returns #FALSE if an error (#DBUS_ERROR_NO_MEMORY or
+ *    #DBUS_ERROR_OBJECT_PATH_IN_USE) is reported
+ */
+dbus_bool_t
+dbus_connection_try_register_object_path (DBusConnection              *connection,
+                                          const char                  *path,
+                                          const DBusObjectPathVTable  *vtable,
+                                          void                        *user_data,
+                                          DBusError                   *error)
+{
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (path != NULL, FALSE);
+  _dbus_return_val_if_fail (path[0] == '/', FALSE);
+  _dbus_return_val_if_fail (vtable != NULL, FALSE);
+
+  return _dbus_connection_register_object_path (connection, FALSE, path, vtable, user_data, error);
+}
+
+/**
+ * Registers a handler for a given path in the object hierarchy.
+ * The given vtable handles messages sent to exactly the given path.
  *
- * @note The thread lock on DBusConnection is held while
- * timeout functions are invoked, so inside these functions you
- * may not invoke any methods on DBusConnection or it will deadlock.
- * See the comments in the code or http://lists.freedesktop.org/archives/dbus/2007-July/thread.html#8144
- * if you encounter this issue and want to attempt writing a patch.
+ * It is a bug to call this function for object paths which already
+ * have a handler. Use dbus_connection_try_register_object_path() if this
+ * might be the case.
  *
- * @param connection the connection.
- * @param add_function function to add a timeout.
- * @param remove_function function to remove a timeout.
- * @param toggled_function function to notify of enable/disable
- * @param data data to pass to add_function and remove_function.
- * @param free_data_function function to be called to free the data.
- * @returns #FALSE on failure (no memory)
+ * @param connection the connection
+ * @param path a '/' delimited string of path elements
+ * @param vtable the virtual table
+ * @param user_data data to pass to functions in the vtable
+ * @returns #FALSE if an error (#DBUS_ERROR_NO_MEMORY or
+ *    #DBUS_ERROR_OBJECT_PATH_IN_USE) ocurred
  */
 dbus_bool_t
-dbus_connection_set_timeout_functions   (DBusConnection            *connection,
-					 DBusAddTimeoutFunction     add_function,
-					 DBusRemoveTimeoutFunction  remove_function,
-                                         DBusTimeoutToggledFunction toggled_function,
-					 void                      *data,
-					 DBusFreeFunction           free_data_function)
+dbus_connection_register_object_path (DBusConnection              *connection,
+                                      const char                  *path,
+                                      const DBusObjectPathVTable  *vtable,
+                                      void                        *user_data)
 {
   dbus_bool_t retval;
+  DBusError error = DBUS_ERROR_INIT;
 
   _dbus_return_val_if_fail (connection != NULL, FALSE);
-  
-  CONNECTION_LOCK (connection);
+  _dbus_return_val_if_fail (path != NULL, FALSE);
+  _dbus_return_val_if_fail (path[0] == '/', FALSE);
+  _dbus_return_val_if_fail (vtable != NULL, FALSE);
 
-  retval = _dbus_timeout_list_set_functions (connection->timeouts,
-                                             add_function, remove_function,
-                                             toggled_function,
-                                             data, free_data_function);
+  retval = _dbus_connection_register_object_path (connection, FALSE, path, vtable, user_data, &error);
 
-  CONNECTION_UNLOCK (connection);
+  if (dbus_error_has_name (&error, DBUS_ERROR_OBJECT_PATH_IN_USE))
+    {
+      _dbus_warn ("%s\n", error.message);
+      dbus_error_free (&error);
+      return FALSE;
+    }
 
   return retval;
 }
 
 /**
- * Sets the mainloop wakeup function for the connection. This function
- * is responsible for waking up the main loop (if its sleeping in
- * another thread) when some some change has happened to the
- * connection that the mainloop needs to reconsider (e.g. a message
- * has been queued for writing).  When using Qt, this typically
- * results in a call to QEventLoop::wakeUp().  When using GLib, it
- * would call g_main_context_wakeup().
+ * Registers a fallback handler for a given subsection of the object
+ * hierarchy.  The given vtable handles messages at or below the given
+ * path. You can use this to establish a default message handling
+ * policy for a whole "subdirectory."
  *
- * @param connection the connection.
- * @param wakeup_main_function function to wake up the mainloop
- * @param data data to pass wakeup_main_function
- * @param free_data_function function to be called to free the data.
+ * @param connection the connection
+ * @param path a '/' delimited string of path elements
+ * @param vtable the virtual table
+ * @param user_data data to pass to functions in the vtable
+ * @param error address where an error can be returned
+ * @returns #FALSE if an error (#DBUS_ERROR_NO_MEMORY or
+ *    #DBUS_ERROR_OBJECT_PATH_IN_USE) is reported
  */
-void
-dbus_connection_set_wakeup_main_function (DBusConnection            *connection,
-					  DBusWakeupMainFunction     wakeup_main_function,
-					  void                      *data,
-					  DBusFreeFunction           free_data_function)
+dbus_bool_t
+dbus_connection_try_register_fallback (DBusConnection              *connection,
+                                       const char                  *path,
+                                       const DBusObjectPathVTable  *vtable,
+                                       void                        *user_data,
+                                       DBusError                   *error)
 {
-  void *old_data;
-  DBusFreeFunction old_free_data;
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (path != NULL, FALSE);
+  _dbus_return_val_if_fail (path[0] == '/', FALSE);
+  _dbus_return_val_if_fail (vtable != NULL, FALSE);
 
-  _dbus_return_if_fail (connection != NULL);
-  
-  CONNECTION_LOCK (connection);
-  old_data = connection->wakeup_main_data;
-  old_free_data = connection->free_wakeup_main_data;
+  return _dbus_connection_register_object_path (connection, TRUE, path, vtable, user_data, error);
+}
 
-  connection->wakeup_main_function = wakeup_main_function;
-  connection->wakeup_main_data = data;
-  connection->free_wakeup_main_data = free_data_function;
-  
-  CONNECTION_UNLOCK (connection);
+/**
+ * Registers a fallback handler for a given subsection of the object
+ * hierarchy.  The given vtable handles messages at or below the given
+ * path. You can use this to establish a default message handling
+ * policy for a whole "subdirectory."
+ *
+ * It is a bug to call this function for object paths which already
+ * have a handler. Use dbus_connection_try_register_fallback() if this
+ * might be the case.
+ *
+ * @param connection the connection
+ * @param path a '/' delimited string of path elements
+ * @param vtable the virtual table
+ * @param user_data data to pass to functions in the vtable
+ * @returns #FALSE if an error (#DBUS_ERROR_NO_MEMORY or
+ *    #DBUS_ERROR_OBJECT_PATH_IN_USE) occured
+ */
+dbus_bool_t
+dbus_connection_register_fallback (DBusConnection              *connection,
+                                   const char                  *path,
+                                   const DBusObjectPathVTable  *vtable,
+                                   void                        *user_data)
+{
+  dbus_bool_t retval;
+  DBusError error = DBUS_ERROR_INIT;
 
-  /* Callback outside the lock */
-  if (old_free_data)
-    (*old_free_data) (old_data);
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (path != NULL, FALSE);
+  _dbus_return_val_if_fail (path[0] == '/', FALSE);
+  _dbus_return_val_if_fail (vtable != NULL, FALSE);
+
+  retval = _dbus_connection_register_object_path (connection, TRUE, path, vtable, user_data, &error);
+
+  if (dbus_error_has_name (&error, DBUS_ERROR_OBJECT_PATH_IN_USE))
+    {
+      _dbus_warn ("%s\n", error.message);
+      dbus_error_free (&error);
+      return FALSE;
+    }
+
+  return retval;
 }
 
 /**
- * Set a function to be invoked when the dispatch status changes.
- * If the dispatch status is #DBUS_DISPATCH_DATA_REMAINS, then
- * dbus_connection_dispatch() needs to be called to process incoming
- * messages. However, dbus_connection_dispatch() MUST NOT BE CALLED
- * from inside the DBusDispatchStatusFunction. Indeed, almost
- * any reentrancy in this function is a bad idea. Instead,
- * the DBusDispatchStatusFunction should simply save an indication
- * that messages should be dispatched later, when the main loop
- * is re-entered.
- *
- * If you don't set a dispatch status function, you have to be sure to
- * dispatch on every iteration of your main loop, especially if
- * dbus_watch_handle() or dbus_timeout_handle() were called.
+ * Unregisters the handler registered with exactly the given path.
+ * It's a bug to call this function for a path that isn't registered.
+ * Can unregister both fallback paths and object paths.
  *
  * @param connection the connection
- * @param function function to call on dispatch status changes
- * @param data data for function
- * @param free_data_function free the function data
+ * @param path a '/' delimited string of path elements
+ * @returns #FALSE if not enough memory
  */
-void
-dbus_connection_set_dispatch_status_function (DBusConnection             *connection,
-                                              DBusDispatchStatusFunction  function,
-                                              void                       *data,
-                                              DBusFreeFunction            free_data_function)
+dbus_bool_t
+dbus_connection_unregister_object_path (DBusConnection              *connection,
+                                        const char                  *path)
 {
-  void *old_data;
-  DBusFreeFunction old_free_data;
+  char **decomposed_path;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (path != NULL, FALSE);
+  _dbus_return_val_if_fail (path[0] == '/', FALSE);
+
+  if (!_dbus_decompose_path (path, strlen (path), &decomposed_path, NULL))
+      return FALSE;
 
-  _dbus_return_if_fail (connection != NULL);
-  
   CONNECTION_LOCK (connection);
-  old_data = connection->dispatch_status_data;
-  old_free_data = connection->free_dispatch_status_data;
 
-  connection->dispatch_status_function = function;
-  connection->dispatch_status_data = data;
-  connection->free_dispatch_status_data = free_data_function;
-  
-  CONNECTION_UNLOCK (connection);
+  _dbus_object_tree_unregister_and_unlock (connection->objects, (const char **) decomposed_path);
+
+  dbus_free_string_array (decomposed_path);
 
-  /* Callback outside the lock */
-  if (old_free_data)
-    (*old_free_data) (old_data);
+  return TRUE;
 }
 
 /**
- * Get the UNIX file descriptor of the connection, if any.  This can
- * be used for SELinux access control checks with getpeercon() for
- * example. DO NOT read or write to the file descriptor, or try to
- * select() on it; use DBusWatch for main loop integration. Not all
- * connections will have a file descriptor. So for adding descriptors
- * to the main loop, use dbus_watch_get_unix_fd() and so forth.
- *
- * If the connection is socket-based, you can also use
- * dbus_connection_get_socket(), which will work on Windows too.
- * This function always fails on Windows.
+ * Gets the user data passed to dbus_connection_register_object_path()
+ * or dbus_connection_register_fallback(). If nothing was registered
+ * at this path, the data is filled in with #NULL.
  *
- * Right now the returned descriptor is always a socket, but
- * that is not guaranteed.
- * 
  * @param connection the connection
- * @param fd return location for the file descriptor.
- * @returns #TRUE if fd is successfully obtained.
+ * @param path the path you registered with
+ * @param data_p location to store the user data, or #NULL
+ * @returns #FALSE if not enough memory
  */
 dbus_bool_t
-dbus_connection_get_unix_fd (DBusConnection *connection,
-                             int            *fd)
+dbus_connection_get_object_path_data (DBusConnection *connection,
+                                      const char     *path,
+                                      void          **data_p)
 {
+  char **decomposed_path;
+
   _dbus_return_val_if_fail (connection != NULL, FALSE);
-  _dbus_return_val_if_fail (connection->transport != NULL, FALSE);
+  _dbus_return_val_if_fail (path != NULL, FALSE);
+  _dbus_return_val_if_fail (data_p != NULL, FALSE);
 
-#ifdef DBUS_WIN
-  /* FIXME do this on a lower level */
-  return FALSE;
-#endif
+  *data_p = NULL;
   
-  return dbus_connection_get_socket(connection, fd);
+  if (!_dbus_decompose_path (path, strlen (path), &decomposed_path, NULL))
+    return FALSE;
+  
+  CONNECTION_LOCK (connection);
+
+  *data_p = _dbus_object_tree_get_user_data_unlocked (connection->objects, (const char**) decomposed_path);
+
+  CONNECTION_UNLOCK (connection);
+
+  dbus_free_string_array (decomposed_path);
+
+  return TRUE;
 }
 
 /**
- * Gets the underlying Windows or UNIX socket file descriptor
- * of the connection, if any. DO NOT read or write to the file descriptor, or try to
- * select() on it; use DBusWatch for main loop integration. Not all
- * connections will have a socket. So for adding descriptors
- * to the main loop, use dbus_watch_get_socket() and so forth.
+ * Lists the registered fallback handlers and object path handlers at
+ * the given parent_path. The returned array should be freed with
+ * dbus_free_string_array().
  *
- * If the connection is not socket-based, this function will return FALSE,
- * even if the connection does have a file descriptor of some kind.
- * i.e. this function always returns specifically a socket file descriptor.
- * 
  * @param connection the connection
- * @param fd return location for the file descriptor.
- * @returns #TRUE if fd is successfully obtained.
+ * @param parent_path the path to list the child handlers of
+ * @param child_entries returns #NULL-terminated array of children
+ * @returns #FALSE if no memory to allocate the child entries
  */
 dbus_bool_t
-dbus_connection_get_socket(DBusConnection              *connection,
-                           int                         *fd)
+dbus_connection_list_registered (DBusConnection              *connection,
+                                 const char                  *parent_path,
+                                 char                      ***child_entries)
 {
+  char **decomposed_path;
   dbus_bool_t retval;
-  DBusSocket s = DBUS_SOCKET_INIT;
-
   _dbus_return_val_if_fail (connection != NULL, FALSE);
-  _dbus_return_val_if_fail (connection->transport != NULL, FALSE);
-  
-  CONNECTION_LOCK (connection);
-  
-  retval = _dbus_transport_get_socket_fd (connection->transport, &s);
+  _dbus_return_val_if_fail (parent_path != NULL, FALSE);
+  _dbus_return_val_if_fail (parent_path[0] == '/', FALSE);
+  _dbus_return_val_if_fail (child_entries != NULL, FALSE);
 
-  if (retval)
-    {
-      *fd = _dbus_socket_get_int (s);
-    }
+  if (!_dbus_decompose_path (parent_path, strlen (parent_path), &decomposed_path, NULL))
+    return FALSE;
 
-  CONNECTION_UNLOCK (connection);
+  CONNECTION_LOCK (connection);
+
+  retval = _dbus_object_tree_list_registered_and_unlock (connection->objects,
+							 (const char **) decomposed_path,
+							 child_entries);
+  dbus_free_string_array (decomposed_path);
 
   return retval;
 }
 
+static DBusDataSlotAllocator slot_allocator =
+  _DBUS_DATA_SLOT_ALLOCATOR_INIT (_DBUS_LOCK_NAME (connection_slots));
 
 /**
- * Gets the UNIX user ID of the connection if known.  Returns #TRUE if
- * the uid is filled in.  Always returns #FALSE on non-UNIX platforms
- * for now, though in theory someone could hook Windows to NIS or
- * something.  Always returns #FALSE prior to authenticating the
- * connection.
+ * Allocates an integer ID to be used for storing application-specific
+ * data on any DBusConnection. The allocated ID may then be used
+ * with dbus_connection_set_data() and dbus_connection_get_data().
+ * The passed-in slot must be initialized to -1, and is filled in
+ * with the slot ID. If the passed-in slot is not -1, it's assumed
+ * to be already allocated, and its refcount is incremented.
+ * 
+ * The allocated slot is global, i.e. all DBusConnection objects will
+ * have a slot with the given integer ID reserved.
  *
- * The UID is only read by servers from clients; clients can't usually
- * get the UID of servers, because servers do not authenticate to
- * clients.  The returned UID is the UID the connection authenticated
- * as.
+ * @param slot_p address of a global variable storing the slot
+ * @returns #FALSE on failure (no memory)
+ */
+dbus_bool_t
+dbus_connection_allocate_data_slot (dbus_int32_t *slot_p)
+{
+  return _dbus_data_slot_allocator_alloc (&slot_allocator,
+                                          slot_p);
+}
+
+/**
+ * Deallocates a global ID for connection data slots.
+ * dbus_connection_get_data() and dbus_connection_set_data() may no
+ * longer be used with this slot.  Existing data stored on existing
+ * DBusConnection objects will be freed when the connection is
+ * finalized, but may not be retrieved (and may only be replaced if
+ * someone else reallocates the slot).  When the refcount on the
+ * passed-in slot reaches 0, it is set to -1.
  *
- * The message bus is a server and the apps connecting to the bus
- * are clients.
+ * @param slot_p address storing the slot to deallocate
+ */
+void
+dbus_connection_free_data_slot (dbus_int32_t *slot_p)
+{
+  _dbus_return_if_fail (*slot_p >= 0);
+  
+  _dbus_data_slot_allocator_free (&slot_allocator, slot_p);
+}
+
+/**
+ * Stores a pointer on a DBusConnection, along
+ * with an optional function to be used for freeing
+ * the data when the data is set again, or when
+ * the connection is finalized. The slot number
+ * must have been allocated with dbus_connection_allocate_data_slot().
  *
- * You can ask the bus to tell you the UID of another connection though
- * if you like; this is done with dbus_bus_get_unix_user().
+ * @note This function does not take the
+ * main thread lock on DBusConnection, which allows it to be
+ * used from inside watch and timeout functions. (See the
+ * note in docs for dbus_connection_set_watch_functions().)
+ * A side effect of this is that you need to know there's
+ * a reference held on the connection while invoking
+ * dbus_connection_set_data(), or the connection could be
+ * finalized during dbus_connection_set_data().
  *
  * @param connection the connection
- * @param uid return location for the user ID
- * @returns #TRUE if uid is filled in with a valid user ID
+ * @param slot the slot number
+ * @param data the data to store
+ * @param free_data_func finalizer function for the data
+ * @returns #TRUE if there was enough memory to store the data
  */
 dbus_bool_t
-dbus_connection_get_unix_user (DBusConnection *connection,
-                               unsigned long  *uid)
+dbus_connection_set_data (DBusConnection   *connection,
+                          dbus_int32_t      slot,
+                          void             *data,
+                          DBusFreeFunction  free_data_func)
 {
-  dbus_bool_t result;
+  DBusFreeFunction old_free_func;
+  void *old_data;
+  dbus_bool_t retval;
 
   _dbus_return_val_if_fail (connection != NULL, FALSE);
-  _dbus_return_val_if_fail (uid != NULL, FALSE);
-
-  CONNECTION_LOCK (connection);
-
-  if (!_dbus_transport_try_to_authenticate (connection->transport))
-    result = FALSE;
-  else
-    result = _dbus_transport_get_unix_user (connection->transport,
-                                            uid);
+  _dbus_return_val_if_fail (slot >= 0, FALSE);
+  
+  SLOTS_LOCK (connection);
 
-#ifdef DBUS_WIN
-  _dbus_assert (!result);
-#endif
+  retval = _dbus_data_slot_list_set (&slot_allocator,
+                                     &connection->slot_list,
+                                     slot, data, free_data_func,
+                                     &old_free_func, &old_data);
   
-  CONNECTION_UNLOCK (connection);
+  SLOTS_UNLOCK (connection);
 
-  return result;
+  if (retval)
+    {
+      /* Do the actual free outside the connection lock */
+      if (old_free_func)
+        (* old_free_func) (old_data);
+    }
+
+  return retval;
 }
 
 /**
- * Gets the process ID of the connection if any.
- * Returns #TRUE if the pid is filled in.
- * Always returns #FALSE prior to authenticating the
- * connection.
+ * Retrieves data previously set with dbus_connection_set_data().
+ * The slot must still be allocated (must not have been freed).
+ *
+ * @note This function does not take the
+ * main thread lock on DBusConnection, which allows it to be
+ * used from inside watch and timeout functions. (See the
+ * note in docs for dbus_connection_set_watch_functions().)
+ * A side effect of this is that you need to know there's
+ * a reference held on the connection while invoking
+ * dbus_connection_get_data(), or the connection could be
+ * finalized during dbus_connection_get_data().
  *
  * @param connection the connection
- * @param pid return location for the process ID
- * @returns #TRUE if uid is filled in with a valid process ID
+ * @param slot the slot to get data from
+ * @returns the data, or #NULL if not found
  */
-dbus_bool_t
-dbus_connection_get_unix_process_id (DBusConnection *connection,
-				     unsigned long  *pid)
+void*
+dbus_connection_get_data (DBusConnection   *connection,
+                          dbus_int32_t      slot)
 {
-  dbus_bool_t result;
-
-  _dbus_return_val_if_fail (connection != NULL, FALSE);
-  _dbus_return_val_if_fail (pid != NULL, FALSE);
+  void *res;
 
-  CONNECTION_LOCK (connection);
+  _dbus_return_val_if_fail (connection != NULL, NULL);
+  _dbus_return_val_if_fail (slot >= 0, NULL);
 
-  if (!_dbus_transport_try_to_authenticate (connection->transport))
-    result = FALSE;
-  else
-    result = _dbus_transport_get_unix_process_id (connection->transport,
-						  pid);
+  /* Setting data takes the slot lock, but reading it doesn't need to */
+  res = _dbus_data_slot_list_get (&slot_allocator,
+                                  &connection->slot_list,
+                                  slot);
 
-  CONNECTION_UNLOCK (connection);
+  return res;
+}
 
-  return result;
+/**
+ * This function sets a global flag for whether dbus_connection_new()
+ * will set SIGPIPE behavior to SIG_IGN.
+ *
+ * @param will_modify_sigpipe #TRUE to allow sigpipe to be set to SIG_IGN
+ */
+void
+dbus_connection_set_change_sigpipe (dbus_bool_t will_modify_sigpipe)
+{  
+  _dbus_modify_sigpipe = will_modify_sigpipe != FALSE;
 }
 
 /**
- * Gets the ADT audit data of the connection if any.
- * Returns #TRUE if the structure pointer is returned.
- * Always returns #FALSE prior to authenticating the
+ * Specifies the maximum size message this connection is allowed to
+ * receive. Larger messages will result in disconnecting the
  * connection.
- *
- * @param connection the connection
- * @param data return location for audit data
- * @param data_size return location for length of audit data
- * @returns #TRUE if audit data is filled in with a valid ucred pointer
+ * 
+ * @param connection a #DBusConnection
+ * @param size maximum message size the connection can receive, in bytes
  */
-dbus_bool_t
-dbus_connection_get_adt_audit_session_data (DBusConnection *connection,
-					    void          **data,
-					    dbus_int32_t   *data_size)
+void
+dbus_connection_set_max_message_size (DBusConnection *connection,
+                                      long            size)
 {
-  dbus_bool_t result;
-
-  _dbus_return_val_if_fail (connection != NULL, FALSE);
-  _dbus_return_val_if_fail (data != NULL, FALSE);
-  _dbus_return_val_if_fail (data_size != NULL, FALSE);
-
+  _dbus_return_if_fail (connection != NULL);
+  
   CONNECTION_LOCK (connection);
-
-  if (!_dbus_transport_try_to_authenticate (connection->transport))
-    result = FALSE;
-  else
-    result = _dbus_transport_get_adt_audit_session_data (connection->transport,
-					    	         data,
-			  			         data_size);
+  _dbus_transport_set_max_message_size (connection->transport,
+                                        size);
   CONNECTION_UNLOCK (connection);
-
-  return result;
 }
 
 /**
- * Sets a predicate function used to determine whether a given user ID
- * is allowed to connect. When an incoming connection has
- * authenticated with a particular user ID, this function is called;
- * if it returns #TRUE, the connection is allowed to proceed,
- * otherwise the connection is disconnected.
- *
- * If the function is set to #NULL (as it is by default), then
- * only the same UID as the server process will be allowed to
- * connect. Also, root is always allowed to connect.
+ * Gets the value set by dbus_connection_set_max_message_size().
  *
- * On Windows, the function will be set and its free_data_function will
- * be invoked when the connection is freed or a new function is set.
- * However, the function will never be called, because there are
- * no UNIX user ids to pass to it, or at least none of the existing
- * auth protocols would allow authenticating as a UNIX user on Windows.
- * 
  * @param connection the connection
- * @param function the predicate
- * @param data data to pass to the predicate
- * @param free_data_function function to free the data
+ * @returns the max size of a single message
  */
-void
-dbus_connection_set_unix_user_function (DBusConnection             *connection,
-                                        DBusAllowUnixUserFunction   function,
-                                        void                       *data,
-                                        DBusFreeFunction            free_data_function)
+long
+dbus_connection_get_max_message_size (DBusConnection *connection)
 {
-  void *old_data = NULL;
-  DBusFreeFunction old_free_function = NULL;
+  long res;
 
-  _dbus_return_if_fail (connection != NULL);
+  _dbus_return_val_if_fail (connection != NULL, 0);
   
   CONNECTION_LOCK (connection);
-  _dbus_transport_set_unix_user_function (connection->transport,
-                                          function, data, free_data_function,
-                                          &old_data, &old_free_function);
+  res = _dbus_transport_get_max_message_size (connection->transport);
   CONNECTION_UNLOCK (connection);
-
-  if (old_free_function != NULL)
-    (* old_free_function) (old_data);
+  return res;
 }
 
-/* Same calling convention as dbus_connection_get_windows_user */
-dbus_bool_t
-_dbus_connection_get_linux_security_label (DBusConnection  *connection,
-                                           char           **label_p)
+/**
+ * Specifies the maximum number of unix fds a message on this
+ * connection is allowed to receive. Messages with more unix fds will
+ * result in disconnecting the connection.
+ *
+ * @param connection a #DBusConnection
+ * @param n maximum message unix fds the connection can receive
+ */
+void
+dbus_connection_set_max_message_unix_fds (DBusConnection *connection,
+                                          long            n)
 {
-  dbus_bool_t result;
-
-  _dbus_assert (connection != NULL);
-  _dbus_assert (label_p != NULL);
+  _dbus_return_if_fail (connection != NULL);
 
   CONNECTION_LOCK (connection);
-
-  if (!_dbus_transport_try_to_authenticate (connection->transport))
-    result = FALSE;
-  else
-    result = _dbus_transport_get_linux_security_label (connection->transport,
-                                                       label_p);
-#ifndef __linux__
-  _dbus_assert (!result);
-#endif
-
+  _dbus_transport_set_max_message_unix_fds (connection->transport,
+                                            n);
   CONNECTION_UNLOCK (connection);
-
-  return result;
 }
 
 /**
- * Gets the Windows user SID of the connection if known.  Returns
- * #TRUE if the ID is filled in.  Always returns #FALSE on non-Windows
- * platforms for now, though in theory someone could hook UNIX to
- * Active Directory or something.  Always returns #FALSE prior to
- * authenticating the connection.
- *
- * The user is only read by servers from clients; clients can't usually
- * get the user of servers, because servers do not authenticate to
- * clients. The returned user is the user the connection authenticated
- * as.
- *
- * The message bus is a server and the apps connecting to the bus
- * are clients.
- *
- * The returned user string has to be freed with dbus_free().
- *
- * The return value indicates whether the user SID is available;
- * if it's available but we don't have the memory to copy it,
- * then the return value is #TRUE and #NULL is given as the SID.
- * 
- * @todo We would like to be able to say "You can ask the bus to tell
- * you the user of another connection though if you like; this is done
- * with dbus_bus_get_windows_user()." But this has to be implemented
- * in bus/driver.c and dbus/dbus-bus.c, and is pointless anyway
- * since on Windows we only use the session bus for now.
+ * Gets the value set by dbus_connection_set_max_message_unix_fds().
  *
  * @param connection the connection
- * @param windows_sid_p return location for an allocated copy of the user ID, or #NULL if no memory
- * @returns #TRUE if user is available (returned value may be #NULL anyway if no memory)
+ * @returns the max numer of unix fds of a single message
  */
-dbus_bool_t
-dbus_connection_get_windows_user (DBusConnection             *connection,
-                                  char                      **windows_sid_p)
+long
+dbus_connection_get_max_message_unix_fds (DBusConnection *connection)
 {
-  dbus_bool_t result;
+  long res;
 
-  _dbus_return_val_if_fail (connection != NULL, FALSE);
-  _dbus_return_val_if_fail (windows_sid_p != NULL, FALSE);
+  _dbus_return_val_if_fail (connection != NULL, 0);
 
   CONNECTION_LOCK (connection);
-
-  if (!_dbus_transport_try_to_authenticate (connection->transport))
-    result = FALSE;
-  else
-    result = _dbus_transport_get_windows_user (connection->transport,
-                                               windows_sid_p);
-
-#ifdef DBUS_UNIX
-  _dbus_assert (!result);
-#endif
-  
+  res = _dbus_transport_get_max_message_unix_fds (connection->transport);
   CONNECTION_UNLOCK (connection);
-
-  return result;
+  return res;
 }
 
 /**
- * Sets a predicate function used to determine whether a given user ID
- * is allowed to connect. When an incoming connection has
- * authenticated with a particular user ID, this function is called;
- * if it returns #TRUE, the connection is allowed to proceed,
- * otherwise the connection is disconnected.
+ * Sets the maximum total number of bytes that can be used for all messages
+ * received on this connection. Messages count toward the maximum until
+ * they are finalized. When the maximum is reached, the connection will
+ * not read more data until some messages are finalized.
  *
- * If the function is set to #NULL (as it is by default), then
- * only the same user owning the server process will be allowed to
- * connect.
+ * The semantics of the maximum are: if outstanding messages are
+ * already above the maximum, additional messages will not be read.
+ * The semantics are not: if the next message would cause us to exceed
+ * the maximum, we don't read it. The reason is that we don't know the
+ * size of a message until after we read it.
  *
- * On UNIX, the function will be set and its free_data_function will
- * be invoked when the connection is freed or a new function is set.
- * However, the function will never be called, because there is no
- * way right now to authenticate as a Windows user on UNIX.
+ * Thus, the max live messages size can actually be exceeded
+ * by up to the maximum size of a single message.
  * 
+ * Also, if we read say 1024 bytes off the wire in a single read(),
+ * and that contains a half-dozen small messages, we may exceed the
+ * size max by that amount. But this should be inconsequential.
+ *
+ * This does imply that we can't call read() with a buffer larger
+ * than we're willing to exceed this limit by.
+ *
  * @param connection the connection
- * @param function the predicate
- * @param data data to pass to the predicate
- * @param free_data_function function to free the data
+ * @param size the maximum size in bytes of all outstanding messages
  */
 void
-dbus_connection_set_windows_user_function (DBusConnection              *connection,
-                                           DBusAllowWindowsUserFunction function,
-                                           void                        *data,
-                                           DBusFreeFunction             free_data_function)
+dbus_connection_set_max_received_size (DBusConnection *connection,
+                                       long            size)
 {
-  void *old_data = NULL;
-  DBusFreeFunction old_free_function = NULL;
-
   _dbus_return_if_fail (connection != NULL);
   
   CONNECTION_LOCK (connection);
-  _dbus_transport_set_windows_user_function (connection->transport,
-                                             function, data, free_data_function,
-                                             &old_data, &old_free_function);
+  _dbus_transport_set_max_received_size (connection->transport,
+                                         size);
   CONNECTION_UNLOCK (connection);
-
-  if (old_free_function != NULL)
-    (* old_free_function) (old_data);
 }
 
 /**
- * This function must be called on the server side of a connection when the
- * connection is first seen in the #DBusNewConnectionFunction. If set to
- * #TRUE (the default is #FALSE), then the connection can proceed even if
- * the client does not authenticate as some user identity, i.e. clients
- * can connect anonymously.
- * 
- * This setting interacts with the available authorization mechanisms
- * (see dbus_server_set_auth_mechanisms()). Namely, an auth mechanism
- * such as ANONYMOUS that supports anonymous auth must be included in
- * the list of available mechanisms for anonymous login to work.
- *
- * This setting also changes the default rule for connections
- * authorized as a user; normally, if a connection authorizes as
- * a user identity, it is permitted if the user identity is
- * root or the user identity matches the user identity of the server
- * process. If anonymous connections are allowed, however,
- * then any user identity is allowed.
+ * Gets the value set by dbus_connection_set_max_received_size().
  *
- * You can override the rules for connections authorized as a
- * user identity with dbus_connection_set_unix_user_function()
- * and dbus_connection_set_windows_user_function().
- * 
  * @param connection the connection
- * @param value whether to allow authentication as an anonymous user
- */
-void
-dbus_connection_set_allow_anonymous (DBusConnection             *connection,
-                                     dbus_bool_t                 value)
+ * @returns the max size of all live messages
+ */
+long
+dbus_connection_get_max_received_size (DBusConnection *connection)
 {
-  _dbus_return_if_fail (connection != NULL);
+  long res;
+
+  _dbus_return_val_if_fail (connection != NULL, 0);
   
   CONNECTION_LOCK (connection);
-  _dbus_transport_set_allow_anonymous (connection->transport, value);
+  res = _dbus_transport_get_max_received_size (connection->transport);
   CONNECTION_UNLOCK (connection);
+  return res;
 }
 
 /**
+ * Sets how many bytes of outgoing messages may be queued before sending
+ * a message writes to the socket immediately. Below this size, sending
+ * only enables the write watch, so that messages sent in quick
+ * succession are written together when the main loop next runs,
+ * rather than with one system call each.
  *
- * Normally #DBusConnection automatically handles all messages to the
- * org.freedesktop.DBus.Peer interface. However, the message bus wants
- * to be able to route methods on that interface through the bus and
- * to other applications. If routing peer messages is enabled, then
- * messages with the org.freedesktop.DBus.Peer interface that also
- * have a bus destination name set will not be automatically
- * handled by the #DBusConnection and instead will be dispatched
- * normally to the application.
+ * This is only useful for connections that are integrated with a main
+ * loop (see dbus_connection_set_watch_functions()). dbus_connection_flush()
+ * and blocking calls such as dbus_connection_send_with_reply_and_block()
+ * still write everything immediately.
  *
- * If a normal application sets this flag, it can break things badly.
- * So don't set this unless you are the message bus.
+ * The default is 0, meaning every message is written as soon as it is
+ * sent.
  *
  * @param connection the connection
- * @param value #TRUE to pass through org.freedesktop.DBus.Peer messages with a bus name set
+ * @param size number of queued bytes below which writing is deferred, or 0
  */
 void
-dbus_connection_set_route_peer_messages (DBusConnection             *connection,
-                                         dbus_bool_t                 value)
+dbus_connection_set_max_unflushed_size (DBusConnection *connection,
+                                        long            size)
 {
   _dbus_return_if_fail (connection != NULL);
-  
+  _dbus_return_if_fail (size >= 0);
+
   CONNECTION_LOCK (connection);
-  connection->route_peer_messages = value;
+  connection->max_unflushed_size = size;
   CONNECTION_UNLOCK (connection);
 }
 
 /**
- * Adds a message filter. Filters are handlers that are run on all
- * incoming messages, prior to the objects registered with
- * dbus_connection_register_object_path().  Filters are run in the
- * order that they were added.  The same handler can be added as a
- * filter more than once, in which case it will be run more than once.
- * Filters added during a filter callback won't be run on the message
- * being processed.
- *
- * @todo we don't run filters on messages while blocking without
- * entering the main loop, since filters are run as part of
- * dbus_connection_dispatch(). This is probably a feature, as filters
- * could create arbitrary reentrancy. But kind of sucks if you're
- * trying to filter METHOD_RETURN for some reason.
+ * Gets the value set by dbus_connection_set_max_unflushed_size().
  *
  * @param connection the connection
- * @param function function to handle messages
- * @param user_data user data to pass to the function
- * @param free_data_function function to use for freeing user data
- * @returns #TRUE on success, #FALSE if not enough memory.
+ * @returns number of queued bytes below which writing is deferred
  */
-dbus_bool_t
-dbus_connection_add_filter (DBusConnection            *connection,
-                            DBusHandleMessageFunction  function,
-                            void                      *user_data,
-                            DBusFreeFunction           free_data_function)
+long
+dbus_connection_get_max_unflushed_size (DBusConnection *connection)
 {
-  DBusMessageFilter *filter;
-  
-  _dbus_return_val_if_fail (connection != NULL, FALSE);
-  _dbus_return_val_if_fail (function != NULL, FALSE);
-
-  filter = dbus_new0 (DBusMessageFilter, 1);
-  if (filter == NULL)
-    return FALSE;
+  long res;
 
-  _dbus_atomic_inc (&filter->refcount);
+  _dbus_return_val_if_fail (connection != NULL, 0);
 
   CONNECTION_LOCK (connection);
-
-  if (!_dbus_list_append (&connection->filter_list,
-                          filter))
-    {
-      _dbus_message_filter_unref (filter);
-      CONNECTION_UNLOCK (connection);
-      return FALSE;
-    }
-
-  /* Fill in filter after all memory allocated,
-   * so we don't run the free_user_data_function
-   * if the add_filter() fails
-   */
-  
-  filter->function = function;
-  filter->user_data = user_data;
-  filter->free_user_data_function = free_data_function;
-        
+  res = connection->max_unflushed_size;
   CONNECTION_UNLOCK (connection);
-  return TRUE;
+  return res;
 }
 
 /**
- * Removes a previously-added message filter. It is a programming
- * error to call this function for a handler that has not been added
- * as a filter. If the given handler was added more than once, only
- * one instance of it will be removed (the most recently-added
- * instance).
+ * Sets how long a blocking read on this connection, such as the one in
+ * dbus_connection_read_write_dispatch() or
+ * dbus_connection_send_with_reply_and_block(), keeps checking the
+ * socket without sleeping before it falls back to a normal wait in
+ * poll(). If data arrives within that time, the thread never has to be
+ * woken up by the scheduler, which cuts the latency of small round
+ * trips at the cost of burning CPU while waiting.
+ *
+ * Where the platform supports it, the socket is also asked to
+ * busy-poll in the kernel (SO_BUSY_POLL), which helps TCP connections;
+ * raising that usually needs extra privileges and failing to set it is
+ * not an error.
+ *
+ * This is only worthwhile for latency-critical clients that can spare
+ * a core. The default is 0, meaning never spin.
  *
  * @param connection the connection
- * @param function the handler to remove
- * @param user_data user data for the handler to remove
- *
+ * @param microseconds how long to spin, or 0
  */
 void
-dbus_connection_remove_filter (DBusConnection            *connection,
-                               DBusHandleMessageFunction  function,
-                               void                      *user_data)
+dbus_connection_set_busy_poll (DBusConnection *connection,
+                               int             microseconds)
 {
-  DBusList *link;
-  DBusMessageFilter *filter;
-  
   _dbus_return_if_fail (connection != NULL);
-  _dbus_return_if_fail (function != NULL);
-  
-  CONNECTION_LOCK (connection);
-
-  filter = NULL;
-  
-  link = _dbus_list_get_last_link (&connection->filter_list);
-  while (link != NULL)
-    {
-      filter = link->data;
+  _dbus_return_if_fail (microseconds >= 0);
 
-      if (filter->function == function &&
-          filter->user_data == user_data)
-        {
-          _dbus_list_remove_link (&connection->filter_list, link);
-          filter->function = NULL;
-          
-          break;
-        }
-        
-      link = _dbus_list_get_prev_link (&connection->filter_list, link);
-      filter = NULL;
-    }
-  
+  CONNECTION_LOCK (connection);
+  _dbus_transport_set_busy_poll (connection->transport, microseconds);
   CONNECTION_UNLOCK (connection);
-
-#ifndef DBUS_DISABLE_CHECKS
-  if (filter == NULL)
-    {
-      _dbus_warn_check_failed ("Attempt to remove filter function %p user data %p, but no such filter has been added\n",
-                               function, user_data);
-      return;
-    }
-#endif
-  
-  /* Call application code */
-  if (filter->free_user_data_function)
-    (* filter->free_user_data_function) (filter->user_data);
-
-  filter->free_user_data_function = NULL;
-  filter->user_data = NULL;
-  
-  _dbus_message_filter_unref (filter);
 }
 
 /**
- * Registers a handler for a given path or subsection in the object
- * hierarchy. The given vtable handles messages sent to exactly the
- * given path or also for paths bellow that, depending on fallback
- * parameter.
+ * Gets the value set by dbus_connection_set_busy_poll().
  *
  * @param connection the connection
- * @param fallback whether to handle messages also for "subdirectory"
- * @param path a '/' delimited string of path elements
- * @param vtable the virtual table
- * @param user_data data to pass to functions in the vtable
- * @param error address where an error can be returned
- * @returns #FALSE if an error (#DBUS_ERROR_NO_MEMORY or
- *    #DBUS_ERROR_OBJECT_PATH_IN_USE) is reported
+ * @returns how long blocking reads spin before sleeping, in microseconds
  */
-static dbus_bool_t
-_dbus_connection_register_object_path (DBusConnection              *connection,
-                                       dbus_bool_t                  fallback,
-                                       const char                  *path,
-                                       const DBusObjectPathVTable  *vtable,
-                                       void                        *user_data,
-                                       DBusError                   *error)
+int
+dbus_connection_get_busy_poll (DBusConnection *connection)
 {
-  char **decomposed_path;
-  dbus_bool_t retval;
+  int res;
 
-  if (!_dbus_decompose_path (path, strlen (path), &decomposed_path, NULL))
-    return FALSE;
+  _dbus_return_val_if_fail (connection != NULL, 0);
 
   CONNECTION_LOCK (connection);
-
-  retval = _dbus_object_tree_register (connection->objects,
-                                       fallback,
-                                       (const char **) decomposed_path, vtable,
-                                       user_data, error);
-
+  res = _dbus_transport_get_busy_poll (connection->transport);
   CONNECTION_UNLOCK (connection);
-
-  dbus_free_string_array (decomposed_path);
-
-  return retval;
+  return res;
 }
 
 /**
- * Registers a handler for a given path in the object hierarchy.
- * The given vtable handles messages sent to exactly the given path.
+ * Sets whether the bodies of messages received on this connection are
+ * trusted to be valid. A trusted body is not validated when it is
+ * received, which saves a pass over every byte of it; the header is
+ * still checked in full.
+ *
+ * This is only safe when the other end is known to validate
+ * everything it sends, as dbus-daemon does: it validates every
+ * message body it receives before relaying it, and builds its own
+ * messages with libdbus. If an invalid body does arrive, reading it
+ * with a #DBusMessageIter can crash the application. Never set this
+ * on a peer-to-peer connection, or for a bus whose daemon you do not
+ * trust.
+ *
+ * The default is #FALSE.
  *
  * @param connection the connection
- * @param path a '/' delimited string of path elements
- * @param vtable the virtual table
- * @param user_data data to pass to functions in the vtable
- * @param error address where an error can be returned
- * @returns #FALSE if an error (#DBUS_ERROR_NO_MEMORY or
- *    #DBUS_ERROR_OBJECT_PATH_IN_USE) is reported
+ * @param trust #TRUE to skip validating received message bodies
  */
-dbus_bool_t
-dbus_connection_try_register_object_path (DBusConnection              *connection,
-                                          const char                  *path,
-                                          const DBusObjectPathVTable  *vtable,
-                                          void                        *user_data,
-                                          DBusError                   *error)
+void
+dbus_connection_set_trust_message_bodies (DBusConnection *connection,
+                                          dbus_bool_t     trust)
 {
-  _dbus_return_val_if_fail (connection != NULL, FALSE);
-  _dbus_return_val_if_fail (path != NULL, FALSE);
-  _dbus_return_val_if_fail (path[0] == '/', FALSE);
-  _dbus_return_val_if_fail (vtable != NULL, FALSE);
+  _dbus_return_if_fail (connection != NULL);
 
-  return _dbus_connection_register_object_path (connection, FALSE, path, vtable, user_data, error);
+  CONNECTION_LOCK (connection);
+  _dbus_transport_set_trust_bodies (connection->transport, trust);
+  CONNECTION_UNLOCK (connection);
 }
 
 /**
- * Registers a handler for a given path in the object hierarchy.
- * The given vtable handles messages sent to exactly the given path.
- *
- * It is a bug to call this function for object paths which already
- * have a handler. Use dbus_connection_try_register_object_path() if this
- * might be the case.
+ * Gets the value set by dbus_connection_set_trust_message_bodies().
  *
  * @param connection the connection
- * @param path a '/' delimited string of path elements
- * @param vtable the virtual table
- * @param user_data data to pass to functions in the vtable
- * @returns #FALSE if an error (#DBUS_ERROR_NO_MEMORY or
- *    #DBUS_ERROR_OBJECT_PATH_IN_USE) ocurred
+ * @returns #TRUE if received message bodies are not validated
  */
 dbus_bool_t
-dbus_connection_register_object_path (DBusConnection              *connection,
-                                      const char                  *path,
-                                      const DBusObjectPathVTable  *vtable,
-                                      void                        *user_data)
+dbus_connection_get_trust_message_bodies (DBusConnection *connection)
 {
-  dbus_bool_t retval;
-  DBusError error = DBUS_ERROR_INIT;
+  dbus_bool_t res;
 
   _dbus_return_val_if_fail (connection != NULL, FALSE);
-  _dbus_return_val_if_fail (path != NULL, FALSE);
-  _dbus_return_val_if_fail (path[0] == '/', FALSE);
-  _dbus_return_val_if_fail (vtable != NULL, FALSE);
-
-  retval = _dbus_connection_register_object_path (connection, FALSE, path, vtable, user_data, &error);
-
-  if (dbus_error_has_name (&error, DBUS_ERROR_OBJECT_PATH_IN_USE))
-    {
-      _dbus_warn ("%s\n", error.message);
-      dbus_error_free (&error);
-      return FALSE;
-    }
 
-  return retval;
+  CONNECTION_LOCK (connection);
+  res = _dbus_transport_get_trust_bodies (connection->transport);
+  CONNECTION_UNLOCK (connection);
+  return res;
 }
 
 /**
- * Registers a fallback handler for a given subsection of the object
- * hierarchy.  The given vtable handles messages at or below the given
- * path. You can use this to establish a default message handling
- * policy for a whole "subdirectory."
+ * Sets the maximum total number of unix fds that can be used for all messages
+ * received on this connection. Messages count toward the maximum until
+ * they are finalized. When the maximum is reached, the connection will
+ * not read more data until some messages are finalized.
+ *
+ * The semantics are analogous to those of dbus_connection_set_max_received_size().
+ *
+ * @param connection the connection
+ * @param n the maximum size in bytes of all outstanding messages
+ */
+void
+dbus_connection_set_max_received_unix_fds (DBusConnection *connection,
+                                           long            n)
+{
+  _dbus_return_if_fail (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+  _dbus_transport_set_max_received_unix_fds (connection->transport,
+                                             n);
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
+ * Gets the value set by dbus_connection_set_max_received_unix_fds().
  *
  * @param connection the connection
- * @param path a '/' delimited string of path elements
- * @param vtable the virtual table
- * @param user_data data to pass to functions in the vtable
- * @param error address where an error can be returned
- * @returns #FALSE if an error (#DBUS_ERROR_NO_MEMORY or
- *    #DBUS_ERROR_OBJECT_PATH_IN_USE) is reported
+ * @returns the max unix fds of all live messages
  */
-dbus_bool_t
-dbus_connection_try_register_fallback (DBusConnection              *connection,
-                                       const char                  *path,
-                                       const DBusObjectPathVTable  *vtable,
-                                       void                        *user_data,
-                                       DBusError                   *error)
+long
+dbus_connection_get_max_received_unix_fds (DBusConnection *connection)
 {
-  _dbus_return_val_if_fail (connection != NULL, FALSE);
-  _dbus_return_val_if_fail (path != NULL, FALSE);
-  _dbus_return_val_if_fail (path[0] == '/', FALSE);
-  _dbus_return_val_if_fail (vtable != NULL, FALSE);
+  long res;
 
-  return _dbus_connection_register_object_path (connection, TRUE, path, vtable, user_data, error);
+  _dbus_return_val_if_fail (connection != NULL, 0);
+
+  CONNECTION_LOCK (connection);
+  res = _dbus_transport_get_max_received_unix_fds (connection->transport);
+  CONNECTION_UNLOCK (connection);
+  return res;
 }
 
 /**
- * Registers a fallback handler for a given subsection of the object
- * hierarchy.  The given vtable handles messages at or below the given
- * path. You can use this to establish a default message handling
- * policy for a whole "subdirectory."
- *
- * It is a bug to call this function for object paths which already
- * have a handler. Use dbus_connection_try_register_fallback() if this
- * might be the case.
+ * Gets the approximate size in bytes of all messages in the outgoing
+ * message queue. The size is approximate in that you shouldn't use
+ * it to decide how many bytes to read off the network or anything
+ * of that nature, as optimizations may choose to tell small white lies
+ * to avoid performance overhead.
  *
  * @param connection the connection
- * @param path a '/' delimited string of path elements
- * @param vtable the virtual table
- * @param user_data data to pass to functions in the vtable
- * @returns #FALSE if an error (#DBUS_ERROR_NO_MEMORY or
- *    #DBUS_ERROR_OBJECT_PATH_IN_USE) occured
+ * @returns the number of bytes that have been queued up but not sent
  */
-dbus_bool_t
-dbus_connection_register_fallback (DBusConnection              *connection,
-                                   const char                  *path,
-                                   const DBusObjectPathVTable  *vtable,
-                                   void                        *user_data)
+long
+dbus_connection_get_outgoing_size (DBusConnection *connection)
 {
-  dbus_bool_t retval;
-  DBusError error = DBUS_ERROR_INIT;
-
-  _dbus_return_val_if_fail (connection != NULL, FALSE);
-  _dbus_return_val_if_fail (path != NULL, FALSE);
-  _dbus_return_val_if_fail (path[0] == '/', FALSE);
-  _dbus_return_val_if_fail (vtable != NULL, FALSE);
-
-  retval = _dbus_connection_register_object_path (connection, TRUE, path, vtable, user_data, &error);
+  long res;
 
-  if (dbus_error_has_name (&error, DBUS_ERROR_OBJECT_PATH_IN_USE))
-    {
-      _dbus_warn ("%s\n", error.message);
-      dbus_error_free (&error);
-      return FALSE;
-    }
+  _dbus_return_val_if_fail (connection != NULL, 0);
 
-  return retval;
+  CONNECTION_LOCK (connection);
+  res = _dbus_counter_get_size_value (connection->outgoing_counter);
+  CONNECTION_UNLOCK (connection);
+  return res;
 }
 
 /**
- * Unregisters the handler registered with exactly the given path.
- * It's a bug to call this function for a path that isn't registered.
- * Can unregister both fallback paths and object paths.
+ * Gives back the memory that the connection's read and write buffers
+ * hold beyond the data in them. A server with very many mostly idle
+ * connections can call this from time to time; the buffers of busy
+ * connections simply grow again.
  *
  * @param connection the connection
- * @param path a '/' delimited string of path elements
- * @returns #FALSE if not enough memory
  */
-dbus_bool_t
-dbus_connection_unregister_object_path (DBusConnection              *connection,
-                                        const char                  *path)
+void
+_dbus_connection_trim_buffers (DBusConnection *connection)
 {
-  char **decomposed_path;
+  CONNECTION_LOCK (connection);
+  _dbus_transport_trim_buffers (connection->transport);
+  CONNECTION_UNLOCK (connection);
+}
 
-  _dbus_return_val_if_fail (connection != NULL, FALSE);
-  _dbus_return_val_if_fail (path != NULL, FALSE);
-  _dbus_return_val_if_fail (path[0] == '/', FALSE);
+#ifdef DBUS_ENABLE_STATS
+void
+_dbus_connection_get_stats (DBusConnection *connection,
+                            dbus_uint32_t  *in_messages,
+                            dbus_uint32_t  *in_bytes,
+                            dbus_uint32_t  *in_fds,
+                            dbus_uint32_t  *in_peak_bytes,
+                            dbus_uint32_t  *in_peak_fds,
+                            dbus_uint64_t  *in_total_bytes,
+                            dbus_uint32_t  *in_throttles,
+                            dbus_uint32_t  *out_messages,
+                            dbus_uint32_t  *out_bytes,
+                            dbus_uint32_t  *out_fds,
+                            dbus_uint32_t  *out_peak_bytes,
+                            dbus_uint32_t  *out_peak_fds,
+                            dbus_uint64_t  *out_total_bytes)
+{
+  CONNECTION_LOCK (connection);
 
-  if (!_dbus_decompose_path (path, strlen (path), &decomposed_path, NULL))
-      return FALSE;
+  if (in_messages != NULL)
+    *in_messages = connection->n_incoming;
 
-  CONNECTION_LOCK (connection);
+  _dbus_transport_get_stats (connection->transport,
+                             in_bytes, in_fds, in_peak_bytes, in_peak_fds,
+                             in_total_bytes, out_total_bytes, in_throttles);
 
-  _dbus_object_tree_unregister_and_unlock (connection->objects, (const char **) decomposed_path);
+  if (out_messages != NULL)
+    *out_messages = connection->n_outgoing;
 
-  dbus_free_string_array (decomposed_path);
+  if (out_bytes != NULL)
+    *out_bytes = _dbus_counter_get_size_value (connection->outgoing_counter);
 
-  return TRUE;
+  if (out_fds != NULL)
+    *out_fds = _dbus_counter_get_unix_fd_value (connection->outgoing_counter);
+
+  if (out_peak_bytes != NULL)
+    *out_peak_bytes = _dbus_counter_get_peak_size_value (connection->outgoing_counter);
+
+  if (out_peak_fds != NULL)
+    *out_peak_fds = _dbus_counter_get_peak_unix_fd_value (connection->outgoing_counter);
+
+  CONNECTION_UNLOCK (connection);
 }
 
 /**
- * Gets the user data passed to dbus_connection_register_object_path()
- * or dbus_connection_register_fallback(). If nothing was registered
- * at this path, the data is filled in with #NULL.
+ * Gets how many bytes went over the connection compressed, and how
+ * many they stood for, in each direction.
  *
- * @param connection the connection
- * @param path the path you registered with
- * @param data_p location to store the user data, or #NULL
- * @returns #FALSE if not enough memory
+ * @returns #FALSE if the connection is not compressed
  */
 dbus_bool_t
-dbus_connection_get_object_path_data (DBusConnection *connection,
-                                      const char     *path,
-                                      void          **data_p)
+_dbus_connection_get_compression_stats (DBusConnection *connection,
+                                        dbus_uint64_t  *in_wire_bytes,
+                                        dbus_uint64_t  *in_plain_bytes,
+                                        dbus_uint64_t  *out_wire_bytes,
+                                        dbus_uint64_t  *out_plain_bytes)
 {
-  char **decomposed_path;
-
-  _dbus_return_val_if_fail (connection != NULL, FALSE);
-  _dbus_return_val_if_fail (path != NULL, FALSE);
-  _dbus_return_val_if_fail (data_p != NULL, FALSE);
+  dbus_bool_t compressed;
 
-  *data_p = NULL;
-  
-  if (!_dbus_decompose_path (path, strlen (path), &decomposed_path, NULL))
-    return FALSE;
-  
   CONNECTION_LOCK (connection);
-
-  *data_p = _dbus_object_tree_get_user_data_unlocked (connection->objects, (const char**) decomposed_path);
-
+  compressed = _dbus_transport_get_compression_stats (connection->transport,
+                                                      in_wire_bytes,
+                                                      in_plain_bytes,
+                                                      out_wire_bytes,
+                                                      out_plain_bytes);
   CONNECTION_UNLOCK (connection);
 
-  dbus_free_string_array (decomposed_path);
-
-  return TRUE;
+  return compressed;
 }
 
 /**
- * Lists the registered fallback handlers and object path handlers at
- * the given parent_path. The returned array should be freed with
- * dbus_free_string_array().
+ * Gets how much memory the connection's read and write buffers hold,
+ * not counting the messages queued in either direction.
  *
- * @param connection the connection
- * @param parent_path the path to list the child handlers of
- * @param child_entries returns #NULL-terminated array of children
- * @returns #FALSE if no memory to allocate the child entries
+ * @returns the number of bytes allocated
  */
-dbus_bool_t
-dbus_connection_list_registered (DBusConnection              *connection,
-                                 const char                  *parent_path,
-                                 char                      ***child_entries)
+dbus_uint32_t
+_dbus_connection_get_buffer_bytes (DBusConnection *connection)
 {
-  char **decomposed_path;
-  dbus_bool_t retval;
-  _dbus_return_val_if_fail (connection != NULL, FALSE);
-  _dbus_return_val_if_fail (parent_path != NULL, FALSE);
-  _dbus_return_val_if_fail (parent_path[0] == '/', FALSE);
-  _dbus_return_val_if_fail (child_entries != NULL, FALSE);
-
-  if (!_dbus_decompose_path (parent_path, strlen (parent_path), &decomposed_path, NULL))
-    return FALSE;
+  dbus_uint32_t bytes;
 
   CONNECTION_LOCK (connection);
+  bytes = _dbus_transport_get_buffer_bytes (connection->transport);
+  CONNECTION_UNLOCK (connection);
 
-  retval = _dbus_object_tree_list_registered_and_unlock (connection->objects,
-							 (const char **) decomposed_path,
-							 child_entries);
-  dbus_free_string_array (decomposed_path);
-
-  return retval;
+  return bytes;
 }
 
-static DBusDataSlotAllocator slot_allocator =
-  _DBUS_DATA_SLOT_ALLOCATOR_INIT (_DBUS_LOCK_NAME (connection_slots));
-
 /**
- * Allocates an integer ID to be used for storing application-specific
- * data on any DBusConnection. The allocated ID may then be used
- * with dbus_connection_set_data() and dbus_connection_get_data().
- * The passed-in slot must be initialized to -1, and is filled in
- * with the slot ID. If the passed-in slot is not -1, it's assumed
- * to be already allocated, and its refcount is incremented.
- * 
- * The allocated slot is global, i.e. all DBusConnection objects will
- * have a slot with the given integer ID reserved.
+ * Gets how many broadcasts were dropped from the outgoing queue
+ * without being written, because they had waited longer than the TTL
+ * set with _dbus_connection_set_broadcast_ttl().
  *
- * @param slot_p address of a global variable storing the slot
- * @returns #FALSE on failure (no memory)
+ * @returns the number of broadcasts dropped
  */
-dbus_bool_t
-dbus_connection_allocate_data_slot (dbus_int32_t *slot_p)
+dbus_uint32_t
+_dbus_connection_get_n_expired_broadcasts (DBusConnection *connection)
 {
-  return _dbus_data_slot_allocator_alloc (&slot_allocator,
-                                          slot_p);
+  dbus_uint32_t n;
+
+  CONNECTION_LOCK (connection);
+  n = connection->n_expired_broadcasts;
+  CONNECTION_UNLOCK (connection);
+
+  return n;
 }
 
 /**
- * Deallocates a global ID for connection data slots.
- * dbus_connection_get_data() and dbus_connection_set_data() may no
- * longer be used with this slot.  Existing data stored on existing
- * DBusConnection objects will be freed when the connection is
- * finalized, but may not be retrieved (and may only be replaced if
- * someone else reallocates the slot).  When the refcount on the
- * passed-in slot reaches 0, it is set to -1.
+ * Gets how many times writing to the connection's socket would have
+ * blocked, or wrote only part of what was waiting, because the peer
+ * was not reading fast enough.
  *
- * @param slot_p address storing the slot to deallocate
+ * @returns the number of blocked writes
  */
-void
-dbus_connection_free_data_slot (dbus_int32_t *slot_p)
+dbus_uint32_t
+_dbus_connection_get_n_write_blocks (DBusConnection *connection)
 {
-  _dbus_return_if_fail (*slot_p >= 0);
-  
-  _dbus_data_slot_allocator_free (&slot_allocator, slot_p);
+  dbus_uint32_t n;
+
+  CONNECTION_LOCK (connection);
+  n = _dbus_transport_get_n_write_blocks (connection->transport);
+  CONNECTION_UNLOCK (connection);
+
+  return n;
 }
+#endif /* DBUS_ENABLE_STATS */
 
 /**
- * Stores a pointer on a DBusConnection, along
- * with an optional function to be used for freeing
- * the data when the data is set again, or when
- * the connection is finalized. The slot number
- * must have been allocated with dbus_connection_allocate_data_slot().
- *
- * @note This function does not take the
- * main thread lock on DBusConnection, which allows it to be
- * used from inside watch and timeout functions. (See the
- * note in docs for dbus_connection_set_watch_functions().)
- * A side effect of this is that you need to know there's
- * a reference held on the connection while invoking
- * dbus_connection_set_data(), or the connection could be
- * finalized during dbus_connection_set_data().
+ * Gets the approximate number of uni fds of all messages in the
+ * outgoing message queue.
  *
  * @param connection the connection
- * @param slot the slot number
- * @param data the data to store
- * @param free_data_func finalizer function for the data
- * @returns #TRUE if there was enough memory to store the data
+ * @returns the number of unix fds that have been queued up but not sent
+ */
+long
+dbus_connection_get_outgoing_unix_fds (DBusConnection *connection)
+{
+  long res;
+
+  _dbus_return_val_if_fail (connection != NULL, 0);
+
+  CONNECTION_LOCK (connection);
+  res = _dbus_counter_get_unix_fd_value (connection->outgoing_counter);
+  CONNECTION_UNLOCK (connection);
+  return res;
+}
+
+/**
+ * Computes the two bits of a SignalInterest bitmap that stand for
+ * signals with @p interface and @p member. Either may be #NULL,
+ * meaning a match rule that does not restrict it; the bits for a rule
+ * restricting neither are not defined, since such a rule can match
+ * any signal.
+ *
+ * The key is the FNV-1a hash of the interface, a 0x01 byte and the
+ * member; the bits are that hash and a remix of it, modulo the number
+ * of bits in the bitmap.
+ *
+ * @param interface the interface, or #NULL
+ * @param member the member, or #NULL
+ * @param first return location for the first bit
+ * @param second return location for the second bit
  */
-dbus_bool_t
-dbus_connection_set_data (DBusConnection   *connection,
-                          dbus_int32_t      slot,
-                          void             *data,
-                          DBusFreeFunction  free_data_func)
+void
+_dbus_signal_interest_get_bits (const char   *interface,
+                                const char   *member,
+                                unsigned int *first,
+                                unsigned int *second)
 {
-  DBusFreeFunction old_free_func;
-  void *old_data;
-  dbus_bool_t retval;
+  dbus_uint32_t h = 2166136261u;
+  const unsigned char *p;
 
-  _dbus_return_val_if_fail (connection != NULL, FALSE);
-  _dbus_return_val_if_fail (slot >= 0, FALSE);
-  
-  SLOTS_LOCK (connection);
+  if (interface != NULL)
+    {
+      for (p = (const unsigned char *) interface; *p != '\0'; p++)
+        h = (h ^ *p) * 16777619u;
+    }
 
-  retval = _dbus_data_slot_list_set (&slot_allocator,
-                                     &connection->slot_list,
-                                     slot, data, free_data_func,
-                                     &old_free_func, &old_data);
-  
-  SLOTS_UNLOCK (connection);
+  h = (h ^ 0x01) * 16777619u;
 
-  if (retval)
+  if (member != NULL)
     {
-      /* Do the actual free outside the connection lock */
-      if (old_free_func)
-        (* old_free_func) (old_data);
+      for (p = (const unsigned char *) member; *p != '\0'; p++)
+        h = (h ^ *p) * 16777619u;
     }
 
-  return retval;
+  *first = h % (DBUS_SIGNAL_INTEREST_BYTES * 8);
+
+  h ^= h >> 16;
+  h *= 0x45d9f3bu;
+  h ^= h >> 16;
+
+  *second = h % (DBUS_SIGNAL_INTEREST_BYTES * 8);
+}
+
+static dbus_bool_t
+signal_interest_has_key (const unsigned char *bitmap,
+                         const char          *interface,
+                         const char          *member)
+{
+  unsigned int first, second;
+
+  _dbus_signal_interest_get_bits (interface, member, &first, &second);
+
+  return ((bitmap[first / 8] & (1 << (first % 8))) != 0 &&
+          (bitmap[second / 8] & (1 << (second % 8))) != 0);
 }
 
 /**
- * Retrieves data previously set with dbus_connection_set_data().
- * The slot must still be allocated (must not have been freed).
- *
- * @note This function does not take the
- * main thread lock on DBusConnection, which allows it to be
- * used from inside watch and timeout functions. (See the
- * note in docs for dbus_connection_set_watch_functions().)
- * A side effect of this is that you need to know there's
- * a reference held on the connection while invoking
- * dbus_connection_get_data(), or the connection could be
- * finalized during dbus_connection_get_data().
+ * Tells whether a broadcast signal with the given @p interface and
+ * @p member could be delivered to anyone if it was sent now, so that
+ * a signal that is expensive to build can be skipped when nobody is
+ * listening.
+ *
+ * The first call on a connection to a message bus asks the bus to
+ * keep the connection informed about which signals its match rules
+ * can deliver, and returns #TRUE; later calls answer from the last
+ * summary the bus sent, which is updated as messages are dispatched.
+ * The summary is approximate in one direction only: #FALSE means
+ * that no match rule on the bus could deliver the signal, whatever
+ * its path or arguments, while #TRUE only means that one might. On
+ * connections that are not to a message bus, or to a bus that does
+ * not provide the summary, this always returns #TRUE.
+ *
+ * A rule being added at around the time the signal is sent may still
+ * miss it, just as it would if the signal had been sent a moment
+ * earlier; signals with a destination are delivered regardless of
+ * match rules and should not be skipped on the strength of this.
  *
  * @param connection the connection
- * @param slot the slot to get data from
- * @returns the data, or #NULL if not found
+ * @param interface the signal's interface
+ * @param member the signal's name
+ * @returns #FALSE if the signal can safely be skipped
  */
-void*
-dbus_connection_get_data (DBusConnection   *connection,
-                          dbus_int32_t      slot)
+dbus_bool_t
+dbus_connection_signal_has_subscribers (DBusConnection *connection,
+                                        const char     *interface,
+                                        const char     *member)
 {
-  void *res;
+  DBusMessage *watch;
+  dbus_bool_t watched;
+  dbus_bool_t has_subscribers;
 
-  _dbus_return_val_if_fail (connection != NULL, NULL);
-  _dbus_return_val_if_fail (slot >= 0, NULL);
+  _dbus_return_val_if_fail (connection != NULL, TRUE);
+  _dbus_return_val_if_fail (interface != NULL, TRUE);
+  _dbus_return_val_if_fail (member != NULL, TRUE);
 
-  SLOTS_LOCK (connection);
+  /* only a message bus can tell us */
+  if (dbus_bus_get_unique_name (connection) == NULL)
+    return TRUE;
 
-  res = _dbus_data_slot_list_get (&slot_allocator,
-                                  &connection->slot_list,
-                                  slot);
-  
-  SLOTS_UNLOCK (connection);
+  CONNECTION_LOCK (connection);
+  watched = connection->signal_interest_watched;
+  connection->signal_interest_watched = TRUE;
+  CONNECTION_UNLOCK (connection);
 
-  return res;
+  if (!watched)
+    {
+      watch = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                            DBUS_PATH_DBUS,
+                                            DBUS_INTERFACE_DBUS,
+                                            "WatchSignalInterest");
+
+      if (watch != NULL)
+        dbus_message_set_no_reply (watch, TRUE);
+
+      if (watch == NULL || !dbus_connection_send (connection, watch, NULL))
+        {
+          /* try again next time */
+          CONNECTION_LOCK (connection);
+          connection->signal_interest_watched = FALSE;
+          CONNECTION_UNLOCK (connection);
+        }
+
+      if (watch != NULL)
+        dbus_message_unref (watch);
+
+      return TRUE;
+    }
+
+  CONNECTION_LOCK (connection);
+
+  has_subscribers = (connection->signal_interest == NULL ||
+                     connection->signal_interest_everything ||
+                     signal_interest_has_key (connection->signal_interest,
+                                              interface, member) ||
+                     signal_interest_has_key (connection->signal_interest,
+                                              interface, NULL) ||
+                     signal_interest_has_key (connection->signal_interest,
+                                              NULL, member));
+
+  CONNECTION_UNLOCK (connection);
+
+  return has_subscribers;
 }
 
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
 /**
- * This function sets a global flag for whether dbus_connection_new()
- * will set SIGPIPE behavior to SIG_IGN.
+ * Returns the address of the transport object of this connection
  *
- * @param will_modify_sigpipe #TRUE to allow sigpipe to be set to SIG_IGN
+ * @param connection the connection
+ * @returns the address string
  */
-void
-dbus_connection_set_change_sigpipe (dbus_bool_t will_modify_sigpipe)
-{  
-  _dbus_modify_sigpipe = will_modify_sigpipe != FALSE;
+const char*
+_dbus_connection_get_address (DBusConnection *connection)
+{
+  return _dbus_transport_get_address (connection->transport);
 }
 
 /**
- * Specifies the maximum size message this connection is allowed to
- * receive. Larger messages will result in disconnecting the
- * connection.
- * 
- * @param connection a #DBusConnection
- * @param size maximum message size the connection can receive, in bytes
+ * Makes the connection authenticate without Unix fd passing, to stand
+ * in for a peer that cannot pass fds. Must be called before the
+ * connection starts authenticating.
+ *
+ * @param connection the connection
  */
 void
-dbus_connection_set_max_message_size (DBusConnection *connection,
-                                      long            size)
+_dbus_connection_disable_unix_fd_passing (DBusConnection *connection)
 {
-  _dbus_return_if_fail (connection != NULL);
-  
   CONNECTION_LOCK (connection);
-  _dbus_transport_set_max_message_size (connection->transport,
-                                        size);
+  _dbus_transport_disable_unix_fd_passing (connection->transport);
   CONNECTION_UNLOCK (connection);
 }
+#endif
 
-/**
- * Gets the value set by dbus_connection_set_max_message_size().
- *
- * @param connection the connection
- * @returns the max size of a single message
- */
-long
-dbus_connection_get_max_message_size (DBusConnection *connection)
+/** @} */
+
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+
+static void
+steal_new_connection (DBusServer     *server,
+                      DBusConnection *new_connection,
+                      void           *data)
 {
-  long res;
+  DBusConnection **connection_p = data;
 
-  _dbus_return_val_if_fail (connection != NULL, 0);
-  
-  CONNECTION_LOCK (connection);
-  res = _dbus_transport_get_max_message_size (connection->transport);
-  CONNECTION_UNLOCK (connection);
-  return res;
+  _dbus_assert (*connection_p == NULL);
+  *connection_p = dbus_connection_ref (new_connection);
 }
 
-/**
- * Specifies the maximum number of unix fds a message on this
- * connection is allowed to receive. Messages with more unix fds will
- * result in disconnecting the connection.
- *
- * @param connection a #DBusConnection
- * @param n maximum message unix fds the connection can receive
- */
-void
-dbus_connection_set_max_message_unix_fds (DBusConnection *connection,
-                                          long            n)
+static DBusMessage *
+wait_for_message (DBusConnection *connection)
 {
-  _dbus_return_if_fail (connection != NULL);
+  DBusMessage *message;
+
+  dbus_connection_flush (connection);
+
+  while ((message = dbus_connection_pop_message (connection)) == NULL)
+    {
+      if (!dbus_connection_read_write (connection, -1))
+        _dbus_assert_not_reached ("disconnected");
+    }
+
+  return message;
+}
+
+/* One method call from client to server and its reply */
+static void
+round_trip (DBusConnection *client,
+            DBusConnection *server)
+{
+  DBusMessage *message;
+  DBusMessage *reply;
+  dbus_uint32_t v_UINT32 = 42;
+
+  message = dbus_message_new_method_call (NULL, "/a", "com.example.Alloc",
+                                          "Ping");
+  if (message == NULL ||
+      !dbus_message_append_args (message, DBUS_TYPE_UINT32, &v_UINT32,
+                                 DBUS_TYPE_INVALID) ||
+      !dbus_connection_send (client, message, NULL))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_unref (message);
+
+  message = wait_for_message (server);
+  _dbus_assert (dbus_message_is_method_call (message, "com.example.Alloc",
+                                             "Ping"));
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL ||
+      !dbus_message_append_args (reply, DBUS_TYPE_UINT32, &v_UINT32,
+                                 DBUS_TYPE_INVALID) ||
+      !dbus_connection_send (server, reply, NULL))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_unref (reply);
+  dbus_message_unref (message);
+
+  message = wait_for_message (client);
+  _dbus_assert (dbus_message_get_type (message) ==
+                DBUS_MESSAGE_TYPE_METHOD_RETURN);
+  dbus_message_unref (message);
+}
+
+/* The same, but the client waits for the reply through a pending call */
+static void
+pending_round_trip (DBusConnection *client,
+                    DBusConnection *server)
+{
+  DBusMessage *message;
+  DBusMessage *reply;
+  DBusPendingCall *pending;
+
+  message = dbus_message_new_method_call (NULL, "/a", "com.example.Alloc",
+                                          "Ping");
+  if (message == NULL ||
+      !dbus_connection_send_with_reply (client, message, &pending, -1))
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (pending != NULL);
+  dbus_message_unref (message);
+
+  message = wait_for_message (server);
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL || !dbus_connection_send (server, reply, NULL))
+    _dbus_assert_not_reached ("no memory");
+  dbus_connection_flush (server);
+  dbus_message_unref (reply);
+  dbus_message_unref (message);
+
+  dbus_pending_call_block (pending);
+  reply = dbus_pending_call_steal_reply (pending);
+  _dbus_assert (dbus_message_get_type (reply) ==
+                DBUS_MESSAGE_TYPE_METHOD_RETURN);
+  dbus_message_unref (reply);
+  dbus_pending_call_unref (pending);
+}
+
+/* A call nobody answers gets the timeout error, built when it expires */
+static void
+check_pending_call_timeout (DBusConnection *client,
+                            DBusConnection *server)
+{
+  DBusMessage *message;
+  DBusMessage *reply;
+  DBusPendingCall *pending;
+  dbus_uint32_t serial;
+
+  message = dbus_message_new_method_call (NULL, "/a", "com.example.Alloc",
+                                          "Ignore");
+  if (message == NULL ||
+      !dbus_connection_send_with_reply (client, message, &pending, 10))
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (pending != NULL);
+  serial = dbus_message_get_serial (message);
+  dbus_message_unref (message);
+
+  message = wait_for_message (server);
+  dbus_message_unref (message);
+
+  dbus_pending_call_block (pending);
+  reply = dbus_pending_call_steal_reply (pending);
+  _dbus_assert (dbus_message_is_error (reply, DBUS_ERROR_NO_REPLY));
+  _dbus_assert (dbus_message_get_reply_serial (reply) == serial);
+  dbus_message_unref (reply);
+  dbus_pending_call_unref (pending);
+}
+
+#define MAX_UNTOGGLED_TIMEOUTS 4
+
+/* The timeouts an application without a DBusTimeoutToggledFunction
+ * has been given */
+static DBusTimeout *untoggled_timeouts[MAX_UNTOGGLED_TIMEOUTS];
+
+static dbus_bool_t
+add_untoggled_timeout (DBusTimeout *timeout,
+                       void        *data)
+{
+  int i;
+
+  for (i = 0; i < MAX_UNTOGGLED_TIMEOUTS; i++)
+    {
+      if (untoggled_timeouts[i] == NULL)
+        {
+          untoggled_timeouts[i] = timeout;
+          return TRUE;
+        }
+    }
+
+  _dbus_assert_not_reached ("too many timeouts");
+  return FALSE;
+}
+
+static void
+remove_untoggled_timeout (DBusTimeout *timeout,
+                          void        *data)
+{
+  int i;
+
+  for (i = 0; i < MAX_UNTOGGLED_TIMEOUTS; i++)
+    {
+      if (untoggled_timeouts[i] == timeout)
+        {
+          untoggled_timeouts[i] = NULL;
+          return;
+        }
+    }
+
+  _dbus_assert_not_reached ("removed a timeout that wasn't added");
+}
+
+/* Returns the only timeout the application has, which must be enabled */
+static DBusTimeout *
+get_untoggled_timeout (void)
+{
+  DBusTimeout *timeout = NULL;
+  int i;
+
+  for (i = 0; i < MAX_UNTOGGLED_TIMEOUTS; i++)
+    {
+      if (untoggled_timeouts[i] != NULL)
+        {
+          _dbus_assert (timeout == NULL);
+          timeout = untoggled_timeouts[i];
+        }
+    }
+
+  _dbus_assert (timeout != NULL);
+  _dbus_assert (dbus_timeout_get_enabled (timeout));
+  return timeout;
+}
+
+/* An application that can't be told about a timeout being toggled
+ * still sees the pending call timeout enabled, and with the interval
+ * of the earliest deadline, and has it taken away once no call is
+ * waiting */
+static void
+check_pending_call_timeout_untoggled (DBusConnection *client,
+                                      DBusConnection *server)
+{
+  DBusMessage *message;
+  DBusMessage *reply;
+  DBusPendingCall *slow;
+  DBusPendingCall *fast;
+  DBusTimeout *timeout;
+  int i;
+
+  if (!dbus_connection_set_timeout_functions (client, add_untoggled_timeout,
+                                              remove_untoggled_timeout,
+                                              NULL, NULL, NULL))
+    _dbus_assert_not_reached ("no memory");
+
+  /* the timeout may still be set for a call that has since had its
+   * reply; when it fires, it finds nothing else to wait for */
+  for (i = 0; i < MAX_UNTOGGLED_TIMEOUTS; i++)
+    {
+      if (untoggled_timeouts[i] != NULL)
+        dbus_timeout_handle (untoggled_timeouts[i]);
+    }
+
+  for (i = 0; i < MAX_UNTOGGLED_TIMEOUTS; i++)
+    _dbus_assert (untoggled_timeouts[i] == NULL);
+
+  message = dbus_message_new_method_call (NULL, "/a", "com.example.Alloc",
+                                          "Ignore");
+  if (message == NULL ||
+      !dbus_connection_send_with_reply (client, message, &slow, 60000))
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (slow != NULL);
+  dbus_message_unref (message);
+
+  timeout = get_untoggled_timeout ();
+  _dbus_assert (dbus_timeout_get_interval (timeout) > 10);
+
+  message = dbus_message_new_method_call (NULL, "/a", "com.example.Alloc",
+                                          "Ignore");
+  if (message == NULL ||
+      !dbus_connection_send_with_reply (client, message, &fast, 10))
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (fast != NULL);
+  dbus_message_unref (message);
+
+  timeout = get_untoggled_timeout ();
+  _dbus_assert (dbus_timeout_get_interval (timeout) <= 10);
+
+  for (i = 0; i < 2; i++)
+    {
+      message = wait_for_message (server);
+      dbus_message_unref (message);
+    }
+
+  _dbus_sleep_milliseconds (20);
+  dbus_timeout_handle (timeout);
+
+  while (dbus_connection_dispatch (client) == DBUS_DISPATCH_DATA_REMAINS)
+    ;
 
-  CONNECTION_LOCK (connection);
-  _dbus_transport_set_max_message_unix_fds (connection->transport,
-                                            n);
-  CONNECTION_UNLOCK (connection);
+  _dbus_assert (dbus_pending_call_get_completed (fast));
+  reply = dbus_pending_call_steal_reply (fast);
+  _dbus_assert (dbus_message_is_error (reply, DBUS_ERROR_NO_REPLY));
+  dbus_message_unref (reply);
+  dbus_pending_call_unref (fast);
+
+  /* set again for the slow call */
+  _dbus_assert (!dbus_pending_call_get_completed (slow));
+  timeout = get_untoggled_timeout ();
+  _dbus_assert (dbus_timeout_get_interval (timeout) > 10);
+
+  /* once that's gone, firing finds nothing left to wait for */
+  dbus_pending_call_cancel (slow);
+  dbus_pending_call_unref (slow);
+  dbus_timeout_handle (timeout);
+
+  for (i = 0; i < MAX_UNTOGGLED_TIMEOUTS; i++)
+    _dbus_assert (untoggled_timeouts[i] == NULL);
+
+  if (!dbus_connection_set_timeout_functions (client, NULL, NULL, NULL,
+                                              NULL, NULL))
+    _dbus_assert_not_reached ("can't fail");
 }
 
-/**
- * Gets the value set by dbus_connection_set_max_message_unix_fds().
- *
- * @param connection the connection
- * @returns the max numer of unix fds of a single message
- */
-long
-dbus_connection_get_max_message_unix_fds (DBusConnection *connection)
+#define MULTI_PEERS 3
+
+/* One message queued on several connections at once arrives on each
+ * with the same serial, and each connection's outgoing size goes back
+ * to zero once it has been written */
+static void
+check_send_multi (DBusServer *listener)
 {
-  long res;
+  DBusConnection *clients[MULTI_PEERS];
+  DBusConnection *servers[MULTI_PEERS];
+  DBusError error = DBUS_ERROR_INIT;
+  DBusMessage *message;
+  dbus_uint32_t serial;
+  int i;
 
-  _dbus_return_val_if_fail (connection != NULL, 0);
+  for (i = 0; i < MULTI_PEERS; i++)
+    {
+      servers[i] = NULL;
+      dbus_server_set_new_connection_function (listener, steal_new_connection,
+                                               &servers[i], NULL);
+
+      clients[i] = dbus_connection_open_private ("debug-pipe:name=connection-test",
+                                                 &error);
+      if (clients[i] == NULL)
+        _dbus_assert_not_reached ("no memory");
+      _dbus_assert (servers[i] != NULL);
+
+      while (!dbus_connection_get_is_authenticated (clients[i]) ||
+             !dbus_connection_get_is_authenticated (servers[i]))
+        {
+          dbus_connection_read_write (clients[i], 10);
+          dbus_connection_read_write (servers[i], 10);
+        }
+    }
 
-  CONNECTION_LOCK (connection);
-  res = _dbus_transport_get_max_message_unix_fds (connection->transport);
-  CONNECTION_UNLOCK (connection);
-  return res;
+  message = dbus_message_new_signal ("/a", "com.example.Multi", "Tick");
+  if (message == NULL ||
+      !dbus_connection_send_multi (servers, MULTI_PEERS, message, &serial))
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (serial != 0);
+  _dbus_assert (serial == dbus_message_get_serial (message));
+  dbus_message_unref (message);
+
+  for (i = 0; i < MULTI_PEERS; i++)
+    {
+      dbus_connection_flush (servers[i]);
+      _dbus_assert (dbus_connection_get_outgoing_size (servers[i]) == 0);
+
+      message = wait_for_message (clients[i]);
+      _dbus_assert (dbus_message_is_signal (message, "com.example.Multi",
+                                            "Tick"));
+      _dbus_assert (dbus_message_get_serial (message) == serial);
+      dbus_message_unref (message);
+    }
+
+  for (i = 0; i < MULTI_PEERS; i++)
+    {
+      dbus_connection_close (clients[i]);
+      dbus_connection_unref (clients[i]);
+      dbus_connection_close (servers[i]);
+      dbus_connection_unref (servers[i]);
+    }
 }
 
-/**
- * Sets the maximum total number of bytes that can be used for all messages
- * received on this connection. Messages count toward the maximum until
- * they are finalized. When the maximum is reached, the connection will
- * not read more data until some messages are finalized.
- *
- * The semantics of the maximum are: if outstanding messages are
- * already above the maximum, additional messages will not be read.
- * The semantics are not: if the next message would cause us to exceed
- * the maximum, we don't read it. The reason is that we don't know the
- * size of a message until after we read it.
- *
- * Thus, the max live messages size can actually be exceeded
- * by up to the maximum size of a single message.
- * 
- * Also, if we read say 1024 bytes off the wire in a single read(),
- * and that contains a half-dozen small messages, we may exceed the
- * size max by that amount. But this should be inconsequential.
- *
- * This does imply that we can't call read() with a buffer larger
- * than we're willing to exceed this limit by.
- *
- * @param connection the connection
- * @param size the maximum size in bytes of all outstanding messages
- */
-void
-dbus_connection_set_max_received_size (DBusConnection *connection,
-                                       long            size)
+#define QUEUED_CALLS 3
+
+static DBusHandlerResult
+queued_call_handler (DBusConnection *connection,
+                     DBusMessage    *message,
+                     void           *user_data)
 {
-  _dbus_return_if_fail (connection != NULL);
-  
-  CONNECTION_LOCK (connection);
-  _dbus_transport_set_max_received_size (connection->transport,
-                                         size);
-  CONNECTION_UNLOCK (connection);
+  dbus_uint32_t *serials = user_data;
+  DBusMessage *reply;
+  int i;
+
+  for (i = 0; serials[i] != 0; i++)
+    ;
+
+  _dbus_assert (i < QUEUED_CALLS);
+  serials[i] = dbus_message_get_serial (message);
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL || !dbus_connection_send (connection, reply, NULL))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_unref (reply);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
 }
 
-/**
- * Gets the value set by dbus_connection_set_max_received_size().
- *
- * @param connection the connection
- * @returns the max size of all live messages
- */
-long
-dbus_connection_get_max_received_size (DBusConnection *connection)
+/* With dispatch queues, dispatching doesn't call object path handlers;
+ * a worker does, in order for each path, and answers calls to paths
+ * nobody handles with an error */
+static void
+check_dispatch_queues (DBusConnection *client,
+                       DBusConnection *server)
 {
-  long res;
+  DBusObjectPathVTable vtable = { NULL, queued_call_handler };
+  dbus_uint32_t sent[QUEUED_CALLS + 1];
+  dbus_uint32_t handled[QUEUED_CALLS + 1] = { 0 };
+  DBusMessage *message;
+  int i, n_replies;
 
-  _dbus_return_val_if_fail (connection != NULL, 0);
-  
-  CONNECTION_LOCK (connection);
-  res = _dbus_transport_get_max_received_size (connection->transport);
-  CONNECTION_UNLOCK (connection);
-  return res;
+  if (!dbus_connection_register_object_path (server, "/queued", &vtable,
+                                             handled) ||
+      !dbus_connection_set_dispatch_queues (server, 4))
+    _dbus_assert_not_reached ("no memory");
+
+  for (i = 0; i <= QUEUED_CALLS; i++)
+    {
+      message = dbus_message_new_method_call (NULL,
+                                              i < QUEUED_CALLS ? "/queued" : "/nowhere",
+                                              "com.example.Queued", "Call");
+      if (message == NULL ||
+          !dbus_connection_send (client, message, &sent[i]))
+        _dbus_assert_not_reached ("no memory");
+      dbus_message_unref (message);
+    }
+
+  dbus_connection_flush (client);
+
+  /* dispatching only queues the calls */
+  while (dbus_connection_get_dispatch_status (server) != DBUS_DISPATCH_DATA_REMAINS)
+    dbus_connection_read_write (server, -1);
+
+  dbus_connection_dispatch (server);
+  _dbus_assert (handled[0] == 0);
+
+  for (n_replies = 0; n_replies <= QUEUED_CALLS; )
+    {
+      dbus_connection_read_write (server, 0);
+
+      while (dbus_connection_dispatch (server) == DBUS_DISPATCH_DATA_REMAINS)
+        ;
+
+      for (i = 0; i <= QUEUED_CALLS; i++)
+        _dbus_assert (dbus_connection_dispatch_worker (server, 0));
+
+      dbus_connection_flush (server);
+
+      message = dbus_connection_pop_message (client);
+      if (message == NULL)
+        {
+          dbus_connection_read_write (client, 10);
+          continue;
+        }
+
+      if (dbus_message_get_reply_serial (message) == sent[QUEUED_CALLS])
+        _dbus_assert (dbus_message_is_error (message,
+                                             DBUS_ERROR_UNKNOWN_METHOD));
+      else
+        _dbus_assert (dbus_message_get_type (message) ==
+                      DBUS_MESSAGE_TYPE_METHOD_RETURN);
+
+      dbus_message_unref (message);
+      n_replies += 1;
+    }
+
+  for (i = 0; i < QUEUED_CALLS; i++)
+    _dbus_assert (handled[i] == sent[i]);
+
+  /* once stopped and empty, workers are told to return */
+  if (!dbus_connection_set_dispatch_queues (server, 0))
+    _dbus_assert_not_reached ("stopping can't fail");
+  _dbus_assert (!dbus_connection_dispatch_worker (server, -1));
+
+  dbus_connection_unregister_object_path (server, "/queued");
 }
 
-/**
- * Sets the maximum total number of unix fds that can be used for all messages
- * received on this connection. Messages count toward the maximum until
- * they are finalized. When the maximum is reached, the connection will
- * not read more data until some messages are finalized.
- *
- * The semantics are analogous to those of dbus_connection_set_max_received_size().
- *
- * @param connection the connection
- * @param n the maximum size in bytes of all outstanding messages
- */
-void
-dbus_connection_set_max_received_unix_fds (DBusConnection *connection,
-                                           long            n)
+static void
+queue_signal (DBusConnection *connection,
+              const char     *member,
+              const char     *destination)
 {
-  _dbus_return_if_fail (connection != NULL);
+  DBusMessage *message;
 
-  CONNECTION_LOCK (connection);
-  _dbus_transport_set_max_received_unix_fds (connection->transport,
-                                             n);
-  CONNECTION_UNLOCK (connection);
+  message = dbus_message_new_signal ("/ttl", "com.example.Ttl", member);
+  if (message == NULL ||
+      (destination != NULL &&
+       !dbus_message_set_destination (message, destination)) ||
+      !dbus_connection_send (connection, message, NULL))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_unref (message);
 }
 
-/**
- * Gets the value set by dbus_connection_set_max_received_unix_fds().
- *
- * @param connection the connection
- * @returns the max unix fds of all live messages
- */
-long
-dbus_connection_get_max_received_unix_fds (DBusConnection *connection)
+/* Broadcasts that have waited in the queue for longer than the TTL
+ * are dropped when the next one is queued, but not the oldest one,
+ * which may be half written, nor signals with a destination */
+static void
+check_broadcast_ttl (DBusConnection *client,
+                     DBusConnection *server)
 {
-  long res;
+  static const char * const expected[] = { "A", "Unicast", "D" };
+  DBusMessage *message;
+  unsigned int i;
 
-  _dbus_return_val_if_fail (connection != NULL, 0);
+  /* leave everything queued until the flush */
+  dbus_connection_set_max_unflushed_size (server, 1024 * 1024);
+  _dbus_connection_set_broadcast_ttl (server, 1);
 
-  CONNECTION_LOCK (connection);
-  res = _dbus_transport_get_max_received_unix_fds (connection->transport);
-  CONNECTION_UNLOCK (connection);
-  return res;
-}
+  queue_signal (server, "A", NULL);
+  queue_signal (server, "B", NULL);
+  queue_signal (server, "Unicast", ":1.1");
+  queue_signal (server, "C", NULL);
+  _dbus_assert (server->n_outgoing == 4);
 
-/**
- * Gets the approximate size in bytes of all messages in the outgoing
- * message queue. The size is approximate in that you shouldn't use
- * it to decide how many bytes to read off the network or anything
- * of that nature, as optimizations may choose to tell small white lies
- * to avoid performance overhead.
- *
- * @param connection the connection
- * @returns the number of bytes that have been queued up but not sent
- */
-long
-dbus_connection_get_outgoing_size (DBusConnection *connection)
-{
-  long res;
+  _dbus_sleep_milliseconds (10);
+  queue_signal (server, "D", NULL);
+  _dbus_assert (server->n_outgoing == 3);
+  _dbus_assert (server->n_expired_broadcasts == 2);
 
-  _dbus_return_val_if_fail (connection != NULL, 0);
+  dbus_connection_flush (server);
 
-  CONNECTION_LOCK (connection);
-  res = _dbus_counter_get_size_value (connection->outgoing_counter);
-  CONNECTION_UNLOCK (connection);
-  return res;
+  for (i = 0; i < _DBUS_N_ELEMENTS (expected); i++)
+    {
+      message = wait_for_message (client);
+      _dbus_assert (dbus_message_has_member (message, expected[i]));
+      dbus_message_unref (message);
+    }
+
+  _dbus_connection_set_broadcast_ttl (server, 0);
+  dbus_connection_set_max_unflushed_size (server, 0);
 }
 
-#ifdef DBUS_ENABLE_STATS
-void
-_dbus_connection_get_stats (DBusConnection *connection,
-                            dbus_uint32_t  *in_messages,
-                            dbus_uint32_t  *in_bytes,
-                            dbus_uint32_t  *in_fds,
-                            dbus_uint32_t  *in_peak_bytes,
-                            dbus_uint32_t  *in_peak_fds,
-                            dbus_uint32_t  *out_messages,
-                            dbus_uint32_t  *out_bytes,
-                            dbus_uint32_t  *out_fds,
-                            dbus_uint32_t  *out_peak_bytes,
-                            dbus_uint32_t  *out_peak_fds)
+#define WARM_UP_ROUND_TRIPS 100
+#define COUNTED_ROUND_TRIPS 1000
+
+/* Once the caches have warmed up, sending a message, receiving it,
+ * replying and receiving the reply does not allocate anything, and
+ * nor does waiting for the reply through a pending call */
+dbus_bool_t
+_dbus_connection_test (void)
 {
-  CONNECTION_LOCK (connection);
+  DBusServer *listener;
+  DBusConnection *client;
+  DBusConnection *server = NULL;
+  DBusError error = DBUS_ERROR_INIT;
+  int i, allocations;
 
-  if (in_messages != NULL)
-    *in_messages = connection->n_incoming;
+  listener = dbus_server_listen ("debug-pipe:name=connection-test", &error);
+  if (listener == NULL)
+    _dbus_assert_not_reached ("no memory");
 
-  _dbus_transport_get_stats (connection->transport,
-                             in_bytes, in_fds, in_peak_bytes, in_peak_fds);
+  dbus_server_set_new_connection_function (listener, steal_new_connection,
+                                           &server, NULL);
 
-  if (out_messages != NULL)
-    *out_messages = connection->n_outgoing;
+  client = dbus_connection_open_private ("debug-pipe:name=connection-test",
+                                         &error);
+  if (client == NULL)
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (server != NULL);
 
-  if (out_bytes != NULL)
-    *out_bytes = _dbus_counter_get_size_value (connection->outgoing_counter);
+  while (!dbus_connection_get_is_authenticated (client) ||
+         !dbus_connection_get_is_authenticated (server))
+    {
+      dbus_connection_read_write (client, 10);
+      dbus_connection_read_write (server, 10);
+    }
 
-  if (out_fds != NULL)
-    *out_fds = _dbus_counter_get_unix_fd_value (connection->outgoing_counter);
+  for (i = 0; i < WARM_UP_ROUND_TRIPS; i++)
+    round_trip (client, server);
 
-  if (out_peak_bytes != NULL)
-    *out_peak_bytes = _dbus_counter_get_peak_size_value (connection->outgoing_counter);
+  allocations = _dbus_get_malloc_calls ();
 
-  if (out_peak_fds != NULL)
-    *out_peak_fds = _dbus_counter_get_peak_unix_fd_value (connection->outgoing_counter);
+  for (i = 0; i < COUNTED_ROUND_TRIPS; i++)
+    round_trip (client, server);
 
-  CONNECTION_UNLOCK (connection);
-}
-#endif /* DBUS_ENABLE_STATS */
+  allocations = _dbus_get_malloc_calls () - allocations;
+  _dbus_verbose ("%d allocations in %d round trips\n", allocations,
+                 COUNTED_ROUND_TRIPS);
 
-/**
- * Gets the approximate number of uni fds of all messages in the
- * outgoing message queue.
- *
- * @param connection the connection
- * @returns the number of unix fds that have been queued up but not sent
- */
-long
-dbus_connection_get_outgoing_unix_fds (DBusConnection *connection)
-{
-  long res;
+  /* without the pools, every list link is allocated separately */
+  if (!_dbus_disable_mem_pools ())
+    _dbus_assert (allocations == 0);
 
-  _dbus_return_val_if_fail (connection != NULL, 0);
+  check_pending_call_timeout (client, server);
+  check_pending_call_timeout_untoggled (client, server);
 
-  CONNECTION_LOCK (connection);
-  res = _dbus_counter_get_unix_fd_value (connection->outgoing_counter);
-  CONNECTION_UNLOCK (connection);
-  return res;
-}
+  for (i = 0; i < WARM_UP_ROUND_TRIPS; i++)
+    pending_round_trip (client, server);
 
-#ifdef DBUS_ENABLE_EMBEDDED_TESTS
-/**
- * Returns the address of the transport object of this connection
- *
- * @param connection the connection
- * @returns the address string
- */
-const char*
-_dbus_connection_get_address (DBusConnection *connection)
-{
-  return _dbus_transport_get_address (connection->transport);
+  allocations = _dbus_get_malloc_calls ();
+
+  for (i = 0; i < COUNTED_ROUND_TRIPS; i++)
+    pending_round_trip (client, server);
+
+  allocations = _dbus_get_malloc_calls () - allocations;
+  _dbus_verbose ("%d allocations in %d round trips with pending calls\n",
+                 allocations, COUNTED_ROUND_TRIPS);
+
+  if (!_dbus_disable_mem_pools ())
+    _dbus_assert (allocations == 0);
+
+  check_send_multi (listener);
+  check_dispatch_queues (client, server);
+  check_broadcast_ttl (client, server);
+
+  dbus_connection_close (client);
+  dbus_connection_unref (client);
+  dbus_connection_close (server);
+  dbus_connection_unref (server);
+  dbus_server_disconnect (listener);
+  dbus_server_unref (listener);
+
+  return TRUE;
 }
-#endif
 
-/** @} */
+#endif /* DBUS_ENABLE_EMBEDDED_TESTS */
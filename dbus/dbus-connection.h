@@ -219,12 +219,26 @@ DBusDispatchStatus dbus_connection_get_dispatch_status          (DBusConnection
 DBUS_EXPORT
 DBusDispatchStatus dbus_connection_dispatch                     (DBusConnection             *connection);
 DBUS_EXPORT
+DBusDispatchStatus dbus_connection_dispatch_batch               (DBusConnection             *connection,
+                                                                 int                         max_messages);
+DBUS_EXPORT
+dbus_bool_t        dbus_connection_set_dispatch_queues          (DBusConnection             *connection,
+                                                                 int                         n_queues);
+DBUS_EXPORT
+dbus_bool_t        dbus_connection_dispatch_worker              (DBusConnection             *connection,
+                                                                 int                         timeout_milliseconds);
+DBUS_EXPORT
 dbus_bool_t        dbus_connection_has_messages_to_send         (DBusConnection *connection);
 DBUS_EXPORT
 dbus_bool_t        dbus_connection_send                         (DBusConnection             *connection,
                                                                  DBusMessage                *message,
                                                                  dbus_uint32_t              *client_serial);
 DBUS_EXPORT
+dbus_bool_t        dbus_connection_send_multi                   (DBusConnection            **connections,
+                                                                 int                         n_connections,
+                                                                 DBusMessage                *message,
+                                                                 dbus_uint32_t              *client_serial);
+DBUS_EXPORT
 dbus_bool_t        dbus_connection_send_with_reply              (DBusConnection             *connection,
                                                                  DBusMessage                *message,
                                                                  DBusPendingCall           **pending_return,
@@ -329,6 +343,21 @@ void dbus_connection_set_max_received_size (DBusConnection *connection,
                                             long            size);
 DBUS_EXPORT
 long dbus_connection_get_max_received_size (DBusConnection *connection);
+DBUS_EXPORT
+void dbus_connection_set_max_unflushed_size (DBusConnection *connection,
+                                             long            size);
+DBUS_EXPORT
+long dbus_connection_get_max_unflushed_size (DBusConnection *connection);
+DBUS_EXPORT
+void dbus_connection_set_busy_poll          (DBusConnection *connection,
+                                             int             microseconds);
+DBUS_EXPORT
+int  dbus_connection_get_busy_poll          (DBusConnection *connection);
+DBUS_EXPORT
+void        dbus_connection_set_trust_message_bodies (DBusConnection *connection,
+                                                      dbus_bool_t     trust);
+DBUS_EXPORT
+dbus_bool_t dbus_connection_get_trust_message_bodies (DBusConnection *connection);
 
 DBUS_EXPORT
 void dbus_connection_set_max_message_unix_fds (DBusConnection *connection,
@@ -346,6 +375,11 @@ long dbus_connection_get_outgoing_size     (DBusConnection *connection);
 DBUS_EXPORT
 long dbus_connection_get_outgoing_unix_fds (DBusConnection *connection);
 
+DBUS_EXPORT
+dbus_bool_t dbus_connection_signal_has_subscribers (DBusConnection *connection,
+                                                    const char     *interface,
+                                                    const char     *member);
+
 DBUS_EXPORT
 DBusPreallocatedSend* dbus_connection_preallocate_send       (DBusConnection       *connection);
 DBUS_EXPORT
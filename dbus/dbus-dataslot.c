@@ -198,6 +198,7 @@ _dbus_data_slot_list_init (DBusDataSlotList *list)
 {
   list->slots = NULL;
   list->n_slots = 0;
+  list->retired = NULL;
 }
 
 /**
@@ -244,21 +245,40 @@ _dbus_data_slot_list_set  (DBusDataSlotAllocator *allocator,
     {
       DBusDataSlot *tmp;
       int i;
-      
-      tmp = dbus_realloc (list->slots,
-                          sizeof (DBusDataSlot) * (slot + 1));
+
+      /* _dbus_data_slot_list_get() doesn't lock, so rather than
+       * realloc() the array, publish a new one, and keep the old one
+       * until the list is freed in case a reader is still using it. */
+      tmp = dbus_new (DBusDataSlot, slot + 1);
       if (tmp == NULL)
         return FALSE;
-      
-      list->slots = tmp;
-      i = list->n_slots;
-      list->n_slots = slot + 1;
+
+      if (list->slots != NULL &&
+          !_dbus_list_prepend (&list->retired, list->slots))
+        {
+          dbus_free (tmp);
+          return FALSE;
+        }
+
+      i = 0;
       while (i < list->n_slots)
         {
-          list->slots[i].data = NULL;
-          list->slots[i].free_data_func = NULL;
+          tmp[i] = list->slots[i];
           ++i;
         }
+
+      while (i < slot + 1)
+        {
+          tmp[i].data = NULL;
+          tmp[i].free_data_func = NULL;
+          ++i;
+        }
+
+      /* A reader that sees the new length must see the new array */
+      _dbus_memory_barrier ();
+      list->slots = tmp;
+      _dbus_memory_barrier ();
+      list->n_slots = slot + 1;
     }
 
   _dbus_assert (slot < list->n_slots);
@@ -276,6 +296,11 @@ _dbus_data_slot_list_set  (DBusDataSlotAllocator *allocator,
  * Retrieves data previously set with _dbus_data_slot_list_set_data().
  * The slot must still be allocated (must not have been freed).
  *
+ * This doesn't need the lock that serializes calls to
+ * _dbus_data_slot_list_set(), so bindings can look up their wrapper
+ * objects without taking a mutex; the result is either the old or
+ * the new data if the slot is being set at the same time.
+ *
  * @param allocator the allocator slot was allocated from
  * @param list the data slot list
  * @param slot the slot to get data from
@@ -286,6 +311,9 @@ _dbus_data_slot_list_get  (DBusDataSlotAllocator *allocator,
                            DBusDataSlotList      *list,
                            int                    slot)
 {
+  DBusDataSlot *slots;
+  int n_slots;
+
 #ifndef DBUS_DISABLE_ASSERT
   /* We need to take the allocator lock here, because the allocator could
    * be e.g. realloc()ing allocated_slots. We avoid doing this if asserts
@@ -301,10 +329,15 @@ _dbus_data_slot_list_get  (DBusDataSlotAllocator *allocator,
   _dbus_unlock (allocator->lock);
 #endif
 
-  if (slot >= list->n_slots)
+  /* Pairs with the barriers in _dbus_data_slot_list_set() */
+  n_slots = list->n_slots;
+  _dbus_memory_barrier ();
+  slots = list->slots;
+
+  if (slot >= n_slots)
     return NULL;
   else
-    return list->slots[slot].data;
+    return slots[slot].data;
 }
 
 /**
@@ -344,6 +377,9 @@ _dbus_data_slot_list_free (DBusDataSlotList *list)
   dbus_free (list->slots);
   list->slots = NULL;
   list->n_slots = 0;
+
+  _dbus_list_foreach (&list->retired, (DBusForeachFunction) dbus_free, NULL);
+  _dbus_list_clear (&list->retired);
 }
 
 /** @} */
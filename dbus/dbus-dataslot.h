@@ -24,6 +24,7 @@
 #define DBUS_DATASLOT_H
 
 #include <dbus/dbus-internals.h>
+#include <dbus/dbus-list.h>
 
 DBUS_BEGIN_DECLS
 
@@ -70,6 +71,7 @@ struct DBusDataSlotList
 {
   DBusDataSlot *slots;   /**< Data slots */
   int           n_slots; /**< Slots we have storage for in data_slots */
+  DBusList     *retired; /**< Replaced arrays lock-free readers may still use */
 };
 
 dbus_bool_t _dbus_data_slot_allocator_init  (DBusDataSlotAllocator  *allocator,
@@ -0,0 +1,476 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-dispatch-queues.c  Per-object-path queues of messages for worker threads
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "dbus-dispatch-queues.h"
+#include "dbus-message.h"
+#include "dbus-threads-internal.h"
+#include "dbus-test.h"
+
+/**
+ * @defgroup DBusDispatchQueues Per-object-path dispatch queues
+ * @ingroup  DBusInternals
+ * @brief Messages waiting for a worker thread to run them through the object tree
+ *
+ * Each message goes to one of a fixed number of FIFO queues, chosen by
+ * a hash of its object path, so that messages for the same object stay
+ * in the order they arrived. A queue is handed to one worker at a time:
+ * while a worker is dispatching a message from it, the queue is busy
+ * and other workers take messages from other queues. Queues that have
+ * messages and aren't busy wait their turn on a ring, so that a busy
+ * object can't starve the others.
+ *
+ * The queues have their own lock, which is never held while calling
+ * out or while taking the connection lock.
+ *
+ * @{
+ */
+
+typedef struct
+{
+  DBusList *messages;   /**< Links from the connection's incoming queue */
+  dbus_bool_t busy;     /**< A worker is dispatching a message from it */
+} DispatchQueue;
+
+struct DBusDispatchQueues
+{
+  DBusCMutex *mutex;         /**< Protects everything below */
+  DBusCondVar *ready_cond;   /**< Signalled when a queue becomes ready, or on stopping */
+  int n_queues;
+  DispatchQueue *queues;
+  int *ready;                /**< Ring of queues that have messages and aren't busy */
+  int ready_head;            /**< Index in ready of the one that has waited longest */
+  int n_ready;
+  dbus_bool_t stopped;       /**< No more messages are accepted */
+};
+
+/* FNV-1a; the worst an unlucky set of paths can do is share a queue */
+static unsigned int
+path_hash (const char *path)
+{
+  const unsigned char *p;
+  unsigned int h = 2166136261u;
+
+  for (p = (const unsigned char *) path; *p != '\0'; p++)
+    {
+      h ^= *p;
+      h *= 16777619u;
+    }
+
+  return h;
+}
+
+/* Called with the lock held, for a queue that has just been given
+ * messages or stopped being busy */
+static void
+make_ready (DBusDispatchQueues *queues,
+            int                 queue)
+{
+  _dbus_assert (queues->n_ready < queues->n_queues);
+
+  queues->ready[(queues->ready_head + queues->n_ready) % queues->n_queues] = queue;
+  queues->n_ready += 1;
+  _dbus_condvar_wake_one (queues->ready_cond);
+}
+
+/**
+ * Creates a set of dispatch queues.
+ *
+ * @param n_queues how many queues to share object paths between
+ * @returns the queues, or #NULL if there is no memory
+ */
+DBusDispatchQueues *
+_dbus_dispatch_queues_new (int n_queues)
+{
+  DBusDispatchQueues *queues;
+
+  _dbus_assert (n_queues > 0);
+
+  queues = dbus_new0 (DBusDispatchQueues, 1);
+  if (queues == NULL)
+    return NULL;
+
+  queues->n_queues = n_queues;
+  queues->queues = dbus_new0 (DispatchQueue, n_queues);
+  queues->ready = dbus_new (int, n_queues);
+
+  if (queues->queues == NULL || queues->ready == NULL)
+    goto failed;
+
+  _dbus_cmutex_new_at_location (&queues->mutex);
+  if (queues->mutex == NULL)
+    goto failed;
+
+  _dbus_condvar_new_at_location (&queues->ready_cond);
+  if (queues->ready_cond == NULL)
+    goto failed;
+
+  return queues;
+
+ failed:
+  _dbus_cmutex_free_at_location (&queues->mutex);
+  dbus_free (queues->ready);
+  dbus_free (queues->queues);
+  dbus_free (queues);
+  return NULL;
+}
+
+/**
+ * Frees the queues, unreferencing any messages still in them. No
+ * worker may be using them.
+ *
+ * @param queues the queues
+ */
+void
+_dbus_dispatch_queues_free (DBusDispatchQueues *queues)
+{
+  DBusList *link;
+  int i;
+
+  for (i = 0; i < queues->n_queues; i++)
+    {
+      _dbus_assert (!queues->queues[i].busy);
+
+      while ((link = _dbus_list_pop_first_link (&queues->queues[i].messages)) != NULL)
+        {
+          dbus_message_unref (link->data);
+          _dbus_list_free_link (link);
+        }
+    }
+
+  _dbus_condvar_free_at_location (&queues->ready_cond);
+  _dbus_cmutex_free_at_location (&queues->mutex);
+  dbus_free (queues->ready);
+  dbus_free (queues->queues);
+  dbus_free (queues);
+}
+
+/**
+ * Gets the number of queues object paths are shared between.
+ *
+ * @param queues the queues
+ * @returns the number of queues
+ */
+int
+_dbus_dispatch_queues_get_size (DBusDispatchQueues *queues)
+{
+  return queues->n_queues;
+}
+
+/**
+ * Appends a message to the queue for its object path, taking
+ * ownership of the link and of the reference to the message it
+ * holds. Never fails for lack of memory, because the link is reused.
+ *
+ * @param queues the queues
+ * @param message_link a link whose data is a method call or signal
+ * @returns #FALSE, leaving the link with the caller, if the queues
+ *  have been stopped
+ */
+dbus_bool_t
+_dbus_dispatch_queues_push (DBusDispatchQueues *queues,
+                            DBusList           *message_link)
+{
+  DispatchQueue *queue;
+  int i;
+
+  i = path_hash (dbus_message_get_path (message_link->data)) % queues->n_queues;
+  queue = &queues->queues[i];
+
+  _dbus_cmutex_lock (queues->mutex);
+
+  if (queues->stopped)
+    {
+      _dbus_cmutex_unlock (queues->mutex);
+      return FALSE;
+    }
+
+  if (queue->messages == NULL && !queue->busy)
+    make_ready (queues, i);
+
+  _dbus_list_append_link (&queue->messages, message_link);
+
+  _dbus_cmutex_unlock (queues->mutex);
+  return TRUE;
+}
+
+/**
+ * Takes the next message from the queue that has waited longest to
+ * be ready, and marks that queue busy until
+ * _dbus_dispatch_queues_done() or _dbus_dispatch_queues_putback() is
+ * called for it. If no queue is ready, waits for one, unless the
+ * queues have been stopped.
+ *
+ * @param queues the queues
+ * @param timeout_milliseconds how long to wait, or -1 to wait for as
+ *  long as it takes; a wakeup that another worker got to first can
+ *  end the wait early
+ * @param queue_p return location for the queue the message came from
+ * @param stopped_p return location for whether the queues are stopped
+ * @returns a link whose data is the message, or #NULL if there is
+ *  none
+ */
+DBusList *
+_dbus_dispatch_queues_pop (DBusDispatchQueues *queues,
+                           int                 timeout_milliseconds,
+                           int                *queue_p,
+                           dbus_bool_t        *stopped_p)
+{
+  DBusList *link = NULL;
+  int i;
+
+  _dbus_cmutex_lock (queues->mutex);
+
+  if (timeout_milliseconds < 0)
+    {
+      while (queues->n_ready == 0 && !queues->stopped)
+        _dbus_condvar_wait (queues->ready_cond, queues->mutex);
+    }
+  else if (timeout_milliseconds > 0 &&
+           queues->n_ready == 0 && !queues->stopped)
+    {
+      _dbus_condvar_wait_timeout (queues->ready_cond, queues->mutex,
+                                  timeout_milliseconds);
+    }
+
+  if (queues->n_ready > 0)
+    {
+      i = queues->ready[queues->ready_head];
+      queues->ready_head = (queues->ready_head + 1) % queues->n_queues;
+      queues->n_ready -= 1;
+
+      _dbus_assert (!queues->queues[i].busy);
+      queues->queues[i].busy = TRUE;
+      link = _dbus_list_pop_first_link (&queues->queues[i].messages);
+      _dbus_assert (link != NULL);
+      *queue_p = i;
+    }
+
+  /* There's no way to wake every waiting worker at once, so each one
+   * woken by stopping wakes the next */
+  if (queues->stopped)
+    _dbus_condvar_wake_one (queues->ready_cond);
+
+  *stopped_p = queues->stopped;
+
+  _dbus_cmutex_unlock (queues->mutex);
+  return link;
+}
+
+/**
+ * Says that the worker has finished with the message it got from
+ * @p queue, so that the queue's next message can be dispatched.
+ *
+ * @param queues the queues
+ * @param queue the queue the message came from
+ */
+void
+_dbus_dispatch_queues_done (DBusDispatchQueues *queues,
+                            int                 queue)
+{
+  _dbus_cmutex_lock (queues->mutex);
+
+  _dbus_assert (queues->queues[queue].busy);
+  queues->queues[queue].busy = FALSE;
+
+  if (queues->queues[queue].messages != NULL)
+    make_ready (queues, queue);
+
+  _dbus_cmutex_unlock (queues->mutex);
+}
+
+/**
+ * Like _dbus_dispatch_queues_done(), but puts the message back at
+ * the head of its queue to be dispatched again, for instance because
+ * there wasn't enough memory to handle it.
+ *
+ * @param queues the queues
+ * @param queue the queue the message came from
+ * @param message_link the link _dbus_dispatch_queues_pop() returned
+ */
+void
+_dbus_dispatch_queues_putback (DBusDispatchQueues *queues,
+                               int                 queue,
+                               DBusList           *message_link)
+{
+  _dbus_cmutex_lock (queues->mutex);
+  _dbus_list_prepend_link (&queues->queues[queue].messages, message_link);
+  _dbus_cmutex_unlock (queues->mutex);
+
+  _dbus_dispatch_queues_done (queues, queue);
+}
+
+/**
+ * Stops the queues accepting messages, or starts them again. Once
+ * stopped, _dbus_dispatch_queues_pop() doesn't wait, so that workers
+ * can finish off what is left and return.
+ *
+ * @param queues the queues
+ * @param stopped #TRUE to stop them
+ */
+void
+_dbus_dispatch_queues_set_stopped (DBusDispatchQueues *queues,
+                                   dbus_bool_t         stopped)
+{
+  _dbus_cmutex_lock (queues->mutex);
+  queues->stopped = stopped;
+
+  if (stopped)
+    _dbus_condvar_wake_one (queues->ready_cond);
+
+  _dbus_cmutex_unlock (queues->mutex);
+}
+
+/** @} */
+
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+
+static DBusList *
+test_link (const char *path)
+{
+  DBusMessage *message;
+  DBusList *link;
+
+  message = dbus_message_new_method_call (NULL, path, "org.example.Test",
+                                          "Method");
+
+  if (message == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  link = _dbus_list_alloc_link (message);
+
+  if (link == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  return link;
+}
+
+static void
+test_free_link (DBusList *link)
+{
+  dbus_message_unref (link->data);
+  _dbus_list_free_link (link);
+}
+
+dbus_bool_t
+_dbus_dispatch_queues_test (void)
+{
+  DBusDispatchQueues *queues;
+  DBusList *a1, *a2, *b1, *link;
+  dbus_bool_t stopped;
+  int qa, qb, q;
+
+  /* One queue: everything is in order, one at a time */
+  queues = _dbus_dispatch_queues_new (1);
+  if (queues == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  a1 = test_link ("/a");
+  b1 = test_link ("/b");
+  _dbus_assert (_dbus_dispatch_queues_push (queues, a1));
+  _dbus_assert (_dbus_dispatch_queues_push (queues, b1));
+
+  link = _dbus_dispatch_queues_pop (queues, 0, &q, &stopped);
+  _dbus_assert (link == a1);
+  _dbus_assert (q == 0);
+  _dbus_assert (!stopped);
+
+  /* busy until done */
+  _dbus_assert (_dbus_dispatch_queues_pop (queues, 0, &q, &stopped) == NULL);
+  _dbus_dispatch_queues_done (queues, 0);
+  test_free_link (a1);
+
+  link = _dbus_dispatch_queues_pop (queues, 0, &q, &stopped);
+  _dbus_assert (link == b1);
+
+  /* a message put back comes out again first */
+  _dbus_dispatch_queues_putback (queues, q, b1);
+  link = _dbus_dispatch_queues_pop (queues, 0, &q, &stopped);
+  _dbus_assert (link == b1);
+  _dbus_dispatch_queues_done (queues, q);
+  test_free_link (b1);
+
+  _dbus_assert (_dbus_dispatch_queues_pop (queues, 0, &q, &stopped) == NULL);
+  _dbus_dispatch_queues_free (queues);
+
+  /* Many queues: while one path is busy, another goes ahead of the
+   * rest of the first path's messages */
+  queues = _dbus_dispatch_queues_new (64);
+  if (queues == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  a1 = test_link ("/org/example/a");
+  a2 = test_link ("/org/example/a");
+  b1 = test_link ("/org/example/b");
+  _dbus_assert (path_hash ("/org/example/a") % 64 !=
+                path_hash ("/org/example/b") % 64);
+
+  _dbus_assert (_dbus_dispatch_queues_push (queues, a1));
+  _dbus_assert (_dbus_dispatch_queues_push (queues, a2));
+  _dbus_assert (_dbus_dispatch_queues_push (queues, b1));
+
+  link = _dbus_dispatch_queues_pop (queues, 0, &qa, &stopped);
+  _dbus_assert (link == a1);
+  link = _dbus_dispatch_queues_pop (queues, 0, &qb, &stopped);
+  _dbus_assert (link == b1);
+  _dbus_assert (qa != qb);
+  _dbus_assert (_dbus_dispatch_queues_pop (queues, 0, &q, &stopped) == NULL);
+
+  _dbus_dispatch_queues_done (queues, qb);
+  test_free_link (b1);
+  _dbus_assert (_dbus_dispatch_queues_pop (queues, 0, &q, &stopped) == NULL);
+
+  _dbus_dispatch_queues_done (queues, qa);
+  test_free_link (a1);
+
+  /* only now can the rest of /a go, and after that, waiting for more
+   * times out */
+  link = _dbus_dispatch_queues_pop (queues, 10, &q, &stopped);
+  _dbus_assert (link == a2);
+  _dbus_assert (q == qa);
+  _dbus_assert (_dbus_dispatch_queues_pop (queues, 10, &q, &stopped) == NULL);
+  _dbus_dispatch_queues_done (queues, qa);
+  test_free_link (a2);
+
+  /* Once stopped, nothing more is accepted, and what is left can be
+   * drained without waiting */
+  a1 = test_link ("/org/example/a");
+  _dbus_assert (_dbus_dispatch_queues_push (queues, a1));
+  _dbus_dispatch_queues_set_stopped (queues, TRUE);
+
+  b1 = test_link ("/org/example/b");
+  _dbus_assert (!_dbus_dispatch_queues_push (queues, b1));
+  test_free_link (b1);
+
+  link = _dbus_dispatch_queues_pop (queues, -1, &q, &stopped);
+  _dbus_assert (link == a1);
+  _dbus_assert (stopped);
+  _dbus_assert (_dbus_dispatch_queues_pop (queues, -1, &q, &stopped) == NULL);
+  _dbus_assert (stopped);
+
+  /* a message left in a queue is freed with it */
+  _dbus_dispatch_queues_putback (queues, q, a1);
+  _dbus_dispatch_queues_free (queues);
+
+  return TRUE;
+}
+
+#endif /* DBUS_ENABLE_EMBEDDED_TESTS */
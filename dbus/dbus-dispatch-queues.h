@@ -0,0 +1,50 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-dispatch-queues.h  Per-object-path queues of messages for worker threads
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#ifndef DBUS_DISPATCH_QUEUES_H
+#define DBUS_DISPATCH_QUEUES_H
+
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-list.h>
+
+DBUS_BEGIN_DECLS
+
+typedef struct DBusDispatchQueues DBusDispatchQueues;
+
+DBusDispatchQueues *_dbus_dispatch_queues_new         (int                  n_queues);
+void                _dbus_dispatch_queues_free        (DBusDispatchQueues  *queues);
+int                 _dbus_dispatch_queues_get_size    (DBusDispatchQueues  *queues);
+dbus_bool_t         _dbus_dispatch_queues_push        (DBusDispatchQueues  *queues,
+                                                       DBusList            *message_link);
+DBusList           *_dbus_dispatch_queues_pop         (DBusDispatchQueues  *queues,
+                                                       int                  timeout_milliseconds,
+                                                       int                 *queue_p,
+                                                       dbus_bool_t         *stopped_p);
+void                _dbus_dispatch_queues_done        (DBusDispatchQueues  *queues,
+                                                       int                  queue);
+void                _dbus_dispatch_queues_putback     (DBusDispatchQueues  *queues,
+                                                       int                  queue,
+                                                       DBusList            *message_link);
+void                _dbus_dispatch_queues_set_stopped (DBusDispatchQueues  *queues,
+                                                       dbus_bool_t          stopped);
+
+DBUS_END_DECLS
+
+#endif /* DBUS_DISPATCH_QUEUES_H */
@@ -316,6 +316,31 @@ _dbus_string_save_to_file (const DBusString *str,
   return retval;
 }
 
+/**
+ * Gets a stamp for the given file that changes when the file is
+ * modified or replaced.
+ *
+ * @param filename the filename
+ * @param stamp return location for the stamp
+ * @returns #FALSE if the file couldn't be stat()ed
+ */
+dbus_bool_t
+_dbus_file_get_stamp (const DBusString *filename,
+                      DBusFileStamp    *stamp)
+{
+  struct stat sb;
+
+  if (stat (_dbus_string_get_const_data (filename), &sb) < 0)
+    return FALSE;
+
+  stamp->device = sb.st_dev;
+  stamp->inode = sb.st_ino;
+  stamp->size = sb.st_size;
+  stamp->mtime = sb.st_mtime;
+  stamp->ctime = sb.st_ctime;
+  return TRUE;
+}
+
 /** Makes the file readable by every user in the system.
  *
  * @param filename the filename
@@ -358,6 +358,32 @@ _dbus_string_save_to_file (const DBusString *str,
 }
 
 
+/**
+ * Gets a stamp for the given file that changes when the file is
+ * modified or replaced.
+ *
+ * @param filename the filename
+ * @param stamp return location for the stamp
+ * @returns #FALSE if the file's attributes couldn't be read
+ */
+dbus_bool_t
+_dbus_file_get_stamp (const DBusString *filename,
+                      DBusFileStamp    *stamp)
+{
+  WIN32_FILE_ATTRIBUTE_DATA data;
+
+  if (!GetFileAttributesExA (_dbus_string_get_const_data (filename),
+                             GetFileExInfoStandard, &data))
+    return FALSE;
+
+  stamp->device = 0;
+  stamp->inode = 0;
+  stamp->size = data.nFileSizeLow;
+  stamp->mtime = data.ftLastWriteTime.dwLowDateTime;
+  stamp->ctime = data.ftCreationTime.dwLowDateTime;
+  return TRUE;
+}
+
 /** Creates the given file, failing if the file already exists.
  *
  * @param filename the filename
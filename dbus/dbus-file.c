@@ -26,3 +26,29 @@
 
 #include "dbus-file.h"
 
+
+/**
+ * @addtogroup DBusFile
+ * @{
+ */
+
+/**
+ * Checks whether two stamps from _dbus_file_get_stamp() describe the
+ * same version of a file.
+ *
+ * @param a a stamp
+ * @param b another stamp
+ * @returns #TRUE if the file looks unchanged
+ */
+dbus_bool_t
+_dbus_file_stamp_equal (const DBusFileStamp *a,
+                        const DBusFileStamp *b)
+{
+  return a->device == b->device &&
+         a->inode == b->inode &&
+         a->size == b->size &&
+         a->mtime == b->mtime &&
+         a->ctime == b->ctime;
+}
+
+/** @} */
@@ -36,10 +36,27 @@ DBUS_BEGIN_DECLS
  * @{
  */
 
+/**
+ * Enough about a file to tell whether it has been modified or
+ * replaced since it was last looked at, without reading it.
+ */
+typedef struct
+{
+  unsigned long device; /**< Device the file is on, or 0 */
+  unsigned long inode;  /**< Inode number, or 0 */
+  unsigned long size;   /**< Size of file */
+  unsigned long mtime;  /**< Modify time */
+  unsigned long ctime;  /**< Status change (or creation) time */
+} DBusFileStamp;
+
 /**
  * File interface
  */
 dbus_bool_t _dbus_file_exists         (const char       *file);
+dbus_bool_t _dbus_file_get_stamp      (const DBusString *filename,
+                                       DBusFileStamp    *stamp);
+dbus_bool_t _dbus_file_stamp_equal    (const DBusFileStamp *a,
+                                       const DBusFileStamp *b);
 DBUS_PRIVATE_EXPORT
 dbus_bool_t _dbus_file_get_contents   (DBusString       *str,
                                        const DBusString *filename,
@@ -78,6 +78,8 @@
 #include "dbus-hash.h"
 #include "dbus-internals.h"
 #include "dbus-mempool.h"
+#include "dbus-sysdeps.h"
+#include <string.h>
 
 /**
  * @defgroup DBusHashTable Hash table
@@ -120,7 +122,20 @@
  * 
  */
 #define RANDOM_INDEX(table, i) \
-    (((((intptr_t) (i))*1103515245) >> (table)->down_shift) & (table)->mask)
+    RANDOM_INDEX_FOR_SIZE (i, (table)->down_shift, (table)->mask)
+
+/**
+ * Like RANDOM_INDEX(), for a bucket array with the given shift and mask
+ * (used for the old array while a rebuild is in progress).
+ */
+#define RANDOM_INDEX_FOR_SIZE(i, down_shift, mask) \
+    (((((intptr_t) (i))*1103515245) >> (down_shift)) & (mask))
+
+/**
+ * While the table is being rebuilt, how many buckets of the old array
+ * are moved to the new one each time an entry is added.
+ */
+#define REBUILD_BUCKETS_PER_ADD 8
 
 /**
  * Initial number of buckets in hash table (hash table statically
@@ -148,6 +163,11 @@ struct DBusHashEntry
                            */
   void *key;              /**< Hash key */
   void *value;            /**< Hash value */
+  unsigned int hash;      /**< Full hash of a string key, so that
+                           * chains can be searched and the table
+                           * rebuilt without touching the keys;
+                           * unused for other key types
+                           */
 };
 
 /**
@@ -204,6 +224,22 @@ struct DBusHashTable {
   DBusFreeFunction free_value_function; /**< Function to free values */
 
   DBusMemPool *entry_pool;              /**< Memory pool for hash entries */
+
+  DBusHashEntry **old_buckets;          /**< While a rebuild is in progress,
+                                         * the previous bucket array, whose
+                                         * entries are moved over a few
+                                         * buckets at a time; else #NULL
+                                         */
+  int n_old_buckets;                    /**< Size of old_buckets */
+  int old_down_shift;                   /**< down_shift for old_buckets */
+  int old_mask;                         /**< mask for old_buckets */
+  int next_old_bucket;                  /**< Next bucket in old_buckets
+                                         * to move; all before it are empty
+                                         */
+
+  dbus_uint64_t hash_key[2];            /**< Copy of the process-wide
+                                         * key for string_hash()
+                                         */
 };
 
 /** 
@@ -234,8 +270,11 @@ static DBusHashEntry* find_string_function      (DBusHashTable          *table,
                                                  dbus_bool_t             create_if_not_found,
                                                  DBusHashEntry        ***bucket,
                                                  DBusPreallocatedHash   *preallocated);
-static unsigned int   string_hash               (const char             *str);
+static unsigned int   string_hash               (DBusHashTable          *table,
+                                                 const char             *str);
 static void           rebuild_table             (DBusHashTable          *table);
+static void           move_old_buckets          (DBusHashTable          *table,
+                                                 int                     n_buckets);
 static DBusHashEntry* alloc_entry               (DBusHashTable          *table);
 static void           remove_entry              (DBusHashTable          *table,
                                                  DBusHashEntry         **bucket,
@@ -271,6 +310,47 @@ static void           free_entry_data           (DBusHashTable          *table,
  * Indicates the type of a key in the hash table.
  */
 
+/* Protected by _DBUS_LOCK (hash_seed) */
+static dbus_bool_t hash_seed_initialized = FALSE;
+static dbus_uint64_t hash_seed[2];
+
+/*
+ * Copies the process-wide key for string_hash() into the table,
+ * choosing the key first if this is the first table. The key is
+ * random so that untrusted peers cannot pick names that all land in
+ * the same bucket.
+ */
+static dbus_bool_t
+init_hash_key (DBusHashTable *table)
+{
+  if (!_DBUS_LOCK (hash_seed))
+    return FALSE;
+
+  if (!hash_seed_initialized)
+    {
+      if (!_dbus_generate_random_bytes_buffer ((char *) hash_seed,
+                                               sizeof (hash_seed), NULL))
+        {
+          /* No source of randomness; a weaker key is still better
+           * than a constant one */
+          long tv_sec, tv_usec;
+
+          _dbus_get_real_time (&tv_sec, &tv_usec);
+          hash_seed[0] = ((dbus_uint64_t) tv_sec << 20) ^ tv_usec;
+          hash_seed[1] = ((dbus_uint64_t) _dbus_getpid () << 32) ^
+            (dbus_uint64_t) (uintptr_t) &tv_sec;
+        }
+
+      hash_seed_initialized = TRUE;
+    }
+
+  table->hash_key[0] = hash_seed[0];
+  table->hash_key[1] = hash_seed[1];
+
+  _DBUS_UNLOCK (hash_seed);
+  return TRUE;
+}
+
 /**
  * Constructs a new hash table. Should be freed with
  * _dbus_hash_table_unref(). If memory cannot be
@@ -288,18 +368,31 @@ _dbus_hash_table_new (DBusHashType     type,
 {
   DBusHashTable *table;
   DBusMemPool *entry_pool;
+  DBusMemoryTag old_tag;
   
-  table = dbus_new0 (DBusHashTable, 1);
-  if (table == NULL)
-    return NULL;
+  old_tag = _dbus_memory_push_tag (DBUS_MEMORY_TAG_HASH);
 
+  table = dbus_new0 (DBusHashTable, 1);
   entry_pool = _dbus_mem_pool_new (sizeof (DBusHashEntry), TRUE);
-  if (entry_pool == NULL)
+
+  _dbus_memory_pop_tag (old_tag);
+
+  if (table == NULL || entry_pool == NULL)
     {
+      if (entry_pool != NULL)
+        _dbus_mem_pool_free (entry_pool);
+
       dbus_free (table);
       return NULL;
     }
   
+  if (type == DBUS_HASH_STRING && !init_hash_key (table))
+    {
+      _dbus_mem_pool_free (entry_pool);
+      dbus_free (table);
+      return NULL;
+    }
+
   table->refcount = 1;
   table->entry_pool = entry_pool;
   
@@ -394,6 +487,16 @@ _dbus_hash_table_unref (DBusHashTable *table)
             {
               free_entry_data (table, entry);
               
+              entry = entry->next;
+            }
+        }
+      for (i = table->next_old_bucket; i < table->n_old_buckets; i++)
+        {
+          entry = table->old_buckets[i];
+          while (entry != NULL)
+            {
+              free_entry_data (table, entry);
+
               entry = entry->next;
             }
         }
@@ -401,9 +504,12 @@ _dbus_hash_table_unref (DBusHashTable *table)
       _dbus_mem_pool_free (table->entry_pool);
 #endif
       
-      /* Free the bucket array, if it was dynamically allocated. */
+      /* Free the bucket arrays, if they were dynamically allocated. */
       if (table->buckets != table->static_buckets)
         dbus_free (table->buckets);
+      if (table->old_buckets != NULL &&
+          table->old_buckets != table->static_buckets)
+        dbus_free (table->old_buckets);
 
       dbus_free (table);
     }
@@ -429,8 +535,11 @@ static DBusHashEntry*
 alloc_entry (DBusHashTable *table)
 {
   DBusHashEntry *entry;
+  DBusMemoryTag old_tag;
 
+  old_tag = _dbus_memory_push_tag (DBUS_MEMORY_TAG_HASH);
   entry = _dbus_mem_pool_alloc (table->entry_pool);
+  _dbus_memory_pop_tag (old_tag);
   
   return entry;
 }
@@ -555,9 +664,14 @@ _dbus_hash_iter_next (DBusHashIter  *iter)
   
   /* Remember that real->entry may have been deleted */
   
+  /* While a rebuild is in progress, bucket numbers below
+   * n_old_buckets are in the old array. Buckets are only moved when
+   * adding entries, which isn't allowed during iteration, so this
+   * numbering stays valid.
+   */
   while (real->next_entry == NULL)
     {
-      if (real->next_bucket >= real->table->n_buckets)
+      if (real->next_bucket >= real->table->n_old_buckets + real->table->n_buckets)
         {
           /* invalidate iter and return false */
           real->entry = NULL;
@@ -566,7 +680,11 @@ _dbus_hash_iter_next (DBusHashIter  *iter)
           return FALSE;
         }
 
-      real->bucket = &(real->table->buckets[real->next_bucket]);
+      if (real->next_bucket < real->table->n_old_buckets)
+        real->bucket = &(real->table->old_buckets[real->next_bucket]);
+      else
+        real->bucket = &(real->table->buckets[real->next_bucket -
+                                              real->table->n_old_buckets]);
       real->next_entry = *(real->bucket);
       real->next_bucket += 1;
     }
@@ -759,10 +877,13 @@ _dbus_hash_iter_lookup (DBusHashTable *table,
   real->bucket = bucket;
   real->entry = entry;
   real->next_entry = entry->next;
-  real->next_bucket = (bucket - table->buckets) + 1;
+  if (table->old_buckets != NULL &&
+      bucket >= table->old_buckets &&
+      bucket < table->old_buckets + table->n_old_buckets)
+    real->next_bucket = (bucket - table->old_buckets) + 1;
+  else
+    real->next_bucket = table->n_old_buckets + (bucket - table->buckets) + 1;
   real->n_entries_on_init = table->n_entries; 
-
-  _dbus_assert (&(table->buckets[real->next_bucket-1]) == real->bucket);
   
   return TRUE;
 }
@@ -770,6 +891,7 @@ _dbus_hash_iter_lookup (DBusHashTable *table,
 static void
 add_allocated_entry (DBusHashTable   *table,
                      DBusHashEntry   *entry,
+                     unsigned int     hash,
                      unsigned int     idx,
                      void            *key,
                      DBusHashEntry ***bucket)
@@ -777,6 +899,11 @@ add_allocated_entry (DBusHashTable   *table,
   DBusHashEntry **b;  
   
   entry->key = key;
+  entry->hash = hash;
+
+  /* Moving buckets doesn't change table->mask, so idx is still right */
+  if (table->old_buckets != NULL)
+    move_old_buckets (table, REBUILD_BUCKETS_PER_ADD);
   
   b = &(table->buckets[idx]);
   entry->next = *b;
@@ -797,6 +924,7 @@ add_allocated_entry (DBusHashTable   *table,
 
 static DBusHashEntry*
 add_entry (DBusHashTable        *table, 
+           unsigned int          hash,
            unsigned int          idx,
            void                 *key,
            DBusHashEntry      ***bucket,
@@ -819,25 +947,71 @@ add_entry (DBusHashTable        *table,
       entry = (DBusHashEntry*) preallocated;
     }
 
-  add_allocated_entry (table, entry, idx, key, bucket);
+  add_allocated_entry (table, entry, hash, idx, key, bucket);
 
   return entry;
 }
 
-/* This is g_str_hash from GLib which was
- * extensively discussed/tested/profiled
+#define SIP_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIP_ROUND(v0, v1, v2, v3) \
+  do {                                                                  \
+    v0 += v1; v1 = SIP_ROTL (v1, 13); v1 ^= v0; v0 = SIP_ROTL (v0, 32); \
+    v2 += v3; v3 = SIP_ROTL (v3, 16); v3 ^= v2;                         \
+    v0 += v3; v3 = SIP_ROTL (v3, 21); v3 ^= v0;                         \
+    v2 += v1; v1 = SIP_ROTL (v1, 17); v1 ^= v2; v2 = SIP_ROTL (v2, 32); \
+  } while (0)
+
+/* SipHash-1-3 of the string, keyed with the table's copy of the
+ * process-wide random key. This reads the name 8 bytes at a time, so
+ * long names sharing a prefix like "org.freedesktop." hash faster
+ * than with a byte at a time function, and without the key an
+ * attacker cannot construct names that collide.
  */
 static unsigned int
-string_hash (const char *str)
+string_hash (DBusHashTable *table,
+             const char    *str)
 {
-  const char *p = str;
-  unsigned int h = *p;
+  const unsigned char *p = (const unsigned char *) str;
+  size_t len = strlen (str);
+  const unsigned char *end = p + (len & ~(size_t) 7);
+  dbus_uint64_t v0, v1, v2, v3, m;
+  int i;
 
-  if (h)
-    for (p += 1; *p != '\0'; p++)
-      h = (h << 5) - h + *p;
+  v0 = table->hash_key[0] ^ DBUS_UINT64_CONSTANT (0x736f6d6570736575);
+  v1 = table->hash_key[1] ^ DBUS_UINT64_CONSTANT (0x646f72616e646f6d);
+  v2 = table->hash_key[0] ^ DBUS_UINT64_CONSTANT (0x6c7967656e657261);
+  v3 = table->hash_key[1] ^ DBUS_UINT64_CONSTANT (0x7465646279746573);
 
-  return h;
+  for (; p != end; p += 8)
+    {
+      m = ((dbus_uint64_t) p[0]) |
+          ((dbus_uint64_t) p[1] << 8) |
+          ((dbus_uint64_t) p[2] << 16) |
+          ((dbus_uint64_t) p[3] << 24) |
+          ((dbus_uint64_t) p[4] << 32) |
+          ((dbus_uint64_t) p[5] << 40) |
+          ((dbus_uint64_t) p[6] << 48) |
+          ((dbus_uint64_t) p[7] << 56);
+      v3 ^= m;
+      SIP_ROUND (v0, v1, v2, v3);
+      v0 ^= m;
+    }
+
+  m = ((dbus_uint64_t) len) << 56;
+  for (i = (int) (len & 7) - 1; i >= 0; i--)
+    m |= ((dbus_uint64_t) p[i]) << (8 * i);
+
+  v3 ^= m;
+  SIP_ROUND (v0, v1, v2, v3);
+  v0 ^= m;
+
+  v2 ^= 0xff;
+  SIP_ROUND (v0, v1, v2, v3);
+  SIP_ROUND (v0, v1, v2, v3);
+  SIP_ROUND (v0, v1, v2, v3);
+
+  return (unsigned int) (v0 ^ v1 ^ v2 ^ v3);
 }
 
 /** Key comparison function */
@@ -846,6 +1020,7 @@ typedef int (* KeyCompareFunc) (const void *key_a, const void *key_b);
 static DBusHashEntry*
 find_generic_function (DBusHashTable        *table,
                        void                 *key,
+                       unsigned int          hash,
                        unsigned int          idx,
                        KeyCompareFunc        compare_func,
                        dbus_bool_t           create_if_not_found,
@@ -862,7 +1037,8 @@ find_generic_function (DBusHashTable        *table,
   while (entry != NULL)
     {
       if ((compare_func == NULL && key == entry->key) ||
-          (compare_func != NULL && (* compare_func) (key, entry->key) == 0))
+          (compare_func != NULL && hash == entry->hash &&
+           (* compare_func) (key, entry->key) == 0))
         {
           if (bucket)
             *bucket = &(table->buckets[idx]);
@@ -876,8 +1052,39 @@ find_generic_function (DBusHashTable        *table,
       entry = entry->next;
     }
 
+  /* If a rebuild is in progress, the entry may not have moved yet */
+  if (table->old_buckets != NULL)
+    {
+      unsigned int old_idx;
+
+      if (table->key_type == DBUS_HASH_STRING)
+        old_idx = hash & table->old_mask;
+      else
+        old_idx = RANDOM_INDEX_FOR_SIZE (key, table->old_down_shift,
+                                         table->old_mask);
+
+      entry = table->old_buckets[old_idx];
+      while (entry != NULL)
+        {
+          if ((compare_func == NULL && key == entry->key) ||
+              (compare_func != NULL && hash == entry->hash &&
+               (* compare_func) (key, entry->key) == 0))
+            {
+              if (bucket)
+                *bucket = &(table->old_buckets[old_idx]);
+
+              if (preallocated)
+                _dbus_hash_table_free_preallocated_entry (table, preallocated);
+
+              return entry;
+            }
+
+          entry = entry->next;
+        }
+    }
+
   if (create_if_not_found)
-    entry = add_entry (table, idx, key, bucket, preallocated);
+    entry = add_entry (table, hash, idx, key, bucket, preallocated);
   else if (preallocated)
     _dbus_hash_table_free_preallocated_entry (table, preallocated);
   
@@ -891,11 +1098,13 @@ find_string_function (DBusHashTable        *table,
                       DBusHashEntry      ***bucket,
                       DBusPreallocatedHash *preallocated)
 {
+  unsigned int hash;
   unsigned int idx;
   
-  idx = string_hash (key) & table->mask;
+  hash = string_hash (table, key);
+  idx = hash & table->mask;
 
-  return find_generic_function (table, key, idx,
+  return find_generic_function (table, key, hash, idx,
                                 (KeyCompareFunc) strcmp, create_if_not_found, bucket,
                                 preallocated);
 }
@@ -912,30 +1121,95 @@ find_direct_function (DBusHashTable        *table,
   idx = RANDOM_INDEX (table, key) & table->mask;
 
 
-  return find_generic_function (table, key, idx,
+  return find_generic_function (table, key, 0, idx,
                                 NULL, create_if_not_found, bucket,
                                 preallocated);
 }
 
+/*
+ * Moves up to n_buckets buckets' worth of entries from the old bucket
+ * array of an in-progress rebuild into the current one, and finishes
+ * the rebuild when the old array is empty.
+ */
+static void
+move_old_buckets (DBusHashTable *table,
+                  int            n_buckets)
+{
+  _dbus_assert (table->old_buckets != NULL);
+
+  while (n_buckets > 0 && table->next_old_bucket < table->n_old_buckets)
+    {
+      DBusHashEntry **old_chain;
+      DBusHashEntry *entry;
+
+      old_chain = &(table->old_buckets[table->next_old_bucket]);
+
+      for (entry = *old_chain; entry != NULL; entry = *old_chain)
+        {
+          unsigned int idx;
+          DBusHashEntry **bucket;
+
+          *old_chain = entry->next;
+          switch (table->key_type)
+            {
+            case DBUS_HASH_STRING:
+              idx = entry->hash & table->mask;
+              break;
+            case DBUS_HASH_INT:
+            case DBUS_HASH_UINTPTR:
+              idx = RANDOM_INDEX (table, entry->key);
+              break;
+            default:
+              idx = 0;
+              _dbus_assert_not_reached ("Unknown hash table type");
+              break;
+            }
+
+          bucket = &(table->buckets[idx]);
+          entry->next = *bucket;
+          *bucket = entry;
+        }
+
+      table->next_old_bucket += 1;
+      n_buckets -= 1;
+    }
+
+  if (table->next_old_bucket == table->n_old_buckets)
+    {
+      /* Free the old bucket array, if it was dynamically allocated. */
+      if (table->old_buckets != table->static_buckets)
+        dbus_free (table->old_buckets);
+
+      table->old_buckets = NULL;
+      table->n_old_buckets = 0;
+      table->next_old_bucket = 0;
+    }
+}
+
+/*
+ * Starts resizing the bucket array. Entries stay in the old array
+ * until move_old_buckets() gets to them, a few buckets per added
+ * entry, so no single insertion has to rehash the whole table.
+ */
 static void
 rebuild_table (DBusHashTable *table)
 {
-  int old_size;
   int new_buckets;
-  DBusHashEntry **old_buckets;
-  DBusHashEntry **old_chain;
-  DBusHashEntry *entry;
+  DBusHashEntry **new_array;
   dbus_bool_t growing;
-  
+  DBusMemoryTag old_tag;
+
+  /* Only tables that keep growing and shrinking across a threshold
+   * get here with the previous rebuild unfinished */
+  if (table->old_buckets != NULL)
+    move_old_buckets (table, table->n_old_buckets);
+
   /*
    * Allocate and initialize the new bucket array, and set up
    * hashing constants for new array size.
    */
 
   growing = table->n_entries >= table->hi_rebuild_size;
-  
-  old_size = table->n_buckets;
-  old_buckets = table->buckets;
 
   if (growing)
     {
@@ -953,16 +1227,25 @@ rebuild_table (DBusHashTable *table)
         return; /* don't bother shrinking this far */
     }
 
-  table->buckets = dbus_new0 (DBusHashEntry*, new_buckets);
-  if (table->buckets == NULL)
+  old_tag = _dbus_memory_push_tag (DBUS_MEMORY_TAG_HASH);
+  new_array = dbus_new0 (DBusHashEntry*, new_buckets);
+  _dbus_memory_pop_tag (old_tag);
+
+  if (new_array == NULL)
     {
       /* out of memory, yay - just don't reallocate, the table will
        * still work, albeit more slowly.
        */
-      table->buckets = old_buckets;
       return;
     }
 
+  table->old_buckets = table->buckets;
+  table->n_old_buckets = table->n_buckets;
+  table->old_down_shift = table->down_shift;
+  table->old_mask = table->mask;
+  table->next_old_bucket = 0;
+
+  table->buckets = new_array;
   table->n_buckets = new_buckets;
   
   if (growing)
@@ -996,44 +1279,10 @@ rebuild_table (DBusHashTable *table)
   _dbus_assert (table->mask != 0);
   /* the mask is essentially the max index */
   _dbus_assert (table->mask < table->n_buckets);
-  
-  /*
-   * Rehash all of the existing entries into the new bucket array.
-   */
-
-  for (old_chain = old_buckets; old_size > 0; old_size--, old_chain++)
-    {
-      for (entry = *old_chain; entry != NULL; entry = *old_chain)
-        {
-          unsigned int idx;
-          DBusHashEntry **bucket;
-          
-          *old_chain = entry->next;
-          switch (table->key_type)
-            {
-            case DBUS_HASH_STRING:
-              idx = string_hash (entry->key) & table->mask;
-              break;
-            case DBUS_HASH_INT:
-            case DBUS_HASH_UINTPTR:
-              idx = RANDOM_INDEX (table, entry->key);
-              break;
-            default:
-              idx = 0;
-              _dbus_assert_not_reached ("Unknown hash table type");
-              break;
-            }
-          
-          bucket = &(table->buckets[idx]);
-          entry->next = *bucket;
-          *bucket = entry;
-        }
-    }
-  
-  /* Free the old bucket array, if it was dynamically allocated. */
-
-  if (old_buckets != table->static_buckets)
-    dbus_free (old_buckets);
+  /* a growing table is done moving buckets long before it grows again */
+  _dbus_assert (!growing ||
+                (table->hi_rebuild_size - table->n_entries) *
+                REBUILD_BUCKETS_PER_ADD >= table->n_old_buckets);
 }
 
 /**
@@ -1533,6 +1782,20 @@ _dbus_hash_test (void)
       _dbus_assert (value != NULL);
       _dbus_assert (strcmp (value, keys[i]) == 0);
 
+      /* Older entries must still be found while a rebuild is moving
+       * them between bucket arrays */
+      value = _dbus_hash_table_lookup_string (table1, keys[i / 2]);
+      _dbus_assert (value != NULL);
+      _dbus_assert (strcmp (value, "Value!") == 0);
+
+      value = _dbus_hash_table_lookup_int (table2, i / 2);
+      _dbus_assert (value != NULL);
+      _dbus_assert (strcmp (value, keys[i / 2]) == 0);
+
+      value = _dbus_hash_table_lookup_uintptr (table3, i / 2);
+      _dbus_assert (value != NULL);
+      _dbus_assert (strcmp (value, keys[i / 2]) == 0);
+
       ++i;
     }
 
@@ -279,7 +279,9 @@ _dbus_warn_check_failed(const char *format,
 #ifdef DBUS_ENABLE_VERBOSE_MODE
 
 static dbus_bool_t verbose_initted = FALSE;
-static dbus_bool_t verbose = TRUE;
+
+/** Whether verbose mode is on; see _dbus_is_verbose() */
+int _dbus_verbose_state = -1;
 
 /** Whether to show the current thread in verbose messages */
 #define PTHREAD_IN_VERBOSE 0
@@ -297,7 +299,7 @@ _dbus_verbose_init (void)
   if (!verbose_initted)
     {
       const char *p = _dbus_getenv ("DBUS_VERBOSE");
-      verbose = p != NULL && *p == '1';
+      _dbus_verbose_state = (p != NULL && *p == '1');
       verbose_initted = TRUE;
 #ifdef DBUS_USE_OUTPUT_DEBUG_STRING
       {
@@ -360,17 +362,17 @@ dbus_bool_t
 _dbus_is_verbose_real (void)
 {
   _dbus_verbose_init ();
-  return verbose;
+  return _dbus_verbose_state != 0;
 }
 
 void _dbus_set_verbose (dbus_bool_t state)
 {
-    verbose = state;
+    _dbus_verbose_state = (state != FALSE);
 }
 
 dbus_bool_t _dbus_get_verbose (void)
 {
-    return verbose;
+    return _dbus_verbose_state != 0;
 }
 
 /**
@@ -455,6 +457,7 @@ void
 _dbus_verbose_reset_real (void)
 {
   verbose_initted = FALSE;
+  _dbus_verbose_state = -1;
 }
 
 void
@@ -1082,4 +1085,177 @@ _dbus_test_oom_handling (const char             *description,
 }
 #endif /* DBUS_ENABLE_EMBEDDED_TESTS */
 
+#ifdef DBUS_ENABLE_STATS
+/*
+ * Time spent per phase of message handling. A phase entered while
+ * another one runs interrupts it, so each phase is charged only its
+ * own time and the phases add up to the time spent in any of them.
+ * As with the memory accounting, only the single-threaded
+ * dbus-daemon turns this on, so nothing here takes a lock.
+ */
+
+static dbus_bool_t phases_enabled = FALSE;
+static DBusPhase current_phase = DBUS_PHASE_NONE;
+static dbus_uint64_t phase_started_nsec;
+static dbus_uint64_t phase_entries[_DBUS_N_PHASES];
+static dbus_uint64_t phase_nsec[_DBUS_N_PHASES];
+static dbus_uint64_t n_iterations;
+static dbus_uint64_t iteration_nsec;
+static dbus_uint64_t busiest_iteration_nsec;
+
+static const char * const phase_names[_DBUS_N_PHASES] = {
+  "None",
+  "SocketRead",
+  "HeaderLoad",
+  "BodyValidation",
+  "Policy",
+  "Matchmaker",
+  "Transaction",
+  "SocketWrite"
+};
+
+/* Charges the time since the current phase started or resumed to it */
+static dbus_uint64_t
+phase_charge (void)
+{
+  dbus_uint64_t now;
+
+  now = _dbus_get_monotonic_time_nsec ();
+
+  if (current_phase != DBUS_PHASE_NONE)
+    {
+      phase_nsec[current_phase] += now - phase_started_nsec;
+      iteration_nsec += now - phase_started_nsec;
+    }
+
+  return now;
+}
+
+/**
+ * Turns the phase timing on or off. Turning it on starts counting
+ * from zero.
+ *
+ * @param enabled #TRUE to time phases
+ */
+void
+_dbus_phase_set_enabled (dbus_bool_t enabled)
+{
+  if (enabled && !phases_enabled)
+    {
+      memset (phase_entries, 0, sizeof (phase_entries));
+      memset (phase_nsec, 0, sizeof (phase_nsec));
+      n_iterations = 0;
+      iteration_nsec = 0;
+      busiest_iteration_nsec = 0;
+    }
+
+  phases_enabled = enabled;
+  current_phase = DBUS_PHASE_NONE;
+}
+
+/**
+ * Gets whether phases are being timed.
+ *
+ * @returns #TRUE if _dbus_phase_set_enabled() turned it on
+ */
+dbus_bool_t
+_dbus_phase_get_enabled (void)
+{
+  return phases_enabled;
+}
+
+/**
+ * Starts charging time to phase, until _dbus_phase_leave().
+ *
+ * @param phase what is about to run
+ * @returns what to pass to _dbus_phase_leave()
+ */
+DBusPhase
+_dbus_phase_enter (DBusPhase phase)
+{
+  DBusPhase previous;
+
+  _dbus_assert (phase < _DBUS_N_PHASES);
+
+  if (!phases_enabled)
+    return DBUS_PHASE_NONE;
+
+  previous = current_phase;
+  phase_started_nsec = phase_charge ();
+  current_phase = phase;
+  phase_entries[phase] += 1;
+
+  return previous;
+}
+
+/**
+ * Undoes _dbus_phase_enter(), resuming the phase it interrupted.
+ *
+ * @param previous what it returned
+ */
+void
+_dbus_phase_leave (DBusPhase previous)
+{
+  if (!phases_enabled)
+    return;
+
+  phase_started_nsec = phase_charge ();
+  current_phase = previous;
+}
+
+/**
+ * Called at the start of each main loop iteration, to find the
+ * iteration, so far, that spent the most time in the phases.
+ */
+void
+_dbus_phase_next_iteration (void)
+{
+  if (!phases_enabled)
+    return;
+
+  n_iterations += 1;
+
+  if (iteration_nsec > busiest_iteration_nsec)
+    busiest_iteration_nsec = iteration_nsec;
+
+  iteration_nsec = 0;
+}
+
+/**
+ * Gets the time charged to a phase since timing was turned on.
+ *
+ * @param phase the phase
+ * @param entries_p return location for how often it was entered
+ * @param nsec_p return location for its time in nanoseconds
+ * @returns the name of the phase, for reports
+ */
+const char *
+_dbus_phase_get_stats (DBusPhase      phase,
+                       dbus_uint64_t *entries_p,
+                       dbus_uint64_t *nsec_p)
+{
+  _dbus_assert (phase < _DBUS_N_PHASES);
+
+  *entries_p = phase_entries[phase];
+  *nsec_p = phase_nsec[phase];
+
+  return phase_names[phase];
+}
+
+/**
+ * Gets the number of main loop iterations since timing was turned
+ * on, and the most time that one of them spent in the phases.
+ *
+ * @param iterations_p return location for the number of iterations
+ * @param busiest_nsec_p return location for the most nanoseconds
+ */
+void
+_dbus_phase_get_iterations (dbus_uint64_t *iterations_p,
+                            dbus_uint64_t *busiest_nsec_p)
+{
+  *iterations_p = n_iterations;
+  *busiest_nsec_p = busiest_iteration_nsec;
+}
+#endif /* DBUS_ENABLE_STATS */
+
 /** @} */
@@ -90,11 +90,24 @@ void _dbus_warn_check_failed  (const char *format,
 #define DBUS_CPP_SUPPORTS_VARIABLE_MACRO_ARGUMENTS
 #endif
 
+/* 0 once verbose mode is known to be off, so that _dbus_is_verbose()
+ * and _dbus_verbose() cost a single test, without a function call or
+ * evaluating the arguments; 1 if on, -1 until DBUS_VERBOSE is read */
+DBUS_PRIVATE_EXPORT
+extern int _dbus_verbose_state;
+
+#  define _dbus_is_verbose() \
+  (_DBUS_UNLIKELY (_dbus_verbose_state != 0) && _dbus_is_verbose_real ())
+
 #ifdef DBUS_CPP_SUPPORTS_VARIABLE_MACRO_ARGUMENTS
 DBUS_PRIVATE_EXPORT
 void _dbus_verbose_real       (const char *file, const int line, const char *function, 
                                const char *format,...) _DBUS_GNUC_PRINTF (4, 5);
-#  define _dbus_verbose(fmt,...) _dbus_verbose_real( __FILE__,__LINE__,__FUNCTION__,fmt, ## __VA_ARGS__)
+#  define _dbus_verbose(fmt,...) \
+  do { \
+    if (_dbus_is_verbose ()) \
+      _dbus_verbose_real( __FILE__,__LINE__,__FUNCTION__,fmt, ## __VA_ARGS__); \
+  } while (0)
 #else
 DBUS_PRIVATE_EXPORT
 void _dbus_verbose_real       (const char *format,
@@ -111,7 +124,6 @@ DBUS_PRIVATE_EXPORT
 void _dbus_set_verbose (dbus_bool_t state);
 
 #  define _dbus_verbose_reset _dbus_verbose_reset_real
-#  define _dbus_is_verbose _dbus_is_verbose_real
 #else
 #  ifdef HAVE_ISO_VARARGS
 #    define _dbus_verbose(...) do { } while (0)
@@ -306,6 +318,8 @@ dbus_bool_t _dbus_decrement_fail_alloc_counter  (void);
 dbus_bool_t _dbus_disable_mem_pools             (void);
 DBUS_PRIVATE_EXPORT
 int         _dbus_get_malloc_blocks_outstanding (void);
+DBUS_PRIVATE_EXPORT
+int         _dbus_get_malloc_calls              (void);
 
 typedef dbus_bool_t (* DBusTestMemoryFunction)  (void *data);
 DBUS_PRIVATE_EXPORT
@@ -322,8 +336,82 @@ dbus_bool_t _dbus_test_oom_handling (const char             *description,
 #define _dbus_decrement_fail_alloc_counter() (FALSE)
 #define _dbus_disable_mem_pools()            (FALSE)
 #define _dbus_get_malloc_blocks_outstanding  (0)
+#define _dbus_get_malloc_calls()             (0)
 #endif /* !DBUS_ENABLE_EMBEDDED_TESTS */
 
+/**
+ * Subsystems that memory is accounted to, in DBUS_ENABLE_STATS builds.
+ */
+typedef enum
+{
+  DBUS_MEMORY_TAG_OTHER,       /**< Anything not tagged */
+  DBUS_MEMORY_TAG_CONNECTION,  /**< Connections and their bus-side data */
+  DBUS_MEMORY_TAG_MATCH_RULE,  /**< Match rules and the matchmaker */
+  DBUS_MEMORY_TAG_POLICY,      /**< Configuration and security policy */
+  DBUS_MEMORY_TAG_MESSAGE,     /**< Messages */
+  DBUS_MEMORY_TAG_LOADER,      /**< Buffers of data read from the socket */
+  DBUS_MEMORY_TAG_HASH,        /**< Hash tables nobody else claimed */
+  DBUS_MEMORY_TAG_LIST,        /**< List links nobody else claimed */
+  _DBUS_N_MEMORY_TAGS
+} DBusMemoryTag;
+
+#ifdef DBUS_ENABLE_STATS
+DBUS_PRIVATE_EXPORT
+void          _dbus_memory_enable_accounting (void);
+DBUS_PRIVATE_EXPORT
+DBusMemoryTag _dbus_memory_push_tag          (DBusMemoryTag  tag);
+DBUS_PRIVATE_EXPORT
+void          _dbus_memory_pop_tag           (DBusMemoryTag  previous);
+DBUS_PRIVATE_EXPORT
+const char   *_dbus_memory_get_tag_stats     (DBusMemoryTag  tag,
+                                              size_t        *bytes_p,
+                                              dbus_uint32_t *blocks_p);
+#else
+#define _dbus_memory_push_tag(tag) (DBUS_MEMORY_TAG_OTHER)
+#define _dbus_memory_pop_tag(previous) ((void) (previous))
+#endif
+
+/**
+ * Phases of message handling that CPU time is accounted to, in
+ * DBUS_ENABLE_STATS builds.
+ */
+typedef enum
+{
+  DBUS_PHASE_NONE,             /**< Outside every phase */
+  DBUS_PHASE_SOCKET_READ,      /**< Reading from the socket */
+  DBUS_PHASE_HEADER_LOAD,      /**< Cutting the data read into messages */
+  DBUS_PHASE_BODY_VALIDATION,  /**< Validating message bodies */
+  DBUS_PHASE_POLICY,           /**< Security policy checks */
+  DBUS_PHASE_MATCHMAKER,       /**< Finding match rule recipients */
+  DBUS_PHASE_TRANSACTION,      /**< Routing a message, the rest of it */
+  DBUS_PHASE_SOCKET_WRITE,     /**< Writing to the socket */
+  _DBUS_N_PHASES
+} DBusPhase;
+
+#ifdef DBUS_ENABLE_STATS
+DBUS_PRIVATE_EXPORT
+void        _dbus_phase_set_enabled    (dbus_bool_t    enabled);
+DBUS_PRIVATE_EXPORT
+dbus_bool_t _dbus_phase_get_enabled    (void);
+DBUS_PRIVATE_EXPORT
+DBusPhase   _dbus_phase_enter          (DBusPhase      phase);
+DBUS_PRIVATE_EXPORT
+void        _dbus_phase_leave          (DBusPhase      previous);
+DBUS_PRIVATE_EXPORT
+void        _dbus_phase_next_iteration (void);
+DBUS_PRIVATE_EXPORT
+const char *_dbus_phase_get_stats      (DBusPhase      phase,
+                                        dbus_uint64_t *entries_p,
+                                        dbus_uint64_t *nsec_p);
+DBUS_PRIVATE_EXPORT
+void        _dbus_phase_get_iterations (dbus_uint64_t *iterations_p,
+                                        dbus_uint64_t *busiest_nsec_p);
+#else
+#define _dbus_phase_enter(phase) (DBUS_PHASE_NONE)
+#define _dbus_phase_leave(previous) ((void) (previous))
+#define _dbus_phase_next_iteration() ((void) 0)
+#endif
+
 typedef void (* DBusShutdownFunction) (void *data);
 DBUS_PRIVATE_EXPORT
 dbus_bool_t _dbus_register_shutdown_func          (DBusShutdownFunction  function,
@@ -349,10 +437,16 @@ typedef enum
   _DBUS_LOCK_shutdown_funcs,
   _DBUS_LOCK_system_users,
   _DBUS_LOCK_message_cache,
-  /* index 10-12 */
+  /* index 10-14 */
   _DBUS_LOCK_shared_connections,
   _DBUS_LOCK_machine_uuid,
   _DBUS_LOCK_sysdeps,
+  _DBUS_LOCK_hash_seed,
+  _DBUS_LOCK_keyrings,
+  /* index 15-19 */
+  _DBUS_LOCK_nonce,
+  _DBUS_LOCK_body_pool,
+  _DBUS_LOCK_pending_call_cache,
 
   _DBUS_N_GLOBAL_LOCKS
 } DBusGlobalLock;
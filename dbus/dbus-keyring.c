@@ -27,6 +27,7 @@
 #include <dbus/dbus-string.h>
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-sysdeps.h>
+#include <dbus/dbus-file.h>
 
 /**
  * @defgroup DBusKeyring keyring class
@@ -86,6 +87,12 @@
 #define MAX_KEYS_IN_FILE 256
 #endif
 
+/**
+ * Maximum number of keyrings kept loaded for reuse by later
+ * authentications
+ */
+#define MAX_CACHED_KEYRINGS 4
+
 /**
  * A single key from the cookie file
  */
@@ -114,11 +121,24 @@ struct DBusKeyring
   DBusString directory;     /**< Directory the below two items are inside */
   DBusString filename;      /**< Keyring filename */
   DBusString filename_lock; /**< Name of lockfile */
+  DBusString context;       /**< Context the keyring was created for */
   DBusKey *keys; /**< Keys loaded from the file */
   int n_keys;    /**< Number of keys */
+  DBusFileStamp stamp; /**< File as of when the keys were loaded */
+  dbus_bool_t have_stamp; /**< #TRUE if @c stamp is valid */
   DBusCredentials *credentials; /**< Credentials containing user the keyring is for */
 };
 
+/*
+ * Every DBusAuth used to load its own keyring, so each connection
+ * using DBUS_COOKIE_SHA1 re-read and parsed the file. Keyrings are
+ * shared instead; all access to a keyring's keys and refcount, and to
+ * this list, is under this lock.
+ *
+ * Protected by _DBUS_LOCK (keyrings)
+ */
+static DBusList *cached_keyrings = NULL;
+
 static DBusKeyring*
 _dbus_keyring_new (void)
 {
@@ -136,6 +156,9 @@ _dbus_keyring_new (void)
 
   if (!_dbus_string_init (&keyring->filename_lock))
     goto out_3;
+
+  if (!_dbus_string_init (&keyring->context))
+    goto out_4;
   
   keyring->refcount = 1;
   keyring->keys = NULL;
@@ -143,6 +166,8 @@ _dbus_keyring_new (void)
 
   return keyring;
 
+ out_4:
+  _dbus_string_free (&keyring->filename_lock);
  out_3:
   _dbus_string_free (&keyring->filename);
  out_2:
@@ -400,6 +425,8 @@ _dbus_keyring_reload (DBusKeyring *keyring,
   int i;
   long now;
   DBusError tmp_error;
+  DBusFileStamp stamp;
+  dbus_bool_t have_stamp;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
   
@@ -423,6 +450,7 @@ _dbus_keyring_reload (DBusKeyring *keyring,
   n_keys = 0;
   retval = FALSE;
   have_lock = FALSE;
+  _DBUS_ZERO (stamp);
 
   _dbus_get_real_time (&now, NULL);
   
@@ -438,6 +466,10 @@ _dbus_keyring_reload (DBusKeyring *keyring,
       have_lock = TRUE;
     }
 
+  /* Stamp the file before reading it, so a change that races with
+   * the read is noticed next time */
+  have_stamp = _dbus_file_get_stamp (&keyring->filename, &stamp);
+
   dbus_error_init (&tmp_error);
   if (!_dbus_file_get_contents (&contents, 
                                 &keyring->filename,
@@ -601,6 +633,9 @@ _dbus_keyring_reload (DBusKeyring *keyring,
       if (!_dbus_string_save_to_file (&contents, &keyring->filename,
                                       FALSE, error))
         goto out;
+
+      /* We hold the lock, so nobody else has changed it since */
+      have_stamp = _dbus_file_get_stamp (&keyring->filename, &stamp);
     }
 
   if (keyring->keys)
@@ -609,6 +644,9 @@ _dbus_keyring_reload (DBusKeyring *keyring,
   keyring->n_keys = n_keys;
   keys = NULL;
   n_keys = 0;
+
+  keyring->stamp = stamp;
+  keyring->have_stamp = have_stamp;
   
   retval = TRUE;  
   
@@ -645,6 +683,114 @@ _dbus_keyring_reload (DBusKeyring *keyring,
   return retval;
 }
 
+static void
+keyring_unref_unlocked (DBusKeyring *keyring)
+{
+  keyring->refcount -= 1;
+
+  if (keyring->refcount == 0)
+    {
+      if (keyring->credentials)
+        _dbus_credentials_unref (keyring->credentials);
+
+      _dbus_string_free (&keyring->filename);
+      _dbus_string_free (&keyring->filename_lock);
+      _dbus_string_free (&keyring->directory);
+      _dbus_string_free (&keyring->context);
+      free_keys (keyring->keys, keyring->n_keys);
+      dbus_free (keyring);      
+    }
+}
+
+static void
+forget_cached_keyrings_unlocked (void)
+{
+  DBusKeyring *keyring;
+
+  while ((keyring = _dbus_list_pop_first (&cached_keyrings)) != NULL)
+    keyring_unref_unlocked (keyring);
+}
+
+static void
+shutdown_cached_keyrings (void *data)
+{
+  if (!_DBUS_LOCK (keyrings))
+    _dbus_assert_not_reached ("global locks were initialized already");
+
+  forget_cached_keyrings_unlocked ();
+
+  _DBUS_UNLOCK (keyrings);
+}
+
+/* Returns a new ref to a cached keyring for this user and context,
+ * re-reading its file if that has changed, or NULL. The cached
+ * keyring moves to the front of the list. */
+static DBusKeyring *
+lookup_cached_keyring_unlocked (DBusCredentials  *credentials,
+                                const DBusString *context)
+{
+  DBusList *link;
+  DBusKeyring *keyring;
+  DBusFileStamp stamp;
+
+  link = _dbus_list_get_first_link (&cached_keyrings);
+  while (link != NULL)
+    {
+      keyring = link->data;
+
+      if (_dbus_credentials_same_user (keyring->credentials, credentials) &&
+          _dbus_string_equal (&keyring->context, context))
+        break;
+
+      link = _dbus_list_get_next_link (&cached_keyrings, link);
+    }
+
+  if (link == NULL)
+    return NULL;
+
+  _dbus_list_unlink (&cached_keyrings, link);
+  _dbus_list_prepend_link (&cached_keyrings, link);
+
+  /* A stat() is much cheaper than reading and parsing the file */
+  if (!keyring->have_stamp ||
+      !_dbus_file_get_stamp (&keyring->filename, &stamp) ||
+      !_dbus_file_stamp_equal (&stamp, &keyring->stamp))
+    {
+      DBusError tmp_error;
+
+      /* As when the keyring was created, keep going with what we
+       * have if the file can't be read */
+      dbus_error_init (&tmp_error);
+      if (!_dbus_keyring_reload (keyring, FALSE, &tmp_error))
+        {
+          _dbus_verbose ("didn't reload cached keyring: %s\n",
+                         tmp_error.message);
+          dbus_error_free (&tmp_error);
+        }
+    }
+
+  keyring->refcount += 1;
+  return keyring;
+}
+
+/* Keeps a ref to a newly created keyring for later lookups; if that
+ * fails for lack of memory the keyring just isn't shared. */
+static void
+cache_keyring_unlocked (DBusKeyring *keyring)
+{
+  if (cached_keyrings == NULL &&
+      !_dbus_register_shutdown_func (shutdown_cached_keyrings, NULL))
+    return;
+
+  if (!_dbus_list_prepend (&cached_keyrings, keyring))
+    return;
+
+  keyring->refcount += 1;
+
+  if (_dbus_list_get_length (&cached_keyrings) > MAX_CACHED_KEYRINGS)
+    keyring_unref_unlocked (_dbus_list_pop_last (&cached_keyrings));
+}
+
 /** @} */ /* end of internals */
 
 /**
@@ -662,8 +808,13 @@ _dbus_keyring_reload (DBusKeyring *keyring,
 DBusKeyring *
 _dbus_keyring_ref (DBusKeyring *keyring)
 {
+  if (!_DBUS_LOCK (keyrings))
+    _dbus_assert_not_reached ("global locks were initialized already");
+
   keyring->refcount += 1;
 
+  _DBUS_UNLOCK (keyrings);
+
   return keyring;
 }
 
@@ -676,19 +827,12 @@ _dbus_keyring_ref (DBusKeyring *keyring)
 void
 _dbus_keyring_unref (DBusKeyring *keyring)
 {
-  keyring->refcount -= 1;
+  if (!_DBUS_LOCK (keyrings))
+    _dbus_assert_not_reached ("global locks were initialized already");
 
-  if (keyring->refcount == 0)
-    {
-      if (keyring->credentials)
-        _dbus_credentials_unref (keyring->credentials);
+  keyring_unref_unlocked (keyring);
 
-      _dbus_string_free (&keyring->filename);
-      _dbus_string_free (&keyring->filename_lock);
-      _dbus_string_free (&keyring->directory);
-      free_keys (keyring->keys, keyring->n_keys);
-      dbus_free (keyring);      
-    }
+  _DBUS_UNLOCK (keyrings);
 }
 
 /**
@@ -748,6 +892,20 @@ _dbus_keyring_new_for_credentials (DBusCredentials  *credentials,
       if (!_dbus_credentials_add_from_current_process (our_credentials))
         goto failed;
     }
+
+  if (!_DBUS_LOCK (keyrings))
+    goto failed;
+
+  keyring = lookup_cached_keyring_unlocked (our_credentials, context);
+
+  _DBUS_UNLOCK (keyrings);
+
+  if (keyring != NULL)
+    {
+      _dbus_credentials_unref (our_credentials);
+      _dbus_string_free (&ringdir);
+      return keyring;
+    }
   
   if (!_dbus_append_keyring_directory_for_credentials (&ringdir,
                                                        our_credentials))
@@ -771,6 +929,9 @@ _dbus_keyring_new_for_credentials (DBusCredentials  *credentials,
       goto failed;
     }
 
+  if (!_dbus_string_copy (context, 0, &keyring->context, 0))
+    goto failed;
+
   /* Save keyring dir in the keyring object */
   if (!_dbus_string_copy (&ringdir, 0,
                           &keyring->directory, 0))
@@ -815,6 +976,13 @@ _dbus_keyring_new_for_credentials (DBusCredentials  *credentials,
       dbus_error_free (&tmp_error);
     }
 
+  if (!_DBUS_LOCK (keyrings))
+    goto failed;
+
+  cache_keyring_unlocked (keyring);
+
+  _DBUS_UNLOCK (keyrings);
+
   _dbus_string_free (&ringdir);
   
   return keyring;
@@ -946,30 +1114,44 @@ _dbus_keyring_get_best_key (DBusKeyring  *keyring,
                             DBusError    *error)
 {
   DBusKey *key;
+  int id;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!_DBUS_LOCK (keyrings))
+    _dbus_assert_not_reached ("global locks were initialized already");
   
   key = find_recent_key (keyring);
   if (key)
-    return key->id;
+    {
+      id = key->id;
+      goto out;
+    }
 
   /* All our keys are too old, or we've never loaded the
    * keyring. Create a new one.
    */
   if (!_dbus_keyring_reload (keyring, TRUE,
                              error))
-    return -1;
+    {
+      id = -1;
+      goto out;
+    }
 
   key = find_recent_key (keyring);
   if (key)
-    return key->id;
+    id = key->id;
   else
     {
       dbus_set_error_const (error,
                             DBUS_ERROR_FAILED,
                             "No recent-enough key found in keyring, and unable to create a new key");
-      return -1;
+      id = -1;
     }
+
+ out:
+  _DBUS_UNLOCK (keyrings);
+  return id;
 }
 
 /**
@@ -1005,16 +1187,59 @@ _dbus_keyring_get_hex_key (DBusKeyring       *keyring,
                            DBusString        *hex_key)
 {
   DBusKey *key;
+  dbus_bool_t retval;
+  long now;
+
+  if (!_DBUS_LOCK (keyrings))
+    _dbus_assert_not_reached ("global locks were initialized already");
+
+  _dbus_get_real_time (&now, NULL);
 
   key = find_key_by_id (keyring->keys,
                         keyring->n_keys,
                         key_id);
+
+  /* The keyring may be shared and loaded a while ago, so a key the
+   * other side has just created, or one that has since expired from
+   * the file, means we should look at the file again. */
+  if (key == NULL ||
+      (now - EXPIRE_KEYS_TIMEOUT_SECONDS) > key->creation_time)
+    {
+      DBusError tmp_error;
+
+      dbus_error_init (&tmp_error);
+      if (!_dbus_keyring_reload (keyring, FALSE, &tmp_error))
+        {
+          _dbus_verbose ("didn't reload keyring: %s\n", tmp_error.message);
+
+          if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
+            {
+              dbus_error_free (&tmp_error);
+              retval = FALSE;
+              goto out;
+            }
+
+          dbus_error_free (&tmp_error);
+        }
+
+      key = find_key_by_id (keyring->keys,
+                            keyring->n_keys,
+                            key_id);
+    }
+
   if (key == NULL)
-    return TRUE; /* had enough memory, so TRUE */
+    {
+      retval = TRUE; /* had enough memory, so TRUE */
+      goto out;
+    }
 
-  return _dbus_string_hex_encode (&key->secret, 0,
-                                  hex_key,
-                                  _dbus_string_get_length (hex_key));
+  retval = _dbus_string_hex_encode (&key->secret, 0,
+                                    hex_key,
+                                    _dbus_string_get_length (hex_key));
+
+ out:
+  _DBUS_UNLOCK (keyrings);
+  return retval;
 }
 
 /** @} */ /* end of exposed API */
@@ -1088,8 +1313,21 @@ _dbus_keyring_test (void)
       goto failure;
     }
 
+  /* Keyrings are shared between users of the same file... */
+  ring2 = _dbus_keyring_new_for_credentials (NULL, &context, &error);
+  _dbus_assert (ring2 == ring1);
+  _dbus_assert (error.name == NULL);
+  _dbus_keyring_unref (ring2);
+
+  /* ...so forget it to check the key really was saved */
+  if (!_DBUS_LOCK (keyrings))
+    _dbus_assert_not_reached ("global locks were initialized already");
+  forget_cached_keyrings_unlocked ();
+  _DBUS_UNLOCK (keyrings);
+
   ring2 = _dbus_keyring_new_for_credentials (NULL, &context, &error);
   _dbus_assert (ring2 != NULL);
+  _dbus_assert (ring2 != ring1);
   _dbus_assert (error.name == NULL);
   
   if (ring1->n_keys != ring2->n_keys)
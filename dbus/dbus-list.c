@@ -27,6 +27,10 @@
 #include "dbus-mempool.h"
 #include "dbus-threads-internal.h"
 
+#ifdef HAVE_SCHED_GETCPU
+#include <sched.h>
+#endif
+
 /**
  * @defgroup DBusList Linked list
  * @ingroup  DBusInternals
@@ -37,6 +41,39 @@
 
 /* Protected by _DBUS_LOCK (list) */
 static DBusMemPool *list_pool;
+static int list_pool_links_in_use = 0;
+static dbus_bool_t list_pool_shutdown_registered = FALSE;
+
+#ifdef HAVE_SCHED_GETCPU
+/* Number of per-CPU link caches; more CPUs than this share them */
+#define LINK_CACHE_N_SHARDS 16
+/* Capacity of a cache */
+#define LINK_CACHE_SIZE 32
+/* How many links a cache takes from, or gives back to, the pool at once */
+#define LINK_CACHE_BATCH (LINK_CACHE_SIZE / 2)
+
+typedef struct
+{
+  DBusCMutex *lock;                  /**< Protects the rest */
+  int n_links;                       /**< Used length of links */
+  DBusList *links[LINK_CACHE_SIZE];  /**< Free links, already counted as in use */
+} LinkCache;
+
+/* A magazine of free links per CPU, so that threads on different CPUs
+ * allocate and free links without all serializing on _DBUS_LOCK (list);
+ * that lock is only taken to move a batch between a cache and the pool.
+ * A cache lock may be held while taking _DBUS_LOCK (list), never the
+ * other way round. The caches exist from when the pool's shutdown
+ * function is registered until dbus_shutdown(), which returns their
+ * links to the pool.
+ */
+static LinkCache link_caches[LINK_CACHE_N_SHARDS];
+/* Whether the caches are usable. Only changed under _DBUS_LOCK (list),
+ * but read without it, in the same way as _dbus_lock() checks whether
+ * the global locks exist; it only becomes TRUE after the cache locks
+ * have been created. */
+static dbus_bool_t link_caches_enabled = FALSE;
+#endif
 
 /**
  * @defgroup DBusListInternals Linked list implementation details
@@ -48,14 +85,204 @@ static DBusMemPool *list_pool;
  * @{
  */
 
+/* While a shutdown function is registered, the pool is kept around
+ * when its last link is freed, so that code which repeatedly creates
+ * and empties a list doesn't recreate the pool (and its blocks) each
+ * time; dbus_shutdown() releases it. If registering failed, or after
+ * shutdown, the pool is freed as soon as it becomes empty.
+ */
+#ifdef HAVE_SCHED_GETCPU
+/* Called with _DBUS_LOCK (list) held */
+static void
+link_caches_init_unlocked (void)
+{
+  int i;
+
+  for (i = 0; i < LINK_CACHE_N_SHARDS; i++)
+    {
+      _dbus_cmutex_new_at_location (&link_caches[i].lock);
+
+      if (link_caches[i].lock == NULL)
+        {
+          /* not fatal, we just don't cache */
+          while (i-- > 0)
+            _dbus_cmutex_free_at_location (&link_caches[i].lock);
+
+          return;
+        }
+
+      link_caches[i].n_links = 0;
+    }
+
+  link_caches_enabled = TRUE;
+}
+
+static LinkCache *
+link_cache_for_this_cpu (void)
+{
+  int cpu;
+
+  cpu = sched_getcpu ();
+  if (cpu < 0)
+    cpu = 0;
+
+  return &link_caches[cpu % LINK_CACHE_N_SHARDS];
+}
+
+static void free_link_unlocked (DBusList *link);
+
+/* Moves up to count links from the cache to the pool; called with
+ * the cache's lock held */
+static void
+link_cache_flush (LinkCache *cache,
+                  int        count)
+{
+  if (!_DBUS_LOCK (list))
+    _dbus_assert_not_reached ("we should have initialized global locks "
+        "before we allocated a linked-list link");
+
+  while (count > 0 && cache->n_links > 0)
+    {
+      cache->n_links -= 1;
+      free_link_unlocked (cache->links[cache->n_links]);
+      count -= 1;
+    }
+
+  _DBUS_UNLOCK (list);
+}
+
+static DBusList *
+link_cache_alloc (void)
+{
+  LinkCache *cache;
+  DBusList *link;
+
+  cache = link_cache_for_this_cpu ();
+  link = NULL;
+
+  _dbus_cmutex_lock (cache->lock);
+
+  if (cache->n_links == 0 && _DBUS_LOCK (list))
+    {
+      while (cache->n_links < LINK_CACHE_BATCH)
+        {
+          link = _dbus_mem_pool_alloc (list_pool);
+          if (link == NULL)
+            break;
+
+          list_pool_links_in_use += 1;
+          cache->links[cache->n_links] = link;
+          cache->n_links += 1;
+        }
+
+      _DBUS_UNLOCK (list);
+    }
+
+  if (cache->n_links > 0)
+    {
+      cache->n_links -= 1;
+      link = cache->links[cache->n_links];
+      /* as if it came straight from the zero-initializing pool */
+      link->prev = NULL;
+      link->next = NULL;
+    }
+  else
+    {
+      link = NULL;
+    }
+
+  _dbus_cmutex_unlock (cache->lock);
+
+  return link;
+}
+
+static void
+link_cache_free (DBusList *link)
+{
+  LinkCache *cache;
+
+  cache = link_cache_for_this_cpu ();
+
+  _dbus_cmutex_lock (cache->lock);
+
+  if (cache->n_links == LINK_CACHE_SIZE)
+    link_cache_flush (cache, LINK_CACHE_BATCH);
+
+  cache->links[cache->n_links] = link;
+  cache->n_links += 1;
+
+  _dbus_cmutex_unlock (cache->lock);
+}
+
+static void
+link_caches_shutdown (void)
+{
+  int i;
+
+  if (!link_caches_enabled)
+    return;
+
+  for (i = 0; i < LINK_CACHE_N_SHARDS; i++)
+    {
+      _dbus_cmutex_lock (link_caches[i].lock);
+      link_cache_flush (&link_caches[i], LINK_CACHE_SIZE);
+      _dbus_cmutex_unlock (link_caches[i].lock);
+    }
+
+  if (!_DBUS_LOCK (list))
+    _dbus_assert_not_reached ("we would have initialized global locks "
+        "before registering a shutdown function");
+
+  link_caches_enabled = FALSE;
+
+  _DBUS_UNLOCK (list);
+
+  for (i = 0; i < LINK_CACHE_N_SHARDS; i++)
+    _dbus_cmutex_free_at_location (&link_caches[i].lock);
+}
+#endif /* HAVE_SCHED_GETCPU */
+
+static void
+list_pool_shutdown (void *data)
+{
+#ifdef HAVE_SCHED_GETCPU
+  link_caches_shutdown ();
+#endif
+
+  if (!_DBUS_LOCK (list))
+    _dbus_assert_not_reached ("we would have initialized global locks "
+        "before registering a shutdown function");
+
+  list_pool_shutdown_registered = FALSE;
+
+  if (list_pool != NULL && list_pool_links_in_use == 0)
+    {
+      _dbus_mem_pool_free (list_pool);
+      list_pool = NULL;
+    }
+
+  _DBUS_UNLOCK (list);
+}
+
 /* the mem pool is probably a speed hit, with the thread
  * lock, though it does still save memory - unknown.
  */
 static DBusList*
-alloc_link (void *data)
+alloc_link_from_pool (void *data)
 {
   DBusList *link;
 
+#ifdef HAVE_SCHED_GETCPU
+  if (link_caches_enabled)
+    {
+      link = link_cache_alloc ();
+      if (link != NULL)
+        link->data = data;
+
+      return link;
+    }
+#endif
+
   if (!_DBUS_LOCK (list))
     return FALSE;
 
@@ -77,6 +304,17 @@ alloc_link (void *data)
           _DBUS_UNLOCK (list);
           return NULL;
         }
+
+      /* Failing to register only means the pool is freed when empty */
+      if (!list_pool_shutdown_registered)
+        list_pool_shutdown_registered =
+          _dbus_register_shutdown_func (list_pool_shutdown, NULL);
+
+#ifdef HAVE_SCHED_GETCPU
+      /* the caches rely on the shutdown function to empty them */
+      if (list_pool_shutdown_registered)
+        link_caches_init_unlocked ();
+#endif
     }
   else
     {
@@ -84,25 +322,59 @@ alloc_link (void *data)
     }
 
   if (link)
-    link->data = data;
+    {
+      link->data = data;
+      list_pool_links_in_use += 1;
+    }
   
   _DBUS_UNLOCK (list);
 
   return link;
 }
 
+static DBusList*
+alloc_link (void *data)
+{
+  DBusList *link;
+  DBusMemoryTag old_tag;
+
+  old_tag = _dbus_memory_push_tag (DBUS_MEMORY_TAG_LIST);
+  link = alloc_link_from_pool (data);
+  _dbus_memory_pop_tag (old_tag);
+
+  return link;
+}
+
+static void
+free_link_unlocked (DBusList *link)
+{
+  _dbus_assert (list_pool_links_in_use > 0);
+  list_pool_links_in_use -= 1;
+
+  if (_dbus_mem_pool_dealloc (list_pool, link) &&
+      !list_pool_shutdown_registered)
+    {
+      _dbus_mem_pool_free (list_pool);
+      list_pool = NULL;
+    }
+}
+
 static void
 free_link (DBusList *link)
 {  
+#ifdef HAVE_SCHED_GETCPU
+  if (link_caches_enabled)
+    {
+      link_cache_free (link);
+      return;
+    }
+#endif
+
   if (!_DBUS_LOCK (list))
     _dbus_assert_not_reached ("we should have initialized global locks "
         "before we allocated a linked-list link");
 
-  if (_dbus_mem_pool_dealloc (list_pool, link))
-    {
-      _dbus_mem_pool_free (list_pool);
-      list_pool = NULL;
-    }
+  free_link_unlocked (link);
   
   _DBUS_UNLOCK (list);
 }
@@ -156,6 +428,22 @@ _dbus_list_get_stats     (dbus_uint32_t *in_use_p,
                           dbus_uint32_t *in_free_list_p,
                           dbus_uint32_t *allocated_p)
 {
+  dbus_uint32_t cached = 0;
+
+#ifdef HAVE_SCHED_GETCPU
+  if (link_caches_enabled)
+    {
+      int i;
+
+      for (i = 0; i < LINK_CACHE_N_SHARDS; i++)
+        {
+          _dbus_cmutex_lock (link_caches[i].lock);
+          cached += link_caches[i].n_links * sizeof (DBusList);
+          _dbus_cmutex_unlock (link_caches[i].lock);
+        }
+    }
+#endif
+
   if (!_DBUS_LOCK (list))
     {
       *in_use_p = 0;
@@ -166,6 +454,11 @@ _dbus_list_get_stats     (dbus_uint32_t *in_use_p,
 
   _dbus_mem_pool_get_stats (list_pool, in_use_p, in_free_list_p, allocated_p);
   _DBUS_UNLOCK (list);
+
+  /* the pool counts links sitting in the per-CPU caches as in use */
+  cached = MIN (cached, *in_use_p);
+  *in_use_p -= cached;
+  *in_free_list_p += cached;
 }
 #endif
 
@@ -544,15 +837,25 @@ _dbus_list_clear (DBusList **list)
   DBusList *link;
 
   link = *list;
+  if (link == NULL)
+    return;
+
+  /* Free the whole list under a single acquisition of the lock */
+  if (!_DBUS_LOCK (list))
+    _dbus_assert_not_reached ("we should have initialized global locks "
+        "before we allocated a linked-list link");
+
   while (link != NULL)
     {
       DBusList *next = _dbus_list_get_next_link (list, link);
       
-      free_link (link);
+      free_link_unlocked (link);
       
       link = next;
     }
 
+  _DBUS_UNLOCK (list);
+
   *list = NULL;
 }
 
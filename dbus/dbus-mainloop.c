@@ -27,6 +27,7 @@
 
 #ifndef DOXYGEN_SHOULD_SKIP_THIS
 
+#include <dbus/dbus-connection-internal.h>
 #include <dbus/dbus-hash.h>
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-socket-set.h>
@@ -34,14 +35,33 @@
 
 #define MAINLOOP_SPEW 0
 
+/** Messages dispatched from a connection per round of _dbus_loop_dispatch() */
+#define MAX_MESSAGES_PER_DISPATCH 32
+/** Bytes of messages dispatched from a connection per round, on average */
+#define MAX_BYTES_PER_DISPATCH (64 * 1024)
+/** Ready fds collected per poll without allocating */
+#define N_STACK_DESCRIPTORS 64
+/** Most ready fds collected per poll, however many fds are watched */
+#define MAX_READY_FDS 4096
+
 struct DBusLoop
 {
   int refcount;
   /** DBusPollable => dbus_malloc'd DBusList ** of references to DBusWatch */
   DBusHashTable *watches;
   DBusSocketSet *socket_set;
-  DBusList *timeouts;
+  /** DBusTimeout * => TimeoutCallback * */
+  DBusHashTable *timeouts;
+  /** enabled TimeoutCallbacks, as a binary min-heap on expiration time */
+  struct TimeoutCallback **timeout_heap;
+  int timeout_heap_size;
+  int timeout_heap_allocated;
+  unsigned int timeout_pass; /**< number of times timeouts were checked */
   int callback_list_serial;
+  int watch_list_serial; /**< like callback_list_serial, but for watches only */
+  /** room for a ready event from each fd, up to MAX_READY_FDS */
+  DBusSocketEvent *ready_fds;
+  int ready_fds_allocated;
   int watch_count;
   int timeout_count;
   int depth; /**< number of recursive runs */
@@ -49,13 +69,19 @@ struct DBusLoop
   /** TRUE if we will skip a watch next time because it was OOM; becomes
    * FALSE between polling, and dealing with the results of the poll */
   unsigned oom_watch_pending : 1;
+  /** TRUE while an iteration is going through ready_fds, so that
+   * nested iterations use their own */
+  unsigned ready_fds_in_use : 1;
 };
 
-typedef struct
+typedef struct TimeoutCallback
 {
   DBusTimeout *timeout;
-  long last_tv_sec;
-  long last_tv_usec;
+  long expiration_tv_sec;
+  long expiration_tv_usec;
+  int interval; /**< interval the expiration time was computed from */
+  int heap_index; /**< index in timeout_heap, or -1 if not enabled */
+  unsigned int last_pass; /**< value of timeout_pass when last fired */
 } TimeoutCallback;
 
 #define TIMEOUT_CALLBACK(callback) ((TimeoutCallback*)callback)
@@ -70,8 +96,11 @@ timeout_callback_new (DBusTimeout         *timeout)
     return NULL;
 
   cb->timeout = timeout;
-  _dbus_get_monotonic_time (&cb->last_tv_sec,
-                            &cb->last_tv_usec);
+  cb->interval = 0;
+  cb->expiration_tv_sec = 0;
+  cb->expiration_tv_usec = 0;
+  cb->heap_index = -1;
+  cb->last_pass = 0;
   return cb;
 }
 
@@ -115,13 +144,20 @@ _dbus_loop_new (void)
   loop->watches = _dbus_hash_table_new (DBUS_HASH_POLLABLE, NULL,
                                         free_watch_table_entry);
 
+  loop->timeouts = _dbus_hash_table_new (DBUS_HASH_UINTPTR, NULL,
+                                         (DBusFreeFunction) timeout_callback_free);
+
   loop->socket_set = _dbus_socket_set_new (0);
 
-  if (loop->watches == NULL || loop->socket_set == NULL)
+  if (loop->watches == NULL || loop->timeouts == NULL ||
+      loop->socket_set == NULL)
     {
       if (loop->watches != NULL)
         _dbus_hash_table_unref (loop->watches);
 
+      if (loop->timeouts != NULL)
+        _dbus_hash_table_unref (loop->timeouts);
+
       if (loop->socket_set != NULL)
         _dbus_socket_set_free (loop->socket_set);
 
@@ -162,6 +198,9 @@ _dbus_loop_unref (DBusLoop *loop)
         }
 
       _dbus_hash_table_unref (loop->watches);
+      _dbus_hash_table_unref (loop->timeouts);
+      dbus_free (loop->timeout_heap);
+      dbus_free (loop->ready_fds);
       _dbus_socket_set_free (loop->socket_set);
       dbus_free (loop);
     }
@@ -307,6 +346,7 @@ _dbus_loop_add_watch (DBusLoop  *loop,
     }
 
   loop->callback_list_serial += 1;
+  loop->watch_list_serial += 1;
   loop->watch_count += 1;
   return TRUE;
 }
@@ -346,6 +386,7 @@ _dbus_loop_remove_watch (DBusLoop         *loop,
             {
               _dbus_list_remove_link (watches, link);
               loop->callback_list_serial += 1;
+              loop->watch_list_serial += 1;
               loop->watch_count -= 1;
               _dbus_watch_unref (this);
 
@@ -366,27 +407,220 @@ _dbus_loop_remove_watch (DBusLoop         *loop,
   _dbus_warn ("could not find watch %p to remove\n", watch);
 }
 
+static dbus_bool_t
+timeout_heap_less (TimeoutCallback *a,
+                   TimeoutCallback *b)
+{
+  if (a->expiration_tv_sec != b->expiration_tv_sec)
+    return a->expiration_tv_sec < b->expiration_tv_sec;
+
+  return a->expiration_tv_usec < b->expiration_tv_usec;
+}
+
+static void
+timeout_heap_set (DBusLoop        *loop,
+                  int              i,
+                  TimeoutCallback *tcb)
+{
+  loop->timeout_heap[i] = tcb;
+  tcb->heap_index = i;
+}
+
+static void
+timeout_heap_sift_up (DBusLoop *loop,
+                      int       i)
+{
+  TimeoutCallback *tcb = loop->timeout_heap[i];
+
+  while (i > 0)
+    {
+      int parent = (i - 1) / 2;
+
+      if (!timeout_heap_less (tcb, loop->timeout_heap[parent]))
+        break;
+
+      timeout_heap_set (loop, i, loop->timeout_heap[parent]);
+      i = parent;
+    }
+
+  timeout_heap_set (loop, i, tcb);
+}
+
+static void
+timeout_heap_sift_down (DBusLoop *loop,
+                        int       i)
+{
+  TimeoutCallback *tcb = loop->timeout_heap[i];
+
+  while (TRUE)
+    {
+      int child = 2 * i + 1;
+
+      if (child >= loop->timeout_heap_size)
+        break;
+
+      if (child + 1 < loop->timeout_heap_size &&
+          timeout_heap_less (loop->timeout_heap[child + 1],
+                             loop->timeout_heap[child]))
+        child += 1;
+
+      if (!timeout_heap_less (loop->timeout_heap[child], tcb))
+        break;
+
+      timeout_heap_set (loop, i, loop->timeout_heap[child]);
+      i = child;
+    }
+
+  timeout_heap_set (loop, i, tcb);
+}
+
+/* Space for every added timeout is reserved by _dbus_loop_add_timeout(),
+ * so this can't fail */
+static void
+timeout_heap_insert (DBusLoop        *loop,
+                     TimeoutCallback *tcb)
+{
+  _dbus_assert (tcb->heap_index < 0);
+  _dbus_assert (loop->timeout_heap_size < loop->timeout_heap_allocated);
+
+  loop->timeout_heap_size += 1;
+  timeout_heap_set (loop, loop->timeout_heap_size - 1, tcb);
+  timeout_heap_sift_up (loop, tcb->heap_index);
+}
+
+static void
+timeout_heap_remove (DBusLoop        *loop,
+                     TimeoutCallback *tcb)
+{
+  TimeoutCallback *last;
+  int i;
+
+  i = tcb->heap_index;
+  _dbus_assert (i >= 0 && i < loop->timeout_heap_size);
+
+  loop->timeout_heap_size -= 1;
+  last = loop->timeout_heap[loop->timeout_heap_size];
+  tcb->heap_index = -1;
+
+  if (last != tcb)
+    {
+      timeout_heap_set (loop, i, last);
+      timeout_heap_sift_up (loop, i);
+      timeout_heap_sift_down (loop, last->heap_index);
+    }
+}
+
+/* Returns the enabled timeout that expires first, or NULL. A timeout
+ * that was disabled without calling _dbus_loop_toggle_timeout() is
+ * dropped from the heap here rather than fired.
+ */
+static TimeoutCallback *
+timeout_heap_peek (DBusLoop *loop)
+{
+  while (loop->timeout_heap_size > 0)
+    {
+      TimeoutCallback *tcb = loop->timeout_heap[0];
+
+      if (dbus_timeout_get_enabled (tcb->timeout))
+        return tcb;
+
+      timeout_heap_remove (loop, tcb);
+    }
+
+  return NULL;
+}
+
+/* Start the timeout's current interval from the given time */
+static void
+timeout_callback_arm (TimeoutCallback *tcb,
+                      long             tv_sec,
+                      long             tv_usec)
+{
+  tcb->interval = dbus_timeout_get_interval (tcb->timeout);
+
+  tcb->expiration_tv_sec = tv_sec + tcb->interval / 1000L;
+  tcb->expiration_tv_usec = tv_usec + (tcb->interval % 1000L) * 1000;
+  if (tcb->expiration_tv_usec >= 1000000)
+    {
+      tcb->expiration_tv_usec -= 1000000;
+      tcb->expiration_tv_sec += 1;
+    }
+}
+
+/* Bring the heap in line with the timeout's enabled flag and interval */
+static void
+refresh_timeout (DBusLoop        *loop,
+                 TimeoutCallback *tcb)
+{
+  if (dbus_timeout_get_enabled (tcb->timeout))
+    {
+      long tv_sec;
+      long tv_usec;
+
+      _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+      timeout_callback_arm (tcb, tv_sec, tv_usec);
+
+      if (tcb->heap_index < 0)
+        {
+          timeout_heap_insert (loop, tcb);
+        }
+      else
+        {
+          timeout_heap_sift_up (loop, tcb->heap_index);
+          timeout_heap_sift_down (loop, tcb->heap_index);
+        }
+    }
+  else if (tcb->heap_index >= 0)
+    {
+      timeout_heap_remove (loop, tcb);
+    }
+}
+
+/**
+ * Adds a timeout to the loop. The loop only looks at the timeout's
+ * enabled flag and interval when it is added, and when
+ * _dbus_loop_toggle_timeout() is called; either starts a new interval.
+ */
 dbus_bool_t
 _dbus_loop_add_timeout (DBusLoop           *loop,
                         DBusTimeout        *timeout)
 {
   TimeoutCallback *tcb;
 
+  _dbus_assert (_dbus_hash_table_lookup_uintptr (loop->timeouts,
+                                                 (uintptr_t) timeout) == NULL);
+
+  if (loop->timeout_count >= loop->timeout_heap_allocated)
+    {
+      TimeoutCallback **heap;
+      int allocated;
+
+      allocated = MAX (loop->timeout_heap_allocated * 2, 8);
+      heap = dbus_realloc (loop->timeout_heap,
+                           allocated * sizeof (TimeoutCallback *));
+      if (heap == NULL)
+        return FALSE;
+
+      loop->timeout_heap = heap;
+      loop->timeout_heap_allocated = allocated;
+    }
+
   tcb = timeout_callback_new (timeout);
   if (tcb == NULL)
     return FALSE;
 
-  if (_dbus_list_append (&loop->timeouts, tcb))
-    {
-      loop->callback_list_serial += 1;
-      loop->timeout_count += 1;
-    }
-  else
+  if (!_dbus_hash_table_insert_uintptr (loop->timeouts, (uintptr_t) timeout,
+                                        tcb))
     {
       timeout_callback_free (tcb);
       return FALSE;
     }
-  
+
+  loop->callback_list_serial += 1;
+  loop->timeout_count += 1;
+
+  refresh_timeout (loop, tcb);
+
   return TRUE;
 }
 
@@ -394,75 +628,67 @@ void
 _dbus_loop_remove_timeout (DBusLoop           *loop,
                            DBusTimeout        *timeout)
 {
-  DBusList *link;
-  
-  link = _dbus_list_get_first_link (&loop->timeouts);
-  while (link != NULL)
+  TimeoutCallback *tcb;
+
+  tcb = _dbus_hash_table_lookup_uintptr (loop->timeouts, (uintptr_t) timeout);
+  if (tcb == NULL)
     {
-      DBusList *next = _dbus_list_get_next_link (&loop->timeouts, link);
-      TimeoutCallback *this = link->data;
+      _dbus_warn ("could not find timeout %p to remove\n", timeout);
+      return;
+    }
 
-      if (this->timeout == timeout)
-        {
-          _dbus_list_remove_link (&loop->timeouts, link);
-          loop->callback_list_serial += 1;
-          loop->timeout_count -= 1;
-          timeout_callback_free (this);
+  if (tcb->heap_index >= 0)
+    timeout_heap_remove (loop, tcb);
 
-          return;
-        }
-      
-      link = next;
+  /* frees tcb */
+  _dbus_hash_table_remove_uintptr (loop->timeouts, (uintptr_t) timeout);
+
+  loop->callback_list_serial += 1;
+  loop->timeout_count -= 1;
+}
+
+/**
+ * Tells the loop that a timeout was enabled, disabled or given a new
+ * interval. If it is enabled, the interval starts again from now.
+ */
+void
+_dbus_loop_toggle_timeout (DBusLoop           *loop,
+                           DBusTimeout        *timeout)
+{
+  TimeoutCallback *tcb;
+
+  tcb = _dbus_hash_table_lookup_uintptr (loop->timeouts, (uintptr_t) timeout);
+  if (tcb == NULL)
+    {
+      _dbus_warn ("could not find timeout %p to toggle\n", timeout);
+      return;
     }
 
-  _dbus_warn ("could not find timeout %p to remove\n", timeout);
+  refresh_timeout (loop, tcb);
 }
 
 /* Convolutions from GLib, there really must be a better way
  * to do this.
  */
 static dbus_bool_t
-check_timeout (long            tv_sec,
-               long            tv_usec,
+check_timeout (DBusLoop        *loop,
+               long             tv_sec,
+               long             tv_usec,
                TimeoutCallback *tcb,
                int             *timeout)
 {
   long sec_remaining;
   long msec_remaining;
-  long expiration_tv_sec;
-  long expiration_tv_usec;
-  long interval_seconds;
-  long interval_milliseconds;
-  int interval;
 
-  /* I'm pretty sure this function could suck (a lot) less */
-  
-  interval = dbus_timeout_get_interval (tcb->timeout);
-  
-  interval_seconds = interval / 1000L;
-  interval_milliseconds = interval % 1000L;
-  
-  expiration_tv_sec = tcb->last_tv_sec + interval_seconds;
-  expiration_tv_usec = tcb->last_tv_usec + interval_milliseconds * 1000;
-  if (expiration_tv_usec >= 1000000)
-    {
-      expiration_tv_usec -= 1000000;
-      expiration_tv_sec += 1;
-    }
-  
-  sec_remaining = expiration_tv_sec - tv_sec;
-  msec_remaining = (expiration_tv_usec - tv_usec) / 1000L;
+  sec_remaining = tcb->expiration_tv_sec - tv_sec;
+  msec_remaining = (tcb->expiration_tv_usec - tv_usec) / 1000L;
 
 #if MAINLOOP_SPEW
-  _dbus_verbose ("Interval is %ld seconds %ld msecs\n",
-                 interval_seconds,
-                 interval_milliseconds);
+  _dbus_verbose ("Interval is %d msecs\n", tcb->interval);
   _dbus_verbose ("Now is  %lu seconds %lu usecs\n",
                  tv_sec, tv_usec);
-  _dbus_verbose ("Last is %lu seconds %lu usecs\n",
-                 tcb->last_tv_sec, tcb->last_tv_usec);
   _dbus_verbose ("Exp is  %lu seconds %lu usecs\n",
-                 expiration_tv_sec, expiration_tv_usec);
+                 tcb->expiration_tv_sec, tcb->expiration_tv_usec);
   _dbus_verbose ("Pre-correction, sec_remaining %ld msec_remaining %ld\n",
                  sec_remaining, msec_remaining);
 #endif
@@ -490,15 +716,16 @@ check_timeout (long            tv_sec,
         *timeout = sec_remaining * 1000 + msec_remaining;        
     }
 
-  if (*timeout > interval)
+  if (*timeout > tcb->interval)
     {
       /* This indicates that the system clock probably moved backward */
       _dbus_verbose ("System clock set backward! Resetting timeout.\n");
-      
-      tcb->last_tv_sec = tv_sec;
-      tcb->last_tv_usec = tv_usec;
 
-      *timeout = interval;
+      /* moves the expiration time earlier, so only ever up the heap */
+      timeout_callback_arm (tcb, tv_sec, tv_usec);
+      timeout_heap_sift_up (loop, tcb->heap_index);
+
+      *timeout = tcb->interval;
     }
   
 #if MAINLOOP_SPEW
@@ -519,6 +746,13 @@ _dbus_loop_dispatch (DBusLoop *loop)
   if (loop->need_dispatch == NULL)
     return FALSE;
   
+  /* Connections are served round-robin: one that still has messages
+   * after its batch goes to the back of the queue, so a single chatty
+   * peer can't hold up routing for everyone else on the loop. A batch
+   * is limited by bytes as well as messages, and a peer that overshoots
+   * with large messages sits out rounds to make up for it. Each
+   * connection's own messages are still dispatched in order.
+   */
  next:
   while (loop->need_dispatch != NULL)
     {
@@ -528,13 +762,21 @@ _dbus_loop_dispatch (DBusLoop *loop)
         {
           DBusDispatchStatus status;
           
-          status = dbus_connection_dispatch (connection);
+          status = _dbus_connection_dispatch_quantum (connection,
+                                                      MAX_MESSAGES_PER_DISPATCH,
+                                                      MAX_BYTES_PER_DISPATCH);
 
           if (status == DBUS_DISPATCH_COMPLETE)
             {
               dbus_connection_unref (connection);
               goto next;
             }
+          else if (status == DBUS_DISPATCH_DATA_REMAINS)
+            {
+              /* keeps our reference; on OOM just keep draining this one */
+              if (_dbus_list_append (&loop->need_dispatch, connection))
+                goto next;
+            }
           else
             {
               if (status == DBUS_DISPATCH_NEED_MEMORY)
@@ -559,6 +801,40 @@ _dbus_loop_queue_dispatch (DBusLoop       *loop,
     return FALSE;
 }
 
+/* Grows loop->ready_fds to hold an event from every watched fd, up to
+ * MAX_READY_FDS, so that a busy loop sees all its ready fds in one
+ * poll. Returns FALSE if the stack array would do as well, which
+ * includes running out of memory before it ever grew.
+ */
+static dbus_bool_t
+ensure_ready_fds (DBusLoop *loop)
+{
+  DBusSocketEvent *new_fds;
+  int wanted;
+
+  wanted = MIN (MAX_READY_FDS,
+                _dbus_hash_table_get_n_entries (loop->watches));
+
+  if (wanted > N_STACK_DESCRIPTORS && wanted > loop->ready_fds_allocated)
+    {
+      /* grow geometrically, so that adding fds one at a time doesn't
+       * reallocate every time */
+      wanted = MAX (wanted, 2 * loop->ready_fds_allocated);
+      wanted = MIN (wanted, MAX_READY_FDS);
+
+      new_fds = dbus_realloc (loop->ready_fds,
+                              wanted * sizeof (DBusSocketEvent));
+
+      if (new_fds != NULL)
+        {
+          loop->ready_fds = new_fds;
+          loop->ready_fds_allocated = wanted;
+        }
+    }
+
+  return loop->ready_fds_allocated > N_STACK_DESCRIPTORS;
+}
+
 /* Returns TRUE if we invoked any timeouts or have ready file
  * descriptors, which is just used in test code as a debug hack
  */
@@ -567,19 +843,27 @@ dbus_bool_t
 _dbus_loop_iterate (DBusLoop     *loop,
                     dbus_bool_t   block)
 {  
-#define N_STACK_DESCRIPTORS 64
   dbus_bool_t retval;
-  DBusSocketEvent ready_fds[N_STACK_DESCRIPTORS];
+  DBusSocketEvent stack_fds[N_STACK_DESCRIPTORS];
+  DBusSocketEvent *ready_fds;
+  int max_ready;
+  dbus_bool_t own_ready_fds;
   int i;
   DBusList *link;
   int n_ready;
   int initial_serial;
+  int initial_watch_serial;
   long timeout;
   int orig_depth;
 
   retval = FALSE;      
+  ready_fds = stack_fds;
+  max_ready = N_STACK_DESCRIPTORS;
+  own_ready_fds = FALSE;
 
   orig_depth = loop->depth;
+
+  _dbus_phase_next_iteration ();
   
 #if MAINLOOP_SPEW
   _dbus_verbose ("Iteration block=%d depth=%d timeout_count=%d watch_count=%d\n",
@@ -587,53 +871,37 @@ _dbus_loop_iterate (DBusLoop     *loop,
 #endif
 
   if (_dbus_hash_table_get_n_entries (loop->watches) == 0 &&
-      loop->timeouts == NULL)
+      loop->timeout_count == 0)
     goto next_iteration;
 
   timeout = -1;
   if (loop->timeout_count > 0)
     {
-      long tv_sec;
-      long tv_usec;
-      
-      _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+      /* only the first timeout to expire matters */
+      TimeoutCallback *tcb = timeout_heap_peek (loop);
 
-      link = _dbus_list_get_first_link (&loop->timeouts);
-      while (link != NULL)
+      if (tcb != NULL)
         {
-          DBusList *next = _dbus_list_get_next_link (&loop->timeouts, link);
-          TimeoutCallback *tcb = link->data;
+          long tv_sec;
+          long tv_usec;
+          int msecs_remaining;
 
-          if (dbus_timeout_get_enabled (tcb->timeout))
-            {
-              int msecs_remaining;
-
-              check_timeout (tv_sec, tv_usec, tcb, &msecs_remaining);
+          _dbus_get_monotonic_time (&tv_sec, &tv_usec);
 
-              if (timeout < 0)
-                timeout = msecs_remaining;
-              else
-                timeout = MIN (msecs_remaining, timeout);
+          check_timeout (loop, tv_sec, tv_usec, tcb, &msecs_remaining);
+          timeout = msecs_remaining;
 
 #if MAINLOOP_SPEW
-              _dbus_verbose ("  timeout added, %d remaining, aggregate timeout %ld\n",
-                             msecs_remaining, timeout);
+          _dbus_verbose ("  first timeout expires in %d milliseconds\n",
+                         msecs_remaining);
 #endif
-              
-              _dbus_assert (timeout >= 0);
-                  
-              if (timeout == 0)
-                break; /* it's not going to get shorter... */
-            }
+        }
 #if MAINLOOP_SPEW
-          else
-            {
-              _dbus_verbose ("  skipping disabled timeout\n");
-            }
-#endif
-          
-          link = next;
+      else
+        {
+          _dbus_verbose ("  no enabled timeouts\n");
         }
+#endif
     }
 
   /* Never block if we have stuff to dispatch */
@@ -651,12 +919,20 @@ _dbus_loop_iterate (DBusLoop     *loop,
   if (loop->oom_watch_pending)
     timeout = MIN (timeout, _dbus_get_oom_wait ());
 
+  if (!loop->ready_fds_in_use && ensure_ready_fds (loop))
+    {
+      ready_fds = loop->ready_fds;
+      max_ready = loop->ready_fds_allocated;
+      loop->ready_fds_in_use = TRUE;
+      own_ready_fds = TRUE;
+    }
+
 #if MAINLOOP_SPEW
-  _dbus_verbose ("  polling on %d descriptors timeout %ld\n", _DBUS_N_ELEMENTS (ready_fds), timeout);
+  _dbus_verbose ("  polling on %d descriptors timeout %ld\n", max_ready, timeout);
 #endif
 
   n_ready = _dbus_socket_set_poll (loop->socket_set, ready_fds,
-                                   _DBUS_N_ELEMENTS (ready_fds), timeout);
+                                   max_ready, timeout);
 
   /* re-enable any watches we skipped this time */
   if (loop->oom_watch_pending)
@@ -699,20 +975,21 @@ _dbus_loop_iterate (DBusLoop     *loop,
     }
 
   initial_serial = loop->callback_list_serial;
+  initial_watch_serial = loop->watch_list_serial;
 
   if (loop->timeout_count > 0)
     {
+      TimeoutCallback *tcb;
       long tv_sec;
       long tv_usec;
 
       _dbus_get_monotonic_time (&tv_sec, &tv_usec);
 
-      /* It'd be nice to avoid this O(n) thingy here */
-      link = _dbus_list_get_first_link (&loop->timeouts);
-      while (link != NULL)
+      loop->timeout_pass += 1;
+
+      while ((tcb = timeout_heap_peek (loop)) != NULL)
         {
-          DBusList *next = _dbus_list_get_next_link (&loop->timeouts, link);
-          TimeoutCallback *tcb = link->data;
+          int msecs_remaining;
 
           if (initial_serial != loop->callback_list_serial)
             goto next_iteration;
@@ -720,43 +997,36 @@ _dbus_loop_iterate (DBusLoop     *loop,
           if (loop->depth != orig_depth)
             goto next_iteration;
 
-          if (dbus_timeout_get_enabled (tcb->timeout))
-            {
-              int msecs_remaining;
-              
-              if (check_timeout (tv_sec, tv_usec,
-                                 tcb, &msecs_remaining))
-                {
-                  /* Save last callback time and fire this timeout */
-                  tcb->last_tv_sec = tv_sec;
-                  tcb->last_tv_usec = tv_usec;
+          /* each timeout fires at most once per iteration, even if its
+           * interval is 0 */
+          if (tcb->last_pass == loop->timeout_pass)
+            break;
 
+          if (!check_timeout (loop, tv_sec, tv_usec,
+                              tcb, &msecs_remaining))
+            {
 #if MAINLOOP_SPEW
-                  _dbus_verbose ("  invoking timeout\n");
+              _dbus_verbose ("  timeout has not expired\n");
 #endif
+              break; /* nor has anything after it */
+            }
 
-                  /* can theoretically return FALSE on OOM, but we just
-                   * let it fire again later - in practice that's what
-                   * every wrapper callback in dbus-daemon used to do */
-                  dbus_timeout_handle (tcb->timeout);
+          /* Start the next interval and fire this timeout; the handler
+           * is free to toggle or remove it */
+          tcb->last_pass = loop->timeout_pass;
+          timeout_callback_arm (tcb, tv_sec, tv_usec);
+          timeout_heap_sift_down (loop, tcb->heap_index);
 
-                  retval = TRUE;
-                }
-              else
-                {
-#if MAINLOOP_SPEW
-                  _dbus_verbose ("  timeout has not expired\n");
-#endif
-                }
-            }
 #if MAINLOOP_SPEW
-          else
-            {
-              _dbus_verbose ("  skipping invocation of disabled timeout\n");
-            }
+          _dbus_verbose ("  invoking timeout\n");
 #endif
 
-          link = next;
+          /* can theoretically return FALSE on OOM, but we just
+           * let it fire again later - in practice that's what
+           * every wrapper callback in dbus-daemon used to do */
+          dbus_timeout_handle (tcb->timeout);
+
+          retval = TRUE;
         }
     }
 
@@ -769,11 +1039,13 @@ _dbus_loop_iterate (DBusLoop     *loop,
           unsigned int condition;
           dbus_bool_t any_oom;
 
-          /* FIXME I think this "restart if we change the watches"
-           * approach could result in starving watches
-           * toward the end of the list.
+          /* Adding or removing a timeout doesn't affect any of this,
+           * so only a change to the watches, after which an fd could
+           * have been closed and reused, makes us go round again. That
+           * keeps the busy fds early in the list from starving the
+           * rest whenever their handlers set up timeouts.
            */
-          if (initial_serial != loop->callback_list_serial)
+          if (initial_watch_serial != loop->watch_list_serial)
             goto next_iteration;
 
           if (loop->depth != orig_depth)
@@ -833,7 +1105,7 @@ _dbus_loop_iterate (DBusLoop     *loop,
                   /* We re-check this every time, in case the callback
                    * added/removed watches, which might make our position in
                    * the linked list invalid. See the FIXME above. */
-                  if (initial_serial != loop->callback_list_serial ||
+                  if (initial_watch_serial != loop->watch_list_serial ||
                       loop->depth != orig_depth)
                     {
                       if (any_oom)
@@ -854,6 +1126,9 @@ _dbus_loop_iterate (DBusLoop     *loop,
   _dbus_verbose ("  moving to next iteration\n");
 #endif
 
+  if (own_ready_fds)
+    loop->ready_fds_in_use = FALSE;
+
   if (_dbus_loop_dispatch (loop))
     retval = TRUE;
   
@@ -467,34 +467,17 @@ _dbus_marshal_read_uint32  (const DBusString *str,
                               _dbus_string_get_const_data (str) + pos);
 }
 
-/**
- * Demarshals a basic-typed value. The "value" pointer is always
- * the address of a variable of the basic type. So e.g.
- * if the basic type is "double" then the pointer is
- * a double*, and if it's "char*" then the pointer is
- * a "char**".
- *
- * A value of type #DBusBasicValue is guaranteed to be large enough to
- * hold any of the types that may be returned, which is handy if you
- * are trying to do things generically. For example you can pass
- * a DBusBasicValue* in to this function, and then pass the same
- * DBusBasicValue* in to _dbus_marshal_basic_type() in order to
- * move a value from one place to another.
- *
- * @param str the string containing the data
- * @param pos position in the string
- * @param type type of value to demarshal
- * @param value pointer to return value data
- * @param byte_order the byte order
- * @param new_pos pointer to update with new position, or #NULL
- **/
-void
-_dbus_marshal_read_basic (const DBusString      *str,
-                          int                    pos,
-                          int                    type,
-                          void                  *value,
-                          int                    byte_order,
-                          int                   *new_pos)
+/* Callers always pass a constant byte order, so that the compiler
+ * expands this once for each byte order: the native copy has no swaps
+ * and no byte order tests left in it.
+ */
+static inline void
+read_basic_in_order (const DBusString      *str,
+                     int                    pos,
+                     int                    type,
+                     void                  *value,
+                     int                    byte_order,
+                     int                   *new_pos)
 {
   const char *str_data;
 
@@ -558,7 +541,10 @@ _dbus_marshal_read_basic (const DBusString      *str,
         int len;
         volatile char **vp = value;
 
-        len = _dbus_marshal_read_uint32 (str, pos, byte_order, &pos);
+        pos = _DBUS_ALIGN_VALUE (pos, 4);
+        len = _dbus_unpack_uint32 (byte_order,
+                                   (const unsigned char *) str_data + pos);
+        pos += 4;
 
         *vp = (char*) str_data + pos;
 
@@ -589,6 +575,45 @@ _dbus_marshal_read_basic (const DBusString      *str,
     *new_pos = pos;
 }
 
+/**
+ * Demarshals a basic-typed value. The "value" pointer is always
+ * the address of a variable of the basic type. So e.g.
+ * if the basic type is "double" then the pointer is
+ * a double*, and if it's "char*" then the pointer is
+ * a "char**".
+ *
+ * A value of type #DBusBasicValue is guaranteed to be large enough to
+ * hold any of the types that may be returned, which is handy if you
+ * are trying to do things generically. For example you can pass
+ * a DBusBasicValue* in to this function, and then pass the same
+ * DBusBasicValue* in to _dbus_marshal_basic_type() in order to
+ * move a value from one place to another.
+ *
+ * @param str the string containing the data
+ * @param pos position in the string
+ * @param type type of value to demarshal
+ * @param value pointer to return value data
+ * @param byte_order the byte order
+ * @param new_pos pointer to update with new position, or #NULL
+ **/
+void
+_dbus_marshal_read_basic (const DBusString      *str,
+                          int                    pos,
+                          int                    type,
+                          void                  *value,
+                          int                    byte_order,
+                          int                   *new_pos)
+{
+  if (byte_order == DBUS_COMPILER_BYTE_ORDER)
+    read_basic_in_order (str, pos, type, value,
+                         DBUS_COMPILER_BYTE_ORDER, new_pos);
+  else
+    read_basic_in_order (str, pos, type, value,
+                         DBUS_COMPILER_BYTE_ORDER == DBUS_LITTLE_ENDIAN ?
+                         DBUS_BIG_ENDIAN : DBUS_LITTLE_ENDIAN,
+                         new_pos);
+}
+
 static dbus_bool_t
 marshal_2_octets (DBusString   *str,
                   int           insert_at,
@@ -31,6 +31,44 @@
  * @{
  */
 
+/*
+ * If the reader is positioned on a struct or dict entry whose fields
+ * are all fixed-size basic types of the same size, returns that size;
+ * otherwise returns 0. An array of such structs can be swapped as a
+ * flat array of values of that size: every field is aligned to its own
+ * size, and the padding between elements is a whole number of
+ * values of that size; it is nul, so swapping it changes nothing.
+ */
+static int
+uniform_fixed_struct_size (DBusTypeReader *reader)
+{
+  DBusTypeReader sub;
+  int current_type;
+  int size;
+
+  _dbus_type_reader_recurse (reader, &sub);
+  size = 0;
+
+  while ((current_type = _dbus_type_reader_get_current_type (&sub)) != DBUS_TYPE_INVALID)
+    {
+      int alignment;
+
+      if (!dbus_type_is_fixed (current_type) ||
+          current_type == DBUS_TYPE_UNIX_FD)
+        return 0;
+
+      alignment = _dbus_type_get_alignment (current_type);
+
+      if (size != 0 && alignment != size)
+        return 0;
+
+      size = alignment;
+      _dbus_type_reader_next (&sub);
+    }
+
+  return size;
+}
+
 static void
 byteswap_body_helper (DBusTypeReader       *reader,
                       dbus_bool_t           walk_reader_to_end,
@@ -113,18 +151,36 @@ byteswap_body_helper (DBusTypeReader       *reader,
                   {
                     DBusTypeReader sub;
                     const unsigned char *array_end;
+                    int field_size;
 
                     array_end = p + array_len;
                     
                     _dbus_type_reader_recurse (reader, &sub);
 
-                    while (p < array_end)
+                    if (elem_type == DBUS_TYPE_STRUCT ||
+                        elem_type == DBUS_TYPE_DICT_ENTRY)
+                      field_size = uniform_fixed_struct_size (&sub);
+                    else
+                      field_size = 0;
+
+                    if (field_size > 0)
+                      {
+                        /* e.g. a(ii) or a{uu}: swap in one pass */
+                        if (field_size > 1)
+                          _dbus_swap_array (p, array_len / field_size,
+                                            field_size);
+                        p += array_len;
+                      }
+                    else
                       {
-                        byteswap_body_helper (&sub,
-                                              FALSE,
-                                              old_byte_order,
-                                              new_byte_order,
-                                              p, &p);
+                        while (p < array_end)
+                          {
+                            byteswap_body_helper (&sub,
+                                                  FALSE,
+                                                  old_byte_order,
+                                                  new_byte_order,
+                                                  p, &p);
+                          }
                       }
                   }
               }
@@ -123,6 +123,13 @@ correct_header_padding (DBusHeader *header)
 #define HEADER_END_BEFORE_PADDING(header) \
   (_dbus_string_get_length (&(header)->data) - (header)->padding)
 
+/**
+ * Room left in a loaded header so that the dbus-daemon can add a
+ * sender field with a typical unique name without reallocating: the
+ * struct before and the padding after, and up to 32 bytes of name
+ */
+#define HEADER_SPARE_FOR_SENDER (2 * MAX_POSSIBLE_HEADER_PADDING + 8 + 32)
+
 /**
  * Invalidates all fields in the cache. This may be used when the
  * cache is totally uninitialized (contains junk) so should not
@@ -143,6 +150,29 @@ _dbus_header_cache_invalidate_all (DBusHeader *header)
     }
 }
 
+/**
+ * Invalidates the cached positions of all fields whose values start
+ * after the given position. When the value at that position changes
+ * size, those are the only values that move.
+ *
+ * @param header the header
+ * @param pos position of the value that changed
+ */
+static void
+_dbus_header_cache_invalidate_after (DBusHeader *header,
+                                     int         pos)
+{
+  int i;
+
+  i = 0;
+  while (i <= DBUS_HEADER_FIELD_LAST)
+    {
+      if (header->fields[i].value_pos > pos)
+        header->fields[i].value_pos = _DBUS_HEADER_FIELD_VALUE_UNKNOWN;
+      ++i;
+    }
+}
+
 /**
  * Caches one field
  *
@@ -467,6 +497,25 @@ _dbus_header_init (DBusHeader *header)
   return TRUE;
 }
 
+/**
+ * Like _dbus_header_init(), but the header data starts out in the
+ * caller's buffer, which must outlive the header; see
+ * _dbus_string_init_borrowed(). Can't fail.
+ *
+ * @param header header to initialize
+ * @param buffer storage for the header data
+ * @param size size of the storage
+ */
+void
+_dbus_header_init_borrowed (DBusHeader *header,
+                            void       *buffer,
+                            int         size)
+{
+  _dbus_string_init_borrowed (&header->data, buffer, size);
+
+  _dbus_header_reinit (header);
+}
+
 /**
  * Frees a header.
  *
@@ -508,6 +557,46 @@ _dbus_header_copy (const DBusHeader *header,
   return TRUE;
 }
 
+/**
+ * Like _dbus_header_copy(), but dest is already initialized and keeps
+ * its own storage, which saves an allocation when that is big enough.
+ * Resets the message serial to 0 on the copy. The field cache of the
+ * source is completed first, so that the copy doesn't have to scan
+ * for fields itself.
+ *
+ * @param dest initialized header to overwrite
+ * @param header header to copy
+ * @returns #FALSE if not enough memory, leaving dest empty
+ */
+dbus_bool_t
+_dbus_header_assign (DBusHeader *dest,
+                     DBusHeader *header)
+{
+  int i;
+
+  for (i = 0; i <= DBUS_HEADER_FIELD_LAST; i++)
+    {
+      if (header->fields[i].value_pos == _DBUS_HEADER_FIELD_VALUE_UNKNOWN)
+        {
+          _dbus_header_cache_revalidate (header);
+          break;
+        }
+    }
+
+  _dbus_header_reinit (dest);
+
+  if (!_dbus_string_copy (&header->data, 0, &dest->data, 0))
+    return FALSE;
+
+  memcpy (dest->fields, header->fields, sizeof (dest->fields));
+  dest->padding = header->padding;
+  dest->byte_order = header->byte_order;
+
+  _dbus_header_set_serial (dest, 0);
+
+  return TRUE;
+}
+
 /**
  * Fills in the primary fields of the header, so the header is ready
  * for use. #NULL may be specified for some or all of the fields to
@@ -778,10 +867,29 @@ check_mandatory_fields (DBusHeader *header)
   return DBUS_VALID;
 }
 
+/* Which slot of the cache a name would occupy. The length and three
+ * sampled bytes tell apart the few dozen names that make up most
+ * traffic; the comparison that follows catches anything else. */
+static int
+name_cache_slot (int                  field,
+                 const unsigned char *name,
+                 int                  len)
+{
+  unsigned int hash;
+
+  hash = len * 31 + field;
+  hash = hash * 31 + name[0];
+  hash = hash * 31 + name[len / 2];
+  hash = hash * 31 + name[len - 1];
+
+  return (hash ^ (hash >> 7)) & (_DBUS_HEADER_NAME_CACHE_SLOTS - 1);
+}
+
 static DBusValidity
-load_and_validate_field (DBusHeader     *header,
-                         int             field,
-                         DBusTypeReader *variant_reader)
+load_and_validate_field (DBusHeader          *header,
+                         int                  field,
+                         DBusTypeReader      *variant_reader,
+                         DBusHeaderNameCache *names)
 {
   int type;
   int expected_type;
@@ -933,7 +1041,31 @@ load_and_validate_field (DBusHeader     *header,
       _dbus_verbose ("Validating string header field; code %d if fails\n",
                      bad_string_code);
 #endif
-      if (!(*string_validation_func) (value_str, str_data_pos, len))
+      if (names != NULL && len > 0 &&
+          len <= _DBUS_HEADER_NAME_CACHE_MAX_LEN &&
+          len <= (dbus_uint32_t) (_dbus_string_get_length (value_str) -
+                                  str_data_pos))
+        {
+          const unsigned char *name;
+          int slot;
+
+          name = (const unsigned char *)
+            _dbus_string_get_const_data_len (value_str, str_data_pos, len);
+          slot = name_cache_slot (field, name, len);
+
+          if (names->slots[slot].field == field &&
+              names->slots[slot].len == len &&
+              memcmp (names->slots[slot].name, name, len) == 0)
+            return DBUS_VALID;
+
+          if (!(*string_validation_func) (value_str, str_data_pos, len))
+            return bad_string_code;
+
+          names->slots[slot].field = field;
+          names->slots[slot].len = len;
+          memcpy (names->slots[slot].name, name, len);
+        }
+      else if (!(*string_validation_func) (value_str, str_data_pos, len))
         return bad_string_code;
     }
 
@@ -964,6 +1096,7 @@ load_and_validate_field (DBusHeader     *header,
  * @param str a string
  * @param start start of header, 8-aligned
  * @param len length of string to look at
+ * @param names recently validated names to check against and add to, or #NULL
  * @returns #FALSE if no memory or data was invalid, #TRUE otherwise
  */
 dbus_bool_t
@@ -976,7 +1109,8 @@ _dbus_header_load (DBusHeader        *header,
                    int                body_len,
                    const DBusString  *str,
                    int                start,
-                   int                len)
+                   int                len,
+                   DBusHeaderNameCache *names)
 {
   int leftover;
   DBusValidity v;
@@ -993,7 +1127,9 @@ _dbus_header_load (DBusHeader        *header,
   _dbus_assert (header_len <= len);
   _dbus_assert (_dbus_string_get_length (&header->data) == 0);
 
-  if (!_dbus_string_copy_len (str, start, header_len, &header->data, 0))
+  if (!_dbus_string_alloc_space (&header->data,
+                                 header_len + HEADER_SPARE_FOR_SENDER) ||
+      !_dbus_string_copy_len (str, start, header_len, &header->data, 0))
     {
       _dbus_verbose ("Failed to copy buffer into new header\n");
       *validity = DBUS_VALIDITY_UNKNOWN_OOM_ERROR;
@@ -1149,7 +1285,8 @@ _dbus_header_load (DBusHeader        *header,
       _dbus_assert (_dbus_type_reader_get_current_type (&struct_reader) == DBUS_TYPE_VARIANT);
       _dbus_type_reader_recurse (&struct_reader, &variant_reader);
 
-      v = load_and_validate_field (header, field_code, &variant_reader);
+      v = load_and_validate_field (header, field_code, &variant_reader,
+                                   names);
       if (v != DBUS_VALID)
         {
           _dbus_verbose ("Field %d was invalid\n", field_code);
@@ -1258,6 +1395,126 @@ find_field_for_modification (DBusHeader     *header,
   return retval;
 }
 
+/*
+ * Sets a string or object path field by moving bytes directly, rather
+ * than through set_basic_field(), which rewrites everything after the
+ * value. Each field is an 8-aligned struct whose last member is the
+ * value, so a change in the value's length only moves the fields after
+ * it, by a multiple of 8, and they stay correctly aligned as they are.
+ * That is at most one memmove, and no allocation if the header has
+ * room, which loaded headers do for a sender.
+ */
+static dbus_bool_t
+set_string_field (DBusHeader *header,
+                  int         field,
+                  int         type,
+                  const char *value)
+{
+  unsigned char *data;
+  dbus_bool_t exists;
+  int byte_order;
+  int len;
+  int array_end;  /* end of the fields, where the padding starts */
+  int field_pos;  /* the field's struct */
+  int value_pos;  /* the field's uint32 length, then the string */
+  int old_next;   /* end of the bytes being replaced */
+  int new_next;   /* end of the bytes replacing them */
+  int shift;
+  int i;
+
+  byte_order = _dbus_header_get_byte_order (header);
+  len = strlen (value);
+  array_end = HEADER_END_BEFORE_PADDING (header);
+  exists = _dbus_header_cache_check (header, field);
+
+  if (exists)
+    {
+      /* the variant's signature is 1, type, nul */
+      value_pos = header->fields[field].value_pos;
+      field_pos = value_pos - 4;
+      _dbus_assert (_dbus_string_get_byte (&header->data, field_pos) == field);
+      _dbus_assert (_dbus_string_get_byte (&header->data, field_pos + 2) == type);
+
+      old_next = value_pos + 4 + 1 +
+        _dbus_marshal_read_uint32 (&header->data, value_pos, byte_order, NULL);
+    }
+  else
+    {
+      field_pos = _DBUS_ALIGN_VALUE (array_end, 8);
+      value_pos = field_pos + 4;
+      old_next = array_end;
+    }
+
+  new_next = value_pos + 4 + len + 1;
+
+  /* The fields after this one, if any, must stay 8-aligned */
+  if (old_next < array_end)
+    {
+      old_next = _DBUS_ALIGN_VALUE (old_next, 8);
+      new_next = _DBUS_ALIGN_VALUE (new_next, 8);
+    }
+
+  shift = new_next - old_next;
+
+  /* After this nothing can fail */
+  if (!_dbus_string_alloc_space (&header->data,
+                                 MAX (shift, 0) + MAX_POSSIBLE_HEADER_PADDING))
+    return FALSE;
+
+  _dbus_string_shorten (&header->data, header->padding);
+
+  if (shift > 0)
+    {
+      if (!_dbus_string_insert_bytes (&header->data, old_next, shift, '\0'))
+        _dbus_assert_not_reached ("space for the field was preallocated");
+    }
+  else if (shift < 0)
+    {
+      _dbus_string_delete (&header->data, new_next, -shift);
+    }
+
+  data = (unsigned char *) _dbus_string_get_data (&header->data);
+
+  if (!exists)
+    {
+      memset (data + array_end, '\0', field_pos - array_end);
+      data[field_pos] = field;
+      data[field_pos + 1] = 1;
+      data[field_pos + 2] = type;
+      data[field_pos + 3] = '\0';
+    }
+
+  _dbus_marshal_set_uint32 (&header->data, value_pos, len, byte_order);
+  memcpy (data + value_pos + 4, value, len + 1);
+  memset (data + value_pos + 4 + len + 1, '\0',
+          new_next - (value_pos + 4 + len + 1));
+
+  array_end += shift;
+  _dbus_marshal_set_uint32 (&header->data, FIELDS_ARRAY_LENGTH_OFFSET,
+                            array_end - FIRST_FIELD_OFFSET, byte_order);
+
+  if (!_dbus_string_align_length (&header->data, 8))
+    _dbus_assert_not_reached ("space for the padding was preallocated");
+
+  header->padding = _dbus_string_get_length (&header->data) - array_end;
+
+  /* Everything after the value moved by the same amount */
+  if (exists)
+    {
+      for (i = 0; i <= DBUS_HEADER_FIELD_LAST; i++)
+        {
+          if (header->fields[i].value_pos > value_pos)
+            header->fields[i].value_pos += shift;
+        }
+    }
+  else
+    {
+      header->fields[field].value_pos = value_pos;
+    }
+
+  return TRUE;
+}
+
 /**
  * Sets the value of a field with basic type. If the value is a string
  * value, it isn't allowed to be #NULL. If the field doesn't exist,
@@ -1277,6 +1534,10 @@ _dbus_header_set_field_basic (DBusHeader       *header,
 {
   _dbus_assert (field <= DBUS_HEADER_FIELD_LAST);
 
+  if (type == DBUS_TYPE_STRING || type == DBUS_TYPE_OBJECT_PATH)
+    return set_string_field (header, field, type,
+                             *(const char * const *) value);
+
   if (!reserve_header_padding (header))
     return FALSE;
 
@@ -1285,6 +1546,11 @@ _dbus_header_set_field_basic (DBusHeader       *header,
     {
       DBusTypeReader reader;
       DBusTypeReader realign_root;
+      int value_pos;
+      int old_end;
+
+      value_pos = header->fields[field].value_pos;
+      old_end = HEADER_END_BEFORE_PADDING (header);
 
       if (!find_field_for_modification (header, field,
                                         &reader, &realign_root))
@@ -1292,6 +1558,16 @@ _dbus_header_set_field_basic (DBusHeader       *header,
 
       if (!set_basic_field (&reader, field, type, value, &realign_root))
         return FALSE;
+
+      correct_header_padding (header);
+
+      /* The value is replaced in place and anything after it is
+       * realigned; if that moved the end of the fields, everything
+       * after the value moved by the same amount. Fields before it
+       * never move.
+       */
+      if (HEADER_END_BEFORE_PADDING (header) != old_end)
+        _dbus_header_cache_invalidate_after (header, value_pos);
     }
   else
     {
@@ -1324,15 +1600,14 @@ _dbus_header_set_field_basic (DBusHeader       *header,
 
       if (!_dbus_type_writer_unrecurse (&writer, &array))
         _dbus_assert_not_reached ("unrecurse from ARRAY should not have used memory");
-    }
 
-  correct_header_padding (header);
+      correct_header_padding (header);
 
-  /* We could be smarter about this (only invalidate fields after the
-   * one we modified, or even only if the one we modified changed
-   * length). But this hack is a start.
-   */
-  _dbus_header_cache_invalidate_all (header);
+      /* The new field went after all the others, so only it needs
+       * looking up again.
+       */
+      header->fields[field].value_pos = _DBUS_HEADER_FIELD_VALUE_UNKNOWN;
+    }
 
   return TRUE;
 }
@@ -1438,7 +1713,10 @@ _dbus_header_delete_field (DBusHeader *header,
 
   correct_header_padding (header);
 
-  _dbus_header_cache_invalidate_all (header);
+  /* Only the fields after the deleted one have moved */
+  _dbus_header_cache_invalidate_after (header,
+                                       _dbus_type_reader_get_value_pos (&reader));
+  header->fields[field].value_pos = _DBUS_HEADER_FIELD_VALUE_NONEXISTENT;
 
   _dbus_assert (!_dbus_header_cache_check (header, field)); /* Expensive assertion ... */
 
@@ -29,6 +29,7 @@
 
 typedef struct DBusHeader      DBusHeader;
 typedef struct DBusHeaderField DBusHeaderField;
+typedef struct DBusHeaderNameCache DBusHeaderNameCache;
 
 #define _DBUS_HEADER_FIELD_VALUE_UNKNOWN -1
 #define _DBUS_HEADER_FIELD_VALUE_NONEXISTENT -2
@@ -59,7 +60,29 @@ struct DBusHeader
   dbus_uint32_t byte_order : 8;     /**< byte order of header */
 };
 
+#define _DBUS_HEADER_NAME_CACHE_SLOTS 16 /**< must be a power of 2 */
+#define _DBUS_HEADER_NAME_CACHE_MAX_LEN 63 /**< longer names are not cached */
+
+/**
+ * Names from string header fields that recently passed validation, so
+ * that the same sender, destination, interface and member arriving
+ * again in the next header is found valid with one comparison. Zero
+ * initialize it before use.
+ */
+struct DBusHeaderNameCache
+{
+  struct
+  {
+    unsigned char field; /**< Header field validated, or 0 if the slot is empty */
+    unsigned char len;   /**< Length of name */
+    char name[_DBUS_HEADER_NAME_CACHE_MAX_LEN]; /**< The name, not nul-terminated */
+  } slots[_DBUS_HEADER_NAME_CACHE_SLOTS]; /**< Indexed by a hash of the name */
+};
+
 dbus_bool_t   _dbus_header_init                   (DBusHeader        *header);
+void          _dbus_header_init_borrowed          (DBusHeader        *header,
+                                                   void              *buffer,
+                                                   int                size);
 void          _dbus_header_free                   (DBusHeader        *header);
 void          _dbus_header_reinit                 (DBusHeader        *header);
 dbus_bool_t   _dbus_header_create                 (DBusHeader        *header,
@@ -72,6 +95,8 @@ dbus_bool_t   _dbus_header_create                 (DBusHeader        *header,
                                                    const char        *error_name);
 dbus_bool_t   _dbus_header_copy                   (const DBusHeader  *header,
                                                    DBusHeader        *dest);
+dbus_bool_t   _dbus_header_assign                 (DBusHeader        *dest,
+                                                   DBusHeader        *header);
 int           _dbus_header_get_message_type       (DBusHeader        *header);
 void          _dbus_header_set_serial             (DBusHeader        *header,
                                                    dbus_uint32_t      serial);
@@ -121,7 +146,8 @@ dbus_bool_t   _dbus_header_load                   (DBusHeader        *header,
                                                    int                body_len,
                                                    const DBusString  *str,
                                                    int                start,
-                                                   int                len);
+                                                   int                len,
+                                                   DBusHeaderNameCache *names);
 void          _dbus_header_byteswap               (DBusHeader        *header,
                                                    int                new_order);
 DBUS_PRIVATE_EXPORT
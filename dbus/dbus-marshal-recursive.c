@@ -890,6 +890,43 @@ _dbus_type_reader_read_basic (const DBusTypeReader    *reader,
 #endif
 }
 
+/**
+ * Reads a basic-typed value, as with _dbus_type_reader_read_basic(),
+ * and moves to the next value, as with _dbus_type_reader_next(). At
+ * the top level of a body, this saves skipping over the value again
+ * after reading it.
+ *
+ * @param reader the reader
+ * @param value the address of the value
+ * @returns #FALSE if there are no more values on this level
+ */
+dbus_bool_t
+_dbus_type_reader_read_basic_and_next (DBusTypeReader *reader,
+                                       void           *value)
+{
+  int t;
+
+  _dbus_assert (!reader->klass->types_only);
+
+  if (reader->klass != &body_reader_class)
+    {
+      _dbus_type_reader_read_basic (reader, value);
+      return _dbus_type_reader_next (reader);
+    }
+
+  t = _dbus_type_reader_get_current_type (reader);
+  _dbus_assert (dbus_type_is_basic (t));
+
+  _dbus_marshal_read_basic (reader->value_str,
+                            reader->value_pos,
+                            t, value,
+                            reader->byte_order,
+                            &reader->value_pos);
+  reader->type_pos += 1;
+
+  return _dbus_type_reader_get_current_type (reader) != DBUS_TYPE_INVALID;
+}
+
 /**
  * Returns the number of bytes in the array.
  *
@@ -973,6 +1010,215 @@ _dbus_type_reader_read_fixed_multi (const DBusTypeReader  *reader,
 #endif
 }
 
+/*
+ * Works out where each member of a struct made of fixed-length
+ * basic types goes on the wire, relative to the start of a struct
+ * (which is always 8-aligned). Returns #FALSE if any member is
+ * string-like. Otherwise stores the length of one struct without
+ * trailing padding in wire_len, and whether the C struct already has
+ * the wire layout, with every member at its wire offset and no gaps
+ * between members or at the end, in same_layout. If it does, and
+ * the byte order is the native one, a whole array of C structs is
+ * also a whole array of marshalled ones.
+ */
+static dbus_bool_t
+struct_fields_get_fixed_layout (const DBusStructField *fields,
+                                int                    n_fields,
+                                size_t                 element_size,
+                                int                   *wire_len,
+                                dbus_bool_t           *same_layout)
+{
+  int pos;
+  int i;
+
+  pos = 0;
+  *same_layout = TRUE;
+
+  for (i = 0; i < n_fields; i++)
+    {
+      int size;
+
+      if (!dbus_type_is_fixed (fields[i].type))
+        return FALSE;
+
+      size = _dbus_type_get_alignment (fields[i].type);
+      if ((size_t) pos != _DBUS_ALIGN_VALUE (pos, size))
+        *same_layout = FALSE;
+      pos = _DBUS_ALIGN_VALUE (pos, size);
+
+      if ((size_t) pos != fields[i].offset)
+        *same_layout = FALSE;
+
+      pos += size;
+    }
+
+  if ((size_t) _DBUS_ALIGN_VALUE (pos, 8) != element_size ||
+      (size_t) pos != element_size)
+    *same_layout = FALSE;
+
+  *wire_len = pos;
+  return TRUE;
+}
+
+/* Copies one fixed-length value of the given size, swapping it if
+ * the byte orders differ
+ */
+static void
+copy_fixed_value (unsigned char       *dest,
+                  const unsigned char *src,
+                  int                  size,
+                  dbus_bool_t          swap)
+{
+  if (!swap || size == 1)
+    {
+      memcpy (dest, src, size);
+    }
+  else if (size == 2)
+    {
+      dbus_uint16_t v;
+
+      memcpy (&v, src, 2);
+      v = DBUS_UINT16_SWAP_LE_BE (v);
+      memcpy (dest, &v, 2);
+    }
+  else if (size == 4)
+    {
+      dbus_uint32_t v;
+
+      memcpy (&v, src, 4);
+      v = DBUS_UINT32_SWAP_LE_BE (v);
+      memcpy (dest, &v, 4);
+    }
+  else
+    {
+      dbus_uint64_t v;
+
+      _dbus_assert (size == 8);
+      memcpy (&v, src, 8);
+      v = DBUS_UINT64_SWAP_LE_BE (v);
+      memcpy (dest, &v, 8);
+    }
+}
+
+/**
+ * Reads structs from the current point in an array into an array of
+ * C structs, and moves the reader past them. This is the counterpart
+ * of _dbus_type_writer_write_struct_multi(); string-like members are
+ * stored as "const char*" pointing into the value string, like
+ * _dbus_type_reader_read_basic() returns them.
+ *
+ * @param reader the reader to read from
+ * @param fields the members of the struct
+ * @param n_fields the number of members
+ * @param elements the array of C structs to fill in
+ * @param element_size the size of one C struct
+ * @param max_elements the number of structs there is room for
+ * @returns the number of structs read, 0 at the end of the array
+ */
+int
+_dbus_type_reader_read_struct_multi (DBusTypeReader        *reader,
+                                     const DBusStructField *fields,
+                                     int                    n_fields,
+                                     void                  *elements,
+                                     size_t                 element_size,
+                                     int                    max_elements)
+{
+  const unsigned char *data;
+  unsigned char *dest;
+  dbus_bool_t swap;
+  dbus_bool_t same_layout;
+  int wire_len;
+  int end_pos;
+  int pos;
+  int n;
+  int j;
+
+  _dbus_assert (!reader->klass->types_only);
+  _dbus_assert (reader->klass == &array_reader_class);
+  _dbus_assert (_dbus_first_type_in_signature (reader->type_str,
+                                               reader->type_pos) == DBUS_TYPE_STRUCT);
+  _dbus_assert (n_fields > 0);
+  _dbus_assert (max_elements >= 0);
+
+  end_pos = reader->u.array.start_pos + array_reader_get_array_len (reader);
+
+  _dbus_assert (reader->value_pos <= end_pos);
+
+  if (reader->value_pos == end_pos || max_elements == 0)
+    return 0;
+
+  data = (const unsigned char *) _dbus_string_get_const_data (reader->value_str);
+  dest = elements;
+  swap = reader->byte_order != DBUS_COMPILER_BYTE_ORDER;
+  pos = reader->value_pos;
+  n = 0;
+
+  if (struct_fields_get_fixed_layout (fields, n_fields, element_size,
+                                      &wire_len, &same_layout) &&
+      same_layout && !swap)
+    {
+      /* The elements are already laid out like the C structs, except
+       * that the last one has no trailing padding
+       */
+      pos = _DBUS_ALIGN_VALUE (pos, 8);
+      n = (end_pos - pos + (int) element_size - wire_len) / (int) element_size;
+      if (n > max_elements)
+        n = max_elements;
+
+      memcpy (dest, data + pos, (size_t) (n - 1) * element_size + wire_len);
+      pos += (n - 1) * element_size + wire_len;
+    }
+  else
+    {
+      while (pos < end_pos && n < max_elements)
+        {
+          pos = _DBUS_ALIGN_VALUE (pos, 8);
+
+          for (j = 0; j < n_fields; j++)
+            {
+              int type = fields[j].type;
+              unsigned char *member = dest + fields[j].offset;
+
+              if (type == DBUS_TYPE_STRING || type == DBUS_TYPE_OBJECT_PATH)
+                {
+                  dbus_uint32_t len;
+
+                  pos = _DBUS_ALIGN_VALUE (pos, 4);
+                  len = _dbus_unpack_uint32 (reader->byte_order, data + pos);
+                  *(const char **) member = (const char *) data + pos + 4;
+                  pos += 4 + len + 1;
+                }
+              else if (type == DBUS_TYPE_SIGNATURE)
+                {
+                  *(const char **) member = (const char *) data + pos + 1;
+                  pos += 1 + data[pos] + 1;
+                }
+              else
+                {
+                  int size = _dbus_type_get_alignment (type);
+
+                  pos = _DBUS_ALIGN_VALUE (pos, size);
+                  copy_fixed_value (member, data + pos, size, swap);
+                  pos += size;
+                }
+            }
+
+          dest += element_size;
+          n++;
+        }
+    }
+
+  _dbus_assert (pos <= end_pos);
+  reader->value_pos = pos;
+
+#if RECURSIVE_MARSHAL_READ_TRACE
+  _dbus_verbose ("  type reader %p read struct array value_pos = %d n_elements = %d\n",
+                 reader, reader->value_pos, n);
+#endif
+
+  return n;
+}
+
 /**
  * Initialize a new reader pointing to the first type and
  * corresponding value that's a child of the current container. It's
@@ -2394,6 +2640,218 @@ _dbus_type_writer_write_fixed_multi (DBusTypeWriter        *writer,
   return TRUE;
 }
 
+/**
+ * Like _dbus_type_writer_write_fixed_multi(), but only accounts for
+ * the block: the typecode is checked and value_pos is advanced past
+ * the values, which are not written to the value string. The caller
+ * must supply the bytes, in the writer's byte order, at the position
+ * value_pos had before the call. Until then value_pos is beyond the
+ * end of the value string, so nothing else may be written with this
+ * writer or its parents.
+ *
+ * @param writer the writer
+ * @param element_type type of stuff in the array
+ * @param n_elements number of elements in the array
+ */
+void
+_dbus_type_writer_skip_fixed_multi (DBusTypeWriter        *writer,
+                                    int                    element_type,
+                                    int                    n_elements)
+{
+  _dbus_assert (writer->container_type == DBUS_TYPE_ARRAY);
+  _dbus_assert (dbus_type_is_fixed (element_type));
+  _dbus_assert (writer->type_pos_is_expectation);
+  _dbus_assert (writer->enabled);
+  _dbus_assert (n_elements >= 0);
+
+  if (!write_or_verify_typecode (writer, element_type))
+    _dbus_assert_not_reached ("OOM should not happen if only verifying typecode");
+
+  writer->value_pos += n_elements * _dbus_type_get_alignment (element_type);
+}
+
+/**
+ * Writes a block of structs taken from an array of C structs. Each
+ * member of the C struct described in fields becomes one field of
+ * the D-Bus struct, so fields must match the element type of the
+ * array being written, and all of them must be basic types. Members
+ * are stored in the C struct the way dbus_message_iter_append_basic()
+ * takes them, so string-like members are "const char*".
+ *
+ * All the bytes are inserted at once and filled in by a single loop,
+ * instead of recursing into every struct. If the struct only has
+ * fixed-length members, each member is copied straight to its wire
+ * offset, and an array of C structs that already has the wire layout
+ * is copied in one go.
+ *
+ * @param writer the writer
+ * @param fields the members of the struct
+ * @param n_fields the number of members
+ * @param elements the array of C structs
+ * @param element_size the size of one C struct
+ * @param n_elements the number of structs
+ * @returns #FALSE if no memory, or if the array would be too long
+ */
+dbus_bool_t
+_dbus_type_writer_write_struct_multi (DBusTypeWriter        *writer,
+                                      const DBusStructField *fields,
+                                      int                    n_fields,
+                                      const void            *elements,
+                                      size_t                 element_size,
+                                      int                    n_elements)
+{
+  const unsigned char *src;
+  unsigned char *data;
+  dbus_bool_t swap;
+  dbus_bool_t same_layout;
+  int wire_len;
+  size_t end;
+  int start;
+  int i, j;
+
+  _dbus_assert (writer->container_type == DBUS_TYPE_ARRAY);
+  _dbus_assert (writer->type_pos_is_expectation);
+  _dbus_assert (n_fields > 0);
+  _dbus_assert (n_elements >= 0);
+
+  if (!write_or_verify_typecode (writer, DBUS_STRUCT_BEGIN_CHAR))
+    _dbus_assert_not_reached ("OOM should not happen if only verifying typecode");
+
+  if (!writer->enabled || n_elements == 0)
+    return TRUE;
+
+  start = _DBUS_ALIGN_VALUE (writer->value_pos, 8);
+  src = elements;
+  swap = writer->byte_order != DBUS_COMPILER_BYTE_ORDER;
+
+  /* Work out how long the block will be, so the array (including
+   * what was written to it before) can be checked once and the
+   * string only has to grow once
+   */
+  if (struct_fields_get_fixed_layout (fields, n_fields, element_size,
+                                      &wire_len, &same_layout))
+    {
+      if ((size_t) n_elements - 1 >
+          (DBUS_MAXIMUM_ARRAY_LENGTH - wire_len) / _DBUS_ALIGN_VALUE (wire_len, 8))
+        return FALSE;
+
+      end = start + (size_t) (n_elements - 1) * _DBUS_ALIGN_VALUE (wire_len, 8) + wire_len;
+    }
+  else
+    {
+      same_layout = FALSE;
+      end = start;
+
+      for (i = 0; i < n_elements; i++)
+        {
+          end = _DBUS_ALIGN_VALUE (end, 8);
+
+          for (j = 0; j < n_fields; j++)
+            {
+              int type = fields[j].type;
+
+              if (type == DBUS_TYPE_STRING || type == DBUS_TYPE_OBJECT_PATH)
+                {
+                  const char *s = *(const char * const *) (src + fields[j].offset);
+
+                  end = _DBUS_ALIGN_VALUE (end, 4) + 4 + strlen (s) + 1;
+                }
+              else if (type == DBUS_TYPE_SIGNATURE)
+                {
+                  const char *s = *(const char * const *) (src + fields[j].offset);
+
+                  end += 1 + strlen (s) + 1;
+                }
+              else
+                {
+                  int size = _dbus_type_get_alignment (type);
+
+                  end = _DBUS_ALIGN_VALUE (end, size) + size;
+                }
+            }
+
+          if (end - writer->u.array.start_pos > DBUS_MAXIMUM_ARRAY_LENGTH)
+            return FALSE;
+
+          src += element_size;
+        }
+
+      src = elements;
+    }
+
+  if (end - writer->u.array.start_pos > DBUS_MAXIMUM_ARRAY_LENGTH)
+    return FALSE;
+
+  /* Padding is left as the zero bytes inserted here */
+  if (!_dbus_string_insert_bytes (writer->value_str, writer->value_pos,
+                                  end - writer->value_pos, '\0'))
+    return FALSE;
+
+  data = (unsigned char *) _dbus_string_get_data_len (writer->value_str, start,
+                                                     end - start);
+
+  if (same_layout && !swap)
+    {
+      memcpy (data, src, end - start);
+    }
+  else
+    {
+      size_t pos = 0;
+
+      for (i = 0; i < n_elements; i++)
+        {
+          pos = _DBUS_ALIGN_VALUE (pos, 8);
+
+          for (j = 0; j < n_fields; j++)
+            {
+              int type = fields[j].type;
+              const unsigned char *member = src + fields[j].offset;
+
+              if (type == DBUS_TYPE_STRING || type == DBUS_TYPE_OBJECT_PATH)
+                {
+                  const char *s = *(const char * const *) member;
+                  dbus_uint32_t len = strlen (s);
+
+                  pos = _DBUS_ALIGN_VALUE (pos, 4);
+                  _dbus_pack_uint32 (len, writer->byte_order, data + pos);
+                  memcpy (data + pos + 4, s, len);
+                  pos += 4 + len + 1;
+                }
+              else if (type == DBUS_TYPE_SIGNATURE)
+                {
+                  const char *s = *(const char * const *) member;
+                  size_t len = strlen (s);
+
+                  data[pos] = len;
+                  memcpy (data + pos + 1, s, len);
+                  pos += 1 + len + 1;
+                }
+              else
+                {
+                  int size = _dbus_type_get_alignment (type);
+
+                  pos = _DBUS_ALIGN_VALUE (pos, size);
+                  copy_fixed_value (data + pos, member, size, swap);
+                  pos += size;
+                }
+            }
+
+          src += element_size;
+        }
+
+      _dbus_assert (pos == end - start);
+    }
+
+  writer->value_pos = end;
+
+#if RECURSIVE_MARSHAL_WRITE_TRACE
+  _dbus_verbose ("  type writer %p struct multi written new type_pos = %d new value_pos = %d n_elements %d\n",
+                 writer, writer->type_pos, writer->value_pos, n_elements);
+#endif
+
+  return TRUE;
+}
+
 static void
 enable_if_after (DBusTypeWriter       *writer,
                  DBusTypeReader       *reader,
@@ -26,6 +26,7 @@
 
 #include <dbus/dbus-protocol.h>
 #include <dbus/dbus-list.h>
+#include <dbus/dbus-message.h>
 
 typedef struct DBusTypeReader      DBusTypeReader;
 typedef struct DBusTypeWriter      DBusTypeWriter;
@@ -115,11 +116,19 @@ int         _dbus_type_reader_get_value_pos             (const DBusTypeReader  *
 DBUS_PRIVATE_EXPORT
 void        _dbus_type_reader_read_basic                (const DBusTypeReader  *reader,
                                                          void                  *value);
+dbus_bool_t _dbus_type_reader_read_basic_and_next       (DBusTypeReader        *reader,
+                                                         void                  *value);
 int         _dbus_type_reader_get_array_length          (const DBusTypeReader  *reader);
 DBUS_PRIVATE_EXPORT
 void        _dbus_type_reader_read_fixed_multi          (const DBusTypeReader  *reader,
                                                          void                  *value,
                                                          int                   *n_elements);
+int         _dbus_type_reader_read_struct_multi         (DBusTypeReader        *reader,
+                                                         const DBusStructField *fields,
+                                                         int                    n_fields,
+                                                         void                  *elements,
+                                                         size_t                 element_size,
+                                                         int                    max_elements);
 void        _dbus_type_reader_read_raw                  (const DBusTypeReader  *reader,
                                                          const unsigned char  **value_location);
 DBUS_PRIVATE_EXPORT
@@ -178,6 +187,15 @@ dbus_bool_t _dbus_type_writer_write_fixed_multi    (DBusTypeWriter        *write
                                                     int                    element_type,
                                                     const void            *value,
                                                     int                    n_elements);
+void        _dbus_type_writer_skip_fixed_multi     (DBusTypeWriter        *writer,
+                                                    int                    element_type,
+                                                    int                    n_elements);
+dbus_bool_t _dbus_type_writer_write_struct_multi   (DBusTypeWriter        *writer,
+                                                    const DBusStructField *fields,
+                                                    int                    n_fields,
+                                                    const void            *elements,
+                                                    size_t                 element_size,
+                                                    int                    n_elements);
 DBUS_PRIVATE_EXPORT
 dbus_bool_t _dbus_type_writer_recurse              (DBusTypeWriter        *writer,
                                                     int                    container_type,
@@ -59,18 +59,18 @@ _dbus_validate_signature_with_reason (const DBusString *type_str,
   int array_depth;
   int dict_entry_depth;
   DBusValidity result;
-
   int element_count;
-  DBusList *element_count_stack;
 
-  result = DBUS_VALID;
-  element_count_stack = NULL;
+  /* Number of complete types seen in the signature itself and in each
+   * open struct or dict entry. The depth checks below happen before
+   * each push, so this can never overflow.
+   */
+  int element_count_stack[1 + 2 * DBUS_MAXIMUM_TYPE_RECURSION_DEPTH];
+  int n_element_counts;
 
-  if (!_dbus_list_append (&element_count_stack, _DBUS_INT_TO_POINTER (0)))
-    {
-      result = DBUS_VALIDITY_UNKNOWN_OOM_ERROR;
-      goto out;
-    }
+  result = DBUS_VALID;
+  element_count_stack[0] = 0;
+  n_element_counts = 1;
 
   _dbus_assert (type_str != NULL);
   _dbus_assert (type_pos < _DBUS_INT32_MAX - len);
@@ -129,13 +129,8 @@ _dbus_validate_signature_with_reason (const DBusString *type_str,
               goto out;
             }
           
-          if (!_dbus_list_append (&element_count_stack, 
-                             _DBUS_INT_TO_POINTER (0)))
-            {
-              result = DBUS_VALIDITY_UNKNOWN_OOM_ERROR;
-              goto out;
-            }
-
+          _dbus_assert (n_element_counts < (int) _DBUS_N_ELEMENTS (element_count_stack));
+          element_count_stack[n_element_counts++] = 0;
           break;
 
         case DBUS_STRUCT_END_CHAR:
@@ -151,7 +146,8 @@ _dbus_validate_signature_with_reason (const DBusString *type_str,
               goto out;
             }
 
-          _dbus_list_pop_last (&element_count_stack);
+          _dbus_assert (n_element_counts > 1);
+          n_element_counts -= 1;
 
           struct_depth -= 1;
           break;
@@ -171,13 +167,8 @@ _dbus_validate_signature_with_reason (const DBusString *type_str,
               goto out;
             }
 
-          if (!_dbus_list_append (&element_count_stack, 
-                             _DBUS_INT_TO_POINTER (0)))
-            {
-              result = DBUS_VALIDITY_UNKNOWN_OOM_ERROR;
-              goto out;
-            }
-
+          _dbus_assert (n_element_counts < (int) _DBUS_N_ELEMENTS (element_count_stack));
+          element_count_stack[n_element_counts++] = 0;
           break;
 
         case DBUS_DICT_ENTRY_END_CHAR:
@@ -189,8 +180,9 @@ _dbus_validate_signature_with_reason (const DBusString *type_str,
             
           dict_entry_depth -= 1;
 
-          element_count = 
-            _DBUS_POINTER_TO_INT (_dbus_list_pop_last (&element_count_stack));
+          _dbus_assert (n_element_counts > 1);
+          n_element_counts -= 1;
+          element_count = element_count_stack[n_element_counts];
 
           if (element_count != 2)
             {
@@ -215,19 +207,7 @@ _dbus_validate_signature_with_reason (const DBusString *type_str,
       if (*p != DBUS_TYPE_ARRAY && 
           *p != DBUS_DICT_ENTRY_BEGIN_CHAR && 
 	  *p != DBUS_STRUCT_BEGIN_CHAR) 
-        {
-          element_count = 
-            _DBUS_POINTER_TO_INT (_dbus_list_pop_last (&element_count_stack));
-
-          ++element_count;
-
-          if (!_dbus_list_append (&element_count_stack, 
-                             _DBUS_INT_TO_POINTER (element_count)))
-            {
-              result = DBUS_VALIDITY_UNKNOWN_OOM_ERROR;
-              goto out;
-            }
-        }
+        element_count_stack[n_element_counts - 1] += 1;
       
       if (array_depth > 0)
         {
@@ -287,10 +267,44 @@ _dbus_validate_signature_with_reason (const DBusString *type_str,
   result = DBUS_VALID;
 
 out:
-  _dbus_list_clear (&element_count_stack);
   return result;
 }
 
+/* Makes room for the count of the array starting at start_pos, which
+ * is filled in once the array has been validated. Entries are made in
+ * the order the arrays start, so they stay sorted by position.
+ * Returns the entry's index, or -1 if arrays aren't being counted.
+ */
+static int
+array_counts_add (DBusArrayCounts *counts,
+                  int              start_pos)
+{
+  if (counts == NULL || counts->failed)
+    return -1;
+
+  if (counts->n_entries == counts->n_allocated)
+    {
+      int n_allocated = counts->n_allocated > 0 ? counts->n_allocated * 2 : 16;
+      int *entries;
+
+      entries = dbus_realloc (counts->entries, n_allocated * 2 * sizeof (int));
+      if (entries == NULL)
+        {
+          /* The counts are only a cache, so carry on without them */
+          _dbus_array_counts_clear (counts);
+          counts->failed = TRUE;
+          return -1;
+        }
+
+      counts->entries = entries;
+      counts->n_allocated = n_allocated;
+    }
+
+  counts->entries[counts->n_entries * 2] = start_pos;
+  counts->entries[counts->n_entries * 2 + 1] = -1;
+  return counts->n_entries++;
+}
+
 /* note: this function is also used to validate the header's values,
  * since the header is a valid body with a particular signature.
  */
@@ -301,7 +315,9 @@ validate_body_helper (DBusTypeReader       *reader,
                       int                   total_depth,
                       const unsigned char  *p,
                       const unsigned char  *end,
-                      const unsigned char **new_p)
+                      const unsigned char **new_p,
+                      DBusArrayCounts      *counts,
+                      const unsigned char  *base)
 {
   int current_type;
 
@@ -468,8 +484,36 @@ validate_body_helper (DBusTypeReader       *reader,
                     if (array_elem_type == DBUS_TYPE_BOOLEAN)
                       {
                         dbus_uint32_t v;
+                        dbus_uint32_t true_value;
+                        dbus_uint32_t bad_bits;
+                        const unsigned char *whole_end;
+
                         alignment = _dbus_type_get_alignment (array_elem_type);
 
+                        /* Check all the complete elements in one pass:
+                         * in either byte order, a valid boolean has no
+                         * bits set other than those of TRUE. p is
+                         * 4-aligned here, so the casts are safe.
+                         */
+                        if (byte_order == DBUS_COMPILER_BYTE_ORDER)
+                          true_value = 1;
+                        else
+                          true_value = DBUS_UINT32_SWAP_LE_BE (1);
+
+                        whole_end = p + (claimed_len & ~(dbus_uint32_t) 3);
+                        bad_bits = 0;
+
+                        while (p < whole_end)
+                          {
+                            bad_bits |= *(const dbus_uint32_t *) p;
+                            p += 4;
+                          }
+
+                        if ((bad_bits & ~true_value) != 0)
+                          return DBUS_INVALID_BOOLEAN_NOT_ZERO_OR_ONE;
+
+                        /* a trailing partial element is checked the
+                         * slow way, so the error codes stay the same */
                         while (p < array_end)
                           {
                             v = _dbus_unpack_uint32 (byte_order, p);
@@ -489,14 +533,26 @@ validate_body_helper (DBusTypeReader       *reader,
 
                 else
                   {
+                    int n_elements = 0;
+                    int counted = -1;
+
+                    if (claimed_len >= DBUS_ARRAY_COUNTS_MIN_LENGTH)
+                      counted = array_counts_add (counts, p - base);
+
                     while (p < array_end)
                       {
                         validity = validate_body_helper (&sub, byte_order, FALSE,
                                                          total_depth + 1,
-                                                         p, end, &p);
+                                                         p, end, &p,
+                                                         counts, base);
                         if (validity != DBUS_VALID)
                           return validity;
+
+                        n_elements++;
                       }
+
+                    if (counted >= 0 && !counts->failed)
+                      counts->entries[counted * 2 + 1] = n_elements;
                   }
 
                 if (p != array_end)
@@ -612,7 +668,8 @@ validate_body_helper (DBusTypeReader       *reader,
 
             validity = validate_body_helper (&sub, byte_order, FALSE,
                                              total_depth + 1,
-                                             p, end, &p);
+                                             p, end, &p,
+                                             counts, base);
             if (validity != DBUS_VALID)
               return validity;
 
@@ -643,7 +700,8 @@ validate_body_helper (DBusTypeReader       *reader,
 
             validity = validate_body_helper (&sub, byte_order, TRUE,
                                              total_depth + 1,
-                                             p, end, &p);
+                                             p, end, &p,
+                                             counts, base);
             if (validity != DBUS_VALID)
               return validity;
           }
@@ -679,6 +737,56 @@ validate_body_helper (DBusTypeReader       *reader,
   return DBUS_VALID;
 }
 
+static DBusValidity
+validate_body (const DBusString *expected_signature,
+               int               expected_signature_start,
+               int               byte_order,
+               int              *bytes_remaining,
+               const DBusString *value_str,
+               int               value_pos,
+               int               len,
+               DBusArrayCounts  *counts)
+{
+  DBusTypeReader reader;
+  const unsigned char *p;
+  const unsigned char *end;
+  DBusValidity validity;
+
+  _dbus_assert (len >= 0);
+  _dbus_assert (value_pos >= 0);
+  _dbus_assert (value_pos <= _dbus_string_get_length (value_str) - len);
+
+  _dbus_verbose ("validating body from pos %d len %d sig '%s'\n",
+                 value_pos, len, _dbus_string_get_const_data_len (expected_signature,
+                                                                  expected_signature_start,
+                                                                  0));
+
+  _dbus_type_reader_init_types_only (&reader,
+                                     expected_signature, expected_signature_start);
+
+  p = _dbus_string_get_const_data_len (value_str, value_pos, len);
+  end = p + len;
+
+  validity = validate_body_helper (&reader, byte_order, TRUE, 0, p, end, &p,
+                                   counts,
+                                   (const unsigned char *) _dbus_string_get_const_data (value_str));
+  if (validity != DBUS_VALID)
+    return validity;
+  
+  if (bytes_remaining)
+    {
+      *bytes_remaining = end - p;
+      return DBUS_VALID;
+    }
+  else if (p < end)
+    return DBUS_INVALID_TOO_MUCH_DATA;
+  else
+    {
+      _dbus_assert (p == end);
+      return DBUS_VALID;
+    }
+}
+
 /**
  * Verifies that the range of value_str from value_pos to value_end is
  * a legitimate value of type expected_signature.  If this function
@@ -708,62 +816,143 @@ _dbus_validate_body_with_reason (const DBusString *expected_signature,
                                  int               value_pos,
                                  int               len)
 {
-  DBusTypeReader reader;
-  const unsigned char *p;
-  const unsigned char *end;
+  return validate_body (expected_signature, expected_signature_start,
+                        byte_order, bytes_remaining, value_str, value_pos,
+                        len, NULL);
+}
+
+/**
+ * Like _dbus_validate_body_with_reason() with bytes_remaining #NULL,
+ * but also records the element counts of large arrays in counts,
+ * which must be empty. Positions are relative to the start of
+ * value_str, like the array start positions of a #DBusTypeReader
+ * reading it. If the body is invalid, counts is left empty.
+ *
+ * @param expected_signature the expected types in the value_str
+ * @param expected_signature_start where in expected_signature is the signature
+ * @param byte_order the byte order
+ * @param value_str the string containing the body
+ * @param value_pos where the values start
+ * @param len length of values after value_pos
+ * @param counts where to record array element counts
+ * @returns #DBUS_VALID if valid, reason why invalid otherwise
+ */
+DBusValidity
+_dbus_validate_body_counting_arrays (const DBusString *expected_signature,
+                                     int               expected_signature_start,
+                                     int               byte_order,
+                                     const DBusString *value_str,
+                                     int               value_pos,
+                                     int               len,
+                                     DBusArrayCounts  *counts)
+{
   DBusValidity validity;
 
-  _dbus_assert (len >= 0);
-  _dbus_assert (value_pos >= 0);
-  _dbus_assert (value_pos <= _dbus_string_get_length (value_str) - len);
+  _dbus_assert (counts->n_entries == 0);
 
-  _dbus_verbose ("validating body from pos %d len %d sig '%s'\n",
-                 value_pos, len, _dbus_string_get_const_data_len (expected_signature,
-                                                                  expected_signature_start,
-                                                                  0));
+  validity = validate_body (expected_signature, expected_signature_start,
+                            byte_order, NULL, value_str, value_pos,
+                            len, counts);
 
-  _dbus_type_reader_init_types_only (&reader,
-                                     expected_signature, expected_signature_start);
+  if (validity != DBUS_VALID)
+    _dbus_array_counts_clear (counts);
 
-  p = _dbus_string_get_const_data_len (value_str, value_pos, len);
-  end = p + len;
+  return validity;
+}
 
-  validity = validate_body_helper (&reader, byte_order, TRUE, 0, p, end, &p);
-  if (validity != DBUS_VALID)
-    return validity;
-  
-  if (bytes_remaining)
-    {
-      *bytes_remaining = end - p;
-      return DBUS_VALID;
-    }
-  else if (p < end)
-    return DBUS_INVALID_TOO_MUCH_DATA;
-  else
+/**
+ * Frees the counts recorded by _dbus_validate_body_counting_arrays().
+ *
+ * @param counts the counts
+ */
+void
+_dbus_array_counts_clear (DBusArrayCounts *counts)
+{
+  dbus_free (counts->entries);
+  counts->entries = NULL;
+  counts->n_entries = 0;
+  counts->n_allocated = 0;
+  counts->failed = FALSE;
+}
+
+/**
+ * Looks up the element count of the array whose elements start at
+ * start_pos.
+ *
+ * @param counts the counts
+ * @param start_pos the position of the array's first element
+ * @returns the number of elements, or -1 if it was not recorded
+ */
+int
+_dbus_array_counts_lookup (const DBusArrayCounts *counts,
+                           int                    start_pos)
+{
+  int low = 0;
+  int high = counts->n_entries;
+
+  while (low < high)
     {
-      _dbus_assert (p == end);
-      return DBUS_VALID;
+      int mid = low + (high - low) / 2;
+      int pos = counts->entries[mid * 2];
+
+      if (pos == start_pos)
+        return counts->entries[mid * 2 + 1];
+      else if (pos < start_pos)
+        low = mid + 1;
+      else
+        high = mid;
     }
+
+  return -1;
 }
 
+/* Character classes for name validation, one bit per question asked
+ * of a character */
+#define NAME_CLASS_INITIAL          0x01 /**< may start a name or element */
+#define NAME_CLASS_ANY              0x02 /**< may appear later in a name */
+#define NAME_CLASS_BUS_INITIAL      0x04 /**< may start a bus name element */
+#define NAME_CLASS_BUS_ANY          0x08 /**< may appear later in a bus name */
+
+#define A (NAME_CLASS_INITIAL | NAME_CLASS_ANY | \
+           NAME_CLASS_BUS_INITIAL | NAME_CLASS_BUS_ANY)
+#define D (NAME_CLASS_ANY | NAME_CLASS_BUS_ANY)
+#define H (NAME_CLASS_BUS_INITIAL | NAME_CLASS_BUS_ANY)
+
+/* A is [A-Za-z_], D is [0-9] and H is '-'. Looking a character up here
+ * is a single load, where the range comparisons it replaces each cost
+ * a couple of branches per byte of every name in every header. */
+static const unsigned char name_char_classes[256] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* 0x00 */
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* 0x10 */
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, H, 0, 0,  /* 0x20 */
+  D, D, D, D, D, D, D, D, D, D, 0, 0, 0, 0, 0, 0,  /* 0x30 */
+  0, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,  /* 0x40 */
+  A, A, A, A, A, A, A, A, A, A, A, 0, 0, 0, 0, A,  /* 0x50 */
+  0, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,  /* 0x60 */
+  A, A, A, A, A, A, A, A, A, A, A, 0, 0, 0, 0, 0   /* 0x70 */
+  /* and nothing outside ASCII */
+};
+
+#undef A
+#undef D
+#undef H
+
+#define NAME_CHAR_HAS_CLASS(c, class) \
+  ((name_char_classes[(unsigned char) (c)] & (class)) != 0)
+
 /**
  * Determine wether the given character is valid as the first character
  * in a name.
  */
 #define VALID_INITIAL_NAME_CHARACTER(c)         \
-  ( ((c) >= 'A' && (c) <= 'Z') ||               \
-    ((c) >= 'a' && (c) <= 'z') ||               \
-    ((c) == '_') )
+  NAME_CHAR_HAS_CLASS (c, NAME_CLASS_INITIAL)
 
 /**
  * Determine wether the given character is valid as a second or later
  * character in a name
  */
 #define VALID_NAME_CHARACTER(c)                 \
-  ( ((c) >= '0' && (c) <= '9') ||               \
-    ((c) >= 'A' && (c) <= 'Z') ||               \
-    ((c) >= 'a' && (c) <= 'z') ||               \
-    ((c) == '_') )
+  NAME_CHAR_HAS_CLASS (c, NAME_CLASS_ANY)
 
 /**
  * Checks that the given range of the string is a valid object path
@@ -1068,19 +1257,14 @@ _dbus_validate_error_name (const DBusString  *str,
  * in a bus name.
  */
 #define VALID_INITIAL_BUS_NAME_CHARACTER(c)         \
-  ( ((c) >= 'A' && (c) <= 'Z') ||               \
-    ((c) >= 'a' && (c) <= 'z') ||               \
-    ((c) == '_') || ((c) == '-'))
+  NAME_CHAR_HAS_CLASS (c, NAME_CLASS_BUS_INITIAL)
 
 /**
  * Determine wether the given character is valid as a second or later
  * character in a bus name
  */
 #define VALID_BUS_NAME_CHARACTER(c)                 \
-  ( ((c) >= '0' && (c) <= '9') ||               \
-    ((c) >= 'A' && (c) <= 'Z') ||               \
-    ((c) >= 'a' && (c) <= 'z') ||               \
-    ((c) == '_') || ((c) == '-'))
+  NAME_CHAR_HAS_CLASS (c, NAME_CLASS_BUS_ANY)
 
 static dbus_bool_t
 _dbus_validate_bus_name_full (const DBusString  *str,
@@ -116,6 +116,23 @@ typedef enum
   DBUS_VALIDITY_LAST
 } DBusValidity;
 
+/**
+ * Element counts of the arrays of non-fixed-length elements found while
+ * validating a body, so that they don't have to be counted again.
+ * Only arrays of at least #DBUS_ARRAY_COUNTS_MIN_LENGTH bytes are
+ * recorded; smaller ones are quick to count.
+ */
+typedef struct
+{
+  int *entries;    /**< array start position and element count pairs, in order of position */
+  int n_entries;   /**< number of pairs in entries */
+  int n_allocated; /**< number of pairs entries has room for */
+  unsigned int failed : 1; /**< ran out of memory, so nothing was recorded */
+} DBusArrayCounts;
+
+/** Arrays shorter than this many bytes are not recorded in #DBusArrayCounts */
+#define DBUS_ARRAY_COUNTS_MIN_LENGTH 256
+
 DBUS_PRIVATE_EXPORT
 DBusValidity _dbus_validate_signature_with_reason (const DBusString *type_str,
                                                    int               type_pos,
@@ -128,6 +145,17 @@ DBusValidity _dbus_validate_body_with_reason      (const DBusString *expected_si
                                                    const DBusString *value_str,
                                                    int               value_pos,
                                                    int               len);
+DBusValidity _dbus_validate_body_counting_arrays  (const DBusString *expected_signature,
+                                                   int               expected_signature_start,
+                                                   int               byte_order,
+                                                   const DBusString *value_str,
+                                                   int               value_pos,
+                                                   int               len,
+                                                   DBusArrayCounts  *counts);
+
+void         _dbus_array_counts_clear             (DBusArrayCounts  *counts);
+int          _dbus_array_counts_lookup            (const DBusArrayCounts *counts,
+                                                   int               start_pos);
 
 const char *_dbus_validity_to_error_message (DBusValidity validity);
 
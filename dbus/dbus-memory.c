@@ -28,6 +28,7 @@
 #include "dbus-list.h"
 #include "dbus-threads.h"
 #include <stdlib.h>
+#include <string.h>
 
 /**
  * @defgroup DBusMemory Memory Allocation
@@ -109,6 +110,7 @@ static dbus_bool_t disable_mem_pools = FALSE;
 static dbus_bool_t backtrace_on_fail_alloc = FALSE;
 static dbus_bool_t malloc_cannot_fail = FALSE;
 static DBusAtomic n_blocks_outstanding = {0};
+static DBusAtomic n_allocations = {0};
 
 /** value stored in guard padding for debugging buffer overrun */
 #define GUARD_VALUE 0xdeadbeef
@@ -307,6 +309,18 @@ _dbus_get_malloc_blocks_outstanding (void)
   return _dbus_atomic_get (&n_blocks_outstanding);
 }
 
+/**
+ * Get the number of times memory has been allocated or reallocated
+ * so far, for tests that count what an operation allocates.
+ *
+ * @returns number of dbus_malloc(), dbus_malloc0() and dbus_realloc() calls
+ */
+int
+_dbus_get_malloc_calls (void)
+{
+  return _dbus_atomic_get (&n_allocations);
+}
+
 /**
  * Where the block came from.
  */
@@ -439,29 +453,86 @@ set_guards (void       *real_block,
 /** @} */ /* End of internals docs */
 
 
-/**
- * @addtogroup DBusMemory
- *
- * @{
- */
+/* Where the memory comes from: the C library, or whatever
+ * dbus_set_allocator() installed */
+static DBusAllocator memory_allocator;
 
-/**
- * Allocates the given number of bytes, as with standard
- * malloc(). Guaranteed to return #NULL if bytes is zero
- * on all platforms. Returns #NULL if the allocation fails.
- * The memory must be released with dbus_free().
- *
- * dbus_malloc() memory is NOT safe to free with regular free() from
- * the C library. Free it with dbus_free() only.
- *
- * @param bytes number of bytes to allocate
- * @return allocated memory, or #NULL if the allocation fails.
- */
-void*
-dbus_malloc (size_t bytes)
+/* Set by the first allocation; the allocator can't change after that */
+static dbus_bool_t allocator_used = FALSE;
+
+static void *
+sys_malloc (size_t bytes)
+{
+  if (!allocator_used)
+    allocator_used = TRUE;
+
+  if (memory_allocator.malloc_function != NULL)
+    return (* memory_allocator.malloc_function) (bytes,
+                                                 memory_allocator.user_data);
+
+  return malloc (bytes);
+}
+
+static void *
+sys_calloc (size_t bytes)
+{
+  void *mem;
+
+  if (memory_allocator.malloc_function == NULL)
+    {
+      if (!allocator_used)
+        allocator_used = TRUE;
+
+      return calloc (bytes, 1);
+    }
+
+  mem = sys_malloc (bytes);
+
+  if (mem != NULL)
+    memset (mem, '\0', bytes);
+
+  return mem;
+}
+
+static void *
+sys_realloc (void   *memory,
+             size_t  old_bytes,
+             size_t  bytes)
+{
+  if (memory == NULL)
+    return sys_malloc (bytes);
+
+  if (memory_allocator.realloc_function != NULL)
+    return (* memory_allocator.realloc_function) (memory, old_bytes, bytes,
+                                                  memory_allocator.user_data);
+
+  return realloc (memory, bytes);
+}
+
+static void
+sys_free (void   *memory,
+          size_t  bytes)
+{
+  if (memory_allocator.free_function != NULL)
+    (* memory_allocator.free_function) (memory, bytes,
+                                        memory_allocator.user_data);
+  else
+    free (memory);
+}
+
+/* The allocator itself; the public functions add the accounting
+ * of DBUS_ENABLE_STATS builds, if any, on top. A size hint is the
+ * full size of the block, or 0 if it isn't known. */
+
+static void raw_free (void   *memory,
+                      size_t  size_hint);
+
+static void*
+raw_malloc (size_t bytes)
 {
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
   _dbus_initialize_malloc_debug ();
+  _dbus_atomic_inc (&n_allocations);
   
   if (_dbus_decrement_fail_alloc_counter ())
     {
@@ -479,7 +550,7 @@ dbus_malloc (size_t bytes)
     {
       void *block;
 
-      block = malloc (bytes + GUARD_EXTRA_SIZE);
+      block = sys_malloc (bytes + GUARD_EXTRA_SIZE);
       if (block)
         {
           _dbus_atomic_inc (&n_blocks_outstanding);
@@ -497,7 +568,7 @@ dbus_malloc (size_t bytes)
   else
     {
       void *mem;
-      mem = malloc (bytes);
+      mem = sys_malloc (bytes);
 
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
       if (mem)
@@ -515,23 +586,12 @@ dbus_malloc (size_t bytes)
     }
 }
 
-/**
- * Allocates the given number of bytes, as with standard malloc(), but
- * all bytes are initialized to zero as with calloc(). Guaranteed to
- * return #NULL if bytes is zero on all platforms. Returns #NULL if the
- * allocation fails.  The memory must be released with dbus_free().
- *
- * dbus_malloc0() memory is NOT safe to free with regular free() from
- * the C library. Free it with dbus_free() only.
- *
- * @param bytes number of bytes to allocate
- * @return allocated memory, or #NULL if the allocation fails.
- */
-void*
-dbus_malloc0 (size_t bytes)
+static void*
+raw_malloc0 (size_t bytes)
 {
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
   _dbus_initialize_malloc_debug ();
+  _dbus_atomic_inc (&n_allocations);
   
   if (_dbus_decrement_fail_alloc_counter ())
     {
@@ -550,7 +610,7 @@ dbus_malloc0 (size_t bytes)
     {
       void *block;
 
-      block = calloc (bytes + GUARD_EXTRA_SIZE, 1);
+      block = sys_calloc (bytes + GUARD_EXTRA_SIZE);
 
       if (block)
         {
@@ -569,7 +629,7 @@ dbus_malloc0 (size_t bytes)
   else
     {
       void *mem;
-      mem = calloc (bytes, 1);
+      mem = sys_calloc (bytes);
 
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
       if (mem)
@@ -587,22 +647,14 @@ dbus_malloc0 (size_t bytes)
     }
 }
 
-/**
- * Resizes a block of memory previously allocated by dbus_malloc() or
- * dbus_malloc0(). Guaranteed to free the memory and return #NULL if bytes
- * is zero on all platforms. Returns #NULL if the resize fails.
- * If the resize fails, the memory is not freed.
- *
- * @param memory block to be resized
- * @param bytes new size of the memory block
- * @return allocated memory, or #NULL if the resize fails.
- */
-void*
-dbus_realloc (void  *memory,
-              size_t bytes)
+static void*
+raw_realloc (void  *memory,
+             size_t size_hint,
+             size_t bytes)
 {
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
   _dbus_initialize_malloc_debug ();
+  _dbus_atomic_inc (&n_allocations);
   
   if (_dbus_decrement_fail_alloc_counter ())
     {
@@ -614,7 +666,7 @@ dbus_realloc (void  *memory,
   
   if (bytes == 0) /* guarantee this is safe */
     {
-      dbus_free (memory);
+      raw_free (memory, size_hint);
       return NULL;
     }
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
@@ -628,9 +680,11 @@ dbus_realloc (void  *memory,
           void *block;
           
           check_guards (memory, FALSE);
-          
-          block = realloc (((unsigned char*)memory) - GUARD_START_OFFSET,
-                           bytes + GUARD_EXTRA_SIZE);
+
+          block = ((unsigned char*)memory) - GUARD_START_OFFSET;
+          old_bytes = *(dbus_uint32_t*)block;
+          block = sys_realloc (block, old_bytes + GUARD_EXTRA_SIZE,
+                               bytes + GUARD_EXTRA_SIZE);
 
           if (block == NULL)
             {
@@ -655,7 +709,7 @@ dbus_realloc (void  *memory,
         {
           void *block;
           
-          block = malloc (bytes + GUARD_EXTRA_SIZE);
+          block = sys_malloc (bytes + GUARD_EXTRA_SIZE);
 
           if (block)
             {
@@ -675,7 +729,7 @@ dbus_realloc (void  *memory,
   else
     {
       void *mem;
-      mem = realloc (memory, bytes);
+      mem = sys_realloc (memory, size_hint, bytes);
 
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
       if (mem == NULL && malloc_cannot_fail)
@@ -691,14 +745,9 @@ dbus_realloc (void  *memory,
     }
 }
 
-/**
- * Frees a block of memory previously allocated by dbus_malloc() or
- * dbus_malloc0(). If passed #NULL, does nothing.
- * 
- * @param memory block to be freed
- */
-void
-dbus_free (void  *memory)
+static void
+raw_free (void  *memory,
+          size_t size_hint)
 {
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
   if (guards)
@@ -706,6 +755,7 @@ dbus_free (void  *memory)
       check_guards (memory, TRUE);
       if (memory)
         {
+          unsigned char *block;
 #ifdef DBUS_DISABLE_ASSERT
           _dbus_atomic_dec (&n_blocks_outstanding);
 #else
@@ -715,7 +765,8 @@ dbus_free (void  *memory)
           _dbus_assert (old_value >= 1);
 #endif
 
-          free (((unsigned char*)memory) - GUARD_START_OFFSET);
+          block = ((unsigned char*)memory) - GUARD_START_OFFSET;
+          sys_free (block, *(dbus_uint32_t*)block + GUARD_EXTRA_SIZE);
         }
       
       return;
@@ -735,10 +786,331 @@ dbus_free (void  *memory)
 #endif
 #endif
 
-      free (memory);
+      sys_free (memory, size_hint);
     }
 }
 
+#ifdef DBUS_ENABLE_STATS
+/**
+ * @addtogroup DBusMemoryInternals
+ *
+ * @{
+ */
+
+/*
+ * Accounting by subsystem. Every block carries a small header with
+ * its size and the tag that was current when it was allocated. Only
+ * the dbus-daemon, which is single-threaded, turns the accounting
+ * on, so the counters need no locking; other processes pay for the
+ * header only.
+ */
+
+/** Size of the header before each block; keeps malloc()'s alignment */
+#define ACCOUNT_HEADER_SIZE 16
+
+/** Tag of the blocks allocated before the accounting was enabled */
+#define TAG_UNTRACKED _DBUS_N_MEMORY_TAGS
+
+typedef struct
+{
+  size_t bytes;       /**< What the caller asked for */
+  unsigned int tag;   /**< #DBusMemoryTag, or TAG_UNTRACKED */
+} AccountHeader;
+
+_DBUS_STATIC_ASSERT (sizeof (AccountHeader) <= ACCOUNT_HEADER_SIZE);
+
+static dbus_bool_t accounting_enabled = FALSE;
+static DBusMemoryTag current_tag = DBUS_MEMORY_TAG_OTHER;
+static size_t tag_bytes[_DBUS_N_MEMORY_TAGS];
+static dbus_uint32_t tag_blocks[_DBUS_N_MEMORY_TAGS];
+
+static const char * const tag_names[_DBUS_N_MEMORY_TAGS] = {
+  "Other",
+  "Connection",
+  "MatchRule",
+  "Policy",
+  "Message",
+  "Loader",
+  "Hash",
+  "List"
+};
+
+/* Fills in the header of a new block and returns what the caller sees */
+static void *
+account_new (void   *block,
+             size_t  bytes)
+{
+  AccountHeader *header = block;
+
+  if (header == NULL)
+    return NULL;
+
+  header->bytes = bytes;
+
+  if (accounting_enabled)
+    {
+      header->tag = current_tag;
+      tag_bytes[current_tag] += bytes;
+      tag_blocks[current_tag] += 1;
+    }
+  else
+    {
+      header->tag = TAG_UNTRACKED;
+    }
+
+  return ((unsigned char *) block) + ACCOUNT_HEADER_SIZE;
+}
+
+static void
+account_forget (AccountHeader *header)
+{
+  if (header->tag != TAG_UNTRACKED)
+    {
+      tag_bytes[header->tag] -= header->bytes;
+      tag_blocks[header->tag] -= 1;
+    }
+}
+
+/**
+ * Starts counting allocations by tag. Blocks that already exist
+ * are not counted.
+ */
+void
+_dbus_memory_enable_accounting (void)
+{
+  accounting_enabled = TRUE;
+}
+
+/**
+ * Makes later allocations count towards tag, unless a tag other
+ * than #DBUS_MEMORY_TAG_OTHER is already current: the outermost
+ * subsystem gets the memory of the hash tables and lists it uses.
+ * Undo with _dbus_memory_pop_tag().
+ *
+ * @param tag the subsystem that is about to allocate
+ * @returns what to pass to _dbus_memory_pop_tag()
+ */
+DBusMemoryTag
+_dbus_memory_push_tag (DBusMemoryTag tag)
+{
+  DBusMemoryTag previous = current_tag;
+
+  _dbus_assert (tag < _DBUS_N_MEMORY_TAGS);
+
+  if (accounting_enabled && previous == DBUS_MEMORY_TAG_OTHER)
+    current_tag = tag;
+
+  return previous;
+}
+
+/**
+ * Undoes _dbus_memory_push_tag().
+ *
+ * @param previous what it returned
+ */
+void
+_dbus_memory_pop_tag (DBusMemoryTag previous)
+{
+  if (accounting_enabled)
+    current_tag = previous;
+}
+
+/**
+ * Gets what is allocated under a tag right now.
+ *
+ * @param tag the tag
+ * @param bytes_p return location for the bytes asked for
+ * @param blocks_p return location for the number of blocks
+ * @returns the name of the tag, for reports
+ */
+const char *
+_dbus_memory_get_tag_stats (DBusMemoryTag  tag,
+                            size_t        *bytes_p,
+                            dbus_uint32_t *blocks_p)
+{
+  _dbus_assert (tag < _DBUS_N_MEMORY_TAGS);
+
+  *bytes_p = tag_bytes[tag];
+  *blocks_p = tag_blocks[tag];
+
+  return tag_names[tag];
+}
+
+/** @} */
+#endif /* DBUS_ENABLE_STATS */
+
+/**
+ * @addtogroup DBusMemory
+ *
+ * @{
+ */
+
+/**
+ * Allocates the given number of bytes, as with standard
+ * malloc(). Guaranteed to return #NULL if bytes is zero
+ * on all platforms. Returns #NULL if the allocation fails.
+ * The memory must be released with dbus_free().
+ *
+ * dbus_malloc() memory is NOT safe to free with regular free() from
+ * the C library. Free it with dbus_free() only.
+ *
+ * @param bytes number of bytes to allocate
+ * @return allocated memory, or #NULL if the allocation fails.
+ */
+void*
+dbus_malloc (size_t bytes)
+{
+#ifdef DBUS_ENABLE_STATS
+  if (bytes == 0 || bytes > ((size_t) -1) - ACCOUNT_HEADER_SIZE)
+    return NULL;
+
+  return account_new (raw_malloc (bytes + ACCOUNT_HEADER_SIZE), bytes);
+#else
+  return raw_malloc (bytes);
+#endif
+}
+
+/**
+ * Allocates the given number of bytes, as with standard malloc(), but
+ * all bytes are initialized to zero as with calloc(). Guaranteed to
+ * return #NULL if bytes is zero on all platforms. Returns #NULL if the
+ * allocation fails.  The memory must be released with dbus_free().
+ *
+ * dbus_malloc0() memory is NOT safe to free with regular free() from
+ * the C library. Free it with dbus_free() only.
+ *
+ * @param bytes number of bytes to allocate
+ * @return allocated memory, or #NULL if the allocation fails.
+ */
+void*
+dbus_malloc0 (size_t bytes)
+{
+#ifdef DBUS_ENABLE_STATS
+  if (bytes == 0 || bytes > ((size_t) -1) - ACCOUNT_HEADER_SIZE)
+    return NULL;
+
+  return account_new (raw_malloc0 (bytes + ACCOUNT_HEADER_SIZE), bytes);
+#else
+  return raw_malloc0 (bytes);
+#endif
+}
+
+/**
+ * Resizes a block of memory previously allocated by dbus_malloc() or
+ * dbus_malloc0(). Guaranteed to free the memory and return #NULL if bytes
+ * is zero on all platforms. Returns #NULL if the resize fails.
+ * If the resize fails, the memory is not freed.
+ *
+ * @param memory block to be resized
+ * @param bytes new size of the memory block
+ * @return allocated memory, or #NULL if the resize fails.
+ */
+void*
+dbus_realloc (void  *memory,
+              size_t bytes)
+{
+#ifdef DBUS_ENABLE_STATS
+  AccountHeader *header;
+  AccountHeader *new_header;
+
+  if (memory == NULL)
+    {
+      if (bytes == 0 || bytes > ((size_t) -1) - ACCOUNT_HEADER_SIZE)
+        return NULL;
+
+      return account_new (raw_realloc (NULL, 0, bytes + ACCOUNT_HEADER_SIZE),
+                          bytes);
+    }
+
+  if (bytes == 0) /* guarantee this is safe */
+    {
+      dbus_free (memory);
+      return NULL;
+    }
+
+  if (bytes > ((size_t) -1) - ACCOUNT_HEADER_SIZE)
+    return NULL;
+
+  header = (AccountHeader *) (((unsigned char *) memory) - ACCOUNT_HEADER_SIZE);
+  new_header = raw_realloc (header, header->bytes + ACCOUNT_HEADER_SIZE,
+                            bytes + ACCOUNT_HEADER_SIZE);
+
+  if (new_header == NULL)
+    return NULL;
+
+  /* the block keeps the tag it was allocated with */
+  if (new_header->tag != TAG_UNTRACKED)
+    tag_bytes[new_header->tag] += bytes - new_header->bytes;
+
+  new_header->bytes = bytes;
+
+  return ((unsigned char *) new_header) + ACCOUNT_HEADER_SIZE;
+#else
+  return raw_realloc (memory, 0, bytes);
+#endif
+}
+
+/**
+ * Frees a block of memory previously allocated by dbus_malloc() or
+ * dbus_malloc0(). If passed #NULL, does nothing.
+ * 
+ * @param memory block to be freed
+ */
+void
+dbus_free (void  *memory)
+{
+#ifdef DBUS_ENABLE_STATS
+  if (memory != NULL)
+    {
+      AccountHeader *header;
+
+      header = (AccountHeader *) (((unsigned char *) memory) - ACCOUNT_HEADER_SIZE);
+      account_forget (header);
+      raw_free (header, header->bytes + ACCOUNT_HEADER_SIZE);
+    }
+#else
+  raw_free (memory, 0);
+#endif
+}
+
+/**
+ * Makes libdbus get its memory from the given functions rather than
+ * malloc(), realloc() and free() from the C library, for example to
+ * use a faster allocator or a heap of the application's own.
+ *
+ * This must be called before anything else in libdbus, since blocks
+ * that already exist could not be freed by the new functions. For
+ * the same reason the allocator can't be changed again once libdbus
+ * has allocated anything, not even after dbus_shutdown(). Blocks
+ * freed by libdbus get the size they were allocated with when it is
+ * known, which it isn't always.
+ *
+ * dbus_malloc() memory handed to the application is still released
+ * with dbus_free(), which passes it on to the free function.
+ *
+ * @param allocator the functions to use, or #NULL for the C library
+ * @returns #FALSE if libdbus has already allocated memory
+ */
+dbus_bool_t
+dbus_set_allocator (const DBusAllocator *allocator)
+{
+  if (allocator_used)
+    return FALSE;
+
+  if (allocator == NULL)
+    {
+      _DBUS_ZERO (memory_allocator);
+      return TRUE;
+    }
+
+  _dbus_return_val_if_fail (allocator->malloc_function != NULL, FALSE);
+  _dbus_return_val_if_fail (allocator->realloc_function != NULL, FALSE);
+  _dbus_return_val_if_fail (allocator->free_function != NULL, FALSE);
+
+  memory_allocator = *allocator;
+  return TRUE;
+}
+
 /**
  * Frees a #NULL-terminated array of strings.
  * If passed #NULL, does nothing.
@@ -937,6 +1309,15 @@ _dbus_memory_test (void)
   old_guards = guards;
   guards = TRUE;
   p = dbus_malloc (4);
+  if (p == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  /* too late, now that memory has been allocated */
+  if (dbus_set_allocator (NULL))
+    _dbus_assert_not_reached ("allocator changed after first use");
+
+  dbus_free (p);
+  p = dbus_malloc (4);
   if (p == NULL)
     _dbus_assert_not_reached ("no memory");
   for (size = 4; size < 256; size += 4)
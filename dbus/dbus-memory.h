@@ -28,6 +28,7 @@
 #define DBUS_MEMORY_H
 
 #include <dbus/dbus-macros.h>
+#include <dbus/dbus-types.h>
 #include <stddef.h>
 
 DBUS_BEGIN_DECLS
@@ -63,6 +64,33 @@ void dbus_free_string_array (char **str_array);
 
 typedef void (* DBusFreeFunction) (void *memory);
 
+/**
+ * Functions that libdbus gets all of its memory from, installed with
+ * dbus_set_allocator(). A size passed back is what the block was
+ * allocated or last resized with, or 0 if libdbus does not know it.
+ */
+typedef struct
+{
+  void* (* malloc_function)  (size_t  bytes,
+                              void   *user_data); /**< Like malloc(); bytes is never 0 */
+  void* (* realloc_function) (void   *memory,
+                              size_t  old_bytes,
+                              size_t  new_bytes,
+                              void   *user_data); /**< Like realloc(); memory is never #NULL and new_bytes never 0 */
+  void  (* free_function)    (void   *memory,
+                              size_t  bytes,
+                              void   *user_data); /**< Like free(); memory is never #NULL */
+  void *user_data; /**< Passed to each of the functions */
+
+  void (* dbus_internal_pad1) (void *); /**< Reserved for future expansion */
+  void (* dbus_internal_pad2) (void *); /**< Reserved for future expansion */
+  void (* dbus_internal_pad3) (void *); /**< Reserved for future expansion */
+  void (* dbus_internal_pad4) (void *); /**< Reserved for future expansion */
+} DBusAllocator;
+
+DBUS_EXPORT
+dbus_bool_t dbus_set_allocator (const DBusAllocator *allocator);
+
 DBUS_EXPORT
 void dbus_shutdown (void);
 
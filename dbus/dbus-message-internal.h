@@ -47,15 +47,41 @@ void _dbus_message_trace_ref (DBusMessage *message,
 
 typedef struct DBusMessageLoader DBusMessageLoader;
 
+DBUS_PRIVATE_EXPORT
 void _dbus_message_get_network_data  (DBusMessage       *message,
 				      const DBusString **header,
 				      const DBusString **body);
+const DBusString *_dbus_message_get_network_tail (DBusMessage *message);
+int  _dbus_message_get_size          (DBusMessage       *message);
+DBusMessage *_dbus_message_copy_header_only (DBusMessage *message);
+DBUS_PRIVATE_EXPORT
+DBusValidity _dbus_message_validate_deferred_body (DBusMessage *message);
+DBUS_PRIVATE_EXPORT
+DBusMessage *_dbus_message_new_reply_from_template (DBusMessage *template_message,
+                                                    DBusMessage *method_call);
 DBUS_PRIVATE_EXPORT
 void _dbus_message_get_unix_fds      (DBusMessage *message,
                                       const int **fds,
                                       unsigned *n_fds);
 
+DBUS_PRIVATE_EXPORT
+void _dbus_message_set_cache_limits  (int max_messages,
+                                      int max_size);
+/* if DBUS_ENABLE_STATS */
+DBUS_PRIVATE_EXPORT
+void _dbus_message_get_cache_stats   (dbus_uint32_t *hits_p,
+                                      dbus_uint32_t *misses_p,
+                                      dbus_uint32_t *cached_p);
+/* if DBUS_ENABLE_STATS */
+DBUS_PRIVATE_EXPORT
+void _dbus_message_get_body_pool_stats (dbus_uint32_t *hits_p,
+                                        dbus_uint32_t *misses_p,
+                                        dbus_uint32_t *cached_bytes_p,
+                                        dbus_uint32_t *used_bytes_p);
+
 void        _dbus_message_lock                  (DBusMessage  *message);
+void        _dbus_message_reset_reply_serial    (DBusMessage  *message,
+                                                 dbus_uint32_t reply_serial);
 void        _dbus_message_unlock                (DBusMessage  *message);
 dbus_bool_t _dbus_message_add_counter           (DBusMessage  *message,
                                                  DBusCounter  *counter);
@@ -77,6 +103,8 @@ void               _dbus_message_loader_get_buffer            (DBusMessageLoader
 DBUS_PRIVATE_EXPORT
 void               _dbus_message_loader_return_buffer         (DBusMessageLoader  *loader,
                                                                DBusString         *buffer);
+int                _dbus_message_loader_get_max_to_read       (DBusMessageLoader  *loader,
+                                                               int                 default_max);
 
 DBUS_PRIVATE_EXPORT
 dbus_bool_t        _dbus_message_loader_get_unix_fds          (DBusMessageLoader  *loader,
@@ -89,6 +117,8 @@ void               _dbus_message_loader_return_unix_fds       (DBusMessageLoader
 
 DBUS_PRIVATE_EXPORT
 dbus_bool_t        _dbus_message_loader_queue_messages        (DBusMessageLoader  *loader);
+void               _dbus_message_loader_trim                  (DBusMessageLoader  *loader);
+int                _dbus_message_loader_get_buffer_bytes      (DBusMessageLoader  *loader);
 DBusMessage*       _dbus_message_loader_peek_message          (DBusMessageLoader  *loader);
 DBUS_PRIVATE_EXPORT
 DBusMessage*       _dbus_message_loader_pop_message           (DBusMessageLoader  *loader);
@@ -108,6 +138,13 @@ long               _dbus_message_loader_get_max_message_size  (DBusMessageLoader
 void               _dbus_message_loader_set_max_message_unix_fds(DBusMessageLoader  *loader,
                                                                  long                n);
 long               _dbus_message_loader_get_max_message_unix_fds(DBusMessageLoader  *loader);
+DBUS_PRIVATE_EXPORT
+void               _dbus_message_loader_set_deferred_validation_size (DBusMessageLoader *loader,
+                                                                      long               size);
+DBUS_PRIVATE_EXPORT
+void               _dbus_message_loader_set_trust_bodies      (DBusMessageLoader  *loader,
+                                                               dbus_bool_t         trust);
+dbus_bool_t        _dbus_message_loader_get_trust_bodies      (DBusMessageLoader  *loader);
 int                _dbus_message_loader_get_pending_fds_count (DBusMessageLoader  *loader);
 void               _dbus_message_loader_set_pending_fds_function (DBusMessageLoader *loader,
                                                                   void (* callback) (void *),
@@ -28,6 +28,8 @@
 #include <dbus/dbus-string.h>
 #include <dbus/dbus-dataslot.h>
 #include <dbus/dbus-marshal-header.h>
+#include <dbus/dbus-marshal-validate.h>
+#include <dbus/dbus-hash.h>
 
 DBUS_BEGIN_DECLS
 
@@ -66,14 +68,29 @@ struct DBusMessageLoader
   DBusList *messages;  /**< Complete messages. */
 
   long max_message_size; /**< Maximum size of a message */
+
+  int pending_message_len; /**< Length claimed by the header of the incomplete message at the start of data, or 0 if not known */
+  int recent_message_len; /**< Decaying maximum of recently loaded messages' lengths, for sizing the buffer */
+
+  DBusMessage *direct_body_message; /**< Message whose large body is being read into its own buffer, or #NULL */
+  int direct_body_len; /**< Claimed body length of direct_body_message */
   long max_message_unix_fds; /**< Maximum unix fds in a message */
+  long deferred_validation_size; /**< Bodies at least this long are left for _dbus_message_validate_deferred_body(), or 0 */
+
+  DBusHeaderNameCache header_names; /**< Names recently found valid in headers loaded here */
 
   DBusValidity corruption_reason; /**< why we were corrupted */
 
   unsigned int corrupted : 1; /**< We got broken data, and are no longer working */
 
+  unsigned int trust_bodies : 1; /**< The peer only sends valid bodies, so they are not validated */
+
   unsigned int buffer_outstanding : 1; /**< Someone is using the buffer to read */
 
+#ifdef DBUS_ENABLE_STATS
+  DBusMemoryTag tag_before_buffer; /**< To restore when the buffer comes back */
+#endif
+
 #ifdef HAVE_UNIX_FD_PASSING
   unsigned int unix_fds_outstanding : 1; /**< Someone is using the unix fd array to read */
 
@@ -104,14 +121,30 @@ struct DBusMessage
 
   DBusString body;   /**< Body network data. */
 
+  DBusString tail;   /**< Borrowed bytes sent after the body without being copied into it, valid if has_tail */
+  void *tail_data;   /**< Passed to tail_free_func when the tail is given back */
+  DBusFreeFunction tail_free_func; /**< Function to give the tail back, or #NULL */
+  DBusString flat_body; /**< Read-only view of the body followed by a copy of the tail, valid if tail_copied */
+  void *pooled_body; /**< Buffer from the body pool that body was initialized on, or #NULL */
+  int pooled_body_class; /**< Size class of pooled_body */
+
+  DBusArrayCounts array_counts; /**< Element counts of large arrays, recorded when the body was validated */
+  DBusHashTable *dict_indexes; /**< Key indexes of large dictionaries by array start position, see dbus_message_iter_find_dict_value() */
+
   unsigned int locked : 1; /**< Message being sent, no modifications allowed. */
 
+  unsigned int has_tail : 1; /**< Has borrowed bytes to send after the body */
+  unsigned int tail_copied : 1; /**< flat_body holds the body followed by a copy of the tail */
+  unsigned int tail_unreserved : 1; /**< The tail is the whole body, shared by dbus_message_copy() with no room reserved for it */
+  unsigned int body_unvalidated : 1; /**< The loader did not validate the body, see _dbus_message_validate_deferred_body() */
+
 #ifndef DBUS_DISABLE_CHECKS
   unsigned int in_cache : 1; /**< Has been "freed" since it's in the cache (this is a debug feature) */
 #endif
 
   DBusList *counters;   /**< 0-N DBusCounter used to track message size/unix fds. */
   long size_counter_delta;   /**< Size we incremented the size counters by.   */
+  dbus_uint64_t queued_nsec; /**< When a connection with a broadcast TTL first queued it, or 0 */
 
   dbus_uint32_t changed_stamp : CHANGED_STAMP_BITS; /**< Incremented when iterators are invalidated. */
 
@@ -130,6 +163,8 @@ struct DBusMessage
   unsigned n_unix_fds_allocated; /**< Allocated size of the array */
 
   long unix_fd_counter_delta; /**< Size we incremented the unix fd counter by */
+
+  DBusList *sealed_mappings; /**< Read-only mappings handed out by dbus_message_iter_get_sealed_bytes() */
 #endif
 };
 
@@ -27,6 +27,7 @@
 #include "dbus-test.h"
 #include "dbus-message-private.h"
 #include "dbus-marshal-recursive.h"
+#include "dbus-signature.h"
 #include "dbus-string.h"
 #ifdef HAVE_UNIX_FD_PASSING
 #include "dbus-sysdeps-unix.h"
@@ -1148,6 +1149,1436 @@ verify_test_message_memleak (DBusMessage *message)
   _dbus_check_fdleaks_leave (initial_fds);
 }
 
+/* Feed a message with a large body to a loader in pieces, followed in
+ * the same read by the start of a small message, as a transport that
+ * ignores _dbus_message_loader_get_max_to_read() would */
+static void
+check_large_body_loading (void)
+{
+  DBusMessageLoader *loader;
+  DBusMessage *large, *small, *message;
+  DBusString payload;
+  DBusString wire;
+  DBusString *buffer;
+  const DBusString *header, *body;
+  const char *s;
+  int large_len, pos, n;
+
+  if (!_dbus_string_init (&payload) ||
+      !_dbus_string_lengthen (&payload, 100 * 1024))
+    _dbus_assert_not_reached ("no memory");
+
+  memset (_dbus_string_get_data (&payload), 'x',
+          _dbus_string_get_length (&payload));
+  s = _dbus_string_get_const_data (&payload);
+
+  large = dbus_message_new_signal ("/a", "com.example.Large", "Blob");
+  small = dbus_message_new_signal ("/b", "com.example.Small", "Ping");
+  if (large == NULL || small == NULL ||
+      !dbus_message_append_args (large, DBUS_TYPE_STRING, &s,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("no memory");
+
+  dbus_message_set_serial (large, 1);
+  dbus_message_set_serial (small, 2);
+  dbus_message_lock (large);
+  dbus_message_lock (small);
+
+  if (!_dbus_string_init (&wire))
+    _dbus_assert_not_reached ("no memory");
+
+  _dbus_message_get_network_data (large, &header, &body);
+  if (!_dbus_string_copy (header, 0, &wire, _dbus_string_get_length (&wire)) ||
+      !_dbus_string_copy (body, 0, &wire, _dbus_string_get_length (&wire)))
+    _dbus_assert_not_reached ("no memory");
+
+  large_len = _dbus_string_get_length (&wire);
+
+  _dbus_message_get_network_data (small, &header, &body);
+  if (!_dbus_string_copy (header, 0, &wire, _dbus_string_get_length (&wire)) ||
+      !_dbus_string_copy (body, 0, &wire, _dbus_string_get_length (&wire)))
+    _dbus_assert_not_reached ("no memory");
+
+  loader = _dbus_message_loader_new ();
+  if (loader == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  /* Everything up to a little before the end of the large message, in
+   * chunks of the suggested size... */
+  pos = 0;
+  while (pos < large_len - 100)
+    {
+      n = _dbus_message_loader_get_max_to_read (loader, 2048);
+      n = MIN (n, large_len - 100 - pos);
+      _dbus_assert (n > 0);
+
+      _dbus_message_loader_get_buffer (loader, &buffer);
+      if (!_dbus_string_copy_len (&wire, pos, n, buffer,
+                                  _dbus_string_get_length (buffer)))
+        _dbus_assert_not_reached ("no memory");
+      _dbus_message_loader_return_buffer (loader, buffer);
+      pos += n;
+
+      if (!_dbus_message_loader_queue_messages (loader))
+        _dbus_assert_not_reached ("no memory to queue messages");
+
+      _dbus_assert (_dbus_message_loader_peek_message (loader) == NULL);
+    }
+
+  /* ... by then the body is being read directly into the message ... */
+  _dbus_assert (loader->direct_body_message != NULL);
+  _dbus_assert (_dbus_message_loader_get_max_to_read (loader, 2048) == 100);
+
+  /* ... and then the rest, overshooting into the small message */
+  _dbus_message_loader_get_buffer (loader, &buffer);
+  if (!_dbus_string_copy_len (&wire, pos, _dbus_string_get_length (&wire) - pos,
+                              buffer, _dbus_string_get_length (buffer)))
+    _dbus_assert_not_reached ("no memory");
+  _dbus_message_loader_return_buffer (loader, buffer);
+
+  if (!_dbus_message_loader_queue_messages (loader))
+    _dbus_assert_not_reached ("no memory to queue messages");
+
+  _dbus_assert (!_dbus_message_loader_get_is_corrupted (loader));
+  _dbus_assert (loader->direct_body_message == NULL);
+
+  message = _dbus_message_loader_pop_message (loader);
+  _dbus_assert (message != NULL);
+  _dbus_assert (dbus_message_get_serial (message) == 1);
+  if (!dbus_message_get_args (message, NULL, DBUS_TYPE_STRING, &s,
+                              DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("large message has the wrong arguments");
+  _dbus_assert (_dbus_string_equal_c_str (&payload, s));
+  dbus_message_unref (message);
+
+  message = _dbus_message_loader_pop_message (loader);
+  _dbus_assert (message != NULL);
+  _dbus_assert (dbus_message_get_serial (message) == 2);
+  _dbus_assert (dbus_message_is_signal (message, "com.example.Small", "Ping"));
+  dbus_message_unref (message);
+
+  _dbus_assert (_dbus_message_loader_pop_message (loader) == NULL);
+
+  _dbus_message_loader_unref (loader);
+  dbus_message_unref (large);
+  dbus_message_unref (small);
+  _dbus_string_free (&wire);
+  _dbus_string_free (&payload);
+}
+
+/* A loader told to defer validation passes on a message with an
+ * invalid body, which only _dbus_message_validate_deferred_body()
+ * rejects, and leaves short bodies to be validated as usual; one that
+ * trusts its peer does not validate bodies at all */
+static void
+check_deferred_body_validation (void)
+{
+  DBusMessageLoader *loader;
+  DBusMessage *message;
+  DBusString wire;
+  DBusString *buffer;
+  const DBusString *header, *body;
+  const char *s = "hello";
+  int body_start;
+  int i;
+
+  if (!_dbus_string_init (&wire))
+    _dbus_assert_not_reached ("no memory");
+
+  /* the same valid signal twice, then with the string's nul replaced */
+  for (i = 0; i < 3; i++)
+    {
+      message = dbus_message_new_signal ("/a", "com.example.Deferred", "Str");
+      if (message == NULL ||
+          !dbus_message_append_args (message, DBUS_TYPE_STRING, &s,
+                                     DBUS_TYPE_INVALID))
+        _dbus_assert_not_reached ("no memory");
+
+      dbus_message_set_serial (message, i + 1);
+      dbus_message_lock (message);
+      _dbus_message_get_network_data (message, &header, &body);
+
+      if (!_dbus_string_copy (header, 0, &wire,
+                              _dbus_string_get_length (&wire)))
+        _dbus_assert_not_reached ("no memory");
+
+      body_start = _dbus_string_get_length (&wire);
+
+      if (!_dbus_string_copy (body, 0, &wire, body_start))
+        _dbus_assert_not_reached ("no memory");
+
+      dbus_message_unref (message);
+    }
+
+  _dbus_string_set_byte (&wire, _dbus_string_get_length (&wire) - 1, 'x');
+
+  loader = _dbus_message_loader_new ();
+  if (loader == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  _dbus_message_loader_set_deferred_validation_size (loader, 1);
+
+  _dbus_message_loader_get_buffer (loader, &buffer);
+  if (!_dbus_string_copy (&wire, 0, buffer, _dbus_string_get_length (buffer)))
+    _dbus_assert_not_reached ("no memory");
+  _dbus_message_loader_return_buffer (loader, buffer);
+
+  if (!_dbus_message_loader_queue_messages (loader))
+    _dbus_assert_not_reached ("no memory to queue messages");
+
+  _dbus_assert (!_dbus_message_loader_get_is_corrupted (loader));
+
+  for (i = 0; i < 2; i++)
+    {
+      message = _dbus_message_loader_pop_message (loader);
+      _dbus_assert (message != NULL);
+      _dbus_assert (message->body_unvalidated);
+      _dbus_assert (_dbus_message_validate_deferred_body (message) ==
+                    DBUS_VALID);
+      _dbus_assert (!message->body_unvalidated);
+
+      if (!dbus_message_get_args (message, NULL, DBUS_TYPE_STRING, &s,
+                                  DBUS_TYPE_INVALID))
+        _dbus_assert_not_reached ("deferred body has the wrong arguments");
+
+      _dbus_assert (strcmp (s, "hello") == 0);
+      dbus_message_unref (message);
+    }
+
+  message = _dbus_message_loader_pop_message (loader);
+  _dbus_assert (message != NULL);
+  _dbus_assert (_dbus_message_validate_deferred_body (message) ==
+                DBUS_INVALID_STRING_MISSING_NUL);
+  _dbus_assert (message->body_unvalidated);
+  dbus_message_unref (message);
+
+  _dbus_assert (_dbus_message_loader_pop_message (loader) == NULL);
+  _dbus_message_loader_unref (loader);
+
+  /* bodies shorter than the limit are still validated on arrival */
+  loader = _dbus_message_loader_new ();
+  if (loader == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  _dbus_message_loader_set_deferred_validation_size (loader, 1024);
+
+  _dbus_message_loader_get_buffer (loader, &buffer);
+  if (!_dbus_string_copy (&wire, 0, buffer, _dbus_string_get_length (buffer)))
+    _dbus_assert_not_reached ("no memory");
+  _dbus_message_loader_return_buffer (loader, buffer);
+
+  if (!_dbus_message_loader_queue_messages (loader))
+    _dbus_assert_not_reached ("no memory to queue messages");
+
+  _dbus_assert (_dbus_message_loader_get_is_corrupted (loader));
+  _dbus_assert (_dbus_message_loader_get_corruption_reason (loader) ==
+                DBUS_INVALID_STRING_MISSING_NUL);
+
+  for (i = 0; i < 2; i++)
+    {
+      message = _dbus_message_loader_pop_message (loader);
+      _dbus_assert (message != NULL);
+      _dbus_assert (!message->body_unvalidated);
+      dbus_message_unref (message);
+    }
+
+  _dbus_message_loader_unref (loader);
+
+  loader = _dbus_message_loader_new ();
+  if (loader == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  _dbus_message_loader_set_trust_bodies (loader, TRUE);
+
+  _dbus_message_loader_get_buffer (loader, &buffer);
+  if (!_dbus_string_copy (&wire, 0, buffer, _dbus_string_get_length (buffer)))
+    _dbus_assert_not_reached ("no memory");
+  _dbus_message_loader_return_buffer (loader, buffer);
+
+  if (!_dbus_message_loader_queue_messages (loader))
+    _dbus_assert_not_reached ("no memory to queue messages");
+
+  _dbus_assert (!_dbus_message_loader_get_is_corrupted (loader));
+
+  for (i = 0; i < 3; i++)
+    {
+      message = _dbus_message_loader_pop_message (loader);
+      _dbus_assert (message != NULL);
+      _dbus_assert (!message->body_unvalidated);
+      dbus_message_unref (message);
+    }
+
+  _dbus_assert (_dbus_message_loader_pop_message (loader) == NULL);
+  _dbus_message_loader_unref (loader);
+  _dbus_string_free (&wire);
+}
+
+/* The cache is a stack, so with the cache enabled the most recently
+ * freed message is the first to be reused; shrinking the limits
+ * drops whatever no longer fits */
+static void
+check_message_cache_limits (void)
+{
+  DBusMessage *a, *b, *message;
+  const char *s;
+  dbus_bool_t cache_enabled;
+
+  s = _dbus_getenv ("DBUS_MESSAGE_CACHE");
+  cache_enabled = !(s != NULL && *s == '0');
+
+  _dbus_message_set_cache_limits (0, 10 * _DBUS_ONE_KILOBYTE);
+  _dbus_message_set_cache_limits (2, 10 * _DBUS_ONE_KILOBYTE);
+
+  a = dbus_message_new_signal ("/a", "a.b", "c");
+  b = dbus_message_new_signal ("/a", "a.b", "c");
+  if (a == NULL || b == NULL)
+    _dbus_assert_not_reached ("out of memory");
+  dbus_message_unref (a);
+  dbus_message_unref (b);
+
+  message = dbus_message_new_signal ("/a", "a.b", "c");
+  if (message == NULL)
+    _dbus_assert_not_reached ("out of memory");
+  if (cache_enabled)
+    _dbus_assert (message == b);
+  b = message;
+
+  message = dbus_message_new_signal ("/a", "a.b", "c");
+  if (message == NULL)
+    _dbus_assert_not_reached ("out of memory");
+  if (cache_enabled)
+    _dbus_assert (message == a);
+  a = message;
+
+  dbus_message_unref (a);
+  dbus_message_unref (b);
+
+  _dbus_message_set_cache_limits (0, 10 * _DBUS_ONE_KILOBYTE);
+  _dbus_message_set_cache_limits (5, 10 * _DBUS_ONE_KILOBYTE);
+}
+
+static int n_borrowed_freed = 0;
+
+static void
+free_borrowed (void *data)
+{
+  dbus_free (data);
+  n_borrowed_freed += 1;
+}
+
+/* Appends n_bytes of a pattern as a borrowed ay, optionally followed
+ * by a uint32 */
+static DBusMessage *
+new_borrowed_message (int          n_bytes,
+                      dbus_bool_t  append_after)
+{
+  DBusMessage *message;
+  DBusMessageIter iter, sub;
+  unsigned char *bytes;
+  dbus_uint32_t after = 42;
+  int i;
+
+  message = dbus_message_new_signal ("/a", "com.example.Borrowed", "Blob");
+  bytes = dbus_malloc (n_bytes);
+  if (message == NULL || bytes == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  for (i = 0; i < n_bytes; i++)
+    bytes[i] = i % 251;
+
+  dbus_message_set_serial (message, 1);
+  dbus_message_iter_init_append (message, &iter);
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                         DBUS_TYPE_BYTE_AS_STRING, &sub) ||
+      !dbus_message_iter_append_fixed_array_borrowed (&sub, DBUS_TYPE_BYTE,
+                                                      &bytes, n_bytes,
+                                                      bytes, free_borrowed) ||
+      !dbus_message_iter_close_container (&iter, &sub))
+    _dbus_assert_not_reached ("no memory");
+
+  if (append_after &&
+      !dbus_message_iter_append_basic (&iter, DBUS_TYPE_UINT32, &after))
+    _dbus_assert_not_reached ("no memory");
+
+  return message;
+}
+
+static void
+verify_borrowed_message (DBusMessage *message,
+                         int          n_bytes,
+                         dbus_bool_t  has_after)
+{
+  DBusMessageIter iter, sub;
+  const unsigned char *bytes;
+  dbus_uint32_t after;
+  int n, i;
+
+  _dbus_assert (dbus_message_has_signature (message, has_after ? "ayu" : "ay"));
+
+  dbus_message_iter_init (message, &iter);
+  dbus_message_iter_recurse (&iter, &sub);
+  dbus_message_iter_get_fixed_array (&sub, &bytes, &n);
+  _dbus_assert (n == n_bytes);
+
+  for (i = 0; i < n; i++)
+    _dbus_assert (bytes[i] == i % 251);
+
+  if (has_after)
+    {
+      _dbus_assert (dbus_message_iter_next (&iter));
+      dbus_message_iter_get_basic (&iter, &after);
+      _dbus_assert (after == 42);
+    }
+
+  _dbus_assert (!dbus_message_iter_next (&iter));
+}
+
+/* Arrays appended with dbus_message_iter_append_fixed_array_borrowed()
+ * go out as a separate segment, and are copied in whenever something
+ * needs the body in one piece */
+static void
+check_borrowed_fixed_array (void)
+{
+  DBusMessage *message, *copy;
+  const DBusString *header, *body, *tail;
+  char *marshalled;
+  int len;
+
+  /* Small blocks are copied straight away */
+  n_borrowed_freed = 0;
+  message = new_borrowed_message (100, FALSE);
+  _dbus_assert (n_borrowed_freed == 1);
+  dbus_message_lock (message);
+  _dbus_assert (_dbus_message_get_network_tail (message) == NULL);
+  verify_borrowed_message (message, 100, FALSE);
+  dbus_message_unref (message);
+
+  /* A large block stays borrowed while the message is sent, read and
+   * copied */
+  n_borrowed_freed = 0;
+  message = new_borrowed_message (10000, FALSE);
+  _dbus_assert (n_borrowed_freed == 0);
+
+  dbus_message_lock (message);
+  _dbus_message_get_network_data (message, &header, &body);
+  tail = _dbus_message_get_network_tail (message);
+  _dbus_assert (tail != NULL);
+  _dbus_assert (_dbus_string_get_length (tail) == 10000);
+  _dbus_assert (_dbus_message_get_size (message) ==
+                _dbus_string_get_length (header) +
+                _dbus_string_get_length (body) + 10000);
+
+  verify_borrowed_message (message, 10000, FALSE);
+  verify_borrowed_message (message, 10000, FALSE);
+  _dbus_assert (_dbus_message_get_network_tail (message) == tail);
+
+  copy = dbus_message_copy (message);
+  _dbus_assert (copy != NULL);
+  verify_borrowed_message (copy, 10000, FALSE);
+  dbus_message_unref (copy);
+
+  if (!dbus_message_marshal (message, &marshalled, &len))
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (len == _dbus_message_get_size (message));
+
+  copy = dbus_message_demarshal (marshalled, len, NULL);
+  _dbus_assert (copy != NULL);
+  verify_borrowed_message (copy, 10000, FALSE);
+  dbus_message_unref (copy);
+  dbus_free (marshalled);
+
+  _dbus_assert (n_borrowed_freed == 0);
+  dbus_message_unref (message);
+  _dbus_assert (n_borrowed_freed == 1);
+
+  /* Appending more copies the block in first */
+  n_borrowed_freed = 0;
+  message = new_borrowed_message (10000, TRUE);
+  _dbus_assert (n_borrowed_freed == 1);
+  dbus_message_lock (message);
+  _dbus_assert (_dbus_message_get_network_tail (message) == NULL);
+  verify_borrowed_message (message, 10000, TRUE);
+  dbus_message_unref (message);
+
+  /* So does reading the message before it's locked */
+  n_borrowed_freed = 0;
+  message = new_borrowed_message (10000, FALSE);
+  verify_borrowed_message (message, 10000, FALSE);
+  _dbus_assert (n_borrowed_freed == 1);
+  dbus_message_lock (message);
+  _dbus_assert (_dbus_message_get_network_tail (message) == NULL);
+  dbus_message_unref (message);
+}
+
+/* Copies of large locked messages refer to the original's body until
+ * their own body is written */
+static void
+check_shared_copy_body (void)
+{
+  DBusMessage *message, *copy;
+  const DBusString *header, *body, *tail;
+  dbus_uint32_t extra = 7;
+
+  /* Small bodies are copied straight away */
+  message = new_borrowed_message (100, TRUE);
+  dbus_message_lock (message);
+  copy = dbus_message_copy (message);
+  _dbus_assert (copy != NULL);
+  dbus_message_lock (copy);
+  _dbus_assert (_dbus_message_get_network_tail (copy) == NULL);
+  verify_borrowed_message (copy, 100, TRUE);
+  dbus_message_unref (copy);
+  dbus_message_unref (message);
+
+  /* So are bodies of messages that can still change */
+  message = new_borrowed_message (10000, TRUE);
+  copy = dbus_message_copy (message);
+  _dbus_assert (copy != NULL);
+  dbus_message_lock (copy);
+  _dbus_assert (_dbus_message_get_network_tail (copy) == NULL);
+  dbus_message_unref (copy);
+
+  /* A large locked body is sent straight from the original, which the
+   * copy keeps alive */
+  dbus_message_lock (message);
+  copy = dbus_message_copy (message);
+  _dbus_assert (copy != NULL);
+
+  /* Reading it neither copies the body nor needs room for it */
+  verify_borrowed_message (copy, 10000, TRUE);
+  _dbus_assert (copy->has_tail);
+  _dbus_assert (_dbus_string_get_allocated (&copy->body) < 100);
+
+  if (!dbus_message_set_destination (copy, "com.example.Forwarded"))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_set_serial (copy, 2);
+  dbus_message_lock (copy);
+
+  _dbus_message_get_network_data (copy, &header, &body);
+  tail = _dbus_message_get_network_tail (copy);
+  _dbus_assert (tail != NULL);
+  _dbus_assert (_dbus_string_get_length (body) == 0);
+  _dbus_message_get_network_data (message, &header, &body);
+  _dbus_assert (_dbus_string_get_const_data (tail) ==
+                _dbus_string_get_const_data (body));
+
+  dbus_message_unref (message);
+  verify_borrowed_message (copy, 10000, TRUE);
+  _dbus_assert (strcmp (dbus_message_get_destination (copy),
+                        "com.example.Forwarded") == 0);
+
+  /* Writing to a copy gives it a body of its own first */
+  message = copy;
+  copy = dbus_message_copy (message);
+  _dbus_assert (copy != NULL);
+  if (!dbus_message_append_args (copy, DBUS_TYPE_UINT32, &extra,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (dbus_message_has_signature (copy, "ayuu"));
+  dbus_message_lock (copy);
+  _dbus_assert (_dbus_message_get_network_tail (copy) == NULL);
+  verify_borrowed_message (message, 10000, TRUE);
+  dbus_message_unref (message);
+  dbus_message_unref (copy);
+}
+
+/* Marshalling into the caller's memory, and demarshalling a message
+ * that borrows its body from it */
+static void
+check_marshal_borrowed (void)
+{
+  DBusMessage *message, *copy;
+  DBusError error = DBUS_ERROR_INIT;
+  const DBusString *header, *body, *tail;
+  const char *segments[DBUS_MESSAGE_MAX_SEGMENTS];
+  int lengths[DBUS_MESSAGE_MAX_SEGMENTS];
+  char *marshalled, *buffer;
+  int len, size, n, i, pos;
+
+  message = new_borrowed_message (10000, FALSE);
+  if (!dbus_message_marshal (message, &marshalled, &len))
+    _dbus_assert_not_reached ("no memory");
+
+  /* Asking for the size, then marshalling into a buffer of that size */
+  _dbus_assert (!dbus_message_marshal_into (message, NULL, 0, &size));
+  _dbus_assert (size == len);
+  buffer = dbus_malloc (size);
+  if (buffer == NULL)
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (!dbus_message_marshal_into (message, buffer, size - 1, &size));
+  _dbus_assert (dbus_message_marshal_into (message, buffer, size, &size));
+  _dbus_assert (size == len);
+  _dbus_assert (memcmp (buffer, marshalled, len) == 0);
+
+  /* The segments, concatenated, are the same */
+  n = dbus_message_marshal_segments (message, segments, lengths,
+                                     DBUS_MESSAGE_MAX_SEGMENTS);
+  _dbus_assert (n == 3);
+  _dbus_assert (dbus_message_get_serial (message) == 1);
+
+  for (i = 0, pos = 0; i < n; i++)
+    {
+      _dbus_assert (memcmp (segments[i], marshalled + pos, lengths[i]) == 0);
+      pos += lengths[i];
+    }
+
+  _dbus_assert (pos == len);
+  dbus_message_unref (message);
+  dbus_free (marshalled);
+
+  /* A large body is borrowed, and given back when the message is freed */
+  n_borrowed_freed = 0;
+  message = dbus_message_demarshal_borrowed (buffer, len, buffer,
+                                             free_borrowed, &error);
+  _dbus_assert (message != NULL);
+  _dbus_assert (n_borrowed_freed == 0);
+
+  /* Passing it on sends it straight from the buffer */
+  copy = dbus_message_copy (message);
+  _dbus_assert (copy != NULL);
+  dbus_message_lock (message);
+  _dbus_message_get_network_data (message, &header, &body);
+  tail = _dbus_message_get_network_tail (message);
+  _dbus_assert (tail != NULL);
+  _dbus_assert (_dbus_string_get_const_data (tail) ==
+                buffer + _dbus_string_get_length (header));
+  _dbus_assert (_dbus_string_get_length (body) == 0);
+  _dbus_assert (_dbus_message_get_size (message) == len);
+
+  verify_borrowed_message (message, 10000, FALSE);
+  dbus_message_unref (message);
+  _dbus_assert (n_borrowed_freed == 1);
+
+  verify_borrowed_message (copy, 10000, FALSE);
+  dbus_message_unref (copy);
+
+  /* Reading it before it is locked copies the body in and gives the
+   * buffer back straight away */
+  message = new_borrowed_message (10000, TRUE);
+  buffer = dbus_malloc (_dbus_message_get_size (message) + 100);
+  if (buffer == NULL)
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (dbus_message_marshal_into (message, buffer,
+                                           _dbus_message_get_size (message) + 100,
+                                           &len));
+  dbus_message_unref (message);
+
+  n_borrowed_freed = 0;
+  message = dbus_message_demarshal_borrowed (buffer, len, buffer,
+                                             free_borrowed, &error);
+  _dbus_assert (message != NULL);
+  _dbus_assert (n_borrowed_freed == 0);
+  verify_borrowed_message (message, 10000, TRUE);
+  _dbus_assert (n_borrowed_freed == 1);
+  dbus_message_unref (message);
+
+  /* Small bodies are copied, and the buffer given back at once */
+  message = new_borrowed_message (100, FALSE);
+  if (!dbus_message_marshal (message, &marshalled, &len))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_unref (message);
+
+  n_borrowed_freed = 0;
+  message = dbus_message_demarshal_borrowed (marshalled, len, marshalled,
+                                             free_borrowed, &error);
+  _dbus_assert (message != NULL);
+  _dbus_assert (n_borrowed_freed == 1);
+  verify_borrowed_message (message, 100, FALSE);
+  dbus_message_unref (message);
+
+  /* Incomplete or corrupt input is refused, and stays the caller's */
+  message = new_borrowed_message (10000, FALSE);
+  if (!dbus_message_marshal (message, &marshalled, &len))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_unref (message);
+
+  n_borrowed_freed = 0;
+  message = dbus_message_demarshal_borrowed (marshalled, len - 1, marshalled,
+                                             free_borrowed, &error);
+  _dbus_assert (message == NULL);
+  _dbus_assert (dbus_error_has_name (&error, DBUS_ERROR_INVALID_ARGS));
+  dbus_error_free (&error);
+
+  message = dbus_message_demarshal_borrowed ("", 0, NULL, free_borrowed,
+                                             &error);
+  _dbus_assert (message == NULL);
+  _dbus_assert (dbus_error_is_set (&error));
+  dbus_error_free (&error);
+
+  /* the array length no longer matches the body */
+  marshalled[len - 10000 - 4] ^= 0x10;
+  message = dbus_message_demarshal_borrowed (marshalled, len, marshalled,
+                                             free_borrowed, &error);
+  _dbus_assert (message == NULL);
+  _dbus_assert (dbus_error_has_name (&error, DBUS_ERROR_INVALID_ARGS));
+  dbus_error_free (&error);
+
+  _dbus_assert (n_borrowed_freed == 0);
+  dbus_free (marshalled);
+}
+
+/* Large received bodies go on buffers from the body pool, which are
+ * reused for the next one */
+static void
+check_body_pool (void)
+{
+  DBusMessage *message, *copy;
+  dbus_uint32_t extra = 7;
+  char *marshalled;
+  int len;
+#ifdef DBUS_ENABLE_STATS
+  dbus_uint32_t hits, misses, cached, used;
+  dbus_uint32_t old_hits, old_misses;
+#endif
+
+  message = new_borrowed_message (2 * 1024 * 1024, FALSE);
+  if (!dbus_message_marshal (message, &marshalled, &len))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_unref (message);
+
+  copy = dbus_message_demarshal (marshalled, len, NULL);
+  _dbus_assert (copy != NULL);
+  _dbus_assert (copy->pooled_body != NULL);
+  verify_borrowed_message (copy, 2 * 1024 * 1024, FALSE);
+
+#ifdef DBUS_ENABLE_STATS
+  _dbus_message_get_body_pool_stats (&old_hits, &old_misses, &cached, &used);
+  _dbus_assert (used >= 4 * 1024 * 1024);
+#endif
+
+  dbus_message_unref (copy);
+
+  copy = dbus_message_demarshal (marshalled, len, NULL);
+  _dbus_assert (copy != NULL);
+  _dbus_assert (copy->pooled_body != NULL);
+
+#ifdef DBUS_ENABLE_STATS
+  _dbus_message_get_body_pool_stats (&hits, &misses, &cached, &used);
+  _dbus_assert (hits == old_hits + 1);
+  _dbus_assert (misses == old_misses);
+#endif
+
+  /* Appending moves the body off the pooled buffer, which still goes
+   * back when the message is freed */
+  if (!dbus_message_append_args (copy, DBUS_TYPE_UINT32, &extra,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (dbus_message_has_signature (copy, "ayu"));
+  dbus_message_unref (copy);
+  dbus_free (marshalled);
+
+  /* Smaller bodies don't use the pool */
+  message = new_borrowed_message (100 * 1024, FALSE);
+  if (!dbus_message_marshal (message, &marshalled, &len))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_unref (message);
+
+  copy = dbus_message_demarshal (marshalled, len, NULL);
+  _dbus_assert (copy != NULL);
+  _dbus_assert (copy->pooled_body == NULL);
+  verify_borrowed_message (copy, 100 * 1024, FALSE);
+  dbus_message_unref (copy);
+  dbus_free (marshalled);
+}
+
+static void
+load_marshalled (DBusMessageLoader *loader,
+                 const char        *data,
+                 int                len)
+{
+  DBusString *buffer;
+
+  _dbus_message_loader_get_buffer (loader, &buffer);
+  if (!_dbus_string_append_len (buffer, data, len))
+    _dbus_assert_not_reached ("no memory");
+  _dbus_message_loader_return_buffer (loader, buffer);
+
+  if (!_dbus_message_loader_queue_messages (loader))
+    _dbus_assert_not_reached ("no memory to queue messages");
+}
+
+/* A name found valid once is remembered by the loader, but only a
+ * byte-for-byte match skips validation: an invalid member that hashes
+ * the same as a cached valid one is still rejected */
+static void
+check_header_name_cache (void)
+{
+  DBusMessageLoader *loader;
+  DBusMessage *message;
+  char *marshalled;
+  int len, i, slot;
+
+  message = dbus_message_new_signal ("/a", "com.example.Names", "Ping");
+  if (message == NULL)
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_set_serial (message, 1);
+
+  if (!dbus_message_marshal (message, &marshalled, &len))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_unref (message);
+
+  loader = _dbus_message_loader_new ();
+  if (loader == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  for (i = 0; i < 2; i++)
+    {
+      load_marshalled (loader, marshalled, len);
+      _dbus_assert (!_dbus_message_loader_get_is_corrupted (loader));
+
+      message = _dbus_message_loader_pop_message (loader);
+      _dbus_assert (message != NULL);
+      _dbus_assert (dbus_message_is_signal (message, "com.example.Names",
+                                            "Ping"));
+      dbus_message_unref (message);
+    }
+
+  for (slot = 0; slot < _DBUS_HEADER_NAME_CACHE_SLOTS; slot++)
+    {
+      if (loader->header_names.slots[slot].field == DBUS_HEADER_FIELD_MEMBER)
+        break;
+    }
+
+  _dbus_assert (slot < _DBUS_HEADER_NAME_CACHE_SLOTS);
+  _dbus_assert (loader->header_names.slots[slot].len == 4);
+  _dbus_assert (memcmp (loader->header_names.slots[slot].name, "Ping", 4) == 0);
+
+  /* "P-ng" has the same length, first, middle and last bytes */
+  for (i = 0; i + 5 <= len; i++)
+    {
+      if (memcmp (marshalled + i, "Ping", 5) == 0)
+        break;
+    }
+
+  _dbus_assert (i + 5 <= len);
+  marshalled[i + 1] = '-';
+
+  load_marshalled (loader, marshalled, len);
+  _dbus_assert (_dbus_message_loader_get_is_corrupted (loader));
+  _dbus_assert (loader->corruption_reason == DBUS_INVALID_BAD_MEMBER);
+
+  _dbus_message_loader_unref (loader);
+  dbus_free (marshalled);
+}
+
+typedef struct
+{
+  dbus_int32_t i;
+  dbus_int32_t j;
+  const char *s;
+  double d;
+  unsigned char y;
+  dbus_bool_t b;
+  const char *o;
+  const char *g;
+} MixedStruct;
+
+static const DBusStructField mixed_fields[] = {
+  { DBUS_TYPE_INT32, _DBUS_STRUCT_OFFSET (MixedStruct, i) },
+  { DBUS_TYPE_INT32, _DBUS_STRUCT_OFFSET (MixedStruct, j) },
+  { DBUS_TYPE_STRING, _DBUS_STRUCT_OFFSET (MixedStruct, s) },
+  { DBUS_TYPE_DOUBLE, _DBUS_STRUCT_OFFSET (MixedStruct, d) },
+  { DBUS_TYPE_BYTE, _DBUS_STRUCT_OFFSET (MixedStruct, y) },
+  { DBUS_TYPE_BOOLEAN, _DBUS_STRUCT_OFFSET (MixedStruct, b) },
+  { DBUS_TYPE_OBJECT_PATH, _DBUS_STRUCT_OFFSET (MixedStruct, o) },
+  { DBUS_TYPE_SIGNATURE, _DBUS_STRUCT_OFFSET (MixedStruct, g) }
+};
+
+/* Laid out exactly like the message, so copied in one go */
+typedef struct
+{
+  dbus_int32_t i;
+  dbus_uint32_t u;
+  double d;
+} PackedStruct;
+
+static const DBusStructField packed_fields[] = {
+  { DBUS_TYPE_INT32, _DBUS_STRUCT_OFFSET (PackedStruct, i) },
+  { DBUS_TYPE_UINT32, _DBUS_STRUCT_OFFSET (PackedStruct, u) },
+  { DBUS_TYPE_DOUBLE, _DBUS_STRUCT_OFFSET (PackedStruct, d) }
+};
+
+/* Fixed-length, but with padding in both the C struct and the message */
+typedef struct
+{
+  unsigned char y;
+  double d;
+  dbus_int16_t n;
+} PaddedStruct;
+
+static const DBusStructField padded_fields[] = {
+  { DBUS_TYPE_BYTE, _DBUS_STRUCT_OFFSET (PaddedStruct, y) },
+  { DBUS_TYPE_DOUBLE, _DBUS_STRUCT_OFFSET (PaddedStruct, d) },
+  { DBUS_TYPE_INT16, _DBUS_STRUCT_OFFSET (PaddedStruct, n) }
+};
+
+/* Appends a byte, then the array, then an int32, either struct by
+ * struct or (except for the first struct) in two bulk calls */
+static DBusMessage *
+new_struct_array_message (const char            *element_signature,
+                          const DBusStructField *fields,
+                          int                    n_fields,
+                          const void            *elements,
+                          size_t                 element_size,
+                          int                    n_elements,
+                          dbus_bool_t            bulk)
+{
+  DBusMessage *message;
+  DBusMessageIter iter, array_iter, struct_iter;
+  const unsigned char *element;
+  unsigned char v_BYTE = 42;
+  dbus_int32_t v_INT32 = 0x12345678;
+  int i, j;
+
+  message = dbus_message_new_method_call ("o.b.c", "/o/b/c", "o.b.c", "Method");
+  if (message == NULL)
+    _dbus_assert_not_reached ("out of memory");
+
+  dbus_message_iter_init_append (message, &iter);
+  if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_BYTE, &v_BYTE) ||
+      !dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                         element_signature, &array_iter))
+    _dbus_assert_not_reached ("out of memory");
+
+  element = elements;
+
+  for (i = 0; i < n_elements; i++)
+    {
+      if (bulk && i > 0)
+        break;
+
+      if (!dbus_message_iter_open_container (&array_iter, DBUS_TYPE_STRUCT,
+                                             NULL, &struct_iter))
+        _dbus_assert_not_reached ("out of memory");
+
+      for (j = 0; j < n_fields; j++)
+        if (!dbus_message_iter_append_basic (&struct_iter, fields[j].type,
+                                             element + fields[j].offset))
+          _dbus_assert_not_reached ("out of memory");
+
+      if (!dbus_message_iter_close_container (&array_iter, &struct_iter))
+        _dbus_assert_not_reached ("out of memory");
+
+      element += element_size;
+    }
+
+  if (bulk && n_elements > 1)
+    {
+      int half = n_elements / 2;
+
+      if (!dbus_message_iter_append_struct_array (&array_iter, fields, n_fields,
+                                                  element, element_size,
+                                                  half - 1) ||
+          !dbus_message_iter_append_struct_array (&array_iter, fields, n_fields,
+                                                  element + (half - 1) * element_size,
+                                                  element_size,
+                                                  n_elements - half))
+        _dbus_assert_not_reached ("out of memory");
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &array_iter) ||
+      !dbus_message_iter_append_basic (&iter, DBUS_TYPE_INT32, &v_INT32))
+    _dbus_assert_not_reached ("out of memory");
+
+  return message;
+}
+
+/* Reads the array back a few structs at a time and compares it with
+ * what was appended */
+static void
+verify_struct_array_message (DBusMessage           *message,
+                             const DBusStructField *fields,
+                             int                    n_fields,
+                             const void            *elements,
+                             size_t                 element_size,
+                             int                    n_elements)
+{
+  DBusMessageIter iter, array_iter;
+  unsigned char *buf;
+  const unsigned char *expected;
+  dbus_int32_t v_INT32;
+  int n_read;
+  int i, j, n;
+
+  buf = dbus_malloc (3 * element_size);
+  if (buf == NULL)
+    _dbus_assert_not_reached ("out of memory");
+
+  if (!dbus_message_iter_init (message, &iter))
+    _dbus_assert_not_reached ("no arguments");
+  dbus_message_iter_next (&iter);
+  _dbus_assert (dbus_message_iter_get_element_count (&iter) == n_elements);
+  dbus_message_iter_recurse (&iter, &array_iter);
+
+  expected = elements;
+  n_read = 0;
+
+  while ((n = dbus_message_iter_get_struct_array (&array_iter, fields, n_fields,
+                                                  buf, element_size, 3)) > 0)
+    {
+      _dbus_assert (n <= 3);
+      n_read += n;
+      _dbus_assert (n_read <= n_elements);
+
+      for (i = 0; i < n; i++)
+        {
+          for (j = 0; j < n_fields; j++)
+            {
+              const void *got = buf + i * element_size + fields[j].offset;
+              const void *want = expected + fields[j].offset;
+
+              if (dbus_type_is_fixed (fields[j].type))
+                _dbus_assert (memcmp (got, want, _dbus_type_get_alignment (fields[j].type)) == 0);
+              else
+                _dbus_assert (strcmp (*(const char * const *) got,
+                                      *(const char * const *) want) == 0);
+            }
+
+          expected += element_size;
+        }
+    }
+
+  _dbus_assert (n_read == n_elements);
+  _dbus_assert (dbus_message_iter_get_arg_type (&array_iter) == DBUS_TYPE_INVALID);
+
+  dbus_message_iter_next (&iter);
+  _dbus_assert (dbus_message_iter_get_arg_type (&iter) == DBUS_TYPE_INT32);
+  dbus_message_iter_get_basic (&iter, &v_INT32);
+  _dbus_assert (v_INT32 == 0x12345678);
+
+  dbus_free (buf);
+}
+
+static void
+check_one_struct_array (const char            *element_signature,
+                        const DBusStructField *fields,
+                        int                    n_fields,
+                        const void            *elements,
+                        size_t                 element_size,
+                        int                    n_elements)
+{
+  DBusMessage *slow, *bulk, *copy;
+  char *marshalled;
+  int len;
+
+  slow = new_struct_array_message (element_signature, fields, n_fields,
+                                   elements, element_size, n_elements, FALSE);
+  bulk = new_struct_array_message (element_signature, fields, n_fields,
+                                   elements, element_size, n_elements, TRUE);
+
+  /* Both ways of appending give the same bytes */
+  _dbus_assert (strcmp (dbus_message_get_signature (slow),
+                        dbus_message_get_signature (bulk)) == 0);
+  _dbus_assert (_dbus_string_equal (&slow->body, &bulk->body));
+
+  verify_struct_array_message (bulk, fields, n_fields,
+                               elements, element_size, n_elements);
+
+  /* Including once the message has been through the validator */
+  dbus_message_set_serial (bulk, 1);
+  if (!dbus_message_marshal (bulk, &marshalled, &len))
+    _dbus_assert_not_reached ("out of memory");
+  copy = dbus_message_demarshal (marshalled, len, NULL);
+  _dbus_assert (copy != NULL);
+  verify_struct_array_message (copy, fields, n_fields,
+                               elements, element_size, n_elements);
+
+  dbus_free (marshalled);
+  dbus_message_unref (copy);
+  dbus_message_unref (slow);
+  dbus_message_unref (bulk);
+}
+
+/* Arrays of structs can be appended and read from arrays of C structs
+ * without recursing into each struct */
+static void
+check_struct_array (void)
+{
+  static const char * const strings[] = { "", "a", "Hello, World", "\xc3\xa9t\xc3\xa9" };
+  static const char * const paths[] = { "/", "/a", "/org/freedesktop/DBus" };
+  static const char * const signatures[] = { "", "i", "a{sv}", "(iisd)" };
+  MixedStruct mixed[23];
+  PackedStruct packed[17];
+  PaddedStruct padded[19];
+  int i;
+
+  /* Garbage in the C struct padding must not reach the message */
+  memset (padded, 0xAA, sizeof (padded));
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (mixed); i++)
+    {
+      mixed[i].i = i;
+      mixed[i].j = -i * 1000;
+      mixed[i].s = strings[i % _DBUS_N_ELEMENTS (strings)];
+      mixed[i].d = i / 3.0;
+      mixed[i].y = 255 - i;
+      mixed[i].b = i % 2;
+      mixed[i].o = paths[i % _DBUS_N_ELEMENTS (paths)];
+      mixed[i].g = signatures[i % _DBUS_N_ELEMENTS (signatures)];
+    }
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (packed); i++)
+    {
+      packed[i].i = -i;
+      packed[i].u = 0xfedcba98 - i;
+      packed[i].d = i * 1.5;
+    }
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (padded); i++)
+    {
+      padded[i].y = i;
+      padded[i].d = -i * 0.25;
+      padded[i].n = i * 100;
+    }
+
+  _dbus_assert (sizeof (PackedStruct) == 16);
+
+  for (i = 0; i <= _DBUS_N_ELEMENTS (mixed); i++)
+    check_one_struct_array ("(iisdybog)", mixed_fields, _DBUS_N_ELEMENTS (mixed_fields),
+                            mixed, sizeof (mixed[0]), i);
+
+  for (i = 0; i <= _DBUS_N_ELEMENTS (packed); i++)
+    check_one_struct_array ("(iud)", packed_fields, _DBUS_N_ELEMENTS (packed_fields),
+                            packed, sizeof (packed[0]), i);
+
+  for (i = 0; i <= _DBUS_N_ELEMENTS (padded); i++)
+    check_one_struct_array ("(ydn)", padded_fields, _DBUS_N_ELEMENTS (padded_fields),
+                            padded, sizeof (padded[0]), i);
+}
+
+/* Validating a received body records the element counts of large
+ * arrays, which dbus_message_iter_get_element_count() then uses */
+static void
+check_array_counts (void)
+{
+  DBusMessage *message, *copy;
+  DBusMessageIter iter, array_iter, variant_iter, inner_iter;
+  const char *v_STRING = "some string";
+  char *marshalled;
+  int len;
+  int i;
+
+  message = dbus_message_new_method_call ("o.b.c", "/o/b/c", "o.b.c", "Method");
+  if (message == NULL)
+    _dbus_assert_not_reached ("out of memory");
+
+  dbus_message_iter_init_append (message, &iter);
+
+  /* A small array, which is not recorded */
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "s", &array_iter))
+    _dbus_assert_not_reached ("out of memory");
+  for (i = 0; i < 3; i++)
+    if (!dbus_message_iter_append_basic (&array_iter, DBUS_TYPE_STRING, &v_STRING))
+      _dbus_assert_not_reached ("out of memory");
+  if (!dbus_message_iter_close_container (&iter, &array_iter))
+    _dbus_assert_not_reached ("out of memory");
+
+  /* A large array of variants, each holding another large array */
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "v", &array_iter))
+    _dbus_assert_not_reached ("out of memory");
+  for (i = 0; i < 5; i++)
+    {
+      int j;
+
+      if (!dbus_message_iter_open_container (&array_iter, DBUS_TYPE_VARIANT, "as", &variant_iter) ||
+          !dbus_message_iter_open_container (&variant_iter, DBUS_TYPE_ARRAY, "s", &inner_iter))
+        _dbus_assert_not_reached ("out of memory");
+
+      for (j = 0; j < 100 + i; j++)
+        if (!dbus_message_iter_append_basic (&inner_iter, DBUS_TYPE_STRING, &v_STRING))
+          _dbus_assert_not_reached ("out of memory");
+
+      if (!dbus_message_iter_close_container (&variant_iter, &inner_iter) ||
+          !dbus_message_iter_close_container (&array_iter, &variant_iter))
+        _dbus_assert_not_reached ("out of memory");
+    }
+  if (!dbus_message_iter_close_container (&iter, &array_iter))
+    _dbus_assert_not_reached ("out of memory");
+
+  /* Nothing is recorded for messages built locally */
+  _dbus_assert (message->array_counts.n_entries == 0);
+
+  dbus_message_set_serial (message, 1);
+  if (!dbus_message_marshal (message, &marshalled, &len))
+    _dbus_assert_not_reached ("out of memory");
+  copy = dbus_message_demarshal (marshalled, len, NULL);
+  _dbus_assert (copy != NULL);
+  dbus_free (marshalled);
+
+  /* The outer array of variants and the five inner arrays */
+  _dbus_assert (copy->array_counts.n_entries == 6);
+
+  if (!dbus_message_iter_init (copy, &iter))
+    _dbus_assert_not_reached ("no arguments");
+  _dbus_assert (dbus_message_iter_get_element_count (&iter) == 3);
+
+  dbus_message_iter_next (&iter);
+  _dbus_assert (dbus_message_iter_get_element_count (&iter) == 5);
+
+  dbus_message_iter_recurse (&iter, &array_iter);
+  for (i = 0; i < 5; i++)
+    {
+      int j;
+
+      dbus_message_iter_recurse (&array_iter, &variant_iter);
+      _dbus_assert (dbus_message_iter_get_element_count (&variant_iter) == 100 + i);
+
+      /* and the recorded counts are right */
+      dbus_message_iter_recurse (&variant_iter, &inner_iter);
+      j = 0;
+      while (dbus_message_iter_get_arg_type (&inner_iter) != DBUS_TYPE_INVALID)
+        {
+          j++;
+          dbus_message_iter_next (&inner_iter);
+        }
+      _dbus_assert (j == 100 + i);
+
+      dbus_message_iter_next (&array_iter);
+    }
+
+  dbus_message_unref (copy);
+  dbus_message_unref (message);
+}
+
+/* Appends an a{sv} with n_entries uint32 values called "key0",
+ * "key1" and so on, plus a second "key0" */
+static void
+append_test_dict (DBusMessageIter *iter,
+                  int              n_entries)
+{
+  DBusMessageIter dict_iter, entry_iter, variant_iter;
+  int i;
+
+  if (!dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY, "{sv}", &dict_iter))
+    _dbus_assert_not_reached ("out of memory");
+
+  for (i = 0; i <= n_entries; i++)
+    {
+      char key[32];
+      const char *v_STRING = key;
+      dbus_uint32_t v_UINT32 = i;
+
+      sprintf (key, "key%d", i < n_entries ? i : 0);
+
+      if (!dbus_message_iter_open_container (&dict_iter, DBUS_TYPE_DICT_ENTRY,
+                                             NULL, &entry_iter) ||
+          !dbus_message_iter_append_basic (&entry_iter, DBUS_TYPE_STRING, &v_STRING) ||
+          !dbus_message_iter_open_container (&entry_iter, DBUS_TYPE_VARIANT,
+                                             "u", &variant_iter) ||
+          !dbus_message_iter_append_basic (&variant_iter, DBUS_TYPE_UINT32, &v_UINT32) ||
+          !dbus_message_iter_close_container (&entry_iter, &variant_iter) ||
+          !dbus_message_iter_close_container (&dict_iter, &entry_iter))
+        _dbus_assert_not_reached ("out of memory");
+    }
+
+  if (!dbus_message_iter_close_container (iter, &dict_iter))
+    _dbus_assert_not_reached ("out of memory");
+}
+
+static void
+check_dict_value (DBusMessageIter *dict_iter,
+                  const char      *key,
+                  int              expected)
+{
+  DBusMessageIter value_iter, variant_iter;
+  dbus_uint32_t v_UINT32;
+
+  if (expected < 0)
+    {
+      _dbus_assert (!dbus_message_iter_find_dict_value (dict_iter, key, &value_iter));
+      return;
+    }
+
+  _dbus_assert (dbus_message_iter_find_dict_value (dict_iter, key, &value_iter));
+  _dbus_assert (dbus_message_iter_get_arg_type (&value_iter) == DBUS_TYPE_VARIANT);
+  dbus_message_iter_recurse (&value_iter, &variant_iter);
+  dbus_message_iter_get_basic (&variant_iter, &v_UINT32);
+  _dbus_assert (v_UINT32 == (dbus_uint32_t) expected);
+  _dbus_assert (!dbus_message_iter_next (&value_iter));
+}
+
+/* Values in string-keyed dictionaries can be found without iterating */
+static void
+check_find_dict_value (void)
+{
+  DBusMessage *message;
+  DBusMessageIter iter, small_iter, large_iter;
+  int i;
+
+  message = dbus_message_new_method_call ("o.b.c", "/o/b/c", "o.b.c", "Method");
+  if (message == NULL)
+    _dbus_assert_not_reached ("out of memory");
+
+  dbus_message_iter_init_append (message, &iter);
+  append_test_dict (&iter, 3);
+  append_test_dict (&iter, 50);
+
+  if (!dbus_message_iter_init (message, &small_iter))
+    _dbus_assert_not_reached ("no arguments");
+  large_iter = small_iter;
+  dbus_message_iter_next (&large_iter);
+
+  /* The small dictionary is just searched */
+  check_dict_value (&small_iter, "key2", 2);
+  check_dict_value (&small_iter, "key0", 0);
+  check_dict_value (&small_iter, "key3", -1);
+  _dbus_assert (message->dict_indexes == NULL);
+
+  /* The large one gets an index, which is kept */
+  for (i = 49; i >= 0; i--)
+    {
+      char key[32];
+
+      sprintf (key, "key%d", i);
+      check_dict_value (&large_iter, key, i);
+    }
+  check_dict_value (&large_iter, "key50", -1);
+  check_dict_value (&large_iter, "", -1);
+  _dbus_assert (message->dict_indexes != NULL);
+  _dbus_assert (_dbus_hash_table_get_n_entries (message->dict_indexes) == 1);
+
+  /* Appending drops it */
+  dbus_message_iter_init_append (message, &iter);
+  _dbus_assert (message->dict_indexes == NULL);
+  check_dict_value (&large_iter, "key7", 7);
+  _dbus_assert (message->dict_indexes != NULL);
+
+  dbus_message_unref (message);
+}
+
+static void
+append_basic_args_slowly (DBusMessage *message,
+                          int          first_arg_type,
+                          ...)
+{
+  DBusMessageIter iter;
+  va_list var_args;
+  int type;
+
+  dbus_message_iter_init_append (message, &iter);
+
+  va_start (var_args, first_arg_type);
+  for (type = first_arg_type;
+       type != DBUS_TYPE_INVALID;
+       type = va_arg (var_args, int))
+    {
+      if (!dbus_message_iter_append_basic (&iter, type,
+                                           va_arg (var_args, const void *)))
+        _dbus_assert_not_reached ("out of memory");
+    }
+  va_end (var_args);
+}
+
+static void
+check_basic_append_args (void)
+{
+  DBusMessage *fast, *slow;
+  unsigned char v_BYTE = 0xfe, r_BYTE;
+  dbus_bool_t v_BOOLEAN = TRUE, r_BOOLEAN;
+  dbus_int16_t v_INT16 = -2, r_INT16;
+  dbus_uint32_t v_UINT32 = 0xdeadbeef, r_UINT32;
+  dbus_int64_t v_INT64 = -5, r_INT64;
+  double v_DOUBLE = 3.25, r_DOUBLE;
+  const char *v_STRING = "Hello", *r_STRING;
+  const char *v_OBJECT_PATH = "/a/b", *r_OBJECT_PATH;
+  const char *v_SIGNATURE = "a{sv}", *r_SIGNATURE;
+  const char *v_EMPTY = "", *r_EMPTY;
+  DBusError error = DBUS_ERROR_INIT;
+
+  fast = dbus_message_new_method_call ("o.b.c", "/o/b/c", "o.b.c", "Method");
+  slow = dbus_message_new_method_call ("o.b.c", "/o/b/c", "o.b.c", "Method");
+  if (fast == NULL || slow == NULL)
+    _dbus_assert_not_reached ("out of memory");
+
+  /* Every basic type, then more onto the end of an existing body so
+   * that the alignment doesn't start out at zero */
+  if (!dbus_message_append_args (fast,
+                                 DBUS_TYPE_BYTE, &v_BYTE,
+                                 DBUS_TYPE_INT16, &v_INT16,
+                                 DBUS_TYPE_STRING, &v_STRING,
+                                 DBUS_TYPE_INT64, &v_INT64,
+                                 DBUS_TYPE_SIGNATURE, &v_SIGNATURE,
+                                 DBUS_TYPE_BOOLEAN, &v_BOOLEAN,
+                                 DBUS_TYPE_INVALID) ||
+      !dbus_message_append_args (fast,
+                                 DBUS_TYPE_BYTE, &v_BYTE,
+                                 DBUS_TYPE_DOUBLE, &v_DOUBLE,
+                                 DBUS_TYPE_OBJECT_PATH, &v_OBJECT_PATH,
+                                 DBUS_TYPE_STRING, &v_EMPTY,
+                                 DBUS_TYPE_UINT32, &v_UINT32,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("out of memory");
+
+  append_basic_args_slowly (slow,
+                            DBUS_TYPE_BYTE, &v_BYTE,
+                            DBUS_TYPE_INT16, &v_INT16,
+                            DBUS_TYPE_STRING, &v_STRING,
+                            DBUS_TYPE_INT64, &v_INT64,
+                            DBUS_TYPE_SIGNATURE, &v_SIGNATURE,
+                            DBUS_TYPE_BOOLEAN, &v_BOOLEAN,
+                            DBUS_TYPE_INVALID);
+  append_basic_args_slowly (slow,
+                            DBUS_TYPE_BYTE, &v_BYTE,
+                            DBUS_TYPE_DOUBLE, &v_DOUBLE,
+                            DBUS_TYPE_OBJECT_PATH, &v_OBJECT_PATH,
+                            DBUS_TYPE_STRING, &v_EMPTY,
+                            DBUS_TYPE_UINT32, &v_UINT32,
+                            DBUS_TYPE_INVALID);
+
+  _dbus_assert (strcmp (dbus_message_get_signature (fast), "ynsxgbydosu") == 0);
+  _dbus_assert (strcmp (dbus_message_get_signature (fast),
+                        dbus_message_get_signature (slow)) == 0);
+  _dbus_assert (_dbus_string_equal (&fast->body, &slow->body));
+
+  if (!dbus_message_get_args (fast, &error,
+                              DBUS_TYPE_BYTE, &r_BYTE,
+                              DBUS_TYPE_INT16, &r_INT16,
+                              DBUS_TYPE_STRING, &r_STRING,
+                              DBUS_TYPE_INT64, &r_INT64,
+                              DBUS_TYPE_SIGNATURE, &r_SIGNATURE,
+                              DBUS_TYPE_BOOLEAN, &r_BOOLEAN,
+                              DBUS_TYPE_BYTE, &r_BYTE,
+                              DBUS_TYPE_DOUBLE, &r_DOUBLE,
+                              DBUS_TYPE_OBJECT_PATH, &r_OBJECT_PATH,
+                              DBUS_TYPE_STRING, &r_EMPTY,
+                              DBUS_TYPE_UINT32, &r_UINT32,
+                              DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached (error.message);
+
+  _dbus_assert (r_BYTE == v_BYTE);
+  _dbus_assert (r_INT16 == v_INT16);
+  _dbus_assert (strcmp (r_STRING, v_STRING) == 0);
+  _dbus_assert (r_INT64 == v_INT64);
+  _dbus_assert (strcmp (r_SIGNATURE, v_SIGNATURE) == 0);
+  _dbus_assert (r_BOOLEAN == v_BOOLEAN);
+  _dbus_assert (_DBUS_DOUBLES_BITWISE_EQUAL (r_DOUBLE, v_DOUBLE));
+  _dbus_assert (strcmp (r_OBJECT_PATH, v_OBJECT_PATH) == 0);
+  _dbus_assert (strcmp (r_EMPTY, v_EMPTY) == 0);
+  _dbus_assert (r_UINT32 == v_UINT32);
+
+  /* Asking for more arguments than there are is still caught */
+  if (dbus_message_get_args (fast, &error,
+                             DBUS_TYPE_BYTE, &r_BYTE,
+                             DBUS_TYPE_INT16, &r_INT16,
+                             DBUS_TYPE_STRING, &r_STRING,
+                             DBUS_TYPE_INT64, &r_INT64,
+                             DBUS_TYPE_SIGNATURE, &r_SIGNATURE,
+                             DBUS_TYPE_BOOLEAN, &r_BOOLEAN,
+                             DBUS_TYPE_BYTE, &r_BYTE,
+                             DBUS_TYPE_DOUBLE, &r_DOUBLE,
+                             DBUS_TYPE_OBJECT_PATH, &r_OBJECT_PATH,
+                             DBUS_TYPE_STRING, &r_EMPTY,
+                             DBUS_TYPE_UINT32, &r_UINT32,
+                             DBUS_TYPE_UINT32, &r_UINT32,
+                             DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("got more arguments than there are");
+  _dbus_assert (dbus_error_has_name (&error, DBUS_ERROR_INVALID_ARGS));
+  dbus_error_free (&error);
+
+  dbus_message_unref (fast);
+  dbus_message_unref (slow);
+}
+
 /**
  * @ingroup DBusMessageInternals
  * Unit test for DBusMessage.
@@ -1239,6 +2670,40 @@ _dbus_message_test (const char *test_data_dir)
   _dbus_assert (dbus_message_has_sender (message, "org.foo.bar1"));
   dbus_message_set_reply_serial (message, 5678);
 
+  /* Changing the sender's length moves the reply serial after it */
+  {
+    const char *senders[] = { ":1.5", ":1.50", "org.foo.bar1",
+                              ":1.23456789012345", ":1.5" };
+    unsigned int j;
+
+    for (j = 0; j < _DBUS_N_ELEMENTS (senders); j++)
+      {
+        DBusMessage *reloaded;
+        char *marshalled;
+        int marshalled_len;
+
+        if (!dbus_message_set_sender (message, senders[j]))
+          _dbus_assert_not_reached ("out of memory");
+
+        _dbus_assert (dbus_message_has_sender (message, senders[j]));
+        _dbus_assert (dbus_message_get_reply_serial (message) == 5678);
+        _dbus_assert (dbus_message_has_destination (message, "org.freedesktop.DBus.TestService"));
+
+        if (!dbus_message_marshal (message, &marshalled, &marshalled_len))
+          _dbus_assert_not_reached ("out of memory");
+
+        reloaded = dbus_message_demarshal (marshalled, marshalled_len, NULL);
+        _dbus_assert (reloaded != NULL);
+        _dbus_assert (dbus_message_has_sender (reloaded, senders[j]));
+        _dbus_assert (dbus_message_get_reply_serial (reloaded) == 5678);
+        _dbus_assert (dbus_message_is_method_call (reloaded, "Foo.TestInterface",
+                                                   "TestMethod"));
+
+        dbus_message_unref (reloaded);
+        dbus_free (marshalled);
+      }
+  }
+
   _dbus_verbose_bytes_of_string (&message->header.data, 0,
                                  _dbus_string_get_length (&message->header.data));
   _dbus_verbose_bytes_of_string (&message->body, 0,
@@ -1315,6 +2780,14 @@ _dbus_message_test (const char *test_data_dir)
   _dbus_assert (strcmp (dbus_message_get_member (message),
                         "Bar") == 0);
 
+  /* Fields around the ones that were resized must still be found */
+  _dbus_assert (dbus_message_has_destination (message, "org.freedesktop.DBus.TestService"));
+  _dbus_assert (dbus_message_get_reply_serial (message) == 5678);
+  _dbus_assert (strcmp (dbus_message_get_path (message),
+                        "/foo") == 0);
+  _dbus_assert (strcmp (dbus_message_get_interface (message),
+                        "org.Foo") == 0);
+
   /* Path decomposing */
   dbus_message_set_path (message, NULL);
   dbus_message_get_path_decomposed (message, &decomposed);
@@ -1343,6 +2816,13 @@ _dbus_message_test (const char *test_data_dir)
   _dbus_assert (decomposed[2] == NULL);
   dbus_free_string_array (decomposed);
 
+  /* The path was deleted and appended again after the other fields */
+  _dbus_assert (strcmp (dbus_message_get_member (message),
+                        "Bar") == 0);
+  _dbus_assert (strcmp (dbus_message_get_interface (message),
+                        "org.Foo") == 0);
+  _dbus_assert (dbus_message_has_destination (message, "org.freedesktop.DBus.TestService"));
+
   dbus_message_unref (message);
 
   /* Test the vararg functions */
@@ -1503,6 +2983,16 @@ _dbus_message_test (const char *test_data_dir)
       _dbus_message_loader_return_buffer (loader, buffer);
     }
 
+  /* With the whole header in, the loader knows how much more to expect
+   * and asks for it in reads no bigger than what it already has */
+  if (!_dbus_message_loader_queue_messages (loader))
+    _dbus_assert_not_reached ("no memory to queue messages");
+
+  _dbus_assert (_dbus_string_get_length (&message->body) > 1);
+  _dbus_assert (_dbus_message_loader_get_max_to_read (loader, 1) ==
+                MIN (_dbus_string_get_length (&message->body),
+                     _dbus_string_get_length (&message->header.data)));
+
   /* Write the body data one byte at a time */
   data = _dbus_string_get_const_data (&message->body);
   for (i = 0; i < _dbus_string_get_length (&message->body); i++)
@@ -1608,6 +3098,123 @@ _dbus_message_test (const char *test_data_dir)
   _dbus_check_fdleaks_leave (initial_fds);
   initial_fds = _dbus_check_fdleaks_enter ();
 
+  check_large_body_loading ();
+  check_deferred_body_validation ();
+  check_memleaks ();
+
+  check_message_cache_limits ();
+  check_memleaks ();
+
+  check_borrowed_fixed_array ();
+  check_shared_copy_body ();
+  check_marshal_borrowed ();
+  check_body_pool ();
+  check_header_name_cache ();
+  check_memleaks ();
+
+  check_struct_array ();
+  check_memleaks ();
+
+  check_array_counts ();
+  check_memleaks ();
+
+  check_find_dict_value ();
+  check_memleaks ();
+
+  check_basic_append_args ();
+  check_memleaks ();
+
+  /* Reserving room avoids reallocating the body while it's built */
+  {
+    DBusMessageIter iter, sub;
+    const char *body_data;
+    const char *sig = "a(id)";
+    dbus_int32_t v_i = 7;
+    double v_d = 0.5;
+    int n_bytes;
+
+    message = dbus_message_new_signal ("/a", "com.example.Reserved", "Blob");
+    _dbus_assert (message != NULL);
+
+    n_bytes = dbus_signature_estimate_size (sig, 1000, 0);
+    if (!dbus_message_reserve_body (message, n_bytes))
+      _dbus_assert_not_reached ("no memory");
+    body_data = _dbus_string_get_const_data (&message->body);
+
+    dbus_message_iter_init_append (message, &iter);
+    if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(id)", &sub))
+      _dbus_assert_not_reached ("no memory");
+
+    for (i = 0; i < 1000; i++)
+      {
+        DBusMessageIter entry;
+
+        if (!dbus_message_iter_open_container (&sub, DBUS_TYPE_STRUCT, NULL, &entry) ||
+            !dbus_message_iter_append_basic (&entry, DBUS_TYPE_INT32, &v_i) ||
+            !dbus_message_iter_append_basic (&entry, DBUS_TYPE_DOUBLE, &v_d) ||
+            !dbus_message_iter_close_container (&sub, &entry))
+          _dbus_assert_not_reached ("no memory");
+      }
+
+    if (!dbus_message_iter_close_container (&iter, &sub))
+      _dbus_assert_not_reached ("no memory");
+
+    _dbus_assert (_dbus_string_get_length (&message->body) == n_bytes);
+    _dbus_assert (_dbus_string_get_const_data (&message->body) == body_data);
+
+    dbus_message_unref (message);
+  }
+
+  /* A message made from a template is the same as one made from scratch */
+  {
+    DBusMessage *template, *from_scratch;
+    const DBusString *header, *body;
+    const DBusString *scratch_header, *scratch_body;
+    const char *v_s = "hello";
+
+    template = dbus_message_new_signal ("/a/b", "com.example.Templated", "Changed");
+    _dbus_assert (template != NULL);
+    if (!dbus_message_set_destination (template, ":1.5") ||
+        !dbus_message_append_args (template, DBUS_TYPE_UINT32, &v_UINT32,
+                                   DBUS_TYPE_INVALID))
+      _dbus_assert_not_reached ("no memory");
+    dbus_message_set_serial (template, 77);
+
+    for (i = 0; i < 3; i++)
+      {
+        message = dbus_message_new_from_template (template);
+        from_scratch = dbus_message_new_signal ("/a/b", "com.example.Templated",
+                                                "Changed");
+        _dbus_assert (message != NULL && from_scratch != NULL);
+
+        _dbus_assert (dbus_message_get_serial (message) == 0);
+        _dbus_assert (strcmp (dbus_message_get_signature (message), "") == 0);
+        _dbus_assert (strcmp (dbus_message_get_destination (message), ":1.5") == 0);
+
+        if (!dbus_message_set_destination (from_scratch, ":1.5") ||
+            !dbus_message_append_args (message, DBUS_TYPE_STRING, &v_s,
+                                       DBUS_TYPE_INVALID) ||
+            !dbus_message_append_args (from_scratch, DBUS_TYPE_STRING, &v_s,
+                                       DBUS_TYPE_INVALID))
+          _dbus_assert_not_reached ("no memory");
+
+        dbus_message_set_serial (message, i + 1);
+        dbus_message_set_serial (from_scratch, i + 1);
+        dbus_message_lock (message);
+        dbus_message_lock (from_scratch);
+
+        _dbus_message_get_network_data (message, &header, &body);
+        _dbus_message_get_network_data (from_scratch, &scratch_header, &scratch_body);
+        _dbus_assert (_dbus_string_equal (header, scratch_header));
+        _dbus_assert (_dbus_string_equal (body, scratch_body));
+
+        dbus_message_unref (message);
+        dbus_message_unref (from_scratch);
+      }
+
+    dbus_message_unref (template);
+  }
+
   /* Test enumeration of array elements */
   for (i = strlen (basic_types) - 1; i > 0; i--)
     {
@@ -1732,6 +3339,69 @@ _dbus_message_test (const char *test_data_dir)
 
   dbus_message_unref (message);
 
+#ifdef HAVE_UNIX_FD_PASSING
+  /* Sealed bytes round-trip through a memfd, and an ordinary fd is refused */
+  {
+    DBusError error = DBUS_ERROR_INIT;
+    DBusMessageIter iter;
+    char *payload;
+    const void *mapped;
+    int n_mapped;
+    int n_payload = 65536 + 7;
+
+    payload = dbus_malloc (n_payload);
+    _dbus_assert (payload != NULL);
+
+    for (i = 0; i < n_payload; i++)
+      payload[i] = i * 7;
+
+    message = dbus_message_new_method_call ("org.freedesktop.DBus.TestService",
+                                            "/org/freedesktop/TestPath",
+                                            "Foo.TestInterface",
+                                            "Method");
+    _dbus_assert (message != NULL);
+
+    dbus_message_iter_init_append (message, &iter);
+
+    if (!dbus_message_iter_append_sealed_bytes (&iter, payload, n_payload,
+                                                &error))
+      {
+        _dbus_assert (dbus_error_has_name (&error, DBUS_ERROR_NOT_SUPPORTED));
+        _dbus_verbose ("Sealed bytes not supported: %s\n", error.message);
+        dbus_error_free (&error);
+      }
+    else
+      {
+        _dbus_assert (dbus_message_iter_append_sealed_bytes (&iter, payload, 0,
+                                                             &error));
+        _dbus_assert (dbus_message_append_args (message,
+                                                DBUS_TYPE_UNIX_FD, &v_UNIX_FD,
+                                                DBUS_TYPE_INVALID));
+        _dbus_assert (dbus_message_has_signature (message, "hhh"));
+
+        dbus_message_iter_init (message, &iter);
+        _dbus_assert (dbus_message_iter_get_sealed_bytes (&iter, &mapped,
+                                                          &n_mapped, &error));
+        _dbus_assert (n_mapped == n_payload);
+        _dbus_assert (memcmp (mapped, payload, n_payload) == 0);
+
+        _dbus_assert (dbus_message_iter_next (&iter));
+        _dbus_assert (dbus_message_iter_get_sealed_bytes (&iter, &mapped,
+                                                          &n_mapped, &error));
+        _dbus_assert (n_mapped == 0);
+
+        _dbus_assert (dbus_message_iter_next (&iter));
+        _dbus_assert (!dbus_message_iter_get_sealed_bytes (&iter, &mapped,
+                                                           &n_mapped, &error));
+        _dbus_assert (dbus_error_has_name (&error, DBUS_ERROR_INVALID_ARGS));
+        dbus_error_free (&error);
+      }
+
+    dbus_message_unref (message);
+    dbus_free (payload);
+  }
+#endif
+
   /* Load all the sample messages from the message factory */
   {
     DBusMessageDataIter diter;
@@ -36,6 +36,7 @@
 #include "dbus-threads-internal.h"
 #ifdef HAVE_UNIX_FD_PASSING
 #include "dbus-sysdeps.h"
+#include "dbus-trace.h"
 #include "dbus-sysdeps-unix.h"
 #endif
 
@@ -215,6 +216,249 @@ _dbus_message_get_network_data (DBusMessage          *message,
   *body = &message->body;
 }
 
+/**
+ * Gets the bytes to be sent right after the body for this message,
+ * if an array was appended with
+ * dbus_message_iter_append_fixed_array_borrowed() and is still
+ * borrowed from the application. Like the rest of the network data,
+ * this stays the same once a message is locked.
+ *
+ * @param message the message.
+ * @returns the bytes following the body, or #NULL if there are none
+ */
+const DBusString *
+_dbus_message_get_network_tail (DBusMessage *message)
+{
+  _dbus_assert (message->locked);
+
+  return message->has_tail ? &message->tail : NULL;
+}
+
+static int
+get_body_length (const DBusMessage *message)
+{
+  int len;
+
+  len = _dbus_string_get_length (&message->body);
+
+  if (message->has_tail)
+    len += _dbus_string_get_length (&message->tail);
+
+  return len;
+}
+
+/* Drops the indexes built by dbus_message_iter_find_dict_value() */
+static void
+clear_dict_indexes (DBusMessage *message)
+{
+  if (message->dict_indexes != NULL)
+    {
+      _dbus_hash_table_unref (message->dict_indexes);
+      message->dict_indexes = NULL;
+    }
+}
+
+/* Gives a borrowed tail back to the application. */
+static void
+release_tail (DBusMessage *message)
+{
+  DBusFreeFunction free_func;
+  void *data;
+
+  if (!message->has_tail)
+    return;
+
+  free_func = message->tail_free_func;
+  data = message->tail_data;
+
+  message->has_tail = FALSE;
+  message->tail_copied = FALSE;
+  message->tail_unreserved = FALSE;
+  message->tail_free_func = NULL;
+  message->tail_data = NULL;
+
+  if (free_func != NULL)
+    (* free_func) (data);
+}
+
+/* Copies a borrowed tail into the body, which has to happen before
+ * anything else is written to the message. A borrowed array reserved
+ * room for it when it was attached, so that can't fail; the body
+ * shared by dbus_message_copy() has no room reserved, and copying it
+ * in can run out of memory.
+ */
+static dbus_bool_t
+flatten_tail (DBusMessage *message)
+{
+  if (!message->has_tail)
+    return TRUE;
+
+  _dbus_assert (!message->locked);
+
+  if (!_dbus_string_copy (&message->tail, 0, &message->body,
+                          _dbus_string_get_length (&message->body)))
+    return FALSE;
+
+  release_tail (message);
+  return TRUE;
+}
+
+/* Gets the whole body for reading. While the message is locked its
+ * network data must not change, so rather than moving the tail into
+ * the body, a copy of it goes into the room reserved after the body
+ * and readers get a read-only view of both.
+ */
+static const DBusString *
+get_body_for_reading (DBusMessage *message)
+{
+  char *data;
+  int body_len;
+  int tail_len;
+
+  if (!message->has_tail)
+    return &message->body;
+
+  /* A shared body is all tail, and can be read where it is */
+  if (message->tail_unreserved)
+    {
+      _dbus_assert (_dbus_string_get_length (&message->body) == 0);
+      return &message->tail;
+    }
+
+  if (!message->locked)
+    {
+      if (!flatten_tail (message))
+        _dbus_assert_not_reached ("room for the tail was reserved");
+
+      return &message->body;
+    }
+
+  if (!message->tail_copied)
+    {
+      body_len = _dbus_string_get_length (&message->body);
+      tail_len = _dbus_string_get_length (&message->tail);
+      data = _dbus_string_get_data (&message->body);
+
+      memcpy (data + body_len, _dbus_string_get_const_data (&message->tail),
+              tail_len);
+      _dbus_string_init_const_len (&message->flat_body, data,
+                                   body_len + tail_len);
+      message->tail_copied = TRUE;
+    }
+
+  return &message->flat_body;
+}
+
+/**
+ * Gets the size of the message's header and body. Once the message is
+ * locked (with dbus_message_lock()), this is its size on the network.
+ *
+ * @param message the message.
+ * @returns size in bytes
+ */
+int
+_dbus_message_get_size (DBusMessage *message)
+{
+  return _dbus_string_get_length (&message->header.data) +
+    get_body_length (message);
+}
+
+/**
+ * Creates a new message with a copy of the given message's header but
+ * no body and no unix fds. The signature and unix fd count header
+ * fields are dropped, since they describe the omitted body, and
+ * everything else, including the serial, is kept.
+ *
+ * @param message the message to copy
+ * @returns the new message, or #NULL if not enough memory
+ */
+DBusMessage *
+_dbus_message_copy_header_only (DBusMessage *message)
+{
+  DBusMessage *retval;
+
+  retval = dbus_new0 (DBusMessage, 1);
+  if (retval == NULL)
+    return NULL;
+
+  _dbus_atomic_inc (&retval->refcount);
+
+  retval->locked = FALSE;
+#ifndef DBUS_DISABLE_CHECKS
+  retval->generation = message->generation;
+#endif
+
+  if (!_dbus_header_copy (&message->header, &retval->header))
+    {
+      dbus_free (retval);
+      return NULL;
+    }
+
+  if (!_dbus_string_init (&retval->body))
+    {
+      _dbus_header_free (&retval->header);
+      dbus_free (retval);
+      return NULL;
+    }
+
+  if (!_dbus_header_delete_field (&retval->header,
+                                  DBUS_HEADER_FIELD_SIGNATURE) ||
+      !_dbus_header_delete_field (&retval->header,
+                                  DBUS_HEADER_FIELD_UNIX_FDS))
+    {
+      _dbus_header_free (&retval->header);
+      _dbus_string_free (&retval->body);
+      dbus_free (retval);
+      return NULL;
+    }
+
+  _dbus_header_update_lengths (&retval->header, 0);
+
+  _dbus_message_trace_ref (retval, 0, 1, "copy_header_only");
+  return retval;
+}
+
+/**
+ * Validates a body that the loader left unvalidated, see
+ * _dbus_message_loader_set_deferred_validation_size(). Nothing may
+ * read the body of such a message until this has returned
+ * #DBUS_VALID; after that, and for any other message, it returns
+ * #DBUS_VALID at once.
+ *
+ * @param message the message
+ * @returns #DBUS_VALID or the reason the body is invalid
+ */
+DBusValidity
+_dbus_message_validate_deferred_body (DBusMessage *message)
+{
+  const DBusString *type_str;
+  int type_pos;
+  const DBusString *body;
+  DBusValidity validity;
+  DBusPhase old_phase;
+
+  if (!message->body_unvalidated)
+    return DBUS_VALID;
+
+  get_const_signature (&message->header, &type_str, &type_pos);
+  body = get_body_for_reading (message);
+
+  old_phase = _dbus_phase_enter (DBUS_PHASE_BODY_VALIDATION);
+  validity = _dbus_validate_body_counting_arrays (type_str,
+                                                  type_pos,
+                                                  _dbus_header_get_byte_order (&message->header),
+                                                  body,
+                                                  0,
+                                                  _dbus_string_get_length (body),
+                                                  &message->array_counts);
+  _dbus_phase_leave (old_phase);
+
+  if (validity == DBUS_VALID)
+    message->body_unvalidated = FALSE;
+
+  return validity;
+}
+
 /**
  * Gets the unix fds to be sent over the network for this message.
  * This function is guaranteed to always return the same data once a
@@ -288,9 +532,7 @@ _dbus_message_add_counter_link (DBusMessage  *message,
    */
   if (message->counters == NULL)
     {
-      message->size_counter_delta =
-        _dbus_string_get_length (&message->header.data) +
-        _dbus_string_get_length (&message->body);
+      message->size_counter_delta = _dbus_message_get_size (message);
 
 #ifdef HAVE_UNIX_FD_PASSING
       message->unix_fd_counter_delta = message->n_unix_fds;
@@ -386,10 +628,10 @@ dbus_message_lock (DBusMessage  *message)
   if (!message->locked)
     {
       _dbus_header_update_lengths (&message->header,
-                                   _dbus_string_get_length (&message->body));
+                                   get_body_length (message));
 
       /* must have a signature if you have a body */
-      _dbus_assert (_dbus_string_get_length (&message->body) == 0 ||
+      _dbus_assert (get_body_length (message) == 0 ||
                     dbus_message_get_signature (message) != NULL);
 
       message->locked = TRUE;
@@ -445,7 +687,7 @@ _dbus_message_set_signature (DBusMessage *message,
   _dbus_return_val_if_fail (signature == NULL ||
                             _dbus_check_is_valid_signature (signature));
   /* can't delete the signature if you have a message body */
-  _dbus_return_val_if_fail (_dbus_string_get_length (&message->body) == 0 ||
+  _dbus_return_val_if_fail (get_body_length (message) == 0 ||
                             signature != NULL);
 
   return set_or_delete_string_field (message,
@@ -501,41 +743,356 @@ _dbus_message_set_signature (DBusMessage *message,
  * mempool).
  */
 
-/** Avoid caching huge messages */
-#define MAX_MESSAGE_SIZE_TO_CACHE 10 * _DBUS_ONE_KILOBYTE
+/** Default for the largest message we will cache */
+#define DEFAULT_MAX_MESSAGE_SIZE_TO_CACHE (10 * _DBUS_ONE_KILOBYTE)
+
+/** Default for how many messages we will cache */
+#define DEFAULT_MAX_MESSAGE_CACHE_SIZE    5
 
-/** Avoid caching too many messages */
-#define MAX_MESSAGE_CACHE_SIZE    5
+/** Upper bound on the configurable cache depth */
+#define MAX_MESSAGE_CACHE_SIZE            64
 
-/* Protected by _DBUS_LOCK (message_cache) */
+/* Protected by _DBUS_LOCK (message_cache). The cache is a stack:
+ * message_cache[0 .. message_cache_count - 1] are the cached messages,
+ * and the most recently freed one (the one most likely to still be
+ * in the CPU cache) is handed out first.
+ */
 static DBusMessage *message_cache[MAX_MESSAGE_CACHE_SIZE];
 static int message_cache_count = 0;
 static dbus_bool_t message_cache_shutdown_registered = FALSE;
+static int message_cache_max_count = DEFAULT_MAX_MESSAGE_CACHE_SIZE;
+static int message_cache_max_size = DEFAULT_MAX_MESSAGE_SIZE_TO_CACHE;
+#ifdef DBUS_ENABLE_STATS
+static dbus_uint32_t message_cache_hits = 0;
+static dbus_uint32_t message_cache_misses = 0;
+#endif
 
 static void
 dbus_message_cache_shutdown (void *data)
 {
-  int i;
-
   if (!_DBUS_LOCK (message_cache))
     _dbus_assert_not_reached ("we would have initialized global locks "
         "before registering a shutdown function");
 
-  i = 0;
-  while (i < MAX_MESSAGE_CACHE_SIZE)
+  while (message_cache_count > 0)
     {
-      if (message_cache[i])
-        dbus_message_finalize (message_cache[i]);
-
-      ++i;
+      message_cache_count -= 1;
+      dbus_message_finalize (message_cache[message_cache_count]);
+      message_cache[message_cache_count] = NULL;
     }
 
-  message_cache_count = 0;
   message_cache_shutdown_registered = FALSE;
+  message_cache_max_count = DEFAULT_MAX_MESSAGE_CACHE_SIZE;
+  message_cache_max_size = DEFAULT_MAX_MESSAGE_SIZE_TO_CACHE;
+#ifdef DBUS_ENABLE_STATS
+  message_cache_hits = 0;
+  message_cache_misses = 0;
+#endif
+
+  _DBUS_UNLOCK (message_cache);
+}
+
+/**
+ * Sets how many freed messages are kept around for reuse, and the
+ * largest message (header plus body, in bytes) that qualifies.
+ * max_messages is clamped to the size of the cache array; 0 disables
+ * the cache. Messages already cached beyond the new limits are
+ * finalized.
+ *
+ * @param max_messages maximum number of cached messages
+ * @param max_size maximum size of a cached message
+ */
+void
+_dbus_message_set_cache_limits (int max_messages,
+                                int max_size)
+{
+  _dbus_assert (max_messages >= 0);
+  _dbus_assert (max_size >= 0);
+
+  if (max_messages > MAX_MESSAGE_CACHE_SIZE)
+    max_messages = MAX_MESSAGE_CACHE_SIZE;
+
+  if (!_DBUS_LOCK (message_cache))
+    return;
+
+  message_cache_max_count = max_messages;
+  message_cache_max_size = max_size;
+
+  while (message_cache_count > message_cache_max_count)
+    {
+      message_cache_count -= 1;
+      dbus_message_finalize (message_cache[message_cache_count]);
+      message_cache[message_cache_count] = NULL;
+    }
 
   _DBUS_UNLOCK (message_cache);
 }
 
+#ifdef DBUS_ENABLE_STATS
+/**
+ * Gets statistics about the message cache: how many new messages
+ * were served from the cache, how many had to be allocated, and how
+ * many messages are currently cached.
+ *
+ * @param hits_p return location for the number of cache hits
+ * @param misses_p return location for the number of cache misses
+ * @param cached_p return location for the number of cached messages
+ */
+void
+_dbus_message_get_cache_stats (dbus_uint32_t *hits_p,
+                               dbus_uint32_t *misses_p,
+                               dbus_uint32_t *cached_p)
+{
+  if (!_DBUS_LOCK (message_cache))
+    {
+      *hits_p = 0;
+      *misses_p = 0;
+      *cached_p = 0;
+      return;
+    }
+
+  *hits_p = message_cache_hits;
+  *misses_p = message_cache_misses;
+  *cached_p = message_cache_count;
+  _DBUS_UNLOCK (message_cache);
+}
+#endif
+
+/*
+ * Bodies of received messages that need at least BODY_POOL_MIN_SIZE
+ * bytes come from a pool of buffers in power-of-two size classes,
+ * allocated with _dbus_alloc_large_pages() so that they can be backed
+ * by huge pages, and kept for the next large message rather than
+ * given back to the system, so that a stream of multi-megabyte
+ * messages doesn't fault in fresh pages for each one. The message
+ * cache doesn't help there, since it only keeps small messages.
+ */
+
+/** Smallest buffer the body pool hands out */
+#define BODY_POOL_MIN_SIZE (1024 * 1024)
+
+/** Number of size classes, enough for the largest possible message */
+#define BODY_POOL_N_CLASSES 8
+
+_DBUS_STATIC_ASSERT (((size_t) BODY_POOL_MIN_SIZE << (BODY_POOL_N_CLASSES - 1)) >=
+                     DBUS_MAXIMUM_MESSAGE_LENGTH);
+
+/** Most bytes kept in free buffers for reuse */
+#define BODY_POOL_MAX_CACHED_BYTES (32 * 1024 * 1024)
+
+/* Protected by _DBUS_LOCK (body_pool). Free buffers of each class are
+ * kept in a list threaded through their first bytes. */
+static void *body_pool_free[BODY_POOL_N_CLASSES];
+static size_t body_pool_cached_bytes = 0;
+static size_t body_pool_used_bytes = 0;
+static dbus_bool_t body_pool_shutdown_registered = FALSE;
+#ifdef DBUS_ENABLE_STATS
+static dbus_uint32_t body_pool_hits = 0;
+static dbus_uint32_t body_pool_misses = 0;
+#endif
+
+static size_t
+body_pool_class_size (int size_class)
+{
+  return (size_t) BODY_POOL_MIN_SIZE << size_class;
+}
+
+static void
+body_pool_shutdown (void *data)
+{
+  int i;
+
+  if (!_DBUS_LOCK (body_pool))
+    _dbus_assert_not_reached ("we would have initialized global locks "
+        "before registering a shutdown function");
+
+  for (i = 0; i < BODY_POOL_N_CLASSES; i++)
+    {
+      while (body_pool_free[i] != NULL)
+        {
+          void *buffer = body_pool_free[i];
+
+          body_pool_free[i] = *(void **) buffer;
+          _dbus_free_large_pages (buffer, body_pool_class_size (i));
+        }
+    }
+
+  body_pool_cached_bytes = 0;
+  body_pool_shutdown_registered = FALSE;
+#ifdef DBUS_ENABLE_STATS
+  body_pool_hits = 0;
+  body_pool_misses = 0;
+#endif
+
+  _DBUS_UNLOCK (body_pool);
+}
+
+/* Gets a buffer of at least size bytes from the pool, or NULL if size
+ * is too small to be worth it or there is no memory */
+static void *
+body_pool_get (int  size,
+               int *size_class_p)
+{
+  void *buffer;
+  int size_class;
+
+  if (size < BODY_POOL_MIN_SIZE)
+    return NULL;
+
+  size_class = 0;
+
+  while (body_pool_class_size (size_class) < (size_t) size)
+    size_class++;
+
+  if (size_class >= BODY_POOL_N_CLASSES)
+    return NULL;
+
+  if (!_DBUS_LOCK (body_pool))
+    return NULL;
+
+  if (!body_pool_shutdown_registered)
+    {
+      if (!_dbus_register_shutdown_func (body_pool_shutdown, NULL))
+        {
+          _DBUS_UNLOCK (body_pool);
+          return NULL;
+        }
+
+      body_pool_shutdown_registered = TRUE;
+    }
+
+  buffer = body_pool_free[size_class];
+
+  if (buffer != NULL)
+    {
+      body_pool_free[size_class] = *(void **) buffer;
+      body_pool_cached_bytes -= body_pool_class_size (size_class);
+#ifdef DBUS_ENABLE_STATS
+      body_pool_hits += 1;
+#endif
+    }
+  else
+    {
+#ifdef DBUS_ENABLE_STATS
+      body_pool_misses += 1;
+#endif
+    }
+
+  _DBUS_UNLOCK (body_pool);
+
+  if (buffer == NULL)
+    buffer = _dbus_alloc_large_pages (body_pool_class_size (size_class));
+
+  if (buffer == NULL)
+    return NULL;
+
+  if (_DBUS_LOCK (body_pool))
+    {
+      body_pool_used_bytes += body_pool_class_size (size_class);
+      _DBUS_UNLOCK (body_pool);
+    }
+
+  *size_class_p = size_class;
+  return buffer;
+}
+
+/* Gives a buffer back to the pool, which keeps it if it has room */
+static void
+body_pool_put (void *buffer,
+               int   size_class)
+{
+  size_t size = body_pool_class_size (size_class);
+
+  if (_DBUS_LOCK (body_pool))
+    {
+      body_pool_used_bytes -= size;
+
+      if (body_pool_shutdown_registered &&
+          body_pool_cached_bytes + size <= BODY_POOL_MAX_CACHED_BYTES)
+        {
+          *(void **) buffer = body_pool_free[size_class];
+          body_pool_free[size_class] = buffer;
+          body_pool_cached_bytes += size;
+          buffer = NULL;
+        }
+
+      _DBUS_UNLOCK (body_pool);
+    }
+
+  _dbus_free_large_pages (buffer, size);
+}
+
+/* Puts the empty body of a new message on a pooled buffer, if it is
+ * going to be big enough for one; otherwise leaves it as it was */
+static void
+use_pooled_body (DBusMessage *message,
+                 int          body_len)
+{
+  void *buffer;
+  int size_class;
+
+  _dbus_assert (message->pooled_body == NULL);
+  _dbus_assert (_dbus_string_get_length (&message->body) == 0);
+
+  /* the nul and alignment padding have to fit too */
+  buffer = body_pool_get (body_len + 2 * _DBUS_STRING_ALLOCATION_PADDING,
+                          &size_class);
+
+  if (buffer == NULL)
+    return;
+
+  _dbus_string_free (&message->body);
+  _dbus_string_init_borrowed (&message->body, buffer,
+                              body_pool_class_size (size_class));
+  message->pooled_body = buffer;
+  message->pooled_body_class = size_class;
+}
+
+/* Gives the pooled buffer back, once body no longer uses it */
+static void
+release_pooled_body (DBusMessage *message)
+{
+  if (message->pooled_body == NULL)
+    return;
+
+  body_pool_put (message->pooled_body, message->pooled_body_class);
+  message->pooled_body = NULL;
+}
+
+#ifdef DBUS_ENABLE_STATS
+/**
+ * Gets statistics about the pool large message bodies come from: how
+ * many were served from buffers it kept, how many needed a new one,
+ * the bytes it keeps for later, and the bytes messages are using.
+ *
+ * @param hits_p return location for the number of reused buffers
+ * @param misses_p return location for the number of new buffers
+ * @param cached_bytes_p return location for the bytes kept for reuse
+ * @param used_bytes_p return location for the bytes in use
+ */
+void
+_dbus_message_get_body_pool_stats (dbus_uint32_t *hits_p,
+                                   dbus_uint32_t *misses_p,
+                                   dbus_uint32_t *cached_bytes_p,
+                                   dbus_uint32_t *used_bytes_p)
+{
+  if (!_DBUS_LOCK (body_pool))
+    {
+      *hits_p = 0;
+      *misses_p = 0;
+      *cached_bytes_p = 0;
+      *used_bytes_p = 0;
+      return;
+    }
+
+  *hits_p = body_pool_hits;
+  *misses_p = body_pool_misses;
+  *cached_bytes_p = body_pool_cached_bytes;
+  *used_bytes_p = body_pool_used_bytes;
+  _DBUS_UNLOCK (body_pool);
+}
+#endif
+
 /**
  * Tries to get a message from the message cache.  The retrieved
  * message will have junk in it, so it still needs to be cleared out
@@ -547,9 +1104,6 @@ static DBusMessage*
 dbus_message_get_cached (void)
 {
   DBusMessage *message;
-  int i;
-
-  message = NULL;
 
   if (!_DBUS_LOCK (message_cache))
     {
@@ -562,6 +1116,9 @@ dbus_message_get_cached (void)
 
   if (message_cache_count == 0)
     {
+#ifdef DBUS_ENABLE_STATS
+      message_cache_misses += 1;
+#endif
       _DBUS_UNLOCK (message_cache);
       return NULL;
     }
@@ -572,27 +1129,20 @@ dbus_message_get_cached (void)
    */
   _dbus_assert (message_cache_shutdown_registered);
 
-  i = 0;
-  while (i < MAX_MESSAGE_CACHE_SIZE)
-    {
-      if (message_cache[i])
-        {
-          message = message_cache[i];
-          message_cache[i] = NULL;
-          message_cache_count -= 1;
-          break;
-        }
-      ++i;
-    }
-  _dbus_assert (message_cache_count >= 0);
-  _dbus_assert (i < MAX_MESSAGE_CACHE_SIZE);
+  message_cache_count -= 1;
+  message = message_cache[message_cache_count];
+  message_cache[message_cache_count] = NULL;
+#ifdef DBUS_ENABLE_STATS
+  message_cache_hits += 1;
+#endif
+
   _dbus_assert (message != NULL);
 
+  _DBUS_UNLOCK (message_cache);
+
   _dbus_assert (_dbus_atomic_get (&message->refcount) == 0);
 
   _dbus_assert (message->counters == NULL);
-  
-  _DBUS_UNLOCK (message_cache);
 
   return message;
 }
@@ -622,6 +1172,25 @@ close_unix_fds(int *fds, unsigned *n_fds)
 
   /* We don't free the array here, in case we can recycle it later */
 }
+
+/** A mapping of a sealed memfd, owned by the message it was read from */
+typedef struct
+{
+  void *data;   /**< The mapped bytes */
+  size_t len;   /**< Length of the mapping */
+} SealedMapping;
+
+static void
+release_sealed_mappings (DBusMessage *message)
+{
+  SealedMapping *mapping;
+
+  while ((mapping = _dbus_list_pop_first (&message->sealed_mappings)) != NULL)
+    {
+      _dbus_memfd_unmap (mapping->data, mapping->len);
+      dbus_free (mapping);
+    }
+}
 #endif
 
 static void
@@ -649,7 +1218,7 @@ static void
 dbus_message_cache_or_finalize (DBusMessage *message)
 {
   dbus_bool_t was_cached;
-  int i;
+  dbus_bool_t had_tail;
 
   _dbus_assert (_dbus_atomic_get (&message->refcount) == 0);
 
@@ -658,16 +1227,33 @@ dbus_message_cache_or_finalize (DBusMessage *message)
    */
   _dbus_data_slot_list_clear (&message->slot_list);
 
+  /* So does giving a borrowed tail back */
+  had_tail = message->has_tail;
+  release_tail (message);
+
+  _dbus_array_counts_clear (&message->array_counts);
+  clear_dict_indexes (message);
+
   _dbus_list_foreach (&message->counters,
                       free_counter, message);
   _dbus_list_clear (&message->counters);
 
 #ifdef HAVE_UNIX_FD_PASSING
+  release_sealed_mappings (message);
   close_unix_fds(message->unix_fds, &message->n_unix_fds);
 #endif
 
   was_cached = FALSE;
 
+  /* The room reserved in the body for a tail isn't worth caching,
+   * and a pooled body is better off back in the pool */
+  if (!_dbus_enable_message_cache () || had_tail ||
+      message->pooled_body != NULL)
+    {
+      dbus_message_finalize (message);
+      return;
+    }
+
   if (!_DBUS_LOCK (message_cache))
     {
       /* The only way to get a non-null message goes through
@@ -683,38 +1269,22 @@ dbus_message_cache_or_finalize (DBusMessage *message)
       if (!_dbus_register_shutdown_func (dbus_message_cache_shutdown, NULL))
         goto out;
 
-      i = 0;
-      while (i < MAX_MESSAGE_CACHE_SIZE)
-        {
-          message_cache[i] = NULL;
-          ++i;
-        }
-
       message_cache_shutdown_registered = TRUE;
     }
 
   _dbus_assert (message_cache_count >= 0);
 
-  if (!_dbus_enable_message_cache ())
-    goto out;
-
   if ((_dbus_string_get_length (&message->header.data) +
        _dbus_string_get_length (&message->body)) >
-      MAX_MESSAGE_SIZE_TO_CACHE)
+      message_cache_max_size)
     goto out;
 
-  if (message_cache_count >= MAX_MESSAGE_CACHE_SIZE)
+  if (message_cache_count >= message_cache_max_count)
     goto out;
 
-  /* Find empty slot */
-  i = 0;
-  while (message_cache[i] != NULL)
-    ++i;
-
-  _dbus_assert (i < MAX_MESSAGE_CACHE_SIZE);
-
-  _dbus_assert (message_cache[i] == NULL);
-  message_cache[i] = message;
+  _dbus_assert (message_cache_count < MAX_MESSAGE_CACHE_SIZE);
+  _dbus_assert (message_cache[message_cache_count] == NULL);
+  message_cache[message_cache_count] = message;
   message_cache_count += 1;
   was_cached = TRUE;
 #ifndef DBUS_DISABLE_CHECKS
@@ -780,6 +1350,44 @@ _dbus_message_iter_check (DBusMessageRealIter *iter)
 }
 #endif /* DBUS_ENABLE_CHECKS || DBUS_ENABLE_ASSERT */
 
+#ifndef DBUS_DISABLE_CHECKS
+/* Checks that fields describes the struct type at type_pos, and
+ * that all the members fit in element_size bytes
+ */
+static dbus_bool_t
+struct_fields_match_signature (const DBusString      *type_str,
+                               int                    type_pos,
+                               const DBusStructField *fields,
+                               int                    n_fields,
+                               size_t                 element_size)
+{
+  int i;
+
+  if (_dbus_string_get_byte (type_str, type_pos) != DBUS_STRUCT_BEGIN_CHAR)
+    return FALSE;
+
+  for (i = 0; i < n_fields; i++)
+    {
+      int type = fields[i].type;
+      size_t size;
+
+      if (!dbus_type_is_basic (type) || type == DBUS_TYPE_UNIX_FD ||
+          _dbus_string_get_byte (type_str, type_pos + 1 + i) != type)
+        return FALSE;
+
+      if (dbus_type_is_fixed (type))
+        size = _dbus_type_get_alignment (type);
+      else
+        size = sizeof (const char *);
+
+      if (fields[i].offset > element_size || size > element_size - fields[i].offset)
+        return FALSE;
+    }
+
+  return _dbus_string_get_byte (type_str, type_pos + 1 + n_fields) == DBUS_STRUCT_END_CHAR;
+}
+#endif
+
 /**
  * Implementation of the varargs arg-getting functions.
  * dbus_message_get_args() is the place to go for complete
@@ -801,6 +1409,7 @@ _dbus_message_iter_get_args_valist (DBusMessageIter *iter,
   DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
   int spec_type, msg_type, i, j;
   dbus_bool_t retval;
+  dbus_bool_t advanced, has_next;
   va_list copy_args;
 
   _dbus_assert (_dbus_message_iter_check (real));
@@ -818,6 +1427,8 @@ _dbus_message_iter_get_args_valist (DBusMessageIter *iter,
   while (spec_type != DBUS_TYPE_INVALID)
     {
       msg_type = dbus_message_iter_get_arg_type (iter);
+      advanced = FALSE;
+      has_next = FALSE;
 
       if (msg_type != spec_type)
         {
@@ -869,8 +1480,11 @@ _dbus_message_iter_get_args_valist (DBusMessageIter *iter,
 
           _dbus_assert (ptr != NULL);
 
-          _dbus_type_reader_read_basic (&real->u.reader,
-                                        ptr);
+          /* Reading also finds the next value, so don't skip this one
+           * again */
+          has_next = _dbus_type_reader_read_basic_and_next (&real->u.reader,
+                                                            ptr);
+          advanced = TRUE;
         }
       else if (spec_type == DBUS_TYPE_ARRAY)
         {
@@ -991,7 +1605,10 @@ _dbus_message_iter_get_args_valist (DBusMessageIter *iter,
       i++;
 
       spec_type = va_arg (var_args, int);
-      if (!_dbus_type_reader_next (&real->u.reader) && spec_type != DBUS_TYPE_INVALID)
+      if (!advanced)
+        has_next = _dbus_type_reader_next (&real->u.reader);
+
+      if (!has_next && spec_type != DBUS_TYPE_INVALID)
         {
           dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
                           "Message has only %d arguments, but more were expected", i);
@@ -1153,6 +1770,34 @@ dbus_message_set_reply_serial (DBusMessage   *message,
                                        &reply_serial);
 }
 
+/**
+ * Overwrites the reply serial of a message that already has one. The
+ * field keeps its size, so unlike dbus_message_set_reply_serial() this
+ * can't run out of memory, which lets a message built in advance be
+ * reused as the reply to a different call.
+ *
+ * @param message the message, which must have a reply serial
+ * @param reply_serial the serial we're replying to
+ */
+void
+_dbus_message_reset_reply_serial (DBusMessage   *message,
+                                  dbus_uint32_t  reply_serial)
+{
+  const DBusString *str;
+  int pos;
+
+  _dbus_assert (!message->locked);
+  _dbus_assert (reply_serial != 0);
+
+  if (!_dbus_header_get_field_raw (&message->header,
+                                   DBUS_HEADER_FIELD_REPLY_SERIAL,
+                                   &str, &pos))
+    _dbus_assert_not_reached ("message has no reply serial to reset");
+
+  _dbus_marshal_set_uint32 ((DBusString *) str, pos, reply_serial,
+                            _dbus_header_get_byte_order (&message->header));
+}
+
 /**
  * Returns the serial that the message is a reply to or 0 if none.
  *
@@ -1182,6 +1827,7 @@ dbus_message_finalize (DBusMessage *message)
 
   /* This calls application callbacks! */
   _dbus_data_slot_list_free (&message->slot_list);
+  release_tail (message);
 
   _dbus_list_foreach (&message->counters,
                       free_counter, message);
@@ -1189,8 +1835,12 @@ dbus_message_finalize (DBusMessage *message)
 
   _dbus_header_free (&message->header);
   _dbus_string_free (&message->body);
+  release_pooled_body (message);
+  _dbus_array_counts_clear (&message->array_counts);
+  clear_dict_indexes (message);
 
 #ifdef HAVE_UNIX_FD_PASSING
+  release_sealed_mappings (message);
   close_unix_fds(message->unix_fds, &message->n_unix_fds);
   dbus_free(message->unix_fds);
 #endif
@@ -1200,12 +1850,34 @@ dbus_message_finalize (DBusMessage *message)
   dbus_free (message);
 }
 
+/** Bytes of header storage allocated in the same block as a message */
+#define MESSAGE_INLINE_HEADER_SIZE 256
+/** Bytes of body storage allocated in the same block as a message */
+#define MESSAGE_INLINE_BODY_SIZE   256
+
+/*
+ * A new message is allocated together with room for a typical header
+ * and body, so that building one only costs a single malloc, and
+ * freeing it a single free. The DBusString code moves the header or
+ * body to the heap if it outgrows this. The message has to come first,
+ * since dbus_message_finalize() frees the whole block by freeing it;
+ * the message cache then recycles whole blocks.
+ */
+typedef struct
+{
+  DBusMessage message;
+  unsigned char header_storage[MESSAGE_INLINE_HEADER_SIZE];
+  unsigned char body_storage[MESSAGE_INLINE_BODY_SIZE];
+} DBusMessageBlock;
+
 static DBusMessage*
-dbus_message_new_empty_header (void)
+dbus_message_new_empty_header_untagged (void)
 {
   DBusMessage *message;
+  DBusMessageBlock *block;
   dbus_bool_t from_cache;
 
+  block = NULL;
   message = dbus_message_get_cached ();
 
   if (message != NULL)
@@ -1215,9 +1887,10 @@ dbus_message_new_empty_header (void)
   else
     {
       from_cache = FALSE;
-      message = dbus_new0 (DBusMessage, 1);
-      if (message == NULL)
+      block = dbus_new0 (DBusMessageBlock, 1);
+      if (block == NULL)
         return NULL;
+      message = &block->message;
 #ifndef DBUS_DISABLE_CHECKS
       message->generation = _dbus_current_generation;
 #endif
@@ -1233,17 +1906,24 @@ dbus_message_new_empty_header (void)
   _dbus_message_trace_ref (message, 0, 1, "new_empty_header");
 
   message->locked = FALSE;
+  message->has_tail = FALSE;
+  message->tail_copied = FALSE;
+  message->tail_unreserved = FALSE;
+  message->body_unvalidated = FALSE;
+  message->pooled_body = NULL;
 #ifndef DBUS_DISABLE_CHECKS
   message->in_cache = FALSE;
 #endif
   message->counters = NULL;
   message->size_counter_delta = 0;
+  message->queued_nsec = 0;
   message->changed_stamp = 0;
 
 #ifdef HAVE_UNIX_FD_PASSING
   message->n_unix_fds = 0;
   message->n_unix_fds_allocated = 0;
   message->unix_fd_counter_delta = 0;
+  message->sealed_mappings = NULL;
 #endif
 
   if (!from_cache)
@@ -1256,23 +1936,28 @@ dbus_message_new_empty_header (void)
     }
   else
     {
-      if (!_dbus_header_init (&message->header))
-        {
-          dbus_free (message);
-          return NULL;
-        }
-
-      if (!_dbus_string_init_preallocated (&message->body, 32))
-        {
-          _dbus_header_free (&message->header);
-          dbus_free (message);
-          return NULL;
-        }
+      _dbus_header_init_borrowed (&message->header, block->header_storage,
+                                  sizeof (block->header_storage));
+      _dbus_string_init_borrowed (&message->body, block->body_storage,
+                                  sizeof (block->body_storage));
     }
 
   return message;
 }
 
+static DBusMessage*
+dbus_message_new_empty_header (void)
+{
+  DBusMessage *message;
+  DBusMemoryTag old_tag;
+
+  old_tag = _dbus_memory_push_tag (DBUS_MEMORY_TAG_MESSAGE);
+  message = dbus_message_new_empty_header_untagged ();
+  _dbus_memory_pop_tag (old_tag);
+
+  return message;
+}
+
 /**
  * Constructs a new message of the given message type.
  * Types include #DBUS_MESSAGE_TYPE_METHOD_CALL,
@@ -1546,14 +2231,14 @@ dbus_message_new_error_printf (DBusMessage *reply_to,
 {
   va_list args;
   DBusString str;
+  unsigned char str_storage[256];
   DBusMessage *message;
 
   _dbus_return_val_if_fail (reply_to != NULL, NULL);
   _dbus_return_val_if_fail (error_name != NULL, NULL);
   _dbus_return_val_if_fail (_dbus_check_is_valid_error_name (error_name), NULL);
 
-  if (!_dbus_string_init (&str))
-    return NULL;
+  _dbus_string_init_borrowed (&str, str_storage, sizeof (str_storage));
 
   va_start (args, error_format);
 
@@ -1571,6 +2256,100 @@ dbus_message_new_error_printf (DBusMessage *reply_to,
 }
 
 
+/**
+ * Creates a new message with the same header as the template message,
+ * without repeating the work of marshalling and validating it. This
+ * is much cheaper than dbus_message_new_signal() and friends for a
+ * message sent over and over again: create the template once, then
+ * a new message from it each time, and append the arguments to that.
+ *
+ * Everything in the template's header is copied except the serial,
+ * which is reset to 0, and the signature and number of Unix file
+ * descriptors, which describe the template's own arguments. The
+ * template's arguments are not copied, so it normally has none.
+ *
+ * @param template_message the message to copy the header from
+ * @returns a new message, or #NULL if not enough memory
+ */
+DBusMessage *
+dbus_message_new_from_template (DBusMessage *template_message)
+{
+  DBusMessage *message;
+
+  _dbus_return_val_if_fail (template_message != NULL, NULL);
+
+  message = dbus_message_new_empty_header ();
+  if (message == NULL)
+    return NULL;
+
+  if (!_dbus_header_assign (&message->header, &template_message->header) ||
+      !_dbus_header_delete_field (&message->header,
+                                  DBUS_HEADER_FIELD_SIGNATURE) ||
+      !_dbus_header_delete_field (&message->header,
+                                  DBUS_HEADER_FIELD_UNIX_FDS))
+    {
+      dbus_message_unref (message);
+      return NULL;
+    }
+
+  _dbus_header_update_lengths (&message->header, 0);
+
+  return message;
+}
+
+/**
+ * Creates a reply to a method call by copying a method return that
+ * was built once in advance, with no destination or reply serial, and
+ * filling those in. This is for replies that are always the same, such
+ * as those to org.freedesktop.DBus.Peer methods, so that their header
+ * and arguments are only marshalled once.
+ *
+ * @param template_message the reply to copy, never sent itself
+ * @param method_call the method call being replied to
+ * @returns the reply, or #NULL if not enough memory
+ */
+DBusMessage *
+_dbus_message_new_reply_from_template (DBusMessage *template_message,
+                                       DBusMessage *method_call)
+{
+  DBusMessage *message;
+  const char *sender;
+
+  _dbus_assert (dbus_message_get_type (template_message) ==
+                DBUS_MESSAGE_TYPE_METHOD_RETURN);
+  _dbus_assert (!template_message->has_tail);
+#ifdef HAVE_UNIX_FD_PASSING
+  _dbus_assert (template_message->n_unix_fds == 0);
+#endif
+
+  message = dbus_message_new_empty_header ();
+  if (message == NULL)
+    return NULL;
+
+  if (!_dbus_header_assign (&message->header, &template_message->header) ||
+      !_dbus_string_copy (&template_message->body, 0, &message->body, 0))
+    goto failed;
+
+  /* sender is allowed to be null here in peer-to-peer case */
+  sender = dbus_message_get_sender (method_call);
+
+  if (sender != NULL && !dbus_message_set_destination (message, sender))
+    goto failed;
+
+  if (!dbus_message_set_reply_serial (message,
+                                      dbus_message_get_serial (method_call)))
+    goto failed;
+
+  return message;
+
+ failed:
+  dbus_message_unref (message);
+  return NULL;
+}
+
+/** Locked bodies at least this long are shared by dbus_message_copy() rather than copied */
+#define MIN_SHARED_BODY_BYTES 4096
+
 /**
  * Creates a new message that is an exact replica of the message
  * specified, except that its refcount is set to 1, its message serial
@@ -1578,6 +2357,15 @@ dbus_message_new_error_printf (DBusMessage *reply_to,
  * outgoing message queue and thus not modifiable) the new message
  * will not be locked.
  *
+ * A locked message can't change any more, so the copy of a large one
+ * only duplicates the header and refers to the original's body, which
+ * it reads and sends from where it is. Forwarding a message with a
+ * different destination or serial therefore neither copies nor
+ * allocates room for its body; it is sent straight from the original.
+ * The body is only copied in when arguments are first appended to the
+ * copy, and appending can then fail for lack of memory, as it always
+ * could.
+ *
  * @todo This function can't be used in programs that try to recover from OOM errors.
  *
  * @param message the message
@@ -1587,9 +2375,16 @@ DBusMessage *
 dbus_message_copy (const DBusMessage *message)
 {
   DBusMessage *retval;
+  dbus_bool_t share_body;
 
   _dbus_return_val_if_fail (message != NULL, NULL);
 
+  /* Swapping the byte order rewrites the body in place, so only a
+   * body that never needs it can be shared */
+  share_body = message->locked && !message->has_tail &&
+    _dbus_header_get_byte_order (&message->header) == DBUS_COMPILER_BYTE_ORDER &&
+    _dbus_string_get_length (&message->body) >= MIN_SHARED_BODY_BYTES;
+
   retval = dbus_new0 (DBusMessage, 1);
   if (retval == NULL)
     return NULL;
@@ -1597,6 +2392,7 @@ dbus_message_copy (const DBusMessage *message)
   _dbus_atomic_inc (&retval->refcount);
 
   retval->locked = FALSE;
+  retval->body_unvalidated = message->body_unvalidated;
 #ifndef DBUS_DISABLE_CHECKS
   retval->generation = message->generation;
 #endif
@@ -1608,17 +2404,24 @@ dbus_message_copy (const DBusMessage *message)
     }
 
   if (!_dbus_string_init_preallocated (&retval->body,
-                                       _dbus_string_get_length (&message->body)))
+                                       share_body ? 0 :
+                                       get_body_length (message)))
     {
       _dbus_header_free (&retval->header);
       dbus_free (retval);
       return NULL;
     }
 
-  if (!_dbus_string_copy (&message->body, 0,
+  if (!share_body &&
+      !_dbus_string_copy (&message->body, 0,
 			  &retval->body, 0))
     goto failed_copy;
 
+  if (message->has_tail &&
+      !_dbus_string_copy (&message->tail, 0, &retval->body,
+                          _dbus_string_get_length (&retval->body)))
+    goto failed_copy;
+
 #ifdef HAVE_UNIX_FD_PASSING
   retval->unix_fds = dbus_new(int, message->n_unix_fds);
   if (retval->unix_fds == NULL && message->n_unix_fds > 0)
@@ -1638,6 +2441,17 @@ dbus_message_copy (const DBusMessage *message)
 
 #endif
 
+  if (share_body)
+    {
+      _dbus_string_init_const_len (&retval->tail,
+                                   _dbus_string_get_const_data (&message->body),
+                                   _dbus_string_get_length (&message->body));
+      retval->tail_data = dbus_message_ref ((DBusMessage *) message);
+      retval->tail_free_func = (DBusFreeFunction) dbus_message_unref;
+      retval->has_tail = TRUE;
+      retval->tail_unreserved = TRUE;
+    }
+
   _dbus_message_trace_ref (retval, 0, 1, "copy");
   return retval;
 
@@ -1668,62 +2482,258 @@ dbus_message_ref (DBusMessage *message)
 {
   dbus_int32_t old_refcount;
 
-  _dbus_return_val_if_fail (message != NULL, NULL);
-  _dbus_return_val_if_fail (message->generation == _dbus_current_generation, NULL);
-  _dbus_return_val_if_fail (!message->in_cache, NULL);
+  _dbus_return_val_if_fail (message != NULL, NULL);
+  _dbus_return_val_if_fail (message->generation == _dbus_current_generation, NULL);
+  _dbus_return_val_if_fail (!message->in_cache, NULL);
+
+  old_refcount = _dbus_atomic_inc (&message->refcount);
+  _dbus_assert (old_refcount >= 1);
+  _dbus_message_trace_ref (message, old_refcount, old_refcount + 1, "ref");
+
+  return message;
+}
+
+/**
+ * Decrements the reference count of a DBusMessage, freeing the
+ * message if the count reaches 0.
+ *
+ * @param message the message
+ * @see dbus_message_ref
+ */
+void
+dbus_message_unref (DBusMessage *message)
+{
+ dbus_int32_t old_refcount;
+
+  _dbus_return_if_fail (message != NULL);
+  _dbus_return_if_fail (message->generation == _dbus_current_generation);
+  _dbus_return_if_fail (!message->in_cache);
+
+  old_refcount = _dbus_atomic_dec (&message->refcount);
+
+  _dbus_assert (old_refcount >= 1);
+
+  _dbus_message_trace_ref (message, old_refcount, old_refcount - 1, "unref");
+
+  if (old_refcount == 1)
+    {
+      /* Calls application callbacks! */
+      dbus_message_cache_or_finalize (message);
+    }
+}
+
+/**
+ * Gets the type of a message. Types include
+ * #DBUS_MESSAGE_TYPE_METHOD_CALL, #DBUS_MESSAGE_TYPE_METHOD_RETURN,
+ * #DBUS_MESSAGE_TYPE_ERROR, #DBUS_MESSAGE_TYPE_SIGNAL, but other
+ * types are allowed and all code must silently ignore messages of
+ * unknown type. #DBUS_MESSAGE_TYPE_INVALID will never be returned.
+ *
+ * @param message the message
+ * @returns the type of the message
+ */
+int
+dbus_message_get_type (DBusMessage *message)
+{
+  _dbus_return_val_if_fail (message != NULL, DBUS_MESSAGE_TYPE_INVALID);
+
+  return _dbus_header_get_message_type (&message->header);
+}
+
+/* The most arguments append_basic_args() will take in one go */
+#define MAX_FAST_BASIC_ARGS 32
+
+/* Appends a run of basic-typed arguments, as dbus_message_append_args()
+ * would, by working out where everything goes first, growing the body
+ * once and then setting the signature once, rather than rewriting the
+ * signature field for every argument. Returns #FALSE without touching
+ * the message if the arguments aren't all basic (or would need any
+ * checks to fail), in which case the caller appends them the slow way;
+ * otherwise *result says whether there was enough memory.
+ */
+static dbus_bool_t
+append_basic_args (DBusMessage *message,
+                   int          first_arg_type,
+                   va_list      var_args,
+                   dbus_bool_t *result)
+{
+  int types[MAX_FAST_BASIC_ARGS];
+  const DBusBasicValue *values[MAX_FAST_BASIC_ARGS];
+  int lengths[MAX_FAST_BASIC_ARGS];
+  const DBusString *current_sig;
+  int current_sig_pos, current_sig_len;
+  char sig[DBUS_MAXIMUM_SIGNATURE_LENGTH + 1];
+  const char *v_STRING;
+  DBusString *body;
+  int body_len;
+  int type, n, i, pos;
+  char *data;
+
+  if (message->locked)
+    return FALSE;
+
+  n = 0;
+  pos = get_body_length (message);
+  type = first_arg_type;
+
+  while (type != DBUS_TYPE_INVALID)
+    {
+      const DBusBasicValue *value;
+      size_t len = 0;
+
+      if (n == MAX_FAST_BASIC_ARGS ||
+          !dbus_type_is_basic (type) ||
+          type == DBUS_TYPE_UNIX_FD)
+        return FALSE;
+
+      value = va_arg (var_args, const DBusBasicValue*);
+      if (value == NULL)
+        return FALSE;
+
+      pos = _DBUS_ALIGN_VALUE (pos, _dbus_type_get_alignment (type));
+
+      switch (type)
+        {
+        case DBUS_TYPE_STRING:
+        case DBUS_TYPE_OBJECT_PATH:
+        case DBUS_TYPE_SIGNATURE:
+#ifndef DBUS_DISABLE_CHECKS
+          if (type == DBUS_TYPE_STRING &&
+              !_dbus_check_is_valid_utf8 (value->str))
+            return FALSE;
+          else if (type == DBUS_TYPE_OBJECT_PATH &&
+                   !_dbus_check_is_valid_path (value->str))
+            return FALSE;
+          else if (type == DBUS_TYPE_SIGNATURE &&
+                   !_dbus_check_is_valid_signature (value->str))
+            return FALSE;
+#endif
+          len = strlen (value->str);
+          if (len > DBUS_MAXIMUM_MESSAGE_LENGTH)
+            return FALSE;
+
+          pos += (type == DBUS_TYPE_SIGNATURE ? 1 : 4) + len + 1;
+          break;
+
+        case DBUS_TYPE_BOOLEAN:
+#ifndef DBUS_DISABLE_CHECKS
+          if (value->bool_val != 0 && value->bool_val != 1)
+            return FALSE;
+#endif
+          /* fall through */
+        default:
+          /* fixed-length basic types are as big as their alignment */
+          pos += _dbus_type_get_alignment (type);
+          break;
+        }
+
+      if (pos > DBUS_MAXIMUM_MESSAGE_LENGTH)
+        return FALSE;
+
+      types[n] = type;
+      values[n] = value;
+      lengths[n] = len;
+      n += 1;
+
+      type = va_arg (var_args, int);
+    }
+
+  if (n == 0)
+    return FALSE;
+
+  if (_dbus_header_get_field_raw (&message->header,
+                                  DBUS_HEADER_FIELD_SIGNATURE,
+                                  &current_sig, &current_sig_pos))
+    current_sig_len = _dbus_string_get_byte (current_sig, current_sig_pos);
+  else
+    current_sig_len = 0;
+
+  if (current_sig_len + n > DBUS_MAXIMUM_SIGNATURE_LENGTH)
+    return FALSE;
+
+  /* From here on the arguments are going in, unless we run out of
+   * memory. The iterator setup already put the message in our byte
+   * order, so everything can be written natively.
+   */
+  _dbus_assert (_dbus_header_get_byte_order (&message->header) ==
+                DBUS_COMPILER_BYTE_ORDER);
 
-  old_refcount = _dbus_atomic_inc (&message->refcount);
-  _dbus_assert (old_refcount >= 1);
-  _dbus_message_trace_ref (message, old_refcount, old_refcount + 1, "ref");
+  *result = FALSE;
 
-  return message;
-}
+  /* The new signature is short enough to build on the stack, which
+   * keeps appending to a recycled message free of allocations */
+  if (current_sig_len > 0)
+    memcpy (sig, _dbus_string_get_const_data_len (current_sig,
+                                                  current_sig_pos + 1,
+                                                  current_sig_len),
+            current_sig_len);
 
-/**
- * Decrements the reference count of a DBusMessage, freeing the
- * message if the count reaches 0.
- *
- * @param message the message
- * @see dbus_message_ref
- */
-void
-dbus_message_unref (DBusMessage *message)
-{
- dbus_int32_t old_refcount;
+  for (i = 0; i < n; i++)
+    sig[current_sig_len + i] = types[i];
 
-  _dbus_return_if_fail (message != NULL);
-  _dbus_return_if_fail (message->generation == _dbus_current_generation);
-  _dbus_return_if_fail (!message->in_cache);
+  sig[current_sig_len + n] = '\0';
 
-  old_refcount = _dbus_atomic_dec (&message->refcount);
+  if (!flatten_tail (message))
+    return TRUE;
 
-  _dbus_assert (old_refcount >= 1);
+  body = &message->body;
+  body_len = _dbus_string_get_length (body);
 
-  _dbus_message_trace_ref (message, old_refcount, old_refcount - 1, "unref");
+  /* Padding and terminating nuls are already in place after this */
+  if (!_dbus_string_insert_bytes (body, body_len, pos - body_len, '\0'))
+    return TRUE;
 
-  if (old_refcount == 1)
+  data = _dbus_string_get_data (body);
+  pos = body_len;
+
+  for (i = 0; i < n; i++)
     {
-      /* Calls application callbacks! */
-      dbus_message_cache_or_finalize (message);
+      dbus_uint32_t u;
+
+      pos = _DBUS_ALIGN_VALUE (pos, _dbus_type_get_alignment (types[i]));
+
+      switch (types[i])
+        {
+        case DBUS_TYPE_STRING:
+        case DBUS_TYPE_OBJECT_PATH:
+          u = lengths[i];
+          memcpy (data + pos, &u, 4);
+          memcpy (data + pos + 4, values[i]->str, lengths[i]);
+          pos += 4 + lengths[i] + 1;
+          break;
+
+        case DBUS_TYPE_SIGNATURE:
+          data[pos] = lengths[i];
+          memcpy (data + pos + 1, values[i]->str, lengths[i]);
+          pos += 1 + lengths[i] + 1;
+          break;
+
+        case DBUS_TYPE_BOOLEAN:
+          u = values[i]->bool_val != FALSE;
+          memcpy (data + pos, &u, 4);
+          pos += 4;
+          break;
+
+        default:
+          memcpy (data + pos, values[i],
+                  _dbus_type_get_alignment (types[i]));
+          pos += _dbus_type_get_alignment (types[i]);
+          break;
+        }
     }
-}
 
-/**
- * Gets the type of a message. Types include
- * #DBUS_MESSAGE_TYPE_METHOD_CALL, #DBUS_MESSAGE_TYPE_METHOD_RETURN,
- * #DBUS_MESSAGE_TYPE_ERROR, #DBUS_MESSAGE_TYPE_SIGNAL, but other
- * types are allowed and all code must silently ignore messages of
- * unknown type. #DBUS_MESSAGE_TYPE_INVALID will never be returned.
- *
- * @param message the message
- * @returns the type of the message
- */
-int
-dbus_message_get_type (DBusMessage *message)
-{
-  _dbus_return_val_if_fail (message != NULL, DBUS_MESSAGE_TYPE_INVALID);
+  _dbus_assert (pos == _dbus_string_get_length (body));
 
-  return _dbus_header_get_message_type (&message->header);
+  v_STRING = sig;
+  if (_dbus_header_set_field_basic (&message->header,
+                                    DBUS_HEADER_FIELD_SIGNATURE,
+                                    DBUS_TYPE_SIGNATURE,
+                                    &v_STRING))
+    *result = TRUE;
+  else
+    _dbus_string_set_length (body, body_len);
+
+  return TRUE;
 }
 
 /**
@@ -1827,6 +2837,8 @@ dbus_message_append_args_valist (DBusMessage *message,
 {
   int type;
   DBusMessageIter iter;
+  dbus_bool_t handled, retval;
+  va_list copy_args;
 
   _dbus_return_val_if_fail (message != NULL, FALSE);
 
@@ -1834,6 +2846,13 @@ dbus_message_append_args_valist (DBusMessage *message,
 
   dbus_message_iter_init_append (message, &iter);
 
+  DBUS_VA_COPY (copy_args, var_args);
+  handled = append_basic_args (message, first_arg_type, copy_args, &retval);
+  va_end (copy_args);
+
+  if (handled)
+    return retval;
+
   while (type != DBUS_TYPE_INVALID)
     {
       if (dbus_type_is_basic (type))
@@ -2079,7 +3098,7 @@ dbus_message_iter_init (DBusMessage     *message,
   _dbus_type_reader_init (&real->u.reader,
                           _dbus_header_get_byte_order (&message->header),
                           type_str, type_pos,
-                          &message->body,
+                          get_body_for_reading (message),
                           0);
 
   return _dbus_type_reader_get_current_type (&real->u.reader) != DBUS_TYPE_INVALID;
@@ -2221,14 +3240,14 @@ dbus_message_iter_get_signature (DBusMessageIter *iter)
 {
   const DBusString *sig;
   DBusString retstr;
+  unsigned char retstr_storage[64];
   char *ret;
   int start, len;
   DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
 
   _dbus_return_val_if_fail (_dbus_message_iter_check (real), NULL);
 
-  if (!_dbus_string_init (&retstr))
-    return NULL;
+  _dbus_string_init_borrowed (&retstr, retstr_storage, sizeof (retstr_storage));
 
   _dbus_type_reader_get_signature (&real->u.reader, &sig,
 				   &start, &len);
@@ -2329,7 +3348,9 @@ dbus_message_iter_get_basic (DBusMessageIter  *iter,
  * to by the iterator.
  * Note that this function is O(1) for arrays of fixed-size types
  * but O(n) for arrays of variable-length types such as strings,
- * so it may be a bad idea to use it.
+ * so it may be a bad idea to use it. The exception is large arrays
+ * in messages that were received and validated: their counts are
+ * recorded during validation, so looking them up is fast.
  *
  * @param iter the iterator
  * @returns the number of elements in the array
@@ -2356,16 +3377,201 @@ dbus_message_iter_get_element_count (DBusMessageIter *iter)
     }
   else
     {
-      while (_dbus_type_reader_get_current_type (&array) != DBUS_TYPE_INVALID)
+      /* Large arrays in received messages were counted by the validator */
+      n_elements = _dbus_array_counts_lookup (&real->message->array_counts,
+                                              array.u.array.start_pos);
+
+      if (n_elements < 0)
         {
-          ++n_elements;
-          _dbus_type_reader_next (&array);
+          n_elements = 0;
+
+          while (_dbus_type_reader_get_current_type (&array) != DBUS_TYPE_INVALID)
+            {
+              ++n_elements;
+              _dbus_type_reader_next (&array);
+            }
         }
     }
 
    return n_elements;
 }
 
+/** Dictionaries with fewer bytes than this are searched without building an index */
+#define MIN_INDEXED_DICT_LENGTH 256
+
+/* Maps each key of the dictionary read by start, which must be at its
+ * first entry, to the position of the entry, for the first entry with
+ * each key. The keys point into the message.
+ */
+static DBusHashTable *
+build_dict_index (const DBusTypeReader *start)
+{
+  DBusHashTable *index;
+  DBusTypeReader array;
+
+  index = _dbus_hash_table_new (DBUS_HASH_STRING, NULL, NULL);
+  if (index == NULL)
+    return NULL;
+
+  array = *start;
+
+  while (_dbus_type_reader_get_current_type (&array) != DBUS_TYPE_INVALID)
+    {
+      DBusTypeReader entry;
+      const char *key;
+      int entry_pos;
+
+      /* Entries never start at 0, since the array length comes first */
+      entry_pos = _dbus_type_reader_get_value_pos (&array);
+      _dbus_type_reader_recurse (&array, &entry);
+      _dbus_type_reader_read_basic (&entry, &key);
+
+      if (_dbus_hash_table_lookup_string (index, key) == NULL &&
+          !_dbus_hash_table_insert_string (index, (char *) key,
+                                           _DBUS_INT_TO_POINTER (entry_pos)))
+        {
+          _dbus_hash_table_unref (index);
+          return NULL;
+        }
+
+      _dbus_type_reader_next (&array);
+    }
+
+  return index;
+}
+
+/* The hash table also calls this with NULL when inserting */
+static void
+free_dict_index (void *index)
+{
+  if (index != NULL)
+    _dbus_hash_table_unref (index);
+}
+
+/* Returns the index of the dictionary read by array, building it if
+ * necessary, or #NULL if there is not enough memory
+ */
+static DBusHashTable *
+get_dict_index (DBusMessage          *message,
+                const DBusTypeReader *array)
+{
+  DBusHashTable *index;
+  int start_pos = array->u.array.start_pos;
+
+  if (message->dict_indexes == NULL)
+    {
+      message->dict_indexes = _dbus_hash_table_new (DBUS_HASH_INT, NULL,
+                                                    free_dict_index);
+      if (message->dict_indexes == NULL)
+        return NULL;
+    }
+
+  index = _dbus_hash_table_lookup_int (message->dict_indexes, start_pos);
+  if (index != NULL)
+    return index;
+
+  index = build_dict_index (array);
+  if (index == NULL)
+    return NULL;
+
+  if (!_dbus_hash_table_insert_int (message->dict_indexes, start_pos, index))
+    {
+      _dbus_hash_table_unref (index);
+      return NULL;
+    }
+
+  return index;
+}
+
+/**
+ * Finds the value for a key in a dictionary whose keys are strings,
+ * such as an "a{sv}" of properties. The message iter should point to
+ * the dictionary, as for dbus_message_iter_get_element_count(). If
+ * the key is found, value is initialized to point to its value (for
+ * "a{sv}", the variant, which has to be recursed into). If the key
+ * appears more than once, the first entry with it is used.
+ *
+ * The first lookup in a large dictionary builds an index of its keys,
+ * which is kept with the message, so looking up several keys in the
+ * same dictionary takes one pass over it instead of one per key. Small
+ * dictionaries are just searched, and so are large ones if there is
+ * not enough memory for the index. Appending to the message drops
+ * the indexes.
+ *
+ * @param iter the message iter pointing to the dictionary
+ * @param key the key to look for
+ * @param value iterator to initialize to point to the value
+ * @returns #TRUE if the key was found
+ */
+dbus_bool_t
+dbus_message_iter_find_dict_value (DBusMessageIter *iter,
+                                   const char      *key,
+                                   DBusMessageIter *value)
+{
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+  DBusMessageRealIter *real_value = (DBusMessageRealIter *)value;
+  DBusTypeReader array;
+  DBusTypeReader entry;
+  DBusHashTable *index;
+
+  _dbus_return_val_if_fail (_dbus_message_iter_check (real), FALSE);
+  _dbus_return_val_if_fail (real->iter_type == DBUS_MESSAGE_ITER_TYPE_READER, FALSE);
+  _dbus_return_val_if_fail (key != NULL, FALSE);
+  _dbus_return_val_if_fail (value != NULL, FALSE);
+  _dbus_return_val_if_fail (_dbus_type_reader_get_current_type (&real->u.reader)
+                            == DBUS_TYPE_ARRAY, FALSE);
+  _dbus_return_val_if_fail (_dbus_type_reader_get_element_type (&real->u.reader)
+                            == DBUS_TYPE_DICT_ENTRY, FALSE);
+  _dbus_return_val_if_fail (_dbus_string_get_byte (real->u.reader.type_str,
+                                                   real->u.reader.type_pos + 2)
+                            == DBUS_TYPE_STRING, FALSE);
+
+  _dbus_type_reader_recurse (&real->u.reader, &array);
+
+  index = NULL;
+  if (_dbus_type_reader_get_array_length (&array) >= MIN_INDEXED_DICT_LENGTH)
+    index = get_dict_index (real->message, &array);
+
+  if (index != NULL)
+    {
+      int entry_pos = _DBUS_POINTER_TO_INT (_dbus_hash_table_lookup_string (index, key));
+
+      if (entry_pos == 0)
+        return FALSE;
+
+      /* The index was built with this same array, so only the position
+       * differs */
+      array.value_pos = entry_pos;
+      _dbus_type_reader_recurse (&array, &entry);
+    }
+  else
+    {
+      while (TRUE)
+        {
+          const char *entry_key;
+
+          if (_dbus_type_reader_get_current_type (&array) == DBUS_TYPE_INVALID)
+            return FALSE;
+
+          _dbus_type_reader_recurse (&array, &entry);
+          _dbus_type_reader_read_basic (&entry, &entry_key);
+
+          if (strcmp (entry_key, key) == 0)
+            break;
+
+          _dbus_type_reader_next (&array);
+        }
+    }
+
+  /* Move past the key to the value */
+  _dbus_type_reader_next (&entry);
+
+  *real_value = *real;
+  real_value->u.reader = entry;
+
+  return TRUE;
+}
+
 /**
  * Returns the number of bytes in the array as marshaled in the wire
  * protocol. The iterator must currently be inside an array-typed
@@ -2442,6 +3648,212 @@ dbus_message_iter_get_fixed_array (DBusMessageIter  *iter,
                                       value, n_elements);
 }
 
+/**
+ * Reads structs from an array into an array of C structs, in one
+ * go. Each member of the C struct described by fields is filled in
+ * from one field of the D-Bus struct, so fields must match the
+ * element type of the array, and all of them must be basic types
+ * other than #DBUS_TYPE_UNIX_FD. Members have the type
+ * dbus_message_iter_get_basic() would store, so string-like members
+ * are "const char*" pointing into the message, which must not be
+ * freed. For example:
+ * @code
+ * struct Item { dbus_int32_t id; const char *name; double weight; };
+ * static const DBusStructField item_fields[] = {
+ *   { DBUS_TYPE_INT32, offsetof (struct Item, id) },
+ *   { DBUS_TYPE_STRING, offsetof (struct Item, name) },
+ *   { DBUS_TYPE_DOUBLE, offsetof (struct Item, weight) }
+ * };
+ * struct Item items[64];
+ * int n;
+ *
+ * dbus_message_iter_recurse (&iter, &array_iter);
+ * while ((n = dbus_message_iter_get_struct_array (&array_iter, item_fields, 3,
+ *                                                 items, sizeof (items[0]),
+ *                                                 64)) > 0)
+ *   handle_items (items, n);
+ * @endcode
+ *
+ * The message iter should be "in" the array, as for
+ * dbus_message_iter_get_fixed_array(). At most max_elements structs
+ * are read, starting at the iterator's position, and the iterator is
+ * moved past them, so the array can be read in batches. Use
+ * dbus_message_iter_get_element_count() on the array if you want to
+ * read it all at once.
+ *
+ * This avoids recursing into every struct, and if the struct only
+ * has fixed-length members and the C struct has the same layout as
+ * the message, whole batches are copied at once.
+ *
+ * @param iter the iterator
+ * @param fields the members of the C struct
+ * @param n_fields the number of members
+ * @param elements the array of C structs to fill in
+ * @param element_size the size of one C struct, usually sizeof()
+ * @param max_elements the number of structs elements has room for
+ * @returns the number of structs read, 0 at the end of the array
+ */
+int
+dbus_message_iter_get_struct_array (DBusMessageIter       *iter,
+                                    const DBusStructField *fields,
+                                    int                    n_fields,
+                                    void                  *elements,
+                                    size_t                 element_size,
+                                    int                    max_elements)
+{
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+
+  _dbus_return_val_if_fail (_dbus_message_iter_check (real), 0);
+  _dbus_return_val_if_fail (real->iter_type == DBUS_MESSAGE_ITER_TYPE_READER, 0);
+  _dbus_return_val_if_fail (fields != NULL, 0);
+  _dbus_return_val_if_fail (n_fields > 0, 0);
+  _dbus_return_val_if_fail (elements != NULL || max_elements == 0, 0);
+  _dbus_return_val_if_fail (max_elements >= 0, 0);
+  /* An element type is only ever preceded by the 'a' of its array */
+  _dbus_return_val_if_fail (real->u.reader.type_pos > 0 &&
+                            _dbus_string_get_byte (real->u.reader.type_str,
+                                                   real->u.reader.type_pos - 1) == DBUS_TYPE_ARRAY,
+                            0);
+  _dbus_return_val_if_fail (struct_fields_match_signature (real->u.reader.type_str,
+                                                           real->u.reader.type_pos,
+                                                           fields, n_fields,
+                                                           element_size),
+                            0);
+
+  return _dbus_type_reader_read_struct_multi (&real->u.reader, fields, n_fields,
+                                              elements, element_size,
+                                              max_elements);
+}
+
+/**
+ * Reads a block of bytes that was appended with
+ * dbus_message_iter_append_sealed_bytes(). The value must be a
+ * #DBUS_TYPE_UNIX_FD referring to a sealed memfd; the file is mapped
+ * read-only and the bytes are never copied.
+ *
+ * The returned block is owned by the message and stays valid until
+ * the message is freed, just like the block returned by
+ * dbus_message_iter_get_fixed_array(). Because the file is sealed,
+ * the sender can no longer change or truncate it, so the bytes can be
+ * validated once and then trusted.
+ *
+ * Fails with #DBUS_ERROR_NOT_SUPPORTED if the platform cannot pass
+ * or seal files, and with #DBUS_ERROR_INVALID_ARGS if the file
+ * descriptor is not a sealed memfd.
+ *
+ * @param iter the iterator
+ * @param value location to store the block
+ * @param n_bytes location to store the number of bytes
+ * @param error error to fill in on failure, or #NULL
+ * @returns #FALSE if error set
+ */
+dbus_bool_t
+dbus_message_iter_get_sealed_bytes (DBusMessageIter  *iter,
+                                    const void      **value,
+                                    int              *n_bytes,
+                                    DBusError        *error)
+{
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+#ifdef HAVE_UNIX_FD_PASSING
+  SealedMapping *mapping;
+  DBusBasicValue idx;
+  void *data;
+  size_t len;
+#endif
+
+  _dbus_return_val_if_fail (_dbus_message_iter_check (real), FALSE);
+  _dbus_return_val_if_fail (dbus_message_iter_get_arg_type (iter) == DBUS_TYPE_UNIX_FD, FALSE);
+  _dbus_return_val_if_fail (value != NULL, FALSE);
+  _dbus_return_val_if_fail (n_bytes != NULL, FALSE);
+  _dbus_return_val_if_error_is_set (error, FALSE);
+
+#ifdef HAVE_UNIX_FD_PASSING
+  _dbus_type_reader_read_basic (&real->u.reader, &idx);
+
+  if (idx.u32 >= real->message->n_unix_fds)
+    {
+      dbus_set_error (error, DBUS_ERROR_INCONSISTENT_MESSAGE,
+                      "Message refers to a file descriptor it does not carry");
+      return FALSE;
+    }
+
+  if (!_dbus_memfd_map_sealed (real->message->unix_fds[idx.u32],
+                               &data, &len, error))
+    return FALSE;
+
+  if (len > _DBUS_INT_MAX)
+    {
+      _dbus_memfd_unmap (data, len);
+      dbus_set_error (error, DBUS_ERROR_LIMITS_EXCEEDED,
+                      "Sealed block is too large");
+      return FALSE;
+    }
+
+  if (data != NULL)
+    {
+      mapping = dbus_new (SealedMapping, 1);
+
+      if (mapping == NULL ||
+          !_dbus_list_append (&real->message->sealed_mappings, mapping))
+        {
+          dbus_free (mapping);
+          _dbus_memfd_unmap (data, len);
+          _DBUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      mapping->data = data;
+      mapping->len = len;
+    }
+
+  *value = data;
+  *n_bytes = len;
+  return TRUE;
+#else
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "File descriptor passing is not supported on this platform");
+  return FALSE;
+#endif
+}
+
+/**
+ * Makes sure that at least n_bytes more can be appended to the
+ * message body without reallocating it. Building a large message
+ * otherwise grows the body a little at a time, copying it each time;
+ * dbus_signature_estimate_size() can help to pick n_bytes. Reserving
+ * too little is harmless, the body just grows as usual once the
+ * reserved room is used up.
+ *
+ * @param message the message
+ * @param n_bytes number of bytes to make room for
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+dbus_message_reserve_body (DBusMessage *message,
+                           int          n_bytes)
+{
+  int body_len;
+  int tail_len;
+
+  _dbus_return_val_if_fail (message != NULL, FALSE);
+  _dbus_return_val_if_fail (!message->locked, FALSE);
+  _dbus_return_val_if_fail (n_bytes >= 0, FALSE);
+  _dbus_return_val_if_fail (n_bytes <= DBUS_MAXIMUM_MESSAGE_LENGTH, FALSE);
+
+  body_len = _dbus_string_get_length (&message->body);
+
+  /* A borrowed tail will be copied into the body before anything else
+   * is appended */
+  tail_len = message->has_tail ? _dbus_string_get_length (&message->tail) : 0;
+
+  if (!_dbus_string_lengthen (&message->body, tail_len + n_bytes))
+    return FALSE;
+
+  _dbus_string_set_length (&message->body, body_len);
+
+  return TRUE;
+}
+
 /**
  * Initializes a #DBusMessageIter for appending arguments to the end
  * of a message.
@@ -2465,6 +3877,9 @@ dbus_message_iter_init_append (DBusMessage     *message,
   _dbus_message_iter_init_common (message, real,
                                   DBUS_MESSAGE_ITER_TYPE_WRITER);
 
+  /* Appending may move the body, and the keys in the indexes with it */
+  clear_dict_indexes (message);
+
   /* We create the signature string and point iterators at it "on demand"
    * when a value is actually appended. That means that init() never fails
    * due to OOM.
@@ -2472,7 +3887,7 @@ dbus_message_iter_init_append (DBusMessage     *message,
   _dbus_type_writer_init_types_delayed (&real->u.writer,
                                         _dbus_header_get_byte_order (&message->header),
                                         &message->body,
-                                        _dbus_string_get_length (&message->body));
+                                        get_body_length (message));
 }
 
 /**
@@ -2492,6 +3907,10 @@ _dbus_message_iter_open_signature (DBusMessageRealIter *real)
 
   _dbus_assert (real->iter_type == DBUS_MESSAGE_ITER_TYPE_WRITER);
 
+  /* Everything written from here on goes after a borrowed tail */
+  if (!flatten_tail (real->message))
+    return FALSE;
+
   if (real->u.writer.type_str != NULL)
     {
       _dbus_assert (real->sig_refcount > 0);
@@ -2743,20 +4162,22 @@ dbus_message_iter_append_basic (DBusMessageIter *iter,
       int *fds;
       dbus_uint32_t u;
 
+      ret = FALSE;
+
       /* First step, include the fd in the fd list of this message */
       if (!(fds = expand_fd_array(real->message, 1)))
-        return FALSE;
+        goto out;
 
       *fds = _dbus_dup(*(int*) value, NULL);
       if (*fds < 0)
-        return FALSE;
+        goto out;
 
       u = real->message->n_unix_fds;
 
       /* Second step, write the index to the fd */
       if (!(ret = _dbus_type_writer_write_basic (&real->u.writer, DBUS_TYPE_UNIX_FD, &u))) {
         _dbus_close(*fds, NULL);
-        return FALSE;
+        goto out;
       }
 
       real->message->n_unix_fds += 1;
@@ -2782,8 +4203,57 @@ dbus_message_iter_append_basic (DBusMessageIter *iter,
       ret = _dbus_type_writer_write_basic (&real->u.writer, type, value);
     }
 
-  if (!_dbus_message_iter_close_signature (real))
-    ret = FALSE;
+#ifdef HAVE_UNIX_FD_PASSING
+ out:
+#endif
+  if (!_dbus_message_iter_close_signature (real))
+    ret = FALSE;
+
+  return ret;
+}
+
+/**
+ * Appends a block of bytes by copying it into a sealed memfd and
+ * appending that as a #DBUS_TYPE_UNIX_FD. Neither the bus daemon nor
+ * the transport ever copies the payload afterwards: only the file
+ * descriptor travels, and the recipient maps the file with
+ * dbus_message_iter_get_sealed_bytes().
+ *
+ * This is worthwhile for large payloads (hundreds of KiB or more)
+ * that would otherwise be copied into the message, out through the
+ * socket, into the bus daemon and out again. The connection must
+ * have negotiated fd passing, see dbus_connection_can_send_type().
+ *
+ * @param iter the append iterator
+ * @param value the bytes to append
+ * @param n_bytes the number of bytes
+ * @param error error to fill in on failure, or #NULL
+ * @returns #FALSE if error set
+ */
+dbus_bool_t
+dbus_message_iter_append_sealed_bytes (DBusMessageIter *iter,
+                                       const void      *value,
+                                       int              n_bytes,
+                                       DBusError       *error)
+{
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+  int fd;
+  dbus_bool_t ret;
+
+  _dbus_return_val_if_fail (_dbus_message_iter_append_check (real), FALSE);
+  _dbus_return_val_if_fail (real->iter_type == DBUS_MESSAGE_ITER_TYPE_WRITER, FALSE);
+  _dbus_return_val_if_fail (value != NULL || n_bytes == 0, FALSE);
+  _dbus_return_val_if_fail (n_bytes >= 0, FALSE);
+  _dbus_return_val_if_error_is_set (error, FALSE);
+
+  if (!_dbus_memfd_create_sealed (value, n_bytes, &fd, error))
+    return FALSE;
+
+  ret = dbus_message_iter_append_basic (iter, DBUS_TYPE_UNIX_FD, &fd);
+  _dbus_close (fd, NULL);
+
+  if (!ret)
+    _DBUS_SET_OOM (error);
 
   return ret;
 }
@@ -2855,11 +4325,241 @@ dbus_message_iter_append_fixed_array (DBusMessageIter *iter,
     }
 #endif
 
+  if (!flatten_tail (real->message))
+    return FALSE;
+
   ret = _dbus_type_writer_write_fixed_multi (&real->u.writer, element_type, value, n_elements);
 
   return ret;
 }
 
+/**
+ * Appends an array of C structs to an array of structs, in one go.
+ * Each member of the C struct described by fields becomes one field
+ * of the D-Bus struct, so fields must match the element type given
+ * to dbus_message_iter_open_container(), and all of them must be
+ * basic types other than #DBUS_TYPE_UNIX_FD. Members have the type
+ * dbus_message_iter_append_basic() takes, so string-like members are
+ * "const char*". For example, to append an array of type "a(isd)":
+ * @code
+ * struct Item { dbus_int32_t id; const char *name; double weight; };
+ * static const DBusStructField item_fields[] = {
+ *   { DBUS_TYPE_INT32, offsetof (struct Item, id) },
+ *   { DBUS_TYPE_STRING, offsetof (struct Item, name) },
+ *   { DBUS_TYPE_DOUBLE, offsetof (struct Item, weight) }
+ * };
+ *
+ * if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(isd)", &array_iter) ||
+ *     !dbus_message_iter_append_struct_array (&array_iter, item_fields, 3,
+ *                                             items, sizeof (items[0]), n_items) ||
+ *     !dbus_message_iter_close_container (&iter, &array_iter))
+ *   fprintf (stderr, "No memory!\n");
+ * @endcode
+ *
+ * This is equivalent to opening, filling and closing a struct
+ * container for each element, but much faster: the message grows
+ * once and the structs are marshalled in a single loop. If the struct
+ * only has fixed-length members, they are copied straight to where
+ * they go in the message, and if the C struct has the same layout as
+ * the message (no padding between or after members, and the
+ * message is in the native byte order) the whole array is copied at
+ * once.
+ *
+ * You may call this function multiple times, and intermix it with
+ * other ways of appending elements, for the same array.
+ *
+ * @todo If this fails due to lack of memory, the message is hosed and
+ * you have to start over building the whole message.
+ *
+ * @param iter the append iterator of the array
+ * @param fields the members of the C struct
+ * @param n_fields the number of members
+ * @param elements the array of C structs
+ * @param element_size the size of one C struct, usually sizeof()
+ * @param n_elements the number of structs to append
+ * @returns #FALSE if not enough memory, or if the array would be too long
+ */
+dbus_bool_t
+dbus_message_iter_append_struct_array (DBusMessageIter       *iter,
+                                       const DBusStructField *fields,
+                                       int                    n_fields,
+                                       const void            *elements,
+                                       size_t                 element_size,
+                                       int                    n_elements)
+{
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+
+  _dbus_return_val_if_fail (_dbus_message_iter_append_check (real), FALSE);
+  _dbus_return_val_if_fail (real->iter_type == DBUS_MESSAGE_ITER_TYPE_WRITER, FALSE);
+  _dbus_return_val_if_fail (real->u.writer.container_type == DBUS_TYPE_ARRAY, FALSE);
+  _dbus_return_val_if_fail (fields != NULL, FALSE);
+  _dbus_return_val_if_fail (n_fields > 0, FALSE);
+  _dbus_return_val_if_fail (elements != NULL || n_elements == 0, FALSE);
+  _dbus_return_val_if_fail (n_elements >= 0, FALSE);
+  _dbus_return_val_if_fail (struct_fields_match_signature (real->u.writer.type_str,
+                                                           real->u.writer.type_pos,
+                                                           fields, n_fields,
+                                                           element_size),
+                            FALSE);
+
+#ifndef DBUS_DISABLE_CHECKS
+  {
+    const unsigned char *element = elements;
+    int i, j;
+
+    for (i = 0; i < n_elements; i++)
+      {
+        for (j = 0; j < n_fields; j++)
+          {
+            const void *member = element + fields[j].offset;
+
+            switch (fields[j].type)
+              {
+              case DBUS_TYPE_BOOLEAN:
+                _dbus_return_val_if_fail (*(const dbus_bool_t *) member == 0 ||
+                                          *(const dbus_bool_t *) member == 1, FALSE);
+                break;
+              case DBUS_TYPE_STRING:
+                _dbus_return_val_if_fail (_dbus_check_is_valid_utf8 (*(const char * const *) member), FALSE);
+                break;
+              case DBUS_TYPE_OBJECT_PATH:
+                _dbus_return_val_if_fail (_dbus_check_is_valid_path (*(const char * const *) member), FALSE);
+                break;
+              case DBUS_TYPE_SIGNATURE:
+                _dbus_return_val_if_fail (_dbus_check_is_valid_signature (*(const char * const *) member), FALSE);
+                break;
+              default:
+                break;
+              }
+          }
+
+        element += element_size;
+      }
+  }
+#endif
+
+  if (!flatten_tail (real->message))
+    return FALSE;
+
+  return _dbus_type_writer_write_struct_multi (&real->u.writer, fields, n_fields,
+                                               elements, element_size, n_elements);
+}
+
+/** Blocks smaller than this are copied as usual, since gathering them would cost more than it saves */
+#define MIN_BORROWED_FIXED_ARRAY_BYTES 4096
+
+/**
+ * Like dbus_message_iter_append_fixed_array(), but borrows the block
+ * instead of copying it into the message. When the message is sent,
+ * the block is written to the socket straight from the caller's
+ * memory, after the rest of the message, which saves a full copy of
+ * large arrays.
+ *
+ * The block must stay valid and unchanged until free_data_func is
+ * called with data, which happens when the message is freed or once
+ * the block has been copied after all. Appending anything else to the
+ * message, or reading it with an iterator before it has been locked
+ * for sending, copies the block into the message and gives it back
+ * right away. Reading a locked message copies it too, but the block
+ * stays borrowed until the message is freed. Blocks smaller than a
+ * few KiB are always copied and given back before this function
+ * returns.
+ *
+ * Room for the copy is reserved in the message in advance, so none of
+ * this can fail later; for big blocks the reserved memory is normally
+ * never touched.
+ *
+ * If this function returns #FALSE, free_data_func is not called and
+ * the caller still owns the block.
+ *
+ * @param iter the append iterator
+ * @param element_type the type of the array elements
+ * @param value the address of the array
+ * @param n_elements the number of elements to append
+ * @param data passed to free_data_func
+ * @param free_data_func function to give the block back, or #NULL
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+dbus_message_iter_append_fixed_array_borrowed (DBusMessageIter  *iter,
+                                               int               element_type,
+                                               const void       *value,
+                                               int               n_elements,
+                                               void             *data,
+                                               DBusFreeFunction  free_data_func)
+{
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+  DBusMessage *message;
+  int alignment;
+  int n_bytes;
+  int body_len;
+
+  _dbus_return_val_if_fail (_dbus_message_iter_append_check (real), FALSE);
+  _dbus_return_val_if_fail (real->iter_type == DBUS_MESSAGE_ITER_TYPE_WRITER, FALSE);
+  _dbus_return_val_if_fail (dbus_type_is_fixed (element_type) && element_type != DBUS_TYPE_UNIX_FD, FALSE);
+  _dbus_return_val_if_fail (real->u.writer.container_type == DBUS_TYPE_ARRAY, FALSE);
+  _dbus_return_val_if_fail (value != NULL, FALSE);
+  _dbus_return_val_if_fail (n_elements >= 0, FALSE);
+  _dbus_return_val_if_fail (n_elements <=
+                            DBUS_MAXIMUM_ARRAY_LENGTH / _dbus_type_get_alignment (element_type),
+                            FALSE);
+
+#ifndef DBUS_DISABLE_CHECKS
+  if (element_type == DBUS_TYPE_BOOLEAN)
+    {
+      const dbus_bool_t * const *bools = value;
+      int i;
+
+      for (i = 0; i < n_elements; i++)
+        {
+          _dbus_return_val_if_fail ((*bools)[i] == 0 || (*bools)[i] == 1, FALSE);
+        }
+    }
+#endif
+
+  message = real->message;
+  if (!flatten_tail (message))
+    return FALSE;
+
+  alignment = _dbus_type_get_alignment (element_type);
+  n_bytes = n_elements * alignment;
+  body_len = _dbus_string_get_length (&message->body);
+
+  /* The block has to go at the very end of the body as it is, so
+   * anything else is copied after all */
+  if (n_bytes < MIN_BORROWED_FIXED_ARRAY_BYTES ||
+      !real->u.writer.enabled ||
+      real->u.writer.value_pos != body_len ||
+      (alignment > 1 && real->u.writer.byte_order != DBUS_COMPILER_BYTE_ORDER))
+    {
+      if (!_dbus_type_writer_write_fixed_multi (&real->u.writer, element_type,
+                                                value, n_elements))
+        return FALSE;
+
+      if (free_data_func != NULL)
+        (* free_data_func) (data);
+
+      return TRUE;
+    }
+
+  if (!_dbus_string_lengthen (&message->body, n_bytes))
+    return FALSE;
+
+  _dbus_string_set_length (&message->body, body_len);
+
+  _dbus_string_init_const_len (&message->tail,
+                               *(const char * const *) value, n_bytes);
+  message->tail_data = data;
+  message->tail_free_func = free_data_func;
+  message->has_tail = TRUE;
+  message->tail_copied = FALSE;
+
+  _dbus_type_writer_skip_fixed_multi (&real->u.writer, element_type,
+                                      n_elements);
+
+  return TRUE;
+}
+
 /**
  * Appends a container-typed value to the message; you are required to
  * append the contents of the container using the returned
@@ -3971,6 +5671,10 @@ _dbus_message_loader_unref (DBusMessageLoader *loader)
                           (DBusForeachFunction) dbus_message_unref,
                           NULL);
       _dbus_list_clear (&loader->messages);
+
+      if (loader->direct_body_message != NULL)
+        dbus_message_unref (loader->direct_body_message);
+
       _dbus_string_free (&loader->data);
       dbus_free (loader);
     }
@@ -4000,9 +5704,17 @@ _dbus_message_loader_get_buffer (DBusMessageLoader  *loader,
 {
   _dbus_assert (!loader->buffer_outstanding);
 
-  *buffer = &loader->data;
+  if (loader->direct_body_message != NULL)
+    *buffer = &loader->direct_body_message->body;
+  else
+    *buffer = &loader->data;
 
   loader->buffer_outstanding = TRUE;
+
+  /* the buffer grows while the transport reads into it */
+#ifdef DBUS_ENABLE_STATS
+  loader->tag_before_buffer = _dbus_memory_push_tag (DBUS_MEMORY_TAG_LOADER);
+#endif
 }
 
 /**
@@ -4019,9 +5731,60 @@ _dbus_message_loader_return_buffer (DBusMessageLoader  *loader,
                                     DBusString         *buffer)
 {
   _dbus_assert (loader->buffer_outstanding);
-  _dbus_assert (buffer == &loader->data);
+  _dbus_assert (buffer == &loader->data ||
+                (loader->direct_body_message != NULL &&
+                 buffer == &loader->direct_body_message->body));
 
   loader->buffer_outstanding = FALSE;
+
+#ifdef DBUS_ENABLE_STATS
+  _dbus_memory_pop_tag (loader->tag_before_buffer);
+#endif
+}
+
+/**
+ * Suggests how many bytes the transport should read into the buffer
+ * from _dbus_message_loader_get_buffer() next.
+ *
+ * Normally this is @p default_max. If the header of an incomplete
+ * message has already been read, the rest of that message can be
+ * read in fewer, larger reads: up to its claimed remaining length,
+ * but never more than the bytes already received, so that a peer
+ * can't make us allocate much more memory than it has sent just by
+ * claiming a large message. While a large body is being read directly
+ * into its message, reads stop exactly at the end of the body.
+ *
+ * @param loader the loader.
+ * @param default_max the transport's usual read size
+ * @returns the number of bytes to try to read
+ */
+int
+_dbus_message_loader_get_max_to_read (DBusMessageLoader *loader,
+                                      int                default_max)
+{
+  int have;
+  int remaining;
+
+  if (loader->direct_body_message != NULL)
+    {
+      have = _dbus_string_get_length (&loader->direct_body_message->header.data) +
+        _dbus_string_get_length (&loader->direct_body_message->body);
+      remaining = loader->direct_body_len -
+        _dbus_string_get_length (&loader->direct_body_message->body);
+
+      if (remaining <= 0)
+        return default_max;
+
+      return MIN (remaining, MAX (default_max, have));
+    }
+
+  have = _dbus_string_get_length (&loader->data);
+  remaining = loader->pending_message_len - have;
+
+  if (remaining <= default_max)
+    return default_max;
+
+  return MIN (remaining, MAX (default_max, have));
 }
 
 /**
@@ -4114,57 +5877,53 @@ _dbus_message_loader_return_unix_fds(DBusMessageLoader  *loader,
  * this single memory block, and move_len() will just swap the buffers
  * if you're moving the entire buffer replacing the dest string.
  *
- * We could also have the message loader tell the transport how many
- * bytes to read; so it would first ask for some arbitrary number like
- * 256, then if the message was incomplete it would use the
- * header/body len to ask for exactly the size of the message (or
- * blocks the size of a typical kernel buffer for the socket). That
- * way we don't get trailing bytes in the buffer that have to be
- * memmoved. Though I suppose we also don't have a chance of reading a
- * bunch of small messages at once, so the optimization may be stupid.
+ * For large messages, the body is not copied: once the header is in,
+ * the rest is read straight into the message's body, see
+ * start_direct_body().
  *
  * Another approach would be to keep a "start" index into
  * loader->data and only delete it occasionally, instead of after
  * each message is loaded.
- *
- * load_message() returns FALSE if not enough memory OR the loader was corrupted
+ */
+
+/**
+ * Bodies at least this long are read directly into the message
+ * instead of going through loader->data.
+ */
+#define DIRECT_BODY_MIN_LEN (64 * 1024)
+
+/*
+ * Validates the header at the start of loader->data and copies it into
+ * @message. Returns FALSE if not enough memory OR the loader was
+ * corrupted.
  */
 static dbus_bool_t
-load_message (DBusMessageLoader *loader,
-              DBusMessage       *message,
-              int                byte_order,
-              int                fields_array_len,
-              int                header_len,
-              int                body_len)
+load_message_header (DBusMessageLoader *loader,
+                     DBusMessage       *message,
+                     int                byte_order,
+                     int                fields_array_len,
+                     int                header_len,
+                     int                body_len)
 {
-  dbus_bool_t oom;
   DBusValidity validity;
-  const DBusString *type_str;
-  int type_pos;
-  DBusValidationMode mode;
-  dbus_uint32_t n_unix_fds = 0;
-
-  mode = DBUS_VALIDATION_MODE_DATA_IS_UNTRUSTED;
-  
-  oom = FALSE;
 
 #if 0
   _dbus_verbose_bytes_of_string (&loader->data, 0, header_len /* + body_len */);
 #endif
 
-  /* 1. VALIDATE AND COPY OVER HEADER */
   _dbus_assert (_dbus_string_get_length (&message->header.data) == 0);
-  _dbus_assert ((header_len + body_len) <= _dbus_string_get_length (&loader->data));
+  _dbus_assert (header_len <= _dbus_string_get_length (&loader->data));
 
   if (!_dbus_header_load (&message->header,
-                          mode,
+                          DBUS_VALIDATION_MODE_DATA_IS_UNTRUSTED,
                           &validity,
                           byte_order,
                           fields_array_len,
                           header_len,
                           body_len,
                           &loader->data, 0,
-                          _dbus_string_get_length (&loader->data)))
+                          _dbus_string_get_length (&loader->data),
+                          &loader->header_names))
     {
       _dbus_verbose ("Failed to load header for new message code %d\n", validity);
 
@@ -4172,42 +5931,88 @@ load_message (DBusMessageLoader *loader,
          oom errors.  They should use DBUS_VALIDITY_UNKNOWN_OOM_ERROR instead */
       _dbus_assert (validity != DBUS_VALID);
 
-      if (validity == DBUS_VALIDITY_UNKNOWN_OOM_ERROR)
-        oom = TRUE;
-      else
+      if (validity != DBUS_VALIDITY_UNKNOWN_OOM_ERROR)
         {
           loader->corrupted = TRUE;
           loader->corruption_reason = validity;
         }
-      goto failed;
+
+      _dbus_verbose_bytes_of_string (&loader->data, 0, _dbus_string_get_length (&loader->data));
+      return FALSE;
     }
 
   _dbus_assert (validity == DBUS_VALID);
+  return TRUE;
+}
+
+/*
+ * Validates the body, which must already be in message->body, unless
+ * the peer is trusted (see _dbus_message_loader_set_trust_bodies()) or
+ * it is long enough to be left for later (see
+ * _dbus_message_loader_set_deferred_validation_size()), attaches the
+ * message's unix fds and queues it. Returns FALSE if not enough
+ * memory OR the loader was corrupted; on OOM, nothing has changed.
+ */
+static dbus_bool_t
+finish_message (DBusMessageLoader *loader,
+                DBusMessage       *message)
+{
+  DBusValidity validity;
+  const DBusString *type_str;
+  int type_pos;
+  DBusList *link;
+  dbus_uint32_t n_unix_fds = 0;
+  int len;
+  DBusPhase old_phase;
 
   /* 2. VALIDATE BODY */
-  if (mode != DBUS_VALIDATION_MODE_WE_TRUST_THIS_DATA_ABSOLUTELY)
+  if (loader->trust_bodies)
+    {
+      validity = DBUS_VALID;
+    }
+  else if (loader->deferred_validation_size > 0 &&
+      _dbus_string_get_length (&message->body) >=
+      loader->deferred_validation_size)
+    {
+      /* The body already has the length the header claims, which is
+       * all the loader itself relies on */
+      message->body_unvalidated = TRUE;
+      validity = DBUS_VALID;
+    }
+  else
     {
       get_const_signature (&message->header, &type_str, &type_pos);
-      
-      /* Because the bytes_remaining arg is NULL, this validates that the
-       * body is the right length
+
+      /* This validates that the body is the right length, and keeps
+       * the counts of large arrays for dbus_message_iter_get_element_count()
        */
-      validity = _dbus_validate_body_with_reason (type_str,
-                                                  type_pos,
-                                                  byte_order,
-                                                  NULL,
-                                                  &loader->data,
-                                                  header_len,
-                                                  body_len);
-      if (validity != DBUS_VALID)
-        {
-          _dbus_verbose ("Failed to validate message body code %d\n", validity);
+      old_phase = _dbus_phase_enter (DBUS_PHASE_BODY_VALIDATION);
+      validity = _dbus_validate_body_counting_arrays (type_str,
+                                                      type_pos,
+                                                      _dbus_header_get_byte_order (&message->header),
+                                                      &message->body,
+                                                      0,
+                                                      _dbus_string_get_length (&message->body),
+                                                      &message->array_counts);
+      _dbus_phase_leave (old_phase);
+    }
 
-          loader->corrupted = TRUE;
-          loader->corruption_reason = validity;
-          
-          goto failed;
-        }
+  if (validity != DBUS_VALID)
+    {
+      _dbus_verbose ("Failed to validate message body code %d\n", validity);
+
+      loader->corrupted = TRUE;
+      loader->corruption_reason = validity;
+      return FALSE;
+    }
+
+  /* Allocate this first, so that once we have taken the fds nothing
+   * else can fail */
+  link = _dbus_list_alloc_link (message);
+  if (link == NULL)
+    {
+      _dbus_verbose ("Failed to append new message to loader queue\n");
+      return FALSE;
     }
 
   /* 3. COPY OVER UNIX FDS */
@@ -4225,7 +6030,8 @@ load_message (DBusMessageLoader *loader,
 
       loader->corrupted = TRUE;
       loader->corruption_reason = DBUS_INVALID_MISSING_UNIX_FDS;
-      goto failed;
+      _dbus_list_free_link (link);
+      return FALSE;
     }
 
   /* If this was a recycled message there might still be
@@ -4238,8 +6044,8 @@ load_message (DBusMessageLoader *loader,
       if (message->unix_fds == NULL)
         {
           _dbus_verbose ("Failed to allocate file descriptor array\n");
-          oom = TRUE;
-          goto failed;
+          _dbus_list_free_link (link);
+          return FALSE;
         }
 
       message->n_unix_fds_allocated = message->n_unix_fds = n_unix_fds;
@@ -4261,82 +6067,189 @@ load_message (DBusMessageLoader *loader,
 
       loader->corrupted = TRUE;
       loader->corruption_reason = DBUS_INVALID_MISSING_UNIX_FDS;
-      goto failed;
+      _dbus_list_free_link (link);
+      return FALSE;
     }
 
 #endif
 
-  /* 3. COPY OVER BODY AND QUEUE MESSAGE */
+  /* 4. QUEUE MESSAGE */
+  _dbus_list_append_link (&loader->messages, link);
 
-  if (!_dbus_list_append (&loader->messages, message))
-    {
-      _dbus_verbose ("Failed to append new message to loader queue\n");
-      oom = TRUE;
-      goto failed;
-    }
+  /* Remember roughly how big messages on this connection are, so that
+   * the buffer is kept at a size that suits them; see
+   * _dbus_message_loader_queue_messages() */
+  len = _dbus_string_get_length (&message->header.data) +
+    _dbus_string_get_length (&message->body);
+
+  if (len >= loader->recent_message_len)
+    loader->recent_message_len = len;
+  else
+    loader->recent_message_len -= (loader->recent_message_len - len) / 8;
+
+  _DBUS_TRACE4 (message__received,
+                dbus_message_get_serial (message),
+                dbus_message_get_type (message),
+                _dbus_string_get_length (&message->header.data),
+                _dbus_string_get_length (&message->body));
+
+  _dbus_verbose ("Loaded message %p\n", message);
+
+  return TRUE;
+}
+
+/*
+ * Loads a message that is entirely in loader->data, and removes it from
+ * there. Returns FALSE if not enough memory OR the loader was corrupted.
+ */
+static dbus_bool_t
+load_message (DBusMessageLoader *loader,
+              DBusMessage       *message,
+              int                byte_order,
+              int                fields_array_len,
+              int                header_len,
+              int                body_len)
+{
+  /* 1. VALIDATE AND COPY OVER HEADER */
+  _dbus_assert ((header_len + body_len) <= _dbus_string_get_length (&loader->data));
+
+  if (!load_message_header (loader, message, byte_order, fields_array_len,
+                            header_len, body_len))
+    return FALSE;
 
   _dbus_assert (_dbus_string_get_length (&message->body) == 0);
-  _dbus_assert (_dbus_string_get_length (&loader->data) >=
-                (header_len + body_len));
+
+  use_pooled_body (message, body_len);
 
   if (!_dbus_string_copy_len (&loader->data, header_len, body_len, &message->body, 0))
     {
       _dbus_verbose ("Failed to move body into new message\n");
-      oom = TRUE;
-      goto failed;
+      return FALSE;
+    }
+
+  if (!finish_message (loader, message))
+    return FALSE;
+
+  _dbus_string_delete (&loader->data, 0, header_len + body_len);
+
+  _dbus_assert (_dbus_string_get_length (&message->header.data) == header_len);
+  _dbus_assert (_dbus_string_get_length (&message->body) == body_len);
+  _dbus_assert (!loader->corrupted);
+  _dbus_assert (loader->messages != NULL);
+  _dbus_assert (_dbus_list_find_last (&loader->messages, message) != NULL);
+
+  return TRUE;
+}
+
+/*
+ * Called when loader->data starts with the complete header of a message
+ * whose body is large and not all here yet. From now on the transport
+ * reads into the message's own body, so the body is never copied out of
+ * loader->data as a whole. Returns FALSE if not enough memory OR the
+ * loader was corrupted; on OOM, nothing has changed.
+ */
+static dbus_bool_t
+start_direct_body (DBusMessageLoader *loader,
+                   int                byte_order,
+                   int                fields_array_len,
+                   int                header_len,
+                   int                body_len)
+{
+  DBusMessage *message;
+  int have;
+
+  _dbus_assert (loader->direct_body_message == NULL);
+  _dbus_assert (!loader->buffer_outstanding);
+
+  have = _dbus_string_get_length (&loader->data);
+  _dbus_assert (have >= header_len);
+  _dbus_assert (have < header_len + body_len);
+
+  message = dbus_message_new_empty_header ();
+  if (message == NULL)
+    return FALSE;
+
+  if (!load_message_header (loader, message, byte_order, fields_array_len,
+                            header_len, body_len))
+    {
+      dbus_message_unref (message);
+      return FALSE;
+    }
+
+  use_pooled_body (message, body_len);
+
+  /* what we have of the body so far */
+  if (!_dbus_string_copy_len (&loader->data, header_len, have - header_len,
+                              &message->body, 0))
+    {
+      dbus_message_unref (message);
+      return FALSE;
     }
 
-  _dbus_string_delete (&loader->data, 0, header_len + body_len);
+  _dbus_string_set_length (&loader->data, 0);
+
+  loader->direct_body_message = message;
+  loader->direct_body_len = body_len;
 
-  /* don't waste more than 2k of memory */
-  _dbus_string_compact (&loader->data, 2048);
+  return TRUE;
+}
 
-  _dbus_assert (_dbus_string_get_length (&message->header.data) == header_len);
-  _dbus_assert (_dbus_string_get_length (&message->body) == body_len);
+/*
+ * Queues the message from start_direct_body() if its body is complete.
+ * Returns FALSE if not enough memory OR the loader was corrupted.
+ */
+static dbus_bool_t
+finish_direct_body (DBusMessageLoader *loader)
+{
+  DBusMessage *message = loader->direct_body_message;
+  int have;
 
-  _dbus_verbose ("Loaded message %p\n", message);
+  _dbus_assert (message != NULL);
+  _dbus_assert (!loader->buffer_outstanding);
 
-  _dbus_assert (!oom);
-  _dbus_assert (!loader->corrupted);
-  _dbus_assert (loader->messages != NULL);
-  _dbus_assert (_dbus_list_find_last (&loader->messages, message) != NULL);
+  have = _dbus_string_get_length (&message->body);
 
-  return TRUE;
+  if (have < loader->direct_body_len)
+    return TRUE;
 
- failed:
+  /* A caller that ignored _dbus_message_loader_get_max_to_read() might
+   * have read past the end of the body; that belongs to the next
+   * message. Nothing else is read into loader->data in the meantime.
+   */
+  if (have > loader->direct_body_len)
+    {
+      _dbus_assert (_dbus_string_get_length (&loader->data) == 0);
 
-  /* Clean up */
+      if (!_dbus_string_move_len (&message->body, loader->direct_body_len,
+                                  have - loader->direct_body_len,
+                                  &loader->data, 0))
+        return FALSE;
+    }
 
-  /* does nothing if the message isn't in the list */
-  _dbus_list_remove_last (&loader->messages, message);
-  
-  if (oom)
-    _dbus_assert (!loader->corrupted);
-  else
-    _dbus_assert (loader->corrupted);
+  if (!finish_message (loader, message))
+    return FALSE;
 
-  _dbus_verbose_bytes_of_string (&loader->data, 0, _dbus_string_get_length (&loader->data));
+  loader->direct_body_message = NULL;
+  loader->direct_body_len = 0;
 
-  return FALSE;
+  return TRUE;
 }
 
-/**
- * Converts buffered data into messages, if we have enough data.  If
- * we don't have enough data, does nothing.
- *
- * @todo we need to check that the proper named header fields exist
- * for each message type.
- *
- * @todo If a message has unknown type, we should probably eat it
- * right here rather than passing it out to applications.  However
- * it's not an error to see messages of unknown type.
- *
- * @param loader the loader.
- * @returns #TRUE if we had enough memory to finish.
- */
-dbus_bool_t
-_dbus_message_loader_queue_messages (DBusMessageLoader *loader)
+static dbus_bool_t
+queue_messages (DBusMessageLoader *loader)
 {
+  loader->pending_message_len = 0;
+
+  if (loader->direct_body_message != NULL)
+    {
+      if (!finish_direct_body (loader))
+        return loader->corrupted;
+
+      /* still waiting for the rest of the body */
+      if (loader->direct_body_message != NULL)
+        return TRUE;
+    }
+
   while (!loader->corrupted &&
          _dbus_string_get_length (&loader->data) >= DBUS_MINIMUM_HEADER_SIZE)
     {
@@ -4383,6 +6296,17 @@ _dbus_message_loader_queue_messages (DBusMessageLoader *loader)
               loader->corrupted = TRUE;
               loader->corruption_reason = validity;
             }
+          else if (body_len >= DIRECT_BODY_MIN_LEN &&
+                   _dbus_string_get_length (&loader->data) >= header_len)
+            {
+              if (!start_direct_body (loader, byte_order, fields_array_len,
+                                      header_len, body_len))
+                return loader->corrupted;
+            }
+          else
+            {
+              loader->pending_message_len = header_len + body_len;
+            }
           return TRUE;
         }
     }
@@ -4390,6 +6314,87 @@ _dbus_message_loader_queue_messages (DBusMessageLoader *loader)
   return TRUE;
 }
 
+/**
+ * Converts buffered data into messages, if we have enough data.  If
+ * we don't have enough data, does nothing.
+ *
+ * @todo we need to check that the proper named header fields exist
+ * for each message type.
+ *
+ * @todo If a message has unknown type, we should probably eat it
+ * right here rather than passing it out to applications.  However
+ * it's not an error to see messages of unknown type.
+ *
+ * @param loader the loader.
+ * @returns #TRUE if we had enough memory to finish.
+ */
+dbus_bool_t
+_dbus_message_loader_queue_messages (DBusMessageLoader *loader)
+{
+  dbus_bool_t retval;
+  int max_waste;
+
+  retval = queue_messages (loader);
+
+  /* Don't waste more than 2k of memory, or twice what recent messages
+   * needed, or what the incomplete message will need anyway, whichever
+   * is most. Compacting once per batch, with room for messages like the
+   * recent ones, avoids shrinking and regrowing the buffer for every
+   * message in a burst; decaying recent_message_len gives back the
+   * space used for an occasional large message.
+   */
+  max_waste = MAX (2048, 2 * loader->recent_message_len);
+  max_waste = MAX (max_waste, loader->pending_message_len);
+  _dbus_string_compact (&loader->data, max_waste);
+
+  return retval;
+}
+
+/**
+ * Gives back all the memory the loader's buffers hold beyond the data
+ * in them, including the room _dbus_message_loader_queue_messages()
+ * keeps for the next messages. Meant for connections that have gone
+ * quiet; the next read has to grow the buffers again.
+ *
+ * @param loader the loader.
+ */
+void
+_dbus_message_loader_trim (DBusMessageLoader *loader)
+{
+  if (!loader->buffer_outstanding)
+    _dbus_string_compact (&loader->data, 0);
+
+#ifdef HAVE_UNIX_FD_PASSING
+  if (!loader->unix_fds_outstanding && loader->n_unix_fds == 0)
+    {
+      dbus_free (loader->unix_fds);
+      loader->unix_fds = NULL;
+      loader->n_unix_fds_allocated = 0;
+    }
+#endif
+}
+
+/**
+ * Gets how much memory the loader's buffers hold, not counting
+ * messages it has already loaded or is reading a large body into.
+ *
+ * @param loader the loader.
+ * @returns the number of bytes allocated
+ */
+int
+_dbus_message_loader_get_buffer_bytes (DBusMessageLoader *loader)
+{
+  int bytes;
+
+  bytes = _dbus_string_get_allocated (&loader->data);
+
+#ifdef HAVE_UNIX_FD_PASSING
+  bytes += loader->n_unix_fds_allocated * sizeof (loader->unix_fds[0]);
+#endif
+
+  return bytes;
+}
+
 /**
  * Peeks at first loaded message, returns #NULL if no messages have
  * been queued.
@@ -4541,6 +6546,48 @@ _dbus_message_loader_get_max_message_unix_fds (DBusMessageLoader  *loader)
   return loader->max_message_unix_fds;
 }
 
+/**
+ * Leaves the bodies of messages of at least @p size bytes unvalidated;
+ * they must be checked with _dbus_message_validate_deferred_body()
+ * before anything reads them. This is for a router that passes most
+ * bodies on untouched. 0, the default, validates every body.
+ *
+ * @param loader the loader
+ * @param size the smallest body left unvalidated, or 0
+ */
+void
+_dbus_message_loader_set_deferred_validation_size (DBusMessageLoader *loader,
+                                                   long               size)
+{
+  loader->deferred_validation_size = size;
+}
+
+/**
+ * Sets whether message bodies are trusted to be valid, and so not
+ * validated. Headers are still validated in full.
+ *
+ * @param loader the loader
+ * @param trust #TRUE to skip validating bodies
+ */
+void
+_dbus_message_loader_set_trust_bodies (DBusMessageLoader *loader,
+                                       dbus_bool_t        trust)
+{
+  loader->trust_bodies = trust != FALSE;
+}
+
+/**
+ * Gets the value set by _dbus_message_loader_set_trust_bodies().
+ *
+ * @param loader the loader
+ * @returns #TRUE if bodies are not validated
+ */
+dbus_bool_t
+_dbus_message_loader_get_trust_bodies (DBusMessageLoader *loader)
+{
+  return loader->trust_bodies;
+}
+
 /**
  * Return how many file descriptors are pending in the loader
  *
@@ -4782,6 +6829,10 @@ dbus_message_marshal (DBusMessage  *msg,
   if (!_dbus_string_copy (&(msg->body), 0, &tmp, *len_p))
     goto fail;
 
+  if (msg->has_tail &&
+      !_dbus_string_copy (&msg->tail, 0, &tmp, _dbus_string_get_length (&tmp)))
+    goto fail;
+
   *len_p = _dbus_string_get_length (&tmp);
 
   if (!_dbus_string_steal_data (&tmp, marshalled_data_p))
@@ -4803,6 +6854,125 @@ dbus_message_marshal (DBusMessage  *msg,
   return FALSE;
 }
 
+/**
+ * Like dbus_message_marshal(), but writes the marshalled form into a
+ * buffer provided by the caller instead of allocating one, so it needs
+ * no memory at all.
+ *
+ * The size of the marshalled form is always stored in len_p. If
+ * buffer_len is smaller than that, nothing is written and #FALSE is
+ * returned; passing a #NULL buffer and a buffer_len of 0 is the way
+ * to ask how big the buffer needs to be.
+ *
+ * @param msg the DBusMessage
+ * @param buffer where to write the marshalled form, or #NULL
+ * @param buffer_len the size of buffer
+ * @param len_p the location to save the length of the marshalled form to
+ * @returns #FALSE if buffer is too small
+ */
+dbus_bool_t
+dbus_message_marshal_into (DBusMessage  *msg,
+                           char         *buffer,
+                           int           buffer_len,
+                           int          *len_p)
+{
+  dbus_bool_t was_locked;
+  int header_len;
+  int body_len;
+
+  _dbus_return_val_if_fail (msg != NULL, FALSE);
+  _dbus_return_val_if_fail (buffer != NULL || buffer_len == 0, FALSE);
+  _dbus_return_val_if_fail (buffer_len >= 0, FALSE);
+  _dbus_return_val_if_fail (len_p != NULL, FALSE);
+
+  /* Ensure the message is locked, to ensure the length header is filled in. */
+  was_locked = msg->locked;
+
+  if (!was_locked)
+    dbus_message_lock (msg);
+
+  *len_p = _dbus_message_get_size (msg);
+
+  if (*len_p > buffer_len)
+    {
+      if (!was_locked)
+        msg->locked = FALSE;
+
+      return FALSE;
+    }
+
+  header_len = _dbus_string_get_length (&msg->header.data);
+  body_len = _dbus_string_get_length (&msg->body);
+
+  memcpy (buffer, _dbus_string_get_const_data (&msg->header.data),
+          header_len);
+  memcpy (buffer + header_len, _dbus_string_get_const_data (&msg->body),
+          body_len);
+
+  if (msg->has_tail)
+    memcpy (buffer + header_len + body_len,
+            _dbus_string_get_const_data (&msg->tail),
+            _dbus_string_get_length (&msg->tail));
+
+  if (!was_locked)
+    msg->locked = FALSE;
+
+  return TRUE;
+}
+
+/**
+ * Gets the marshalled form of a message as the segments it is kept in,
+ * without copying it, for transports that can gather a message from
+ * several pieces of memory. Concatenated, the segments are what
+ * dbus_message_marshal() would return.
+ *
+ * This locks the message, as sending it would, and the segments stay
+ * valid for as long as the caller holds a reference to it.
+ *
+ * @param msg the DBusMessage
+ * @param data array of at least #DBUS_MESSAGE_MAX_SEGMENTS locations to save the start of each segment to
+ * @param lengths array of at least #DBUS_MESSAGE_MAX_SEGMENTS locations to save the length of each segment to
+ * @param n_segments the size of data and lengths
+ * @returns the number of segments
+ */
+int
+dbus_message_marshal_segments (DBusMessage  *msg,
+                               const char  **data,
+                               int          *lengths,
+                               int           n_segments)
+{
+  int n;
+
+  _dbus_return_val_if_fail (msg != NULL, 0);
+  _dbus_return_val_if_fail (data != NULL, 0);
+  _dbus_return_val_if_fail (lengths != NULL, 0);
+  _dbus_return_val_if_fail (n_segments >= DBUS_MESSAGE_MAX_SEGMENTS, 0);
+
+  dbus_message_lock (msg);
+
+  data[0] = _dbus_string_get_const_data (&msg->header.data);
+  lengths[0] = _dbus_string_get_length (&msg->header.data);
+  n = 1;
+
+  if (_dbus_string_get_length (&msg->body) > 0)
+    {
+      data[n] = _dbus_string_get_const_data (&msg->body);
+      lengths[n] = _dbus_string_get_length (&msg->body);
+      n++;
+    }
+
+  if (msg->has_tail)
+    {
+      data[n] = _dbus_string_get_const_data (&msg->tail);
+      lengths[n] = _dbus_string_get_length (&msg->tail);
+      n++;
+    }
+
+  _dbus_assert (n <= DBUS_MESSAGE_MAX_SEGMENTS);
+
+  return n;
+}
+
 /**
  * Demarshal a D-Bus message from the format described in the D-Bus
  * specification.
@@ -4864,6 +7034,180 @@ dbus_message_demarshal (const char *str,
   return NULL;
 }
 
+/**
+ * Like dbus_message_demarshal(), but borrows a large body from str
+ * instead of copying it, in the same way as
+ * dbus_message_iter_append_fixed_array_borrowed(). Only the header,
+ * which is usually small, is copied. A message that is passed on
+ * without reading its arguments is sent straight from str.
+ *
+ * str must stay valid and unchanged until free_data_func is called
+ * with data, which happens when the message is freed or once the body
+ * has been copied after all, because the arguments were read or
+ * appended to. Small bodies, and bodies that would not be 8-byte
+ * aligned in str, are always copied, and str is given back before
+ * this function returns.
+ *
+ * str must hold exactly one whole message, as reported by
+ * dbus_message_demarshal_bytes_needed(). The body is validated here,
+ * as in dbus_message_demarshal().
+ *
+ * If this function returns #NULL, free_data_func is not called and
+ * the caller still owns str.
+ *
+ * @param str the marshalled DBusMessage
+ * @param len the length of str
+ * @param data passed to free_data_func
+ * @param free_data_func function to give str back, or #NULL
+ * @param error the location to save errors to
+ * @returns #NULL if there was an error
+ */
+DBusMessage *
+dbus_message_demarshal_borrowed (const char       *str,
+                                 int               len,
+                                 void             *data,
+                                 DBusFreeFunction  free_data_func,
+                                 DBusError        *error)
+{
+  DBusString input;
+  DBusMessage *msg;
+  DBusValidity validity;
+  const DBusString *type_str;
+  const DBusString *body;
+  const char *body_data;
+  dbus_uint32_t n_unix_fds = 0;
+  dbus_bool_t borrow;
+  int type_pos;
+  int byte_order, fields_array_len, header_len, body_len;
+
+  _dbus_return_val_if_fail (str != NULL, NULL);
+  _dbus_return_val_if_fail (len >= 0, NULL);
+  _dbus_return_val_if_error_is_set (error, NULL);
+
+  msg = NULL;
+  _dbus_string_init_const_len (&input, str, len);
+
+  if (len < DBUS_MINIMUM_HEADER_SIZE)
+    goto fail_incomplete;
+
+  if (!_dbus_header_have_message_untrusted (DBUS_MAXIMUM_MESSAGE_LENGTH,
+                                            &validity,
+                                            &byte_order,
+                                            &fields_array_len,
+                                            &header_len,
+                                            &body_len,
+                                            &input, 0, len))
+    {
+      if (validity == DBUS_VALID)
+        goto fail_incomplete;
+
+      goto fail_corrupt;
+    }
+
+  if (header_len + body_len != len)
+    goto fail_incomplete;
+
+  msg = dbus_message_new_empty_header ();
+  if (msg == NULL)
+    goto fail_oom;
+
+  if (!_dbus_header_load (&msg->header,
+                          DBUS_VALIDATION_MODE_DATA_IS_UNTRUSTED,
+                          &validity,
+                          byte_order,
+                          fields_array_len,
+                          header_len,
+                          body_len,
+                          &input, 0, len, NULL))
+    {
+      if (validity == DBUS_VALIDITY_UNKNOWN_OOM_ERROR)
+        goto fail_oom;
+
+      goto fail_corrupt;
+    }
+
+  /* As in dbus_message_demarshal(), there is nowhere for fds to come
+   * from */
+  _dbus_header_get_field_basic (&msg->header,
+                                DBUS_HEADER_FIELD_UNIX_FDS,
+                                DBUS_TYPE_UINT32,
+                                &n_unix_fds);
+
+  if (n_unix_fds > 0)
+    {
+      validity = DBUS_INVALID_MISSING_UNIX_FDS;
+      goto fail_corrupt;
+    }
+
+  body_data = str + header_len;
+  borrow = body_len >= MIN_BORROWED_FIXED_ARRAY_BYTES &&
+    _DBUS_ALIGN_ADDRESS (body_data, 8) == body_data;
+
+  if (borrow)
+    {
+      /* Reserve room to flatten the body into later, as for any
+       * borrowed tail */
+      if (!_dbus_string_lengthen (&msg->body, body_len))
+        goto fail_oom;
+
+      _dbus_string_set_length (&msg->body, 0);
+      _dbus_string_init_const_len (&msg->tail, body_data, body_len);
+      body = &msg->tail;
+    }
+  else
+    {
+      if (!_dbus_string_copy_len (&input, header_len, body_len,
+                                  &msg->body, 0))
+        goto fail_oom;
+
+      body = &msg->body;
+    }
+
+  get_const_signature (&msg->header, &type_str, &type_pos);
+  validity = _dbus_validate_body_counting_arrays (type_str, type_pos,
+                                                  byte_order, body, 0,
+                                                  body_len,
+                                                  &msg->array_counts);
+
+  if (validity != DBUS_VALID)
+    goto fail_corrupt;
+
+  if (borrow)
+    {
+      msg->tail_data = data;
+      msg->tail_free_func = free_data_func;
+      msg->has_tail = TRUE;
+      msg->tail_copied = FALSE;
+    }
+  else if (free_data_func != NULL)
+    {
+      (* free_data_func) (data);
+    }
+
+  _dbus_string_free (&input);
+  return msg;
+
+ fail_incomplete:
+  dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                  "Message is incomplete or followed by other data");
+  goto fail;
+
+ fail_corrupt:
+  dbus_set_error (error, DBUS_ERROR_INVALID_ARGS, "Message is corrupted (%s)",
+                  _dbus_validity_to_error_message (validity));
+  goto fail;
+
+ fail_oom:
+  _DBUS_SET_OOM (error);
+
+ fail:
+  if (msg != NULL)
+    dbus_message_unref (msg);
+
+  _dbus_string_free (&input);
+  return NULL;
+}
+
 /**
  * Returns the number of bytes required to be in the buffer to demarshal a
  * D-Bus message.
@@ -66,6 +66,19 @@ struct DBusMessageIter
   void *pad3;           /**< Don't use this */
 };
 
+/** Describes one member of a C struct, see dbus_message_iter_append_struct_array() */
+typedef struct DBusStructField DBusStructField;
+
+/**
+ * One member of a C struct whose values are appended or read as a
+ * D-Bus struct field.
+ */
+struct DBusStructField
+{
+  int type;      /**< basic type of the member, which must not be #DBUS_TYPE_UNIX_FD */
+  size_t offset; /**< offset of the member in the C struct, as given by offsetof() */
+};
+
 DBUS_EXPORT
 DBusMessage* dbus_message_new               (int          message_type);
 DBUS_EXPORT
@@ -89,6 +102,9 @@ DBusMessage* dbus_message_new_error_printf  (DBusMessage *reply_to,
                                              const char  *error_format,
 					     ...);
 
+DBUS_EXPORT
+DBusMessage* dbus_message_new_from_template (DBusMessage *template_message);
+
 DBUS_EXPORT
 DBusMessage* dbus_message_copy              (const DBusMessage *message);
 
@@ -240,8 +256,27 @@ DBUS_EXPORT
 void        dbus_message_iter_get_fixed_array  (DBusMessageIter *iter,
                                                 void            *value,
                                                 int             *n_elements);
+DBUS_EXPORT
+dbus_bool_t dbus_message_iter_find_dict_value  (DBusMessageIter *iter,
+                                                const char      *key,
+                                                DBusMessageIter *value);
+DBUS_EXPORT
+int         dbus_message_iter_get_struct_array (DBusMessageIter       *iter,
+                                                const DBusStructField *fields,
+                                                int                    n_fields,
+                                                void                  *elements,
+                                                size_t                 element_size,
+                                                int                    max_elements);
+DBUS_EXPORT
+dbus_bool_t dbus_message_iter_get_sealed_bytes (DBusMessageIter  *iter,
+                                                const void      **value,
+                                                int              *n_bytes,
+                                                DBusError        *error);
 
 
+DBUS_EXPORT
+dbus_bool_t dbus_message_reserve_body            (DBusMessage     *message,
+                                                  int              n_bytes);
 DBUS_EXPORT
 void        dbus_message_iter_init_append        (DBusMessage     *message,
                                                   DBusMessageIter *iter);
@@ -255,6 +290,25 @@ dbus_bool_t dbus_message_iter_append_fixed_array (DBusMessageIter *iter,
                                                   const void      *value,
                                                   int              n_elements);
 DBUS_EXPORT
+dbus_bool_t dbus_message_iter_append_fixed_array_borrowed (DBusMessageIter  *iter,
+                                                           int               element_type,
+                                                           const void       *value,
+                                                           int               n_elements,
+                                                           void             *data,
+                                                           DBusFreeFunction  free_data_func);
+DBUS_EXPORT
+dbus_bool_t dbus_message_iter_append_struct_array (DBusMessageIter       *iter,
+                                                   const DBusStructField *fields,
+                                                   int                    n_fields,
+                                                   const void            *elements,
+                                                   size_t                 element_size,
+                                                   int                    n_elements);
+DBUS_EXPORT
+dbus_bool_t dbus_message_iter_append_sealed_bytes (DBusMessageIter *iter,
+                                                   const void      *value,
+                                                   int              n_bytes,
+                                                   DBusError       *error);
+DBUS_EXPORT
 dbus_bool_t dbus_message_iter_open_container     (DBusMessageIter *iter,
                                                   int              type,
                                                   const char      *contained_signature,
@@ -301,6 +355,26 @@ DBusMessage* dbus_message_demarshal (const char *str,
                                      int         len,
                                      DBusError  *error);
 
+/** The most segments dbus_message_marshal_segments() returns */
+#define DBUS_MESSAGE_MAX_SEGMENTS 3
+
+DBUS_EXPORT
+dbus_bool_t  dbus_message_marshal_into     (DBusMessage  *msg,
+                                            char         *buffer,
+                                            int           buffer_len,
+                                            int          *len_p);
+DBUS_EXPORT
+int          dbus_message_marshal_segments (DBusMessage  *msg,
+                                            const char  **data,
+                                            int          *lengths,
+                                            int           n_segments);
+DBUS_EXPORT
+DBusMessage* dbus_message_demarshal_borrowed (const char       *str,
+                                              int               len,
+                                              void             *data,
+                                              DBusFreeFunction  free_data_func,
+                                              DBusError        *error);
+
 DBUS_EXPORT
 int          dbus_message_demarshal_bytes_needed (const char *str, 
                                                   int len);
@@ -24,11 +24,91 @@
 #include <config.h>
 // major sections of this file are modified code from libassuan, (C) FSF
 #include "dbus-nonce.h"
+#include "dbus-file.h"
 #include "dbus-internals.h"
 #include "dbus-protocol.h"
 #include "dbus-sysdeps.h"
 
 #include <stdio.h>
+#include <string.h>
+
+/*
+ * The nonce file read most recently. A client connecting to a
+ * nonce-tcp server, and the server accepting each connection, read the
+ * same file every time; while it hasn't changed, a stat() is enough.
+ *
+ * Protected by _DBUS_LOCK (nonce)
+ */
+static char *cached_nonce_path = NULL;
+static char cached_nonce[16];
+static DBusFileStamp cached_nonce_stamp;
+
+static void
+shutdown_cached_nonce (void *data)
+{
+  if (!_DBUS_LOCK (nonce))
+    _dbus_assert_not_reached ("global locks were initialized already");
+
+  dbus_free (cached_nonce_path);
+  cached_nonce_path = NULL;
+
+  _DBUS_UNLOCK (nonce);
+}
+
+/* Appends the cached nonce if it was read from fname, which is still
+ * as described by stamp */
+static dbus_bool_t
+lookup_cached_nonce (const DBusString    *fname,
+                     const DBusFileStamp *stamp,
+                     DBusString          *nonce,
+                     dbus_bool_t         *found)
+{
+  dbus_bool_t ret = TRUE;
+
+  *found = FALSE;
+
+  if (!_DBUS_LOCK (nonce))
+    return TRUE;
+
+  if (cached_nonce_path != NULL &&
+      strcmp (cached_nonce_path, _dbus_string_get_const_data (fname)) == 0 &&
+      _dbus_file_stamp_equal (stamp, &cached_nonce_stamp))
+    {
+      *found = TRUE;
+      ret = _dbus_string_append_len (nonce, cached_nonce, sizeof cached_nonce);
+    }
+
+  _DBUS_UNLOCK (nonce);
+  return ret;
+}
+
+/* If there's no memory to remember it, we read the file next time */
+static void
+cache_nonce (const DBusString    *fname,
+             const DBusFileStamp *stamp,
+             const char          *buffer)
+{
+  char *path;
+
+  if (!_DBUS_LOCK (nonce))
+    return;
+
+  if (cached_nonce_path == NULL &&
+      !_dbus_register_shutdown_func (shutdown_cached_nonce, NULL))
+    goto out;
+
+  path = _dbus_strdup (_dbus_string_get_const_data (fname));
+  if (path == NULL)
+    goto out;
+
+  dbus_free (cached_nonce_path);
+  cached_nonce_path = path;
+  memcpy (cached_nonce, buffer, sizeof cached_nonce);
+  cached_nonce_stamp = *stamp;
+
+ out:
+  _DBUS_UNLOCK (nonce);
+}
 
 static dbus_bool_t
 do_check_nonce (DBusSocket fd, const DBusString *nonce, DBusError *error)
@@ -113,11 +193,31 @@ _dbus_read_nonce (const DBusString *fname, DBusString *nonce, DBusError* error)
   FILE *fp;
   char buffer[17];
   size_t nread;
+  DBusFileStamp stamp;
+  dbus_bool_t have_stamp;
 
   buffer[sizeof buffer - 1] = '\0';
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
+  /* stat before reading, so that a change while we read is noticed
+   * next time */
+  have_stamp = _dbus_file_get_stamp (fname, &stamp);
+
+  if (have_stamp)
+    {
+      dbus_bool_t found;
+
+      if (!lookup_cached_nonce (fname, &stamp, nonce, &found))
+        {
+          dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+          return FALSE;
+        }
+
+      if (found)
+        return TRUE;
+    }
+
   _dbus_verbose ("reading nonce from file: %s\n", _dbus_string_get_const_data (fname));
 
 
@@ -145,6 +245,10 @@ _dbus_read_nonce (const DBusString *fname, DBusString *nonce, DBusError* error)
       dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
       return FALSE;
     }
+
+  if (have_stamp && nread == sizeof buffer - 1)
+    cache_nonce (fname, &stamp, buffer);
+
   return TRUE;
 }
 
@@ -51,6 +51,20 @@ static DBusObjectSubtree* _dbus_object_subtree_new   (const char
 static DBusObjectSubtree* _dbus_object_subtree_ref   (DBusObjectSubtree           *subtree);
 static void               _dbus_object_subtree_unref (DBusObjectSubtree           *subtree);
 
+/** Number of recently dispatched paths remembered by the tree */
+#define N_RECENT_PATHS 8
+
+/**
+ * Result of looking up the handlers for an object path that has
+ * no handler registered at exactly that path.
+ */
+typedef struct
+{
+  char              *path;        /**< Object path from the message */
+  DBusObjectSubtree *subtree;     /**< Deepest node covering path, or #NULL */
+  dbus_bool_t        exact_match; /**< Whether subtree is at path itself */
+} DBusRecentPath;
+
 /**
  * Internals of DBusObjectTree
  */
@@ -60,6 +74,10 @@ struct DBusObjectTree
   DBusConnection     *connection; /**< Connection this tree belongs to */
 
   DBusObjectSubtree  *root;       /**< Root of the tree ("/" node) */
+
+  DBusHashTable      *registered; /**< Registered nodes by their full path */
+  DBusRecentPath      recent[N_RECENT_PATHS]; /**< Recent other lookups, most recent first */
+  int                 n_recent;   /**< Number of valid entries in recent */
 };
 
 /**
@@ -78,6 +96,8 @@ struct DBusObjectSubtree
   int                                n_subtrees;          /**< Number of child nodes */
   int                                max_subtrees;        /**< Number of allocated entries in subtrees */
   unsigned int                       invoke_as_fallback : 1; /**< Whether to invoke message_function when child nodes don't handle the message */
+  char                              *path;                /**< Full path while registered, key in the tree's index */
+  char                              *introspect_xml;      /**< Cached reply of the default Introspect handler, or #NULL */
   char                               name[1]; /**< Allocated as large as necessary */
 };
 
@@ -108,12 +128,18 @@ _dbus_object_tree_new (DBusConnection *connection)
   if (tree->root == NULL)
     goto oom;
   tree->root->invoke_as_fallback = TRUE;
+
+  tree->registered = _dbus_hash_table_new (DBUS_HASH_STRING, NULL, NULL);
+  if (tree->registered == NULL)
+    goto oom;
   
   return tree;
 
  oom:
   if (tree)
     {
+      if (tree->root)
+        _dbus_object_subtree_unref (tree->root);
       dbus_free (tree);
     }
 
@@ -150,10 +176,21 @@ _dbus_object_tree_unref (DBusObjectTree *tree)
     {
       _dbus_object_tree_free_all_unlocked (tree);
 
+      _dbus_hash_table_unref (tree->registered);
       dbus_free (tree);
     }
 }
 
+/* The default Introspect reply only lists the node's children, so it
+ * must be forgotten whenever a child is added or removed.
+ */
+static void
+forget_introspect_xml (DBusObjectSubtree *subtree)
+{
+  dbus_free (subtree->introspect_xml);
+  subtree->introspect_xml = NULL;
+}
+
 /** Set to 1 to get a bunch of debug spew about finding the
  * subtree nodes
  */
@@ -301,6 +338,7 @@ find_subtree_recurse (DBusObjectSubtree  *subtree,
 		   sizeof subtree->subtrees[0]);
 	}
       subtree->subtrees[child_pos] = child;
+      forget_introspect_xml (subtree);
 
       if (index_in_parent)
         *index_in_parent = child_pos;
@@ -377,6 +415,75 @@ ensure_subtree (DBusObjectTree *tree,
 
 static char *flatten_path (const char **path);
 
+/* Must be called whenever the set of nodes or handlers changes, since
+ * the remembered subtrees are not referenced and may go away.
+ */
+static void
+forget_recent_paths (DBusObjectTree *tree)
+{
+  while (tree->n_recent > 0)
+    {
+      tree->n_recent -= 1;
+      dbus_free (tree->recent[tree->n_recent].path);
+      tree->recent[tree->n_recent].path = NULL;
+    }
+}
+
+static DBusRecentPath *
+lookup_recent_path (DBusObjectTree *tree,
+                    const char     *path)
+{
+  int i;
+
+  for (i = 0; i < tree->n_recent; i++)
+    {
+      if (strcmp (tree->recent[i].path, path) == 0)
+        {
+          DBusRecentPath found;
+
+          /* Move to the front so the least recently used one is
+           * dropped first */
+          found = tree->recent[i];
+          memmove (&tree->recent[1], &tree->recent[0],
+                   i * sizeof (tree->recent[0]));
+          tree->recent[0] = found;
+
+          return &tree->recent[0];
+        }
+    }
+
+  return NULL;
+}
+
+/* Failure to remember a path is not an error, only a missed
+ * optimization next time.
+ */
+static void
+remember_recent_path (DBusObjectTree    *tree,
+                      const char        *path,
+                      DBusObjectSubtree *subtree,
+                      dbus_bool_t        exact_match)
+{
+  char *copy;
+
+  copy = _dbus_strdup (path);
+  if (copy == NULL)
+    return;
+
+  if (tree->n_recent == N_RECENT_PATHS)
+    {
+      tree->n_recent -= 1;
+      dbus_free (tree->recent[tree->n_recent].path);
+    }
+
+  memmove (&tree->recent[1], &tree->recent[0],
+           tree->n_recent * sizeof (tree->recent[0]));
+  tree->recent[0].path = copy;
+  tree->recent[0].subtree = subtree;
+  tree->recent[0].exact_match = exact_match;
+  tree->n_recent += 1;
+}
+
 /**
  * Registers a new subtree in the global object tree.
  *
@@ -398,32 +505,48 @@ _dbus_object_tree_register (DBusObjectTree              *tree,
                             DBusError                   *error)
 {
   DBusObjectSubtree  *subtree;
+  DBusPreallocatedHash *entry;
+  char *complete_path;
 
   _dbus_assert (tree != NULL);
   _dbus_assert (vtable->message_function != NULL);
   _dbus_assert (path != NULL);
 
+  /* Even a failed attempt may add intermediate nodes */
+  forget_recent_paths (tree);
+
+  complete_path = flatten_path (path);
+  if (complete_path == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  entry = _dbus_hash_table_preallocate_entry (tree->registered);
+  if (entry == NULL)
+    {
+      dbus_free (complete_path);
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
   subtree = ensure_subtree (tree, path);
   if (subtree == NULL)
     {
+      _dbus_hash_table_free_preallocated_entry (tree->registered, entry);
+      dbus_free (complete_path);
       _DBUS_SET_OOM (error);
       return FALSE;
     }
 
   if (subtree->message_function != NULL)
     {
-      if (error != NULL)
-        {
-          char *complete_path = flatten_path (path);
-
-          dbus_set_error (error, DBUS_ERROR_OBJECT_PATH_IN_USE,
-                          "A handler is already registered for %s",
-                          complete_path ? complete_path
-                                        : "(cannot represent path: out of memory!)");
-
-          dbus_free (complete_path);
-        }
+      dbus_set_error (error, DBUS_ERROR_OBJECT_PATH_IN_USE,
+                      "A handler is already registered for %s",
+                      complete_path);
 
+      _dbus_hash_table_free_preallocated_entry (tree->registered, entry);
+      dbus_free (complete_path);
       return FALSE;
     }
 
@@ -432,6 +555,11 @@ _dbus_object_tree_register (DBusObjectTree              *tree,
   subtree->user_data = user_data;
   subtree->invoke_as_fallback = fallback != FALSE;
 
+  _dbus_assert (subtree->path == NULL);
+  subtree->path = complete_path;
+  _dbus_hash_table_insert_string_preallocated (tree->registered, entry,
+                                               subtree->path, subtree);
+
   return TRUE;
 }
 
@@ -460,6 +588,10 @@ unregister_subtree (DBusObjectSubtree                 *subtree,
     {
       subtree->message_function = NULL;
 
+      /* The caller has already removed it from the index */
+      dbus_free (subtree->path);
+      subtree->path = NULL;
+
       *unregister_function_out = subtree->unregister_function;
       *user_data_out = subtree->user_data;
 
@@ -516,6 +648,7 @@ attempt_child_removal (DBusObjectSubtree  *parent,
                (parent->n_subtrees - child_index - 1)
                * sizeof (parent->subtrees[0]));
       parent->n_subtrees -= 1;
+      forget_introspect_xml (parent);
 
       /* ... and free it */
       candidate->parent = NULL;
@@ -625,6 +758,7 @@ void
 _dbus_object_tree_unregister_and_unlock (DBusObjectTree          *tree,
                                          const char             **path)
 {
+  DBusObjectSubtree *subtree;
   dbus_bool_t found_subtree;
   dbus_bool_t continue_removal_attempts;
   DBusObjectPathUnregisterFunction unregister_function;
@@ -638,6 +772,12 @@ _dbus_object_tree_unregister_and_unlock (DBusObjectTree          *tree,
   unregister_function = NULL;
   user_data = NULL;
 
+  forget_recent_paths (tree);
+
+  subtree = lookup_subtree (tree, path);
+  if (subtree != NULL && subtree->path != NULL)
+    _dbus_hash_table_remove_string (tree->registered, subtree->path);
+
   found_subtree = unregister_and_free_path_recurse (tree->root,
                                                     path,
                                                     &continue_removal_attempts,
@@ -705,6 +845,8 @@ free_subtree_recurse (DBusConnection    *connection,
   subtree->message_function = NULL;
   subtree->unregister_function = NULL;
   subtree->user_data = NULL;
+  dbus_free (subtree->path);
+  subtree->path = NULL;
 
   /* Now free ourselves */
   _dbus_object_subtree_unref (subtree);
@@ -719,6 +861,9 @@ free_subtree_recurse (DBusConnection    *connection,
 void
 _dbus_object_tree_free_all_unlocked (DBusObjectTree *tree)
 {
+  forget_recent_paths (tree);
+  _dbus_hash_table_remove_all (tree->registered);
+
   if (tree->root)
     free_subtree_recurse (tree->connection,
                           tree->root);
@@ -772,11 +917,12 @@ _dbus_object_tree_list_registered_unlocked (DBusObjectTree *tree,
 static DBusHandlerResult
 handle_default_introspect_and_unlock (DBusObjectTree          *tree,
                                       DBusMessage             *message,
-                                      const char             **path)
+                                      const char              *object_path)
 {
+  char **path;
   DBusString xml;
   DBusHandlerResult result;
-  char **children;
+  DBusObjectSubtree *subtree;
   int i;
   DBusMessage *reply;
   DBusMessageIter iter;
@@ -823,35 +969,48 @@ handle_default_introspect_and_unlock (DBusObjectTree          *tree,
 
   result = DBUS_HANDLER_RESULT_NEED_MEMORY;
 
-  children = NULL;
-  if (!_dbus_object_tree_list_registered_unlocked (tree, path, &children))
+  path = NULL;
+  if (!_dbus_decompose_path (object_path, strlen (object_path), &path, NULL))
     goto out;
 
-  if (!_dbus_string_append (&xml, DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE))
-    goto out;
-  
-  if (!_dbus_string_append (&xml, "<node>\n"))
-    goto out;
+  subtree = lookup_subtree (tree, (const char **) path);
 
-  i = 0;
-  while (children[i] != NULL)
+  if (subtree != NULL && subtree->introspect_xml != NULL)
+    {
+      v_STRING = subtree->introspect_xml;
+    }
+  else
     {
-      if (!_dbus_string_append_printf (&xml, "  <node name=\"%s\"/>\n",
-                                       children[i]))
+      if (!_dbus_string_append (&xml, DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE))
         goto out;
 
-      ++i;
-    }
+      if (!_dbus_string_append (&xml, "<node>\n"))
+        goto out;
 
-  if (!_dbus_string_append (&xml, "</node>\n"))
-    goto out;
+      for (i = 0; subtree != NULL && i < subtree->n_subtrees; i++)
+        {
+          if (!_dbus_string_append_printf (&xml, "  <node name=\"%s\"/>\n",
+                                           subtree->subtrees[i]->name))
+            goto out;
+        }
+
+      if (!_dbus_string_append (&xml, "</node>\n"))
+        goto out;
+
+      /* Keep it until the node's children change; if that fails we
+       * just generate it again next time */
+      if (subtree != NULL &&
+          _dbus_string_steal_data (&xml, &subtree->introspect_xml))
+        v_STRING = subtree->introspect_xml;
+      else
+        v_STRING = _dbus_string_get_const_data (&xml);
+    }
 
   reply = dbus_message_new_method_return (message);
   if (reply == NULL)
     goto out;
 
   dbus_message_iter_init_append (reply, &iter);
-  v_STRING = _dbus_string_get_const_data (&xml);
   if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &v_STRING))
     goto out;
   
@@ -880,7 +1039,7 @@ handle_default_introspect_and_unlock (DBusObjectTree          *tree,
     }
   
   _dbus_string_free (&xml);
-  dbus_free_string_array (children);
+  dbus_free_string_array (path);
   if (reply)
     dbus_message_unref (reply);
   
@@ -894,6 +1053,11 @@ handle_default_introspect_and_unlock (DBusObjectTree          *tree,
  * number of path elements; that is, message to /foo/bar/baz would go
  * to the handler for /foo/bar before the one for /foo.
  *
+ * Paths with a handler registered at exactly that path are found
+ * in the tree's index; the few most recently dispatched other paths
+ * are remembered until the next registration or unregistration, so
+ * only the first message to a fallback object walks the tree.
+ *
  * @todo thread problems
  *
  * @param tree the global object tree
@@ -906,32 +1070,19 @@ _dbus_object_tree_dispatch_and_unlock (DBusObjectTree          *tree,
                                        DBusMessage             *message,
                                        dbus_bool_t             *found_object)
 {
-  char **path;
+  const char *path;
   dbus_bool_t exact_match;
   DBusList *list;
   DBusList *link;
   DBusHandlerResult result;
   DBusObjectSubtree *subtree;
+  DBusRecentPath *recent;
   
 #if 0
   _dbus_verbose ("Dispatch of message by object path\n");
 #endif
   
-  path = NULL;
-  if (!dbus_message_get_path_decomposed (message, &path))
-    {
-#ifdef DBUS_ENABLE_EMBEDDED_TESTS
-      if (tree->connection)
-#endif
-        {
-          _dbus_verbose ("unlock\n");
-          _dbus_connection_unlock (tree->connection);
-        }
-      
-      _dbus_verbose ("No memory to get decomposed path\n");
-
-      return DBUS_HANDLER_RESULT_NEED_MEMORY;
-    }
+  path = dbus_message_get_path (message);
 
   if (path == NULL)
     {
@@ -948,7 +1099,40 @@ _dbus_object_tree_dispatch_and_unlock (DBusObjectTree          *tree,
     }
   
   /* Find the deepest path that covers the path in the message */
-  subtree = find_handler (tree, (const char**) path, &exact_match);
+  subtree = _dbus_hash_table_lookup_string (tree->registered, path);
+  if (subtree != NULL)
+    {
+      exact_match = TRUE;
+    }
+  else if ((recent = lookup_recent_path (tree, path)) != NULL)
+    {
+      subtree = recent->subtree;
+      exact_match = recent->exact_match;
+    }
+  else
+    {
+      char **decomposed;
+
+      if (!_dbus_decompose_path (path, strlen (path), &decomposed, NULL))
+        {
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+          if (tree->connection)
+#endif
+            {
+              _dbus_verbose ("unlock\n");
+              _dbus_connection_unlock (tree->connection);
+            }
+
+          _dbus_verbose ("No memory to get decomposed path\n");
+
+          return DBUS_HANDLER_RESULT_NEED_MEMORY;
+        }
+
+      subtree = find_handler (tree, (const char**) decomposed, &exact_match);
+      dbus_free_string_array (decomposed);
+
+      remember_recent_path (tree, path, subtree, exact_match);
+    }
   
   if (found_object)
     *found_object = !!subtree;
@@ -1039,8 +1223,7 @@ _dbus_object_tree_dispatch_and_unlock (DBusObjectTree          *tree,
     {
       /* This hardcoded default handler does a minimal Introspect()
        */
-      result = handle_default_introspect_and_unlock (tree, message,
-                                                     (const char**) path);
+      result = handle_default_introspect_and_unlock (tree, message, path);
     }
   else
     {
@@ -1059,8 +1242,6 @@ _dbus_object_tree_dispatch_and_unlock (DBusObjectTree          *tree,
       _dbus_object_subtree_unref (link->data);
       _dbus_list_remove_link (&list, link);
     }
-  
-  dbus_free_string_array (path);
 
   return result;
 }
@@ -1189,6 +1370,7 @@ _dbus_object_subtree_unref (DBusObjectSubtree *subtree)
       _dbus_assert (subtree->unregister_function == NULL);
       _dbus_assert (subtree->message_function == NULL);
 
+      dbus_free (subtree->introspect_xml);
       dbus_free (subtree->subtrees);
       dbus_free (subtree);
     }
@@ -1592,6 +1774,59 @@ do_test_dispatch (DBusObjectTree *tree,
   return FALSE;
 }
 
+static dbus_bool_t
+do_test_introspect (DBusObjectTree *tree,
+                    const char    **path,
+                    const char     *child,
+                    dbus_bool_t     expect_child)
+{
+  DBusMessage *message;
+  DBusObjectSubtree *subtree;
+  DBusHandlerResult result;
+  char *flat;
+
+  message = NULL;
+
+  flat = flatten_path (path);
+  if (flat == NULL)
+    goto oom;
+
+  message = dbus_message_new_method_call (NULL,
+                                          flat,
+                                          DBUS_INTERFACE_INTROSPECTABLE,
+                                          "Introspect");
+  dbus_free (flat);
+  if (message == NULL)
+    goto oom;
+
+  /* so that a reply can be created */
+  dbus_message_set_serial (message, 1);
+
+  result = _dbus_object_tree_dispatch_and_unlock (tree, message, NULL);
+  if (result == DBUS_HANDLER_RESULT_NEED_MEMORY)
+    goto oom;
+
+  _dbus_assert (result == DBUS_HANDLER_RESULT_HANDLED);
+
+  /* The reply isn't sent without a connection, so look at what was
+   * cached instead, if there was memory to cache it */
+  subtree = lookup_subtree (tree, path);
+  _dbus_assert (subtree != NULL);
+
+  if (subtree->introspect_xml != NULL)
+    _dbus_assert ((strstr (subtree->introspect_xml, child) != NULL) ==
+                  expect_child);
+
+  dbus_message_unref (message);
+
+  return TRUE;
+
+ oom:
+  if (message)
+    dbus_message_unref (message);
+  return FALSE;
+}
+
 static size_t
 string_array_length (const char **array)
 {
@@ -1694,6 +1929,7 @@ object_tree_test_iteration (void *data)
   const char *path12[] = { "blah", "a", "d", NULL };
   const char *path13[] = { "blah", "b", "d", NULL };
   const char *path14[] = { "blah", "c", "d", NULL };
+  const char *path15[] = { "foo", "bar", "baz", "unregistered", NULL };
   DBusObjectPathVTable test_vtable = { NULL, test_message_function, NULL };
   DBusObjectTree *tree;
   TreeTestData tree_test_data[9];
@@ -2302,6 +2538,37 @@ object_tree_test_iteration (void *data)
     goto out;
   if (!do_test_dispatch (tree, path8, 8, tree_test_data, _DBUS_N_ELEMENTS (tree_test_data)))
     goto out;
+
+  /* Only fallbacks cover path15; the second dispatch uses the
+   * remembered lookup, which must not survive re-registering path3 */
+  if (!do_test_dispatch (tree, path15, 3, tree_test_data, _DBUS_N_ELEMENTS (tree_test_data)))
+    goto out;
+  if (!do_test_dispatch (tree, path15, 3, tree_test_data, _DBUS_N_ELEMENTS (tree_test_data)))
+    goto out;
+
+  _dbus_object_tree_unregister_and_unlock (tree, path3);
+  _dbus_assert (tree_test_data[3].handler_unregistered);
+  if (!do_register (tree, path3, FALSE, 3, tree_test_data))
+    goto out;
+
+  if (!do_test_dispatch (tree, path15, 2, tree_test_data, _DBUS_N_ELEMENTS (tree_test_data)))
+    goto out;
+  if (!do_test_dispatch (tree, path3, 3, tree_test_data, _DBUS_N_ELEMENTS (tree_test_data)))
+    goto out;
+
+  /* The default Introspect reply is cached until a child goes away */
+  if (!do_test_introspect (tree, path2, "\"boo\"", TRUE))
+    goto out;
+  if (!do_test_introspect (tree, path2, "\"boo\"", TRUE))
+    goto out;
+
+  _dbus_object_tree_unregister_and_unlock (tree, path4);
+  _dbus_assert (lookup_subtree (tree, path2)->introspect_xml == NULL);
+
+  if (!do_test_introspect (tree, path2, "\"boo\"", FALSE))
+    goto out;
+  if (!do_test_introspect (tree, path2, "\"baz\"", TRUE))
+    goto out;
   
  out:
   if (tree)
@@ -34,7 +34,15 @@ DBUS_BEGIN_DECLS
 dbus_bool_t      _dbus_pending_call_is_timeout_added_unlocked    (DBusPendingCall    *pending);
 void             _dbus_pending_call_set_timeout_added_unlocked   (DBusPendingCall    *pending,
                                                                   dbus_bool_t         is_added);
-DBusTimeout    * _dbus_pending_call_get_timeout_unlocked         (DBusPendingCall    *pending);
+DBusList       * _dbus_pending_call_get_timeout_queue_link_unlocked (DBusPendingCall *pending);
+void             _dbus_pending_call_set_timeout_queue_link_unlocked (DBusPendingCall *pending,
+                                                                     DBusList        *link,
+                                                                     long             tv_sec,
+                                                                     long             tv_usec);
+void             _dbus_pending_call_get_deadline_unlocked        (DBusPendingCall    *pending,
+                                                                  long               *tv_sec,
+                                                                  long               *tv_usec);
+int              _dbus_pending_call_get_timeout_interval_unlocked (DBusPendingCall   *pending);
 dbus_uint32_t    _dbus_pending_call_get_reply_serial_unlocked    (DBusPendingCall    *pending);
 void             _dbus_pending_call_set_reply_serial_unlocked    (DBusPendingCall    *pending,
                                                                   dbus_uint32_t       serial);
@@ -44,17 +52,22 @@ dbus_bool_t      _dbus_pending_call_get_completed_unlocked       (DBusPendingCal
 void             _dbus_pending_call_complete                     (DBusPendingCall    *pending);
 void             _dbus_pending_call_set_reply_unlocked           (DBusPendingCall    *pending,
                                                                   DBusMessage        *message);
-void             _dbus_pending_call_queue_timeout_error_unlocked (DBusPendingCall    *pending,
+dbus_bool_t      _dbus_pending_call_queue_timeout_error_unlocked (DBusPendingCall    *pending,
                                                                   DBusConnection     *connection);
+dbus_bool_t      _dbus_pending_call_build_timeout_error_unlocked (DBusPendingCall    *pending);
+DBusList       * _dbus_pending_call_new_timeout_error_link       (void);
+dbus_bool_t      _dbus_pending_call_get_reply_queued_unlocked    (DBusPendingCall    *pending);
+dbus_bool_t      _dbus_pending_call_can_route_reply_unlocked     (DBusPendingCall    *pending);
+dbus_bool_t      _dbus_pending_call_has_reply_unlocked           (DBusPendingCall    *pending);
+void             _dbus_pending_call_route_reply_link_unlocked    (DBusPendingCall    *pending,
+                                                                  DBusList           *link);
+void             _dbus_pending_call_set_reply_queued_unlocked    (DBusPendingCall    *pending,
+                                                                  dbus_bool_t         is_queued);
 void             _dbus_pending_call_set_reply_serial_unlocked    (DBusPendingCall    *pending,
                                                                   dbus_uint32_t       serial);
-dbus_bool_t      _dbus_pending_call_set_timeout_error_unlocked   (DBusPendingCall    *pending,
-                                                                  DBusMessage        *message,
-                                                                  dbus_uint32_t       serial);
 DBUS_PRIVATE_EXPORT
 DBusPendingCall* _dbus_pending_call_new_unlocked                 (DBusConnection     *connection,
-                                                                  int                 timeout_milliseconds,
-                                                                  DBusTimeoutHandler  timeout_handler);
+                                                                  int                 timeout_milliseconds);
 DBUS_PRIVATE_EXPORT
 DBusPendingCall* _dbus_pending_call_ref_unlocked                 (DBusPendingCall    *pending);
 DBUS_PRIVATE_EXPORT
@@ -69,16 +69,40 @@ struct DBusPendingCall
 
   DBusConnection *connection;                     /**< Connections we're associated with */
   DBusMessage *reply;                             /**< Reply (after we've received it) */
-  DBusTimeout *timeout;                           /**< Timeout */
+  int timeout_milliseconds;                       /**< Reply timeout, or #DBUS_TIMEOUT_INFINITE */
 
-  DBusList *timeout_link;                         /**< Preallocated timeout response */
+  DBusList *timeout_link;                         /**< Timeout error reply, once it has been built */
+  DBusList *timeout_queue_link;                   /**< Link in the connection's queue of timeouts, while added */
+  long deadline_tv_sec;                           /**< Monotonic time when the timeout expires, while added */
+  long deadline_tv_usec;                          /**< Microseconds part of deadline_tv_sec */
   
   dbus_uint32_t reply_serial;                     /**< Expected serial of reply */
 
+  DBusPendingCallQueue *completion_queue;         /**< Queue to put the call on when it completes, or #NULL */
+  DBusList *completion_link;                      /**< Preallocated link in completion_queue */
+
   unsigned int completed : 1;                     /**< TRUE if completed */
   unsigned int timeout_added : 1;                 /**< Have added the timeout */
+  unsigned int reply_queued : 1;                  /**< A reply may be waiting in the connection's incoming queue */
+  unsigned int timeout_error_used : 1;            /**< The timeout error has been handed over */
 };
 
+/**
+ * Implementation details of #DBusPendingCallQueue - all fields are private.
+ */
+struct DBusPendingCallQueue
+{
+  DBusAtomic refcount;                            /**< reference count */
+  DBusCMutex *mutex;                              /**< Protects the other fields */
+  DBusList *calls;                                /**< Completed #DBusPendingCall, oldest first, each with a ref */
+  DBusWakeupMainFunction wakeup_function;         /**< Called when a call is added */
+  void *wakeup_data;                              /**< Data for wakeup_function */
+  DBusFreeFunction free_wakeup_data;              /**< Frees wakeup_data */
+};
+
+static void pending_call_queue_push (DBusPendingCallQueue *queue,
+                                     DBusPendingCall      *pending);
+
 static void
 _dbus_pending_call_trace_ref (DBusPendingCall *pending_call,
     int old_refcount,
@@ -95,6 +119,104 @@ _dbus_pending_call_trace_ref (DBusPendingCall *pending_call,
 
 static dbus_int32_t notify_user_data_slot = -1;
 
+/*
+ * Freed pending calls are kept for reuse, so that a steady stream of
+ * method calls doesn't allocate one each time. A cached call keeps its
+ * data slot array, which every call with a notify function needs, and
+ * its ref on notify_user_data_slot, so that the slot isn't freed and
+ * allocated again for each call.
+ */
+
+/** Most freed pending calls kept for reuse */
+#define MAX_PENDING_CALL_CACHE_SIZE 32
+
+/* Protected by _DBUS_LOCK (pending_call_cache) */
+static DBusPendingCall *pending_call_cache[MAX_PENDING_CALL_CACHE_SIZE];
+static int pending_call_cache_count = 0;
+static dbus_bool_t pending_call_cache_shutdown_registered = FALSE;
+
+static void
+pending_call_cache_shutdown (void *data)
+{
+  if (!_DBUS_LOCK (pending_call_cache))
+    _dbus_assert_not_reached ("we would have initialized global locks "
+        "before registering a shutdown function");
+
+  while (pending_call_cache_count > 0)
+    {
+      DBusPendingCall *pending;
+
+      pending_call_cache_count -= 1;
+      pending = pending_call_cache[pending_call_cache_count];
+      pending_call_cache[pending_call_cache_count] = NULL;
+
+      _dbus_data_slot_list_free (&pending->slot_list);
+      dbus_free (pending);
+      dbus_pending_call_free_data_slot (&notify_user_data_slot);
+    }
+
+  pending_call_cache_shutdown_registered = FALSE;
+
+  _DBUS_UNLOCK (pending_call_cache);
+}
+
+static DBusPendingCall *
+pending_call_get_cached (void)
+{
+  DBusPendingCall *pending = NULL;
+
+  if (!_DBUS_LOCK (pending_call_cache))
+    return NULL;
+
+  if (pending_call_cache_count > 0)
+    {
+      pending_call_cache_count -= 1;
+      pending = pending_call_cache[pending_call_cache_count];
+      pending_call_cache[pending_call_cache_count] = NULL;
+    }
+
+  _DBUS_UNLOCK (pending_call_cache);
+
+  return pending;
+}
+
+/* Frees a pending call whose data slots have been cleared and whose
+ * other resources are already released, or keeps it for reuse */
+static void
+pending_call_cache_or_free (DBusPendingCall *pending)
+{
+  if (_dbus_disable_mem_pools () || !_DBUS_LOCK (pending_call_cache))
+    goto free;
+
+  if (!pending_call_cache_shutdown_registered)
+    {
+      if (!_dbus_register_shutdown_func (pending_call_cache_shutdown, NULL))
+        {
+          _DBUS_UNLOCK (pending_call_cache);
+          goto free;
+        }
+
+      pending_call_cache_shutdown_registered = TRUE;
+    }
+
+  if (pending_call_cache_count < MAX_PENDING_CALL_CACHE_SIZE)
+    {
+      pending_call_cache[pending_call_cache_count] = pending;
+      pending_call_cache_count += 1;
+      pending = NULL;
+    }
+
+  _DBUS_UNLOCK (pending_call_cache);
+
+  if (pending == NULL)
+    return;
+
+ free:
+  _dbus_data_slot_list_free (&pending->slot_list);
+  dbus_free (pending);
+  dbus_pending_call_free_data_slot (&notify_user_data_slot);
+}
+
 /**
  * Creates a new pending reply object.
  *
@@ -102,59 +224,50 @@ static dbus_int32_t notify_user_data_slot = -1;
  * @param timeout_milliseconds length of timeout, -1 (or
  *  #DBUS_TIMEOUT_USE_DEFAULT) for default,
  *  #DBUS_TIMEOUT_INFINITE for no timeout
- * @param timeout_handler timeout handler, takes pending call as data
  * @returns a new #DBusPendingCall or #NULL if no memory.
  */
 DBusPendingCall*
 _dbus_pending_call_new_unlocked (DBusConnection    *connection,
-                                 int                timeout_milliseconds,
-                                 DBusTimeoutHandler timeout_handler)
+                                 int                timeout_milliseconds)
 {
   DBusPendingCall *pending;
-  DBusTimeout *timeout;
 
   _dbus_assert (timeout_milliseconds >= 0 || timeout_milliseconds == -1);
  
   if (timeout_milliseconds == -1)
     timeout_milliseconds = _DBUS_DEFAULT_TIMEOUT_VALUE;
 
-  if (!dbus_pending_call_allocate_data_slot (&notify_user_data_slot))
-    return NULL;
-  
-  pending = dbus_new0 (DBusPendingCall, 1);
-  
-  if (pending == NULL)
+  pending = pending_call_get_cached ();
+
+  if (pending != NULL)
     {
-      dbus_pending_call_free_data_slot (&notify_user_data_slot);
-      return NULL;
-    }
+      DBusDataSlotList slot_list = pending->slot_list;
 
-  if (timeout_milliseconds != DBUS_TIMEOUT_INFINITE)
+      _DBUS_ZERO (*pending);
+      pending->slot_list = slot_list;
+    }
+  else
     {
-      timeout = _dbus_timeout_new (timeout_milliseconds,
-                                   timeout_handler,
-                                   pending, NULL);  
+      if (!dbus_pending_call_allocate_data_slot (&notify_user_data_slot))
+        return NULL;
+
+      pending = dbus_new0 (DBusPendingCall, 1);
 
-      if (timeout == NULL)
+      if (pending == NULL)
         {
           dbus_pending_call_free_data_slot (&notify_user_data_slot);
-          dbus_free (pending);
           return NULL;
         }
 
-      pending->timeout = timeout;
-    }
-  else
-    {
-      pending->timeout = NULL;
+      _dbus_data_slot_list_init (&pending->slot_list);
     }
 
+  pending->timeout_milliseconds = timeout_milliseconds;
+
   _dbus_atomic_inc (&pending->refcount);
   pending->connection = connection;
   _dbus_connection_ref_unlocked (pending->connection);
 
-  _dbus_data_slot_list_init (&pending->slot_list);
-
   _dbus_pending_call_trace_ref (pending, 0, 1, "new_unlocked");
 
   return pending;
@@ -174,8 +287,11 @@ _dbus_pending_call_set_reply_unlocked (DBusPendingCall *pending,
 {
   if (message == NULL)
     {
+      /* _dbus_pending_call_build_timeout_error_unlocked() succeeded */
+      _dbus_assert (pending->timeout_link != NULL);
       message = pending->timeout_link->data;
       _dbus_list_clear (&pending->timeout_link);
+      pending->timeout_error_used = TRUE;
     }
   else
     dbus_message_ref (message);
@@ -215,6 +331,97 @@ _dbus_pending_call_complete (DBusPendingCall *pending)
       
       (* pending->function) (pending, user_data);
     }
+
+  if (pending->completion_queue != NULL)
+    {
+      DBusPendingCallQueue *queue = pending->completion_queue;
+
+      /* the queue doesn't need us to keep it alive any more, and
+       * mustn't, or a call nobody pops would keep its queue alive */
+      pending->completion_queue = NULL;
+      pending_call_queue_push (queue, pending);
+      dbus_pending_call_queue_unref (queue);
+    }
+}
+
+/**
+ * Creates a timeout error reply, as given to calls that don't get a
+ * reply in time, for a connection to keep in reserve. Its reply
+ * serial is a placeholder, reset when the reserve is used.
+ *
+ * @returns a link holding the reply, or #NULL if no memory
+ */
+DBusList *
+_dbus_pending_call_new_timeout_error_link (void)
+{
+  DBusMessage *reply;
+  DBusList *reply_link;
+  const char *text = "Did not receive a reply. Possible causes include: "
+                     "the remote application did not send a reply, "
+                     "the message bus security policy blocked the reply, "
+                     "the reply timeout expired, or "
+                     "the network connection was broken.";
+
+  reply = dbus_message_new (DBUS_MESSAGE_TYPE_ERROR);
+  if (reply == NULL)
+    return NULL;
+
+  dbus_message_set_no_reply (reply, TRUE);
+
+  if (!dbus_message_set_error_name (reply, DBUS_ERROR_NO_REPLY) ||
+      !dbus_message_set_reply_serial (reply, 1) ||
+      !dbus_message_append_args (reply,
+                                 DBUS_TYPE_STRING, &text,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (reply);
+      return NULL;
+    }
+
+  reply_link = _dbus_list_alloc_link (reply);
+  if (reply_link == NULL)
+    {
+      /* it's OK to unref this, nothing that could have attached a callback
+       * has ever seen it */
+      dbus_message_unref (reply);
+      return NULL;
+    }
+
+  return reply_link;
+}
+
+/**
+ * Makes sure the pending call has its timeout error reply, which is
+ * only built once the call times out, since almost none do. If there
+ * isn't enough memory, the connection's reserve reply is used; only
+ * if that has gone too does this fail, and the caller should try
+ * again later.
+ *
+ * @param pending the pending call
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_pending_call_build_timeout_error_unlocked (DBusPendingCall *pending)
+{
+  _dbus_assert (!pending->timeout_error_used);
+
+  if (pending->timeout_link != NULL)
+    return TRUE;
+
+  pending->timeout_link = _dbus_pending_call_new_timeout_error_link ();
+
+  if (pending->timeout_link == NULL)
+    {
+      pending->timeout_link =
+        _dbus_connection_take_timeout_error_reserve_unlocked (pending->connection);
+
+      if (pending->timeout_link == NULL)
+        return FALSE;
+    }
+
+  _dbus_message_reset_reply_serial (pending->timeout_link->data,
+                                    pending->reply_serial);
+  return TRUE;
 }
 
 /**
@@ -223,19 +430,127 @@ _dbus_pending_call_complete (DBusPendingCall *pending)
  *
  * @param pending the pending call
  * @param connection the connection the call was sent to
+ * @returns #FALSE if there wasn't enough memory for the error reply
  */
-void
+dbus_bool_t
 _dbus_pending_call_queue_timeout_error_unlocked (DBusPendingCall *pending, 
                                                  DBusConnection  *connection)
 {
+  DBusList *link;
+
   _dbus_assert (connection == pending->connection);
-  
-  if (pending->timeout_link)
+
+  if (pending->timeout_error_used)
+    return TRUE;
+
+  /* If a reply has already been handed over, it wins */
+  if (pending->completion_queue != NULL && pending->reply != NULL)
+    return TRUE;
+
+  if (!_dbus_pending_call_build_timeout_error_unlocked (pending))
+    return FALSE;
+
+  link = pending->timeout_link;
+  pending->timeout_link = NULL;
+  pending->timeout_error_used = TRUE;
+
+  if (pending->completion_queue != NULL)
     {
-      _dbus_connection_queue_synthesized_message_link (connection,
-						       pending->timeout_link);
-      pending->timeout_link = NULL;
+      _dbus_pending_call_route_reply_link_unlocked (pending, link);
     }
+  else
+    {
+      _dbus_connection_queue_synthesized_message_link (connection, link);
+      pending->reply_queued = TRUE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * Checks whether a reply to this call should bypass the connection's
+ * incoming queue, because the call has a completion queue, and
+ * whether it can: no reply has been handed over already.
+ *
+ * @param pending the pending call
+ * @returns #TRUE if the reply should go to
+ *   _dbus_pending_call_route_reply_link_unlocked()
+ */
+dbus_bool_t
+_dbus_pending_call_can_route_reply_unlocked (DBusPendingCall *pending)
+{
+  return pending->completion_queue != NULL && pending->reply == NULL;
+}
+
+/**
+ * Checks whether the pending call has been given its reply, but
+ * isn't completed yet. The connection must not complete it with a
+ * second reply in this state.
+ *
+ * @param pending the pending call
+ * @returns #TRUE if a reply is waiting to be completed
+ */
+dbus_bool_t
+_dbus_pending_call_has_reply_unlocked (DBusPendingCall *pending)
+{
+  return pending->reply != NULL && !pending->completed;
+}
+
+/**
+ * Gives a pending call with a completion queue the reply in the given
+ * link, and passes the link on to the connection to complete the call
+ * the next time it is safe to drop the lock, without waiting for
+ * dbus_connection_dispatch(). The link's ref on the message moves to
+ * the pending call, and the link is reused to hold a new ref on it.
+ *
+ * @param pending the pending call
+ * @param link a link whose data is the reply
+ */
+void
+_dbus_pending_call_route_reply_link_unlocked (DBusPendingCall *pending,
+                                              DBusList        *link)
+{
+  _dbus_assert (_dbus_pending_call_can_route_reply_unlocked (pending));
+  _dbus_assert (pending->reply_serial ==
+                dbus_message_get_reply_serial (link->data));
+
+  pending->reply = link->data;
+  link->data = _dbus_pending_call_ref_unlocked (pending);
+
+  _dbus_connection_queue_completed_pending_call_link (pending->connection,
+                                                      link);
+}
+
+/**
+ * Checks whether a reply to this call may have been put in the
+ * connection's incoming queue. If not, there is no need to look
+ * for one there.
+ *
+ * @param pending the pending_call
+ * @returns #TRUE if the incoming queue should be searched
+ */
+dbus_bool_t
+_dbus_pending_call_get_reply_queued_unlocked (DBusPendingCall *pending)
+{
+  _dbus_assert (pending != NULL);
+
+  return pending->reply_queued;
+}
+
+/**
+ * Records whether a reply to this call may be in the connection's
+ * incoming queue.
+ *
+ * @param pending the pending_call
+ * @param is_queued whether a reply has been queued
+ */
+void
+_dbus_pending_call_set_reply_queued_unlocked (DBusPendingCall *pending,
+                                              dbus_bool_t      is_queued)
+{
+  _dbus_assert (pending != NULL);
+
+  pending->reply_queued = is_queued;
 }
 
 /**
@@ -270,17 +585,73 @@ _dbus_pending_call_set_timeout_added_unlocked (DBusPendingCall  *pending,
 
 
 /**
- * Retrives the timeout
+ * Gets the link that holds the pending call in its connection's
+ * queue of pending call timeouts.
+ *
+ * @param pending the pending_call
+ * @returns the link, or #NULL if the timeout is not queued
+ */
+DBusList *
+_dbus_pending_call_get_timeout_queue_link_unlocked (DBusPendingCall *pending)
+{
+  _dbus_assert (pending != NULL);
+
+  return pending->timeout_queue_link;
+}
+
+/**
+ * Records the link that holds the pending call in its connection's
+ * queue of pending call timeouts, and when the timeout expires.
+ *
+ * @param pending the pending_call
+ * @param link the link, or #NULL when the timeout is dequeued
+ * @param tv_sec monotonic time in seconds when the timeout expires
+ * @param tv_usec microseconds part of tv_sec
+ */
+void
+_dbus_pending_call_set_timeout_queue_link_unlocked (DBusPendingCall *pending,
+                                                    DBusList        *link,
+                                                    long             tv_sec,
+                                                    long             tv_usec)
+{
+  _dbus_assert (pending != NULL);
+
+  pending->timeout_queue_link = link;
+  pending->deadline_tv_sec = tv_sec;
+  pending->deadline_tv_usec = tv_usec;
+}
+
+/**
+ * Gets when the pending call's queued timeout expires.
+ *
+ * @param pending the pending_call
+ * @param tv_sec return location for the monotonic time in seconds
+ * @param tv_usec return location for the microseconds part
+ */
+void
+_dbus_pending_call_get_deadline_unlocked (DBusPendingCall *pending,
+                                          long            *tv_sec,
+                                          long            *tv_usec)
+{
+  _dbus_assert (pending != NULL);
+  _dbus_assert (pending->timeout_queue_link != NULL);
+
+  *tv_sec = pending->deadline_tv_sec;
+  *tv_usec = pending->deadline_tv_usec;
+}
+
+/**
+ * Gets how long the call waits for its reply.
  *
  * @param pending the pending_call
- * @returns a timeout object or NULL if call has no timeout
+ * @returns the timeout in milliseconds, or #DBUS_TIMEOUT_INFINITE
  */
-DBusTimeout *
-_dbus_pending_call_get_timeout_unlocked (DBusPendingCall  *pending)
+int
+_dbus_pending_call_get_timeout_interval_unlocked (DBusPendingCall  *pending)
 {
   _dbus_assert (pending != NULL);
 
-  return pending->timeout;
+  return pending->timeout_milliseconds;
 }
 
 /**
@@ -342,47 +713,6 @@ _dbus_pending_call_get_connection_unlocked (DBusPendingCall *pending)
   return pending->connection;
 }
 
-/**
- * Sets the reply message associated with the pending call to a timeout error
- *
- * @param pending the pending_call
- * @param message the message we are sending the error reply to 
- * @param serial serial number for the reply
- * @return #FALSE on OOM
- */
-dbus_bool_t
-_dbus_pending_call_set_timeout_error_unlocked (DBusPendingCall *pending,
-                                               DBusMessage     *message,
-                                               dbus_uint32_t    serial)
-{ 
-  DBusList *reply_link;
-  DBusMessage *reply;
-
-  reply = dbus_message_new_error (message, DBUS_ERROR_NO_REPLY,
-                                  "Did not receive a reply. Possible causes include: "
-                                  "the remote application did not send a reply, "
-                                  "the message bus security policy blocked the reply, "
-                                  "the reply timeout expired, or "
-                                  "the network connection was broken.");
-  if (reply == NULL)
-    return FALSE;
-
-  reply_link = _dbus_list_alloc_link (reply);
-  if (reply_link == NULL)
-    {
-      /* it's OK to unref this, nothing that could have attached a callback
-       * has ever seen it */
-      dbus_message_unref (reply);
-      return FALSE;
-    }
-
-  pending->timeout_link = reply_link;
-
-  _dbus_pending_call_set_reply_serial_unlocked (pending, serial);
-  
-  return TRUE;
-}
-
 /**
  * Increments the reference count on a pending call,
  * while the lock on its connection is already held.
@@ -412,15 +742,13 @@ _dbus_pending_call_last_unref (DBusPendingCall *pending)
    * from the connection, or never attached.
    */
   _dbus_assert (!pending->timeout_added);  
+  _dbus_assert (pending->timeout_queue_link == NULL);
 
   connection = pending->connection;
 
   /* this assumes we aren't holding connection lock... */
-  _dbus_data_slot_list_free (&pending->slot_list);
+  _dbus_data_slot_list_clear (&pending->slot_list);
 
-  if (pending->timeout != NULL)
-    _dbus_timeout_unref (pending->timeout);
-      
   if (pending->timeout_link)
     {
       dbus_message_unref ((DBusMessage *)pending->timeout_link->data);
@@ -433,10 +761,15 @@ _dbus_pending_call_last_unref (DBusPendingCall *pending)
       dbus_message_unref (pending->reply);
       pending->reply = NULL;
     }
-      
-  dbus_free (pending);
 
-  dbus_pending_call_free_data_slot (&notify_user_data_slot);
+  if (pending->completion_link != NULL)
+    _dbus_list_free_link (pending->completion_link);
+
+  /* only if we never completed */
+  if (pending->completion_queue != NULL)
+    dbus_pending_call_queue_unref (pending->completion_queue);
+
+  pending_call_cache_or_free (pending);
 
   /* connection lock should not be held. */
   /* Free the connection last to avoid a weird state while
@@ -737,6 +1070,7 @@ void
 dbus_pending_call_block (DBusPendingCall *pending)
 {
   _dbus_return_if_fail (pending != NULL);
+  _dbus_return_if_fail (pending->completion_queue == NULL);
 
   _dbus_connection_block_pending_call (pending);
 }
@@ -840,4 +1174,232 @@ dbus_pending_call_get_data (DBusPendingCall   *pending,
   return res;
 }
 
+/**
+ * Asks for the pending call to be put on a completion queue when it
+ * completes, instead of or as well as calling its notify function.
+ *
+ * The reply is then handed over as soon as it has been read from the
+ * connection, by whichever thread read it, without waiting for
+ * dbus_connection_dispatch(); the same goes for a timeout error. As
+ * for any other pending call, an error for disconnection is only
+ * generated once the messages received before the disconnection have
+ * been dispatched. Other threads can take completed calls off the
+ * queue with dbus_pending_call_queue_pop() and get their replies with
+ * dbus_pending_call_steal_reply().
+ *
+ * A new reference to the pending call is held by the queue until it
+ * is popped. The queue can only be set once, and it must be set
+ * before the call completes. Don't use dbus_pending_call_block() on a
+ * call that has a completion queue: wait on the queue instead.
+ *
+ * @param pending the pending call
+ * @param queue the queue
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+dbus_pending_call_set_completion_queue (DBusPendingCall      *pending,
+                                        DBusPendingCallQueue *queue)
+{
+  DBusList *link;
+
+  _dbus_return_val_if_fail (pending != NULL, FALSE);
+  _dbus_return_val_if_fail (queue != NULL, FALSE);
+  _dbus_return_val_if_fail (pending->completion_queue == NULL, FALSE);
+
+  link = _dbus_list_alloc_link (NULL);
+  if (link == NULL)
+    return FALSE;
+
+  CONNECTION_LOCK (pending->connection);
+
+  if (pending->completed)
+    {
+      CONNECTION_UNLOCK (pending->connection);
+      _dbus_list_free_link (link);
+      _dbus_warn_check_failed ("dbus_pending_call_set_completion_queue() "
+                               "called on a pending call that has already "
+                               "completed\n");
+      return FALSE;
+    }
+
+  pending->completion_link = link;
+  pending->completion_queue = dbus_pending_call_queue_ref (queue);
+
+  CONNECTION_UNLOCK (pending->connection);
+  return TRUE;
+}
+
+/** @} */
+
+/**
+ * @defgroup DBusPendingCallQueue DBusPendingCallQueue
+ * @ingroup  DBus
+ * @brief Thread-safe queue of completed pending calls
+ *
+ * A DBusPendingCallQueue collects #DBusPendingCall objects as they
+ * complete, so that replies can be picked up by any thread, for
+ * instance by an executor that resumes whichever task was waiting
+ * for them, rather than only by the thread that dispatches the
+ * connection. See dbus_pending_call_set_completion_queue().
+ *
+ * @{
+ */
+
+/**
+ * @typedef DBusPendingCallQueue
+ *
+ * Opaque data type representing a queue of completed pending calls.
+ */
+
+/**
+ * Creates a new, empty completion queue.
+ *
+ * @returns the new queue, or #NULL if not enough memory
+ */
+DBusPendingCallQueue *
+dbus_pending_call_queue_new (void)
+{
+  DBusPendingCallQueue *queue;
+
+  queue = dbus_new0 (DBusPendingCallQueue, 1);
+  if (queue == NULL)
+    return NULL;
+
+  _dbus_cmutex_new_at_location (&queue->mutex);
+  if (queue->mutex == NULL)
+    {
+      dbus_free (queue);
+      return NULL;
+    }
+
+  _dbus_lock_profile_name (queue->mutex, "pending call queue", queue);
+
+  _dbus_atomic_inc (&queue->refcount);
+  return queue;
+}
+
+/**
+ * Increments the reference count on a completion queue.
+ *
+ * @param queue the queue
+ * @returns the queue
+ */
+DBusPendingCallQueue *
+dbus_pending_call_queue_ref (DBusPendingCallQueue *queue)
+{
+  _dbus_return_val_if_fail (queue != NULL, NULL);
+
+  _dbus_atomic_inc (&queue->refcount);
+  return queue;
+}
+
+/**
+ * Decrements the reference count on a completion queue, freeing it
+ * and dropping its references to any calls still on it if the count
+ * reaches 0.
+ *
+ * @param queue the queue
+ */
+void
+dbus_pending_call_queue_unref (DBusPendingCallQueue *queue)
+{
+  DBusPendingCall *pending;
+
+  _dbus_return_if_fail (queue != NULL);
+
+  if (_dbus_atomic_dec (&queue->refcount) != 1)
+    return;
+
+  while ((pending = _dbus_list_pop_first (&queue->calls)) != NULL)
+    dbus_pending_call_unref (pending);
+
+  if (queue->free_wakeup_data != NULL)
+    (* queue->free_wakeup_data) (queue->wakeup_data);
+
+  _dbus_cmutex_free_at_location (&queue->mutex);
+  dbus_free (queue);
+}
+
+/**
+ * Sets a function to be called whenever a call is added to the queue,
+ * for instance to write to an eventfd or wake up a condition variable.
+ * It is called with no libdbus locks held, from whichever thread
+ * completed the call, and must not block. Replaces any previous
+ * function, freeing its data.
+ *
+ * @param queue the queue
+ * @param wakeup_function function to call, or #NULL
+ * @param data data to pass to wakeup_function
+ * @param free_data_function function to free data, or #NULL
+ */
+void
+dbus_pending_call_queue_set_wakeup_function (DBusPendingCallQueue   *queue,
+                                             DBusWakeupMainFunction  wakeup_function,
+                                             void                   *data,
+                                             DBusFreeFunction        free_data_function)
+{
+  void *old_data;
+  DBusFreeFunction old_free_data;
+
+  _dbus_return_if_fail (queue != NULL);
+
+  _dbus_cmutex_lock (queue->mutex);
+  old_data = queue->wakeup_data;
+  old_free_data = queue->free_wakeup_data;
+
+  queue->wakeup_function = wakeup_function;
+  queue->wakeup_data = data;
+  queue->free_wakeup_data = free_data_function;
+  _dbus_cmutex_unlock (queue->mutex);
+
+  if (old_free_data != NULL)
+    (* old_free_data) (old_data);
+}
+
+/**
+ * Takes the oldest completed call off the queue. The caller gets the
+ * queue's reference to it.
+ *
+ * @param queue the queue
+ * @returns a completed pending call, or #NULL if the queue is empty
+ */
+DBusPendingCall *
+dbus_pending_call_queue_pop (DBusPendingCallQueue *queue)
+{
+  DBusPendingCall *pending;
+
+  _dbus_return_val_if_fail (queue != NULL, NULL);
+
+  _dbus_cmutex_lock (queue->mutex);
+  pending = _dbus_list_pop_first (&queue->calls);
+  _dbus_cmutex_unlock (queue->mutex);
+
+  return pending;
+}
+
+/* Called with no locks held, when pending completes */
+static void
+pending_call_queue_push (DBusPendingCallQueue *queue,
+                         DBusPendingCall      *pending)
+{
+  DBusWakeupMainFunction wakeup_function;
+  void *wakeup_data;
+  DBusList *link;
+
+  link = pending->completion_link;
+  pending->completion_link = NULL;
+  _dbus_assert (link != NULL);
+
+  link->data = dbus_pending_call_ref (pending);
+
+  _dbus_cmutex_lock (queue->mutex);
+  _dbus_list_append_link (&queue->calls, link);
+  wakeup_function = queue->wakeup_function;
+  wakeup_data = queue->wakeup_data;
+  _dbus_cmutex_unlock (queue->mutex);
+
+  if (wakeup_function != NULL)
+    (* wakeup_function) (wakeup_data);
+}
+
 /** @} */
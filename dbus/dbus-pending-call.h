@@ -41,6 +41,8 @@ DBUS_BEGIN_DECLS
 #define DBUS_TIMEOUT_INFINITE ((int) 0x7fffffff)
 #define DBUS_TIMEOUT_USE_DEFAULT (-1)
 
+typedef struct DBusPendingCallQueue DBusPendingCallQueue;
+
 DBUS_EXPORT
 DBusPendingCall* dbus_pending_call_ref       (DBusPendingCall               *pending);
 DBUS_EXPORT
@@ -72,6 +74,24 @@ DBUS_EXPORT
 void*       dbus_pending_call_get_data           (DBusPendingCall  *pending,
                                                   dbus_int32_t      slot);
 
+DBUS_EXPORT
+dbus_bool_t dbus_pending_call_set_completion_queue (DBusPendingCall      *pending,
+                                                    DBusPendingCallQueue *queue);
+
+DBUS_EXPORT
+DBusPendingCallQueue* dbus_pending_call_queue_new   (void);
+DBUS_EXPORT
+DBusPendingCallQueue* dbus_pending_call_queue_ref   (DBusPendingCallQueue   *queue);
+DBUS_EXPORT
+void                  dbus_pending_call_queue_unref (DBusPendingCallQueue   *queue);
+DBUS_EXPORT
+void                  dbus_pending_call_queue_set_wakeup_function (DBusPendingCallQueue   *queue,
+                                                                   DBusWakeupMainFunction  wakeup_function,
+                                                                   void                   *data,
+                                                                   DBusFreeFunction        free_data_function);
+DBUS_EXPORT
+DBusPendingCall*      dbus_pending_call_queue_pop   (DBusPendingCallQueue   *queue);
+
 /** @} */
 
 DBUS_END_DECLS
@@ -63,8 +63,10 @@ struct DBusCounter
   long peak_unix_fd_value;  /**< largest ever unix fd counter value */
 #endif
 
-  long notify_size_guard_value;    /**< call notify function when crossing this size value */
-  long notify_unix_fd_guard_value; /**< call notify function when crossing this unix fd value */
+  long notify_size_guard_value;    /**< call notify function when rising to this size value */
+  long notify_size_resume_value;   /**< call notify function when falling below this size value */
+  long notify_unix_fd_guard_value; /**< call notify function when rising to this unix fd value */
+  long notify_unix_fd_resume_value; /**< call notify function when falling below this unix fd value */
 
   DBusCounterNotifyFunction notify_function; /**< notify function */
   void *notify_data; /**< data for notify function */
@@ -102,6 +104,8 @@ _dbus_counter_new (void)
     dbus_free (counter);
     counter = NULL;
   }
+  else
+    _dbus_lock_profile_name (counter->mutex, "counter", counter);
 
   return counter;
 }
@@ -188,8 +192,8 @@ _dbus_counter_adjust_size (DBusCounter *counter,
   if (counter->notify_function != NULL &&
       ((old < counter->notify_size_guard_value &&
         counter->size_value >= counter->notify_size_guard_value) ||
-       (old >= counter->notify_size_guard_value &&
-        counter->size_value < counter->notify_size_guard_value)))
+       (old >= counter->notify_size_resume_value &&
+        counter->size_value < counter->notify_size_resume_value)))
     counter->notify_pending = TRUE;
 
   _dbus_rmutex_unlock (counter->mutex);
@@ -257,8 +261,8 @@ _dbus_counter_adjust_unix_fd (DBusCounter *counter,
   if (counter->notify_function != NULL &&
       ((old < counter->notify_unix_fd_guard_value &&
         counter->unix_fd_value >= counter->notify_unix_fd_guard_value) ||
-       (old >= counter->notify_unix_fd_guard_value &&
-        counter->unix_fd_value < counter->notify_unix_fd_guard_value)))
+       (old >= counter->notify_unix_fd_resume_value &&
+        counter->unix_fd_value < counter->notify_unix_fd_resume_value)))
     counter->notify_pending = TRUE;
 
   _dbus_rmutex_unlock (counter->mutex);
@@ -290,25 +294,36 @@ _dbus_counter_get_unix_fd_value (DBusCounter *counter)
 
 /**
  * Sets the notify function for this counter; the notify function is
- * called whenever the counter's values cross the guard values in
- * either direction (moving up, or moving down).
+ * called whenever a counter's value rises to its guard value, or
+ * falls below its resume value. A resume value below the guard value
+ * gives hysteresis: a value moving back and forth across the guard
+ * value doesn't notify each time.
  *
  * @param counter the counter
- * @param size_guard_value the value we're notified if the size counter crosses
- * @param unix_fd_guard_value the value we're notified if the unix fd counter crosses
+ * @param size_guard_value the value we're notified if the size counter rises to
+ * @param size_resume_value the value we're notified if the size counter falls below
+ * @param unix_fd_guard_value the value we're notified if the unix fd counter rises to
+ * @param unix_fd_resume_value the value we're notified if the unix fd counter falls below
  * @param function function to call in order to notify
  * @param user_data data to pass to the function
  */
 void
 _dbus_counter_set_notify (DBusCounter               *counter,
                           long                       size_guard_value,
+                          long                       size_resume_value,
                           long                       unix_fd_guard_value,
+                          long                       unix_fd_resume_value,
                           DBusCounterNotifyFunction  function,
                           void                      *user_data)
 {
+  _dbus_assert (size_resume_value <= size_guard_value);
+  _dbus_assert (unix_fd_resume_value <= unix_fd_guard_value);
+
   _dbus_rmutex_lock (counter->mutex);
   counter->notify_size_guard_value = size_guard_value;
+  counter->notify_size_resume_value = size_resume_value;
   counter->notify_unix_fd_guard_value = unix_fd_guard_value;
+  counter->notify_unix_fd_resume_value = unix_fd_resume_value;
   counter->notify_function = function;
   counter->notify_data = user_data;
   counter->notify_pending = FALSE;
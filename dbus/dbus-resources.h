@@ -48,7 +48,9 @@ long         _dbus_counter_get_unix_fd_value (DBusCounter *counter);
 
 void _dbus_counter_set_notify    (DBusCounter               *counter,
                                   long                       size_guard_value,
+                                  long                       size_resume_value,
                                   long                       unix_fd_guard_value,
+                                  long                       unix_fd_resume_value,
                                   DBusCounterNotifyFunction  function,
                                   void                      *user_data);
 
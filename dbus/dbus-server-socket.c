@@ -29,6 +29,9 @@
 #include "dbus-memory.h"
 #include "dbus-nonce.h"
 #include "dbus-string.h"
+#ifdef DBUS_UNIX
+#include "dbus-sysdeps-unix.h"
+#endif
 
 /**
  * @defgroup DBusServerSocket DBusServer implementations for SOCKET
@@ -81,10 +84,19 @@ socket_finalize (DBusServer *server)
   dbus_free (server);
 }
 
-/* Return value is just for memory, not other failures. */
+/**
+ * Most clients to accept per readability notification on a listening
+ * socket, so that a flood of reconnections is drained in a few main
+ * loop iterations without starving existing connections.
+ */
+#define MAX_ACCEPTS_PER_WAKEUP 32
+
+/* Return value is just for memory, not other failures. The client
+ * socket must already be nonblocking.
+ */
 static dbus_bool_t
-handle_new_client_fd_and_unlock (DBusServer *server,
-                                 DBusSocket  client_fd)
+handle_new_client_fd_untagged (DBusServer *server,
+                               DBusSocket  client_fd)
 {
   DBusConnection *connection;
   DBusTransport *transport;
@@ -96,12 +108,6 @@ handle_new_client_fd_and_unlock (DBusServer *server,
 
   HAVE_LOCK_CHECK (server);
 
-  if (!_dbus_set_socket_nonblocking (client_fd, NULL))
-    {
-      SERVER_UNLOCK (server);
-      return TRUE;
-    }
-
   transport = _dbus_transport_new_for_socket (client_fd, &server->guid_hex, NULL);
   if (transport == NULL)
     {
@@ -155,6 +161,22 @@ handle_new_client_fd_and_unlock (DBusServer *server,
   return TRUE;
 }
 
+/* Everything the new connection allocates here counts as connection
+ * memory, also what the new connection function allocates for it */
+static dbus_bool_t
+handle_new_client_fd_and_unlock (DBusServer *server,
+                                 DBusSocket  client_fd)
+{
+  dbus_bool_t retval;
+  DBusMemoryTag old_tag;
+
+  old_tag = _dbus_memory_push_tag (DBUS_MEMORY_TAG_CONNECTION);
+  retval = handle_new_client_fd_untagged (server, client_fd);
+  _dbus_memory_pop_tag (old_tag);
+
+  return retval;
+}
+
 static dbus_bool_t
 socket_handle_watch (DBusWatch    *watch,
                    unsigned int  flags,
@@ -186,33 +208,63 @@ socket_handle_watch (DBusWatch    *watch,
       DBusSocket client_fd;
       DBusSocket listen_fd;
       int saved_errno;
+      int n_accepted;
 
       listen_fd = _dbus_watch_get_socket (watch);
 
-      if (socket_server->noncefile)
-          client_fd = _dbus_accept_with_noncefile (listen_fd, socket_server->noncefile);
-      else 
-          client_fd = _dbus_accept (listen_fd);
-
-      saved_errno = _dbus_save_socket_errno ();
+      /* The listening socket is nonblocking, so keep accepting until
+       * the backlog is empty or we have done our share for this
+       * iteration. Accepting with a nonce needs a blocking read from
+       * each client, so that is still done one at a time.
+       */
+      _dbus_server_ref_unlocked (server);
 
-      if (!_dbus_socket_is_valid (client_fd))
+      for (n_accepted = 0;
+           n_accepted < (socket_server->noncefile ? 1 : MAX_ACCEPTS_PER_WAKEUP);
+           n_accepted++)
         {
-          /* EINTR handled for us */
-
-          if (_dbus_get_is_errno_eagain_or_ewouldblock (saved_errno))
-            _dbus_verbose ("No client available to accept after all\n");
+          if (socket_server->noncefile)
+            client_fd = _dbus_accept_with_noncefile (listen_fd, socket_server->noncefile);
           else
-            _dbus_verbose ("Failed to accept a client connection: %s\n",
-                           _dbus_strerror (saved_errno));
+            client_fd = _dbus_accept_nonblocking (listen_fd);
+
+          saved_errno = _dbus_save_socket_errno ();
+
+          if (!_dbus_socket_is_valid (client_fd))
+            {
+              /* EINTR handled for us */
+
+              if (_dbus_get_is_errno_eagain_or_ewouldblock (saved_errno))
+                _dbus_verbose ("No client available to accept after all\n");
+              else
+                _dbus_verbose ("Failed to accept a client connection: %s\n",
+                               _dbus_strerror (saved_errno));
+
+              break;
+            }
+
+          if (socket_server->noncefile &&
+              !_dbus_set_socket_nonblocking (client_fd, NULL))
+            {
+              _dbus_close_socket (client_fd, NULL);
+              continue;
+            }
 
-          SERVER_UNLOCK (server);
-        }
-      else
-        {
           if (!handle_new_client_fd_and_unlock (server, client_fd))
             _dbus_verbose ("Rejected client connection due to lack of memory\n");
+
+          SERVER_LOCK (server);
+
+          /* The new connection function may have shut us down, or
+           * disabled the watch to stop accepting for now, as the
+           * dbus-daemon does while it has too many incomplete
+           * connections */
+          if (server->disconnected || !_dbus_watch_get_enabled (watch))
+            break;
         }
+
+      SERVER_UNLOCK (server);
+      dbus_server_unref (server);
     }
 
   if (flags & DBUS_WATCH_ERROR)
@@ -376,32 +428,14 @@ _dbus_server_new_for_socket (DBusSocket       *fds,
   return NULL;
 }
 
-/**
- * Creates a new server listening on TCP.
- * If host is NULL, it will default to localhost.
- * If bind is NULL, it will default to the value for the host
- * parameter, and if that is NULL, then localhost
- * If bind is a hostname, it will be resolved and will listen
- * on all returned addresses.
- * If family is NULL, hostname resolution will try all address
- * families, otherwise it can be ipv4 or ipv6 to restrict the
- * addresses considered.
- *
- * @param host the hostname to report for the listen address
- * @param bind the hostname to listen on
- * @param port the port to listen on or 0 to let the OS choose
- * @param family
- * @param error location to store reason for failure.
- * @param use_nonce whether to use a nonce for low-level authentication (nonce-tcp transport) or not (tcp transport)
- * @returns the new server, or #NULL on failure.
- */
-DBusServer*
-_dbus_server_new_for_tcp_socket (const char     *host,
-                                 const char     *bind,
-                                 const char     *port,
-                                 const char     *family,
-                                 DBusError      *error,
-                                 dbus_bool_t    use_nonce)
+static DBusServer*
+new_for_tcp_socket (const char     *host,
+                    const char     *bind,
+                    const char     *port,
+                    const char     *family,
+                    dbus_bool_t     use_nonce,
+                    dbus_bool_t     reuse_port,
+                    DBusError      *error)
 {
   DBusServer *server;
   DBusSocket *listen_fds = NULL;
@@ -438,9 +472,16 @@ _dbus_server_new_for_tcp_socket (const char     *host,
   else if (strcmp (bind, "*") == 0)
     bind = NULL;
 
-  nlisten_fds =_dbus_listen_tcp_socket (bind, port, family,
-                                        &port_str,
-                                        &listen_fds, error);
+#ifdef DBUS_UNIX
+  if (reuse_port)
+    nlisten_fds = _dbus_listen_tcp_socket_shared (bind, port, family,
+                                                  &port_str,
+                                                  &listen_fds, error);
+  else
+#endif
+    nlisten_fds = _dbus_listen_tcp_socket (bind, port, family,
+                                           &port_str,
+                                           &listen_fds, error);
   if (nlisten_fds <= 0)
     {
       _DBUS_ASSERT_ERROR_IS_SET(error);
@@ -520,6 +561,37 @@ _dbus_server_new_for_tcp_socket (const char     *host,
   return NULL;
 }
 
+/**
+ * Creates a new server listening on TCP.
+ * If host is NULL, it will default to localhost.
+ * If bind is NULL, it will default to the value for the host
+ * parameter, and if that is NULL, then localhost
+ * If bind is a hostname, it will be resolved and will listen
+ * on all returned addresses.
+ * If family is NULL, hostname resolution will try all address
+ * families, otherwise it can be ipv4 or ipv6 to restrict the
+ * addresses considered.
+ *
+ * @param host the hostname to report for the listen address
+ * @param bind the hostname to listen on
+ * @param port the port to listen on or 0 to let the OS choose
+ * @param family
+ * @param error location to store reason for failure.
+ * @param use_nonce whether to use a nonce for low-level authentication (nonce-tcp transport) or not (tcp transport)
+ * @returns the new server, or #NULL on failure.
+ */
+DBusServer*
+_dbus_server_new_for_tcp_socket (const char     *host,
+                                 const char     *bind,
+                                 const char     *port,
+                                 const char     *family,
+                                 DBusError      *error,
+                                 dbus_bool_t    use_nonce)
+{
+  return new_for_tcp_socket (host, bind, port, family, use_nonce, FALSE,
+                             error);
+}
+
 /**
  * Tries to interpret the address entry for various socket-related
  * addresses (well, currently only tcp and nonce-tcp).
@@ -549,14 +621,52 @@ _dbus_server_listen_socket (DBusAddressEntry *entry,
       const char *port;
       const char *bind;
       const char *family;
+      const char *reuseport;
+      dbus_bool_t use_nonce;
+      dbus_bool_t reuse_port;
 
       host = dbus_address_entry_get_value (entry, "host");
       bind = dbus_address_entry_get_value (entry, "bind");
       port = dbus_address_entry_get_value (entry, "port");
       family = dbus_address_entry_get_value (entry, "family");
+      reuseport = dbus_address_entry_get_value (entry, "reuseport");
+      use_nonce = strcmp (method, "nonce-tcp") == 0;
+
+      if (reuseport == NULL || strcmp (reuseport, "false") == 0)
+        {
+          reuse_port = FALSE;
+        }
+      else if (strcmp (reuseport, "true") == 0)
+        {
+          reuse_port = TRUE;
+        }
+      else
+        {
+          dbus_set_error (error, DBUS_ERROR_BAD_ADDRESS,
+                          "reuseport must be true or false in address");
+          return DBUS_SERVER_LISTEN_BAD_ADDRESS;
+        }
+
+      /* Every process sharing the port must give the same answer to
+       * clients, which a random port or a per-process nonce can't */
+      if (reuse_port && (port == NULL || strcmp (port, "0") == 0 || use_nonce))
+        {
+          dbus_set_error (error, DBUS_ERROR_BAD_ADDRESS,
+                          "reuseport=true needs a tcp: address with a fixed port");
+          return DBUS_SERVER_LISTEN_BAD_ADDRESS;
+        }
+
+#ifndef DBUS_UNIX
+      if (reuse_port)
+        {
+          dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                          "Sharing a listening port is not supported on this platform");
+          return DBUS_SERVER_LISTEN_DID_NOT_CONNECT;
+        }
+#endif
 
-      *server_p = _dbus_server_new_for_tcp_socket (host, bind, port,
-                                                   family, error, strcmp (method, "nonce-tcp") == 0 ? TRUE : FALSE);
+      *server_p = new_for_tcp_socket (host, bind, port, family, use_nonce,
+                                      reuse_port, error);
 
       if (*server_p)
         {
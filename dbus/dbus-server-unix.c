@@ -39,6 +39,10 @@
  * @{
  */
 
+static DBusServer *_dbus_server_new_for_vsock (const char *cid,
+                                               const char *port,
+                                               DBusError  *error);
+
 /**
  * Tries to interpret the address entry in a platform-specific
  * way, creating a platform-specific server type if appropriate.
@@ -198,6 +202,24 @@ _dbus_server_listen_platform_specific (DBusAddressEntry *entry,
             *server_p = _dbus_server_new_for_domain_socket (abstract, TRUE, error);
         }
 
+      if (*server_p != NULL)
+        {
+          _DBUS_ASSERT_ERROR_IS_CLEAR(error);
+          return DBUS_SERVER_LISTEN_OK;
+        }
+      else
+        {
+          _DBUS_ASSERT_ERROR_IS_SET(error);
+          return DBUS_SERVER_LISTEN_DID_NOT_CONNECT;
+        }
+    }
+  else if (strcmp (method, "vsock") == 0)
+    {
+      const char *cid = dbus_address_entry_get_value (entry, "cid");
+      const char *port = dbus_address_entry_get_value (entry, "port");
+
+      *server_p = _dbus_server_new_for_vsock (cid, port, error);
+
       if (*server_p != NULL)
         {
           _DBUS_ASSERT_ERROR_IS_CLEAR(error);
@@ -372,4 +394,76 @@ _dbus_server_new_for_domain_socket (const char     *path,
   return NULL;
 }
 
+/**
+ * Creates a new server listening on the given Linux vsock context ID
+ * and port, so that virtual machines can connect to a server on their
+ * host, or the other way round.
+ *
+ * @param cid the context ID to listen on, or #NULL for any
+ * @param port the port to listen on, or #NULL or "0" for a free one
+ * @param error location to store reason for failure.
+ * @returns the new server, or #NULL on failure.
+ */
+static DBusServer*
+_dbus_server_new_for_vsock (const char     *cid,
+                            const char     *port,
+                            DBusError      *error)
+{
+  DBusServer *server;
+  DBusSocket listen_fd;
+  DBusString address;
+  DBusString port_str;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!_dbus_string_init (&address))
+    {
+      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+      return NULL;
+    }
+
+  if (!_dbus_string_init (&port_str))
+    {
+      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+      goto failed_0;
+    }
+
+  listen_fd.fd = _dbus_listen_vsock_socket (cid, port, &port_str, error);
+
+  if (listen_fd.fd < 0)
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      goto failed_1;
+    }
+
+  if (!_dbus_string_append (&address, "vsock:") ||
+      (cid != NULL &&
+       !_dbus_string_append_printf (&address, "cid=%s,", cid)) ||
+      !_dbus_string_append (&address, "port=") ||
+      !_dbus_string_copy (&port_str, 0, &address,
+                          _dbus_string_get_length (&address)))
+    {
+      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+      goto failed_2;
+    }
+
+  server = _dbus_server_new_for_socket (&listen_fd, 1, &address, 0, error);
+  if (server == NULL)
+    goto failed_2;
+
+  _dbus_string_free (&port_str);
+  _dbus_string_free (&address);
+
+  return server;
+
+ failed_2:
+  _dbus_close_socket (listen_fd, NULL);
+ failed_1:
+  _dbus_string_free (&port_str);
+ failed_0:
+  _dbus_string_free (&address);
+
+  return NULL;
+}
+
 /** @} */
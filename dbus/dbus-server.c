@@ -151,6 +151,8 @@ _dbus_server_init_base (DBusServer             *server,
   _dbus_rmutex_new_at_location (&server->mutex);
   if (server->mutex == NULL)
     goto oom;
+
+  _dbus_lock_profile_name (server->mutex, "server", server);
   
   server->watches = _dbus_watch_list_new ();
   if (server->watches == NULL)
@@ -1200,9 +1202,54 @@ _dbus_server_test (void)
     "tcp:port=1234;unix:path=./boogie",
 #endif
   };
+  const char *bad_addresses[] = {
+    "tcp:port=0,reuseport=true",
+    "tcp:reuseport=true",
+    "nonce-tcp:port=1234,reuseport=true",
+    "tcp:port=1234,reuseport=yes",
+#ifdef HAVE_LINUX_VM_SOCKETS_H
+    "vsock:port=twelve",
+    "vsock:cid=2a,port=1234",
+    "vsock:cid=4294967295,port=1234",
+#endif
+  };
 
   DBusServer *server;
+  DBusServer *second;
+  DBusError error = DBUS_ERROR_INIT;
   int i;
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (bad_addresses); i++)
+    {
+      server = dbus_server_listen (bad_addresses[i], &error);
+      _dbus_assert (server == NULL);
+      _dbus_assert (dbus_error_has_name (&error, DBUS_ERROR_BAD_ADDRESS));
+      dbus_error_free (&error);
+    }
+
+  /* Two servers can share a port if both ask to */
+  server = dbus_server_listen ("tcp:host=localhost,port=1234,reuseport=true",
+                               &error);
+  if (server != NULL)
+    {
+      second = dbus_server_listen ("tcp:host=localhost,port=1234,reuseport=true",
+                                   &error);
+      if (second == NULL)
+        {
+          _dbus_warn ("server listen error: %s: %s\n", error.name, error.message);
+          _dbus_assert_not_reached ("Failed to share a listening port");
+        }
+
+      dbus_server_disconnect (second);
+      dbus_server_unref (second);
+      dbus_server_disconnect (server);
+      dbus_server_unref (server);
+    }
+  else
+    {
+      _dbus_assert (dbus_error_has_name (&error, DBUS_ERROR_NOT_SUPPORTED));
+      dbus_error_free (&error);
+    }
   
   for (i = 0; i < _DBUS_N_ELEMENTS (valid_addresses); i++)
     {
@@ -0,0 +1,750 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-shm-ring.c  Shared memory rings between two processes on one host
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "dbus-shm-ring.h"
+#include "dbus-sysdeps.h"
+#include "dbus-sysdeps-unix.h"
+#include "dbus-test.h"
+
+#include <string.h>
+
+/**
+ * @defgroup DBusShmRing Shared memory rings
+ * @ingroup  DBusInternals
+ * @brief A pair of byte rings in memory shared by a client and a server
+ *
+ * Each direction is a single-producer, single-consumer ring of bytes
+ * with free-running 32-bit head and tail counters. Only the writer
+ * stores the head and only the reader the tail; each keeps its own
+ * copy and checks the other side's against the size of the ring, so
+ * a peer scribbling on the shared page can garble its own messages
+ * but cannot make us read or write outside the mapping.
+ *
+ * A side that finds its incoming ring empty, or its outgoing ring
+ * too full, sleeps on an eventfd that the peer rings when that
+ * changes.
+ *
+ * @{
+ */
+
+/** Control blocks sit in the first page, data areas follow it */
+#define SHM_RING_HEADER_SIZE 4096
+/** Each direction's data area, unless the server is told otherwise */
+#define SHM_RING_DEFAULT_SIZE (256 * 1024)
+/** Smallest data area a client accepts */
+#define SHM_RING_MIN_SIZE 4096
+/** Largest data area a client accepts */
+#define SHM_RING_MAX_SIZE (16 * 1024 * 1024)
+/** Keeps what each side stores on its own cache line */
+#define SHM_RING_LINE 64
+
+/**
+ * The shared state of one direction.
+ */
+typedef struct
+{
+  volatile dbus_uint32_t head;           /**< Total bytes written; stored by the writer */
+  volatile dbus_uint32_t socket_bytes;   /**< Total bytes the writer sent on the socket instead */
+  unsigned char pad0[SHM_RING_LINE - 2 * sizeof (dbus_uint32_t)];
+  volatile dbus_uint32_t tail;           /**< Total bytes read; stored by the reader */
+  unsigned char pad1[SHM_RING_LINE - sizeof (dbus_uint32_t)];
+  volatile dbus_uint32_t writer_waiting; /**< Set by the writer, cleared by the reader who then wakes it */
+  unsigned char pad2[SHM_RING_LINE - sizeof (dbus_uint32_t)];
+} DBusShmRingControl;
+
+_DBUS_STATIC_ASSERT (2 * sizeof (DBusShmRingControl) <= SHM_RING_HEADER_SIZE);
+
+/* Index of each direction in the header and the data */
+#define CLIENT_TO_SERVER 0
+#define SERVER_TO_CLIENT 1
+
+/**
+ * One side's view of the pair of rings.
+ */
+struct DBusShmRing
+{
+  unsigned char *map;                /**< Header and both data areas */
+  size_t map_len;                    /**< Length of the mapping */
+  dbus_uint32_t size;                /**< Size of each data area, a power of two */
+  int memfd;                         /**< The server's until the setup is sent, or -1 */
+  int doorbells[2];                  /**< Ours, indexed by #DBusShmRingDoorbell */
+  int peer_doorbells[2];             /**< The peer's */
+
+  DBusShmRingControl *out_control;   /**< Control block of the ring we write */
+  unsigned char *out_data;           /**< Data area of the ring we write */
+  dbus_uint32_t out_head;            /**< What we last stored as out_control->head */
+  dbus_uint32_t out_socket_bytes;    /**< What we last stored as out_control->socket_bytes */
+
+  DBusShmRingControl *in_control;    /**< Control block of the ring we read */
+  const unsigned char *in_data;      /**< Data area of the ring we read */
+  dbus_uint32_t in_tail;             /**< What we last stored as in_control->tail */
+  dbus_uint32_t in_readable;         /**< What _dbus_shm_ring_get_readable() last said */
+};
+
+static void
+close_fds (int *fds,
+           int  n_fds)
+{
+  int i;
+
+  for (i = 0; i < n_fds; i++)
+    {
+      if (fds[i] >= 0)
+        _dbus_close (fds[i], NULL);
+      fds[i] = -1;
+    }
+}
+
+static DBusShmRing *
+ring_new (dbus_uint32_t  size,
+          DBusError     *error)
+{
+  DBusShmRing *ring;
+
+  ring = dbus_new0 (DBusShmRing, 1);
+
+  if (ring == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      return NULL;
+    }
+
+  ring->size = size;
+  ring->map_len = SHM_RING_HEADER_SIZE + 2 * (size_t) size;
+  ring->memfd = -1;
+  ring->doorbells[0] = ring->doorbells[1] = -1;
+  ring->peer_doorbells[0] = ring->peer_doorbells[1] = -1;
+  return ring;
+}
+
+static void
+ring_attach (DBusShmRing *ring,
+             void        *map,
+             dbus_bool_t  is_server)
+{
+  int out, in;
+
+  out = is_server ? SERVER_TO_CLIENT : CLIENT_TO_SERVER;
+  in = is_server ? CLIENT_TO_SERVER : SERVER_TO_CLIENT;
+
+  ring->map = map;
+  ring->out_control = ((DBusShmRingControl *) ring->map) + out;
+  ring->in_control = ((DBusShmRingControl *) ring->map) + in;
+  ring->out_data = ring->map + SHM_RING_HEADER_SIZE + out * (size_t) ring->size;
+  ring->in_data = ring->map + SHM_RING_HEADER_SIZE + in * (size_t) ring->size;
+
+  /* start from wherever the counters are: the server may already
+   * have written to its ring by the time the client maps it */
+  ring->out_head = ring->out_control->head;
+  ring->out_socket_bytes = ring->out_control->socket_bytes;
+  ring->in_tail = ring->in_control->tail;
+  ring->in_readable = 0;
+}
+
+/**
+ * Creates the server's side of a new pair of rings, with fresh
+ * eventfds for both sides. Send what _dbus_shm_ring_get_setup()
+ * returns to the client, then call _dbus_shm_ring_setup_sent().
+ *
+ * @param error error to set on failure
+ * @returns the ring, or #NULL with @p error set
+ */
+DBusShmRing *
+_dbus_shm_ring_new_server (DBusError *error)
+{
+  DBusShmRing *ring;
+  void *map;
+  int i;
+
+  ring = ring_new (SHM_RING_DEFAULT_SIZE, error);
+
+  if (ring == NULL)
+    return NULL;
+
+  if (!_dbus_memfd_create_shared (ring->map_len, &ring->memfd, error))
+    goto failed;
+
+  for (i = 0; i < 2; i++)
+    {
+      if (!_dbus_eventfd_new (&ring->doorbells[i], error) ||
+          !_dbus_eventfd_new (&ring->peer_doorbells[i], error))
+        goto failed;
+    }
+
+  if (!_dbus_memfd_map_shared (ring->memfd, ring->map_len, &map, error))
+    goto failed;
+
+  ring_attach (ring, map, TRUE);
+  return ring;
+
+ failed:
+  _dbus_shm_ring_free (ring);
+  return NULL;
+}
+
+/**
+ * Creates the client's side of a pair of rings from what the server
+ * sent. Takes ownership of the fds, whether it succeeds or not.
+ *
+ * @param fds the #DBUS_SHM_RING_N_SETUP_FDS fds from the server
+ * @param size the size of each data area, from the server
+ * @param error error to set on failure
+ * @returns the ring, or #NULL with @p error set
+ */
+DBusShmRing *
+_dbus_shm_ring_new_client (int           *fds,
+                           dbus_uint32_t  size,
+                           DBusError     *error)
+{
+  DBusShmRing *ring;
+  void *map;
+
+  if (size < SHM_RING_MIN_SIZE || size > SHM_RING_MAX_SIZE ||
+      (size & (size - 1)) != 0)
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                      "Shared memory ring has unusable size %u", size);
+      close_fds (fds, DBUS_SHM_RING_N_SETUP_FDS);
+      return NULL;
+    }
+
+  ring = ring_new (size, error);
+
+  if (ring == NULL)
+    {
+      close_fds (fds, DBUS_SHM_RING_N_SETUP_FDS);
+      return NULL;
+    }
+
+  /* in the order _dbus_shm_ring_get_setup() puts them */
+  ring->doorbells[DBUS_SHM_RING_DATA] = fds[1];
+  ring->doorbells[DBUS_SHM_RING_SPACE] = fds[2];
+  ring->peer_doorbells[DBUS_SHM_RING_DATA] = fds[3];
+  ring->peer_doorbells[DBUS_SHM_RING_SPACE] = fds[4];
+
+  if (!_dbus_memfd_map_shared (fds[0], ring->map_len, &map, error))
+    {
+      close_fds (fds, 1);
+      _dbus_shm_ring_free (ring);
+      return NULL;
+    }
+
+  close_fds (fds, 1);
+  ring_attach (ring, map, FALSE);
+  return ring;
+}
+
+/**
+ * Unmaps the rings and closes their fds.
+ *
+ * @param ring the ring
+ */
+void
+_dbus_shm_ring_free (DBusShmRing *ring)
+{
+  if (ring->map != NULL)
+    _dbus_memfd_unmap (ring->map, ring->map_len);
+
+  close_fds (&ring->memfd, 1);
+  close_fds (ring->doorbells, 2);
+  close_fds (ring->peer_doorbells, 2);
+  dbus_free (ring);
+}
+
+/**
+ * Gets what the server sends the client to set up the rings: the
+ * memfd, then the client's data and space doorbells, then the
+ * server's. The fds still belong to the ring.
+ *
+ * @param ring the server's ring
+ * @param fds array of #DBUS_SHM_RING_N_SETUP_FDS to fill in
+ * @param size return location for the size of each data area
+ */
+void
+_dbus_shm_ring_get_setup (DBusShmRing   *ring,
+                          int           *fds,
+                          dbus_uint32_t *size)
+{
+  _dbus_assert (ring->memfd >= 0);
+
+  fds[0] = ring->memfd;
+  fds[1] = ring->peer_doorbells[DBUS_SHM_RING_DATA];
+  fds[2] = ring->peer_doorbells[DBUS_SHM_RING_SPACE];
+  fds[3] = ring->doorbells[DBUS_SHM_RING_DATA];
+  fds[4] = ring->doorbells[DBUS_SHM_RING_SPACE];
+  *size = ring->size;
+}
+
+/**
+ * Closes the server's memfd once the client has it; the mapping stays.
+ *
+ * @param ring the server's ring
+ */
+void
+_dbus_shm_ring_setup_sent (DBusShmRing *ring)
+{
+  close_fds (&ring->memfd, 1);
+}
+
+/**
+ * Gets one of the eventfds this side polls.
+ *
+ * @param ring the ring
+ * @param which the doorbell
+ * @returns the eventfd
+ */
+int
+_dbus_shm_ring_get_doorbell (DBusShmRing         *ring,
+                             DBusShmRingDoorbell  which)
+{
+  return ring->doorbells[which];
+}
+
+/**
+ * Makes one of this side's doorbells unreadable again, before looking
+ * at the ring it is about.
+ *
+ * @param ring the ring
+ * @param which the doorbell
+ */
+void
+_dbus_shm_ring_clear_doorbell (DBusShmRing         *ring,
+                               DBusShmRingDoorbell  which)
+{
+  _dbus_eventfd_clear (ring->doorbells[which]);
+}
+
+/**
+ * Rings one of this side's own doorbells, for instance because we
+ * stopped reading with data left in the ring and want to be woken up
+ * to read the rest.
+ *
+ * @param ring the ring
+ * @param which the doorbell
+ */
+void
+_dbus_shm_ring_wake_self (DBusShmRing         *ring,
+                          DBusShmRingDoorbell  which)
+{
+  _dbus_eventfd_signal (ring->doorbells[which]);
+}
+
+static void
+publish_head (DBusShmRing   *ring,
+              dbus_uint32_t  old_head,
+              dbus_uint32_t  head)
+{
+  DBusShmRingControl *control = ring->out_control;
+
+  /* the bytes must be there before the reader can see them */
+  _dbus_memory_barrier ();
+  ring->out_head = head;
+  control->head = head;
+  _dbus_memory_barrier ();
+
+  /* A reader that had read everything may be asleep. If it still had
+   * some to go, it looks at the head again after storing its tail,
+   * and the barriers mean it sees ours or we see its tail. */
+  if (control->tail == old_head)
+    _dbus_eventfd_signal (ring->peer_doorbells[DBUS_SHM_RING_DATA]);
+}
+
+/**
+ * Copies as much of the given buffers into the outgoing ring as fits,
+ * like a non-blocking write(). After a short write, the space
+ * doorbell rings once the reader has made room.
+ *
+ * @param ring the ring
+ * @param buffers the strings to write from
+ * @param starts where in each string to start
+ * @param lens how much of each string to write
+ * @param n_buffers the number of strings
+ * @returns the number of bytes written, or -1 if the peer corrupted the ring
+ */
+int
+_dbus_shm_ring_write (DBusShmRing       *ring,
+                      const DBusString **buffers,
+                      const int         *starts,
+                      const int         *lens,
+                      int                n_buffers)
+{
+  DBusShmRingControl *control = ring->out_control;
+  dbus_bool_t waiting;
+  int total;
+  int done;
+  int i;
+
+  waiting = FALSE;
+  total = 0;
+  done = 0;
+  i = 0;
+
+  while (TRUE)
+    {
+      dbus_uint32_t old_head, head, used, space;
+
+      old_head = head = ring->out_head;
+      used = head - control->tail;
+
+      if (used > ring->size)
+        return -1;
+
+      space = ring->size - used;
+
+      /* the reader must have finished with bytes before we reuse them */
+      _dbus_memory_barrier ();
+
+      while (i < n_buffers && space > 0)
+        {
+          const unsigned char *data;
+          dbus_uint32_t offset, n, first;
+
+          n = MIN (space, (dbus_uint32_t) (lens[i] - done));
+          data = (const unsigned char *)
+            _dbus_string_get_const_data_len (buffers[i], starts[i] + done, n);
+
+          offset = head & (ring->size - 1);
+          first = MIN (n, ring->size - offset);
+          memcpy (ring->out_data + offset, data, first);
+          memcpy (ring->out_data, data + first, n - first);
+
+          head += n;
+          space -= n;
+          total += n;
+          done += n;
+
+          if (done == lens[i])
+            {
+              i++;
+              done = 0;
+            }
+        }
+
+      if (head != old_head)
+        publish_head (ring, old_head, head);
+
+      if (i == n_buffers)
+        {
+          if (waiting)
+            control->writer_waiting = 0;
+          break;
+        }
+
+      if (waiting)
+        break;
+
+      /* Full: ask the reader for a wakeup, then look again in case it
+       * made room before it could see that we asked */
+      control->writer_waiting = 1;
+      _dbus_memory_barrier ();
+      waiting = TRUE;
+    }
+
+  return total;
+}
+
+/**
+ * Checks whether the reader has read everything we wrote, for instance
+ * before sending something on the socket that must not overtake it.
+ * If not, the space doorbell rings once it has read some more.
+ *
+ * @param ring the ring
+ * @returns #TRUE if the outgoing ring is empty
+ */
+dbus_bool_t
+_dbus_shm_ring_outgoing_drained (DBusShmRing *ring)
+{
+  DBusShmRingControl *control = ring->out_control;
+
+  if (control->tail == ring->out_head)
+    return TRUE;
+
+  control->writer_waiting = 1;
+  _dbus_memory_barrier ();
+
+  if (control->tail == ring->out_head)
+    {
+      control->writer_waiting = 0;
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+/**
+ * Counts bytes sent on the socket rather than through the ring, so
+ * that the reader knows to read them before anything written to the
+ * ring after them.
+ *
+ * @param ring the ring
+ * @param n_bytes how many bytes were sent
+ */
+void
+_dbus_shm_ring_add_socket_bytes (DBusShmRing *ring,
+                                 int          n_bytes)
+{
+  ring->out_socket_bytes += n_bytes;
+  /* publish_head() has a barrier before the next head */
+  ring->out_control->socket_bytes = ring->out_socket_bytes;
+}
+
+/**
+ * Gets how many bytes are waiting in the incoming ring. If the
+ * peer's socket byte count is ahead of what we read from the socket,
+ * those bytes came first and must be read before these.
+ *
+ * @param ring the ring
+ * @param peer_socket_bytes return location for the peer's count of socket bytes, or #NULL
+ * @returns the number of bytes, or -1 if the peer corrupted the ring
+ */
+int
+_dbus_shm_ring_get_readable (DBusShmRing   *ring,
+                             dbus_uint32_t *peer_socket_bytes)
+{
+  DBusShmRingControl *control = ring->in_control;
+  dbus_uint32_t head, used;
+
+  head = control->head;
+
+  /* the peer counted its socket bytes, and wrote the data, before it
+   * stored this head */
+  _dbus_memory_barrier ();
+
+  if (peer_socket_bytes != NULL)
+    *peer_socket_bytes = control->socket_bytes;
+
+  used = head - ring->in_tail;
+
+  if (used > ring->size)
+    return -1;
+
+  ring->in_readable = used;
+  return used;
+}
+
+/**
+ * Appends bytes from the incoming ring to a string, and wakes the
+ * writer if it was waiting for room.
+ *
+ * @param ring the ring
+ * @param buffer the string to append to
+ * @param len how many bytes, at most what _dbus_shm_ring_get_readable() said
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_shm_ring_read (DBusShmRing *ring,
+                     DBusString  *buffer,
+                     int          len)
+{
+  DBusShmRingControl *control = ring->in_control;
+  unsigned char *dest;
+  dbus_uint32_t offset, first;
+  int start;
+
+  _dbus_assert (len >= 0 && (dbus_uint32_t) len <= ring->in_readable);
+
+  start = _dbus_string_get_length (buffer);
+
+  if (!_dbus_string_lengthen (buffer, len))
+    return FALSE;
+
+  dest = (unsigned char *) _dbus_string_get_data_len (buffer, start, len);
+  offset = ring->in_tail & (ring->size - 1);
+  first = MIN ((dbus_uint32_t) len, ring->size - offset);
+  memcpy (dest, ring->in_data + offset, first);
+  memcpy (dest + first, ring->in_data, len - first);
+
+  /* we must have the bytes before the writer may reuse them */
+  _dbus_memory_barrier ();
+  ring->in_tail += len;
+  ring->in_readable -= len;
+  control->tail = ring->in_tail;
+  _dbus_memory_barrier ();
+
+  if (control->writer_waiting)
+    {
+      control->writer_waiting = 0;
+      _dbus_eventfd_signal (ring->peer_doorbells[DBUS_SHM_RING_SPACE]);
+    }
+
+  return TRUE;
+}
+
+/** @} */
+
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+
+static dbus_bool_t
+doorbell_is_rung (DBusShmRing         *ring,
+                  DBusShmRingDoorbell  which)
+{
+  DBusPollFD pfd;
+
+  pfd.fd = _dbus_shm_ring_get_doorbell (ring, which);
+  pfd.events = _DBUS_POLLIN;
+  pfd.revents = 0;
+
+  return _dbus_poll (&pfd, 1, 0) == 1 && (pfd.revents & _DBUS_POLLIN);
+}
+
+static void
+check_write (DBusShmRing      *ring,
+             const DBusString *str,
+             int               start,
+             int               len,
+             int               expected)
+{
+  const DBusString *buffers[1];
+  int starts[1];
+  int lens[1];
+
+  buffers[0] = str;
+  starts[0] = start;
+  lens[0] = len;
+
+  if (_dbus_shm_ring_write (ring, buffers, starts, lens, 1) != expected)
+    _dbus_assert_not_reached ("ring wrote the wrong number of bytes");
+}
+
+static void
+check_read (DBusShmRing      *ring,
+            const DBusString *expected,
+            int               start,
+            int               len)
+{
+  DBusString got;
+
+  if (!_dbus_string_init (&got))
+    _dbus_assert_not_reached ("no memory");
+
+  if (_dbus_shm_ring_get_readable (ring, NULL) < len)
+    _dbus_assert_not_reached ("ring has too little to read");
+
+  if (!_dbus_shm_ring_read (ring, &got, len))
+    _dbus_assert_not_reached ("no memory");
+
+  if (!_dbus_string_equal_substring (&got, 0, len, expected, start))
+    _dbus_assert_not_reached ("ring returned the wrong bytes");
+
+  _dbus_string_free (&got);
+}
+
+/**
+ * @ingroup DBusShmRing
+ * Unit test for the shared memory rings.
+ *
+ * @returns #TRUE on success.
+ */
+dbus_bool_t
+_dbus_shm_ring_test (void)
+{
+  DBusShmRing *server;
+  DBusShmRing *client;
+  DBusError error;
+  DBusString data;
+  int fds[DBUS_SHM_RING_N_SETUP_FDS];
+  dbus_uint32_t size;
+  dbus_uint32_t socket_bytes;
+  int i;
+
+  dbus_error_init (&error);
+
+  server = _dbus_shm_ring_new_server (&error);
+
+  if (server == NULL)
+    {
+      _dbus_verbose ("Skipping shared memory ring test: %s\n", error.message);
+      dbus_error_free (&error);
+      return TRUE;
+    }
+
+  /* the client gets its own copies, as if passed over a socket */
+  _dbus_shm_ring_get_setup (server, fds, &size);
+
+  for (i = 0; i < DBUS_SHM_RING_N_SETUP_FDS; i++)
+    {
+      fds[i] = _dbus_dup (fds[i], &error);
+      _dbus_assert (fds[i] >= 0);
+    }
+
+  _dbus_shm_ring_setup_sent (server);
+
+  client = _dbus_shm_ring_new_client (fds, size, &error);
+  _dbus_assert (client != NULL);
+
+  if (!_dbus_string_init (&data))
+    _dbus_assert_not_reached ("no memory");
+
+  for (i = 0; i < (int) size + 100; i++)
+    {
+      if (!_dbus_string_append_byte (&data, (i * 7) & 0xff))
+        _dbus_assert_not_reached ("no memory");
+    }
+
+  /* writing to an empty ring rings the reader's doorbell */
+  _dbus_assert (_dbus_shm_ring_get_readable (client, NULL) == 0);
+  _dbus_assert (!doorbell_is_rung (client, DBUS_SHM_RING_DATA));
+  check_write (server, &data, 0, 10, 10);
+  _dbus_assert (doorbell_is_rung (client, DBUS_SHM_RING_DATA));
+  _dbus_shm_ring_clear_doorbell (client, DBUS_SHM_RING_DATA);
+  _dbus_assert (!doorbell_is_rung (client, DBUS_SHM_RING_DATA));
+
+  /* writing to a ring that isn't empty doesn't */
+  check_write (server, &data, 10, 10, 10);
+  _dbus_assert (!doorbell_is_rung (client, DBUS_SHM_RING_DATA));
+  _dbus_assert (!_dbus_shm_ring_outgoing_drained (server));
+  check_read (client, &data, 0, 20);
+  _dbus_assert (doorbell_is_rung (server, DBUS_SHM_RING_SPACE));
+  _dbus_shm_ring_clear_doorbell (server, DBUS_SHM_RING_SPACE);
+  _dbus_assert (_dbus_shm_ring_outgoing_drained (server));
+
+  /* socket bytes are reported with the data written after them */
+  _dbus_shm_ring_add_socket_bytes (client, 3);
+  check_write (client, &data, 0, 1, 1);
+  _dbus_assert (_dbus_shm_ring_get_readable (server, &socket_bytes) == 1);
+  _dbus_assert (socket_bytes == 3);
+  check_read (server, &data, 0, 1);
+
+  /* a short write when full, then a wakeup once there is room,
+   * and the rest goes in across the end of the data area */
+  check_write (server, &data, 0, size + 100, size);
+  _dbus_assert (!doorbell_is_rung (server, DBUS_SHM_RING_SPACE));
+  check_read (client, &data, 0, 100);
+  _dbus_assert (doorbell_is_rung (server, DBUS_SHM_RING_SPACE));
+  _dbus_shm_ring_clear_doorbell (server, DBUS_SHM_RING_SPACE);
+  check_write (server, &data, size, 100, 100);
+  check_read (client, &data, 100, size);
+  _dbus_assert (_dbus_shm_ring_get_readable (client, NULL) == 0);
+
+  /* a peer that claims more than fits is caught */
+  client->in_control->head = client->in_tail + size + 1;
+  _dbus_assert (_dbus_shm_ring_get_readable (client, NULL) == -1);
+  server->out_control->tail = server->out_head + 1;
+  _dbus_assert (_dbus_shm_ring_write (server, NULL, NULL, NULL, 0) == -1);
+
+  _dbus_string_free (&data);
+  _dbus_shm_ring_free (client);
+  _dbus_shm_ring_free (server);
+  return TRUE;
+}
+
+#endif /* DBUS_ENABLE_EMBEDDED_TESTS */
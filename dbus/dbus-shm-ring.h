@@ -0,0 +1,83 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-shm-ring.h  Shared memory rings between two processes on one host
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#ifndef DBUS_SHM_RING_H
+#define DBUS_SHM_RING_H
+
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-string.h>
+
+/* The fds that set up a ring travel over the socket, and the ring
+ * itself is a memfd with eventfds to wake the other side */
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_SYS_EVENTFD_H) && defined(HAVE_UNIX_FD_PASSING)
+#define DBUS_HAVE_SHM_RING 1
+#endif
+
+DBUS_BEGIN_DECLS
+
+/** Number of fds the server sends to set up a ring */
+#define DBUS_SHM_RING_N_SETUP_FDS 5
+
+/**
+ * The two eventfds each side of a ring waits on.
+ */
+typedef enum
+{
+  DBUS_SHM_RING_DATA,   /**< The peer wrote to our incoming ring */
+  DBUS_SHM_RING_SPACE   /**< The peer made room in our outgoing ring */
+} DBusShmRingDoorbell;
+
+typedef struct DBusShmRing DBusShmRing;
+
+DBusShmRing *_dbus_shm_ring_new_server         (DBusError            *error);
+DBusShmRing *_dbus_shm_ring_new_client         (int                  *fds,
+                                                dbus_uint32_t         size,
+                                                DBusError            *error);
+void         _dbus_shm_ring_free               (DBusShmRing          *ring);
+void         _dbus_shm_ring_get_setup          (DBusShmRing          *ring,
+                                                int                  *fds,
+                                                dbus_uint32_t        *size);
+void         _dbus_shm_ring_setup_sent         (DBusShmRing          *ring);
+
+int          _dbus_shm_ring_get_doorbell       (DBusShmRing          *ring,
+                                                DBusShmRingDoorbell   which);
+void         _dbus_shm_ring_clear_doorbell     (DBusShmRing          *ring,
+                                                DBusShmRingDoorbell   which);
+void         _dbus_shm_ring_wake_self          (DBusShmRing          *ring,
+                                                DBusShmRingDoorbell   which);
+
+int          _dbus_shm_ring_write              (DBusShmRing          *ring,
+                                                const DBusString    **buffers,
+                                                const int            *starts,
+                                                const int            *lens,
+                                                int                   n_buffers);
+dbus_bool_t  _dbus_shm_ring_outgoing_drained   (DBusShmRing          *ring);
+void         _dbus_shm_ring_add_socket_bytes   (DBusShmRing          *ring,
+                                                int                   n_bytes);
+
+int          _dbus_shm_ring_get_readable       (DBusShmRing          *ring,
+                                                dbus_uint32_t        *peer_socket_bytes);
+dbus_bool_t  _dbus_shm_ring_read               (DBusShmRing          *ring,
+                                                DBusString           *buffer,
+                                                int                   len);
+
+DBUS_END_DECLS
+
+#endif /* DBUS_SHM_RING_H */
@@ -408,6 +408,126 @@ dbus_type_is_valid (int typecode)
     }
 }
 
+/* Returns where the value iter points at would end if marshalled at
+ * pos, or DBUS_MAXIMUM_MESSAGE_LENGTH if that would be even further */
+static int
+estimate_value_end (const DBusSignatureIter *iter,
+                    int                      pos,
+                    int                      n_array_elements,
+                    int                      n_string_bytes)
+{
+  DBusSignatureIter sub;
+  int type;
+  int start;
+  int element_size;
+
+  type = dbus_signature_iter_get_current_type (iter);
+  pos = _DBUS_ALIGN_VALUE (pos, _dbus_type_get_alignment (type));
+
+  switch (type)
+    {
+    case DBUS_TYPE_STRING:
+    case DBUS_TYPE_OBJECT_PATH:
+      pos += 4 + n_string_bytes + 1;
+      break;
+
+    case DBUS_TYPE_SIGNATURE:
+      pos += 1 + MIN (n_string_bytes, DBUS_MAXIMUM_SIGNATURE_LENGTH) + 1;
+      break;
+
+    case DBUS_TYPE_VARIANT:
+      /* Counted as if it held a string */
+      pos += 1 + 1 + 1;
+      pos = _DBUS_ALIGN_VALUE (pos, 4);
+      pos += 4 + n_string_bytes + 1;
+      break;
+
+    case DBUS_TYPE_ARRAY:
+      pos += 4;
+      dbus_signature_iter_recurse (iter, &sub);
+      start = _DBUS_ALIGN_VALUE (pos,
+          _dbus_type_get_alignment (dbus_signature_iter_get_current_type (&sub)));
+
+      if (n_array_elements == 0)
+        break;
+
+      /* Elements can differ in padding, but not by much */
+      element_size = estimate_value_end (&sub, start, n_array_elements,
+                                         n_string_bytes) - start;
+
+      if (element_size > (DBUS_MAXIMUM_MESSAGE_LENGTH - start) / n_array_elements)
+        return DBUS_MAXIMUM_MESSAGE_LENGTH;
+
+      pos = start + element_size * n_array_elements;
+      break;
+
+    case DBUS_TYPE_STRUCT:
+    case DBUS_TYPE_DICT_ENTRY:
+      dbus_signature_iter_recurse (iter, &sub);
+
+      do
+        {
+          pos = estimate_value_end (&sub, pos, n_array_elements,
+                                    n_string_bytes);
+        }
+      while (pos < DBUS_MAXIMUM_MESSAGE_LENGTH &&
+             dbus_signature_iter_next (&sub));
+      break;
+
+    default:
+      /* Fixed-length basic types are as long as they are aligned */
+      pos += _dbus_type_get_alignment (type);
+      break;
+    }
+
+  return MIN (pos, DBUS_MAXIMUM_MESSAGE_LENGTH);
+}
+
+/**
+ * Estimates how many bytes a message body with the given signature
+ * takes, for reserving room with dbus_message_reserve_body(). Every
+ * array is assumed to have n_array_elements elements, every
+ * string-like value to be n_string_bytes long, and every variant to
+ * hold such a string. For a signature without arrays, strings or
+ * variants the result is exact. The estimate is never more than
+ * #DBUS_MAXIMUM_MESSAGE_LENGTH.
+ *
+ * @param signature a valid type signature
+ * @param n_array_elements number of elements to assume for each array
+ * @param n_string_bytes length to assume for each string, object path or signature
+ * @returns estimated body size in bytes
+ */
+int
+dbus_signature_estimate_size (const char *signature,
+                              int         n_array_elements,
+                              int         n_string_bytes)
+{
+  DBusSignatureIter iter;
+  int pos;
+
+  _dbus_return_val_if_fail (signature != NULL, 0);
+  _dbus_return_val_if_fail (n_array_elements >= 0, 0);
+  _dbus_return_val_if_fail (n_string_bytes >= 0, 0);
+  _dbus_return_val_if_fail (n_string_bytes <= DBUS_MAXIMUM_MESSAGE_LENGTH, 0);
+  _dbus_return_val_if_fail (dbus_signature_validate (signature, NULL), 0);
+
+  dbus_signature_iter_init (&iter, signature);
+
+  if (dbus_signature_iter_get_current_type (&iter) == DBUS_TYPE_INVALID)
+    return 0;
+
+  pos = 0;
+
+  do
+    {
+      pos = estimate_value_end (&iter, pos, n_array_elements, n_string_bytes);
+    }
+  while (pos < DBUS_MAXIMUM_MESSAGE_LENGTH &&
+         dbus_signature_iter_next (&iter));
+
+  return pos;
+}
+
 /** @} */ /* end of DBusSignature group */
 
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
@@ -436,6 +556,16 @@ _dbus_signature_test (void)
   dbus_signature_iter_init (&iter, sig);
   _dbus_assert (dbus_signature_iter_get_current_type (&iter) == DBUS_TYPE_INVALID);
 
+  _dbus_assert (dbus_signature_estimate_size ("", 10, 10) == 0);
+  _dbus_assert (dbus_signature_estimate_size ("yu", 10, 10) == 8);
+  _dbus_assert (dbus_signature_estimate_size ("(yd)", 10, 10) == 16);
+  _dbus_assert (dbus_signature_estimate_size ("s", 10, 5) == 10);
+  _dbus_assert (dbus_signature_estimate_size ("ay", 10, 10) == 14);
+  _dbus_assert (dbus_signature_estimate_size ("ad", 0, 10) == 4);
+  _dbus_assert (dbus_signature_estimate_size ("a(id)", 3, 10) == 56);
+  _dbus_assert (dbus_signature_estimate_size ("aay", 1000000, 0) ==
+                DBUS_MAXIMUM_MESSAGE_LENGTH);
+
   sig = DBUS_TYPE_STRING_AS_STRING;
   _dbus_assert (dbus_signature_validate (sig, NULL));
   _dbus_assert (dbus_signature_validate_single (sig, NULL));
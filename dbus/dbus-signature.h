@@ -81,6 +81,11 @@ dbus_bool_t     dbus_signature_validate_single       (const char       *signatur
 DBUS_EXPORT
 dbus_bool_t     dbus_type_is_valid                   (int            typecode);
 
+DBUS_EXPORT
+int             dbus_signature_estimate_size         (const char       *signature,
+                                                      int               n_array_elements,
+                                                      int               n_string_bytes);
+
 DBUS_EXPORT
 dbus_bool_t     dbus_type_is_basic                   (int            typecode);
 DBUS_EXPORT
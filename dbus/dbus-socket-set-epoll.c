@@ -25,6 +25,7 @@
 #include <config.h>
 #include "dbus-socket-set.h"
 
+#include <dbus/dbus-hash.h>
 #include <dbus/dbus-internals.h>
 #include <dbus/dbus-sysdeps.h>
 
@@ -39,9 +40,32 @@
 
 #ifndef DOXYGEN_SHOULD_SKIP_THIS
 
+typedef struct SocketSetEpollFd SocketSetEpollFd;
+
+/* What we asked the kernel for and what our caller wants can differ:
+ * see socket_set_epoll_enable() */
+struct SocketSetEpollFd {
+    int fd;
+    /* level-triggered events registered with the kernel, or 0 if only
+     * EPOLLET is registered */
+    uint32_t kernel_events;
+    /* events our caller has enabled, or 0 if disabled */
+    uint32_t wanted_events;
+    SocketSetEpollFd *prev_dirty;
+    SocketSetEpollFd *next_dirty;
+    dbus_bool_t dirty;
+};
+
 typedef struct {
     DBusSocketSet parent;
     int epfd;
+    /* int fd => owned SocketSetEpollFd */
+    DBusHashTable *fds;
+    /* fds with wanted_events that are not in kernel_events */
+    SocketSetEpollFd *dirty;
+    /* room for more events than fit on the stack, grown on demand */
+    struct epoll_event *events;
+    int n_events_allocated;
 } DBusSocketSetEpoll;
 
 static inline DBusSocketSetEpoll *
@@ -63,6 +87,10 @@ socket_set_epoll_free (DBusSocketSet *set)
   if (self->epfd != -1)
     close (self->epfd);
 
+  if (self->fds != NULL)
+    _dbus_hash_table_unref (self->fds);
+
+  dbus_free (self->events);
   dbus_free (self);
 }
 
@@ -78,6 +106,15 @@ _dbus_socket_set_epoll_new (void)
 
   self->parent.cls = &_dbus_socket_set_epoll_class;
 
+  self->fds = _dbus_hash_table_new (DBUS_HASH_INT, NULL, dbus_free);
+
+  if (self->fds == NULL)
+    {
+      self->epfd = -1;
+      socket_set_epoll_free ((DBusSocketSet *) self);
+      return NULL;
+    }
+
   self->epfd = epoll_create1 (EPOLL_CLOEXEC);
 
   if (self->epfd == -1)
@@ -134,6 +171,106 @@ epoll_events_to_watch_flags (uint32_t events)
   return flags;
 }
 
+static void
+socket_set_epoll_mark_dirty (DBusSocketSetEpoll *self,
+                             SocketSetEpollFd   *entry)
+{
+  if (entry->dirty)
+    return;
+
+  entry->dirty = TRUE;
+  entry->prev_dirty = NULL;
+  entry->next_dirty = self->dirty;
+
+  if (self->dirty != NULL)
+    self->dirty->prev_dirty = entry;
+
+  self->dirty = entry;
+}
+
+static void
+socket_set_epoll_unmark_dirty (DBusSocketSetEpoll *self,
+                               SocketSetEpollFd   *entry)
+{
+  if (!entry->dirty)
+    return;
+
+  if (entry->prev_dirty != NULL)
+    entry->prev_dirty->next_dirty = entry->next_dirty;
+  else
+    self->dirty = entry->next_dirty;
+
+  if (entry->next_dirty != NULL)
+    entry->next_dirty->prev_dirty = entry->prev_dirty;
+
+  entry->dirty = FALSE;
+  entry->prev_dirty = NULL;
+  entry->next_dirty = NULL;
+}
+
+/* Register exactly @events with the kernel, level-triggered */
+static void
+socket_set_epoll_arm (DBusSocketSetEpoll *self,
+                      SocketSetEpollFd   *entry,
+                      uint32_t            events)
+{
+  struct epoll_event event;
+  int err;
+
+  event.data.ptr = entry;
+
+  /* The naive thing to do for no events would be EPOLL_CTL_DEL, but
+   * that'll probably free resources in the kernel. When we come to arm
+   * it again, there might not be enough resources to bring it back!
+   *
+   * The next idea you might have is to set the flags to 0. However, events
+   * always trigger on EPOLLERR and EPOLLHUP, even if libdbus isn't actually
+   * delivering them to a DBusWatch. Because epoll is level-triggered by
+   * default, we'll busy-loop on an unhandled error or hangup; not good.
+   *
+   * So, let's set it to be edge-triggered: then the worst case is that
+   * we get one event, which socket_set_epoll_poll() drops because no
+   * watch is enabled. When we re-enable a watch we'll switch back to
+   * level-triggered and be notified again (verified to work on 2.6.32).
+   * Compile this file with -DTEST_BEHAVIOUR_OF_EPOLLET for test code.
+   */
+  if (events != 0)
+    event.events = events;
+  else
+    event.events = EPOLLET;
+
+  if (epoll_ctl (self->epfd, EPOLL_CTL_MOD, entry->fd, &event) == 0)
+    {
+      entry->kernel_events = events;
+      return;
+    }
+
+  err = errno;
+
+  /* Enabling a file descriptor isn't allowed to fail, even for OOM, so we
+   * do our best to avoid all of these. */
+  switch (err)
+    {
+      case EBADF:
+        _dbus_warn ("Bad fd %d\n", entry->fd);
+        break;
+
+      case ENOENT:
+        _dbus_warn ("fd %d enabled before it was added\n", entry->fd);
+        break;
+
+      case ENOMEM:
+        _dbus_warn ("Insufficient memory to change watch for fd %d\n",
+                    entry->fd);
+        break;
+
+      default:
+        _dbus_warn ("Misc error when trying to watch fd %d: %s\n", entry->fd,
+                    strerror (err));
+        break;
+    }
+}
+
 static dbus_bool_t
 socket_set_epoll_add (DBusSocketSet  *set,
                       DBusPollable    fd,
@@ -141,19 +278,38 @@ socket_set_epoll_add (DBusSocketSet  *set,
                       dbus_bool_t     enabled)
 {
   DBusSocketSetEpoll *self = socket_set_epoll_cast (set);
+  SocketSetEpollFd *entry;
   struct epoll_event event;
   int err;
 
-  event.data.fd = fd;
+  entry = dbus_new0 (SocketSetEpollFd, 1);
+
+  if (entry == NULL)
+    return FALSE;
+
+  entry->fd = fd;
 
   if (enabled)
+    entry->wanted_events = watch_flags_to_epoll_events (flags);
+
+  entry->kernel_events = entry->wanted_events;
+
+  if (!_dbus_hash_table_insert_int (self->fds, fd, entry))
     {
-      event.events = watch_flags_to_epoll_events (flags);
+      dbus_free (entry);
+      return FALSE;
+    }
+
+  event.data.ptr = entry;
+
+  if (entry->kernel_events != 0)
+    {
+      event.events = entry->kernel_events;
     }
   else
     {
       /* We need to add *something* to reserve space in the kernel's data
-       * structures: see socket_set_epoll_disable for more details */
+       * structures: see socket_set_epoll_arm for more details */
       event.events = EPOLLET;
     }
 
@@ -184,47 +340,42 @@ socket_set_epoll_add (DBusSocketSet  *set,
         break;
     }
 
+  /* frees entry */
+  _dbus_hash_table_remove_int (self->fds, fd);
+
   return FALSE;
 }
 
+/*
+ * DBusTransport enables and disables its write watch around nearly every
+ * message it queues, so we avoid calling epoll_ctl() for each toggle.
+ * Events that are enabled but not yet registered with the kernel are
+ * registered in one go by the next socket_set_epoll_poll(). Events that
+ * are no longer wanted simply stay registered: socket_set_epoll_poll()
+ * filters them out, and only stops the kernel reporting them if one of them
+ * actually happens. A watch that is disabled and re-enabled between two
+ * polls, or that stays enabled while it is idle, costs no syscalls at all.
+ */
 static void
 socket_set_epoll_enable (DBusSocketSet  *set,
                          DBusPollable    fd,
                          unsigned int    flags)
 {
   DBusSocketSetEpoll *self = socket_set_epoll_cast (set);
-  struct epoll_event event;
-  int err;
-
-  event.data.fd = fd;
-  event.events = watch_flags_to_epoll_events (flags);
-
-  if (epoll_ctl (self->epfd, EPOLL_CTL_MOD, fd, &event) == 0)
-    return;
+  SocketSetEpollFd *entry;
 
-  err = errno;
+  entry = _dbus_hash_table_lookup_int (self->fds, fd);
 
-  /* Enabling a file descriptor isn't allowed to fail, even for OOM, so we
-   * do our best to avoid all of these. */
-  switch (err)
+  if (entry == NULL)
     {
-      case EBADF:
-        _dbus_warn ("Bad fd %d\n", fd);
-        break;
+      _dbus_warn ("fd %d enabled before it was added\n", fd);
+      return;
+    }
 
-      case ENOENT:
-        _dbus_warn ("fd %d enabled before it was added\n", fd);
-        break;
+  entry->wanted_events = watch_flags_to_epoll_events (flags);
 
-      case ENOMEM:
-        _dbus_warn ("Insufficient memory to change watch for fd %d\n", fd);
-        break;
-
-      default:
-        _dbus_warn ("Misc error when trying to watch fd %d: %s\n", fd,
-                    strerror (err));
-        break;
-    }
+  if ((entry->wanted_events & ~entry->kernel_events) != 0)
+    socket_set_epoll_mark_dirty (self, entry);
 }
 
 static void
@@ -232,34 +383,19 @@ socket_set_epoll_disable (DBusSocketSet  *set,
                           DBusPollable    fd)
 {
   DBusSocketSetEpoll *self = socket_set_epoll_cast (set);
-  struct epoll_event event;
-  int err;
+  SocketSetEpollFd *entry;
 
-  /* The naive thing to do would be EPOLL_CTL_DEL, but that'll probably
-   * free resources in the kernel. When we come to do socket_set_epoll_enable,
-   * there might not be enough resources to bring it back!
-   *
-   * The next idea you might have is to set the flags to 0. However, events
-   * always trigger on EPOLLERR and EPOLLHUP, even if libdbus isn't actually
-   * delivering them to a DBusWatch. Because epoll is level-triggered by
-   * default, we'll busy-loop on an unhandled error or hangup; not good.
-   *
-   * So, let's set it to be edge-triggered: then the worst case is that
-   * we return from poll immediately on one iteration, ignore it because no
-   * watch is enabled, then go back to normal. When we re-enable a watch
-   * we'll switch back to level-triggered and be notified again (verified to
-   * work on 2.6.32). Compile this file with -DTEST_BEHAVIOUR_OF_EPOLLET for
-   * test code.
-   */
-  event.data.fd = fd;
-  event.events = EPOLLET;
+  entry = _dbus_hash_table_lookup_int (self->fds, fd);
 
-  if (epoll_ctl (self->epfd, EPOLL_CTL_MOD, fd, &event) == 0)
-    return;
+  if (entry == NULL)
+    {
+      _dbus_warn ("fd %d disabled before it was added\n", fd);
+      return;
+    }
 
-  err = errno;
-  _dbus_warn ("Error when trying to watch fd %d: %s\n", fd,
-              strerror (err));
+  /* see socket_set_epoll_enable() */
+  entry->wanted_events = 0;
+  socket_set_epoll_unmark_dirty (self, entry);
 }
 
 static void
@@ -267,11 +403,21 @@ socket_set_epoll_remove (DBusSocketSet  *set,
                          DBusPollable    fd)
 {
   DBusSocketSetEpoll *self = socket_set_epoll_cast (set);
+  SocketSetEpollFd *entry;
   int err;
   /* Kernels < 2.6.9 require a non-NULL struct pointer, even though its
    * contents are ignored */
   struct epoll_event dummy = { 0 };
 
+  entry = _dbus_hash_table_lookup_int (self->fds, fd);
+
+  if (entry != NULL)
+    {
+      socket_set_epoll_unmark_dirty (self, entry);
+      /* frees entry */
+      _dbus_hash_table_remove_int (self->fds, fd);
+    }
+
   if (epoll_ctl (self->epfd, EPOLL_CTL_DEL, fd, &dummy) == 0)
     return;
 
@@ -284,6 +430,42 @@ socket_set_epoll_remove (DBusSocketSet  *set,
  * memory. */
 #define N_STACK_DESCRIPTORS 64
 
+/* Gets room for as many events as the caller can take and there are
+ * fds to report them, growing self->events when that is more than
+ * fits on the stack. If that fails we make do with what we have. */
+static struct epoll_event *
+socket_set_epoll_get_events (DBusSocketSetEpoll *self,
+                             struct epoll_event *stack_events,
+                             int                 max_events,
+                             int                *n_events_p)
+{
+  struct epoll_event *new_events;
+  int wanted;
+
+  wanted = MIN (max_events, _dbus_hash_table_get_n_entries (self->fds));
+
+  if (wanted > N_STACK_DESCRIPTORS && wanted > self->n_events_allocated)
+    {
+      new_events = dbus_realloc (self->events,
+                                 wanted * sizeof (struct epoll_event));
+
+      if (new_events != NULL)
+        {
+          self->events = new_events;
+          self->n_events_allocated = wanted;
+        }
+    }
+
+  if (self->n_events_allocated > N_STACK_DESCRIPTORS)
+    {
+      *n_events_p = MIN (max_events, self->n_events_allocated);
+      return self->events;
+    }
+
+  *n_events_p = MIN (max_events, N_STACK_DESCRIPTORS);
+  return stack_events;
+}
+
 static int
 socket_set_epoll_poll (DBusSocketSet   *set,
                        DBusSocketEvent *revents,
@@ -291,26 +473,60 @@ socket_set_epoll_poll (DBusSocketSet   *set,
                        int              timeout_ms)
 {
   DBusSocketSetEpoll *self = socket_set_epoll_cast (set);
-  struct epoll_event events[N_STACK_DESCRIPTORS];
+  struct epoll_event stack_events[N_STACK_DESCRIPTORS];
+  struct epoll_event *events;
+  int n_events;
   int n_ready;
   int i;
 
+  int n_wanted;
+
   _dbus_assert (max_events > 0);
 
-  n_ready = epoll_wait (self->epfd, events,
-                        MIN (_DBUS_N_ELEMENTS (events), max_events),
-                        timeout_ms);
+  while (self->dirty != NULL)
+    {
+      SocketSetEpollFd *entry = self->dirty;
+
+      socket_set_epoll_unmark_dirty (self, entry);
+      socket_set_epoll_arm (self, entry, entry->wanted_events);
+    }
+
+  events = socket_set_epoll_get_events (self, stack_events, max_events,
+                                        &n_events);
+  n_ready = epoll_wait (self->epfd, events, n_events, timeout_ms);
 
   if (n_ready <= 0)
     return n_ready;
 
+  n_wanted = 0;
+
   for (i = 0; i < n_ready; i++)
     {
-      revents[i].fd = events[i].data.fd;
-      revents[i].flags = epoll_events_to_watch_flags (events[i].events);
+      SocketSetEpollFd *entry = events[i].data.ptr;
+      uint32_t wanted;
+
+      if (entry->wanted_events != 0)
+        wanted = events[i].events & (entry->wanted_events | EPOLLERR | EPOLLHUP);
+      else
+        wanted = 0;
+
+      if (wanted == 0)
+        {
+          /* Only events nobody asked for; stop the kernel reporting
+           * them. If only EPOLLET was registered, that is already the
+           * case, and touching it again would re-arm the edge. */
+          if (entry->kernel_events != 0)
+            socket_set_epoll_arm (self, entry, entry->wanted_events);
+
+          continue;
+        }
+
+      revents[n_wanted].fd = entry->fd;
+      revents[n_wanted].flags = epoll_events_to_watch_flags (wanted);
+      n_wanted++;
     }
 
-  return n_ready;
+  return n_wanted;
 }
 
 DBusSocketSetClass _dbus_socket_set_epoll_class = {
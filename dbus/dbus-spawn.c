@@ -189,7 +189,7 @@ read_pid (int        fd,
  * main process
  * | fork() A
  * \- babysitter
- *    | fork () B
+ *    | vfork () B
  *    \- grandchild     --> exec -->    spawned process
  *
  * IPC:
@@ -222,6 +222,12 @@ read_pid (int        fd,
  * On SIGCHLD, the babysitter sends CHILD_EXITED + the exit status.
  * The main process doesn't explicitly send anything, but when it exits,
  * the babysitter gets POLLHUP or POLLERR.
+ *
+ * The babysitter has to be a real process, so that the spawned process
+ * is inherited by init once nobody is watching it, but the grandchild
+ * doesn't: the babysitter sets up everything it will inherit, and
+ * starts it with vfork() where available, so that a big main process's
+ * page tables are only copied once per spawn.
  */
 
 /* Messages from children to parents */
@@ -1002,21 +1008,22 @@ write_status_and_exit (int fd, int status)
   exit (0);
 }
 
+/* Runs in the babysitter: everything the spawned process is meant to
+ * inherit is set up here, so that exec_child() only has to exec. The
+ * other fds passed in are still open here, but exec_child() closes them
+ * or makes them stdout and stderr. */
 static void
-do_exec (int                       child_err_report_fd,
-	 char                    **argv,
-	 char                    **envp,
-	 DBusSpawnChildSetupFunc   child_setup,
-	 void                     *user_data)
+prepare_child (int                       child_err_report_fd,
+               int                       babysitter_fd,
+               int                       fd_out,
+               int                       fd_err,
+               DBusSpawnChildSetupFunc   child_setup,
+               void                     *user_data)
 {
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
   int i, max_open;
 #endif
 
-  _dbus_verbose_reset ();
-  _dbus_verbose ("Child process has PID " DBUS_PID_FORMAT "\n",
-                 _dbus_getpid ());
-  
   if (child_setup)
     (* child_setup) (user_data);
 
@@ -1027,7 +1034,8 @@ do_exec (int                       child_err_report_fd,
     {
       int retval;
 
-      if (i == child_err_report_fd)
+      if (i == child_err_report_fd || i == babysitter_fd ||
+          i == fd_out || i == fd_err)
         continue;
       
       retval = fcntl (i, F_GETFD);
@@ -1036,19 +1044,50 @@ do_exec (int                       child_err_report_fd,
         _dbus_warn ("Fd %d did not have the close-on-exec flag set!\n", i);
     }
 #endif
+}
+
+/* Runs in the grandchild, which may share the babysitter's memory
+ * until it execs (see vfork()), so it may only make system calls and
+ * must not change anything the babysitter will look at again */
+static void
+exec_child (int     child_err_report_fd,
+            int     babysitter_fd,
+            int     fd_out,
+            int     fd_err,
+            char  **argv,
+            char  **envp)
+{
+  int report[2];
+
+  /* Go back to ignoring SIGPIPE, since it's evil */
+  signal (SIGPIPE, SIG_IGN);
 
-  if (envp == NULL)
+  close (babysitter_fd);
+
+  /* log to systemd journal if possible */
+  if (fd_out >= 0)
     {
-      _dbus_assert (environ != NULL);
+      dup2 (fd_out, STDOUT_FILENO);
+      close (fd_out);
+    }
 
-      envp = environ;
+  if (fd_err >= 0)
+    {
+      dup2 (fd_err, STDERR_FILENO);
+      close (fd_err);
     }
-  
+
   execve (argv[0], argv, envp);
-  
-  /* Exec failed */
-  write_err_and_exit (child_err_report_fd,
-                      CHILD_EXEC_FAILED);
+
+  /* Exec failed; this is short enough for the pipe to take at once */
+  report[0] = CHILD_EXEC_FAILED;
+  report[1] = errno;
+
+  while (write (child_err_report_fd, report, sizeof (report)) < 0 &&
+         errno == EINTR)
+    ;
+
+  _exit (1);
 }
 
 static void
@@ -1189,8 +1228,9 @@ babysit (pid_t grandchild_pid,
 
 /**
  * Spawns a new process. The child_setup
- * function is passed the given user_data and is run in the child
- * just before calling exec().
+ * function is passed the given user_data and is run in the babysitter
+ * just before it starts the child, which inherits whatever it changes,
+ * such as resource limits.
  *
  * Also creates a "babysitter" which tracks the status of the
  * child process, advising the parent if the child exits.
@@ -1343,8 +1383,27 @@ _dbus_spawn_async_with_babysitter (DBusBabysitter          **sitter_p,
       close_and_invalidate (&child_err_report_pipe[READ_END]);
       close_and_invalidate (&babysitter_pipe[0].fd);
       
+#ifdef HAVE_SYSTEMD
+      prepare_child (child_err_report_pipe[WRITE_END], babysitter_pipe[1].fd,
+                     fd_out, fd_err, child_setup, user_data);
+#else
+      prepare_child (child_err_report_pipe[WRITE_END], babysitter_pipe[1].fd,
+                     -1, -1, child_setup, user_data);
+#endif
+
+      if (env == NULL)
+        {
+          _dbus_assert (environ != NULL);
+
+          env = environ;
+        }
+
       /* Create the child that will exec () */
+#ifdef HAVE_VFORK
+      grandchild_pid = vfork ();
+#else
       grandchild_pid = fork ();
+#endif
       
       if (grandchild_pid < 0)
 	{
@@ -1354,28 +1413,19 @@ _dbus_spawn_async_with_babysitter (DBusBabysitter          **sitter_p,
 	}
       else if (grandchild_pid == 0)
       {
-          /* Go back to ignoring SIGPIPE, since it's evil
-           */
-          signal (SIGPIPE, SIG_IGN);
-
-          close_and_invalidate (&babysitter_pipe[1].fd);
 #ifdef HAVE_SYSTEMD
-	  /* log to systemd journal if possible */
-	  if (fd_out >= 0)
-            dup2 (fd_out, STDOUT_FILENO);
-	  if (fd_err >= 0)
-            dup2 (fd_err, STDERR_FILENO);
-          close_and_invalidate (&fd_out);
-          close_and_invalidate (&fd_err);
+	  exec_child (child_err_report_pipe[WRITE_END], babysitter_pipe[1].fd,
+		      fd_out, fd_err, argv, env);
+#else
+	  exec_child (child_err_report_pipe[WRITE_END], babysitter_pipe[1].fd,
+		      -1, -1, argv, env);
 #endif
-	  do_exec (child_err_report_pipe[WRITE_END],
-		   argv,
-		   env,
-		   child_setup, user_data);
           _dbus_assert_not_reached ("Got to code after exec() - should have exited on error");
 	}
       else
 	{
+          _dbus_verbose ("Child process has PID %d\n", grandchild_pid);
+
           close_and_invalidate (&child_err_report_pipe[WRITE_END]);
 #ifdef HAVE_SYSTEMD
           close_and_invalidate (&fd_out);
@@ -415,6 +415,74 @@ _dbus_string_test (void)
   _dbus_string_free (&str);
   _dbus_string_free (&other);
 
+  /* Check borrowed storage: growing past it, moving and stealing */
+  {
+    unsigned char storage[32];
+
+    _dbus_string_init_borrowed (&str, storage, sizeof (storage));
+
+    if (!_dbus_string_append (&str, "Hello World"))
+      _dbus_assert_not_reached ("could not append to string");
+
+    _dbus_assert (_dbus_string_get_const_data (&str) >= (char *) storage);
+    _dbus_assert (_dbus_string_get_const_data (&str) <
+                  (char *) storage + sizeof (storage));
+
+    i = 0;
+    while (i < 10)
+      {
+        if (!_dbus_string_append (&str, "Hello World"))
+          _dbus_assert_not_reached ("could not append to string");
+        ++i;
+      }
+
+    _dbus_assert (_dbus_string_get_length (&str) == 11 * 11);
+    _dbus_assert (_dbus_string_get_const_data (&str) < (char *) storage ||
+                  _dbus_string_get_const_data (&str) >=
+                  (char *) storage + sizeof (storage));
+    _dbus_string_free (&str);
+
+    _dbus_string_init_borrowed (&str, storage, sizeof (storage));
+
+    if (!_dbus_string_init (&other))
+      _dbus_assert_not_reached ("could not init string");
+
+    if (!_dbus_string_append (&other, "Hello World"))
+      _dbus_assert_not_reached ("could not append to string");
+
+    if (!_dbus_string_move (&other, 0, &str, 0))
+      _dbus_assert_not_reached ("could not move");
+
+    _dbus_assert (_dbus_string_get_length (&other) == 0);
+    _dbus_assert (_dbus_string_equal_c_str (&str, "Hello World"));
+
+    if (!_dbus_string_move (&str, 0, &other, 0))
+      _dbus_assert_not_reached ("could not move");
+
+    _dbus_assert (_dbus_string_get_length (&str) == 0);
+    _dbus_assert (_dbus_string_equal_c_str (&other, "Hello World"));
+    _dbus_string_free (&other);
+    _dbus_string_free (&str);
+
+    _dbus_string_init_borrowed (&str, storage, sizeof (storage));
+
+    if (!_dbus_string_append (&str, "Hello World"))
+      _dbus_assert_not_reached ("could not append to string");
+
+    if (!_dbus_string_steal_data (&str, &s))
+      _dbus_assert_not_reached ("failed to steal data");
+
+    _dbus_assert (strcmp (s, "Hello World") == 0);
+    dbus_free (s);
+
+    /* the string keeps its storage for the next value */
+    _dbus_assert (_dbus_string_get_length (&str) == 0);
+    _dbus_assert (_dbus_string_get_const_data (&str) >= (char *) storage);
+    _dbus_assert (_dbus_string_get_const_data (&str) <
+                  (char *) storage + sizeof (storage));
+    _dbus_string_free (&str);
+  }
+
   /* Check replace */
 
   if (!_dbus_string_init (&str))
@@ -932,6 +1000,58 @@ _dbus_string_test (void)
     _dbus_string_free (&str);
   }
 
+  /* Test UTF-8 validation with a nul, a bad byte or a valid
+   * two-byte character at every offset and alignment, so that both
+   * the word at a time and byte at a time paths see them */
+  {
+    const char *ascii = "abcdefghijklmnopqrstuvwxyz0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    int start, len, pos;
+
+    if (!_dbus_string_init (&str))
+      _dbus_assert_not_reached ("no memory");
+
+    for (start = 0; start < 8; start++)
+      for (len = 0; len < 48; len++)
+        {
+          if (!_dbus_string_set_length (&str, 0) ||
+              !_dbus_string_append_len (&str, ascii, start + len))
+            _dbus_assert_not_reached ("no memory");
+
+          if (!_dbus_string_validate_utf8 (&str, start, len))
+            _dbus_assert_not_reached ("ASCII should be valid UTF-8");
+
+          for (pos = start; pos < start + len; pos++)
+            {
+              _dbus_string_set_byte (&str, pos, '\0');
+              if (_dbus_string_validate_utf8 (&str, start, len))
+                _dbus_assert_not_reached ("embedded nul should be invalid");
+
+              _dbus_string_set_byte (&str, pos, 0x80);
+              if (_dbus_string_validate_utf8 (&str, start, len))
+                _dbus_assert_not_reached ("lone continuation byte should be invalid");
+
+              if (pos + 1 < start + len)
+                {
+                  _dbus_string_set_byte (&str, pos, 0xc3);
+                  _dbus_string_set_byte (&str, pos + 1, 0xa9);
+                  if (!_dbus_string_validate_utf8 (&str, start, len))
+                    _dbus_assert_not_reached ("two-byte character should be valid");
+                  _dbus_string_set_byte (&str, pos + 1, ascii[pos + 1]);
+                }
+              else
+                {
+                  _dbus_string_set_byte (&str, pos, 0xc3);
+                  if (_dbus_string_validate_utf8 (&str, start, len))
+                    _dbus_assert_not_reached ("truncated character should be invalid");
+                }
+
+              _dbus_string_set_byte (&str, pos, ascii[pos]);
+            }
+        }
+
+    _dbus_string_free (&str);
+  }
+
   return TRUE;
 }
 
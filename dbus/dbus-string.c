@@ -158,12 +158,83 @@ _dbus_string_init_preallocated (DBusString *str,
   real->locked = FALSE;
   real->invalid = FALSE;
   real->align_offset = 0;
+  real->borrowed = FALSE;
   
   fixup_alignment (real);
   
   return TRUE;
 }
 
+/**
+ * Initializes a string that starts out using the caller's buffer as
+ * its storage, for instance space inside a larger struct, and only
+ * moves to the heap if it outgrows it. The buffer must stay valid
+ * until the string is freed, and the string must still be freed with
+ * _dbus_string_free(), which doesn't free the buffer. The usable size
+ * is @p size minus #_DBUS_STRING_ALLOCATION_PADDING.
+ *
+ * This is cheapest for short-lived strings whose contents are usually
+ * small, with the buffer on the stack: _dbus_string_steal_data() hands
+ * out an exactly-sized copy and leaves the string in the buffer, ready
+ * for the next value.
+ *
+ * @param str memory to hold the string
+ * @param buffer storage to use
+ * @param size size of the storage
+ */
+void
+_dbus_string_init_borrowed (DBusString *str,
+                            void       *buffer,
+                            int         size)
+{
+  DBusRealString *real;
+
+  _dbus_assert (str != NULL);
+  _dbus_assert (buffer != NULL);
+  _dbus_assert (size > _DBUS_STRING_ALLOCATION_PADDING);
+
+  real = (DBusRealString*) str;
+
+  real->str = buffer;
+  real->allocated = size;
+  real->len = 0;
+  real->str[real->len] = '\0';
+
+  real->constant = FALSE;
+  real->locked = FALSE;
+  real->invalid = FALSE;
+  real->align_offset = 0;
+  real->borrowed = TRUE;
+
+  fixup_alignment (real);
+}
+
+/* Moves a borrowed string's data to the heap, with room for
+ * new_allocated bytes. */
+static dbus_bool_t
+unborrow (DBusRealString *real,
+          int             new_allocated)
+{
+  unsigned char *new_str;
+
+  _dbus_assert (real->borrowed);
+  _dbus_assert (new_allocated >= real->len + _DBUS_STRING_ALLOCATION_PADDING);
+
+  new_str = dbus_malloc (new_allocated);
+  if (_DBUS_UNLIKELY (new_str == NULL))
+    return FALSE;
+
+  memcpy (new_str, real->str, real->len + 1);
+
+  real->str = new_str;
+  real->allocated = new_allocated;
+  real->align_offset = 0;
+  real->borrowed = FALSE;
+  fixup_alignment (real);
+
+  return TRUE;
+}
+
 /**
  * Initializes a string. The string starts life with zero length.  The
  * string must eventually be freed with _dbus_string_free().
@@ -271,7 +342,8 @@ _dbus_string_free (DBusString *str)
   if (real->str == NULL)
     return;
 
-  dbus_free (real->str - real->align_offset);
+  if (!real->borrowed)
+    dbus_free (real->str - real->align_offset);
 
   real->invalid = TRUE;
 }
@@ -289,6 +361,10 @@ compact (DBusRealString *real,
   if (waste <= max_waste)
     return TRUE;
 
+  /* there is no giving back part of someone else's buffer */
+  if (real->borrowed)
+    return TRUE;
+
   new_allocated = real->len + _DBUS_STRING_ALLOCATION_PADDING;
 
   new_str = dbus_realloc (real->str - real->align_offset, new_allocated);
@@ -363,6 +439,10 @@ reallocate_for_length (DBusRealString *real,
                        new_length + _DBUS_STRING_ALLOCATION_PADDING);
 
   _dbus_assert (new_allocated >= real->allocated); /* code relies on this */
+
+  if (real->borrowed)
+    return unborrow (real, new_allocated);
+
   new_str = dbus_realloc (real->str - real->align_offset, new_allocated);
   if (_DBUS_UNLIKELY (new_str == NULL))
     return FALSE;
@@ -644,6 +724,21 @@ _dbus_string_steal_data (DBusString        *str,
   DBUS_STRING_PREAMBLE (str);
   _dbus_assert (data_return != NULL);
 
+  if (real->borrowed)
+    {
+      /* The caller is going to dbus_free() it, so hand out a copy,
+       * and keep the buffer for whatever the string holds next */
+      *data_return = dbus_malloc (real->len + 1);
+      if (*data_return == NULL)
+        return FALSE;
+
+      memcpy (*data_return, real->str, real->len + 1);
+      real->len = 0;
+      real->str[0] = '\0';
+
+      return TRUE;
+    }
+
   undo_alignment (real);
   
   *data_return = (char*) real->str;
@@ -744,6 +839,24 @@ _dbus_string_get_length (const DBusString  *str)
 }
 #endif /* !_dbus_string_get_length */
 
+/**
+ * Gets how much memory a string holds, including room it has not
+ * used yet. Constant strings and strings using someone else's buffer
+ * hold none.
+ *
+ * @returns the number of bytes allocated for the string
+ */
+int
+_dbus_string_get_allocated (const DBusString  *str)
+{
+  DBUS_CONST_STRING_PREAMBLE (str);
+
+  if (real->constant || real->borrowed)
+    return 0;
+
+  return real->allocated;
+}
+
 /**
  * Makes a string longer by the given number of bytes.  Checks whether
  * adding additional_length to the current length would overflow an
@@ -1323,7 +1436,8 @@ _dbus_string_move_len (DBusString       *source,
     }
   else if (start == 0 &&
            len == real_source->len &&
-           real_dest->len == 0)
+           real_dest->len == 0 &&
+           !real_source->borrowed)
     {
       /* Short-circuit moving an entire existing string to an empty string
        * by just swapping the buffers.
@@ -1336,10 +1450,26 @@ _dbus_string_move_len (DBusString       *source,
         (a)->len = (b)->len;                    \
         (a)->allocated = (b)->allocated;        \
         (a)->align_offset = (b)->align_offset;  \
+        (a)->borrowed = (b)->borrowed;          \
       } while (0)
       
       DBusRealString tmp;
 
+      if (real_dest->borrowed)
+        {
+          /* The destination's buffer belongs to whatever holds the
+           * destination, so it can't be handed to the source; give
+           * the source a buffer of its own and drop the borrowed one.
+           */
+          if (!_dbus_string_init ((DBusString *) &tmp))
+            return FALSE;
+
+          ASSIGN_DATA (real_dest, real_source);
+          ASSIGN_DATA (real_source, &tmp);
+
+          return TRUE;
+        }
+
       ASSIGN_DATA (&tmp, real_source);
       ASSIGN_DATA (real_source, real_dest);
       ASSIGN_DATA (real_dest, &tmp);
@@ -2536,6 +2666,14 @@ _dbus_string_toupper_ascii (const DBusString *str,
     }
 }
 
+/** An unsigned long with every byte set to 0x01 */
+#define ASCII_WORD_LOW_BITS  (((unsigned long) -1) / 0xff)
+/** An unsigned long with every byte set to 0x80 */
+#define ASCII_WORD_HIGH_BITS (ASCII_WORD_LOW_BITS * 0x80)
+/** Whether any byte of a word with no high bits set is zero */
+#define ASCII_WORD_HAS_NUL(word) \
+  ((((word) - ASCII_WORD_LOW_BITS) & ~(word) & ASCII_WORD_HIGH_BITS) != 0)
+
 /**
  * Checks that the given range of the string is valid UTF-8. If the
  * given range is not entirely contained in the string, returns
@@ -2582,6 +2720,26 @@ _dbus_string_validate_utf8  (const DBusString *str,
       int i, mask, char_len;
       dbus_unichar_t result;
 
+      /* Skip a machine word at a time while it is all ASCII and
+       * contains no nul byte; the byte at a time loop below
+       * handles everything else, so this is purely an optimization.
+       */
+      while ((size_t) (end - p) >= sizeof (unsigned long))
+        {
+          unsigned long word;
+
+          memcpy (&word, p, sizeof (word));
+
+          if ((word & ASCII_WORD_HIGH_BITS) != 0 ||
+              ASCII_WORD_HAS_NUL (word))
+            break;
+
+          p += sizeof (word);
+        }
+
+      if (p == end)
+        break;
+
       /* nul bytes considered invalid */
       if (*p == '\0')
         break;
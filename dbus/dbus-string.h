@@ -52,6 +52,7 @@ struct DBusString
   unsigned int dummy_bit2 : 1; /**< placeholder */
   unsigned int dummy_bit3 : 1; /**< placeholder */
   unsigned int dummy_bits : 3; /**< placeholder */
+  unsigned int dummy_bit4 : 1; /**< placeholder */
 };
 
 #ifdef DBUS_DISABLE_ASSERT
@@ -78,6 +79,9 @@ void          _dbus_string_init_const_len        (DBusString        *str,
                                                   int                len);
 dbus_bool_t   _dbus_string_init_preallocated     (DBusString        *str,
                                                   int                allocate_size);
+void          _dbus_string_init_borrowed         (DBusString        *str,
+                                                  void              *buffer,
+                                                  int                size);
 
 DBUS_PRIVATE_EXPORT
 dbus_bool_t _dbus_string_init_from_string        (DBusString        *str,
@@ -150,6 +154,7 @@ void          _dbus_string_copy_to_buffer_with_nul (const DBusString  *str,
 DBUS_PRIVATE_EXPORT
 int           _dbus_string_get_length            (const DBusString  *str);
 #endif /* !_dbus_string_get_length */
+int           _dbus_string_get_allocated         (const DBusString  *str);
 
 /**
  * Get the string's length as an unsigned integer, for comparison with
@@ -83,12 +83,26 @@ _dbus_platform_cmutex_new (void)
 {
   DBusCMutex *pmutex;
   int result;
+#ifdef HAVE_PTHREAD_MUTEX_ADAPTIVE_NP
+  pthread_mutexattr_t mutexattr;
+#endif
 
   pmutex = dbus_new (DBusCMutex, 1);
   if (pmutex == NULL)
     return NULL;
 
+#ifdef HAVE_PTHREAD_MUTEX_ADAPTIVE_NP
+  /* These never recurse, and guard short sections like the io_path
+   * and dispatch handoffs between threads; an adaptive mutex spins
+   * briefly before sleeping on its futex, so a thread waiting for
+   * one that is about to be released doesn't need a context switch. */
+  pthread_mutexattr_init (&mutexattr);
+  pthread_mutexattr_settype (&mutexattr, PTHREAD_MUTEX_ADAPTIVE_NP);
+  result = pthread_mutex_init (&pmutex->lock, &mutexattr);
+  pthread_mutexattr_destroy (&mutexattr);
+#else
   result = pthread_mutex_init (&pmutex->lock, NULL);
+#endif
 
   if (result == ENOMEM || result == EAGAIN)
     {
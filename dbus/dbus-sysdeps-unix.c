@@ -65,6 +65,7 @@
 #ifdef HAVE_WRITEV
 #include <sys/uio.h>
 #endif
+#include <limits.h>
 #ifdef HAVE_POLL
 #include <sys/poll.h>
 #endif
@@ -77,6 +78,16 @@
 #ifdef HAVE_ALLOCA_H
 #include <alloca.h>
 #endif
+#ifdef HAVE_GETRANDOM
+#include <sys/random.h>
+#endif
+#include <sys/mman.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+#ifdef HAVE_LINUX_VM_SOCKETS_H
+#include <linux/vm_sockets.h>
+#endif
 
 #ifdef HAVE_ADT
 #include <bsm/adt.h>
@@ -536,6 +547,101 @@ _dbus_write_socket_with_unix_fds_two(DBusSocket        fd,
 #endif
 }
 
+/**
+ * Like _dbus_write_socket_many(), but sends @p fds along with the
+ * first byte written. The buffers must hold a single message starting
+ * at its first byte, since fds may not arrive before the message they
+ * belong to.
+ *
+ * @param fd the socket
+ * @param buffers the buffers to write, in order
+ * @param starts first byte to write in each buffer
+ * @param lens number of bytes to write from each buffer
+ * @param n_buffers number of buffers, at least 1
+ * @param fds the fds to send
+ * @param n_fds number of fds
+ * @returns total bytes written from all buffers, or -1 on error
+ */
+int
+_dbus_write_socket_many_with_unix_fds (DBusSocket         fd,
+                                       const DBusString **buffers,
+                                       const int         *starts,
+                                       const int         *lens,
+                                       int                n_buffers,
+                                       const int         *fds,
+                                       int                n_fds)
+{
+#ifndef HAVE_UNIX_FD_PASSING
+
+  if (n_fds > 0) {
+    errno = ENOTSUP;
+    return -1;
+  }
+
+  return _dbus_write_socket_many (fd, buffers, starts, lens, n_buffers);
+#else
+
+  struct iovec vectors[_DBUS_MAX_SOCKET_WRITE_VECTORS];
+  struct msghdr m;
+  struct cmsghdr *cm;
+  int bytes_written;
+  int i;
+
+  _dbus_assert (n_buffers > 0);
+  _dbus_assert (n_fds >= 0);
+
+  if (n_buffers > _DBUS_MAX_SOCKET_WRITE_VECTORS)
+    n_buffers = _DBUS_MAX_SOCKET_WRITE_VECTORS;
+
+#ifdef IOV_MAX
+  if (n_buffers > IOV_MAX)
+    n_buffers = IOV_MAX;
+#endif
+
+  for (i = 0; i < n_buffers; i++)
+    {
+      _dbus_assert (buffers[i] != NULL);
+      _dbus_assert (starts[i] >= 0);
+      _dbus_assert (lens[i] >= 0);
+
+      vectors[i].iov_base = (char *) _dbus_string_get_const_data_len (buffers[i],
+                                                                      starts[i],
+                                                                      lens[i]);
+      vectors[i].iov_len = lens[i];
+    }
+
+  _DBUS_ZERO(m);
+  m.msg_iov = vectors;
+  m.msg_iovlen = n_buffers;
+
+  if (n_fds > 0)
+    {
+      m.msg_controllen = CMSG_SPACE(n_fds * sizeof(int));
+      m.msg_control = alloca(m.msg_controllen);
+      memset(m.msg_control, 0, m.msg_controllen);
+
+      cm = CMSG_FIRSTHDR(&m);
+      cm->cmsg_level = SOL_SOCKET;
+      cm->cmsg_type = SCM_RIGHTS;
+      cm->cmsg_len = CMSG_LEN(n_fds * sizeof(int));
+      memcpy(CMSG_DATA(cm), fds, n_fds * sizeof(int));
+    }
+
+ again:
+
+  bytes_written = sendmsg (fd.fd, &m, 0
+#if HAVE_DECL_MSG_NOSIGNAL
+                           |MSG_NOSIGNAL
+#endif
+                           );
+
+  if (bytes_written < 0 && errno == EINTR)
+    goto again;
+
+  return bytes_written;
+#endif
+}
+
 /**
  * Like _dbus_write_two() but only works on sockets and is thus
  * available on Windows.
@@ -606,6 +712,85 @@ _dbus_write_socket_two (DBusSocket        fd,
 #endif
 }
 
+/**
+ * Like _dbus_write_socket_two(), but gathers any number of buffers,
+ * so that several queued messages can be written with one system
+ * call. At most #_DBUS_MAX_SOCKET_WRITE_VECTORS buffers are written,
+ * or fewer if the system's IOV_MAX is lower; the caller finds out
+ * from the return value, as for any other short write. Handles EINTR
+ * for you.
+ *
+ * @param fd the socket
+ * @param buffers the buffers to write, in order
+ * @param starts first byte to write in each buffer
+ * @param lens number of bytes to write from each buffer
+ * @param n_buffers number of buffers, at least 1
+ * @returns total bytes written from all buffers, or -1 on error
+ */
+int
+_dbus_write_socket_many (DBusSocket         fd,
+                         const DBusString **buffers,
+                         const int         *starts,
+                         const int         *lens,
+                         int                n_buffers)
+{
+#if defined(HAVE_WRITEV) || HAVE_DECL_MSG_NOSIGNAL
+  struct iovec vectors[_DBUS_MAX_SOCKET_WRITE_VECTORS];
+#if HAVE_DECL_MSG_NOSIGNAL
+  struct msghdr m;
+#endif
+  int bytes_written;
+  int i;
+
+  _dbus_assert (n_buffers > 0);
+
+  if (n_buffers > _DBUS_MAX_SOCKET_WRITE_VECTORS)
+    n_buffers = _DBUS_MAX_SOCKET_WRITE_VECTORS;
+
+#ifdef IOV_MAX
+  if (n_buffers > IOV_MAX)
+    n_buffers = IOV_MAX;
+#endif
+
+  for (i = 0; i < n_buffers; i++)
+    {
+      _dbus_assert (buffers[i] != NULL);
+      _dbus_assert (starts[i] >= 0);
+      _dbus_assert (lens[i] >= 0);
+
+      vectors[i].iov_base = (char *) _dbus_string_get_const_data_len (buffers[i],
+                                                                      starts[i],
+                                                                      lens[i]);
+      vectors[i].iov_len = lens[i];
+    }
+
+#if HAVE_DECL_MSG_NOSIGNAL
+  _DBUS_ZERO(m);
+  m.msg_iov = vectors;
+  m.msg_iovlen = n_buffers;
+#endif
+
+ again:
+
+#if HAVE_DECL_MSG_NOSIGNAL
+  bytes_written = sendmsg (fd.fd, &m, MSG_NOSIGNAL);
+#else
+  bytes_written = writev (fd.fd, vectors, n_buffers);
+#endif
+
+  if (bytes_written < 0 && errno == EINTR)
+    goto again;
+
+  return bytes_written;
+
+#else
+  _dbus_assert (n_buffers > 0);
+
+  /* one buffer at a time is still a valid short write */
+  return _dbus_write_socket (fd, buffers[0], starts[0], lens[0]);
+#endif
+}
+
 /**
  * Thin wrapper around the read() system call that appends
  * the data it reads to the DBusString buffer. It appends
@@ -1365,6 +1550,14 @@ _dbus_connect_tcp_socket_with_nonce (const char     *host,
   return fd;
 }
 
+static int listen_tcp_socket (const char     *host,
+                              const char     *port,
+                              const char     *family,
+                              dbus_bool_t     reuse_port,
+                              DBusString     *retport,
+                              DBusSocket    **fds_p,
+                              DBusError      *error);
+
 /**
  * Creates a socket and binds it to the given path, then listens on
  * the socket. The socket is set to be nonblocking.  In case of port=0
@@ -1388,6 +1581,45 @@ _dbus_listen_tcp_socket (const char     *host,
                          DBusString     *retport,
                          DBusSocket    **fds_p,
                          DBusError      *error)
+{
+  return listen_tcp_socket (host, port, family, FALSE, retport, fds_p, error);
+}
+
+/**
+ * Like _dbus_listen_tcp_socket(), but sets SO_REUSEPORT on the
+ * sockets before binding them, so that other processes of the same
+ * user can listen on the same port too and the kernel spreads new
+ * connections between all of them.
+ *
+ * @param host the host name to listen on
+ * @param port the port to listen on, which must not be zero
+ * @param family the address family to listen on, NULL for all
+ * @param retport string to return the actual port listened on
+ * @param fds_p location to store returned file descriptors
+ * @param error return location for errors
+ * @returns the number of listening file descriptors or -1 on error
+ */
+int
+_dbus_listen_tcp_socket_shared (const char     *host,
+                                const char     *port,
+                                const char     *family,
+                                DBusString     *retport,
+                                DBusSocket    **fds_p,
+                                DBusError      *error)
+{
+  _dbus_assert (port != NULL && strcmp (port, "0") != 0);
+
+  return listen_tcp_socket (host, port, family, TRUE, retport, fds_p, error);
+}
+
+static int
+listen_tcp_socket (const char     *host,
+                   const char     *port,
+                   const char     *family,
+                   dbus_bool_t     reuse_port,
+                   DBusString     *retport,
+                   DBusSocket    **fds_p,
+                   DBusError      *error)
 {
   int saved_errno;
   int nlisten_fd = 0, res, i;
@@ -1399,6 +1631,15 @@ _dbus_listen_tcp_socket (const char     *host,
   *fds_p = NULL;
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
+#ifndef SO_REUSEPORT
+  if (reuse_port)
+    {
+      dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                      "Sharing a listening port is not supported on this platform");
+      return -1;
+    }
+#endif
+
   _DBUS_ZERO (hints);
 
   if (!family)
@@ -1450,6 +1691,22 @@ _dbus_listen_tcp_socket (const char     *host,
                       host ? host : "*", port, _dbus_strerror (errno));
         }
 
+#ifdef SO_REUSEPORT
+      /* Unlike SO_REUSEADDR, sharing the port is the whole point, so
+       * don't carry on without it */
+      if (reuse_port &&
+          setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &reuseaddr,
+                      sizeof (reuseaddr)) == -1)
+        {
+          saved_errno = errno;
+          _dbus_close (fd, NULL);
+          dbus_set_error (error, _dbus_error_from_errno (saved_errno),
+                          "Failed to set SO_REUSEPORT on socket \"%s:%s\": %s",
+                          host ? host : "*", port, _dbus_strerror (saved_errno));
+          goto failed;
+        }
+#endif
+
       /* Nagle's algorithm imposes a huge delay on the initial messages
          going over TCP. */
       tcp_nodelay_on = 1;
@@ -1592,6 +1849,211 @@ _dbus_listen_tcp_socket (const char     *host,
   return -1;
 }
 
+#ifdef HAVE_LINUX_VM_SOCKETS_H
+/* Parses the decimal cid or port of a vsock address; VMADDR_CID_ANY
+ * and VMADDR_PORT_ANY are not allowed, because they are spelled by
+ * leaving the key out */
+static dbus_bool_t
+parse_vsock_number (const char   *key,
+                    const char   *value,
+                    unsigned int *number_p,
+                    DBusError    *error)
+{
+  DBusString str;
+  unsigned long number;
+  int end;
+
+  _dbus_string_init_const (&str, value);
+
+  if (!_dbus_string_parse_uint (&str, 0, &number, &end) ||
+      end != _dbus_string_get_length (&str) ||
+      number >= VMADDR_CID_ANY)
+    {
+      dbus_set_error (error, DBUS_ERROR_BAD_ADDRESS,
+                      "Invalid vsock %s \"%s\"", key, value);
+      return FALSE;
+    }
+
+  *number_p = number;
+  return TRUE;
+}
+#endif
+
+/**
+ * Creates a Linux vsock (AF_VSOCK) socket and connects to the given
+ * context ID and port, for instance from a virtual machine to its host,
+ * whose context ID is 2. The connection fd is returned, and is set up
+ * as nonblocking.
+ *
+ * This will set FD_CLOEXEC for the socket returned
+ *
+ * @param cid the context ID to connect to, in decimal
+ * @param port the port to connect to, in decimal
+ * @param error return location for error code
+ * @returns connection file descriptor or -1 on error
+ */
+int
+_dbus_connect_vsock_socket (const char     *cid,
+                            const char     *port,
+                            DBusError      *error)
+{
+#ifdef HAVE_LINUX_VM_SOCKETS_H
+  struct sockaddr_vm addr;
+  unsigned int cid_number, port_number;
+  int fd, saved_errno;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!parse_vsock_number ("cid", cid, &cid_number, error) ||
+      !parse_vsock_number ("port", port, &port_number, error))
+    return -1;
+
+  _dbus_verbose ("connecting to vsock socket %u:%u\n",
+                 cid_number, port_number);
+
+  if (!_dbus_open_socket (&fd, AF_VSOCK, SOCK_STREAM, 0, error))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      return -1;
+    }
+
+  _DBUS_ZERO (addr);
+  addr.svm_family = AF_VSOCK;
+  addr.svm_cid = cid_number;
+  addr.svm_port = port_number;
+
+  if (connect (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0)
+    {
+      saved_errno = errno;
+      dbus_set_error (error, _dbus_error_from_errno (saved_errno),
+                      "Failed to connect to vsock socket \"%s:%s\": %s",
+                      cid, port, _dbus_strerror (saved_errno));
+      _dbus_close (fd, NULL);
+      return -1;
+    }
+
+  if (!_dbus_set_fd_nonblocking (fd, error))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      _dbus_close (fd, NULL);
+      return -1;
+    }
+
+  return fd;
+#else
+  dbus_set_error_const (error, DBUS_ERROR_NOT_SUPPORTED,
+                        "dbus was compiled without vsock support");
+  return -1;
+#endif
+}
+
+/**
+ * Creates a Linux vsock (AF_VSOCK) socket and binds it to the given
+ * context ID and port, then listens on it. The socket is set to be
+ * nonblocking. If @p cid is #NULL, the socket accepts connections
+ * addressed to any of this machine's context IDs; if @p port is
+ * #NULL or "0", a free port is chosen, and either way the port
+ * listened on is appended to @p retport.
+ *
+ * This will set FD_CLOEXEC for the socket returned
+ *
+ * @param cid the context ID to listen on, in decimal, or #NULL
+ * @param port the port to listen on, in decimal, or #NULL
+ * @param retport string to return the actual port listened on
+ * @param error return location for errors
+ * @returns the listening file descriptor or -1 on error
+ */
+int
+_dbus_listen_vsock_socket (const char     *cid,
+                           const char     *port,
+                           DBusString     *retport,
+                           DBusError      *error)
+{
+#ifdef HAVE_LINUX_VM_SOCKETS_H
+  struct sockaddr_vm addr;
+  socklen_t addrlen;
+  unsigned int cid_number = VMADDR_CID_ANY;
+  unsigned int port_number = VMADDR_PORT_ANY;
+  int listen_fd, saved_errno;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if ((cid != NULL &&
+       !parse_vsock_number ("cid", cid, &cid_number, error)) ||
+      (port != NULL && strcmp (port, "0") != 0 &&
+       !parse_vsock_number ("port", port, &port_number, error)))
+    return -1;
+
+  _dbus_verbose ("listening on vsock socket %s:%s\n",
+                 cid ? cid : "*", port ? port : "0");
+
+  if (!_dbus_open_socket (&listen_fd, AF_VSOCK, SOCK_STREAM, 0, error))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      return -1;
+    }
+
+  _DBUS_ZERO (addr);
+  addr.svm_family = AF_VSOCK;
+  addr.svm_cid = cid_number;
+  addr.svm_port = port_number;
+
+  if (bind (listen_fd, (struct sockaddr *) &addr, sizeof (addr)) < 0)
+    {
+      saved_errno = errno;
+      dbus_set_error (error, _dbus_error_from_errno (saved_errno),
+                      "Failed to bind vsock socket \"%s:%s\": %s",
+                      cid ? cid : "*", port ? port : "0",
+                      _dbus_strerror (saved_errno));
+      _dbus_close (listen_fd, NULL);
+      return -1;
+    }
+
+  if (listen (listen_fd, 30 /* backlog */) < 0)
+    {
+      saved_errno = errno;
+      dbus_set_error (error, _dbus_error_from_errno (saved_errno),
+                      "Failed to listen on vsock socket \"%s:%s\": %s",
+                      cid ? cid : "*", port ? port : "0",
+                      _dbus_strerror (saved_errno));
+      _dbus_close (listen_fd, NULL);
+      return -1;
+    }
+
+  addrlen = sizeof (addr);
+
+  if (getsockname (listen_fd, (struct sockaddr *) &addr, &addrlen) < 0)
+    {
+      saved_errno = errno;
+      dbus_set_error (error, _dbus_error_from_errno (saved_errno),
+                      "Failed to resolve vsock port: %s",
+                      _dbus_strerror (saved_errno));
+      _dbus_close (listen_fd, NULL);
+      return -1;
+    }
+
+  if (!_dbus_string_append_printf (retport, "%u", addr.svm_port))
+    {
+      _DBUS_SET_OOM (error);
+      _dbus_close (listen_fd, NULL);
+      return -1;
+    }
+
+  if (!_dbus_set_fd_nonblocking (listen_fd, error))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      _dbus_close (listen_fd, NULL);
+      return -1;
+    }
+
+  return listen_fd;
+#else
+  dbus_set_error_const (error, DBUS_ERROR_NOT_SUPPORTED,
+                        "dbus was compiled without vsock support");
+  return -1;
+#endif
+}
+
 static dbus_bool_t
 write_credentials_byte (int             server_fd,
                         DBusError      *error)
@@ -2132,23 +2594,15 @@ _dbus_send_credentials_socket  (DBusSocket       server_fd,
     return FALSE;
 }
 
-/**
- * Accepts a connection on a listening socket.
- * Handles EINTR for you.
- *
- * This will enable FD_CLOEXEC for the returned socket.
- *
- * @param listen_fd the listen file descriptor
- * @returns the connection fd of the client, or -1 on error
- */
-DBusSocket
-_dbus_accept  (DBusSocket listen_fd)
+static DBusSocket
+accept_socket (DBusSocket  listen_fd,
+               dbus_bool_t nonblocking)
 {
   DBusSocket client_fd;
   struct sockaddr addr;
   socklen_t addrlen;
 #ifdef HAVE_ACCEPT4
-  dbus_bool_t cloexec_done;
+  dbus_bool_t flags_done;
 #endif
 
   addrlen = sizeof (addr);
@@ -2158,11 +2612,13 @@ _dbus_accept  (DBusSocket listen_fd)
 #ifdef HAVE_ACCEPT4
   /*
    * At compile-time, we assume that if accept4() is available in
-   * libc headers, SOCK_CLOEXEC is too. At runtime, it is still
-   * not necessarily true that either is supported by the running kernel.
+   * libc headers, SOCK_CLOEXEC and SOCK_NONBLOCK are too. At runtime,
+   * it is still not necessarily true that they are supported by the
+   * running kernel.
    */
-  client_fd.fd = accept4 (listen_fd.fd, &addr, &addrlen, SOCK_CLOEXEC);
-  cloexec_done = client_fd.fd >= 0;
+  client_fd.fd = accept4 (listen_fd.fd, &addr, &addrlen,
+                          SOCK_CLOEXEC | (nonblocking ? SOCK_NONBLOCK : 0));
+  flags_done = client_fd.fd >= 0;
 
   if (client_fd.fd < 0 && (errno == ENOSYS || errno == EINVAL))
 #endif
@@ -2174,20 +2630,57 @@ _dbus_accept  (DBusSocket listen_fd)
     {
       if (errno == EINTR)
         goto retry;
+
+      /* leave errno for the caller */
+      return client_fd;
     }
 
   _dbus_verbose ("client fd %d accepted\n", client_fd.fd);
 
 #ifdef HAVE_ACCEPT4
-  if (!cloexec_done)
+  if (!flags_done)
 #endif
     {
       _dbus_fd_set_close_on_exec(client_fd.fd);
+
+      if (nonblocking && !_dbus_set_fd_nonblocking (client_fd.fd, NULL))
+        {
+          _dbus_close (client_fd.fd, NULL);
+          client_fd.fd = -1;
+        }
     }
 
   return client_fd;
 }
 
+/**
+ * Accepts a connection on a listening socket.
+ * Handles EINTR for you.
+ *
+ * This will enable FD_CLOEXEC for the returned socket.
+ *
+ * @param listen_fd the listen file descriptor
+ * @returns the connection fd of the client, or -1 on error
+ */
+DBusSocket
+_dbus_accept  (DBusSocket listen_fd)
+{
+  return accept_socket (listen_fd, FALSE);
+}
+
+/**
+ * Like _dbus_accept(), but the returned socket is also nonblocking.
+ * Where accept4() is available this needs no extra system calls.
+ *
+ * @param listen_fd the listen file descriptor
+ * @returns the connection fd of the client, or -1 on error
+ */
+DBusSocket
+_dbus_accept_nonblocking (DBusSocket listen_fd)
+{
+  return accept_socket (listen_fd, TRUE);
+}
+
 /**
  * Checks to make sure the given directory is
  * private to the user
@@ -2678,7 +3171,13 @@ dbus_int32_t
 _dbus_atomic_inc (DBusAtomic *atomic)
 {
 #if DBUS_USE_SYNC
+# ifdef __ATOMIC_RELAXED
+  /* Callers already hold a reference (or only count), so incrementing
+   * needs no ordering with respect to other memory accesses */
+  return __atomic_fetch_add (&atomic->value, 1, __ATOMIC_RELAXED);
+# else
   return __sync_add_and_fetch(&atomic->value, 1)-1;
+# endif
 #else
   dbus_int32_t res;
 
@@ -2701,7 +3200,13 @@ dbus_int32_t
 _dbus_atomic_dec (DBusAtomic *atomic)
 {
 #if DBUS_USE_SYNC
+# ifdef __ATOMIC_ACQ_REL
+  /* Whoever drops the last reference must see every write made by
+   * the other holders before it frees the object */
+  return __atomic_fetch_sub (&atomic->value, 1, __ATOMIC_ACQ_REL);
+# else
   return __sync_sub_and_fetch(&atomic->value, 1)+1;
+# endif
 #else
   dbus_int32_t res;
 
@@ -2738,6 +3243,23 @@ _dbus_atomic_get (DBusAtomic *atomic)
 #endif
 }
 
+/**
+ * Issues a full memory barrier: loads and stores before it are not
+ * reordered with those after it, by the compiler or the CPU. This is
+ * for data that is read without taking a lock.
+ */
+void
+_dbus_memory_barrier (void)
+{
+#if DBUS_USE_SYNC
+  __sync_synchronize ();
+#else
+  /* taking and releasing a mutex is a barrier too */
+  pthread_mutex_lock (&atomic_mutex);
+  pthread_mutex_unlock (&atomic_mutex);
+#endif
+}
+
 /**
  * Wrapper for poll().
  *
@@ -2848,6 +3370,36 @@ _dbus_get_monotonic_time (long *tv_sec,
 #endif
 }
 
+/**
+ * Get a monotonic time in nanoseconds, for measuring short intervals.
+ * Where available the clock is not slewed by NTP, so that intervals
+ * stay comparable. Its starting point is arbitrary.
+ *
+ * @returns the time in nanoseconds
+ */
+dbus_uint64_t
+_dbus_get_monotonic_time_nsec (void)
+{
+  /* CMake builds don't check for HAVE_MONOTONIC_CLOCK, but a
+   * CLOCK_MONOTONIC_RAW comes with a clock_gettime() */
+#if defined (HAVE_MONOTONIC_CLOCK) || defined (CLOCK_MONOTONIC_RAW)
+  struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_RAW
+  if (clock_gettime (CLOCK_MONOTONIC_RAW, &ts) != 0)
+#endif
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return ((dbus_uint64_t) ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#else
+  long tv_sec, tv_usec;
+
+  _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+
+  return ((dbus_uint64_t) tv_sec) * 1000000000 + ((dbus_uint64_t) tv_usec) * 1000;
+#endif
+}
+
 /**
  * Get current time, as in gettimeofday(). Never uses the monotonic
  * clock.
@@ -2998,6 +3550,57 @@ _dbus_generate_random_bytes (DBusString *str,
   old_len = _dbus_string_get_length (str);
   fd = -1;
 
+#ifdef HAVE_GETRANDOM
+  /* getrandom() draws from the same pool as /dev/urandom without
+   * costing us an fd and two more syscalls, and it works in a chroot
+   * with no /dev. Requests of up to 256 bytes, which is all we ever
+   * make, are never cut short once the pool is initialized; be
+   * careful anyway. */
+  {
+    int done;
+    char *p;
+
+    if (!_dbus_string_lengthen (str, n_bytes))
+      {
+        _DBUS_SET_OOM (error);
+        return FALSE;
+      }
+
+    p = _dbus_string_get_data_len (str, old_len, n_bytes);
+    done = 0;
+
+    while (done < n_bytes)
+      {
+        ssize_t got = getrandom (p + done, n_bytes - done, 0);
+
+        if (got < 0)
+          {
+            if (errno == EINTR)
+              continue;
+
+            break;
+          }
+
+        done += got;
+      }
+
+    if (done == n_bytes)
+      return TRUE;
+
+    _dbus_string_set_length (str, old_len);
+
+    /* ENOSYS from a kernel older than 3.17 or a seccomp filter that
+     * doesn't know about it: fall back to the device */
+    if (errno != ENOSYS && errno != EPERM)
+      {
+        dbus_set_error (error, _dbus_error_from_errno (errno),
+                        "Could not get random bytes: %s",
+                        _dbus_strerror (errno));
+        return FALSE;
+      }
+  }
+#endif
+
   /* note, urandom on linux will fall back to pseudorandom */
   fd = open ("/dev/urandom", O_RDONLY);
 
@@ -3098,6 +3701,525 @@ _dbus_fd_set_close_on_exec (int fd)
   fcntl (fd, F_SETFD, val);
 }
 
+#if defined(HAVE_MEMFD_CREATE) && defined(F_ADD_SEALS)
+#define MEMFD_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+#endif
+
+/**
+ * Copies a block of memory into a new anonymous file and seals it so
+ * that neither its size nor its contents can change any more. The
+ * receiver of the file descriptor can then map it without having to
+ * trust the sender not to modify it underneath.
+ *
+ * @param data the bytes to copy
+ * @param len the number of bytes
+ * @param fd_p return location for the new file descriptor
+ * @param error error object
+ * @returns #FALSE if error set
+ */
+dbus_bool_t
+_dbus_memfd_create_sealed (const void *data,
+                           size_t      len,
+                           int        *fd_p,
+                           DBusError  *error)
+{
+#ifdef MEMFD_SEALS
+  const char *p;
+  int fd;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  fd = memfd_create ("dbus-sealed-bytes", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+  if (fd < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to create memfd: %s", _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  p = data;
+
+  while (len > 0)
+    {
+      ssize_t n;
+
+      n = write (fd, p, len);
+
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          dbus_set_error (error, _dbus_error_from_errno (errno),
+                          "Failed to fill memfd: %s", _dbus_strerror (errno));
+          _dbus_close (fd, NULL);
+          return FALSE;
+        }
+
+      p += n;
+      len -= n;
+    }
+
+  if (fcntl (fd, F_ADD_SEALS, MEMFD_SEALS) < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to seal memfd: %s", _dbus_strerror (errno));
+      _dbus_close (fd, NULL);
+      return FALSE;
+    }
+
+  *fd_p = fd;
+  return TRUE;
+#else
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "Sealed memory files are not supported on this platform");
+  return FALSE;
+#endif
+}
+
+/**
+ * Maps a file descriptor created by _dbus_memfd_create_sealed()
+ * read-only. Fails if the file is not fully sealed, since otherwise
+ * the sender could still truncate it (turning reads into SIGBUS) or
+ * change the bytes after they were validated.
+ *
+ * A zero-length file yields #NULL data and a zero length; otherwise
+ * release the mapping with _dbus_memfd_unmap().
+ *
+ * @param fd the file descriptor, which is not consumed
+ * @param data_p return location for the mapped bytes
+ * @param len_p return location for the number of bytes
+ * @param error error object
+ * @returns #FALSE if error set
+ */
+dbus_bool_t
+_dbus_memfd_map_sealed (int         fd,
+                        void      **data_p,
+                        size_t     *len_p,
+                        DBusError  *error)
+{
+#ifdef MEMFD_SEALS
+  struct stat sb;
+  void *data;
+  int seals;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  seals = fcntl (fd, F_GET_SEALS);
+
+  if (seals < 0 || (seals & MEMFD_SEALS) != MEMFD_SEALS)
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                      "File descriptor is not a sealed memfd");
+      return FALSE;
+    }
+
+  if (fstat (fd, &sb) < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to stat memfd: %s", _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  if (sb.st_size == 0)
+    {
+      *data_p = NULL;
+      *len_p = 0;
+      return TRUE;
+    }
+
+  data = mmap (NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+  if (data == MAP_FAILED)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to map memfd: %s", _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  *data_p = data;
+  *len_p = sb.st_size;
+  return TRUE;
+#else
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "Sealed memory files are not supported on this platform");
+  return FALSE;
+#endif
+}
+
+/**
+ * Releases a mapping made by _dbus_memfd_map_sealed().
+ *
+ * @param data the mapped bytes
+ * @param len the number of bytes
+ */
+void
+_dbus_memfd_unmap (void   *data,
+                   size_t  len)
+{
+#ifdef MEMFD_SEALS
+  if (data != NULL)
+    munmap (data, len);
+#endif
+}
+
+#ifdef MEMFD_SEALS
+#define MEMFD_SHARED_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+#endif
+
+/** Size of a transparent huge page on common platforms */
+#define LARGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/**
+ * Maps size bytes of anonymous memory for a large buffer, aligned to
+ * and advised for transparent huge pages where the kernel supports
+ * them, so that filling it takes fewer page faults and TLB entries.
+ * The memory starts out zeroed and must be released with
+ * _dbus_free_large_pages().
+ *
+ * @param size the number of bytes
+ * @returns the memory, or #NULL if it could not be mapped
+ */
+void *
+_dbus_alloc_large_pages (size_t size)
+{
+  char *map;
+  char *pages;
+  size_t map_size;
+
+  _dbus_assert (size > 0);
+
+  /* Map a huge page too many, so that the part we keep can start at a
+   * huge page boundary */
+  map_size = size;
+
+  if (size >= LARGE_PAGE_SIZE)
+    map_size += LARGE_PAGE_SIZE;
+
+  map = mmap (NULL, map_size, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (map == MAP_FAILED)
+    return NULL;
+
+  pages = map;
+
+  if (map_size > size)
+    {
+      pages = _DBUS_ALIGN_ADDRESS (map, LARGE_PAGE_SIZE);
+
+      if (pages > map)
+        munmap (map, pages - map);
+
+      if (map + map_size > pages + size)
+        munmap (pages + size, (map + map_size) - (pages + size));
+    }
+
+#ifdef MADV_HUGEPAGE
+  /* only a hint; without THP this is just ordinary memory */
+  madvise (pages, size, MADV_HUGEPAGE);
+#endif
+
+  return pages;
+}
+
+/**
+ * Releases memory from _dbus_alloc_large_pages().
+ *
+ * @param pages the memory
+ * @param size the size it was allocated with
+ */
+void
+_dbus_free_large_pages (void   *pages,
+                        size_t  size)
+{
+  if (pages != NULL)
+    munmap (pages, size);
+}
+
+/**
+ * Creates a zero-filled anonymous file of a fixed size, for two
+ * processes to map and write to. Unlike _dbus_memfd_create_sealed()
+ * the contents stay writable; only the size is sealed, so that
+ * neither side can truncate it under the other's mapping.
+ *
+ * @param len the size of the file
+ * @param fd_p return location for the new file descriptor
+ * @param error error object
+ * @returns #FALSE if error set
+ */
+dbus_bool_t
+_dbus_memfd_create_shared (size_t     len,
+                           int       *fd_p,
+                           DBusError *error)
+{
+#ifdef MEMFD_SEALS
+  int fd;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  fd = memfd_create ("dbus-shared-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+  if (fd < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to create memfd: %s", _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  if (ftruncate (fd, len) < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to size memfd: %s", _dbus_strerror (errno));
+      _dbus_close (fd, NULL);
+      return FALSE;
+    }
+
+  if (fcntl (fd, F_ADD_SEALS, MEMFD_SHARED_SEALS) < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to seal memfd: %s", _dbus_strerror (errno));
+      _dbus_close (fd, NULL);
+      return FALSE;
+    }
+
+  *fd_p = fd;
+  return TRUE;
+#else
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "Shared memory files are not supported on this platform");
+  return FALSE;
+#endif
+}
+
+/**
+ * Maps a file descriptor created by _dbus_memfd_create_shared()
+ * read-write. Fails if its size is not sealed or is not @p len, so
+ * that accesses within @p len bytes can never fault.
+ *
+ * Release the mapping with _dbus_memfd_unmap().
+ *
+ * @param fd the file descriptor, which is not consumed
+ * @param len the size the file must have
+ * @param data_p return location for the mapped bytes
+ * @param error error object
+ * @returns #FALSE if error set
+ */
+dbus_bool_t
+_dbus_memfd_map_shared (int         fd,
+                        size_t      len,
+                        void      **data_p,
+                        DBusError  *error)
+{
+#ifdef MEMFD_SEALS
+  struct stat sb;
+  void *data;
+  int seals;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  seals = fcntl (fd, F_GET_SEALS);
+
+  if (seals < 0 ||
+      (seals & (F_SEAL_SHRINK | F_SEAL_GROW)) != (F_SEAL_SHRINK | F_SEAL_GROW))
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                      "File descriptor is not a memfd with a sealed size");
+      return FALSE;
+    }
+
+  if (fstat (fd, &sb) < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to stat memfd: %s", _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  if (len == 0 || (size_t) sb.st_size != len)
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                      "Shared memfd has the wrong size");
+      return FALSE;
+    }
+
+  data = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  if (data == MAP_FAILED)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to map memfd: %s", _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  *data_p = data;
+  return TRUE;
+#else
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "Shared memory files are not supported on this platform");
+  return FALSE;
+#endif
+}
+
+/**
+ * Maps an existing regular file read-write and shared, so that what
+ * is stored in the mapping is seen by every other process that maps
+ * it. Fails if the file is not exactly @p len bytes long, so that
+ * accesses within @p len bytes can never fault.
+ *
+ * Release the mapping with _dbus_file_unmap_shared().
+ *
+ * @param filename the file
+ * @param len the size the file must have
+ * @param data_p return location for the mapped bytes
+ * @param error error object
+ * @returns #FALSE if error set
+ */
+dbus_bool_t
+_dbus_file_map_shared (const DBusString  *filename,
+                       size_t             len,
+                       void             **data_p,
+                       DBusError         *error)
+{
+  const char *filename_c;
+  struct stat sb;
+  void *data;
+  int fd;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  filename_c = _dbus_string_get_const_data (filename);
+  fd = open (filename_c, O_RDWR);
+
+  if (fd < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to open \"%s\": %s", filename_c,
+                      _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  _dbus_fd_set_close_on_exec (fd);
+
+  if (fstat (fd, &sb) < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to stat \"%s\": %s", filename_c,
+                      _dbus_strerror (errno));
+      _dbus_close (fd, NULL);
+      return FALSE;
+    }
+
+  if (!S_ISREG (sb.st_mode) || len == 0 || (size_t) sb.st_size != len)
+    {
+      dbus_set_error (error, DBUS_ERROR_FAILED,
+                      "\"%s\" is not a regular file of %lu bytes",
+                      filename_c, (unsigned long) len);
+      _dbus_close (fd, NULL);
+      return FALSE;
+    }
+
+  data = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  /* the mapping keeps the file open */
+  _dbus_close (fd, NULL);
+
+  if (data == MAP_FAILED)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to map \"%s\": %s", filename_c,
+                      _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  *data_p = data;
+  return TRUE;
+}
+
+/**
+ * Releases a mapping made by _dbus_file_map_shared().
+ *
+ * @param data the mapped bytes
+ * @param len the number of bytes
+ */
+void
+_dbus_file_unmap_shared (void   *data,
+                         size_t  len)
+{
+  if (data != NULL)
+    munmap (data, len);
+}
+
+/**
+ * Creates a non-blocking eventfd, to be used as a doorbell: one side
+ * rings it with _dbus_eventfd_signal() and the other polls it for
+ * readability and then calls _dbus_eventfd_clear().
+ *
+ * @param fd_p return location for the new file descriptor
+ * @param error error object
+ * @returns #FALSE if error set
+ */
+dbus_bool_t
+_dbus_eventfd_new (int       *fd_p,
+                   DBusError *error)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+  int fd;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  if (fd < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to create eventfd: %s", _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  *fd_p = fd;
+  return TRUE;
+#else
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "eventfd is not supported on this platform");
+  return FALSE;
+#endif
+}
+
+/**
+ * Makes an eventfd readable. Signalling it again before the reader
+ * has cleared it is harmless.
+ *
+ * @param fd the eventfd
+ */
+void
+_dbus_eventfd_signal (int fd)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+  eventfd_t one = 1;
+
+  /* can only fail with EAGAIN if the counter is about to overflow,
+   * in which case it is readable anyway */
+  while (write (fd, &one, sizeof (one)) < 0 && errno == EINTR)
+    ;
+#endif
+}
+
+/**
+ * Makes an eventfd unreadable until it is next signalled.
+ *
+ * @param fd the eventfd
+ */
+void
+_dbus_eventfd_clear (int fd)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+  eventfd_t value;
+
+  while (read (fd, &value, sizeof (value)) < 0 && errno == EINTR)
+    ;
+#endif
+}
+
 /**
  * Closes a file descriptor.
  *
@@ -3182,6 +4304,75 @@ _dbus_set_socket_nonblocking (DBusSocket      fd,
   return _dbus_set_fd_nonblocking (fd.fd, error);
 }
 
+/**
+ * Asks the kernel to busy-poll the device queue for up to the given
+ * time when reading from the socket finds no data (SO_BUSY_POLL).
+ * Raising it usually requires CAP_NET_ADMIN, and it only has an
+ * effect on network sockets.
+ *
+ * @param fd the socket
+ * @param microseconds how long to busy-poll, or 0 to stop
+ * @returns #TRUE if the option was set
+ */
+dbus_bool_t
+_dbus_set_socket_busy_poll (DBusSocket fd,
+                            int        microseconds)
+{
+#ifdef SO_BUSY_POLL
+  return setsockopt (fd.fd, SOL_SOCKET, SO_BUSY_POLL, &microseconds,
+                     sizeof (microseconds)) == 0;
+#else
+  return FALSE;
+#endif
+}
+
+/**
+ * Gets the size of the kernel's send (SO_SNDBUF) or receive
+ * (SO_RCVBUF) buffer for the socket. Linux reports twice what was
+ * asked for, to cover its bookkeeping.
+ *
+ * @param fd the socket
+ * @param send #TRUE for the send buffer, #FALSE for the receive buffer
+ * @returns the size in bytes, or -1 if it can't be found out
+ */
+int
+_dbus_get_socket_buffer_size (DBusSocket  fd,
+                              dbus_bool_t send)
+{
+  int size;
+  socklen_t len = sizeof (size);
+
+  if (getsockopt (fd.fd, SOL_SOCKET, send ? SO_SNDBUF : SO_RCVBUF,
+                  &size, &len) < 0)
+    return -1;
+
+  return size;
+}
+
+/**
+ * Asks for the socket's send or receive buffer to be @p size bytes.
+ * Without privileges the kernel silently caps it, on Linux at
+ * net.core.wmem_max or rmem_max, so the caller should look at the
+ * result rather than assume it got what it asked for.
+ *
+ * @param fd the socket
+ * @param send #TRUE for the send buffer, #FALSE for the receive buffer
+ * @param size the size to ask for
+ * @returns the size as _dbus_get_socket_buffer_size() now reports it,
+ *  or -1 if setting it failed
+ */
+int
+_dbus_set_socket_buffer_size (DBusSocket  fd,
+                              dbus_bool_t send,
+                              int         size)
+{
+  if (setsockopt (fd.fd, SOL_SOCKET, send ? SO_SNDBUF : SO_RCVBUF,
+                  &size, sizeof (size)) < 0)
+    return -1;
+
+  return _dbus_get_socket_buffer_size (fd, send);
+}
+
 static dbus_bool_t
 _dbus_set_fd_nonblocking (int             fd,
                           DBusError      *error)
@@ -4236,6 +5427,15 @@ _dbus_close_all (void)
 
 #ifdef __linux__
   DIR *d;
+#endif
+
+#ifdef HAVE_CLOSE_RANGE
+  /* One system call, if the kernel is new enough (Linux 5.9) */
+  if (close_range (3, ~0U, 0) == 0)
+    return;
+#endif
+
+#ifdef __linux__
 
   /* On Linux we can optimize this a bit if /proc is available. If it
      isn't available, fall back to the brute force way. */
@@ -4363,6 +5563,9 @@ _dbus_append_address_from_socket (DBusSocket  fd,
       struct sockaddr_un un;
       struct sockaddr_in ipv4;
       struct sockaddr_in6 ipv6;
+#ifdef HAVE_LINUX_VM_SOCKETS_H
+      struct sockaddr_vm vm;
+#endif
   } socket;
   char hostip[INET6_ADDRSTRLEN];
   int size = sizeof (socket);
@@ -4404,6 +5607,16 @@ _dbus_append_address_from_socket (DBusSocket  fd,
             _dbus_address_append_escaped (address, &path_str))
           return TRUE;
       break;
+#endif
+#ifdef HAVE_LINUX_VM_SOCKETS_H
+    case AF_VSOCK:
+      if (socket.vm.svm_cid == VMADDR_CID_ANY ?
+          _dbus_string_append_printf (address, "vsock:port=%u",
+                                      socket.vm.svm_port) :
+          _dbus_string_append_printf (address, "vsock:cid=%u,port=%u",
+                                      socket.vm.svm_cid, socket.vm.svm_port))
+        return TRUE;
+      break;
 #endif
     default:
       dbus_set_error (error,
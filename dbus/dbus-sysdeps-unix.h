@@ -73,6 +73,21 @@ int _dbus_listen_unix_socket  (const char     *path,
                                dbus_bool_t     abstract,
                                DBusError      *error);
 
+int _dbus_listen_tcp_socket_shared (const char     *host,
+                                    const char     *port,
+                                    const char     *family,
+                                    DBusString     *retport,
+                                    DBusSocket    **fds_p,
+                                    DBusError      *error);
+
+int _dbus_connect_vsock_socket (const char     *cid,
+                                const char     *port,
+                                DBusError      *error);
+int _dbus_listen_vsock_socket  (const char     *cid,
+                                const char     *port,
+                                DBusString     *retport,
+                                DBusError      *error);
+
 int _dbus_connect_exec (const char     *path,
                         char *const    argv[],
                         DBusError      *error);
@@ -155,6 +170,38 @@ dbus_bool_t _dbus_append_address_from_socket (DBusSocket  fd,
 DBUS_PRIVATE_EXPORT
 void _dbus_fd_set_close_on_exec (int fd);
 
+DBUS_PRIVATE_EXPORT
+dbus_bool_t _dbus_memfd_create_sealed (const void *data,
+                                       size_t      len,
+                                       int        *fd_p,
+                                       DBusError  *error);
+DBUS_PRIVATE_EXPORT
+dbus_bool_t _dbus_memfd_map_sealed    (int         fd,
+                                       void      **data_p,
+                                       size_t     *len_p,
+                                       DBusError  *error);
+DBUS_PRIVATE_EXPORT
+void        _dbus_memfd_unmap         (void       *data,
+                                       size_t      len);
+dbus_bool_t _dbus_memfd_create_shared (size_t      len,
+                                       int        *fd_p,
+                                       DBusError  *error);
+dbus_bool_t _dbus_memfd_map_shared    (int         fd,
+                                       size_t      len,
+                                       void      **data_p,
+                                       DBusError  *error);
+dbus_bool_t _dbus_file_map_shared     (const DBusString  *filename,
+                                       size_t             len,
+                                       void             **data_p,
+                                       DBusError         *error);
+void        _dbus_file_unmap_shared   (void       *data,
+                                       size_t      len);
+
+dbus_bool_t _dbus_eventfd_new         (int        *fd_p,
+                                       DBusError  *error);
+void        _dbus_eventfd_signal      (int         fd);
+void        _dbus_eventfd_clear       (int         fd);
+
 /** @} */
 
 DBUS_END_DECLS
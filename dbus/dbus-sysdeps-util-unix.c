@@ -45,6 +45,9 @@
 #ifdef HAVE_SYS_RESOURCE_H
 #include <sys/resource.h>
 #endif
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
 #include <grp.h>
 #include <sys/socket.h>
 #include <dirent.h>
@@ -516,6 +519,153 @@ _dbus_rlimit_free (DBusRLimit *lim)
   dbus_free (lim);
 }
 
+#ifdef HAVE_SCHED_SETAFFINITY
+
+struct DBusCpuAffinity {
+    cpu_set_t cpus;
+};
+
+/* Parses a list like "0-3,8" into cpus */
+static dbus_bool_t
+parse_cpu_list (const char *list,
+                cpu_set_t  *cpus)
+{
+  const char *p = list;
+  char *end;
+  unsigned long first, last, cpu;
+
+  CPU_ZERO (cpus);
+
+  while (TRUE)
+    {
+      if (*p < '0' || *p > '9')
+        return FALSE;
+
+      first = strtoul (p, &end, 10);
+      last = first;
+      p = end;
+
+      if (*p == '-')
+        {
+          p++;
+
+          if (*p < '0' || *p > '9')
+            return FALSE;
+
+          last = strtoul (p, &end, 10);
+          p = end;
+        }
+
+      if (first > last || last >= CPU_SETSIZE)
+        return FALSE;
+
+      for (cpu = first; cpu <= last; cpu++)
+        CPU_SET (cpu, cpus);
+
+      if (*p == '\0')
+        return TRUE;
+
+      if (*p != ',')
+        return FALSE;
+
+      p++;
+    }
+}
+
+/**
+ * Restricts this process to the given CPUs. With the kernel's default
+ * first-touch policy, memory it allocates from then on also comes from
+ * the NUMA nodes of those CPUs.
+ *
+ * @param cpus CPU numbers and ranges separated by commas, like "0-3,8"
+ * @param error return location for errors
+ * @returns the previous affinity, for _dbus_cpu_affinity_restore(), or #NULL on error
+ */
+DBusCpuAffinity *
+_dbus_cpu_affinity_set (const char *cpus,
+                        DBusError  *error)
+{
+  DBusCpuAffinity *saved;
+  cpu_set_t wanted;
+
+  if (!parse_cpu_list (cpus, &wanted))
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                      "Invalid CPU list \"%s\": expected CPU numbers and "
+                      "ranges separated by commas, such as \"0-3,8\"",
+                      cpus);
+      return NULL;
+    }
+
+  saved = dbus_new0 (DBusCpuAffinity, 1);
+
+  if (saved == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      return NULL;
+    }
+
+  if (sched_getaffinity (0, sizeof (saved->cpus), &saved->cpus) < 0 ||
+      sched_setaffinity (0, sizeof (wanted), &wanted) < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to set CPU affinity to \"%s\": %s", cpus,
+                      _dbus_strerror (errno));
+      dbus_free (saved);
+      return NULL;
+    }
+
+  return saved;
+}
+
+dbus_bool_t
+_dbus_cpu_affinity_restore (DBusCpuAffinity *saved,
+                            DBusError       *error)
+{
+  if (sched_setaffinity (0, sizeof (saved->cpus), &saved->cpus) < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to restore old CPU affinity: %s",
+                      _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+#else /* !HAVE_SCHED_SETAFFINITY */
+
+static void
+cpu_affinity_not_supported (DBusError *error)
+{
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "cannot change CPU affinity on this platform");
+}
+
+DBusCpuAffinity *
+_dbus_cpu_affinity_set (const char *cpus,
+                        DBusError  *error)
+{
+  cpu_affinity_not_supported (error);
+  return NULL;
+}
+
+dbus_bool_t
+_dbus_cpu_affinity_restore (DBusCpuAffinity *saved,
+                            DBusError       *error)
+{
+  cpu_affinity_not_supported (error);
+  return FALSE;
+}
+
+#endif
+
+void
+_dbus_cpu_affinity_free (DBusCpuAffinity *saved)
+{
+  dbus_free (saved);
+}
+
 void
 _dbus_init_system_log (dbus_bool_t is_daemon)
 {
@@ -296,6 +296,36 @@ _dbus_rlimit_free (DBusRLimit *lim)
   _dbus_assert (lim == NULL);
 }
 
+static void
+cpu_affinity_not_supported (DBusError *error)
+{
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "cannot change CPU affinity on this platform");
+}
+
+DBusCpuAffinity *
+_dbus_cpu_affinity_set (const char *cpus,
+                        DBusError  *error)
+{
+  cpu_affinity_not_supported (error);
+  return NULL;
+}
+
+dbus_bool_t
+_dbus_cpu_affinity_restore (DBusCpuAffinity *saved,
+                            DBusError       *error)
+{
+  cpu_affinity_not_supported (error);
+  return FALSE;
+}
+
+void
+_dbus_cpu_affinity_free (DBusCpuAffinity *saved)
+{
+  /* _dbus_cpu_affinity_set() cannot return non-NULL on Windows */
+  _dbus_assert (saved == NULL);
+}
+
 void
 _dbus_init_system_log (dbus_bool_t is_daemon)
 {
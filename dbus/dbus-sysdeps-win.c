@@ -557,6 +557,64 @@ _dbus_set_socket_nonblocking (DBusSocket      handle,
   return TRUE;
 }
 
+/**
+ * Would ask the kernel to busy-poll the socket, but Windows has no
+ * equivalent of SO_BUSY_POLL.
+ *
+ * @param handle the socket
+ * @param microseconds how long to busy-poll, or 0 to stop
+ * @returns #FALSE
+ */
+dbus_bool_t
+_dbus_set_socket_busy_poll (DBusSocket handle,
+                            int        microseconds)
+{
+  return FALSE;
+}
+
+/**
+ * Gets the size of the send (SO_SNDBUF) or receive (SO_RCVBUF) buffer
+ * for the socket.
+ *
+ * @param handle the socket
+ * @param send #TRUE for the send buffer, #FALSE for the receive buffer
+ * @returns the size in bytes, or -1 if it can't be found out
+ */
+int
+_dbus_get_socket_buffer_size (DBusSocket  handle,
+                              dbus_bool_t send)
+{
+  int size;
+  int len = sizeof (size);
+
+  if (getsockopt (handle.sock, SOL_SOCKET, send ? SO_SNDBUF : SO_RCVBUF,
+                  (char *) &size, &len) == SOCKET_ERROR)
+    return -1;
+
+  return size;
+}
+
+/**
+ * Asks for the socket's send or receive buffer to be @p size bytes.
+ *
+ * @param handle the socket
+ * @param send #TRUE for the send buffer, #FALSE for the receive buffer
+ * @param size the size to ask for
+ * @returns the size as _dbus_get_socket_buffer_size() now reports it,
+ *  or -1 if setting it failed
+ */
+int
+_dbus_set_socket_buffer_size (DBusSocket  handle,
+                              dbus_bool_t send,
+                              int         size)
+{
+  if (setsockopt (handle.sock, SOL_SOCKET, send ? SO_SNDBUF : SO_RCVBUF,
+                  (const char *) &size, sizeof (size)) == SOCKET_ERROR)
+    return -1;
+
+  return _dbus_get_socket_buffer_size (handle, send);
+}
+
 
 /**
  * Like _dbus_write() but will use writev() if possible
@@ -642,6 +700,75 @@ _dbus_write_socket_two (DBusSocket        fd,
   return bytes_written;
 }
 
+/**
+ * Like _dbus_write_socket_two(), but gathers any number of buffers,
+ * so that several queued messages can be written with one system
+ * call. At most #_DBUS_MAX_SOCKET_WRITE_VECTORS buffers are written;
+ * the caller finds out from the return value, as for any other short
+ * write.
+ *
+ * @param fd the socket
+ * @param buffers the buffers to write, in order
+ * @param starts first byte to write in each buffer
+ * @param lens number of bytes to write from each buffer
+ * @param n_buffers number of buffers, at least 1
+ * @returns total bytes written from all buffers, or -1 on error
+ */
+int
+_dbus_write_socket_many (DBusSocket         fd,
+                         const DBusString **buffers,
+                         const int         *starts,
+                         const int         *lens,
+                         int                n_buffers)
+{
+  WSABUF vectors[_DBUS_MAX_SOCKET_WRITE_VECTORS];
+  int rc;
+  int i;
+  DWORD bytes_written;
+
+  _dbus_assert (n_buffers > 0);
+
+  if (n_buffers > _DBUS_MAX_SOCKET_WRITE_VECTORS)
+    n_buffers = _DBUS_MAX_SOCKET_WRITE_VECTORS;
+
+  for (i = 0; i < n_buffers; i++)
+    {
+      _dbus_assert (buffers[i] != NULL);
+      _dbus_assert (starts[i] >= 0);
+      _dbus_assert (lens[i] >= 0);
+
+      vectors[i].buf = (char *) _dbus_string_get_const_data_len (buffers[i],
+                                                                 starts[i],
+                                                                 lens[i]);
+      vectors[i].len = lens[i];
+    }
+
+ again:
+
+  _dbus_verbose ("WSASend: %d buffers fd=%Iu\n", n_buffers, fd.sock);
+  rc = WSASend (fd.sock,
+                vectors,
+                n_buffers,
+                &bytes_written,
+                0,
+                NULL,
+                NULL);
+
+  if (rc == SOCKET_ERROR)
+    {
+      DBUS_SOCKET_SET_ERRNO ();
+      _dbus_verbose ("WSASend: failed: %s\n", _dbus_strerror_from_errno ());
+      bytes_written = -1;
+    }
+  else
+    _dbus_verbose ("WSASend: = %ld\n", bytes_written);
+
+  if (bytes_written < 0 && errno == EINTR)
+    goto again;
+
+  return bytes_written;
+}
+
 #if 0
 
 /**
@@ -1866,6 +1993,29 @@ _dbus_accept  (DBusSocket listen_fd)
   return client_fd;
 }
 
+/**
+ * Like _dbus_accept(), but the returned socket is also nonblocking.
+ *
+ * @param listen_fd the listen file descriptor
+ * @returns the connection fd of the client, or -1 on error
+ */
+DBusSocket
+_dbus_accept_nonblocking (DBusSocket listen_fd)
+{
+  DBusSocket client_fd;
+
+  client_fd = _dbus_accept (listen_fd);
+
+  if (_dbus_socket_is_valid (client_fd) &&
+      !_dbus_set_socket_nonblocking (client_fd, NULL))
+    {
+      _dbus_close_socket (client_fd, NULL);
+      _dbus_socket_invalidate (&client_fd);
+    }
+
+  return client_fd;
+}
+
 
 
 
@@ -2191,6 +2341,33 @@ _dbus_get_real_time (long *tv_sec,
     *tv_usec = time64 % 1000000;
 }
 
+/**
+ * Allocates memory for a large buffer, which must be released with
+ * _dbus_free_large_pages(). On Windows this is ordinary zeroed
+ * memory.
+ *
+ * @param size the number of bytes
+ * @returns the memory, or #NULL if not enough memory
+ */
+void *
+_dbus_alloc_large_pages (size_t size)
+{
+  return dbus_malloc0 (size);
+}
+
+/**
+ * Releases memory from _dbus_alloc_large_pages().
+ *
+ * @param pages the memory
+ * @param size the size it was allocated with
+ */
+void
+_dbus_free_large_pages (void   *pages,
+                        size_t  size)
+{
+  dbus_free (pages);
+}
+
 /**
  * Get current time, as in gettimeofday(). Use the monotonic clock if
  * available, to avoid problems when the system time changes.
@@ -2206,6 +2383,31 @@ _dbus_get_monotonic_time (long *tv_sec,
   _dbus_get_real_time (tv_sec, tv_usec);
 }
 
+/**
+ * Get a monotonic time in nanoseconds, for measuring short intervals.
+ * Its starting point is arbitrary.
+ *
+ * @returns the time in nanoseconds
+ */
+dbus_uint64_t
+_dbus_get_monotonic_time_nsec (void)
+{
+  LARGE_INTEGER frequency, counter;
+
+  if (!QueryPerformanceFrequency (&frequency) ||
+      !QueryPerformanceCounter (&counter))
+    {
+      long tv_sec, tv_usec;
+
+      _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+      return ((dbus_uint64_t) tv_sec) * 1000000000 + ((dbus_uint64_t) tv_usec) * 1000;
+    }
+
+  return (((dbus_uint64_t) counter.QuadPart) / frequency.QuadPart) * 1000000000 +
+    ((((dbus_uint64_t) counter.QuadPart) % frequency.QuadPart) * 1000000000) /
+    frequency.QuadPart;
+}
+
 /**
  * signal (SIGPIPE, SIG_IGN);
  */
@@ -3263,6 +3465,20 @@ _dbus_atomic_get (DBusAtomic *atomic)
   return atomic->value;
 }
 
+/**
+ * Issues a full memory barrier: loads and stores before it are not
+ * reordered with those after it, by the compiler or the CPU. This is
+ * for data that is read without taking a lock.
+ */
+void
+_dbus_memory_barrier (void)
+{
+  /* As in _dbus_atomic_get(), MemoryBarrier() isn't always available */
+  long dummy = 0;
+
+  InterlockedExchange (&dummy, 1);
+}
+
 /**
  * Called when the bus daemon is signaled to reload its configuration; any
  * caches should be nuked. Of course any caches that need explicit reload
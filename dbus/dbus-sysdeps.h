@@ -173,6 +173,13 @@ _dbus_socket_get_invalid (void)
 
 dbus_bool_t _dbus_set_socket_nonblocking (DBusSocket      fd,
                                           DBusError      *error);
+dbus_bool_t _dbus_set_socket_busy_poll   (DBusSocket      fd,
+                                          int             microseconds);
+int         _dbus_get_socket_buffer_size (DBusSocket      fd,
+                                          dbus_bool_t     send);
+int         _dbus_set_socket_buffer_size (DBusSocket      fd,
+                                          dbus_bool_t     send,
+                                          int             size);
 
 DBUS_PRIVATE_EXPORT
 dbus_bool_t _dbus_close_socket     (DBusSocket        fd,
@@ -194,6 +201,15 @@ int         _dbus_write_socket_two (DBusSocket        fd,
                                     int               start2,
                                     int               len2);
 
+/** Maximum number of buffers _dbus_write_socket_many() writes at once */
+#define _DBUS_MAX_SOCKET_WRITE_VECTORS 64
+
+int         _dbus_write_socket_many (DBusSocket         fd,
+                                     const DBusString **buffers,
+                                     const int         *starts,
+                                     const int         *lens,
+                                     int                n_buffers);
+
 int _dbus_read_socket_with_unix_fds      (DBusSocket        fd,
                                           DBusString       *buffer,
                                           int               count,
@@ -215,6 +231,13 @@ int _dbus_write_socket_with_unix_fds_two (DBusSocket        fd,
                                           int               len2,
                                           const int        *fds,
                                           int               n_fds);
+int _dbus_write_socket_many_with_unix_fds (DBusSocket         fd,
+                                           const DBusString **buffers,
+                                           const int         *starts,
+                                           const int         *lens,
+                                           int                n_buffers,
+                                           const int         *fds,
+                                           int                n_fds);
 
 DBusSocket _dbus_connect_tcp_socket  (const char     *host,
                                       const char     *port,
@@ -232,6 +255,7 @@ int _dbus_listen_tcp_socket   (const char     *host,
                                DBusSocket    **fds_p,
                                DBusError      *error);
 DBusSocket _dbus_accept       (DBusSocket      listen_fd);
+DBusSocket _dbus_accept_nonblocking (DBusSocket listen_fd);
 
 dbus_bool_t _dbus_read_credentials_socket (DBusSocket        client_fd,
                                            DBusCredentials  *credentials,
@@ -298,6 +322,7 @@ struct DBusAtomic
 dbus_int32_t _dbus_atomic_inc (DBusAtomic *atomic);
 dbus_int32_t _dbus_atomic_dec (DBusAtomic *atomic);
 dbus_int32_t _dbus_atomic_get (DBusAtomic *atomic);
+void         _dbus_memory_barrier (void);
 
 #ifdef DBUS_WIN
 
@@ -407,6 +432,9 @@ DBUS_PRIVATE_EXPORT
 void _dbus_get_monotonic_time (long *tv_sec,
                                long *tv_usec);
 
+DBUS_PRIVATE_EXPORT
+dbus_uint64_t _dbus_get_monotonic_time_nsec (void);
+
 DBUS_PRIVATE_EXPORT
 void _dbus_get_real_time (long *tv_sec,
                           long *tv_usec);
@@ -674,6 +702,18 @@ dbus_bool_t     _dbus_rlimit_restore_fd_limit              (DBusRLimit   *saved,
                                                             DBusError    *error);
 void            _dbus_rlimit_free                          (DBusRLimit   *lim);
 
+typedef struct DBusCpuAffinity DBusCpuAffinity;
+
+DBusCpuAffinity *_dbus_cpu_affinity_set                    (const char      *cpus,
+                                                            DBusError       *error);
+dbus_bool_t      _dbus_cpu_affinity_restore                (DBusCpuAffinity *saved,
+                                                            DBusError       *error);
+void             _dbus_cpu_affinity_free                   (DBusCpuAffinity *saved);
+
+void *_dbus_alloc_large_pages (size_t  size);
+void  _dbus_free_large_pages  (void   *pages,
+                               size_t  size);
+
 /** @} */
 
 DBUS_END_DECLS
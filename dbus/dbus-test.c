@@ -123,6 +123,10 @@ dbus_internal_do_not_use_run_tests (const char *test_data_dir, const char *speci
 
   run_test ("server", specific_test, _dbus_server_test);
 
+  run_test ("connection", specific_test, _dbus_connection_test);
+
+  run_test ("bus", specific_test, _dbus_bus_test);
+
   run_test ("object-tree", specific_test, _dbus_object_tree_test);
 
   run_test ("signature", specific_test, _dbus_signature_test);
@@ -157,12 +161,18 @@ dbus_internal_do_not_use_run_tests (const char *test_data_dir, const char *speci
   run_data_test ("userdb", specific_test, _dbus_userdb_test, test_data_dir);
 
   run_test ("transport-unix", specific_test, _dbus_transport_unix_test);
+
+  run_test ("shm-ring", specific_test, _dbus_shm_ring_test);
 #endif
   
   run_test ("keyring", specific_test, _dbus_keyring_test);
 
   run_data_test ("sha", specific_test, _dbus_sha_test, test_data_dir);
   
+  run_test ("compress", specific_test, _dbus_compress_test);
+
+  run_test ("dispatch-queues", specific_test, _dbus_dispatch_queues_test);
+
   run_data_test ("auth", specific_test, _dbus_auth_test, test_data_dir);
 
   printf ("%s: completed successfully\n", "test-dbus");
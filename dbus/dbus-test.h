@@ -67,6 +67,12 @@ dbus_bool_t _dbus_address_test           (void);
 DBUS_PRIVATE_EXPORT
 dbus_bool_t _dbus_server_test            (void);
 
+DBUS_PRIVATE_EXPORT
+dbus_bool_t _dbus_connection_test        (void);
+
+DBUS_PRIVATE_EXPORT
+dbus_bool_t _dbus_bus_test               (void);
+
 dbus_bool_t _dbus_message_test           (const char *test_data_dir);
 dbus_bool_t _dbus_auth_test              (const char *test_data_dir);
 
@@ -88,6 +94,15 @@ dbus_bool_t _dbus_userdb_test            (const char *test_data_dir);
 DBUS_PRIVATE_EXPORT
 dbus_bool_t _dbus_transport_unix_test    (void);
 
+DBUS_PRIVATE_EXPORT
+dbus_bool_t _dbus_shm_ring_test          (void);
+
+DBUS_PRIVATE_EXPORT
+dbus_bool_t _dbus_compress_test          (void);
+
+DBUS_PRIVATE_EXPORT
+dbus_bool_t _dbus_dispatch_queues_test   (void);
+
 DBUS_PRIVATE_EXPORT
 dbus_bool_t _dbus_memory_test            (void);
 
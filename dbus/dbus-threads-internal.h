@@ -48,6 +48,35 @@ typedef struct DBusCMutex DBusCMutex;
 
 DBUS_BEGIN_DECLS
 
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+/**
+ * How long one mutex was waited for and held while profiling
+ */
+typedef struct
+{
+  const char *name;             /**< What it protects, or #NULL if unknown */
+  const void *owner;            /**< The object it belongs to, or #NULL */
+  unsigned long n_locks;        /**< Times it was locked, not counting recursion */
+  dbus_uint64_t wait_nsec;      /**< Total time spent waiting to lock it */
+  dbus_uint64_t max_wait_nsec;  /**< Longest wait to lock it */
+  dbus_uint64_t hold_nsec;      /**< Total time it was held */
+  dbus_uint64_t max_hold_nsec;  /**< Longest time it was held */
+} DBusLockProfile;
+
+DBUS_PRIVATE_EXPORT
+dbus_bool_t  _dbus_lock_profile_start        (void);
+DBUS_PRIVATE_EXPORT
+void         _dbus_lock_profile_stop         (void);
+DBUS_PRIVATE_EXPORT
+int          _dbus_lock_profile_get          (DBusLockProfile  *profiles,
+                                              int               n_profiles);
+void         _dbus_lock_profile_name         (const void       *mutex,
+                                              const char       *name,
+                                              const void       *owner);
+#else
+#define _dbus_lock_profile_name(mutex, name, owner) do { } while (0)
+#endif
+
 DBUS_PRIVATE_EXPORT
 void         _dbus_rmutex_lock               (DBusRMutex       *mutex);
 DBUS_PRIVATE_EXPORT
@@ -26,6 +26,8 @@
 #include "dbus-threads-internal.h"
 #include "dbus-list.h"
 
+#include <string.h>
+
 static int thread_init_generation = 0;
 
 /**
@@ -38,6 +40,275 @@ static int thread_init_generation = 0;
  * @{
  */
 
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+
+/** Most mutexes that can be profiled at once */
+#define LOCK_PROFILE_SIZE 509
+
+typedef struct
+{
+  const void *mutex;            /**< The mutex, or #NULL if the slot is free */
+  DBusLockProfile profile;
+  int depth;                    /**< Recursion depth while it is held */
+  dbus_uint64_t held_since;     /**< When it was locked, if held */
+} LockProfileEntry;
+
+static dbus_bool_t lock_profiling = FALSE;
+static DBusCMutex *lock_profile_mutex = NULL;
+static LockProfileEntry lock_profile_table[LOCK_PROFILE_SIZE];
+
+static const char * const global_lock_names[] = {
+  "list",
+  "connection_slots",
+  "pending_call_slots",
+  "server_slots",
+  "message_slots",
+  "bus",
+  "bus_datas",
+  "shutdown_funcs",
+  "system_users",
+  "message_cache",
+  "shared_connections",
+  "machine_uuid",
+  "sysdeps",
+  "hash_seed",
+  "keyrings",
+  "nonce",
+  "body_pool",
+  "pending_call_cache"
+};
+
+_DBUS_STATIC_ASSERT (_DBUS_N_ELEMENTS (global_lock_names) ==
+                     _DBUS_N_GLOBAL_LOCKS);
+
+/*
+ * Finds the entry for a mutex, adding it if it is new. Each entry's
+ * statistics are only changed by a thread holding its mutex, so only
+ * adding entries needs a lock of its own. Returns #NULL if the table
+ * is full, in which case the mutex isn't profiled.
+ */
+static LockProfileEntry *
+lock_profile_lookup (const void *mutex,
+                     const char *name)
+{
+  LockProfileEntry *entry = NULL;
+  int start, i;
+
+  start = ((uintptr_t) mutex / sizeof (void *)) % LOCK_PROFILE_SIZE;
+  i = start;
+
+  /* A slot's mutex is only written once, under lock_profile_mutex */
+  while (lock_profile_table[i].mutex != NULL)
+    {
+      if (lock_profile_table[i].mutex == mutex)
+        return &lock_profile_table[i];
+
+      i = (i + 1) % LOCK_PROFILE_SIZE;
+
+      if (i == start)
+        return NULL;
+    }
+
+  _dbus_platform_cmutex_lock (lock_profile_mutex);
+
+  /* someone else might have added it, or taken the free slot */
+  do
+    {
+      if (lock_profile_table[i].mutex == mutex)
+        {
+          entry = &lock_profile_table[i];
+          break;
+        }
+
+      if (lock_profile_table[i].mutex == NULL)
+        {
+          entry = &lock_profile_table[i];
+          entry->profile.name = name;
+          entry->mutex = mutex;
+          break;
+        }
+
+      i = (i + 1) % LOCK_PROFILE_SIZE;
+    }
+  while (i != start);
+
+  _dbus_platform_cmutex_unlock (lock_profile_mutex);
+  return entry;
+}
+
+/* Called with the mutex newly locked; it was asked for at @p asked */
+static void
+lock_profile_locked (const void    *mutex,
+                     const char    *name,
+                     dbus_uint64_t  asked)
+{
+  LockProfileEntry *entry = lock_profile_lookup (mutex, name);
+  dbus_uint64_t now, waited;
+
+  if (entry == NULL || entry->depth++ > 0)
+    return;
+
+  now = _dbus_get_monotonic_time_nsec ();
+  waited = now - asked;
+  entry->held_since = now;
+  entry->profile.n_locks += 1;
+  entry->profile.wait_nsec += waited;
+
+  if (waited > entry->profile.max_wait_nsec)
+    entry->profile.max_wait_nsec = waited;
+}
+
+/* Called with the mutex still locked, just before unlocking it */
+static void
+lock_profile_unlocking (const void *mutex,
+                        const char *name)
+{
+  LockProfileEntry *entry = lock_profile_lookup (mutex, name);
+  dbus_uint64_t held;
+
+  /* depth is 0 if it was locked before profiling started */
+  if (entry == NULL || entry->depth == 0 || --entry->depth > 0)
+    return;
+
+  held = _dbus_get_monotonic_time_nsec () - entry->held_since;
+  entry->profile.hold_nsec += held;
+
+  if (held > entry->profile.max_hold_nsec)
+    entry->profile.max_hold_nsec = held;
+}
+
+/* Waiting on a condition variable is neither holding nor waiting for
+ * its mutex */
+static void
+lock_profile_condvar_waiting (DBusCMutex *mutex)
+{
+  LockProfileEntry *entry = lock_profile_lookup (mutex, NULL);
+
+  if (entry == NULL || entry->depth == 0)
+    return;
+
+  entry->profile.hold_nsec +=
+    _dbus_get_monotonic_time_nsec () - entry->held_since;
+}
+
+static void
+lock_profile_condvar_woken (DBusCMutex *mutex)
+{
+  LockProfileEntry *entry = lock_profile_lookup (mutex, NULL);
+
+  if (entry != NULL && entry->depth > 0)
+    entry->held_since = _dbus_get_monotonic_time_nsec ();
+}
+
+static void
+lock_profile_shutdown (void *data)
+{
+  lock_profiling = FALSE;
+  _dbus_platform_cmutex_free (lock_profile_mutex);
+  lock_profile_mutex = NULL;
+}
+
+/**
+ * Starts recording how long each mutex is waited for and held, for
+ * benchmarks. Statistics from any earlier profiling are discarded.
+ * This must be called while no other thread is using libdbus.
+ *
+ * Only libdbus built with embedded tests can do this, and mutexes
+ * cost a clock read and a table lookup each time they are locked
+ * or unlocked while profiling is on.
+ *
+ * @returns #FALSE if there is not enough memory
+ */
+dbus_bool_t
+_dbus_lock_profile_start (void)
+{
+  if (!dbus_threads_init_default ())
+    return FALSE;
+
+  if (lock_profile_mutex == NULL)
+    {
+      lock_profile_mutex = _dbus_platform_cmutex_new ();
+
+      if (lock_profile_mutex == NULL)
+        return FALSE;
+
+      if (!_dbus_register_shutdown_func (lock_profile_shutdown, NULL))
+        {
+          _dbus_platform_cmutex_free (lock_profile_mutex);
+          lock_profile_mutex = NULL;
+          return FALSE;
+        }
+    }
+
+  memset (lock_profile_table, 0, sizeof (lock_profile_table));
+  lock_profiling = TRUE;
+  return TRUE;
+}
+
+/**
+ * Stops recording what _dbus_lock_profile_start() started. This must
+ * be called while no other thread is using libdbus.
+ */
+void
+_dbus_lock_profile_stop (void)
+{
+  lock_profiling = FALSE;
+}
+
+/**
+ * Copies out up to @p n_profiles of the statistics recorded since
+ * _dbus_lock_profile_start(), one per mutex that was locked.
+ *
+ * @param profiles where to put them
+ * @param n_profiles how many fit
+ * @returns how many were copied
+ */
+int
+_dbus_lock_profile_get (DBusLockProfile *profiles,
+                        int              n_profiles)
+{
+  int i, n = 0;
+
+  for (i = 0; i < LOCK_PROFILE_SIZE && n < n_profiles; i++)
+    {
+      if (lock_profile_table[i].mutex != NULL &&
+          lock_profile_table[i].profile.n_locks > 0)
+        profiles[n++] = lock_profile_table[i].profile;
+    }
+
+  return n;
+}
+
+/**
+ * Says what a mutex protects, so that its statistics can be told
+ * apart from those of other mutexes if it is locked while profiling.
+ * Does nothing unless profiling has been started.
+ *
+ * @param mutex a #DBusRMutex or #DBusCMutex
+ * @param name what it protects, which must stay valid
+ * @param owner the object it belongs to, or #NULL
+ */
+void
+_dbus_lock_profile_name (const void *mutex,
+                         const char *name,
+                         const void *owner)
+{
+  LockProfileEntry *entry;
+
+  if (!lock_profiling || mutex == NULL)
+    return;
+
+  entry = lock_profile_lookup (mutex, name);
+
+  if (entry != NULL)
+    {
+      entry->profile.name = name;
+      entry->profile.owner = owner;
+    }
+}
+
+#endif /* DBUS_ENABLE_EMBEDDED_TESTS */
+
 /**
  * Creates a new mutex
  * or creates a no-op mutex if threads are not initialized.
@@ -124,6 +395,17 @@ _dbus_rmutex_lock (DBusRMutex *mutex)
   if (mutex == NULL)
     return;
 
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+  if (_DBUS_UNLIKELY (lock_profiling))
+    {
+      dbus_uint64_t asked = _dbus_get_monotonic_time_nsec ();
+
+      _dbus_platform_rmutex_lock (mutex);
+      lock_profile_locked (mutex, NULL, asked);
+      return;
+    }
+#endif
+
   _dbus_platform_rmutex_lock (mutex);
 }
 
@@ -138,6 +420,17 @@ _dbus_cmutex_lock (DBusCMutex *mutex)
   if (mutex == NULL)
     return;
 
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+  if (_DBUS_UNLIKELY (lock_profiling))
+    {
+      dbus_uint64_t asked = _dbus_get_monotonic_time_nsec ();
+
+      _dbus_platform_cmutex_lock (mutex);
+      lock_profile_locked (mutex, NULL, asked);
+      return;
+    }
+#endif
+
   _dbus_platform_cmutex_lock (mutex);
 }
 
@@ -152,6 +445,11 @@ _dbus_rmutex_unlock (DBusRMutex *mutex)
   if (mutex == NULL)
     return;
 
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+  if (_DBUS_UNLIKELY (lock_profiling))
+    lock_profile_unlocking (mutex, NULL);
+#endif
+
   _dbus_platform_rmutex_unlock (mutex);
 }
 
@@ -166,6 +464,11 @@ _dbus_cmutex_unlock (DBusCMutex *mutex)
   if (mutex == NULL)
     return;
 
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+  if (_DBUS_UNLIKELY (lock_profiling))
+    lock_profile_unlocking (mutex, NULL);
+#endif
+
   _dbus_platform_cmutex_unlock (mutex);
 }
 
@@ -243,6 +546,16 @@ _dbus_condvar_wait (DBusCondVar *cond,
   if (cond == NULL || mutex == NULL)
     return;
 
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+  if (_DBUS_UNLIKELY (lock_profiling))
+    {
+      lock_profile_condvar_waiting (mutex);
+      _dbus_platform_condvar_wait (cond, mutex);
+      lock_profile_condvar_woken (mutex);
+      return;
+    }
+#endif
+
   _dbus_platform_condvar_wait (cond, mutex);
 }
 
@@ -265,6 +578,19 @@ _dbus_condvar_wait_timeout (DBusCondVar               *cond,
   if (cond == NULL || mutex == NULL)
     return TRUE;
 
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+  if (_DBUS_UNLIKELY (lock_profiling))
+    {
+      dbus_bool_t woken;
+
+      lock_profile_condvar_waiting (mutex);
+      woken = _dbus_platform_condvar_wait_timeout (cond, mutex,
+          timeout_milliseconds);
+      lock_profile_condvar_woken (mutex);
+      return woken;
+    }
+#endif
+
   return _dbus_platform_condvar_wait_timeout (cond, mutex,
       timeout_milliseconds);
 }
@@ -343,6 +669,18 @@ _dbus_lock (DBusGlobalLock lock)
       !dbus_threads_init_default ())
     return FALSE;
 
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+  if (_DBUS_UNLIKELY (lock_profiling))
+    {
+      dbus_uint64_t asked = _dbus_get_monotonic_time_nsec ();
+
+      _dbus_platform_rmutex_lock (global_locks[lock]);
+      lock_profile_locked (global_locks[lock], global_lock_names[lock],
+                           asked);
+      return TRUE;
+    }
+#endif
+
   _dbus_platform_rmutex_lock (global_locks[lock]);
   return TRUE;
 }
@@ -353,6 +691,11 @@ _dbus_unlock (DBusGlobalLock lock)
   _dbus_assert (lock >= 0);
   _dbus_assert (lock < _DBUS_N_GLOBAL_LOCKS);
 
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+  if (_DBUS_UNLIKELY (lock_profiling))
+    lock_profile_unlocking (global_locks[lock], global_lock_names[lock]);
+#endif
+
   _dbus_platform_rmutex_unlock (global_locks[lock]);
 }
 
@@ -375,6 +375,22 @@ _dbus_timeout_list_toggle_timeout (DBusTimeoutList           *timeout_list,
                                                 timeout_list->timeout_data);
 }
 
+/**
+ * Checks whether the application will notice a timeout being toggled,
+ * and so a change to its interval. This is the case if it has a
+ * DBusTimeoutToggledFunction, or if it hasn't been given the timeouts
+ * yet. Otherwise the timeout has to be removed and added again.
+ *
+ * @param timeout_list the timeout list.
+ * @returns #TRUE if toggling reaches the application
+ */
+dbus_bool_t
+_dbus_timeout_list_can_toggle (DBusTimeoutList *timeout_list)
+{
+  return timeout_list->add_timeout_function == NULL ||
+    timeout_list->timeout_toggled_function != NULL;
+}
+
 /** @} */
 
 /**
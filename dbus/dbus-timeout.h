@@ -70,6 +70,7 @@ void             _dbus_timeout_list_remove_timeout (DBusTimeoutList           *t
 void             _dbus_timeout_list_toggle_timeout (DBusTimeoutList           *timeout_list,
                                                     DBusTimeout               *timeout,
                                                     dbus_bool_t                enabled);
+dbus_bool_t      _dbus_timeout_list_can_toggle     (DBusTimeoutList           *timeout_list);
 
 
 /** @} */
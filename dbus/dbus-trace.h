@@ -0,0 +1,68 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-trace.h  Static tracepoints
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#ifndef DBUS_TRACE_H
+#define DBUS_TRACE_H
+
+/*
+ * When built with --enable-usdt (DBUS_ENABLE_USDT in CMake), these
+ * become SystemTap/USDT probes in provider "dbus", usable from
+ * bpftrace, perf, stap and so on. A probe nobody is attached to is a
+ * single nop, but its arguments are still evaluated, so keep them
+ * cheap. Otherwise they compile to nothing and the arguments are not
+ * evaluated at all.
+ *
+ * Probes in libdbus:
+ *   message__received (serial, type, header bytes, body bytes)
+ *   message__sent (serial, type, bytes)
+ *   socket__written (bytes, messages)
+ *
+ * Probes in dbus-daemon:
+ *   dispatch__start (serial, sender, type)
+ *   dispatch__done (serial, sender)
+ *   policy__checked (serial, sender, proposed recipient, allowed)
+ *   match__recipients (serial, sender, recipients)
+ *   message__enqueued (serial, sender, recipient)
+ *
+ * Serials are the sender's, which the dbus-daemon doesn't change, so
+ * together with the sender they identify a message at every hop.
+ * Names are unique names and may be NULL.
+ */
+
+#ifdef DBUS_ENABLE_USDT
+
+#include <sys/sdt.h>
+
+#define _DBUS_TRACE2(name, a, b) \
+  DTRACE_PROBE2 (dbus, name, a, b)
+#define _DBUS_TRACE3(name, a, b, c) \
+  DTRACE_PROBE3 (dbus, name, a, b, c)
+#define _DBUS_TRACE4(name, a, b, c, d) \
+  DTRACE_PROBE4 (dbus, name, a, b, c, d)
+
+#else /* !DBUS_ENABLE_USDT */
+
+#define _DBUS_TRACE2(name, a, b) do { } while (0)
+#define _DBUS_TRACE3(name, a, b, c) do { } while (0)
+#define _DBUS_TRACE4(name, a, b, c, d) do { } while (0)
+
+#endif /* !DBUS_ENABLE_USDT */
+
+#endif /* DBUS_TRACE_H */
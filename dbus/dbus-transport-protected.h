@@ -66,9 +66,18 @@ struct DBusTransportVTable
   void        (* live_messages_changed) (DBusTransport *transport);
   /**< Outstanding messages counter changed */
 
+  void        (* messages_queued)       (DBusTransport *transport);
+  /**< Outgoing messages were queued for the main loop to write */
+
   dbus_bool_t (* get_socket_fd) (DBusTransport *transport,
                                  DBusSocket    *fd_p);
   /**< Get socket file descriptor */
+
+  void        (* trim_buffers)          (DBusTransport *transport);
+  /**< Give back memory the transport's own buffers hold beyond their data */
+
+  int         (* get_buffer_bytes)      (DBusTransport *transport);
+  /**< Memory held by the transport's own buffers */
 };
 
 /**
@@ -95,6 +104,18 @@ struct DBusTransport
   long max_live_messages_unix_fds;            /**< Max total unix fds of received messages. */
 
   DBusCounter *live_messages;                 /**< Counter for size/unix fds of all live messages. */
+  dbus_bool_t live_messages_throttled;        /**< Stopped reading at a max_live_messages_* limit, until below both resume values */
+
+  int busy_poll_usec;                         /**< How long a blocking iteration spins before sleeping in poll() */
+  int max_send_buffer_size;                   /**< Largest the socket's send buffer is grown to when writes block, or 0 to leave it */
+  int max_receive_buffer_size;                /**< Largest the socket's receive buffer is grown to when reads fill it, or 0 to leave it */
+
+#ifdef DBUS_ENABLE_STATS
+  dbus_uint64_t bytes_read;                   /**< Total bytes read from the socket */
+  dbus_uint64_t bytes_written;                /**< Total bytes written to the socket */
+  dbus_uint32_t n_throttled;                  /**< Times reading stopped because live_messages hit a limit */
+  dbus_uint32_t n_write_blocks;               /**< Writes the socket took only part of, or none */
+#endif
 
   char *address;                              /**< Address of the server we are connecting to (#NULL for the server side of a transport) */
 
@@ -117,6 +138,7 @@ struct DBusTransport
   unsigned int is_server : 1;                 /**< #TRUE if on the server side */
   unsigned int unused_bytes_recovered : 1;    /**< #TRUE if we've recovered unused bytes from auth */
   unsigned int allow_anonymous : 1;           /**< #TRUE if an anonymous client can connect */
+  unsigned int reads_paused : 1;              /**< #TRUE if the owner has asked us to stop reading for now */
 };
 
 dbus_bool_t _dbus_transport_init_base     (DBusTransport             *transport,
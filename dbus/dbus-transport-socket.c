@@ -29,6 +29,11 @@
 #include "dbus-transport-protected.h"
 #include "dbus-watch.h"
 #include "dbus-credentials.h"
+#include "dbus-trace.h"
+#ifdef DBUS_UNIX
+#include "dbus-shm-ring.h"
+#include "dbus-sysdeps-unix.h"
+#endif
 
 /**
  * @defgroup DBusTransportSocket DBusTransport implementations for sockets
@@ -38,6 +43,23 @@
  * @{
  */
 
+/**
+ * Maximum number of queued messages gathered into a single write;
+ * each needs up to two buffers (header and body).
+ */
+#define MAX_MESSAGES_PER_WRITE (_DBUS_MAX_SOCKET_WRITE_VECTORS / 2)
+
+#ifdef DBUS_HAVE_SHM_RING
+/**
+ * Length of the record a server sends right after authentication when
+ * a shared memory ring was negotiated: 'S', three zero bytes and the
+ * size of each data area, with the ring's fds; or 'N' and seven zero
+ * bytes if it could not set one up after all, and the connection
+ * carries on over the socket alone.
+ */
+#define SHM_SETUP_LEN 8
+#endif
+
 /**
  * Opaque object representing a socket file descriptor transport.
  */
@@ -66,8 +88,104 @@ struct DBusTransportSocket
   DBusString encoded_incoming;          /**< Encoded version of current
                                          *   incoming data.
                                          */
+  int send_buffer_size;                 /**< SO_SNDBUF as last reported,
+                                         *   0 if not asked yet, or -1
+                                         *   once it stops growing.
+                                         */
+  int receive_buffer_size;              /**< The same for SO_RCVBUF. */
+#ifdef DBUS_HAVE_SHM_RING
+  DBusShmRing *shm_ring;                /**< Rings the messages go through
+                                         *   once set up, or #NULL.
+                                         */
+  DBusWatch *data_watch;                /**< Watch for data in the ring. */
+  DBusWatch *space_watch;               /**< Watch for room in the ring. */
+  unsigned char shm_setup[SHM_SETUP_LEN]; /**< Record setting up the ring. */
+  int shm_setup_bytes;                  /**< How much of it was sent or
+                                         *   received so far.
+                                         */
+  int shm_setup_fds[DBUS_SHM_RING_N_SETUP_FDS]; /**< Fds received with it. */
+  int n_shm_setup_fds;                  /**< Number of those. */
+  dbus_uint32_t shm_socket_bytes_read;  /**< Bytes read from the socket
+                                         *   since the ring was set up.
+                                         */
+  unsigned int shm_setup_done : 1;      /**< Both sides know whether the
+                                         *   ring is used.
+                                         */
+  unsigned int shm_write_blocked : 1;   /**< Waiting for room in the ring
+                                         *   or for the peer to empty it.
+                                         */
+#endif
 };
 
+#ifdef DBUS_HAVE_SHM_RING
+/* The ring, if messages go through it by now */
+static DBusShmRing *
+active_shm_ring (DBusTransportSocket *socket_transport)
+{
+  return socket_transport->shm_setup_done ? socket_transport->shm_ring : NULL;
+}
+
+/* Whether we still have to send or receive the record that sets up the
+ * ring; only meaningful once authenticated */
+static dbus_bool_t
+shm_setup_pending (DBusTransport *transport)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+
+  return !socket_transport->shm_setup_done &&
+    _dbus_auth_get_shared_memory_negotiated (transport->auth);
+}
+
+static void
+remove_watch (DBusTransport  *transport,
+              DBusWatch     **watch_p)
+{
+  if (*watch_p == NULL)
+    return;
+
+  if (transport->connection)
+    _dbus_connection_remove_watch_unlocked (transport->connection, *watch_p);
+  _dbus_watch_invalidate (*watch_p);
+  _dbus_watch_unref (*watch_p);
+  *watch_p = NULL;
+}
+
+static void
+free_shm_ring (DBusTransportSocket *socket_transport)
+{
+  int i;
+
+  if (socket_transport->shm_ring != NULL)
+    {
+      _dbus_shm_ring_free (socket_transport->shm_ring);
+      socket_transport->shm_ring = NULL;
+    }
+
+  for (i = 0; i < socket_transport->n_shm_setup_fds; i++)
+    _dbus_close (socket_transport->shm_setup_fds[i], NULL);
+
+  socket_transport->n_shm_setup_fds = 0;
+}
+
+/* The data doorbell is watched whenever the socket is watched for
+ * reading, the space doorbell only while a write is waiting for it */
+static void
+check_doorbell_watches (DBusTransport *transport)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+
+  if (active_shm_ring (socket_transport) == NULL || transport->disconnected)
+    return;
+
+  _dbus_connection_toggle_watch_unlocked (transport->connection,
+                                          socket_transport->data_watch,
+                                          _dbus_watch_get_enabled (socket_transport->read_watch));
+  _dbus_connection_toggle_watch_unlocked (transport->connection,
+                                          socket_transport->space_watch,
+                                          socket_transport->shm_write_blocked);
+}
+#endif
+
 static void
 free_watches (DBusTransport *transport)
 {
@@ -95,6 +213,11 @@ free_watches (DBusTransport *transport)
       socket_transport->write_watch = NULL;
     }
 
+#ifdef DBUS_HAVE_SHM_RING
+  remove_watch (transport, &socket_transport->data_watch);
+  remove_watch (transport, &socket_transport->space_watch);
+#endif
+
   _dbus_verbose ("end\n");
 }
 
@@ -107,6 +230,10 @@ socket_finalize (DBusTransport *transport)
   
   free_watches (transport);
 
+#ifdef DBUS_HAVE_SHM_RING
+  free_shm_ring (socket_transport);
+#endif
+
   _dbus_string_free (&socket_transport->encoded_outgoing);
   _dbus_string_free (&socket_transport->encoded_incoming);
   
@@ -135,6 +262,15 @@ check_write_watch (DBusTransport *transport)
   
   _dbus_transport_ref (transport);
 
+#ifdef DBUS_HAVE_SHM_RING
+  /* The server sends the ring's setup first, and the client waits for it */
+  if (_dbus_transport_try_to_authenticate (transport) &&
+      shm_setup_pending (transport))
+    needed = transport->is_server;
+  else if (socket_transport->shm_write_blocked)
+    needed = FALSE;
+  else
+#endif
   if (_dbus_transport_try_to_authenticate (transport))
     needed = _dbus_connection_has_messages_to_send_unlocked (transport->connection);
   else
@@ -154,6 +290,8 @@ check_write_watch (DBusTransport *transport)
           if (auth_state == DBUS_AUTH_STATE_HAVE_BYTES_TO_SEND ||
               auth_state == DBUS_AUTH_STATE_WAITING_FOR_MEMORY)
             needed = TRUE;
+          else if (_dbus_auth_get_pipelined_begin_sent (transport->auth))
+            needed = _dbus_connection_has_messages_to_send_unlocked (transport->connection);
           else
             needed = FALSE;
         }
@@ -168,6 +306,10 @@ check_write_watch (DBusTransport *transport)
                                           socket_transport->write_watch,
                                           needed);
 
+#ifdef DBUS_HAVE_SHM_RING
+  check_doorbell_watches (transport);
+#endif
+
   _dbus_transport_unref (transport);
 }
 
@@ -191,10 +333,15 @@ check_read_watch (DBusTransport *transport)
   
   _dbus_transport_ref (transport);
 
+#ifdef DBUS_HAVE_SHM_RING
+  if (_dbus_transport_try_to_authenticate (transport) &&
+      shm_setup_pending (transport))
+    need_read_watch = TRUE;
+  else
+#endif
   if (_dbus_transport_try_to_authenticate (transport))
-    need_read_watch =
-      (_dbus_counter_get_size_value (transport->live_messages) < transport->max_live_messages_size) &&
-      (_dbus_counter_get_unix_fd_value (transport->live_messages) < transport->max_live_messages_unix_fds);
+    need_read_watch = !transport->reads_paused &&
+      !_dbus_transport_get_is_throttled (transport);
   else
     {
       if (transport->receive_credentials_pending)
@@ -229,6 +376,10 @@ check_read_watch (DBusTransport *transport)
                                           socket_transport->read_watch,
                                           need_read_watch);
 
+#ifdef DBUS_HAVE_SHM_RING
+  check_doorbell_watches (transport);
+#endif
+
   _dbus_transport_unref (transport);
 }
 
@@ -493,16 +644,414 @@ do_authentication (DBusTransport *transport,
     return TRUE;
 }
 
+/* Appends a slice of @str to the vectors for _dbus_write_socket_many(),
+ * unless it is empty */
+static void
+add_write_buffer (const DBusString **buffers,
+                  int               *starts,
+                  int               *lens,
+                  int               *n_buffers,
+                  const DBusString  *str,
+                  int                start,
+                  int                len)
+{
+  if (len == 0)
+    return;
+
+  _dbus_assert (*n_buffers < _DBUS_MAX_SOCKET_WRITE_VECTORS);
+
+  buffers[*n_buffers] = str;
+  starts[*n_buffers] = start;
+  lens[*n_buffers] = len;
+  *n_buffers += 1;
+}
+
+/* Most vectors add_message_buffers() can use for one message */
+#define MAX_VECTORS_PER_MESSAGE 3
+
+/* Appends what is left of @message after its first @written bytes to the
+ * vectors for _dbus_write_socket_many(): its header, its body and any
+ * array it borrowed from the application */
+static void
+add_message_buffers (const DBusString **buffers,
+                     int               *starts,
+                     int               *lens,
+                     int               *n_buffers,
+                     DBusMessage       *message,
+                     int                written)
+{
+  const DBusString *segments[MAX_VECTORS_PER_MESSAGE];
+  int n_segments;
+  int i;
+
+  _dbus_message_get_network_data (message, &segments[0], &segments[1]);
+  segments[2] = _dbus_message_get_network_tail (message);
+  n_segments = segments[2] != NULL ? 3 : 2;
+
+  for (i = 0; i < n_segments; i++)
+    {
+      int len;
+
+      len = _dbus_string_get_length (segments[i]);
+
+      if (written >= len)
+        {
+          written -= len;
+          continue;
+        }
+
+      add_write_buffer (buffers, starts, lens, n_buffers, segments[i],
+                        written, len - written);
+      written = 0;
+    }
+}
+
+#ifdef DBUS_HAVE_SHM_RING
 /* returns false on oom */
 static dbus_bool_t
-do_writing (DBusTransport *transport)
+add_doorbell_watches (DBusTransport *transport)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  DBusShmRing *ring = socket_transport->shm_ring;
+
+  _dbus_assert (ring != NULL);
+  _dbus_assert (socket_transport->data_watch == NULL);
+
+  socket_transport->data_watch =
+    _dbus_watch_new (_dbus_shm_ring_get_doorbell (ring, DBUS_SHM_RING_DATA),
+                     DBUS_WATCH_READABLE, FALSE, NULL, NULL, NULL);
+  socket_transport->space_watch =
+    _dbus_watch_new (_dbus_shm_ring_get_doorbell (ring, DBUS_SHM_RING_SPACE),
+                     DBUS_WATCH_READABLE, FALSE, NULL, NULL, NULL);
+
+  if (socket_transport->data_watch == NULL ||
+      socket_transport->space_watch == NULL)
+    goto failed;
+
+  _dbus_watch_set_handler (socket_transport->data_watch,
+                           _dbus_connection_handle_watch,
+                           transport->connection, NULL);
+  _dbus_watch_set_handler (socket_transport->space_watch,
+                           _dbus_connection_handle_watch,
+                           transport->connection, NULL);
+
+  if (!_dbus_connection_add_watch_unlocked (transport->connection,
+                                            socket_transport->data_watch))
+    goto failed;
+
+  if (!_dbus_connection_add_watch_unlocked (transport->connection,
+                                            socket_transport->space_watch))
+    {
+      _dbus_connection_remove_watch_unlocked (transport->connection,
+                                              socket_transport->data_watch);
+      goto failed;
+    }
+
+  return TRUE;
+
+ failed:
+  if (socket_transport->data_watch != NULL)
+    {
+      _dbus_watch_invalidate (socket_transport->data_watch);
+      _dbus_watch_unref (socket_transport->data_watch);
+      socket_transport->data_watch = NULL;
+    }
+
+  if (socket_transport->space_watch != NULL)
+    {
+      _dbus_watch_invalidate (socket_transport->space_watch);
+      _dbus_watch_unref (socket_transport->space_watch);
+      socket_transport->space_watch = NULL;
+    }
+
+  return FALSE;
+}
+
+/* The server sets up the ring and sends it over as soon as the client
+ * is authenticated, before any message. If it can't, it tells the
+ * client so and the connection stays on the socket alone. */
+static void
+send_shm_setup (DBusTransport *transport)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  DBusString setup;
+  int fds[DBUS_SHM_RING_N_SETUP_FDS];
+  dbus_uint32_t size;
+  int bytes_written;
+  int saved_errno;
+
+  if (socket_transport->shm_setup[0] == '\0')
+    {
+      DBusError error = DBUS_ERROR_INIT;
+
+      socket_transport->shm_ring = _dbus_shm_ring_new_server (&error);
+
+      if (socket_transport->shm_ring == NULL)
+        {
+          _dbus_verbose ("Not using a shared memory ring after all: %s\n",
+                         error.message);
+          dbus_error_free (&error);
+        }
+      else if (!add_doorbell_watches (transport))
+        {
+          _dbus_verbose ("Not using a shared memory ring after all: no memory for its watches\n");
+          free_shm_ring (socket_transport);
+        }
+
+      if (socket_transport->shm_ring != NULL)
+        {
+          _dbus_shm_ring_get_setup (socket_transport->shm_ring, fds, &size);
+          socket_transport->shm_setup[0] = 'S';
+          memcpy (socket_transport->shm_setup + 4, &size, sizeof (size));
+        }
+      else
+        socket_transport->shm_setup[0] = 'N';
+    }
+
+  _dbus_string_init_const_len (&setup,
+                               (const char *) socket_transport->shm_setup,
+                               SHM_SETUP_LEN);
+
+  if (socket_transport->shm_setup_bytes == 0 &&
+      socket_transport->shm_ring != NULL)
+    {
+      _dbus_shm_ring_get_setup (socket_transport->shm_ring, fds, &size);
+      bytes_written =
+        _dbus_write_socket_with_unix_fds (socket_transport->fd, &setup,
+                                          0, SHM_SETUP_LEN,
+                                          fds, DBUS_SHM_RING_N_SETUP_FDS);
+    }
+  else
+    {
+      bytes_written =
+        _dbus_write_socket (socket_transport->fd, &setup,
+                            socket_transport->shm_setup_bytes,
+                            SHM_SETUP_LEN - socket_transport->shm_setup_bytes);
+    }
+  saved_errno = _dbus_save_socket_errno ();
+
+  if (bytes_written < 0)
+    {
+      if (_dbus_get_is_errno_eagain_or_ewouldblock (saved_errno) ||
+          _dbus_get_is_errno_epipe (saved_errno))
+        return;
+
+      _dbus_verbose ("Error writing shared memory setup: %s\n",
+                     _dbus_strerror (saved_errno));
+      do_io_error (transport);
+      return;
+    }
+
+  socket_transport->shm_setup_bytes += bytes_written;
+
+  if (socket_transport->shm_setup_bytes == SHM_SETUP_LEN)
+    {
+      _dbus_verbose ("Sent shared memory setup, ring %s\n",
+                     socket_transport->shm_ring != NULL ? "in use" : "not in use");
+
+      if (socket_transport->shm_ring != NULL)
+        _dbus_shm_ring_setup_sent (socket_transport->shm_ring);
+
+      socket_transport->shm_setup_done = TRUE;
+    }
+}
+
+/* The client waits for the server's setup before it writes anything.
+ * returns false on oom */
+static dbus_bool_t
+receive_shm_setup (DBusTransport *transport)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+
+  if (socket_transport->shm_setup_bytes < SHM_SETUP_LEN)
+    {
+      unsigned char storage[SHM_SETUP_LEN * 4];
+      DBusString buffer;
+      int fds[DBUS_SHM_RING_N_SETUP_FDS];
+      int n_fds;
+      int expected_fds;
+      int bytes_read;
+      int saved_errno;
+
+      _dbus_string_init_borrowed (&buffer, storage, sizeof (storage));
+
+      /* The fds come with the first byte, and nothing comes after */
+      n_fds = socket_transport->shm_setup_bytes == 0 ?
+        DBUS_SHM_RING_N_SETUP_FDS : 0;
+
+      bytes_read =
+        _dbus_read_socket_with_unix_fds (socket_transport->fd, &buffer,
+                                         SHM_SETUP_LEN - socket_transport->shm_setup_bytes,
+                                         fds, &n_fds);
+      saved_errno = _dbus_save_socket_errno ();
+
+      if (bytes_read > 0)
+        memcpy (socket_transport->shm_setup + socket_transport->shm_setup_bytes,
+                _dbus_string_get_const_data (&buffer), bytes_read);
+
+      _dbus_string_free (&buffer);
+
+      if (bytes_read < 0)
+        {
+          if (_dbus_get_is_errno_enomem (saved_errno))
+            return FALSE;
+
+          if (!_dbus_get_is_errno_eagain_or_ewouldblock (saved_errno))
+            {
+              _dbus_verbose ("Error reading shared memory setup: %s\n",
+                             _dbus_strerror (saved_errno));
+              do_io_error (transport);
+            }
+
+          return TRUE;
+        }
+
+      if (bytes_read == 0)
+        {
+          _dbus_verbose ("Disconnected while waiting for shared memory setup\n");
+          do_io_error (transport);
+          return TRUE;
+        }
+
+      if (socket_transport->shm_setup_bytes == 0)
+        {
+          memcpy (socket_transport->shm_setup_fds, fds, n_fds * sizeof (int));
+          socket_transport->n_shm_setup_fds = n_fds;
+        }
+
+      socket_transport->shm_setup_bytes += bytes_read;
+
+      if (socket_transport->shm_setup_bytes < SHM_SETUP_LEN)
+        return TRUE;
+
+      expected_fds = socket_transport->shm_setup[0] == 'S' ?
+        DBUS_SHM_RING_N_SETUP_FDS : 0;
+
+      if ((socket_transport->shm_setup[0] != 'S' &&
+           socket_transport->shm_setup[0] != 'N') ||
+          socket_transport->n_shm_setup_fds != expected_fds)
+        {
+          _dbus_verbose ("Invalid shared memory setup from server\n");
+          do_io_error (transport);
+          return TRUE;
+        }
+
+      if (socket_transport->shm_setup[0] == 'S')
+        {
+          DBusError error = DBUS_ERROR_INIT;
+          dbus_uint32_t size;
+
+          memcpy (&size, socket_transport->shm_setup + 4, sizeof (size));
+
+          /* The ring owns the fds now, whether it worked or not */
+          socket_transport->n_shm_setup_fds = 0;
+          socket_transport->shm_ring =
+            _dbus_shm_ring_new_client (socket_transport->shm_setup_fds,
+                                       size, &error);
+
+          if (socket_transport->shm_ring == NULL)
+            {
+              _dbus_verbose ("Failed to use shared memory ring: %s\n",
+                             error.message);
+              dbus_error_free (&error);
+              do_io_error (transport);
+              return TRUE;
+            }
+        }
+    }
+
+  if (socket_transport->shm_ring != NULL &&
+      !add_doorbell_watches (transport))
+    return FALSE;
+
+  _dbus_verbose ("Received shared memory setup, ring %s\n",
+                 socket_transport->shm_ring != NULL ? "in use" : "not in use");
+
+  socket_transport->shm_setup_done = TRUE;
+
+  /* Messages may have been queued while we waited */
+  check_read_watch (transport);
+  check_write_watch (transport);
+
+  return TRUE;
+}
+#endif
+
+/* Grows the kernel's send or receive buffer for the socket towards
+ * @wanted bytes, or at least doubles it, up to the transport's limit.
+ * Once the kernel stops giving us more (without privileges, Linux
+ * caps both at net.core.wmem_max and rmem_max), it is left alone. */
+static void
+grow_socket_buffer (DBusTransportSocket *socket_transport,
+                    dbus_bool_t          send,
+                    int                  wanted)
+{
+  int *size_p;
+  int max_size, target, size;
+
+  if (send)
+    {
+      size_p = &socket_transport->send_buffer_size;
+      max_size = socket_transport->base.max_send_buffer_size;
+    }
+  else
+    {
+      size_p = &socket_transport->receive_buffer_size;
+      max_size = socket_transport->base.max_receive_buffer_size;
+    }
+
+  if (max_size <= 0 || *size_p < 0)
+    return;
+
+  if (*size_p == 0)
+    *size_p = _dbus_get_socket_buffer_size (socket_transport->fd, send);
+
+  if (*size_p <= 0)
+    {
+      *size_p = -1;
+      return;
+    }
+
+  target = MIN (MAX (wanted, *size_p * 2), max_size);
+
+  if (target <= *size_p)
+    return;
+
+  size = _dbus_set_socket_buffer_size (socket_transport->fd, send, target);
+
+  _dbus_verbose ("%s buffer of fd %" DBUS_SOCKET_FORMAT " grown from %d to %d "
+                 "(asked for %d)\n", send ? "send" : "receive",
+                 _dbus_socket_printable (socket_transport->fd),
+                 *size_p, size, target);
+
+  *size_p = size > *size_p ? size : -1;
+}
+
+/* The socket took only part of a write of @len bytes, or none */
+static void
+socket_write_blocked (DBusTransportSocket *socket_transport,
+                      int                  len)
+{
+#ifdef DBUS_ENABLE_STATS
+  socket_transport->base.n_write_blocks += 1;
+#endif
+
+  grow_socket_buffer (socket_transport, TRUE, len);
+}
+
+/* returns false on oom */
+static dbus_bool_t
+do_writing_untimed (DBusTransport *transport)
 {
   int total;
   DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
   dbus_bool_t oom;
   
-  /* No messages without authentication! */
-  if (!_dbus_transport_try_to_authenticate (transport))
+  /* No messages without authentication! Except that a client which
+   * pipelined its authentication can send them right behind BEGIN.
+   */
+  if (!_dbus_transport_try_to_authenticate (transport) &&
+      !_dbus_auth_get_pipelined_begin_sent (transport->auth))
     {
       _dbus_verbose ("Not authenticated, not writing anything\n");
       return TRUE;
@@ -514,6 +1063,24 @@ do_writing (DBusTransport *transport)
       return TRUE;
     }
 
+#ifdef DBUS_HAVE_SHM_RING
+  if (_dbus_transport_try_to_authenticate (transport) &&
+      shm_setup_pending (transport))
+    {
+      if (transport->is_server)
+        send_shm_setup (transport);
+
+      if (shm_setup_pending (transport))
+        {
+          _dbus_verbose ("Shared memory ring not set up yet, not writing anything\n");
+          return TRUE;
+        }
+    }
+
+  /* Set again below if the ring is still in the way */
+  socket_transport->shm_write_blocked = FALSE;
+#endif
+
 #if 1
   _dbus_verbose ("do_writing(), have_messages = %d, fd = %" DBUS_SOCKET_FORMAT "\n",
                  _dbus_connection_has_messages_to_send_unlocked (transport->connection),
@@ -530,9 +1097,18 @@ do_writing (DBusTransport *transport)
       DBusMessage *message;
       const DBusString *header;
       const DBusString *body;
-      int header_len, body_len;
+      const DBusString *tail;
+      int header_len, body_len, tail_len;
       int total_bytes_to_write;
       int saved_errno;
+      DBusMessage *batch[MAX_MESSAGES_PER_WRITE];
+      int batch_lens[MAX_MESSAGES_PER_WRITE];
+      int n_batch;
+      int i;
+#ifdef DBUS_HAVE_SHM_RING
+      DBusShmRing *ring = active_shm_ring (socket_transport);
+      dbus_bool_t use_ring = FALSE;
+#endif
       
       if (total > socket_transport->max_bytes_written_per_iteration)
         {
@@ -551,9 +1127,15 @@ do_writing (DBusTransport *transport)
       
       _dbus_message_get_network_data (message,
                                       &header, &body);
+      tail = _dbus_message_get_network_tail (message);
 
       header_len = _dbus_string_get_length (header);
       body_len = _dbus_string_get_length (body);
+      tail_len = tail != NULL ? _dbus_string_get_length (tail) : 0;
+
+      /* Usually just this message, but see below */
+      batch[0] = message;
+      n_batch = 1;
 
       if (_dbus_auth_needs_encoding (transport->auth))
         {
@@ -570,7 +1152,10 @@ do_writing (DBusTransport *transport)
                 }
               
               if (!_dbus_auth_encode_data (transport->auth,
-                                           body, &socket_transport->encoded_outgoing))
+                                           body, &socket_transport->encoded_outgoing) ||
+                  (tail != NULL &&
+                   !_dbus_auth_encode_data (transport->auth,
+                                            tail, &socket_transport->encoded_outgoing)))
                 {
                   _dbus_string_set_length (&socket_transport->encoded_outgoing, 0);
                   oom = TRUE;
@@ -579,6 +1164,7 @@ do_writing (DBusTransport *transport)
             }
           
           total_bytes_to_write = _dbus_string_get_length (&socket_transport->encoded_outgoing);
+          batch_lens[0] = total_bytes_to_write;
 
 #if 0
           _dbus_verbose ("encoded message is %d bytes\n",
@@ -594,61 +1180,145 @@ do_writing (DBusTransport *transport)
         }
       else
         {
-          total_bytes_to_write = header_len + body_len;
+          const DBusString *buffers[_DBUS_MAX_SOCKET_WRITE_VECTORS];
+          int starts[_DBUS_MAX_SOCKET_WRITE_VECTORS];
+          int lens[_DBUS_MAX_SOCKET_WRITE_VECTORS];
+          const int *unix_fds;
+          unsigned n_unix_fds;
+          dbus_bool_t send_fds;
+          int n_buffers;
+          int n_queued;
+          int budget;
+
+          total_bytes_to_write = header_len + body_len + tail_len;
+          batch_lens[0] = total_bytes_to_write;
 
 #if 0
           _dbus_verbose ("message is %d bytes\n",
                          total_bytes_to_write);
 #endif
 
-#ifdef HAVE_UNIX_FD_PASSING
-          if (socket_transport->message_bytes_written <= 0 && DBUS_TRANSPORT_CAN_SEND_UNIX_FD(transport))
+          n_buffers = 0;
+          send_fds = FALSE;
+
+          add_message_buffers (buffers, starts, lens, &n_buffers, message,
+                               socket_transport->message_bytes_written);
+
+          /* A message whose fds have not been sent yet has not had any
+           * of its bytes written either, so they go with its first byte */
+          _dbus_message_get_unix_fds (message, &unix_fds, &n_unix_fds);
+
+#ifdef DBUS_HAVE_SHM_RING
+          /* With a ring, only messages carrying fds still go over the
+           * socket, and only once the peer has read everything queued
+           * in the ring before them */
+          if (ring != NULL)
+            {
+              use_ring = n_unix_fds == 0;
+
+              if (!use_ring && !_dbus_shm_ring_outgoing_drained (ring))
+                {
+                  _dbus_verbose ("Waiting for the ring to drain before a message with fds\n");
+                  socket_transport->shm_write_blocked = TRUE;
+                  goto out;
+                }
+            }
+#endif
+
+          /* Send the fds along with the first byte of the message */
+          if (socket_transport->message_bytes_written <= 0 &&
+              n_unix_fds > 0 &&
+              DBUS_TRANSPORT_CAN_SEND_UNIX_FD (transport))
+            send_fds = TRUE;
+
+          /* If more messages are queued behind this one, write as many
+           * of them as fit in the per-iteration budget with the same
+           * system call. The spec does not let fds arrive before the
+           * first byte of their own message, so a message carrying fds
+           * has to start a write of its own: the batch stops there, and
+           * a message sending its fds goes out alone.
+           */
+          budget = socket_transport->max_bytes_written_per_iteration - total -
+            (total_bytes_to_write - socket_transport->message_bytes_written);
+
+          n_queued = _dbus_connection_get_messages_to_send (transport->connection,
+                                                            batch,
+                                                            MAX_MESSAGES_PER_WRITE);
+          _dbus_assert (n_queued >= 1);
+          _dbus_assert (batch[0] == message);
+
+          while (!send_fds && n_batch < n_queued && budget > 0)
+            {
+              DBusMessage *next = batch[n_batch];
+
+              if (n_buffers + MAX_VECTORS_PER_MESSAGE > _DBUS_MAX_SOCKET_WRITE_VECTORS)
+                break;
+
+              dbus_message_lock (next);
+
+              _dbus_message_get_unix_fds (next, &unix_fds, &n_unix_fds);
+
+#ifdef DBUS_HAVE_SHM_RING
+              /* The ring takes messages up to the next one with fds,
+               * the socket one at a time */
+              if (ring != NULL && (!use_ring || n_unix_fds > 0))
+                break;
+#endif
+
+              if (n_unix_fds > 0)
+                break;
+
+              add_message_buffers (buffers, starts, lens, &n_buffers, next, 0);
+
+              batch_lens[n_batch] = _dbus_message_get_size (next);
+              budget -= batch_lens[n_batch];
+              n_batch++;
+            }
+
+#ifdef DBUS_HAVE_SHM_RING
+          if (use_ring)
             {
-              /* Send the fds along with the first byte of the message */
-              const int *unix_fds;
-              unsigned n;
+              bytes_written = _dbus_shm_ring_write (ring, buffers, starts,
+                                                    lens, n_buffers);
+              saved_errno = 0;
 
-              _dbus_message_get_unix_fds(message, &unix_fds, &n);
+              if (bytes_written < 0)
+                {
+                  _dbus_verbose ("Shared memory ring corrupted by the peer\n");
+                  do_io_error (transport);
+                  goto out;
+                }
+            }
+          else
+#endif
+#ifdef HAVE_UNIX_FD_PASSING
+          if (send_fds)
+            {
+              _dbus_assert (n_batch == 1);
 
               bytes_written =
-                _dbus_write_socket_with_unix_fds_two (socket_transport->fd,
-                                                      header,
-                                                      socket_transport->message_bytes_written,
-                                                      header_len - socket_transport->message_bytes_written,
-                                                      body,
-                                                      0, body_len,
-                                                      unix_fds,
-                                                      n);
+                _dbus_write_socket_many_with_unix_fds (socket_transport->fd,
+                                                       buffers, starts, lens,
+                                                       n_buffers,
+                                                       unix_fds,
+                                                       n_unix_fds);
               saved_errno = _dbus_save_socket_errno ();
 
-              if (bytes_written > 0 && n > 0)
-                _dbus_verbose("Wrote %i unix fds\n", n);
+              if (bytes_written > 0)
+                _dbus_verbose ("Wrote %i unix fds\n", n_unix_fds);
             }
           else
 #endif
             {
-              if (socket_transport->message_bytes_written < header_len)
-                {
-                  bytes_written =
-                    _dbus_write_socket_two (socket_transport->fd,
-                                            header,
-                                            socket_transport->message_bytes_written,
-                                            header_len - socket_transport->message_bytes_written,
-                                            body,
-                                            0, body_len);
-                }
-              else
-                {
-                  bytes_written =
-                    _dbus_write_socket (socket_transport->fd,
-                                        body,
-                                        (socket_transport->message_bytes_written - header_len),
-                                        body_len -
-                                        (socket_transport->message_bytes_written - header_len));
-                }
-
+              bytes_written =
+                _dbus_write_socket_many (socket_transport->fd,
+                                         buffers, starts, lens, n_buffers);
               saved_errno = _dbus_save_socket_errno ();
             }
+
+          total_bytes_to_write = 0;
+          for (i = 0; i < n_batch; i++)
+            total_bytes_to_write += batch_lens[i];
         }
 
       if (bytes_written < 0)
@@ -661,7 +1331,12 @@ do_writing (DBusTransport *transport)
            * http://lists.freedesktop.org/archives/dbus/2008-March/009526.html
            */
           
-          if (_dbus_get_is_errno_eagain_or_ewouldblock (saved_errno) || _dbus_get_is_errno_epipe (saved_errno))
+          if (_dbus_get_is_errno_eagain_or_ewouldblock (saved_errno))
+            {
+              socket_write_blocked (socket_transport, total_bytes_to_write);
+              goto out;
+            }
+          else if (_dbus_get_is_errno_epipe (saved_errno))
             goto out;
 
           /* Since Linux commit 25888e (from 2.6.37-rc4, Nov 2010), sendmsg()
@@ -703,23 +1378,64 @@ do_writing (DBusTransport *transport)
         }
       else
         {
-          _dbus_verbose (" wrote %d bytes of %d\n", bytes_written,
-                         total_bytes_to_write);
+          _dbus_verbose (" wrote %d bytes of %d in %d message(s)\n",
+                         bytes_written, total_bytes_to_write, n_batch);
           
           total += bytes_written;
-          socket_transport->message_bytes_written += bytes_written;
+#ifdef DBUS_HAVE_SHM_RING
+          /* The peer reads this much from the socket before it looks at
+           * anything written to the ring after it */
+          if (ring != NULL && !use_ring)
+            _dbus_shm_ring_add_socket_bytes (ring, bytes_written);
+#endif
+#ifdef DBUS_ENABLE_STATS
+          transport->bytes_written += bytes_written;
+#endif
+          _DBUS_TRACE2 (socket__written, bytes_written, n_batch);
 
-          _dbus_assert (socket_transport->message_bytes_written <=
-                        total_bytes_to_write);
-          
-          if (socket_transport->message_bytes_written == total_bytes_to_write)
+          /* Account for every message the write completed, and record
+           * how far it got into the first one it didn't */
+          for (i = 0; i < n_batch; i++)
             {
+              int remaining;
+
+              remaining = batch_lens[i] - socket_transport->message_bytes_written;
+
+              if (bytes_written < remaining)
+                {
+                  socket_transport->message_bytes_written += bytes_written;
+                  break;
+                }
+
+              bytes_written -= remaining;
+
+              _DBUS_TRACE3 (message__sent,
+                            dbus_message_get_serial (batch[i]),
+                            dbus_message_get_type (batch[i]),
+                            batch_lens[i]);
+
               socket_transport->message_bytes_written = 0;
               _dbus_string_set_length (&socket_transport->encoded_outgoing, 0);
               _dbus_string_compact (&socket_transport->encoded_outgoing, 2048);
 
               _dbus_connection_message_sent_unlocked (transport->connection,
-                                                      message);
+                                                      batch[i]);
+            }
+
+          _dbus_assert (bytes_written == 0 || i < n_batch);
+
+          /* A short write means the socket's buffer is full, so writing
+           * again would just get EAGAIN; wait for the write watch, or
+           * for the peer to make room in the ring */
+          if (i < n_batch)
+            {
+#ifdef DBUS_HAVE_SHM_RING
+              if (use_ring)
+                socket_transport->shm_write_blocked = TRUE;
+              else
+#endif
+                socket_write_blocked (socket_transport, total_bytes_to_write);
+              goto out;
             }
         }
     }
@@ -731,16 +1447,35 @@ do_writing (DBusTransport *transport)
     return TRUE;
 }
 
+static dbus_bool_t
+do_writing (DBusTransport *transport)
+{
+  dbus_bool_t retval;
+  DBusPhase old_phase;
+
+  old_phase = _dbus_phase_enter (DBUS_PHASE_SOCKET_WRITE);
+  retval = do_writing_untimed (transport);
+  _dbus_phase_leave (old_phase);
+
+  return retval;
+}
+
 /* returns false on out-of-memory */
 static dbus_bool_t
-do_reading (DBusTransport *transport)
+do_reading_untimed (DBusTransport *transport,
+                    dbus_bool_t    socket_readable)
 {
   DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
   DBusString *buffer;
   int bytes_read;
+  int bytes_requested;
   int total;
   dbus_bool_t oom;
   int saved_errno;
+#ifdef DBUS_HAVE_SHM_RING
+  DBusShmRing *ring;
+  dbus_bool_t behind;
+#endif
 
   _dbus_verbose ("fd = %" DBUS_SOCKET_FORMAT "\n",
                  _dbus_socket_printable (socket_transport->fd));
@@ -749,6 +1484,13 @@ do_reading (DBusTransport *transport)
   if (!_dbus_transport_try_to_authenticate (transport))
     return TRUE;
 
+#ifdef DBUS_HAVE_SHM_RING
+  /* Nor before the ring is set up; the server still reads, so as to
+   * notice the client going away */
+  if (shm_setup_pending (transport) && !transport->is_server)
+    return socket_readable ? receive_shm_setup (transport) : TRUE;
+#endif
+
   oom = FALSE;
   
   total = 0;
@@ -772,7 +1514,76 @@ do_reading (DBusTransport *transport)
     goto out;
 
   if (!dbus_watch_get_enabled (socket_transport->read_watch))
-    return TRUE;
+    goto out;
+
+#ifdef DBUS_HAVE_SHM_RING
+  ring = active_shm_ring (socket_transport);
+  behind = FALSE;
+
+  if (ring != NULL)
+    {
+      dbus_uint32_t socket_bytes;
+      int readable;
+
+      readable = _dbus_shm_ring_get_readable (ring, &socket_bytes);
+
+      if (readable < 0)
+        {
+          _dbus_verbose ("Shared memory ring corrupted by the peer\n");
+          do_io_error (transport);
+          goto out;
+        }
+
+      /* What the peer wrote to the socket before it wrote what is in
+       * the ring now has to be read first. We can also be ahead, having
+       * read bytes the peer has not counted yet; it writes nothing to
+       * the ring until it has, so that is the same as caught up. */
+      behind = (dbus_int32_t) (socket_bytes - socket_transport->shm_socket_bytes_read) > 0;
+
+      if (!behind && readable > 0)
+        {
+          int max_to_read;
+
+          _dbus_message_loader_get_buffer (transport->loader,
+                                           &buffer);
+
+          max_to_read = _dbus_message_loader_get_max_to_read (transport->loader,
+                                                              socket_transport->max_bytes_read_per_iteration);
+          bytes_read = MIN (readable, max_to_read);
+
+          if (!_dbus_shm_ring_read (ring, buffer, bytes_read))
+            {
+              _dbus_verbose ("Out of memory reading from the shared memory ring\n");
+              _dbus_message_loader_return_buffer (transport->loader,
+                                                  buffer);
+              oom = TRUE;
+              goto out;
+            }
+
+          _dbus_message_loader_return_buffer (transport->loader,
+                                              buffer);
+
+          _dbus_verbose (" read %d bytes from the ring\n", bytes_read);
+
+          total += bytes_read;
+#ifdef DBUS_ENABLE_STATS
+          transport->bytes_read += bytes_read;
+#endif
+
+          if (!_dbus_transport_queue_messages (transport))
+            {
+              oom = TRUE;
+              _dbus_verbose (" out of memory when queueing messages we just read in the transport\n");
+              goto out;
+            }
+
+          goto again;
+        }
+
+      if (!behind && !socket_readable)
+        goto out;
+    }
+#endif
   
   if (_dbus_auth_needs_decoding (transport->auth))
     {
@@ -780,11 +1591,18 @@ do_reading (DBusTransport *transport)
       _dbus_assert(!DBUS_TRANSPORT_CAN_SEND_UNIX_FD(transport));
 
       if (_dbus_string_get_length (&socket_transport->encoded_incoming) > 0)
-        bytes_read = _dbus_string_get_length (&socket_transport->encoded_incoming);
+        {
+          bytes_read = _dbus_string_get_length (&socket_transport->encoded_incoming);
+          /* we didn't read anything from the socket */
+          bytes_requested = 0;
+        }
       else
-        bytes_read = _dbus_read_socket (socket_transport->fd,
-                                        &socket_transport->encoded_incoming,
-                                        socket_transport->max_bytes_read_per_iteration);
+        {
+          bytes_requested = socket_transport->max_bytes_read_per_iteration;
+          bytes_read = _dbus_read_socket (socket_transport->fd,
+                                          &socket_transport->encoded_incoming,
+                                          bytes_requested);
+        }
 
       saved_errno = _dbus_save_socket_errno ();
 
@@ -800,10 +1618,17 @@ do_reading (DBusTransport *transport)
                                        &socket_transport->encoded_incoming,
                                        buffer))
             {
-              _dbus_verbose ("Out of memory decoding incoming data\n");
               _dbus_message_loader_return_buffer (transport->loader,
                                               buffer);
 
+              if (_dbus_auth_get_data_corrupted (transport->auth))
+                {
+                  _dbus_verbose ("Peer sent data that can't be decoded\n");
+                  do_io_error (transport);
+                  goto out;
+                }
+
+              _dbus_verbose ("Out of memory decoding incoming data\n");
               oom = TRUE;
               goto out;
             }
@@ -817,9 +1642,15 @@ do_reading (DBusTransport *transport)
     }
   else
     {
+      int max_to_read;
+
       _dbus_message_loader_get_buffer (transport->loader,
                                        &buffer);
 
+      max_to_read = _dbus_message_loader_get_max_to_read (transport->loader,
+                                                          socket_transport->max_bytes_read_per_iteration);
+      bytes_requested = max_to_read;
+
 #ifdef HAVE_UNIX_FD_PASSING
       if (DBUS_TRANSPORT_CAN_SEND_UNIX_FD(transport))
         {
@@ -835,7 +1666,7 @@ do_reading (DBusTransport *transport)
 
           bytes_read = _dbus_read_socket_with_unix_fds(socket_transport->fd,
                                                        buffer,
-                                                       socket_transport->max_bytes_read_per_iteration,
+                                                       max_to_read,
                                                        fds, &n_fds);
           saved_errno = _dbus_save_socket_errno ();
 
@@ -848,7 +1679,7 @@ do_reading (DBusTransport *transport)
 #endif
         {
           bytes_read = _dbus_read_socket (socket_transport->fd,
-                                          buffer, socket_transport->max_bytes_read_per_iteration);
+                                          buffer, max_to_read);
           saved_errno = _dbus_save_socket_errno ();
         }
 
@@ -867,7 +1698,17 @@ do_reading (DBusTransport *transport)
           goto out;
         }
       else if (_dbus_get_is_errno_eagain_or_ewouldblock (saved_errno))
-        goto out;
+        {
+#ifdef DBUS_HAVE_SHM_RING
+          /* The peer had finished writing those bytes before it said so */
+          if (behind)
+            {
+              _dbus_verbose ("Peer claims more was written to the socket than arrived\n");
+              do_io_error (transport);
+            }
+#endif
+          goto out;
+        }
       else
         {
           _dbus_verbose ("Error reading from remote app: %s\n",
@@ -887,6 +1728,9 @@ do_reading (DBusTransport *transport)
       _dbus_verbose (" read %d bytes\n", bytes_read);
       
       total += bytes_read;      
+#ifdef DBUS_ENABLE_STATS
+      transport->bytes_read += bytes_read;
+#endif
 
       if (!_dbus_transport_queue_messages (transport))
         {
@@ -894,6 +1738,31 @@ do_reading (DBusTransport *transport)
           _dbus_verbose (" out of memory when queueing messages we just read in the transport\n");
           goto out;
         }
+
+#ifdef DBUS_HAVE_SHM_RING
+      /* Even when the socket is empty, the ring may not be */
+      if (ring != NULL)
+        {
+          socket_transport->shm_socket_bytes_read += bytes_read;
+          socket_readable = bytes_read == bytes_requested;
+          goto again;
+        }
+#endif
+
+      /* Reads only get this big for large messages; one that took
+       * about as much as the kernel reports holding (Linux reports
+       * twice the payload) suggests the peer was waiting for room */
+      if (socket_transport->base.max_receive_buffer_size > 0 &&
+          socket_transport->receive_buffer_size >= 0 &&
+          bytes_read >= socket_transport->receive_buffer_size / 2)
+        grow_socket_buffer (socket_transport, FALSE, bytes_requested);
+
+      /* A short read means we emptied the socket's buffer, so reading
+       * again would just get EAGAIN: leave it to the next poll to say
+       * whether more has arrived since. (Reading ancillary data can
+       * also cut a read short; then the next poll returns at once.) */
+      if (bytes_read < bytes_requested)
+        goto out;
       
       /* Try reading more data until we get EAGAIN and return, or
        * exceed max bytes per iteration.  If in blocking mode of
@@ -903,12 +1772,37 @@ do_reading (DBusTransport *transport)
     }
 
  out:
+#ifdef DBUS_HAVE_SHM_RING
+  /* Whatever made us stop, come back for what is left in the ring */
+  ring = active_shm_ring (socket_transport);
+
+  if (ring != NULL && !transport->disconnected &&
+      _dbus_shm_ring_get_readable (ring, NULL) > 0)
+    _dbus_shm_ring_wake_self (ring, DBUS_SHM_RING_DATA);
+#endif
+
   if (oom)
     return FALSE;
   else
     return TRUE;
 }
 
+/* Cutting what was read into messages is a phase of its own, which
+ * interrupts this one */
+static dbus_bool_t
+do_reading (DBusTransport *transport,
+            dbus_bool_t    socket_readable)
+{
+  dbus_bool_t retval;
+  DBusPhase old_phase;
+
+  old_phase = _dbus_phase_enter (DBUS_PHASE_SOCKET_READ);
+  retval = do_reading_untimed (transport, socket_readable);
+  _dbus_phase_leave (old_phase);
+
+  return retval;
+}
+
 static dbus_bool_t
 unix_error_with_read_to_come (DBusTransport *itransport,
                               DBusWatch     *watch,
@@ -936,7 +1830,12 @@ socket_handle_watch (DBusTransport *transport,
   DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
 
   _dbus_assert (watch == socket_transport->read_watch ||
-                watch == socket_transport->write_watch);
+                watch == socket_transport->write_watch
+#ifdef DBUS_HAVE_SHM_RING
+                || watch == socket_transport->data_watch
+                || watch == socket_transport->space_watch
+#endif
+                );
   _dbus_assert (watch != NULL);
   
   /* If we hit an error here on a write watch, don't disconnect the transport yet because data can
@@ -969,7 +1868,7 @@ socket_handle_watch (DBusTransport *transport,
        */
       if (!auth_finished)
 	{
-	  if (!do_reading (transport))
+	  if (!do_reading (transport, TRUE))
 	    {
 	      _dbus_verbose ("no memory to read\n");
 	      return FALSE;
@@ -999,6 +1898,36 @@ socket_handle_watch (DBusTransport *transport,
       /* See if we still need the write watch */
       check_write_watch (transport);
     }
+#ifdef DBUS_HAVE_SHM_RING
+  else if (watch == socket_transport->data_watch &&
+           (flags & DBUS_WATCH_READABLE))
+    {
+      _dbus_verbose ("handling shared memory data doorbell\n");
+      _dbus_shm_ring_clear_doorbell (socket_transport->shm_ring,
+                                     DBUS_SHM_RING_DATA);
+
+      if (!do_reading (transport, FALSE))
+        {
+          _dbus_verbose ("no memory to read\n");
+          return FALSE;
+        }
+    }
+  else if (watch == socket_transport->space_watch &&
+           (flags & DBUS_WATCH_READABLE))
+    {
+      _dbus_verbose ("handling shared memory space doorbell\n");
+      _dbus_shm_ring_clear_doorbell (socket_transport->shm_ring,
+                                     DBUS_SHM_RING_SPACE);
+
+      if (!do_writing (transport))
+        {
+          _dbus_verbose ("no memory to write\n");
+          return FALSE;
+        }
+
+      check_write_watch (transport);
+    }
+#endif
 #ifdef DBUS_ENABLE_VERBOSE_MODE
   else
     {
@@ -1025,6 +1954,10 @@ socket_disconnect (DBusTransport *transport)
   _dbus_verbose ("\n");
   
   free_watches (transport);
+
+#ifdef DBUS_HAVE_SHM_RING
+  free_shm_ring (socket_transport);
+#endif
   
   _dbus_close_socket (socket_transport->fd, NULL);
   _dbus_socket_invalidate (&socket_transport->fd);
@@ -1061,6 +1994,36 @@ socket_connection_set (DBusTransport *transport)
   return TRUE;
 }
 
+/* Polls without sleeping until the socket is ready, poll() fails
+ * or the budget runs out, so that a reply arriving soon does not have
+ * to wait for the scheduler to wake us up. Returns like _dbus_poll().
+ */
+static int
+busy_poll (DBusPollFD *fds,
+           int         n_fds,
+           int         budget_usec)
+{
+  long start_sec, start_usec;
+  long now_sec, now_usec;
+  int poll_res;
+
+  _dbus_get_monotonic_time (&start_sec, &start_usec);
+
+  while (TRUE)
+    {
+      poll_res = _dbus_poll (fds, n_fds, 0);
+
+      if (poll_res != 0)
+        return poll_res;
+
+      _dbus_get_monotonic_time (&now_sec, &now_usec);
+
+      if ((now_sec - start_sec) * 1000000 + (now_usec - start_usec) >=
+          budget_usec)
+        return 0;
+    }
+}
+
 /**
  * @todo We need to have a way to wake up the select sleep if
  * a new iteration request comes in with a flag (read/write) that
@@ -1075,8 +2038,15 @@ socket_do_iteration (DBusTransport *transport,
 {
   DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
   DBusPollFD poll_fd;
+  DBusPollFD poll_fds[3];
+  int n_poll_fds;
+  int data_index;
+  int space_index;
   int poll_res;
   int poll_timeout;
+#ifdef DBUS_HAVE_SHM_RING
+  DBusShmRing *ring;
+#endif
 
   _dbus_verbose (" iteration flags = %s%s timeout = %d read_watch = %p write_watch = %p fd = %" DBUS_SOCKET_FORMAT "\n",
                  flags & DBUS_ITERATION_DO_READING ? "read" : "",
@@ -1094,7 +2064,14 @@ socket_do_iteration (DBusTransport *transport,
 
   poll_fd.fd = _dbus_socket_get_pollable (socket_transport->fd);
   poll_fd.events = 0;
-  
+
+#ifdef DBUS_HAVE_SHM_RING
+  /* Nothing else happens until the ring is set up */
+  if (_dbus_transport_try_to_authenticate (transport) &&
+      shm_setup_pending (transport))
+    poll_fd.events |= transport->is_server ? _DBUS_POLLOUT : _DBUS_POLLIN;
+  else
+#endif
   if (_dbus_transport_try_to_authenticate (transport))
     {
       /* This is kind of a hack; if we have stuff to write, then try
@@ -1125,7 +2102,11 @@ socket_do_iteration (DBusTransport *transport,
 	poll_fd.events |= _DBUS_POLLIN;
 
       _dbus_assert (socket_transport->write_watch);
-      if (flags & DBUS_ITERATION_DO_WRITING)
+      if ((flags & DBUS_ITERATION_DO_WRITING)
+#ifdef DBUS_HAVE_SHM_RING
+          && !socket_transport->shm_write_blocked
+#endif
+          )
         poll_fd.events |= _DBUS_POLLOUT;
     }
   else
@@ -1141,11 +2122,45 @@ socket_do_iteration (DBusTransport *transport,
       if (transport->send_credentials_pending ||
           auth_state == DBUS_AUTH_STATE_HAVE_BYTES_TO_SEND)
 	poll_fd.events |= _DBUS_POLLOUT;
+      else if ((flags & DBUS_ITERATION_DO_WRITING) &&
+               _dbus_auth_get_pipelined_begin_sent (transport->auth) &&
+               _dbus_connection_has_messages_to_send_unlocked (transport->connection))
+        poll_fd.events |= _DBUS_POLLOUT;
     }
 
-  if (poll_fd.events)
+  /* With a ring, its doorbells are polled alongside the socket */
+  n_poll_fds = 1;
+  data_index = -1;
+  space_index = -1;
+
+#ifdef DBUS_HAVE_SHM_RING
+  ring = active_shm_ring (socket_transport);
+
+  if (ring != NULL && !transport->disconnected)
+    {
+      if (flags & DBUS_ITERATION_DO_READING)
+        {
+          data_index = n_poll_fds++;
+          poll_fds[data_index].fd =
+            _dbus_shm_ring_get_doorbell (ring, DBUS_SHM_RING_DATA);
+          poll_fds[data_index].events = _DBUS_POLLIN;
+        }
+
+      if ((flags & DBUS_ITERATION_DO_WRITING) &&
+          socket_transport->shm_write_blocked)
+        {
+          space_index = n_poll_fds++;
+          poll_fds[space_index].fd =
+            _dbus_shm_ring_get_doorbell (ring, DBUS_SHM_RING_SPACE);
+          poll_fds[space_index].events = _DBUS_POLLIN;
+        }
+    }
+#endif
+
+  if (poll_fd.events || n_poll_fds > 1)
     {
       int saved_errno;
+      int i;
 
       if (flags & DBUS_ITERATION_BLOCK)
 	poll_timeout = timeout_milliseconds;
@@ -1164,7 +2179,15 @@ socket_do_iteration (DBusTransport *transport,
         }
       
     again:
-      poll_res = _dbus_poll (&poll_fd, 1, poll_timeout);
+      poll_res = 0;
+      poll_fds[0] = poll_fd;
+
+      if (transport->busy_poll_usec > 0 && poll_timeout != 0 &&
+          (poll_fd.events & _DBUS_POLLIN))
+        poll_res = busy_poll (poll_fds, n_poll_fds, transport->busy_poll_usec);
+
+      if (poll_res == 0)
+        poll_res = _dbus_poll (poll_fds, n_poll_fds, poll_timeout);
       saved_errno = _dbus_save_socket_errno ();
 
       if (poll_res < 0 && _dbus_get_is_errno_eintr (saved_errno))
@@ -1179,10 +2202,13 @@ socket_do_iteration (DBusTransport *transport,
       if (poll_res >= 0)
         {
           if (poll_res == 0)
-            poll_fd.revents = 0; /* some concern that posix does not guarantee this;
-                                  * valgrind flags it as an error. though it probably
-                                  * is guaranteed on linux at least.
-                                  */
+            for (i = 0; i < n_poll_fds; i++)
+              poll_fds[i].revents = 0; /* some concern that posix does not guarantee this;
+                                        * valgrind flags it as an error. though it probably
+                                        * is guaranteed on linux at least.
+                                        */
+
+          poll_fd = poll_fds[0];
           
           if (poll_fd.revents & _DBUS_POLLERR)
             do_io_error (transport);
@@ -1190,6 +2216,10 @@ socket_do_iteration (DBusTransport *transport,
             {
               dbus_bool_t need_read = (poll_fd.revents & _DBUS_POLLIN) > 0;
               dbus_bool_t need_write = (poll_fd.revents & _DBUS_POLLOUT) > 0;
+              dbus_bool_t data_rung = data_index >= 0 &&
+                (poll_fds[data_index].revents & _DBUS_POLLIN) > 0;
+              dbus_bool_t space_rung = space_index >= 0 &&
+                (poll_fds[space_index].revents & _DBUS_POLLIN) > 0;
 	      dbus_bool_t authentication_completed;
 
               _dbus_verbose ("in iteration, need_read=%d need_write=%d\n",
@@ -1200,10 +2230,33 @@ socket_do_iteration (DBusTransport *transport,
 	      /* See comment in socket_handle_watch. */
 	      if (authentication_completed)
                 goto out;
+
+#ifdef DBUS_HAVE_SHM_RING
+              if (!transport->disconnected &&
+                  _dbus_transport_try_to_authenticate (transport) &&
+                  shm_setup_pending (transport))
+                {
+                  if (need_read && !transport->is_server)
+                    receive_shm_setup (transport);
+                  if (need_write && transport->is_server)
+                    do_writing (transport);
+                  goto out;
+                }
+
+              /* NULL if we were disconnected meanwhile */
+              ring = active_shm_ring (socket_transport);
+
+              if (ring != NULL && data_rung)
+                _dbus_shm_ring_clear_doorbell (ring, DBUS_SHM_RING_DATA);
+              if (ring != NULL && space_rung)
+                _dbus_shm_ring_clear_doorbell (ring, DBUS_SHM_RING_SPACE);
+#endif
                                  
-              if (need_read && (flags & DBUS_ITERATION_DO_READING))
-                do_reading (transport);
-              if (need_write && (flags & DBUS_ITERATION_DO_WRITING))
+              if ((need_read || data_rung) &&
+                  (flags & DBUS_ITERATION_DO_READING))
+                do_reading (transport, need_read);
+              if ((need_write || space_rung) &&
+                  (flags & DBUS_ITERATION_DO_WRITING))
                 do_writing (transport);
             }
         }
@@ -1231,6 +2284,13 @@ socket_do_iteration (DBusTransport *transport,
   _dbus_verbose (" ... leaving do_iteration()\n");
 }
 
+static void
+socket_messages_queued (DBusTransport *transport)
+{
+  /* Let the main loop write them out */
+  check_write_watch (transport);
+}
+
 static void
 socket_live_messages_changed (DBusTransport *transport)
 {
@@ -1250,6 +2310,25 @@ socket_get_socket_fd (DBusTransport *transport,
   return TRUE;
 }
 
+static void
+socket_trim_buffers (DBusTransport *transport)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+
+  /* Both are normally empty between messages, but keep up to 2k each */
+  _dbus_string_compact (&socket_transport->encoded_outgoing, 0);
+  _dbus_string_compact (&socket_transport->encoded_incoming, 0);
+}
+
+static int
+socket_get_buffer_bytes (DBusTransport *transport)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+
+  return _dbus_string_get_allocated (&socket_transport->encoded_outgoing) +
+    _dbus_string_get_allocated (&socket_transport->encoded_incoming);
+}
+
 static const DBusTransportVTable socket_vtable = {
   socket_finalize,
   socket_handle_watch,
@@ -1257,7 +2336,10 @@ static const DBusTransportVTable socket_vtable = {
   socket_connection_set,
   socket_do_iteration,
   socket_live_messages_changed,
-  socket_get_socket_fd
+  socket_messages_queued,
+  socket_get_socket_fd,
+  socket_trim_buffers,
+  socket_get_buffer_bytes
 };
 
 /**
@@ -1311,6 +2393,21 @@ _dbus_transport_new_for_socket (DBusSocket        fd,
   _dbus_auth_set_unix_fd_possible(socket_transport->base.auth, _dbus_socket_can_pass_unix_fd(fd));
 #endif
 
+#ifdef DBUS_HAVE_SHM_RING
+  _dbus_auth_set_shared_memory_possible (socket_transport->base.auth,
+                                         _dbus_socket_can_pass_unix_fd (fd));
+#endif
+
+#ifdef HAVE_LZ4
+  /* Worth it between hosts, where there are no fds to pass */
+#ifdef HAVE_UNIX_FD_PASSING
+  _dbus_auth_set_compression_possible (socket_transport->base.auth,
+                                       !_dbus_socket_can_pass_unix_fd (fd));
+#else
+  _dbus_auth_set_compression_possible (socket_transport->base.auth, TRUE);
+#endif
+#endif
+
   socket_transport->fd = fd;
   socket_transport->message_bytes_written = 0;
   
@@ -109,6 +109,67 @@ _dbus_transport_new_for_domain_socket (const char     *path,
   return NULL;
 }
 
+/**
+ * Creates a new transport for the given Linux vsock context ID and
+ * port. This creates a client-side of a transport.
+ *
+ * @param cid the context ID to connect to, in decimal
+ * @param port the port to connect to, in decimal
+ * @param error address where an error can be returned.
+ * @returns a new transport, or #NULL on failure.
+ */
+static DBusTransport*
+_dbus_transport_new_for_vsock (const char     *cid,
+                               const char     *port,
+                               DBusError      *error)
+{
+  DBusSocket fd = DBUS_SOCKET_INIT;
+  DBusTransport *transport;
+  DBusString address;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!_dbus_string_init (&address))
+    {
+      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+      return NULL;
+    }
+
+  if (!_dbus_string_append_printf (&address, "vsock:cid=%s,port=%s",
+                                   cid, port))
+    {
+      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+      goto failed_0;
+    }
+
+  fd.fd = _dbus_connect_vsock_socket (cid, port, error);
+  if (fd.fd < 0)
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      goto failed_0;
+    }
+
+  _dbus_verbose ("Successfully connected to vsock socket %s:%s\n",
+                 cid, port);
+
+  transport = _dbus_transport_new_for_socket (fd, NULL, &address);
+  if (transport == NULL)
+    {
+      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+      goto failed_1;
+    }
+
+  _dbus_string_free (&address);
+
+  return transport;
+
+ failed_1:
+  _dbus_close_socket (fd, NULL);
+ failed_0:
+  _dbus_string_free (&address);
+  return NULL;
+}
+
 /**
  * Creates a new transport for the given binary and arguments. This
  * creates a client-side of a transport. The process will be forked
@@ -272,6 +333,30 @@ _dbus_transport_open_platform_specific (DBusAddressEntry  *entry,
           return DBUS_TRANSPORT_OPEN_OK;
         }
     }
+  else if (strcmp (method, "vsock") == 0)
+    {
+      const char *cid = dbus_address_entry_get_value (entry, "cid");
+      const char *port = dbus_address_entry_get_value (entry, "port");
+
+      if (cid == NULL || port == NULL)
+        {
+          _dbus_set_bad_address (error, "vsock", cid ? "port" : "cid",
+                                 NULL);
+          return DBUS_TRANSPORT_OPEN_BAD_ADDRESS;
+        }
+
+      *transport_p = _dbus_transport_new_for_vsock (cid, port, error);
+      if (*transport_p == NULL)
+        {
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          return DBUS_TRANSPORT_OPEN_DID_NOT_CONNECT;
+        }
+      else
+        {
+          _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+          return DBUS_TRANSPORT_OPEN_OK;
+        }
+    }
   else if (strcmp (method, "unixexec") == 0)
     {
       const char *path;
@@ -85,6 +85,26 @@ live_messages_notify (DBusCounter *counter,
   _dbus_connection_unlock (transport->connection);
 }
 
+/* Once a limit stops us reading, we only read again when the live
+ * messages have fallen a quarter of the way back, so that a consumer
+ * that keeps us at the limit doesn't turn the read watch off and on
+ * for every message it frees.
+ */
+#define LIVE_MESSAGES_RESUME_VALUE(max) ((max) - (max) / 4)
+
+static void
+live_messages_set_notify (DBusTransport *transport)
+{
+  transport->live_messages_throttled = FALSE;
+  _dbus_counter_set_notify (transport->live_messages,
+                            transport->max_live_messages_size,
+                            LIVE_MESSAGES_RESUME_VALUE (transport->max_live_messages_size),
+                            transport->max_live_messages_unix_fds,
+                            LIVE_MESSAGES_RESUME_VALUE (transport->max_live_messages_unix_fds),
+                            live_messages_notify,
+                            transport);
+}
+
 /**
  * Initializes the base class members of DBusTransport.  Chained up to
  * by subclasses in their constructor.  The server GUID is the
@@ -190,15 +210,14 @@ _dbus_transport_init_base (DBusTransport             *transport,
   /* On Linux RLIMIT_NOFILE defaults to 1024, so allowing 4096 fds live
      should be more than enough */
   transport->max_live_messages_unix_fds = 4096;
+  transport->busy_poll_usec = 0;
+  transport->max_send_buffer_size = 0;
+  transport->max_receive_buffer_size = 0;
 
   /* credentials read from socket if any */
   transport->credentials = creds;
 
-  _dbus_counter_set_notify (transport->live_messages,
-                            transport->max_live_messages_size,
-                            transport->max_live_messages_unix_fds,
-                            live_messages_notify,
-                            transport);
+  live_messages_set_notify (transport);
 
   if (transport->address)
     _dbus_verbose ("Initialized transport on address %s\n", transport->address);
@@ -227,7 +246,7 @@ _dbus_transport_finalize_base (DBusTransport *transport)
   _dbus_message_loader_unref (transport->loader);
   _dbus_auth_unref (transport->auth);
   _dbus_counter_set_notify (transport->live_messages,
-                            0, 0, NULL, NULL);
+                            0, 0, 0, 0, NULL, NULL);
   _dbus_counter_unref (transport->live_messages);
   dbus_free (transport->address);
   dbus_free (transport->expected_guid);
@@ -369,6 +388,9 @@ _dbus_transport_open (DBusAddressEntry *entry,
 {
   DBusTransport *transport;
   const char *expected_guid_orig;
+  const char *pipeline;
+  const char *shm;
+  const char *compression;
   char *expected_guid;
   int i;
   DBusError tmp_error = DBUS_ERROR_INIT;
@@ -445,6 +467,37 @@ _dbus_transport_open (DBusAddressEntry *entry,
        */
       if(expected_guid)
         transport->expected_guid = expected_guid;
+
+      /* pipeline=true asks for the authentication and the first
+       * messages to be sent without waiting for the server, which
+       * only works if it accepts EXTERNAL.
+       */
+      pipeline = dbus_address_entry_get_value (entry, "pipeline");
+
+      if (pipeline != NULL && strcmp (pipeline, "true") == 0 &&
+          !_dbus_auth_client_pipeline (transport->auth))
+        {
+          _dbus_transport_unref (transport);
+          _DBUS_SET_OOM (error);
+          return NULL;
+        }
+
+      /* shm=true asks for messages to go through a shared memory
+       * ring once authenticated, if both sides can do that.
+       */
+      shm = dbus_address_entry_get_value (entry, "shm");
+
+      if (shm != NULL && strcmp (shm, "true") == 0)
+        _dbus_auth_client_request_shared_memory (transport->auth);
+
+      /* compression=lz4 asks for the message stream to be compressed,
+       * which the server may refuse; it is never used where fds can be
+       * passed.
+       */
+      compression = dbus_address_entry_get_value (entry, "compression");
+
+      if (compression != NULL && strcmp (compression, "lz4") == 0)
+        _dbus_auth_client_request_compression (transport->auth);
     }
 
   return transport;
@@ -1005,40 +1058,62 @@ _dbus_transport_do_iteration (DBusTransport  *transport,
   _dbus_verbose ("end\n");
 }
 
+/**
+ * Notifies the transport that outgoing messages have been queued
+ * without an iteration to write them, so that it can arrange for the
+ * main loop to do so.
+ *
+ * @param transport the transport.
+ */
+void
+_dbus_transport_messages_queued (DBusTransport *transport)
+{
+  if (transport->disconnected)
+    return;
+
+  _dbus_transport_ref (transport);
+  (* transport->vtable->messages_queued) (transport);
+  _dbus_transport_unref (transport);
+}
+
+/**
+ * Gives back the memory that the transport's buffers, and those of its
+ * message loader, hold beyond the data in them. Buffers grow back as
+ * soon as there is traffic again, so this is for connections that have
+ * been quiet for a while.
+ *
+ * @param transport the transport.
+ */
+void
+_dbus_transport_trim_buffers (DBusTransport *transport)
+{
+  _dbus_message_loader_trim (transport->loader);
+
+  if (transport->vtable->trim_buffers)
+    (* transport->vtable->trim_buffers) (transport);
+}
+
 static dbus_bool_t
 recover_unused_bytes (DBusTransport *transport)
 {
   if (_dbus_auth_needs_decoding (transport->auth))
     {
-      DBusString plaintext;
       const DBusString *encoded;
       DBusString *buffer;
       int orig_len;
-      
-      if (!_dbus_string_init (&plaintext))
-        goto nomem;
+      dbus_bool_t succeeded;
       
       _dbus_auth_get_unused_bytes (transport->auth,
                                    &encoded);
 
-      if (!_dbus_auth_decode_data (transport->auth,
-                                   encoded, &plaintext))
-        {
-          _dbus_string_free (&plaintext);
-          goto nomem;
-        }
-      
       _dbus_message_loader_get_buffer (transport->loader,
                                        &buffer);
       
       orig_len = _dbus_string_get_length (buffer);
-      
-      if (!_dbus_string_move (&plaintext, 0, buffer,
-                              orig_len))
-        {
-          _dbus_string_free (&plaintext);
-          goto nomem;
-        }
+
+      /* Straight into the loader's buffer: a decoder may keep state
+       * between calls, so the bytes must not be decoded twice */
+      succeeded = _dbus_auth_decode_data (transport->auth, encoded, buffer);
       
       _dbus_verbose (" %d unused bytes sent to message loader\n", 
                      _dbus_string_get_length (buffer) -
@@ -1047,9 +1122,18 @@ recover_unused_bytes (DBusTransport *transport)
       _dbus_message_loader_return_buffer (transport->loader,
                                           buffer);
 
+      if (!succeeded && _dbus_auth_get_data_corrupted (transport->auth))
+        {
+          _dbus_verbose ("Peer sent data that can't be decoded, disconnecting\n");
+          _dbus_auth_delete_unused_bytes (transport->auth);
+          _dbus_transport_disconnect (transport);
+          return TRUE;
+        }
+
+      if (!succeeded)
+        goto nomem;
+
       _dbus_auth_delete_unused_bytes (transport->auth);
-      
-      _dbus_string_free (&plaintext);
     }
   else
     {
@@ -1090,6 +1174,38 @@ recover_unused_bytes (DBusTransport *transport)
   return FALSE;
 }
 
+/**
+ * Whether the live messages we have read are holding us back from
+ * reading more. Reading stops when they reach either limit, and
+ * starts again only once they are below both resume values.
+ *
+ * @param transport the transport
+ * @returns #TRUE if we should not read
+ */
+dbus_bool_t
+_dbus_transport_get_is_throttled (DBusTransport *transport)
+{
+  long size = _dbus_counter_get_size_value (transport->live_messages);
+  long fds = _dbus_counter_get_unix_fd_value (transport->live_messages);
+
+  if (transport->live_messages_throttled)
+    {
+      if (size < LIVE_MESSAGES_RESUME_VALUE (transport->max_live_messages_size) &&
+          fds < LIVE_MESSAGES_RESUME_VALUE (transport->max_live_messages_unix_fds))
+        transport->live_messages_throttled = FALSE;
+    }
+  else if (size >= transport->max_live_messages_size ||
+           fds >= transport->max_live_messages_unix_fds)
+    {
+      transport->live_messages_throttled = TRUE;
+#ifdef DBUS_ENABLE_STATS
+      transport->n_throttled += 1;
+#endif
+    }
+
+  return transport->live_messages_throttled;
+}
+
 /**
  * Reports our current dispatch status (whether there's buffered
  * data to be queued as messages, or not, or we need memory).
@@ -1100,8 +1216,11 @@ recover_unused_bytes (DBusTransport *transport)
 DBusDispatchStatus
 _dbus_transport_get_dispatch_status (DBusTransport *transport)
 {
-  if (_dbus_counter_get_size_value (transport->live_messages) >= transport->max_live_messages_size ||
-      _dbus_counter_get_unix_fd_value (transport->live_messages) >= transport->max_live_messages_unix_fds)
+  DBusPhase old_phase;
+  dbus_bool_t queued;
+
+  if (transport->reads_paused ||
+      _dbus_transport_get_is_throttled (transport))
     return DBUS_DISPATCH_COMPLETE; /* complete for now */
 
   if (!_dbus_transport_try_to_authenticate (transport))
@@ -1113,13 +1232,22 @@ _dbus_transport_get_dispatch_status (DBusTransport *transport)
         return DBUS_DISPATCH_COMPLETE;
     }
 
-  if (!transport->unused_bytes_recovered &&
-      !recover_unused_bytes (transport))
-    return DBUS_DISPATCH_NEED_MEMORY;
+  if (!transport->unused_bytes_recovered)
+    {
+      if (!recover_unused_bytes (transport))
+        return DBUS_DISPATCH_NEED_MEMORY;
 
-  transport->unused_bytes_recovered = TRUE;
+      transport->unused_bytes_recovered = TRUE;
+
+      /* From now on the auth conversation only encodes and decodes */
+      _dbus_auth_shrink (transport->auth);
+    }
   
-  if (!_dbus_message_loader_queue_messages (transport->loader))
+  old_phase = _dbus_phase_enter (DBUS_PHASE_HEADER_LOAD);
+  queued = _dbus_message_loader_queue_messages (transport->loader);
+  _dbus_phase_leave (old_phase);
+
+  if (!queued)
     return DBUS_DISPATCH_NEED_MEMORY;
 
   if (_dbus_message_loader_peek_message (transport->loader) != NULL)
@@ -1215,6 +1343,44 @@ _dbus_transport_set_max_message_unix_fds (DBusTransport  *transport,
   _dbus_message_loader_set_max_message_unix_fds (transport->loader, n);
 }
 
+/**
+ * See _dbus_connection_set_deferred_validation_size().
+ *
+ * @param transport the transport
+ * @param size the smallest body left unvalidated, or 0
+ */
+void
+_dbus_transport_set_deferred_validation_size (DBusTransport  *transport,
+                                              long            size)
+{
+  _dbus_message_loader_set_deferred_validation_size (transport->loader, size);
+}
+
+/**
+ * See dbus_connection_set_trust_message_bodies().
+ *
+ * @param transport the transport
+ * @param trust #TRUE to skip validating received bodies
+ */
+void
+_dbus_transport_set_trust_bodies (DBusTransport *transport,
+                                  dbus_bool_t    trust)
+{
+  _dbus_message_loader_set_trust_bodies (transport->loader, trust);
+}
+
+/**
+ * See dbus_connection_get_trust_message_bodies().
+ *
+ * @param transport the transport
+ * @returns #TRUE if received bodies are not validated
+ */
+dbus_bool_t
+_dbus_transport_get_trust_bodies (DBusTransport *transport)
+{
+  return _dbus_message_loader_get_trust_bodies (transport->loader);
+}
+
 /**
  * See dbus_connection_get_max_message_size().
  *
@@ -1250,11 +1416,7 @@ _dbus_transport_set_max_received_size (DBusTransport  *transport,
                                        long            size)
 {
   transport->max_live_messages_size = size;
-  _dbus_counter_set_notify (transport->live_messages,
-                            transport->max_live_messages_size,
-                            transport->max_live_messages_unix_fds,
-                            live_messages_notify,
-                            transport);
+  live_messages_set_notify (transport);
 }
 
 /**
@@ -1268,11 +1430,7 @@ _dbus_transport_set_max_received_unix_fds (DBusTransport  *transport,
                                            long            n)
 {
   transport->max_live_messages_unix_fds = n;
-  _dbus_counter_set_notify (transport->live_messages,
-                            transport->max_live_messages_size,
-                            transport->max_live_messages_unix_fds,
-                            live_messages_notify,
-                            transport);
+  live_messages_set_notify (transport);
 }
 
 /**
@@ -1299,6 +1457,74 @@ _dbus_transport_get_max_received_unix_fds (DBusTransport  *transport)
   return transport->max_live_messages_unix_fds;
 }
 
+/**
+ * See _dbus_connection_set_reads_paused().
+ *
+ * @param transport the transport
+ * @param paused #TRUE to stop reading and parsing messages
+ */
+void
+_dbus_transport_set_reads_paused (DBusTransport *transport,
+                                  dbus_bool_t    paused)
+{
+  transport->reads_paused = paused != FALSE;
+
+  /* disable or re-enable the read watch, as for the live messages
+   * limits */
+  if (transport->vtable->live_messages_changed)
+    (* transport->vtable->live_messages_changed) (transport);
+}
+
+/**
+ * See dbus_connection_set_busy_poll().
+ *
+ * @param transport the transport
+ * @param microseconds how long blocking iterations spin before sleeping
+ */
+void
+_dbus_transport_set_busy_poll (DBusTransport *transport,
+                               int            microseconds)
+{
+  DBusSocket fd;
+
+  transport->busy_poll_usec = microseconds;
+
+  /* Best effort: also let the kernel spin on the device queue, which
+   * helps TCP and needs CAP_NET_ADMIN to raise. */
+  if (_dbus_transport_get_socket_fd (transport, &fd) &&
+      !_dbus_set_socket_busy_poll (fd, microseconds))
+    _dbus_verbose ("could not set SO_BUSY_POLL on transport %p\n",
+                   transport);
+}
+
+/**
+ * See dbus_connection_get_busy_poll().
+ *
+ * @param transport the transport
+ * @returns how long blocking iterations spin before sleeping
+ */
+int
+_dbus_transport_get_busy_poll (DBusTransport *transport)
+{
+  return transport->busy_poll_usec;
+}
+
+/**
+ * See _dbus_connection_set_max_socket_buffer_sizes().
+ *
+ * @param transport the transport
+ * @param send_size largest send buffer to grow to, or 0
+ * @param receive_size largest receive buffer to grow to, or 0
+ */
+void
+_dbus_transport_set_max_socket_buffer_sizes (DBusTransport *transport,
+                                             int            send_size,
+                                             int            receive_size)
+{
+  transport->max_send_buffer_size = send_size;
+  transport->max_receive_buffer_size = receive_size;
+}
+
 /**
  * See dbus_connection_get_unix_user().
  *
@@ -1539,6 +1765,22 @@ _dbus_transport_set_allow_anonymous (DBusTransport              *transport,
   transport->allow_anonymous = value != FALSE;
 }
 
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+/**
+ * Authenticates without offering Unix fd passing, as if the socket
+ * could not pass fds. Must be called before authentication starts.
+ *
+ * @param transport the transport
+ */
+void
+_dbus_transport_disable_unix_fd_passing (DBusTransport *transport)
+{
+  _dbus_assert (!transport->authenticated);
+
+  _dbus_auth_set_unix_fd_possible (transport->auth, FALSE);
+}
+#endif
+
 /**
  * Return how many file descriptors are pending in the loader
  *
@@ -1572,7 +1814,10 @@ _dbus_transport_get_stats (DBusTransport  *transport,
                            dbus_uint32_t  *queue_bytes,
                            dbus_uint32_t  *queue_fds,
                            dbus_uint32_t  *peak_queue_bytes,
-                           dbus_uint32_t  *peak_queue_fds)
+                           dbus_uint32_t  *peak_queue_fds,
+                           dbus_uint64_t  *total_bytes_read,
+                           dbus_uint64_t  *total_bytes_written,
+                           dbus_uint32_t  *n_throttled)
 {
   if (queue_bytes != NULL)
     *queue_bytes = _dbus_counter_get_size_value (transport->live_messages);
@@ -1585,6 +1830,47 @@ _dbus_transport_get_stats (DBusTransport  *transport,
 
   if (peak_queue_fds != NULL)
     *peak_queue_fds = _dbus_counter_get_peak_unix_fd_value (transport->live_messages);
+
+  if (total_bytes_read != NULL)
+    *total_bytes_read = transport->bytes_read;
+
+  if (total_bytes_written != NULL)
+    *total_bytes_written = transport->bytes_written;
+
+  if (n_throttled != NULL)
+    *n_throttled = transport->n_throttled;
+}
+
+dbus_uint32_t
+_dbus_transport_get_n_write_blocks (DBusTransport *transport)
+{
+  return transport->n_write_blocks;
+}
+
+dbus_bool_t
+_dbus_transport_get_compression_stats (DBusTransport *transport,
+                                       dbus_uint64_t *in_wire_bytes,
+                                       dbus_uint64_t *in_plain_bytes,
+                                       dbus_uint64_t *out_wire_bytes,
+                                       dbus_uint64_t *out_plain_bytes)
+{
+  return _dbus_auth_get_compression_stats (transport->auth,
+                                           in_wire_bytes, in_plain_bytes,
+                                           out_wire_bytes, out_plain_bytes);
+}
+
+int
+_dbus_transport_get_buffer_bytes (DBusTransport *transport)
+{
+  int bytes;
+
+  bytes = _dbus_message_loader_get_buffer_bytes (transport->loader) +
+    _dbus_auth_get_buffer_bytes (transport->auth);
+
+  if (transport->vtable->get_buffer_bytes)
+    bytes += (* transport->vtable->get_buffer_bytes) (transport);
+
+  return bytes;
 }
 #endif /* DBUS_ENABLE_STATS */
 
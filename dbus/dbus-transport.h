@@ -53,7 +53,10 @@ dbus_bool_t        _dbus_transport_set_connection         (DBusTransport
 void               _dbus_transport_do_iteration           (DBusTransport              *transport,
                                                            unsigned int                flags,
                                                            int                         timeout_milliseconds);
+void               _dbus_transport_messages_queued        (DBusTransport              *transport);
+void               _dbus_transport_trim_buffers           (DBusTransport              *transport);
 DBusDispatchStatus _dbus_transport_get_dispatch_status    (DBusTransport              *transport);
+dbus_bool_t        _dbus_transport_get_is_throttled       (DBusTransport              *transport);
 dbus_bool_t        _dbus_transport_queue_messages         (DBusTransport              *transport);
 
 void               _dbus_transport_set_max_message_size   (DBusTransport              *transport,
@@ -66,9 +69,22 @@ long               _dbus_transport_get_max_received_size  (DBusTransport
 void               _dbus_transport_set_max_message_unix_fds (DBusTransport              *transport,
                                                              long                        n);
 long               _dbus_transport_get_max_message_unix_fds (DBusTransport              *transport);
+void               _dbus_transport_set_deferred_validation_size (DBusTransport          *transport,
+                                                                 long                    size);
+void               _dbus_transport_set_trust_bodies       (DBusTransport              *transport,
+                                                           dbus_bool_t                 trust);
+void               _dbus_transport_set_reads_paused       (DBusTransport              *transport,
+                                                           dbus_bool_t                 paused);
+dbus_bool_t        _dbus_transport_get_trust_bodies       (DBusTransport              *transport);
 void               _dbus_transport_set_max_received_unix_fds(DBusTransport              *transport,
                                                              long                        n);
 long               _dbus_transport_get_max_received_unix_fds(DBusTransport              *transport);
+void               _dbus_transport_set_busy_poll          (DBusTransport              *transport,
+                                                           int                         microseconds);
+int                _dbus_transport_get_busy_poll          (DBusTransport              *transport);
+void               _dbus_transport_set_max_socket_buffer_sizes (DBusTransport         *transport,
+                                                                int                    send_size,
+                                                                int                    receive_size);
 
 dbus_bool_t        _dbus_transport_get_socket_fd          (DBusTransport              *transport,
                                                            DBusSocket                 *fd_p);
@@ -98,6 +114,7 @@ void               _dbus_transport_set_windows_user_function (DBusTransport
                                                               DBusFreeFunction           *old_free_data_function);
 dbus_bool_t        _dbus_transport_set_auth_mechanisms    (DBusTransport              *transport,
                                                            const char                **mechanisms);
+void               _dbus_transport_disable_unix_fd_passing (DBusTransport             *transport);
 void               _dbus_transport_set_allow_anonymous    (DBusTransport              *transport,
                                                            dbus_bool_t                 value);
 int                _dbus_transport_get_pending_fds_count  (DBusTransport              *transport);
@@ -110,7 +127,17 @@ void _dbus_transport_get_stats (DBusTransport  *transport,
                                 dbus_uint32_t  *queue_bytes,
                                 dbus_uint32_t  *queue_fds,
                                 dbus_uint32_t  *peak_queue_bytes,
-                                dbus_uint32_t  *peak_queue_fds);
+                                dbus_uint32_t  *peak_queue_fds,
+                                dbus_uint64_t  *total_bytes_read,
+                                dbus_uint64_t  *total_bytes_written,
+                                dbus_uint32_t  *n_throttled);
+dbus_bool_t _dbus_transport_get_compression_stats (DBusTransport *transport,
+                                                   dbus_uint64_t *in_wire_bytes,
+                                                   dbus_uint64_t *in_plain_bytes,
+                                                   dbus_uint64_t *out_wire_bytes,
+                                                   dbus_uint64_t *out_plain_bytes);
+int _dbus_transport_get_buffer_bytes (DBusTransport *transport);
+dbus_uint32_t _dbus_transport_get_n_write_blocks (DBusTransport *transport);
 
 DBUS_END_DECLS
 
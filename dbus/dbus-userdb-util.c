@@ -272,6 +272,11 @@ _dbus_user_database_lookup_group (DBusUserDatabase *db,
                      info->gid);
       return info;
     }
+  else if (gid != DBUS_GID_UNSET &&
+           _dbus_user_database_check_missing (db->missing_groups, gid, error))
+    {
+      return NULL;
+    }
   else
     {
       if (gid != DBUS_GID_UNSET)
@@ -290,9 +295,14 @@ _dbus_user_database_lookup_group (DBusUserDatabase *db,
 
       if (gid != DBUS_GID_UNSET)
         {
-          if (!_dbus_group_info_fill_gid (info, gid, error))
+          DBusError tmp_error = DBUS_ERROR_INIT;
+
+          /* the caller might not want to know why, but we do */
+          if (!_dbus_group_info_fill_gid (info, gid, &tmp_error))
             {
-              _DBUS_ASSERT_ERROR_IS_SET (error);
+              _dbus_user_database_remember_missing (db->missing_groups,
+                                                    gid, &tmp_error);
+              dbus_move_error (&tmp_error, error);
               _dbus_group_info_free_allocated (info);
               return NULL;
             }
@@ -450,6 +460,8 @@ _dbus_userdb_test (const char *test_data_dir)
   unsigned long *group_ids;
   int n_group_ids, i;
   DBusError error;
+  DBusUserDatabase *db;
+  const DBusUserInfo *info;
 
   if (!_dbus_username_from_current_process (&username))
     _dbus_assert_not_reached ("didn't get username");
@@ -484,6 +496,34 @@ _dbus_userdb_test (const char *test_data_dir)
 
   dbus_free (group_ids);
 
+  /* Failed lookups are remembered for a while */
+  db = _dbus_user_database_new ();
+  if (db == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  if (_dbus_user_database_get_uid (db, 2147480000, &info, &error))
+    {
+      printf ("UID 2147480000 exists, not testing lookup failures\n");
+    }
+  else if (!dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
+    {
+      const char *name = error.name;
+
+      dbus_error_free (&error);
+      _dbus_assert (_dbus_hash_table_get_n_entries (db->missing_users) == 1);
+
+      if (_dbus_user_database_get_uid (db, 2147480000, &info, &error))
+        _dbus_assert_not_reached ("cached failure was forgotten");
+      _dbus_assert (dbus_error_has_name (&error, name));
+      dbus_error_free (&error);
+
+      _dbus_user_database_flush (db);
+      _dbus_assert (_dbus_hash_table_get_n_entries (db->missing_users) == 0);
+    }
+
+  dbus_error_free (&error);
+  _dbus_user_database_unref (db);
+
   return TRUE;
 }
 #endif /* DBUS_ENABLE_EMBEDDED_TESTS */
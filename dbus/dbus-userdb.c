@@ -35,6 +35,118 @@
  * @{
  */
 
+/**
+ * How long a UID or GID that the system couldn't find is remembered
+ * as missing. With directory-backed NSS a miss can take a long time,
+ * and is usually repeated by every connection from the same user.
+ */
+#define MISSING_ENTRY_SECONDS 20
+
+/**
+ * Maximum number of remembered misses of each kind
+ */
+#define MAX_MISSING_ENTRIES 256
+
+/**
+ * A UID or GID that couldn't be found, and why
+ */
+typedef struct
+{
+  long expires;      /**< Monotonic time to look it up again */
+  const char *name;  /**< Error name from the lookup */
+  char *message;     /**< Error message from the lookup */
+} DBusUserDatabaseMiss;
+
+static void
+free_miss (void *data)
+{
+  DBusUserDatabaseMiss *miss = data;
+
+  if (miss == NULL) /* hash table will pass NULL */
+    return;
+
+  dbus_free (miss->message);
+  dbus_free (miss);
+}
+
+/**
+ * Checks whether a UID or GID was recently not found, and if so sets
+ * the same error as that lookup did.
+ *
+ * @param missing the database's table of misses for users or groups
+ * @param id the UID or GID
+ * @param error error to set
+ * @returns #TRUE if the error was set
+ */
+dbus_bool_t
+_dbus_user_database_check_missing (DBusHashTable *missing,
+                                   unsigned long  id,
+                                   DBusError     *error)
+{
+  DBusUserDatabaseMiss *miss;
+  long now;
+
+  miss = _dbus_hash_table_lookup_uintptr (missing, id);
+  if (miss == NULL)
+    return FALSE;
+
+  _dbus_get_monotonic_time (&now, NULL);
+
+  if (now >= miss->expires)
+    {
+      _dbus_hash_table_remove_uintptr (missing, id);
+      return FALSE;
+    }
+
+  _dbus_verbose ("Using cached failure for ID %lu\n", id);
+  dbus_set_error (error, miss->name, "%s", miss->message);
+  return TRUE;
+}
+
+/**
+ * Remembers that looking up a UID or GID failed, unless it failed
+ * for lack of memory. If that can't be remembered, it will just be
+ * looked up again next time.
+ *
+ * @param missing the database's table of misses for users or groups
+ * @param id the UID or GID
+ * @param error the error from the lookup
+ */
+void
+_dbus_user_database_remember_missing (DBusHashTable   *missing,
+                                      unsigned long    id,
+                                      const DBusError *error)
+{
+  DBusUserDatabaseMiss *miss;
+
+  _DBUS_ASSERT_ERROR_IS_SET (error);
+
+  if (dbus_error_has_name (error, DBUS_ERROR_NO_MEMORY))
+    return;
+
+  if (_dbus_hash_table_get_n_entries (missing) >= MAX_MISSING_ENTRIES)
+    _dbus_hash_table_remove_all (missing);
+
+  miss = dbus_new0 (DBusUserDatabaseMiss, 1);
+  if (miss == NULL)
+    return;
+
+  miss->message = _dbus_strdup (error->message);
+  if (miss->message == NULL)
+    {
+      dbus_free (miss);
+      return;
+    }
+
+  /* error names are always static strings */
+  miss->name = error->name;
+  _dbus_get_monotonic_time (&miss->expires, NULL);
+  miss->expires += MISSING_ENTRY_SECONDS;
+
+  if (!_dbus_hash_table_insert_uintptr (missing, id, miss))
+    free_miss (miss);
+}
+
 /**
  * Frees the given #DBusUserInfo's members with _dbus_user_info_free()
  * and also calls dbus_free() on the block itself
@@ -155,6 +267,11 @@ _dbus_user_database_lookup (DBusUserDatabase *db,
                      info->uid);
       return info;
     }
+  else if (uid != DBUS_UID_UNSET &&
+           _dbus_user_database_check_missing (db->missing_users, uid, error))
+    {
+      return NULL;
+    }
   else
     {
       if (uid != DBUS_UID_UNSET)
@@ -173,9 +290,14 @@ _dbus_user_database_lookup (DBusUserDatabase *db,
 
       if (uid != DBUS_UID_UNSET)
         {
-          if (!_dbus_user_info_fill_uid (info, uid, error))
+          DBusError tmp_error = DBUS_ERROR_INIT;
+
+          /* the caller might not want to know why, but we do */
+          if (!_dbus_user_info_fill_uid (info, uid, &tmp_error))
             {
-              _DBUS_ASSERT_ERROR_IS_SET (error);
+              _dbus_user_database_remember_missing (db->missing_users,
+                                                    uid, &tmp_error);
+              dbus_move_error (&tmp_error, error);
               _dbus_user_info_free_allocated (info);
               return NULL;
             }
@@ -578,6 +700,16 @@ _dbus_user_database_new (void)
                                              NULL, NULL);
   if (db->groups_by_name == NULL)
     goto failed;
+
+  db->missing_users = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+                                            NULL, free_miss);
+  if (db->missing_users == NULL)
+    goto failed;
+
+  db->missing_groups = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+                                             NULL, free_miss);
+  if (db->missing_groups == NULL)
+    goto failed;
   
   return db;
   
@@ -596,6 +728,8 @@ _dbus_user_database_flush (DBusUserDatabase *db)
   _dbus_hash_table_remove_all(db->groups_by_name);
   _dbus_hash_table_remove_all(db->users);
   _dbus_hash_table_remove_all(db->groups);
+  _dbus_hash_table_remove_all(db->missing_users);
+  _dbus_hash_table_remove_all(db->missing_groups);
 }
 
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
@@ -638,6 +772,12 @@ _dbus_user_database_unref (DBusUserDatabase  *db)
 
       if (db->groups_by_name)
         _dbus_hash_table_unref (db->groups_by_name);
+
+      if (db->missing_users)
+        _dbus_hash_table_unref (db->missing_users);
+
+      if (db->missing_groups)
+        _dbus_hash_table_unref (db->missing_groups);
       
       dbus_free (db);
     }
@@ -48,7 +48,8 @@ struct DBusUserDatabase
   DBusHashTable *groups; /**< Groups in the database by GID */
   DBusHashTable *users_by_name; /**< Users in the database by name */
   DBusHashTable *groups_by_name; /**< Groups in the database by name */
-
+  DBusHashTable *missing_users; /**< UIDs recently not found */
+  DBusHashTable *missing_groups; /**< GIDs recently not found */
 };
 
 
@@ -86,6 +87,14 @@ DBusGroupInfo* _dbus_user_database_lookup_group (DBusUserDatabase *db,
                                                  const DBusString *groupname,
                                                  DBusError        *error);
 DBUS_PRIVATE_EXPORT
+dbus_bool_t    _dbus_user_database_check_missing    (DBusHashTable   *missing,
+                                                     unsigned long    id,
+                                                     DBusError       *error);
+DBUS_PRIVATE_EXPORT
+void           _dbus_user_database_remember_missing (DBusHashTable   *missing,
+                                                     unsigned long    id,
+                                                     const DBusError *error);
+DBUS_PRIVATE_EXPORT
 void           _dbus_user_info_free_allocated   (DBusUserInfo     *info);
 DBUS_PRIVATE_EXPORT
 void           _dbus_group_info_free_allocated  (DBusGroupInfo    *info);
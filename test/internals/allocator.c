@@ -0,0 +1,261 @@
+/* Regression test for dbus_set_allocator()
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * The allocator has to be installed before libdbus allocates anything,
+ * so this is a program of its own rather than part of test-dbus.
+ */
+
+#include <config.h>
+
+#include <dbus/dbus.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Blocks handed out by test_malloc() and test_realloc() and not yet
+ * freed, with the size each was last allocated with */
+#define MAX_BLOCKS 10000
+
+typedef struct {
+    void *memory;
+    size_t bytes;
+} Block;
+
+static Block blocks[MAX_BLOCKS];
+static int n_blocks = 0;
+
+static int n_mallocs = 0;
+static int n_reallocs = 0;
+static int n_frees = 0;
+static int n_hinted = 0;
+static int user_data = 0;
+
+static void
+die (const char *message)
+{
+  fprintf (stderr, "%s\n", message);
+  exit (1);
+}
+
+static Block *
+find_block (void *memory)
+{
+  int i;
+
+  for (i = 0; i < n_blocks; i++)
+    {
+      if (blocks[i].memory == memory)
+        return &blocks[i];
+    }
+
+  die ("libdbus passed on a block that the allocator didn't allocate");
+  return NULL;
+}
+
+/* A size hint is either unknown, or exactly what the block was
+ * allocated or last resized with */
+static void
+check_hint (Block *block,
+    size_t hint)
+{
+  if (hint == 0)
+    return;
+
+  if (hint != block->bytes)
+    {
+      fprintf (stderr, "size hint %lu for a block of %lu bytes\n",
+               (unsigned long) hint, (unsigned long) block->bytes);
+      exit (1);
+    }
+
+  n_hinted++;
+}
+
+static void *
+test_malloc (size_t bytes,
+    void *data)
+{
+  void *memory;
+
+  if (data != &user_data)
+    die ("malloc function got the wrong user data");
+
+  if (bytes == 0)
+    die ("malloc function asked for 0 bytes");
+
+  if (n_blocks == MAX_BLOCKS)
+    die ("too many blocks");
+
+  memory = malloc (bytes);
+
+  if (memory != NULL)
+    {
+      blocks[n_blocks].memory = memory;
+      blocks[n_blocks].bytes = bytes;
+      n_blocks++;
+    }
+
+  n_mallocs++;
+  return memory;
+}
+
+static void *
+test_realloc (void *memory,
+    size_t old_bytes,
+    size_t new_bytes,
+    void *data)
+{
+  Block *block;
+  void *new_memory;
+
+  if (data != &user_data)
+    die ("realloc function got the wrong user data");
+
+  if (memory == NULL || new_bytes == 0)
+    die ("realloc function used as malloc or free");
+
+  block = find_block (memory);
+  check_hint (block, old_bytes);
+
+  new_memory = realloc (memory, new_bytes);
+
+  if (new_memory != NULL)
+    {
+      block->memory = new_memory;
+      block->bytes = new_bytes;
+    }
+
+  n_reallocs++;
+  return new_memory;
+}
+
+static void
+test_free (void *memory,
+    size_t bytes,
+    void *data)
+{
+  Block *block;
+
+  if (data != &user_data)
+    die ("free function got the wrong user data");
+
+  if (memory == NULL)
+    die ("free function asked to free NULL");
+
+  block = find_block (memory);
+  check_hint (block, bytes);
+
+  *block = blocks[--n_blocks];
+  free (memory);
+  n_frees++;
+}
+
+/* This test outputs TAP syntax: http://testanything.org/ */
+int
+main (int argc,
+    char **argv)
+{
+  DBusAllocator allocator;
+  DBusMessage *message;
+  DBusMessageIter iter;
+  char *memory;
+  char text[4096];
+  const char *p = text;
+  int test_num = 0;
+  int i;
+
+  memset (&allocator, '\0', sizeof (allocator));
+  allocator.malloc_function = test_malloc;
+  allocator.realloc_function = test_realloc;
+  allocator.free_function = test_free;
+  allocator.user_data = &user_data;
+
+  /* Nothing has been allocated yet, so it can even be put back */
+  if (!dbus_set_allocator (NULL) || !dbus_set_allocator (&allocator))
+    die ("unable to set allocator");
+  printf ("ok %d - allocator installed\n", ++test_num);
+
+  memory = dbus_malloc (100);
+  if (memory == NULL || n_mallocs != 1 || n_blocks != 1 ||
+      blocks[0].bytes < 100)
+    die ("dbus_malloc() didn't use the allocator");
+
+  memory = dbus_realloc (memory, 10000);
+  if (memory == NULL || n_reallocs != 1 || blocks[0].bytes < 10000)
+    die ("dbus_realloc() didn't use the allocator");
+
+  memset (memory, 'x', 10000);
+  dbus_free (memory);
+  if (n_frees != 1 || n_blocks != 0)
+    die ("dbus_free() didn't use the allocator");
+  printf ("ok %d - dbus_malloc(), dbus_realloc() and dbus_free()\n",
+          ++test_num);
+
+  if (dbus_set_allocator (NULL))
+    die ("allocator changed after first use");
+  printf ("ok %d - allocator can't be changed once used\n", ++test_num);
+
+  /* Building a message grows its strings as it goes */
+  memset (text, 'x', sizeof (text) - 1);
+  text[sizeof (text) - 1] = '\0';
+
+  message = dbus_message_new_signal ("/com/example/Allocator",
+                                     "com.example.Allocator", "Grow");
+  if (message == NULL)
+    die ("out of memory");
+
+  dbus_message_iter_init_append (message, &iter);
+
+  for (i = 0; i < 16; i++)
+    {
+      if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &p))
+        die ("out of memory");
+    }
+
+  dbus_message_unref (message);
+  dbus_shutdown ();
+
+  if (n_reallocs < 2)
+    die ("libdbus didn't resize anything through the allocator");
+
+#ifdef DBUS_ENABLE_STATS
+  /* Memory accounting always knows how big a block is */
+  if (n_hinted != n_reallocs + n_frees)
+    die ("size hints missing");
+#endif
+
+  if (n_blocks != 0)
+    {
+      fprintf (stderr, "%d blocks not freed through the allocator\n",
+               n_blocks);
+      exit (1);
+    }
+  printf ("ok %d - libdbus used the allocator for everything (%d mallocs, "
+          "%d reallocs, %d frees, %d with size hints)\n", ++test_num,
+          n_mallocs, n_reallocs, n_frees, n_hinted);
+
+  printf ("1..%d\n", test_num);
+  return 0;
+}
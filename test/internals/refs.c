@@ -480,7 +480,7 @@ test_pending_call (Fixture *f,
 
   _dbus_connection_lock (f->connection);
   pending_call = _dbus_pending_call_new_unlocked (f->connection,
-      DBUS_TIMEOUT_INFINITE, NULL);
+      DBUS_TIMEOUT_INFINITE);
   g_assert (pending_call != NULL);
   _dbus_connection_unlock (f->connection);
 
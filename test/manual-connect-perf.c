@@ -0,0 +1,383 @@
+/* Manual benchmark for connecting to the bus and for service activation
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * syntax:  manual-connect-perf [CONNECTIONS [ACTIVATIONS [NAME]]]
+ *
+ * Times CONNECTIONS (default 1000) calls to dbus_bus_get_private() on
+ * the session bus, each of which connects, authenticates and says
+ * Hello, and closes each connection before the next.
+ *
+ * Then, if NAME (default org.freedesktop.DBus.TestSuiteEchoService,
+ * which is test/test-service.c) can be activated on that bus, times
+ * ACTIVATIONS (default 20) auto-starting Echo calls to it while it is
+ * not running ("cold"), asking it to Exit after each, and as many Echo
+ * calls while it is running ("warm"). To include activation, run this
+ * on a bus whose <servicedir> is test/data/valid-service-files in the
+ * build directory.
+ *
+ * Results are printed on stdout as JSON, with latencies in
+ * microseconds.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dbus/dbus.h>
+#include <dbus/dbus-sysdeps.h>
+
+#define TEST_SERVICE "org.freedesktop.DBus.TestSuiteEchoService"
+#define TEST_PATH "/org/freedesktop/TestSuite"
+#define TEST_INTERFACE "org.freedesktop.TestSuite"
+
+typedef struct {
+    long *samples;
+    unsigned int n;
+    long total;
+} Latencies;
+
+static void
+die (const char *message)
+{
+  fprintf (stderr, "%s\n", message);
+  exit (1);
+}
+
+static long
+now_usec (void)
+{
+  long tv_sec, tv_usec;
+
+  _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+  return tv_sec * 1000000 + tv_usec;
+}
+
+static void
+latencies_init (Latencies *l,
+    unsigned int count)
+{
+  l->samples = dbus_new0 (long, count);
+  l->n = 0;
+  l->total = 0;
+
+  if (l->samples == NULL)
+    die ("out of memory allocating samples");
+}
+
+static void
+latencies_add (Latencies *l,
+    long usec)
+{
+  l->samples[l->n++] = usec;
+  l->total += usec;
+}
+
+static int
+compare_samples (const void *a,
+    const void *b)
+{
+  long x = *(const long *) a;
+  long y = *(const long *) b;
+
+  return (x > y) - (x < y);
+}
+
+/* nearest-rank percentile of the sorted samples */
+static long
+percentile (const Latencies *l,
+    double p)
+{
+  unsigned int rank = (unsigned int) (p * l->n + 0.999999);
+
+  if (rank < 1)
+    rank = 1;
+
+  return l->samples[rank - 1];
+}
+
+static void
+print_result (const char *name,
+    Latencies *l,
+    dbus_bool_t last)
+{
+  printf ("  \"%s\": {\"count\": %u", name, l->n);
+
+  if (l->n > 0)
+    {
+      qsort (l->samples, l->n, sizeof (long), compare_samples);
+      printf (", \"per_second\": %.1f, \"min\": %ld, \"p50\": %ld, "
+              "\"p99\": %ld, \"p99.9\": %ld, \"max\": %ld",
+              l->total > 0 ? l->n * 1e6 / l->total : 0.0,
+              l->samples[0], percentile (l, 0.5), percentile (l, 0.99),
+              percentile (l, 0.999), l->samples[l->n - 1]);
+    }
+
+  printf ("}%s\n", last ? "" : ",");
+  dbus_free (l->samples);
+}
+
+static void
+time_connections (Latencies *l,
+    unsigned int count)
+{
+  unsigned int i;
+
+  for (i = 0; i < count; i++)
+    {
+      DBusError e = DBUS_ERROR_INIT;
+      DBusConnection *conn;
+      long start = now_usec ();
+
+      conn = dbus_bus_get_private (DBUS_BUS_SESSION, &e);
+
+      if (conn == NULL)
+        {
+          fprintf (stderr, "Unable to connect to session bus: %s: %s\n",
+                   e.name, e.message);
+          exit (1);
+        }
+
+      latencies_add (l, now_usec () - start);
+
+      dbus_connection_close (conn);
+      dbus_connection_unref (conn);
+    }
+}
+
+/* Returns FALSE if @name can't be activated on this bus */
+static dbus_bool_t
+time_echo (DBusConnection *conn,
+    const char *name,
+    Latencies *l)
+{
+  DBusError e = DBUS_ERROR_INIT;
+  DBusMessage *call;
+  DBusMessage *reply;
+  const char *payload = "hello";
+  long start;
+
+  call = dbus_message_new_method_call (name, TEST_PATH, TEST_INTERFACE,
+                                       "Echo");
+
+  if (call == NULL ||
+      !dbus_message_append_args (call, DBUS_TYPE_STRING, &payload,
+                                 DBUS_TYPE_INVALID))
+    die ("out of memory building method call");
+
+  start = now_usec ();
+  reply = dbus_connection_send_with_reply_and_block (conn, call, -1, &e);
+
+  if (reply == NULL)
+    {
+      if (!dbus_error_has_name (&e, DBUS_ERROR_SERVICE_UNKNOWN))
+        {
+          fprintf (stderr, "Unable to call %s: %s: %s\n", name,
+                   e.name, e.message);
+          exit (1);
+        }
+
+      dbus_error_free (&e);
+      dbus_message_unref (call);
+      return FALSE;
+    }
+
+  latencies_add (l, now_usec () - start);
+
+  dbus_message_unref (reply);
+  dbus_message_unref (call);
+  return TRUE;
+}
+
+static DBusHandlerResult
+name_lost_cb (DBusConnection *conn,
+    DBusMessage *message,
+    void *data)
+{
+  dbus_bool_t *lost = data;
+  const char *name, *old_owner, *new_owner;
+
+  if (dbus_message_is_signal (message, DBUS_INTERFACE_DBUS,
+                              "NameOwnerChanged") &&
+      dbus_message_get_args (message, NULL,
+                             DBUS_TYPE_STRING, &name,
+                             DBUS_TYPE_STRING, &old_owner,
+                             DBUS_TYPE_STRING, &new_owner,
+                             DBUS_TYPE_INVALID) &&
+      new_owner[0] == '\0')
+    *lost = TRUE;
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/* Asks the service to exit, and waits until it has lost its name, so
+ * that the next call activates it again */
+static void
+stop_service (DBusConnection *conn,
+    const char *name,
+    dbus_bool_t *lost)
+{
+  DBusMessage *call;
+
+  call = dbus_message_new_method_call (name, TEST_PATH, TEST_INTERFACE,
+                                       "Exit");
+
+  if (call == NULL)
+    die ("out of memory building method call");
+
+  dbus_message_set_no_reply (call, TRUE);
+  dbus_message_set_auto_start (call, FALSE);
+
+  *lost = FALSE;
+
+  if (!dbus_connection_send (conn, call, NULL))
+    die ("out of memory sending method call");
+
+  dbus_message_unref (call);
+
+  while (!*lost)
+    {
+      if (!dbus_connection_read_write_dispatch (conn, -1))
+        die ("disconnected from session bus");
+    }
+}
+
+static void
+time_activation (Latencies *cold,
+    Latencies *warm,
+    unsigned int count,
+    const char *name)
+{
+  DBusError e = DBUS_ERROR_INIT;
+  DBusConnection *conn;
+  dbus_bool_t lost = FALSE;
+  char *rule;
+  unsigned int i;
+
+  conn = dbus_bus_get_private (DBUS_BUS_SESSION, &e);
+
+  if (conn == NULL)
+    {
+      fprintf (stderr, "Unable to connect to session bus: %s: %s\n",
+               e.name, e.message);
+      exit (1);
+    }
+
+  rule = dbus_malloc (strlen (name) + 100);
+
+  if (rule == NULL)
+    die ("out of memory building match rule");
+
+  sprintf (rule, "type='signal',sender='" DBUS_SERVICE_DBUS "',"
+           "member='NameOwnerChanged',arg0='%s'", name);
+  dbus_bus_add_match (conn, rule, &e);
+  dbus_free (rule);
+
+  if (dbus_error_is_set (&e))
+    {
+      fprintf (stderr, "Unable to add match rule: %s: %s\n",
+               e.name, e.message);
+      exit (1);
+    }
+
+  if (!dbus_connection_add_filter (conn, name_lost_cb, &lost, NULL))
+    die ("out of memory adding filter");
+
+  /* a copy left running by someone else would make the first call warm */
+  if (dbus_bus_name_has_owner (conn, name, NULL))
+    stop_service (conn, name, &lost);
+
+  for (i = 0; i < count; i++)
+    {
+      if (!time_echo (conn, name, cold))
+        {
+          fprintf (stderr, "%s is not activatable on this bus, "
+                   "not timing activation\n", name);
+          break;
+        }
+
+      stop_service (conn, name, &lost);
+    }
+
+  if (cold->n > 0)
+    {
+      /* the cold calls left it stopped */
+      if (!dbus_bus_start_service_by_name (conn, name, 0, NULL, &e))
+        {
+          fprintf (stderr, "Unable to start %s: %s: %s\n", name,
+                   e.name, e.message);
+          exit (1);
+        }
+
+      for (i = 0; i < count; i++)
+        {
+          if (!time_echo (conn, name, warm))
+            die ("service stopped while timing warm calls");
+        }
+
+      stop_service (conn, name, &lost);
+    }
+
+  dbus_connection_close (conn);
+  dbus_connection_unref (conn);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  unsigned int connections = 1000;
+  unsigned int activations = 20;
+  const char *name = TEST_SERVICE;
+  Latencies connect, cold, warm;
+
+  if (argc > 1)
+    connections = strtoul (argv[1], NULL, 10);
+
+  if (argc > 2)
+    activations = strtoul (argv[2], NULL, 10);
+
+  if (argc > 3)
+    name = argv[3];
+
+  if (connections < 1 || activations < 1)
+    die ("syntax: manual-connect-perf [CONNECTIONS [ACTIVATIONS [NAME]]]");
+
+  latencies_init (&connect, connections);
+  latencies_init (&cold, activations);
+  latencies_init (&warm, activations);
+
+  time_connections (&connect, connections);
+  time_activation (&cold, &warm, activations, name);
+
+  printf ("{\n");
+  print_result ("connect", &connect, FALSE);
+  print_result ("cold_activation", &cold, FALSE);
+  print_result ("warm_activation", &warm, TRUE);
+  printf ("}\n");
+
+  dbus_shutdown ();
+  return 0;
+}
@@ -0,0 +1,583 @@
+/* Manual benchmark for message marshalling and demarshalling
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * syntax:  manual-marshal-perf [SCALE]
+ *
+ * For each message body in the corpus below, times building it with
+ * dbus_message_append_args() (where that can express it) and with
+ * DBusMessageIter, reading it back, dbus_message_iter_get_fixed_array(),
+ * _dbus_validate_body_with_reason(), byteswapping, and
+ * dbus_message_marshal() / dbus_message_demarshal(). Each operation is
+ * repeated the corpus entry's iteration count times SCALE (default 1).
+ *
+ * Results are printed on stdout as JSON.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dbus/dbus.h>
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-marshal-basic.h>
+#include <dbus/dbus-marshal-byteswap.h>
+#include <dbus/dbus-marshal-validate.h>
+#include <dbus/dbus-message-internal.h>
+#include <dbus/dbus-string.h>
+#include <dbus/dbus-sysdeps.h>
+
+typedef struct {
+    const char *name;
+    /* NULL if dbus_message_append_args() can't express this body */
+    dbus_bool_t (* append_args) (DBusMessage *message);
+    dbus_bool_t (* build) (DBusMessageIter *iter);
+    int iterations;
+} Corpus;
+
+static int scale = 1;
+static dbus_bool_t first_result = TRUE;
+
+/* one large shared payload for the byte arrays */
+#define BIG_AY_BYTES (1024 * 1024)
+static char big_ay[BIG_AY_BYTES];
+
+#define N_INTS 1024
+static dbus_int32_t ints[N_INTS];
+
+static void
+die (const char *message)
+{
+  fprintf (stderr, "%s\n", message);
+  exit (1);
+}
+
+static dbus_int64_t
+now_usec (void)
+{
+  long tv_sec, tv_usec;
+
+  _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+  return ((dbus_int64_t) tv_sec) * 1000000 + tv_usec;
+}
+
+/* ---- corpus ---- */
+
+static const char *basic_string = "hello, world!";
+static const char *basic_path = "/com/example/Object";
+static dbus_uint32_t basic_uint32 = 0xdeadbeef;
+static dbus_int64_t basic_int64 = -42;
+static double basic_double = 3.14159;
+static dbus_bool_t basic_boolean = TRUE;
+
+static dbus_bool_t
+append_args_basic (DBusMessage *message)
+{
+  const dbus_int32_t *p = ints;
+
+  return dbus_message_append_args (message,
+      DBUS_TYPE_STRING, &basic_string,
+      DBUS_TYPE_OBJECT_PATH, &basic_path,
+      DBUS_TYPE_UINT32, &basic_uint32,
+      DBUS_TYPE_INT64, &basic_int64,
+      DBUS_TYPE_DOUBLE, &basic_double,
+      DBUS_TYPE_BOOLEAN, &basic_boolean,
+      DBUS_TYPE_ARRAY, DBUS_TYPE_INT32, &p, N_INTS,
+      DBUS_TYPE_INVALID);
+}
+
+static dbus_bool_t
+build_basic (DBusMessageIter *iter)
+{
+  DBusMessageIter array;
+  const dbus_int32_t *p = ints;
+
+  return dbus_message_iter_append_basic (iter, DBUS_TYPE_STRING,
+          &basic_string) &&
+      dbus_message_iter_append_basic (iter, DBUS_TYPE_OBJECT_PATH,
+          &basic_path) &&
+      dbus_message_iter_append_basic (iter, DBUS_TYPE_UINT32,
+          &basic_uint32) &&
+      dbus_message_iter_append_basic (iter, DBUS_TYPE_INT64, &basic_int64) &&
+      dbus_message_iter_append_basic (iter, DBUS_TYPE_DOUBLE,
+          &basic_double) &&
+      dbus_message_iter_append_basic (iter, DBUS_TYPE_BOOLEAN,
+          &basic_boolean) &&
+      dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY,
+          DBUS_TYPE_INT32_AS_STRING, &array) &&
+      dbus_message_iter_append_fixed_array (&array, DBUS_TYPE_INT32, &p,
+          N_INTS) &&
+      dbus_message_iter_close_container (iter, &array);
+}
+
+static dbus_bool_t
+append_args_ay (DBusMessage *message)
+{
+  const char *p = big_ay;
+
+  return dbus_message_append_args (message,
+      DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &p, BIG_AY_BYTES,
+      DBUS_TYPE_INVALID);
+}
+
+static dbus_bool_t
+build_ay (DBusMessageIter *iter)
+{
+  DBusMessageIter array;
+  const char *p = big_ay;
+
+  return dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY,
+          DBUS_TYPE_BYTE_AS_STRING, &array) &&
+      dbus_message_iter_append_fixed_array (&array, DBUS_TYPE_BYTE, &p,
+          BIG_AY_BYTES) &&
+      dbus_message_iter_close_container (iter, &array);
+}
+
+/* an a{sv} of n properties with a realistic mix of value types */
+static dbus_bool_t
+append_properties (DBusMessageIter *iter,
+    int n)
+{
+  DBusMessageIter array, entry, variant, inner;
+  char name[32];
+  const char *p = name;
+  int i, j;
+
+  if (!dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY, "{sv}",
+          &array))
+    return FALSE;
+
+  for (i = 0; i < n; i++)
+    {
+      dbus_bool_t ok;
+
+      snprintf (name, sizeof (name), "Property%d", i);
+
+      if (!dbus_message_iter_open_container (&array, DBUS_TYPE_DICT_ENTRY,
+              NULL, &entry) ||
+          !dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING, &p))
+        return FALSE;
+
+      switch (i % 4)
+        {
+          case 0:
+            ok = dbus_message_iter_open_container (&entry, DBUS_TYPE_VARIANT,
+                    DBUS_TYPE_STRING_AS_STRING, &variant) &&
+                dbus_message_iter_append_basic (&variant, DBUS_TYPE_STRING,
+                    &basic_string);
+            break;
+
+          case 1:
+            ok = dbus_message_iter_open_container (&entry, DBUS_TYPE_VARIANT,
+                    DBUS_TYPE_UINT32_AS_STRING, &variant) &&
+                dbus_message_iter_append_basic (&variant, DBUS_TYPE_UINT32,
+                    &basic_uint32);
+            break;
+
+          case 2:
+            ok = dbus_message_iter_open_container (&entry, DBUS_TYPE_VARIANT,
+                    DBUS_TYPE_BOOLEAN_AS_STRING, &variant) &&
+                dbus_message_iter_append_basic (&variant, DBUS_TYPE_BOOLEAN,
+                    &basic_boolean);
+            break;
+
+          default:
+            ok = dbus_message_iter_open_container (&entry, DBUS_TYPE_VARIANT,
+                    "as", &variant) &&
+                dbus_message_iter_open_container (&variant, DBUS_TYPE_ARRAY,
+                    DBUS_TYPE_STRING_AS_STRING, &inner);
+
+            for (j = 0; ok && j < 3; j++)
+              ok = dbus_message_iter_append_basic (&inner, DBUS_TYPE_STRING,
+                  &basic_string);
+
+            ok = ok && dbus_message_iter_close_container (&variant, &inner);
+            break;
+        }
+
+      if (!ok ||
+          !dbus_message_iter_close_container (&entry, &variant) ||
+          !dbus_message_iter_close_container (&array, &entry))
+        return FALSE;
+    }
+
+  return dbus_message_iter_close_container (iter, &array);
+}
+
+static dbus_bool_t
+build_asv (DBusMessageIter *iter)
+{
+  return append_properties (iter, 20);
+}
+
+/* shaped like ObjectManager.GetManagedObjects(), but as an array */
+static dbus_bool_t
+build_managed_objects (DBusMessageIter *iter)
+{
+  DBusMessageIter array, object, interfaces, entry;
+  char path[64], interface[64];
+  const char *p;
+  int i, j;
+
+  if (!dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY,
+          "(oa{sa{sv}})", &array))
+    return FALSE;
+
+  for (i = 0; i < 50; i++)
+    {
+      snprintf (path, sizeof (path), "/com/example/Object%d", i);
+      p = path;
+
+      if (!dbus_message_iter_open_container (&array, DBUS_TYPE_STRUCT, NULL,
+              &object) ||
+          !dbus_message_iter_append_basic (&object, DBUS_TYPE_OBJECT_PATH,
+              &p) ||
+          !dbus_message_iter_open_container (&object, DBUS_TYPE_ARRAY,
+              "{sa{sv}}", &interfaces))
+        return FALSE;
+
+      for (j = 0; j < 3; j++)
+        {
+          snprintf (interface, sizeof (interface), "com.example.Interface%d",
+                    j);
+          p = interface;
+
+          if (!dbus_message_iter_open_container (&interfaces,
+                  DBUS_TYPE_DICT_ENTRY, NULL, &entry) ||
+              !dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING, &p) ||
+              !append_properties (&entry, 5) ||
+              !dbus_message_iter_close_container (&interfaces, &entry))
+            return FALSE;
+        }
+
+      if (!dbus_message_iter_close_container (&object, &interfaces) ||
+          !dbus_message_iter_close_container (&array, &object))
+        return FALSE;
+    }
+
+  return dbus_message_iter_close_container (iter, &array);
+}
+
+static const Corpus corpus[] = {
+    { "souxdbai", append_args_basic, build_basic, 20000 },
+    { "a{sv}", NULL, build_asv, 10000 },
+    { "a(oa{sa{sv}})", NULL, build_managed_objects, 200 },
+    { "ay", append_args_ay, build_ay, 200 }
+};
+
+/* ---- operations ---- */
+
+static DBusMessage *
+new_message (void)
+{
+  DBusMessage *message;
+
+  message = dbus_message_new_signal ("/com/example/Perf", "com.example.Perf",
+      "Bench");
+
+  if (message == NULL)
+    die ("out of memory allocating message");
+
+  return message;
+}
+
+static DBusMessage *
+build_message (const Corpus *c)
+{
+  DBusMessage *message = new_message ();
+  DBusMessageIter iter;
+
+  dbus_message_iter_init_append (message, &iter);
+
+  if (!c->build (&iter))
+    die ("out of memory building message");
+
+  return message;
+}
+
+static void
+report (const Corpus *c,
+    const char *operation,
+    int iterations,
+    dbus_int64_t usec,
+    int body_bytes)
+{
+  double seconds = usec / 1000000.0;
+
+  if (seconds <= 0)
+    seconds = 0.000001;
+
+  printf ("%s    {\"corpus\": \"%s\", \"operation\": \"%s\", "
+          "\"iterations\": %d, \"body_bytes\": %d, \"ns_per_op\": %.1f, "
+          "\"mb_per_second\": %.1f}",
+          first_result ? "" : ",\n",
+          c->name, operation, iterations, body_bytes,
+          seconds * 1e9 / iterations,
+          (double) body_bytes * iterations / seconds / (1024 * 1024));
+  first_result = FALSE;
+  fflush (stdout);
+}
+
+/* read back every value in the body, as a client would */
+static void
+read_values (DBusMessageIter *iter)
+{
+  do
+    {
+      int type = dbus_message_iter_get_arg_type (iter);
+
+      if (type == DBUS_TYPE_INVALID)
+        break;
+
+      if (dbus_type_is_basic (type))
+        {
+          DBusBasicValue value;
+
+          dbus_message_iter_get_basic (iter, &value);
+        }
+      else if (type == DBUS_TYPE_ARRAY &&
+               dbus_type_is_fixed (dbus_message_iter_get_element_type (iter)))
+        {
+          DBusMessageIter sub;
+          const void *values;
+          int n_elements;
+
+          /* nobody reads these one element at a time */
+          dbus_message_iter_recurse (iter, &sub);
+          dbus_message_iter_get_fixed_array (&sub, &values, &n_elements);
+        }
+      else
+        {
+          DBusMessageIter sub;
+
+          dbus_message_iter_recurse (iter, &sub);
+          read_values (&sub);
+        }
+    }
+  while (dbus_message_iter_next (iter));
+}
+
+/* how many top-level fixed-size arrays there are, reading each once */
+static int
+get_fixed_arrays (DBusMessage *message)
+{
+  DBusMessageIter iter, sub;
+  int n = 0;
+
+  if (!dbus_message_iter_init (message, &iter))
+    return 0;
+
+  do
+    {
+      if (dbus_message_iter_get_arg_type (&iter) == DBUS_TYPE_ARRAY &&
+          dbus_type_is_fixed (dbus_message_iter_get_element_type (&iter)))
+        {
+          const void *values;
+          int n_elements;
+
+          dbus_message_iter_recurse (&iter, &sub);
+          dbus_message_iter_get_fixed_array (&sub, &values, &n_elements);
+          n++;
+        }
+    }
+  while (dbus_message_iter_next (&iter));
+
+  return n;
+}
+
+static void
+run_corpus (const Corpus *c)
+{
+  DBusMessage *message;
+  DBusMessageIter iter;
+  const DBusString *header, *body;
+  DBusString signature, swapped;
+  int iterations = c->iterations * scale;
+  int body_bytes, blob_len, byte_order, i;
+  dbus_int64_t start, elapsed;
+  DBusValidity validity;
+  char *blob;
+
+  if (c->append_args != NULL)
+    {
+      start = now_usec ();
+
+      for (i = 0; i < iterations; i++)
+        {
+          message = new_message ();
+
+          if (!c->append_args (message))
+            die ("out of memory appending arguments");
+
+          dbus_message_unref (message);
+        }
+
+      elapsed = now_usec () - start;
+      message = new_message ();
+
+      if (!c->append_args (message))
+        die ("out of memory appending arguments");
+
+      dbus_message_lock (message);
+      _dbus_message_get_network_data (message, &header, &body);
+      report (c, "append_args", iterations, elapsed,
+              _dbus_string_get_length (body));
+      dbus_message_unref (message);
+    }
+
+  start = now_usec ();
+
+  for (i = 0; i < iterations; i++)
+    dbus_message_unref (build_message (c));
+
+  elapsed = now_usec () - start;
+  message = build_message (c);
+  dbus_message_set_serial (message, 1);
+  dbus_message_lock (message);
+  _dbus_message_get_network_data (message, &header, &body);
+  body_bytes = _dbus_string_get_length (body);
+  report (c, "iter_build", iterations, elapsed, body_bytes);
+
+  start = now_usec ();
+
+  for (i = 0; i < iterations; i++)
+    {
+      if (dbus_message_iter_init (message, &iter))
+        read_values (&iter);
+    }
+
+  report (c, "iter_read", iterations, now_usec () - start, body_bytes);
+
+  if (get_fixed_arrays (message) > 0)
+    {
+      start = now_usec ();
+
+      for (i = 0; i < iterations; i++)
+        get_fixed_arrays (message);
+
+      report (c, "get_fixed_array", iterations, now_usec () - start,
+              body_bytes);
+    }
+
+  _dbus_string_init_const (&signature, dbus_message_get_signature (message));
+  byte_order = DBUS_COMPILER_BYTE_ORDER;
+  start = now_usec ();
+
+  for (i = 0; i < iterations; i++)
+    {
+      validity = _dbus_validate_body_with_reason (&signature, 0, byte_order,
+          NULL, body, 0, body_bytes);
+
+      if (validity != DBUS_VALID)
+        die (_dbus_validity_to_error_message (validity));
+    }
+
+  report (c, "validate_body", iterations, now_usec () - start, body_bytes);
+
+  /* swap a copy back and forth, so it's valid again after an even
+   * number of iterations */
+  if (!_dbus_string_init (&swapped) ||
+      !_dbus_string_copy (body, 0, &swapped, 0))
+    die ("out of memory copying body");
+
+  start = now_usec ();
+
+  for (i = 0; i < iterations; i++)
+    {
+      int new_byte_order = (byte_order == DBUS_LITTLE_ENDIAN ?
+                            DBUS_BIG_ENDIAN : DBUS_LITTLE_ENDIAN);
+
+      _dbus_marshal_byteswap (&signature, 0, byte_order, new_byte_order,
+                              &swapped, 0);
+      byte_order = new_byte_order;
+    }
+
+  report (c, "byteswap", iterations, now_usec () - start, body_bytes);
+  _dbus_string_free (&swapped);
+
+  start = now_usec ();
+
+  for (i = 0; i < iterations; i++)
+    {
+      if (!dbus_message_marshal (message, &blob, &blob_len))
+        die ("out of memory marshalling message");
+
+      dbus_free (blob);
+    }
+
+  report (c, "marshal", iterations, now_usec () - start, body_bytes);
+
+  if (!dbus_message_marshal (message, &blob, &blob_len))
+    die ("out of memory marshalling message");
+
+  start = now_usec ();
+
+  for (i = 0; i < iterations; i++)
+    {
+      DBusMessage *copy;
+      DBusError e = DBUS_ERROR_INIT;
+
+      copy = dbus_message_demarshal (blob, blob_len, &e);
+
+      if (copy == NULL)
+        die (e.message);
+
+      dbus_message_unref (copy);
+    }
+
+  report (c, "demarshal", iterations, now_usec () - start, body_bytes);
+
+  dbus_free (blob);
+  dbus_message_unref (message);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  unsigned int i;
+
+  if (argc > 1)
+    scale = atoi (argv[1]);
+
+  if (scale < 1)
+    die ("syntax: manual-marshal-perf [SCALE]");
+
+  for (i = 0; i < BIG_AY_BYTES; i++)
+    big_ay[i] = i & 0xff;
+
+  for (i = 0; i < N_INTS; i++)
+    ints[i] = i;
+
+  printf ("{\n  \"results\": [\n");
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (corpus); i++)
+    run_corpus (&corpus[i]);
+
+  printf ("\n  ]\n}\n");
+
+  dbus_shutdown ();
+  return 0;
+}
@@ -0,0 +1,444 @@
+/* Manual benchmark for the dbus-daemon's memory use per client
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * syntax:  manual-memory-perf [CLIENTS [RULES [NAMES]]]
+ *
+ * Starts a dbus-daemon ($DBUS_TEST_DAEMON, or dbus-daemon from the
+ * PATH) with $DBUS_TEST_DATA/valid-config-files/session.conf, or with
+ * --session if DBUS_TEST_DATA is unset. Then connects CLIENTS (default
+ * 500) clients that stay idle, adds RULES (default 10) distinct match
+ * rules for each, and makes each own NAMES (default 2) well-known
+ * names. After each step it measures the dbus-daemon's resident set
+ * size, from /proc, and if it was built with --enable-stats, the
+ * bytes it has allocated with dbus_malloc(), in total and by
+ * subsystem, from Debug.Stats.GetStats. The growth over each step is
+ * reported per connection, per match rule and per name.
+ *
+ * Results are printed on stdout as JSON, in bytes.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <dbus/dbus.h>
+
+#define BUS_STATS_INTERFACE "org.freedesktop.DBus.Debug.Stats"
+
+/* more than enough for the subsystems the dbus-daemon counts */
+#define MAX_TAGS 32
+
+typedef struct {
+    long rss;
+    /* -1 if the dbus-daemon doesn't count its allocations */
+    long allocated;
+    unsigned int n_tags;
+    char *tag_names[MAX_TAGS];
+    long tag_bytes[MAX_TAGS];
+} Sample;
+
+static void
+die (const char *message)
+{
+  fprintf (stderr, "%s\n", message);
+  exit (1);
+}
+
+static char *
+start_daemon (pid_t *pid)
+{
+  const char *daemon = getenv ("DBUS_TEST_DAEMON");
+  const char *data = getenv ("DBUS_TEST_DATA");
+  char config[4096];
+  char address[4096];
+  size_t len = 0;
+  int fds[2];
+
+  if (daemon == NULL)
+    daemon = "dbus-daemon";
+
+  if (data != NULL)
+    snprintf (config, sizeof (config),
+              "--config-file=%s/valid-config-files/session.conf", data);
+  else
+    strcpy (config, "--session");
+
+  if (pipe (fds) != 0)
+    die ("unable to create pipe");
+
+  *pid = fork ();
+
+  if (*pid < 0)
+    die ("unable to fork");
+
+  if (*pid == 0)
+    {
+      char print_address[32];
+
+      close (fds[0]);
+      snprintf (print_address, sizeof (print_address),
+                "--print-address=%d", fds[1]);
+      execlp (daemon, daemon, config, "--nofork", print_address,
+              (char *) NULL);
+      fprintf (stderr, "Unable to run %s: %s\n", daemon, strerror (errno));
+      _exit (1);
+    }
+
+  close (fds[1]);
+
+  while (len < sizeof (address) - 1)
+    {
+      ssize_t bytes = read (fds[0], address + len, sizeof (address) - 1 - len);
+
+      if (bytes < 0 && errno == EINTR)
+        continue;
+
+      if (bytes <= 0)
+        die ("dbus-daemon did not print its address");
+
+      len += bytes;
+      address[len] = '\0';
+
+      if (strchr (address, '\n') != NULL)
+        break;
+    }
+
+  close (fds[0]);
+  *strchr (address, '\n') = '\0';
+  return strdup (address);
+}
+
+static DBusConnection *
+connect_client (const char *address)
+{
+  DBusError e = DBUS_ERROR_INIT;
+  DBusConnection *conn;
+
+  conn = dbus_connection_open_private (address, &e);
+
+  if (conn == NULL || !dbus_bus_register (conn, &e))
+    {
+      fprintf (stderr, "Unable to connect to %s: %s: %s\n", address,
+               e.name, e.message);
+      exit (1);
+    }
+
+  return conn;
+}
+
+static long
+read_rss (pid_t pid)
+{
+  char path[64];
+  char line[256];
+  long kb = -1;
+  FILE *file;
+
+  snprintf (path, sizeof (path), "/proc/%ld/status", (long) pid);
+  file = fopen (path, "r");
+
+  if (file == NULL)
+    return -1;
+
+  while (fgets (line, sizeof (line), file) != NULL)
+    {
+      if (sscanf (line, "VmRSS: %ld kB", &kb) == 1)
+        break;
+    }
+
+  fclose (file);
+  return kb < 0 ? -1 : kb * 1024;
+}
+
+static void
+read_allocated (DBusConnection *conn,
+    Sample *sample)
+{
+  DBusError e = DBUS_ERROR_INIT;
+  DBusMessage *call;
+  DBusMessage *reply;
+  DBusMessageIter iter, arr_iter;
+  const char *suffix = "MemoryBytes";
+
+  sample->allocated = -1;
+  sample->n_tags = 0;
+
+  call = dbus_message_new_method_call (DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+                                       BUS_STATS_INTERFACE, "GetStats");
+
+  if (call == NULL)
+    die ("out of memory building method call");
+
+  reply = dbus_connection_send_with_reply_and_block (conn, call, -1, &e);
+  dbus_message_unref (call);
+
+  if (reply == NULL)
+    {
+      /* not built with --enable-stats */
+      dbus_error_free (&e);
+      return;
+    }
+
+  dbus_message_iter_init (reply, &iter);
+
+  if (dbus_message_iter_get_arg_type (&iter) != DBUS_TYPE_ARRAY)
+    die ("GetStats returned something other than a{sv}");
+
+  dbus_message_iter_recurse (&iter, &arr_iter);
+
+  while (dbus_message_iter_get_arg_type (&arr_iter) == DBUS_TYPE_DICT_ENTRY)
+    {
+      DBusMessageIter entry, variant;
+      const char *key;
+      size_t key_len, suffix_len = strlen (suffix);
+      dbus_uint64_t bytes;
+
+      dbus_message_iter_recurse (&arr_iter, &entry);
+      dbus_message_iter_get_basic (&entry, &key);
+      dbus_message_iter_next (&entry);
+      dbus_message_iter_recurse (&entry, &variant);
+      key_len = strlen (key);
+
+      if (key_len > suffix_len &&
+          strcmp (key + key_len - suffix_len, suffix) == 0 &&
+          dbus_message_iter_get_arg_type (&variant) == DBUS_TYPE_UINT64 &&
+          sample->n_tags < MAX_TAGS)
+        {
+          dbus_message_iter_get_basic (&variant, &bytes);
+
+          sample->tag_names[sample->n_tags] = strndup (key,
+                                                       key_len - suffix_len);
+
+          if (sample->tag_names[sample->n_tags] == NULL)
+            die ("out of memory copying GetStats key");
+
+          sample->tag_bytes[sample->n_tags] = (long) bytes;
+          sample->allocated = (sample->allocated < 0 ? 0 :
+                               sample->allocated) + (long) bytes;
+          sample->n_tags++;
+        }
+
+      dbus_message_iter_next (&arr_iter);
+    }
+
+  dbus_message_unref (reply);
+}
+
+static void
+take_sample (DBusConnection *conn,
+    pid_t pid,
+    Sample *sample)
+{
+  /* GetStats only replies once everything sent before it is handled */
+  read_allocated (conn, sample);
+  sample->rss = read_rss (pid);
+}
+
+static void
+free_sample (Sample *sample)
+{
+  unsigned int i;
+
+  for (i = 0; i < sample->n_tags; i++)
+    free (sample->tag_names[i]);
+}
+
+/* growth from before to after, divided by count */
+static void
+print_growth (const char *name,
+    const Sample *before,
+    const Sample *after,
+    unsigned int count,
+    dbus_bool_t last)
+{
+  unsigned int i;
+
+  printf ("  \"%s\": {\"count\": %u", name, count);
+
+  if (before->rss >= 0 && after->rss >= 0)
+    printf (", \"rss\": %.1f", (double) (after->rss - before->rss) / count);
+
+  if (before->allocated >= 0 && after->allocated >= 0)
+    {
+      printf (", \"allocated\": %.1f",
+              (double) (after->allocated - before->allocated) / count);
+
+      /* the dbus-daemon always lists the same tags in the same order */
+      for (i = 0; i < after->n_tags && i < before->n_tags; i++)
+        printf (", \"%s\": %.1f", after->tag_names[i],
+                (double) (after->tag_bytes[i] - before->tag_bytes[i]) /
+                count);
+    }
+
+  printf ("}%s\n", last ? "" : ",");
+}
+
+static void
+add_rules (DBusConnection *conn,
+    unsigned int client,
+    unsigned int count)
+{
+  DBusError e = DBUS_ERROR_INIT;
+  char rule[256];
+  unsigned int i;
+
+  for (i = 0; i < count; i++)
+    {
+      /* distinct, so that none can share another's storage */
+      snprintf (rule, sizeof (rule),
+                "type='signal',interface='com.example.MemoryPerf',"
+                "member='Member%u',arg0='client%u'", i, client);
+      dbus_bus_add_match (conn, rule, &e);
+
+      if (dbus_error_is_set (&e))
+        {
+          fprintf (stderr, "Unable to add match rule: %s: %s\n",
+                   e.name, e.message);
+          exit (1);
+        }
+    }
+}
+
+static void
+request_names (DBusConnection *conn,
+    unsigned int client,
+    unsigned int count)
+{
+  DBusError e = DBUS_ERROR_INIT;
+  char name[256];
+  unsigned int i;
+
+  for (i = 0; i < count; i++)
+    {
+      snprintf (name, sizeof (name), "com.example.MemoryPerf.Client%u.Name%u",
+                client, i);
+
+      if (dbus_bus_request_name (conn, name, DBUS_NAME_FLAG_DO_NOT_QUEUE,
+                                 &e) != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+        {
+          fprintf (stderr, "Unable to own %s: %s: %s\n", name,
+                   e.name ? e.name : "not primary owner",
+                   e.message ? e.message : "");
+          exit (1);
+        }
+    }
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  unsigned int n_clients = 500;
+  unsigned int n_rules = 10;
+  unsigned int n_names = 2;
+  DBusConnection *control;
+  DBusConnection **clients;
+  Sample idle, connected, with_rules, with_names;
+  char *address;
+  pid_t pid;
+  unsigned int i;
+
+  if (argc > 1)
+    n_clients = strtoul (argv[1], NULL, 10);
+
+  if (argc > 2)
+    n_rules = strtoul (argv[2], NULL, 10);
+
+  if (argc > 3)
+    n_names = strtoul (argv[3], NULL, 10);
+
+  if (n_clients < 1 || n_rules < 1 || n_names < 1)
+    die ("syntax: manual-memory-perf [CLIENTS [RULES [NAMES]]]");
+
+  clients = dbus_new0 (DBusConnection *, n_clients);
+
+  if (clients == NULL)
+    die ("out of memory allocating clients");
+
+  address = start_daemon (&pid);
+
+  if (address == NULL)
+    die ("out of memory copying address");
+
+  control = connect_client (address);
+  take_sample (control, pid, &idle);
+
+  for (i = 0; i < n_clients; i++)
+    clients[i] = connect_client (address);
+
+  take_sample (control, pid, &connected);
+
+  for (i = 0; i < n_clients; i++)
+    add_rules (clients[i], i, n_rules);
+
+  take_sample (control, pid, &with_rules);
+
+  for (i = 0; i < n_clients; i++)
+    request_names (clients[i], i, n_names);
+
+  take_sample (control, pid, &with_names);
+
+  printf ("{\n  \"clients\": %u,\n  \"rules_per_client\": %u,\n"
+          "  \"names_per_client\": %u,\n", n_clients, n_rules, n_names);
+  printf ("  \"idle\": {\"rss\": %ld", idle.rss);
+
+  if (idle.allocated >= 0)
+    printf (", \"allocated\": %ld", idle.allocated);
+
+  printf ("},\n");
+  print_growth ("per_connection", &idle, &connected, n_clients, FALSE);
+  print_growth ("per_match_rule", &connected, &with_rules,
+                n_clients * n_rules, FALSE);
+  print_growth ("per_name", &with_rules, &with_names,
+                n_clients * n_names, TRUE);
+  printf ("}\n");
+
+  for (i = 0; i < n_clients; i++)
+    {
+      dbus_connection_close (clients[i]);
+      dbus_connection_unref (clients[i]);
+    }
+
+  dbus_connection_close (control);
+  dbus_connection_unref (control);
+  kill (pid, SIGTERM);
+  waitpid (pid, NULL, 0);
+
+  free_sample (&idle);
+  free_sample (&connected);
+  free_sample (&with_rules);
+  free_sample (&with_names);
+  free (address);
+  dbus_free (clients);
+  dbus_shutdown ();
+  return 0;
+}
@@ -0,0 +1,454 @@
+/* Manual throughput benchmark for relaying messages between connections
+ *
+ * Based on test/relay.c, Copyright © 2010-2011 Nokia Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * syntax:  manual-relay-perf [MESSAGES [ADDRESS]]
+ *
+ * Builds the same miniature dbus-daemon as test/relay.c, then for each
+ * payload signature and size, times how long it takes to build
+ * MESSAGES signals (default 10000; fewer for large payloads), send them
+ * from the left client, relay them through the server connections and
+ * receive them on the right client. Everything runs in this process on
+ * a DBusLoop, so the results cover libdbus marshalling, transport and
+ * dispatch but none of the dbus-daemon's routing or policy.
+ *
+ * Results are printed on stdout as JSON.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <dbus/dbus.h>
+#include <dbus/dbus-sysdeps.h>
+
+#include "test-utils.h"
+
+/* left      socket     left      dispatch     right    socket     right
+ * client ===========>  server --------------> server ===========> client
+ * conn                 conn                   conn                conn
+ */
+typedef struct {
+    TestMainContext *ctx;
+
+    DBusServer *server;
+
+    DBusConnection *left_client_conn;
+    DBusConnection *left_server_conn;
+
+    DBusConnection *right_server_conn;
+    DBusConnection *right_client_conn;
+
+    unsigned int n_received;
+} Fixture;
+
+typedef struct {
+    const char *signature;
+    int payload_bytes;
+} Case;
+
+static const Case cases[] = {
+    { "", 0 },
+    { "ay", 64 },
+    { "ay", 4096 },
+    { "ay", 65536 },
+    { "ay", 1048576 },
+    { "s", 64 },
+    { "s", 4096 },
+    { "s", 65536 },
+    { "as", 4096 },
+    { "as", 65536 },
+    { "a{sv}", 4096 },
+    { "a{sv}", 65536 }
+};
+
+/* at most this many messages are between the left and right clients */
+#define WINDOW 64
+
+/* above this payload size, send proportionally fewer messages */
+#define FULL_COUNT_BYTES 4096
+
+/* but never fewer than this */
+#define MIN_COUNT 100
+
+static void
+die (const char *message)
+{
+  fprintf (stderr, "%s\n", message);
+  exit (1);
+}
+
+static DBusHandlerResult
+server_message_cb (DBusConnection *server_conn,
+    DBusMessage *message,
+    void *data)
+{
+  Fixture *f = data;
+
+  if (!dbus_connection_send (f->right_server_conn, message, NULL))
+    die ("out of memory relaying message");
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static DBusHandlerResult
+right_client_message_cb (DBusConnection *client_conn,
+    DBusMessage *message,
+    void *data)
+{
+  Fixture *f = data;
+
+  f->n_received++;
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static void
+new_conn_cb (DBusServer *server,
+    DBusConnection *server_conn,
+    void *data)
+{
+  Fixture *f = data;
+
+  if (f->left_server_conn == NULL)
+    {
+      f->left_server_conn = dbus_connection_ref (server_conn);
+
+      if (!dbus_connection_add_filter (server_conn, server_message_cb,
+                                       f, NULL))
+        die ("out of memory adding filter");
+    }
+  else
+    {
+      f->right_server_conn = dbus_connection_ref (server_conn);
+    }
+
+  if (!test_connection_setup (f->ctx, server_conn))
+    die ("out of memory setting up connection");
+}
+
+static DBusConnection *
+connect_client (Fixture *f,
+    const char *address,
+    DBusConnection **server_conn_p)
+{
+  DBusError e = DBUS_ERROR_INIT;
+  DBusConnection *client_conn;
+
+  client_conn = dbus_connection_open_private (address, &e);
+
+  if (client_conn == NULL)
+    {
+      fprintf (stderr, "Unable to connect to %s: %s: %s\n", address,
+               e.name, e.message);
+      exit (1);
+    }
+
+  if (!test_connection_setup (f->ctx, client_conn))
+    die ("out of memory setting up connection");
+
+  while (*server_conn_p == NULL)
+    test_main_context_iterate (f->ctx, TRUE);
+
+  return client_conn;
+}
+
+static void
+setup (Fixture *f,
+    const char *listen_address)
+{
+  DBusError e = DBUS_ERROR_INIT;
+  char *address;
+
+  memset (f, 0, sizeof (*f));
+  f->ctx = test_main_context_get ();
+
+  f->server = dbus_server_listen (listen_address, &e);
+
+  if (f->server == NULL)
+    {
+      fprintf (stderr, "Unable to listen on %s: %s: %s\n", listen_address,
+               e.name, e.message);
+      exit (1);
+    }
+
+  dbus_server_set_new_connection_function (f->server, new_conn_cb, f, NULL);
+
+  if (!test_server_setup (f->ctx, f->server))
+    die ("out of memory setting up server");
+
+  address = dbus_server_get_address (f->server);
+
+  if (address == NULL)
+    die ("out of memory getting server address");
+
+  f->left_client_conn = connect_client (f, address, &f->left_server_conn);
+  f->right_client_conn = connect_client (f, address, &f->right_server_conn);
+  dbus_free (address);
+
+  if (!dbus_connection_add_filter (f->right_client_conn,
+                                   right_client_message_cb, f, NULL))
+    die ("out of memory adding filter");
+}
+
+static void
+shutdown_connection (DBusConnection *conn)
+{
+  test_connection_shutdown (NULL, conn);
+  dbus_connection_close (conn);
+  dbus_connection_unref (conn);
+}
+
+static void
+teardown (Fixture *f)
+{
+  shutdown_connection (f->left_client_conn);
+  shutdown_connection (f->right_client_conn);
+  shutdown_connection (f->left_server_conn);
+  shutdown_connection (f->right_server_conn);
+
+  dbus_server_disconnect (f->server);
+  dbus_server_unref (f->server);
+  test_main_context_unref (f->ctx);
+}
+
+/*
+ * Append a payload of roughly payload_bytes bytes with the given
+ * signature. Arrays of strings use 31-character elements and dicts
+ * use "keyN" => int32 entries, so that the marshalling cost per byte
+ * differs from the flat byte array and string cases.
+ */
+static dbus_bool_t
+append_payload (DBusMessage *message,
+    const Case *c,
+    const char *buf)
+{
+  DBusMessageIter iter, array, entry, variant;
+  const char *p = buf;
+  char key[32];
+  int i, n;
+
+  dbus_message_iter_init_append (message, &iter);
+
+  if (strcmp (c->signature, "") == 0)
+    return TRUE;
+
+  if (strcmp (c->signature, "ay") == 0)
+    return dbus_message_append_args (message,
+        DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &p, c->payload_bytes,
+        DBUS_TYPE_INVALID);
+
+  if (strcmp (c->signature, "s") == 0)
+    return dbus_message_append_args (message,
+        DBUS_TYPE_STRING, &p,
+        DBUS_TYPE_INVALID);
+
+  if (strcmp (c->signature, "as") == 0)
+    {
+      /* buf + payload_bytes - 31 is a 31-character string */
+      p = buf + c->payload_bytes - 31;
+      n = c->payload_bytes / 32;
+
+      if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+              DBUS_TYPE_STRING_AS_STRING, &array))
+        return FALSE;
+
+      for (i = 0; i < n; i++)
+        {
+          if (!dbus_message_iter_append_basic (&array, DBUS_TYPE_STRING, &p))
+            return FALSE;
+        }
+
+      return dbus_message_iter_close_container (&iter, &array);
+    }
+
+  /* a{sv} */
+  n = c->payload_bytes / 16;
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+          "{sv}", &array))
+    return FALSE;
+
+  for (i = 0; i < n; i++)
+    {
+      p = key;
+      snprintf (key, sizeof (key), "key%d", i);
+
+      if (!dbus_message_iter_open_container (&array, DBUS_TYPE_DICT_ENTRY,
+              NULL, &entry) ||
+          !dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING, &p) ||
+          !dbus_message_iter_open_container (&entry, DBUS_TYPE_VARIANT,
+              DBUS_TYPE_INT32_AS_STRING, &variant) ||
+          !dbus_message_iter_append_basic (&variant, DBUS_TYPE_INT32, &i) ||
+          !dbus_message_iter_close_container (&entry, &variant) ||
+          !dbus_message_iter_close_container (&array, &entry))
+        return FALSE;
+    }
+
+  return dbus_message_iter_close_container (&iter, &array);
+}
+
+static DBusMessage *
+new_message (const Case *c,
+    const char *buf)
+{
+  DBusMessage *message;
+
+  message = dbus_message_new_signal ("/com/example/Hello",
+      "com.example.Hello", "Relay");
+
+  if (message == NULL || !append_payload (message, c, buf))
+    die ("out of memory building message");
+
+  return message;
+}
+
+static double
+now (void)
+{
+  long tv_sec, tv_usec;
+
+  _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+  return tv_sec + tv_usec / 1000000.0;
+}
+
+static void
+run_case (Fixture *f,
+    const Case *c,
+    const char *buf,
+    unsigned int count,
+    dbus_bool_t first)
+{
+  DBusMessage *message;
+  unsigned int sent = 0;
+  char *blob;
+  int message_bytes;
+  double start, seconds;
+  clock_t cpu_start, cpu;
+
+  if (c->payload_bytes > FULL_COUNT_BYTES)
+    {
+      count = count / (c->payload_bytes / FULL_COUNT_BYTES);
+
+      if (count < MIN_COUNT)
+        count = MIN_COUNT;
+    }
+
+  /* the size of each message as it goes over the two sockets */
+  message = new_message (c, buf);
+
+  if (!dbus_message_marshal (message, &blob, &message_bytes))
+    die ("out of memory marshalling message");
+
+  dbus_free (blob);
+  dbus_message_unref (message);
+
+  f->n_received = 0;
+  start = now ();
+  cpu_start = clock ();
+
+  while (f->n_received < count)
+    {
+      while (sent < count && sent - f->n_received < WINDOW)
+        {
+          message = new_message (c, buf);
+
+          if (!dbus_connection_send (f->left_client_conn, message, NULL))
+            die ("out of memory sending message");
+
+          dbus_message_unref (message);
+          sent++;
+        }
+
+      test_main_context_iterate (f->ctx, TRUE);
+    }
+
+  cpu = clock () - cpu_start;
+  seconds = now () - start;
+
+  printf ("%s    {\"signature\": \"%s\", \"payload_bytes\": %d, "
+          "\"message_bytes\": %d, \"messages\": %u, \"seconds\": %.6f, "
+          "\"messages_per_second\": %.1f, \"bytes_per_second\": %.1f, "
+          "\"cpu_ns_per_message\": %.1f}",
+          first ? "" : ",\n",
+          c->signature, c->payload_bytes, message_bytes, count, seconds,
+          count / seconds, (double) count * message_bytes / seconds,
+          (double) cpu * 1e9 / CLOCKS_PER_SEC / count);
+  fflush (stdout);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  Fixture f;
+  const char *listen_address = TEST_LISTEN;
+  unsigned int count = 10000;
+  char *buf;
+  int max_bytes = 0;
+  unsigned int i;
+
+  if (argc > 1)
+    count = strtoul (argv[1], NULL, 10);
+
+  if (argc > 2)
+    listen_address = argv[2];
+
+  if (count < 1)
+    die ("syntax: manual-relay-perf [MESSAGES [ADDRESS]]");
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (cases); i++)
+    {
+      if (cases[i].payload_bytes > max_bytes)
+        max_bytes = cases[i].payload_bytes;
+    }
+
+  /* shared by every case: the first payload_bytes bytes are the byte
+   * array, and the string ends at the terminating '\0' */
+  buf = dbus_malloc (max_bytes + 1);
+
+  if (buf == NULL)
+    die ("out of memory allocating payload");
+
+  setup (&f, listen_address);
+
+  printf ("{\n  \"address\": \"%s\",\n  \"results\": [\n", listen_address);
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (cases); i++)
+    {
+      memset (buf, 'X', max_bytes);
+      buf[cases[i].payload_bytes] = '\0';
+      run_case (&f, &cases[i], buf, count, i == 0);
+    }
+
+  printf ("\n  ]\n}\n");
+
+  teardown (&f);
+  dbus_free (buf);
+  dbus_shutdown ();
+  return 0;
+}
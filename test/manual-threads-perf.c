@@ -0,0 +1,556 @@
+/* Manual benchmark for lock contention in a shared DBusConnection
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * syntax:  manual-threads-perf [MESSAGES [MAX_SENDERS [MAX_DISPATCHERS [ADDRESS]]]]
+ *
+ * Connects one client DBusConnection to an in-process DBusServer, whose
+ * end of the connection is served by a thread of its own. Then, for
+ * 1, 2, 4... up to MAX_SENDERS (default 8) threads sharing the client
+ * connection, and 0 (for method calls only), 1, 2, 4... up to
+ * MAX_DISPATCHERS (default 4) threads calling
+ * dbus_connection_read_write_dispatch() on it, times MESSAGES
+ * (default 20000) messages split between the senders:
+ *
+ * - method calls, each sent with
+ *   dbus_connection_send_with_reply_and_block() and answered by the
+ *   server thread;
+ * - signals, each sent with dbus_connection_send(), relayed back by the
+ *   server thread and received by a filter on the dispatching threads.
+ *
+ * Some combinations are very slow, so each stops sending after
+ * MAX_SECONDS and reports how many messages it got through.
+ *
+ * If libdbus was built with embedded tests, each result also lists how
+ * many times each mutex that was used was locked, how long it was
+ * waited for and how long it was held, from _dbus_lock_profile_get().
+ * Profiling adds a little to the time taken by every lock, so the
+ * throughput figures from such builds are somewhat pessimistic.
+ *
+ * Results are printed on stdout as JSON, with times in microseconds.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include <dbus/dbus.h>
+#include <dbus/dbus-sysdeps.h>
+#include <dbus/dbus-threads-internal.h>
+
+#include "test-utils.h"
+
+#define TEST_PATH "/org/freedesktop/TestSuite"
+#define TEST_INTERFACE "org.freedesktop.TestSuite"
+
+/* at most this many signals are on their way back at once */
+#define WINDOW 64
+
+/* How long a dispatching thread blocks in poll(). A message queued
+ * meanwhile by another thread isn't written until it returns, so this
+ * bounds how long messages can wait to be sent. */
+#define DISPATCH_TIMEOUT_MILLISECONDS 1
+
+/* longest time to spend on one combination of threads */
+#define MAX_SECONDS 10
+
+/* more than enough for the mutexes one connection and its server use */
+#define MAX_PROFILES 64
+
+typedef enum {
+    MODE_METHOD_CALL,
+    MODE_SIGNAL
+} Mode;
+
+typedef struct {
+    TestMainContext *ctx;
+    DBusServer *server;
+    DBusConnection *client_conn;
+    DBusConnection *server_conn;
+    pthread_t server_thread;
+
+    Mode mode;
+    unsigned int per_sender;
+    dbus_uint64_t deadline;
+
+    /* protects everything below */
+    pthread_mutex_t lock;
+    /* signalled when a relayed signal arrives */
+    pthread_cond_t cond;
+    unsigned int n_sent;
+    unsigned int n_received;
+    unsigned int n_replies;
+    dbus_bool_t stop_dispatching;
+} Fixture;
+
+static void
+die (const char *message)
+{
+  fprintf (stderr, "%s\n", message);
+  exit (1);
+}
+
+static void
+start_thread (pthread_t *thread,
+    void *(* func) (void *),
+    void *data)
+{
+  if (pthread_create (thread, NULL, func, data) != 0)
+    die ("unable to start thread");
+}
+
+static DBusHandlerResult
+server_message_cb (DBusConnection *server_conn,
+    DBusMessage *message,
+    void *data)
+{
+  if (dbus_message_is_method_call (message, TEST_INTERFACE, "Ping"))
+    {
+      DBusMessage *reply = dbus_message_new_method_return (message);
+
+      if (reply == NULL ||
+          !dbus_connection_send (server_conn, reply, NULL))
+        die ("out of memory replying");
+
+      dbus_message_unref (reply);
+      return DBUS_HANDLER_RESULT_HANDLED;
+    }
+
+  if (dbus_message_is_signal (message, TEST_INTERFACE, "Tick"))
+    {
+      if (!dbus_connection_send (server_conn, message, NULL))
+        die ("out of memory relaying signal");
+
+      return DBUS_HANDLER_RESULT_HANDLED;
+    }
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+static DBusHandlerResult
+client_message_cb (DBusConnection *client_conn,
+    DBusMessage *message,
+    void *data)
+{
+  Fixture *f = data;
+
+  if (!dbus_message_is_signal (message, TEST_INTERFACE, "Tick"))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  pthread_mutex_lock (&f->lock);
+  f->n_received++;
+  pthread_cond_broadcast (&f->cond);
+  pthread_mutex_unlock (&f->lock);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static void
+new_conn_cb (DBusServer *server,
+    DBusConnection *server_conn,
+    void *data)
+{
+  Fixture *f = data;
+
+  /* served by server_thread, not the main loop */
+  f->server_conn = dbus_connection_ref (server_conn);
+
+  if (!dbus_connection_add_filter (server_conn, server_message_cb,
+                                   f, NULL))
+    die ("out of memory adding filter");
+}
+
+static void *
+server_thread (void *data)
+{
+  Fixture *f = data;
+
+  /* until the client closes its end */
+  while (dbus_connection_read_write_dispatch (f->server_conn, -1))
+    ;
+
+  return NULL;
+}
+
+static void
+ping (Fixture *f)
+{
+  DBusError e = DBUS_ERROR_INIT;
+  DBusMessage *call;
+  DBusMessage *reply;
+
+  call = dbus_message_new_method_call (NULL, TEST_PATH, TEST_INTERFACE,
+                                       "Ping");
+
+  if (call == NULL)
+    die ("out of memory building method call");
+
+  reply = dbus_connection_send_with_reply_and_block (f->client_conn, call,
+                                                     -1, &e);
+
+  if (reply == NULL)
+    {
+      fprintf (stderr, "Unable to call Ping: %s: %s\n", e.name, e.message);
+      exit (1);
+    }
+
+  dbus_message_unref (reply);
+  dbus_message_unref (call);
+}
+
+static void
+tick (Fixture *f)
+{
+  DBusMessage *signal;
+
+  pthread_mutex_lock (&f->lock);
+
+  while (f->n_sent - f->n_received >= WINDOW)
+    pthread_cond_wait (&f->cond, &f->lock);
+
+  f->n_sent++;
+  pthread_mutex_unlock (&f->lock);
+
+  signal = dbus_message_new_signal (TEST_PATH, TEST_INTERFACE, "Tick");
+
+  if (signal == NULL ||
+      !dbus_connection_send (f->client_conn, signal, NULL))
+    die ("out of memory sending signal");
+
+  dbus_message_unref (signal);
+}
+
+static void *
+sender_thread (void *data)
+{
+  Fixture *f = data;
+  unsigned int i;
+
+  for (i = 0; i < f->per_sender; i++)
+    {
+      if (_dbus_get_monotonic_time_nsec () > f->deadline)
+        break;
+
+      if (f->mode == MODE_METHOD_CALL)
+        {
+          ping (f);
+          pthread_mutex_lock (&f->lock);
+          f->n_replies++;
+          pthread_mutex_unlock (&f->lock);
+        }
+      else
+        {
+          tick (f);
+        }
+    }
+
+  return NULL;
+}
+
+static void *
+dispatcher_thread (void *data)
+{
+  Fixture *f = data;
+  dbus_bool_t stop = FALSE;
+
+  while (!stop)
+    {
+      if (!dbus_connection_read_write_dispatch (f->client_conn,
+                                                DISPATCH_TIMEOUT_MILLISECONDS))
+        die ("disconnected from server");
+
+      pthread_mutex_lock (&f->lock);
+      stop = f->stop_dispatching;
+      pthread_mutex_unlock (&f->lock);
+    }
+
+  return NULL;
+}
+
+static void
+setup (Fixture *f,
+    const char *listen_address)
+{
+  DBusError e = DBUS_ERROR_INIT;
+  char *address;
+
+  f->server = dbus_server_listen (listen_address, &e);
+
+  if (f->server == NULL)
+    {
+      fprintf (stderr, "Unable to listen on %s: %s: %s\n", listen_address,
+               e.name, e.message);
+      exit (1);
+    }
+
+  dbus_server_set_new_connection_function (f->server, new_conn_cb, f, NULL);
+
+  if (!test_server_setup (f->ctx, f->server))
+    die ("out of memory setting up server");
+
+  address = dbus_server_get_address (f->server);
+
+  if (address == NULL)
+    die ("out of memory getting server address");
+
+  f->client_conn = dbus_connection_open_private (address, &e);
+  dbus_free (address);
+
+  if (f->client_conn == NULL)
+    {
+      fprintf (stderr, "Unable to connect: %s: %s\n", e.name, e.message);
+      exit (1);
+    }
+
+  if (!dbus_connection_add_filter (f->client_conn, client_message_cb,
+                                   f, NULL))
+    die ("out of memory adding filter");
+
+  while (f->server_conn == NULL)
+    test_main_context_iterate (f->ctx, TRUE);
+
+  /* the rest happens on threads */
+  test_server_shutdown (f->ctx, f->server);
+  start_thread (&f->server_thread, server_thread, f);
+
+  /* get authentication out of the way */
+  ping (f);
+}
+
+static void
+teardown (Fixture *f)
+{
+  dbus_connection_close (f->client_conn);
+  pthread_join (f->server_thread, NULL);
+  dbus_connection_close (f->server_conn);
+
+  dbus_connection_unref (f->client_conn);
+  dbus_connection_unref (f->server_conn);
+  dbus_server_disconnect (f->server);
+  dbus_server_unref (f->server);
+
+  f->client_conn = NULL;
+  f->server_conn = NULL;
+  f->server = NULL;
+}
+
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+static void
+print_locks (Fixture *f)
+{
+  DBusLockProfile profiles[MAX_PROFILES];
+  int i, n;
+
+  n = _dbus_lock_profile_get (profiles, MAX_PROFILES);
+  printf (", \"locks\": [");
+
+  for (i = 0; i < n; i++)
+    {
+      const char *owner = "none";
+
+      if (profiles[i].owner == f->client_conn)
+        owner = "client";
+      else if (profiles[i].owner == f->server_conn)
+        owner = "server";
+      else if (profiles[i].owner == f->server)
+        owner = "listener";
+      else if (profiles[i].owner != NULL)
+        owner = "other";
+
+      printf ("%s\n        {\"lock\": \"%s\", \"owner\": \"%s\", "
+              "\"count\": %lu, "
+              "\"wait\": %.1f, \"max_wait\": %.1f, "
+              "\"hold\": %.1f, \"max_hold\": %.1f}",
+              i > 0 ? "," : "",
+              profiles[i].name != NULL ? profiles[i].name : "unnamed", owner,
+              profiles[i].n_locks,
+              profiles[i].wait_nsec / 1e3, profiles[i].max_wait_nsec / 1e3,
+              profiles[i].hold_nsec / 1e3, profiles[i].max_hold_nsec / 1e3);
+    }
+
+  printf ("]");
+}
+#endif
+
+static void
+run (Fixture *f,
+    const char *listen_address,
+    Mode mode,
+    unsigned int messages,
+    unsigned int senders,
+    unsigned int dispatchers,
+    dbus_bool_t first)
+{
+  /* one spare, so that there is something to allocate for 0 */
+  pthread_t *sender_threads = dbus_new0 (pthread_t, senders + 1);
+  pthread_t *dispatcher_threads = dbus_new0 (pthread_t, dispatchers + 1);
+  dbus_uint64_t start, elapsed;
+  unsigned int i, n_messages;
+
+  if (sender_threads == NULL || dispatcher_threads == NULL)
+    die ("out of memory allocating threads");
+
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+  if (!_dbus_lock_profile_start ())
+    die ("out of memory starting lock profiling");
+#endif
+
+  setup (f, listen_address);
+
+  f->mode = mode;
+  f->per_sender = messages / senders;
+  f->n_sent = 0;
+  f->n_received = 0;
+  f->n_replies = 0;
+  f->stop_dispatching = FALSE;
+
+  start = _dbus_get_monotonic_time_nsec ();
+  f->deadline = start + (dbus_uint64_t) MAX_SECONDS * 1000000000;
+
+  for (i = 0; i < dispatchers; i++)
+    start_thread (&dispatcher_threads[i], dispatcher_thread, f);
+
+  for (i = 0; i < senders; i++)
+    start_thread (&sender_threads[i], sender_thread, f);
+
+  for (i = 0; i < senders; i++)
+    pthread_join (sender_threads[i], NULL);
+
+  pthread_mutex_lock (&f->lock);
+
+  if (mode == MODE_SIGNAL)
+    {
+      while (f->n_received < f->n_sent)
+        pthread_cond_wait (&f->cond, &f->lock);
+
+      n_messages = f->n_received;
+    }
+  else
+    {
+      n_messages = f->n_replies;
+    }
+
+  elapsed = _dbus_get_monotonic_time_nsec () - start;
+  f->stop_dispatching = TRUE;
+  pthread_mutex_unlock (&f->lock);
+
+  for (i = 0; i < dispatchers; i++)
+    pthread_join (dispatcher_threads[i], NULL);
+
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+  _dbus_lock_profile_stop ();
+#endif
+
+  printf ("%s\n      {\"senders\": %u, \"dispatchers\": %u, "
+          "\"messages\": %u, \"per_second\": %.1f",
+          first ? "" : ",", senders, dispatchers, n_messages,
+          elapsed > 0 ? n_messages * 1e9 / elapsed : 0.0);
+
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+  print_locks (f);
+#endif
+
+  printf ("}");
+  fflush (stdout);
+
+  teardown (f);
+  dbus_free (sender_threads);
+  dbus_free (dispatcher_threads);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  Fixture f;
+  const char *listen_address = TEST_LISTEN;
+  unsigned int messages = 20000;
+  unsigned int max_senders = 8;
+  unsigned int max_dispatchers = 4;
+  unsigned int senders, dispatchers;
+  dbus_bool_t first;
+
+  if (argc > 1)
+    messages = strtoul (argv[1], NULL, 10);
+
+  if (argc > 2)
+    max_senders = strtoul (argv[2], NULL, 10);
+
+  if (argc > 3)
+    max_dispatchers = strtoul (argv[3], NULL, 10);
+
+  if (argc > 4)
+    listen_address = argv[4];
+
+  if (messages < max_senders || max_senders < 1 || max_dispatchers < 1)
+    die ("syntax: manual-threads-perf [MESSAGES [MAX_SENDERS "
+         "[MAX_DISPATCHERS [ADDRESS]]]]");
+
+  if (!dbus_threads_init_default ())
+    die ("out of memory initializing threads");
+
+  memset (&f, 0, sizeof (f));
+  pthread_mutex_init (&f.lock, NULL);
+  pthread_cond_init (&f.cond, NULL);
+  f.ctx = test_main_context_get ();
+
+  printf ("{\n  \"address\": \"%s\",\n  \"method_call\": [", listen_address);
+  first = TRUE;
+
+  for (senders = 1; senders <= max_senders; senders *= 2)
+    {
+      for (dispatchers = 0; dispatchers <= max_dispatchers;
+           dispatchers = dispatchers > 0 ? dispatchers * 2 : 1)
+        {
+          run (&f, listen_address, MODE_METHOD_CALL, messages, senders,
+               dispatchers, first);
+          first = FALSE;
+        }
+    }
+
+  printf ("\n  ],\n  \"signal\": [");
+  first = TRUE;
+
+  for (senders = 1; senders <= max_senders; senders *= 2)
+    {
+      for (dispatchers = 1; dispatchers <= max_dispatchers;
+           dispatchers *= 2)
+        {
+          run (&f, listen_address, MODE_SIGNAL, messages, senders,
+               dispatchers, first);
+          first = FALSE;
+        }
+    }
+
+  printf ("\n  ]\n}\n");
+
+  test_main_context_unref (f.ctx);
+  pthread_cond_destroy (&f.cond);
+  pthread_mutex_destroy (&f.lock);
+  dbus_shutdown ();
+  return 0;
+}
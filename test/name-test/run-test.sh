@@ -69,12 +69,14 @@ py_test () {
 }
 
 test_num=1
-# TAP test plan: we will run 8 tests
-echo "1..8"
+# TAP test plan: we will run 10 tests
+echo "1..10"
 
 c_test test-ids
+c_test test-name-owner-cache
 c_test test-pending-call-dispatch
 c_test test-pending-call-timeout
+c_test test-pending-call-queue
 c_test test-threads-init
 c_test test-privserver-client
 c_test test-shutdown
@@ -0,0 +1,137 @@
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dbus/dbus.h>
+
+#define NAME "org.freedesktop.DBus.TestSuite.NameOwnerCache"
+
+static void
+die (const char *message)
+{
+  fprintf (stderr, "*** test-name-owner-cache: %s", message);
+  exit (1);
+}
+
+/* Give the NameOwnerChanged signal time to arrive and be dispatched */
+static void
+wait_for_name_owner_changed (DBusConnection *connection)
+{
+  int i;
+
+  for (i = 0; i < 100; i++)
+    {
+      if (!dbus_connection_read_write_dispatch (connection, 10))
+        die ("Disconnected\n");
+    }
+}
+
+static void
+expect_owner (DBusConnection *connection,
+              const char     *expected)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  char *owner;
+
+  owner = dbus_bus_get_name_owner_cached (connection, NAME, &error);
+
+  if (expected == NULL)
+    {
+      if (owner != NULL)
+        die ("Name should not have an owner\n");
+
+      if (!dbus_error_has_name (&error, DBUS_ERROR_NAME_HAS_NO_OWNER))
+        die ("Expected NameHasNoOwner\n");
+
+      dbus_error_free (&error);
+
+      if (dbus_bus_name_has_owner_cached (connection, NAME, NULL))
+        die ("Cache disagrees with itself\n");
+    }
+  else
+    {
+      if (owner == NULL)
+        {
+          fprintf (stderr, "*** %s\n", error.message);
+          die ("Name should have an owner\n");
+        }
+
+      if (strcmp (owner, expected) != 0)
+        die ("Wrong owner\n");
+
+      if (!dbus_bus_name_has_owner_cached (connection, NAME, NULL))
+        die ("Cache disagrees with itself\n");
+    }
+
+  dbus_free (owner);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  DBusError error;
+  DBusConnection *connection;
+  DBusConnection *owner;
+  char *bus_owner;
+
+  dbus_error_init (&error);
+  connection = dbus_bus_get (DBUS_BUS_SESSION, &error);
+  if (connection == NULL)
+    {
+      fprintf (stderr, "*** Failed to open connection to session bus: %s\n",
+               error.message);
+      dbus_error_free (&error);
+      return 1;
+    }
+
+  owner = dbus_bus_get_private (DBUS_BUS_SESSION, &error);
+  if (owner == NULL)
+    {
+      fprintf (stderr, "*** Failed to open connection to session bus: %s\n",
+               error.message);
+      dbus_error_free (&error);
+      return 1;
+    }
+
+  bus_owner = dbus_bus_get_name_owner_cached (connection, DBUS_SERVICE_DBUS,
+                                              NULL);
+  if (bus_owner == NULL || strcmp (bus_owner, DBUS_SERVICE_DBUS) != 0)
+    die ("The bus should own its own name\n");
+  dbus_free (bus_owner);
+
+  /* Not owned yet; this first lookup subscribes to changes */
+  expect_owner (connection, NULL);
+
+  if (dbus_bus_request_name (owner, NAME, 0, &error) !=
+      DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+    die ("Failed to request name\n");
+
+  wait_for_name_owner_changed (connection);
+  expect_owner (connection, dbus_bus_get_unique_name (owner));
+
+  if (dbus_bus_release_name (owner, NAME, &error) !=
+      DBUS_RELEASE_NAME_REPLY_RELEASED)
+    die ("Failed to release name\n");
+
+  wait_for_name_owner_changed (connection);
+  expect_owner (connection, NULL);
+
+  /* Owners that go away without releasing are noticed too */
+  if (dbus_bus_request_name (owner, NAME, 0, &error) !=
+      DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+    die ("Failed to request name\n");
+
+  wait_for_name_owner_changed (connection);
+  expect_owner (connection, dbus_bus_get_unique_name (owner));
+
+  dbus_connection_close (owner);
+  dbus_connection_unref (owner);
+
+  wait_for_name_owner_changed (connection);
+  expect_owner (connection, NULL);
+
+  dbus_connection_unref (connection);
+
+  return 0;
+}
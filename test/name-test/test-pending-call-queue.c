@@ -0,0 +1,173 @@
+/**
+* Test that pending calls with a completion queue are completed and
+* put on it as their replies are read, without anyone dispatching, and
+* that a disconnection completes them too.
+**/
+
+#include <config.h>
+#include <dbus/dbus.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N_CALLS 20
+
+static int wakeups = 0;
+
+static void
+count_wakeup (void *data)
+{
+  wakeups++;
+}
+
+static void
+die (const char *message)
+{
+  printf ("Failed: %s ***\n", message);
+  exit (1);
+}
+
+static DBusPendingCall *
+start_call (DBusConnection       *conn,
+            const char           *destination,
+            const char           *method,
+            DBusPendingCallQueue *queue)
+{
+  DBusMessage *message;
+  DBusPendingCall *pending;
+
+  message = dbus_message_new_method_call (destination, "/",
+                                          DBUS_INTERFACE_DBUS, method);
+
+  if (message == NULL ||
+      !dbus_connection_send_with_reply (conn, message, &pending,
+                                        DBUS_TIMEOUT_INFINITE) ||
+      pending == NULL)
+    die ("could not send message");
+
+  if (!dbus_pending_call_set_completion_queue (pending, queue))
+    die ("could not set completion queue");
+
+  dbus_message_unref (message);
+  return pending;
+}
+
+static void
+test_replies (DBusConnection       *conn,
+              DBusPendingCallQueue *queue)
+{
+  DBusPendingCall *pending;
+  int i;
+  int completed = 0;
+
+  for (i = 0; i < N_CALLS; i++)
+    {
+      /* half of them get an error reply */
+      pending = start_call (conn, DBUS_SERVICE_DBUS,
+                            (i % 2) ? "GetId" : "NoSuchMethod", queue);
+      dbus_pending_call_unref (pending);
+    }
+
+  while (completed < N_CALLS)
+    {
+      if (!dbus_connection_read_write (conn, -1))
+        die ("disconnected");
+
+      while ((pending = dbus_pending_call_queue_pop (queue)) != NULL)
+        {
+          DBusMessage *reply;
+
+          if (!dbus_pending_call_get_completed (pending))
+            die ("call on completion queue is not completed");
+
+          reply = dbus_pending_call_steal_reply (pending);
+
+          if (reply == NULL)
+            die ("no reply");
+
+          dbus_message_unref (reply);
+          dbus_pending_call_unref (pending);
+          completed++;
+        }
+    }
+
+  if (wakeups != N_CALLS)
+    die ("wrong number of wakeups");
+}
+
+static void
+test_disconnect (DBusPendingCallQueue *queue)
+{
+  DBusConnection *conn;
+  DBusPendingCall *pending;
+  DBusPendingCall *popped;
+  DBusMessage *reply;
+  DBusError error;
+
+  dbus_error_init (&error);
+
+  conn = dbus_bus_get_private (DBUS_BUS_SESSION, &error);
+  if (conn == NULL)
+    die (error.message);
+
+  dbus_connection_set_exit_on_disconnect (conn, FALSE);
+
+  /* nobody is going to answer a call to ourselves, since we don't
+   * dispatch */
+  pending = start_call (conn, dbus_bus_get_unique_name (conn), "Ping",
+                        queue);
+  dbus_connection_flush (conn);
+  dbus_connection_close (conn);
+
+  /* the disconnection is only noticed once the messages that arrived
+   * before it have been dispatched */
+  while (dbus_connection_dispatch (conn) == DBUS_DISPATCH_DATA_REMAINS)
+    ;
+
+  popped = dbus_pending_call_queue_pop (queue);
+
+  if (popped != pending)
+    die ("call was not completed on disconnection");
+
+  reply = dbus_pending_call_steal_reply (popped);
+
+  if (reply == NULL ||
+      !dbus_message_is_error (reply, DBUS_ERROR_NO_REPLY))
+    die ("expected NoReply error");
+
+  dbus_message_unref (reply);
+  dbus_pending_call_unref (popped);
+  dbus_pending_call_unref (pending);
+  dbus_connection_unref (conn);
+}
+
+int
+main (int argc, char *argv[])
+{
+  DBusConnection *conn;
+  DBusPendingCallQueue *queue;
+  DBusError error;
+
+  printf ("*** Testing pending call completion queues\n");
+
+  dbus_error_init (&error);
+
+  conn = dbus_bus_get (DBUS_BUS_SESSION, &error);
+  if (conn == NULL)
+    die (error.message);
+
+  queue = dbus_pending_call_queue_new ();
+  if (queue == NULL)
+    die ("out of memory");
+
+  dbus_pending_call_queue_set_wakeup_function (queue, count_wakeup,
+                                               NULL, NULL);
+
+  test_replies (conn, queue);
+  test_disconnect (queue);
+
+  dbus_pending_call_queue_unref (queue);
+  dbus_connection_unref (conn);
+
+  printf ("Success ***\n");
+  exit (0);
+}
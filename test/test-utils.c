@@ -53,6 +53,15 @@ remove_timeout (DBusTimeout *timeout,
   _dbus_loop_remove_timeout (cd->loop, timeout);
 }
 
+static void
+toggle_timeout (DBusTimeout *timeout,
+                void        *data)
+{
+  CData *cd = data;
+
+  _dbus_loop_toggle_timeout (cd->loop, timeout);
+}
+
 static void
 dispatch_status_function (DBusConnection    *connection,
                           DBusDispatchStatus new_status,
@@ -97,9 +106,10 @@ cdata_new (DBusLoop       *loop,
   return cd;
 }
 
-dbus_bool_t
-test_connection_setup (TestMainContext *ctx,
-                       DBusConnection *connection)
+static dbus_bool_t
+connection_setup (TestMainContext *ctx,
+                  DBusConnection  *connection,
+                  dbus_bool_t      toggle_timeouts)
 {
   DBusLoop *loop = ctx;
   CData *cd;
@@ -128,7 +138,8 @@ test_connection_setup (TestMainContext *ctx,
   if (!dbus_connection_set_timeout_functions (connection,
                                               add_timeout,
                                               remove_timeout,
-                                              NULL,
+                                              toggle_timeouts ?
+                                                toggle_timeout : NULL,
                                               cd, cdata_free))
     goto nomem;
 
@@ -151,6 +162,23 @@ test_connection_setup (TestMainContext *ctx,
   return FALSE;
 }
 
+dbus_bool_t
+test_connection_setup (TestMainContext *ctx,
+                       DBusConnection *connection)
+{
+  return connection_setup (ctx, connection, TRUE);
+}
+
+/* Like test_connection_setup(), but as for an application that has no
+ * DBusTimeoutToggledFunction, so that libdbus has to remove and add
+ * timeouts again instead of toggling them */
+dbus_bool_t
+test_connection_setup_without_toggle (TestMainContext *ctx,
+                                      DBusConnection  *connection)
+{
+  return connection_setup (ctx, connection, FALSE);
+}
+
 static void
 die (const char *message)
 {
@@ -260,6 +288,15 @@ remove_server_timeout (DBusTimeout *timeout,
   _dbus_loop_remove_timeout (context->loop, timeout);
 }
 
+static void
+toggle_server_timeout (DBusTimeout *timeout,
+                       void        *data)
+{
+  ServerData *context = data;
+
+  _dbus_loop_toggle_timeout (context->loop, timeout);
+}
+
 dbus_bool_t
 test_server_setup (TestMainContext *ctx,
                    DBusServer    *server)
@@ -288,7 +325,7 @@ test_server_setup (TestMainContext *ctx,
   if (!dbus_server_set_timeout_functions (server,
                                           add_server_timeout,
                                           remove_server_timeout,
-                                          NULL,
+                                          toggle_server_timeout,
                                           sd, serverdata_free))
     {
       goto nomem;
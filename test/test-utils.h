@@ -18,6 +18,8 @@ void             test_main_context_iterate        (TestMainContext *ctx,
 
 dbus_bool_t test_connection_setup                 (TestMainContext *ctx,
                                                    DBusConnection *connection);
+dbus_bool_t test_connection_setup_without_toggle  (TestMainContext *ctx,
+                                                   DBusConnection *connection);
 void        test_connection_shutdown              (TestMainContext *ctx,
                                                    DBusConnection *connection);
 
@@ -22,6 +22,8 @@ parser = argparse.ArgumentParser(description='Testing D-Bus match rules')
 parser.add_argument('--session', help='session bus', action="store_true")
 parser.add_argument('--system', help='system bus', action="store_true")
 parser.add_argument('--all', help='print all match rules', action="store_true")
+parser.add_argument('--page-size', help='bytes per reply when paging (default: chosen by the bus)',
+                    type=int, default=0)
 args = parser.parse_args()
 
 if args.system and args.session:
@@ -40,13 +42,34 @@ remote_object = bus.get_object("org.freedesktop.DBus",
 bus_iface = dbus.Interface(remote_object, "org.freedesktop.DBus")
 stats_iface = dbus.Interface(remote_object, "org.freedesktop.DBus.Debug.Stats")
 
+# Page through the bus if it can, so as not to hold up a big one
+
+def get_paged(method, merge, result):
+  cursor = ''
+  while True:
+    page, cursor = method(cursor, dbus.UInt32(args.page_size))
+    merge(result, page)
+    if not cursor:
+      return result
+
 try:
-  match_rules = stats_iface.GetAllMatchRules()
-except:
-  print("GetConnectionMatchRules failed: did you enable the Stats interface?")
-  sys.exit(1)
+  match_rules = get_paged(stats_iface.GetMatchRulesPaged,
+                          lambda r, page: r.update(page), {})
+  names = get_paged(stats_iface.ListNamesPaged,
+                    lambda r, page: r.extend(page), [])
+except dbus.exceptions.DBusException as e:
+  if e.get_dbus_name() != 'org.freedesktop.DBus.Error.UnknownMethod':
+    print("GetMatchRulesPaged failed: %s" % e)
+    sys.exit(1)
+
+  try:
+    match_rules = stats_iface.GetAllMatchRules()
+  except:
+    print("GetConnectionMatchRules failed: did you enable the Stats interface?")
+    sys.exit(1)
+
+  names = bus_iface.ListNames()
 
-names = bus_iface.ListNames()
 unique_names = [ a for a in names if a.startswith(":") ]
 pids = dict((name, bus_iface.GetConnectionUnixProcessID(name)) for name in unique_names)
 cmds = dict((name, get_cmdline(pids[name])) for name in unique_names)
@@ -0,0 +1,782 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-marshal-gen.c  Generate typed marshalling functions from introspection XML
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <expat.h>
+
+#include <dbus/dbus.h>
+#include "tool-common.h"
+
+/*
+ * For every method and signal in an introspection file this writes a
+ * pair of functions with one C parameter per argument: one appending
+ * the arguments to a message, one checking the signature of a message
+ * and reading them back. They are built on dbus_message_append_args()
+ * and dbus_message_get_args(), which take the fast paths for these
+ * argument lists, so callers don't need to spell out type codes or
+ * walk a DBusMessageIter themselves.
+ *
+ * Only basic types, arrays of fixed-length types and arrays of
+ * strings are covered. Argument lists with anything else in them are
+ * left out, with a comment saying so in the output.
+ */
+
+typedef enum
+{
+  MODE_HEADER,
+  MODE_BODY
+} Mode;
+
+typedef enum
+{
+  KIND_BASIC,
+  KIND_FIXED_ARRAY,
+  KIND_STRING_ARRAY,
+  KIND_UNSUPPORTED
+} ArgKind;
+
+typedef struct
+{
+  char *name;
+  char *type;
+  dbus_bool_t in;
+} Arg;
+
+typedef struct
+{
+  Mode mode;
+  const char *prefix;
+  const char *filename;
+  XML_Parser parser;
+
+  char *interface;
+  char *member;
+  dbus_bool_t is_signal;
+
+  Arg *args;
+  int n_args;
+  int n_allocated;
+} Generator;
+
+static const struct
+{
+  char code;
+  const char *c_type;
+  const char *macro;
+} basic_types[] = {
+  { DBUS_TYPE_BYTE, "unsigned char", "DBUS_TYPE_BYTE" },
+  { DBUS_TYPE_BOOLEAN, "dbus_bool_t", "DBUS_TYPE_BOOLEAN" },
+  { DBUS_TYPE_INT16, "dbus_int16_t", "DBUS_TYPE_INT16" },
+  { DBUS_TYPE_UINT16, "dbus_uint16_t", "DBUS_TYPE_UINT16" },
+  { DBUS_TYPE_INT32, "dbus_int32_t", "DBUS_TYPE_INT32" },
+  { DBUS_TYPE_UINT32, "dbus_uint32_t", "DBUS_TYPE_UINT32" },
+  { DBUS_TYPE_INT64, "dbus_int64_t", "DBUS_TYPE_INT64" },
+  { DBUS_TYPE_UINT64, "dbus_uint64_t", "DBUS_TYPE_UINT64" },
+  { DBUS_TYPE_DOUBLE, "double", "DBUS_TYPE_DOUBLE" },
+  { DBUS_TYPE_UNIX_FD, "int", "DBUS_TYPE_UNIX_FD" },
+  { DBUS_TYPE_STRING, "const char *", "DBUS_TYPE_STRING" },
+  { DBUS_TYPE_OBJECT_PATH, "const char *", "DBUS_TYPE_OBJECT_PATH" },
+  { DBUS_TYPE_SIGNATURE, "const char *", "DBUS_TYPE_SIGNATURE" }
+};
+
+static void
+usage (const char *name, int ecode)
+{
+  fprintf (stderr,
+           "Usage: %s [--header | --body] [--prefix=PREFIX] "
+           "[--include=HEADER] [FILE]\n",
+           name);
+  exit (ecode);
+}
+
+static void
+version (void)
+{
+  printf ("D-Bus Marshaller Generator %s\n"
+          "This is free software; see the source for copying conditions.\n"
+          "There is NO warranty; not even for MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.\n",
+          VERSION);
+  exit (0);
+}
+
+static char *
+xstrdup (const char *str)
+{
+  char *copy;
+
+  copy = strdup (str);
+  if (copy == NULL)
+    tool_oom ("copying a string");
+
+  return copy;
+}
+
+static void
+fail (Generator  *gen,
+      const char *message)
+{
+  fprintf (stderr, "%s:%lu: %s\n", gen->filename,
+           (unsigned long) XML_GetCurrentLineNumber (gen->parser),
+           message);
+  exit (1);
+}
+
+static const char *
+get_attribute (const char **attrs,
+               const char  *name)
+{
+  int i;
+
+  for (i = 0; attrs[i] != NULL; i += 2)
+    {
+      if (strcmp (attrs[i], name) == 0)
+        return attrs[i + 1];
+    }
+
+  return NULL;
+}
+
+static int
+find_basic_type (char code)
+{
+  int i;
+
+  for (i = 0; i < (int) (sizeof (basic_types) / sizeof (basic_types[0])); i++)
+    {
+      if (basic_types[i].code == code)
+        return i;
+    }
+
+  return -1;
+}
+
+/* Works out how an argument is passed, and which basic type it's made of */
+static ArgKind
+classify_type (const char *type,
+               int        *basic)
+{
+  if (type[0] != '\0' && type[1] == '\0')
+    {
+      *basic = find_basic_type (type[0]);
+      return *basic < 0 ? KIND_UNSUPPORTED : KIND_BASIC;
+    }
+
+  if (type[0] != DBUS_TYPE_ARRAY || type[1] == '\0' || type[2] != '\0')
+    return KIND_UNSUPPORTED;
+
+  *basic = find_basic_type (type[1]);
+
+  if (*basic < 0 || type[1] == DBUS_TYPE_UNIX_FD)
+    return KIND_UNSUPPORTED;
+
+  if (dbus_type_is_fixed (type[1]))
+    return KIND_FIXED_ARRAY;
+
+  return KIND_STRING_ARRAY;
+}
+
+/* Appends NAME to STR as lower case with underscores: "GetNameOwner"
+ * becomes "get_name_owner" and "org.freedesktop.DBus" becomes
+ * "org_freedesktop_d_bus".
+ */
+static void
+append_uscore (char       *str,
+               const char *name)
+{
+  char *p;
+  int i;
+
+  p = str + strlen (str);
+
+  for (i = 0; name[i] != '\0'; i++)
+    {
+      unsigned char c = name[i];
+
+      if (isupper (c))
+        {
+          if (i > 0 &&
+              (islower ((unsigned char) name[i - 1]) ||
+               isdigit ((unsigned char) name[i - 1]) ||
+               (isupper ((unsigned char) name[i - 1]) &&
+                islower ((unsigned char) name[i + 1]))))
+            *p++ = '_';
+
+          *p++ = tolower (c);
+        }
+      else if (isalnum (c))
+        {
+          *p++ = c;
+        }
+      else
+        {
+          *p++ = '_';
+        }
+    }
+
+  *p = '\0';
+}
+
+/* Worst case for append_uscore() */
+#define USCORE_LENGTH(name) (2 * strlen (name))
+
+static char *
+make_function_name (Generator  *gen,
+                    const char *verb,
+                    const char *suffix)
+{
+  char *name;
+  size_t len;
+
+  len = strlen (gen->prefix) + USCORE_LENGTH (gen->interface) +
+    USCORE_LENGTH (gen->member) + strlen (verb) + strlen (suffix) + 5;
+
+  name = malloc (len);
+  if (name == NULL)
+    tool_oom ("building a function name");
+
+  strcpy (name, gen->prefix);
+  if (name[0] != '\0')
+    strcat (name, "_");
+  append_uscore (name, gen->interface);
+  strcat (name, "_");
+  append_uscore (name, gen->member);
+  strcat (name, "_");
+  strcat (name, verb);
+
+  if (suffix[0] != '\0')
+    {
+      strcat (name, "_");
+      strcat (name, suffix);
+    }
+
+  return name;
+}
+
+static void
+print_param (const char *c_type,
+             const char *pointers,
+             const char *name,
+             int         indent)
+{
+  /* "const char *" already ends with its space */
+  printf (",\n%*s%s%s%s%s", indent, "", c_type,
+          c_type[strlen (c_type) - 1] == '*' ? "" : " ",
+          pointers, name);
+}
+
+static void
+print_signature (const char  *function,
+                 dbus_bool_t  getter,
+                 Arg        **args,
+                 int          n_args)
+{
+  int indent;
+  int i;
+
+  indent = strlen (function) + 2;
+
+  printf ("dbus_bool_t\n%s (DBusMessage *message", function);
+
+  if (getter)
+    printf (",\n%*sDBusError   *error", indent, "");
+
+  for (i = 0; i < n_args; i++)
+    {
+      const char *dir = args[i]->in ? "IN_" : "OUT_";
+      char name[256];
+      char n_name[256];
+      char c_type[64];
+      int basic;
+      ArgKind kind;
+
+      kind = classify_type (args[i]->type, &basic);
+      snprintf (name, sizeof (name), "%s%s", dir, args[i]->name);
+      snprintf (n_name, sizeof (n_name), "n_%s%s", dir, args[i]->name);
+
+      switch (kind)
+        {
+        case KIND_BASIC:
+          print_param (basic_types[basic].c_type, getter ? "*" : "",
+                       name, indent);
+          break;
+
+        case KIND_FIXED_ARRAY:
+          snprintf (c_type, sizeof (c_type), "const %s",
+                    basic_types[basic].c_type);
+          print_param (c_type, getter ? "**" : "*", name, indent);
+          print_param ("int", getter ? "*" : "", n_name, indent);
+          break;
+
+        case KIND_STRING_ARRAY:
+          print_param (getter ? "char" : "const char",
+                       getter ? "***" : "**", name, indent);
+          print_param ("int", getter ? "*" : "", n_name, indent);
+          break;
+
+        case KIND_UNSUPPORTED:
+        default:
+          abort ();
+        }
+    }
+
+  printf (")");
+}
+
+static void
+print_type_list (Arg         **args,
+                 int           n_args,
+                 dbus_bool_t   getter,
+                 int           indent)
+{
+  int i;
+
+  for (i = 0; i < n_args; i++)
+    {
+      const char *dir = args[i]->in ? "IN_" : "OUT_";
+      const char *ref = getter ? "" : "&";
+      int basic;
+
+      if (classify_type (args[i]->type, &basic) == KIND_BASIC)
+        printf ("%*s%s, %s%s%s,\n", indent, "", basic_types[basic].macro,
+                ref, dir, args[i]->name);
+      else
+        printf ("%*sDBUS_TYPE_ARRAY, %s, %s%s%s, n_%s%s,\n", indent, "",
+                basic_types[basic].macro, ref, dir, args[i]->name,
+                dir, args[i]->name);
+    }
+
+  printf ("%*sDBUS_TYPE_INVALID);\n", indent, "");
+}
+
+/* Writes the pair of functions for the arguments of the current
+ * member going in one direction.
+ */
+static void
+emit_functions (Generator   *gen,
+                dbus_bool_t  in,
+                const char  *suffix)
+{
+  Arg **args;
+  char *signature;
+  char *append_name;
+  char *get_name;
+  int n_args;
+  int i;
+
+  args = malloc (sizeof (Arg *) * (gen->n_args + 1));
+  signature = malloc (DBUS_MAXIMUM_SIGNATURE_LENGTH + 1);
+  if (args == NULL || signature == NULL)
+    tool_oom ("collecting arguments");
+
+  n_args = 0;
+  signature[0] = '\0';
+
+  for (i = 0; i < gen->n_args; i++)
+    {
+      int basic;
+
+      if (gen->args[i].in != in)
+        continue;
+
+      if (strlen (signature) + strlen (gen->args[i].type) >
+          DBUS_MAXIMUM_SIGNATURE_LENGTH)
+        fail (gen, "Signature is too long");
+
+      strcat (signature, gen->args[i].type);
+
+      if (classify_type (gen->args[i].type, &basic) == KIND_UNSUPPORTED)
+        {
+          printf ("/* %s.%s (%s): \"%s\" is not supported, use DBusMessageIter */\n\n",
+                  gen->interface, gen->member, in ? "in" : "out",
+                  gen->args[i].type);
+          fprintf (stderr, "%s: skipping %s.%s: can't handle type \"%s\"\n",
+                   gen->filename, gen->interface, gen->member,
+                   gen->args[i].type);
+          goto out;
+        }
+
+      args[n_args++] = &gen->args[i];
+    }
+
+  append_name = make_function_name (gen, "append", suffix);
+  get_name = make_function_name (gen, "get", suffix);
+
+  printf ("/* %s.%s%s%s (\"%s\") */\n", gen->interface, gen->member,
+          suffix[0] != '\0' ? " " : "", suffix, signature);
+
+  print_signature (append_name, FALSE, args, n_args);
+
+  if (gen->mode == MODE_HEADER)
+    {
+      printf (";\n");
+    }
+  else
+    {
+      printf ("\n{\n"
+              "  return dbus_message_append_args (message,\n");
+      print_type_list (args, n_args, FALSE, 34);
+      printf ("}\n");
+    }
+
+  printf ("\n");
+  print_signature (get_name, TRUE, args, n_args);
+
+  if (gen->mode == MODE_HEADER)
+    {
+      printf (";\n");
+    }
+  else
+    {
+      printf ("\n{\n"
+              "  if (!dbus_message_has_signature (message, \"%s\"))\n"
+              "    {\n"
+              "      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,\n"
+              "                      \"Expected arguments \\\"%%s\\\" but got \\\"%%s\\\"\",\n"
+              "                      \"%s\", dbus_message_get_signature (message));\n"
+              "      return FALSE;\n"
+              "    }\n"
+              "\n"
+              "  return dbus_message_get_args (message, error,\n",
+              signature, signature);
+      print_type_list (args, n_args, TRUE, 31);
+      printf ("}\n");
+    }
+
+  printf ("\n");
+
+  free (append_name);
+  free (get_name);
+
+ out:
+  free (args);
+  free (signature);
+}
+
+static void
+clear_member (Generator *gen)
+{
+  int i;
+
+  for (i = 0; i < gen->n_args; i++)
+    {
+      free (gen->args[i].name);
+      free (gen->args[i].type);
+    }
+
+  gen->n_args = 0;
+  free (gen->member);
+  gen->member = NULL;
+}
+
+static void
+add_arg (Generator   *gen,
+         const char **attrs)
+{
+  const char *name;
+  const char *type;
+  const char *direction;
+  char buf[64];
+  Arg *arg;
+  char *p;
+
+  name = get_attribute (attrs, "name");
+  type = get_attribute (attrs, "type");
+  direction = get_attribute (attrs, "direction");
+
+  if (type == NULL)
+    fail (gen, "<arg> has no type");
+
+  if (!dbus_signature_validate_single (type, NULL))
+    fail (gen, "<arg> type is not a single complete type");
+
+  if (gen->n_args == gen->n_allocated)
+    {
+      int n = gen->n_allocated == 0 ? 8 : gen->n_allocated * 2;
+      Arg *args = realloc (gen->args, sizeof (Arg) * n);
+
+      if (args == NULL)
+        tool_oom ("adding an argument");
+
+      gen->args = args;
+      gen->n_allocated = n;
+    }
+
+  arg = &gen->args[gen->n_args];
+
+  if (name == NULL || name[0] == '\0')
+    {
+      snprintf (buf, sizeof (buf), "arg%d", gen->n_args);
+      name = buf;
+    }
+
+  arg->name = xstrdup (name);
+  arg->type = xstrdup (type);
+
+  /* Signal arguments are always outgoing */
+  if (gen->is_signal)
+    arg->in = FALSE;
+  else
+    arg->in = (direction == NULL || strcmp (direction, "in") == 0);
+
+  for (p = arg->name; *p != '\0'; p++)
+    {
+      if (!isalnum ((unsigned char) *p))
+        *p = '_';
+    }
+
+  /* keep the generated names short enough for print_signature() */
+  if (strlen (arg->name) > 200)
+    arg->name[200] = '\0';
+
+  gen->n_args += 1;
+}
+
+static void XMLCALL
+start_element (void        *data,
+               const char  *element,
+               const char **attrs)
+{
+  Generator *gen = data;
+  const char *name;
+
+  if (strcmp (element, "interface") == 0)
+    {
+      name = get_attribute (attrs, "name");
+      if (name == NULL)
+        fail (gen, "<interface> has no name");
+
+      free (gen->interface);
+      gen->interface = xstrdup (name);
+    }
+  else if (gen->interface != NULL &&
+           (strcmp (element, "method") == 0 ||
+            strcmp (element, "signal") == 0))
+    {
+      name = get_attribute (attrs, "name");
+      if (name == NULL)
+        fail (gen, "member has no name");
+
+      clear_member (gen);
+      gen->member = xstrdup (name);
+      gen->is_signal = (element[0] == 's');
+    }
+  else if (gen->member != NULL && strcmp (element, "arg") == 0)
+    {
+      add_arg (gen, attrs);
+    }
+}
+
+static void XMLCALL
+end_element (void       *data,
+             const char *element)
+{
+  Generator *gen = data;
+
+  if (strcmp (element, "interface") == 0)
+    {
+      free (gen->interface);
+      gen->interface = NULL;
+    }
+  else if (gen->member != NULL && strcmp (element, "method") == 0)
+    {
+      emit_functions (gen, TRUE, "in");
+      emit_functions (gen, FALSE, "out");
+      clear_member (gen);
+    }
+  else if (gen->member != NULL && strcmp (element, "signal") == 0)
+    {
+      emit_functions (gen, FALSE, "");
+      clear_member (gen);
+    }
+}
+
+/* "foo/com.example.Foo.xml" -> "COM_EXAMPLE_FOO_MARSHAL_H" */
+static char *
+make_include_guard (const char *filename)
+{
+  const char *base;
+  const char *dot;
+  char *guard;
+  size_t len;
+  size_t i;
+
+  base = strrchr (filename, '/');
+  base = (base == NULL) ? filename : base + 1;
+  dot = strrchr (base, '.');
+  len = (dot == NULL) ? strlen (base) : (size_t) (dot - base);
+
+  guard = malloc (len + sizeof ("_MARSHAL_H"));
+  if (guard == NULL)
+    tool_oom ("building the include guard");
+
+  for (i = 0; i < len; i++)
+    {
+      unsigned char c = base[i];
+
+      guard[i] = isalnum (c) ? toupper (c) : '_';
+    }
+
+  strcpy (guard + len, "_MARSHAL_H");
+  return guard;
+}
+
+int
+main (int argc, char *argv[])
+{
+  Generator gen;
+  const char *include;
+  const char *input;
+  char *guard = NULL;
+  FILE *file;
+  int i;
+
+  memset (&gen, 0, sizeof (gen));
+  gen.mode = MODE_BODY;
+  gen.prefix = "";
+  include = NULL;
+  input = NULL;
+
+  for (i = 1; i < argc; i++)
+    {
+      const char *arg = argv[i];
+
+      if (strcmp (arg, "--header") == 0)
+        gen.mode = MODE_HEADER;
+      else if (strcmp (arg, "--body") == 0)
+        gen.mode = MODE_BODY;
+      else if (strncmp (arg, "--prefix=", strlen ("--prefix=")) == 0)
+        gen.prefix = arg + strlen ("--prefix=");
+      else if (strncmp (arg, "--include=", strlen ("--include=")) == 0)
+        include = arg + strlen ("--include=");
+      else if (strcmp (arg, "--help") == 0)
+        usage (argv[0], 0);
+      else if (strcmp (arg, "--version") == 0)
+        version ();
+      else if (arg[0] == '-' && arg[1] != '\0')
+        usage (argv[0], 1);
+      else if (input == NULL)
+        input = arg;
+      else
+        usage (argv[0], 1);
+    }
+
+  if (input == NULL || strcmp (input, "-") == 0)
+    {
+      gen.filename = "<stdin>";
+      file = stdin;
+    }
+  else
+    {
+      gen.filename = input;
+      file = fopen (input, "r");
+
+      if (file == NULL)
+        {
+          fprintf (stderr, "%s: can't open %s: %s\n", argv[0], input,
+                   strerror (errno));
+          exit (1);
+        }
+    }
+
+  gen.parser = XML_ParserCreate (NULL);
+  if (gen.parser == NULL)
+    tool_oom ("creating the XML parser");
+
+  XML_SetUserData (gen.parser, &gen);
+  XML_SetElementHandler (gen.parser, start_element, end_element);
+
+  printf ("/* Generated by dbus-marshal-gen from %s. Do not edit. */\n\n",
+          gen.filename);
+
+  if (gen.mode == MODE_HEADER)
+    {
+      guard = make_include_guard (input != NULL ? input : "dbus-marshal-gen");
+      printf ("#ifndef %s\n"
+              "#define %s\n"
+              "\n"
+              "#include <dbus/dbus.h>\n"
+              "\n"
+              "DBUS_BEGIN_DECLS\n"
+              "\n",
+              guard, guard);
+    }
+  else if (include != NULL)
+    {
+      printf ("#include \"%s\"\n\n", include);
+    }
+  else
+    {
+      printf ("#include <dbus/dbus.h>\n\n");
+    }
+
+  while (TRUE)
+    {
+      char buf[4096];
+      size_t len;
+      int done;
+
+      len = fread (buf, 1, sizeof (buf), file);
+      done = len < sizeof (buf);
+
+      if (ferror (file))
+        {
+          fprintf (stderr, "%s: error reading %s\n", argv[0], gen.filename);
+          exit (1);
+        }
+
+      if (XML_Parse (gen.parser, buf, len, done) == XML_STATUS_ERROR)
+        fail (&gen, XML_ErrorString (XML_GetErrorCode (gen.parser)));
+
+      if (done)
+        break;
+    }
+
+  if (gen.mode == MODE_HEADER)
+    printf ("DBUS_END_DECLS\n"
+            "\n"
+            "#endif /* %s */\n",
+            guard);
+
+  XML_ParserFree (gen.parser);
+
+  if (file != stdin)
+    fclose (file);
+
+  clear_member (&gen);
+  free (gen.args);
+  free (gen.interface);
+  free (guard);
+
+  if (fflush (stdout) != 0 || ferror (stdout))
+    {
+      fprintf (stderr, "%s: error writing output\n", argv[0]);
+      exit (1);
+    }
+
+  return 0;
+}
@@ -22,6 +22,7 @@
 #include <config.h>
 
 #include "dbus/dbus-internals.h"        /* just for the macros */
+#include "dbus/dbus-message-internal.h" /* for zero-copy binary output */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -199,20 +200,65 @@ typedef enum {
     BINARY_MODE_PCAP
 } BinaryMode;
 
+/* Binary output is collected here and written out in one go once
+ * everything libdbus has already read is dispatched, so a busy bus
+ * costs one write() per batch rather than two per message, and a
+ * quiet one still sees each message straight away. */
+#define BINARY_BATCH_SIZE (256 * 1024)
+
+static char binary_batch[BINARY_BATCH_SIZE];
+static size_t binary_batch_len = 0;
+
+static void
+binary_write (const void *data,
+              size_t      len)
+{
+  if (!tool_write_all (STDOUT_FILENO, data, len))
+    {
+      perror ("dbus-monitor: write");
+      exit (1);
+    }
+}
+
+static void
+binary_flush (void)
+{
+  binary_write (binary_batch, binary_batch_len);
+  binary_batch_len = 0;
+}
+
+static void
+binary_append (const void *data,
+               size_t      len)
+{
+  if (binary_batch_len + len > BINARY_BATCH_SIZE)
+    binary_flush ();
+
+  /* anything too big to batch goes straight out, after what came before */
+  if (len > BINARY_BATCH_SIZE)
+    {
+      binary_write (data, len);
+      return;
+    }
+
+  memcpy (binary_batch + binary_batch_len, data, len);
+  binary_batch_len += len;
+}
+
 static DBusHandlerResult
 binary_filter_func (DBusConnection *connection,
                     DBusMessage    *message,
                     void           *user_data)
 {
   BinaryMode mode = _DBUS_POINTER_TO_INT (user_data);
-  char *blob;
+  const DBusString *header, *body;
   int len;
 
-  /* It would be nice if we could do a zero-copy "peek" one day, but libdbus
-   * is so copy-happy that this isn't really a big deal.
-   */
-  if (!dbus_message_marshal (message, &blob, &len))
-    tool_oom ("retrieving message");
+  /* Copy the message's own buffers instead of marshalling it into a
+   * new allocation; locking it makes them what went over the wire. */
+  dbus_message_lock (message);
+  _dbus_message_get_network_data (message, &header, &body);
+  len = _dbus_string_get_length (header) + _dbus_string_get_length (body);
 
   switch (mode)
     {
@@ -223,20 +269,16 @@ binary_filter_func (DBusConnection *connection,
              * original length.
              * http://wiki.wireshark.org/Development/LibpcapFileFormat
              */
-            dbus_uint32_t header[4] = { 0, 0, len, len };
+            dbus_uint32_t packet_header[4] = { 0, 0, len, len };
 
             /* If this gets padded then we'd need to write it out in pieces */
-            _DBUS_STATIC_ASSERT (sizeof (header) == 16);
+            _DBUS_STATIC_ASSERT (sizeof (packet_header) == 16);
 
             _dbus_get_real_time (&tv_sec, &tv_usec);
-            header[0] = tv_sec;
-            header[1] = tv_usec;
+            packet_header[0] = tv_sec;
+            packet_header[1] = tv_usec;
 
-            if (!tool_write_all (STDOUT_FILENO, header, sizeof (header)))
-              {
-                perror ("dbus-monitor: write");
-                exit (1);
-              }
+            binary_append (packet_header, sizeof (packet_header));
           }
         break;
 
@@ -246,18 +288,22 @@ binary_filter_func (DBusConnection *connection,
         break;
     }
 
-  if (!tool_write_all (STDOUT_FILENO, blob, len))
-    {
-      perror ("dbus-monitor: write");
-      exit (1);
-    }
-
-  dbus_free (blob);
+  binary_append (_dbus_string_get_const_data (header),
+                 _dbus_string_get_length (header));
+  binary_append (_dbus_string_get_const_data (body),
+                 _dbus_string_get_length (body));
 
   if (dbus_message_is_signal (message,
                               DBUS_INTERFACE_LOCAL,
                               "Disconnected"))
-    exit (0);
+    {
+      binary_flush ();
+      exit (0);
+    }
+
+  if (dbus_connection_get_dispatch_status (connection) !=
+      DBUS_DISPATCH_DATA_REMAINS)
+    binary_flush ();
 
   return DBUS_HANDLER_RESULT_HANDLED;
 }
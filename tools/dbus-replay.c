@@ -0,0 +1,902 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-replay.c - replay a dbus-monitor --pcap capture against a bus
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dbus/dbus.h>
+
+#include "dbus/dbus-hash.h"
+#include "dbus/dbus-sysdeps.h"
+#include "test-tool.h"
+#include "tool-common.h"
+
+/* http://www.tcpdump.org/linktypes.html */
+#define LINKTYPE_DBUS 231
+
+#define PCAP_MAGIC         0xA1B2C3D4U
+#define PCAP_MAGIC_NSEC    0xA1B23C4DU
+
+/* One message from the capture */
+typedef struct
+{
+  dbus_int64_t at;        /**< When it was captured, in microseconds */
+  DBusMessage *message;
+  dbus_bool_t answered;   /**< A method call that the capture has a reply to */
+} CapturedMessage;
+
+/* One method call as it was replayed */
+typedef struct
+{
+  dbus_uint32_t serial;   /**< Its serial in the replay */
+  dbus_int64_t sent_at;
+  dbus_bool_t delivered;  /**< The replayed callee has received it */
+  dbus_bool_t awaited;    /**< A reply is expected and hasn't come */
+} ReplayCall;
+
+/* A connection from the capture, and the one that stands in for it */
+typedef struct
+{
+  char *capture_name;
+  DBusConnection *connection;
+  /* the capture's serial of each of its calls -> CapturedMessage */
+  DBusHashTable *captured_calls;
+  /* the capture's serial of each call sent -> ReplayCall */
+  DBusHashTable *calls_by_capture_serial;
+  /* the replay's serial of each call sent -> ReplayCall */
+  DBusHashTable *calls_by_serial;
+  /* well-known names it answered calls to */
+  char **names;
+  int n_names;
+} ReplayPeer;
+
+static CapturedMessage *captured = NULL;
+static int n_captured = 0;
+
+static ReplayPeer **peers = NULL;
+static int n_peers = 0;
+static DBusHashTable *peers_by_capture_name = NULL;
+static DBusHashTable *peers_by_name = NULL;
+
+/* round-trip times of the replayed method calls, in microseconds */
+static dbus_int64_t *latencies = NULL;
+static int n_latencies = 0;
+static int latencies_size = 0;
+static int n_awaited = 0;
+
+static void
+usage (int ecode)
+{
+  fprintf (stderr,
+           "Usage: dbus-test-tool replay [OPTIONS] CAPTURE\n"
+           "\n"
+           "Replay the traffic in CAPTURE, written by dbus-monitor --pcap\n"
+           "(or '-' for stdin), with one connection per peer seen in it.\n"
+           "\n"
+           "Options:\n"
+           "\n"
+           "    --session     use the session bus (default)\n"
+           "    --system      use the system bus\n"
+           "    --address=ADDRESS  use the bus at ADDRESS\n"
+           "\n"
+           "    --fast        send as fast as possible, instead of keeping\n"
+           "                  the captured intervals between messages\n"
+           "    --reply-wait=MS   how long a reply waits for its call to be\n"
+           "                  delivered before it is skipped (default 1000)\n"
+           "\n"
+           );
+  exit (ecode);
+}
+
+static dbus_int64_t
+now_usec (void)
+{
+  long tv_sec, tv_usec;
+
+  _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+  return ((dbus_int64_t) tv_sec) * 1000000 + tv_usec;
+}
+
+static dbus_uint32_t
+swap_uint32 (dbus_uint32_t value,
+             dbus_bool_t   swap)
+{
+  if (!swap)
+    return value;
+
+  return ((value & 0x000000FFU) << 24) |
+         ((value & 0x0000FF00U) << 8) |
+         ((value & 0x00FF0000U) >> 8) |
+         ((value & 0xFF000000U) >> 24);
+}
+
+static void
+read_exactly (FILE       *file,
+              void       *buf,
+              size_t      len,
+              const char *what)
+{
+  if (fread (buf, 1, len, file) != len)
+    {
+      fprintf (stderr, "Capture is truncated in %s\n", what);
+      exit (1);
+    }
+}
+
+/* Reads the whole capture into memory, so that replies can be
+ * matched to their calls before anything is sent */
+static void
+load_capture (FILE *file)
+{
+  dbus_uint32_t file_header[6];
+  dbus_bool_t swap, nsec;
+  int size = 0;
+  char *data = NULL;
+  dbus_uint32_t data_size = 0;
+
+  read_exactly (file, file_header, sizeof (file_header), "the file header");
+
+  swap = FALSE;
+  if (file_header[0] == swap_uint32 (PCAP_MAGIC, TRUE) ||
+      file_header[0] == swap_uint32 (PCAP_MAGIC_NSEC, TRUE))
+    swap = TRUE;
+
+  nsec = (swap_uint32 (file_header[0], swap) == PCAP_MAGIC_NSEC);
+
+  if (swap_uint32 (file_header[0], swap) != PCAP_MAGIC && !nsec)
+    {
+      fprintf (stderr, "Not a pcap capture\n");
+      exit (1);
+    }
+
+  if (swap_uint32 (file_header[5], swap) != LINKTYPE_DBUS)
+    {
+      fprintf (stderr, "Not a capture of D-Bus messages\n");
+      exit (1);
+    }
+
+  while (TRUE)
+    {
+      dbus_uint32_t packet_header[4];
+      dbus_uint32_t len, orig_len;
+      DBusError error = DBUS_ERROR_INIT;
+      DBusMessage *message;
+
+      if (fread (packet_header, 1, sizeof (packet_header), file) !=
+          sizeof (packet_header))
+        break;
+
+      len = swap_uint32 (packet_header[2], swap);
+      orig_len = swap_uint32 (packet_header[3], swap);
+
+      if (len > data_size)
+        {
+          char *tmp = dbus_realloc (data, len);
+
+          if (tmp == NULL)
+            tool_oom ("reading the capture");
+
+          data = tmp;
+          data_size = len;
+        }
+
+      read_exactly (file, data, len, "a message");
+
+      if (len < orig_len)
+        {
+          VERBOSE (stderr, "Skipping a message truncated by the capture\n");
+          continue;
+        }
+
+      message = dbus_message_demarshal (data, len, &error);
+
+      if (message == NULL)
+        {
+          fprintf (stderr, "Skipping a message that can't be read: %s\n",
+                   error.message);
+          dbus_error_free (&error);
+          continue;
+        }
+
+      if (n_captured == size)
+        {
+          CapturedMessage *tmp;
+
+          size = size > 0 ? size * 2 : 1024;
+          tmp = dbus_realloc (captured, size * sizeof (CapturedMessage));
+
+          if (tmp == NULL)
+            tool_oom ("reading the capture");
+
+          captured = tmp;
+        }
+
+      captured[n_captured].at =
+        ((dbus_int64_t) swap_uint32 (packet_header[0], swap)) * 1000000 +
+        swap_uint32 (packet_header[1], swap) / (nsec ? 1000 : 1);
+      captured[n_captured].message = message;
+      captured[n_captured].answered = FALSE;
+      n_captured++;
+    }
+
+  dbus_free (data);
+}
+
+static dbus_bool_t
+is_peer_name (const char *name)
+{
+  return name != NULL && name[0] == ':';
+}
+
+static ReplayPeer *
+peer_for_capture_name (const char *name)
+{
+  ReplayPeer *peer;
+  ReplayPeer **tmp;
+
+  peer = _dbus_hash_table_lookup_string (peers_by_capture_name, name);
+
+  if (peer != NULL)
+    return peer;
+
+  peer = dbus_new0 (ReplayPeer, 1);
+  tmp = dbus_realloc (peers, (n_peers + 1) * sizeof (ReplayPeer *));
+
+  if (peer == NULL || tmp == NULL)
+    tool_oom ("adding a peer");
+
+  peers = tmp;
+  peer->capture_name = strdup (name);
+  peer->captured_calls = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+                                               NULL, NULL);
+  peer->calls_by_capture_serial = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+                                                        NULL, dbus_free);
+  peer->calls_by_serial = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+                                                NULL, NULL);
+
+  if (peer->capture_name == NULL ||
+      peer->captured_calls == NULL ||
+      peer->calls_by_capture_serial == NULL ||
+      peer->calls_by_serial == NULL ||
+      !_dbus_hash_table_insert_string (peers_by_capture_name,
+                                       peer->capture_name, peer))
+    tool_oom ("adding a peer");
+
+  peers[n_peers++] = peer;
+  return peer;
+}
+
+static void
+peer_add_name (ReplayPeer *peer,
+               const char *name)
+{
+  char **tmp;
+  int i;
+
+  for (i = 0; i < peer->n_names; i++)
+    {
+      if (strcmp (peer->names[i], name) == 0)
+        return;
+    }
+
+  tmp = dbus_realloc (peer->names, (peer->n_names + 1) * sizeof (char *));
+
+  if (tmp == NULL)
+    tool_oom ("adding a name");
+
+  peer->names = tmp;
+  peer->names[peer->n_names] = strdup (name);
+
+  if (peer->names[peer->n_names] == NULL)
+    tool_oom ("adding a name");
+
+  peer->n_names++;
+}
+
+/* Finds the peers, which calls have replies, and the well-known names
+ * that the peers must have owned since before the capture started */
+static void
+analyse_capture (void)
+{
+  int i;
+
+  for (i = 0; i < n_captured; i++)
+    {
+      DBusMessage *message = captured[i].message;
+      const char *sender = dbus_message_get_sender (message);
+      const char *destination = dbus_message_get_destination (message);
+      ReplayPeer *caller;
+      CapturedMessage *call;
+      const char *called;
+
+      if (is_peer_name (destination))
+        peer_for_capture_name (destination);
+
+      if (!is_peer_name (sender))
+        continue;
+
+      peer_for_capture_name (sender);
+
+      switch (dbus_message_get_type (message))
+        {
+          case DBUS_MESSAGE_TYPE_METHOD_CALL:
+            caller = peer_for_capture_name (sender);
+
+            if (!_dbus_hash_table_insert_uintptr (caller->captured_calls,
+                    dbus_message_get_serial (message), &captured[i]))
+              tool_oom ("indexing calls");
+
+            break;
+
+          case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+          case DBUS_MESSAGE_TYPE_ERROR:
+            if (!is_peer_name (destination))
+              break;
+
+            caller = peer_for_capture_name (destination);
+            call = _dbus_hash_table_lookup_uintptr (caller->captured_calls,
+                dbus_message_get_reply_serial (message));
+
+            if (call == NULL)
+              break;
+
+            call->answered = TRUE;
+            called = dbus_message_get_destination (call->message);
+
+            if (called != NULL && !is_peer_name (called) &&
+                strcmp (called, DBUS_SERVICE_DBUS) != 0)
+              peer_add_name (peer_for_capture_name (sender), called);
+
+            break;
+
+          default:
+            break;
+        }
+    }
+}
+
+static void
+record_latency (dbus_int64_t sent_at)
+{
+  if (n_latencies == latencies_size)
+    {
+      dbus_int64_t *tmp;
+
+      latencies_size = latencies_size > 0 ? latencies_size * 2 : 1024;
+      tmp = dbus_realloc (latencies, latencies_size * sizeof (dbus_int64_t));
+
+      if (tmp == NULL)
+        tool_oom ("recording latencies");
+
+      latencies = tmp;
+    }
+
+  latencies[n_latencies++] = now_usec () - sent_at;
+}
+
+/*
+ * Notes calls arriving at their replayed callee, so that the reply
+ * isn't sent before the call, and replies arriving at the caller.
+ * Everything is handled here, so that libdbus doesn't answer the
+ * replayed calls itself.
+ */
+static DBusHandlerResult
+replay_filter (DBusConnection *connection,
+               DBusMessage    *message,
+               void           *user_data)
+{
+  ReplayPeer *peer = user_data;
+  ReplayPeer *caller;
+  ReplayCall *call;
+
+  switch (dbus_message_get_type (message))
+    {
+      case DBUS_MESSAGE_TYPE_METHOD_CALL:
+        if (dbus_message_get_sender (message) == NULL)
+          break;
+
+        caller = _dbus_hash_table_lookup_string (peers_by_name,
+            dbus_message_get_sender (message));
+
+        if (caller == NULL)
+          break;
+
+        call = _dbus_hash_table_lookup_uintptr (caller->calls_by_serial,
+            dbus_message_get_serial (message));
+
+        if (call != NULL)
+          call->delivered = TRUE;
+
+        break;
+
+      case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+      case DBUS_MESSAGE_TYPE_ERROR:
+        call = _dbus_hash_table_lookup_uintptr (peer->calls_by_serial,
+            dbus_message_get_reply_serial (message));
+
+        if (call != NULL && call->awaited)
+          {
+            record_latency (call->sent_at);
+            call->awaited = FALSE;
+            n_awaited--;
+          }
+
+        break;
+
+      case DBUS_MESSAGE_TYPE_SIGNAL:
+        if (dbus_message_is_signal (message, DBUS_INTERFACE_LOCAL,
+                                    "Disconnected"))
+          {
+            fprintf (stderr, "Disconnected from bus\n");
+            exit (1);
+          }
+
+        break;
+
+      default:
+        break;
+    }
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/* Drives every connection from one poll(), for up to timeout
+ * milliseconds, or until something happened if timeout is -1 */
+static void
+replay_iterate (DBusPollFD *fds,
+                int         timeout)
+{
+  int i;
+
+  for (i = 0; i < n_peers; i++)
+    {
+      int fd;
+
+      if (dbus_connection_get_dispatch_status (peers[i]->connection) ==
+          DBUS_DISPATCH_DATA_REMAINS)
+        timeout = 0;
+
+      if (!dbus_connection_get_socket (peers[i]->connection, &fd))
+        {
+          fprintf (stderr, "Disconnected from bus\n");
+          exit (1);
+        }
+
+#ifdef DBUS_WIN
+      fds[i].fd.sock = fd;
+#else
+      fds[i].fd = fd;
+#endif
+      fds[i].events = _DBUS_POLLIN;
+      fds[i].revents = 0;
+
+      if (dbus_connection_has_messages_to_send (peers[i]->connection))
+        fds[i].events |= _DBUS_POLLOUT;
+    }
+
+  _dbus_poll (fds, n_peers, timeout);
+
+  for (i = 0; i < n_peers; i++)
+    {
+      if (fds[i].revents != 0 &&
+          !dbus_connection_read_write (peers[i]->connection, 0))
+        {
+          fprintf (stderr, "Disconnected from bus\n");
+          exit (1);
+        }
+
+      while (dbus_connection_dispatch (peers[i]->connection) ==
+             DBUS_DISPATCH_DATA_REMAINS)
+        ;
+    }
+}
+
+/* Waits until the given time, or until *done is TRUE */
+static void
+replay_wait (DBusPollFD        *fds,
+             dbus_int64_t       until,
+             const dbus_bool_t *done)
+{
+  dbus_int64_t now;
+
+  while ((done == NULL || !*done) && (now = now_usec ()) < until)
+    replay_iterate (fds, (int) ((until - now + 999) / 1000));
+}
+
+static DBusConnection *
+replay_connect (DBusBusType  type,
+                const char  *address)
+{
+  DBusConnection *connection;
+  DBusError error = DBUS_ERROR_INIT;
+
+  if (address != NULL)
+    {
+      connection = dbus_connection_open_private (address, &error);
+
+      if (connection != NULL && !dbus_bus_register (connection, &error))
+        {
+          dbus_connection_close (connection);
+          dbus_connection_unref (connection);
+          connection = NULL;
+        }
+    }
+  else
+    {
+      connection = dbus_bus_get_private (type, &error);
+    }
+
+  if (connection == NULL)
+    {
+      fprintf (stderr, "Failed to connect to bus: %s: %s\n",
+               error.name, error.message);
+      exit (1);
+    }
+
+  dbus_connection_set_exit_on_disconnect (connection, FALSE);
+  return connection;
+}
+
+static void
+set_up_peers (DBusBusType  type,
+              const char  *address)
+{
+  int i, j;
+
+  for (i = 0; i < n_peers; i++)
+    {
+      ReplayPeer *peer = peers[i];
+
+      peer->connection = replay_connect (type, address);
+
+      if (!dbus_connection_add_filter (peer->connection, replay_filter,
+                                       peer, NULL) ||
+          !_dbus_hash_table_insert_string (peers_by_name,
+              (char *) dbus_bus_get_unique_name (peer->connection), peer))
+        tool_oom ("setting up a peer");
+
+      for (j = 0; j < peer->n_names; j++)
+        {
+          DBusError error = DBUS_ERROR_INIT;
+          int result;
+
+          result = dbus_bus_request_name (peer->connection, peer->names[j],
+                                          DBUS_NAME_FLAG_DO_NOT_QUEUE,
+                                          &error);
+
+          if (result != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+            {
+              fprintf (stderr, "%s for %s could not own %s: %s\n",
+                       dbus_bus_get_unique_name (peer->connection),
+                       peer->capture_name, peer->names[j],
+                       dbus_error_is_set (&error) ? error.message :
+                         "it is taken");
+              dbus_error_free (&error);
+            }
+        }
+    }
+}
+
+/* Whether the message can't or shouldn't be sent again */
+static dbus_bool_t
+skip_message (DBusMessage *message)
+{
+  /* the bus sends its own messages; and the connections have already
+   * said Hello, and must not turn into monitors */
+  if (!is_peer_name (dbus_message_get_sender (message)) ||
+      dbus_message_is_method_call (message, DBUS_INTERFACE_DBUS, "Hello") ||
+      dbus_message_is_method_call (message, DBUS_INTERFACE_MONITORING,
+                                   "BecomeMonitor") ||
+      dbus_message_is_method_call (message, DBUS_INTERFACE_MONITORING,
+                                   "BecomeMonitorWithOptions"))
+    return TRUE;
+
+  /* a capture doesn't have the fds */
+  return dbus_message_contains_unix_fds (message);
+}
+
+/* Sends one captured message from its stand-in; returns FALSE if it
+ * had to be skipped */
+static dbus_bool_t
+replay_message (CapturedMessage *captured_message,
+                DBusPollFD      *fds,
+                int              reply_wait)
+{
+  DBusMessage *original = captured_message->message;
+  DBusMessage *message;
+  ReplayPeer *sender, *recipient;
+  ReplayCall *call = NULL;
+  const char *destination;
+  dbus_uint32_t serial;
+
+  sender = _dbus_hash_table_lookup_string (peers_by_capture_name,
+               dbus_message_get_sender (original));
+  destination = dbus_message_get_destination (original);
+  recipient = NULL;
+
+  if (is_peer_name (destination))
+    recipient = _dbus_hash_table_lookup_string (peers_by_capture_name,
+                                                destination);
+
+  if (dbus_message_get_type (original) == DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+      dbus_message_get_type (original) == DBUS_MESSAGE_TYPE_ERROR)
+    {
+      if (recipient == NULL)
+        return FALSE;
+
+      call = _dbus_hash_table_lookup_uintptr (
+          recipient->calls_by_capture_serial,
+          dbus_message_get_reply_serial (original));
+
+      /* the call was made before the capture started */
+      if (call == NULL)
+        return FALSE;
+
+      replay_wait (fds, now_usec () + reply_wait * 1000, &call->delivered);
+
+      if (!call->delivered)
+        return FALSE;
+    }
+
+  message = dbus_message_copy (original);
+
+  if (message == NULL ||
+      !dbus_message_set_sender (message, NULL) ||
+      (recipient != NULL &&
+       !dbus_message_set_destination (message,
+           dbus_bus_get_unique_name (recipient->connection))) ||
+      (call != NULL &&
+       !dbus_message_set_reply_serial (message, call->serial)))
+    tool_oom ("copying a message");
+
+  if (!dbus_connection_send (sender->connection, message, &serial))
+    tool_oom ("sending a message");
+
+  dbus_message_unref (message);
+
+  if (dbus_message_get_type (original) == DBUS_MESSAGE_TYPE_METHOD_CALL)
+    {
+      call = dbus_new0 (ReplayCall, 1);
+
+      if (call == NULL)
+        tool_oom ("recording a call");
+
+      call->serial = serial;
+      call->sent_at = now_usec ();
+      call->awaited = (captured_message->answered &&
+                       !dbus_message_get_no_reply (original));
+
+      if (call->awaited)
+        n_awaited++;
+
+      /* a capture serial can be seen again if the capture is
+       * long enough to wrap around; the later call wins */
+      _dbus_hash_table_remove_uintptr (sender->calls_by_serial, serial);
+
+      if (!_dbus_hash_table_insert_uintptr (sender->calls_by_serial,
+                                            serial, call) ||
+          !_dbus_hash_table_insert_uintptr (sender->calls_by_capture_serial,
+              dbus_message_get_serial (original), call))
+        tool_oom ("recording a call");
+    }
+
+  return TRUE;
+}
+
+static int
+compare_latencies (const void *a,
+                   const void *b)
+{
+  dbus_int64_t x = *(const dbus_int64_t *) a;
+  dbus_int64_t y = *(const dbus_int64_t *) b;
+
+  return (x > y) - (x < y);
+}
+
+/* nearest-rank percentile of the sorted latencies */
+static long
+percentile (double p)
+{
+  int rank = (int) (p * n_latencies + 0.999999);
+
+  if (rank < 1)
+    rank = 1;
+
+  return (long) latencies[rank - 1];
+}
+
+static void
+report (int          sent,
+        int          skipped,
+        dbus_int64_t elapsed)
+{
+  double seconds = elapsed / 1000000.0;
+
+  printf ("%d peers, %d messages replayed in %.3f s: %.0f messages/s, "
+          "%d skipped\n",
+          n_peers, sent, seconds, seconds > 0 ? sent / seconds : 0.0,
+          skipped);
+
+  qsort (latencies, n_latencies, sizeof (dbus_int64_t), compare_latencies);
+
+  printf ("%d method calls answered, %d replies missing\n",
+          n_latencies, n_awaited);
+
+  if (n_latencies > 0)
+    printf ("latency (us): min %ld p50 %ld p99 %ld p99.9 %ld max %ld\n",
+            (long) latencies[0], percentile (0.5), percentile (0.99),
+            percentile (0.999), (long) latencies[n_latencies - 1]);
+}
+
+int
+dbus_test_tool_replay (int argc, char **argv)
+{
+  DBusBusType type = DBUS_BUS_SESSION;
+  const char *address = NULL;
+  const char *path = NULL;
+  dbus_bool_t fast = FALSE;
+  int reply_wait = 1000;
+  DBusPollFD *fds;
+  FILE *file;
+  dbus_int64_t start;
+  int sent = 0;
+  int skipped = 0;
+  int i;
+
+  /* argv[1] is the tool name, so start from 2 */
+
+  for (i = 2; i < argc; i++)
+    {
+      const char *arg = argv[i];
+
+      if (strcmp (arg, "--system") == 0)
+        {
+          type = DBUS_BUS_SYSTEM;
+          address = NULL;
+        }
+      else if (strcmp (arg, "--session") == 0)
+        {
+          type = DBUS_BUS_SESSION;
+          address = NULL;
+        }
+      else if (strstr (arg, "--address=") == arg)
+        {
+          address = arg + strlen ("--address=");
+        }
+      else if (strcmp (arg, "--fast") == 0)
+        {
+          fast = TRUE;
+        }
+      else if (strstr (arg, "--reply-wait=") == arg)
+        {
+          reply_wait = atoi (arg + strlen ("--reply-wait="));
+
+          if (reply_wait < 0)
+            usage (2);
+        }
+      else if (strcmp (arg, "--help") == 0)
+        {
+          usage (0);
+        }
+      else if (arg[0] == '-' && arg[1] != '\0')
+        {
+          usage (2);
+        }
+      else if (path == NULL)
+        {
+          path = arg;
+        }
+      else
+        {
+          usage (2);
+        }
+    }
+
+  if (path == NULL)
+    usage (2);
+
+  if (strcmp (path, "-") == 0)
+    {
+      file = stdin;
+    }
+  else
+    {
+      file = fopen (path, "rb");
+
+      if (file == NULL)
+        {
+          perror (path);
+          exit (1);
+        }
+    }
+
+  peers_by_capture_name = _dbus_hash_table_new (DBUS_HASH_STRING,
+                                                NULL, NULL);
+  peers_by_name = _dbus_hash_table_new (DBUS_HASH_STRING, NULL, NULL);
+
+  if (peers_by_capture_name == NULL || peers_by_name == NULL)
+    tool_oom ("allocating peer tables");
+
+  load_capture (file);
+
+  if (file != stdin)
+    fclose (file);
+
+  analyse_capture ();
+
+  if (n_peers == 0)
+    {
+      fprintf (stderr, "No peers in the capture\n");
+      exit (1);
+    }
+
+  set_up_peers (type, address);
+
+  fds = dbus_new0 (DBusPollFD, n_peers);
+
+  if (fds == NULL)
+    tool_oom ("allocating poll fds");
+
+  start = now_usec ();
+
+  for (i = 0; i < n_captured; i++)
+    {
+      if (skip_message (captured[i].message))
+        continue;
+
+      if (fast)
+        replay_iterate (fds, 0);
+      else
+        replay_wait (fds, start + (captured[i].at - captured[0].at), NULL);
+
+      if (replay_message (&captured[i], fds, reply_wait))
+        sent++;
+      else
+        skipped++;
+    }
+
+  /* wait for the last replies, giving up when none has come for as
+   * long as a reply waits for its call */
+  while (n_awaited > 0)
+    {
+      dbus_int64_t until = now_usec () + reply_wait * 1000;
+      int awaited = n_awaited;
+
+      while (n_awaited == awaited && now_usec () < until)
+        replay_iterate (fds, (int) ((until - now_usec () + 999) / 1000));
+
+      if (n_awaited == awaited)
+        break;
+    }
+
+  report (sent, skipped, now_usec () - start);
+
+  dbus_free (fds);
+
+  for (i = 0; i < n_peers; i++)
+    {
+      dbus_connection_close (peers[i]->connection);
+      dbus_connection_unref (peers[i]->connection);
+    }
+
+  return 0;
+}
@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 #include <dbus/dbus.h>
 #include "dbus/dbus-internals.h"
@@ -52,7 +53,8 @@ static const char *appname;
 static void
 usage (int ecode)
 {
-  fprintf (stderr, "Usage: %s [--help] [--system | --session | --bus=ADDRESS | --peer=ADDRESS] [--dest=NAME] [--type=TYPE] [--print-reply[=literal]] [--reply-timeout=MSEC] <destination object path> <message name> [contents ...]\n", appname);
+  fprintf (stderr, "Usage: %s [--help] [--system | --session | --bus=ADDRESS | --peer=ADDRESS] [--dest=NAME] [--type=TYPE] [--print-reply[=literal]] [--reply-timeout=MSEC] <destination object path> <message name> [contents ...]\n"
+           "       %s [--help] [--system | --session | --bus=ADDRESS | --peer=ADDRESS] [--dest=NAME] [--type=TYPE] [--print-reply[=literal]] [--reply-timeout=MSEC] [--max-in-flight=N] --batch=FILE\n", appname, appname);
   exit (ecode);
 }
 
@@ -224,6 +226,539 @@ type_from_name (const char *arg)
   return type;
 }
 
+/* Builds the message described by an object path, an
+ * Interface.Member name and the contents arguments, all of which may
+ * be modified. Exits on anything badly formed, as for the command line
+ * itself. */
+static DBusMessage *
+build_message (int          message_type,
+               const char  *dest,
+               const char  *path,
+               char        *name,
+               int          n_contents,
+               char       **contents)
+{
+  DBusMessage *message;
+  DBusMessageIter iter;
+  int i;
+
+  if (message_type == DBUS_MESSAGE_TYPE_METHOD_CALL)
+    {
+      char *last_dot;
+
+      last_dot = strrchr (name, '.');
+      if (last_dot == NULL)
+        {
+          fprintf (stderr, "Must use org.mydomain.Interface.Method notation, no dot in \"%s\"\n",
+                   name);
+          exit (1);
+        }
+      *last_dot = '\0';
+      
+      message = dbus_message_new_method_call (NULL,
+                                              path,
+                                              name,
+                                              last_dot + 1);
+      dbus_message_set_auto_start (message, TRUE);
+    }
+  else if (message_type == DBUS_MESSAGE_TYPE_SIGNAL)
+    {
+      char *last_dot;
+
+      last_dot = strrchr (name, '.');
+      if (last_dot == NULL)
+        {
+          fprintf (stderr, "Must use org.mydomain.Interface.Signal notation, no dot in \"%s\"\n",
+                   name);
+          exit (1);
+        }
+      *last_dot = '\0';
+      
+      message = dbus_message_new_signal (path, name, last_dot + 1);
+    }
+  else
+    {
+      fprintf (stderr, "Internal error, unknown message type\n");
+      exit (1);
+    }
+
+  if (message == NULL)
+    {
+      fprintf (stderr, "Couldn't allocate D-Bus message\n");
+      exit (1);
+    }
+
+  if (dest && !dbus_message_set_destination (message, dest))
+    {
+      fprintf (stderr, "Not enough memory\n");
+      exit (1);
+    }
+  
+  dbus_message_iter_init_append (message, &iter);
+
+  i = 0;
+
+  while (i < n_contents)
+    {
+      char *arg;
+      char *c;
+      int type;
+      int secondary_type;
+      int container_type;
+      DBusMessageIter *target_iter;
+      DBusMessageIter container_iter;
+
+      type = DBUS_TYPE_INVALID;
+      arg = contents[i++];
+      c = strchr (arg, ':');
+
+      if (c == NULL)
+	{
+	  fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", appname, arg);
+	  exit (1);
+	}
+
+      *(c++) = 0;
+
+      container_type = DBUS_TYPE_INVALID;
+
+      if (strcmp (arg, "variant") == 0)
+	container_type = DBUS_TYPE_VARIANT;
+      else if (strcmp (arg, "array") == 0)
+	container_type = DBUS_TYPE_ARRAY;
+      else if (strcmp (arg, "dict") == 0)
+	container_type = DBUS_TYPE_DICT_ENTRY;
+
+      if (container_type != DBUS_TYPE_INVALID)
+	{
+	  arg = c;
+	  c = strchr (arg, ':');
+	  if (c == NULL)
+	    {
+	      fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", appname, arg);
+	      exit (1);
+	    }
+	  *(c++) = 0;
+	}
+
+      if (arg[0] == 0)
+	type = DBUS_TYPE_STRING;
+      else
+	type = type_from_name (arg);
+
+      if (container_type == DBUS_TYPE_DICT_ENTRY)
+	{
+	  char sig[5];
+	  arg = c;
+	  c = strchr (c, ':');
+	  if (c == NULL)
+	    {
+	      fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", appname, arg);
+	      exit (1);
+	    }
+	  *(c++) = 0;
+	  secondary_type = type_from_name (arg);
+	  sig[0] = DBUS_DICT_ENTRY_BEGIN_CHAR;
+	  sig[1] = type;
+	  sig[2] = secondary_type;
+	  sig[3] = DBUS_DICT_ENTRY_END_CHAR;
+	  sig[4] = '\0';
+	  dbus_message_iter_open_container (&iter,
+					    DBUS_TYPE_ARRAY,
+					    sig,
+					    &container_iter);
+	  target_iter = &container_iter;
+	}
+      else if (container_type != DBUS_TYPE_INVALID)
+	{
+	  char sig[2];
+	  sig[0] = type;
+	  sig[1] = '\0';
+	  dbus_message_iter_open_container (&iter,
+					    container_type,
+					    sig,
+					    &container_iter);
+	  target_iter = &container_iter;
+	}
+      else
+	target_iter = &iter;
+
+      if (container_type == DBUS_TYPE_ARRAY)
+	{
+	  append_array (target_iter, type, c);
+	}
+      else if (container_type == DBUS_TYPE_DICT_ENTRY)
+	{
+	  append_dict (target_iter, type, secondary_type, c);
+	}
+      else
+	append_arg (target_iter, type, c);
+
+      if (container_type != DBUS_TYPE_INVALID)
+	{
+	  dbus_message_iter_close_container (&iter,
+					     &container_iter);
+	}
+    }
+
+  return message;
+}
+
+/* Reads a line of any length from @file into *@buf, without the
+ * newline, growing *@buf as needed. Returns FALSE at the end of the
+ * file. */
+static dbus_bool_t
+read_line (FILE    *file,
+           char   **buf,
+           size_t  *allocated)
+{
+  size_t len = 0;
+  int c;
+
+  while ((c = getc (file)) != EOF && c != '\n')
+    {
+      if (len + 2 > *allocated)
+        {
+          size_t new_allocated = *allocated > 0 ? *allocated * 2 : 256;
+          char *new_buf = realloc (*buf, new_allocated);
+
+          if (new_buf == NULL)
+            {
+              fprintf (stderr, "%s: Not enough memory\n", appname);
+              exit (1);
+            }
+
+          *buf = new_buf;
+          *allocated = new_allocated;
+        }
+
+      (*buf)[len++] = c;
+    }
+
+  if (c == EOF && len == 0)
+    return FALSE;
+
+  if (*buf == NULL)
+    {
+      *buf = malloc (1);
+      *allocated = 1;
+
+      if (*buf == NULL)
+        {
+          fprintf (stderr, "%s: Not enough memory\n", appname);
+          exit (1);
+        }
+    }
+
+  (*buf)[len] = '\0';
+  return TRUE;
+}
+
+/* Splits @line in place into words separated by spaces or tabs. A
+ * word may contain "double quoted" runs, in which spaces are kept, and
+ * a backslash takes the next character literally. Returns the number
+ * of words, which are stored in *@words (to be freed). */
+static int
+split_line (char    *line,
+            int      lineno,
+            char  ***words)
+{
+  int n_words = 0;
+  int n_allocated = 0;
+  char *in = line;
+  char *out = line;
+
+  *words = NULL;
+
+  while (TRUE)
+    {
+      dbus_bool_t quoted = FALSE;
+
+      while (*in == ' ' || *in == '\t' || *in == '\r')
+        in++;
+
+      if (*in == '\0' || *in == '#')
+        break;
+
+      if (n_words == n_allocated)
+        {
+          char **new_words;
+
+          n_allocated = n_allocated > 0 ? n_allocated * 2 : 8;
+          new_words = realloc (*words, n_allocated * sizeof (char *));
+
+          if (new_words == NULL)
+            {
+              fprintf (stderr, "%s: Not enough memory\n", appname);
+              exit (1);
+            }
+
+          *words = new_words;
+        }
+
+      (*words)[n_words++] = out;
+
+      while (*in != '\0' &&
+             (quoted || (*in != ' ' && *in != '\t' && *in != '\r')))
+        {
+          if (*in == '"')
+            {
+              quoted = !quoted;
+              in++;
+            }
+          else if (*in == '\\' && in[1] != '\0')
+            {
+              *out++ = in[1];
+              in += 2;
+            }
+          else
+            {
+              *out++ = *in++;
+            }
+        }
+
+      if (quoted)
+        {
+          fprintf (stderr, "%s: Line %d: unterminated quotes\n", appname,
+                   lineno);
+          exit (1);
+        }
+
+      /* the terminator may overwrite the separator just read past,
+       * never anything still to be read */
+      if (*in != '\0')
+        in++;
+
+      *out++ = '\0';
+    }
+
+  return n_words;
+}
+
+typedef struct
+{
+  int lineno;
+  int *in_flight;
+  int *failures;
+  dbus_bool_t print_reply;
+  dbus_bool_t print_reply_literal;
+} BatchCall;
+
+static void
+batch_call_complete (DBusPendingCall *pending,
+                     void            *user_data)
+{
+  BatchCall *call = user_data;
+  DBusMessage *reply;
+
+  reply = dbus_pending_call_steal_reply (pending);
+  /* the library makes up an error reply if the call times out */
+  _dbus_assert (reply != NULL);
+
+  if (dbus_message_get_type (reply) == DBUS_MESSAGE_TYPE_ERROR)
+    {
+      DBusError error;
+
+      dbus_error_init (&error);
+      dbus_set_error_from_message (&error, reply);
+      fprintf (stderr, "Line %d: Error %s: %s\n", call->lineno,
+               error.name, error.message);
+      dbus_error_free (&error);
+      *call->failures += 1;
+    }
+  else if (call->print_reply)
+    {
+      long sec, usec;
+
+      if (!call->print_reply_literal)
+        printf ("line %d: ", call->lineno);
+
+      _dbus_get_real_time (&sec, &usec);
+      print_message (reply, call->print_reply_literal, sec, usec);
+
+      /* literal strings have no newline of their own, which would run
+       * one reply into the next */
+      if (call->print_reply_literal)
+        printf ("\n");
+    }
+
+  dbus_message_unref (reply);
+  *call->in_flight -= 1;
+}
+
+/* Sends a message for each line of @filename ("-" for standard
+ * input), each line being what could follow the options on the
+ * command line, optionally preceded by its own --dest= or --type=.
+ * Replies to method calls are waited for, with at most @max_in_flight
+ * outstanding at once, and printed as they arrive rather than in
+ * order. Returns the exit status. */
+static int
+send_batch (DBusConnection *connection,
+            const char     *filename,
+            int             default_message_type,
+            const char     *default_dest,
+            dbus_bool_t     print_reply,
+            dbus_bool_t     print_reply_literal,
+            int             reply_timeout,
+            int             max_in_flight)
+{
+  FILE *file;
+  char *line = NULL;
+  size_t allocated = 0;
+  int lineno = 0;
+  int in_flight = 0;
+  int failures = 0;
+
+  if (strcmp (filename, "-") == 0)
+    {
+      file = stdin;
+    }
+  else
+    {
+      file = fopen (filename, "r");
+
+      if (file == NULL)
+        {
+          fprintf (stderr, "%s: Unable to open \"%s\": %s\n", appname,
+                   filename, _dbus_strerror (errno));
+          return 1;
+        }
+    }
+
+  while (read_line (file, &line, &allocated))
+    {
+      DBusMessage *message;
+      DBusPendingCall *pending;
+      BatchCall *call;
+      char **words;
+      int n_words;
+      int message_type = default_message_type;
+      const char *dest = default_dest;
+      int i = 0;
+
+      lineno++;
+      n_words = split_line (line, lineno, &words);
+
+      if (n_words == 0)
+        continue;
+
+      for (; i < n_words && words[i][0] == '-'; i++)
+        {
+          if (strstr (words[i], "--dest=") == words[i])
+            {
+              dest = strchr (words[i], '=') + 1;
+            }
+          else if (strstr (words[i], "--type=") == words[i])
+            {
+              message_type = dbus_message_type_from_string (strchr (words[i], '=') + 1);
+            }
+          else
+            {
+              fprintf (stderr, "%s: Line %d: unknown option \"%s\"\n",
+                       appname, lineno, words[i]);
+              exit (1);
+            }
+        }
+
+      if (n_words - i < 2)
+        {
+          fprintf (stderr, "%s: Line %d: expected an object path and a "
+                   "message name\n", appname, lineno);
+          exit (1);
+        }
+
+      if (!(message_type == DBUS_MESSAGE_TYPE_METHOD_CALL ||
+            message_type == DBUS_MESSAGE_TYPE_SIGNAL))
+        {
+          fprintf (stderr, "%s: Line %d: message type is not supported\n",
+                   appname, lineno);
+          exit (1);
+        }
+
+      if (dest && !dbus_validate_bus_name (dest, NULL))
+        {
+          fprintf (stderr, "%s: Line %d: invalid destination \"%s\"\n",
+                   appname, lineno, dest);
+          exit (1);
+        }
+
+      message = build_message (message_type, dest, words[i], words[i + 1],
+                               n_words - i - 2, words + i + 2);
+      free (words);
+
+      if (message_type != DBUS_MESSAGE_TYPE_METHOD_CALL || !print_reply)
+        {
+          if (!dbus_connection_send (connection, message, NULL))
+            {
+              fprintf (stderr, "%s: Not enough memory\n", appname);
+              exit (1);
+            }
+
+          dbus_message_unref (message);
+          continue;
+        }
+
+      /* keep the window full, but no fuller */
+      while (in_flight >= max_in_flight &&
+             dbus_connection_read_write_dispatch (connection, -1))
+        ;
+
+      call = malloc (sizeof (BatchCall));
+
+      if (call == NULL ||
+          !dbus_connection_send_with_reply (connection, message, &pending,
+                                            reply_timeout) ||
+          pending == NULL)
+        {
+          fprintf (stderr, "%s: Line %d: unable to send, or disconnected\n",
+                   appname, lineno);
+          exit (1);
+        }
+
+      call->lineno = lineno;
+      call->in_flight = &in_flight;
+      call->failures = &failures;
+      call->print_reply = print_reply;
+      call->print_reply_literal = print_reply_literal;
+
+      if (!dbus_pending_call_set_notify (pending, batch_call_complete, call,
+                                         free))
+        {
+          fprintf (stderr, "%s: Not enough memory\n", appname);
+          exit (1);
+        }
+
+      in_flight++;
+      dbus_pending_call_unref (pending);
+      dbus_message_unref (message);
+
+      /* pick up whatever has already arrived, without waiting */
+      while (dbus_connection_dispatch (connection) ==
+             DBUS_DISPATCH_DATA_REMAINS)
+        ;
+    }
+
+  while (in_flight > 0 &&
+         dbus_connection_read_write_dispatch (connection, -1))
+    ;
+
+  free (line);
+
+  if (file != stdin)
+    fclose (file);
+
+  dbus_connection_flush (connection);
+
+  if (in_flight > 0)
+    {
+      fprintf (stderr, "%s: Disconnected with %d replies outstanding\n",
+               appname, in_flight);
+      return 1;
+    }
+
+  return failures > 0 ? 1 : 0;
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -233,21 +768,22 @@ main (int argc, char *argv[])
   dbus_bool_t print_reply;
   dbus_bool_t print_reply_literal;
   int reply_timeout;
-  DBusMessageIter iter;
   int i;
   DBusBusType type = DBUS_BUS_SESSION;
   const char *dest = NULL;
-  const char *name = NULL;
+  char *name = NULL;
   const char *path = NULL;
   int message_type = DBUS_MESSAGE_TYPE_SIGNAL;
   const char *type_str = NULL;
   const char *address = NULL;
   int is_bus = FALSE;
   int session_or_system = FALSE;
+  const char *batch_file = NULL;
+  int max_in_flight = 64;
 
   appname = argv[0];
   
-  if (argc < 3)
+  if (argc < 2)
     usage (1);
 
   print_reply = FALSE;
@@ -330,6 +866,25 @@ main (int argc, char *argv[])
 	}
       else if (strstr (arg, "--type=") == arg)
 	type_str = strchr (arg, '=') + 1;
+      else if (strstr (arg, "--batch=") == arg)
+	{
+	  batch_file = strchr (arg, '=') + 1;
+	  if (*batch_file == '\0')
+	    {
+	      fprintf (stderr, "\"--batch=\" requires a FILE, or - for standard input\n");
+	      usage (1);
+	    }
+	}
+      else if (strstr (arg, "--max-in-flight=") == arg)
+	{
+	  max_in_flight = strtol (strchr (arg, '=') + 1, NULL, 10);
+	  if (max_in_flight <= 0)
+	    {
+	      fprintf (stderr, "invalid value (%s) of \"--max-in-flight\"\n",
+	               strchr (arg, '=') + 1);
+	      usage (1);
+	    }
+	}
       else if (!strcmp(arg, "--help"))
 	usage (0);
       else if (arg[0] == '-')
@@ -340,7 +895,13 @@ main (int argc, char *argv[])
         name = arg;
     }
 
-  if (name == NULL)
+  if (batch_file != NULL && path != NULL)
+    {
+      fprintf (stderr, "\"--batch\" reads the messages to send, so no object path or message name may be given\n");
+      usage (1);
+    }
+
+  if (name == NULL && batch_file == NULL)
     usage (1);
 
   if (session_or_system &&
@@ -399,162 +960,13 @@ main (int argc, char *argv[])
         }
     }
 
-  if (message_type == DBUS_MESSAGE_TYPE_METHOD_CALL)
-    {
-      char *last_dot;
-
-      last_dot = strrchr (name, '.');
-      if (last_dot == NULL)
-        {
-          fprintf (stderr, "Must use org.mydomain.Interface.Method notation, no dot in \"%s\"\n",
-                   name);
-          exit (1);
-        }
-      *last_dot = '\0';
-      
-      message = dbus_message_new_method_call (NULL,
-                                              path,
-                                              name,
-                                              last_dot + 1);
-      dbus_message_set_auto_start (message, TRUE);
-    }
-  else if (message_type == DBUS_MESSAGE_TYPE_SIGNAL)
-    {
-      char *last_dot;
-
-      last_dot = strrchr (name, '.');
-      if (last_dot == NULL)
-        {
-          fprintf (stderr, "Must use org.mydomain.Interface.Signal notation, no dot in \"%s\"\n",
-                   name);
-          exit (1);
-        }
-      *last_dot = '\0';
-      
-      message = dbus_message_new_signal (path, name, last_dot + 1);
-    }
-  else
-    {
-      fprintf (stderr, "Internal error, unknown message type\n");
-      exit (1);
-    }
-
-  if (message == NULL)
-    {
-      fprintf (stderr, "Couldn't allocate D-Bus message\n");
-      exit (1);
-    }
-
-  if (dest && !dbus_message_set_destination (message, dest))
-    {
-      fprintf (stderr, "Not enough memory\n");
-      exit (1);
-    }
-  
-  dbus_message_iter_init_append (message, &iter);
-
-  while (i < argc)
-    {
-      char *arg;
-      char *c;
-      int type;
-      int secondary_type;
-      int container_type;
-      DBusMessageIter *target_iter;
-      DBusMessageIter container_iter;
-
-      type = DBUS_TYPE_INVALID;
-      arg = argv[i++];
-      c = strchr (arg, ':');
-
-      if (c == NULL)
-	{
-	  fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", argv[0], arg);
-	  exit (1);
-	}
-
-      *(c++) = 0;
-
-      container_type = DBUS_TYPE_INVALID;
-
-      if (strcmp (arg, "variant") == 0)
-	container_type = DBUS_TYPE_VARIANT;
-      else if (strcmp (arg, "array") == 0)
-	container_type = DBUS_TYPE_ARRAY;
-      else if (strcmp (arg, "dict") == 0)
-	container_type = DBUS_TYPE_DICT_ENTRY;
-
-      if (container_type != DBUS_TYPE_INVALID)
-	{
-	  arg = c;
-	  c = strchr (arg, ':');
-	  if (c == NULL)
-	    {
-	      fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", argv[0], arg);
-	      exit (1);
-	    }
-	  *(c++) = 0;
-	}
+  if (batch_file != NULL)
+    exit (send_batch (connection, batch_file, message_type, dest,
+                      print_reply, print_reply_literal, reply_timeout,
+                      max_in_flight));
 
-      if (arg[0] == 0)
-	type = DBUS_TYPE_STRING;
-      else
-	type = type_from_name (arg);
-
-      if (container_type == DBUS_TYPE_DICT_ENTRY)
-	{
-	  char sig[5];
-	  arg = c;
-	  c = strchr (c, ':');
-	  if (c == NULL)
-	    {
-	      fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", argv[0], arg);
-	      exit (1);
-	    }
-	  *(c++) = 0;
-	  secondary_type = type_from_name (arg);
-	  sig[0] = DBUS_DICT_ENTRY_BEGIN_CHAR;
-	  sig[1] = type;
-	  sig[2] = secondary_type;
-	  sig[3] = DBUS_DICT_ENTRY_END_CHAR;
-	  sig[4] = '\0';
-	  dbus_message_iter_open_container (&iter,
-					    DBUS_TYPE_ARRAY,
-					    sig,
-					    &container_iter);
-	  target_iter = &container_iter;
-	}
-      else if (container_type != DBUS_TYPE_INVALID)
-	{
-	  char sig[2];
-	  sig[0] = type;
-	  sig[1] = '\0';
-	  dbus_message_iter_open_container (&iter,
-					    container_type,
-					    sig,
-					    &container_iter);
-	  target_iter = &container_iter;
-	}
-      else
-	target_iter = &iter;
-
-      if (container_type == DBUS_TYPE_ARRAY)
-	{
-	  append_array (target_iter, type, c);
-	}
-      else if (container_type == DBUS_TYPE_DICT_ENTRY)
-	{
-	  append_dict (target_iter, type, secondary_type, c);
-	}
-      else
-	append_arg (target_iter, type, c);
-
-      if (container_type != DBUS_TYPE_INVALID)
-	{
-	  dbus_message_iter_close_container (&iter,
-					     &container_iter);
-	}
-    }
+  message = build_message (message_type, dest, path, name,
+                           argc - i, argv + i);
 
   if (print_reply)
     {
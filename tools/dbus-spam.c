@@ -30,11 +30,30 @@
 
 #include <dbus/dbus.h>
 
+#include "dbus/dbus-sysdeps.h"
 #include "test-tool.h"
 #include "tool-common.h"
 
 static dbus_bool_t ignore_errors = FALSE;
 
+/* what to put in each message */
+static const char *destination = DBUS_SERVICE_DBUS;
+static const char *payload = NULL;
+static char *payload_buf = NULL;
+static size_t payload_len;
+static int payload_type = DBUS_TYPE_STRING;
+static DBusMessage *template = NULL;
+static int n_random_sizes = 0;
+static unsigned int *random_sizes = NULL;
+
+/* benchmark results, in microseconds */
+static dbus_int64_t *latencies = NULL;
+static int n_latencies = 0;
+static int n_errors = 0;
+
+#define FANOUT_MATCH_RULE \
+  "type='signal',interface='com.example',member='Spam',path='/'"
+
 static void
 usage (int ecode)
 {
@@ -72,6 +91,14 @@ usage (int ecode)
            "\n"
            "    --seed=SEED   seed for srand (default is time())\n"
            "\n"
+           "    --latency     time each round-trip and report throughput and\n"
+           "                  latency percentiles when done\n"
+           "    --connections=N   spread messages over N connections\n"
+           "                  (implies --latency)\n"
+           "    --fanout=M    emit com.example.Spam signals to M subscriber\n"
+           "                  connections instead of calling methods, and time\n"
+           "                  each delivery (implies --latency)\n"
+           "\n"
            );
   exit (ecode);
 }
@@ -145,13 +172,399 @@ consume_stdin (char   **payload_p,
   *payload_p = buf;
 }
 
+/*
+ * Build the next message to send: a copy of the template if there is
+ * one, otherwise a com.example.Spam() method call carrying the payload.
+ * If sent_at is non-NULL, build a com.example.Spam signal instead, with
+ * sent_at as its first argument so that subscribers can time it.
+ */
+static DBusMessage *
+new_spam_message (dbus_bool_t         no_reply,
+                  const dbus_int64_t *sent_at)
+{
+  DBusMessage *message;
+
+  if (template != NULL)
+    {
+      message = dbus_message_copy (template);
+
+      if (message == NULL)
+        tool_oom ("copying message");
+
+      dbus_message_set_no_reply (message, no_reply);
+    }
+  else
+    {
+      dbus_bool_t mem;
+      unsigned int len = 0;
+
+      if (sent_at != NULL)
+        message = dbus_message_new_signal ("/", "com.example", "Spam");
+      else
+        message = dbus_message_new_method_call (destination,
+                                                "/",
+                                                "com.example",
+                                                "Spam");
+
+      if (message == NULL)
+        tool_oom ("allocating message");
+
+      dbus_message_set_no_reply (message, no_reply);
+
+      if (sent_at != NULL &&
+          !dbus_message_append_args (message,
+                                     DBUS_TYPE_INT64, sent_at,
+                                     DBUS_TYPE_INVALID))
+        tool_oom ("building message");
+
+      switch (payload_type)
+        {
+          case DBUS_TYPE_STRING:
+            if (random_sizes != NULL)
+              {
+                /* this isn't fair, strictly speaking - the first few
+                 * are a bit more likely to be chosen, unless
+                 * RAND_MAX is divisible by n_random_sizes - but it's
+                 * good enough for traffic-generation */
+                len = random_sizes[rand () % n_random_sizes];
+                payload_buf[len] = '\0';
+              }
+
+            mem = dbus_message_append_args (message,
+                                            DBUS_TYPE_STRING, &payload,
+                                            DBUS_TYPE_INVALID);
+
+            if (random_sizes != NULL)
+              {
+                /* undo the truncation above */
+                payload_buf[len] = 'X';
+              }
+
+            break;
+
+          case DBUS_TYPE_ARRAY:
+            len = payload_len;
+
+            /* as above, not strictly fair, but close enough */
+            if (random_sizes != NULL)
+              len = random_sizes[rand () % n_random_sizes];
+
+            mem = dbus_message_append_args (message,
+                                            DBUS_TYPE_ARRAY,
+                                              DBUS_TYPE_BYTE,
+                                              &payload,
+                                              (dbus_uint32_t) len,
+                                            DBUS_TYPE_INVALID);
+            break;
+
+          default:
+            mem = TRUE;
+        }
+
+      if (!mem)
+        tool_oom ("building message");
+    }
+
+  return message;
+}
+
+static dbus_int64_t
+now_usec (void)
+{
+  long tv_sec, tv_usec;
+
+  _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+  return ((dbus_int64_t) tv_sec) * 1000000 + tv_usec;
+}
+
+static void
+record_latency (dbus_int64_t sent_at)
+{
+  latencies[n_latencies++] = now_usec () - sent_at;
+}
+
+static void
+benchmark_pc_notify (DBusPendingCall *pc,
+                     void            *data)
+{
+  DBusMessage *message;
+  dbus_int64_t *sent_at = data;
+  DBusError error = DBUS_ERROR_INIT;
+
+  record_latency (*sent_at);
+  message = dbus_pending_call_steal_reply (pc);
+
+  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
+    {
+      if (!ignore_errors)
+        {
+          dbus_set_error_from_message (&error, message);
+          fprintf (stderr, "Failed to receive reply #%d: %s: %s\n",
+                   n_latencies, error.name, error.message);
+          dbus_error_free (&error);
+        }
+
+      n_errors++;
+    }
+
+  dbus_message_unref (message);
+}
+
+static DBusHandlerResult
+subscriber_filter (DBusConnection *connection,
+                   DBusMessage    *message,
+                   void           *user_data)
+{
+  dbus_int64_t sent_at;
+
+  if (!dbus_message_is_signal (message, "com.example", "Spam"))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (dbus_message_get_args (message, NULL,
+                             DBUS_TYPE_INT64, &sent_at,
+                             DBUS_TYPE_INVALID))
+    record_latency (sent_at);
+  else
+    n_errors++;
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static int
+compare_latencies (const void *a,
+                   const void *b)
+{
+  dbus_int64_t x = *(const dbus_int64_t *) a;
+  dbus_int64_t y = *(const dbus_int64_t *) b;
+
+  return (x > y) - (x < y);
+}
+
+/* nearest-rank percentile of the sorted latencies */
+static long
+percentile (double p)
+{
+  int rank = (int) (p * n_latencies + 0.999999);
+
+  if (rank < 1)
+    rank = 1;
+
+  return (long) latencies[rank - 1];
+}
+
+static void
+report_latencies (dbus_int64_t elapsed)
+{
+  double seconds = elapsed / 1000000.0;
+
+  qsort (latencies, n_latencies, sizeof (dbus_int64_t), compare_latencies);
+
+  printf ("%d messages in %.3f s: %.0f messages/s, %d errors\n",
+          n_latencies, seconds,
+          seconds > 0 ? n_latencies / seconds : 0.0, n_errors);
+
+  if (n_latencies > 0)
+    printf ("latency (us): min %ld p50 %ld p99 %ld p99.9 %ld max %ld\n",
+            (long) latencies[0], percentile (0.5), percentile (0.99),
+            percentile (0.999), (long) latencies[n_latencies - 1]);
+}
+
+static DBusConnection *
+benchmark_connect (DBusBusType type)
+{
+  DBusConnection *connection;
+  DBusError error = DBUS_ERROR_INIT;
+
+  connection = dbus_bus_get_private (type, &error);
+
+  if (connection == NULL)
+    {
+      fprintf (stderr, "Failed to connect to bus: %s: %s\n",
+               error.name, error.message);
+      exit (1);
+    }
+
+  return connection;
+}
+
+/*
+ * Drive every connection from one poll() loop, so that neither the
+ * senders nor the subscribers can starve each other, until all the
+ * replies or signal deliveries we are waiting for have arrived.
+ */
+static void
+benchmark_iterate (DBusConnection **connections,
+                   DBusPollFD      *fds,
+                   int              n)
+{
+  int i;
+  int timeout = -1;
+
+  for (i = 0; i < n; i++)
+    {
+      int fd;
+
+      if (dbus_connection_get_dispatch_status (connections[i]) ==
+          DBUS_DISPATCH_DATA_REMAINS)
+        timeout = 0;
+
+      if (!dbus_connection_get_socket (connections[i], &fd))
+        {
+          fprintf (stderr, "Disconnected from bus\n");
+          exit (1);
+        }
+
+#ifdef DBUS_WIN
+      fds[i].fd.sock = fd;
+#else
+      fds[i].fd = fd;
+#endif
+      fds[i].events = _DBUS_POLLIN;
+      fds[i].revents = 0;
+
+      if (dbus_connection_has_messages_to_send (connections[i]))
+        fds[i].events |= _DBUS_POLLOUT;
+    }
+
+  _dbus_poll (fds, n, timeout);
+
+  for (i = 0; i < n; i++)
+    {
+      if (fds[i].revents != 0 &&
+          !dbus_connection_read_write (connections[i], 0))
+        {
+          fprintf (stderr, "Disconnected from bus\n");
+          exit (1);
+        }
+
+      while (dbus_connection_dispatch (connections[i]) ==
+             DBUS_DISPATCH_DATA_REMAINS)
+        ;
+    }
+}
+
+static int
+run_benchmark (DBusBusType type,
+               int         count,
+               int         queue_len,
+               int         n_connections,
+               int         n_subscribers)
+{
+  DBusConnection **connections;
+  DBusPollFD *fds;
+  DBusError error = DBUS_ERROR_INIT;
+  int n = n_connections + n_subscribers;
+  int expected = count * (n_subscribers > 0 ? n_subscribers : 1);
+  int sent = 0;
+  dbus_int64_t start;
+  int i;
+
+  connections = dbus_new0 (DBusConnection *, n);
+  fds = dbus_new0 (DBusPollFD, n);
+  latencies = dbus_new (dbus_int64_t, expected);
+
+  if (connections == NULL || fds == NULL || latencies == NULL)
+    tool_oom ("allocating benchmark");
+
+  for (i = 0; i < n; i++)
+    connections[i] = benchmark_connect (type);
+
+  for (i = n_connections; i < n; i++)
+    {
+      dbus_bus_add_match (connections[i], FANOUT_MATCH_RULE, &error);
+
+      if (dbus_error_is_set (&error))
+        {
+          fprintf (stderr, "Failed to subscribe: %s: %s\n",
+                   error.name, error.message);
+          exit (1);
+        }
+
+      if (!dbus_connection_add_filter (connections[i], subscriber_filter,
+                                       NULL, NULL))
+        tool_oom ("adding filter");
+    }
+
+  VERBOSE (stderr, "Benchmarking %d messages over %d connections, "
+           "%d subscribers\n", count, n_connections, n_subscribers);
+
+  start = now_usec ();
+
+  while (n_latencies < expected)
+    {
+      /* in-flight messages are counted in units of one message, so a
+       * signal is in flight until the last subscriber has it */
+      while (sent < count &&
+             (queue_len == -1 ||
+              sent * (expected / count) - n_latencies <
+                queue_len * (expected / count)))
+        {
+          DBusConnection *sender = connections[sent % n_connections];
+          dbus_int64_t *sent_at;
+          DBusMessage *message;
+
+          sent_at = dbus_new (dbus_int64_t, 1);
+
+          if (sent_at == NULL)
+            tool_oom ("allocating timestamp");
+
+          *sent_at = now_usec ();
+
+          if (n_subscribers > 0)
+            {
+              message = new_spam_message (FALSE, sent_at);
+
+              if (!dbus_connection_send (sender, message, NULL))
+                tool_oom ("sending message");
+
+              dbus_free (sent_at);
+            }
+          else
+            {
+              DBusPendingCall *pc;
+
+              message = new_spam_message (FALSE, NULL);
+
+              if (!dbus_connection_send_with_reply (sender, message, &pc,
+                                                    DBUS_TIMEOUT_INFINITE) ||
+                  pc == NULL)
+                tool_oom ("sending message");
+
+              if (!dbus_pending_call_set_notify (pc, benchmark_pc_notify,
+                                                 sent_at, dbus_free))
+                tool_oom ("setting pending call notifier");
+
+              dbus_pending_call_unref (pc);
+            }
+
+          dbus_message_unref (message);
+          sent++;
+        }
+
+      benchmark_iterate (connections, fds, n);
+    }
+
+  report_latencies (now_usec () - start);
+
+  for (i = 0; i < n; i++)
+    {
+      dbus_connection_close (connections[i]);
+      dbus_connection_unref (connections[i]);
+    }
+
+  dbus_free (connections);
+  dbus_free (fds);
+  dbus_free (latencies);
+  latencies = NULL;
+  return n_errors > 0 && !ignore_errors;
+}
+
 int
 dbus_test_tool_spam (int argc, char **argv)
 {
   DBusConnection *connection = NULL;
   DBusError error = DBUS_ERROR_INIT;
   DBusBusType type = DBUS_BUS_SESSION;
-  const char *destination = DBUS_SERVICE_DBUS;
   int i;
   int count = 1;
   int sent = 0;
@@ -159,17 +572,13 @@ dbus_test_tool_spam (int argc, char **argv)
   int received = 0;
   unsigned int received_before_this_conn = 0;
   int queue_len = 1;
-  const char *payload = NULL;
-  char *payload_buf = NULL;
-  size_t payload_len;
-  int payload_type = DBUS_TYPE_STRING;
-  DBusMessage *template = NULL;
   dbus_bool_t flood = FALSE;
   dbus_bool_t no_reply = FALSE;
   unsigned int messages_per_conn = 0;
   unsigned int seed = time (NULL);
-  int n_random_sizes = 0;
-  unsigned int *random_sizes = NULL;
+  dbus_bool_t latency = FALSE;
+  int n_connections = 1;
+  int n_subscribers = 0;
 
   /* argv[1] is the tool name, so start from 2 */
 
@@ -324,6 +733,28 @@ dbus_test_tool_spam (int argc, char **argv)
           if (messages_per_conn > 0 && flood)
             usage (2);
         }
+      else if (strcmp (arg, "--latency") == 0)
+        {
+          latency = TRUE;
+        }
+      else if (strstr (arg, "--connections=") == arg)
+        {
+          n_connections = atoi (arg + strlen ("--connections="));
+
+          if (n_connections < 1)
+            usage (2);
+
+          latency = TRUE;
+        }
+      else if (strstr (arg, "--fanout=") == arg)
+        {
+          n_subscribers = atoi (arg + strlen ("--fanout="));
+
+          if (n_subscribers < 1)
+            usage (2);
+
+          latency = TRUE;
+        }
       else
         {
           usage (2);
@@ -338,6 +769,28 @@ dbus_test_tool_spam (int argc, char **argv)
       payload_len = strlen (payload);
     }
 
+  if (latency)
+    {
+      int ret;
+
+      /* replies are what we time, and reconnecting would time that too */
+      if (no_reply || messages_per_conn > 0 ||
+          (n_subscribers > 0 && template != NULL))
+        usage (2);
+
+      ret = run_benchmark (type, count, queue_len, n_connections,
+                           n_subscribers);
+
+      dbus_free (payload_buf);
+      dbus_free (random_sizes);
+
+      if (template != NULL)
+        dbus_message_unref (template);
+
+      dbus_shutdown ();
+      return ret;
+    }
+
   VERBOSE (stderr, "Will send up to %d messages, with up to %d queued, max %d per connection\n",
            count, queue_len, messages_per_conn);
 
@@ -387,77 +840,7 @@ dbus_test_tool_spam (int argc, char **argv)
         {
           DBusMessage *message;
 
-          if (template != NULL)
-            {
-              message = dbus_message_copy (template);
-
-              if (message == NULL)
-                tool_oom ("copying message");
-
-              dbus_message_set_no_reply (message, no_reply);
-            }
-          else
-            {
-              dbus_bool_t mem;
-              unsigned int len = 0;
-
-              message = dbus_message_new_method_call (destination,
-                                                      "/",
-                                                      "com.example",
-                                                      "Spam");
-
-              if (message == NULL)
-                tool_oom ("allocating message");
-
-              dbus_message_set_no_reply (message, no_reply);
-
-              switch (payload_type)
-                {
-                  case DBUS_TYPE_STRING:
-                    if (random_sizes != NULL)
-                      {
-                        /* this isn't fair, strictly speaking - the first few
-                         * are a bit more likely to be chosen, unless
-                         * RAND_MAX is divisible by n_random_sizes - but it's
-                         * good enough for traffic-generation */
-                        len = random_sizes[rand () % n_random_sizes];
-                        payload_buf[len] = '\0';
-                      }
-
-                    mem = dbus_message_append_args (message,
-                                                    DBUS_TYPE_STRING, &payload,
-                                                    DBUS_TYPE_INVALID);
-
-                    if (random_sizes != NULL)
-                      {
-                        /* undo the truncation above */
-                        payload_buf[len] = 'X';
-                      }
-
-                    break;
-
-                  case DBUS_TYPE_ARRAY:
-                    len = payload_len;
-
-                    /* as above, not strictly fair, but close enough */
-                    if (random_sizes != NULL)
-                      len = random_sizes[rand () % n_random_sizes];
-
-                    mem = dbus_message_append_args (message,
-                                                    DBUS_TYPE_ARRAY,
-                                                      DBUS_TYPE_BYTE,
-                                                      &payload,
-                                                      (dbus_uint32_t) len,
-                                                    DBUS_TYPE_INVALID);
-                    break;
-
-                  default:
-                    mem = TRUE;
-                }
-
-              if (!mem)
-                tool_oom ("building message");
-            }
+          message = new_spam_message (no_reply, NULL);
 
           if (no_reply)
             {
@@ -36,6 +36,7 @@ static struct {
 } subcommands[] = {
       { "black-hole", dbus_test_tool_black_hole },
       { "echo",       dbus_test_tool_echo },
+      { "replay",     dbus_test_tool_replay },
       { "spam",       dbus_test_tool_spam },
       { NULL, NULL }
 };
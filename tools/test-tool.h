@@ -26,6 +26,7 @@
 
 int dbus_test_tool_black_hole (int argc, char **argv);
 int dbus_test_tool_echo (int argc, char **argv);
+int dbus_test_tool_replay (int argc, char **argv);
 int dbus_test_tool_spam (int argc, char **argv);
 
 #endif